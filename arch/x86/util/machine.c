@@ -7,6 +7,7 @@
 #include "../../util/map.h"
 #include "../../util/symbol.h"
 #include "../../util/sane_ctype.h"
+#include "../../util/kallsyms-cache.h"
 
 #include <symbol/kallsyms.h>
 
@@ -78,7 +79,7 @@ int machine__create_extra_kernel_maps(struct machine *machine,
 	if (symbol__restricted_filename(filename, "/proc/kallsyms"))
 		return 0;
 
-	ret = kallsyms__parse(filename, &mi, find_extra_kernel_maps);
+	ret = kallsyms_cache__parse(filename, &mi, find_extra_kernel_maps);
 	if (ret)
 		goto out_free;
 
@@ -2,6 +2,8 @@
 #ifndef BENCH_H
 #define BENCH_H
 
+#include <linux/types.h>
+
 /*
  * The madvise transparent hugepage constants were added in glibc
  * 2.13. For compatibility with older versions of glibc, define these
@@ -29,8 +31,11 @@
 int bench_numa(int argc, const char **argv);
 int bench_sched_messaging(int argc, const char **argv);
 int bench_sched_pipe(int argc, const char **argv);
+int bench_sched_wakeup(int argc, const char **argv);
+int bench_sched_ipc(int argc, const char **argv);
 int bench_mem_memcpy(int argc, const char **argv);
 int bench_mem_memset(int argc, const char **argv);
+int bench_mem_bandwidth(int argc, const char **argv);
 int bench_futex_hash(int argc, const char **argv);
 int bench_futex_wake(int argc, const char **argv);
 int bench_futex_wake_parallel(int argc, const char **argv);
@@ -41,16 +46,60 @@ int bench_futex_lock_pi(int argc, const char **argv);
 int bench_epoll_wait(int argc, const char **argv);
 int bench_epoll_ctl(int argc, const char **argv);
 
+int bench_internals_ordered_events(int argc, const char **argv);
+int bench_internals_parse_sample(int argc, const char **argv);
+int bench_internals_findnew_thread(int argc, const char **argv);
+int bench_internals_find_symbol(int argc, const char **argv);
+int bench_internals_hists_add(int argc, const char **argv);
+int bench_internals_callchain_append(int argc, const char **argv);
+int bench_internals_synthesize(int argc, const char **argv);
+int bench_internals_kallsyms_parse(int argc, const char **argv);
+int bench_internals_symbol_load(int argc, const char **argv);
+
+int bench_record_ring(int argc, const char **argv);
+
 #define BENCH_FORMAT_DEFAULT_STR	"default"
 #define BENCH_FORMAT_DEFAULT		0
 #define BENCH_FORMAT_SIMPLE_STR		"simple"
 #define BENCH_FORMAT_SIMPLE		1
 
+#define BENCH_FORMAT_JSON_STR		"json"
+#define BENCH_FORMAT_JSON		2
+#define BENCH_FORMAT_CSV_STR		"csv"
+#define BENCH_FORMAT_CSV		3
+
 #define BENCH_FORMAT_UNKNOWN		-1
 
 extern int bench_format;
 extern unsigned int bench_repeat;
 
+/*
+ * Report a result of the run for --format=json/csv and the statistics over
+ * the --repeat runs, does nothing otherwise. metric is a stable name for
+ * regression tracking, unit what value is in.
+ */
+void bench_report(const char *metric, const char *unit, double value);
+void bench_report__set_fd(int fd);
+
+/* --counters and --counters-metrics, see bench/counters.c */
+extern const char *bench_counters_events;
+extern const char *bench_counters_metrics;
+
+int bench_counters__open(void);
+void bench_counters__close(void);
+void bench_counters__start(void);
+void bench_counters__stop(void);
+void bench_counters__set_ops(u64 nr);
+void bench_counters__report(void);
+
+/* The metrics reported by all the runs of one benchmark */
+struct bench_results;
+
+struct bench_results *bench_results__new(const char *collection, const char *benchmark);
+int bench_results__read(struct bench_results *res, int fd);
+void bench_results__print_summary(struct bench_results *res);
+void bench_results__delete(struct bench_results *res);
+
 #ifndef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
 #include <pthread.h>
 #include <linux/compiler.h>
@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * counters.c
+ *
+ * --counters: the hardware events of a benchmark, counted in the region it
+ * measures, see bench_counters__start(), or over its whole run when it
+ * doesn't mark one, then shown after its results with the IPC and the
+ * events per operation.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/debug.h"
+#include "../util/cpumap.h"
+#include "../util/evlist.h"
+#include "../util/evsel.h"
+#include "../util/expr.h"
+#include "../util/metricgroup.h"
+#include "../util/parse-events.h"
+#include "../util/thread_map.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/time64.h>
+
+const char *bench_counters_events;
+const char *bench_counters_metrics;
+
+static struct perf_evlist *counters;
+static struct rblist metric_events;
+
+enum counters_state {
+	COUNTERS__IDLE,
+	COUNTERS__RUNNING,
+	COUNTERS__DONE,
+};
+
+static enum counters_state state;
+/* indexed by evsel->idx, the counts at the start then in the region */
+static double *counts;
+static u64 ops;
+static u64 start_ns, duration_ns;
+
+static u64 counters__clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* The counts of the evsel, scaled when it was multiplexed */
+static double counters__read(struct perf_evsel *evsel)
+{
+	struct perf_counts_values count;
+
+	if (perf_evsel__read(evsel, 0, 0, &count) || !count.run)
+		return 0;
+
+	if (count.run < count.ena)
+		return (double)count.val * count.ena / count.run;
+	return count.val;
+}
+
+int bench_counters__open(void)
+{
+	struct parse_events_error parse_error;
+	struct thread_map *threads;
+	struct cpu_map *cpus;
+	struct perf_evsel *evsel;
+	char sbuf[STRERR_BUFSIZE];
+	int err;
+
+	if (!bench_counters_events && !bench_counters_metrics)
+		return 0;
+
+	counters = perf_evlist__new();
+	if (counters == NULL)
+		return -ENOMEM;
+
+	if (bench_counters_events) {
+		memset(&parse_error, 0, sizeof(parse_error));
+		err = parse_events(counters, bench_counters_events, &parse_error);
+		if (err) {
+			parse_events_print_error(&parse_error, bench_counters_events);
+			goto out_delete;
+		}
+	}
+
+	if (bench_counters_metrics) {
+		struct option opt = { .value = &counters, };
+
+		err = metricgroup__parse_groups(&opt, bench_counters_metrics,
+						&metric_events);
+		if (err) {
+			pr_err("Cannot set up the --counters-metrics %s\n",
+			       bench_counters_metrics);
+			goto out_delete;
+		}
+	}
+
+	err = -ENOMEM;
+	threads = thread_map__new_by_tid(getpid());
+	cpus = cpu_map__dummy_new();
+	if (threads == NULL || cpus == NULL) {
+		thread_map__put(threads);
+		cpu_map__put(cpus);
+		goto out_delete;
+	}
+	perf_evlist__set_maps(counters, cpus, threads);
+
+	/* the threads and processes of the benchmark count too */
+	evlist__for_each_entry(counters, evsel) {
+		evsel->attr.inherit = 1;
+		evsel->attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+					  PERF_FORMAT_TOTAL_TIME_RUNNING;
+	}
+
+	err = perf_evlist__open(counters);
+	if (err < 0) {
+		pr_err("Failed to open the --counters events: %s\n",
+		       str_error_r(-err, sbuf, sizeof(sbuf)));
+		goto out_delete;
+	}
+
+	err = -ENOMEM;
+	counts = calloc(counters->nr_entries, sizeof(*counts));
+	if (counts == NULL)
+		goto out_delete;
+
+	state = COUNTERS__IDLE;
+	ops = 0;
+	return 0;
+
+out_delete:
+	perf_evlist__delete(counters);
+	counters = NULL;
+	return err;
+}
+
+void bench_counters__close(void)
+{
+	if (counters == NULL)
+		return;
+
+	perf_evlist__close(counters);
+	perf_evlist__delete(counters);
+	counters = NULL;
+	zfree(&counts);
+}
+
+/*
+ * Mark the start of the region the benchmark measures, called by 'perf
+ * bench' before running it and again by the benchmarks that have setup
+ * work not to count, e.g. creating their threads.
+ */
+void bench_counters__start(void)
+{
+	struct perf_evsel *evsel;
+
+	if (counters == NULL)
+		return;
+
+	evlist__for_each_entry(counters, evsel)
+		counts[evsel->idx] = counters__read(evsel);
+	start_ns = counters__clock();
+	state = COUNTERS__RUNNING;
+}
+
+/* Mark the end of the region, only the first one after the start counts */
+void bench_counters__stop(void)
+{
+	struct perf_evsel *evsel;
+
+	if (counters == NULL || state != COUNTERS__RUNNING)
+		return;
+
+	duration_ns = counters__clock() - start_ns;
+	evlist__for_each_entry(counters, evsel)
+		counts[evsel->idx] = counters__read(evsel) - counts[evsel->idx];
+	state = COUNTERS__DONE;
+}
+
+/* The number of operations done in the region, for the events per op */
+void bench_counters__set_ops(u64 nr)
+{
+	ops = nr;
+}
+
+static double counters__find(u32 type, u64 config)
+{
+	struct perf_evsel *evsel;
+
+	evlist__for_each_entry(counters, evsel) {
+		if (evsel->attr.type == type && evsel->attr.config == config)
+			return counts[evsel->idx];
+	}
+	return 0;
+}
+
+static void counters__report_metrics(void)
+{
+	struct rb_node *node;
+
+	for (node = rb_first_cached(&metric_events.entries); node; node = rb_next(node)) {
+		struct metric_event *me = container_of(node, struct metric_event, nd);
+		struct metric_expr *mexp;
+
+		list_for_each_entry(mexp, &me->head, nd) {
+			double vals[MAX_PARSE_ID], ratio;
+			struct parse_ctx pctx;
+			const char *p = mexp->metric_expr, *name;
+			char metric[128];
+			int i, err;
+
+			expr__ctx_init(&pctx);
+			vals[0] = counts[me->evsel->idx];
+			expr__add_id(&pctx, me->evsel->name, vals[0]);
+			for (i = 0; mexp->metric_events[i]; i++) {
+				struct perf_evsel *evsel = mexp->metric_events[i];
+
+				if (!strcmp(evsel->name, "duration_time"))
+					vals[i + 1] = duration_ns / 1e9;
+				else
+					vals[i + 1] = counts[evsel->idx];
+				expr__add_id(&pctx, evsel->name, vals[i + 1]);
+			}
+
+			if (mexp->metric_prog)
+				err = expr__eval(mexp->metric_prog, vals, &ratio);
+			else
+				err = expr__parse(&ratio, &pctx, &p);
+			if (err)
+				continue;
+
+			name = mexp->metric_name ?: me->evsel->name;
+			scnprintf(metric, sizeof(metric), "metric.%s", name);
+			bench_report(metric, "ratio", ratio);
+			if (bench_format == BENCH_FORMAT_DEFAULT)
+				printf(" %18.2f  %s\n", ratio, name);
+		}
+	}
+}
+
+/* Show the counts of the region after the results of the benchmark */
+void bench_counters__report(void)
+{
+	double cycles, instructions;
+	struct perf_evsel *evsel;
+
+	if (counters == NULL || state != COUNTERS__DONE)
+		return;
+
+	cycles = counters__find(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	instructions = counters__find(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("\n # Counters:\n\n");
+
+	evlist__for_each_entry(counters, evsel) {
+		const char *name = perf_evsel__name(evsel);
+		double val = counts[evsel->idx];
+		char metric[128];
+
+		if (!strcmp(name, "duration_time"))
+			continue;
+
+		scnprintf(metric, sizeof(metric), "counters.%s", name);
+		bench_report(metric, "count", val);
+		if (ops) {
+			scnprintf(metric, sizeof(metric), "counters.%s_per_op", name);
+			bench_report(metric, "per op", val / ops);
+		}
+
+		if (bench_format != BENCH_FORMAT_DEFAULT)
+			continue;
+
+		printf(" %18.0f  %-24s", val, name);
+		if (ops)
+			printf(" # %12.2f per op", val / ops);
+		printf("\n");
+	}
+
+	if (cycles && instructions) {
+		bench_report("counters.ipc", "insn per cycle", instructions / cycles);
+		if (bench_format == BENCH_FORMAT_DEFAULT)
+			printf(" %18.2f  insn per cycle\n", instructions / cycles);
+	}
+
+	counters__report_metrics();
+}
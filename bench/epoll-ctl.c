@@ -285,6 +285,10 @@ static void print_summary(void)
 		stddev[i] = stddev_stats(&all_stats[i]);
 	}
 
+	bench_report("add_per_thread", "ops", avg[OP_EPOLL_ADD]);
+	bench_report("mod_per_thread", "ops", avg[OP_EPOLL_MOD]);
+	bench_report("del_per_thread", "ops", avg[OP_EPOLL_DEL]);
+
 	printf("\nAveraged %ld ADD operations (+- %.2f%%)\n",
 	       avg[OP_EPOLL_ADD], rel_stddev_stats(stddev[OP_EPOLL_ADD],
 						   avg[OP_EPOLL_ADD]));
@@ -58,6 +58,11 @@
  * IO polling methods, for example. Hence everything is very adhoc and
  * outputs raw microbenchmark numbers. Also this uses eventfd, similar
  * tools tend to use pipes or sockets, but the result is the same.
+ *
+ * The one exception is --io-uring, which runs the same workers, fds and
+ * writer but waits with io_uring poll requests, oneshot and rearmed or
+ * multishot, on a ring per thread, so event loop designs can be compared
+ * on the same harness. An operation is then a completion plus its read.
  */
 
 /* For the CLR_() macros */
@@ -75,11 +80,16 @@
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/types.h>
+#include <poll.h>
+#ifdef HAVE_LIBURING_SUPPORT
+#include <liburing.h>
+#endif
 
 #include "../util/stat.h"
 #include <subcmd/parse-options.h>
 #include "bench.h"
 #include "cpumap.h"
+#include "futex-profile.h"
 
 #include <err.h>
 
@@ -106,6 +116,14 @@ static bool et; /* edge-trigger */
 static bool oneshot;
 static bool multiq; /* use an epoll instance per thread */
 
+/* wait with io_uring instead, "poll" or "multishot" */
+static const char *uring_mode;
+static bool multishot;
+
+/* the write time of the fds the workers haven't read yet, for --latency */
+static bool latency;
+static u64 *write_ns;
+
 /* amount of fds to monitor, per thread */
 static unsigned int nfds = 64;
 
@@ -120,6 +138,11 @@ struct worker {
 	pthread_t thread;
 	unsigned long ops;
 	int *fdmap;
+	/* behind pointers, --randomize shuffles the workers while they run */
+	struct futex_hist *hist;
+#ifdef HAVE_LIBURING_SUPPORT
+	struct io_uring *ring;
+#endif
 };
 
 static const struct option options[] = {
@@ -130,6 +153,7 @@ static const struct option options[] = {
 	OPT_BOOLEAN( 'n', "noaffinity",  &noaffinity,   "Disables CPU affinity"),
 	OPT_BOOLEAN('R', "randomize", &randomize,   "Enable random write behaviour (default is lineal)"),
 	OPT_BOOLEAN( 'v', "verbose", &__verbose, "Verbose mode"),
+	OPT_BOOLEAN( 'L', "latency", &latency, "Measure the wakeup latency, from the write to the read of each fd"),
 
 	/* epoll specific options */
 	OPT_BOOLEAN( 'm', "multiq",  &multiq,   "Use multiple epoll instances (one per thread)"),
@@ -137,6 +161,10 @@ static const struct option options[] = {
 	OPT_UINTEGER( 'N', "nested",  &nested,   "Nesting level epoll hierarchy (default is 0, no nesting)"),
 	OPT_BOOLEAN( 'S', "oneshot",  &oneshot,   "Use EPOLLONESHOT semantics"),
 	OPT_BOOLEAN( 'E', "edge",  &et,   "Use Edge-triggered interface (default is LT)"),
+#ifdef HAVE_LIBURING_SUPPORT
+	OPT_STRING(  'U', "io-uring", &uring_mode, "poll|multishot",
+		     "Wait with io_uring poll requests instead, one ring per thread"),
+#endif
 
 	OPT_END()
 };
@@ -179,6 +207,91 @@ static void shuffle(void *array, size_t n, size_t size)
 }
 
 
+static void worker_started(void)
+{
+	pthread_mutex_lock(&thread_lock);
+	threads_starting--;
+	if (!threads_starting)
+		pthread_cond_signal(&thread_parent);
+	pthread_cond_wait(&thread_worker, &thread_lock);
+	pthread_mutex_unlock(&thread_lock);
+}
+
+static void worker_read_done(struct futex_hist *hist, int fd)
+{
+	u64 then;
+
+	if (!latency)
+		return;
+
+	then = __atomic_exchange_n(&write_ns[fd], 0, __ATOMIC_ACQ_REL);
+	if (then)
+		futex_hist__add(hist, futex_profile__now_ns() - then);
+}
+
+#ifdef HAVE_LIBURING_SUPPORT
+static void uring_poll(struct io_uring *ring, int fd)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+	if (!sqe)
+		errx(EXIT_FAILURE, "io_uring submission queue full");
+
+	if (multishot)
+		io_uring_prep_poll_multishot(sqe, fd, POLLIN);
+	else
+		io_uring_prep_poll_add(sqe, fd, POLLIN);
+	io_uring_sqe_set_data(sqe, (void *)(long)fd);
+}
+
+static void *uring_workerfn(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	unsigned long ops = w->ops;
+	struct io_uring *ring = w->ring;
+	struct futex_hist *hist = w->hist;
+	struct io_uring_cqe *cqe;
+	uint64_t val;
+	int fd, ret;
+
+	worker_started();
+
+	do {
+		/* like the epoll_wait(2) workers, one event at a time */
+		if (nonblocking)
+			ret = io_uring_peek_cqe(ring, &cqe);
+		else
+			ret = io_uring_wait_cqe(ring, &cqe);
+		if (ret == -EAGAIN || ret == -EINTR)
+			continue;
+		if (ret < 0)
+			errx(EXIT_FAILURE, "io_uring_wait_cqe: %s", strerror(-ret));
+		if (cqe->res < 0)
+			errx(EXIT_FAILURE, "io_uring poll: %s", strerror(-cqe->res));
+
+		fd = (long)io_uring_cqe_get_data(cqe);
+
+		/* rearm oneshot polls, and multishot ones the kernel ended */
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			uring_poll(ring, fd);
+			io_uring_submit(ring);
+		}
+		io_uring_cqe_seen(ring, cqe);
+
+		/* a multishot poll may complete again for a value already read */
+		if (read(fd, &val, sizeof(val)) < 0)
+			continue;
+
+		worker_read_done(hist, fd);
+		ops++;
+	}  while (!done);
+
+	io_uring_queue_exit(ring);
+	w->ops = ops;
+	return NULL;
+}
+#endif
+
 static void *workerfn(void *arg)
 {
 	int fd, ret, r;
@@ -188,13 +301,9 @@ static void *workerfn(void *arg)
 	uint64_t val;
 	int to = nonblocking? 0 : -1;
 	int efd = multiq ? w->epollfd : epollfd;
+	struct futex_hist *hist = w->hist;
 
-	pthread_mutex_lock(&thread_lock);
-	threads_starting--;
-	if (!threads_starting)
-		pthread_cond_signal(&thread_parent);
-	pthread_cond_wait(&thread_worker, &thread_lock);
-	pthread_mutex_unlock(&thread_lock);
+	worker_started();
 
 	do {
 		/*
@@ -214,6 +323,8 @@ static void *workerfn(void *arg)
 		do {
 			r = read(fd, &val, sizeof(val));
 		} while (!done && (r < 0 && errno == EAGAIN));
+		if (r > 0)
+			worker_read_done(hist, fd);
 
 		if (et) {
 			ev.events = EPOLLIN | EPOLLET;
@@ -283,11 +394,31 @@ static void print_summary(void)
 	unsigned long avg = avg_stats(&throughput_stats);
 	double stddev = stddev_stats(&throughput_stats);
 
+	bench_report("throughput_per_thread", "ops/sec", avg);
+
 	printf("\nAveraged %ld operations/sec (+- %.2f%%), total secs = %d\n",
 	       avg, rel_stddev_stats(stddev, avg),
 	       (int) runtime.tv_sec);
 }
 
+static void print_latency(struct worker *worker)
+{
+	struct futex_hist all;
+	unsigned int i;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < nthreads; i++)
+		futex_hist__merge(&all, worker[i].hist);
+
+	bench_report("wakeup_latency_p50", "nsec", futex_hist__percentile(&all, 50));
+	bench_report("wakeup_latency_p99", "nsec", futex_hist__percentile(&all, 99));
+
+	printf("Wakeup latency of all threads: ");
+	futex_hist__fprintf_summary(&all, stdout);
+	printf("\n");
+	futex_hist__fprintf(&all, stdout);
+}
+
 static int do_threads(struct worker *worker, struct cpu_map *cpu)
 {
 	pthread_attr_t thread_attr, *attrp = NULL;
@@ -309,6 +440,21 @@ static int do_threads(struct worker *worker, struct cpu_map *cpu)
 	for (i = 0; i < nthreads; i++) {
 		struct worker *w = &worker[i];
 
+		w->hist = calloc(1, sizeof(*w->hist));
+		if (!w->hist)
+			return 1;
+
+#ifdef HAVE_LIBURING_SUPPORT
+		if (uring_mode) {
+			w->ring = calloc(1, sizeof(*w->ring));
+			if (!w->ring)
+				return 1;
+
+			ret = io_uring_queue_init(nfds, w->ring, 0);
+			if (ret)
+				errx(EXIT_FAILURE, "io_uring_queue_init: %s", strerror(-ret));
+		}
+#endif
 		if (multiq) {
 			w->epollfd = epoll_create(1);
 			if (w->epollfd < 0)
@@ -331,6 +477,13 @@ static int do_threads(struct worker *worker, struct cpu_map *cpu)
 			if (w->fdmap[j] < 0)
 				err(EXIT_FAILURE, "eventfd");
 
+#ifdef HAVE_LIBURING_SUPPORT
+			if (uring_mode) {
+				uring_poll(w->ring, w->fdmap[j]);
+				continue;
+			}
+#endif
+
 			ev.data.fd = w->fdmap[j];
 			ev.events = events;
 
@@ -351,8 +504,19 @@ static int do_threads(struct worker *worker, struct cpu_map *cpu)
 			attrp = &thread_attr;
 		}
 
-		ret = pthread_create(&w->thread, attrp, workerfn,
-				     (void *)(struct worker *) w);
+#ifdef HAVE_LIBURING_SUPPORT
+		if (uring_mode) {
+			ret = io_uring_submit(w->ring);
+			if (ret < 0)
+				errx(EXIT_FAILURE, "io_uring_submit: %s", strerror(-ret));
+		}
+#endif
+
+		ret = pthread_create(&w->thread, attrp,
+#ifdef HAVE_LIBURING_SUPPORT
+				     uring_mode ? uring_workerfn :
+#endif
+				     workerfn, (void *)(struct worker *) w);
 		if (ret)
 			err(EXIT_FAILURE, "pthread_create");
 	}
@@ -388,6 +552,14 @@ static void *writerfn(void *p)
 			}
 
 			for (j = 0; j < nfds; j++) {
+				if (latency) {
+					u64 zero = 0, now = futex_profile__now_ns();
+
+					/* the oldest unread write is what the wakeup is late for */
+					__atomic_compare_exchange_n(&write_ns[w->fdmap[j]], &zero, now,
+								    false, __ATOMIC_RELEASE,
+								    __ATOMIC_RELAXED);
+				}
 				do {
 					sz = write(w->fdmap[j], &val, sizeof(val));
 				} while (!wdone && (sz < 0 && errno == EAGAIN));
@@ -420,6 +592,13 @@ int bench_epoll_wait(int argc, const char **argv)
 	struct rlimit rl, prevrl;
 
 	argc = parse_options(argc, argv, options, bench_epoll_wait_usage, 0);
+	if (uring_mode) {
+		multishot = !strcmp(uring_mode, "multishot");
+		/* the rings are per thread and there is nothing to nest or rearm */
+		if ((!multishot && strcmp(uring_mode, "poll")) ||
+		    multiq || nested || et || oneshot)
+			argc = -1;
+	}
 	if (argc) {
 		usage_with_options(bench_epoll_wait_usage, options);
 		exit(EXIT_FAILURE);
@@ -434,7 +613,7 @@ int bench_epoll_wait(int argc, const char **argv)
 		goto errmem;
 
 	/* a single, main epoll instance */
-	if (!multiq) {
+	if (!multiq && !uring_mode) {
 		epollfd = epoll_create(1);
 		if (epollfd < 0)
 			err(EXIT_FAILURE, "epoll_create");
@@ -446,7 +625,7 @@ int bench_epoll_wait(int argc, const char **argv)
 			nest_epollfd(NULL);
 	}
 
-	printinfo("Using %s queue model\n", multiq ? "multi" : "single");
+	printinfo("Using %s queue model\n", multiq || uring_mode ? "multi" : "single");
 	printinfo("Nesting level(s): %d\n", nested);
 
 	/* default to the number of CPUs and leave one for the writer pthread */
@@ -466,9 +645,18 @@ int bench_epoll_wait(int argc, const char **argv)
 	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
 		err(EXIT_FAILURE, "setrlimit");
 
+	if (latency) {
+		/* indexed by fd, which stay below the limit */
+		write_ns = calloc(rl.rlim_cur, sizeof(*write_ns));
+		if (!write_ns)
+			goto errmem;
+	}
+
 	printf("Run summary [PID %d]: %d threads monitoring%s on "
 	       "%d file-descriptors for %d secs.\n\n",
-	       getpid(), nthreads, oneshot ? " (EPOLLONESHOT semantics)": "", nfds, nsecs);
+	       getpid(), nthreads,
+	       uring_mode ? (multishot ? " (io_uring multishot poll)" : " (io_uring poll)") :
+	       oneshot ? " (EPOLLONESHOT semantics)": "", nfds, nsecs);
 
 	init_stats(&throughput_stats);
 	pthread_mutex_init(&thread_lock, NULL);
@@ -531,6 +719,9 @@ int bench_epoll_wait(int argc, const char **argv)
 	}
 
 	print_summary();
+	if (latency)
+		print_latency(worker);
+	free(write_ns);
 
 	close(epollfd);
 	return ret;
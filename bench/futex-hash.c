@@ -24,6 +24,7 @@
 #include <subcmd/parse-options.h>
 #include "bench.h"
 #include "futex.h"
+#include "futex-profile.h"
 #include "cpumap.h"
 
 #include <err.h>
@@ -33,7 +34,11 @@ static unsigned int nsecs    = 10;
 /* amount of futexes per thread */
 static unsigned int nfutexes = 1024;
 static bool fshared = false, done = false, silent = false;
-static int futex_flag = 0;
+static bool global = false, latency = false;
+static unsigned int shared_pct;
+static const char *placement = "none";
+static const char *zipf_str;
+static struct futex_zipf zipf;
 
 struct timeval start, end, runtime;
 static pthread_mutex_t thread_lock;
@@ -46,6 +51,8 @@ struct worker {
 	u_int32_t *futex;
 	pthread_t thread;
 	unsigned long ops;
+	u64 seed;
+	struct futex_hist hist;
 };
 
 static const struct option options[] = {
@@ -54,6 +61,12 @@ static const struct option options[] = {
 	OPT_UINTEGER('f', "futexes", &nfutexes, "Specify amount of futexes per threads"),
 	OPT_BOOLEAN( 's', "silent",  &silent,   "Silent mode: do not display data/details"),
 	OPT_BOOLEAN( 'S', "shared",  &fshared,  "Use shared futexes instead of private ones"),
+	OPT_UINTEGER('m', "shared-pct", &shared_pct, "Specify the percentage of shared futexes, the rest are private"),
+	OPT_BOOLEAN( 'G', "global",  &global,   "All threads operate on the same futexes instead of their own"),
+	OPT_STRING(  'z', "zipf",    &zipf_str, "theta", "Pick the futexes with a Zipf distribution of this skew instead of in turn"),
+	OPT_STRING(  'p', "placement", &placement, "none|spread|compact",
+		     "Place the threads in cpu order, round robin over the NUMA nodes or filling a node first"),
+	OPT_BOOLEAN( 'H', "histogram", &latency, "Measure the latency of every operation and print the histograms"),
 	OPT_END()
 };
 
@@ -78,13 +91,19 @@ static void *workerfn(void *arg)
 
 	do {
 		for (i = 0; i < nfutexes; i++, ops++) {
+			unsigned int idx = zipf.cdf ? futex_zipf__next(&zipf, &w->seed) : i;
+			int flag = futex_profile__shared(idx, shared_pct) ? 0 : FUTEX_PRIVATE_FLAG;
+			u64 t0 = latency ? futex_profile__now_ns() : 0;
+
 			/*
 			 * We want the futex calls to fail in order to stress
 			 * the hashing of uaddr and not measure other steps,
 			 * such as internal waitqueue handling, thus enlarging
 			 * the critical region protected by hb->lock.
 			 */
-			ret = futex_wait(&w->futex[i], 1234, NULL, futex_flag);
+			ret = futex_wait(&w->futex[idx], 1234, NULL, flag);
+			if (latency)
+				futex_hist__add(&w->hist, futex_profile__now_ns() - t0);
 			if (!silent &&
 			    (!ret || errno != EAGAIN || errno != EWOULDBLOCK))
 				warn("Non-expected futex return call");
@@ -110,11 +129,31 @@ static void print_summary(void)
 	unsigned long avg = avg_stats(&throughput_stats);
 	double stddev = stddev_stats(&throughput_stats);
 
+	bench_report("throughput_per_thread", "ops/sec", avg);
+
 	printf("%sAveraged %ld operations/sec (+- %.2f%%), total secs = %d\n",
 	       !silent ? "\n" : "", avg, rel_stddev_stats(stddev, avg),
 	       (int) runtime.tv_sec);
 }
 
+static void print_latency(struct worker *worker)
+{
+	struct futex_hist all;
+	unsigned int i;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < nthreads; i++)
+		futex_hist__merge(&all, &worker[i].hist);
+
+	bench_report("latency_p50", "nsec", futex_hist__percentile(&all, 50));
+	bench_report("latency_p99", "nsec", futex_hist__percentile(&all, 99));
+
+	printf("\nLatency of all threads: ");
+	futex_hist__fprintf_summary(&all, stdout);
+	printf("\n");
+	futex_hist__fprintf(&all, stdout);
+}
+
 int bench_futex_hash(int argc, const char **argv)
 {
 	int ret = 0;
@@ -124,9 +163,14 @@ int bench_futex_hash(int argc, const char **argv)
 	pthread_attr_t thread_attr;
 	struct worker *worker = NULL;
 	struct cpu_map *cpu;
+	u_int32_t *global_futexes = NULL;
+	u64 total_ops = 0;
+	int *cpus;
 
 	argc = parse_options(argc, argv, options, bench_futex_hash_usage, 0);
-	if (argc) {
+	if (fshared)
+		shared_pct = 100;
+	if (argc || !nfutexes || shared_pct > 100) {
 		usage_with_options(bench_futex_hash_usage, options);
 		exit(EXIT_FAILURE);
 	}
@@ -146,11 +190,24 @@ int bench_futex_hash(int argc, const char **argv)
 	if (!worker)
 		goto errmem;
 
-	if (!fshared)
-		futex_flag = FUTEX_PRIVATE_FLAG;
+	cpus = futex_placement__cpus(cpu, placement, nthreads);
+	if (!cpus)
+		errx(EXIT_FAILURE, "Invalid placement: %s", placement);
+
+	if (zipf_str && futex_zipf__init(&zipf, nfutexes, strtod(zipf_str, NULL)))
+		goto errmem;
+
+	if (global) {
+		global_futexes = calloc(nfutexes, sizeof(*global_futexes));
+		if (!global_futexes)
+			goto errmem;
+	}
 
-	printf("Run summary [PID %d]: %d threads, each operating on %d [%s] futexes for %d secs.\n\n",
-	       getpid(), nthreads, nfutexes, fshared ? "shared":"private", nsecs);
+	printf("Run summary [PID %d]: %d threads, %s %d [%d%% shared] futexes for %d secs.\n",
+	       getpid(), nthreads, global ? "all operating on the same" : "each operating on",
+	       nfutexes, shared_pct, nsecs);
+	printf("Picking the futexes %s%s, %s thread placement.\n\n",
+	       zipf_str ? "with Zipf theta " : "in turn", zipf_str ?: "", placement);
 
 	init_stats(&throughput_stats);
 	pthread_mutex_init(&thread_lock, NULL);
@@ -162,12 +219,16 @@ int bench_futex_hash(int argc, const char **argv)
 	gettimeofday(&start, NULL);
 	for (i = 0; i < nthreads; i++) {
 		worker[i].tid = i;
-		worker[i].futex = calloc(nfutexes, sizeof(*worker[i].futex));
+		worker[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if (global)
+			worker[i].futex = global_futexes;
+		else
+			worker[i].futex = calloc(nfutexes, sizeof(*worker[i].futex));
 		if (!worker[i].futex)
 			goto errmem;
 
 		CPU_ZERO(&cpuset);
-		CPU_SET(cpu->map[i % cpu->nr], &cpuset);
+		CPU_SET(cpus[i], &cpuset);
 
 		ret = pthread_attr_setaffinity_np(&thread_attr, sizeof(cpu_set_t), &cpuset);
 		if (ret)
@@ -186,6 +247,7 @@ int bench_futex_hash(int argc, const char **argv)
 		pthread_cond_wait(&thread_parent, &thread_lock);
 	pthread_cond_broadcast(&thread_worker);
 	pthread_mutex_unlock(&thread_lock);
+	bench_counters__start();
 
 	sleep(nsecs);
 	toggle_done(0, NULL, NULL);
@@ -195,6 +257,7 @@ int bench_futex_hash(int argc, const char **argv)
 		if (ret)
 			err(EXIT_FAILURE, "pthread_join");
 	}
+	bench_counters__stop();
 
 	/* cleanup & report results */
 	pthread_cond_destroy(&thread_parent);
@@ -203,6 +266,7 @@ int bench_futex_hash(int argc, const char **argv)
 
 	for (i = 0; i < nthreads; i++) {
 		unsigned long t = worker[i].ops/runtime.tv_sec;
+		total_ops += worker[i].ops;
 		update_stats(&throughput_stats, t);
 		if (!silent) {
 			if (nfutexes == 1)
@@ -212,13 +276,25 @@ int bench_futex_hash(int argc, const char **argv)
 				printf("[thread %2d] futexes: %p ... %p [ %ld ops/sec ]\n",
 				       worker[i].tid, &worker[i].futex[0],
 				       &worker[i].futex[nfutexes-1], t);
+			if (latency) {
+				printf("             cpu %d, ", cpus[i]);
+				futex_hist__fprintf_summary(&worker[i].hist, stdout);
+				printf("\n");
+			}
 		}
 
-		free(worker[i].futex);
+		if (!global)
+			free(worker[i].futex);
 	}
 
+	bench_counters__set_ops(total_ops);
 	print_summary();
+	if (latency)
+		print_latency(worker);
 
+	free(global_futexes);
+	futex_zipf__exit(&zipf);
+	free(cpus);
 	free(worker);
 	free(cpu);
 	return ret;
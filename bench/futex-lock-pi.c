@@ -15,6 +15,7 @@
 #include <errno.h>
 #include "bench.h"
 #include "futex.h"
+#include "futex-profile.h"
 #include "cpumap.h"
 
 #include <err.h>
@@ -26,6 +27,8 @@ struct worker {
 	u_int32_t *futex;
 	pthread_t thread;
 	unsigned long ops;
+	u64 seed;
+	struct futex_hist hist;
 };
 
 static u_int32_t global_futex = 0;
@@ -34,7 +37,12 @@ static unsigned int nsecs = 10;
 static bool silent = false, multi = false;
 static bool done = false, fshared = false;
 static unsigned int nthreads = 0;
-static int futex_flag = 0;
+static unsigned int nfutexes = 0, shared_pct;
+static u_int32_t *futexes;
+static bool latency = false;
+static const char *placement = "none";
+static const char *zipf_str;
+static struct futex_zipf zipf;
 struct timeval start, end, runtime;
 static pthread_mutex_t thread_lock;
 static unsigned int threads_starting;
@@ -47,6 +55,12 @@ static const struct option options[] = {
 	OPT_BOOLEAN( 'M', "multi",   &multi,     "Use multiple futexes"),
 	OPT_BOOLEAN( 's', "silent",  &silent,    "Silent mode: do not display data/details"),
 	OPT_BOOLEAN( 'S', "shared",  &fshared,   "Use shared futexes instead of private ones"),
+	OPT_UINTEGER('f', "futexes", &nfutexes,  "Specify amount of futexes the threads pick one of for each lock"),
+	OPT_UINTEGER('m', "shared-pct", &shared_pct, "Specify the percentage of shared futexes, the rest are private"),
+	OPT_STRING(  'z', "zipf",    &zipf_str,  "theta", "Pick the futexes with a Zipf distribution of this skew instead of uniformly"),
+	OPT_STRING(  'p', "placement", &placement, "none|spread|compact",
+		     "Place the threads in cpu order, round robin over the NUMA nodes or filling a node first"),
+	OPT_BOOLEAN( 'H', "histogram", &latency, "Measure the latency of every lock and print the histograms"),
 	OPT_END()
 };
 
@@ -60,11 +74,31 @@ static void print_summary(void)
 	unsigned long avg = avg_stats(&throughput_stats);
 	double stddev = stddev_stats(&throughput_stats);
 
+	bench_report("throughput_per_thread", "ops/sec", avg);
+
 	printf("%sAveraged %ld operations/sec (+- %.2f%%), total secs = %d\n",
 	       !silent ? "\n" : "", avg, rel_stddev_stats(stddev, avg),
 	       (int) runtime.tv_sec);
 }
 
+static void print_latency(void)
+{
+	struct futex_hist all;
+	unsigned int i;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < nthreads; i++)
+		futex_hist__merge(&all, &worker[i].hist);
+
+	bench_report("lock_latency_p50", "nsec", futex_hist__percentile(&all, 50));
+	bench_report("lock_latency_p99", "nsec", futex_hist__percentile(&all, 99));
+
+	printf("\nLock latency of all threads: ");
+	futex_hist__fprintf_summary(&all, stdout);
+	printf("\n");
+	futex_hist__fprintf(&all, stdout);
+}
+
 static void toggle_done(int sig __maybe_unused,
 			siginfo_t *info __maybe_unused,
 			void *uc __maybe_unused)
@@ -88,25 +122,38 @@ static void *workerfn(void *arg)
 	pthread_mutex_unlock(&thread_lock);
 
 	do {
-		int ret;
+		unsigned int idx = w->tid;
+		u_int32_t *uaddr = w->futex;
+		int ret, flag;
+		u64 t0;
+
+		/* pick one of the shared set of futexes for this round */
+		if (nfutexes) {
+			idx = futex_zipf__next(&zipf, &w->seed);
+			uaddr = &futexes[idx];
+		}
+		flag = futex_profile__shared(idx, shared_pct) ? 0 : FUTEX_PRIVATE_FLAG;
+		t0 = latency ? futex_profile__now_ns() : 0;
 	again:
-		ret = futex_lock_pi(w->futex, NULL, futex_flag);
+		ret = futex_lock_pi(uaddr, NULL, flag);
 
 		if (ret) { /* handle lock acquisition */
 			if (!silent)
 				warn("thread %d: Could not lock pi-lock for %p (%d)",
-				     w->tid, w->futex, ret);
+				     w->tid, uaddr, ret);
 			if (done)
 				break;
 
 			goto again;
 		}
+		if (latency)
+			futex_hist__add(&w->hist, futex_profile__now_ns() - t0);
 
 		usleep(1);
-		ret = futex_unlock_pi(w->futex, futex_flag);
+		ret = futex_unlock_pi(uaddr, flag);
 		if (ret && !silent)
 			warn("thread %d: Could not unlock pi-lock for %p (%d)",
-			     w->tid, w->futex, ret);
+			     w->tid, uaddr, ret);
 		ops++; /* account for thread's share of work */
 	}  while (!done);
 
@@ -115,7 +162,7 @@ static void *workerfn(void *arg)
 }
 
 static void create_threads(struct worker *w, pthread_attr_t thread_attr,
-			   struct cpu_map *cpu)
+			   int *cpus)
 {
 	cpu_set_t cpuset;
 	unsigned int i;
@@ -124,8 +171,11 @@ static void create_threads(struct worker *w, pthread_attr_t thread_attr,
 
 	for (i = 0; i < nthreads; i++) {
 		worker[i].tid = i;
+		worker[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
 
-		if (multi) {
+		if (nfutexes) {
+			worker[i].futex = futexes;
+		} else if (multi) {
 			worker[i].futex = calloc(1, sizeof(u_int32_t));
 			if (!worker[i].futex)
 				err(EXIT_FAILURE, "calloc");
@@ -133,7 +183,7 @@ static void create_threads(struct worker *w, pthread_attr_t thread_attr,
 			worker[i].futex = &global_futex;
 
 		CPU_ZERO(&cpuset);
-		CPU_SET(cpu->map[i % cpu->nr], &cpuset);
+		CPU_SET(cpus[i], &cpuset);
 
 		if (pthread_attr_setaffinity_np(&thread_attr, sizeof(cpu_set_t), &cpuset))
 			err(EXIT_FAILURE, "pthread_attr_setaffinity_np");
@@ -150,9 +200,12 @@ int bench_futex_lock_pi(int argc, const char **argv)
 	struct sigaction act;
 	pthread_attr_t thread_attr;
 	struct cpu_map *cpu;
+	int *cpus;
 
 	argc = parse_options(argc, argv, options, bench_futex_lock_pi_usage, 0);
-	if (argc)
+	if (fshared)
+		shared_pct = 100;
+	if (argc || shared_pct > 100 || (zipf_str && !nfutexes))
 		goto err;
 
 	cpu = cpu_map__new(NULL);
@@ -170,11 +223,27 @@ int bench_futex_lock_pi(int argc, const char **argv)
 	if (!worker)
 		err(EXIT_FAILURE, "calloc");
 
-	if (!fshared)
-		futex_flag = FUTEX_PRIVATE_FLAG;
+	cpus = futex_placement__cpus(cpu, placement, nthreads);
+	if (!cpus)
+		errx(EXIT_FAILURE, "Invalid placement: %s", placement);
+
+	if (nfutexes) {
+		futexes = calloc(nfutexes, sizeof(*futexes));
+		if (!futexes)
+			err(EXIT_FAILURE, "calloc");
+	}
 
-	printf("Run summary [PID %d]: %d threads doing pi lock/unlock pairing for %d secs.\n\n",
+	/* theta 0 picks uniformly */
+	if (nfutexes && futex_zipf__init(&zipf, nfutexes, zipf_str ? strtod(zipf_str, NULL) : 0))
+		err(EXIT_FAILURE, "calloc");
+
+	printf("Run summary [PID %d]: %d threads doing pi lock/unlock pairing for %d secs.\n",
 	       getpid(), nthreads, nsecs);
+	if (nfutexes)
+		printf("Picking one of %d [%d%% shared] futexes %s%s, %s thread placement.\n",
+		       nfutexes, shared_pct, zipf_str ? "with Zipf theta " : "uniformly",
+		       zipf_str ?: "", placement);
+	printf("\n");
 
 	init_stats(&throughput_stats);
 	pthread_mutex_init(&thread_lock, NULL);
@@ -185,7 +254,7 @@ int bench_futex_lock_pi(int argc, const char **argv)
 	pthread_attr_init(&thread_attr);
 	gettimeofday(&start, NULL);
 
-	create_threads(worker, thread_attr, cpu);
+	create_threads(worker, thread_attr, cpus);
 	pthread_attr_destroy(&thread_attr);
 
 	pthread_mutex_lock(&thread_lock);
@@ -212,16 +281,27 @@ int bench_futex_lock_pi(int argc, const char **argv)
 		unsigned long t = worker[i].ops/runtime.tv_sec;
 
 		update_stats(&throughput_stats, t);
-		if (!silent)
+		if (!silent) {
 			printf("[thread %3d] futex: %p [ %ld ops/sec ]\n",
 			       worker[i].tid, worker[i].futex, t);
+			if (latency) {
+				printf("              cpu %d, ", cpus[i]);
+				futex_hist__fprintf_summary(&worker[i].hist, stdout);
+				printf("\n");
+			}
+		}
 
-		if (multi)
+		if (multi && !nfutexes)
 			free(worker[i].futex);
 	}
 
 	print_summary();
+	if (latency)
+		print_latency();
 
+	free(futexes);
+	futex_zipf__exit(&zipf);
+	free(cpus);
 	free(worker);
 	return ret;
 err:
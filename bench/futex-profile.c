@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * futex-profile.c
+ *
+ * Thread placement, skewed futex selection and per operation latency
+ * histograms for the futex benchmarks.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/compiler.h>
+#include <linux/kernel.h>
+#include <linux/time64.h>
+
+#include "cpumap.h"
+#include "futex-profile.h"
+
+u64 futex_profile__now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void futex_hist__add(struct futex_hist *hist, u64 ns)
+{
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= FUTEX_HIST_BUCKETS)
+		bucket = FUTEX_HIST_BUCKETS - 1;
+
+	hist->buckets[bucket]++;
+	hist->nr++;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+void futex_hist__merge(struct futex_hist *to, struct futex_hist *from)
+{
+	int i;
+
+	for (i = 0; i < FUTEX_HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->nr += from->nr;
+	to->max = max(to->max, from->max);
+}
+
+/* The upper bound of the bucket holding the pct percentile */
+u64 futex_hist__percentile(struct futex_hist *hist, double pct)
+{
+	u64 target = hist->nr * pct / 100, seen = 0;
+	int i;
+
+	for (i = 0; i < FUTEX_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen > target)
+			return min_t(u64, 1ULL << (i + 1), hist->max);
+	}
+
+	return hist->max;
+}
+
+void futex_hist__fprintf_summary(struct futex_hist *hist, FILE *fp)
+{
+	fprintf(fp, "p50 <= %llu ns, p99 <= %llu ns, p99.9 <= %llu ns, max %llu ns",
+		(unsigned long long)futex_hist__percentile(hist, 50),
+		(unsigned long long)futex_hist__percentile(hist, 99),
+		(unsigned long long)futex_hist__percentile(hist, 99.9),
+		(unsigned long long)hist->max);
+}
+
+void futex_hist__fprintf(struct futex_hist *hist, FILE *fp)
+{
+	u64 peak = 0;
+	int i, first = -1, last = -1;
+
+	for (i = 0; i < FUTEX_HIST_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+		peak = max(peak, hist->buckets[i]);
+	}
+
+	fprintf(fp, "%24s : %-12s |%-40s|\n", "ns", "count", "distribution");
+	for (i = first; i >= 0 && i <= last; i++) {
+		int bar = hist->buckets[i] * 40 / peak;
+		char range[48];
+
+		snprintf(range, sizeof(range), "%llu -> %llu",
+			 i ? 1ULL << i : 0, (1ULL << (i + 1)) - 1);
+		fprintf(fp, "%24s : %-12llu |%-40.*s|\n", range,
+			(unsigned long long)hist->buckets[i], bar,
+			"****************************************");
+	}
+}
+
+int futex_zipf__init(struct futex_zipf *zipf, unsigned int n, double theta)
+{
+	double sum = 0;
+	unsigned int i;
+
+	zipf->n = n;
+	zipf->cdf = malloc(n * sizeof(*zipf->cdf));
+	if (zipf->cdf == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		sum += 1.0 / pow(i + 1, theta);
+		zipf->cdf[i] = sum;
+	}
+	for (i = 0; i < n; i++)
+		zipf->cdf[i] /= sum;
+
+	return 0;
+}
+
+void futex_zipf__exit(struct futex_zipf *zipf)
+{
+	free(zipf->cdf);
+	zipf->cdf = NULL;
+}
+
+unsigned int futex_zipf__next(struct futex_zipf *zipf, u64 *seed)
+{
+	unsigned int lo = 0, hi = zipf->n - 1;
+	double u;
+
+	/* xorshift64, each thread has its own seed */
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	u = (*seed >> 11) * (1.0 / (1ULL << 53));
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (zipf->cdf[mid] <= u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int cpu_node(int cpu)
+{
+	static bool initialized;
+
+	if (!initialized) {
+		initialized = true;
+		cpu__setup_cpunode_map();
+	}
+
+	return cpu__get_node(cpu);
+}
+
+int *futex_placement__cpus(struct cpu_map *cpu, const char *placement,
+			   unsigned int nthreads)
+{
+	int i, n, nr = cpu->nr, *cpus, *by_node;
+	int *node_start, nr_nodes = 0, max_node = 0;
+
+	cpus = calloc(nthreads, sizeof(*cpus));
+	if (cpus == NULL)
+		return NULL;
+
+	if (!strcmp(placement, "none")) {
+		for (i = 0; i < (int)nthreads; i++)
+			cpus[i] = cpu->map[i % nr];
+		return cpus;
+	}
+
+	if (strcmp(placement, "spread") && strcmp(placement, "compact")) {
+		free(cpus);
+		return NULL;
+	}
+
+	/* the cpus of the map grouped by node, -1 (unknown) counts as node 0 */
+	for (i = 0; i < nr; i++)
+		max_node = max(max_node, cpu_node(cpu->map[i]));
+
+	by_node = calloc(nr, sizeof(*by_node));
+	node_start = calloc(max_node + 2, sizeof(*node_start));
+	if (by_node == NULL || node_start == NULL) {
+		free(by_node);
+		free(node_start);
+		free(cpus);
+		return NULL;
+	}
+
+	for (n = 0, i = 0; n <= max_node; n++) {
+		int c, start = i;
+
+		for (c = 0; c < nr; c++) {
+			int node = cpu_node(cpu->map[c]);
+
+			if (max(node, 0) == n)
+				by_node[i++] = cpu->map[c];
+		}
+		/* nodes without cpus of the map are left out */
+		if (i > start)
+			node_start[nr_nodes++] = start;
+	}
+	node_start[nr_nodes] = nr;
+
+	for (i = 0; i < (int)nthreads; i++) {
+		if (!strcmp(placement, "compact")) {
+			cpus[i] = by_node[i % nr];
+		} else {
+			int node = i % nr_nodes;
+			int size = node_start[node + 1] - node_start[node];
+
+			cpus[i] = by_node[node_start[node] + (i / nr_nodes) % size];
+		}
+	}
+
+	free(by_node);
+	free(node_start);
+	return cpus;
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef BENCH_FUTEX_PROFILE_H
+#define BENCH_FUTEX_PROFILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <linux/types.h>
+
+struct cpu_map;
+
+/*
+ * Contention profiles shared by the futex benchmarks: where the threads
+ * run, which futexes they pick and how long each operation took.
+ */
+
+/* log2 buckets of nanoseconds, bucket i holds [2^i, 2^(i+1)) */
+#define FUTEX_HIST_BUCKETS	40
+
+struct futex_hist {
+	u64	buckets[FUTEX_HIST_BUCKETS];
+	u64	nr;
+	u64	max;
+};
+
+void futex_hist__add(struct futex_hist *hist, u64 ns);
+void futex_hist__merge(struct futex_hist *to, struct futex_hist *from);
+u64 futex_hist__percentile(struct futex_hist *hist, double pct);
+void futex_hist__fprintf_summary(struct futex_hist *hist, FILE *fp);
+void futex_hist__fprintf(struct futex_hist *hist, FILE *fp);
+
+/* Zipf distributed picks of [0, n), theta 0 is uniform */
+struct futex_zipf {
+	double	     *cdf;
+	unsigned int n;
+};
+
+int futex_zipf__init(struct futex_zipf *zipf, unsigned int n, double theta);
+void futex_zipf__exit(struct futex_zipf *zipf);
+unsigned int futex_zipf__next(struct futex_zipf *zipf, u64 *seed);
+
+/*
+ * The cpu thread i runs on for placement "none" (cpu map order), "spread"
+ * (round robin over the NUMA nodes) or "compact" (fill a node first).
+ * Returns NULL for an unknown placement.
+ */
+int *futex_placement__cpus(struct cpu_map *cpu, const char *placement,
+			   unsigned int nthreads);
+
+/* Whether futex idx uses shared ops, for shared_pct percent of them */
+static inline bool futex_profile__shared(unsigned int idx, unsigned int shared_pct)
+{
+	return idx % 100 < shared_pct;
+}
+
+u64 futex_profile__now_ns(void);
+
+#endif /* BENCH_FUTEX_PROFILE_H */
@@ -187,6 +187,7 @@ int bench_futex_requeue(int argc, const char **argv)
 
 		update_stats(&requeued_stats, nrequeued);
 		update_stats(&requeuetime_stats, runtime.tv_usec);
+		bench_report("requeue_time", "msec", runtime.tv_usec / (double)USEC_PER_MSEC);
 
 		if (!silent) {
 			printf("[Run %d]: Requeued %d of %d threads in %.4f ms\n",
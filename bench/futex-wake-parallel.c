@@ -176,6 +176,8 @@ static void print_run(struct thread_data *waking_worker, unsigned int run_num)
 	waketime_stddev = stddev_stats(&__waketime_stats);
 	wakeup_avg = avg_stats(&__wakeup_stats);
 
+	bench_report("per_thread_wake_time", "msec", waketime_avg / USEC_PER_MSEC);
+
 	printf("[Run %d]: Avg per-thread latency (waking %d/%d threads) "
 	       "in %.4f ms (+-%.2f%%)\n", run_num + 1, wakeup_avg,
 	       nblocked_threads, waketime_avg / USEC_PER_MSEC,
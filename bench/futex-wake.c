@@ -185,6 +185,7 @@ int bench_futex_wake(int argc, const char **argv)
 
 		update_stats(&wakeup_stats, nwoken);
 		update_stats(&waketime_stats, runtime.tv_usec);
+		bench_report("wake_time", "msec", runtime.tv_usec / (double)USEC_PER_MSEC);
 
 		if (!silent) {
 			printf("[Run %d]: Wokeup %d of %d threads in %.4f ms\n",
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * internals-events.c
+ *
+ * ordered-events: Benchmark for queueing and flushing ordered events
+ * parse-sample:   Benchmark for perf_evsel__parse_sample()
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/event.h"
+#include "../util/evsel.h"
+#include "../util/ordered-events.h"
+#include <subcmd/parse-options.h>
+#include "../builtin.h"
+#include "bench.h"
+#include "internals.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static int		nr_events   = 1000000;
+static int		nr_cpus	    = 8;
+static int		round_size  = 10000;
+static bool		per_source;
+
+static const struct option oe_options[] = {
+	OPT_INTEGER('l', "nr-events",	&nr_events,	"Specify number of events to queue"),
+	OPT_INTEGER('c', "nr-cpus",	&nr_cpus,	"Specify number of interleaved cpu streams"),
+	OPT_INTEGER('r', "round",	&round_size,	"Specify number of events between round flushes"),
+	OPT_BOOLEAN('s', "sources",	&per_source,	"Queue each cpu stream in its own source queue"),
+	OPT_END()
+};
+
+static const char * const bench_oe_usage[] = {
+	"perf bench internals ordered-events <options>",
+	NULL
+};
+
+static u64 nr_delivered;
+
+static int oe_deliver(struct ordered_events *oe __maybe_unused,
+		      struct ordered_event *event __maybe_unused)
+{
+	nr_delivered++;
+	return 0;
+}
+
+int bench_internals_ordered_events(int argc, const char **argv)
+{
+	struct ordered_events oe;
+	union perf_event event = {
+		.header = {
+			.type = PERF_RECORD_SAMPLE,
+			.size = sizeof(struct perf_event_header),
+		},
+	};
+	struct timeval start, stop, diff;
+	u64 *clock, seed = 0x2545f4914f6cdd1dULL;
+	int i, err = 0;
+
+	argc = parse_options(argc, argv, oe_options, bench_oe_usage, 0);
+	if (argc)
+		usage_with_options(bench_oe_usage, oe_options);
+
+	if (nr_cpus < 1 || round_size < 1)
+		usage_with_options(bench_oe_usage, oe_options);
+
+	clock = calloc(nr_cpus, sizeof(*clock));
+	if (clock == NULL)
+		return -1;
+
+	ordered_events__init(&oe, oe_deliver, NULL);
+	if (per_source && ordered_events__set_sources(&oe, nr_cpus) < 0) {
+		free(clock);
+		return -1;
+	}
+
+	nr_delivered = 0;
+	gettimeofday(&start, NULL);
+
+	/*
+	 * Each cpu stream is in time order on its own, the streams get
+	 * interleaved randomly, like the per cpu ring buffers of a record.
+	 */
+	for (i = 0; i < nr_events; i++) {
+		int cpu = bench__random(&seed) % nr_cpus;
+		u64 ts = clock[cpu] += 1 + bench__random(&seed) % 1000;
+
+		if (per_source)
+			err = ordered_events__queue_src(&oe, &event, ts, 0, cpu);
+		else
+			err = ordered_events__queue(&oe, &event, ts, 0);
+		if (err)
+			break;
+
+		if ((i + 1) % round_size == 0) {
+			err = ordered_events__flush(&oe, OE_FLUSH__ROUND);
+			if (err)
+				break;
+		}
+	}
+
+	if (!err)
+		err = ordered_events__flush(&oe, OE_FLUSH__FINAL);
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	ordered_events__free(&oe);
+	free(clock);
+
+	if (err) {
+		fprintf(stderr, "Failed to queue the events: %d\n", err);
+		return err;
+	}
+
+	bench__print_ops("ordered events", nr_delivered, &diff);
+	return 0;
+}
+
+static int nr_samples	   = 1000000;
+static int callchain_depth = 16;
+
+static const struct option ps_options[] = {
+	OPT_INTEGER('l', "nr-samples",	&nr_samples,	  "Specify number of samples to parse"),
+	OPT_INTEGER('d', "depth",	&callchain_depth, "Specify the callchain depth, 0 for none"),
+	OPT_END()
+};
+
+static const char * const bench_ps_usage[] = {
+	"perf bench internals parse-sample <options>",
+	NULL
+};
+
+#define PS_SAMPLE_TYPE	(PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_IP | PERF_SAMPLE_TID | \
+			 PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD)
+
+int bench_internals_parse_sample(int argc, const char **argv)
+{
+	u64 sample_type = PS_SAMPLE_TYPE;
+	struct perf_evsel evsel = {
+		.needs_swap = false,
+	};
+	struct perf_sample sample = {
+		.ip	= 0x400123,
+		.pid	= BENCH_PID_BASE,
+		.tid	= BENCH_PID_BASE,
+		.time	= 1000000,
+		.id	= 1,
+		.cpu	= 1,
+		.period	= 1000,
+	};
+	struct perf_sample sample_out;
+	struct ip_callchain *callchain = NULL;
+	struct timeval start, stop, diff;
+	union perf_event *event;
+	u64 sum = 0;
+	size_t sz;
+	int i, err;
+
+	argc = parse_options(argc, argv, ps_options, bench_ps_usage, 0);
+	if (argc)
+		usage_with_options(bench_ps_usage, ps_options);
+
+	if (callchain_depth > 0) {
+		callchain = zalloc(sizeof(*callchain) + callchain_depth * sizeof(u64));
+		if (callchain == NULL)
+			return -1;
+
+		callchain->nr = callchain_depth;
+		for (i = 0; i < callchain_depth; i++)
+			callchain->ips[i] = 0x400000 + i * 0x100;
+
+		sample.callchain = callchain;
+		sample_type |= PERF_SAMPLE_CALLCHAIN;
+	}
+
+	evsel.attr.sample_type = sample_type;
+	evsel.sample_size = __perf_evsel__sample_size(sample_type);
+
+	sz = perf_event__sample_event_size(&sample, sample_type, 0);
+	event = zalloc(sz);
+	if (event == NULL) {
+		free(callchain);
+		return -1;
+	}
+
+	event->header.type = PERF_RECORD_SAMPLE;
+	event->header.size = sz;
+
+	err = perf_event__synthesize_sample(event, sample_type, 0, &sample);
+	if (err)
+		goto out_free;
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_samples; i++) {
+		err = perf_evsel__parse_sample(&evsel, event, &sample_out);
+		if (err)
+			break;
+		/* keep the parse from being optimized away */
+		sum += sample_out.ip;
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	if (err)
+		goto out_free;
+
+	if (sum != (u64)nr_samples * sample.ip)
+		fprintf(stderr, "Unexpected parse result\n");
+
+	bench__print_ops("sample parses", nr_samples, &diff);
+
+out_free:
+	if (err)
+		fprintf(stderr, "Failed to parse the sample: %d\n", err);
+	free(event);
+	free(callchain);
+	return err;
+}
@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * internals-hists.c
+ *
+ * hists-add:        Benchmark for adding resolved samples to the hists,
+ *                   without and with callchains
+ * callchain-append: Benchmark for merging callchains into a callchain tree
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/callchain.h"
+#include "../util/event.h"
+#include "../util/evlist.h"
+#include "../util/evsel.h"
+#include "../util/hist.h"
+#include "../util/map.h"
+#include "../util/map_groups.h"
+#include "../util/parse-events.h"
+#include "../util/sort.h"
+#include "../util/symbol.h"
+#include "../util/thread.h"
+#include <subcmd/parse-options.h>
+#include "../builtin.h"
+#include "bench.h"
+#include "internals.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static int nr_loops	   = 1000000;
+static int nr_threads	   = 16;
+static int nr_dsos	   = 8;
+static int nr_syms	   = 1024;
+static int nr_chains	   = 1000;
+static int callchain_depth = 16;
+
+/*
+ * The first frames of the synthetic chains are shared by many chains
+ * and the deeper ones get more and more distinct, roughly what a real
+ * profile looks like from main() down.
+ */
+static void bench_chain__ip(struct bench_machine *bm, int chain, int frame,
+			    u64 *ip)
+{
+	u64 state = (((u64)frame << 32) | (chain % (1 + frame * frame))) *
+		    0x9e3779b97f4a7c15ULL + 1;
+	u64 key = bench__random(&state);
+
+	*ip = bench_machine__ip(bm, key % bm->nr_dsos, (key >> 16) % bm->nr_syms);
+}
+
+static const struct option hists_options[] = {
+	OPT_INTEGER('l', "nr-samples",	&nr_loops,	  "Specify number of samples to add"),
+	OPT_INTEGER('t', "nr-threads",	&nr_threads,	  "Specify number of sampled threads"),
+	OPT_INTEGER('d', "nr-dsos",	&nr_dsos,	  "Specify number of mapped dsos"),
+	OPT_INTEGER('s', "nr-symbols",	&nr_syms,	  "Specify number of symbols per dso"),
+	OPT_INTEGER('u', "nr-chains",	&nr_chains,	  "Specify number of distinct callchains"),
+	OPT_INTEGER('D', "depth",	&callchain_depth, "Specify the callchain depth"),
+	OPT_END()
+};
+
+static const char * const bench_hists_usage[] = {
+	"perf bench internals hists-add <options>",
+	NULL
+};
+
+static int hists_add_run(struct bench_machine *bm, u64 *chains, bool use_callchain)
+{
+	struct perf_evlist *evlist = perf_evlist__new();
+	struct perf_sample sample = { .period = 1000, };
+	struct timeval start, stop, diff;
+	struct perf_evsel *evsel;
+	u64 seed = 0x9e3779b97f4a7c15ULL;
+	int i, err = -1;
+
+	if (evlist == NULL)
+		return -ENOMEM;
+
+	if (parse_events(evlist, "cpu-clock", NULL))
+		goto out;
+
+	evsel = perf_evlist__first(evlist);
+
+	symbol_conf.use_callchain = use_callchain;
+	if (use_callchain)
+		perf_evsel__set_sample_bit(evsel, CALLCHAIN);
+
+	setup_sorting(NULL);
+	callchain_register_param(&callchain_param);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_loops; i++) {
+		int chain = bench__random(&seed) % nr_chains;
+		struct addr_location al;
+		struct hist_entry_iter iter = {
+			.evsel	= evsel,
+			.sample	= &sample,
+			.ops	= &hist_iter_normal,
+		};
+
+		sample.cpumode = PERF_RECORD_MISC_USER;
+		sample.pid = sample.tid = bench_machine__pid(bm, bench__random(&seed) % nr_threads);
+		/* the leaf of the chain is the sampled ip */
+		sample.ip = chains[chain * (callchain_depth + 1) + 1];
+		sample.callchain = (struct ip_callchain *)&chains[chain * (callchain_depth + 1)];
+
+		if (machine__resolve(bm->machine, &al, &sample) < 0)
+			goto out_stop;
+
+		err = hist_entry_iter__add(&iter, &al, sysctl_perf_event_max_stack, NULL);
+		addr_location__put(&al);
+		if (err)
+			goto out_stop;
+	}
+	err = 0;
+
+out_stop:
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	if (!err) {
+		if (bench_format == BENCH_FORMAT_DEFAULT)
+			printf("# %s callchains\n", use_callchain ? "With" : "Without");
+		bench__print_ops("sample additions", nr_loops, &diff);
+	}
+
+	reset_output_field();
+out:
+	perf_evlist__delete(evlist);
+	return err;
+}
+
+int bench_internals_hists_add(int argc, const char **argv)
+{
+	struct bench_machine bm;
+	u64 *chains;
+	int i, f, err;
+
+	argc = parse_options(argc, argv, hists_options, bench_hists_usage, 0);
+	if (argc || nr_threads < 1 || nr_dsos < 1 || nr_syms < 1 ||
+	    nr_chains < 1 || callchain_depth < 1)
+		usage_with_options(bench_hists_usage, hists_options);
+
+	err = hists__init();
+	if (err)
+		return err;
+
+	if (bench_machine__init(&bm, nr_threads, nr_dsos, nr_syms) < 0)
+		return -1;
+
+	/* laid out as struct ip_callchain, leaf first */
+	chains = calloc(nr_chains * (callchain_depth + 1), sizeof(u64));
+	if (chains == NULL) {
+		bench_machine__exit(&bm);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_chains; i++) {
+		u64 *chain = &chains[i * (callchain_depth + 1)];
+
+		chain[0] = callchain_depth;
+		for (f = 0; f < callchain_depth; f++)
+			bench_chain__ip(&bm, i, f, &chain[callchain_depth - f]);
+	}
+
+	err = hists_add_run(&bm, chains, false);
+	if (!err) {
+		if (bench_format == BENCH_FORMAT_DEFAULT)
+			printf("\n");
+		err = hists_add_run(&bm, chains, true);
+	}
+
+	if (err)
+		fprintf(stderr, "Failed to add a sample to the hists: %d\n", err);
+
+	free(chains);
+	bench_machine__exit(&bm);
+	return err;
+}
+
+static const struct option callchain_options[] = {
+	OPT_INTEGER('l', "nr-loops",	&nr_loops,	  "Specify number of callchains to append"),
+	OPT_INTEGER('u', "nr-chains",	&nr_chains,	  "Specify number of distinct callchains"),
+	OPT_INTEGER('D', "depth",	&callchain_depth, "Specify the callchain depth"),
+	OPT_END()
+};
+
+static const char * const bench_callchain_usage[] = {
+	"perf bench internals callchain-append <options>",
+	NULL
+};
+
+struct bench_frame {
+	u64		ip;
+	struct map	*map;
+	struct symbol	*sym;
+};
+
+int bench_internals_callchain_append(int argc, const char **argv)
+{
+	struct callchain_cursor *cursor = &callchain_cursor;
+	struct timeval start, stop, diff;
+	struct callchain_alloc alloc;
+	struct callchain_root root;
+	struct bench_machine bm;
+	struct bench_frame *frames;
+	struct thread *thread;
+	u64 seed = 0x9e3779b97f4a7c15ULL;
+	int i, f, err = 0;
+
+	argc = parse_options(argc, argv, callchain_options, bench_callchain_usage, 0);
+	if (argc || nr_chains < 1 || callchain_depth < 1)
+		usage_with_options(bench_callchain_usage, callchain_options);
+
+	if (bench_machine__init(&bm, 1, nr_dsos, nr_syms) < 0)
+		return -1;
+
+	frames = calloc(nr_chains * callchain_depth, sizeof(*frames));
+	thread = machine__find_thread(bm.machine, bench_machine__pid(&bm, 0),
+				      bench_machine__pid(&bm, 0));
+	if (frames == NULL || thread == NULL) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	/* resolve up front, only the cursor and the tree get measured */
+	for (i = 0; i < nr_chains; i++) {
+		for (f = 0; f < callchain_depth; f++) {
+			struct bench_frame *frame = &frames[i * callchain_depth + f];
+
+			bench_chain__ip(&bm, i, f, &frame->ip);
+			frame->map = maps__find(&thread->mg->maps, frame->ip);
+			if (frame->map)
+				frame->sym = map__find_symbol(frame->map,
+							      frame->map->map_ip(frame->map, frame->ip));
+		}
+	}
+
+	symbol_conf.use_callchain = true;
+	callchain_register_param(&callchain_param);
+
+	callchain_alloc__init(&alloc);
+	callchain_init(&root);
+	root.node.alloc = &alloc;
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_loops && !err; i++) {
+		struct bench_frame *chain = &frames[(bench__random(&seed) % nr_chains) *
+						    callchain_depth];
+
+		callchain_cursor_reset(cursor);
+		for (f = 0; f < callchain_depth && !err; f++)
+			err = callchain_cursor_append(cursor, chain[f].ip, chain[f].map,
+						      chain[f].sym, false, NULL, 0, 0, 0,
+						      NULL);
+		callchain_cursor_commit(cursor);
+
+		if (!err)
+			err = callchain_append(&root, cursor, 1000);
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	callchain_cursor_reset(cursor);
+	free_callchain(&root);
+	callchain_alloc__exit(&alloc);
+
+	if (err)
+		fprintf(stderr, "Failed to append a callchain: %d\n", err);
+	else
+		bench__print_ops("callchain appends", nr_loops, &diff);
+
+out_free:
+	thread__put(thread);
+	free(frames);
+	bench_machine__exit(&bm);
+	return err;
+}
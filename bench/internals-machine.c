@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * internals-machine.c
+ *
+ * findnew-thread: Benchmark for machine__findnew_thread()
+ * find-symbol:    Benchmark for maps__find() + map__find_symbol()
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/map.h"
+#include "../util/map_groups.h"
+#include "../util/symbol.h"
+#include "../util/thread.h"
+#include <subcmd/parse-options.h>
+#include "../builtin.h"
+#include "bench.h"
+#include "internals.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static int nr_loops   = 1000000;
+static int nr_threads = 1000;
+static int nr_dsos    = 16;
+static int nr_syms    = 4096;
+
+static const struct option thread_options[] = {
+	OPT_INTEGER('l', "nr-loops",	&nr_loops,	"Specify number of lookups"),
+	OPT_INTEGER('t', "nr-threads",	&nr_threads,	"Specify number of threads"),
+	OPT_END()
+};
+
+static const char * const bench_thread_usage[] = {
+	"perf bench internals findnew-thread <options>",
+	NULL
+};
+
+int bench_internals_findnew_thread(int argc, const char **argv)
+{
+	struct bench_machine bm;
+	struct timeval start, stop, diff;
+	u64 seed = 0x9e3779b97f4a7c15ULL;
+	int i, err = 0;
+
+	argc = parse_options(argc, argv, thread_options, bench_thread_usage, 0);
+	if (argc || nr_threads < 1)
+		usage_with_options(bench_thread_usage, thread_options);
+
+	if (bench_machine__init(&bm, nr_threads, 0, 0) < 0)
+		return -1;
+
+	gettimeofday(&start, NULL);
+
+	/* random pids so the last match cache doesn't short cut the lookup */
+	for (i = 0; i < nr_loops; i++) {
+		pid_t pid = bench_machine__pid(&bm, bench__random(&seed) % nr_threads);
+		struct thread *thread = machine__findnew_thread(bm.machine, pid, pid);
+
+		if (thread == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		thread__put(thread);
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	bench_machine__exit(&bm);
+
+	if (err)
+		return err;
+
+	bench__print_ops("thread lookups", nr_loops, &diff);
+	return 0;
+}
+
+static const struct option symbol_options[] = {
+	OPT_INTEGER('l', "nr-loops",	&nr_loops,	"Specify number of lookups"),
+	OPT_INTEGER('d', "nr-dsos",	&nr_dsos,	"Specify number of mapped dsos"),
+	OPT_INTEGER('s', "nr-symbols",	&nr_syms,	"Specify number of symbols per dso"),
+	OPT_END()
+};
+
+static const char * const bench_symbol_usage[] = {
+	"perf bench internals find-symbol <options>",
+	NULL
+};
+
+int bench_internals_find_symbol(int argc, const char **argv)
+{
+	struct bench_machine bm;
+	struct timeval start, stop, diff;
+	struct thread *thread;
+	u64 seed = 0x9e3779b97f4a7c15ULL;
+	int i, err = 0;
+
+	argc = parse_options(argc, argv, symbol_options, bench_symbol_usage, 0);
+	if (argc || nr_dsos < 1 || nr_syms < 1)
+		usage_with_options(bench_symbol_usage, symbol_options);
+
+	if (bench_machine__init(&bm, 1, nr_dsos, nr_syms) < 0)
+		return -1;
+
+	thread = machine__find_thread(bm.machine, bench_machine__pid(&bm, 0),
+				      bench_machine__pid(&bm, 0));
+	if (thread == NULL) {
+		bench_machine__exit(&bm);
+		return -1;
+	}
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < nr_loops; i++) {
+		u64 ip = bench_machine__ip(&bm, bench__random(&seed) % nr_dsos,
+					   bench__random(&seed) % nr_syms);
+		struct map *map = maps__find(&thread->mg->maps, ip);
+
+		if (map == NULL || map__find_symbol(map, map->map_ip(map, ip)) == NULL) {
+			err = -ENOENT;
+			break;
+		}
+	}
+
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+
+	thread__put(thread);
+	bench_machine__exit(&bm);
+
+	if (err) {
+		fprintf(stderr, "Failed to resolve a synthetic address\n");
+		return err;
+	}
+
+	bench__print_ops("symbol lookups", nr_loops, &diff);
+	return 0;
+}
@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * internals-symbols.c
+ *
+ * kallsyms-parse: Benchmark for parsing kallsyms and splitting it per module
+ * symbol-load:    Benchmark for loading the ELF symbols of a binary, with
+ *                 and without demangling, and from the symbol cache
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/debug.h"
+#include "../util/dso.h"
+#include "../util/machine.h"
+#include "../util/map.h"
+#include "../util/stat.h"
+#include "../util/symbol.h"
+#include "../util/symcache.h"
+#include <subcmd/parse-options.h>
+#include <symbol/kallsyms.h>
+#include "../builtin.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <linux/time64.h>
+
+static int	   iterations = 10;
+static const char *kallsyms_filename = "/proc/kallsyms";
+static const char *binary_filename;
+
+static const struct option kallsyms_options[] = {
+	OPT_INTEGER('i', "iterations",	&iterations,	    "Specify number of runs"),
+	OPT_STRING('k', "kallsyms",	&kallsyms_filename, "file", "kallsyms pathname"),
+	OPT_END()
+};
+
+static const char * const bench_kallsyms_usage[] = {
+	"perf bench internals kallsyms-parse <options>",
+	NULL
+};
+
+static u64 timeval__usec(struct timeval *start, struct timeval *end)
+{
+	struct timeval diff;
+
+	timersub(end, start, &diff);
+	return diff.tv_sec * USEC_PER_SEC + diff.tv_usec;
+}
+
+static void print_stats(const char *what, struct stats *stats, int nr_syms)
+{
+	char metric[64];
+
+	/* without the colon of the text layout */
+	scnprintf(metric, sizeof(metric), "%.*s", (int)strcspn(what, ":"), what);
+	bench_report(metric, "usec", avg_stats(stats));
+
+	if (bench_format == BENCH_FORMAT_SIMPLE) {
+		printf("%.3f\n", avg_stats(stats));
+		return;
+	}
+
+	printf("  %-32s %12.3f usec (+- %.3f usec), %d symbols\n", what,
+	       avg_stats(stats), stddev_stats(stats), nr_syms);
+}
+
+static int count_kallsyms_symbol(void *arg, const char *name __maybe_unused,
+				 char type __maybe_unused, u64 start __maybe_unused)
+{
+	int *nr_syms = arg;
+
+	(*nr_syms)++;
+	return 0;
+}
+
+int bench_internals_kallsyms_parse(int argc, const char **argv)
+{
+	struct stats parse_stats, load_stats;
+	struct timeval start, end;
+	int i, nr_parsed = 0, nr_loaded = 0, err = 0;
+
+	argc = parse_options(argc, argv, kallsyms_options, bench_kallsyms_usage, 0);
+	if (argc || iterations < 1)
+		usage_with_options(bench_kallsyms_usage, kallsyms_options);
+
+	if (symbol__init(NULL) < 0)
+		return -1;
+
+	init_stats(&parse_stats);
+	init_stats(&load_stats);
+
+	for (i = 0; i < iterations && !err; i++) {
+		struct machines machines;
+		struct map *map;
+
+		/* just the parsing, the callback only counts */
+		nr_parsed = 0;
+		gettimeofday(&start, NULL);
+		err = kallsyms__parse(kallsyms_filename, &nr_parsed,
+				      count_kallsyms_symbol);
+		gettimeofday(&end, NULL);
+		if (err)
+			break;
+		update_stats(&parse_stats, timeval__usec(&start, &end));
+
+		/* what report and top do: parse, insert, fixup and split */
+		machines__init(&machines);
+		if (machine__create_kernel_maps(&machines.host) < 0) {
+			machines__exit(&machines);
+			err = -1;
+			break;
+		}
+
+		map = machine__kernel_map(&machines.host);
+		gettimeofday(&start, NULL);
+		nr_loaded = __dso__load_kallsyms(map->dso, kallsyms_filename, map, true);
+		gettimeofday(&end, NULL);
+		update_stats(&load_stats, timeval__usec(&start, &end));
+
+		machines__exit(&machines);
+		if (nr_loaded < 0)
+			err = nr_loaded;
+	}
+
+	if (err) {
+		fprintf(stderr, "Failed to load %s, check kptr_restrict: %d\n",
+			kallsyms_filename, err);
+		return err;
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# %s, %d iterations\n", kallsyms_filename, iterations);
+	print_stats("kallsyms__parse:", &parse_stats, nr_parsed);
+	print_stats("dso__load_kallsyms:", &load_stats, nr_loaded);
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("  %-32s %12.3f usec\n", "of which insert, fixup, split:",
+		       avg_stats(&load_stats) - avg_stats(&parse_stats));
+	return 0;
+}
+
+static const struct option symbol_options[] = {
+	OPT_INTEGER('i', "iterations",	&iterations,	  "Specify number of runs"),
+	OPT_STRING('b', "binary",	&binary_filename, "file",
+		   "ELF binary to load the symbols of, default: perf itself"),
+	OPT_END()
+};
+
+static const char * const bench_symbol_usage[] = {
+	"perf bench internals symbol-load <options>",
+	NULL
+};
+
+/* Returns the number of symbols loaded, the dso is left in *dsop */
+static int load_elf_symbols(const char *filename, struct dso **dsop)
+{
+	struct dso *dso = dso__new(filename);
+	struct symsrc ss;
+	struct map *map;
+	int ret = -1;
+
+	if (dso == NULL)
+		return -ENOMEM;
+
+	map = map__new2(0, dso);
+	if (map == NULL)
+		goto out_put;
+
+	if (symsrc__init(&ss, dso, filename, DSO_BINARY_TYPE__SYSTEM_PATH_DSO) < 0)
+		goto out_map;
+
+	ret = dso__load_sym(dso, map, &ss, &ss, 0);
+	symsrc__destroy(&ss);
+	dso__set_loaded(dso);
+
+out_map:
+	map__put(map);
+	if (ret >= 0 && dsop) {
+		*dsop = dso;
+		return ret;
+	}
+out_put:
+	dso__put(dso);
+	return ret;
+}
+
+static int bench_elf_symbols(const char *filename, bool demangle)
+{
+	struct timeval start, end;
+	struct stats stats;
+	int i, nr_syms = 0;
+
+	symbol_conf.demangle = demangle;
+	init_stats(&stats);
+
+	for (i = 0; i < iterations; i++) {
+		gettimeofday(&start, NULL);
+		nr_syms = load_elf_symbols(filename, NULL);
+		gettimeofday(&end, NULL);
+		if (nr_syms < 0)
+			return nr_syms;
+		update_stats(&stats, timeval__usec(&start, &end));
+	}
+
+	print_stats(demangle ? "ELF symtab, demangled:" : "ELF symtab, not demangled:",
+		    &stats, nr_syms);
+	return 0;
+}
+
+static int bench_symcache(const char *filename)
+{
+	char cache[PATH_MAX] = "/tmp/perf-bench-symcache-XXXXXX";
+	u8 build_id[BUILD_ID_SIZE];
+	struct timeval start, end;
+	struct dso *dso = NULL;
+	struct stats stats;
+	int i, fd, nr_syms, err = -1;
+
+	if (filename__read_build_id(filename, build_id, sizeof(build_id)) <= 0) {
+		if (bench_format == BENCH_FORMAT_DEFAULT)
+			printf("  %s has no build-id, skipping the symbol cache\n", filename);
+		return 0;
+	}
+
+	fd = mkstemp(cache);
+	if (fd < 0)
+		return -errno;
+	close(fd);
+
+	if (load_elf_symbols(filename, &dso) < 0)
+		goto out_unlink;
+
+	dso__set_build_id(dso, build_id);
+	err = dso__save_symcache(dso, cache);
+	dso__put(dso);
+	if (err)
+		goto out_unlink;
+
+	init_stats(&stats);
+
+	for (i = 0; i < iterations; i++) {
+		dso = dso__new(filename);
+		if (dso == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		dso__set_build_id(dso, build_id);
+
+		gettimeofday(&start, NULL);
+		nr_syms = dso__load_symcache_file(dso, cache);
+		gettimeofday(&end, NULL);
+		dso__put(dso);
+		if (nr_syms < 0) {
+			err = nr_syms;
+			break;
+		}
+		update_stats(&stats, timeval__usec(&start, &end));
+	}
+
+	if (!err)
+		print_stats("symbol cache:", &stats, nr_syms);
+out_unlink:
+	unlink(cache);
+	return err;
+}
+
+int bench_internals_symbol_load(int argc, const char **argv)
+{
+	char self[PATH_MAX];
+	bool demangle = symbol_conf.demangle;
+	const char *filename;
+	int err;
+
+	argc = parse_options(argc, argv, symbol_options, bench_symbol_usage, 0);
+	if (argc || iterations < 1)
+		usage_with_options(bench_symbol_usage, symbol_options);
+
+	if (symbol__init(NULL) < 0)
+		return -1;
+
+	filename = binary_filename;
+	if (filename == NULL) {
+		ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+
+		if (n < 0)
+			return -errno;
+		self[n] = '\0';
+		filename = self;
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("# %s, %d iterations\n", filename, iterations);
+
+	err = bench_elf_symbols(filename, false);
+	if (!err)
+		err = bench_elf_symbols(filename, true);
+	/* the cache holds the names as demangled when it was written */
+	if (!err)
+		err = bench_symcache(filename);
+
+	symbol_conf.demangle = demangle;
+
+	if (err)
+		fprintf(stderr, "Failed to load the symbols of %s: %d\n", filename, err);
+	return err;
+}
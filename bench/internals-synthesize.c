@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * internals-synthesize.c
+ *
+ * synthesize: Benchmark for the synthesis of the pre-existing threads,
+ *             their maps and the kernel and module maps
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/debug.h"
+#include "../util/event.h"
+#include "../util/machine.h"
+#include "../util/stat.h"
+#include "../util/tool.h"
+#include <subcmd/parse-options.h>
+#include "../builtin.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/time64.h>
+
+static int  iterations	 = 10;
+static int  nr_processes;
+static int  nr_maps	 = 32;
+static int  nr_threads	 = -1;
+
+static const struct option options[] = {
+	OPT_INTEGER('i', "iterations",	 &iterations,	"Specify number of synthesis runs"),
+	OPT_INTEGER('p', "nr-processes", &nr_processes,	"Synthesize a generated procfs with this many processes instead of /proc"),
+	OPT_INTEGER('m', "nr-maps",	 &nr_maps,	"Specify number of maps per generated process"),
+	OPT_INTEGER('t', "nr-threads",	 &nr_threads,	"Specify number of threads for the parallel run, default: online cpus, 1: serial only"),
+	OPT_END()
+};
+
+static const char * const bench_synthesize_usage[] = {
+	"perf bench internals synthesize <options>",
+	NULL
+};
+
+static u64 nr_events, nr_comms;
+
+static int process_synthesized_event(struct perf_tool *tool __maybe_unused,
+				     union perf_event *event,
+				     struct perf_sample *sample __maybe_unused,
+				     struct machine *machine __maybe_unused)
+{
+	nr_events++;
+	/* one main thread comm per process */
+	if (event->header.type == PERF_RECORD_COMM &&
+	    event->comm.pid == event->comm.tid)
+		nr_comms++;
+	return 0;
+}
+
+static int write_file(const char *path, const char *buf, size_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ssize_t n;
+
+	if (fd < 0)
+		return -errno;
+
+	n = write(fd, buf, size);
+	close(fd);
+	return n == (ssize_t)size ? 0 : -EIO;
+}
+
+/*
+ * Generate <root>/proc/<pid>/{status,task/<pid>/maps} for nr_processes
+ * processes, only what the synthesis reads.
+ */
+static int fake_procfs__create(char *root)
+{
+	char path[PATH_MAX], *maps;
+	size_t maps_size = (size_t)nr_maps * 128;
+	int pid, m, err = 0;
+
+	maps = malloc(maps_size);
+	if (maps == NULL)
+		return -ENOMEM;
+
+	for (pid = 1; pid <= nr_processes && !err; pid++) {
+		char status[128];
+		size_t len = 0;
+		int n;
+
+		snprintf(path, sizeof(path), "%s/proc/%d/task/%d", root, pid, pid);
+		err = mkdir_p(path, 0755);
+		if (err)
+			break;
+
+		n = snprintf(status, sizeof(status),
+			     "Name:\tbench-%d\nTgid:\t%d\nPPid:\t1\n", pid, pid);
+		snprintf(path, sizeof(path), "%s/proc/%d/status", root, pid);
+		err = write_file(path, status, n);
+		if (err)
+			break;
+
+		for (m = 0; m < nr_maps; m++) {
+			u64 start = 0x400000ULL + (u64)m * 0x200000;
+
+			len += snprintf(maps + len, maps_size - len,
+					"%08" PRIx64 "-%08" PRIx64 " r-xp 00000000 08:01 %d"
+					"                          /bench/lib%d.so\n",
+					start, start + 0x100000, 1000 + m, m);
+		}
+
+		snprintf(path, sizeof(path), "%s/proc/%d/task/%d/maps", root, pid, pid);
+		err = write_file(path, maps, len);
+	}
+
+	free(maps);
+	return err;
+}
+
+static int run_synthesis(struct machine *machine, unsigned int threads,
+			 const char *title)
+{
+	struct perf_tool tool = { .ordered_events = false, };
+	struct stats time_stats, event_stats;
+	struct timeval start, end, diff;
+	u64 runtime_us, processes = 0;
+	char metric[64];
+	double time_avg;
+	int i, err;
+
+	init_stats(&time_stats);
+	init_stats(&event_stats);
+
+	for (i = 0; i < iterations; i++) {
+		nr_events = nr_comms = 0;
+
+		gettimeofday(&start, NULL);
+		err = perf_event__synthesize_threads(&tool, process_synthesized_event,
+						     machine, false, threads);
+		gettimeofday(&end, NULL);
+		if (err)
+			return err;
+
+		timersub(&end, &start, &diff);
+		runtime_us = diff.tv_sec * USEC_PER_SEC + diff.tv_usec;
+		update_stats(&time_stats, runtime_us);
+		update_stats(&event_stats, nr_events);
+		processes = nr_comms;
+	}
+
+	time_avg = avg_stats(&time_stats);
+
+	snprintf(metric, sizeof(metric), "synthesis_time.%uthreads", threads);
+	bench_report(metric, "usec", time_avg);
+
+	if (bench_format == BENCH_FORMAT_SIMPLE) {
+		printf("%.3f\n", time_avg);
+		return 0;
+	}
+
+	printf("# %s synthesis of %" PRIu64 " processes, %d iterations\n",
+	       title, processes, iterations);
+	printf("  Average synthesis took: %.3f usec (+- %.3f usec)\n",
+	       time_avg, stddev_stats(&time_stats));
+	printf("  Average num. events: %.3f (+- %.3f)\n",
+	       avg_stats(&event_stats), stddev_stats(&event_stats));
+	if (processes)
+		printf("  Average time per process: %.3f usec\n", time_avg / processes);
+	if (avg_stats(&event_stats))
+		printf("  Average time per event: %.3f usec\n",
+		       time_avg / avg_stats(&event_stats));
+	printf("\n");
+	return 0;
+}
+
+static void run_kernel_synthesis(struct machine *machine)
+{
+	struct perf_tool tool = { .ordered_events = false, };
+	struct timeval start, end, diff;
+	struct stats time_stats;
+	int i;
+
+	if (machine__create_kernel_maps(machine) < 0) {
+		pr_debug("Couldn't create the kernel maps, skipping their synthesis\n");
+		return;
+	}
+
+	init_stats(&time_stats);
+
+	for (i = 0; i < iterations; i++) {
+		gettimeofday(&start, NULL);
+		perf_event__synthesize_kernel_mmap(&tool, process_synthesized_event, machine);
+		perf_event__synthesize_modules(&tool, process_synthesized_event, machine);
+		gettimeofday(&end, NULL);
+
+		timersub(&end, &start, &diff);
+		update_stats(&time_stats, diff.tv_sec * USEC_PER_SEC + diff.tv_usec);
+	}
+
+	if (bench_format == BENCH_FORMAT_SIMPLE) {
+		printf("%.3f\n", avg_stats(&time_stats));
+		return;
+	}
+
+	printf("# Kernel and module maps synthesis, %d iterations\n", iterations);
+	printf("  Average synthesis took: %.3f usec (+- %.3f usec)\n",
+	       avg_stats(&time_stats), stddev_stats(&time_stats));
+}
+
+int bench_internals_synthesize(int argc, const char **argv)
+{
+	char root[PATH_MAX] = "";
+	struct machines machines;
+	struct machine *machine;
+	int err;
+
+	argc = parse_options(argc, argv, options, bench_synthesize_usage, 0);
+	if (argc || iterations < 1 || nr_processes < 0 || nr_maps < 0)
+		usage_with_options(bench_synthesize_usage, options);
+
+	if (nr_threads < 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	machines__init(&machines);
+	machine = &machines.host;
+
+	if (nr_processes) {
+		strcpy(root, "/tmp/perf-bench-synthesize-XXXXXX");
+		if (mkdtemp(root) == NULL) {
+			err = -errno;
+			root[0] = '\0';
+			goto out;
+		}
+
+		err = fake_procfs__create(root);
+		if (err) {
+			fprintf(stderr, "Failed to generate the procfs in %s: %d\n", root, err);
+			goto out;
+		}
+
+		/* the synthesis looks up everything under the machine's root */
+		free(machine->root_dir);
+		machine->root_dir = strdup(root);
+		if (machine->root_dir == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	err = run_synthesis(machine, 1, "Single threaded");
+	if (!err && nr_threads > 1) {
+		char title[64];
+
+		snprintf(title, sizeof(title), "Parallel (%d threads)", nr_threads);
+		err = run_synthesis(machine, nr_threads, title);
+	}
+
+	if (err)
+		fprintf(stderr, "Synthesis failed: %d\n", err);
+	else if (!nr_processes)
+		run_kernel_synthesis(machine);
+
+out:
+	if (root[0])
+		rm_rf(root);
+	machines__exit(&machines);
+	return err;
+}
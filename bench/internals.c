@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * internals.c
+ *
+ * Helpers shared by the 'perf bench internals' suites, which measure
+ * perf's own event processing hot paths on synthetic data.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/debug.h"
+#include "../util/dso.h"
+#include "../util/map.h"
+#include "../util/symbol.h"
+#include "../util/thread.h"
+#include "bench.h"
+#include "internals.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/time64.h>
+
+static int bench_machine__add_symbols(struct bench_machine *bm, struct dso *dso,
+				      int idx)
+{
+	char name[64];
+	int i;
+
+	/* emulate dso__load() */
+	dso__set_loaded(dso);
+
+	for (i = 0; i < bm->nr_syms; i++) {
+		struct symbol *sym;
+
+		snprintf(name, sizeof(name), "lib%d_func%d", idx, i);
+		sym = dso__new_symbol(dso, i * BENCH_SYM_LEN, BENCH_SYM_LEN,
+				      STB_GLOBAL, STT_FUNC, name);
+		if (sym == NULL)
+			return -ENOMEM;
+
+		symbols__insert(&dso->symbols, sym);
+	}
+
+	return 0;
+}
+
+int bench_machine__init(struct bench_machine *bm, int nr_threads,
+			int nr_dsos, int nr_syms)
+{
+	int i, d;
+
+	if (symbol__init(NULL) < 0)
+		return -1;
+
+	bm->nr_threads = nr_threads;
+	bm->nr_dsos    = nr_dsos;
+	bm->nr_syms    = nr_syms;
+	bm->map_len    = PERF_ALIGN(nr_syms * BENCH_SYM_LEN, page_size);
+
+	machines__init(&bm->machines);
+	bm->machine = machines__find(&bm->machines, HOST_KERNEL_ID);
+
+	for (i = 0; i < nr_threads; i++) {
+		pid_t pid = bench_machine__pid(bm, i);
+		struct thread *thread;
+
+		thread = machine__findnew_thread(bm->machine, pid, pid);
+		if (thread == NULL)
+			goto out_err;
+
+		thread__set_comm(thread, "bench", 0);
+		thread__put(thread);
+
+		for (d = 0; d < nr_dsos; d++) {
+			struct perf_sample sample = {
+				.cpumode = PERF_RECORD_MISC_USER,
+			};
+			union perf_event event = {
+				.mmap = {
+					.pid   = pid,
+					.tid   = pid,
+					.start = BENCH_MAP_BASE + d * bm->map_len,
+					.len   = bm->map_len,
+					.pgoff = 0ULL,
+				},
+			};
+
+			snprintf(event.mmap.filename, sizeof(event.mmap.filename),
+				 "/bench/lib%d.so", d);
+
+			if (machine__process_mmap_event(bm->machine, &event, &sample) < 0)
+				goto out_err;
+		}
+	}
+
+	for (d = 0; d < nr_dsos; d++) {
+		char filename[PATH_MAX];
+		struct dso *dso;
+		int err;
+
+		snprintf(filename, sizeof(filename), "/bench/lib%d.so", d);
+		dso = machine__findnew_dso(bm->machine, filename);
+		if (dso == NULL)
+			goto out_err;
+
+		err = bench_machine__add_symbols(bm, dso, d);
+		dso__put(dso);
+		if (err)
+			goto out_err;
+	}
+
+	return 0;
+
+out_err:
+	fprintf(stderr, "Not enough memory for the synthetic machine\n");
+	machines__exit(&bm->machines);
+	return -1;
+}
+
+void bench_machine__exit(struct bench_machine *bm)
+{
+	machines__exit(&bm->machines);
+}
+
+void bench__print_ops(const char *what, u64 nr_ops, struct timeval *diff)
+{
+	unsigned long result_usec = diff->tv_sec * USEC_PER_SEC + diff->tv_usec;
+
+	if (result_usec) {
+		bench_report("op_time", "usec", (double)result_usec / nr_ops);
+		bench_report("throughput", "ops/sec",
+			     (double)nr_ops * USEC_PER_SEC / result_usec);
+	}
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# Executed %" PRIu64 " %s\n\n", nr_ops, what);
+
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff->tv_sec,
+		       (unsigned long) (diff->tv_usec / USEC_PER_MSEC));
+
+		printf(" %14lf usecs/op\n",
+		       (double)result_usec / (double)nr_ops);
+		printf(" %14" PRIu64 " ops/sec\n",
+		       result_usec ? (u64)((double)nr_ops /
+					   ((double)result_usec / (double)USEC_PER_SEC)) : 0);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n",
+		       diff->tv_sec,
+		       (unsigned long) (diff->tv_usec / USEC_PER_MSEC));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+}
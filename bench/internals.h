@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef BENCH_INTERNALS_H
+#define BENCH_INTERNALS_H
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "../util/machine.h"
+
+/*
+ * A synthetic host machine for the 'perf bench internals' suites:
+ * nr_threads threads (pid BENCH_PID_BASE + i) all mapping the same
+ * nr_dsos dsos, each holding nr_syms symbols of BENCH_SYM_LEN bytes
+ * laid out back to back.
+ */
+#define BENCH_PID_BASE		1000
+#define BENCH_MAP_BASE		0x400000ULL
+#define BENCH_SYM_LEN		0x40ULL
+
+struct bench_machine {
+	struct machines	machines;
+	struct machine	*machine;
+	int		nr_threads;
+	int		nr_dsos;
+	int		nr_syms;
+	u64		map_len;
+};
+
+int bench_machine__init(struct bench_machine *bm, int nr_threads,
+			int nr_dsos, int nr_syms);
+void bench_machine__exit(struct bench_machine *bm);
+
+static inline pid_t bench_machine__pid(struct bench_machine *bm __maybe_unused, int thread)
+{
+	return BENCH_PID_BASE + thread;
+}
+
+/* The address of the middle of symbol 'sym' in dso 'dso' */
+static inline u64 bench_machine__ip(struct bench_machine *bm, int dso, int sym)
+{
+	return BENCH_MAP_BASE + dso * bm->map_len + sym * BENCH_SYM_LEN +
+	       BENCH_SYM_LEN / 2;
+}
+
+/* xorshift64, cheap enough not to show up in the measurements */
+static inline u64 bench__random(u64 *state)
+{
+	u64 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+void bench__print_ops(const char *what, u64 nr_ops, struct timeval *diff);
+
+#endif /* BENCH_INTERNALS_H */
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * mem-bandwidth.c
+ *
+ * bandwidth: Read, write and copy bandwidth plus pointer chase latency
+ * across buffer sizes, from the cpus of every NUMA node to the memory of
+ * every node, with THP off and on.
+ *
+ * The nodes come from the same numa_topology__new() the perf.data
+ * HEADER_NUMA_TOPOLOGY feature is written from.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/cpumap.h"
+#include "../util/cputopo.h"
+#include "../util/debug.h"
+#include "../util/string2.h"
+#include <subcmd/parse-options.h>
+#include "bench.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/kernel.h>
+#include <linux/time64.h>
+
+#ifndef MPOL_BIND
+# define MPOL_BIND	2
+#endif
+
+#define CACHE_LINE	64
+
+static const char	*sizes_str = "32KB,256KB,8MB,256MB";
+static int		min_time_ms = 100;
+static bool		local_only;
+
+static const struct option options[] = {
+	OPT_STRING('s', "sizes", &sizes_str, "32KB,256KB,8MB,256MB",
+		   "Specify the comma separated buffer sizes, from the L1 cache to DRAM. "
+		   "Available units: B, KB, MB, GB and TB (case insensitive)"),
+	OPT_INTEGER('t', "min-time", &min_time_ms,
+		    "Specify the minimum time of each measurement in ms (default: 100)"),
+	OPT_BOOLEAN('L', "local-only", &local_only,
+		    "Only measure the memory of the node of the cpus"),
+	OPT_END()
+};
+
+static const char * const bench_mem_bandwidth_usage[] = {
+	"perf bench mem bandwidth <options>",
+	NULL
+};
+
+/* Keeps the read and chase loops from being optimized away */
+static volatile u64 sink;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void do_read(void *buf, void *dst __maybe_unused, size_t size)
+{
+	u64 *p = buf, sum = 0;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(u64); i++)
+		sum += p[i];
+	sink += sum;
+}
+
+static void do_write(void *buf, void *dst __maybe_unused, size_t size)
+{
+	u64 *p = buf;
+	size_t i;
+
+	for (i = 0; i < size / sizeof(u64); i++)
+		p[i] = i;
+}
+
+static void do_copy(void *buf, void *dst, size_t size)
+{
+	memcpy(dst, buf, size);
+}
+
+/* Repeat fn over the buffer for at least min_time_ms, returns bytes/ns */
+static double measure_bandwidth(void (*fn)(void *, void *, size_t),
+				void *buf, void *dst, size_t size)
+{
+	u64 start, elapsed, loops = 0;
+
+	/* warm up, and fault the pages in */
+	fn(buf, dst, size);
+
+	start = now_ns();
+	do {
+		fn(buf, dst, size);
+		loops++;
+		elapsed = now_ns() - start;
+	} while (elapsed < (u64)min_time_ms * NSEC_PER_MSEC);
+
+	return (double)size * loops / elapsed;
+}
+
+/*
+ * Link the cache lines of the buffer in a single random cycle (Sattolo),
+ * so the chase defeats the prefetchers, returns ns per load.
+ */
+static double measure_latency(void *buf, size_t size)
+{
+	size_t i, nr_lines = size / CACHE_LINE;
+	u64 start, elapsed, loads = 0, seed = 0x9e3779b97f4a7c15ULL;
+	size_t *order;
+	void **p;
+
+	if (nr_lines < 2)
+		return 0;
+
+	order = malloc(nr_lines * sizeof(*order));
+	if (order == NULL)
+		return 0;
+
+	for (i = 0; i < nr_lines; i++)
+		order[i] = i;
+
+	for (i = nr_lines - 1; i > 0; i--) {
+		size_t j, tmp;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		j = seed % i;
+
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for (i = 0; i < nr_lines; i++)
+		*(void **)(buf + order[i] * CACHE_LINE) =
+			buf + order[(i + 1) % nr_lines] * CACHE_LINE;
+	free(order);
+
+	p = buf;
+	start = now_ns();
+	do {
+		for (i = 0; i < nr_lines; i++)
+			p = *p;
+		loads += nr_lines;
+		elapsed = now_ns() - start;
+	} while (elapsed < (u64)min_time_ms * NSEC_PER_MSEC);
+
+	sink += (unsigned long)p;
+	return (double)elapsed / loads;
+}
+
+/* The memory of the buffers stays on node, or wherever without NUMA support */
+static void *alloc_buffer(size_t size, int node, bool thp)
+{
+	unsigned long nodemask[4] = { 0, };
+	void *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	madvise(buf, size, thp ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+
+	if (node >= 0 && node < (int)(sizeof(nodemask) * 8)) {
+		nodemask[node / (sizeof(long) * 8)] = 1UL << (node % (sizeof(long) * 8));
+		if (syscall(__NR_mbind, buf, size, MPOL_BIND, nodemask,
+			    sizeof(nodemask) * 8, 0) && errno != ENOSYS)
+			pr_debug("mbind to node %d failed: %s\n", node, strerror(errno));
+	}
+
+	return buf;
+}
+
+static int bind_cpus(const char *cpus)
+{
+	struct cpu_map *map = cpu_map__new(cpus);
+	cpu_set_t mask;
+	int i, err;
+
+	if (map == NULL)
+		return -ENOMEM;
+
+	CPU_ZERO(&mask);
+	for (i = 0; i < map->nr; i++)
+		CPU_SET(map->map[i], &mask);
+	cpu_map__put(map);
+
+	err = sched_setaffinity(0, sizeof(mask), &mask);
+	return err ? -errno : 0;
+}
+
+static int parse_sizes(size_t **sizesp)
+{
+	char *str = strdup(sizes_str), *tok, *saveptr = NULL;
+	size_t *sizes = NULL;
+	int nr = 0;
+
+	if (str == NULL)
+		return -ENOMEM;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		s64 size = perf_atoll(tok);
+		size_t *tmp;
+
+		if (size < CACHE_LINE) {
+			fprintf(stderr, "Invalid size: %s\n", tok);
+			nr = -EINVAL;
+			break;
+		}
+
+		tmp = realloc(sizes, (nr + 1) * sizeof(*sizes));
+		if (tmp == NULL) {
+			nr = -ENOMEM;
+			break;
+		}
+		sizes = tmp;
+		sizes[nr++] = size;
+	}
+
+	free(str);
+	if (nr <= 0)
+		free(sizes);
+	else
+		*sizesp = sizes;
+	return nr;
+}
+
+static void print_size(size_t size)
+{
+	if (size >= 1024 * 1024 * 1024)
+		printf(" %9zuGB", size >> 30);
+	else if (size >= 1024 * 1024)
+		printf(" %9zuMB", size >> 20);
+	else if (size >= 1024)
+		printf(" %9zuKB", size >> 10);
+	else
+		printf(" %10zuB", size);
+}
+
+static void report_size(bool thp, unsigned int cpu_node, int mem_node, size_t size,
+			const char *what, const char *unit, double value)
+{
+	char metric[128];
+
+	snprintf(metric, sizeof(metric), "%s.node%u-node%d.%zu.%s",
+		 thp ? "thp" : "nothp", cpu_node, mem_node, size, what);
+	bench_report(metric, unit, value);
+}
+
+static int measure_node_pair(struct numa_topology_node *cpu_node, int mem_node,
+			     size_t *sizes, int nr_sizes, bool thp)
+{
+	int i;
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("# THP %s, cpus of node %u (%s), memory of node %d\n",
+		       thp ? "on" : "off", cpu_node->node, cpu_node->cpus, mem_node);
+		printf(" %11s %12s %12s %12s %12s\n", "size",
+		       "read GB/s", "write GB/s", "copy GB/s", "latency ns");
+	}
+
+	for (i = 0; i < nr_sizes; i++) {
+		size_t size = sizes[i];
+		double rd, wr, cp, lat;
+		void *buf, *dst;
+
+		buf = alloc_buffer(size, mem_node, thp);
+		dst = alloc_buffer(size, mem_node, thp);
+		if (buf == NULL || dst == NULL) {
+			fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+			if (buf)
+				munmap(buf, size);
+			return -ENOMEM;
+		}
+
+		wr  = measure_bandwidth(do_write, buf, NULL, size);
+		rd  = measure_bandwidth(do_read, buf, NULL, size);
+		cp  = measure_bandwidth(do_copy, buf, dst, size);
+		lat = measure_latency(buf, size);
+
+		munmap(buf, size);
+		munmap(dst, size);
+
+		/* bytes/ns are GB/s */
+		report_size(thp, cpu_node->node, mem_node, size, "read", "GB/sec", rd);
+		report_size(thp, cpu_node->node, mem_node, size, "write", "GB/sec", wr);
+		report_size(thp, cpu_node->node, mem_node, size, "copy", "GB/sec", cp);
+		report_size(thp, cpu_node->node, mem_node, size, "latency", "nsec", lat);
+
+		if (bench_format == BENCH_FORMAT_SIMPLE) {
+			printf("%s\t%u\t%d\t%zu\t%.3f\t%.3f\t%.3f\t%.3f\n",
+			       thp ? "thp" : "nothp", cpu_node->node, mem_node,
+			       size, rd, wr, cp, lat);
+		} else {
+			print_size(size);
+			printf(" %12.3f %12.3f %12.3f %12.3f\n", rd, wr, cp, lat);
+		}
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT)
+		printf("\n");
+	return 0;
+}
+
+int bench_mem_bandwidth(int argc, const char **argv)
+{
+	struct numa_topology *tp;
+	size_t *sizes = NULL;
+	int nr_sizes, thp, i, j, err = 0;
+
+	argc = parse_options(argc, argv, options, bench_mem_bandwidth_usage, 0);
+	if (argc || min_time_ms < 1)
+		usage_with_options(bench_mem_bandwidth_usage, options);
+
+	nr_sizes = parse_sizes(&sizes);
+	if (nr_sizes < 0)
+		return nr_sizes;
+
+	tp = numa_topology__new();
+	if (tp == NULL) {
+		fprintf(stderr, "Failed to read the NUMA topology\n");
+		free(sizes);
+		return -1;
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("# NUMA topology, as in the perf.data header:\n");
+		for (i = 0; i < (int)tp->nr; i++) {
+			printf("#   node%u meminfo  : total = %" PRIu64 " kB, free = %" PRIu64 " kB\n",
+			       tp->nodes[i].node, tp->nodes[i].mem_total, tp->nodes[i].mem_free);
+			printf("#   node%u cpu list : %s\n", tp->nodes[i].node, tp->nodes[i].cpus);
+		}
+		printf("\n");
+	}
+
+	for (thp = 0; thp < 2 && !err; thp++) {
+		for (i = 0; i < (int)tp->nr && !err; i++) {
+			struct numa_topology_node *cpu_node = &tp->nodes[i];
+
+			/* memory only nodes */
+			if (!cpu_node->cpus || !*cpu_node->cpus)
+				continue;
+
+			err = bind_cpus(cpu_node->cpus);
+			if (err) {
+				fprintf(stderr, "Failed to run on the cpus of node %u\n",
+					cpu_node->node);
+				break;
+			}
+
+			for (j = 0; j < (int)tp->nr && !err; j++) {
+				if (local_only && j != i)
+					continue;
+
+				err = measure_node_pair(cpu_node, tp->nodes[j].node,
+							sizes, nr_sizes, thp);
+			}
+		}
+	}
+
+	numa_topology__delete(tp);
+	free(sizes);
+	return err;
+}
@@ -12,7 +12,8 @@
 #include "../util/util.h"
 #include <subcmd/parse-options.h>
 #include "../util/header.h"
-#include "../util/cloexec.h"
+#include "../util/evsel.h"
+#include "../util/thread_map.h"
 #include "../util/string2.h"
 #include "bench.h"
 #include "mem-memcpy-arch.h"
@@ -23,6 +24,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <linux/kernel.h>
 #include <linux/time64.h>
 
 #define K 1024
@@ -31,11 +33,14 @@ static const char	*size_str	= "1MB";
 static const char	*function_str	= "all";
 static int		nr_loops	= 1;
 static bool		use_cycles;
-static int		cycles_fd;
+static struct perf_evsel *cycles_evsel;
+static struct perf_evsel *instructions_evsel;
+/* of the last do_cycles() */
+static u64		result_instructions;
 
 static const struct option options[] = {
 	OPT_STRING('s', "size", &size_str, "1MB",
-		    "Specify the size of the memory buffers. "
+		    "Specify the size of the memory buffers, a comma separated list compares the functions per size. "
 		    "Available units: B, KB, MB, GB and TB (case insensitive)"),
 
 	OPT_STRING('f', "function", &function_str, "all",
@@ -45,7 +50,7 @@ static const struct option options[] = {
 		    "Specify the number of loops to run. (default: 1)"),
 
 	OPT_BOOLEAN('c', "cycles", &use_cycles,
-		    "Use a cycles event instead of gettimeofday() to measure performance"),
+		    "Use a cycles event instead of gettimeofday() to measure performance, show the instructions too"),
 
 	OPT_END()
 };
@@ -60,34 +65,79 @@ struct function {
 		memcpy_t memcpy;
 		memset_t memset;
 	} fn;
+	/* whether this cpu can run it, NULL for always */
+	bool (*supported)(void);
 };
 
-static struct perf_event_attr cycle_attr = {
-	.type		= PERF_TYPE_HARDWARE,
-	.config		= PERF_COUNT_HW_CPU_CYCLES
-};
+static bool function__supported(const struct function *r)
+{
+	return !r->supported || r->supported();
+}
 
-static int init_cycles(void)
+/*
+ * Count the event for this thread, read with rdpmc when the kernel lets
+ * us, so that reading the counters doesn't add a syscall to what is
+ * measured.
+ */
+static struct perf_evsel *self_counter__new(u64 config)
 {
-	cycles_fd = sys_perf_event_open(&cycle_attr, getpid(), -1, -1, perf_event_open_cloexec_flag());
+	struct perf_event_attr attr = {
+		.type	= PERF_TYPE_HARDWARE,
+		.config	= config,
+	};
+	struct thread_map *threads;
+	struct perf_evsel *evsel;
+	int err;
+
+	threads = thread_map__new_by_tid(getpid());
+	if (threads == NULL)
+		return NULL;
+
+	evsel = perf_evsel__new(&attr);
+	if (evsel == NULL)
+		goto out_put;
+
+	err = perf_evsel__open_per_thread(evsel, threads);
+	if (err < 0) {
+		if (err == -ENOSYS)
+			pr_debug("No CONFIG_PERF_EVENTS=y kernel support configured?\n");
+		perf_evsel__delete(evsel);
+		evsel = NULL;
+		goto out_put;
+	}
 
-	if (cycles_fd < 0 && errno == ENOSYS) {
-		pr_debug("No CONFIG_PERF_EVENTS=y kernel support configured?\n");
+	if (perf_evsel__mmap_self(evsel))
+		pr_debug("Reading the %s counter with read()\n", perf_evsel__name(evsel));
+out_put:
+	thread_map__put(threads);
+	return evsel;
+}
+
+static int init_cycles(void)
+{
+	cycles_evsel = self_counter__new(PERF_COUNT_HW_CPU_CYCLES);
+	if (cycles_evsel == NULL)
 		return -1;
-	}
 
-	return cycles_fd;
+	/* optional, e.g. not on all virtual machines */
+	instructions_evsel = self_counter__new(PERF_COUNT_HW_INSTRUCTIONS);
+	return 0;
 }
 
-static u64 get_cycles(void)
+static u64 read_counter(struct perf_evsel *evsel)
 {
-	int ret;
-	u64 clk;
+	struct perf_counts_values count;
 
-	ret = read(cycles_fd, &clk, sizeof(u64));
-	BUG_ON(ret != sizeof(u64));
+	if (evsel == NULL)
+		return 0;
 
-	return clk;
+	BUG_ON(perf_evsel__read_self(evsel, &count));
+	return count.val;
+}
+
+static u64 get_cycles(void)
+{
+	return read_counter(cycles_evsel);
 }
 
 static double timeval2double(struct timeval *ts)
@@ -141,10 +191,25 @@ static void __bench_mem_function(struct bench_mem_info *info, int r_idx, size_t
 		result_bps = info->do_gettimeofday(r, size, src, dst);
 	}
 
+	if (use_cycles) {
+		bench_report(r->name, "cycles/byte", (double)result_cycles/size_total);
+		if (instructions_evsel) {
+			char metric[128];
+
+			scnprintf(metric, sizeof(metric), "%s.instructions", r->name);
+			bench_report(metric, "instructions/byte",
+				     (double)result_instructions/size_total);
+		}
+	} else
+		bench_report(r->name, "GB/sec", result_bps / K / K / K);
+
 	switch (bench_format) {
 	case BENCH_FORMAT_DEFAULT:
 		if (use_cycles) {
 			printf(" %14lf cycles/byte\n", (double)result_cycles/size_total);
+			if (instructions_evsel)
+				printf(" %14lf instructions/byte\n",
+				       (double)result_instructions/size_total);
 		} else {
 			print_bps(result_bps);
 		}
@@ -172,6 +237,144 @@ out_alloc_failed:
 	goto out_free;
 }
 
+/* Bytes per second, or per cycle with --cycles, the higher the better */
+static double bench_mem_rate(struct bench_mem_info *info, const struct function *r,
+			     size_t size, void *src, void *dst)
+{
+	if (use_cycles)
+		return (double)size * nr_loops / info->do_cycles(r, size, src, dst);
+
+	return info->do_gettimeofday(r, size, src, dst);
+}
+
+/* Run enough loops that the small sizes aren't lost in the timer resolution */
+#define SWEEP_MIN_BYTES		(256ULL << 20)
+
+static void print_size(size_t size)
+{
+	if (size >= K * K * K)
+		printf("%8zuGB", size / K / K / K);
+	else if (size >= K * K)
+		printf("%8zuMB", size / K / K);
+	else if (size >= K)
+		printf("%8zuKB", size / K);
+	else
+		printf("%9zuB", size);
+}
+
+/*
+ * Compare all the functions this cpu supports for each of the sizes, then
+ * print from which size on each function is the fastest.
+ */
+static int bench_mem_sweep(struct bench_mem_info *info)
+{
+	int i, nr_sizes = 0, nr_functions = 0, loops = nr_loops, best, prev_best = -1;
+	char *str = strdup(size_str), *tok, *saveptr = NULL;
+	size_t *sizes = NULL, *tmp;
+	int *fastest = NULL;
+	int err = -1;
+
+	if (str == NULL)
+		return -1;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		s64 size = perf_atoll(tok);
+
+		if (size <= 0) {
+			fprintf(stderr, "Invalid size:%s\n", tok);
+			goto out_free;
+		}
+
+		tmp = realloc(sizes, (nr_sizes + 1) * sizeof(*sizes));
+		if (tmp == NULL)
+			goto out_free;
+		sizes = tmp;
+		sizes[nr_sizes++] = size;
+	}
+
+	while (info->functions[nr_functions].name)
+		nr_functions++;
+
+	fastest = calloc(nr_sizes, sizeof(*fastest));
+	if (fastest == NULL)
+		goto out_free;
+
+	for (i = 0; i < nr_sizes; i++) {
+		size_t size = sizes[i];
+		double best_rate = 0;
+		void *src = NULL, *dst = zalloc(size);
+		int f;
+
+		if (info->alloc_src)
+			src = zalloc(size);
+		if (dst == NULL || (info->alloc_src && src == NULL)) {
+			printf("# Memory allocation failed - maybe size (%zu) is too large?\n", size);
+			free(src);
+			free(dst);
+			goto out_free;
+		}
+
+		nr_loops = max_t(u64, loops, SWEEP_MIN_BYTES / size);
+
+		if (bench_format == BENCH_FORMAT_DEFAULT) {
+			printf("# size ");
+			print_size(size);
+			printf(", %d loops\n", nr_loops);
+		}
+
+		for (f = 0; f < nr_functions; f++) {
+			const struct function *r = &info->functions[f];
+			char metric[64];
+			double rate;
+
+			if (!function__supported(r))
+				continue;
+
+			rate = bench_mem_rate(info, r, size, src, dst);
+			if (rate > best_rate) {
+				best_rate = rate;
+				fastest[i] = f;
+			}
+
+			snprintf(metric, sizeof(metric), "%s.%zu", r->name, size);
+			if (use_cycles)
+				bench_report(metric, "bytes/cycle", rate);
+			else
+				bench_report(metric, "GB/sec", rate / K / K / K);
+
+			if (bench_format == BENCH_FORMAT_SIMPLE)
+				printf("%zu\t%s\t%lf\n", size, r->name, rate);
+			else if (use_cycles)
+				printf(" %-20s %14lf bytes/cycle\n", r->name, rate);
+			else
+				printf(" %-20s %14lf GB/sec\n", r->name, rate / K / K / K);
+		}
+
+		free(src);
+		free(dst);
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("\n# Fastest function, from size:\n");
+		for (i = 0; i < nr_sizes; i++) {
+			best = fastest[i];
+			if (best == prev_best)
+				continue;
+			print_size(sizes[i]);
+			printf("  %s\n", info->functions[best].name);
+			prev_best = best;
+		}
+	}
+	err = 0;
+
+out_free:
+	nr_loops = loops;
+	free(fastest);
+	free(sizes);
+	free(str);
+	return err;
+}
+
 static int bench_mem_common(int argc, const char **argv, struct bench_mem_info *info)
 {
 	int i;
@@ -188,6 +391,9 @@ static int bench_mem_common(int argc, const char **argv, struct bench_mem_info *
 		}
 	}
 
+	if (strchr(size_str, ','))
+		return bench_mem_sweep(info);
+
 	size = (size_t)perf_atoll((char *)size_str);
 	size_total = (double)size * nr_loops;
 
@@ -197,8 +403,10 @@ static int bench_mem_common(int argc, const char **argv, struct bench_mem_info *
 	}
 
 	if (!strncmp(function_str, "all", 3)) {
-		for (i = 0; info->functions[i].name; i++)
-			__bench_mem_function(info, i, size, size_total);
+		for (i = 0; info->functions[i].name; i++) {
+			if (function__supported(&info->functions[i]))
+				__bench_mem_function(info, i, size, size_total);
+		}
 		return 0;
 	}
 
@@ -211,12 +419,19 @@ static int bench_mem_common(int argc, const char **argv, struct bench_mem_info *
 			printf("Unknown function: %s\n", function_str);
 		printf("Available functions:\n");
 		for (i = 0; info->functions[i].name; i++) {
-			printf("\t%s ... %s\n",
-			       info->functions[i].name, info->functions[i].desc);
+			printf("\t%s ... %s%s\n",
+			       info->functions[i].name, info->functions[i].desc,
+			       function__supported(&info->functions[i]) ?
+			       "" : " (not supported by this cpu)");
 		}
 		return 1;
 	}
 
+	if (!function__supported(&info->functions[i])) {
+		printf("Function %s is not supported by this cpu\n", function_str);
+		return 1;
+	}
+
 	__bench_mem_function(info, i, size, size_total);
 
 	return 0;
@@ -224,7 +439,7 @@ static int bench_mem_common(int argc, const char **argv, struct bench_mem_info *
 
 static u64 do_memcpy_cycles(const struct function *r, size_t size, void *src, void *dst)
 {
-	u64 cycle_start = 0ULL, cycle_end = 0ULL;
+	u64 cycle_start = 0ULL, cycle_end = 0ULL, instructions_start;
 	memcpy_t fn = r->fn.memcpy;
 	int i;
 
@@ -237,10 +452,12 @@ static u64 do_memcpy_cycles(const struct function *r, size_t size, void *src, vo
 	 */
 	fn(dst, src, size);
 
+	instructions_start = read_counter(instructions_evsel);
 	cycle_start = get_cycles();
 	for (i = 0; i < nr_loops; ++i)
 		fn(dst, src, size);
 	cycle_end = get_cycles();
+	result_instructions = read_counter(instructions_evsel) - instructions_start;
 
 	return cycle_end - cycle_start;
 }
@@ -278,6 +495,11 @@ struct function memcpy_functions[] = {
 # undef MEMCPY_FN
 #endif
 
+#define MEMCPY_VEC_FN(_fn, _supported, _name, _desc) \
+	{.name = _name, .desc = _desc, .fn.memcpy = _fn, .supported = _supported},
+#include "mem-memcpy-vec-def.h"
+#undef MEMCPY_VEC_FN
+
 	{ .name = NULL, }
 };
 
@@ -301,7 +523,7 @@ int bench_mem_memcpy(int argc, const char **argv)
 
 static u64 do_memset_cycles(const struct function *r, size_t size, void *src __maybe_unused, void *dst)
 {
-	u64 cycle_start = 0ULL, cycle_end = 0ULL;
+	u64 cycle_start = 0ULL, cycle_end = 0ULL, instructions_start;
 	memset_t fn = r->fn.memset;
 	int i;
 
@@ -311,10 +533,12 @@ static u64 do_memset_cycles(const struct function *r, size_t size, void *src __m
 	 */
 	fn(dst, -1, size);
 
+	instructions_start = read_counter(instructions_evsel);
 	cycle_start = get_cycles();
 	for (i = 0; i < nr_loops; ++i)
 		fn(dst, i, size);
 	cycle_end = get_cycles();
+	result_instructions = read_counter(instructions_evsel) - instructions_start;
 
 	return cycle_end - cycle_start;
 }
@@ -357,6 +581,11 @@ static const struct function memset_functions[] = {
 # undef MEMSET_FN
 #endif
 
+#define MEMSET_VEC_FN(_fn, _supported, _name, _desc) \
+	{ .name = _name, .desc = _desc, .fn.memset = _fn, .supported = _supported },
+#include "mem-memset-vec-def.h"
+#undef MEMSET_VEC_FN
+
 	{ .name = NULL, }
 };
 
@@ -11,3 +11,10 @@
 
 #endif
 
+#define MEMCPY_VEC_FN(fn, supported, name, desc)	\
+	void *fn(void *, const void *, size_t);	\
+	bool supported(void);
+
+#include "mem-memcpy-vec-def.h"
+
+#undef MEMCPY_VEC_FN
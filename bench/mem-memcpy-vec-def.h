@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifdef __x86_64__
+MEMCPY_VEC_FN(memcpy_rep_movsb, mem_vec__has_erms,
+	"x86-64-rep-movsb",
+	"inline rep movsb, needs ERMS, FSRM makes it fast for short copies too")
+
+MEMCPY_VEC_FN(memcpy_sse2_nt, mem_vec__has_sse2,
+	"x86-64-sse2-nt",
+	"SSE2 loads with non-temporal stores")
+
+MEMCPY_VEC_FN(memcpy_avx2_nt, mem_vec__has_avx2,
+	"x86-64-avx2-nt",
+	"AVX2 loads with non-temporal stores")
+
+MEMCPY_VEC_FN(memcpy_avx512_nt, mem_vec__has_avx512,
+	"x86-64-avx512-nt",
+	"AVX-512 loads with non-temporal stores")
+#endif
+
+#ifdef __aarch64__
+MEMCPY_VEC_FN(memcpy_neon, mem_vec__has_neon,
+	"arm64-neon",
+	"NEON 64 byte loads and stores")
+
+MEMCPY_VEC_FN(memcpy_neon_nt, mem_vec__has_neon,
+	"arm64-neon-nt",
+	"NEON loads with non-temporal (stnp) stores")
+
+#ifdef __ARM_FEATURE_SVE
+MEMCPY_VEC_FN(memcpy_sve, mem_vec__has_sve,
+	"arm64-sve",
+	"SVE predicated loads and stores")
+#endif
+#endif
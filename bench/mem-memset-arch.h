@@ -11,3 +11,10 @@
 
 #endif
 
+#define MEMSET_VEC_FN(fn, supported, name, desc)	\
+	void *fn(void *, int, size_t);			\
+	bool supported(void);
+
+#include "mem-memset-vec-def.h"
+
+#undef MEMSET_VEC_FN
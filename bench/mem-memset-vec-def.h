@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifdef __x86_64__
+MEMSET_VEC_FN(memset_rep_stosb, mem_vec__has_erms,
+	"x86-64-rep-stosb",
+	"inline rep stosb, needs ERMS")
+
+MEMSET_VEC_FN(memset_sse2_nt, mem_vec__has_sse2,
+	"x86-64-sse2-nt",
+	"SSE2 non-temporal stores")
+
+MEMSET_VEC_FN(memset_avx2_nt, mem_vec__has_avx2,
+	"x86-64-avx2-nt",
+	"AVX2 non-temporal stores")
+
+MEMSET_VEC_FN(memset_avx512_nt, mem_vec__has_avx512,
+	"x86-64-avx512-nt",
+	"AVX-512 non-temporal stores")
+#endif
+
+#ifdef __aarch64__
+MEMSET_VEC_FN(memset_neon, mem_vec__has_neon,
+	"arm64-neon",
+	"NEON 64 byte stores")
+
+MEMSET_VEC_FN(memset_neon_nt, mem_vec__has_neon,
+	"arm64-neon-nt",
+	"NEON non-temporal (stnp) stores")
+
+#ifdef __ARM_FEATURE_SVE
+MEMSET_VEC_FN(memset_sve, mem_vec__has_sve,
+	"arm64-sve",
+	"SVE predicated stores")
+#endif
+#endif
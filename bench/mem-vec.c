@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * mem-vec.c
+ *
+ * Vectorized and string instruction memcpy() and memset() variants for
+ * 'perf bench mem', each with the check of the cpu features it needs so
+ * only what can run here gets benchmarked.
+ *
+ * The non-temporal variants store the unaligned head and the tail with
+ * the libc functions and only the aligned middle with streaming stores.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "mem-memcpy-arch.h"
+#include "mem-memset-arch.h"
+
+#ifdef __x86_64__
+#include <cpuid.h>
+#include <immintrin.h>
+
+bool mem_vec__has_erms(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	return ebx & (1 << 9);
+}
+
+bool mem_vec__has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+bool mem_vec__has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+bool mem_vec__has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+
+void *memcpy_rep_movsb(void *dst, const void *src, size_t len)
+{
+	void *ret = dst;
+
+	asm volatile("rep movsb"
+		     : "+D" (dst), "+S" (src), "+c" (len)
+		     : : "memory");
+	return ret;
+}
+
+void *memset_rep_stosb(void *dst, int c, size_t len)
+{
+	void *ret = dst;
+
+	asm volatile("rep stosb"
+		     : "+D" (dst), "+c" (len)
+		     : "a" (c) : "memory");
+	return ret;
+}
+
+/* Bytes to copy or set with libc before dst is aligned to align */
+static size_t nt_head(void *dst, size_t len, size_t align)
+{
+	size_t head = -(uintptr_t)dst & (align - 1);
+
+	return head < len ? head : len;
+}
+
+#define NT_FUNCS(name, isa, vec, width, loadu, stream, set1)			\
+__attribute__((target(isa)))							\
+void *memcpy_##name##_nt(void *dst, const void *src, size_t len)		\
+{										\
+	size_t head = nt_head(dst, len, width);					\
+	char *d = dst;								\
+	const char *s = src;							\
+										\
+	memcpy(d, s, head);							\
+	d += head, s += head, len -= head;					\
+										\
+	for (; len >= 4 * width; d += 4 * width, s += 4 * width, len -= 4 * width) { \
+		vec a = loadu((const void *)(s));				\
+		vec b = loadu((const void *)(s + width));			\
+		vec c = loadu((const void *)(s + 2 * width));			\
+		vec e = loadu((const void *)(s + 3 * width));			\
+										\
+		stream((void *)(d), a);						\
+		stream((void *)(d + width), b);					\
+		stream((void *)(d + 2 * width), c);				\
+		stream((void *)(d + 3 * width), e);				\
+	}									\
+	_mm_sfence();								\
+										\
+	memcpy(d, s, len);							\
+	return dst;								\
+}										\
+										\
+__attribute__((target(isa)))							\
+void *memset_##name##_nt(void *dst, int c, size_t len)			\
+{										\
+	size_t head = nt_head(dst, len, width);					\
+	vec v = set1((char)c);							\
+	char *d = dst;								\
+										\
+	memset(d, c, head);							\
+	d += head, len -= head;							\
+										\
+	for (; len >= 4 * width; d += 4 * width, len -= 4 * width) {		\
+		stream((void *)(d), v);						\
+		stream((void *)(d + width), v);					\
+		stream((void *)(d + 2 * width), v);				\
+		stream((void *)(d + 3 * width), v);				\
+	}									\
+	_mm_sfence();								\
+										\
+	memset(d, c, len);							\
+	return dst;								\
+}
+
+#define sse2_loadu(p)		_mm_loadu_si128((const __m128i *)(p))
+#define sse2_stream(p, v)	_mm_stream_si128((__m128i *)(p), v)
+#define avx2_loadu(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define avx2_stream(p, v)	_mm256_stream_si256((__m256i *)(p), v)
+#define avx512_loadu(p)		_mm512_loadu_si512(p)
+#define avx512_stream(p, v)	_mm512_stream_si512((void *)(p), v)
+
+NT_FUNCS(sse2,	 "sse2",    __m128i, 16, sse2_loadu,   sse2_stream,   _mm_set1_epi8)
+NT_FUNCS(avx2,	 "avx2",    __m256i, 32, avx2_loadu,   avx2_stream,   _mm256_set1_epi8)
+NT_FUNCS(avx512, "avx512f", __m512i, 64, avx512_loadu, avx512_stream, _mm512_set1_epi8)
+
+#endif /* __x86_64__ */
+
+#ifdef __aarch64__
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SVE
+# define HWCAP_SVE	(1 << 22)
+#endif
+
+/* Advanced SIMD is mandatory on arm64 */
+bool mem_vec__has_neon(void)
+{
+	return true;
+}
+
+bool mem_vec__has_sve(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_SVE;
+}
+
+void *memcpy_neon(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+
+	for (; len >= 64; d += 64, s += 64, len -= 64) {
+		uint8x16x4_t v = vld1q_u8_x4(s);
+
+		vst1q_u8_x4(d, v);
+	}
+
+	memcpy(d, s, len);
+	return dst;
+}
+
+void *memset_neon(void *dst, int c, size_t len)
+{
+	uint8x16_t b = vdupq_n_u8(c);
+	uint8x16x4_t v = { { b, b, b, b } };
+	uint8_t *d = dst;
+
+	for (; len >= 64; d += 64, len -= 64)
+		vst1q_u8_x4(d, v);
+
+	memset(d, c, len);
+	return dst;
+}
+
+void *memcpy_neon_nt(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+
+	for (; len >= 64; d += 64, s += 64, len -= 64) {
+		asm volatile("ldp q0, q1, [%1]\n\t"
+			     "ldp q2, q3, [%1, #32]\n\t"
+			     "stnp q0, q1, [%0]\n\t"
+			     "stnp q2, q3, [%0, #32]"
+			     : : "r" (d), "r" (s)
+			     : "v0", "v1", "v2", "v3", "memory");
+	}
+
+	memcpy(d, s, len);
+	return dst;
+}
+
+void *memset_neon_nt(void *dst, int c, size_t len)
+{
+	uint8x16_t v = vdupq_n_u8(c);
+	char *d = dst;
+
+	for (; len >= 64; d += 64, len -= 64) {
+		asm volatile("stnp %q1, %q1, [%0]\n\t"
+			     "stnp %q1, %q1, [%0, #32]"
+			     : : "r" (d), "w" (v) : "memory");
+	}
+
+	memset(d, c, len);
+	return dst;
+}
+
+#ifdef __ARM_FEATURE_SVE
+#include <arm_sve.h>
+
+void *memcpy_sve(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i;
+
+	for (i = 0; i < len; i += svcntb()) {
+		svbool_t pg = svwhilelt_b8_u64(i, len);
+
+		svst1_u8(pg, d + i, svld1_u8(pg, s + i));
+	}
+
+	return dst;
+}
+
+void *memset_sve(void *dst, int c, size_t len)
+{
+	svuint8_t v = svdup_n_u8(c);
+	uint8_t *d = dst;
+	size_t i;
+
+	for (i = 0; i < len; i += svcntb())
+		svst1_u8(svwhilelt_b8_u64(i, len), d + i, v);
+
+	return dst;
+}
+#endif /* __ARM_FEATURE_SVE */
+
+#endif /* __aarch64__ */
@@ -1469,6 +1469,16 @@ static void deinit(void)
 static void print_res(const char *name, double val,
 		      const char *txt_unit, const char *txt_short, const char *txt_long)
 {
+	char metric[128], unit[32];
+
+	/* the names and units carry the commas of the text layout */
+	if (name)
+		scnprintf(metric, sizeof(metric), "%.*s.%s", (int)strcspn(name, ","), name, txt_short);
+	else
+		scnprintf(metric, sizeof(metric), "%s", txt_short);
+	scnprintf(unit, sizeof(unit), "%.*s", (int)strcspn(txt_unit, ","), txt_unit);
+	bench_report(metric, unit, val);
+
 	if (!name)
 		name = "main,";
 
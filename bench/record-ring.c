@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * record-ring.c
+ *
+ * ring: Benchmark for the ring buffer reading of perf record
+ *
+ * For each record configuration (-m, --aio, --affinity, --threads, ...)
+ * run the real 'perf record' on writer threads producing a controlled
+ * rate of events, then report the events and bytes written per second,
+ * the lost events and the CPU used by the record process itself.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/data.h"
+#include "../util/debug.h"
+#include "../util/event.h"
+#include "../util/session.h"
+#include "../util/string2.h"
+#include "../util/tool.h"
+#include <subcmd/parse-options.h>
+#include "../builtin.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <linux/kernel.h>
+#include <linux/time64.h>
+
+#define MAX_CONFIGS	16
+
+static int	   nr_writers = 4;
+static int	   rate;
+static int	   runtime    = 5;
+static const char *event      = "page-faults";
+static const char *output_dir = "/tmp";
+static const char *configs[MAX_CONFIGS];
+static int	   nr_configs;
+static bool	   writer;
+
+static const char * const default_configs[] = {
+	"-m 16",
+	"-m 256",
+	"-m 256 --affinity=cpu",
+	"-m 256 --threads",
+#ifdef HAVE_AIO_SUPPORT
+	"-m 256 --aio",
+#endif
+};
+
+static int parse_config(const struct option *opt __maybe_unused,
+			const char *str, int unset __maybe_unused)
+{
+	if (nr_configs == MAX_CONFIGS) {
+		pr_err("Only %d configurations can be compared\n", MAX_CONFIGS);
+		return -1;
+	}
+
+	configs[nr_configs++] = str;
+	return 0;
+}
+
+static struct option options[] = {
+	OPT_INTEGER('t', "nr-writers",	&nr_writers,	"Specify number of writer threads"),
+	OPT_INTEGER('r', "rate",	&rate,		"Specify events per second per writer, 0: as fast as possible"),
+	OPT_INTEGER('l', "runtime",	&runtime,	"Specify the runtime of each configuration in seconds"),
+	OPT_STRING('e', "event",	&event,	"event", "Event recorded with a period of 1, should count the writers' page faults"),
+	OPT_STRING('o', "output-dir",	&output_dir, "dir", "Directory for the perf.data files"),
+	OPT_CALLBACK('C', "config",	NULL, "record options",
+		     "Record options of a configuration to compare, can be repeated",
+		     parse_config),
+	/* how the benchmark runs its own workload under perf record */
+	OPT_BOOLEAN(0, "writer",	&writer,	"Run as the writers"),
+	OPT_END()
+};
+
+static const char * const bench_record_ring_usage[] = {
+	"perf bench record ring <options>",
+	NULL
+};
+
+#define WRITER_PAGES	256
+#define WRITER_BATCH	64
+
+/*
+ * Every touch of a page dropped with MADV_DONTNEED is a page fault, which
+ * makes for one event per touch with a period of 1.
+ */
+static void *writer_thread(void *arg __maybe_unused)
+{
+	size_t size = WRITER_PAGES * page_size;
+	struct timespec start, now;
+	u64 done = 0;
+	char *buf;
+	int i;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		u64 elapsed_ns;
+
+		for (i = 0; i < WRITER_BATCH; i++)
+			buf[((done + i) % WRITER_PAGES) * page_size] = 1;
+		done += WRITER_BATCH;
+
+		if (done % WRITER_PAGES == 0)
+			madvise(buf, size, MADV_DONTNEED);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed_ns = (now.tv_sec - start.tv_sec) * NSEC_PER_SEC +
+			     now.tv_nsec - start.tv_nsec;
+		if (elapsed_ns >= (u64)runtime * NSEC_PER_SEC)
+			break;
+
+		/* ahead of the asked for rate: sleep until it catches up */
+		if (rate) {
+			u64 due_ns = done * NSEC_PER_SEC / rate;
+
+			if (due_ns > elapsed_ns) {
+				struct timespec ts = {
+					.tv_sec	 = (due_ns - elapsed_ns) / NSEC_PER_SEC,
+					.tv_nsec = (due_ns - elapsed_ns) % NSEC_PER_SEC,
+				};
+
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+
+	munmap(buf, size);
+	return NULL;
+}
+
+static int run_writers(void)
+{
+	pthread_t *threads = calloc(nr_writers, sizeof(*threads));
+	int i, started;
+
+	if (threads == NULL)
+		return -ENOMEM;
+
+	for (started = 0; started < nr_writers; started++) {
+		if (pthread_create(&threads[started], NULL, writer_thread, NULL))
+			break;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	return started == nr_writers ? 0 : -1;
+}
+
+struct ring_result {
+	u64	samples;
+	u64	lost;
+	u64	bytes;
+	double	wall_usec;
+	double	cpu_usec;
+};
+
+/*
+ * In a child, as the record state is static: record the writers, that
+ * is perf itself rerun with --writer, then report the CPU used here, by
+ * the record process and its threads, not the writers.
+ */
+static void record_child(const char *config, const char *path, int fd)
+{
+	char exe[PATH_MAX], nr[16], r[16], l[16];
+	const char **rec_argv;
+	char **config_argv;
+	struct rusage usage;
+	int config_argc, i = 0, j;
+	double cpu_usec;
+	ssize_t n;
+
+	n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (n < 0)
+		exit(1);
+	exe[n] = '\0';
+
+	config_argv = argv_split(config, &config_argc);
+	rec_argv = calloc(config_argc + 32, sizeof(char *));
+	if (config_argv == NULL || rec_argv == NULL)
+		exit(1);
+
+	snprintf(nr, sizeof(nr), "%d", nr_writers);
+	snprintf(r, sizeof(r), "%d", rate);
+	snprintf(l, sizeof(l), "%d", runtime);
+
+	rec_argv[i++] = "record";
+	rec_argv[i++] = "--quiet";
+	rec_argv[i++] = "-e";
+	rec_argv[i++] = event;
+	rec_argv[i++] = "-c";
+	rec_argv[i++] = "1";
+	rec_argv[i++] = "-o";
+	rec_argv[i++] = path;
+	for (j = 0; j < config_argc; j++)
+		rec_argv[i++] = config_argv[j];
+	rec_argv[i++] = "--";
+	rec_argv[i++] = exe;
+	rec_argv[i++] = "bench";
+	rec_argv[i++] = "record";
+	rec_argv[i++] = "ring";
+	rec_argv[i++] = "--writer";
+	rec_argv[i++] = "-t";
+	rec_argv[i++] = nr;
+	rec_argv[i++] = "-r";
+	rec_argv[i++] = r;
+	rec_argv[i++] = "-l";
+	rec_argv[i++] = l;
+
+	if (cmd_record(i, rec_argv))
+		exit(1);
+
+	getrusage(RUSAGE_SELF, &usage);
+	cpu_usec = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * USEC_PER_SEC +
+		   usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+	if (write(fd, &cpu_usec, sizeof(cpu_usec)) != sizeof(cpu_usec))
+		exit(1);
+	exit(0);
+}
+
+static struct ring_result *cur_result;
+
+static int count_sample(struct perf_tool *tool __maybe_unused,
+			union perf_event *event __maybe_unused,
+			struct perf_sample *sample __maybe_unused,
+			struct perf_evsel *evsel __maybe_unused,
+			struct machine *machine __maybe_unused)
+{
+	cur_result->samples++;
+	return 0;
+}
+
+static int count_lost(struct perf_tool *tool __maybe_unused,
+		      union perf_event *event,
+		      struct perf_sample *sample __maybe_unused,
+		      struct machine *machine __maybe_unused)
+{
+	cur_result->lost += event->lost.lost;
+	return 0;
+}
+
+static int count_lost_samples(struct perf_tool *tool __maybe_unused,
+			      union perf_event *event,
+			      struct perf_sample *sample __maybe_unused,
+			      struct machine *machine __maybe_unused)
+{
+	cur_result->lost += event->lost_samples.lost;
+	return 0;
+}
+
+static int count_events(const char *path, struct ring_result *result)
+{
+	struct perf_tool tool = {
+		.sample		= count_sample,
+		.lost		= count_lost,
+		.lost_samples	= count_lost_samples,
+	};
+	struct perf_data data = {
+		.path  = path,
+		.mode  = PERF_DATA_MODE_READ,
+	};
+	struct perf_session *session;
+	int err;
+
+	session = perf_session__new(&data, false, &tool);
+	if (session == NULL)
+		return -1;
+
+	cur_result = result;
+	err = perf_session__process_events(session);
+	result->bytes = session->header.data_size;
+	perf_session__delete(session);
+	return err;
+}
+
+static int run_config(const char *config, struct ring_result *result)
+{
+	char path[PATH_MAX];
+	struct timeval start, end, diff;
+	int pipefd[2], status, err = -1;
+	pid_t pid;
+
+	snprintf(path, sizeof(path), "%s/perf-bench-ring-%d.data", output_dir, getpid());
+
+	if (pipe(pipefd) < 0)
+		return -errno;
+
+	gettimeofday(&start, NULL);
+
+	pid = fork();
+	if (pid < 0)
+		goto out_close;
+
+	if (pid == 0) {
+		close(pipefd[0]);
+		record_child(config, path, pipefd[1]);
+	}
+
+	close(pipefd[1]);
+	pipefd[1] = -1;
+
+	if (read(pipefd[0], &result->cpu_usec, sizeof(result->cpu_usec)) !=
+	    sizeof(result->cpu_usec))
+		result->cpu_usec = -1;
+
+	waitpid(pid, &status, 0);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	result->wall_usec = diff.tv_sec * USEC_PER_SEC + diff.tv_usec;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) || result->cpu_usec < 0) {
+		pr_err("perf record %s failed\n", config);
+		goto out_unlink;
+	}
+
+	err = count_events(path, result);
+
+out_unlink:
+	unlink(path);
+out_close:
+	close(pipefd[0]);
+	if (pipefd[1] >= 0)
+		close(pipefd[1]);
+	return err;
+}
+
+static void print_result(const char *config, struct ring_result *result)
+{
+	double secs = result->wall_usec / USEC_PER_SEC;
+	u64 total = result->samples + result->lost;
+	char metric[128];
+
+	snprintf(metric, sizeof(metric), "%s.events", config);
+	bench_report(metric, "events/sec", result->samples / secs);
+	snprintf(metric, sizeof(metric), "%s.lost", config);
+	bench_report(metric, "events", result->lost);
+	snprintf(metric, sizeof(metric), "%s.reader_cpu", config);
+	bench_report(metric, "%", 100.0 * result->cpu_usec / result->wall_usec);
+
+	if (bench_format == BENCH_FORMAT_SIMPLE) {
+		printf("%s\t%.0f\t%.0f\t%" PRIu64 "\t%.1f\n", config,
+		       result->samples / secs, result->bytes / secs,
+		       result->lost, 100.0 * result->cpu_usec / result->wall_usec);
+		return;
+	}
+
+	printf("# perf record %s\n", config);
+	printf(" %14.0f events/sec\n", result->samples / secs);
+	printf(" %14.3f MB/sec\n", result->bytes / secs / (1024 * 1024));
+	printf(" %14" PRIu64 " lost events (%.2f%%)\n", result->lost,
+	       total ? 100.0 * result->lost / total : 0.0);
+	printf(" %14.1f %% reader CPU\n\n", 100.0 * result->cpu_usec / result->wall_usec);
+}
+
+int bench_record_ring(int argc, const char **argv)
+{
+	int i, err = 0;
+
+	set_option_flag(options, 0, "writer", PARSE_OPT_HIDDEN);
+
+	argc = parse_options(argc, argv, options, bench_record_ring_usage, 0);
+	if (argc || nr_writers < 1 || rate < 0 || runtime < 1)
+		usage_with_options(bench_record_ring_usage, options);
+
+	if (writer)
+		return run_writers();
+
+	if (!nr_configs) {
+		for (i = 0; i < (int)ARRAY_SIZE(default_configs); i++)
+			configs[nr_configs++] = default_configs[i];
+	}
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("# %d writers, %s, %d seconds per configuration\n\n",
+		       nr_writers, rate ? "rate limited" : "unlimited rate", runtime);
+		if (rate)
+			printf("# %d %s/sec per writer\n\n", rate, event);
+	}
+
+	for (i = 0; i < nr_configs; i++) {
+		struct ring_result result = { .samples = 0, };
+
+		err = run_config(configs[i], &result);
+		if (err)
+			break;
+		print_result(configs[i], &result);
+	}
+
+	return err;
+}
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * report.c
+ *
+ * Structured results of the benchmarks: each run reports its metrics with
+ * bench_report() down a pipe to the parent 'perf bench', which prints every
+ * sample as JSON or CSV and keeps the statistics over the --repeat runs.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/debug.h"
+#include "../util/stat.h"
+#include "bench.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct bench_metric {
+	char		*name;
+	char		*unit;
+	unsigned int	nr;
+	struct stats	stats;
+};
+
+struct bench_results {
+	const char		*collection;
+	const char		*benchmark;
+	struct bench_metric	*metrics;
+	int			nr_metrics;
+};
+
+/* Where this run reports to, -1 when nobody listens */
+static int report_fd = -1;
+
+void bench_report__set_fd(int fd)
+{
+	report_fd = fd;
+}
+
+void bench_report(const char *metric, const char *unit, double value)
+{
+	char buf[256];
+	int n;
+
+	if (report_fd < 0)
+		return;
+
+	/* one write each, below PIPE_BUF, so threads don't interleave */
+	n = scnprintf(buf, sizeof(buf), "%s\t%s\t%.17g\n", metric, unit, value);
+	if (write(report_fd, buf, n) != n)
+		pr_debug("Failed to report %s: %s\n", metric, strerror(errno));
+}
+
+static struct bench_metric *bench_results__findnew(struct bench_results *res,
+						   const char *name, const char *unit)
+{
+	struct bench_metric *m;
+	int i;
+
+	for (i = 0; i < res->nr_metrics; i++) {
+		if (!strcmp(res->metrics[i].name, name))
+			return &res->metrics[i];
+	}
+
+	m = realloc(res->metrics, (res->nr_metrics + 1) * sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	res->metrics = m;
+
+	m = &res->metrics[res->nr_metrics];
+	m->name = strdup(name);
+	m->unit = strdup(unit);
+	if (m->name == NULL || m->unit == NULL) {
+		free(m->name);
+		free(m->unit);
+		return NULL;
+	}
+	m->nr = 0;
+	init_stats(&m->stats);
+	res->nr_metrics++;
+	return m;
+}
+
+static void bench_results__print_sample(struct bench_results *res,
+					struct bench_metric *m, double value)
+{
+	if (bench_format == BENCH_FORMAT_JSON) {
+		printf("{\"collection\": \"%s\", \"benchmark\": \"%s\", \"metric\": \"%s\", "
+		       "\"unit\": \"%s\", \"repeat\": %u, \"value\": %.17g}\n",
+		       res->collection, res->benchmark, m->name, m->unit, m->nr, value);
+	} else if (bench_format == BENCH_FORMAT_CSV) {
+		printf("%s,%s,%s,%s,%u,%.17g,\n", res->collection, res->benchmark,
+		       m->name, m->unit, m->nr, value);
+	}
+}
+
+int bench_results__read(struct bench_results *res, int fd)
+{
+	FILE *fp = fdopen(fd, "r");
+	char *line = NULL;
+	size_t len = 0;
+	int err = 0;
+
+	if (fp == NULL)
+		return -errno;
+
+	while (getline(&line, &len, fp) > 0) {
+		char *name, *unit, *value, *saveptr = NULL;
+		struct bench_metric *m;
+		double val;
+
+		name  = strtok_r(line, "\t", &saveptr);
+		unit  = strtok_r(NULL, "\t", &saveptr);
+		value = strtok_r(NULL, "\n", &saveptr);
+		if (!name || !unit || !value)
+			continue;
+
+		m = bench_results__findnew(res, name, unit);
+		if (m == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		val = strtod(value, NULL);
+		bench_results__print_sample(res, m, val);
+		update_stats(&m->stats, val);
+		m->nr++;
+	}
+
+	free(line);
+	fclose(fp);
+	return err;
+}
+
+void bench_results__print_summary(struct bench_results *res)
+{
+	int i;
+
+	for (i = 0; i < res->nr_metrics; i++) {
+		struct bench_metric *m = &res->metrics[i];
+		double avg = avg_stats(&m->stats), stddev = stddev_stats(&m->stats);
+
+		switch (bench_format) {
+		case BENCH_FORMAT_JSON:
+			printf("{\"collection\": \"%s\", \"benchmark\": \"%s\", \"metric\": \"%s\", "
+			       "\"unit\": \"%s\", \"repeats\": %u, \"value\": %.17g, \"stddev\": %.17g}\n",
+			       res->collection, res->benchmark, m->name, m->unit, m->nr, avg, stddev);
+			break;
+		case BENCH_FORMAT_CSV:
+			printf("%s,%s,%s,%s,all,%.17g,%.17g\n", res->collection, res->benchmark,
+			       m->name, m->unit, avg, stddev);
+			break;
+		case BENCH_FORMAT_SIMPLE:
+			printf("%s\t%s\t%u\t%.17g\t%.17g\n", m->name, m->unit, m->nr, avg, stddev);
+			break;
+		case BENCH_FORMAT_DEFAULT:
+		default:
+			if (i == 0)
+				printf("\n# Over %u runs:\n", m->nr);
+			printf(" %-40s %16.3f %s (+- %.2f%%)\n", m->name, avg, m->unit,
+			       rel_stddev_stats(stddev, avg));
+			break;
+		}
+	}
+}
+
+struct bench_results *bench_results__new(const char *collection, const char *benchmark)
+{
+	struct bench_results *res = zalloc(sizeof(*res));
+
+	if (res) {
+		res->collection = collection;
+		res->benchmark  = benchmark;
+	}
+	return res;
+}
+
+void bench_results__delete(struct bench_results *res)
+{
+	int i;
+
+	if (res == NULL)
+		return;
+
+	for (i = 0; i < res->nr_metrics; i++) {
+		free(res->metrics[i].name);
+		free(res->metrics[i].unit);
+	}
+	free(res->metrics);
+	free(res);
+}
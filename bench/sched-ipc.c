@@ -0,0 +1,531 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * sched-ipc.c
+ *
+ * ipc-matrix: Ping-pong latency between every pair of cpus over pipes,
+ *             eventfds and futexes, with the topology relation of each
+ *             pair, to find the pairs to keep IRQs and threads off
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/cpumap.h"
+#include "../util/cputopo.h"
+#include "../util/header.h"
+#include <subcmd/parse-options.h>
+#include "bench.h"
+#include "futex.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <linux/kernel.h>
+#include <linux/time64.h>
+
+#define WARMUP_LOOPS	100
+#define NR_SLOWEST	10
+
+static const char	*cpu_list;
+static const char	*mechanism_str = "all";
+static unsigned int	loops = 1000;
+
+static const struct option options[] = {
+	OPT_STRING('C', "cpu", &cpu_list, "cpu", "list of cpus to pair, default: all online"),
+	OPT_STRING('m', "mechanism", &mechanism_str, "pipe|eventfd|futex|all",
+		   "Specify the ping-pong mechanism (default: all)"),
+	OPT_UINTEGER('l', "loops", &loops, "Specify number of round trips per pair (default: 1000)"),
+	OPT_END()
+};
+
+static const char * const bench_sched_ipc_usage[] = {
+	"perf bench sched ipc-matrix <options>",
+	NULL
+};
+
+/* Each side of a pair waits on its own inbox */
+struct ipc_pair {
+	int		pipe[2][2];
+	int		eventfd[2];
+	u_int32_t	futex[2];
+	int		cpu[2];
+	u64		ns;
+};
+
+struct ipc_mechanism {
+	const char *name;
+	int  (*init)(struct ipc_pair *p);
+	void (*signal)(struct ipc_pair *p, int to);
+	void (*wait)(struct ipc_pair *p, int me);
+	void (*exit)(struct ipc_pair *p);
+};
+
+static int pipe__init(struct ipc_pair *p)
+{
+	if (pipe(p->pipe[0]))
+		return -errno;
+	if (pipe(p->pipe[1])) {
+		close(p->pipe[0][0]);
+		close(p->pipe[0][1]);
+		return -errno;
+	}
+	return 0;
+}
+
+static void pipe__signal(struct ipc_pair *p, int to)
+{
+	char c = 0;
+	ssize_t ret __maybe_unused = write(p->pipe[to][1], &c, 1);
+
+	BUG_ON(ret != 1);
+}
+
+static void pipe__wait(struct ipc_pair *p, int me)
+{
+	char c;
+	ssize_t ret __maybe_unused = read(p->pipe[me][0], &c, 1);
+
+	BUG_ON(ret != 1);
+}
+
+static void pipe__exit(struct ipc_pair *p)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		close(p->pipe[i][0]);
+		close(p->pipe[i][1]);
+	}
+}
+
+static int eventfd__init(struct ipc_pair *p)
+{
+	p->eventfd[0] = eventfd(0, 0);
+	if (p->eventfd[0] < 0)
+		return -errno;
+	p->eventfd[1] = eventfd(0, 0);
+	if (p->eventfd[1] < 0) {
+		close(p->eventfd[0]);
+		return -errno;
+	}
+	return 0;
+}
+
+static void eventfd__signal(struct ipc_pair *p, int to)
+{
+	u64 val = 1;
+	ssize_t ret __maybe_unused = write(p->eventfd[to], &val, sizeof(val));
+
+	BUG_ON(ret != sizeof(val));
+}
+
+static void eventfd__wait(struct ipc_pair *p, int me)
+{
+	u64 val;
+	ssize_t ret __maybe_unused = read(p->eventfd[me], &val, sizeof(val));
+
+	BUG_ON(ret != sizeof(val));
+}
+
+static void eventfd__exit(struct ipc_pair *p)
+{
+	close(p->eventfd[0]);
+	close(p->eventfd[1]);
+}
+
+static int futex__init(struct ipc_pair *p)
+{
+	p->futex[0] = p->futex[1] = 0;
+	return 0;
+}
+
+static void futex__signal(struct ipc_pair *p, int to)
+{
+	__atomic_store_n(&p->futex[to], 1, __ATOMIC_RELEASE);
+	futex_wake(&p->futex[to], 1, FUTEX_PRIVATE_FLAG);
+}
+
+static void futex__wait(struct ipc_pair *p, int me)
+{
+	while (!__atomic_exchange_n(&p->futex[me], 0, __ATOMIC_ACQUIRE))
+		futex_wait(&p->futex[me], 0, NULL, FUTEX_PRIVATE_FLAG);
+}
+
+static void futex__exit(struct ipc_pair *p __maybe_unused)
+{
+}
+
+static const struct ipc_mechanism mechanisms[] = {
+	{ "pipe",    pipe__init,    pipe__signal,    pipe__wait,    pipe__exit    },
+	{ "eventfd", eventfd__init, eventfd__signal, eventfd__wait, eventfd__exit },
+	{ "futex",   futex__init,   futex__signal,   futex__wait,   futex__exit   },
+};
+
+static const struct ipc_mechanism *mechanism;
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void *pong_thread(void *arg)
+{
+	struct ipc_pair *p = arg;
+	unsigned int i;
+
+	for (i = 0; i < WARMUP_LOOPS + loops; i++) {
+		mechanism->wait(p, 1);
+		mechanism->signal(p, 0);
+	}
+
+	return NULL;
+}
+
+static void *ping_thread(void *arg)
+{
+	struct ipc_pair *p = arg;
+	unsigned int i;
+	u64 start = 0;
+
+	for (i = 0; i < WARMUP_LOOPS + loops; i++) {
+		if (i == WARMUP_LOOPS)
+			start = now_ns();
+		mechanism->signal(p, 1);
+		mechanism->wait(p, 0);
+	}
+
+	/* one way latency */
+	p->ns = (now_ns() - start) / loops / 2;
+	return NULL;
+}
+
+static int run_pair(int cpu0, int cpu1, u64 *ns)
+{
+	struct ipc_pair pair = { .cpu = { cpu0, cpu1 }, };
+	void *(*fn[2])(void *) = { ping_thread, pong_thread };
+	pthread_t threads[2];
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int i, err;
+
+	err = mechanism->init(&pair);
+	if (err)
+		return err;
+
+	pthread_attr_init(&attr);
+	for (i = 0; i < 2; i++) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(pair.cpu[i], &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+
+		err = -pthread_create(&threads[i], &attr, fn[i], &pair);
+		BUG_ON(err);
+	}
+	pthread_attr_destroy(&attr);
+
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	mechanism->exit(&pair);
+	*ns = pair.ns;
+	return 0;
+}
+
+enum ipc_relation {
+	IPC_REL_SMT,
+	IPC_REL_LLC,
+	IPC_REL_PACKAGE,
+	IPC_REL_REMOTE,
+	IPC_REL_MAX,
+};
+
+static const char * const relation_names[IPC_REL_MAX] = {
+	[IPC_REL_SMT]	  = "SMT siblings",
+	[IPC_REL_LLC]	  = "shared LLC",
+	[IPC_REL_PACKAGE] = "same package",
+	[IPC_REL_REMOTE]  = "other package",
+};
+
+/* For the metric names */
+static const char * const relation_keys[IPC_REL_MAX] = {
+	[IPC_REL_SMT]	  = "smt",
+	[IPC_REL_LLC]	  = "llc",
+	[IPC_REL_PACKAGE] = "package",
+	[IPC_REL_REMOTE]  = "remote",
+};
+
+/* Where a cpu sits: its core and package in cpu_topology, its last level cache */
+struct ipc_cpu {
+	int	cpu;
+	int	core;
+	int	package;
+	char	*llc;
+};
+
+static int cpu_list__index(char **lists, u32 nr, int cpu)
+{
+	u32 i;
+	int j;
+
+	for (i = 0; i < nr; i++) {
+		struct cpu_map *map = cpu_map__new(lists[i]);
+		bool found = false;
+
+		for (j = 0; map && j < map->nr; j++)
+			found |= map->map[j] == cpu;
+		cpu_map__put(map);
+		if (found)
+			return i;
+	}
+
+	return -1;
+}
+
+static char *cpu__llc(int cpu)
+{
+	struct cpu_cache_level cache, llc = { .level = 0, };
+	u16 idx;
+
+	for (idx = 0; idx < 10; idx++) {
+		if (cpu_cache_level__read(&cache, cpu, idx))
+			break;
+		if (cache.level > llc.level) {
+			cpu_cache_level__free(&llc);
+			llc = cache;
+		} else {
+			cpu_cache_level__free(&cache);
+		}
+	}
+
+	free(llc.type);
+	free(llc.size);
+	return llc.map;
+}
+
+static enum ipc_relation ipc_cpu__relation(struct ipc_cpu *a, struct ipc_cpu *b)
+{
+	if (a->core >= 0 && a->core == b->core)
+		return IPC_REL_SMT;
+	if (a->llc && b->llc && !strcmp(a->llc, b->llc))
+		return IPC_REL_LLC;
+	if (a->package == b->package)
+		return IPC_REL_PACKAGE;
+	return IPC_REL_REMOTE;
+}
+
+struct ipc_result {
+	int			a, b;
+	u64			ns;
+	enum ipc_relation	rel;
+};
+
+static int ipc_result__cmp(const void *a, const void *b)
+{
+	const struct ipc_result *ra = a, *rb = b;
+
+	return ra->ns < rb->ns ? 1 : ra->ns > rb->ns ? -1 : 0;
+}
+
+static void print_summary(struct ipc_cpu *cpus, struct ipc_result *results, int nr)
+{
+	double avg[IPC_REL_MAX] = { 0, };
+	u64 lo[IPC_REL_MAX], hi[IPC_REL_MAX] = { 0, };
+	int count[IPC_REL_MAX] = { 0, };
+	int i, r;
+
+	for (r = 0; r < IPC_REL_MAX; r++)
+		lo[r] = ULLONG_MAX;
+
+	for (i = 0; i < nr; i++) {
+		r = results[i].rel;
+		avg[r] += results[i].ns;
+		count[r]++;
+		lo[r] = min(lo[r], results[i].ns);
+		hi[r] = max(hi[r], results[i].ns);
+	}
+
+	printf("\n %-16s %8s %10s %10s %10s\n", "relation", "pairs", "min ns", "avg ns", "max ns");
+	for (r = 0; r < IPC_REL_MAX; r++) {
+		if (!count[r])
+			continue;
+		avg[r] /= count[r];
+		printf(" %-16s %8d %10" PRIu64 " %10.0f %10" PRIu64 "\n",
+		       relation_names[r], count[r], lo[r], avg[r], hi[r]);
+	}
+
+	/* the pairs slower than what their topology explains are the bad ones */
+	qsort(results, nr, sizeof(*results), ipc_result__cmp);
+	printf("\n# Slowest pairs\n");
+	for (i = 0; i < nr && i < NR_SLOWEST; i++) {
+		struct ipc_result *res = &results[i];
+
+		printf(" cpu %4d <-> cpu %4d %10" PRIu64 " ns  %s%s\n",
+		       cpus[res->a].cpu, cpus[res->b].cpu, res->ns,
+		       relation_names[res->rel],
+		       res->ns > 1.5 * avg[res->rel] ? " (1.5x its relation's avg)" : "");
+	}
+}
+
+static void report_relations(struct ipc_result *results, int nr)
+{
+	double sum[IPC_REL_MAX] = { 0, };
+	int count[IPC_REL_MAX] = { 0, };
+	char metric[64];
+	int i, r;
+
+	for (i = 0; i < nr; i++) {
+		sum[results[i].rel] += results[i].ns;
+		count[results[i].rel]++;
+	}
+
+	for (r = 0; r < IPC_REL_MAX; r++) {
+		if (!count[r])
+			continue;
+		snprintf(metric, sizeof(metric), "%s.%s", mechanism->name, relation_keys[r]);
+		bench_report(metric, "nsec", sum[r] / count[r]);
+	}
+}
+
+static int run_matrix(struct ipc_cpu *cpus, int nr)
+{
+	int nr_pairs = nr * (nr - 1) / 2, n = 0, i, j, err = 0;
+	struct ipc_result *results;
+	u64 *matrix;
+
+	results = calloc(nr_pairs, sizeof(*results));
+	matrix = calloc(nr * nr, sizeof(*matrix));
+	if (results == NULL || matrix == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr && !err; i++) {
+		for (j = i + 1; j < nr; j++) {
+			struct ipc_result *res = &results[n++];
+
+			err = run_pair(cpus[i].cpu, cpus[j].cpu, &res->ns);
+			if (err)
+				break;
+
+			res->a = i;
+			res->b = j;
+			res->rel = ipc_cpu__relation(&cpus[i], &cpus[j]);
+			matrix[i * nr + j] = matrix[j * nr + i] = res->ns;
+
+			if (bench_format == BENCH_FORMAT_SIMPLE)
+				printf("%s\t%d\t%d\t%" PRIu64 "\t%s\n", mechanism->name,
+				       cpus[i].cpu, cpus[j].cpu, res->ns,
+				       relation_names[res->rel]);
+		}
+	}
+
+	if (err) {
+		fprintf(stderr, "%s ping-pong failed: %s\n", mechanism->name, strerror(-err));
+		goto out;
+	}
+
+	report_relations(results, nr_pairs);
+
+	if (bench_format == BENCH_FORMAT_DEFAULT) {
+		printf("# %s, one way latency in ns, %u round trips per pair\n",
+		       mechanism->name, loops);
+		printf(" %6s", "cpu");
+		for (j = 0; j < nr; j++)
+			printf(" %6d", cpus[j].cpu);
+		printf("\n");
+
+		for (i = 0; i < nr; i++) {
+			printf(" %6d", cpus[i].cpu);
+			for (j = 0; j < nr; j++) {
+				if (i == j)
+					printf(" %6s", "-");
+				else
+					printf(" %6" PRIu64, matrix[i * nr + j]);
+			}
+			printf("\n");
+		}
+
+		print_summary(cpus, results, nr_pairs);
+		printf("\n");
+	}
+out:
+	free(matrix);
+	free(results);
+	return err;
+}
+
+static struct ipc_cpu *ipc_cpus__new(struct cpu_map *map)
+{
+	struct cpu_topology *tp = cpu_topology__new();
+	struct ipc_cpu *cpus;
+	int i;
+
+	cpus = calloc(map->nr, sizeof(*cpus));
+	if (cpus == NULL)
+		goto out;
+
+	for (i = 0; i < map->nr; i++) {
+		cpus[i].cpu = map->map[i];
+		cpus[i].core = tp ? cpu_list__index(tp->thread_siblings, tp->thread_sib, cpus[i].cpu) : -1;
+		cpus[i].package = tp ? cpu_list__index(tp->core_siblings, tp->core_sib, cpus[i].cpu) : -1;
+		cpus[i].llc = cpu__llc(cpus[i].cpu);
+	}
+out:
+	if (tp)
+		cpu_topology__delete(tp);
+	return cpus;
+}
+
+int bench_sched_ipc(int argc, const char **argv)
+{
+	struct ipc_cpu *cpus;
+	struct cpu_map *map;
+	int i, err = 0;
+	bool found = false;
+
+	argc = parse_options(argc, argv, options, bench_sched_ipc_usage, 0);
+	if (argc || !loops)
+		usage_with_options(bench_sched_ipc_usage, options);
+
+	map = cpu_map__new(cpu_list);
+	if (map == NULL || map->nr < 2) {
+		fprintf(stderr, "Need at least two cpus to pair\n");
+		cpu_map__put(map);
+		return -1;
+	}
+
+	cpus = ipc_cpus__new(map);
+	if (cpus == NULL) {
+		cpu_map__put(map);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (int)ARRAY_SIZE(mechanisms) && !err; i++) {
+		if (strcmp(mechanism_str, "all") && strcmp(mechanism_str, mechanisms[i].name))
+			continue;
+
+		found = true;
+		mechanism = &mechanisms[i];
+		err = run_matrix(cpus, map->nr);
+	}
+
+	if (!found) {
+		fprintf(stderr, "Unknown mechanism: %s\n", mechanism_str);
+		err = -1;
+	}
+
+	for (i = 0; i < map->nr; i++)
+		free(cpus[i].llc);
+	free(cpus);
+	cpu_map__put(map);
+	return err;
+}
@@ -304,6 +304,8 @@ int bench_sched_messaging(int argc, const char **argv)
 
 	timersub(&stop, &start, &diff);
 
+	bench_report("total_time", "sec", diff.tv_sec + (double)diff.tv_usec / USEC_PER_SEC);
+
 	switch (bench_format) {
 	case BENCH_FORMAT_DEFAULT:
 		printf("# %d sender and receiver %s per group\n",
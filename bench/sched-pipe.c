@@ -100,6 +100,7 @@ int bench_sched_pipe(int argc, const char **argv)
 	BUG_ON(pipe(pipe_2));
 
 	gettimeofday(&start, NULL);
+	bench_counters__start();
 
 	for (t = 0; t < nr_threads; t++) {
 		td = threads + t;
@@ -147,9 +148,16 @@ int bench_sched_pipe(int argc, const char **argv)
 		assert((retpid == pid) && WIFEXITED(wait_stat));
 	}
 
+	bench_counters__stop();
+	bench_counters__set_ops(loops);
 	gettimeofday(&stop, NULL);
 	timersub(&stop, &start, &diff);
 
+	result_usec = diff.tv_sec * USEC_PER_SEC + diff.tv_usec;
+	bench_report("total_time", "sec", (double)result_usec / USEC_PER_SEC);
+	bench_report("op_time", "usec", (double)result_usec / loops);
+	bench_report("throughput", "ops/sec", (double)loops * USEC_PER_SEC / result_usec);
+
 	switch (bench_format) {
 	case BENCH_FORMAT_DEFAULT:
 		printf("# Executed %d pipe operations between two %s\n\n",
@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * sched-wakeup.c
+ *
+ * wakeup: Timer wakeup latency on every cpu, like cyclictest
+ *
+ * One thread per cpu sleeps until an absolute deadline, interval after the
+ * previous one, and measures how late it got to run.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/cpumap.h"
+#include <subcmd/parse-options.h>
+#include "bench.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/kernel.h>
+#include <linux/time64.h>
+
+static const char	*cpu_list;
+static unsigned int	interval_us = 1000;
+static unsigned int	loops = 10000;
+static unsigned int	hist_us = 100;
+static int		priority;
+
+static const struct option options[] = {
+	OPT_STRING('C', "cpu", &cpu_list, "cpu", "list of cpus to measure, default: all online"),
+	OPT_UINTEGER('i', "interval", &interval_us, "Specify the wakeup interval in usecs (default: 1000)"),
+	OPT_UINTEGER('l', "loops", &loops, "Specify number of wakeups per cpu (default: 10000)"),
+	OPT_UINTEGER('H', "histogram", &hist_us, "Specify the histogram size in usecs (default: 100)"),
+	OPT_INTEGER('p', "priority", &priority, "Run the threads SCHED_FIFO with this priority, 0: SCHED_OTHER"),
+	OPT_END()
+};
+
+static const char * const bench_sched_wakeup_usage[] = {
+	"perf bench sched wakeup <options>",
+	NULL
+};
+
+struct wakeup_thread {
+	int		cpu;
+	pthread_t	pthread;
+	u64		min, max, sum, nr;
+	/* usecs of latency, the last bucket counts the overflows */
+	u64		*hist;
+};
+
+static u64 timespec__ns(struct timespec *ts)
+{
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void *wakeup_thread(void *arg)
+{
+	struct wakeup_thread *t = arg;
+	struct timespec next, now;
+	unsigned int i;
+
+	if (priority) {
+		struct sched_param param = { .sched_priority = priority, };
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+		if (err)
+			fprintf(stderr, "cpu %d: Failed to set SCHED_FIFO: %s\n",
+				t->cpu, strerror(err));
+	}
+
+	t->min = ULLONG_MAX;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (i = 0; i < loops; i++) {
+		u64 lat;
+
+		next.tv_nsec += interval_us * NSEC_PER_USEC;
+		while (next.tv_nsec >= (long)NSEC_PER_SEC) {
+			next.tv_nsec -= NSEC_PER_SEC;
+			next.tv_sec++;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		lat = timespec__ns(&now) - timespec__ns(&next);
+		t->min = min(t->min, lat);
+		t->max = max(t->max, lat);
+		t->sum += lat;
+		t->nr++;
+		t->hist[min(lat / NSEC_PER_USEC, (u64)hist_us)]++;
+	}
+
+	return NULL;
+}
+
+/* In usecs, from the histogram */
+static u64 wakeup_thread__p99(struct wakeup_thread *t)
+{
+	u64 seen = 0;
+	unsigned int us;
+
+	for (us = 0; us < hist_us; us++) {
+		seen += t->hist[us];
+		if (seen * 100 >= t->nr * 99)
+			return us;
+	}
+
+	return t->max / NSEC_PER_USEC;
+}
+
+static void print_results(struct wakeup_thread *threads, int nr)
+{
+	u64 sum = 0, nr_wakeups = 0, max_ns = 0, p99 = 0;
+	unsigned int us;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		sum += threads[i].sum;
+		nr_wakeups += threads[i].nr;
+		max_ns = max(max_ns, threads[i].max);
+		p99 = max(p99, wakeup_thread__p99(&threads[i]));
+	}
+	bench_report("avg_latency", "usec", sum / 1000.0 / nr_wakeups);
+	bench_report("max_latency", "usec", max_ns / 1000.0);
+	bench_report("worst_cpu_p99_latency", "usec", p99);
+
+	if (bench_format == BENCH_FORMAT_SIMPLE) {
+		for (i = 0; i < nr; i++) {
+			struct wakeup_thread *t = &threads[i];
+
+			printf("%d\t%.3f\t%.3f\t%.3f\n", t->cpu, t->min / 1000.0,
+			       t->sum / 1000.0 / t->nr, t->max / 1000.0);
+		}
+		return;
+	}
+
+	printf("# %d threads, %u wakeups each, %u usecs interval, %s\n\n",
+	       nr, loops, interval_us, priority ? "SCHED_FIFO" : "SCHED_OTHER");
+	printf(" %5s %12s %12s %12s %12s\n", "cpu", "min usecs", "avg usecs",
+	       "p99 usecs", "max usecs");
+	for (i = 0; i < nr; i++) {
+		struct wakeup_thread *t = &threads[i];
+
+		printf(" %5d %12.3f %12.3f %12" PRIu64 " %12.3f\n", t->cpu,
+		       t->min / 1000.0, t->sum / 1000.0 / t->nr,
+		       wakeup_thread__p99(t), t->max / 1000.0);
+	}
+
+	/* the cyclictest -h layout, a column per cpu, empty rows left out */
+	printf("\n# Histogram, usecs and the wakeups of each cpu\n");
+	for (us = 0; us < hist_us; us++) {
+		for (i = 0; i < nr; i++) {
+			if (threads[i].hist[us])
+				break;
+		}
+		if (i == nr)
+			continue;
+
+		printf("%06u", us);
+		for (i = 0; i < nr; i++)
+			printf(" %06" PRIu64, threads[i].hist[us]);
+		printf("\n");
+	}
+
+	printf("# Histogram Overflows:");
+	for (i = 0; i < nr; i++)
+		printf(" %05" PRIu64, threads[i].hist[hist_us]);
+	printf("\n");
+}
+
+int bench_sched_wakeup(int argc, const char **argv)
+{
+	struct wakeup_thread *threads;
+	struct cpu_map *cpus;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int i, err = 0;
+
+	argc = parse_options(argc, argv, options, bench_sched_wakeup_usage, 0);
+	if (argc || !loops || !interval_us || !hist_us || priority < 0)
+		usage_with_options(bench_sched_wakeup_usage, options);
+
+	cpus = cpu_map__new(cpu_list);
+	if (cpus == NULL) {
+		fprintf(stderr, "Invalid cpu list: %s\n", cpu_list);
+		return -1;
+	}
+
+	threads = calloc(cpus->nr, sizeof(*threads));
+	if (threads == NULL) {
+		cpu_map__put(cpus);
+		return -ENOMEM;
+	}
+
+	pthread_attr_init(&attr);
+	for (i = 0; i < cpus->nr; i++) {
+		struct wakeup_thread *t = &threads[i];
+
+		t->cpu = cpus->map[i];
+		t->hist = calloc(hist_us + 1, sizeof(*t->hist));
+		if (t->hist == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		CPU_ZERO(&cpuset);
+		CPU_SET(t->cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+
+		err = -pthread_create(&t->pthread, &attr, wakeup_thread, t);
+		if (err) {
+			free(t->hist);
+			t->hist = NULL;
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	/* only the threads that got created */
+	while (--i >= 0)
+		pthread_join(threads[i].pthread, NULL);
+
+	if (err)
+		fprintf(stderr, "Failed to start the wakeup threads: %s\n", strerror(-err));
+	else
+		print_results(threads, cpus->nr);
+
+	for (i = 0; i < cpus->nr; i++)
+		free(threads[i].hist);
+	free(threads);
+	cpu_map__put(cpus);
+	return err;
+}
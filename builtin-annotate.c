@@ -36,6 +36,9 @@
 
 #include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <linux/bitmap.h>
 
 struct perf_annotate {
@@ -46,6 +49,8 @@ struct perf_annotate {
 	bool	   skip_missing;
 	bool	   has_br_stack;
 	bool	   group_set;
+	unsigned int nr_hottest;
+	unsigned int nr_threads;
 	const char *sym_hist_filter;
 	const char *cpu_list;
 	DECLARE_BITMAP(cpu_bitmap, MAX_NR_CPUS);
@@ -69,8 +74,8 @@ struct perf_annotate {
  * well as count the ratio each branch is taken.
  *
  * We can do this without knowing the actual instruction stream by keeping
- * track of the address ranges. We break down ranges such that there is no
- * overlap and iterate from the start until the end.
+ * track of the address ranges. The blocks are gathered here and broken down
+ * into ranges that don't overlap in one go, when the annotation looks them up.
  *
  * @acme: once we parse the objdump output _before_ processing the samples,
  * we can easily fold the branch.cycles IPC bits in.
@@ -79,47 +84,13 @@ static void process_basic_block(struct addr_map_symbol *start,
 				struct addr_map_symbol *end,
 				struct branch_flags *flags)
 {
-	struct symbol *sym = start->sym;
-	struct annotation *notes = sym ? symbol__annotation(sym) : NULL;
-	struct block_range_iter iter;
-	struct block_range *entry;
-
 	/*
 	 * Sanity; NULL isn't executable and the CPU cannot execute backwards
 	 */
 	if (!start->addr || start->addr > end->addr)
 		return;
 
-	iter = block_range__create(start->addr, end->addr);
-	if (!block_range_iter__valid(&iter))
-		return;
-
-	/*
-	 * First block in range is a branch target.
-	 */
-	entry = block_range_iter(&iter);
-	assert(entry->is_target);
-	entry->entry++;
-
-	do {
-		entry = block_range_iter(&iter);
-
-		entry->coverage++;
-		entry->sym = sym;
-
-		if (notes)
-			notes->max_coverage = max(notes->max_coverage, entry->coverage);
-
-	} while (block_range_iter__next(&iter));
-
-	/*
-	 * Last block in rage is a branch.
-	 */
-	entry = block_range_iter(&iter);
-	assert(entry->is_branch);
-	entry->taken++;
-	if (flags->predicted)
-		entry->pred++;
+	block_range__add(start->addr, end->addr, start->sym, flags->predicted);
 }
 
 static void process_branch_stack(struct branch_stack *bs, struct addr_location *al,
@@ -145,7 +116,7 @@ static void process_branch_stack(struct branch_stack *bs, struct addr_location *
 		prev = &bi[i].to;
 	}
 
-	free(bi);
+	sample__put_bstack(bi);
 }
 
 static int hist_iter__branch_callback(struct hist_entry_iter *iter,
@@ -302,6 +273,175 @@ static int hist_entry__tty_annotate(struct hist_entry *he,
 	return symbol__tty_annotate2(he->ms.sym, he->ms.map, evsel, &ann->opts);
 }
 
+static bool hist_entry__can_annotate(struct hist_entry *he,
+				     struct perf_annotate *ann)
+{
+	if (he->ms.sym == NULL || he->ms.map->dso->annotate_warned)
+		return false;
+
+	if (ann->sym_hist_filter &&
+	    strcmp(he->ms.sym->name, ann->sym_hist_filter) != 0)
+		return false;
+
+	return symbol__annotation(he->ms.sym)->src != NULL;
+}
+
+struct hottest_entry {
+	struct hist_entry *he;
+	unsigned int	  idx;
+};
+
+static int hottest_entry__cmp_sym(const void *a, const void *b)
+{
+	const struct hottest_entry *ea = a, *eb = b;
+
+	if (ea->he->ms.sym != eb->he->ms.sym)
+		return ea->he->ms.sym < eb->he->ms.sym ? -1 : 1;
+
+	return ea->idx < eb->idx ? -1 : ea->idx > eb->idx;
+}
+
+static int hottest_entry__cmp_idx(const void *a, const void *b)
+{
+	const struct hottest_entry *ea = a, *eb = b;
+
+	return ea->idx < eb->idx ? -1 : ea->idx > eb->idx;
+}
+
+/*
+ * Collect the hist entries of the ann->nr_hottest symbols with the most
+ * samples, in output order.  There is an entry per IP, keep the first one
+ * of each symbol.
+ */
+static int hists__find_hottest(struct hists *hists, struct perf_annotate *ann,
+			       struct hottest_entry **pentries)
+{
+	struct hottest_entry *entries;
+	unsigned int i, nr = 0, nr_syms = 0;
+	struct rb_node *nd;
+
+	for (nd = rb_first_cached(&hists->entries); nd; nd = rb_next(nd)) {
+		if (hist_entry__can_annotate(rb_entry(nd, struct hist_entry, rb_node), ann))
+			nr++;
+	}
+
+	entries = calloc(nr, sizeof(*entries));
+	if (entries == NULL)
+		return -ENOMEM;
+
+	nr = 0;
+	for (nd = rb_first_cached(&hists->entries); nd; nd = rb_next(nd)) {
+		struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node);
+
+		if (hist_entry__can_annotate(he, ann)) {
+			entries[nr].he  = he;
+			entries[nr].idx = nr;
+			nr++;
+		}
+	}
+
+	qsort(entries, nr, sizeof(*entries), hottest_entry__cmp_sym);
+	for (i = 0; i < nr; i++) {
+		if (nr_syms && entries[nr_syms - 1].he->ms.sym == entries[i].he->ms.sym)
+			continue;
+		entries[nr_syms++] = entries[i];
+	}
+	qsort(entries, nr_syms, sizeof(*entries), hottest_entry__cmp_idx);
+
+	*pentries = entries;
+	return min(nr_syms, ann->nr_hottest);
+}
+
+struct annotate_hottest_arg {
+	struct hottest_entry	*entries;
+	struct perf_evsel	*evsel;
+	struct perf_annotate	*ann;
+	unsigned int		nr;
+	unsigned int		next;
+};
+
+static void *annotate_hottest_worker(void *arg)
+{
+	struct annotate_hottest_arg *args = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&args->next, 1)) < args->nr) {
+		struct hist_entry *he = args->entries[i].he;
+		struct annotation *notes = symbol__annotation(he->ms.sym);
+
+		/*
+		 * Errors are reported when it gets annotated again to be
+		 * printed.
+		 */
+		pthread_mutex_lock(&notes->lock);
+		symbol__annotate(he->ms.sym, he->ms.map, args->evsel, 0,
+				 &args->ann->opts, NULL);
+		pthread_mutex_unlock(&notes->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Disassemble the hottest symbols on ann->nr_threads threads, then print
+ * them one after the other, using what was disassembled for them.
+ */
+static void hists__annotate_hottest(struct hists *hists,
+				    struct perf_evsel *evsel,
+				    struct perf_annotate *ann)
+{
+	struct annotate_hottest_arg args = { .evsel = evsel, .ann = ann, };
+	unsigned int i, started = 0, nr_threads = ann->nr_threads;
+	bool singlethreaded = perf_singlethreaded;
+	pthread_t *threads = NULL;
+	int nr;
+
+	nr = hists__find_hottest(hists, ann, &args.entries);
+	if (nr < 0) {
+		pr_err("Not enough memory to annotate the hottest symbols\n");
+		return;
+	}
+	args.nr = nr;
+
+	if (nr_threads == UINT_MAX)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > args.nr)
+		nr_threads = args.nr;
+
+	if (nr_threads > 1) {
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+		perf_set_multithreaded();
+	}
+
+	for (; threads && started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL,
+				   annotate_hottest_worker, &args))
+			break;
+	}
+
+	annotate_hottest_worker(&args);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (nr_threads > 1 && singlethreaded)
+		perf_set_singlethreaded();
+
+	pr_debug("Annotated %u symbols with %u threads\n", args.nr, started + 1);
+
+	for (i = 0; i < args.nr; i++) {
+		struct hist_entry *he = args.entries[i].he;
+		struct annotation *notes = symbol__annotation(he->ms.sym);
+
+		hist_entry__tty_annotate(he, evsel, ann);
+		annotated_source__delete(notes->src);
+		notes->src = NULL;
+	}
+
+	free(threads);
+	free(args.entries);
+}
+
 static void hists__find_annotations(struct hists *hists,
 				    struct perf_evsel *evsel,
 				    struct perf_annotate *ann)
@@ -309,6 +449,11 @@ static void hists__find_annotations(struct hists *hists,
 	struct rb_node *nd = rb_first_cached(&hists->entries), *next;
 	int key = K_RIGHT;
 
+	if (use_browser == 0 && ann->nr_hottest) {
+		hists__annotate_hottest(hists, evsel, ann);
+		return;
+	}
+
 	while (nd) {
 		struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node);
 		struct annotation *notes;
@@ -377,8 +522,8 @@ find_next:
 			 * symbol, free he->ms.sym->src to signal we already
 			 * processed this symbol.
 			 */
-			zfree(&notes->src->cycles_hist);
-			zfree(&notes->src);
+			annotated_source__delete(notes->src);
+			notes->src = NULL;
 		}
 	}
 }
@@ -485,6 +630,7 @@ int cmd_annotate(int argc, const char **argv)
 			.ordering_requires_timestamps = true,
 		},
 		.opts = annotation__default_options,
+		.nr_threads = UINT_MAX,
 	};
 	struct perf_data data = {
 		.mode  = PERF_DATA_MODE_READ,
@@ -516,6 +662,11 @@ int cmd_annotate(int argc, const char **argv)
 		    "print matching source lines (may be slow)"),
 	OPT_BOOLEAN('P', "full-paths", &annotate.opts.full_path,
 		    "Don't shorten the displayed pathnames"),
+	OPT_UINTEGER(0, "hottest", &annotate.nr_hottest,
+		     "Annotate only the N symbols with the most samples,"
+		     " disassembling them in parallel (stdio only)"),
+	OPT_UINTEGER(0, "annotate-threads", &annotate.nr_threads,
+		     "Number of threads disassembling the --hottest symbols"),
 	OPT_BOOLEAN(0, "skip-missing", &annotate.skip_missing,
 		    "Skip symbols that cannot be annotated"),
 	OPT_BOOLEAN_SET(0, "group", &symbol_conf.event_group,
@@ -624,16 +775,10 @@ int cmd_annotate(int argc, const char **argv)
 
 out_delete:
 	/*
-	 * Speed up the exit process, for large files this can
-	 * take quite a while.
-	 *
-	 * XXX Enable this when using valgrind or if we ever
-	 * librarize this command.
-	 *
-	 * Also experiment with obstacks to see how much speed
-	 * up we'll get here.
-	 *
-	 * perf_session__delete(session);
+	 * Speed up the exit process, for large files tearing down the
+	 * machines can take quite a while.
 	 */
+	annotate.session->skip_teardown = true;
+	perf_session__delete(annotate.session);
 	return ret;
 }
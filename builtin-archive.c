@@ -0,0 +1,667 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * builtin-archive.c
+ *
+ * Builtin archive command: collect the objects in the build-id cache of the
+ * DSOs with hits in perf.data into a zstd compressed tar file, so that it
+ * can be analysed on another machine.
+ *
+ * The tar stream is cut in chunks compressed as separate zstd frames on
+ * several threads, their concatenation is a valid zstd stream.
+ */
+#include "builtin.h"
+#include "perf.h"
+#include "util/build-id.h"
+#include "util/compress.h"
+#include "util/data.h"
+#include "util/debug.h"
+#include "util/dso.h"
+#include "util/machine.h"
+#include "util/path.h"
+#include "util/session.h"
+#include "util/strlist.h"
+#include "util/symbol.h"
+#include "util/util.h"
+#include <subcmd/parse-options.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/kernel.h>
+
+#define ARCHIVE_CHUNK_SIZE	(1024 * 1024)
+#define TAR_BLOCK		512
+#define TAR_NAME_MAX		100
+
+/* GNU tar, for the names and link targets longer than 100 bytes */
+struct tar_header {
+	char	name[TAR_NAME_MAX];
+	char	mode[8];
+	char	uid[8];
+	char	gid[8];
+	char	size[12];
+	char	mtime[12];
+	char	chksum[8];
+	char	typeflag;
+	char	linkname[TAR_NAME_MAX];
+	char	magic[6];
+	char	version[2];
+	char	uname[32];
+	char	gname[32];
+	char	devmajor[8];
+	char	devminor[8];
+	char	prefix[155];
+	char	pad[12];
+};
+
+struct archive_chunk {
+	void	*data;
+	size_t	 size;
+	void	*compressed;
+	size_t	 compressed_size;
+};
+
+struct archive_worker {
+	struct archive		*archive;
+	struct zstd_data	 zstd;
+	pthread_t		 thread;
+};
+
+struct archive {
+	int			 fd;
+	struct archive_worker	*workers;
+	unsigned int		 nr_workers;
+	/* two per worker, compressed together once all are filled */
+	struct archive_chunk	*chunks;
+	unsigned int		 nr_chunks;
+	unsigned int		 cur;
+	unsigned int		 nr_filled;
+	unsigned int		 next;
+	size_t			 compressed_max;
+	int			 err;
+	u64			 size, compressed_size;
+	/* build-ids already archived and those the destination has */
+	struct strlist		*seen;
+	struct strlist		*skip_ids;
+	const char		*skip_dir;
+	FILE			*manifest;
+	unsigned int		 nr_added, nr_skipped, nr_missing;
+};
+
+static void *archive_worker__compress(void *arg)
+{
+	struct archive_worker *w = arg;
+	struct archive *a = w->archive;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&a->next, 1)) < a->nr_filled) {
+		struct archive_chunk *c = &a->chunks[i];
+
+		c->compressed_size = zstd_compress_frame(&w->zstd, c->compressed,
+							 a->compressed_max,
+							 c->data, c->size);
+		if (!c->compressed_size)
+			a->err = -EINVAL;
+	}
+
+	return NULL;
+}
+
+/* Compress the filled chunks on the workers, then write them in order */
+static int archive__flush(struct archive *a)
+{
+	unsigned int i, started = 0;
+
+	a->nr_filled = a->cur;
+	if (a->cur < a->nr_chunks && a->chunks[a->cur].size)
+		a->nr_filled++;
+	a->next = 0;
+
+	if (a->nr_filled == 0)
+		return 0;
+
+	for (; started < min(a->nr_workers, a->nr_filled) - 1; started++) {
+		struct archive_worker *w = &a->workers[started + 1];
+
+		if (pthread_create(&w->thread, NULL, archive_worker__compress, w))
+			break;
+	}
+
+	archive_worker__compress(&a->workers[0]);
+
+	for (i = 0; i < started; i++)
+		pthread_join(a->workers[i + 1].thread, NULL);
+
+	if (a->err)
+		return a->err;
+
+	for (i = 0; i < a->nr_filled; i++) {
+		struct archive_chunk *c = &a->chunks[i];
+
+		if (writen(a->fd, c->compressed, c->compressed_size) < 0)
+			return -errno;
+
+		a->size		   += c->size;
+		a->compressed_size += c->compressed_size;
+		c->size = 0;
+	}
+
+	a->cur = 0;
+	return 0;
+}
+
+/* The chunk to add to, after compressing all of them once they are full */
+static struct archive_chunk *archive__chunk(struct archive *a)
+{
+	if (a->chunks[a->cur].size == ARCHIVE_CHUNK_SIZE &&
+	    ++a->cur == a->nr_chunks && archive__flush(a))
+		return NULL;
+
+	return &a->chunks[a->cur];
+}
+
+static int archive__write(struct archive *a, const void *buf, size_t len)
+{
+	while (len) {
+		struct archive_chunk *c = archive__chunk(a);
+		size_t n;
+
+		if (c == NULL)
+			return -1;
+
+		n = min(len, ARCHIVE_CHUNK_SIZE - c->size);
+		if (buf) {
+			memcpy(c->data + c->size, buf, n);
+			buf += n;
+		} else {
+			memset(c->data + c->size, 0, n);
+		}
+		c->size += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Pad to a whole tar block */
+static int archive__pad(struct archive *a, u64 size)
+{
+	return archive__write(a, NULL, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static int archive__write_header(struct archive *a, const char *name, char type,
+				 mode_t mode, u64 size, time_t mtime,
+				 const char *linkname)
+{
+	struct tar_header h;
+	unsigned int i, sum = 0;
+
+	memset(&h, 0, sizeof(h));
+	strncpy(h.name, name, sizeof(h.name));
+	snprintf(h.mode, sizeof(h.mode), "%07o", mode & 07777);
+	snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+	snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+	snprintf(h.size, sizeof(h.size), "%011" PRIo64, size);
+	snprintf(h.mtime, sizeof(h.mtime), "%011llo", (unsigned long long)mtime);
+	h.typeflag = type;
+	if (linkname)
+		strncpy(h.linkname, linkname, sizeof(h.linkname));
+	memcpy(h.magic, "ustar ", sizeof(h.magic));
+	memcpy(h.version, " ", sizeof(h.version));
+
+	memset(h.chksum, ' ', sizeof(h.chksum));
+	for (i = 0; i < sizeof(h); i++)
+		sum += ((unsigned char *)&h)[i];
+	snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+
+	return archive__write(a, &h, sizeof(h));
+}
+
+/* A GNU tar 'L' or 'K' entry with a name or link target too long for the header */
+static int archive__write_long(struct archive *a, char type, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	if (archive__write_header(a, "././@LongLink", type, 0644, len, 0, NULL) ||
+	    archive__write(a, str, len))
+		return -1;
+
+	return archive__pad(a, len);
+}
+
+static int archive__add_header(struct archive *a, const char *name, char type,
+			       struct stat *st, u64 size, const char *linkname)
+{
+	if (linkname && strlen(linkname) >= TAR_NAME_MAX &&
+	    archive__write_long(a, 'K', linkname))
+		return -1;
+
+	if (strlen(name) >= TAR_NAME_MAX &&
+	    archive__write_long(a, 'L', name))
+		return -1;
+
+	return archive__write_header(a, name, type, st->st_mode, size,
+				     st->st_mtime, linkname);
+}
+
+static int archive__add_file(struct archive *a, const char *name, const char *path)
+{
+	struct stat st;
+	u64 left;
+	int fd, err = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		pr_err("Failed to open %s: %s\n", path, strerror(errno));
+		goto out_close;
+	}
+
+	if (archive__add_header(a, name, '0', &st, st.st_size, NULL))
+		goto out_close;
+
+	/* read straight into the chunks, zeroes if it got shorter */
+	for (left = st.st_size; left; ) {
+		struct archive_chunk *c = archive__chunk(a);
+		ssize_t n;
+
+		if (c == NULL)
+			goto out_close;
+
+		n = read(fd, c->data + c->size, min(left, (u64)(ARCHIVE_CHUNK_SIZE - c->size)));
+		if (n < 0) {
+			pr_err("Failed to read %s: %s\n", path, strerror(errno));
+			goto out_close;
+		}
+		if (n == 0) {
+			pr_warning("%s got shorter while being archived\n", path);
+			if (archive__write(a, NULL, left))
+				goto out_close;
+			break;
+		}
+		c->size += n;
+		left -= n;
+	}
+
+	err = archive__pad(a, st.st_size);
+out_close:
+	if (fd >= 0)
+		close(fd);
+	return err;
+}
+
+/* The files in the cache directory of a build-id, e.g. elf, kallsyms, debug */
+static int archive__add_dir(struct archive *a, const char *name, const char *path)
+{
+	char fname[PATH_MAX], fpath[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	int err = 0;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		pr_err("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (!err && (ent = readdir(dir)) != NULL) {
+		path__join(fpath, sizeof(fpath), path, ent->d_name);
+		if (stat(fpath, &st) || !S_ISREG(st.st_mode))
+			continue;
+
+		path__join(fname, sizeof(fname), name, ent->d_name);
+		err = archive__add_file(a, fname, fpath);
+	}
+
+	closedir(dir);
+	return err;
+}
+
+static bool archive__skip(struct archive *a, const char *sbuild_id)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (a->skip_ids && strlist__has_entry(a->skip_ids, sbuild_id))
+		return true;
+
+	if (a->skip_dir) {
+		scnprintf(path, sizeof(path), "%s/.build-id/%.2s/%s",
+			  a->skip_dir, sbuild_id, sbuild_id + 2);
+		return !lstat(path, &st);
+	}
+
+	return false;
+}
+
+/*
+ * The .build-id link of the build-id, as it is, and the files it points to,
+ * all relative to the build-id cache, as 'perf buildid-cache' lays them out.
+ */
+static int archive__add_build_id(struct archive *a, const char *sbuild_id,
+				 const char *root, struct dso *dso)
+{
+	char *linkname, target[PATH_MAX], path[PATH_MAX], name[PATH_MAX];
+	size_t root_len = strlen(root);
+	struct stat st;
+	ssize_t len;
+	int err = -1;
+
+	linkname = build_id_cache__linkname(sbuild_id, NULL, 0);
+	if (linkname == NULL)
+		return -ENOMEM;
+
+	len = readlink(linkname, target, sizeof(target) - 1);
+	if (len < 0 || lstat(linkname, &st) || realpath(linkname, path) == NULL ||
+	    strncmp(path, root, root_len) || path[root_len] != '/') {
+		pr_debug("%s of %s is not in the build-id cache\n",
+			 sbuild_id, dso->long_name);
+		a->nr_missing++;
+		err = 0;
+		goto out_free;
+	}
+	target[len] = '\0';
+
+	scnprintf(name, sizeof(name), ".build-id/%.2s/%s", sbuild_id, sbuild_id + 2);
+	if (archive__add_header(a, name, '2', &st, 0, target))
+		goto out_free;
+
+	if (stat(path, &st))
+		goto out_free;
+
+	if (S_ISDIR(st.st_mode))
+		err = archive__add_dir(a, path + root_len + 1, path);
+	else
+		err = archive__add_file(a, path + root_len + 1, path);
+
+	if (!err) {
+		a->nr_added++;
+		if (a->manifest)
+			fprintf(a->manifest, "%s %s\n", sbuild_id, dso->long_name);
+	}
+out_free:
+	free(linkname);
+	return err;
+}
+
+static int archive__add_machine(struct archive *a, struct machine *machine,
+				const char *root, bool with_hits)
+{
+	struct dso *dso;
+
+	list_for_each_entry(dso, &machine->dsos.head, node) {
+		char sbuild_id[SBUILD_ID_SIZE];
+		int err;
+
+		if (!dso->has_build_id || (with_hits && !dso->hit))
+			continue;
+
+		build_id__sprintf(dso->build_id, sizeof(dso->build_id), sbuild_id);
+
+		err = strlist__add(a->seen, sbuild_id);
+		if (err == -EEXIST)
+			continue;
+		if (err)
+			return err;
+
+		if (archive__skip(a, sbuild_id)) {
+			a->nr_skipped++;
+			continue;
+		}
+
+		err = archive__add_build_id(a, sbuild_id, root, dso);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int archive__add_session(struct archive *a, struct perf_session *session,
+				bool with_hits)
+{
+	char root[PATH_MAX];
+	struct rb_node *nd;
+	int err;
+
+	if (realpath(buildid_dir, root) == NULL) {
+		pr_err("No build-id cache at %s\n", buildid_dir);
+		return -ENOENT;
+	}
+
+	err = archive__add_machine(a, &session->machines.host, root, with_hits);
+
+	for (nd = rb_first_cached(&session->machines.guests); nd && !err; nd = rb_next(nd)) {
+		struct machine *pos = rb_entry(nd, struct machine, rb_node);
+
+		err = archive__add_machine(a, pos, root, with_hits);
+	}
+
+	return err;
+}
+
+static void archive__exit(struct archive *a)
+{
+	unsigned int i;
+
+	for (i = 0; a->chunks && i < a->nr_chunks; i++) {
+		free(a->chunks[i].data);
+		free(a->chunks[i].compressed);
+	}
+	zfree(&a->chunks);
+
+	for (i = 0; a->workers && i < a->nr_workers; i++)
+		zstd_fini(&a->workers[i].zstd);
+	zfree(&a->workers);
+
+	strlist__delete(a->seen);
+	strlist__delete(a->skip_ids);
+}
+
+static int archive__init(struct archive *a, unsigned int nr_workers, int level)
+{
+	unsigned int i;
+
+	a->nr_workers	  = nr_workers;
+	a->nr_chunks	  = 2 * nr_workers;
+	a->compressed_max = ZSTD_compressBound(ARCHIVE_CHUNK_SIZE);
+
+	a->seen	   = strlist__new(NULL, NULL);
+	a->workers = calloc(a->nr_workers, sizeof(*a->workers));
+	a->chunks  = calloc(a->nr_chunks, sizeof(*a->chunks));
+	if (a->seen == NULL || a->workers == NULL || a->chunks == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < a->nr_workers; i++) {
+		a->workers[i].archive = a;
+		if (zstd_init(&a->workers[i].zstd, level))
+			return -EINVAL;
+	}
+
+	for (i = 0; i < a->nr_chunks; i++) {
+		a->chunks[i].data	= malloc(ARCHIVE_CHUNK_SIZE);
+		a->chunks[i].compressed = malloc(a->compressed_max);
+		if (a->chunks[i].data == NULL || a->chunks[i].compressed == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* The build-ids, first on each line, of 'perf buildid-list' or --manifest */
+static struct strlist *build_ids__load(const char *filename)
+{
+	struct strlist *ids = strlist__new(NULL, NULL);
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (ids == NULL)
+		return NULL;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		pr_err("Failed to open %s: %s\n", filename, strerror(errno));
+		strlist__delete(ids);
+		return NULL;
+	}
+
+	while (getline(&line, &len, fp) > 0) {
+		char *sep = strpbrk(line, " \t\n");
+
+		if (sep)
+			*sep = '\0';
+		if (*line && strlist__add(ids, line) == -ENOMEM) {
+			strlist__delete(ids);
+			ids = NULL;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return ids;
+}
+
+int cmd_archive(int argc, const char **argv)
+{
+	struct archive a = { .fd = -1, };
+	struct perf_session *session;
+	struct perf_data data = {
+		.mode  = PERF_DATA_MODE_READ,
+	};
+	const char *output = NULL, *manifest = NULL, *skip = NULL;
+	unsigned int nr_workers = 0, level = 1;
+	bool with_hits = true;
+	char *out_name = NULL;
+	struct stat st;
+	int err = -1;
+	const struct option options[] = {
+	OPT_STRING('i', "input", &input_name, "file", "input file name"),
+	OPT_STRING('o', "output", &output, "file",
+		   "archive file name, default: <input>.tar.zst"),
+	OPT_UINTEGER('j', "jobs", &nr_workers,
+		     "number of threads compressing, default: the online CPUs"),
+	OPT_UINTEGER('z', "compression-level", &level,
+		     "zstd compression level, 1 to 22, default: 1"),
+	OPT_STRING(0, "manifest", &manifest, "file",
+		   "write the archived build-ids and DSOs to file"),
+	OPT_STRING(0, "skip", &skip, "dir|file",
+		   "skip the build-ids in this build-id cache or listed in this file"),
+	OPT_BOOLEAN('f', "force", &data.force, "don't complain, do it"),
+	OPT_INCR('v', "verbose", &verbose, "be more verbose"),
+	OPT_END()
+	};
+	const char * const archive_usage[] = {
+		"perf archive [<options>] [file]",
+		NULL
+	};
+
+	argc = parse_options(argc, argv, options, archive_usage, 0);
+	if (argc > 1)
+		usage_with_options(archive_usage, options);
+	if (argc == 1)
+		input_name = argv[0];
+	if (input_name == NULL)
+		input_name = "perf.data";
+	data.path = input_name;
+
+	if (level < 1 || level > 22) {
+		pr_err("The compression level must be between 1 and 22\n");
+		return -1;
+	}
+
+	if (output == NULL) {
+		if (asprintf(&out_name, "%s.tar.zst", input_name) < 0)
+			return -ENOMEM;
+		output = out_name;
+	}
+
+	if (!nr_workers)
+		nr_workers = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+
+	if (archive__init(&a, nr_workers, level))
+		goto out_exit;
+
+	if (skip) {
+		if (!stat(skip, &st) && S_ISDIR(st.st_mode))
+			a.skip_dir = skip;
+		else if ((a.skip_ids = build_ids__load(skip)) == NULL)
+			goto out_exit;
+	}
+
+	symbol__elf_init();
+
+	session = perf_session__new(&data, false, &build_id__mark_dso_hit_ops);
+	if (session == NULL)
+		goto out_exit;
+
+	/* the AUX area traces aren't decoded, take all the DSOs then */
+	if (!perf_data__is_pipe(&data) &&
+	    perf_header__has_feat(&session->header, HEADER_AUXTRACE))
+		with_hits = false;
+
+	if (with_hits || perf_data__is_pipe(&data))
+		perf_session__process_events(session);
+
+	if (manifest) {
+		a.manifest = fopen(manifest, "w");
+		if (a.manifest == NULL) {
+			pr_err("Failed to open %s: %s\n", manifest, strerror(errno));
+			goto out_delete;
+		}
+	}
+
+	a.fd = open(output, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (a.fd < 0) {
+		pr_err("Failed to open %s: %s\n", output, strerror(errno));
+		goto out_delete;
+	}
+
+	/* the end of the archive is two zeroed blocks */
+	if (archive__add_session(&a, session, with_hits) ||
+	    archive__write(&a, NULL, 2 * TAR_BLOCK) || archive__flush(&a)) {
+		pr_err("Failed to write %s\n", output);
+		unlink(output);
+		goto out_delete;
+	}
+
+	if (a.nr_added == 0) {
+		pr_err("perf archive: no build-ids found%s\n",
+		       a.nr_skipped ? " that aren't already at the destination" : "");
+		unlink(output);
+		goto out_delete;
+	}
+
+	fprintf(stderr, "Archived %u build-ids", a.nr_added);
+	if (a.nr_skipped)
+		fprintf(stderr, ", skipped %u already at the destination", a.nr_skipped);
+	if (a.nr_missing)
+		fprintf(stderr, ", %u not in the build-id cache", a.nr_missing);
+	fprintf(stderr, ", %.1f MB compressed to %.1f MB\n",
+		a.size / 1048576.0, a.compressed_size / 1048576.0);
+
+	printf("Now please run:\n\n");
+	printf("$ tar --zstd -xvf %s -C ~/.debug\n\n", output);
+	printf("wherever you need to run 'perf report' on.\n");
+	err = 0;
+
+out_delete:
+	if (a.fd >= 0)
+		close(a.fd);
+	if (a.manifest)
+		fclose(a.manifest);
+	perf_session__delete(session);
+out_exit:
+	archive__exit(&a);
+	free(out_name);
+	return err;
+}
@@ -15,6 +15,8 @@
  *  numa  ... NUMA scheduling and MM performance
  *  futex ... Futex performance
  *  epoll ... Event poll performance
+ *  internals ... perf's own event processing performance
+ *  record ... perf record ring buffer reading performance
  */
 #include "perf.h"
 #include "util/util.h"
@@ -22,10 +24,15 @@
 #include "builtin.h"
 #include "bench/bench.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
 
 typedef int (*bench_fn_t)(int argc, const char **argv);
 
@@ -33,6 +40,8 @@ struct bench {
 	const char	*name;
 	const char	*summary;
 	bench_fn_t	fn;
+	/* loops bench_repeat times itself, reporting each loop */
+	bool		repeats;
 };
 
 #ifdef HAVE_LIBNUMA_SUPPORT
@@ -46,6 +55,8 @@ static struct bench numa_benchmarks[] = {
 static struct bench sched_benchmarks[] = {
 	{ "messaging",	"Benchmark for scheduling and IPC",		bench_sched_messaging	},
 	{ "pipe",	"Benchmark for pipe() between two processes",	bench_sched_pipe	},
+	{ "wakeup",	"Benchmark for timer wakeup latency per cpu",	bench_sched_wakeup	},
+	{ "ipc-matrix",	"Benchmark for ping-pong latency per cpu pair",	bench_sched_ipc		},
 	{ "all",	"Run all scheduler benchmarks",		NULL			},
 	{ NULL,		NULL,						NULL			}
 };
@@ -53,15 +64,16 @@ static struct bench sched_benchmarks[] = {
 static struct bench mem_benchmarks[] = {
 	{ "memcpy",	"Benchmark for memcpy() functions",		bench_mem_memcpy	},
 	{ "memset",	"Benchmark for memset() functions",		bench_mem_memset	},
+	{ "bandwidth",	"Benchmark for bandwidth and latency per NUMA node", bench_mem_bandwidth	},
 	{ "all",	"Run all memory access benchmarks",		NULL			},
 	{ NULL,		NULL,						NULL			}
 };
 
 static struct bench futex_benchmarks[] = {
 	{ "hash",	"Benchmark for futex hash table",               bench_futex_hash	},
-	{ "wake",	"Benchmark for futex wake calls",               bench_futex_wake	},
-	{ "wake-parallel", "Benchmark for parallel futex wake calls",   bench_futex_wake_parallel },
-	{ "requeue",	"Benchmark for futex requeue calls",            bench_futex_requeue	},
+	{ "wake",	"Benchmark for futex wake calls",               bench_futex_wake, true	},
+	{ "wake-parallel", "Benchmark for parallel futex wake calls",   bench_futex_wake_parallel, true },
+	{ "requeue",	"Benchmark for futex requeue calls",            bench_futex_requeue, true },
 	/* pi-futexes */
 	{ "lock-pi",	"Benchmark for futex lock_pi calls",            bench_futex_lock_pi	},
 	{ "all",	"Run all futex benchmarks",			NULL			},
@@ -77,6 +89,26 @@ static struct bench epoll_benchmarks[] = {
 };
 #endif // HAVE_EVENTFD
 
+static struct bench internals_benchmarks[] = {
+	{ "ordered-events", "Benchmark for queueing and flushing ordered events", bench_internals_ordered_events },
+	{ "parse-sample", "Benchmark for parsing sample events",	bench_internals_parse_sample },
+	{ "findnew-thread", "Benchmark for machine thread lookups",	bench_internals_findnew_thread },
+	{ "find-symbol", "Benchmark for map and symbol lookups",	bench_internals_find_symbol },
+	{ "hists-add",	"Benchmark for adding samples to the hists",	bench_internals_hists_add },
+	{ "callchain-append", "Benchmark for appending to callchain trees", bench_internals_callchain_append },
+	{ "synthesize",	"Benchmark for the synthesis of the existing threads and maps", bench_internals_synthesize },
+	{ "kallsyms-parse", "Benchmark for parsing and splitting kallsyms", bench_internals_kallsyms_parse },
+	{ "symbol-load", "Benchmark for loading the ELF symbols of a binary", bench_internals_symbol_load },
+	{ "all",	"Run all internals benchmarks",			NULL			},
+	{ NULL,		NULL,						NULL			}
+};
+
+static struct bench record_benchmarks[] = {
+	{ "ring",	"Benchmark for perf record ring buffer reading configurations", bench_record_ring },
+	{ "all",	"Run all record benchmarks",			NULL			},
+	{ NULL,		NULL,						NULL			}
+};
+
 struct collection {
 	const char	*name;
 	const char	*summary;
@@ -93,6 +125,8 @@ static struct collection collections[] = {
 #ifdef HAVE_EVENTFD
 	{"epoll",       "Epoll stressing benchmarks",                   epoll_benchmarks        },
 #endif
+	{ "internals",	"perf's own event processing benchmarks",	internals_benchmarks	},
+	{ "record",	"perf record benchmarks",			record_benchmarks	},
 	{ "all",	"All benchmarks",				NULL			},
 	{ NULL,		NULL,						NULL			}
 };
@@ -123,9 +157,18 @@ static const char *bench_format_str;
 int bench_format = BENCH_FORMAT_DEFAULT;
 unsigned int bench_repeat = 10; /* default number of times to repeat the run */
 
+/* Runs of each benchmark, each in its own process, when --repeat is given */
+static unsigned int bench_runs = 1;
+static unsigned int repeat_str = UINT_MAX;
+
 static const struct option bench_options[] = {
-	OPT_STRING('f', "format", &bench_format_str, "default|simple", "Specify the output formatting style"),
-	OPT_UINTEGER('r', "repeat",  &bench_repeat,   "Specify amount of times to repeat the run"),
+	OPT_STRING('f', "format", &bench_format_str, "default|simple|json|csv", "Specify the output formatting style"),
+	OPT_UINTEGER('r', "repeat",  &repeat_str,   "Specify amount of times to repeat the run"),
+	OPT_STRING_OPTARG(0, "counters", &bench_counters_events, "events",
+			  "Count events in the measured region of the benchmarks",
+			  "cycles,instructions,cache-misses,branch-misses"),
+	OPT_STRING(0, "counters-metrics", &bench_counters_metrics, "metric/metric group list",
+		   "Count the events of these metrics in the measured region of the benchmarks"),
 	OPT_END()
 };
 
@@ -160,32 +203,125 @@ static int bench_str2int(const char *str)
 		return BENCH_FORMAT_DEFAULT;
 	else if (!strcmp(str, BENCH_FORMAT_SIMPLE_STR))
 		return BENCH_FORMAT_SIMPLE;
+	else if (!strcmp(str, BENCH_FORMAT_JSON_STR))
+		return BENCH_FORMAT_JSON;
+	else if (!strcmp(str, BENCH_FORMAT_CSV_STR))
+		return BENCH_FORMAT_CSV;
 
 	return BENCH_FORMAT_UNKNOWN;
 }
 
+static bool bench_format__structured(void)
+{
+	return bench_format == BENCH_FORMAT_JSON || bench_format == BENCH_FORMAT_CSV;
+}
+
+/*
+ * Run the benchmark in this process, counting the --counters events in the
+ * region it measures.
+ */
+static int bench__run(struct bench *bench, int argc, const char **argv)
+{
+	int ret = bench_counters__open();
+
+	if (ret)
+		return ret;
+
+	bench_counters__start();
+	ret = bench->fn(argc, argv);
+	bench_counters__stop();
+	if (!ret)
+		bench_counters__report();
+	bench_counters__close();
+
+	return ret;
+}
+
+/*
+ * Run the benchmark runs times, each in a child so the static state of the
+ * benchmarks starts afresh, collecting what they report with bench_report().
+ * For json and csv their own output is dropped, only the metrics are shown.
+ */
+static int run_bench_forked(const char *coll_name, struct bench *bench,
+			    unsigned int runs, int argc, const char **argv)
+{
+	struct bench_results *res = bench_results__new(coll_name, bench->name);
+	int fds[2], status, ret = 0;
+	unsigned int i;
+	pid_t pid;
+
+	if (res == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < runs && !ret; i++) {
+		if (pipe(fds)) {
+			ret = -errno;
+			break;
+		}
+
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0) {
+			ret = -errno;
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+
+		if (!pid) {
+			close(fds[0]);
+			if (bench_format__structured()) {
+				int null = open("/dev/null", O_WRONLY);
+
+				if (null >= 0)
+					dup2(null, STDOUT_FILENO);
+				bench_format = BENCH_FORMAT_SIMPLE;
+			}
+			bench_report__set_fd(fds[1]);
+			exit(bench__run(bench, argc, argv) ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+
+		close(fds[1]);
+		ret = bench_results__read(res, fds[0]);
+		if (waitpid(pid, &status, 0) < 0)
+			ret = -errno;
+		else if (!ret && (!WIFEXITED(status) || WEXITSTATUS(status)))
+			ret = 1;
+	}
+
+	bench_results__print_summary(res);
+	bench_results__delete(res);
+	return ret;
+}
+
 /*
  * Run a specific benchmark but first rename the running task's ->comm[]
  * to something meaningful:
  */
-static int run_bench(const char *coll_name, const char *bench_name, bench_fn_t fn,
+static int run_bench(const char *coll_name, struct bench *bench,
 		     int argc, const char **argv)
 {
+	unsigned int runs;
 	int size;
 	char *name;
 	int ret;
 
-	size = strlen(coll_name) + 1 + strlen(bench_name) + 1;
+	size = strlen(coll_name) + 1 + strlen(bench->name) + 1;
 
 	name = zalloc(size);
 	BUG_ON(!name);
 
-	scnprintf(name, size, "%s-%s", coll_name, bench_name);
+	scnprintf(name, size, "%s-%s", coll_name, bench->name);
 
 	prctl(PR_SET_NAME, name);
 	argv[0] = name;
 
-	ret = fn(argc, argv);
+	/* the benchmarks repeating themselves report each of their loops */
+	runs = bench->repeats ? 1 : bench_runs;
+	if (runs > 1 || bench_format__structured())
+		ret = run_bench_forked(coll_name, bench, runs, argc, argv);
+	else
+		ret = bench__run(bench, argc, argv);
 
 	free(name);
 
@@ -208,12 +344,14 @@ static void run_collection(struct collection *coll)
 	for_each_bench(coll, bench) {
 		if (!bench->fn)
 			break;
-		printf("# Running %s/%s benchmark...\n", coll->name, bench->name);
+		if (!bench_format__structured())
+			printf("# Running %s/%s benchmark...\n", coll->name, bench->name);
 		fflush(stdout);
 
 		argv[1] = bench->name;
-		run_bench(coll->name, bench->name, bench->fn, 1, argv);
-		printf("\n");
+		run_bench(coll->name, bench, 1, argv);
+		if (!bench_format__structured())
+			printf("\n");
 	}
 }
 
@@ -245,10 +383,15 @@ int cmd_bench(int argc, const char **argv)
 		goto end;
 	}
 
-	if (bench_repeat == 0) {
+	if (repeat_str == 0) {
 		printf("Invalid repeat option: Must specify a positive value\n");
 		goto end;
 	}
+	if (repeat_str != UINT_MAX)
+		bench_repeat = bench_runs = repeat_str;
+
+	if (bench_format == BENCH_FORMAT_CSV)
+		printf("collection,benchmark,metric,unit,repeat,value,stddev\n");
 
 	if (argc < 1) {
 		print_usage();
@@ -284,7 +427,7 @@ int cmd_bench(int argc, const char **argv)
 			if (bench_format == BENCH_FORMAT_DEFAULT)
 				printf("# Running '%s/%s' benchmark:\n", coll->name, bench->name);
 			fflush(stdout);
-			ret = run_bench(coll->name, bench->name, bench->fn, argc-1, argv+1);
+			ret = run_bench(coll->name, bench, argc-1, argv+1);
 			goto end;
 		}
 
@@ -24,6 +24,7 @@
 #include "util/build-id.h"
 #include "util/session.h"
 #include "util/symbol.h"
+#include "util/symcache.h"
 #include "util/time-utils.h"
 #include "util/probe-file.h"
 
@@ -186,6 +187,9 @@ static int build_id_cache__add_file(const char *filename, struct nsinfo *nsi)
 	build_id__sprintf(build_id, sizeof(build_id), sbuild_id);
 	err = build_id_cache__add_s(sbuild_id, filename, nsi,
 				    false, false);
+	if (!err && build_id_cache__add_symcache(build_id, sizeof(build_id),
+						 filename, nsi) < 0)
+		pr_debug("Couldn't write the symbol cache of %s\n", filename);
 	pr_debug("Adding %s %s: %s\n", sbuild_id, filename,
 		 err ? "FAIL" : "Ok");
 	return err;
@@ -319,6 +323,9 @@ static int build_id_cache__update_file(const char *filename, struct nsinfo *nsi)
 	if (!err)
 		err = build_id_cache__add_s(sbuild_id, filename, nsi, false,
 					    false);
+	if (!err && build_id_cache__add_symcache(build_id, sizeof(build_id),
+						 filename, nsi) < 0)
+		pr_debug("Couldn't write the symbol cache of %s\n", filename);
 
 	pr_debug("Updating %s %s: %s\n", sbuild_id, filename,
 		 err ? "FAIL" : "Ok");
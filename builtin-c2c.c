@@ -12,9 +12,14 @@
  */
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <linux/compiler.h>
 #include <linux/kernel.h>
 #include <linux/stringify.h>
+#include <linux/time64.h>
 #include <asm/bug.h>
 #include <sys/param.h>
 #include "util.h"
@@ -34,6 +39,11 @@
 #include "thread.h"
 #include "mem2node.h"
 #include "symbol.h"
+#include "cpumap.h"
+#include "parse-events.h"
+#include "term.h"
+#include "thread_map.h"
+#include "top.h"
 
 struct c2c_hists {
 	struct hists		hists;
@@ -88,6 +98,12 @@ struct perf_c2c {
 	bool			 stats_only;
 	bool			 symbol_full;
 
+	/* threads sorting the entries of the cachelines */
+	unsigned int		 nr_threads;
+
+	/* perf c2c top shows the cachelines, not what is in them */
+	bool			 lines_only;
+
 	/* HITM shared clines stats */
 	struct c2c_stats	hitm_stats;
 	int			shared_clines;
@@ -120,7 +136,7 @@ static const struct option c2c_options[] = {
 
 static struct perf_c2c c2c;
 
-static void *c2c_he_zalloc(size_t size)
+static void *c2c_he_zalloc(struct hists *hists __maybe_unused, size_t size)
 {
 	struct c2c_hist_entry *c2c_he;
 
@@ -147,13 +163,14 @@ static void *c2c_he_zalloc(size_t size)
 	return &c2c_he->he;
 }
 
-static void c2c_he_free(void *he)
+static void c2c_he_free(struct hists *hists __maybe_unused, void *he)
 {
 	struct c2c_hist_entry *c2c_he;
 
 	c2c_he = container_of(he, struct c2c_hist_entry, he);
 	if (c2c_he->hists) {
 		hists__delete_entries(&c2c_he->hists->hists);
+		hists__exit_alloc(&c2c_he->hists->hists);
 		free(c2c_he->hists);
 	}
 
@@ -299,7 +316,7 @@ static int process_sample_event(struct perf_tool *tool __maybe_unused,
 	hists__inc_nr_samples(&c2c_hists->hists, he->filtered);
 	ret = hist_entry__append_callchain(he, sample);
 
-	if (!ret) {
+	if (!ret && !c2c.lines_only) {
 		/*
 		 * There's already been warning about missing
 		 * sample's cpu value. Let's account all to
@@ -363,7 +380,7 @@ static struct perf_c2c c2c = {
 };
 
 static const char * const c2c_usage[] = {
-	"perf c2c {record|report}",
+	"perf c2c {record|report|top}",
 	NULL
 };
 
@@ -1970,16 +1987,24 @@ static void calc_width(struct c2c_hist_entry *c2c_he)
 	set_nodestr(c2c_he);
 }
 
+/*
+ * The srclines are looked up and the node column widths are shared by all
+ * the cachelines, which may be sorted on several threads.
+ */
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int filter_cb(struct hist_entry *he, void *arg __maybe_unused)
 {
 	struct c2c_hist_entry *c2c_he;
 
 	c2c_he = container_of(he, struct c2c_hist_entry, he);
 
+	pthread_mutex_lock(&filter_lock);
 	if (c2c.show_src && !he->srcline)
 		he->srcline = hist_entry__srcline(he);
 
 	calc_width(c2c_he);
+	pthread_mutex_unlock(&filter_lock);
 
 	if (!valid_hitm_or_store(he))
 		he->filtered = HIST_FILTER__C2C;
@@ -1987,8 +2012,107 @@ static int filter_cb(struct hist_entry *he, void *arg __maybe_unused)
 	return 0;
 }
 
-static int resort_cl_cb(struct hist_entry *he, void *arg __maybe_unused)
+static void resort_cacheline(struct c2c_hists *c2c_hists)
+{
+	hists__collapse_resort(&c2c_hists->hists, NULL);
+	hists__output_resort_cb(&c2c_hists->hists, NULL, filter_cb);
+}
+
+/* The cachelines to sort on c2c.nr_threads threads */
+struct c2c_lines {
+	struct c2c_hists	**hists;
+	unsigned int		nr;
+	unsigned int		alloc;
+};
+
+struct c2c_lines_worker {
+	struct c2c_lines	*lines;
+	unsigned int		shard;
+	unsigned int		nr_shards;
+};
+
+static int c2c_lines__add(struct c2c_lines *lines, struct c2c_hists *c2c_hists)
+{
+	if (lines->nr == lines->alloc) {
+		unsigned int alloc = lines->alloc ? lines->alloc * 2 : 1024;
+		struct c2c_hists **hists;
+
+		hists = realloc(lines->hists, alloc * sizeof(*hists));
+		if (hists == NULL)
+			return -ENOMEM;
+		lines->hists = hists;
+		lines->alloc = alloc;
+	}
+
+	lines->hists[lines->nr++] = c2c_hists;
+	return 0;
+}
+
+static void *c2c_lines_worker__run(void *arg)
+{
+	struct c2c_lines_worker *worker = arg;
+	unsigned int i;
+
+	/* the cachelines never share entries, each is sorted on its own */
+	for (i = worker->shard; i < worker->lines->nr; i += worker->nr_shards)
+		resort_cacheline(worker->lines->hists[i]);
+
+	return NULL;
+}
+
+static void c2c_lines__resort(struct c2c_lines *lines, unsigned int nr_threads)
+{
+	struct c2c_lines_worker *workers;
+	pthread_t *threads;
+	unsigned int i, started = 0;
+	bool singlethreaded = perf_singlethreaded;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (workers == NULL || threads == NULL) {
+		struct c2c_lines_worker worker = {
+			.lines	   = lines,
+			.nr_shards = 1,
+		};
+
+		c2c_lines_worker__run(&worker);
+		goto out_free;
+	}
+
+	perf_set_multithreaded();
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].lines     = lines;
+		workers[i].shard     = i;
+		workers[i].nr_shards = nr_threads;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, c2c_lines_worker__run,
+				   &workers[i])) {
+			/* the shards without a thread are done below */
+			break;
+		}
+		started = i;
+	}
+
+	c2c_lines_worker__run(&workers[0]);
+	for (i = started + 1; i < nr_threads; i++)
+		c2c_lines_worker__run(&workers[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (singlethreaded)
+		perf_set_singlethreaded();
+out_free:
+	free(workers);
+	free(threads);
+}
+
+static int resort_cl_cb(struct hist_entry *he, void *arg)
 {
+	struct c2c_lines *lines = arg;
 	struct c2c_hist_entry *c2c_he;
 	struct c2c_hists *c2c_hists;
 	bool display = he__display(he, &c2c.hitm_stats);
@@ -2004,8 +2128,8 @@ static int resort_cl_cb(struct hist_entry *he, void *arg __maybe_unused)
 
 		c2c_hists__reinit(c2c_hists, c2c.cl_output, c2c.cl_resort);
 
-		hists__collapse_resort(&c2c_hists->hists, NULL);
-		hists__output_resort_cb(&c2c_hists->hists, NULL, filter_cb);
+		if (lines == NULL || c2c_lines__add(lines, c2c_hists))
+			resort_cacheline(c2c_hists);
 	}
 
 	return 0;
@@ -2026,6 +2150,8 @@ static int setup_nodes(struct perf_session *session)
 	if (c2c.node_info > 2)
 		c2c.node_info = 2;
 
+	perf_env__read_feat(&session->header.env, HEADER_NUMA_TOPOLOGY);
+
 	c2c.nodes_cnt = session->header.env.nr_numa_nodes;
 	c2c.cpus_cnt  = session->header.env.nr_cpus_online;
 
@@ -2091,7 +2217,8 @@ static int resort_hitm_cb(struct hist_entry *he, void *arg __maybe_unused)
 	return 0;
 }
 
-static int hists__iterate_cb(struct hists *hists, hists__resort_cb_t cb)
+static int hists__iterate_cb(struct hists *hists, hists__resort_cb_t cb,
+			     void *arg)
 {
 	struct rb_node *next = rb_first_cached(&hists->entries);
 	int ret = 0;
@@ -2100,7 +2227,7 @@ static int hists__iterate_cb(struct hists *hists, hists__resort_cb_t cb)
 		struct hist_entry *he;
 
 		he = rb_entry(next, struct hist_entry, rb_node);
-		ret = cb(he, NULL);
+		ret = cb(he, arg);
 		if (ret)
 			break;
 		next = rb_next(&he->rb_node);
@@ -2397,6 +2524,7 @@ static int perf_c2c__browse_cacheline(struct hist_entry *he)
 	}
 
 out:
+	hist_browser__exit(&cl_browser->hb);
 	free(cl_browser);
 	return 0;
 }
@@ -2738,6 +2866,8 @@ static int perf_c2c__report(int argc, const char **argv)
 	OPT_STRING('c', "coalesce", &coalesce, "coalesce fields",
 		   "coalesce fields: pid,tid,iaddr,dso"),
 	OPT_BOOLEAN('f', "force", &symbol_conf.force, "don't complain, do it"),
+	OPT_UINTEGER(0, "threads", &c2c.nr_threads,
+		     "Sort the entries of the cachelines on N threads"),
 	OPT_PARENT(c2c_options),
 	OPT_END()
 	};
@@ -2837,7 +2967,15 @@ static int perf_c2c__report(int argc, const char **argv)
 
 	hists__collapse_resort(&c2c.hists.hists, NULL);
 	hists__output_resort_cb(&c2c.hists.hists, &prog, resort_hitm_cb);
-	hists__iterate_cb(&c2c.hists.hists, resort_cl_cb);
+	if (c2c.nr_threads > 1) {
+		struct c2c_lines lines = { .nr = 0, };
+
+		hists__iterate_cb(&c2c.hists.hists, resort_cl_cb, &lines);
+		c2c_lines__resort(&lines, c2c.nr_threads);
+		free(lines.hists);
+	} else {
+		hists__iterate_cb(&c2c.hists.hists, resort_cl_cb, NULL);
+	}
 
 	ui_progress__finish();
 
@@ -2960,6 +3098,506 @@ static int perf_c2c__record(int argc, const char **argv)
 	return ret;
 }
 
+/*
+ * The cost budgeted for each sample: the PMI, writing the PEBS record
+ * and the ring buffer event, what perf c2c top spends itself on top of
+ * it is measured.
+ */
+#define C2C_TOP_SAMPLE_NS	3000
+
+struct c2c_top {
+	struct record_opts	 opts;
+	struct perf_evlist	*evlist;
+	unsigned int		 delay_secs;
+	unsigned int		 print_entries;
+	/* percent of the monitored cpus the sampling may take */
+	double			 budget;
+	double			 overhead;
+	unsigned int		 freq;
+	unsigned int		 max_freq;
+	/* since the last refresh */
+	u64			 samples;
+	u64			 last_ns;
+	u64			 last_cpu_ns;
+	u64			 total_samples;
+};
+
+static volatile int c2c_top__done;
+
+static void c2c_top__sig(int sig __maybe_unused)
+{
+	c2c_top__done = 1;
+}
+
+static u64 c2c_top__now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* The cpu time perf itself used so far */
+static u64 c2c_top__cpu_ns(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NSEC_PER_SEC +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * NSEC_PER_USEC;
+}
+
+static void c2c_top__deliver(struct c2c_top *top, struct perf_session *session,
+			     union perf_event *event)
+{
+	struct machine *machine = &session->machines.host;
+	struct perf_sample sample;
+	struct perf_evsel *evsel;
+
+	if (perf_evlist__parse_sample(top->evlist, event, &sample)) {
+		pr_debug("Can't parse sample, skipping it.\n");
+		return;
+	}
+
+	if (event->header.type != PERF_RECORD_SAMPLE) {
+		if (event->header.type < PERF_RECORD_MAX)
+			machine__process_event(machine, event, &sample);
+		return;
+	}
+
+	/* the guests aren't resolved */
+	if (sample.cpumode != PERF_RECORD_MISC_USER &&
+	    sample.cpumode != PERF_RECORD_MISC_KERNEL)
+		return;
+
+	evsel = perf_evlist__id2evsel(top->evlist, sample.id);
+	if (evsel == NULL)
+		return;
+
+	top->samples++;
+	process_sample_event(&c2c.tool, event, &sample, evsel, machine);
+}
+
+static void c2c_top__mmap_read(struct c2c_top *top, struct perf_session *session)
+{
+	struct perf_evlist *evlist = top->evlist;
+	int i;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct perf_mmap *md = &evlist->mmap[i];
+		union perf_event *event;
+
+		if (perf_mmap__read_init(md) < 0)
+			continue;
+
+		while ((event = perf_mmap__read_event(md)) != NULL) {
+			c2c_top__deliver(top, session, event);
+			perf_mmap__consume(md);
+		}
+
+		perf_mmap__read_done(md);
+	}
+}
+
+/*
+ * Lower the sampling frequency when the samples of the last refresh
+ * period cost more than the budget, raise it back when there's room.
+ */
+static void c2c_top__update_budget(struct c2c_top *top, u64 now)
+{
+	int nr_cpus = cpu_map__nr(top->evlist->cpus);
+	u64 cpu_ns = c2c_top__cpu_ns();
+	u64 elapsed = now - top->last_ns;
+	unsigned int freq = top->freq;
+	struct perf_evsel *evsel;
+	double cost;
+
+	if (elapsed == 0)
+		return;
+
+	cost = top->samples * C2C_TOP_SAMPLE_NS + (cpu_ns - top->last_cpu_ns);
+	top->overhead = 100.0 * cost / ((double)elapsed * (nr_cpus > 0 ? nr_cpus : 1));
+
+	if (top->overhead > top->budget)
+		freq = freq * (top->budget / top->overhead);
+	else if (top->overhead < top->budget / 2)
+		freq = min(top->max_freq, freq * 2);
+	if (freq == 0)
+		freq = 1;
+
+	if (freq != top->freq) {
+		evlist__for_each_entry(top->evlist, evsel) {
+			if (perf_evsel__set_period(evsel, freq))
+				pr_debug("Couldn't set the %s frequency to %u\n",
+					 perf_evsel__name(evsel), freq);
+		}
+		top->freq = freq;
+	}
+
+	top->total_samples += top->samples;
+	top->samples = 0;
+	top->last_ns = now;
+	top->last_cpu_ns = cpu_ns;
+}
+
+static u32 c2c_he__display_hitm(struct c2c_hist_entry *c2c_he)
+{
+	switch (c2c.display) {
+	case DISPLAY_LCL:
+		return c2c_he->stats.lcl_hitm;
+	case DISPLAY_RMT:
+		return c2c_he->stats.rmt_hitm;
+	case DISPLAY_TOT:
+	default:
+		return c2c_he->stats.tot_hitm;
+	}
+}
+
+static int c2c_he__cmp_hitm(const void *a, const void *b)
+{
+	struct c2c_hist_entry *c2c_a = *(struct c2c_hist_entry **)a;
+	struct c2c_hist_entry *c2c_b = *(struct c2c_hist_entry **)b;
+	u32 hitm_a = c2c_he__display_hitm(c2c_a);
+	u32 hitm_b = c2c_he__display_hitm(c2c_b);
+
+	if (hitm_a != hitm_b)
+		return hitm_a < hitm_b ? 1 : -1;
+	return 0;
+}
+
+static void c2c_top__print(struct c2c_top *top, struct c2c_hist_entry **lines,
+			   unsigned int nr_lines, u32 hitms)
+{
+	unsigned int i, nr = nr_lines;
+
+	if (top->print_entries && nr > top->print_entries)
+		nr = top->print_entries;
+
+	puts(CONSOLE_CLEAR);
+	printf(" perf c2c top: %" PRIu64 " samples, %.2f%% overhead of %.2f%%, %u Hz, %u cachelines with %s HITMs\n\n",
+	       top->total_samples, top->overhead, top->budget, top->freq,
+	       nr_lines, display_str[c2c.display]);
+	printf(" %5s %7s %18s %7s %7s %7s %7s %7s %5s  %s\n",
+	       "Index", "Hitm", "Cacheline", "Tot", "Lcl", "Rmt",
+	       "Loads", "Stores", "Cpus", "Symbol");
+
+	for (i = 0; i < nr; i++) {
+		struct c2c_hist_entry *c2c_he = lines[i];
+		struct hist_entry *he = &c2c_he->he;
+
+		printf(" %5u %6.2f%% %#18" PRIx64 " %7u %7u %7u %7u %7u %5d  %s\n",
+		       i, hitms ? 100.0 * c2c_he__display_hitm(c2c_he) / hitms : 0.0,
+		       cl_address(he->mem_info->daddr.addr),
+		       c2c_he->stats.tot_hitm, c2c_he->stats.lcl_hitm,
+		       c2c_he->stats.rmt_hitm, c2c_he->stats.load,
+		       c2c_he->stats.store,
+		       bitmap_weight(c2c_he->cpuset, c2c.cpus_cnt),
+		       he->ms.sym ? he->ms.sym->name : "[unknown]");
+	}
+
+	fflush(stdout);
+}
+
+/*
+ * Show the cachelines with the most HITMs since the samples started
+ * to be taken, the counts decaying at each refresh so the lines that
+ * aren't contended anymore go down and away.
+ */
+static void c2c_top__refresh(struct c2c_top *top)
+{
+	struct hists *hists = &c2c.hists.hists;
+	struct c2c_hist_entry **lines;
+	struct rb_node *next;
+	unsigned int nr = 0;
+	u32 hitms = 0;
+
+	hists__output_resort(hists, NULL);
+
+	lines = calloc(hists->nr_entries ?: 1, sizeof(*lines));
+	if (lines != NULL) {
+		for (next = rb_first_cached(&hists->entries); next; next = rb_next(next)) {
+			struct hist_entry *he = rb_entry(next, struct hist_entry, rb_node);
+			struct c2c_hist_entry *c2c_he;
+
+			c2c_he = container_of(he, struct c2c_hist_entry, he);
+			if (!c2c_he__display_hitm(c2c_he))
+				continue;
+
+			hitms += c2c_he__display_hitm(c2c_he);
+			lines[nr++] = c2c_he;
+		}
+
+		qsort(lines, nr, sizeof(*lines), c2c_he__cmp_hitm);
+		c2c_top__print(top, lines, nr, hitms);
+		free(lines);
+	}
+
+	next = rb_first_cached(&hists->entries);
+	while (next) {
+		struct hist_entry *he = rb_entry(next, struct hist_entry, rb_node);
+		struct c2c_hist_entry *c2c_he;
+
+		c2c_he = container_of(he, struct c2c_hist_entry, he);
+		next = rb_next(next);
+
+		c2c_decay_stats(&c2c_he->stats);
+		if (!c2c_he->stats.nr_entries)
+			hists__delete_entry(hists, he);
+	}
+
+	c2c_decay_stats(&c2c.hists.stats);
+}
+
+static int c2c_top__start_counters(struct c2c_top *top)
+{
+	struct perf_evlist *evlist = top->evlist;
+	struct perf_evsel *evsel;
+	char msg[BUFSIZ];
+
+	perf_evlist__config(evlist, &top->opts, NULL);
+
+	evlist__for_each_entry(evlist, evsel) {
+try_again:
+		if (perf_evsel__open(evsel, evlist->cpus, evlist->threads) < 0) {
+			if (perf_evsel__fallback(evsel, errno, msg, sizeof(msg))) {
+				if (verbose > 0)
+					ui__warning("%s\n", msg);
+				goto try_again;
+			}
+
+			perf_evsel__open_strerror(evsel, &top->opts.target,
+						  errno, msg, sizeof(msg));
+			ui__error("%s\n", msg);
+			return -1;
+		}
+	}
+
+	if (perf_evlist__mmap(evlist, top->opts.mmap_pages) < 0) {
+		ui__error("Failed to mmap with %d (%s)\n",
+			  errno, str_error_r(errno, msg, sizeof(msg)));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_budget(const struct option *opt, const char *str,
+			int unset __maybe_unused)
+{
+	double *budget = (double *)opt->value;
+	char *end;
+
+	*budget = strtod(str, &end);
+	if (*end != '\0' || *budget <= 0 || *budget > 100) {
+		pr_err("Invalid budget: %s, it is a percentage\n", str);
+		return -1;
+	}
+
+	return 0;
+}
+
+static const char * const __usage_top[] = {
+	"perf c2c top [<options>]",
+	NULL
+};
+
+static int perf_c2c__top(int argc, const char **argv)
+{
+	struct c2c_top top = {
+		.delay_secs	= 2,
+		.budget		= 1.0,
+		.opts = {
+			.mmap_pages	= UINT_MAX,
+			.user_freq	= UINT_MAX,
+			.user_interval	= ULLONG_MAX,
+			.sample_address	= true,
+			.sample_weight	= true,
+			.sample_cpu	= true,
+			.target		= {
+				.uses_mmap   = true,
+			},
+		},
+	};
+	struct record_opts *opts = &top.opts;
+	struct target *target = &opts->target;
+	struct perf_session *session = NULL;
+	const char *display = NULL;
+	bool event_set = false;
+	char errbuf[BUFSIZ];
+	struct winsize ws;
+	const struct option options[] = {
+	OPT_CALLBACK('e', "event", &event_set, "event",
+		     "event selector. Use 'perf mem record -e list' to list available events",
+		     parse_record_events),
+	OPT_UINTEGER('l', "ldlat", &perf_mem_events__loads_ldlat, "setup mem-loads latency"),
+	OPT_BOOLEAN('u', "all-user", &opts->all_user, "collect only user level data"),
+	OPT_BOOLEAN('k', "all-kernel", &opts->all_kernel, "collect only kernel level data"),
+	OPT_BOOLEAN('a', "all-cpus", &target->system_wide,
+		    "system-wide collection from all CPUs"),
+	OPT_STRING('C', "cpu", &target->cpu_list, "cpu",
+		   "list of cpus to monitor"),
+	OPT_STRING('p', "pid", &target->pid, "pid",
+		   "profile events on existing process id"),
+	OPT_STRING('t', "tid", &target->tid, "tid",
+		   "profile events on existing thread id"),
+	OPT_STRING('d', "display", &display, "Switch HITM output type", "lcl,rmt"),
+	OPT_UINTEGER(0, "delay", &top.delay_secs,
+		     "number of seconds to delay between refreshes"),
+	OPT_UINTEGER(0, "entries", &top.print_entries,
+		     "number of cachelines to display"),
+	OPT_CALLBACK(0, "budget", &top.budget, "percent",
+		     "sampling overhead budget, in percent of the monitored cpus",
+		     parse_budget),
+	OPT_PARENT(c2c_options),
+	OPT_END()
+	};
+	int j, err = -1;
+
+	if (perf_mem_events__init()) {
+		pr_err("failed: memory events not supported\n");
+		return -1;
+	}
+
+	argc = parse_options(argc, argv, options, __usage_top, 0);
+	if (argc)
+		usage_with_options(__usage_top, options);
+
+	if (setup_display(display))
+		return -1;
+
+	if (top.delay_secs < 1)
+		top.delay_secs = 1;
+
+	if (!top.print_entries) {
+		get_term_dimensions(&ws);
+		top.print_entries = ws.ws_row > 4 ? ws.ws_row - 4 : 1;
+	}
+
+	top.evlist = perf_evlist__new();
+	if (top.evlist == NULL)
+		return -ENOMEM;
+
+	if (!event_set) {
+		perf_mem_events[PERF_MEM_EVENTS__LOAD].record  = true;
+		perf_mem_events[PERF_MEM_EVENTS__STORE].record = true;
+	}
+
+	for (j = 0; j < PERF_MEM_EVENTS__MAX; j++) {
+		if (!perf_mem_events[j].record)
+			continue;
+
+		if (!perf_mem_events[j].supported) {
+			pr_err("failed: event '%s' not supported\n",
+			       perf_mem_events[j].name);
+			goto out_delete;
+		}
+
+		if (parse_events(top.evlist, perf_mem_events__name(j), NULL)) {
+			pr_err("failed: can't add event '%s'\n",
+			       perf_mem_events[j].name);
+			goto out_delete;
+		}
+	}
+
+	/* each event on each cpu takes its share of the budget */
+	top.max_freq = top.budget / 100 * NSEC_PER_SEC / C2C_TOP_SAMPLE_NS /
+		       top.evlist->nr_entries;
+	opts->freq = top.max_freq ?: 1;
+
+	err = target__validate(target);
+	if (err) {
+		target__strerror(target, err, errbuf, BUFSIZ);
+		ui__warning("%s\n", errbuf);
+	}
+
+	if (target__none(target))
+		target->system_wide = true;
+
+	err = -1;
+	if (perf_evlist__create_maps(top.evlist, target) < 0) {
+		ui__error("Couldn't create thread/CPU maps: %s\n",
+			  errno == ENOENT ? "No such process" : str_error_r(errno, errbuf, sizeof(errbuf)));
+		goto out_delete;
+	}
+
+	/* this caps the frequency to what the kernel allows */
+	if (record_opts__config(opts))
+		goto out_delete;
+
+	top.max_freq = top.freq = opts->freq;
+
+	if (symbol__init(NULL) < 0)
+		goto out_delete;
+
+	session = perf_session__new(NULL, false, NULL);
+	if (session == NULL)
+		goto out_delete;
+
+	if (perf_env__read_numa_topology(&session->header.env)) {
+		pr_err("Failed to read the numa topology\n");
+		goto out_delete;
+	}
+
+	/* the cpus are bits in each cacheline's cpuset */
+	session->header.env.nr_cpus_online = cpu__max_cpu();
+
+	if (setup_nodes(session)) {
+		pr_err("Failed setup nodes\n");
+		goto out_delete;
+	}
+
+	if (c2c_hists__init(&c2c.hists, "dcacheline", 2)) {
+		pr_debug("Failed to initialize hists\n");
+		goto out_delete;
+	}
+
+	c2c.lines_only = true;
+
+	if (perf_session__register_idle_thread(session) < 0)
+		goto out_delete;
+
+	machine__synthesize_threads(&session->machines.host, target,
+				    top.evlist->threads, false, 1);
+
+	if (c2c_top__start_counters(&top))
+		goto out_delete;
+
+	session->evlist = top.evlist;
+	perf_session__set_id_hdr_size(session);
+
+	signal(SIGINT, c2c_top__sig);
+	signal(SIGTERM, c2c_top__sig);
+
+	top.last_ns = c2c_top__now_ns();
+	top.last_cpu_ns = c2c_top__cpu_ns();
+
+	perf_evlist__enable(top.evlist);
+
+	while (!c2c_top__done) {
+		u64 now;
+
+		c2c_top__mmap_read(&top, session);
+		perf_evlist__poll(top.evlist, 100);
+
+		now = c2c_top__now_ns();
+		if (now - top.last_ns >= top.delay_secs * NSEC_PER_SEC) {
+			c2c_top__update_budget(&top, now);
+			c2c_top__refresh(&top);
+		}
+	}
+
+	perf_evlist__disable(top.evlist);
+	err = 0;
+
+out_delete:
+	perf_evlist__delete(top.evlist);
+	if (session)
+		perf_session__delete(session);
+	return err;
+}
+
 int cmd_c2c(int argc, const char **argv)
 {
 	argc = parse_options(argc, argv, c2c_options, c2c_usage,
@@ -2972,6 +3610,8 @@ int cmd_c2c(int argc, const char **argv)
 		return perf_c2c__record(argc, argv);
 	} else if (!strncmp(argv[0], "rep", 3)) {
 		return perf_c2c__report(argc, argv);
+	} else if (!strcmp(argv[0], "top")) {
+		return perf_c2c__top(argc, argv);
 	} else {
 		usage_with_options(c2c_usage, c2c_options);
 	}
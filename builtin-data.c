@@ -6,6 +6,9 @@
 #include <subcmd/parse-options.h>
 #include "data-convert.h"
 #include "data-convert-bt.h"
+#include "data-convert-columnar.h"
+#include "data-sort.h"
+#include "data-split.h"
 
 typedef int (*data_cmd_fn_t)(int argc, const char **argv);
 
@@ -24,7 +27,7 @@ static const struct option data_options[] = {
 	OPT_END()
 };
 
-static const char * const data_subcommands[] = { "convert", NULL };
+static const char * const data_subcommands[] = { "convert", "sort", "split", "merge", NULL };
 
 static const char *data_usage[] = {
 	"perf data [<common options>] <command> [<options>]",
@@ -54,6 +57,7 @@ static const char * const data_convert_usage[] = {
 static int cmd_data_convert(int argc, const char **argv)
 {
 	const char *to_ctf     = NULL;
+	const char *to_columnar = NULL;
 	struct perf_data_convert_opts opts = {
 		.force = false,
 		.all = false,
@@ -64,16 +68,13 @@ static int cmd_data_convert(int argc, const char **argv)
 #ifdef HAVE_LIBBABELTRACE_SUPPORT
 		OPT_STRING(0, "to-ctf", &to_ctf, NULL, "Convert to CTF format"),
 #endif
+		OPT_STRING(0, "to-columnar", &to_columnar, NULL,
+			   "Convert the samples to columnar format"),
 		OPT_BOOLEAN('f', "force", &opts.force, "don't complain, do it"),
 		OPT_BOOLEAN(0, "all", &opts.all, "Convert all events"),
 		OPT_END()
 	};
 
-#ifndef HAVE_LIBBABELTRACE_SUPPORT
-	pr_err("No conversion support compiled in. perf should be compiled with environment variables LIBBABELTRACE=1 and LIBBABELTRACE_DIR=/path/to/libbabeltrace/\n");
-	return -1;
-#endif
-
 	argc = parse_options(argc, argv, options,
 			     data_convert_usage, 0);
 	if (argc) {
@@ -81,6 +82,10 @@ static int cmd_data_convert(int argc, const char **argv)
 		return -1;
 	}
 
+	if (to_columnar)
+		return columnar_convert__perf2columnar(input_name, to_columnar,
+						       &opts);
+
 	if (to_ctf) {
 #ifdef HAVE_LIBBABELTRACE_SUPPORT
 		return bt_convert__perf2ctf(input_name, to_ctf, &opts);
@@ -93,8 +98,93 @@ static int cmd_data_convert(int argc, const char **argv)
 	return 0;
 }
 
+static const char * const data_sort_usage[] = {
+	"perf data sort [<options>]",
+	NULL
+};
+
+static int cmd_data_sort(int argc, const char **argv)
+{
+	const char *output = NULL;
+	bool force = false;
+	const struct option options[] = {
+		OPT_INCR('v', "verbose", &verbose, "be more verbose"),
+		OPT_STRING('i', "input", &input_name, "file", "input file name"),
+		OPT_STRING('o', "output", &output, "file", "output file name"),
+		OPT_BOOLEAN('f', "force", &force, "don't complain, do it"),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, options, data_sort_usage, 0);
+	if (argc || !output) {
+		usage_with_options(data_sort_usage, options);
+		return -1;
+	}
+
+	return data_sort__sort(input_name ?: "perf.data", output, force);
+}
+
+static const char * const data_split_usage[] = {
+	"perf data split [<options>]",
+	NULL
+};
+
+static int cmd_data_split(int argc, const char **argv)
+{
+	struct data_split_opts opts = { .force = false, };
+	const char *output = NULL;
+	const struct option options[] = {
+		OPT_INCR('v', "verbose", &verbose, "be more verbose"),
+		OPT_STRING('i', "input", &input_name, "file", "input file name"),
+		OPT_STRING('o', "output", &output, "file", "output file name"),
+		OPT_STRING(0, "time", &opts.time_str, "str",
+			   "Time span of the samples kept (start,stop)"),
+		OPT_STRING('C', "cpu", &opts.cpu_list, "cpu", "list of cpus to keep"),
+		OPT_STRING(0, "pid", &opts.pid_list, "pid[,pid...]",
+			   "list of pids to keep the samples of"),
+		OPT_BOOLEAN('f', "force", &opts.force, "don't complain, do it"),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, options, data_split_usage, 0);
+	if (argc || !output) {
+		usage_with_options(data_split_usage, options);
+		return -1;
+	}
+
+	return data_split__split(input_name ?: "perf.data", output, &opts);
+}
+
+static const char * const data_merge_usage[] = {
+	"perf data merge [<options>] <file> <file>...",
+	NULL
+};
+
+static int cmd_data_merge(int argc, const char **argv)
+{
+	const char *output = NULL;
+	bool force = false;
+	const struct option options[] = {
+		OPT_INCR('v', "verbose", &verbose, "be more verbose"),
+		OPT_STRING('o', "output", &output, "file", "output file name"),
+		OPT_BOOLEAN('f', "force", &force, "don't complain, do it"),
+		OPT_END()
+	};
+
+	argc = parse_options(argc, argv, options, data_merge_usage, 0);
+	if (argc < 1 || !output) {
+		usage_with_options(data_merge_usage, options);
+		return -1;
+	}
+
+	return data_split__merge(argv, argc, output, force);
+}
+
 static struct data_cmd data_cmds[] = {
 	{ "convert", "converts data file between formats", cmd_data_convert },
+	{ "sort", "writes the events of a data file in time order", cmd_data_sort },
+	{ "split", "writes the samples of a time, cpus or pids to a data file", cmd_data_split },
+	{ "merge", "writes the events of data files to one", cmd_data_merge },
 	{ .name = NULL, },
 };
 
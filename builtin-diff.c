@@ -12,6 +12,8 @@
 #include "util/hist.h"
 #include "util/evsel.h"
 #include "util/evlist.h"
+#include "util/dso.h"
+#include "util/map.h"
 #include "util/session.h"
 #include "util/tool.h"
 #include "util/sort.h"
@@ -23,8 +25,11 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <math.h>
+#include <linux/hash.h>
 
 struct perf_diff {
 	struct perf_tool		 tool;
@@ -55,10 +60,29 @@ struct diff_hpp_fmt {
 	int			 header_width;
 };
 
+/* The periods of the (dso, symbol) pairs of a file, for --delta-threshold */
+struct diff_gate_entry {
+	struct dso		*dso;
+	struct symbol		*sym;
+	u64			 period;
+	bool			 used;
+};
+
+struct diff_gate {
+	struct diff_gate_entry	*entries;
+	unsigned int		 bits;
+	size_t			 nr;
+	u64			 total;
+};
+
 struct data__file {
 	struct perf_session	*session;
 	struct perf_data	 data;
+	/* the tool of the session, with the time ranges of this file */
+	struct perf_diff	 diff;
 	int			 idx;
+	int			 err;
+	struct diff_gate	 gate;
 	struct hists		*hists;
 	struct diff_hpp_fmt	 fmt[PERF_HPP_DIFF__MAX_INDEX];
 };
@@ -75,6 +99,8 @@ static int data__files_cnt;
 #define data__for_each_file_new(i, d) data__for_each_file_start(i, d, 1)
 
 static bool force;
+static bool diff_gate;
+static double delta_threshold;
 static bool show_period;
 static bool show_formula;
 static bool show_baseline_only;
@@ -382,6 +408,101 @@ out_put:
 	return ret;
 }
 
+#define DIFF_GATE_MIN_BITS	12
+
+static size_t diff_gate__slot(struct diff_gate *gate, struct dso *dso,
+			      struct symbol *sym)
+{
+	size_t mask = (1UL << gate->bits) - 1;
+	size_t i = hash_64((unsigned long)dso * 31 + (unsigned long)sym,
+			   gate->bits);
+
+	while (gate->entries[i].used &&
+	       (gate->entries[i].dso != dso || gate->entries[i].sym != sym))
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+static int diff_gate__grow(struct diff_gate *gate)
+{
+	struct diff_gate_entry *old = gate->entries;
+	size_t i, old_size = old ? 1UL << gate->bits : 0;
+
+	gate->bits = old ? gate->bits + 1 : DIFF_GATE_MIN_BITS;
+	gate->entries = calloc(1UL << gate->bits, sizeof(*gate->entries));
+	if (gate->entries == NULL) {
+		gate->entries = old;
+		gate->bits--;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].used)
+			gate->entries[diff_gate__slot(gate, old[i].dso,
+						      old[i].sym)] = old[i];
+	}
+
+	free(old);
+	return 0;
+}
+
+static int diff_gate__add(struct diff_gate *gate, struct addr_location *al,
+			  u64 period)
+{
+	struct dso *dso = al->map ? al->map->dso : NULL;
+	struct diff_gate_entry *entry;
+
+	if ((gate->entries == NULL || gate->nr >= (1UL << gate->bits) / 2) &&
+	    diff_gate__grow(gate))
+		return -ENOMEM;
+
+	entry = &gate->entries[diff_gate__slot(gate, dso, al->sym)];
+	if (!entry->used) {
+		entry->dso  = dso;
+		entry->sym  = al->sym;
+		entry->used = true;
+		gate->nr++;
+	}
+
+	entry->period += period;
+	gate->total   += period;
+	return 0;
+}
+
+/*
+ * Just sum the periods per (dso, symbol) when only the entries over the
+ * delta threshold are printed, there are no hists to build and collapse.
+ */
+static int diff__process_gate_sample_event(struct perf_tool *tool,
+					   union perf_event *event,
+					   struct perf_sample *sample,
+					   struct perf_evsel *evsel __maybe_unused,
+					   struct machine *machine)
+{
+	struct data__file *d = container_of(tool, struct data__file, diff.tool);
+	struct addr_location al;
+	int ret = 0;
+
+	if (perf_time__ranges_skip_sample(d->diff.ptime_range,
+					  d->diff.range_num, sample->time))
+		return 0;
+
+	if (machine__resolve(machine, &al, sample) < 0) {
+		pr_warning("problem processing %d event, skipping it.\n",
+			   event->header.type);
+		return -1;
+	}
+
+	if ((cpu_list && !test_bit(sample->cpu, cpu_bitmap)) || al.filtered)
+		goto out_put;
+
+	ret = diff_gate__add(&d->gate, &al, sample->period);
+out_put:
+	addr_location__put(&al);
+	return ret;
+}
+
 static struct perf_diff pdiff = {
 	.tool = {
 		.sample	= diff__process_sample_event,
@@ -835,9 +956,9 @@ static int parse_absolute_time(struct data__file *d, char **pstr)
 	}
 
 	ret = perf_time__parse_for_ranges(*pstr, d->session,
-					  &pdiff.ptime_range,
-					  &pdiff.range_size,
-					  &pdiff.range_num);
+					  &d->diff.ptime_range,
+					  &d->diff.range_size,
+					  &d->diff.range_num);
 	if (ret < 0)
 		return ret;
 
@@ -854,9 +975,9 @@ static int parse_percent_time(struct data__file *d)
 	int ret;
 
 	ret = perf_time__parse_for_ranges(pdiff.time_str, d->session,
-					  &pdiff.ptime_range,
-					  &pdiff.range_size,
-					  &pdiff.range_num);
+					  &d->diff.ptime_range,
+					  &d->diff.range_size,
+					  &d->diff.range_num);
 	return ret;
 }
 
@@ -873,6 +994,251 @@ static int parse_time_str(struct data__file *d, char *abstime_ostr,
 	return ret;
 }
 
+struct data__worker {
+	int	shard;
+	int	nr_shards;
+};
+
+static void *data__worker_run(void *arg)
+{
+	struct data__worker *worker = arg;
+	int i;
+
+	for (i = worker->shard; i < data__files_cnt; i += worker->nr_shards) {
+		struct data__file *d = &data__files[i];
+
+		d->err = perf_session__process_events(d->session);
+		if (d->err) {
+			pr_err("Failed to process %s\n", d->data.path);
+			continue;
+		}
+
+		perf_evlist__collapse_resort(d->session->evlist);
+	}
+
+	return NULL;
+}
+
+/* The sessions are independent, process the files on a pool of threads */
+static int data__process_files(void)
+{
+	struct data__worker *workers;
+	pthread_t *threads;
+	bool singlethreaded = perf_singlethreaded;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, nr_threads, started = 0;
+	struct data__file *d;
+
+	nr_threads = min_t(int, nr_cpus > 0 ? nr_cpus : 1, data__files_cnt);
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (nr_threads < 2 || workers == NULL || threads == NULL) {
+		struct data__worker worker = { .nr_shards = 1, };
+
+		data__worker_run(&worker);
+		goto out_free;
+	}
+
+	perf_set_multithreaded();
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].shard = i;
+		workers[i].nr_shards = nr_threads;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, data__worker_run,
+				   &workers[i])) {
+			/* the shards without a thread are done below */
+			break;
+		}
+		started = i;
+	}
+
+	data__worker_run(&workers[0]);
+	for (i = started + 1; i < nr_threads; i++)
+		data__worker_run(&workers[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (singlethreaded)
+		perf_set_singlethreaded();
+out_free:
+	free(workers);
+	free(threads);
+
+	data__for_each_file(i, d) {
+		if (d->err)
+			return d->err;
+	}
+	return 0;
+}
+
+/* A (dso, symbol) pair by name, summed over the pairs of all the files */
+struct diff_gate_sym {
+	u64			 hash;
+	const char		*dso;
+	const char		*sym;
+	u64			*periods;
+};
+
+struct diff_gate_offender {
+	struct diff_gate_sym	*gs;
+	int			 idx;
+	double			 delta;
+	double			 baseline;
+	double			 new;
+};
+
+static const char *diff_gate__dso_name(struct dso *dso)
+{
+	if (dso == NULL)
+		return "[unknown]";
+
+	return verbose > 0 ? dso->long_name : dso->short_name;
+}
+
+static u64 diff_gate__hash_str(u64 hash, const char *s)
+{
+	/* FNV-1a */
+	for (; *s; s++)
+		hash = (hash ^ (u8)*s) * 1099511628211ULL;
+	return hash;
+}
+
+static struct diff_gate_sym *diff_gate__find(struct diff_gate_sym *syms,
+					     size_t mask, const char *dso,
+					     const char *sym)
+{
+	u64 hash = diff_gate__hash_str(14695981039346656037ULL, dso);
+	size_t i;
+
+	hash = diff_gate__hash_str(hash ^ '\n', sym);
+
+	for (i = hash & mask; syms[i].dso; i = (i + 1) & mask) {
+		if (syms[i].hash == hash && !strcmp(syms[i].dso, dso) &&
+		    !strcmp(syms[i].sym, sym))
+			return &syms[i];
+	}
+
+	syms[i].hash = hash;
+	syms[i].dso  = dso;
+	syms[i].sym  = sym;
+	return &syms[i];
+}
+
+static int diff_gate__offender_cmp(const void *a, const void *b)
+{
+	const struct diff_gate_offender *oa = a, *ob = b;
+
+	if (oa->idx != ob->idx)
+		return oa->idx - ob->idx;
+	if (fabs(oa->delta) != fabs(ob->delta))
+		return fabs(oa->delta) < fabs(ob->delta) ? 1 : -1;
+	return strcmp(oa->gs->sym, ob->gs->sym);
+}
+
+static double diff_gate__percent(struct data__file *d, u64 period)
+{
+	return d->gate.total ? 100.0 * period / d->gate.total : 0.0;
+}
+
+/*
+ * Print one line per (dso, symbol) pair whose share of the samples of a
+ * data file moved by at least delta_threshold percent from the baseline:
+ *
+ *   file index, delta, baseline %, new %, dso, symbol
+ *
+ * Returns 1 if there was any, for the exit status.
+ */
+static int diff_gate__report(void)
+{
+	struct diff_gate_offender *offenders = NULL;
+	struct diff_gate_sym *syms;
+	const char *sep = symbol_conf.field_sep ?: "\t";
+	size_t nr = 0, size = 16, mask, i, j, nr_offenders = 0;
+	u64 *periods;
+	struct data__file *d;
+	int ret = -ENOMEM, k;
+
+	data__for_each_file(k, d)
+		nr += d->gate.nr;
+
+	while (size < 2 * nr)
+		size <<= 1;
+	mask = size - 1;
+
+	syms = calloc(size, sizeof(*syms));
+	periods = calloc(size * data__files_cnt, sizeof(*periods));
+	if (syms == NULL || periods == NULL)
+		goto out_free;
+
+	data__for_each_file(k, d) {
+		for (i = 0; d->gate.entries && i < (1UL << d->gate.bits); i++) {
+			struct diff_gate_entry *entry = &d->gate.entries[i];
+			struct diff_gate_sym *gs;
+
+			if (!entry->used)
+				continue;
+
+			gs = diff_gate__find(syms, mask,
+					     diff_gate__dso_name(entry->dso),
+					     entry->sym ? entry->sym->name : "[unknown]");
+			gs->periods = &periods[(gs - syms) * data__files_cnt];
+			gs->periods[k] += entry->period;
+		}
+	}
+
+	offenders = calloc(size * data__files_cnt, sizeof(*offenders));
+	if (offenders == NULL)
+		goto out_free;
+
+	for (i = 0; i < size; i++) {
+		struct diff_gate_sym *gs = &syms[i];
+		double baseline;
+
+		if (gs->dso == NULL)
+			continue;
+
+		baseline = diff_gate__percent(&data__files[0], gs->periods[0]);
+
+		data__for_each_file_new(k, d) {
+			double new = diff_gate__percent(d, gs->periods[k]);
+
+			if (fabs(new - baseline) < delta_threshold)
+				continue;
+
+			offenders[nr_offenders++] = (struct diff_gate_offender) {
+				.gs	  = gs,
+				.idx	  = k,
+				.delta	  = new - baseline,
+				.baseline = baseline,
+				.new	  = new,
+			};
+		}
+	}
+
+	qsort(offenders, nr_offenders, sizeof(*offenders),
+	      diff_gate__offender_cmp);
+
+	for (j = 0; j < nr_offenders; j++) {
+		struct diff_gate_offender *o = &offenders[j];
+
+		printf("%d%s%+.4f%s%.4f%s%.4f%s%s%s%s\n", o->idx, sep,
+		       o->delta, sep, o->baseline, sep, o->new, sep,
+		       o->gs->dso, sep, o->gs->sym);
+	}
+
+	ret = nr_offenders ? 1 : 0;
+out_free:
+	free(offenders);
+	free(periods);
+	free(syms);
+	return ret;
+}
+
 static int __cmd_diff(void)
 {
 	struct data__file *d;
@@ -886,8 +1252,12 @@ static int __cmd_diff(void)
 	abstime_tmp = abstime_ostr;
 	ret = -EINVAL;
 
+	if (diff_gate)
+		pdiff.tool.sample = diff__process_gate_sample_event;
+
 	data__for_each_file(i, d) {
-		d->session = perf_session__new(&d->data, false, &pdiff.tool);
+		d->diff = pdiff;
+		d->session = perf_session__new(&d->data, false, &d->diff.tool);
 		if (!d->session) {
 			pr_err("Failed to open %s\n", d->data.path);
 			ret = -1;
@@ -906,38 +1276,48 @@ static int __cmd_diff(void)
 			if (ret < 0)
 				goto out_delete;
 		}
-
-		ret = perf_session__process_events(d->session);
-		if (ret) {
-			pr_err("Failed to process %s\n", d->data.path);
-			goto out_delete;
-		}
-
-		perf_evlist__collapse_resort(d->session->evlist);
-
-		if (pdiff.ptime_range)
-			zfree(&pdiff.ptime_range);
 	}
 
-	data_process();
+	ret = data__process_files();
+	if (ret)
+		goto out_delete;
+
+	if (diff_gate)
+		ret = diff_gate__report();
+	else
+		data_process();
 
  out_delete:
 	data__for_each_file(i, d) {
 		perf_session__delete(d->session);
+		zfree(&d->diff.ptime_range);
+		zfree(&d->gate.entries);
 		data__free(d);
 	}
 
 	free(data__files);
 
-	if (pdiff.ptime_range)
-		zfree(&pdiff.ptime_range);
-
 	if (abstime_ostr)
 		free(abstime_ostr);
 
 	return ret;
 }
 
+static int parse_delta_threshold(const struct option *opt __maybe_unused,
+				 const char *str, int unset __maybe_unused)
+{
+	char *end;
+
+	delta_threshold = strtod(str, &end);
+	if (end == str || *end || delta_threshold < 0) {
+		pr_err("Invalid delta threshold: %s\n", str);
+		return -1;
+	}
+
+	diff_gate = true;
+	return 0;
+}
+
 static const char * const diff_usage[] = {
 	"perf diff [<options>] [old_file] [new_file]",
 	NULL,
@@ -989,6 +1369,9 @@ static const struct option options[] = {
 		   "only consider symbols in these pids"),
 	OPT_STRING(0, "tid", &symbol_conf.tid_list_str, "tid[,tid...]",
 		   "only consider symbols in these tids"),
+	OPT_CALLBACK(0, "delta-threshold", NULL, "percent",
+		     "Only print the dso,symbol pairs whose share moved by at least percent",
+		     parse_delta_threshold),
 	OPT_END()
 };
 
@@ -9,11 +9,18 @@
 #include "builtin.h"
 #include "perf.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/stat.h>
+#include <linux/time64.h>
+#include <traceevent/event-parse.h>
+#include <traceevent/kbuffer.h>
 
 #include "debug.h"
 #include <subcmd/parse-options.h>
@@ -23,6 +30,8 @@
 #include "cpumap.h"
 #include "thread_map.h"
 #include "util/config.h"
+#include "util/trace-event.h"
+#include "util/util.h"
 
 
 #define DEFAULT_TRACER  "function_graph"
@@ -36,6 +45,9 @@ struct perf_ftrace {
 	struct list_head	graph_funcs;
 	struct list_head	nograph_funcs;
 	int			graph_depth;
+	/* the directory the raw buffers are written to or read from */
+	const char		*output;
+	const char		*input;
 };
 
 struct filter_entry {
@@ -44,6 +56,8 @@ struct filter_entry {
 };
 
 static bool done;
+/* the raw buffer readers drain what is left and exit */
+static volatile bool readers_stop;
 
 static void sig_handler(int sig __maybe_unused)
 {
@@ -273,6 +287,524 @@ static int set_tracing_depth(struct perf_ftrace *ftrace)
 	return 0;
 }
 
+/* The tracefs files needed to format the raw buffers offline */
+static const struct {
+	const char	*name;
+	const char	*file;
+} ftrace_meta_files[] = {
+	{ "events/header_page",	"header_page",	  },
+	{ "printk_formats",	"printk_formats", },
+	{ "saved_cmdlines",	"saved_cmdlines", },
+};
+
+struct ftrace_reader {
+	int		cpu;
+	int		raw_fd;
+	int		out_fd;
+	int		pipe[2];
+	pthread_t	thread;
+	u64		bytes;
+	int		err;
+};
+
+static int ftrace__copy_tracing_file(const char *name, const char *to)
+{
+	char *file = get_tracing_file(name);
+	int err;
+
+	if (file == NULL)
+		return -1;
+
+	err = copyfile_mode(file, to, 0644);
+	if (err)
+		pr_err("failed to save %s\n", file);
+	put_tracing_file(file);
+	return err;
+}
+
+/* What the ftrace events look like, and the symbols and comms they refer to */
+static int ftrace__save_meta(struct perf_ftrace *ftrace)
+{
+	char path[PATH_MAX], *events;
+	struct dirent *dent;
+	unsigned int i;
+	DIR *dir;
+	int err = 0;
+
+	scnprintf(path, sizeof(path), "%s/ftrace", ftrace->output);
+	if (mkdir_p(path, 0755)) {
+		pr_err("failed to create %s\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ftrace_meta_files); i++) {
+		scnprintf(path, sizeof(path), "%s/%s", ftrace->output,
+			  ftrace_meta_files[i].file);
+		if (ftrace__copy_tracing_file(ftrace_meta_files[i].name, path))
+			return -1;
+	}
+
+	scnprintf(path, sizeof(path), "%s/kallsyms", ftrace->output);
+	if (copyfile_mode("/proc/kallsyms", path, 0644)) {
+		pr_err("failed to save /proc/kallsyms\n");
+		return -1;
+	}
+
+	events = get_tracing_file("events/ftrace");
+	if (events == NULL)
+		return -1;
+
+	dir = opendir(events);
+	if (dir == NULL) {
+		pr_err("failed to open %s\n", events);
+		put_tracing_file(events);
+		return -1;
+	}
+
+	while (!err && (dent = readdir(dir)) != NULL) {
+		char name[PATH_MAX];
+
+		if (dent->d_type != DT_DIR || dent->d_name[0] == '.')
+			continue;
+
+		scnprintf(name, sizeof(name), "events/ftrace/%s/format",
+			  dent->d_name);
+		scnprintf(path, sizeof(path), "%s/ftrace/%s", ftrace->output,
+			  dent->d_name);
+		err = ftrace__copy_tracing_file(name, path);
+	}
+
+	closedir(dir);
+	put_tracing_file(events);
+	return err;
+}
+
+static int ftrace_reader__write(struct ftrace_reader *reader, void *buf,
+				size_t size)
+{
+	if (writen(reader->out_fd, buf, size) != (ssize_t)size)
+		return -errno;
+
+	reader->bytes += size;
+	return 0;
+}
+
+/*
+ * The buffer pages go from the ring buffer to the file through a pipe
+ * without being copied, what is left once tracing is off is read.
+ */
+static void *ftrace_reader__run(void *arg)
+{
+	struct ftrace_reader *reader = arg;
+	struct pollfd pollfd = {
+		.fd	= reader->raw_fd,
+		.events = POLLIN,
+	};
+	void *page;
+	ssize_t n;
+
+	while (!readers_stop) {
+		if (poll(&pollfd, 1, 100) <= 0)
+			continue;
+
+		n = splice(reader->raw_fd, NULL, reader->pipe[1], NULL,
+			   page_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n <= 0)
+			break;
+
+		while (n > 0) {
+			ssize_t m = splice(reader->pipe[0], NULL,
+					   reader->out_fd, NULL, n,
+					   SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				reader->err = -errno;
+				return NULL;
+			}
+			reader->bytes += m;
+			n -= m;
+		}
+	}
+
+	page = malloc(page_size);
+	if (page == NULL) {
+		reader->err = -ENOMEM;
+		return NULL;
+	}
+
+	/* the partially filled pages, padded to a page each */
+	while ((n = read(reader->raw_fd, page, page_size)) > 0) {
+		memset(page + n, 0, page_size - n);
+		reader->err = ftrace_reader__write(reader, page, page_size);
+		if (reader->err)
+			break;
+	}
+
+	free(page);
+	return NULL;
+}
+
+static void ftrace_reader__exit(struct ftrace_reader *reader)
+{
+	if (reader->raw_fd >= 0)
+		close(reader->raw_fd);
+	if (reader->out_fd >= 0)
+		close(reader->out_fd);
+	if (reader->pipe[0] >= 0) {
+		close(reader->pipe[0]);
+		close(reader->pipe[1]);
+	}
+}
+
+static int ftrace_reader__init(struct ftrace_reader *reader,
+			       struct perf_ftrace *ftrace, int cpu)
+{
+	char name[64], path[PATH_MAX], *file;
+
+	reader->cpu = cpu;
+
+	scnprintf(name, sizeof(name), "per_cpu/cpu%d/trace_pipe_raw", cpu);
+	file = get_tracing_file(name);
+	if (file == NULL)
+		return -1;
+
+	reader->raw_fd = open(file, O_RDONLY | O_NONBLOCK);
+	put_tracing_file(file);
+	if (reader->raw_fd < 0) {
+		pr_err("failed to open %s\n", name);
+		return -1;
+	}
+
+	scnprintf(path, sizeof(path), "%s/cpu%d", ftrace->output, cpu);
+	reader->out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (reader->out_fd < 0) {
+		pr_err("failed to create %s\n", path);
+		return -1;
+	}
+
+	if (pipe(reader->pipe)) {
+		reader->pipe[0] = reader->pipe[1] = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ftrace__record_raw(struct perf_ftrace *ftrace)
+{
+	struct cpu_map *cpus;
+	struct ftrace_reader *readers;
+	int i, started = 0, err = -1;
+	u64 bytes = 0;
+
+	if (ftrace__save_meta(ftrace))
+		return -1;
+
+	if (ftrace->target.cpu_list)
+		cpus = cpu_map__get(ftrace->evlist->cpus);
+	else
+		cpus = cpu_map__new(NULL);
+	if (cpus == NULL)
+		return -1;
+
+	readers = calloc(cpus->nr, sizeof(*readers));
+	if (readers == NULL)
+		goto out_put;
+
+	for (i = 0; i < cpus->nr; i++) {
+		readers[i].raw_fd = readers[i].out_fd = -1;
+		readers[i].pipe[0] = readers[i].pipe[1] = -1;
+	}
+
+	for (i = 0; i < cpus->nr; i++) {
+		if (ftrace_reader__init(&readers[i], ftrace, cpus->map[i]))
+			goto out_exit;
+	}
+
+	for (started = 0; started < cpus->nr; started++) {
+		if (pthread_create(&readers[started].thread, NULL,
+				   ftrace_reader__run, &readers[started])) {
+			pr_err("failed to start the buffer readers\n");
+			goto out_stop;
+		}
+	}
+
+	if (write_tracing_file("tracing_on", "1") < 0) {
+		pr_err("can't enable tracing\n");
+		goto out_stop;
+	}
+
+	perf_evlist__start_workload(ftrace->evlist);
+
+	while (!done)
+		poll(NULL, 0, 100);
+
+	write_tracing_file("tracing_on", "0");
+	err = 0;
+out_stop:
+	readers_stop = true;
+	for (i = 0; i < started; i++) {
+		pthread_join(readers[i].thread, NULL);
+		if (readers[i].err) {
+			pr_err("failed to save the buffer of cpu%d\n",
+			       readers[i].cpu);
+			err = -1;
+		}
+		bytes += readers[i].bytes;
+	}
+
+	if (!err)
+		fprintf(stderr, "Wrote %" PRIu64 " bytes of trace buffers to %s\n",
+			bytes, ftrace->output);
+out_exit:
+	for (i = 0; i < cpus->nr; i++)
+		ftrace_reader__exit(&readers[i]);
+	free(readers);
+out_put:
+	cpu_map__put(cpus);
+	return err;
+}
+
+/* A cpu buffer written by ftrace__record_raw(), read a page at a time */
+struct ftrace_cpu_buf {
+	int			cpu;
+	int			fd;
+	void			*page;
+	struct kbuffer		*kbuf;
+	void			*data;
+	unsigned long long	ts;
+};
+
+static void ftrace_cpu_buf__next(struct ftrace_cpu_buf *buf, bool first)
+{
+	if (!first)
+		buf->data = kbuffer_next_event(buf->kbuf, &buf->ts);
+
+	while (buf->data == NULL) {
+		if (readn(buf->fd, buf->page, page_size) != (ssize_t)page_size)
+			return;
+
+		if (kbuffer_load_subbuffer(buf->kbuf, buf->page))
+			continue;
+		buf->data = kbuffer_read_event(buf->kbuf, &buf->ts);
+	}
+}
+
+static char *ftrace__read_file(struct perf_ftrace *ftrace, const char *name,
+			       size_t *sizep)
+{
+	char path[PATH_MAX], *buf;
+	struct stat st;
+	int fd;
+
+	scnprintf(path, sizeof(path), "%s/%s", ftrace->input, name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("failed to open %s\n", path);
+		return NULL;
+	}
+
+	buf = NULL;
+	if (fstat(fd, &st) == 0) {
+		buf = malloc(st.st_size + 1);
+		if (buf && readn(fd, buf, st.st_size) != st.st_size)
+			zfree(&buf);
+	}
+	close(fd);
+
+	if (buf) {
+		buf[st.st_size] = '\0';
+		*sizep = st.st_size;
+	}
+	return buf;
+}
+
+static void ftrace__parse_kallsyms(struct tep_handle *tep, char *file)
+{
+	char *line, *next = NULL;
+
+	for (line = strtok_r(file, "\n", &next); line;
+	     line = strtok_r(NULL, "\n", &next)) {
+		char type, name[256], mod[64] = "";
+		unsigned long long addr;
+
+		if (sscanf(line, "%llx %c %255s [%63[^]]]", &addr, &type,
+			   name, mod) < 3)
+			continue;
+		tep_register_function(tep, name, addr, mod[0] ? mod : NULL);
+	}
+}
+
+static int ftrace__parse_meta(struct perf_ftrace *ftrace, struct tep_handle *tep)
+{
+	char path[PATH_MAX], *buf;
+	struct dirent *dent;
+	size_t size;
+	DIR *dir;
+
+	tep_set_long_size(tep, sizeof(long));
+	tep_set_page_size(tep, page_size);
+
+	buf = ftrace__read_file(ftrace, "header_page", &size);
+	if (buf == NULL)
+		return -1;
+	if (!tep_parse_header_page(tep, buf, size, sizeof(long)))
+		tep_set_long_size(tep, tep_get_header_page_size(tep));
+	free(buf);
+
+	buf = ftrace__read_file(ftrace, "printk_formats", &size);
+	if (buf)
+		parse_ftrace_printk(tep, buf, size);
+	free(buf);
+
+	buf = ftrace__read_file(ftrace, "saved_cmdlines", &size);
+	if (buf)
+		parse_saved_cmdline(tep, buf, size);
+	free(buf);
+
+	buf = ftrace__read_file(ftrace, "kallsyms", &size);
+	if (buf)
+		ftrace__parse_kallsyms(tep, buf);
+	free(buf);
+
+	scnprintf(path, sizeof(path), "%s/ftrace", ftrace->input);
+	dir = opendir(path);
+	if (dir == NULL) {
+		pr_err("failed to open %s\n", path);
+		return -1;
+	}
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_name[0] == '.')
+			continue;
+
+		scnprintf(path, sizeof(path), "ftrace/%s", dent->d_name);
+		buf = ftrace__read_file(ftrace, path, &size);
+		if (buf && parse_ftrace_file(tep, buf, size))
+			pr_debug("failed to parse the format of %s\n", dent->d_name);
+		free(buf);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static void ftrace__print_event(struct tep_handle *tep,
+				struct ftrace_cpu_buf *buf)
+{
+	struct tep_record record = {
+		.ts   = buf->ts,
+		.cpu  = buf->cpu,
+		.data = buf->data,
+		.size = kbuffer_event_size(buf->kbuf),
+	};
+	struct tep_event *event;
+
+	event = tep_find_event(tep, tep_data_type(tep, &record));
+
+	printf(" %3d) %5llu.%06llu: ", buf->cpu, buf->ts / NSEC_PER_SEC,
+	       (buf->ts % NSEC_PER_SEC) / NSEC_PER_USEC);
+	if (event == NULL) {
+		printf("unknown event %d\n", tep_data_type(tep, &record));
+		return;
+	}
+
+	printf("%s: ", event->name);
+	event_format__fprintf(event, buf->cpu, buf->data, record.size, stdout);
+	printf("\n");
+}
+
+/* Format the buffers written with --output, in time order */
+static int ftrace__show_raw(struct perf_ftrace *ftrace)
+{
+	enum kbuffer_long_size lsize = sizeof(long) == 8 ? KBUFFER_LSIZE_8 :
+							      KBUFFER_LSIZE_4;
+	enum kbuffer_endian endian = tep_host_bigendian() ? KBUFFER_ENDIAN_BIG :
+							     KBUFFER_ENDIAN_LITTLE;
+	struct ftrace_cpu_buf *bufs = NULL;
+	struct tep_handle *tep;
+	struct dirent *dent;
+	int i, nr = 0, err = -1;
+	DIR *dir;
+
+	tep = tep_alloc();
+	if (tep == NULL)
+		return -ENOMEM;
+
+	if (ftrace__parse_meta(ftrace, tep))
+		goto out_free;
+
+	dir = opendir(ftrace->input);
+	if (dir == NULL)
+		goto out_free;
+
+	while ((dent = readdir(dir)) != NULL) {
+		char path[PATH_MAX];
+		struct ftrace_cpu_buf *buf;
+		int cpu;
+
+		if (sscanf(dent->d_name, "cpu%d", &cpu) != 1)
+			continue;
+
+		buf = realloc(bufs, (nr + 1) * sizeof(*bufs));
+		if (buf == NULL)
+			break;
+		bufs = buf;
+		buf = &bufs[nr];
+
+		memset(buf, 0, sizeof(*buf));
+		buf->cpu = cpu;
+		scnprintf(path, sizeof(path), "%s/%s", ftrace->input,
+			  dent->d_name);
+		buf->fd = open(path, O_RDONLY);
+		buf->page = malloc(page_size);
+		buf->kbuf = kbuffer_alloc(lsize, endian);
+		nr++;
+
+		if (buf->fd < 0 || buf->page == NULL || buf->kbuf == NULL) {
+			pr_err("failed to read %s\n", path);
+			closedir(dir);
+			goto out_close;
+		}
+		ftrace_cpu_buf__next(buf, true);
+	}
+	closedir(dir);
+
+	setup_pager();
+
+	while (!done) {
+		struct ftrace_cpu_buf *first = NULL;
+
+		for (i = 0; i < nr; i++) {
+			if (bufs[i].data &&
+			    (first == NULL || bufs[i].ts < first->ts))
+				first = &bufs[i];
+		}
+		if (first == NULL)
+			break;
+
+		ftrace__print_event(tep, first);
+		ftrace_cpu_buf__next(first, false);
+	}
+	err = 0;
+
+out_close:
+	for (i = 0; i < nr; i++) {
+		if (bufs[i].fd >= 0)
+			close(bufs[i].fd);
+		free(bufs[i].page);
+		if (bufs[i].kbuf)
+			kbuffer_free(bufs[i].kbuf);
+	}
+	free(bufs);
+out_free:
+	tep_free(tep);
+	return err;
+}
+
 static int __cmd_ftrace(struct perf_ftrace *ftrace, int argc, const char **argv)
 {
 	char *trace_file;
@@ -332,6 +864,12 @@ static int __cmd_ftrace(struct perf_ftrace *ftrace, int argc, const char **argv)
 		goto out_reset;
 	}
 
+	if (ftrace->output) {
+		if (ftrace__record_raw(ftrace))
+			done = false;
+		goto out_reset;
+	}
+
 	setup_pager();
 
 	trace_file = get_tracing_file("trace_pipe");
@@ -470,6 +1008,10 @@ int cmd_ftrace(int argc, const char **argv)
 		     "Set nograph filter on given functions", parse_filter_func),
 	OPT_INTEGER('D', "graph-depth", &ftrace.graph_depth,
 		    "Max depth for function graph tracer"),
+	OPT_STRING('o', "output", &ftrace.output, "dir",
+		   "save the binary per cpu buffers to dir"),
+	OPT_STRING('i', "input", &ftrace.input, "dir",
+		   "show what was saved with --output"),
 	OPT_END()
 	};
 
@@ -484,6 +1026,14 @@ int cmd_ftrace(int argc, const char **argv)
 
 	argc = parse_options(argc, argv, ftrace_options, ftrace_usage,
 			    PARSE_OPT_STOP_AT_NON_OPTION);
+
+	if (ftrace.input) {
+		signal(SIGINT, sig_handler);
+		signal(SIGPIPE, sig_handler);
+		ret = ftrace__show_raw(&ftrace);
+		goto out_delete_filters;
+	}
+
 	if (!argc && target__none(&ftrace.target))
 		usage_with_options(ftrace_usage, ftrace_options);
 
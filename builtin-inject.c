@@ -22,13 +22,19 @@
 #include "util/jit.h"
 #include "util/symbol.h"
 #include "util/thread.h"
+#include "util/intlist.h"
+#include "util/map_groups.h"
 
 #include <subcmd/parse-options.h>
 
 #include <linux/list.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 
+/* The repiped events are written in chunks of up to that much */
+#define INJECT_BUF_SIZE		(256 << 10)
+
 struct perf_inject {
 	struct perf_tool	tool;
 	struct perf_session	*session;
@@ -37,12 +43,20 @@ struct perf_inject {
 	bool			have_auxtrace;
 	bool			strip;
 	bool			jit_mode;
+	bool			lazy_mmaps;
 	const char		*input_name;
 	struct perf_data	output;
 	u64			bytes_written;
+	/* repiped and not yet written */
+	void			*out_buf;
+	size_t			out_len;
 	u64			aux_id;
 	struct list_head	samples;
 	struct itrace_synth_opts itrace_synth_opts;
+	/* for --lazy-mmaps, the pids already looked at and the sample being */
+	struct intlist		*lazy_pids;
+	union perf_event	*lazy_event;
+	struct perf_sample	*lazy_sample;
 };
 
 struct event_entry {
@@ -51,15 +65,46 @@ struct event_entry {
 	union perf_event event[0];
 };
 
+static int output_write(struct perf_inject *inject, void *buf, size_t sz)
+{
+	if (perf_data__write(&inject->output, buf, sz) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Needed before anything writes to the output file descriptor directly */
+static int output_flush(struct perf_inject *inject)
+{
+	int ret;
+
+	if (inject->out_len == 0)
+		return 0;
+
+	ret = output_write(inject, inject->out_buf, inject->out_len);
+	inject->out_len = 0;
+	return ret;
+}
+
 static int output_bytes(struct perf_inject *inject, void *buf, size_t sz)
 {
-	ssize_t size;
+	int ret;
 
-	size = perf_data__write(&inject->output, buf, sz);
-	if (size < 0)
-		return -errno;
+	if (inject->out_len + sz > INJECT_BUF_SIZE) {
+		ret = output_flush(inject);
+		if (ret)
+			return ret;
+	}
 
-	inject->bytes_written += size;
+	if (sz >= INJECT_BUF_SIZE) {
+		ret = output_write(inject, buf, sz);
+		if (ret)
+			return ret;
+	} else {
+		memcpy(inject->out_buf + inject->out_len, buf, sz);
+		inject->out_len += sz;
+	}
+
+	inject->bytes_written += sz;
 	return 0;
 }
 
@@ -114,19 +159,44 @@ static int perf_event__repipe_attr(struct perf_tool *tool,
 
 #ifdef HAVE_AUXTRACE_SUPPORT
 
+/*
+ * Move the data in the kernel when either end is a pipe, else read it in
+ * the output buffer.
+ */
 static int copy_bytes(struct perf_inject *inject, int fd, off_t size)
 {
-	char buf[4096];
+	int out_fd = perf_data__fd(&inject->output);
 	ssize_t ssz;
 	int ret;
 
+	ret = output_flush(inject);
+	if (ret)
+		return ret;
+
 	while (size > 0) {
-		ssz = read(fd, buf, min(size, (off_t)sizeof(buf)));
+		ssz = splice(fd, NULL, out_fd, NULL, size,
+			     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (ssz < 0 && errno == EINTR)
+			continue;
+		if (ssz <= 0)
+			break;
+		inject->bytes_written += ssz;
+		size -= ssz;
+	}
+
+	while (size > 0) {
+		ssz = read(fd, inject->out_buf,
+			   min(size, (off_t)INJECT_BUF_SIZE));
+		if (ssz < 0 && errno == EINTR)
+			continue;
 		if (ssz < 0)
 			return -errno;
-		ret = output_bytes(inject, buf, ssz);
+		if (ssz == 0)
+			return -EINVAL;
+		ret = output_write(inject, inject->out_buf, ssz);
 		if (ret)
 			return ret;
+		inject->bytes_written += ssz;
 		size -= ssz;
 	}
 
@@ -149,6 +219,7 @@ static s64 perf_event__repipe_auxtrace(struct perf_session *session,
 		offset = lseek(inject->output.file.fd, 0, SEEK_CUR);
 		if (offset == -1)
 			return -errno;
+		offset += inject->out_len;
 		ret = auxtrace_index__auxtrace_event(&session->auxtrace_index,
 						     event, offset);
 		if (ret < 0)
@@ -257,6 +328,10 @@ static int perf_event__jit_repipe_mmap(struct perf_tool *tool,
 	u64 n = 0;
 	int ret;
 
+	ret = output_flush(inject);
+	if (ret)
+		return ret;
+
 	/*
 	 * if jit marker, then inject jit mmaps and generate ELF images
 	 */
@@ -295,6 +370,10 @@ static int perf_event__jit_repipe_mmap2(struct perf_tool *tool,
 	u64 n = 0;
 	int ret;
 
+	ret = output_flush(inject);
+	if (ret)
+		return ret;
+
 	/*
 	 * if jit marker, then inject jit mmaps and generate ELF images
 	 */
@@ -462,6 +541,93 @@ repipe:
 	return 0;
 }
 
+/* Make a synthesized event look like it happened with sample */
+static void perf_inject__set_id_sample(struct perf_inject *inject,
+				       union perf_event *event,
+				       struct perf_sample *sample,
+				       struct machine *machine)
+{
+	struct perf_evsel *evsel = perf_evlist__first(inject->session->evlist);
+	u64 type = evsel->attr.sample_type;
+	u64 *array;
+	u32 *p;
+
+	if (!machine->id_hdr_size)
+		return;
+
+	array = (void *)event + event->header.size - machine->id_hdr_size;
+
+	if (type & PERF_SAMPLE_TID) {
+		p = (u32 *)array++;
+		p[0] = sample->pid;
+		p[1] = sample->tid;
+	}
+	if (type & PERF_SAMPLE_TIME)
+		*array++ = sample->time;
+	if (type & PERF_SAMPLE_ID)
+		*array++ = sample->id;
+	if (type & PERF_SAMPLE_STREAM_ID)
+		*array++ = sample->stream_id;
+	if (type & PERF_SAMPLE_CPU) {
+		p = (u32 *)array++;
+		p[0] = sample->cpu;
+		p[1] = 0;
+	}
+	if (type & PERF_SAMPLE_IDENTIFIER)
+		*array++ = sample->id;
+}
+
+static int perf_event__repipe_lazy_mmap(struct perf_tool *tool,
+					union perf_event *event,
+					struct perf_sample *sample,
+					struct machine *machine)
+{
+	struct perf_inject *inject = container_of(tool, struct perf_inject, tool);
+
+	perf_inject__set_id_sample(inject, event, inject->lazy_sample, machine);
+	return perf_event__repipe_mmap2(tool, event, sample, machine);
+}
+
+/*
+ * perf record --lazy-mmaps only synthesized the existing tasks, not their
+ * maps, synthesize them from /proc just before the first sample of each
+ * task without any, as long as it is still around.
+ */
+static int perf_event__inject_lazy_mmaps(struct perf_tool *tool,
+					 union perf_event *event,
+					 struct perf_sample *sample,
+					 struct perf_evsel *evsel,
+					 struct machine *machine)
+{
+	struct perf_inject *inject = container_of(tool, struct perf_inject, tool);
+	struct thread *thread;
+	pid_t pid = sample->pid;
+
+	if (pid <= 0 || !machine__is_host(machine) ||
+	    intlist__has_entry(inject->lazy_pids, pid))
+		goto out;
+
+	if (intlist__add(inject->lazy_pids, pid))
+		return -ENOMEM;
+
+	thread = machine__findnew_thread(machine, pid, pid);
+	if (thread && map_groups__empty(thread->mg)) {
+		inject->lazy_sample = sample;
+		if (perf_event__synthesize_mmap_events(tool, inject->lazy_event,
+						       pid, pid,
+						       perf_event__repipe_lazy_mmap,
+						       machine, false))
+			pr_debug("couldn't synthesize the maps of pid %d\n", pid);
+		inject->lazy_sample = NULL;
+	}
+	thread__put(thread);
+out:
+	if (inject->build_ids)
+		return perf_event__inject_buildid(tool, event, sample, evsel,
+						  machine);
+	return perf_event__repipe_sample(tool, event, sample, evsel, machine);
+}
+
 static int perf_inject__sched_process_exit(struct perf_tool *tool,
 					   union perf_event *event __maybe_unused,
 					   struct perf_sample *sample,
@@ -639,7 +805,7 @@ static int __cmd_inject(struct perf_inject *inject)
 	signal(SIGINT, sig_handler);
 
 	if (inject->build_ids || inject->sched_stat ||
-	    inject->itrace_synth_opts.set) {
+	    inject->itrace_synth_opts.set || inject->lazy_mmaps) {
 		inject->tool.mmap	  = perf_event__repipe_mmap;
 		inject->tool.mmap2	  = perf_event__repipe_mmap2;
 		inject->tool.fork	  = perf_event__repipe_fork;
@@ -648,7 +814,17 @@ static int __cmd_inject(struct perf_inject *inject)
 
 	output_data_offset = session->header.data_offset;
 
-	if (inject->build_ids) {
+	if (inject->lazy_mmaps) {
+		struct machine *machine = &session->machines.host;
+
+		inject->lazy_pids = intlist__new(NULL);
+		inject->lazy_event = malloc(sizeof(inject->lazy_event->mmap2) +
+					    machine->id_hdr_size);
+		if (inject->lazy_pids == NULL || inject->lazy_event == NULL)
+			return -ENOMEM;
+
+		inject->tool.sample = perf_event__inject_lazy_mmaps;
+	} else if (inject->build_ids) {
 		inject->tool.sample = perf_event__inject_buildid;
 	} else if (inject->sched_stat) {
 		struct perf_evsel *evsel;
@@ -692,6 +868,8 @@ static int __cmd_inject(struct perf_inject *inject)
 		lseek(fd, output_data_offset, SEEK_SET);
 
 	ret = perf_session__process_events(session);
+	if (!ret)
+		ret = output_flush(inject);
 	if (ret)
 		return ret;
 
@@ -753,6 +931,7 @@ int cmd_inject(int argc, const char **argv)
 			.aux		= perf_event__repipe,
 			.itrace_start	= perf_event__repipe,
 			.context_switch	= perf_event__repipe,
+			.cgroup		= perf_event__repipe,
 			.read		= perf_event__repipe_sample,
 			.throttle	= perf_event__repipe,
 			.unthrottle	= perf_event__repipe,
@@ -803,6 +982,9 @@ int cmd_inject(int argc, const char **argv)
 				    itrace_parse_synth_opts),
 		OPT_BOOLEAN(0, "strip", &inject.strip,
 			    "strip non-synthesized events (use with --itrace)"),
+		OPT_BOOLEAN(0, "lazy-mmaps", &inject.lazy_mmaps,
+			    "synthesize the maps of the tasks recorded with "
+			    "perf record --lazy-mmaps before their first sample"),
 		OPT_END()
 	};
 	const char * const inject_usage[] = {
@@ -830,6 +1012,10 @@ int cmd_inject(int argc, const char **argv)
 		return -1;
 	}
 
+	inject.out_buf = malloc(INJECT_BUF_SIZE);
+	if (inject.out_buf == NULL)
+		return -ENOMEM;
+
 	inject.tool.ordered_events = inject.sched_stat;
 
 	data.path = inject.input_name;
@@ -868,5 +1054,8 @@ int cmd_inject(int argc, const char **argv)
 
 out_delete:
 	perf_session__delete(inject.session);
+	intlist__delete(inject.lazy_pids);
+	free(inject.lazy_event);
+	free(inject.out_buf);
 	return ret;
 }
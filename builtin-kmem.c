@@ -19,16 +19,23 @@
 #include "util/trace-event.h"
 #include "util/data.h"
 #include "util/cpumap.h"
+#include "util/machine.h"
+#include "util/parse-events.h"
 
 #include "util/debug.h"
 
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/rbtree.h>
 #include <linux/string.h>
+#include <linux/time64.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <locale.h>
 #include <regex.h>
+#include <signal.h>
+#include <time.h>
 
 #include "sane_ctype.h"
 
@@ -66,7 +73,146 @@ struct alloc_stat {
 	struct rb_node node;
 };
 
-static struct rb_root root_alloc_stat;
+/*
+ * An open addressing hash, with linear probing, of the stats keyed by a
+ * pointer or a page, so that matching the frees with the allocations
+ * doesn't chase pointers down a tree for each event.  The keys are kept
+ * in the slots, an empty slot has no data.
+ */
+struct kmem_hash_slot {
+	u64	key;
+	void	*data;
+};
+
+struct kmem_hash {
+	struct kmem_hash_slot	*slots;
+	unsigned int		bits;
+	unsigned long		nr;
+};
+
+#define KMEM_HASH_MIN_BITS	12
+
+static unsigned long kmem_hash__mask(struct kmem_hash *h)
+{
+	return (1UL << h->bits) - 1;
+}
+
+static struct kmem_hash_slot *kmem_hash__slot(struct kmem_hash *h, u64 key)
+{
+	unsigned long i, mask = kmem_hash__mask(h);
+
+	for (i = hash_64(key, h->bits); ; i = (i + 1) & mask) {
+		struct kmem_hash_slot *slot = &h->slots[i];
+
+		if (slot->data == NULL || slot->key == key)
+			return slot;
+	}
+}
+
+static void *kmem_hash__find(struct kmem_hash *h, u64 key)
+{
+	if (h->slots == NULL)
+		return NULL;
+	return kmem_hash__slot(h, key)->data;
+}
+
+static int kmem_hash__grow(struct kmem_hash *h)
+{
+	struct kmem_hash old = *h;
+	unsigned long i;
+
+	h->bits = old.slots ? old.bits + 1 : KMEM_HASH_MIN_BITS;
+	h->slots = calloc(1UL << h->bits, sizeof(*h->slots));
+	if (h->slots == NULL) {
+		*h = old;
+		return -ENOMEM;
+	}
+
+	for (i = 0; old.slots && i <= kmem_hash__mask(&old); i++) {
+		if (old.slots[i].data)
+			*kmem_hash__slot(h, old.slots[i].key) = old.slots[i];
+	}
+
+	free(old.slots);
+	return 0;
+}
+
+/* key must not be in h already */
+static int kmem_hash__add(struct kmem_hash *h, u64 key, void *data)
+{
+	struct kmem_hash_slot *slot;
+
+	/* at most 3/4 full, the probes stay short */
+	if (h->slots == NULL || (h->nr + 1) * 4 > (kmem_hash__mask(h) + 1) * 3) {
+		if (kmem_hash__grow(h))
+			return -ENOMEM;
+	}
+
+	slot = kmem_hash__slot(h, key);
+	slot->key  = key;
+	slot->data = data;
+	h->nr++;
+	return 0;
+}
+
+static void kmem_hash__remove(struct kmem_hash *h, u64 key)
+{
+	unsigned long i, j, mask = kmem_hash__mask(h);
+	struct kmem_hash_slot *slot = kmem_hash__slot(h, key);
+
+	if (slot->data == NULL)
+		return;
+
+	/* move back the entries after it that would not be found anymore */
+	i = slot - h->slots;
+	for (j = (i + 1) & mask; h->slots[j].data; j = (j + 1) & mask) {
+		unsigned long home = hash_64(h->slots[j].key, h->bits);
+
+		/* is home cyclically in (i, j] ? then it stays */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+
+	h->slots[i].data = NULL;
+	h->nr--;
+}
+
+static int kmem_hash_slot__cmp(const void *a, const void *b)
+{
+	const struct kmem_hash_slot *sa = a, *sb = b;
+
+	if (sa->key < sb->key)
+		return -1;
+	return sa->key > sb->key;
+}
+
+/* Empty h, handing its data in key order to fn */
+static void kmem_hash__drain(struct kmem_hash *h, void (*fn)(void *data, void *arg),
+			     void *arg)
+{
+	unsigned long i, nr = 0;
+
+	if (h->slots == NULL)
+		return;
+
+	/* pack the entries at the start, then sort them */
+	for (i = 0; i <= kmem_hash__mask(h); i++) {
+		if (h->slots[i].data)
+			h->slots[nr++] = h->slots[i];
+	}
+	qsort(h->slots, nr, sizeof(*h->slots), kmem_hash_slot__cmp);
+
+	for (i = 0; i < nr; i++)
+		fn(h->slots[i].data, arg);
+
+	zfree(&h->slots);
+	h->nr = 0;
+}
+
+static struct kmem_hash alloc_stat_hash;
 static struct rb_root root_alloc_sorted;
 static struct rb_root root_caller_stat;
 static struct rb_root root_caller_sorted;
@@ -81,23 +227,9 @@ const char *time_str;
 static int insert_alloc_stat(unsigned long call_site, unsigned long ptr,
 			     int bytes_req, int bytes_alloc, int cpu)
 {
-	struct rb_node **node = &root_alloc_stat.rb_node;
-	struct rb_node *parent = NULL;
-	struct alloc_stat *data = NULL;
-
-	while (*node) {
-		parent = *node;
-		data = rb_entry(*node, struct alloc_stat, node);
+	struct alloc_stat *data = kmem_hash__find(&alloc_stat_hash, ptr);
 
-		if (ptr > data->ptr)
-			node = &(*node)->rb_right;
-		else if (ptr < data->ptr)
-			node = &(*node)->rb_left;
-		else
-			break;
-	}
-
-	if (data && data->ptr == ptr) {
+	if (data) {
 		data->hit++;
 		data->bytes_req += bytes_req;
 		data->bytes_alloc += bytes_alloc;
@@ -113,8 +245,11 @@ static int insert_alloc_stat(unsigned long call_site, unsigned long ptr,
 		data->bytes_req = bytes_req;
 		data->bytes_alloc = bytes_alloc;
 
-		rb_link_node(&data->node, parent, node);
-		rb_insert_color(&data->node, &root_alloc_stat);
+		if (kmem_hash__add(&alloc_stat_hash, ptr, data)) {
+			pr_err("%s: malloc failed\n", __func__);
+			free(data);
+			return -1;
+		}
 	}
 	data->call_site = call_site;
 	data->alloc_cpu = cpu;
@@ -200,7 +335,6 @@ static int perf_evsel__process_alloc_node_event(struct perf_evsel *evsel,
 	return ret;
 }
 
-static int ptr_cmp(void *, void *);
 static int slab_callsite_cmp(void *, void *);
 
 static struct alloc_stat *search_alloc_stat(unsigned long ptr,
@@ -234,7 +368,7 @@ static int perf_evsel__process_free_event(struct perf_evsel *evsel,
 	unsigned long ptr = perf_evsel__intval(evsel, sample, "ptr");
 	struct alloc_stat *s_alloc, *s_caller;
 
-	s_alloc = search_alloc_stat(ptr, 0, &root_alloc_stat, ptr_cmp);
+	s_alloc = kmem_hash__find(&alloc_stat_hash, ptr);
 	if (!s_alloc)
 		return 0;
 
@@ -286,7 +420,7 @@ struct page_stat {
 	int 		nr_free;
 };
 
-static struct rb_root page_live_tree;
+static struct kmem_hash page_live_hash;
 static struct rb_root page_alloc_tree;
 static struct rb_root page_alloc_sorted;
 static struct rb_root page_caller_tree;
@@ -326,14 +460,13 @@ static int callcmp(const void *a, const void *b)
 		return -1;
 }
 
-static int build_alloc_func_list(void)
+static int build_alloc_func_list(struct machine *machine)
 {
 	int ret;
 	struct map *kernel_map;
 	struct symbol *sym;
 	struct rb_node *node;
 	struct alloc_func *func;
-	struct machine *machine = &kmem_session->machines.host;
 	regex_t alloc_func_regex;
 	static const char pattern[] = "^_?_?(alloc|get_free|get_zeroed)_pages?";
 
@@ -387,7 +520,7 @@ static u64 find_callsite(struct perf_evsel *evsel, struct perf_sample *sample)
 	struct callchain_cursor_node *node;
 
 	if (alloc_func_list == NULL) {
-		if (build_alloc_func_list() < 0)
+		if (build_alloc_func_list(machine) < 0)
 			goto out;
 	}
 
@@ -437,27 +570,10 @@ static LIST_HEAD(page_caller_sort_input);
 static struct page_stat *
 __page_stat__findnew_page(struct page_stat *pstat, bool create)
 {
-	struct rb_node **node = &page_live_tree.rb_node;
-	struct rb_node *parent = NULL;
-	struct page_stat *data;
-
-	while (*node) {
-		s64 cmp;
-
-		parent = *node;
-		data = rb_entry(*node, struct page_stat, node);
-
-		cmp = data->page - pstat->page;
-		if (cmp < 0)
-			node = &parent->rb_left;
-		else if (cmp > 0)
-			node = &parent->rb_right;
-		else
-			return data;
-	}
+	struct page_stat *data = kmem_hash__find(&page_live_hash, pstat->page);
 
-	if (!create)
-		return NULL;
+	if (data || !create)
+		return data;
 
 	data = zalloc(sizeof(*data));
 	if (data != NULL) {
@@ -466,8 +582,8 @@ __page_stat__findnew_page(struct page_stat *pstat, bool create)
 		data->gfp_flags = pstat->gfp_flags;
 		data->migrate_type = pstat->migrate_type;
 
-		rb_link_node(&data->node, parent, node);
-		rb_insert_color(&data->node, &page_live_tree);
+		if (kmem_hash__add(&page_live_hash, data->page, data))
+			zfree(&data);
 	}
 
 	return data;
@@ -886,7 +1002,7 @@ static int perf_evsel__process_page_free_event(struct perf_evsel *evsel,
 	this.migrate_type = pstat->migrate_type;
 	this.callsite = pstat->callsite;
 
-	rb_erase(&pstat->node, &page_live_tree);
+	kmem_hash__remove(&page_live_hash, pstat->page);
 	free(pstat);
 
 	if (live_page) {
@@ -1166,9 +1282,30 @@ static void print_slab_summary(void)
 	printf("Cross CPU allocations: %'lu/%'lu\n", nr_cross_allocs, nr_allocs);
 }
 
-static void print_page_summary(void)
+static void print_order_stats(int stats[MAX_PAGE_ORDER][MAX_MIGRATE_TYPES])
 {
 	int o, m;
+
+	printf("%5s  %12s  %12s  %12s  %12s  %12s\n", "Order",  "Unmovable",
+	       "Reclaimable", "Movable", "Reserved", "CMA/Isolated");
+	printf("%.5s  %.12s  %.12s  %.12s  %.12s  %.12s\n", graph_dotted_line,
+	       graph_dotted_line, graph_dotted_line, graph_dotted_line,
+	       graph_dotted_line, graph_dotted_line);
+
+	for (o = 0; o < MAX_PAGE_ORDER; o++) {
+		printf("%5d", o);
+		for (m = 0; m < MAX_MIGRATE_TYPES - 1; m++) {
+			if (stats[o][m])
+				printf("  %'12d", stats[o][m]);
+			else
+				printf("  %12c", '.');
+		}
+		printf("\n");
+	}
+}
+
+static void print_page_summary(void)
+{
 	u64 nr_alloc_freed = nr_page_frees - nr_page_nomatch;
 	u64 total_alloc_freed_bytes = total_page_free_bytes - total_page_nomatch_bytes;
 
@@ -1193,22 +1330,7 @@ static void print_page_summary(void)
 	       nr_page_fails, total_page_fail_bytes / 1024);
 	printf("\n");
 
-	printf("%5s  %12s  %12s  %12s  %12s  %12s\n", "Order",  "Unmovable",
-	       "Reclaimable", "Movable", "Reserved", "CMA/Isolated");
-	printf("%.5s  %.12s  %.12s  %.12s  %.12s  %.12s\n", graph_dotted_line,
-	       graph_dotted_line, graph_dotted_line, graph_dotted_line,
-	       graph_dotted_line, graph_dotted_line);
-
-	for (o = 0; o < MAX_PAGE_ORDER; o++) {
-		printf("%5d", o);
-		for (m = 0; m < MAX_MIGRATE_TYPES - 1; m++) {
-			if (order_stats[o][m])
-				printf("  %'12d", order_stats[o][m]);
-			else
-				printf("  %12c", '.');
-		}
-		printf("\n");
-	}
+	print_order_stats(order_stats);
 }
 
 static void print_slab_result(struct perf_session *session)
@@ -1291,6 +1413,29 @@ static void __sort_slab_result(struct rb_root *root, struct rb_root *root_sorted
 	}
 }
 
+struct sort_result_arg {
+	struct rb_root		*root_sorted;
+	struct list_head	*sort_list;
+};
+
+static void sort_slab_insert_hashed(void *data, void *arg)
+{
+	struct sort_result_arg *sort = arg;
+
+	sort_slab_insert(sort->root_sorted, data, sort->sort_list);
+}
+
+static void __sort_slab_hash(struct kmem_hash *h, struct rb_root *root_sorted,
+			     struct list_head *sort_list)
+{
+	struct sort_result_arg arg = {
+		.root_sorted = root_sorted,
+		.sort_list   = sort_list,
+	};
+
+	kmem_hash__drain(h, sort_slab_insert_hashed, &arg);
+}
+
 static void sort_page_insert(struct rb_root *root, struct page_stat *data,
 			     struct list_head *sort_list)
 {
@@ -1338,18 +1483,36 @@ static void __sort_page_result(struct rb_root *root, struct rb_root *root_sorted
 	}
 }
 
+static void sort_page_insert_hashed(void *data, void *arg)
+{
+	struct sort_result_arg *sort = arg;
+
+	sort_page_insert(sort->root_sorted, data, sort->sort_list);
+}
+
+static void __sort_page_hash(struct kmem_hash *h, struct rb_root *root_sorted,
+			     struct list_head *sort_list)
+{
+	struct sort_result_arg arg = {
+		.root_sorted = root_sorted,
+		.sort_list   = sort_list,
+	};
+
+	kmem_hash__drain(h, sort_page_insert_hashed, &arg);
+}
+
 static void sort_result(void)
 {
 	if (kmem_slab) {
-		__sort_slab_result(&root_alloc_stat, &root_alloc_sorted,
-				   &slab_alloc_sort);
+		__sort_slab_hash(&alloc_stat_hash, &root_alloc_sorted,
+				 &slab_alloc_sort);
 		__sort_slab_result(&root_caller_stat, &root_caller_sorted,
 				   &slab_caller_sort);
 	}
 	if (kmem_page) {
 		if (live_page)
-			__sort_page_result(&page_live_tree, &page_alloc_sorted,
-					   &page_alloc_sort);
+			__sort_page_hash(&page_live_hash, &page_alloc_sorted,
+					 &page_alloc_sort);
 		else
 			__sort_page_result(&page_alloc_tree, &page_alloc_sorted,
 					   &page_alloc_sort);
@@ -1404,6 +1567,644 @@ out:
 	return err;
 }
 
+/*
+ * perf kmem top: the kmem events read live from the ring buffers, the
+ * allocations kept only until they are freed, aggregated by callsite and
+ * shown at each interval, so that neither a perf.data file nor every
+ * allocation seen has to be kept on busy systems.
+ */
+struct kmem_top_site {
+	u64	call_site;
+	/* in the interval */
+	u64	nr_alloc;
+	u64	nr_free;
+	u64	bytes_req;
+	u64	bytes_alloc;
+	u64	pingpong;
+	/* still allocated */
+	u64	nr_live;
+	u64	live_bytes;
+};
+
+/* An allocation not freed yet */
+struct kmem_top_obj {
+	u64	call_site;
+	u32	bytes;
+	short	cpu;
+	u8	order;
+	u8	migrate_type;
+};
+
+static struct kmem_top {
+	struct record_opts	opts;
+	struct perf_evlist	*evlist;
+	struct machine		*machine;
+	unsigned int		interval;
+	unsigned long		max_live;
+	struct kmem_hash	slab_live;
+	struct kmem_hash	slab_sites;
+	struct kmem_hash	page_live;
+	struct kmem_hash	page_sites;
+	/* in the interval */
+	u64			bytes_req;
+	u64			bytes_alloc;
+	u64			page_bytes_alloc;
+	u64			page_bytes_free;
+	unsigned long		nr_untracked;
+	unsigned long		nr_nomatch;
+	unsigned long		nr_page_fails;
+	u64			lost;
+	/* the pages still allocated */
+	int			page_orders[MAX_PAGE_ORDER][MAX_MIGRATE_TYPES];
+} kmem_top = {
+	.opts = {
+		.mmap_pages	= UINT_MAX,
+		.user_freq	= UINT_MAX,
+		.user_interval	= ULLONG_MAX,
+		.sample_time	= true,
+		.sample_cpu	= true,
+	},
+	.interval	= 1000,
+	.max_live	= 1UL << 20,
+};
+
+static volatile int kmem_top_done;
+
+static void kmem_top__sig(int sig __maybe_unused)
+{
+	kmem_top_done = 1;
+}
+
+static struct kmem_top_site *kmem_top__findnew_site(struct kmem_hash *h, u64 call_site)
+{
+	struct kmem_top_site *site = kmem_hash__find(h, call_site);
+
+	if (site)
+		return site;
+
+	site = zalloc(sizeof(*site));
+	if (site == NULL)
+		return NULL;
+
+	site->call_site = call_site;
+	if (kmem_hash__add(h, call_site, site))
+		zfree(&site);
+	return site;
+}
+
+/*
+ * Track what was allocated at key by site, NULL when past --max-live,
+ * only counted then.
+ */
+static struct kmem_top_obj *kmem_top__track(struct kmem_hash *live, struct kmem_hash *sites,
+					    u64 key, struct kmem_top_site *site, u32 bytes)
+{
+	struct kmem_top_obj *obj = kmem_hash__find(live, key);
+
+	if (obj) {
+		/* its free was lost, the old one is gone */
+		struct kmem_top_site *old = kmem_hash__find(sites, obj->call_site);
+
+		if (old) {
+			old->nr_live--;
+			old->live_bytes -= obj->bytes;
+		}
+	} else {
+		if (live->nr >= kmem_top.max_live) {
+			kmem_top.nr_untracked++;
+			return NULL;
+		}
+
+		obj = zalloc(sizeof(*obj));
+		if (obj == NULL || kmem_hash__add(live, key, obj)) {
+			free(obj);
+			kmem_top.nr_untracked++;
+			return NULL;
+		}
+	}
+
+	obj->call_site = site->call_site;
+	obj->bytes = bytes;
+	site->nr_live++;
+	site->live_bytes += bytes;
+	return obj;
+}
+
+/* Forget obj at key when freed, returning its site */
+static struct kmem_top_site *kmem_top__untrack(struct kmem_hash *live, struct kmem_hash *sites,
+					       u64 key, struct kmem_top_obj *obj)
+{
+	struct kmem_top_site *site = kmem_hash__find(sites, obj->call_site);
+
+	if (site) {
+		site->nr_free++;
+		site->nr_live--;
+		site->live_bytes -= obj->bytes;
+	}
+
+	kmem_hash__remove(live, key);
+	return site;
+}
+
+static int kmem_top__process_alloc_event(struct perf_evsel *evsel,
+					 struct perf_sample *sample)
+{
+	u64 ptr = perf_evsel__intval(evsel, sample, "ptr"),
+	    call_site = perf_evsel__intval(evsel, sample, "call_site");
+	u32 bytes_req = perf_evsel__intval(evsel, sample, "bytes_req"),
+	    bytes_alloc = perf_evsel__intval(evsel, sample, "bytes_alloc");
+	struct kmem_top_site *site;
+	struct kmem_top_obj *obj;
+
+	site = kmem_top__findnew_site(&kmem_top.slab_sites, call_site);
+	if (site == NULL)
+		return -ENOMEM;
+
+	site->nr_alloc++;
+	site->bytes_req += bytes_req;
+	site->bytes_alloc += bytes_alloc;
+	kmem_top.bytes_req += bytes_req;
+	kmem_top.bytes_alloc += bytes_alloc;
+
+	if (ptr == 0)
+		return 0;
+
+	obj = kmem_top__track(&kmem_top.slab_live, &kmem_top.slab_sites, ptr, site,
+			      bytes_alloc);
+	if (obj)
+		obj->cpu = sample->cpu;
+	return 0;
+}
+
+static int kmem_top__process_free_event(struct perf_evsel *evsel,
+					struct perf_sample *sample)
+{
+	u64 ptr = perf_evsel__intval(evsel, sample, "ptr");
+	struct kmem_top_obj *obj = kmem_hash__find(&kmem_top.slab_live, ptr);
+	struct kmem_top_site *site;
+
+	if (obj == NULL) {
+		/* allocated before we started, or untracked */
+		if (ptr)
+			kmem_top.nr_nomatch++;
+		return 0;
+	}
+
+	site = kmem_top__untrack(&kmem_top.slab_live, &kmem_top.slab_sites, ptr, obj);
+	if (site && (short)sample->cpu != obj->cpu)
+		site->pingpong++;
+
+	free(obj);
+	return 0;
+}
+
+/* The first caller in the kernel callchain that is not an alloc function */
+static u64 kmem_top__page_callsite(struct perf_sample *sample)
+{
+	struct ip_callchain *chain = sample->callchain;
+	u64 i;
+
+	if (alloc_func_list == NULL && build_alloc_func_list(kmem_top.machine) < 0)
+		return sample->ip;
+
+	for (i = 0; chain && i < chain->nr; i++) {
+		struct alloc_func key;
+
+		if (chain->ips[i] >= PERF_CONTEXT_MAX)
+			continue;
+
+		key.start = key.end = chain->ips[i];
+		if (!bsearch(&key, alloc_func_list, nr_alloc_funcs,
+			     sizeof(key), callcmp))
+			return chain->ips[i];
+	}
+
+	return sample->ip;
+}
+
+static int kmem_top__process_page_alloc_event(struct perf_evsel *evsel,
+					      struct perf_sample *sample)
+{
+	unsigned int order = perf_evsel__intval(evsel, sample, "order");
+	unsigned int migrate_type = perf_evsel__intval(evsel, sample, "migratetype");
+	u64 bytes = (u64)page_size << order;
+	struct kmem_top_site *site;
+	struct kmem_top_obj *obj;
+	u64 page;
+
+	if (use_pfn)
+		page = perf_evsel__intval(evsel, sample, "pfn");
+	else
+		page = perf_evsel__intval(evsel, sample, "page");
+
+	if (!valid_page(page)) {
+		kmem_top.nr_page_fails++;
+		return 0;
+	}
+
+	site = kmem_top__findnew_site(&kmem_top.page_sites, kmem_top__page_callsite(sample));
+	if (site == NULL)
+		return -ENOMEM;
+
+	site->nr_alloc++;
+	site->bytes_alloc += bytes;
+	kmem_top.page_bytes_alloc += bytes;
+
+	if (order >= MAX_PAGE_ORDER || migrate_type >= MAX_MIGRATE_TYPES)
+		return 0;
+
+	obj = kmem_top__track(&kmem_top.page_live, &kmem_top.page_sites, page, site,
+			      bytes);
+	if (obj) {
+		obj->order = order;
+		obj->migrate_type = migrate_type;
+		kmem_top.page_orders[order][migrate_type]++;
+	}
+	return 0;
+}
+
+static int kmem_top__process_page_free_event(struct perf_evsel *evsel,
+					     struct perf_sample *sample)
+{
+	unsigned int order = perf_evsel__intval(evsel, sample, "order");
+	struct kmem_top_obj *obj;
+	u64 page;
+
+	if (use_pfn)
+		page = perf_evsel__intval(evsel, sample, "pfn");
+	else
+		page = perf_evsel__intval(evsel, sample, "page");
+
+	kmem_top.page_bytes_free += (u64)page_size << order;
+
+	obj = kmem_hash__find(&kmem_top.page_live, page);
+	if (obj == NULL) {
+		kmem_top.nr_nomatch++;
+		return 0;
+	}
+
+	kmem_top.page_orders[obj->order][obj->migrate_type]--;
+	kmem_top__untrack(&kmem_top.page_live, &kmem_top.page_sites, page, obj);
+	free(obj);
+	return 0;
+}
+
+static void kmem_top__deliver(union perf_event *event)
+{
+	struct perf_sample sample;
+	struct perf_evsel *evsel;
+	tracepoint_handler f;
+
+	if (event->header.type == PERF_RECORD_LOST) {
+		kmem_top.lost += event->lost.lost;
+		return;
+	}
+
+	if (event->header.type != PERF_RECORD_SAMPLE ||
+	    perf_evlist__parse_sample(kmem_top.evlist, event, &sample))
+		return;
+
+	evsel = perf_evlist__id2evsel(kmem_top.evlist, sample.id);
+	if (evsel == NULL || evsel->handler == NULL)
+		return;
+
+	f = evsel->handler;
+	f(evsel, &sample);
+}
+
+static void kmem_top__mmap_read(void)
+{
+	struct perf_evlist *evlist = kmem_top.evlist;
+	int i;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct perf_mmap *md = &evlist->mmap[i];
+		union perf_event *event;
+
+		if (perf_mmap__read_init(md) < 0)
+			continue;
+
+		while ((event = perf_mmap__read_event(md)) != NULL) {
+			kmem_top__deliver(event);
+			perf_mmap__consume(md);
+		}
+
+		perf_mmap__read_done(md);
+	}
+}
+
+static int kmem_top_site__cmp(const void *a, const void *b)
+{
+	const struct kmem_top_site *sa = *(const struct kmem_top_site **)a;
+	const struct kmem_top_site *sb = *(const struct kmem_top_site **)b;
+
+	if (sa->live_bytes != sb->live_bytes)
+		return sa->live_bytes < sb->live_bytes ? 1 : -1;
+	if (sa->bytes_alloc != sb->bytes_alloc)
+		return sa->bytes_alloc < sb->bytes_alloc ? 1 : -1;
+	return 0;
+}
+
+static void kmem_top__callsite_str(u64 addr, char *buf, size_t size)
+{
+	struct symbol *sym = NULL;
+	struct map *map;
+
+	if (!raw_ip && kmem_top.machine)
+		sym = machine__find_kernel_symbol(kmem_top.machine, addr, &map);
+
+	if (sym != NULL)
+		scnprintf(buf, size, "%s+%" PRIx64 "", sym->name,
+			  addr - map->unmap_ip(map, sym->start));
+	else
+		scnprintf(buf, size, "%#" PRIx64 "", addr);
+}
+
+/*
+ * Print the callsites with the most still allocated then the most
+ * allocated in the interval, start a new interval and forget the
+ * callsites with nothing left allocated.
+ */
+static void kmem_top__print_sites(struct kmem_hash *sites, bool page, int n_lines)
+{
+	struct kmem_top_site **sorted;
+	unsigned long i, nr = 0;
+
+	if (sites->slots == NULL)
+		return;
+
+	sorted = calloc(sites->nr ?: 1, sizeof(*sorted));
+	if (sorted == NULL)
+		return;
+
+	for (i = 0; i <= kmem_hash__mask(sites); i++) {
+		if (sites->slots[i].data)
+			sorted[nr++] = sites->slots[i].data;
+	}
+
+	qsort(sorted, nr, sizeof(*sorted), kmem_top_site__cmp);
+
+	printf("%.105s\n", graph_dotted_line);
+	if (page)
+		printf(" %-34s | Live (KB)     | Live     | Allocs   | Frees    | Alloc (KB)\n",
+		       "Callsite");
+	else
+		printf(" %-34s | Live (KB)     | Live     | Allocs   | Frees    | Alloc/Req (KB)      | Ping-pong | Frag\n",
+		       "Callsite");
+	printf("%.105s\n", graph_dotted_line);
+
+	for (i = 0; i < nr; i++) {
+		struct kmem_top_site *site = sorted[i];
+		char buf[BUFSIZ];
+
+		if (n_lines >= 0 && i >= (unsigned long)n_lines)
+			break;
+
+		kmem_top__callsite_str(site->call_site, buf, sizeof(buf));
+		printf(" %-34s | %'13" PRIu64 " | %'8" PRIu64 " | %'8" PRIu64 " | %'8" PRIu64 " |",
+		       buf, site->live_bytes / 1024, site->nr_live,
+		       site->nr_alloc, site->nr_free);
+		if (page)
+			printf(" %'10" PRIu64 "\n", site->bytes_alloc / 1024);
+		else
+			printf(" %'9" PRIu64 "/%-'9" PRIu64 " | %'9" PRIu64 " | %6.3f%%\n",
+			       site->bytes_alloc / 1024, site->bytes_req / 1024,
+			       site->pingpong,
+			       fragmentation(site->bytes_req, site->bytes_alloc));
+	}
+
+	if (i < nr)
+		printf(" ...\n");
+	printf("%.105s\n", graph_dotted_line);
+
+	for (i = 0; i < nr; i++) {
+		struct kmem_top_site *site = sorted[i];
+
+		if (site->nr_live == 0) {
+			kmem_hash__remove(sites, site->call_site);
+			free(site);
+			continue;
+		}
+
+		site->nr_alloc = site->nr_free = 0;
+		site->bytes_req = site->bytes_alloc = 0;
+		site->pingpong = 0;
+	}
+
+	free(sorted);
+}
+
+static u64 kmem_top__live_bytes(struct kmem_hash *sites)
+{
+	unsigned long i;
+	u64 bytes = 0;
+
+	for (i = 0; sites->slots && i <= kmem_hash__mask(sites); i++) {
+		struct kmem_top_site *site = sites->slots[i].data;
+
+		if (site)
+			bytes += site->live_bytes;
+	}
+
+	return bytes;
+}
+
+static void kmem_top__print(double secs, int n_lines)
+{
+	printf("\n# %.3f secs", secs);
+	if (kmem_top.lost)
+		printf(", %'" PRIu64 " events lost", kmem_top.lost);
+	if (kmem_top.nr_untracked)
+		printf(", %'lu allocations untracked past --max-live", kmem_top.nr_untracked);
+	printf("\n");
+
+	if (kmem_slab) {
+		printf("\nSLAB allocator: %'" PRIu64 " KB allocated, %'" PRIu64 " KB requested, "
+		       "%f%% internal fragmentation, %'lu live objects (%'" PRIu64 " KB)\n",
+		       kmem_top.bytes_alloc / 1024, kmem_top.bytes_req / 1024,
+		       fragmentation(kmem_top.bytes_req, kmem_top.bytes_alloc),
+		       kmem_top.slab_live.nr, kmem_top__live_bytes(&kmem_top.slab_sites) / 1024);
+		kmem_top__print_sites(&kmem_top.slab_sites, false, n_lines);
+	}
+
+	if (kmem_page) {
+		printf("\nPage allocator: %'" PRIu64 " KB allocated, %'" PRIu64 " KB freed, "
+		       "%'lu failures, %'lu live pages (%'" PRIu64 " KB)\n",
+		       kmem_top.page_bytes_alloc / 1024, kmem_top.page_bytes_free / 1024,
+		       kmem_top.nr_page_fails, kmem_top.page_live.nr,
+		       kmem_top__live_bytes(&kmem_top.page_sites) / 1024);
+		kmem_top__print_sites(&kmem_top.page_sites, true, n_lines);
+
+		printf("\nLive pages by order and migrate type:\n");
+		print_order_stats(kmem_top.page_orders);
+	}
+
+	if (kmem_top.nr_nomatch)
+		printf("\n%'lu frees of allocations made before perf started\n",
+		       kmem_top.nr_nomatch);
+
+	fflush(stdout);
+
+	kmem_top.bytes_req = kmem_top.bytes_alloc = 0;
+	kmem_top.page_bytes_alloc = kmem_top.page_bytes_free = 0;
+	kmem_top.nr_untracked = kmem_top.nr_nomatch = kmem_top.nr_page_fails = 0;
+	kmem_top.lost = 0;
+}
+
+static const struct perf_evsel_str_handler kmem_top_tracepoints[] = {
+	/* slab allocator, the _node ones are gone since v6.1 */
+	{ "kmem:kmalloc",		kmem_top__process_alloc_event, },
+	{ "kmem:kmem_cache_alloc",	kmem_top__process_alloc_event, },
+	{ "kmem:kmalloc_node",		kmem_top__process_alloc_event, },
+	{ "kmem:kmem_cache_alloc_node",	kmem_top__process_alloc_event, },
+	{ "kmem:kfree",			kmem_top__process_free_event, },
+	{ "kmem:kmem_cache_free",	kmem_top__process_free_event, },
+	/* page allocator */
+	{ "kmem:mm_page_alloc",		kmem_top__process_page_alloc_event, },
+	{ "kmem:mm_page_free",		kmem_top__process_page_free_event, },
+};
+
+static int kmem_top__open(void)
+{
+	struct perf_evlist *evlist = kmem_top.evlist;
+	struct perf_evsel *evsel;
+	char msg[BUFSIZ];
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(kmem_top_tracepoints); i++) {
+		const char *name = kmem_top_tracepoints[i].name;
+		bool page = strstr(name, "mm_page") != NULL;
+
+		if ((page && !kmem_page) || (!page && !kmem_slab))
+			continue;
+
+		if (!is_valid_tracepoint(name)) {
+			pr_debug("Skipping %s, not in this kernel\n", name);
+			continue;
+		}
+
+		if (parse_events(evlist, name, NULL))
+			return -1;
+
+		evsel = perf_evlist__last(evlist);
+		evsel->handler = kmem_top_tracepoints[i].handler;
+
+		if (!strcmp(name, "kmem:mm_page_alloc") && perf_evsel__field(evsel, "pfn"))
+			use_pfn = true;
+	}
+
+	if (evlist->nr_entries == 0) {
+		pr_err("No kmem tracepoints found, is tracefs mounted?\n");
+		return -1;
+	}
+
+	perf_evlist__config(evlist, &kmem_top.opts, NULL);
+
+	/* the kernel callchain, for the callsite of the pages */
+	evlist__for_each_entry(evlist, evsel) {
+		if (!strcmp(perf_evsel__name(evsel), "kmem:mm_page_alloc")) {
+			perf_evsel__set_sample_bit(evsel, CALLCHAIN);
+			evsel->attr.exclude_callchain_user = 1;
+		}
+	}
+
+	evlist__for_each_entry(evlist, evsel) {
+		if (perf_evsel__open(evsel, evlist->cpus, evlist->threads) < 0) {
+			perf_evsel__open_strerror(evsel, &kmem_top.opts.target,
+						  errno, msg, sizeof(msg));
+			pr_err("%s\n", msg);
+			return -1;
+		}
+	}
+
+	if (perf_evlist__mmap(evlist, kmem_top.opts.mmap_pages) < 0) {
+		pr_err("Failed to mmap with %d (%s)\n",
+		       errno, str_error_r(errno, msg, sizeof(msg)));
+		return -1;
+	}
+
+	perf_evlist__enable(evlist);
+	return 0;
+}
+
+static void kmem_top__free_hash(struct kmem_hash *h)
+{
+	unsigned long i;
+
+	for (i = 0; h->slots && i <= kmem_hash__mask(h); i++)
+		free(h->slots[i].data);
+	zfree(&h->slots);
+	h->nr = 0;
+}
+
+static u64 kmem_top__now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int __cmd_top(void)
+{
+	struct target *target = &kmem_top.opts.target;
+	int n_lines = max(caller_lines, alloc_lines);
+	char errbuf[BUFSIZ];
+	u64 start, last;
+	int err = -1;
+
+	if (n_lines < 0)
+		n_lines = 20;
+
+	target->system_wide = true;
+
+	kmem_top.evlist = perf_evlist__new();
+	if (kmem_top.evlist == NULL)
+		return -ENOMEM;
+
+	if (perf_evlist__create_maps(kmem_top.evlist, target) < 0) {
+		pr_err("Couldn't create CPU maps: %s\n",
+		       str_error_r(errno, errbuf, sizeof(errbuf)));
+		goto out_delete;
+	}
+
+	kmem_top.machine = machine__new_kallsyms();
+
+	if (kmem_top__open())
+		goto out_delete;
+
+	signal(SIGINT, kmem_top__sig);
+	signal(SIGTERM, kmem_top__sig);
+
+	start = last = kmem_top__now_ns();
+
+	while (!kmem_top_done) {
+		u64 now;
+
+		kmem_top__mmap_read();
+		perf_evlist__poll(kmem_top.evlist, 100);
+
+		now = kmem_top__now_ns();
+		if (!kmem_top_done && now - last < kmem_top.interval * NSEC_PER_MSEC)
+			continue;
+
+		kmem_top__mmap_read();
+		kmem_top__print((double)(now - start) / NSEC_PER_SEC, n_lines);
+		last = now;
+	}
+
+	err = 0;
+out_delete:
+	perf_evlist__delete(kmem_top.evlist);
+	kmem_top__free_hash(&kmem_top.slab_live);
+	kmem_top__free_hash(&kmem_top.slab_sites);
+	kmem_top__free_hash(&kmem_top.page_live);
+	kmem_top__free_hash(&kmem_top.page_sites);
+	if (kmem_top.machine)
+		machine__delete(kmem_top.machine);
+	return err;
+}
+
 /* slab sort keys */
 static int ptr_cmp(void *a, void *b)
 {
@@ -1917,9 +2718,18 @@ int cmd_kmem(int argc, const char **argv)
 	OPT_BOOLEAN(0, "live", &live_page, "Show live page stat"),
 	OPT_STRING(0, "time", &time_str, "str",
 		   "Time span of interest (start,stop)"),
+	OPT_UINTEGER('I', "interval", &kmem_top.interval,
+		     "print the top callsites every N msecs, with top"),
+	OPT_STRING('C', "cpu", &kmem_top.opts.target.cpu_list, "cpu",
+		   "list of cpus to trace, with top"),
+	OPT_CALLBACK('m', "mmap-pages", &kmem_top.opts.mmap_pages, "pages",
+		     "number of mmap data pages, with top",
+		     perf_evlist__parse_mmap_pages),
+	OPT_ULONG(0, "max-live", &kmem_top.max_live,
+		  "allocations tracked until freed at most, with top"),
 	OPT_END()
 	};
-	const char *const kmem_subcommands[] = { "record", "stat", NULL };
+	const char *const kmem_subcommands[] = { "record", "stat", "top", NULL };
 	const char *kmem_usage[] = {
 		NULL,
 		NULL
@@ -1949,6 +2759,16 @@ int cmd_kmem(int argc, const char **argv)
 		return __cmd_record(argc, argv);
 	}
 
+	if (!strcmp(argv[0], "top")) {
+		if (!kmem_top.interval) {
+			pr_err("The interval must be greater than 0\n");
+			return -EINVAL;
+		}
+		setlocale(LC_ALL, "");
+		symbol__init(NULL);
+		return __cmd_top();
+	}
+
 	data.path = input_name;
 
 	kmem_session = session = perf_session__new(&data, false, &perf_kmem);
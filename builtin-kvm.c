@@ -132,12 +132,22 @@ static bool register_kvm_events_ops(struct perf_kvm_stat *kvm)
 	return false;
 }
 
+/*
+ * Each vcpu thread accounts its events in its own stats, a flat array
+ * indexed by kvm_event->idx, the totals are merged when displaying.
+ */
 struct vcpu_event_record {
+	struct list_head list;
 	int vcpu_id;
+	u32 start_cpu;
 	u64 start_time;
 	struct kvm_event *last_event;
+	int nr_stats;
+	struct kvm_event_stats *stats;
 };
 
+/* Enough for the exit reasons of a vcpu, the array grows if not */
+#define VCPU_EVENT_SLOTS	64
 
 static void init_kvm_event_record(struct perf_kvm_stat *kvm)
 {
@@ -145,30 +155,28 @@ static void init_kvm_event_record(struct perf_kvm_stat *kvm)
 
 	for (i = 0; i < EVENTS_CACHE_SIZE; i++)
 		INIT_LIST_HEAD(&kvm->kvm_events_cache[i]);
+
+	INIT_LIST_HEAD(&kvm->vcpu_records);
 }
 
-#ifdef HAVE_TIMERFD_SUPPORT
-static void clear_events_cache_stats(struct list_head *kvm_events_cache)
+static void kvm_event_stats__init(struct kvm_event_stats *kvm_stats, int nr)
 {
-	struct list_head *head;
-	struct kvm_event *event;
-	unsigned int i;
-	int j;
+	int i;
 
-	for (i = 0; i < EVENTS_CACHE_SIZE; i++) {
-		head = &kvm_events_cache[i];
-		list_for_each_entry(event, head, hash_entry) {
-			/* reset stats for event */
-			event->total.time = 0;
-			init_stats(&event->total.stats);
-
-			for (j = 0; j < event->max_vcpu; ++j) {
-				event->vcpu[j].time = 0;
-				init_stats(&event->vcpu[j].stats);
-			}
-		}
+	for (i = 0; i < nr; i++) {
+		kvm_stats[i].time = 0;
+		init_stats(&kvm_stats[i].stats);
 	}
 }
+
+#ifdef HAVE_TIMERFD_SUPPORT
+static void clear_events_cache_stats(struct perf_kvm_stat *kvm)
+{
+	struct vcpu_event_record *vcpu_record;
+
+	list_for_each_entry(vcpu_record, &kvm->vcpu_records, list)
+		kvm_event_stats__init(vcpu_record->stats, vcpu_record->nr_stats);
+}
 #endif
 
 static int kvm_events_hash_fn(u64 key)
@@ -176,34 +184,35 @@ static int kvm_events_hash_fn(u64 key)
 	return key & (EVENTS_CACHE_SIZE - 1);
 }
 
-static bool kvm_event_expand(struct kvm_event *event, int vcpu_id)
+static bool vcpu_event_record__expand(struct vcpu_event_record *vcpu_record,
+				      int idx)
 {
-	int old_max_vcpu = event->max_vcpu;
-	void *prev;
+	struct kvm_event_stats *stats;
+	int nr = vcpu_record->nr_stats ?: VCPU_EVENT_SLOTS;
 
-	if (vcpu_id < event->max_vcpu)
+	if (idx < vcpu_record->nr_stats)
 		return true;
 
-	while (event->max_vcpu <= vcpu_id)
-		event->max_vcpu += DEFAULT_VCPU_NUM;
+	while (nr <= idx)
+		nr *= 2;
 
-	prev = event->vcpu;
-	event->vcpu = realloc(event->vcpu,
-			      event->max_vcpu * sizeof(*event->vcpu));
-	if (!event->vcpu) {
-		free(prev);
+	stats = realloc(vcpu_record->stats, nr * sizeof(*stats));
+	if (!stats) {
 		pr_err("Not enough memory\n");
 		return false;
 	}
 
-	memset(event->vcpu + old_max_vcpu, 0,
-	       (event->max_vcpu - old_max_vcpu) * sizeof(*event->vcpu));
+	kvm_event_stats__init(stats + vcpu_record->nr_stats,
+			      nr - vcpu_record->nr_stats);
+	vcpu_record->stats = stats;
+	vcpu_record->nr_stats = nr;
 	return true;
 }
 
-static struct kvm_event *kvm_alloc_init_event(struct event_key *key)
+static struct kvm_event *kvm_alloc_init_event(struct perf_kvm_stat *kvm,
+					      struct event_key *key)
 {
-	struct kvm_event *event;
+	struct kvm_event *event, **events;
 
 	event = zalloc(sizeof(*event));
 	if (!event) {
@@ -211,11 +220,41 @@ static struct kvm_event *kvm_alloc_init_event(struct event_key *key)
 		return NULL;
 	}
 
+	events = realloc(kvm->events, (kvm->nr_events + 1) * sizeof(*events));
+	if (!events) {
+		pr_err("Not enough memory\n");
+		free(event);
+		return NULL;
+	}
+
 	event->key = *key;
+	event->idx = kvm->nr_events;
 	init_stats(&event->total.stats);
+
+	kvm->events = events;
+	kvm->events[kvm->nr_events++] = event;
 	return event;
 }
 
+/* Sum what the vcpus accounted in the totals of the events */
+static void kvm_events__merge_vcpus(struct perf_kvm_stat *kvm)
+{
+	struct vcpu_event_record *vcpu_record;
+	int i;
+
+	for (i = 0; i < kvm->nr_events; i++)
+		kvm_event_stats__init(&kvm->events[i]->total, 1);
+
+	list_for_each_entry(vcpu_record, &kvm->vcpu_records, list) {
+		for (i = 0; i < vcpu_record->nr_stats && i < kvm->nr_events; i++) {
+			struct kvm_event_stats *total = &kvm->events[i]->total;
+
+			total->time += vcpu_record->stats[i].time;
+			merge_stats(&total->stats, &vcpu_record->stats[i].stats);
+		}
+	}
+}
+
 static struct kvm_event *find_create_kvm_event(struct perf_kvm_stat *kvm,
 					       struct event_key *key)
 {
@@ -230,7 +269,7 @@ static struct kvm_event *find_create_kvm_event(struct perf_kvm_stat *kvm,
 			return event;
 	}
 
-	event = kvm_alloc_init_event(key);
+	event = kvm_alloc_init_event(kvm, key);
 	if (!event)
 		return NULL;
 
@@ -240,15 +279,25 @@ static struct kvm_event *find_create_kvm_event(struct perf_kvm_stat *kvm,
 
 static bool handle_begin_event(struct perf_kvm_stat *kvm,
 			       struct vcpu_event_record *vcpu_record,
-			       struct event_key *key, u64 timestamp)
+			       struct event_key *key,
+			       struct perf_sample *sample)
 {
 	struct kvm_event *event = NULL;
 
+	/*
+	 * Live mode reads the mmaps one after the other, an exit older
+	 * than the one pending is from a cpu the vcpu migrated away from,
+	 * its entry was already seen.
+	 */
+	if (sample->time < vcpu_record->start_time)
+		return true;
+
 	if (key->key != INVALID_KEY)
 		event = find_create_kvm_event(kvm, key);
 
 	vcpu_record->last_event = event;
-	vcpu_record->start_time = timestamp;
+	vcpu_record->start_time = sample->time;
+	vcpu_record->start_cpu = sample->cpu;
 	return true;
 }
 
@@ -259,29 +308,21 @@ kvm_update_event_stats(struct kvm_event_stats *kvm_stats, u64 time_diff)
 	update_stats(&kvm_stats->stats, time_diff);
 }
 
-static double kvm_event_rel_stddev(int vcpu_id, struct kvm_event *event)
+static double kvm_event_rel_stddev(struct kvm_event *event)
 {
 	struct kvm_event_stats *kvm_stats = &event->total;
 
-	if (vcpu_id != -1)
-		kvm_stats = &event->vcpu[vcpu_id];
-
 	return rel_stddev_stats(stddev_stats(&kvm_stats->stats),
 				avg_stats(&kvm_stats->stats));
 }
 
-static bool update_kvm_event(struct kvm_event *event, int vcpu_id,
-			     u64 time_diff)
+static bool update_kvm_event(struct vcpu_event_record *vcpu_record,
+			     struct kvm_event *event, u64 time_diff)
 {
-	if (vcpu_id == -1) {
-		kvm_update_event_stats(&event->total, time_diff);
-		return true;
-	}
-
-	if (!kvm_event_expand(event, vcpu_id))
+	if (!vcpu_event_record__expand(vcpu_record, event->idx))
 		return false;
 
-	kvm_update_event_stats(&event->vcpu[vcpu_id], time_diff);
+	kvm_update_event_stats(&vcpu_record->stats[event->idx], time_diff);
 	return true;
 }
 
@@ -340,12 +381,6 @@ static bool handle_end_event(struct perf_kvm_stat *kvm,
 {
 	struct kvm_event *event;
 	u64 time_begin, time_diff;
-	int vcpu;
-
-	if (kvm->trace_vcpu == -1)
-		vcpu = -1;
-	else
-		vcpu = vcpu_record->vcpu_id;
 
 	event = vcpu_record->last_event;
 	time_begin = vcpu_record->start_time;
@@ -363,6 +398,15 @@ static bool handle_end_event(struct perf_kvm_stat *kvm,
 	if (!event && key->key == INVALID_KEY)
 		return true;
 
+	/*
+	 * Seems to happen once in a while during live mode, the entry of
+	 * an exit older than the pending one, read from another mmap.
+	 */
+	if (sample->time < time_begin) {
+		pr_debug("End time before begin time; skipping event.\n");
+		return true;
+	}
+
 	if (!event)
 		event = find_create_kvm_event(kvm, key);
 
@@ -372,9 +416,10 @@ static bool handle_end_event(struct perf_kvm_stat *kvm,
 	vcpu_record->last_event = NULL;
 	vcpu_record->start_time = 0;
 
-	/* seems to happen once in a while during live mode */
-	if (sample->time < time_begin) {
-		pr_debug("End time before begin time; skipping event.\n");
+	/* the exit and the entry got read from different mmaps */
+	if (kvm->live && sample->cpu != vcpu_record->start_cpu) {
+		pr_debug("VM %d, vcpu %d migrated while handling an exit; skipping event.\n",
+			 sample->pid, vcpu_record->vcpu_id);
 		return true;
 	}
 
@@ -391,11 +436,12 @@ static bool handle_end_event(struct perf_kvm_stat *kvm,
 		}
 	}
 
-	return update_kvm_event(event, vcpu, time_diff);
+	return update_kvm_event(vcpu_record, event, time_diff);
 }
 
 static
-struct vcpu_event_record *per_vcpu_record(struct thread *thread,
+struct vcpu_event_record *per_vcpu_record(struct perf_kvm_stat *kvm,
+					  struct thread *thread,
 					  struct perf_evsel *evsel,
 					  struct perf_sample *sample)
 {
@@ -409,8 +455,15 @@ struct vcpu_event_record *per_vcpu_record(struct thread *thread,
 			return NULL;
 		}
 
+		/* the stats slots of the events seen so far, and then some */
+		if (!vcpu_event_record__expand(vcpu_record, kvm->nr_events)) {
+			free(vcpu_record);
+			return NULL;
+		}
+
 		vcpu_record->vcpu_id = perf_evsel__intval(evsel, sample,
 							  vcpu_id_str);
+		list_add_tail(&vcpu_record->list, &kvm->vcpu_records);
 		thread__set_priv(thread, vcpu_record);
 	}
 
@@ -426,7 +479,7 @@ static bool handle_kvm_event(struct perf_kvm_stat *kvm,
 	struct event_key key = { .key = INVALID_KEY,
 				 .exit_reasons = kvm->exit_reasons };
 
-	vcpu_record = per_vcpu_record(thread, evsel, sample);
+	vcpu_record = per_vcpu_record(kvm, thread, evsel, sample);
 	if (!vcpu_record)
 		return true;
 
@@ -436,7 +489,7 @@ static bool handle_kvm_event(struct perf_kvm_stat *kvm,
 		return true;
 
 	if (kvm->events_ops->is_begin_event(evsel, sample, &key))
-		return handle_begin_event(kvm, vcpu_record, &key, sample->time);
+		return handle_begin_event(kvm, vcpu_record, &key, sample);
 
 	if (is_child_event(kvm, evsel, sample, &key))
 		return handle_child_event(kvm, vcpu_record, &key, sample);
@@ -447,16 +500,12 @@ static bool handle_kvm_event(struct perf_kvm_stat *kvm,
 	return true;
 }
 
+/* Only the vcpu reported is accounted, in the totals when merged */
 #define GET_EVENT_KEY(func, field)					\
-static u64 get_event_ ##func(struct kvm_event *event, int vcpu)		\
+static u64 get_event_ ##func(struct kvm_event *event,			\
+			     int vcpu __maybe_unused)			\
 {									\
-	if (vcpu == -1)							\
-		return event->total.field;				\
-									\
-	if (vcpu >= event->max_vcpu)					\
-		return 0;						\
-									\
-	return event->vcpu[vcpu].field;					\
+	return event->total.field;					\
 }
 
 #define COMPARE_EVENT_KEY(func, field)					\
@@ -539,6 +588,8 @@ static void sort_result(struct perf_kvm_stat *kvm)
 	int vcpu = kvm->trace_vcpu;
 	struct kvm_event *event;
 
+	kvm_events__merge_vcpus(kvm);
+
 	for (i = 0; i < EVENTS_CACHE_SIZE; i++) {
 		list_for_each_entry(event, &kvm->kvm_events_cache[i], hash_entry) {
 			if (event_is_valid(event, vcpu)) {
@@ -636,7 +687,7 @@ static void print_result(struct perf_kvm_stat *kvm)
 		pr_info("%9.2fus ", (double)min / NSEC_PER_USEC);
 		pr_info("%9.2fus ", (double)max / NSEC_PER_USEC);
 		pr_info("%9.2fus ( +-%7.2f%% )", (double)etime / ecount / NSEC_PER_USEC,
-			kvm_event_rel_stddev(vcpu, event));
+			kvm_event_rel_stddev(event));
 		pr_info("\n");
 	}
 
@@ -735,55 +786,48 @@ static bool verify_vcpu(int vcpu)
 }
 
 #ifdef HAVE_TIMERFD_SUPPORT
-/* keeping the max events to a modest level to keep
- * the processing of samples per mmap smooth.
+/*
+ * The events are delivered as read from each mmap, without ordering
+ * them across mmaps: the exit and the entry of a vcpu are on the same
+ * cpu, so they come in order from its mmap, unless the vcpu migrated in
+ * between, see handle_end_event().
  */
-#define PERF_KVM__MAX_EVENTS_PER_MMAP  25
-
-static s64 perf_kvm__mmap_read_idx(struct perf_kvm_stat *kvm, int idx,
-				   u64 *mmap_time)
+static s64 perf_kvm__mmap_read_idx(struct perf_kvm_stat *kvm, int idx)
 {
 	struct perf_evlist *evlist = kvm->evlist;
+	struct perf_mmap_batch batch;
+	struct perf_sample sample;
 	union perf_event *event;
 	struct perf_mmap *md;
-	u64 timestamp;
 	s64 n = 0;
 	int err;
 
-	*mmap_time = ULLONG_MAX;
 	md = &evlist->mmap[idx];
 	err = perf_mmap__read_init(md);
 	if (err < 0)
 		return (err == -EAGAIN) ? 0 : -1;
 
-	while ((event = perf_mmap__read_event(md)) != NULL) {
-		err = perf_evlist__parse_sample_timestamp(evlist, event, &timestamp);
-		if (err) {
-			perf_mmap__consume(md);
-			pr_err("Failed to parse sample\n");
-			return -1;
-		}
+	while (perf_mmap__read_batch(md, &batch, md->mask + 1) > 0) {
+		while ((event = perf_mmap_batch__next(&batch)) != NULL) {
+			err = perf_evlist__parse_sample(evlist, event, &sample);
+			if (err) {
+				perf_mmap__consume_batch(md, &batch);
+				pr_err("Failed to parse sample\n");
+				return -1;
+			}
 
-		err = perf_session__queue_event(kvm->session, event, timestamp, 0);
-		/*
-		 * FIXME: Here we can't consume the event, as perf_session__queue_event will
-		 *        point to it, and it'll get possibly overwritten by the kernel.
-		 */
-		perf_mmap__consume(md);
+			err = perf_session__deliver_synth_event(kvm->session, event,
+								&sample);
+			if (err) {
+				perf_mmap__consume_batch(md, &batch);
+				pr_err("Failed to process event: %d\n", err);
+				return -1;
+			}
 
-		if (err) {
-			pr_err("Failed to enqueue sample: %d\n", err);
-			return -1;
+			n++;
 		}
 
-		/* save time stamp of our first sample for this mmap */
-		if (n == 0)
-			*mmap_time = timestamp;
-
-		/* limit events per mmap handled all at once */
-		n++;
-		if (n == PERF_KVM__MAX_EVENTS_PER_MMAP)
-			break;
+		perf_mmap__consume_batch(md, &batch);
 	}
 
 	perf_mmap__read_done(md);
@@ -792,45 +836,23 @@ static s64 perf_kvm__mmap_read_idx(struct perf_kvm_stat *kvm, int idx,
 
 static int perf_kvm__mmap_read(struct perf_kvm_stat *kvm)
 {
-	int i, err, throttled = 0;
 	s64 n, ntotal = 0;
-	u64 flush_time = ULLONG_MAX, mmap_time;
+	int i;
 
 	for (i = 0; i < kvm->evlist->nr_mmaps; i++) {
-		n = perf_kvm__mmap_read_idx(kvm, i, &mmap_time);
-		if (n < 0)
-			return -1;
-
-		/* flush time is going to be the minimum of all the individual
-		 * mmap times. Essentially, we flush all the samples queued up
-		 * from the last pass under our minimal start time -- that leaves
-		 * a very small race for samples to come in with a lower timestamp.
-		 * The ioctl to return the perf_clock timestamp should close the
-		 * race entirely.
-		 */
-		if (mmap_time < flush_time)
-			flush_time = mmap_time;
-
-		ntotal += n;
-		if (n == PERF_KVM__MAX_EVENTS_PER_MMAP)
-			throttled = 1;
-	}
-
-	/* flush queue after each round in which we processed events */
-	if (ntotal) {
-		struct ordered_events *oe = &kvm->session->ordered_events;
-
-		oe->next_flush = flush_time;
-		err = ordered_events__flush(oe, OE_FLUSH__ROUND);
-		if (err) {
+		n = perf_kvm__mmap_read_idx(kvm, i);
+		if (n < 0) {
 			if (kvm->lost_events)
 				pr_info("\nLost events: %" PRIu64 "\n\n",
 					kvm->lost_events);
-			return err;
+			return -1;
 		}
+
+		ntotal += n;
 	}
 
-	return throttled;
+	/* poll again only once the mmaps are drained */
+	return ntotal != 0;
 }
 
 static volatile int done;
@@ -894,7 +916,7 @@ static int perf_kvm__handle_timerfd(struct perf_kvm_stat *kvm)
 	print_result(kvm);
 
 	/* reset counts */
-	clear_events_cache_stats(kvm->kvm_events_cache);
+	clear_events_cache_stats(kvm);
 	kvm->total_count = 0;
 	kvm->total_time = 0;
 	kvm->lost_events = 0;
@@ -1382,7 +1404,6 @@ static int kvm_events_live(struct perf_kvm_stat *kvm,
 	kvm->tool.fork   = perf_event__process_fork;
 	kvm->tool.lost   = process_lost_event;
 	kvm->tool.namespaces  = perf_event__process_namespaces;
-	kvm->tool.ordered_events = true;
 	perf_tool__fill_defaults(&kvm->tool);
 
 	/* set defaults */
@@ -1448,7 +1469,6 @@ static int kvm_events_live(struct perf_kvm_stat *kvm,
 	}
 	kvm->session->evlist = kvm->evlist;
 	perf_session__set_id_hdr_size(kvm->session);
-	ordered_events__set_copy_on_queue(&kvm->session->ordered_events, true);
 	machine__synthesize_threads(&kvm->session->machines.host, &kvm->opts.target,
 				    kvm->evlist->threads, false, 1);
 	err = kvm_live_open_events(kvm);
@@ -19,6 +19,10 @@
 #include "util/session.h"
 #include "util/tool.h"
 #include "util/data.h"
+#include "util/bpf-lock.h"
+#include "util/latency-hist.h"
+#include "util/machine.h"
+#include "util/parse-events.h"
 
 #include <sys/types.h>
 #include <sys/prctl.h>
@@ -26,10 +30,14 @@
 #include <pthread.h>
 #include <math.h>
 #include <limits.h>
+#include <signal.h>
+#include <time.h>
 
 #include <linux/list.h>
 #include <linux/hash.h>
 #include <linux/kernel.h>
+#include <linux/time64.h>
+#include <linux/err.h>
 
 static struct perf_session *session;
 
@@ -102,19 +110,28 @@ struct lock_stat {
  * 4) Are there other patterns?
  */
 struct lock_seq_stat {
-	struct list_head        list;
+	struct hlist_node	hash_entry;
 	int			state;
 	u64			prev_event_time;
 	void                    *addr;
+	u32			tid;
 
 	int                     read_count;
 };
 
+/* the lock sequences being tracked, keyed by thread and lock */
+#define SEQHASH_BITS		12
+#define SEQHASH_SIZE		(1UL << SEQHASH_BITS)
+
+static struct hlist_head seqhash_table[SEQHASH_SIZE];
+
+#define seqhashentry(tid, addr)	\
+	(seqhash_table + hash_long((unsigned long)(addr) ^ hash_32(tid, 32), SEQHASH_BITS))
+
 struct thread_stat {
 	struct rb_node		rb;
 
 	u32                     tid;
-	struct list_head        seq_list;
 };
 
 static struct rb_root		thread_stats;
@@ -175,7 +192,6 @@ static struct thread_stat *thread_stat_findnew_after_first(u32 tid)
 	}
 
 	st->tid = tid;
-	INIT_LIST_HEAD(&st->seq_list);
 
 	thread_stat_insert(st);
 
@@ -196,7 +212,6 @@ static struct thread_stat *thread_stat_findnew_first(u32 tid)
 		return NULL;
 	}
 	st->tid = tid;
-	INIT_LIST_HEAD(&st->seq_list);
 
 	rb_link_node(&st->rb, NULL, &thread_stats.rb_node);
 	rb_insert_color(&st->rb, &thread_stats);
@@ -246,6 +261,8 @@ static const char		*sort_key = "acquired";
 static int			(*compare)(struct lock_stat *, struct lock_stat *);
 
 static struct rb_root		result;	/* place to store sorted data */
+static int			nr_result, max_result;
+static int			nr_lock_stats, nr_bad_lock_stats;
 
 #define DEF_KEY_LOCK(name, fn_suffix)	\
 	{ #name, lock_stat_key_ ## fn_suffix }
@@ -297,6 +314,10 @@ static void insert_to_result(struct lock_stat *st,
 
 	rb_link_node(&st->rb, parent, rb);
 	rb_insert_color(&st->rb, &result);
+
+	/* keep just the top max_result, dropping the smaller */
+	if (max_result && ++nr_result > max_result)
+		rb_erase(rb_last(&result), &result);
 }
 
 /* returns left most element of result, and erase it */
@@ -360,15 +381,20 @@ struct trace_lock_handler {
 			     struct perf_sample *sample);
 };
 
-static struct lock_seq_stat *get_seq(struct thread_stat *ts, void *addr)
+static struct lock_seq_stat *get_seq(u32 tid, void *addr)
 {
+	struct hlist_head *head = seqhashentry(tid, addr);
 	struct lock_seq_stat *seq;
 
-	list_for_each_entry(seq, &ts->seq_list, list) {
-		if (seq->addr == addr)
+	hlist_for_each_entry(seq, head, hash_entry) {
+		if (seq->addr == addr && seq->tid == tid)
 			return seq;
 	}
 
+	/* the threads are looked up when a sequence starts, for 'info -t' */
+	if (!thread_stat_findnew(tid))
+		return NULL;
+
 	seq = zalloc(sizeof(struct lock_seq_stat));
 	if (!seq) {
 		pr_err("memory allocation failed\n");
@@ -376,11 +402,18 @@ static struct lock_seq_stat *get_seq(struct thread_stat *ts, void *addr)
 	}
 	seq->state = SEQ_STATE_UNINITIALIZED;
 	seq->addr = addr;
+	seq->tid = tid;
 
-	list_add(&seq->list, &ts->seq_list);
+	hlist_add_head(&seq->hash_entry, head);
 	return seq;
 }
 
+static void put_seq(struct lock_seq_stat *seq)
+{
+	hlist_del(&seq->hash_entry);
+	free(seq);
+}
+
 enum broken_state {
 	BROKEN_ACQUIRE,
 	BROKEN_ACQUIRED,
@@ -401,7 +434,6 @@ static int report_lock_acquire_event(struct perf_evsel *evsel,
 {
 	void *addr;
 	struct lock_stat *ls;
-	struct thread_stat *ts;
 	struct lock_seq_stat *seq;
 	const char *name = perf_evsel__strval(evsel, sample, "name");
 	u64 tmp = perf_evsel__intval(evsel, sample, "lockdep_addr");
@@ -415,11 +447,7 @@ static int report_lock_acquire_event(struct perf_evsel *evsel,
 	if (ls->discard)
 		return 0;
 
-	ts = thread_stat_findnew(sample->tid);
-	if (!ts)
-		return -ENOMEM;
-
-	seq = get_seq(ts, addr);
+	seq = get_seq(sample->tid, addr);
 	if (!seq)
 		return -ENOMEM;
 
@@ -454,8 +482,7 @@ broken:
 		/* broken lock sequence, discard it */
 		ls->discard = 1;
 		bad_hist[BROKEN_ACQUIRE]++;
-		list_del(&seq->list);
-		free(seq);
+		put_seq(seq);
 		goto end;
 	default:
 		BUG_ON("Unknown state of lock sequence found!\n");
@@ -473,7 +500,6 @@ static int report_lock_acquired_event(struct perf_evsel *evsel,
 {
 	void *addr;
 	struct lock_stat *ls;
-	struct thread_stat *ts;
 	struct lock_seq_stat *seq;
 	u64 contended_term;
 	const char *name = perf_evsel__strval(evsel, sample, "name");
@@ -487,11 +513,7 @@ static int report_lock_acquired_event(struct perf_evsel *evsel,
 	if (ls->discard)
 		return 0;
 
-	ts = thread_stat_findnew(sample->tid);
-	if (!ts)
-		return -ENOMEM;
-
-	seq = get_seq(ts, addr);
+	seq = get_seq(sample->tid, addr);
 	if (!seq)
 		return -ENOMEM;
 
@@ -515,8 +537,7 @@ static int report_lock_acquired_event(struct perf_evsel *evsel,
 		/* broken lock sequence, discard it */
 		ls->discard = 1;
 		bad_hist[BROKEN_ACQUIRED]++;
-		list_del(&seq->list);
-		free(seq);
+		put_seq(seq);
 		goto end;
 	default:
 		BUG_ON("Unknown state of lock sequence found!\n");
@@ -536,7 +557,6 @@ static int report_lock_contended_event(struct perf_evsel *evsel,
 {
 	void *addr;
 	struct lock_stat *ls;
-	struct thread_stat *ts;
 	struct lock_seq_stat *seq;
 	const char *name = perf_evsel__strval(evsel, sample, "name");
 	u64 tmp = perf_evsel__intval(evsel, sample, "lockdep_addr");
@@ -549,11 +569,7 @@ static int report_lock_contended_event(struct perf_evsel *evsel,
 	if (ls->discard)
 		return 0;
 
-	ts = thread_stat_findnew(sample->tid);
-	if (!ts)
-		return -ENOMEM;
-
-	seq = get_seq(ts, addr);
+	seq = get_seq(sample->tid, addr);
 	if (!seq)
 		return -ENOMEM;
 
@@ -570,8 +586,7 @@ static int report_lock_contended_event(struct perf_evsel *evsel,
 		/* broken lock sequence, discard it */
 		ls->discard = 1;
 		bad_hist[BROKEN_CONTENDED]++;
-		list_del(&seq->list);
-		free(seq);
+		put_seq(seq);
 		goto end;
 	default:
 		BUG_ON("Unknown state of lock sequence found!\n");
@@ -591,7 +606,6 @@ static int report_lock_release_event(struct perf_evsel *evsel,
 {
 	void *addr;
 	struct lock_stat *ls;
-	struct thread_stat *ts;
 	struct lock_seq_stat *seq;
 	const char *name = perf_evsel__strval(evsel, sample, "name");
 	u64 tmp = perf_evsel__intval(evsel, sample, "lockdep_addr");
@@ -604,11 +618,7 @@ static int report_lock_release_event(struct perf_evsel *evsel,
 	if (ls->discard)
 		return 0;
 
-	ts = thread_stat_findnew(sample->tid);
-	if (!ts)
-		return -ENOMEM;
-
-	seq = get_seq(ts, addr);
+	seq = get_seq(sample->tid, addr);
 	if (!seq)
 		return -ENOMEM;
 
@@ -639,8 +649,7 @@ static int report_lock_release_event(struct perf_evsel *evsel,
 
 	ls->nr_release++;
 free_seq:
-	list_del(&seq->list);
-	free(seq);
+	put_seq(seq);
 end:
 	return 0;
 }
@@ -721,13 +730,9 @@ static void print_result(void)
 
 	pr_info("\n\n");
 
-	bad = total = 0;
+	bad = nr_bad_lock_stats;
+	total = nr_lock_stats;
 	while ((st = pop_from_result())) {
-		total++;
-		if (st->discard) {
-			bad++;
-			continue;
-		}
 		bzero(cut_name, 20);
 
 		if (strlen(st->name) < 16) {
@@ -842,6 +847,11 @@ static void sort_result(void)
 
 	for (i = 0; i < LOCKHASH_SIZE; i++) {
 		list_for_each_entry(st, &lockhash_table[i], hash_entry) {
+			nr_lock_stats++;
+			if (st->discard) {
+				nr_bad_lock_stats++;
+				continue;
+			}
 			insert_to_result(st, compare);
 		}
 	}
@@ -950,6 +960,565 @@ static int __cmd_record(int argc, const char **argv)
 	return ret;
 }
 
+/*
+ * perf lock contention: the lock:contention_begin and lock:contention_end
+ * tracepoints, that need neither lockdep nor lock_stat, aggregated by lock
+ * and caller as they are read from the ring buffers, or in the kernel with
+ * --bpf, the top ones shown at each interval.
+ */
+#define CONTENTION_HASH_BITS	12
+#define CONTENTION_HASH_SIZE	(1UL << CONTENTION_HASH_BITS)
+#define CONTENTION_LOG2		32
+
+struct contention_stat {
+	struct list_head	hash_entry;
+	u64			lock;
+	u64			caller;
+	u64			count;
+	u64			total;
+	u64			max;
+	struct latency_hist	hist;
+};
+
+/* A thread waiting, or whose end was read before its begin */
+struct contention_wait {
+	struct list_head	hash_entry;
+	u32			tid;
+	u64			lock;
+	u64			caller;
+	u64			begin;
+	u64			end;
+};
+
+static struct contention {
+	struct record_opts	opts;
+	struct perf_evlist	*evlist;
+	struct perf_evsel	*begin_evsel;
+	struct bpf_lock		*bpf;
+	const char		*bpf_path;
+	struct machine		*machine;
+	unsigned int		interval;
+	int			entries;
+	bool			hist;
+	struct list_head	stats[CONTENTION_HASH_SIZE];
+	struct list_head	waits[CONTENTION_HASH_SIZE];
+	int			nr_stats;
+	u64			lost;
+	/* the locking functions, [start, end) of the lock and sched texts */
+	u64			text_start[2];
+	u64			text_end[2];
+} contention = {
+	.opts = {
+		.mmap_pages	= UINT_MAX,
+		.user_freq	= UINT_MAX,
+		.user_interval	= ULLONG_MAX,
+		.sample_time	= true,
+	},
+	.interval	= 1000,
+	.entries	= 20,
+	.hist		= true,
+};
+
+static volatile int contention_done;
+
+static void contention__sig(int sig __maybe_unused)
+{
+	contention_done = 1;
+}
+
+static void contention__read_lock_text(void)
+{
+	static const char * const names[][2] = {
+		{ "__lock_text_start",	"__lock_text_end",  },
+		{ "__sched_text_start", "__sched_text_end", },
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (kallsyms__get_function_start("/proc/kallsyms", names[i][0],
+						 &contention.text_start[i]) ||
+		    kallsyms__get_function_start("/proc/kallsyms", names[i][1],
+						 &contention.text_end[i]))
+			contention.text_start[i] = contention.text_end[i] = 0;
+	}
+}
+
+static bool contention__is_lock_function(u64 ip)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(contention.text_start); i++) {
+		if (ip >= contention.text_start[i] && ip < contention.text_end[i])
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The first caller below the locking functions, past the tracing ones on
+ * top of them, or the first address when none is known.
+ */
+static u64 contention__caller(u64 *ips, int nr)
+{
+	int i = 0, first = -1;
+
+	for (i = 0; i < nr; i++) {
+		if (ips[i] >= PERF_CONTEXT_MAX)
+			continue;
+		if (first < 0)
+			first = i;
+		if (contention__is_lock_function(ips[i]))
+			break;
+	}
+
+	while (i < nr && (ips[i] >= PERF_CONTEXT_MAX ||
+			  contention__is_lock_function(ips[i])))
+		i++;
+
+	if (i < nr)
+		return ips[i];
+	return first >= 0 ? ips[first] : 0;
+}
+
+static struct contention_stat *contention__findnew_stat(u64 lock, u64 caller)
+{
+	struct list_head *entry = contention.stats +
+				  hash_long((unsigned long)(lock ^ caller),
+					    CONTENTION_HASH_BITS);
+	struct contention_stat *st;
+
+	list_for_each_entry(st, entry, hash_entry) {
+		if (st->lock == lock && st->caller == caller)
+			return st;
+	}
+
+	st = zalloc(sizeof(*st));
+	if (st == NULL)
+		return NULL;
+
+	st->lock   = lock;
+	st->caller = caller;
+	list_add(&st->hash_entry, entry);
+	contention.nr_stats++;
+	return st;
+}
+
+static void contention__add(u64 lock, u64 caller, u64 wait)
+{
+	struct contention_stat *st = contention__findnew_stat(lock, caller);
+
+	if (st == NULL)
+		return;
+
+	st->count++;
+	st->total += wait;
+	if (wait > st->max)
+		st->max = wait;
+	latency_hist__add(&st->hist, wait);
+}
+
+static struct contention_wait *contention__findnew_wait(u32 tid)
+{
+	struct list_head *entry = contention.waits +
+				  hash_long((unsigned long)tid, CONTENTION_HASH_BITS);
+	struct contention_wait *w;
+
+	list_for_each_entry(w, entry, hash_entry) {
+		if (w->tid == tid)
+			return w;
+	}
+
+	w = zalloc(sizeof(*w));
+	if (w == NULL)
+		return NULL;
+
+	w->tid = tid;
+	list_add(&w->hash_entry, entry);
+	return w;
+}
+
+static void contention_wait__delete(struct contention_wait *w)
+{
+	list_del(&w->hash_entry);
+	free(w);
+}
+
+/*
+ * The ring buffers are read one CPU after the other, the end of a wait
+ * on a CPU can be read before its begin on another one.
+ */
+static void contention__begin(u32 tid, u64 lock, u64 caller, u64 time)
+{
+	struct contention_wait *w = contention__findnew_wait(tid);
+
+	if (w == NULL)
+		return;
+
+	if (w->end) {
+		if (w->lock == lock && w->end >= time) {
+			contention__add(lock, caller, w->end - time);
+			contention_wait__delete(w);
+			return;
+		}
+		w->end = 0;
+	} else if (w->begin && w->lock == lock) {
+		/* a mutex spinning then sleeping begins twice, keep the first */
+		return;
+	}
+
+	w->begin  = time;
+	w->lock   = lock;
+	w->caller = caller;
+}
+
+static void contention__end(u32 tid, u64 lock, u64 time)
+{
+	struct contention_wait *w = contention__findnew_wait(tid);
+
+	if (w == NULL)
+		return;
+
+	if (w->begin && w->lock == lock && time >= w->begin) {
+		contention__add(lock, w->caller, time - w->begin);
+		contention_wait__delete(w);
+		return;
+	}
+
+	w->begin = 0;
+	w->end   = time;
+	w->lock  = lock;
+}
+
+static void contention__deliver(union perf_event *event)
+{
+	struct perf_sample sample;
+	struct perf_evsel *evsel;
+	u64 lock;
+
+	if (event->header.type == PERF_RECORD_LOST) {
+		contention.lost += event->lost.lost;
+		return;
+	}
+
+	if (event->header.type != PERF_RECORD_SAMPLE ||
+	    perf_evlist__parse_sample(contention.evlist, event, &sample))
+		return;
+
+	evsel = perf_evlist__id2evsel(contention.evlist, sample.id);
+	if (evsel == NULL)
+		return;
+
+	lock = perf_evsel__intval(evsel, &sample, "lock_addr");
+
+	if (evsel == contention.begin_evsel) {
+		u64 caller = 0;
+
+		if (sample.callchain)
+			caller = contention__caller(sample.callchain->ips,
+						    sample.callchain->nr);
+		contention__begin(sample.tid, lock, caller, sample.time);
+	} else {
+		contention__end(sample.tid, lock, sample.time);
+	}
+}
+
+static void contention__mmap_read(void)
+{
+	struct perf_evlist *evlist = contention.evlist;
+	int i;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct perf_mmap *md = &evlist->mmap[i];
+		union perf_event *event;
+
+		if (perf_mmap__read_init(md) < 0)
+			continue;
+
+		while ((event = perf_mmap__read_event(md)) != NULL) {
+			contention__deliver(event);
+			perf_mmap__consume(md);
+		}
+
+		perf_mmap__read_done(md);
+	}
+}
+
+static int contention__add_bpf(void *arg __maybe_unused, u64 lock, u64 *ips,
+			       int nr_ips, struct bpf_lock_stat *stat)
+{
+	struct contention_stat *st;
+	unsigned int i;
+
+	st = contention__findnew_stat(lock, contention__caller(ips, nr_ips));
+	if (st == NULL)
+		return -ENOMEM;
+
+	st->count += stat->count;
+	st->total += stat->total;
+	if (stat->max > st->max)
+		st->max = stat->max;
+
+	/* only the power of two is known, count them at its middle */
+	for (i = 0; i < ARRAY_SIZE(stat->hist); i++) {
+		if (stat->hist[i])
+			latency_hist__add_n(&st->hist, (1ULL << i) + (1ULL << i) / 2,
+					    stat->hist[i]);
+	}
+
+	return 0;
+}
+
+static int contention_stat__cmp(const void *a, const void *b)
+{
+	const struct contention_stat *sa = *(const struct contention_stat **)a;
+	const struct contention_stat *sb = *(const struct contention_stat **)b;
+
+	if (sa->total != sb->total)
+		return sa->total < sb->total ? 1 : -1;
+	return 0;
+}
+
+static void contention_stat__print_hist(struct contention_stat *st)
+{
+	u64 log2[CONTENTION_LOG2] = { 0, }, max = 0;
+	unsigned int i;
+
+	latency_hist__log2(&st->hist, log2, CONTENTION_LOG2);
+
+	for (i = 0; i < CONTENTION_LOG2; i++)
+		max = max(max, log2[i]);
+
+	for (i = 0; i < CONTENTION_LOG2; i++) {
+		int bar;
+
+		if (log2[i] == 0)
+			continue;
+
+		bar = max ? (log2[i] * 40 + max - 1) / max : 0;
+		printf("%24" PRIu64 " - %-12" PRIu64 " ns: %10" PRIu64 " |%-40.*s|\n",
+		       i ? (u64)1 << i : 0, ((u64)1 << (i + 1)) - 1, log2[i], bar,
+		       "########################################");
+	}
+}
+
+static void contention__print_caller(u64 caller)
+{
+	struct map *map = NULL;
+	struct symbol *sym = NULL;
+
+	if (caller && contention.machine)
+		sym = machine__find_kernel_symbol(contention.machine, caller, &map);
+
+	if (sym)
+		printf("%s+%#" PRIx64 "\n", sym->name, map->map_ip(map, caller) - sym->start);
+	else if (caller)
+		printf("%#" PRIx64 "\n", caller);
+	else
+		printf("[unknown]\n");
+}
+
+/* Show the top locks and callers of the interval, then start a new one */
+static void contention__print(double secs)
+{
+	struct contention_stat **sorted, *st, *n;
+	unsigned int i;
+	int nr = 0;
+
+	sorted = calloc(contention.nr_stats ?: 1, sizeof(*sorted));
+
+	for (i = 0; i < CONTENTION_HASH_SIZE; i++) {
+		list_for_each_entry(st, &contention.stats[i], hash_entry) {
+			if (sorted)
+				sorted[nr++] = st;
+		}
+	}
+
+	qsort(sorted, nr, sizeof(*sorted), contention_stat__cmp);
+
+	printf("\n# %.3f secs, %d contended locks and callers", secs, contention.nr_stats);
+	if (contention.lost)
+		printf(", %" PRIu64 " events lost", contention.lost);
+	printf("\n\n%10s %15s %15s %15s %15s  %18s  %s\n", "contended",
+	       "total wait (ns)", "max wait (ns)", "avg wait (ns)", "p99 wait (ns)",
+	       "lock", "caller");
+
+	for (i = 0; i < (unsigned int)nr; i++) {
+		st = sorted[i];
+		if (contention.entries > 0 && (int)i == contention.entries)
+			break;
+
+		printf("%10" PRIu64 " %15" PRIu64 " %15" PRIu64 " %15" PRIu64 " %15" PRIu64 "  %#18" PRIx64 "  ",
+		       st->count, st->total, st->max, st->total / st->count,
+		       latency_hist__percentile(&st->hist, 99), st->lock);
+		contention__print_caller(st->caller);
+
+		if (contention.hist)
+			contention_stat__print_hist(st);
+	}
+
+	fflush(stdout);
+	free(sorted);
+
+	for (i = 0; i < CONTENTION_HASH_SIZE; i++) {
+		struct contention_wait *w, *wn;
+
+		list_for_each_entry_safe(st, n, &contention.stats[i], hash_entry) {
+			list_del(&st->hash_entry);
+			free(st);
+		}
+
+		/* the ends whose begin was before perf started */
+		list_for_each_entry_safe(w, wn, &contention.waits[i], hash_entry) {
+			if (w->end)
+				contention_wait__delete(w);
+		}
+	}
+
+	contention.nr_stats = 0;
+	contention.lost = 0;
+}
+
+static int contention__open_tracepoints(void)
+{
+	struct perf_evlist *evlist = contention.evlist;
+	struct perf_evsel *evsel;
+	char msg[BUFSIZ];
+
+	if (parse_events(evlist, "lock:contention_begin,lock:contention_end", NULL))
+		return -1;
+
+	contention.begin_evsel = perf_evlist__first(evlist);
+
+	perf_evlist__config(evlist, &contention.opts, NULL);
+
+	/* only the begin has the callchain, of the kernel, for the caller */
+	perf_evsel__set_sample_bit(contention.begin_evsel, CALLCHAIN);
+	contention.begin_evsel->attr.exclude_callchain_user = 1;
+
+	evlist__for_each_entry(evlist, evsel) {
+		if (perf_evsel__open(evsel, evlist->cpus, evlist->threads) < 0) {
+			perf_evsel__open_strerror(evsel, &contention.opts.target,
+						  errno, msg, sizeof(msg));
+			pr_err("%s\n", msg);
+			return -1;
+		}
+	}
+
+	if (perf_evlist__mmap(evlist, contention.opts.mmap_pages) < 0) {
+		pr_err("Failed to mmap with %d (%s)\n",
+		       errno, str_error_r(errno, msg, sizeof(msg)));
+		return -1;
+	}
+
+	perf_evlist__enable(evlist);
+	return 0;
+}
+
+static u64 contention__now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int __cmd_contention(void)
+{
+	struct target *target = &contention.opts.target;
+	u64 start, last;
+	char errbuf[BUFSIZ];
+	unsigned int i;
+	int err = -1;
+
+	if (!is_valid_tracepoint("lock:contention_begin") ||
+	    !is_valid_tracepoint("lock:contention_end")) {
+		pr_err("The lock:contention_begin and lock:contention_end tracepoints are needed, "
+		       "in kernels since v5.19\n");
+		return -1;
+	}
+
+	for (i = 0; i < CONTENTION_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&contention.stats[i]);
+		INIT_LIST_HEAD(&contention.waits[i]);
+	}
+
+	err = target__validate(target);
+	if (err) {
+		target__strerror(target, err, errbuf, BUFSIZ);
+		pr_warning("%s\n", errbuf);
+	}
+
+	if (target__none(target))
+		target->system_wide = true;
+
+	err = -1;
+	contention.evlist = perf_evlist__new();
+	if (contention.evlist == NULL)
+		return -ENOMEM;
+
+	if (perf_evlist__create_maps(contention.evlist, target) < 0) {
+		pr_err("Couldn't create thread/CPU maps: %s\n",
+		       errno == ENOENT ? "No such process" : str_error_r(errno, errbuf, sizeof(errbuf)));
+		goto out_delete;
+	}
+
+	if (symbol__init(NULL) < 0)
+		goto out_delete;
+
+	contention__read_lock_text();
+	contention.machine = machine__new_kallsyms();
+
+	if (contention.bpf_path) {
+		contention.bpf = bpf_lock__new(contention.bpf_path);
+		if (IS_ERR(contention.bpf)) {
+			contention.bpf = NULL;
+			goto out_delete;
+		}
+		if (bpf_lock__open(contention.bpf, contention.evlist->cpus,
+				   contention.evlist->threads))
+			goto out_delete;
+	} else if (contention__open_tracepoints()) {
+		goto out_delete;
+	}
+
+	signal(SIGINT, contention__sig);
+	signal(SIGTERM, contention__sig);
+
+	start = last = contention__now_ns();
+
+	while (!contention_done) {
+		u64 now;
+
+		if (contention.bpf)
+			usleep(min(contention.interval, 100U) * USEC_PER_MSEC);
+		else {
+			contention__mmap_read();
+			perf_evlist__poll(contention.evlist, 100);
+		}
+
+		now = contention__now_ns();
+		if (!contention_done && now - last < contention.interval * NSEC_PER_MSEC)
+			continue;
+
+		if (contention.bpf)
+			bpf_lock__read(contention.bpf, contention__add_bpf, NULL);
+		else
+			contention__mmap_read();
+
+		contention__print((double)(now - start) / NSEC_PER_SEC);
+		last = now;
+	}
+
+	err = 0;
+out_delete:
+	bpf_lock__delete(contention.bpf);
+	perf_evlist__delete(contention.evlist);
+	if (contention.machine)
+		machine__delete(contention.machine);
+	return err;
+}
+
 int cmd_lock(int argc, const char **argv)
 {
 	const struct option lock_options[] = {
@@ -971,16 +1540,41 @@ int cmd_lock(int argc, const char **argv)
 	const struct option report_options[] = {
 	OPT_STRING('k', "key", &sort_key, "acquired",
 		    "key for sorting (acquired / contended / avg_wait / wait_total / wait_max / wait_min)"),
+	OPT_INTEGER('E', "entries", &max_result,
+		    "display only the first N locks, by the sort key"),
 	/* TODO: type */
 	OPT_PARENT(lock_options)
 	};
 
+	const struct option contention_options[] = {
+	OPT_BOOLEAN('a', "all-cpus", &contention.opts.target.system_wide,
+		    "system-wide, the default without a target"),
+	OPT_STRING('C', "cpu", &contention.opts.target.cpu_list, "cpu",
+		    "list of cpus to trace"),
+	OPT_STRING('p', "pid", &contention.opts.target.pid, "pid",
+		    "trace the locks waited for by existing process id"),
+	OPT_STRING('t', "tid", &contention.opts.target.tid, "tid",
+		    "trace the locks waited for by existing thread id"),
+	OPT_UINTEGER('I', "interval", &contention.interval,
+		     "print the top contended locks every N msecs"),
+	OPT_INTEGER('E', "entries", &contention.entries,
+		    "display only the first N locks and callers, by total wait"),
+	OPT_BOOLEAN(0, "hist", &contention.hist,
+		    "show the log2 histogram of the waits of each entry"),
+	OPT_STRING_OPTARG(0, "bpf", &contention.bpf_path, "file",
+			  "aggregate in the kernel with a BPF program, "
+			  "examples/bpf/lock_contention.c by default", ""),
+	OPT_CALLBACK('m', "mmap-pages", &contention.opts.mmap_pages, "pages",
+		     "number of mmap data pages", perf_evlist__parse_mmap_pages),
+	OPT_PARENT(lock_options)
+	};
+
 	const char * const info_usage[] = {
 		"perf lock info [<options>]",
 		NULL
 	};
 	const char *const lock_subcommands[] = { "record", "report", "script",
-						 "info", NULL };
+						 "info", "contention", NULL };
 	const char *lock_usage[] = {
 		NULL,
 		NULL
@@ -989,6 +1583,10 @@ int cmd_lock(int argc, const char **argv)
 		"perf lock report [<options>]",
 		NULL
 	};
+	const char * const contention_usage[] = {
+		"perf lock contention [<options>]",
+		NULL
+	};
 	unsigned int i;
 	int rc = 0;
 
@@ -1024,6 +1622,18 @@ int cmd_lock(int argc, const char **argv)
 		/* recycling report_lock_ops */
 		trace_handler = &report_lock_ops;
 		rc = __cmd_report(true);
+	} else if (!strncmp(argv[0], "contention", 4)) {
+		if (argc) {
+			argc = parse_options(argc, argv, contention_options,
+					     contention_usage, 0);
+			if (argc)
+				usage_with_options(contention_usage, contention_options);
+		}
+		if (!contention.interval) {
+			pr_err("The interval must be greater than 0\n");
+			usage_with_options(contention_usage, contention_options);
+		}
+		rc = __cmd_contention();
 	} else {
 		usage_with_options(lock_usage, lock_options);
 	}
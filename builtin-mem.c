@@ -15,10 +15,20 @@
 #include "util/debug.h"
 #include "util/map.h"
 #include "util/symbol.h"
+#include "util/evlist.h"
+#include "util/cpumap.h"
+#include "util/mem2node.h"
 
 #define MEM_OPERATION_LOAD	0x1
 #define MEM_OPERATION_STORE	0x2
 
+struct mem_node_stat {
+	u64			samples;
+	/* on a cpu of the node */
+	u64			local;
+	u64			weight;
+};
+
 struct perf_mem {
 	struct perf_tool	tool;
 	char const		*input_name;
@@ -26,9 +36,16 @@ struct perf_mem {
 	bool			dump_raw;
 	bool			force;
 	bool			phys_addr;
+	bool			nodes;
 	int			operation;
 	const char		*cpu_list;
 	DECLARE_BITMAP(cpu_bitmap, MAX_NR_CPUS);
+	/* --nodes: the samples per node of their physical address */
+	struct mem2node		mem2node;
+	int			*cpu2node;
+	int			nr_cpus;
+	struct mem_node_stat	*node_stats;
+	int			nr_nodes;
 };
 
 static int parse_record_events(const struct option *opt,
@@ -227,12 +244,37 @@ out_put:
 	return 0;
 }
 
+/* The last slot is for the addresses in no node */
+static void node_stats__add(struct perf_mem *mem, struct perf_sample *sample)
+{
+	int node = mem2node__node(&mem->mem2node, sample->phys_addr);
+	struct mem_node_stat *stat;
+
+	if (node < 0 || node >= mem->nr_nodes)
+		node = mem->nr_nodes;
+
+	stat = &mem->node_stats[node];
+	stat->samples++;
+	stat->weight += sample->weight;
+
+	if (sample->cpu < (u32)mem->nr_cpus && mem->cpu2node[sample->cpu] == node)
+		stat->local++;
+}
+
 static int process_sample_event(struct perf_tool *tool,
 				union perf_event *event,
 				struct perf_sample *sample,
 				struct perf_evsel *evsel __maybe_unused,
 				struct machine *machine)
 {
+	struct perf_mem *mem = container_of(tool, struct perf_mem, tool);
+
+	if (mem->nodes) {
+		if (!mem->cpu_list || test_bit(sample->cpu, mem->cpu_bitmap))
+			node_stats__add(mem, sample);
+		return 0;
+	}
+
 	return dump_raw_samples(tool, event, sample, machine);
 }
 
@@ -273,11 +315,150 @@ out_delete:
 	return ret;
 }
 
+static int setup_nodes(struct perf_mem *mem, struct perf_env *env)
+{
+	int i, j;
+
+	mem->nr_nodes = 0;
+	for (i = 0; i < env->nr_memory_nodes; i++)
+		mem->nr_nodes = max(mem->nr_nodes, (int)env->memory_nodes[i].node + 1);
+	for (i = 0; i < env->nr_numa_nodes; i++)
+		mem->nr_nodes = max(mem->nr_nodes, (int)env->numa_nodes[i].node + 1);
+
+	mem->node_stats = calloc(mem->nr_nodes + 1, sizeof(*mem->node_stats));
+	if (mem->node_stats == NULL)
+		return -ENOMEM;
+
+	mem->nr_cpus = env->nr_cpus_avail;
+	mem->cpu2node = malloc(mem->nr_cpus * sizeof(*mem->cpu2node));
+	if (mem->cpu2node == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < mem->nr_cpus; i++)
+		mem->cpu2node[i] = -1;
+
+	for (i = 0; i < env->nr_numa_nodes; i++) {
+		struct numa_node *n = &env->numa_nodes[i];
+
+		for (j = 0; n->map && j < n->map->nr; j++) {
+			int cpu = n->map->map[j];
+
+			if (cpu >= 0 && cpu < mem->nr_cpus)
+				mem->cpu2node[cpu] = n->node;
+		}
+	}
+
+	return 0;
+}
+
+static void node_stats__fprintf(struct perf_mem *mem, FILE *fp)
+{
+	const char *sep = symbol_conf.field_sep;
+	u64 total = 0;
+	int node;
+
+	for (node = 0; node <= mem->nr_nodes; node++)
+		total += mem->node_stats[node].samples;
+
+	if (sep) {
+		fprintf(fp, "# NODE%sSAMPLES%sSAMPLES%%%sLOCAL%%%sAVG WEIGHT\n",
+			sep, sep, sep, sep);
+	} else {
+		fprintf(fp, "# %4s  %12s  %8s  %8s  %10s\n",
+			"NODE", "SAMPLES", "SAMPLES%", "LOCAL%", "AVG WEIGHT");
+	}
+
+	for (node = 0; node <= mem->nr_nodes; node++) {
+		struct mem_node_stat *stat = &mem->node_stats[node];
+		double pct = total ? 100.0 * stat->samples / total : 0;
+		double local = stat->samples ? 100.0 * stat->local / stat->samples : 0;
+		double weight = stat->samples ? (double)stat->weight / stat->samples : 0;
+		char name[16];
+
+		if (!stat->samples)
+			continue;
+
+		if (node == mem->nr_nodes)
+			scnprintf(name, sizeof(name), "?");
+		else
+			scnprintf(name, sizeof(name), "%d", node);
+
+		if (sep) {
+			fprintf(fp, "%s%s%" PRIu64 "%s%.2f%s%.2f%s%.1f\n", name,
+				sep, stat->samples, sep, pct, sep, local, sep, weight);
+		} else {
+			fprintf(fp, "  %4s  %12" PRIu64 "  %7.2f%%  %7.2f%%  %10.1f\n",
+				name, stat->samples, pct, local, weight);
+		}
+	}
+}
+
+static int report_node_events(struct perf_mem *mem)
+{
+	struct perf_data data = {
+		.path  = input_name,
+		.mode  = PERF_DATA_MODE_READ,
+		.force = mem->force,
+	};
+	struct perf_session *session;
+	struct perf_env *env;
+	int ret;
+
+	session = perf_session__new(&data, false, &mem->tool);
+	if (session == NULL)
+		return -1;
+
+	env = &session->header.env;
+	perf_env__read_feat(env, HEADER_MEM_TOPOLOGY);
+	perf_env__read_feat(env, HEADER_NUMA_TOPOLOGY);
+	ret = -1;
+
+	if (!(perf_evlist__combined_sample_type(session->evlist) & PERF_SAMPLE_PHYS_ADDR)) {
+		pr_err("No physical addresses in the samples, record them with 'perf mem record -p'\n");
+		goto out_delete;
+	}
+
+	if (!env->nr_memory_nodes) {
+		pr_err("No memory topology in the data file\n");
+		goto out_delete;
+	}
+
+	if (mem->cpu_list) {
+		ret = perf_session__cpu_bitmap(session, mem->cpu_list,
+					       mem->cpu_bitmap);
+		if (ret < 0)
+			goto out_delete;
+	}
+
+	ret = mem2node__init(&mem->mem2node, env);
+	if (ret < 0)
+		goto out_delete;
+
+	ret = setup_nodes(mem, env);
+	if (ret < 0)
+		goto out_free;
+
+	ret = perf_session__process_events(session);
+	if (!ret)
+		node_stats__fprintf(mem, stdout);
+
+out_free:
+	zfree(&mem->cpu2node);
+	zfree(&mem->node_stats);
+	mem2node__exit(&mem->mem2node);
+out_delete:
+	perf_session__delete(session);
+	return ret;
+}
+
 static int report_events(int argc, const char **argv, struct perf_mem *mem)
 {
 	const char **rep_argv;
 	int ret, i = 0, j, rep_argc;
 
+	if (mem->nodes)
+		return report_node_events(mem);
+
 	if (mem->dump_raw)
 		return report_raw_events(mem);
 
@@ -421,6 +602,8 @@ int cmd_mem(int argc, const char **argv)
 		   " between columns '.' is reserved."),
 	OPT_BOOLEAN('f', "force", &mem.force, "don't complain, do it"),
 	OPT_BOOLEAN('p', "phys-data", &mem.phys_addr, "Record/Report sample physical addresses"),
+	OPT_BOOLEAN('N', "nodes", &mem.nodes,
+		    "Report the samples per NUMA node of their physical address"),
 	OPT_END()
 	};
 	const char *const mem_subcommands[] = { "record", "report", NULL };
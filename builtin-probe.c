@@ -36,6 +36,7 @@
 #include "util/util.h"
 #include "util/strlist.h"
 #include "util/strfilter.h"
+#include "util/string2.h"
 #include "util/symbol.h"
 #include "util/debug.h"
 #include <subcmd/parse-options.h>
@@ -55,7 +56,8 @@ static struct {
 	bool quiet;
 	bool target_used;
 	int nevents;
-	struct perf_probe_event events[MAX_PROBES];
+	int nr_alloc_events;
+	struct perf_probe_event *events;
 	struct line_range line_range;
 	char *target;
 	struct strfilter *filter;
@@ -65,14 +67,24 @@ static struct {
 /* Parse an event definition. Note that any error must die. */
 static int parse_probe_event(const char *str)
 {
-	struct perf_probe_event *pev = &params.events[params.nevents];
+	struct perf_probe_event *pev;
 	int ret;
 
 	pr_debug("probe-definition(%d): %s\n", params.nevents, str);
-	if (++params.nevents == MAX_PROBES) {
-		pr_err("Too many probes (> %d) were specified.", MAX_PROBES);
-		return -1;
+	/* No limit on the events, a --batch can have many */
+	if (params.nevents == params.nr_alloc_events) {
+		int nr = params.nr_alloc_events ? params.nr_alloc_events * 2 :
+						  MAX_PROBES;
+
+		pev = realloc(params.events, nr * sizeof(*pev));
+		if (!pev)
+			return -ENOMEM;
+		memset(pev + params.nevents, 0,
+		       (nr - params.nevents) * sizeof(*pev));
+		params.events = pev;
+		params.nr_alloc_events = nr;
 	}
+	pev = &params.events[params.nevents++];
 
 	pev->uprobes = params.uprobes;
 	if (params.target) {
@@ -266,14 +278,13 @@ static int opt_show_lines(const struct option *opt,
 static int opt_show_vars(const struct option *opt,
 			 const char *str, int unset __maybe_unused)
 {
-	struct perf_probe_event *pev = &params.events[params.nevents];
 	int ret;
 
 	if (!str)
 		return 0;
 
 	ret = parse_probe_event(str);
-	if (!ret && pev->nargs != 0) {
+	if (!ret && params.events[params.nevents - 1].nargs != 0) {
 		pr_err("  Error: '--vars' doesn't accept arguments.\n");
 		return -EINVAL;
 	}
@@ -296,6 +307,48 @@ static int opt_add_probe_event(const struct option *opt,
 	return 0;
 }
 
+/*
+ * Add the probe definitions of a file, one per line like with --add, so
+ * that they are converted with one debuginfo and written at once.
+ */
+static int opt_add_probe_batch(const struct option *opt __maybe_unused,
+			       const char *str, int unset __maybe_unused)
+{
+	char *line = NULL, *p;
+	size_t len = 0;
+	int ret = 0;
+	FILE *fp;
+
+	if (!str)
+		return 0;
+
+	fp = strcmp(str, "-") ? fopen(str, "r") : stdin;
+	if (!fp) {
+		pr_err("Failed to open %s: %m\n", str);
+		return -errno;
+	}
+
+	while (getline(&line, &len, fp) > 0) {
+		p = trim(line);
+		if (*p == '\0' || *p == '#')
+			continue;
+		ret = parse_probe_event(p);
+		if (ret < 0) {
+			pr_err("  Error: Bad probe definition in %s: %s\n",
+			       str, p);
+			break;
+		}
+	}
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+
+	/* A -D before or after it shows the definitions instead */
+	if (!params.command)
+		params.command = 'a';
+	return ret;
+}
+
 static int opt_set_filter_with_command(const struct option *opt,
 				       const char *str, int unset)
 {
@@ -328,6 +381,7 @@ static void cleanup_params(void)
 
 	for (i = 0; i < params.nevents; i++)
 		clear_perf_probe_event(params.events + i);
+	free(params.events);
 	line_range__clear(&params.line_range);
 	free(params.target);
 	strfilter__delete(params.filter);
@@ -543,6 +597,9 @@ __cmd_probe(int argc, const char **argv)
 		"\t\tARG:\tProbe argument (kprobe-tracer argument format.)\n",
 #endif
 		opt_add_probe_event),
+	OPT_CALLBACK(0, "batch", NULL, "file",
+		"add the probe definitions of a file, one per line ('-' for stdin)",
+		opt_add_probe_batch),
 	OPT_CALLBACK('D', "definition", NULL, PROBEDEF_STR,
 		"Show trace event definition of given traceevent for k/uprobe_events.",
 		opt_add_probe_event),
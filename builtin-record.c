@@ -13,6 +13,7 @@
 #include "util/build-id.h"
 #include "util/util.h"
 #include <subcmd/parse-options.h>
+#include <api/fd/array.h>
 #include "util/parse-events.h"
 #include "util/config.h"
 
@@ -26,6 +27,10 @@
 #include "util/session.h"
 #include "util/tool.h"
 #include "util/symbol.h"
+#include "util/machine.h"
+#include "util/map.h"
+#include "util/thread.h"
+#include "util/dso.h"
 #include "util/cpumap.h"
 #include "util/thread_map.h"
 #include "util/data.h"
@@ -42,17 +47,27 @@
 #include "util/time-utils.h"
 #include "util/units.h"
 #include "util/bpf-event.h"
+#include "util/net-output.h"
 #include "asm/bug.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <locale.h>
 #include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sched.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#ifdef HAVE_LIBURING_SUPPORT
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+#include <linux/log2.h>
 #include <linux/time64.h>
 
 struct switch_output {
@@ -62,9 +77,143 @@ struct switch_output {
 	unsigned long	 time;
 	const char	*str;
 	bool		 set;
-	char		 **filenames;
+	/* The rotated files still subject to the retention, oldest first */
+	struct list_head files;
+	int		 nr_files;
 	int		 num_files;
-	int		 cur_file;
+	const char	*max_age_str;
+	unsigned long	 max_age;
+	/* SIGUSR2 asked to preserve the window around now */
+	volatile int	 keep;
+	unsigned int	 keep_after;
+	unsigned int	 keep_left;
+	/* The previous file, while it gets its build-ids in the background */
+	pthread_t	 finalize_tid;
+	char		*finalize_path;
+};
+
+/*
+ * --flight-recorder: what the forward ring buffer of one mmap had lately,
+ * head and tail count bytes since the start, tail is where the oldest
+ * event still in the buffer starts.
+ */
+struct record_flight {
+	void			*base;
+	size_t			 size;
+	u64			 head;
+	u64			 tail;
+};
+
+/*
+ * --aux-snapshot-buffer: the AUX area data of one mmap, drained as it comes
+ * instead of left for the kernel to overwrite.  head and tail count bytes
+ * since the start, tail is where what wasn't written out yet starts, end
+ * is the offset in the AUX area of the byte at head.
+ */
+struct record_aux_ring {
+	void			*base;
+	size_t			 size;
+	u64			 head;
+	u64			 tail;
+	u64			 end;
+};
+
+/*
+ * --max-overhead: the sample periods are scaled up while the reader CPU
+ * time over the last interval is past the budget or the kernel lost or
+ * throttled samples, and back down while there's room.
+ */
+struct record_overhead {
+	double			 budget;
+	double			 scale;
+	u64			*orig;
+	u64			 last_ns;
+	u64			 last_cpu_ns;
+	u64			 lost;
+	u64			 throttled;
+	/* bytes of an event that started in the previous chunk */
+	size_t			 skip;
+};
+
+#define RECORD_OVERHEAD_INTERVAL_NS	NSEC_PER_SEC
+
+/*
+ * For --stats, the event an mmap chunk ended in the middle of, at the
+ * upper bound of the ring buffer, to be picked up in the next one.
+ */
+struct record_stats_cut {
+	/* bytes of it in the next chunk */
+	size_t			 skip;
+	/* where its lost count is in the next chunk, plus one, if LOST */
+	size_t			 lost_at;
+};
+
+struct switch_output_file {
+	struct list_head list;
+	char		*path;
+	time_t		 time;
+};
+
+struct record;
+
+/*
+ * With --threads every record_thread owns a subset of evlist->mmap and
+ * drains it into its own file of the directory data format, data.<idx>.
+ */
+struct record_thread {
+	pthread_t		 tid;
+	bool			 running;
+	struct record		*rec;
+	struct perf_data_file	*file;
+	struct perf_mmap	**maps;
+	int			 nr_mmaps;
+	struct fdarray		 pollfd;
+	int			 ctlfd[2];
+	cpu_set_t		 mask;
+	u64			 bytes_written;
+	unsigned long long	 samples;
+	int			 err;
+	/* for --stats, added up when the thread is stopped */
+	u64			 polls;
+	u64			 poll_ns;
+	u64			 poll_max_ns;
+};
+
+#ifdef HAVE_LIBURING_SUPPORT
+/*
+ * A write request in flight on the io_uring, one per aio control block
+ * of every mmap, see record__uring_req().
+ */
+struct record_uring_req {
+	struct perf_mmap	*map;
+	struct aiocb		*cblock;
+	struct iovec		 iov;
+	int			 buf_index;
+};
+#endif
+
+/* A sample whose map wasn't known yet, see record__buildids_retry() */
+struct record_hit {
+	u32			pid;
+	u32			tid;
+	u64			ip;
+	u8			cpumode;
+	u8			rounds;
+};
+
+/*
+ * The dsos hit, found out from the events as they get written instead
+ * of reading all the data back when recording ends.
+ */
+struct record_buildids {
+	bool			live;
+	u64			samples;
+	/* the beginning of an event a chunk ended in the middle of */
+	void			*carry;
+	size_t			carry_len;
+	struct record_hit	*retry;
+	unsigned int		nr_retry;
+	unsigned int		alloc_retry;
 };
 
 struct record {
@@ -83,25 +232,87 @@ struct record {
 	bool			buildid_all;
 	bool			timestamp_filename;
 	bool			timestamp_boundary;
+	bool			off_cpu;
+	bool			target_cgroup;
+	/* the tasks of the cgroup of the target, for --target-cgroup */
+	struct thread_map	*cgroup_threads;
 	struct switch_output	switch_output;
+	struct record_buildids	buildids;
 	unsigned long long	samples;
 	cpu_set_t		affinity_mask;
+	struct record_thread	*threads;
+	int			nr_threads;
+	struct perf_tsc_conversion tc;
+	bool			time_index_tsc;
+	u64			time_index_bytes;
+	u64			time_index_size;
+	struct record_overhead	overhead;
+	const char		*net_addr;
+	const char		*net_queue_str;
+	const char		*net_backpressure;
+	struct net_output	*net;
+	const char		*flight_str;
+	unsigned long		flight_size;
+	struct record_flight	*flight;
+	const char		*aux_ring_str;
+	unsigned long		aux_ring_size;
+	struct record_aux_ring	*aux_ring;
+	bool			stats;
+	struct record_stats_cut	*stats_cut;
+#ifdef HAVE_LIBURING_SUPPORT
+	struct io_uring		uring;
+	struct record_uring_req	*uring_reqs;
+	int			uring_efd;
+	bool			uring_fixed;
+	bool			uring_inplace;
+#endif
 };
 
 static volatile int auxtrace_record__snapshot_started;
 static DEFINE_TRIGGER(auxtrace_snapshot_trigger);
 static DEFINE_TRIGGER(switch_output_trigger);
 
+static struct parse_tag tags_size[] = {
+	{ .tag  = 'B', .mult = 1       },
+	{ .tag  = 'K', .mult = 1 << 10 },
+	{ .tag  = 'M', .mult = 1 << 20 },
+	{ .tag  = 'G', .mult = 1 << 30 },
+	{ .tag  = 0 },
+};
+
 static const char *affinity_tags[PERF_AFFINITY_MAX] = {
 	"SYS", "NODE", "CPU"
 };
 
+static const char *thread_spec_tags[THREAD_SPEC__MAX] = {
+	"undefined", "cpu", "core", "socket", "numa"
+};
+
+static bool record__threads_enabled(struct record *rec)
+{
+	return rec->opts.threads_spec != THREAD_SPEC__UNDEFINED;
+}
+
+static bool record__comp_enabled(struct record *rec)
+{
+	return rec->opts.comp_level > 0;
+}
+
 static bool switch_output_signal(struct record *rec)
 {
 	return rec->switch_output.signal &&
 	       trigger_is_ready(&switch_output_trigger);
 }
 
+/* With a size or time rotation and a retention, SIGUSR2 preserves the window */
+static bool switch_output_keep(struct record *rec)
+{
+	return rec->switch_output.enabled && !rec->switch_output.signal &&
+	       (rec->switch_output.num_files || rec->switch_output.max_age) &&
+	       !rec->opts.auxtrace_snapshot_mode &&
+	       trigger_is_ready(&switch_output_trigger);
+}
+
 static bool switch_output_size(struct record *rec)
 {
 	return rec->switch_output.size &&
@@ -115,16 +326,131 @@ static bool switch_output_time(struct record *rec)
 	       trigger_is_ready(&switch_output_trigger);
 }
 
-static int record__write(struct record *rec, struct perf_mmap *map __maybe_unused,
+/* The --stats of an mmap of the evlist, the overwrite ones aren't accounted */
+static struct record_mmap_stats *record__mmap_stats(struct record *rec, struct perf_mmap *map)
+{
+	if (!rec->stats || !map || map->overwrite)
+		return NULL;
+	return &rec->session->header.env.record_stats[map - rec->evlist->mmap];
+}
+
+/*
+ * Count the events of a chunk of an mmap as it is pushed, the way
+ * record__overhead_chunk() does, along with the samples the LOST
+ * records say the kernel dropped.
+ */
+static void record__stats_chunk(struct record *rec, struct perf_mmap *map,
+				void *bf, size_t size)
+{
+	struct record_mmap_stats *st = record__mmap_stats(rec, map);
+	struct record_stats_cut *cut;
+	size_t off;
+
+	if (!st)
+		return;
+
+	cut = &rec->stats_cut[map - rec->evlist->mmap];
+	st->bytes += size;
+
+	/* the chunks are cut at page bounds, so a u64 never is */
+	if (cut->lost_at) {
+		if (cut->lost_at - 1 + sizeof(u64) <= size)
+			st->lost += *(u64 *)(bf + cut->lost_at - 1);
+		cut->lost_at = 0;
+	}
+
+	if (cut->skip >= size) {
+		cut->skip -= size;
+		return;
+	}
+
+	for (off = cut->skip, cut->skip = 0; off + sizeof(struct perf_event_header) <= size; ) {
+		struct perf_event_header *hdr = bf + off;
+		size_t lost_off = 0;
+
+		if (hdr->size < sizeof(*hdr))
+			break;
+
+		st->events++;
+		switch (hdr->type) {
+		case PERF_RECORD_LOST:
+			lost_off = off + offsetof(struct lost_event, lost);
+			break;
+		case PERF_RECORD_LOST_SAMPLES:
+			lost_off = off + offsetof(struct lost_samples_event, lost);
+			break;
+		case PERF_RECORD_THROTTLE:
+			st->throttle++;
+			break;
+		case PERF_RECORD_UNTHROTTLE:
+			st->unthrottle++;
+			break;
+		default:
+			break;
+		}
+
+		if (lost_off) {
+			st->lost_records++;
+			if (lost_off + sizeof(u64) <= size)
+				st->lost += *(u64 *)(bf + lost_off);
+			else
+				cut->lost_at = lost_off - size + 1;
+		}
+
+		if (off + hdr->size > size) {
+			cut->skip = off + hdr->size - size;
+			break;
+		}
+		off += hdr->size;
+	}
+}
+
+/* How full the mmap is as it gets drained, returns when the drain starts */
+static u64 record__stats_drain_start(struct record_mmap_stats *st, struct perf_mmap *map)
+{
+	u64 used = perf_mmap__read_head(map) - map->prev;
+
+	if (used > st->max_used)
+		st->max_used = used;
+	return rdclock();
+}
+
+static void record__stats_drain_end(struct record_mmap_stats *st, u64 start, u64 bytes)
+{
+	st->push_ns += rdclock() - start;
+	if (st->bytes != bytes)
+		st->reads++;
+}
+
+static void record__stats_poll(u64 *polls, u64 *poll_ns, u64 *poll_max_ns, u64 start)
+{
+	u64 ns = rdclock() - start;
+
+	(*polls)++;
+	*poll_ns += ns;
+	if (ns > *poll_max_ns)
+		*poll_max_ns = ns;
+}
+
+static int record__write(struct record *rec, struct perf_mmap *map,
 			 void *bf, size_t size)
 {
 	struct perf_data_file *file = &rec->session->data->file;
+	struct record_mmap_stats *st = record__mmap_stats(rec, map);
+	u64 start = st ? rdclock() : 0;
 
-	if (perf_data_file__write(file, bf, size) < 0) {
+	if (rec->net) {
+		if (net_output__write(rec->net, bf, size) < 0) {
+			pr_err("failed to queue perf data for %s\n", rec->net_addr);
+			return -1;
+		}
+	} else if (perf_data_file__write(file, bf, size) < 0) {
 		pr_err("failed to write perf data, error: %m\n");
 		return -1;
 	}
 
+	if (st)
+		st->write_ns += rdclock() - start;
 	rec->bytes_written += size;
 
 	if (switch_output_size(rec))
@@ -133,6 +459,310 @@ static int record__write(struct record *rec, struct perf_mmap *map __maybe_unuse
 	return 0;
 }
 
+#ifdef HAVE_LIBURING_SUPPORT
+static bool record__uring_enabled(struct record *rec)
+{
+	return rec->opts.io_uring;
+}
+
+/*
+ * Data goes right from the kernel buffers when they are registered,
+ * unless it has to be transformed on the way.
+ */
+static bool record__uring_inplace(struct record *rec, struct perf_mmap *map)
+{
+	return rec->uring_inplace && !map->overwrite && !rec->opts.comp_level;
+}
+
+static struct record_uring_req *
+record__uring_req(struct record *rec, struct perf_mmap *map, struct aiocb *cblock)
+{
+	int idx = (map - rec->evlist->mmap) * rec->opts.nr_cblocks +
+		  (cblock - map->aio.cblocks);
+
+	return &rec->uring_reqs[idx];
+}
+
+static int record__uring_submit(struct record *rec, struct record_uring_req *req)
+{
+	struct aiocb *cblock = req->cblock;
+	char msg[STRERR_BUFSIZE];
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	sqe = io_uring_get_sqe(&rec->uring);
+	if (!sqe) {
+		pr_err("failed to queue perf data, io_uring is full\n");
+		return -1;
+	}
+
+	if (rec->uring_fixed) {
+		io_uring_prep_write_fixed(sqe, cblock->aio_fildes, (void *)cblock->aio_buf,
+					  cblock->aio_nbytes, cblock->aio_offset,
+					  req->buf_index);
+	} else {
+		req->iov.iov_base = (void *)cblock->aio_buf;
+		req->iov.iov_len  = cblock->aio_nbytes;
+		io_uring_prep_writev(sqe, cblock->aio_fildes, &req->iov, 1,
+				     cblock->aio_offset);
+	}
+	io_uring_sqe_set_data(sqe, req);
+
+	ret = io_uring_submit(&rec->uring);
+	if (ret < 0) {
+		pr_err("failed to queue perf data, error: %s\n", str_error_r(-ret, msg, sizeof(msg)));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int record__uring_write(struct record *rec, struct perf_mmap *map,
+			       struct aiocb *cblock, int trace_fd,
+			       void *buf, size_t size, off_t off)
+{
+	struct record_uring_req *req = record__uring_req(rec, map, cblock);
+	int rc;
+
+	cblock->aio_fildes = trace_fd;
+	cblock->aio_buf    = buf;
+	cblock->aio_nbytes = size;
+	cblock->aio_offset = off;
+
+	req->map    = map;
+	req->cblock = cblock;
+	if (record__uring_inplace(rec, map))
+		req->buf_index = map - rec->evlist->mmap;
+	else
+		req->buf_index = (rec->uring_inplace ? rec->evlist->nr_mmaps : 0) +
+				 (req - rec->uring_reqs);
+
+	rc = record__uring_submit(rec, req);
+	if (rc)
+		cblock->aio_fildes = -1;
+
+	return rc;
+}
+
+static void record__uring_complete(struct record *rec, struct io_uring_cqe *cqe)
+{
+	struct record_uring_req *req = io_uring_cqe_get_data(cqe);
+	struct aiocb *cblock = req->cblock;
+	ssize_t written = cqe->res;
+	char msg[STRERR_BUFSIZE];
+
+	io_uring_cqe_seen(&rec->uring, cqe);
+
+	if (written == -EINTR || written == -EAGAIN)
+		written = 0;
+
+	if (written < 0) {
+		pr_err("failed to write perf data, error: %s\n", str_error_r(-written, msg, sizeof(msg)));
+	} else if ((size_t)written < cblock->aio_nbytes) {
+		/*
+		 * The write request requires restart with the
+		 * reminder if the kernel didn't write whole
+		 * chunk at once.
+		 */
+		cblock->aio_buf    = (void *)cblock->aio_buf + written;
+		cblock->aio_nbytes -= written;
+		cblock->aio_offset += written;
+		if (!record__uring_submit(rec, req))
+			return;
+	}
+
+	cblock->aio_fildes = -1;
+	perf_mmap__aio_consume_inplace(req->map);
+	/*
+	 * md->refcount is incremented in perf_mmap__aio_push() for
+	 * every enqueued write request, drop it as it is complete.
+	 */
+	perf_mmap__put(req->map);
+}
+
+/* Complete the writes that are done, as signalled thru the poll loop. */
+static void record__uring_reap(struct record *rec)
+{
+	struct io_uring_cqe *cqe;
+	u64 count;
+
+	if (!record__uring_enabled(rec))
+		return;
+
+	if (read(rec->uring_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		pr_debug("failed to read io_uring eventfd, error: %m\n");
+
+	while (!io_uring_peek_cqe(&rec->uring, &cqe) && cqe)
+		record__uring_complete(rec, cqe);
+}
+
+static int record__uring_sync(struct record *rec, struct perf_mmap *md, bool sync_all)
+{
+	struct aiocb *cblocks = md->aio.cblocks;
+	struct io_uring_cqe *cqe;
+	char msg[STRERR_BUFSIZE];
+	int i, busy, ret;
+
+	do {
+		busy = 0;
+		for (i = 0; i < md->aio.nr_cblocks; ++i) {
+			if (cblocks[i].aio_fildes != -1)
+				busy = 1;
+			else if (!sync_all && !md->aio.inplace)
+				return i;
+		}
+		if (!busy)
+			return sync_all ? -1 : 0;
+
+		ret = io_uring_wait_cqe(&rec->uring, &cqe);
+		if (ret < 0) {
+			if (ret == -EINTR)
+				continue;
+			pr_err("failed to sync perf data, error: %s\n", str_error_r(-ret, msg, sizeof(msg)));
+			return -1;
+		}
+		record__uring_complete(rec, cqe);
+	} while (1);
+}
+
+static int record__uring_init(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	int i, err, nr_reqs = evlist->nr_mmaps * rec->opts.nr_cblocks;
+	char msg[STRERR_BUFSIZE];
+	struct iovec *bufs;
+
+	rec->uring_efd = -1;
+	if (!record__uring_enabled(rec))
+		return 0;
+
+	err = io_uring_queue_init(roundup_pow_of_two(nr_reqs), &rec->uring, 0);
+	if (err < 0) {
+		pr_err("failed to setup io_uring, error: %s\n", str_error_r(-err, msg, sizeof(msg)));
+		rec->opts.io_uring = false;
+		return -1;
+	}
+
+	rec->uring_reqs = calloc(nr_reqs, sizeof(*rec->uring_reqs));
+	if (!rec->uring_reqs)
+		return -ENOMEM;
+
+	/*
+	 * Register the kernel buffers followed by the aio data buffers,
+	 * that gets the writes rid of the per request page pinning and
+	 * lets them go right from the kernel buffers. Not every kernel
+	 * can pin the perf buffers, then only the aio data buffers are
+	 * registered and the data is copied there as with Posix AIO.
+	 */
+	bufs = calloc(evlist->nr_mmaps + nr_reqs, sizeof(*bufs));
+	if (!bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct perf_mmap *map = &evlist->mmap[i];
+		int j;
+
+		bufs[i].iov_base = map->base + page_size;
+		bufs[i].iov_len  = map->mask + 1;
+
+		for (j = 0; j < map->aio.nr_cblocks; j++) {
+			struct iovec *buf = &bufs[evlist->nr_mmaps + i * rec->opts.nr_cblocks + j];
+
+			buf->iov_base = map->aio.data[j];
+			buf->iov_len  = perf_mmap__mmap_len(map);
+		}
+	}
+
+	err = io_uring_register_buffers(&rec->uring, bufs, evlist->nr_mmaps + nr_reqs);
+	if (!err) {
+		rec->uring_fixed = rec->uring_inplace = true;
+	} else {
+		pr_debug("failed to register kernel buffers with io_uring, error: %s\n",
+			 str_error_r(-err, msg, sizeof(msg)));
+		err = io_uring_register_buffers(&rec->uring, bufs + evlist->nr_mmaps, nr_reqs);
+		if (!err)
+			rec->uring_fixed = true;
+	}
+	free(bufs);
+
+	rec->uring_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rec->uring_efd < 0) {
+		pr_err("failed to create io_uring eventfd, error: %m\n");
+		return -1;
+	}
+
+	err = io_uring_register_eventfd(&rec->uring, rec->uring_efd);
+	if (err < 0) {
+		pr_err("failed to register io_uring eventfd, error: %s\n", str_error_r(-err, msg, sizeof(msg)));
+		return -1;
+	}
+
+	if (perf_evlist__add_pollfd(evlist, rec->uring_efd) < 0) {
+		pr_err("failed to poll io_uring eventfd\n");
+		return -1;
+	}
+
+	pr_debug("io_uring: %d entries, %s writes\n", nr_reqs,
+		 rec->uring_inplace ? "in place" :
+		 rec->uring_fixed ? "registered buffer" : "copying");
+
+	return 0;
+}
+
+static void record__uring_exit(struct record *rec)
+{
+	if (!record__uring_enabled(rec))
+		return;
+
+	io_uring_queue_exit(&rec->uring);
+	if (rec->uring_efd >= 0)
+		close(rec->uring_efd);
+	zfree(&rec->uring_reqs);
+}
+#else
+static bool record__uring_enabled(struct record *rec __maybe_unused)
+{
+	return false;
+}
+
+static bool record__uring_inplace(struct record *rec __maybe_unused,
+				  struct perf_mmap *map __maybe_unused)
+{
+	return false;
+}
+
+#ifdef HAVE_AIO_SUPPORT
+static int record__uring_write(struct record *rec __maybe_unused,
+			       struct perf_mmap *map __maybe_unused,
+			       struct aiocb *cblock __maybe_unused,
+			       int trace_fd __maybe_unused, void *buf __maybe_unused,
+			       size_t size __maybe_unused, off_t off __maybe_unused)
+{
+	return -1;
+}
+
+static int record__uring_sync(struct record *rec __maybe_unused,
+			      struct perf_mmap *md __maybe_unused,
+			      bool sync_all __maybe_unused)
+{
+	return -1;
+}
+#endif
+
+static void record__uring_reap(struct record *rec __maybe_unused)
+{
+}
+
+static int record__uring_init(struct record *rec __maybe_unused)
+{
+	return 0;
+}
+
+static void record__uring_exit(struct record *rec __maybe_unused)
+{
+}
+#endif
+
 #ifdef HAVE_AIO_SUPPORT
 static int record__aio_write(struct aiocb *cblock, int trace_fd,
 		void *buf, size_t size, off_t off)
@@ -205,13 +835,16 @@ static int record__aio_complete(struct perf_mmap *md, struct aiocb *cblock)
 	return rc;
 }
 
-static int record__aio_sync(struct perf_mmap *md, bool sync_all)
+static int record__aio_sync(struct record *rec, struct perf_mmap *md, bool sync_all)
 {
 	struct aiocb **aiocb = md->aio.aiocb;
 	struct aiocb *cblocks = md->aio.cblocks;
 	struct timespec timeout = { 0, 1000 * 1000  * 1 }; /* 1ms */
 	int i, do_suspend;
 
+	if (record__uring_enabled(rec))
+		return record__uring_sync(rec, md, sync_all);
+
 	do {
 		do_suspend = 0;
 		for (i = 0; i < md->aio.nr_cblocks; ++i) {
@@ -240,14 +873,28 @@ static int record__aio_sync(struct perf_mmap *md, bool sync_all)
 	} while (1);
 }
 
-static int record__aio_pushfn(void *to, struct aiocb *cblock, void *bf, size_t size, off_t off)
+static int record__aio_pushfn(struct perf_mmap *map, void *to, struct aiocb *cblock,
+			      void *bf, size_t size, off_t off)
 {
 	struct record *rec = to;
+	struct record_mmap_stats *st = record__mmap_stats(rec, map);
 	int ret, trace_fd = rec->session->data->file.fd;
+	u64 start = 0;
 
 	rec->samples++;
 
-	ret = record__aio_write(cblock, trace_fd, bf, size, off);
+	/* written right from the ring buffer, it wasn't seen by record__aio_copyfn() */
+	if (record__uring_inplace(rec, map))
+		record__stats_chunk(rec, map, bf, size);
+
+	if (st)
+		start = rdclock();
+	if (record__uring_enabled(rec))
+		ret = record__uring_write(rec, map, cblock, trace_fd, bf, size, off);
+	else
+		ret = record__aio_write(cblock, trace_fd, bf, size, off);
+	if (st)
+		st->write_ns += rdclock() - start;
 	if (!ret) {
 		rec->bytes_written += size;
 		if (switch_output_size(rec))
@@ -280,7 +927,7 @@ static void record__aio_mmap_read_sync(struct record *rec)
 		struct perf_mmap *map = &maps[i];
 
 		if (map->base)
-			record__aio_sync(map, true);
+			record__aio_sync(rec, map, true);
 	}
 }
 
@@ -307,13 +954,15 @@ static int record__aio_parse(const struct option *opt,
 #else /* HAVE_AIO_SUPPORT */
 static int nr_cblocks_max = 0;
 
-static int record__aio_sync(struct perf_mmap *md __maybe_unused, bool sync_all __maybe_unused)
+static int record__aio_sync(struct record *rec __maybe_unused, struct perf_mmap *md __maybe_unused,
+			    bool sync_all __maybe_unused)
 {
 	return -1;
 }
 
-static int record__aio_pushfn(void *to __maybe_unused, struct aiocb *cblock __maybe_unused,
-		void *bf __maybe_unused, size_t size __maybe_unused, off_t off __maybe_unused)
+static int record__aio_pushfn(struct perf_mmap *map __maybe_unused, void *to __maybe_unused,
+		struct aiocb *cblock __maybe_unused, void *bf __maybe_unused,
+		size_t size __maybe_unused, off_t off __maybe_unused)
 {
 	return -1;
 }
@@ -332,9 +981,284 @@ static void record__aio_mmap_read_sync(struct record *rec __maybe_unused)
 }
 #endif
 
-static int record__aio_enabled(struct record *rec)
+static size_t process_comp_header(void *record, size_t increment)
 {
-	return rec->opts.nr_cblocks > 0;
+	struct compressed_event *event = record;
+	size_t size = sizeof(*event);
+
+	if (increment) {
+		event->header.size += increment;
+		return increment;
+	}
+
+	event->header.type = PERF_RECORD_COMPRESSED;
+	event->header.size = size;
+
+	return size;
+}
+
+static size_t zstd_compress(struct perf_session *session, void *dst, size_t dst_size,
+			    void *src, size_t src_size)
+{
+	size_t compressed;
+	size_t max_record_size = PERF_SAMPLE_MAX_SIZE - sizeof(struct compressed_event) - 1;
+
+	compressed = zstd_compress_stream_to_records(&session->zstd_data, dst, dst_size, src, src_size,
+						     max_record_size, process_comp_header);
+
+	session->bytes_transferred += src_size;
+	session->bytes_compressed  += compressed;
+
+	return compressed;
+}
+
+static size_t record__aio_copyfn(struct perf_mmap *map, void *to,
+				 void *dst, size_t dst_size, void *src, size_t src_size)
+{
+	struct record *rec = to;
+
+	record__stats_chunk(rec, map, src, src_size);
+
+	if (record__comp_enabled(rec)) {
+		struct record_mmap_stats *st = record__mmap_stats(rec, map);
+		u64 start = st ? rdclock() : 0;
+		size_t size = zstd_compress(rec->session, dst, dst_size, src, src_size);
+
+		if (st)
+			st->compress_ns += rdclock() - start;
+		return size;
+	}
+
+	memcpy(dst, src, src_size);
+	return src_size;
+}
+
+static unsigned int comp_level_default = 1;
+static unsigned int comp_level_max = 22;
+
+static int record__parse_comp_level(const struct option *opt, const char *str, int unset)
+{
+	struct record_opts *opts = opt->value;
+
+	if (unset) {
+		opts->comp_level = 0;
+	} else {
+		if (str)
+			opts->comp_level = strtol(str, NULL, 0);
+		if (!opts->comp_level)
+			opts->comp_level = comp_level_default;
+	}
+
+	return 0;
+}
+
+/* Forced reads of the maps that are below --mmap-flush, in ms */
+#define MMAP_FLUSH_TIMEOUT	1000
+
+static int record__parse_mmap_flush(const struct option *opt, const char *str, int unset)
+{
+	struct record_opts *opts = opt->value;
+	unsigned long flush;
+
+	if (unset || !str) {
+		opts->mmap_flush = 1;
+		return 0;
+	}
+
+	flush = parse_tag_value(str, tags_size);
+	if (flush == (unsigned long)-1) {
+		char *endptr;
+
+		flush = strtoul(str, &endptr, 0);
+		if (*endptr) {
+			pr_err("Invalid --mmap-flush size: %s\n", str);
+			return -1;
+		}
+	}
+
+	/* the cap depends on the map size, see record__mmap_evlist() */
+	opts->mmap_flush = min(flush, (unsigned long)INT_MAX) ?: 1;
+	return 0;
+}
+
+static int record__aio_enabled(struct record *rec)
+{
+	return rec->opts.nr_cblocks > 0;
+}
+
+/* Samples that can't be resolved after that many rounds are dropped */
+#define RECORD_HIT_ROUNDS	2
+#define RECORD_HIT_MAX		(1 << 16)
+
+static bool record__buildids_mark(struct record *rec, struct record_hit *hit)
+{
+	struct machine *machine = &rec->session->machines.host;
+	struct addr_location al;
+	struct thread *thread;
+	bool found;
+
+	thread = machine__findnew_thread(machine, hit->pid, hit->tid);
+	if (thread == NULL)
+		return false;
+
+	found = thread__find_map(thread, hit->cpumode, hit->ip, &al) != NULL;
+	if (found)
+		al.map->dso->hit = 1;
+
+	thread__put(thread);
+	return found;
+}
+
+static void record__buildids_retry_add(struct record *rec, struct record_hit *hit)
+{
+	struct record_buildids *b = &rec->buildids;
+
+	if (b->nr_retry == b->alloc_retry) {
+		unsigned int alloc = b->alloc_retry ? b->alloc_retry * 2 : 256;
+		struct record_hit *retry;
+
+		if (alloc > RECORD_HIT_MAX)
+			return;
+
+		retry = realloc(b->retry, alloc * sizeof(*retry));
+		if (retry == NULL)
+			return;
+		b->retry = retry;
+		b->alloc_retry = alloc;
+	}
+
+	b->retry[b->nr_retry++] = *hit;
+}
+
+/*
+ * The mmaps are read one after the other, a sample may come before the
+ * mmap event of its map when they are in different mmaps, so the ones
+ * not resolved are tried again at the end of the next rounds.
+ */
+static void record__buildids_retry(struct record *rec, bool last)
+{
+	struct record_buildids *b = &rec->buildids;
+	unsigned int i, nr = 0;
+
+	for (i = 0; i < b->nr_retry; i++) {
+		struct record_hit *hit = &b->retry[i];
+
+		if (record__buildids_mark(rec, hit) || last ||
+		    ++hit->rounds == RECORD_HIT_ROUNDS)
+			continue;
+
+		b->retry[nr++] = *hit;
+	}
+
+	b->nr_retry = nr;
+}
+
+static void record__buildids_sample(struct record *rec,
+				    struct perf_sample *sample)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	struct record_hit hit = {
+		.pid	 = sample->pid,
+		.tid	 = sample->tid,
+		.ip	 = sample->ip,
+		.cpumode = sample->cpumode,
+	};
+
+	/* not in time order across the mmaps */
+	if (evlist->first_sample_time == 0 ||
+	    sample->time < evlist->first_sample_time)
+		evlist->first_sample_time = sample->time;
+
+	if (sample->time > evlist->last_sample_time)
+		evlist->last_sample_time = sample->time;
+
+	if (rec->buildid_all)
+		return;
+
+	rec->buildids.samples++;
+	if (!record__buildids_mark(rec, &hit))
+		record__buildids_retry_add(rec, &hit);
+}
+
+/*
+ * Keep the host threads and maps up to date with the events written, the
+ * threads that exit are kept as their samples may still be in other mmaps.
+ */
+static void record__buildids_event(struct record *rec, union perf_event *event)
+{
+	struct machine *machine = &rec->session->machines.host;
+	u8 cpumode = event->header.misc & PERF_RECORD_MISC_CPUMODE_MASK;
+	struct perf_sample sample;
+
+	switch (event->header.type) {
+	case PERF_RECORD_SAMPLE:
+	case PERF_RECORD_MMAP:
+	case PERF_RECORD_MMAP2:
+	case PERF_RECORD_COMM:
+	case PERF_RECORD_FORK:
+		break;
+	default:
+		return;
+	}
+
+	/* the guests are left to process_buildids() */
+	if (cpumode == PERF_RECORD_MISC_GUEST_KERNEL ||
+	    cpumode == PERF_RECORD_MISC_GUEST_USER) {
+		pr_debug("Guest events, reading the build-ids back after recording\n");
+		rec->buildids.live = false;
+		return;
+	}
+
+	if (perf_evlist__parse_sample(rec->evlist, event, &sample))
+		return;
+
+	if (event->header.type == PERF_RECORD_SAMPLE)
+		record__buildids_sample(rec, &sample);
+	else
+		machine__process_event(machine, event, &sample);
+}
+
+/*
+ * The header of an event is always in a chunk, the u64 alignment of the
+ * ring buffer sees to it, the rest may be in the next one.
+ */
+static void record__buildids_chunk(struct record *rec, void *bf, size_t size)
+{
+	struct record_buildids *b = &rec->buildids;
+	size_t off = 0;
+
+	if (b->carry_len) {
+		union perf_event *event = b->carry;
+		size_t len = min_t(size_t, size, event->header.size - b->carry_len);
+
+		memcpy(b->carry + b->carry_len, bf, len);
+		b->carry_len += len;
+		off = len;
+		if (b->carry_len < event->header.size)
+			return;
+
+		b->carry_len = 0;
+		record__buildids_event(rec, event);
+	}
+
+	while (b->live && off + sizeof(struct perf_event_header) <= size) {
+		union perf_event *event = bf + off;
+
+		if (event->header.size < sizeof(event->header)) {
+			pr_debug("Bad event size, reading the build-ids back after recording\n");
+			b->live = false;
+			return;
+		}
+
+		if (off + event->header.size > size) {
+			memcpy(b->carry, event, size - off);
+			b->carry_len = size - off;
+			return;
+		}
+
+		record__buildids_event(rec, event);
+		off += event->header.size;
+	}
 }
 
 static int process_synthesized_event(struct perf_tool *tool,
@@ -343,13 +1267,184 @@ static int process_synthesized_event(struct perf_tool *tool,
 				     struct machine *machine __maybe_unused)
 {
 	struct record *rec = container_of(tool, struct record, tool);
+
+	if (rec->buildids.live)
+		record__buildids_event(rec, event);
+
 	return record__write(rec, NULL, event, event->header.size);
 }
 
+static void record__overhead_chunk(struct record *rec, void *bf, size_t size)
+{
+	struct record_overhead *o = &rec->overhead;
+	size_t off;
+
+	if (o->skip >= size) {
+		o->skip -= size;
+		return;
+	}
+
+	for (off = o->skip, o->skip = 0; off + sizeof(struct perf_event_header) <= size; ) {
+		struct perf_event_header *hdr = bf + off;
+
+		if (hdr->size < sizeof(*hdr))
+			break;
+
+		if (hdr->type == PERF_RECORD_LOST || hdr->type == PERF_RECORD_LOST_SAMPLES)
+			o->lost++;
+		else if (hdr->type == PERF_RECORD_THROTTLE)
+			o->throttled++;
+
+		if (off + hdr->size > size) {
+			o->skip = off + hdr->size - size;
+			break;
+		}
+		off += hdr->size;
+	}
+}
+
+static u64 record__cpu_ns(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * NSEC_PER_SEC +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * NSEC_PER_USEC;
+}
+
+static bool record__overhead_sampling(struct perf_evsel *evsel)
+{
+	return !(evsel->attr.type == PERF_TYPE_SOFTWARE &&
+		 evsel->attr.config == PERF_COUNT_SW_DUMMY);
+}
+
+static int record__overhead_init(struct record *rec)
+{
+	struct record_overhead *o = &rec->overhead;
+	struct perf_evsel *evsel;
+
+	if (!o->budget)
+		return 0;
+
+	o->orig = calloc(rec->evlist->nr_entries, sizeof(*o->orig));
+	if (o->orig == NULL)
+		return -ENOMEM;
+
+	evlist__for_each_entry(rec->evlist, evsel) {
+		o->orig[evsel->idx] = evsel->attr.freq ? evsel->attr.sample_freq :
+							 evsel->attr.sample_period;
+	}
+
+	o->scale = 1;
+	o->last_ns = rdclock();
+	o->last_cpu_ns = record__cpu_ns();
+	return 0;
+}
+
+/*
+ * Runs every RECORD_OVERHEAD_INTERVAL_NS. Like 'perf c2c top' the budget
+ * is a percentage of the recorded cpus. Each sample has its period in it,
+ * so report weighs them right across the changes.
+ */
+static void record__overhead_control(struct record *rec)
+{
+	struct record_overhead *o = &rec->overhead;
+	int nr_cpus = cpu_map__nr(rec->evlist->cpus);
+	u64 now = rdclock(), cpu_ns, elapsed = now - o->last_ns;
+	double scale = o->scale, pct;
+	struct perf_evsel *evsel;
+
+	if (!o->budget || elapsed < RECORD_OVERHEAD_INTERVAL_NS)
+		return;
+
+	cpu_ns = record__cpu_ns();
+	pct = 100.0 * (cpu_ns - o->last_cpu_ns) / ((double)elapsed * (nr_cpus > 0 ? nr_cpus : 1));
+
+	if (pct > o->budget)
+		scale *= max(2.0, pct / o->budget);
+	else if (o->lost || o->throttled)
+		scale *= 2;
+	else if (pct < o->budget / 2)
+		scale = max(1.0, scale / 1.25);
+
+	if (scale != o->scale) {
+		pr_debug("overhead: %.2f%% of %.2f%%, %" PRIu64 " lost, %" PRIu64
+			 " throttled, periods scaled by %.2f\n",
+			 pct, o->budget, o->lost, o->throttled, scale);
+
+		evlist__for_each_entry(rec->evlist, evsel) {
+			u64 orig = o->orig[evsel->idx], value;
+
+			if (!orig || !record__overhead_sampling(evsel))
+				continue;
+
+			if (evsel->attr.freq)
+				value = max_t(u64, orig / scale, 1);
+			else
+				value = orig * scale;
+
+			if (perf_evsel__set_period(evsel, value))
+				pr_debug("Couldn't set the %s period to %" PRIu64 "\n",
+					 perf_evsel__name(evsel), value);
+		}
+		o->scale = scale;
+	}
+
+	o->lost = o->throttled = 0;
+	o->last_ns = now;
+	o->last_cpu_ns = cpu_ns;
+}
+
+static void record_flight__append(struct record_flight *fl, void *bf, size_t size)
+{
+	size_t off, n;
+
+	/* Make room, the events are u64 aligned so their headers don't wrap */
+	while (fl->head + size - fl->tail > fl->size && fl->tail < fl->head) {
+		struct perf_event_header *hdr = fl->base + fl->tail % fl->size;
+
+		fl->tail += hdr->size;
+	}
+
+	off = fl->head % fl->size;
+	n = min(size, fl->size - off);
+	memcpy(fl->base + off, bf, n);
+	memcpy(fl->base, bf + n, size - n);
+	fl->head += size;
+}
+
 static int record__pushfn(struct perf_mmap *map, void *to, void *bf, size_t size)
 {
 	struct record *rec = to;
 
+	if (rec->buildids.live)
+		record__buildids_chunk(rec, bf, size);
+
+	if (rec->overhead.budget)
+		record__overhead_chunk(rec, bf, size);
+
+	record__stats_chunk(rec, map, bf, size);
+
+	if (rec->flight) {
+		record_flight__append(&rec->flight[map - rec->evlist->mmap], bf, size);
+		rec->samples++;
+		return 0;
+	}
+
+	if (record__comp_enabled(rec)) {
+		struct record_mmap_stats *st = record__mmap_stats(rec, map);
+		u64 start = st ? rdclock() : 0;
+
+		size = zstd_compress(rec->session, map->data, perf_mmap__mmap_len(map), bf, size);
+		if (st)
+			st->compress_ns += rdclock() - start;
+		if (!size)
+			return -1;
+		bf = map->data;
+	}
+
 	rec->samples++;
 	return record__write(rec, map, bf, size);
 }
@@ -423,13 +1518,104 @@ static int record__process_auxtrace(struct perf_tool *tool,
 	return 0;
 }
 
+static void record_aux_ring__copy(struct record_aux_ring *ar, void *buf, size_t len)
+{
+	size_t off, n;
+
+	/* only the last size bytes are kept */
+	if (len > ar->size) {
+		ar->head += len - ar->size;
+		buf += len - ar->size;
+		len = ar->size;
+	}
+
+	off = ar->head % ar->size;
+	n = min(len, ar->size - off);
+	memcpy(ar->base + off, buf, n);
+	memcpy(ar->base, buf + n, len - n);
+	ar->head += len;
+}
+
+/* process_auxtrace_t that drains to the --aux-snapshot-buffer of the mmap */
+static int record__aux_ring_append(struct perf_tool *tool,
+				   struct perf_mmap *map,
+				   union perf_event *event, void *data1,
+				   size_t len1, void *data2, size_t len2)
+{
+	struct record *rec = container_of(tool, struct record, tool);
+	struct record_aux_ring *ar = &rec->aux_ring[map - rec->evlist->mmap];
+
+	record_aux_ring__copy(ar, data1, len1);
+	if (len2)
+		record_aux_ring__copy(ar, data2, len2);
+	if (ar->head - ar->tail > ar->size)
+		ar->tail = ar->head - ar->size;
+	ar->end = event->auxtrace.offset + len1 + len2;
+
+	return 0;
+}
+
+/*
+ * Write out what the --aux-snapshot-buffer of the mmap got since the last
+ * snapshot, after draining the AUX area, as one snapshot of all of it.
+ */
+static int record__aux_ring_snapshot(struct record *rec, struct perf_mmap *map)
+{
+	struct record_aux_ring *ar = &rec->aux_ring[map - rec->evlist->mmap];
+	struct auxtrace_mmap *mm = &map->auxtrace_mmap;
+	unsigned int alignment = rec->itr->alignment;
+	size_t size, off, len1;
+	union perf_event ev;
+	int ret;
+
+	ret = auxtrace_mmap__read(map, rec->itr, &rec->tool,
+				  record__aux_ring_append);
+	if (ret < 0)
+		return ret;
+
+	size = ar->head - ar->tail;
+	/* start at a whole record of the trace */
+	if (alignment && (ar->end - size) % alignment) {
+		size_t unwanted = alignment - (ar->end - size) % alignment;
+
+		size = size > unwanted ? size - unwanted : 0;
+	}
+	if (!size)
+		return 0;
+
+	off = (ar->head - size) % ar->size;
+	len1 = min(size, ar->size - off);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.auxtrace.header.type = PERF_RECORD_AUXTRACE;
+	ev.auxtrace.header.size = sizeof(ev.auxtrace);
+	/* the padding is written by record__process_auxtrace() */
+	ev.auxtrace.size = roundup(size, PERF_AUXTRACE_RECORD_ALIGNMENT);
+	ev.auxtrace.offset = ar->end - size;
+	ev.auxtrace.reference = auxtrace_record__reference(rec->itr);
+	ev.auxtrace.idx = mm->idx;
+	ev.auxtrace.tid = mm->tid;
+	ev.auxtrace.cpu = mm->cpu;
+
+	ar->tail = ar->head;
+
+	ret = record__process_auxtrace(&rec->tool, map, &ev, ar->base + off,
+				       len1, ar->base, size - len1);
+	if (ret)
+		return ret;
+
+	rec->samples++;
+	return 0;
+}
+
 static int record__auxtrace_mmap_read(struct record *rec,
 				      struct perf_mmap *map)
 {
 	int ret;
 
 	ret = auxtrace_mmap__read(map, rec->itr, &rec->tool,
-				  record__process_auxtrace);
+				  rec->aux_ring ? record__aux_ring_append :
+						  record__process_auxtrace);
 	if (ret < 0)
 		return ret;
 
@@ -444,6 +1630,9 @@ static int record__auxtrace_mmap_read_snapshot(struct record *rec,
 {
 	int ret;
 
+	if (rec->aux_ring)
+		return record__aux_ring_snapshot(rec, map);
+
 	ret = auxtrace_mmap__read_snapshot(map, rec->itr, &rec->tool,
 					   record__process_auxtrace,
 					   rec->opts.auxtrace_snapshot_size);
@@ -538,15 +1727,26 @@ static int record__mmap_evlist(struct record *rec,
 			       struct perf_evlist *evlist)
 {
 	struct record_opts *opts = &rec->opts;
+	int flush_max;
 	char msg[512];
 
-	if (opts->affinity != PERF_AFFINITY_SYS)
+	/* the huge staging buffers go on the node of their cpu */
+	if (opts->affinity != PERF_AFFINITY_SYS || opts->mmap_huge)
 		cpu__setup_cpunode_map();
 
+	/* leave room in the maps for what comes while one is read */
+	flush_max = perf_evlist__mmap_size(opts->mmap_pages) / 4;
+	if (opts->mmap_flush > flush_max)
+		opts->mmap_flush = flush_max;
+	pr_debug("mmap flush: %d\n", opts->mmap_flush);
+
 	if (perf_evlist__mmap_ex(evlist, opts->mmap_pages,
 				 opts->auxtrace_mmap_pages,
-				 opts->auxtrace_snapshot_mode,
-				 opts->nr_cblocks, opts->affinity) < 0) {
+				 /* the --aux-snapshot-buffer drains it instead */
+				 opts->auxtrace_snapshot_mode && !rec->aux_ring_str,
+				 opts->nr_cblocks, opts->affinity,
+				 opts->comp_level, opts->mmap_flush,
+				 opts->mmap_huge) < 0) {
 		if (errno == EPERM) {
 			pr_err("Permission error mapping pages.\n"
 			       "Consider increasing "
@@ -572,6 +1772,19 @@ static int record__mmap(struct record *rec)
 	return record__mmap_evlist(rec, rec->evlist);
 }
 
+/* How much of the staging buffers the kernel did back with huge pages */
+static void record__print_huge_stats(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	u64 total, huge;
+
+	if (perf_mmap__huge_stats(evlist->mmap, evlist->nr_mmaps, &total, &huge) || !total)
+		return;
+
+	fprintf(stderr, "[ perf record: %.3f MB of the %.3f MB of staging buffers in huge pages (%.1f%%) ]\n",
+		huge / 1024.0 / 1024.0, total / 1024.0 / 1024.0, 100.0 * huge / total);
+}
+
 static int record__open(struct record *rec)
 {
 	char msg[BUFSIZ];
@@ -592,6 +1805,9 @@ static int record__open(struct record *rec)
 
 		pos = perf_evlist__first(evlist);
 		pos->tracking = 0;
+		/* the side band events of --target-cgroup are in its cgroup too */
+		if (rec->target_cgroup)
+			evlist__set_default_cgroup(evlist, pos->cgrp);
 		pos = perf_evlist__last(evlist);
 		pos->tracking = 1;
 		pos->attr.enable_on_exec = 1;
@@ -735,55 +1951,386 @@ static void record__adjust_affinity(struct record *rec, struct perf_mmap *map)
 	}
 }
 
-static int record__mmap_read_evlist(struct record *rec, struct perf_evlist *evlist,
-				    bool overwrite)
-{
-	u64 bytes_written = rec->bytes_written;
-	int i;
-	int rc = 0;
-	struct perf_mmap *maps;
-	int trace_fd = rec->data.file.fd;
-	off_t off;
+/*
+ * Add a time index entry every this much data or time, whatever
+ * comes later.
+ */
+#define TIME_INDEX_BYTES	(4 * 1024 * 1024)
+#define TIME_INDEX_NSEC		(100 * NSEC_PER_MSEC)
 
-	if (!evlist)
-		return 0;
+/* The current time of the events clock, if it can be read. */
+static bool record__time_index_clock(struct record *rec, u64 *now)
+{
+	struct timespec ts;
 
-	maps = overwrite ? evlist->overwrite_mmap : evlist->mmap;
-	if (!maps)
-		return 0;
+	if (rec->opts.use_clockid) {
+		if (clock_gettime(rec->opts.clockid, &ts))
+			return false;
+		*now = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+		return true;
+	}
 
-	if (overwrite && evlist->bkw_mmap_state != BKW_MMAP_DATA_PENDING)
-		return 0;
+	if (!rec->time_index_tsc)
+		return false;
 
-	if (record__aio_enabled(rec))
-		off = record__aio_get_pos(trace_fd);
+	*now = tsc_to_perf_time(rdtsc(), &rec->tc);
+	return true;
+}
 
-	for (i = 0; i < evlist->nr_mmaps; i++) {
+/*
+ * Called after a round is written: everything before the current
+ * offset was read before now, so the events are not later than that.
+ * The events past the next round were generated after now, as only
+ * then the buffers were read again.
+ */
+static void record__time_index_add(struct record *rec)
+{
+	struct perf_header *header = &rec->session->header;
+	struct perf_env *env = &header->env;
+	struct time_index_entry *entry;
+	u64 now;
+
+	if (!perf_header__has_feat(header, HEADER_TIME_INDEX) ||
+	    !record__time_index_clock(rec, &now))
+		return;
+
+	if (env->nr_time_index &&
+	    rec->bytes_written - rec->time_index_bytes < TIME_INDEX_BYTES &&
+	    now - env->time_index[env->nr_time_index - 1].time < TIME_INDEX_NSEC)
+		return;
+
+	if (env->nr_time_index == rec->time_index_size) {
+		u64 size = rec->time_index_size ? rec->time_index_size * 2 : 1024;
+
+		entry = realloc(env->time_index, size * sizeof(*entry));
+		if (!entry) {
+			pr_debug("failed to allocate time index, disabling it\n");
+			perf_header__clear_feat(header, HEADER_TIME_INDEX);
+			return;
+		}
+		env->time_index = entry;
+		rec->time_index_size = size;
+	}
+
+	entry = &env->time_index[env->nr_time_index++];
+	entry->time   = now;
+	entry->offset = lseek(perf_data__fd(&rec->data), 0, SEEK_CUR);
+	rec->time_index_bytes = rec->bytes_written;
+}
+
+static void *record_flight__alloc(size_t size)
+{
+	void *base;
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_NORESERVE, -1, 0);
+	if (base != MAP_FAILED)
+		return base;
+
+	/* No hugetlbfs pages reserved, settle for THP */
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	madvise(base, size, MADV_HUGEPAGE);
+	return base;
+}
+
+/*
+ * Network output is pipe mode: the header, attributes and what gets
+ * synthesized at the start go to an unlinked file, to be sent at the
+ * start of every connection, the rest is queued for the sender thread.
+ */
+static int record__net_open(struct record *rec)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/perf-net-XXXXXX", getenv("TMPDIR") ?: "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		pr_err("Failed to create %s: %m\n", path);
+		return -errno;
+	}
+	unlink(path);
+
+	rec->data.file.fd = fd;
+	return 0;
+}
+
+static int record__net_start(struct record *rec)
+{
+	unsigned long max_queued = 64 << 20;
+	int err;
+
+	if (rec->net_queue_str) {
+		max_queued = parse_tag_value(rec->net_queue_str, tags_size);
+		if (max_queued == (unsigned long) -1 || !max_queued) {
+			pr_err("Invalid --net-queue: %s\n", rec->net_queue_str);
+			return -EINVAL;
+		}
+	}
+
+	rec->net = net_output__new(rec->net_addr, max_queued,
+				   rec->net_backpressure && !strcmp(rec->net_backpressure, "block"),
+				   perf_evlist__id_hdr_size(rec->evlist));
+	if (rec->net == NULL)
+		return -ENOMEM;
+
+	err = net_output__start(rec->net, perf_data__fd(&rec->data));
+	if (err)
+		pr_err("Failed to start sending to %s: %s\n", rec->net_addr, strerror(-err));
+	return err;
+}
+
+static int record__flight_init(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	/* at least two chunks of what one drain of the mmap can bring */
+	size_t size = roundup(max_t(size_t, rec->flight_size, 2 * evlist->mmap_len), 2 << 20);
+	int i;
+
+	if (!rec->flight_str)
+		return 0;
+
+	rec->flight = calloc(evlist->nr_mmaps, sizeof(*rec->flight));
+	if (rec->flight == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		rec->flight[i].base = record_flight__alloc(size);
+		if (rec->flight[i].base == NULL) {
+			pr_err("Failed to allocate %zu bytes of flight recorder buffer: %m\n", size);
+			return -ENOMEM;
+		}
+		rec->flight[i].size = size;
+	}
+
+	pr_debug("flight recorder: %d buffers of %zu bytes\n", evlist->nr_mmaps, size);
+	return 0;
+}
+
+static int record__stats_init(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	struct perf_env *env = &rec->session->header.env;
+	int i;
+
+	if (!rec->stats)
+		return 0;
+
+	env->record_stats = calloc(evlist->nr_mmaps, sizeof(*env->record_stats));
+	rec->stats_cut = calloc(evlist->nr_mmaps, sizeof(*rec->stats_cut));
+	if (env->record_stats == NULL || rec->stats_cut == NULL)
+		return -ENOMEM;
+	env->nr_record_stats = evlist->nr_mmaps;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct perf_mmap *map = &evlist->mmap[i];
+
+		env->record_stats[i].cpu = (u64)map->cpu;
+		if (map->base)
+			env->record_stats[i].size = map->mask + 1;
+	}
+	return 0;
+}
+
+/* What --stats saw, the same as perf report --header shows */
+static void record__print_stats(struct record *rec)
+{
+	struct perf_env *env = &rec->session->header.env;
+	u64 i;
+
+	fprintf(stderr, "[ perf record: %" PRIu64 " polls, %.3f ms avg, %.3f ms max ]\n",
+		env->record_polls,
+		env->record_polls ? env->record_poll_ns / 1e6 / env->record_polls : 0.0,
+		env->record_poll_max_ns / 1e6);
+
+	fprintf(stderr, "%6s %10s %10s %8s %6s %10s %10s %10s %10s %8s %8s %8s\n",
+		"cpu", "MB", "events", "reads", "used%", "push ms", "write ms",
+		"comp ms", "lost", "LOST", "THROTTLE", "UNTHROT");
+
+	for (i = 0; i < env->nr_record_stats; i++) {
+		struct record_mmap_stats *st = &env->record_stats[i];
+		char cpu[16];
+
+		if ((s64)st->cpu < 0)
+			scnprintf(cpu, sizeof(cpu), "#%" PRIu64, i);
+		else
+			scnprintf(cpu, sizeof(cpu), "%" PRIu64, st->cpu);
+
+		fprintf(stderr, "%6s %10.3f %10" PRIu64 " %8" PRIu64 " %6.1f %10.3f %10.3f %10.3f %10" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+			cpu, st->bytes / 1024.0 / 1024.0, st->events, st->reads,
+			st->size ? 100.0 * st->max_used / st->size : 0.0,
+			st->push_ns / 1e6, st->write_ns / 1e6, st->compress_ns / 1e6,
+			st->lost, st->lost_records, st->throttle, st->unthrottle);
+	}
+}
+
+static void record__flight_exit(struct record *rec)
+{
+	int i;
+
+	if (!rec->flight)
+		return;
+
+	for (i = 0; i < rec->evlist->nr_mmaps; i++) {
+		if (rec->flight[i].base)
+			munmap(rec->flight[i].base, rec->flight[i].size);
+	}
+	zfree(&rec->flight);
+}
+
+static int record__aux_ring_init(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	int i;
+
+	if (!rec->aux_ring_str)
+		return 0;
+
+	rec->aux_ring = calloc(evlist->nr_mmaps, sizeof(*rec->aux_ring));
+	if (rec->aux_ring == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct auxtrace_mmap *mm = &evlist->mmap[i].auxtrace_mmap;
+		/* at least what one drain of the AUX area can bring */
+		size_t size = roundup(max_t(size_t, rec->aux_ring_size, mm->len), 2 << 20);
+
+		if (!mm->base)
+			continue;
+
+		rec->aux_ring[i].base = record_flight__alloc(size);
+		if (rec->aux_ring[i].base == NULL) {
+			pr_err("Failed to allocate %zu bytes of AUX area snapshot buffer: %m\n", size);
+			return -ENOMEM;
+		}
+		rec->aux_ring[i].size = size;
+		pr_debug("AUX area snapshot buffer %d: %zu bytes\n", i, size);
+	}
+
+	return 0;
+}
+
+static void record__aux_ring_exit(struct record *rec)
+{
+	int i;
+
+	if (!rec->aux_ring)
+		return;
+
+	for (i = 0; i < rec->evlist->nr_mmaps; i++) {
+		if (rec->aux_ring[i].base)
+			munmap(rec->aux_ring[i].base, rec->aux_ring[i].size);
+	}
+	zfree(&rec->aux_ring);
+}
+
+/* Writes out and empties the flight recorder buffers, as one round */
+static int record__flight_dump(struct record *rec)
+{
+	u64 bytes_written = rec->bytes_written;
+	int i;
+
+	if (!rec->flight)
+		return 0;
+
+	for (i = 0; i < rec->evlist->nr_mmaps; i++) {
+		struct record_flight *fl = &rec->flight[i];
+
+		while (fl->tail < fl->head) {
+			size_t off = fl->tail % fl->size;
+			size_t n = min(fl->head - fl->tail, (u64)(fl->size - off));
+
+			if (record__write(rec, NULL, fl->base + off, n) < 0)
+				return -1;
+			fl->tail += n;
+		}
+		fl->head = fl->tail = 0;
+	}
+
+	if (bytes_written != rec->bytes_written)
+		return record__write(rec, NULL, &finished_round_event, sizeof(finished_round_event));
+	return 0;
+}
+
+/*
+ * With synch, the maps are read whatever they have, not only those
+ * with --mmap-flush bytes: at a timeout, the end or an output switch.
+ */
+static int record__mmap_read_evlist(struct record *rec, struct perf_evlist *evlist,
+				    bool overwrite, bool synch)
+{
+	u64 bytes_written = rec->bytes_written;
+	int i;
+	int rc = 0;
+	struct perf_mmap *maps;
+	int trace_fd = rec->data.file.fd;
+	off_t off;
+
+	if (!evlist)
+		return 0;
+
+	maps = overwrite ? evlist->overwrite_mmap : evlist->mmap;
+	if (!maps)
+		return 0;
+
+	if (overwrite && evlist->bkw_mmap_state != BKW_MMAP_DATA_PENDING)
+		return 0;
+
+	if (record__aio_enabled(rec))
+		off = record__aio_get_pos(trace_fd);
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
 		struct perf_mmap *map = &maps[i];
+		struct record_mmap_stats *st = record__mmap_stats(rec, map);
+		int flush = map->flush;
+		u64 start = 0, bytes = 0;
+
+		if (synch)
+			map->flush = 1;
 
 		if (map->base) {
 			record__adjust_affinity(rec, map);
+			if (st) {
+				bytes = st->bytes;
+				start = record__stats_drain_start(st, map);
+			}
 			if (!record__aio_enabled(rec)) {
 				if (perf_mmap__push(map, rec, record__pushfn) != 0) {
+					map->flush = flush;
 					rc = -1;
 					goto out;
 				}
+				/* a chunk can only be dropped whole, end it at an event */
+				if (rec->net)
+					net_output__flush(rec->net);
 			} else {
 				int idx;
 				/*
 				 * Call record__aio_sync() to wait till map->data buffer
 				 * becomes available after previous aio write request.
 				 */
-				idx = record__aio_sync(map, false);
-				if (perf_mmap__aio_push(map, rec, idx, record__aio_pushfn, &off) != 0) {
+				idx = record__aio_sync(rec, map, false);
+				if (idx < 0 ||
+				    perf_mmap__aio_push(map, rec, idx,
+							record__uring_inplace(rec, map) ? NULL : record__aio_copyfn,
+							record__aio_pushfn, &off) != 0) {
 					record__aio_set_pos(trace_fd, off);
+					map->flush = flush;
 					rc = -1;
 					goto out;
 				}
 			}
+			if (st)
+				record__stats_drain_end(st, start, bytes);
 		}
+		map->flush = flush;
 
-		if (map->auxtrace_mmap.base && !rec->opts.auxtrace_snapshot_mode &&
+		if (map->auxtrace_mmap.base &&
+		    (!rec->opts.auxtrace_snapshot_mode || rec->aux_ring) &&
 		    record__auxtrace_mmap_read(rec, map) != 0) {
 			rc = -1;
 			goto out;
@@ -793,12 +2340,21 @@ static int record__mmap_read_evlist(struct record *rec, struct perf_evlist *evli
 	if (record__aio_enabled(rec))
 		record__aio_set_pos(trace_fd, off);
 
+	if (rec->buildids.live)
+		record__buildids_retry(rec, false);
+
 	/*
 	 * Mark the round finished in case we wrote
 	 * at least one event.
 	 */
-	if (bytes_written != rec->bytes_written)
+	if (bytes_written != rec->bytes_written) {
 		rc = record__write(rec, NULL, &finished_round_event, sizeof(finished_round_event));
+		if (!rc && !overwrite)
+			record__time_index_add(rec);
+	}
+
+	if (rec->net)
+		net_output__flush(rec->net);
 
 	if (overwrite)
 		perf_evlist__toggle_bkw_mmap(evlist, BKW_MMAP_EMPTY);
@@ -806,15 +2362,393 @@ out:
 	return rc;
 }
 
-static int record__mmap_read_all(struct record *rec)
+static int record__mmap_read_all(struct record *rec, bool synch)
+{
+	int err;
+
+	record__uring_reap(rec);
+
+	/* With --threads the non-overwrite mmaps are drained by the workers. */
+	if (!record__threads_enabled(rec)) {
+		err = record__mmap_read_evlist(rec, rec->evlist, false, synch);
+		if (err)
+			return err;
+	}
+
+	return record__mmap_read_evlist(rec, rec->evlist, true, synch);
+}
+
+static int record__thread_pushfn(struct perf_mmap *map, void *to, void *bf, size_t size)
+{
+	struct record_thread *thread = to;
+	struct record_mmap_stats *st = record__mmap_stats(thread->rec, map);
+	u64 start = 0;
+
+	record__stats_chunk(thread->rec, map, bf, size);
+
+	if (st)
+		start = rdclock();
+	if (perf_data_file__write(thread->file, bf, size) < 0) {
+		pr_err("failed to write perf data to %s, error: %m\n",
+		       thread->file->path);
+		return -1;
+	}
+	if (st)
+		st->write_ns += rdclock() - start;
+
+	thread->samples++;
+	thread->bytes_written += size;
+	return 0;
+}
+
+static int record__thread_mmap_read(struct record_thread *thread, bool synch)
+{
+	u64 bytes_written = thread->bytes_written;
+	int i;
+
+	for (i = 0; i < thread->nr_mmaps; i++) {
+		struct perf_mmap *map = thread->maps[i];
+		struct record_mmap_stats *st = record__mmap_stats(thread->rec, map);
+		int flush = map->flush;
+		int err = 0;
+
+		if (synch)
+			map->flush = 1;
+		if (map->base) {
+			u64 start = 0, bytes = 0;
+
+			if (st) {
+				bytes = st->bytes;
+				start = record__stats_drain_start(st, map);
+			}
+			err = perf_mmap__push(map, thread, record__thread_pushfn);
+			if (st)
+				record__stats_drain_end(st, start, bytes);
+		}
+		map->flush = flush;
+		if (err)
+			return -1;
+	}
+
+	/*
+	 * Every data file is processed in rounds on its own, so
+	 * mark the round finished in the thread's file.
+	 */
+	if (bytes_written != thread->bytes_written) {
+		if (perf_data_file__write(thread->file, &finished_round_event,
+					  sizeof(finished_round_event)) < 0)
+			return -1;
+		thread->bytes_written += sizeof(finished_round_event);
+	}
+
+	return 0;
+}
+
+static void record__thread_munmap_filtered(struct fdarray *fda, int fd,
+					   void *arg __maybe_unused)
 {
+	struct perf_mmap *map = fda->priv[fd].ptr;
+
+	if (map)
+		perf_mmap__put(map);
+}
+
+static void *record__thread(void *arg)
+{
+	struct record_thread *thread = arg;
+	int timeout = thread->rec->opts.mmap_flush > 1 ? MMAP_FLUSH_TIMEOUT : -1;
+	bool draining = false, synch = false;
+	u64 start;
 	int err;
 
-	err = record__mmap_read_evlist(rec, rec->evlist, false);
+	if (CPU_COUNT(&thread->mask))
+		sched_setaffinity(0, sizeof(thread->mask), &thread->mask);
+
+	for (;;) {
+		unsigned long long hits = thread->samples;
+
+		if (record__thread_mmap_read(thread, synch || draining) < 0) {
+			thread->err = -1;
+			break;
+		}
+		synch = false;
+
+		if (hits != thread->samples)
+			continue;
+
+		if (draining)
+			break;
+
+		start = thread->rec->stats ? rdclock() : 0;
+		err = fdarray__poll(&thread->pollfd, timeout);
+		if (start)
+			record__stats_poll(&thread->polls, &thread->poll_ns,
+					   &thread->poll_max_ns, start);
+		if (err < 0 && errno != EINTR) {
+			thread->err = -errno;
+			break;
+		}
+		/* nothing came for a while, write what is below --mmap-flush */
+		if (err == 0)
+			synch = true;
+
+		/* The control pipe is always the first entry, see record__thread_pollfd() */
+		if (thread->pollfd.entries[0].revents & POLLIN)
+			draining = true;
+
+		if (fdarray__filter(&thread->pollfd, POLLERR | POLLHUP,
+				    record__thread_munmap_filtered, NULL) <= 1)
+			draining = true;
+	}
+
+	return NULL;
+}
+
+static int record__thread_key(struct record *rec, int cpu)
+{
+	if (cpu < 0)
+		return 0;
+
+	switch (rec->opts.threads_spec) {
+	case THREAD_SPEC__CORE:
+		return (cpu_map__get_socket_id(cpu) << 16) | cpu_map__get_core_id(cpu);
+	case THREAD_SPEC__SOCKET:
+		return cpu_map__get_socket_id(cpu);
+	case THREAD_SPEC__NUMA:
+		return cpu__get_node(cpu);
+	case THREAD_SPEC__CPU:
+	case THREAD_SPEC__UNDEFINED:
+	case THREAD_SPEC__MAX:
+	default:
+		return cpu;
+	}
+}
+
+static int record__threads_alloc(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	int i, j, *keys, err = -ENOMEM;
+
+	keys = calloc(evlist->nr_mmaps, sizeof(*keys));
+	rec->threads = calloc(evlist->nr_mmaps, sizeof(*rec->threads));
+	if (!keys || !rec->threads)
+		goto out;
+
+	for (i = 0; i < evlist->nr_mmaps; i++) {
+		struct perf_mmap *map = &evlist->mmap[i];
+		int key = record__thread_key(rec, map->cpu);
+		struct record_thread *thread;
+
+		for (j = 0; j < rec->nr_threads; j++) {
+			if (keys[j] == key)
+				break;
+		}
+
+		thread = &rec->threads[j];
+		if (j == rec->nr_threads) {
+			thread->maps = calloc(evlist->nr_mmaps, sizeof(*thread->maps));
+			if (!thread->maps)
+				goto out;
+
+			thread->rec = rec;
+			thread->ctlfd[0] = thread->ctlfd[1] = -1;
+			fdarray__init(&thread->pollfd, 64);
+			CPU_ZERO(&thread->mask);
+			keys[j] = key;
+			rec->nr_threads++;
+		}
+
+		thread->maps[thread->nr_mmaps++] = map;
+
+		if (CPU_COUNT(&map->affinity_mask))
+			CPU_OR(&thread->mask, &thread->mask, &map->affinity_mask);
+		else if (map->cpu >= 0)
+			CPU_SET(map->cpu, &thread->mask);
+	}
+
+	err = 0;
+out:
+	free(keys);
+	return err;
+}
+
+static int record__thread_pollfd(struct record_thread *thread,
+				 struct fdarray *evlist_pollfd)
+{
+	int i, j, pos;
+
+	if (pipe(thread->ctlfd) < 0)
+		return -errno;
+
+	pos = fdarray__add(&thread->pollfd, thread->ctlfd[0], POLLIN);
+	if (pos < 0)
+		return pos;
+	thread->pollfd.priv[pos].ptr = NULL;
+
+	for (i = 0; i < evlist_pollfd->nr; i++) {
+		struct perf_mmap *map = evlist_pollfd->priv[i].ptr;
+
+		for (j = 0; j < thread->nr_mmaps; j++) {
+			if (thread->maps[j] != map)
+				continue;
+
+			pos = fdarray__add(&thread->pollfd,
+					   evlist_pollfd->entries[i].fd,
+					   evlist_pollfd->entries[i].events);
+			if (pos < 0)
+				return pos;
+			thread->pollfd.priv[pos].ptr = map;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int record__threads_setup(struct record *rec)
+{
+	struct perf_evlist *evlist = rec->evlist;
+	struct fdarray *pollfd = &evlist->pollfd;
+	int i, err;
+
+	if (!record__threads_enabled(rec))
+		return 0;
+
+	err = record__threads_alloc(rec);
 	if (err)
 		return err;
 
-	return record__mmap_read_evlist(rec, rec->evlist, true);
+	err = perf_data__create_dir(&rec->data, rec->nr_threads);
+	if (err) {
+		pr_err("Failed to create data directory: %s\n", strerror(-err));
+		return err;
+	}
+
+	for (i = 0; i < rec->nr_threads; i++) {
+		struct record_thread *thread = &rec->threads[i];
+
+		thread->file = &rec->data.dir.files[i];
+
+		err = record__thread_pollfd(thread, pollfd);
+		if (err)
+			return err;
+	}
+
+	/*
+	 * The main thread keeps polling evlist->pollfd only to notice
+	 * POLLHUP, the data itself is consumed by the worker threads.
+	 */
+	for (i = 0; i < pollfd->nr; i++)
+		pollfd->entries[i].events &= ~POLLIN;
+
+	pr_debug("threads: %d reader threads (%s)\n", rec->nr_threads,
+		 thread_spec_tags[rec->opts.threads_spec]);
+	return 0;
+}
+
+static int record__threads_start(struct record *rec)
+{
+	sigset_t full, mask;
+	int i, err = 0;
+
+	/* Leave signal handling to the main thread. */
+	sigfillset(&full);
+	pthread_sigmask(SIG_SETMASK, &full, &mask);
+
+	for (i = 0; i < rec->nr_threads; i++) {
+		struct record_thread *thread = &rec->threads[i];
+
+		err = pthread_create(&thread->tid, NULL, record__thread, thread);
+		if (err) {
+			pr_err("Failed to start reader thread: %s\n", strerror(err));
+			err = -err;
+			break;
+		}
+		thread->running = true;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+	return err;
+}
+
+static int record__threads_stop(struct record *rec)
+{
+	int i, err = 0;
+	char msg = 0;
+
+	for (i = 0; i < rec->nr_threads; i++) {
+		struct record_thread *thread = &rec->threads[i];
+
+		if (thread->running && write(thread->ctlfd[1], &msg, sizeof(msg)) != sizeof(msg))
+			pr_warning("Failed to stop reader thread %d: %m\n", i);
+	}
+
+	for (i = 0; i < rec->nr_threads; i++) {
+		struct record_thread *thread = &rec->threads[i];
+
+		if (!thread->running)
+			continue;
+
+		pthread_join(thread->tid, NULL);
+		thread->running = false;
+
+		if (thread->err && !err)
+			err = thread->err;
+
+		rec->samples += thread->samples;
+		if (rec->stats) {
+			struct perf_env *env = &rec->session->header.env;
+
+			env->record_polls += thread->polls;
+			env->record_poll_ns += thread->poll_ns;
+			if (thread->poll_max_ns > env->record_poll_max_ns)
+				env->record_poll_max_ns = thread->poll_max_ns;
+		}
+		pr_debug("threads: thread %d wrote %" PRIu64 " bytes to %s\n",
+			 i, thread->bytes_written, thread->file->path);
+	}
+
+	return err;
+}
+
+static void record__threads_free(struct record *rec)
+{
+	int i;
+
+	for (i = 0; i < rec->nr_threads; i++) {
+		struct record_thread *thread = &rec->threads[i];
+
+		fdarray__exit(&thread->pollfd);
+		if (thread->ctlfd[0] >= 0)
+			close(thread->ctlfd[0]);
+		if (thread->ctlfd[1] >= 0)
+			close(thread->ctlfd[1]);
+		free(thread->maps);
+	}
+
+	zfree(&rec->threads);
+	rec->nr_threads = 0;
+}
+
+static int record__filter_pollfd(struct record *rec)
+{
+	int ret;
+
+	/*
+	 * With --threads the mmaps are released by the worker that
+	 * owns them, see record__thread_munmap_filtered().
+	 */
+	if (record__threads_enabled(rec))
+		return fdarray__filter(&rec->evlist->pollfd, POLLERR | POLLHUP,
+				       NULL, NULL);
+
+	ret = perf_evlist__filter_pollfd(rec->evlist, POLLERR | POLLHUP);
+
+	/* The io_uring eventfd is never filtered, don't count it. */
+	if (ret > 0 && record__uring_enabled(rec))
+		ret--;
+
+	return ret;
 }
 
 static void record__init_features(struct record *rec)
@@ -840,13 +2774,116 @@ static void record__init_features(struct record *rec)
 	if (!(rec->opts.use_clockid && rec->opts.clockid_res_ns))
 		perf_header__clear_feat(&session->header, HEADER_CLOCKID);
 
-	perf_header__clear_feat(&session->header, HEADER_DIR_FORMAT);
+	if (!record__threads_enabled(rec))
+		perf_header__clear_feat(&session->header, HEADER_DIR_FORMAT);
+
+	if (!record__comp_enabled(rec))
+		perf_header__clear_feat(&session->header, HEADER_COMPRESSED);
+
+	/* The index refers to the offsets of the single output file. */
+	if (rec->data.is_pipe || record__threads_enabled(rec) ||
+	    rec->switch_output.enabled)
+		perf_header__clear_feat(&session->header, HEADER_TIME_INDEX);
 
 	perf_header__clear_feat(&session->header, HEADER_STAT);
+	/* only perf data sort writes the events in time order */
+	perf_header__clear_feat(&session->header, HEADER_SORTED);
+
+	/* in a pipe the header goes before there is anything to count */
+	if (!rec->stats || rec->data.is_pipe)
+		perf_header__clear_feat(&session->header, HEADER_RECORD_STATS);
+}
+
+/*
+ * Whether a rotated file can get its build-ids after the switch. It needs
+ * the samples to be walked again, which we do on the side with a session
+ * of its own, so the reader goes on draining into the next file.
+ * With live build-ids there's nothing to walk, and the timestamp boundary
+ * is taken from the recording session, so those stay in line.
+ */
+static bool record__finalize_in_background(struct record *rec, bool at_exit)
+{
+	return !at_exit && !rec->no_buildid && !rec->buildids.live &&
+	       !rec->timestamp_boundary;
+}
+
+static void *record__finalize_thread(void *arg)
+{
+	struct record *rec = arg;
+	const char *path = rec->switch_output.finalize_path;
+	struct perf_data data = {
+		.path = path,
+		.mode = PERF_DATA_MODE_READ,
+	};
+	struct perf_session *session;
+	int fd, err = -1;
+
+	session = perf_session__new(&data, false, &build_id__mark_dso_hit_ops);
+	if (session == NULL)
+		goto out;
+
+	if (rec->buildid_all)
+		err = dsos__hit_all(session);
+	else
+		err = perf_session__process_events(session);
+	if (err)
+		goto out_delete;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		err = -errno;
+		goto out_delete;
+	}
+
+	/* Rewrites the features after the data, now with the build-ids */
+	perf_header__set_feat(&session->header, HEADER_BUILD_ID);
+	err = perf_session__write_header(session, session->evlist, fd, true);
+	close(fd);
+
+out_delete:
+	perf_session__delete(session);
+out:
+	if (err)
+		pr_warning("Failed to add the build-ids to %s\n", path);
+	return NULL;
+}
+
+static void record__finalize_wait(struct record *rec)
+{
+	if (rec->switch_output.finalize_path == NULL)
+		return;
+
+	pthread_join(rec->switch_output.finalize_tid, NULL);
+	zfree(&rec->switch_output.finalize_path);
+}
+
+static int record__finalize_start(struct record *rec, const char *path)
+{
+	sigset_t full, mask;
+	int err;
+
+	/* One file at a time, if it's still going, this rotation waits */
+	record__finalize_wait(rec);
+
+	rec->switch_output.finalize_path = strdup(path);
+	if (rec->switch_output.finalize_path == NULL)
+		return -ENOMEM;
+
+	sigfillset(&full);
+	pthread_sigmask(SIG_SETMASK, &full, &mask);
+	err = pthread_create(&rec->switch_output.finalize_tid, NULL,
+			     record__finalize_thread, rec);
+	pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+	if (err) {
+		zfree(&rec->switch_output.finalize_path);
+		return -err;
+	}
+	return 0;
 }
 
 static void
-record__finish_output(struct record *rec)
+record__finish_output(struct record *rec, bool background)
 {
 	struct perf_data *data = &rec->data;
 	int fd = perf_data__fd(data);
@@ -856,9 +2893,35 @@ record__finish_output(struct record *rec)
 
 	rec->session->header.data_size += rec->bytes_written;
 	data->file.size = lseek(perf_data__fd(data), 0, SEEK_CUR);
+	if (perf_data__is_dir(data))
+		perf_data__update_dir(data);
+
+	if (!rec->session->header.env.nr_time_index)
+		perf_header__clear_feat(&rec->session->header, HEADER_TIME_INDEX);
+
+	if (rec->session->bytes_compressed) {
+		float ratio = (float)rec->session->bytes_transferred /
+			      (float)rec->session->bytes_compressed;
+
+		rec->session->header.env.comp_ratio = ratio + 0.5;
+	}
+
+	if (background) {
+		/* record__finalize_thread() adds them */
+		perf_header__clear_feat(&rec->session->header, HEADER_BUILD_ID);
+		perf_session__write_header(rec->session, rec->evlist, fd, true);
+		perf_header__set_feat(&rec->session->header, HEADER_BUILD_ID);
+		return;
+	}
 
 	if (!rec->no_buildid) {
-		process_buildids(rec);
+		if (rec->buildids.live) {
+			record__buildids_retry(rec, true);
+			rec->samples = rec->buildids.samples;
+			rec->buildids.samples = 0;
+		} else {
+			process_buildids(rec);
+		}
 
 		if (rec->buildid_all)
 			dsos__hit_all(rec->session);
@@ -890,10 +2953,93 @@ static int record__synthesize_workload(struct record *rec, bool tail)
 
 static int record__synthesize(struct record *rec, bool tail);
 
+static bool switch_output__retention(struct switch_output *s)
+{
+	return s->num_files || s->max_age;
+}
+
+static void switch_output__keep(struct switch_output_file *file)
+{
+	if (!quiet)
+		fprintf(stderr, "[ perf record: Keeping %s ]\n", file->path);
+	list_del(&file->list);
+	free(file->path);
+	free(file);
+}
+
+static void switch_output__evict(struct switch_output_file *file)
+{
+	remove(file->path);
+	list_del(&file->list);
+	free(file->path);
+	free(file);
+}
+
+/*
+ * Takes the rotated file at path: it's deleted once it falls out of the
+ * last num_files or gets older than max_age. After a keep request it and
+ * the ones still retained are left alone, and so are the next keep_after.
+ */
+static void switch_output__retain(struct switch_output *s, char *path)
+{
+	struct switch_output_file *file, *tmp;
+	time_t now = time(NULL);
+
+	if (!switch_output__retention(s)) {
+		free(path);
+		return;
+	}
+
+	file = zalloc(sizeof(*file));
+	if (file == NULL) {
+		pr_warning("Not enough memory to track %s, it won't be deleted\n", path);
+		free(path);
+		return;
+	}
+	file->path = path;
+	file->time = now;
+	list_add_tail(&file->list, &s->files);
+	s->nr_files++;
+
+	if (s->keep) {
+		s->keep = 0;
+		s->keep_left = s->keep_after + 1;
+	}
+
+	if (s->keep_left) {
+		s->keep_left--;
+		list_for_each_entry_safe(file, tmp, &s->files, list)
+			switch_output__keep(file);
+		s->nr_files = 0;
+		return;
+	}
+
+	list_for_each_entry_safe(file, tmp, &s->files, list) {
+		if ((!s->num_files || s->nr_files <= s->num_files) &&
+		    (!s->max_age || now - file->time <= (time_t)s->max_age))
+			break;
+		switch_output__evict(file);
+		s->nr_files--;
+	}
+}
+
+static void switch_output__exit(struct switch_output *s)
+{
+	struct switch_output_file *file, *tmp;
+
+	/* the files stay, only the tracking goes */
+	list_for_each_entry_safe(file, tmp, &s->files, list) {
+		list_del(&file->list);
+		free(file->path);
+		free(file);
+	}
+}
+
 static int
 record__switch_output(struct record *rec, bool at_exit)
 {
 	struct perf_data *data = &rec->data;
+	bool background = record__finalize_in_background(rec, at_exit);
 	int fd, err;
 	char *new_filename;
 
@@ -907,7 +3053,7 @@ record__switch_output(struct record *rec, bool at_exit)
 		record__synthesize_workload(rec, true);
 
 	rec->samples = 0;
-	record__finish_output(rec);
+	record__finish_output(rec, background);
 	err = fetch_current_timestamp(timestamp, sizeof(timestamp));
 	if (err) {
 		pr_err("Failed to get current timestamp\n");
@@ -926,20 +3072,11 @@ record__switch_output(struct record *rec, bool at_exit)
 		fprintf(stderr, "[ perf record: Dump %s.%s ]\n",
 			data->path, timestamp);
 
-	if (rec->switch_output.num_files) {
-		int n = rec->switch_output.cur_file + 1;
+	if (background && fd >= 0 && record__finalize_start(rec, new_filename))
+		pr_warning("Failed to start adding the build-ids to %s\n", new_filename);
 
-		if (n >= rec->switch_output.num_files)
-			n = 0;
-		rec->switch_output.cur_file = n;
-		if (rec->switch_output.filenames[n]) {
-			remove(rec->switch_output.filenames[n]);
-			free(rec->switch_output.filenames[n]);
-		}
-		rec->switch_output.filenames[n] = new_filename;
-	} else {
-		free(new_filename);
-	}
+	if (fd >= 0)
+		switch_output__retain(&rec->switch_output, new_filename);
 
 	/* Output tracking events */
 	if (!at_exit) {
@@ -1010,6 +3147,13 @@ static const struct perf_event_mmap_page *record__pick_pc(struct record *rec)
 	return NULL;
 }
 
+static void record__time_index_init(struct record *rec)
+{
+	const struct perf_event_mmap_page *pc = record__pick_pc(rec);
+
+	rec->time_index_tsc = pc && !perf_read_tsc_conversion(pc, &rec->tc);
+}
+
 static int record__synthesize(struct record *rec, bool tail)
 {
 	struct perf_session *session = rec->session;
@@ -1119,9 +3263,23 @@ static int record__synthesize(struct record *rec, bool tail)
 	if (err < 0)
 		pr_warning("Couldn't synthesize bpf events.\n");
 
-	err = __machine__synthesize_threads(machine, tool, &opts->target, rec->evlist->threads,
-					    process_synthesized_event, opts->sample_address,
-					    1);
+	if (opts->record_cgroup) {
+		err = perf_event__synthesize_cgroups(tool, process_synthesized_event,
+						     machine);
+		if (err < 0)
+			pr_warning("Couldn't synthesize cgroup events.\n");
+	}
+
+	/* their maps get synthesized by perf inject --lazy-mmaps, if sampled */
+	perf_event__skip_all_mmaps(opts->lazy_mmaps);
+	if (rec->cgroup_threads)
+		err = perf_event__synthesize_thread_map(tool, rec->cgroup_threads,
+							process_synthesized_event,
+							machine, opts->sample_address);
+	else
+		err = __machine__synthesize_threads(machine, tool, &opts->target, rec->evlist->threads,
+						    process_synthesized_event, opts->sample_address,
+						    opts->nr_threads_synthesize);
 out:
 	return err;
 }
@@ -1136,8 +3294,9 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 	struct record_opts *opts = &rec->opts;
 	struct perf_data *data = &rec->data;
 	struct perf_session *session;
-	bool disabled = false, draining = false;
+	bool disabled = false, draining = false, synch = false;
 	struct perf_evlist *sb_evlist = NULL;
+	int timeout;
 	int fd;
 
 	atexit(record__sig_exit);
@@ -1159,12 +3318,35 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 		signal(SIGUSR2, SIG_IGN);
 	}
 
+	if (record__threads_enabled(rec))
+		data->is_dir = true;
+
 	session = perf_session__new(data, false, tool);
 	if (session == NULL) {
 		pr_err("Perf session creation failed.\n");
 		return -1;
 	}
 
+	if (data->is_pipe && record__threads_enabled(rec)) {
+		pr_err("--threads can't be used with pipe output.\n");
+		status = -EINVAL;
+		goto out_delete_session;
+	}
+
+	if (data->is_pipe && rec->flight_str) {
+		pr_err("--flight-recorder can't be used with pipe output.\n");
+		status = -EINVAL;
+		goto out_delete_session;
+	}
+
+	if (rec->net_addr) {
+		err = record__net_open(rec);
+		if (err) {
+			status = err;
+			goto out_delete_session;
+		}
+	}
+
 	fd = perf_data__fd(data);
 	rec->session = session;
 
@@ -1173,6 +3355,17 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 	if (rec->opts.use_clockid && rec->opts.clockid_res_ns)
 		session->header.env.clockid_res_ns = rec->opts.clockid_res_ns;
 
+	if (record__comp_enabled(rec)) {
+		if (zstd_init(&session->zstd_data, rec->opts.comp_level) < 0) {
+			pr_err("Compression initialization failed.\n");
+			status = -1;
+			goto out_delete_session;
+		}
+
+		session->header.env.comp_type  = PERF_COMP_ZSTD;
+		session->header.env.comp_level = rec->opts.comp_level;
+	}
+
 	if (forks) {
 		err = perf_evlist__prepare_workload(rec->evlist, &opts->target,
 						    argv, data->is_pipe,
@@ -1197,6 +3390,33 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 		err = -1;
 		goto out_child;
 	}
+	session->header.env.comp_mmap_len = session->evlist->mmap_len;
+
+	err = record__flight_init(rec);
+	if (err)
+		goto out_child;
+
+	err = record__stats_init(rec);
+	if (err)
+		goto out_child;
+
+	err = record__aux_ring_init(rec);
+	if (err)
+		goto out_child;
+
+	err = record__overhead_init(rec);
+	if (err)
+		goto out_child;
+
+	err = record__uring_init(rec);
+	if (err)
+		goto out_child;
+
+	record__time_index_init(rec);
+
+	err = record__threads_setup(rec);
+	if (err)
+		goto out_child;
 
 	err = bpf__apply_obj_config();
 	if (err) {
@@ -1246,10 +3466,26 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 		opts->no_bpf_event = true;
 	}
 
+	/*
+	 * The aio writes and the --threads workers push the events from
+	 * elsewhere, what they wrote is read back in process_buildids().
+	 */
+	if (!rec->no_buildid && !data->is_pipe &&
+	    !record__aio_enabled(rec) && !record__threads_enabled(rec)) {
+		rec->buildids.carry = malloc(PERF_SAMPLE_MAX_SIZE);
+		rec->buildids.live = rec->buildids.carry != NULL;
+	}
+
 	err = record__synthesize(rec, false);
 	if (err < 0)
 		goto out_child;
 
+	if (rec->net_addr) {
+		err = record__net_start(rec);
+		if (err)
+			goto out_child;
+	}
+
 	if (rec->realtime_prio) {
 		struct sched_param param;
 
@@ -1261,6 +3497,10 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 		}
 	}
 
+	err = record__threads_start(rec);
+	if (err)
+		goto out_child;
+
 	/*
 	 * When perf is starting the traced process, all the events
 	 * (apart from group members) have enable_on_exec=1 set,
@@ -1326,6 +3566,8 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 	trigger_ready(&auxtrace_snapshot_trigger);
 	trigger_ready(&switch_output_trigger);
 	perf_hooks__invoke_record_start();
+	timeout = opts->mmap_flush > 1 ? MMAP_FLUSH_TIMEOUT : -1;
+
 	for (;;) {
 		unsigned long long hits = rec->samples;
 
@@ -1340,12 +3582,16 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 		if (trigger_is_hit(&switch_output_trigger) || done || draining)
 			perf_evlist__toggle_bkw_mmap(rec->evlist, BKW_MMAP_DATA_PENDING);
 
-		if (record__mmap_read_all(rec) < 0) {
+		if (record__mmap_read_all(rec, synch || done || draining ||
+					  trigger_is_hit(&switch_output_trigger)) < 0) {
 			trigger_error(&auxtrace_snapshot_trigger);
 			trigger_error(&switch_output_trigger);
 			err = -1;
 			goto out_child;
 		}
+		synch = false;
+
+		record__overhead_control(rec);
 
 		if (auxtrace_record__snapshot_started) {
 			auxtrace_record__snapshot_started = 0;
@@ -1383,6 +3629,12 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 				fprintf(stderr, "[ perf record: dump data: Woken up %ld times ]\n",
 					waking);
 			waking = 0;
+			if (record__flight_dump(rec) < 0) {
+				pr_err("Failed to write the flight recorder buffers\n");
+				trigger_error(&switch_output_trigger);
+				err = -1;
+				goto out_child;
+			}
 			fd = record__switch_output(rec, false);
 			if (fd < 0) {
 				pr_err("Failed to switch to new file\n");
@@ -1397,9 +3649,22 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 		}
 
 		if (hits == rec->samples) {
+			u64 start;
+
 			if (done || draining)
 				break;
-			err = perf_evlist__poll(rec->evlist, -1);
+			/* with --threads it's the workers that wait for the data */
+			start = rec->stats && !record__threads_enabled(rec) ? rdclock() : 0;
+			err = perf_evlist__poll(rec->evlist, timeout);
+			if (start) {
+				struct perf_env *env = &rec->session->header.env;
+
+				record__stats_poll(&env->record_polls, &env->record_poll_ns,
+						   &env->record_poll_max_ns, start);
+			}
+			/* nothing came for a while, write what is below --mmap-flush */
+			if (err == 0)
+				synch = true;
 			/*
 			 * Propagate error, only if there's any. Ignore positive
 			 * number of returned events and interrupt error.
@@ -1408,7 +3673,7 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 				err = 0;
 			waking++;
 
-			if (perf_evlist__filter_pollfd(rec->evlist, POLLERR | POLLHUP) == 0)
+			if (record__filter_pollfd(rec) == 0)
 				draining = true;
 		}
 
@@ -1442,6 +3707,10 @@ static int __cmd_record(struct record *rec, int argc, const char **argv)
 
 out_child:
 	record__aio_mmap_read_sync(rec);
+	record__uring_exit(rec);
+
+	if (record__threads_stop(rec) && !err)
+		err = -1;
 
 	if (forks) {
 		int exit_status;
@@ -1460,13 +3729,18 @@ out_child:
 	} else
 		status = err;
 
+	if (!err && record__flight_dump(rec) < 0) {
+		pr_err("Failed to write the flight recorder buffers\n");
+		status = err = -1;
+	}
+
 	record__synthesize(rec, true);
-	/* this will be recalculated during process_buildids() */
+	/* this will be recalculated in record__finish_output() */
 	rec->samples = 0;
 
 	if (!err) {
 		if (!rec->timestamp_filename) {
-			record__finish_output(rec);
+			record__finish_output(rec, false);
 		} else {
 			fd = record__switch_output(rec, true);
 			if (fd < 0) {
@@ -1489,12 +3763,38 @@ out_child:
 		else
 			samples[0] = '\0';
 
-		fprintf(stderr,	"[ perf record: Captured and wrote %.3f MB %s%s%s ]\n",
-			perf_data__size(data) / 1024.0 / 1024.0,
-			data->path, postfix, samples);
+		if (rec->session->bytes_compressed) {
+			fprintf(stderr,	"[ perf record: Captured and wrote %.3f MB %s%s%s, compressed (original %.3f MB, ratio is %.3f) ]\n",
+				perf_data__size(data) / 1024.0 / 1024.0,
+				data->path, postfix, samples,
+				rec->session->bytes_transferred / 1024.0 / 1024.0,
+				(float)rec->session->bytes_transferred /
+				(float)rec->session->bytes_compressed);
+		} else {
+			fprintf(stderr,	"[ perf record: Captured and wrote %.3f MB %s%s%s ]\n",
+				perf_data__size(data) / 1024.0 / 1024.0,
+				data->path, postfix, samples);
+		}
+
+		if (rec->opts.mmap_huge)
+			record__print_huge_stats(rec);
+
+		if (rec->stats)
+			record__print_stats(rec);
 	}
 
 out_delete_session:
+	net_output__delete(rec->net);
+	rec->net = NULL;
+	zfree(&rec->overhead.orig);
+	zfree(&rec->stats_cut);
+	record__flight_exit(rec);
+	record__aux_ring_exit(rec);
+	record__finalize_wait(rec);
+	switch_output__exit(&rec->switch_output);
+	zfree(&rec->buildids.carry);
+	zfree(&rec->buildids.retry);
+	record__threads_free(rec);
 	perf_session__delete(session);
 
 	if (!opts->no_bpf_event)
@@ -1560,6 +3860,110 @@ int record_callchain_opt(const struct option *opt,
 	return 0;
 }
 
+/*
+ * --off-cpu: the callchains of the threads where they block, for perf
+ * report --off-cpu, from the sched_switch samples.  With the switch events,
+ * which have no callchain, telling when the threads are back on a cpu, the
+ * samples are filtered to the switches out of threads that block, as
+ * preemptions are most of the switches of busy machines.
+ */
+static int record__add_off_cpu(struct record *rec)
+{
+	struct perf_evsel *evsel;
+
+	if (perf_evlist__add_newtp(rec->evlist, "sched", "sched_switch", NULL)) {
+		pr_err("--off-cpu needs the sched:sched_switch tracepoint\n");
+		return -EINVAL;
+	}
+	evsel = perf_evlist__last(rec->evlist);
+
+	if (!callchain_param.enabled) {
+		callchain_param.enabled = true;
+		if (callchain_param.record_mode == CALLCHAIN_NONE)
+			callchain_param.record_mode = CALLCHAIN_FP;
+	}
+
+	if (perf_can_record_switch_events()) {
+		rec->opts.record_switch_events = true;
+		if (perf_evsel__set_filter(evsel, "prev_state != 0"))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * --target-cgroup: for the -p/-t of many threads, instead of an event and
+ * ring buffer per thread of the target, open events per cpu filtered to
+ * the cgroup of the target.  The fds and buffers then scale with the cpus,
+ * and the new threads are followed without inheritance.  The samples of
+ * the other tasks of the cgroup are recorded too, and only those tasks
+ * are synthesized, so the target is better in a cgroup of its own.
+ */
+static int record__setup_target_cgroup(struct record *rec)
+{
+	struct target *target = &rec->opts.target;
+	const char *str = target->pid ?: target->tid;
+	char name[PATH_MAX], pid_name[PATH_MAX];
+	struct thread_map *threads;
+	struct cgroup *cgrp;
+	int i;
+
+	if (!str || target->system_wide || target->cpu_list || nr_cgroups) {
+		pr_err("--target-cgroup needs -p or -t and no -a, -C or -G\n");
+		return -EINVAL;
+	}
+
+	threads = target->pid ? thread_map__new_str(str, NULL, UINT_MAX, false) :
+				thread_map__new_by_tid_str(str);
+	if (!threads || !threads->nr) {
+		pr_err("Couldn't find the threads of %s\n", str);
+		thread_map__put(threads);
+		return -ESRCH;
+	}
+
+	for (i = 0; i < threads->nr; i++) {
+		pid_t pid = thread_map__pid(threads, i);
+
+		if (cgroup__pid_name(pid, pid_name, sizeof(pid_name))) {
+			pr_err("Couldn't find the cgroup of %d\n", pid);
+			goto out_err;
+		}
+		if (i == 0)
+			strcpy(name, pid_name);
+		else if (strcmp(name, pid_name)) {
+			pr_err("The threads of %s are in different cgroups\n", str);
+			goto out_err;
+		}
+	}
+	thread_map__put(threads);
+
+	if (!strcmp(name, "/")) {
+		pr_err("%s is in the root cgroup, --target-cgroup would record all tasks\n", str);
+		return -EINVAL;
+	}
+
+	cgrp = evlist__findnew_cgroup(rec->evlist, name);
+	if (!cgrp)
+		return -ENOENT;
+	evlist__set_default_cgroup(rec->evlist, cgrp);
+	cgroup__put(cgrp);
+
+	rec->cgroup_threads = cgroup__thread_map(name);
+	if (!rec->cgroup_threads)
+		pr_warning("Couldn't read the tasks of the cgroup %s\n", name);
+
+	pr_debug("recording the cgroup %s of %s on all cpus\n", name, str);
+	target->pid = NULL;
+	target->tid = NULL;
+	target->system_wide = true;
+	return 0;
+
+out_err:
+	thread_map__put(threads);
+	return -EINVAL;
+}
+
 static int perf_record_config(const char *var, const char *value, void *cb)
 {
 	struct record *rec = cb;
@@ -1703,6 +4107,53 @@ static int record__parse_affinity(const struct option *opt, const char *str, int
 	return 0;
 }
 
+static int record__parse_huge_buffers(const struct option *opt, const char *str, int unset)
+{
+	struct record_opts *opts = (struct record_opts *)opt->value;
+
+	if (unset) {
+		opts->mmap_huge = PERF_MMAP_HUGE_NONE;
+		return 0;
+	}
+
+	if (!str || !strcasecmp(str, "thp"))
+		opts->mmap_huge = PERF_MMAP_HUGE_THP;
+	else if (!strcasecmp(str, "hugetlb"))
+		opts->mmap_huge = PERF_MMAP_HUGE_HUGETLB;
+	else {
+		pr_err("Invalid --huge-buffers: %s, thp or hugetlb expected\n", str);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int record__parse_threads(const struct option *opt, const char *str, int unset)
+{
+	struct record_opts *opts = (struct record_opts *)opt->value;
+	int spec;
+
+	if (unset) {
+		opts->threads_spec = THREAD_SPEC__UNDEFINED;
+		return 0;
+	}
+
+	if (!str) {
+		opts->threads_spec = THREAD_SPEC__CPU;
+		return 0;
+	}
+
+	for (spec = THREAD_SPEC__CPU; spec < THREAD_SPEC__MAX; spec++) {
+		if (!strcasecmp(str, thread_spec_tags[spec])) {
+			opts->threads_spec = spec;
+			return 0;
+		}
+	}
+
+	pr_err("Unknown --threads spec: %s\n", str);
+	return -1;
+}
+
 static int record__parse_mmap_pages(const struct option *opt,
 				    const char *str,
 				    int unset __maybe_unused)
@@ -1766,13 +4217,6 @@ static void switch_output_size_warn(struct record *rec)
 static int switch_output_setup(struct record *rec)
 {
 	struct switch_output *s = &rec->switch_output;
-	static struct parse_tag tags_size[] = {
-		{ .tag  = 'B', .mult = 1       },
-		{ .tag  = 'K', .mult = 1 << 10 },
-		{ .tag  = 'M', .mult = 1 << 20 },
-		{ .tag  = 'G', .mult = 1 << 30 },
-		{ .tag  = 0 },
-	};
 	static struct parse_tag tags_time[] = {
 		{ .tag  = 's', .mult = 1        },
 		{ .tag  = 'm', .mult = 60       },
@@ -1782,6 +4226,20 @@ static int switch_output_setup(struct record *rec)
 	};
 	unsigned long val;
 
+	INIT_LIST_HEAD(&s->files);
+
+	if (s->max_age_str) {
+		if (!s->set) {
+			pr_err("--switch-max-age needs --switch-output\n");
+			return -1;
+		}
+		s->max_age = parse_tag_value(s->max_age_str, tags_time);
+		if (s->max_age == (unsigned long) -1 || !s->max_age) {
+			pr_err("Invalid --switch-max-age: %s\n", s->max_age_str);
+			return -1;
+		}
+	}
+
 	if (!s->set)
 		return 0;
 
@@ -1818,6 +4276,48 @@ enabled:
 	return 0;
 }
 
+/*
+ * The flight recorder is written out on SIGUSR2 and at the end, each time
+ * to a file of its own like --switch-output=signal does.
+ */
+static int record__flight_setup(struct record *rec)
+{
+	struct switch_output *s = &rec->switch_output;
+
+	rec->flight_size = parse_tag_value(rec->flight_str, tags_size);
+	if (rec->flight_size == (unsigned long) -1 || !rec->flight_size)
+		return -1;
+
+	if (s->set && strcmp(s->str, "signal")) {
+		pr_err("--flight-recorder is dumped on SIGUSR2, it can't switch output on size or time\n");
+		return -1;
+	}
+
+	s->set = true;
+	s->str = "signal";
+	return 0;
+}
+
+static int record__parse_overhead(const struct option *opt, const char *str,
+				  int unset __maybe_unused)
+{
+	struct record *rec = (struct record *)opt->value;
+	char *end;
+
+	rec->overhead.budget = strtod(str, &end);
+	if (*end != '\0' || rec->overhead.budget <= 0 || rec->overhead.budget > 100) {
+		pr_err("Invalid overhead: %s, it is a percentage\n", str);
+		return -1;
+	}
+
+	/* the periods change, so every sample has to carry its own */
+	if (!rec->opts.period_set) {
+		rec->opts.period = true;
+		rec->opts.period_set = true;
+	}
+	return 0;
+}
+
 static const char * const __record_usage[] = {
 	"perf record [<options>] [<command>]",
 	"perf record [<options>] -- <command> [<options>]",
@@ -1842,11 +4342,16 @@ static struct record record = {
 		.user_freq	     = UINT_MAX,
 		.user_interval	     = ULLONG_MAX,
 		.freq		     = 4000,
+		.mmap_flush	     = 1,
+		.nr_threads_synthesize = 1,
 		.target		     = {
 			.uses_mmap   = true,
 			.default_per_cpu = true,
 		},
 	},
+	.switch_output = {
+		.keep_after	= 1,
+	},
 	.tool = {
 		.sample		= process_sample_event,
 		.fork		= perf_event__process_fork,
@@ -1978,10 +4483,25 @@ static struct option __record_options[] = {
 			  "opts", "AUX area tracing Snapshot Mode", ""),
 	OPT_UINTEGER(0, "proc-map-timeout", &proc_map_timeout,
 			"per thread proc mmap processing timeout in ms"),
+	OPT_UINTEGER(0, "num-thread-synthesize",
+		     &record.opts.nr_threads_synthesize,
+		     "number of threads to run for event synthesis"),
+	OPT_CALLBACK(0, "synth-skip-mmaps", NULL, "comm[,comm...]",
+		     "don't synthesize the maps of existing tasks with these comms",
+		     perf_event__parse_skip_mmaps),
+	OPT_BOOLEAN(0, "lazy-mmaps", &record.opts.lazy_mmaps,
+		    "don't synthesize the maps of existing tasks, "
+		    "have perf inject --lazy-mmaps add them for the sampled ones"),
 	OPT_BOOLEAN(0, "namespaces", &record.opts.record_namespaces,
 		    "Record namespaces events"),
+	OPT_BOOLEAN(0, "all-cgroups", &record.opts.record_cgroup,
+		    "Record cgroup events"),
 	OPT_BOOLEAN(0, "switch-events", &record.opts.record_switch_events,
 		    "Record context switch events"),
+	OPT_BOOLEAN(0, "off-cpu", &record.off_cpu,
+		    "Record the callchains where the threads block, for perf report --off-cpu"),
+	OPT_BOOLEAN(0, "target-cgroup", &record.target_cgroup,
+		    "For -p/-t, record with per-cpu events in the cgroup of the target"),
 	OPT_BOOLEAN_FLAG(0, "all-kernel", &record.opts.all_kernel,
 			 "Configure all used events to run in kernel space.",
 			 PARSE_OPT_EXCLUSIVE),
@@ -2006,6 +4526,18 @@ static struct option __record_options[] = {
 			  "signal"),
 	OPT_INTEGER(0, "switch-max-files", &record.switch_output.num_files,
 		   "Limit number of switch output generated files"),
+	OPT_STRING(0, "net-queue", &record.net_queue_str, "size[BKMG]",
+		   "With -o tcp://host:port or unix:path, the data queued for sending (default: 64M)"),
+	OPT_STRING(0, "net-backpressure", &record.net_backpressure, "drop|block",
+		   "With -o tcp://host:port or unix:path, what to do with a full queue (default: drop)"),
+	OPT_STRING(0, "flight-recorder", &record.flight_str, "size[BKMG]",
+		   "Keep the last size bytes of events of each ring buffer in memory, written out on SIGUSR2 and at exit"),
+	OPT_STRING(0, "aux-snapshot-buffer", &record.aux_ring_str, "size[BKMG]",
+		   "With -S, drain the AUX area into a buffer of size bytes per mmap, written out on snapshot"),
+	OPT_STRING(0, "switch-max-age", &record.switch_output.max_age_str, "time[smhd]",
+		   "Delete the switch output generated files older than this"),
+	OPT_UINTEGER(0, "switch-keep-after", &record.switch_output.keep_after,
+		     "Number of files to keep after a SIGUSR2 preserved the retained ones (default: 1)"),
 	OPT_BOOLEAN(0, "dry-run", &dry_run,
 		    "Parse options then exit"),
 #ifdef HAVE_AIO_SUPPORT
@@ -2013,9 +4545,30 @@ static struct option __record_options[] = {
 		     &nr_cblocks_default, "n", "Use <n> control blocks in asynchronous trace writing mode (default: 1, max: 4)",
 		     record__aio_parse),
 #endif
+#ifdef HAVE_LIBURING_SUPPORT
+	OPT_BOOLEAN(0, "io-uring", &record.opts.io_uring,
+		    "Use io_uring for asynchronous trace writing, implies --aio"),
+#endif
+	OPT_CALLBACK(0, "max-overhead", &record, "percent",
+		     "Scale the sample periods to keep the perf CPU time below this percentage of the recorded cpus",
+		     record__parse_overhead),
 	OPT_CALLBACK(0, "affinity", &record.opts, "node|cpu",
 		     "Set affinity mask of trace reading thread to NUMA node cpu mask or cpu of processed mmap buffer",
 		     record__parse_affinity),
+	OPT_CALLBACK_OPTARG(0, "threads", &record.opts, NULL, "cpu|core|socket|numa",
+			    "write data using a reader thread per cpu, core, socket or numa node (default: cpu)",
+			    record__parse_threads),
+	OPT_CALLBACK_OPTARG('z', "compression-level", &record.opts, &comp_level_default,
+			    "n", "Compress records using specified level (default: 1 - fastest compression, 22 - greatest compression)",
+			    record__parse_comp_level),
+	OPT_CALLBACK(0, "mmap-flush", &record.opts, "number",
+		     "Minimal number of bytes that is extracted from mmap data pages (default: 1)",
+		     record__parse_mmap_flush),
+	OPT_CALLBACK_OPTARG(0, "huge-buffers", &record.opts, NULL, "thp|hugetlb",
+			    "Back the --aio and -z staging buffers with huge pages on the node of their cpu (default: thp)",
+			    record__parse_huge_buffers),
+	OPT_BOOLEAN(0, "stats", &record.stats,
+		    "Show what draining every mmap took and lost, also kept in the header"),
 	OPT_END()
 };
 
@@ -2048,6 +4601,12 @@ int cmd_record(int argc, const char **argv)
 	set_nobuild('\0', "vmlinux", true);
 # undef set_nobuild
 # undef REASON
+#endif
+
+#ifndef HAVE_ZSTD_SUPPORT
+# define set_nobuild(s, l, c) set_option_nobuild(record_options, s, l, "NO_LIBZSTD=1", c)
+	set_nobuild('z', "compression-level", true);
+# undef set_nobuild
 #endif
 
 	CPU_ZERO(&rec->affinity_mask);
@@ -2082,6 +4641,30 @@ int cmd_record(int argc, const char **argv)
 		return -EINVAL;
 	}
 
+	if (net_output__is_addr(rec->data.path)) {
+		rec->net_addr = rec->data.path;
+		rec->data.path = "-";
+	}
+
+	if (rec->net_backpressure && strcmp(rec->net_backpressure, "drop") &&
+	    strcmp(rec->net_backpressure, "block")) {
+		parse_options_usage(record_usage, record_options, "net-backpressure", 0);
+		return -EINVAL;
+	}
+
+	if (rec->flight_str && record__flight_setup(rec)) {
+		parse_options_usage(record_usage, record_options, "flight-recorder", 0);
+		return -EINVAL;
+	}
+
+	if (rec->aux_ring_str) {
+		rec->aux_ring_size = parse_tag_value(rec->aux_ring_str, tags_size);
+		if (rec->aux_ring_size == (unsigned long) -1 || !rec->aux_ring_size) {
+			parse_options_usage(record_usage, record_options, "aux-snapshot-buffer", 0);
+			return -EINVAL;
+		}
+	}
+
 	if (switch_output_setup(rec)) {
 		parse_options_usage(record_usage, record_options, "switch-output", 0);
 		return -EINVAL;
@@ -2092,13 +4675,6 @@ int cmd_record(int argc, const char **argv)
 		alarm(rec->switch_output.time);
 	}
 
-	if (rec->switch_output.num_files) {
-		rec->switch_output.filenames = calloc(sizeof(char *),
-						      rec->switch_output.num_files);
-		if (!rec->switch_output.filenames)
-			return -EINVAL;
-	}
-
 	/*
 	 * Allow aliases to facilitate the lookup of symbols for address
 	 * filters. Refer to auxtrace_parse_filters().
@@ -2111,6 +4687,12 @@ int cmd_record(int argc, const char **argv)
 	if (err)
 		goto out;
 
+	if (rec->aux_ring_str && !rec->opts.auxtrace_snapshot_mode) {
+		pr_err("--aux-snapshot-buffer requires AUX area tracing Snapshot Mode (-S)\n");
+		err = -EINVAL;
+		goto out;
+	}
+
 	if (dry_run)
 		goto out;
 
@@ -2168,12 +4750,24 @@ int cmd_record(int argc, const char **argv)
 	if (record.opts.overwrite)
 		record.opts.tail_synthesize = true;
 
+	if (rec->off_cpu) {
+		err = record__add_off_cpu(rec);
+		if (err)
+			goto out;
+	}
+
 	if (rec->evlist->nr_entries == 0 &&
 	    __perf_evlist__add_default(rec->evlist, !record.opts.no_samples) < 0) {
 		pr_err("Not enough memory for event selector list\n");
 		goto out;
 	}
 
+	if (rec->target_cgroup) {
+		err = record__setup_target_cgroup(rec);
+		if (err)
+			goto out;
+	}
+
 	if (rec->opts.target.tid && !rec->opts.no_inherit_set)
 		rec->opts.no_inherit = true;
 
@@ -2218,6 +4812,16 @@ int cmd_record(int argc, const char **argv)
 		goto out;
 	}
 
+	if (rec->opts.io_uring) {
+		if (rec->opts.overwrite) {
+			pr_err("--io-uring is incompatible with --overwrite\n");
+			err = -EINVAL;
+			goto out;
+		}
+		if (!rec->opts.nr_cblocks)
+			rec->opts.nr_cblocks = nr_cblocks_default;
+	}
+
 	if (rec->opts.nr_cblocks > nr_cblocks_max)
 		rec->opts.nr_cblocks = nr_cblocks_max;
 	if (verbose > 0)
@@ -2225,9 +4829,38 @@ int cmd_record(int argc, const char **argv)
 
 	pr_debug("affinity: %s\n", affinity_tags[rec->opts.affinity]);
 
+	if (rec->opts.comp_level > comp_level_max)
+		rec->opts.comp_level = comp_level_max;
+	pr_debug("comp level: %d\n", rec->opts.comp_level);
+
+	if (rec->opts.mmap_huge && !rec->opts.nr_cblocks && !rec->opts.comp_level)
+		pr_warning("--huge-buffers only backs the staging buffers of --aio and -z\n");
+
+	if (rec->flight_str &&
+	    (rec->opts.nr_cblocks || rec->opts.overwrite || rec->opts.comp_level ||
+	     record__threads_enabled(rec))) {
+		pr_err("--flight-recorder is incompatible with --aio, --overwrite, -z and --threads\n");
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (record__threads_enabled(rec)) {
+		if (rec->opts.nr_cblocks || rec->opts.overwrite ||
+		    rec->switch_output.enabled || rec->opts.full_auxtrace ||
+		    rec->opts.auxtrace_snapshot_mode || rec->opts.comp_level) {
+			pr_err("--threads is incompatible with --aio, --overwrite, --switch-output, -z and AUX area tracing\n");
+			err = -EINVAL;
+			goto out;
+		}
+
+		if (rec->opts.threads_spec == THREAD_SPEC__NUMA)
+			cpu__setup_cpunode_map();
+	}
+
 	err = __cmd_record(&record, argc, argv);
 out:
 	perf_evlist__delete(rec->evlist);
+	thread_map__put(rec->cgroup_threads);
 	symbol__exit();
 	auxtrace_record__free(rec->itr);
 	return err;
@@ -2246,6 +4879,10 @@ static void snapshot_sig_handler(int sig __maybe_unused)
 
 	if (switch_output_signal(rec))
 		trigger_hit(&switch_output_trigger);
+	else if (switch_output_keep(rec)) {
+		rec->switch_output.keep = 1;
+		trigger_hit(&switch_output_trigger);
+	}
 }
 
 static void alarm_sig_handler(int sig __maybe_unused)
@@ -42,10 +42,18 @@
 #include "util/auxtrace.h"
 #include "util/units.h"
 #include "util/branch.h"
+#include "util/branch-profile.h"
+#include "util/report-cache.h"
+#include "util/mem-stats.h"
+#include "util/stage-time.h"
+#include "util/off-cpu.h"
 
+#include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <regex.h>
 #include "sane_ctype.h"
 #include <signal.h>
@@ -72,6 +80,9 @@ struct report {
 	bool			header_only;
 	bool			nonany_branch_mode;
 	bool			group_set;
+	/* rebuild the hists from the report cache of the data file */
+	bool			cache;
+	struct report_cache	*rc;
 	int			max_stack;
 	struct perf_read_values	show_threads_values;
 	struct annotation_options annotation_opts;
@@ -79,16 +90,40 @@ struct report {
 	const char		*cpu_list;
 	const char		*symbol_filter_str;
 	const char		*time_str;
+	/* flame graph output instead of the report, "folded" or "json" */
+	const char		*folded;
+	/* the dir the branch profiles are written to instead */
+	const char		*branch_profile;
+	struct branch_profile	*bp;
+	/* the sched_switch samples weighted by the time off cpu */
+	bool			off_cpu;
+	struct off_cpu		*oc;
 	struct perf_time_interval *ptime_range;
 	int			range_size;
 	int			range_num;
 	float			min_percent;
 	u64			nr_entries;
 	u64			queue_size;
+	const char		*queue_spill;
 	int			socket_filter;
+	unsigned int		nr_symbol_threads;
+	unsigned int		nr_unwind_threads;
 	DECLARE_BITMAP(cpu_bitmap, MAX_NR_CPUS);
 	struct branch_type_stat	brtype_stat;
 	bool			symbol_ipc;
+	/* the samples went over --max-memory, see report__add_sample() */
+	bool			over_max_memory;
+	/* the -i inputs after the first one, summed into its hists */
+	struct report_input	*inputs;
+	int			nr_inputs;
+	int			next_input;
+	unsigned int		nr_input_threads;
+};
+
+struct report_input {
+	struct report		rep;
+	struct perf_data	data;
+	int			err;
 };
 
 static int report__config(const char *var, const char *value, void *cb)
@@ -110,9 +145,22 @@ static int report__config(const char *var, const char *value, void *cb)
 		symbol_conf.cumulate_callchain = perf_config_bool(var, value);
 		return 0;
 	}
+	if (!strcmp(var, "report.defer-children")) {
+		symbol_conf.defer_children = perf_config_bool(var, value);
+		return 0;
+	}
+	if (!strcmp(var, "report.cache")) {
+		rep->cache = perf_config_bool(var, value);
+		return 0;
+	}
 	if (!strcmp(var, "report.queue-size"))
 		return perf_config_u64(&rep->queue_size, var, value);
 
+	if (!strcmp(var, "report.queue-spill")) {
+		rep->queue_spill = strdup(value);
+		return rep->queue_spill ? 0 : -ENOMEM;
+	}
+
 	if (!strcmp(var, "report.sort_order")) {
 		default_sort_order = strdup(value);
 		return 0;
@@ -228,38 +276,25 @@ static int process_feature_event(struct perf_session *session,
 	return 0;
 }
 
-static int process_sample_event(struct perf_tool *tool,
-				union perf_event *event,
-				struct perf_sample *sample,
-				struct perf_evsel *evsel,
-				struct machine *machine)
+/* Add sample, resolved to al, to the hists */
+static int report__add_sample(struct report *rep, struct perf_evsel *evsel,
+			      struct perf_sample *sample,
+			      struct addr_location *al)
 {
-	struct report *rep = container_of(tool, struct report, tool);
-	struct addr_location al;
 	struct hist_entry_iter iter = {
 		.evsel 			= evsel,
 		.sample 		= sample,
 		.hide_unresolved 	= symbol_conf.hide_unresolved,
 		.add_entry_cb 		= hist_iter__report_callback,
 	};
+	int max_stack = rep->max_stack;
 	int ret = 0;
 
-	if (perf_time__ranges_skip_sample(rep->ptime_range, rep->range_num,
-					  sample->time)) {
+	if (symbol_conf.hide_unresolved && al->sym == NULL)
 		return 0;
-	}
-
-	if (machine__resolve(machine, &al, sample) < 0) {
-		pr_debug("problem processing %d event, skipping it.\n",
-			 event->header.type);
-		return -1;
-	}
-
-	if (symbol_conf.hide_unresolved && al.sym == NULL)
-		goto out_put;
 
 	if (rep->cpu_list && !test_bit(sample->cpu, rep->cpu_bitmap))
-		goto out_put;
+		return 0;
 
 	if (sort__mode == SORT_MODE__BRANCH) {
 		/*
@@ -267,29 +302,287 @@ static int process_sample_event(struct perf_tool *tool,
 		 * branch stacks have been synthesized (using itrace options).
 		 */
 		if (!sample->branch_stack)
-			goto out_put;
+			return 0;
 
 		iter.add_entry_cb = hist_iter__branch_callback;
 		iter.ops = &hist_iter_branch;
 	} else if (rep->mem_mode) {
 		iter.ops = &hist_iter_mem;
-	} else if (symbol_conf.cumulate_callchain) {
+	} else if (symbol_conf.cumulate_callchain &&
+		   !symbol_conf.defer_children) {
 		iter.ops = &hist_iter_cumulative;
 	} else {
 		iter.ops = &hist_iter_normal;
 	}
 
-	if (al.map != NULL)
-		al.map->dso->hit = 1;
+	if (al->map != NULL)
+		al->map->dso->hit = 1;
 
-	ret = hist_entry_iter__add(&iter, &al, rep->max_stack, rep);
+	/*
+	 * Over --max-memory the samples are still counted, but without their
+	 * callchains, which is what grows the most.
+	 */
+	if (mem_stats__over_budget()) {
+		if (!rep->over_max_memory) {
+			ui__warning("Over the --max-memory of %" PRIu64 " bytes, "
+				    "adding the next samples without their callchains.\n",
+				    mem_stats__max_bytes);
+			rep->over_max_memory = true;
+		}
+		max_stack = 0;
+	}
+
+	ret = hist_entry_iter__add(&iter, al, max_stack, rep);
 	if (ret < 0)
 		pr_debug("problem adding hist entry, skipping event\n");
+	return ret;
+}
+
+static int report__add_off_cpu(void *arg, struct perf_evsel *evsel,
+			       struct perf_sample *sample,
+			       struct machine *machine)
+{
+	struct report *rep = arg;
+	struct addr_location al;
+	int ret;
+
+	if (perf_time__ranges_skip_sample(rep->ptime_range, rep->range_num,
+					  sample->time))
+		return 0;
+
+	if (machine__resolve(machine, &al, sample) < 0) {
+		pr_debug("problem processing the switch out of %d, skipping it.\n",
+			 sample->tid);
+		return -1;
+	}
+
+	ret = report__add_sample(rep, evsel, sample, &al);
+	addr_location__put(&al);
+	return ret;
+}
+
+/*
+ * --off-cpu: keep the switch out of the thread, added to the hists when it
+ * is switched in again, here for the next_pid when the switch events
+ * weren't recorded.
+ */
+static int report__off_cpu_sample(struct report *rep, struct perf_evsel *evsel,
+				  struct perf_sample *sample,
+				  struct machine *machine)
+{
+	int next_tid = perf_evsel__intval(evsel, sample, "next_pid");
+	int ret;
+
+	if (next_tid > 0) {
+		ret = off_cpu__switch_in(rep->oc, next_tid, sample->time, machine,
+					 report__add_off_cpu, rep);
+		if (ret)
+			return ret;
+	}
+
+	return off_cpu__switch_out(rep->oc, evsel, sample);
+}
+
+static int process_switch_event(struct perf_tool *tool,
+				union perf_event *event,
+				struct perf_sample *sample,
+				struct machine *machine)
+{
+	struct report *rep = container_of(tool, struct report, tool);
+
+	if (rep->oc && !(event->header.misc & PERF_RECORD_MISC_SWITCH_OUT)) {
+		int ret = off_cpu__switch_in(rep->oc, sample->tid, sample->time,
+					     machine, report__add_off_cpu, rep);
+		if (ret)
+			return ret;
+	}
+
+	return perf_event__process_switch(tool, event, sample, machine);
+}
+
+static int process_sample_event(struct perf_tool *tool,
+				union perf_event *event,
+				struct perf_sample *sample,
+				struct perf_evsel *evsel,
+				struct machine *machine)
+{
+	struct report *rep = container_of(tool, struct report, tool);
+	struct addr_location al;
+	int ret = 0;
+
+	if (rep->oc && off_cpu__is_switch(evsel))
+		return report__off_cpu_sample(rep, evsel, sample, machine);
+
+	/* the cache keeps the samples out of the time ranges too */
+	if (rep->rc == NULL &&
+	    perf_time__ranges_skip_sample(rep->ptime_range, rep->range_num,
+					  sample->time)) {
+		return 0;
+	}
+
+	if (machine__resolve(machine, &al, sample) < 0) {
+		pr_debug("problem processing %d event, skipping it.\n",
+			 event->header.type);
+		return -1;
+	}
+
+	if (rep->bp) {
+		if (!rep->cpu_list || test_bit(sample->cpu, rep->cpu_bitmap))
+			ret = branch_profile__add_sample(rep->bp, sample, &al);
+		goto out_put;
+	}
+
+	if (rep->rc) {
+		report_cache__add(rep->rc, evsel, sample, &al);
+		if (perf_time__ranges_skip_sample(rep->ptime_range,
+						  rep->range_num, sample->time))
+			goto out_put;
+	}
+
+	ret = report__add_sample(rep, evsel, sample, &al);
 out_put:
 	addr_location__put(&al);
 	return ret;
 }
 
+static int report__replay_sample(void *arg, struct perf_evsel *evsel,
+				 struct perf_sample *sample,
+				 struct addr_location *al)
+{
+	struct report *rep = arg;
+
+	if (perf_time__ranges_skip_sample(rep->ptime_range, rep->range_num,
+					  sample->time))
+		return 0;
+
+	return report__add_sample(rep, evsel, sample, al);
+}
+
+/*
+ * The cache only has what the hists are built from without callchains,
+ * branch stacks, memory info or the raw data of the samples.
+ */
+static bool report__cache_usable(struct report *rep)
+{
+	struct perf_session *session = rep->session;
+	struct perf_evsel *evsel;
+
+	if (!rep->cache || perf_data__is_pipe(session->data) ||
+	    session->data->is_dir || dump_trace ||
+	    rep->stats_mode || rep->tasks_mode || rep->show_threads ||
+	    rep->mem_mode || rep->branch_profile || sort__mode != SORT_MODE__NORMAL ||
+	    symbol_conf.use_callchain || symbol_conf.cumulate_callchain ||
+	    perf_hpp_list.parent ||
+	    perf_header__has_feat(&session->header, HEADER_AUXTRACE))
+		return false;
+
+	evlist__for_each_entry(session->evlist, evsel) {
+		if (evsel->attr.type == PERF_TYPE_TRACEPOINT)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Build the hists from the report cache if it is there and up to date,
+ * or else from the events, keeping the samples in a new cache.
+ */
+static int report__process_events(struct report *rep)
+{
+	struct perf_session *session = rep->session;
+	bool cache = report__cache_usable(rep);
+	int ret;
+
+	if (cache) {
+		ret = report_cache__replay(session, report__replay_sample, rep);
+		if (ret != -ENOENT)
+			return ret;
+
+		rep->rc = report_cache__new(session);
+	}
+
+	if (!rep->stats_mode && !rep->tasks_mode &&
+	    (perf_hpp_list.sym || symbol_conf.use_callchain))
+		perf_session__load_dsos(session, rep->nr_symbol_threads);
+
+	if (!rep->stats_mode && !rep->tasks_mode && symbol_conf.use_callchain) {
+		ret = perf_session__unwind_threads(session, rep->nr_unwind_threads,
+						   rep->max_stack);
+		if (ret)
+			return ret;
+	}
+
+	ret = perf_session__process_events(session);
+
+	if (rep->rc) {
+		if (!ret && !session_done() && report_cache__write(rep->rc))
+			pr_debug("failed to write the report cache\n");
+		report_cache__delete(rep->rc);
+		rep->rc = NULL;
+	}
+
+	return ret;
+}
+
+static void *report__process_inputs_worker(void *arg)
+{
+	struct report *rep = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&rep->next_input, 1)) < rep->nr_inputs) {
+		struct report_input *in = &rep->inputs[i];
+
+		if (session_done())
+			break;
+
+		in->err = report__process_events(&in->rep);
+		if (in->err)
+			pr_err("%s: failed to process the events\n", in->data.path);
+	}
+
+	return NULL;
+}
+
+/*
+ * The other inputs are each a session of their own, processed on up to
+ * --input-threads threads, this one included once its session is done.
+ */
+static int report__process_inputs(struct report *rep)
+{
+	unsigned int nr_threads = rep->nr_input_threads, started = 0, i;
+	pthread_t *threads = NULL;
+	int ret;
+
+	if (nr_threads == UINT_MAX)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = min_t(unsigned int, nr_threads, rep->nr_inputs + 1);
+
+	rep->next_input = 0;
+	if (nr_threads > 1)
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+
+	for (i = 0; threads && i < nr_threads - 1; i++) {
+		if (pthread_create(&threads[started], NULL,
+				   report__process_inputs_worker, rep))
+			break;
+		started++;
+	}
+
+	ret = report__process_events(rep);
+
+	report__process_inputs_worker(rep);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; !ret && i < (unsigned int)rep->nr_inputs; i++)
+		ret = rep->inputs[i].err;
+
+	return ret;
+}
+
 static int process_read_event(struct perf_tool *tool,
 			      union perf_event *event,
 			      struct perf_sample *sample __maybe_unused,
@@ -370,6 +663,26 @@ static int report__setup_sample_type(struct report *rep)
 		}
 	}
 
+	if (rep->branch_profile && !is_pipe &&
+	    !(sample_type & PERF_SAMPLE_BRANCH_STACK)) {
+		ui__error("Selected --branch-profile but no branch data. "
+			  "Did you call perf record without -b?\n");
+		return -1;
+	}
+
+	if (rep->off_cpu) {
+		if (!perf_evlist__find_tracepoint_by_name(session->evlist,
+							  "sched:sched_switch")) {
+			ui__error("Selected --off-cpu but no sched:sched_switch samples. "
+				  "Did you call perf record without --off-cpu?\n");
+			return -1;
+		}
+
+		rep->oc = off_cpu__new();
+		if (rep->oc == NULL)
+			return -ENOMEM;
+	}
+
 	if (symbol_conf.use_callchain || symbol_conf.cumulate_callchain) {
 		if ((sample_type & PERF_SAMPLE_REGS_USER) &&
 		    (sample_type & PERF_SAMPLE_STACK_USER)) {
@@ -386,6 +699,12 @@ static int report__setup_sample_type(struct report *rep)
 				PERF_SAMPLE_BRANCH_ANY))
 		rep->nonany_branch_mode = true;
 
+	/* the children come from the callchains kept in the self entries */
+	if (symbol_conf.defer_children &&
+	    (!symbol_conf.cumulate_callchain || !symbol_conf.use_callchain ||
+	     callchain_param.branch_callstack))
+		symbol_conf.defer_children = false;
+
 	return 0;
 }
 
@@ -502,6 +821,37 @@ static int perf_evlist__tty_browse_hists(struct perf_evlist *evlist,
 	return 0;
 }
 
+/* The stacks of every event, for flamegraph.pl or d3-flame-graph */
+static int perf_evlist__fprintf_folded(struct perf_evlist *evlist,
+				       struct report *rep)
+{
+	bool json = !strcmp(rep->folded, "json");
+	struct perf_evsel *pos;
+	int nr = 0, ret = 0;
+
+	evlist__for_each_entry(evlist, pos) {
+		if (evsel__hists(pos)->nr_entries)
+			nr++;
+	}
+
+	evlist__for_each_entry(evlist, pos) {
+		struct hists *hists = evsel__hists(pos);
+		const char *evname = perf_evsel__name(pos);
+
+		if (!hists->nr_entries)
+			continue;
+
+		if (json)
+			ret = hists__fprintf_flame_json(hists, evname, stdout);
+		else
+			ret = hists__fprintf_folded(hists, nr > 1 ? evname : NULL, stdout);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
 static void report__warn_kptr_restrict(const struct report *rep)
 {
 	struct map *kernel_map = machine__kernel_map(&rep->session->machines.host);
@@ -560,6 +910,9 @@ static int report__browse_hists(struct report *rep)
 			help = "Cannot load tips.txt file, please install perf!";
 	}
 
+	if (rep->folded)
+		return perf_evlist__fprintf_folded(evlist, rep);
+
 	switch (use_browser) {
 	case 1:
 		ret = perf_evlist__tui_browse_hists(evlist, help, NULL,
@@ -584,6 +937,41 @@ static int report__browse_hists(struct report *rep)
 	return ret;
 }
 
+/* Sum the hists of the same event in the other inputs into the ones of pos */
+static int report__merge_inputs(struct report *rep, struct perf_evsel *pos,
+				struct ui_progress *prog)
+{
+	const char *name = perf_evsel__name(pos);
+	int i, j, ret;
+
+	for (i = 0; i < rep->nr_inputs; i++) {
+		struct report_input *in = &rep->inputs[i];
+		struct perf_evsel *evsel;
+
+		evsel = perf_evlist__find_evsel_by_str(in->rep.session->evlist, name);
+		if (evsel == NULL) {
+			pr_debug("%s: no %s event to merge\n", in->data.path, name);
+			continue;
+		}
+
+		ret = hists__collapse_merge(evsel__hists(pos), evsel__hists(evsel), prog);
+		if (ret < 0)
+			return ret;
+
+		if (pos->idx)
+			continue;
+
+		for (j = 0; j < PERF_BR_MAX; j++)
+			rep->brtype_stat.counts[j] += in->rep.brtype_stat.counts[j];
+		rep->brtype_stat.cond_fwd += in->rep.brtype_stat.cond_fwd;
+		rep->brtype_stat.cond_bwd += in->rep.brtype_stat.cond_bwd;
+		rep->brtype_stat.cross_4k += in->rep.brtype_stat.cross_4k;
+		rep->brtype_stat.cross_2m += in->rep.brtype_stat.cross_2m;
+	}
+
+	return 0;
+}
+
 static int report__collapse_hists(struct report *rep)
 {
 	struct ui_progress prog;
@@ -600,10 +988,20 @@ static int report__collapse_hists(struct report *rep)
 
 		hists->socket_filter = rep->socket_filter;
 
+		if (symbol_conf.defer_children) {
+			ret = hists__add_children(hists);
+			if (ret < 0)
+				break;
+		}
+
 		ret = hists__collapse_resort(hists, &prog);
 		if (ret < 0)
 			break;
 
+		ret = report__merge_inputs(rep, pos, &prog);
+		if (ret < 0)
+			break;
+
 		/* Non-group events are considered as leader */
 		if (symbol_conf.event_group &&
 		    !perf_evsel__is_group_leader(pos)) {
@@ -727,7 +1125,7 @@ static size_t maps__fprintf_task(struct maps *maps, int indent, FILE *fp)
 
 static int map_groups__fprintf_task(struct map_groups *mg, int indent, FILE *fp)
 {
-	return maps__fprintf_task(&mg->maps, indent, fp);
+	return maps__fprintf_task(&map_groups__owner(mg)->maps, indent, fp);
 }
 
 static void task__print_level(struct task *task, FILE *fp, int level)
@@ -815,9 +1213,82 @@ static int tasks_print(struct report *rep, FILE *fp)
 	return 0;
 }
 
+static void report__set_queue_size(struct report *rep, struct perf_session *session)
+{
+	if (rep->queue_size) {
+		ordered_events__set_alloc_size(&session->ordered_events,
+					       rep->queue_size);
+	} else if (mem_stats__max_bytes) {
+		/* flush the queued events early rather than queue them all */
+		ordered_events__set_alloc_size(&session->ordered_events,
+					       mem_stats__max_bytes / 4);
+	} else {
+		return;
+	}
+
+	/* or write them to disk, to be merged back in order */
+	if (rep->queue_spill &&
+	    ordered_events__set_spill(&session->ordered_events, rep->queue_spill))
+		pr_warning("Not spilling the queued events to %s\n", rep->queue_spill);
+}
+
+/*
+ * The other inputs get the setup of the first one, their sessions are
+ * kept until the end as the merged hists point to their threads and maps.
+ */
+static int report__open_inputs(struct report *rep)
+{
+	int i, ret;
+
+	for (i = 0; i < rep->nr_inputs; i++) {
+		struct report_input *in = &rep->inputs[i];
+		struct perf_session *session;
+
+		in->rep = *rep;
+		in->rep.inputs	  = NULL;
+		in->rep.nr_inputs = 0;
+		in->data.force	  = symbol_conf.force;
+
+		session = perf_session__new(&in->data, false, &in->rep.tool);
+		if (session == NULL)
+			return -1;
+
+		report__set_queue_size(rep, session);
+		session->itrace_synth_opts = rep->session->itrace_synth_opts;
+		in->rep.session = session;
+
+		setup_forced_leader(&in->rep, session->evlist);
+
+		ret = report__setup_sample_type(&in->rep);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void report__close_inputs(struct report *rep)
+{
+	int i;
+
+	for (i = 0; i < rep->nr_inputs; i++) {
+		struct perf_session *session = rep->inputs[i].rep.session;
+
+		if (session) {
+			session->skip_teardown = true;
+			perf_session__delete(session);
+		}
+		off_cpu__delete(rep->inputs[i].rep.oc);
+	}
+
+	zfree(&rep->inputs);
+	rep->nr_inputs = 0;
+}
+
 static int __cmd_report(struct report *rep)
 {
-	int ret;
+	u64 start;
+	int i, ret;
 	struct perf_session *session = rep->session;
 	struct perf_evsel *pos;
 	struct perf_data *data = session->data;
@@ -852,7 +1323,19 @@ static int __cmd_report(struct report *rep)
 	if (rep->tasks_mode)
 		tasks_setup(rep);
 
-	ret = perf_session__process_events(session);
+	if (rep->branch_profile) {
+		rep->bp = branch_profile__new();
+		if (!rep->bp)
+			return -ENOMEM;
+	}
+
+	ret = report__open_inputs(rep);
+	if (ret)
+		return ret;
+
+	ret = report__process_inputs(rep);
+	off_cpu__delete(rep->oc);
+	rep->oc = NULL;
 	if (ret) {
 		ui__error("failed to process sample\n");
 		return ret;
@@ -864,11 +1347,24 @@ static int __cmd_report(struct report *rep)
 	if (rep->tasks_mode)
 		return tasks_print(rep, stdout);
 
+	if (rep->bp) {
+		ret = branch_profile__write(rep->bp, rep->branch_profile, stdout,
+					    quiet ? 0 : 10);
+		branch_profile__delete(rep->bp);
+		rep->bp = NULL;
+		return ret;
+	}
+
 	report__warn_kptr_restrict(rep);
 
 	evlist__for_each_entry(session->evlist, pos)
 		rep->nr_entries += evsel__hists(pos)->nr_entries;
 
+	for (i = 0; i < rep->nr_inputs; i++) {
+		evlist__for_each_entry(rep->inputs[i].rep.session->evlist, pos)
+			rep->nr_entries += evsel__hists(pos)->nr_entries;
+	}
+
 	if (use_browser == 0) {
 		if (verbose > 3)
 			perf_session__fprintf(session, stdout);
@@ -907,7 +1403,10 @@ static int __cmd_report(struct report *rep)
 
 	report__output_resort(rep);
 
-	return report__browse_hists(rep);
+	start = stage_time__start();
+	ret = report__browse_hists(rep);
+	stage_time__end(STAGE_TIME__OUTPUT, start);
+	return ret;
 }
 
 static int
@@ -1005,6 +1504,109 @@ parse_percent_limit(const struct option *opt, const char *str,
 	return 0;
 }
 
+static bool report__dir_has_header(const char *path)
+{
+	char header[PATH_MAX];
+
+	scnprintf(header, sizeof(header), "%s/header", path);
+	return !access(header, F_OK);
+}
+
+/* A data file, or a data directory of 'perf record --threads' */
+static bool report__is_data(const char *path)
+{
+	struct stat st;
+	u64 magic;
+	bool ret;
+	int fd;
+
+	if (stat(path, &st))
+		return false;
+
+	if (S_ISDIR(st.st_mode))
+		return report__dir_has_header(path);
+
+	if (!S_ISREG(st.st_mode))
+		return false;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ret = read(fd, &magic, sizeof(magic)) == sizeof(magic) &&
+	      is_perf_magic(magic);
+	close(fd);
+	return ret;
+}
+
+static int report__add_input(struct report *rep, const char *path)
+{
+	struct report_input *in;
+
+	/* the first one is the session the others are merged into */
+	if (input_name == NULL) {
+		input_name = path;
+		return 0;
+	}
+
+	in = realloc(rep->inputs, (rep->nr_inputs + 1) * sizeof(*in));
+	if (in == NULL)
+		return -ENOMEM;
+
+	rep->inputs = in;
+	in = &rep->inputs[rep->nr_inputs++];
+	memset(in, 0, sizeof(*in));
+	in->data.path = path;
+	in->data.mode = PERF_DATA_MODE_READ;
+	return 0;
+}
+
+/* The data files in a directory that isn't a data directory itself */
+static int report__add_input_dir(struct report *rep, const char *dir)
+{
+	struct dirent **entries;
+	int i, n, nr = 0, ret = 0;
+
+	n = scandir(dir, &entries, NULL, alphasort);
+	if (n < 0) {
+		pr_err("Failed to read %s: %s\n", dir, strerror(errno));
+		return -errno;
+	}
+
+	for (i = 0; i < n; i++) {
+		char *path;
+
+		if (!ret && entries[i]->d_name[0] != '.') {
+			if (asprintf(&path, "%s/%s", dir, entries[i]->d_name) < 0)
+				ret = -ENOMEM;
+			else if (!report__is_data(path))
+				free(path);
+			else if (!(ret = report__add_input(rep, path)))
+				nr++;
+		}
+		free(entries[i]);
+	}
+	free(entries);
+
+	if (!ret && !nr) {
+		pr_err("No perf data files in %s\n", dir);
+		ret = -EINVAL;
+	}
+	return ret;
+}
+
+static int report__parse_input(const struct option *opt, const char *arg,
+			       int unset __maybe_unused)
+{
+	struct report *rep = opt->value;
+	struct stat st;
+
+	if (!stat(arg, &st) && S_ISDIR(st.st_mode) && !report__dir_has_header(arg))
+		return report__add_input_dir(rep, arg);
+
+	return report__add_input(rep, arg);
+}
+
 int cmd_report(int argc, const char **argv)
 {
 	struct perf_session *session;
@@ -1032,6 +1634,7 @@ int cmd_report(int argc, const char **argv)
 			.exit		 = perf_event__process_exit,
 			.fork		 = perf_event__process_fork,
 			.lost		 = perf_event__process_lost,
+			.context_switch	 = process_switch_event,
 			.read		 = process_read_event,
 			.attr		 = perf_event__process_attr,
 			.tracing_data	 = perf_event__process_tracing_data,
@@ -1047,19 +1650,33 @@ int cmd_report(int argc, const char **argv)
 		.max_stack		 = PERF_MAX_STACK_DEPTH,
 		.pretty_printing_style	 = "normal",
 		.socket_filter		 = -1,
+		.nr_symbol_threads	 = UINT_MAX,
+		.nr_unwind_threads	 = UINT_MAX,
+		.nr_input_threads	 = UINT_MAX,
 		.annotation_opts	 = annotation__default_options,
 	};
 	const struct option options[] = {
-	OPT_STRING('i', "input", &input_name, "file",
-		    "input file name"),
+	OPT_CALLBACK('i', "input", &report, "file",
+		     "input file name, or directory of them, the hists of more"
+		     " than one are summed", report__parse_input),
 	OPT_INCR('v', "verbose", &verbose,
 		    "be more verbose (show symbol address, etc)"),
 	OPT_BOOLEAN('q', "quiet", &quiet, "Do not show any message"),
 	OPT_BOOLEAN('D', "dump-raw-trace", &dump_trace,
 		    "dump raw trace in ASCII"),
 	OPT_BOOLEAN(0, "stats", &report.stats_mode, "Display event stats"),
+	OPT_BOOLEAN(0, "stage-stats", &stage_time__enabled,
+		    "Display the time spent processing events, resolving samples, etc"),
+	OPT_BOOLEAN(0, "mem-stats", &mem_stats__enabled,
+		    "Display the memory used by hist entries, callchains, threads, etc"),
+	OPT_CALLBACK(0, "max-memory", NULL, "size",
+		     "Add samples without callchains and flush the queued events"
+		     " early to stay under that much memory (B/K/M/G)",
+		     mem_stats__parse_max),
 	OPT_BOOLEAN(0, "tasks", &report.tasks_mode, "Display recorded tasks"),
 	OPT_BOOLEAN(0, "mmaps", &report.mmaps_mode, "Display recorded tasks memory maps"),
+	OPT_STRING(0, "branch-profile", &report.branch_profile, "dir",
+		   "Write the branch stacks as an AutoFDO profile of each dso in dir"),
 	OPT_STRING('k', "vmlinux", &symbol_conf.vmlinux_name,
 		   "file", "vmlinux pathname"),
 	OPT_BOOLEAN(0, "ignore-vmlinux", &symbol_conf.ignore_vmlinux,
@@ -1100,6 +1717,10 @@ int cmd_report(int argc, const char **argv)
 			     callchain_default_opt),
 	OPT_BOOLEAN(0, "children", &symbol_conf.cumulate_callchain,
 		    "Accumulate callchains of children and show total overhead as well"),
+	OPT_BOOLEAN(0, "off-cpu", &report.off_cpu,
+		    "Weight the sched:sched_switch samples by the time until the thread runs again"),
+	OPT_BOOLEAN(0, "defer-children", &symbol_conf.defer_children,
+		    "Accumulate the children from the callchains after reading the samples"),
 	OPT_INTEGER(0, "max-stack", &report.max_stack,
 		    "Set the maximum stack depth when parsing the callchain, "
 		    "anything beyond the specified depth will be ignored. "
@@ -1173,10 +1794,25 @@ int cmd_report(int argc, const char **argv)
 		    "Show callgraph from reference event"),
 	OPT_INTEGER(0, "socket-filter", &report.socket_filter,
 		    "only show processor socket that match with this filter"),
+	OPT_UINTEGER(0, "symbol-threads", &report.nr_symbol_threads,
+		     "Number of threads loading symbols before processing"
+		     " events, 0 to load them as samples hit them"),
+	OPT_BOOLEAN(0, "cache", &report.cache,
+		    "Rebuild the hists from the resolved samples kept next to"
+		    " the data file, keeping them there when they are not"),
+	OPT_UINTEGER(0, "unwind-threads", &report.nr_unwind_threads,
+		     "Number of threads unwinding the user stacks of samples"
+		     " for --call-graph=dwarf, 0 to unwind them one by one"),
+	OPT_UINTEGER(0, "input-threads", &report.nr_input_threads,
+		     "Number of threads processing the inputs when there are"
+		     " more than one"),
 	OPT_BOOLEAN(0, "raw-trace", &symbol_conf.raw_trace,
 		    "Show raw trace event output (do not use print fmt or plugins)"),
 	OPT_BOOLEAN(0, "hierarchy", &symbol_conf.report_hierarchy,
 		    "Show entries in a hierarchy"),
+	OPT_STRING_OPTARG(0, "folded", &report.folded, "format",
+			  "Print the stacks for flame graphs instead: folded"
+			  " (default) or json", "folded"),
 	OPT_CALLBACK_DEFAULT(0, "stdio-color", NULL, "mode",
 			     "'always' (default), 'never' or 'auto' only applicable to --stdio mode",
 			     stdio__config_color, "always"),
@@ -1221,6 +1857,10 @@ int cmd_report(int argc, const char **argv)
 	if (report.mmaps_mode)
 		report.tasks_mode = true;
 
+	/* the tasks are listed with their maps after all the events */
+	if (report.tasks_mode)
+		symbol_conf.keep_exited_maps = true;
+
 	if (quiet)
 		perf_quiet_option();
 
@@ -1259,10 +1899,7 @@ repeat:
 	if (session == NULL)
 		return -1;
 
-	if (report.queue_size) {
-		ordered_events__set_alloc_size(&session->ordered_events,
-					       report.queue_size);
-	}
+	report__set_queue_size(&report, session);
 
 	session->itrace_synth_opts = &itrace_synth_opts;
 
@@ -1309,6 +1946,15 @@ repeat:
 		symbol_conf.cumulate_callchain = false;
 	}
 
+	if (report.folded) {
+		if (strcmp(report.folded, "folded") && strcmp(report.folded, "json")) {
+			parse_options_usage(report_usage, options, "folded", 0);
+			goto error;
+		}
+		/* the callers' entries would have the same stacks again */
+		symbol_conf.cumulate_callchain = false;
+	}
+
 	if (symbol_conf.report_hierarchy) {
 		/* disable incompatible options */
 		symbol_conf.cumulate_callchain = false;
@@ -1323,6 +1969,15 @@ repeat:
 		perf_hpp_list.need_collapse = true;
 	}
 
+	/*
+	 * The entries of the other inputs are summed as they collapse, the
+	 * same binaries have different paths on different hosts.
+	 */
+	if (report.nr_inputs) {
+		perf_hpp_list.need_collapse = true;
+		symbol_conf.dso_by_build_id = true;
+	}
+
 	if (report.use_stdio)
 		use_browser = 0;
 	else if (report.use_tui)
@@ -1331,18 +1986,30 @@ repeat:
 		use_browser = 2;
 
 	/* Force tty output for header output and per-thread stat. */
-	if (report.header || report.header_only || report.show_threads)
+	if (report.header || report.header_only || report.show_threads ||
+	    report.folded)
 		use_browser = 0;
 	if (report.header || report.header_only)
 		report.tool.show_feat_hdr = SHOW_FEAT_HEADER;
 	if (report.show_full_info)
 		report.tool.show_feat_hdr = SHOW_FEAT_HEADER_FULL_INFO;
-	if (report.stats_mode || report.tasks_mode)
+	if (report.stats_mode || report.tasks_mode || report.branch_profile)
 		use_browser = 0;
+	/* the time spent goes with the event stats */
+	if (report.stats_mode)
+		stage_time__enabled = true;
 	if (report.stats_mode && report.tasks_mode) {
 		pr_err("Error: --tasks and --mmaps can't be used together with --stats\n");
 		goto error;
 	}
+	if (report.nr_inputs &&
+	    (report.stats_mode || report.tasks_mode || report.show_threads ||
+	     report.header || report.header_only || dump_trace ||
+	     report.branch_profile)) {
+		pr_err("Error: --stats, --tasks, --mmaps, --threads, --header, --header-only,\n"
+		       "--branch-profile and --dump-raw-trace take a single input\n");
+		goto error;
+	}
 
 	if (strcmp(input_name, "-") != 0)
 		setup_browser(true);
@@ -1383,8 +2050,9 @@ repeat:
 			ret = 0;
 			goto error;
 		}
-	} else if (use_browser == 0 && !quiet &&
-		   !report.stats_mode && !report.tasks_mode) {
+	} else if (use_browser == 0 && !quiet && !report.folded &&
+		   !report.stats_mode && !report.tasks_mode &&
+		   !report.branch_profile) {
 		fputs("# To display the perf.data header info, please use --header/--header-only options.\n#\n",
 		      stdout);
 	}
@@ -1441,15 +2109,26 @@ repeat:
 
 	ret = __cmd_report(&report);
 	if (ret == K_SWITCH_INPUT_DATA) {
+		/* switching to another data file leaves the other inputs */
+		report__close_inputs(&report);
 		perf_session__delete(session);
 		goto repeat;
 	} else
 		ret = 0;
 
+	if (stage_time__enabled)
+		stage_time__fprintf(stdout);
+	if (mem_stats__enabled)
+		mem_stats__fprintf(stdout);
+
 error:
 	if (report.ptime_range)
 		zfree(&report.ptime_range);
 
+	report__close_inputs(&report);
+
+	/* the exit releases the machines much faster */
+	session->skip_teardown = true;
 	perf_session__delete(session);
 	return ret;
 }
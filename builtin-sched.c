@@ -27,6 +27,8 @@
 #include <linux/log2.h>
 #include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <inttypes.h>
 
 #include <errno.h>
@@ -39,12 +41,12 @@
 #include "sane_ctype.h"
 
 #define PR_SET_NAME		15               /* Set process name */
-#define MAX_CPUS		4096
 #define COMM_LEN		20
 #define SYM_LEN			129
 #define MAX_PID			1024000
 
 struct sched_atom;
+struct replay_worker;
 
 struct task_desc {
 	unsigned long		nr;
@@ -62,6 +64,10 @@ struct task_desc {
 	sem_t			work_done_sem;
 
 	u64			cpu_usage;
+
+	/* with --multiplex, the worker the task runs on and its run queue */
+	struct replay_worker	*worker;
+	struct task_desc	*next_runnable;
 };
 
 enum sched_event_type {
@@ -78,9 +84,33 @@ struct sched_atom {
 	u64			duration;
 	unsigned long		nr;
 	sem_t			*wait_sem;
+	struct replay_wait	*wait;
 	struct task_desc	*wakee;
 };
 
+/*
+ * What a sleep atom waits for with --multiplex: the wakeups posted before
+ * it is reached, or the task parked on it until its wakeup.
+ */
+struct replay_wait {
+	pthread_mutex_t		lock;
+	unsigned int		count;
+	struct task_desc	*waiter;
+};
+
+/* A thread pinned to a cpu, running the tasks made runnable on it */
+struct replay_worker {
+	pthread_mutex_t		lock;
+	struct task_desc	*head, *tail;
+	/* bumped when a task is queued, what the worker waits on */
+	u32			futex;
+	int			cpu;
+	int			fd;
+	sem_t			ready;
+	pthread_t		thread;
+	struct perf_sched	*sched;
+} __aligned(64);
+
 #define TASK_STATE_TO_CHAR_STR "RSDTtZXxKWP"
 
 /* task state bitmask, copied from include/linux/sched.h */
@@ -151,11 +181,21 @@ struct trace_sched_handler {
 				  struct machine *machine);
 };
 
+/*
+ * The state tracked for each cpu, each on cache lines of its own so that
+ * the cpus could be processed in parallel.
+ */
+struct sched_cpu {
+	u64		 last_switched;
+	struct thread	 *curr_thread;
+	u32		 curr_pid;
+} __aligned(64);
+
 #define COLOR_PIDS PERF_COLOR_BLUE
 #define COLOR_CPUS PERF_COLOR_BG_RED
 
 struct perf_sched_map {
-	DECLARE_BITMAP(comp_cpus_mask, MAX_CPUS);
+	unsigned long		*comp_cpus_mask;
 	int			*comp_cpus;
 	bool			 comp;
 	struct thread_map	*color_pids;
@@ -181,11 +221,16 @@ struct perf_sched {
  * weird events, such as a task being switched away that is not current.
  */
 	int		 max_cpu;
-	u32		 curr_pid[MAX_CPUS];
-	struct thread	 *curr_thread[MAX_CPUS];
+	int		 nr_cpus;
+	struct sched_cpu *cpus;
 	char		 next_shortname1;
 	char		 next_shortname2;
 	unsigned int	 replay_repeat;
+	bool		 replay_multiplex;
+	int		 nr_replay_workers;
+	struct replay_worker *replay_workers;
+	/* tasks still to replay all their atoms in this run, futex */
+	u32		 replay_pending;
 	unsigned long	 nr_run_events;
 	unsigned long	 nr_sleep_events;
 	unsigned long	 nr_wakeup_events;
@@ -212,7 +257,6 @@ struct perf_sched {
 	u64		 run_avg;
 	u64		 all_runtime;
 	u64		 all_count;
-	u64		 cpu_last_switched[MAX_CPUS];
 	struct rb_root_cached atom_root, sorted_atom_root, merged_atom_root;
 	struct list_head sort_list, cmp_pid;
 	bool force;
@@ -419,6 +463,13 @@ static void add_sched_event_wakeup(struct perf_sched *sched, struct task_desc *t
 	wakee_event->specific_wait = 1;
 	event->wait_sem = wakee_event->wait_sem;
 
+	if (sched->replay_multiplex) {
+		wakee_event->wait = zalloc(sizeof(*wakee_event->wait));
+		BUG_ON(wakee_event->wait == NULL);
+		pthread_mutex_init(&wakee_event->wait->lock, NULL);
+		event->wait = wakee_event->wait;
+	}
+
 	sched->nr_wakeup_events++;
 }
 
@@ -680,6 +731,20 @@ static void create_tasks(struct perf_sched *sched)
 	}
 }
 
+static void account_cpu_usage(struct perf_sched *sched, u64 cpu_usage_0,
+			      u64 cpu_usage_1)
+{
+	if (!sched->runavg_cpu_usage)
+		sched->runavg_cpu_usage = sched->cpu_usage;
+	sched->runavg_cpu_usage = (sched->runavg_cpu_usage * (sched->replay_repeat - 1) + sched->cpu_usage) / sched->replay_repeat;
+
+	sched->parent_cpu_usage = cpu_usage_1 - cpu_usage_0;
+	if (!sched->runavg_parent_cpu_usage)
+		sched->runavg_parent_cpu_usage = sched->parent_cpu_usage;
+	sched->runavg_parent_cpu_usage = (sched->runavg_parent_cpu_usage * (sched->replay_repeat - 1) +
+					 sched->parent_cpu_usage)/sched->replay_repeat;
+}
+
 static void wait_for_tasks(struct perf_sched *sched)
 {
 	u64 cpu_usage_0, cpu_usage_1;
@@ -713,15 +778,7 @@ static void wait_for_tasks(struct perf_sched *sched)
 	}
 
 	cpu_usage_1 = get_cpu_usage_nsec_parent();
-	if (!sched->runavg_cpu_usage)
-		sched->runavg_cpu_usage = sched->cpu_usage;
-	sched->runavg_cpu_usage = (sched->runavg_cpu_usage * (sched->replay_repeat - 1) + sched->cpu_usage) / sched->replay_repeat;
-
-	sched->parent_cpu_usage = cpu_usage_1 - cpu_usage_0;
-	if (!sched->runavg_parent_cpu_usage)
-		sched->runavg_parent_cpu_usage = sched->parent_cpu_usage;
-	sched->runavg_parent_cpu_usage = (sched->runavg_parent_cpu_usage * (sched->replay_repeat - 1) +
-					 sched->parent_cpu_usage)/sched->replay_repeat;
+	account_cpu_usage(sched, cpu_usage_0, cpu_usage_1);
 
 	ret = pthread_mutex_lock(&sched->start_work_mutex);
 	BUG_ON(ret);
@@ -733,12 +790,244 @@ static void wait_for_tasks(struct perf_sched *sched)
 	}
 }
 
+static long sys_futex(u32 *uaddr, int op, u32 val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void replay_worker__queue(struct replay_worker *worker,
+				 struct task_desc *task)
+{
+	pthread_mutex_lock(&worker->lock);
+	task->next_runnable = NULL;
+	if (worker->tail)
+		worker->tail->next_runnable = task;
+	else
+		worker->head = task;
+	worker->tail = task;
+	pthread_mutex_unlock(&worker->lock);
+
+	__atomic_add_fetch(&worker->futex, 1, __ATOMIC_SEQ_CST);
+	sys_futex(&worker->futex, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static struct task_desc *replay_worker__next(struct replay_worker *worker)
+{
+	struct task_desc *task;
+
+	pthread_mutex_lock(&worker->lock);
+	task = worker->head;
+	if (task) {
+		worker->head = task->next_runnable;
+		if (worker->head == NULL)
+			worker->tail = NULL;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	return task;
+}
+
+/*
+ * Replay the atoms of task until it sleeps waiting for a wakeup not yet
+ * posted, parking it on that wait, or until its next run atom if other
+ * tasks are runnable on this worker, queueing it after them.
+ */
+static void replay_worker__run_task(struct replay_worker *worker,
+				    struct task_desc *task)
+{
+	struct perf_sched *sched = worker->sched;
+
+	while (task->curr_event < task->nr_events) {
+		struct sched_atom *atom = task->atoms[task->curr_event++];
+		struct replay_wait *wait = atom->wait;
+		struct task_desc *waiter = NULL;
+
+		switch (atom->type) {
+		case SCHED_EVENT_RUN:
+			if (READ_ONCE(worker->head)) {
+				task->curr_event--;
+				replay_worker__queue(worker, task);
+				return;
+			}
+			burn_nsecs(sched, atom->duration);
+			break;
+		case SCHED_EVENT_SLEEP:
+			if (wait == NULL)
+				break;
+			pthread_mutex_lock(&wait->lock);
+			if (wait->count) {
+				wait->count--;
+			} else {
+				wait->waiter = task;
+				task = NULL;
+			}
+			pthread_mutex_unlock(&wait->lock);
+			if (task == NULL)
+				return;
+			break;
+		case SCHED_EVENT_WAKEUP:
+			if (wait == NULL)
+				break;
+			pthread_mutex_lock(&wait->lock);
+			if (wait->waiter) {
+				waiter = wait->waiter;
+				wait->waiter = NULL;
+			} else {
+				wait->count++;
+			}
+			pthread_mutex_unlock(&wait->lock);
+			if (waiter)
+				replay_worker__queue(waiter->worker, waiter);
+			break;
+		case SCHED_EVENT_MIGRATION:
+			break;
+		default:
+			BUG_ON(1);
+		}
+	}
+
+	/* the last one wakes up the main thread */
+	if (__atomic_sub_fetch(&sched->replay_pending, 1, __ATOMIC_SEQ_CST) == 0)
+		sys_futex(&sched->replay_pending, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static void *replay_worker__thread(void *arg)
+{
+	struct replay_worker *worker = arg;
+	cpu_set_t cpus;
+	char comm[16];
+
+	CPU_ZERO(&cpus);
+	CPU_SET(worker->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		pr_debug("replay: couldn't pin the worker to cpu %d\n", worker->cpu);
+
+	snprintf(comm, sizeof(comm), ":replay/%d", worker->cpu);
+	prctl(PR_SET_NAME, comm);
+
+	worker->fd = self_open_counters(worker->sched, 0);
+	sem_post(&worker->ready);
+
+	while (1) {
+		u32 seq = __atomic_load_n(&worker->futex, __ATOMIC_SEQ_CST);
+		struct task_desc *task = replay_worker__next(worker);
+
+		if (task == NULL) {
+			sys_futex(&worker->futex, FUTEX_WAIT_PRIVATE, seq);
+			continue;
+		}
+
+		replay_worker__run_task(worker, task);
+	}
+
+	return NULL;
+}
+
+/*
+ * With --multiplex the tasks are replayed by a worker pinned to each
+ * online cpu instead of by a thread each, the task number picking the
+ * worker, so that many thousand tasks can be replayed.
+ */
+static void create_replay_workers(struct perf_sched *sched)
+{
+	int i, err, nr = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long t;
+
+	if (nr < 1)
+		nr = 1;
+
+	BUG_ON(posix_memalign((void **)&sched->replay_workers,
+			      sizeof(*sched->replay_workers),
+			      nr * sizeof(*sched->replay_workers)));
+	memset(sched->replay_workers, 0, nr * sizeof(*sched->replay_workers));
+	sched->nr_replay_workers = nr;
+
+	for (t = 0; t < sched->nr_tasks; t++)
+		sched->tasks[t]->worker = &sched->replay_workers[t % nr];
+
+	for (i = 0; i < nr; i++) {
+		struct replay_worker *worker = &sched->replay_workers[i];
+
+		pthread_mutex_init(&worker->lock, NULL);
+		sem_init(&worker->ready, 0, 0);
+		worker->cpu   = i;
+		worker->sched = sched;
+		err = pthread_create(&worker->thread, NULL, replay_worker__thread,
+				     worker);
+		BUG_ON(err);
+	}
+
+	for (i = 0; i < nr; i++)
+		BUG_ON(sem_wait(&sched->replay_workers[i].ready));
+}
+
+static u64 replay_workers__cpu_usage(struct perf_sched *sched)
+{
+	u64 usage = 0;
+	int i;
+
+	for (i = 0; i < sched->nr_replay_workers; i++) {
+		struct replay_worker *worker = &sched->replay_workers[i];
+
+		/* the task clock of the worker threads, opened from them */
+		usage += get_cpu_usage_nsec_self(worker->fd);
+	}
+
+	return usage;
+}
+
+static void reset_replay_waits(struct perf_sched *sched)
+{
+	unsigned long i, j;
+
+	for (i = 0; i < sched->nr_tasks; i++) {
+		struct task_desc *task = sched->tasks[i];
+
+		task->curr_event = 0;
+		for (j = 0; j < task->nr_events; j++) {
+			struct replay_wait *wait = task->atoms[j]->wait;
+
+			if (wait && task->atoms[j]->type == SCHED_EVENT_SLEEP) {
+				wait->count  = 0;
+				wait->waiter = NULL;
+			}
+		}
+	}
+}
+
+static void wait_for_replay_workers(struct perf_sched *sched)
+{
+	u64 cpu_usage_0, cpu_usage_1, usage_0;
+	unsigned long i;
+	u32 pending;
+
+	reset_replay_waits(sched);
+
+	sched->start_time = get_nsecs();
+	usage_0 = replay_workers__cpu_usage(sched);
+	cpu_usage_0 = get_cpu_usage_nsec_parent();
+
+	__atomic_store_n(&sched->replay_pending, sched->nr_tasks, __ATOMIC_SEQ_CST);
+	for (i = 0; i < sched->nr_tasks; i++)
+		replay_worker__queue(sched->tasks[i]->worker, sched->tasks[i]);
+
+	while ((pending = __atomic_load_n(&sched->replay_pending, __ATOMIC_SEQ_CST)))
+		sys_futex(&sched->replay_pending, FUTEX_WAIT_PRIVATE, pending);
+
+	cpu_usage_1 = get_cpu_usage_nsec_parent();
+	sched->cpu_usage = replay_workers__cpu_usage(sched) - usage_0;
+	account_cpu_usage(sched, cpu_usage_0, cpu_usage_1);
+}
+
 static void run_one_test(struct perf_sched *sched)
 {
 	u64 T0, T1, delta, avg_delta, fluct;
 
 	T0 = get_nsecs();
-	wait_for_tasks(sched);
+	if (sched->replay_multiplex)
+		wait_for_replay_workers(sched);
+	else
+		wait_for_tasks(sched);
 	T1 = get_nsecs();
 
 	delta = T1 - T0;
@@ -836,10 +1125,10 @@ static int replay_switch_event(struct perf_sched *sched,
 	if (verbose > 0)
 		printf("sched_switch event %p\n", evsel);
 
-	if (cpu >= MAX_CPUS || cpu < 0)
+	if (cpu >= sched->nr_cpus || cpu < 0)
 		return 0;
 
-	timestamp0 = sched->cpu_last_switched[cpu];
+	timestamp0 = sched->cpus[cpu].last_switched;
 	if (timestamp0)
 		delta = timestamp - timestamp0;
 	else
@@ -856,7 +1145,7 @@ static int replay_switch_event(struct perf_sched *sched,
 	prev = register_pid(sched, prev_pid, prev_comm);
 	next = register_pid(sched, next_pid, next_comm);
 
-	sched->cpu_last_switched[cpu] = timestamp;
+	sched->cpus[cpu].last_switched = timestamp;
 
 	add_sched_event_run(sched, prev, timestamp, delta);
 	add_sched_event_sleep(sched, prev, timestamp, prev_state);
@@ -1024,6 +1313,16 @@ static char sched_out_state(u64 prev_state)
 	return str[prev_state];
 }
 
+static void work_atoms__free_list(struct work_atoms *atoms)
+{
+	struct work_atom *atom, *tmp;
+
+	list_for_each_entry_safe(atom, tmp, &atoms->work_list, list) {
+		list_del(&atom->list);
+		free(atom);
+	}
+}
+
 static int
 add_sched_out_event(struct work_atoms *atoms,
 		    char run_state,
@@ -1035,6 +1334,13 @@ add_sched_out_event(struct work_atoms *atoms,
 		return -1;
 	}
 
+	/*
+	 * Only the last atom is ever looked at, the previous ones were
+	 * accrued in atoms already, free them so that the memory used
+	 * depends on the number of threads, not on the number of events.
+	 */
+	work_atoms__free_list(atoms);
+
 	atom->sched_out_time = timestamp;
 
 	if (run_state == 'R') {
@@ -1105,10 +1411,10 @@ static int latency_switch_event(struct perf_sched *sched,
 	int cpu = sample->cpu, err = -1;
 	s64 delta;
 
-	BUG_ON(cpu >= MAX_CPUS || cpu < 0);
+	BUG_ON(cpu >= sched->nr_cpus || cpu < 0);
 
-	timestamp0 = sched->cpu_last_switched[cpu];
-	sched->cpu_last_switched[cpu] = timestamp;
+	timestamp0 = sched->cpus[cpu].last_switched;
+	sched->cpus[cpu].last_switched = timestamp;
 	if (timestamp0)
 		delta = timestamp - timestamp0;
 	else
@@ -1176,7 +1482,7 @@ static int latency_runtime_event(struct perf_sched *sched,
 	if (thread == NULL)
 		return -1;
 
-	BUG_ON(cpu >= MAX_CPUS || cpu < 0);
+	BUG_ON(cpu >= sched->nr_cpus || cpu < 0);
 	if (!atoms) {
 		if (thread_atoms_insert(sched, thread))
 			goto out_put;
@@ -1528,13 +1834,13 @@ static int map_switch_event(struct perf_sched *sched, struct perf_evsel *evsel,
 	const char *color = PERF_COLOR_NORMAL;
 	char stimestamp[32];
 
-	BUG_ON(this_cpu >= MAX_CPUS || this_cpu < 0);
+	BUG_ON(this_cpu >= sched->nr_cpus || this_cpu < 0);
 
 	if (this_cpu > sched->max_cpu)
 		sched->max_cpu = this_cpu;
 
 	if (sched->map.comp) {
-		cpus_nr = bitmap_weight(sched->map.comp_cpus_mask, MAX_CPUS);
+		cpus_nr = bitmap_weight(sched->map.comp_cpus_mask, sched->nr_cpus);
 		if (!test_and_set_bit(this_cpu, sched->map.comp_cpus_mask)) {
 			sched->map.comp_cpus[cpus_nr++] = this_cpu;
 			new_cpu = true;
@@ -1542,8 +1848,8 @@ static int map_switch_event(struct perf_sched *sched, struct perf_evsel *evsel,
 	} else
 		cpus_nr = sched->max_cpu;
 
-	timestamp0 = sched->cpu_last_switched[this_cpu];
-	sched->cpu_last_switched[this_cpu] = timestamp;
+	timestamp0 = sched->cpus[this_cpu].last_switched;
+	sched->cpus[this_cpu].last_switched = timestamp;
 	if (timestamp0)
 		delta = timestamp - timestamp0;
 	else
@@ -1564,7 +1870,8 @@ static int map_switch_event(struct perf_sched *sched, struct perf_evsel *evsel,
 		return -1;
 	}
 
-	sched->curr_thread[this_cpu] = thread__get(sched_in);
+	thread__put(sched->cpus[this_cpu].curr_thread);
+	sched->cpus[this_cpu].curr_thread = thread__get(sched_in);
 
 	printf("  ");
 
@@ -1596,7 +1903,7 @@ static int map_switch_event(struct perf_sched *sched, struct perf_evsel *evsel,
 
 	for (i = 0; i < cpus_nr; i++) {
 		int cpu = sched->map.comp ? sched->map.comp_cpus[i] : i;
-		struct thread *curr_thread = sched->curr_thread[cpu];
+		struct thread *curr_thread = sched->cpus[cpu].curr_thread;
 		struct thread_runtime *curr_tr;
 		const char *pid_color = color;
 		const char *cpu_color = color;
@@ -1615,8 +1922,8 @@ static int map_switch_event(struct perf_sched *sched, struct perf_evsel *evsel,
 		else
 			color_fprintf(stdout, cpu_color, "*");
 
-		if (sched->curr_thread[cpu]) {
-			curr_tr = thread__get_runtime(sched->curr_thread[cpu]);
+		if (curr_thread) {
+			curr_tr = thread__get_runtime(curr_thread);
 			if (curr_tr == NULL) {
 				thread__put(sched_in);
 				return -1;
@@ -1663,19 +1970,25 @@ static int process_sched_switch_event(struct perf_tool *tool,
 	u32 prev_pid = perf_evsel__intval(evsel, sample, "prev_pid"),
 	    next_pid = perf_evsel__intval(evsel, sample, "next_pid");
 
-	if (sched->curr_pid[this_cpu] != (u32)-1) {
+	if (this_cpu >= sched->nr_cpus || this_cpu < 0) {
+		pr_err("sched_switch event on cpu %d, the header has %d\n",
+		       this_cpu, sched->nr_cpus);
+		return -1;
+	}
+
+	if (sched->cpus[this_cpu].curr_pid != (u32)-1) {
 		/*
 		 * Are we trying to switch away a PID that is
 		 * not current?
 		 */
-		if (sched->curr_pid[this_cpu] != prev_pid)
+		if (sched->cpus[this_cpu].curr_pid != prev_pid)
 			sched->nr_context_switch_bugs++;
 	}
 
 	if (sched->tp_handler->switch_event)
 		err = sched->tp_handler->switch_event(sched, evsel, sample, machine);
 
-	sched->curr_pid[this_cpu] = next_pid;
+	sched->cpus[this_cpu].curr_pid = next_pid;
 	return err;
 }
 
@@ -1774,6 +2087,55 @@ static int perf_sched__process_comm(struct perf_tool *tool __maybe_unused,
 	return 0;
 }
 
+/*
+ * Size the per cpu state from HEADER_NRCPUS, or from this machine if the
+ * file doesn't have it, covering the cpus 'perf sched map' shows too.
+ */
+static int perf_sched__alloc_cpus(struct perf_sched *sched,
+				  struct perf_env *env)
+{
+	int i, nr_cpus = perf_env__nr_cpus_avail(env);
+
+	if (nr_cpus <= 0)
+		nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (nr_cpus < sched->max_cpu + 1)
+		nr_cpus = sched->max_cpu + 1;
+
+	if (posix_memalign((void **)&sched->cpus, sizeof(*sched->cpus),
+			   nr_cpus * sizeof(*sched->cpus))) {
+		sched->cpus = NULL;
+		return -ENOMEM;
+	}
+
+	memset(sched->cpus, 0, nr_cpus * sizeof(*sched->cpus));
+	for (i = 0; i < nr_cpus; i++)
+		sched->cpus[i].curr_pid = -1;
+
+	if (sched->map.comp) {
+		sched->map.comp_cpus = calloc(nr_cpus, sizeof(int));
+		sched->map.comp_cpus_mask = calloc(BITS_TO_LONGS(nr_cpus),
+						   sizeof(unsigned long));
+		if (!sched->map.comp_cpus || !sched->map.comp_cpus_mask)
+			return -ENOMEM;
+	}
+
+	sched->nr_cpus = nr_cpus;
+	return 0;
+}
+
+static void perf_sched__free_cpus(struct perf_sched *sched)
+{
+	int i;
+
+	for (i = 0; i < sched->nr_cpus; i++)
+		thread__zput(sched->cpus[i].curr_thread);
+
+	zfree(&sched->cpus);
+	zfree(&sched->map.comp_cpus);
+	zfree(&sched->map.comp_cpus_mask);
+	sched->nr_cpus = 0;
+}
+
 static int perf_sched__read_events(struct perf_sched *sched)
 {
 	const struct perf_evsel_str_handler handlers[] = {
@@ -1799,6 +2161,11 @@ static int perf_sched__read_events(struct perf_sched *sched)
 
 	symbol__init(&session->header.env);
 
+	if (perf_sched__alloc_cpus(sched, &session->header.env)) {
+		pr_err("No memory for the per cpu state\n");
+		goto out_delete;
+	}
+
 	if (perf_session__set_tracepoints_handlers(session, handlers))
 		goto out_delete;
 
@@ -1816,6 +2183,7 @@ static int perf_sched__read_events(struct perf_sched *sched)
 
 	rc = 0;
 out_delete:
+	perf_sched__free_cpus(sched);
 	perf_session__delete(session);
 	return rc;
 }
@@ -3153,6 +3521,7 @@ static int perf_sched__lat(struct perf_sched *sched)
 		output_lat_thread(sched, work_list);
 		next = rb_next(next);
 		thread__zput(work_list->thread);
+		work_atoms__free_list(work_list);
 	}
 
 	printf(" -----------------------------------------------------------------------------------------------------------------\n");
@@ -3173,12 +3542,6 @@ static int setup_map_cpus(struct perf_sched *sched)
 
 	sched->max_cpu  = sysconf(_SC_NPROCESSORS_CONF);
 
-	if (sched->map.comp) {
-		sched->map.comp_cpus = zalloc(sched->max_cpu * sizeof(int));
-		if (!sched->map.comp_cpus)
-			return -1;
-	}
-
 	if (!sched->map.cpus_str)
 		return 0;
 
@@ -3271,7 +3634,10 @@ static int perf_sched__replay(struct perf_sched *sched)
 	print_task_traces(sched);
 	add_cross_task_wakeups(sched);
 
-	create_tasks(sched);
+	if (sched->replay_multiplex)
+		create_replay_workers(sched);
+	else
+		create_tasks(sched);
 	printf("------------------------------------------------------------\n");
 	for (i = 0; i < sched->replay_repeat; i++)
 		run_one_test(sched);
@@ -3382,6 +3748,8 @@ int cmd_sched(int argc, const char **argv)
 	const struct option replay_options[] = {
 	OPT_UINTEGER('r', "repeat", &sched.replay_repeat,
 		     "repeat the workload replay N times (-1: infinite)"),
+	OPT_BOOLEAN(0, "multiplex", &sched.replay_multiplex,
+		    "replay the tasks on a worker thread pinned to each cpu"),
 	OPT_PARENT(sched_options)
 	};
 	const struct option map_options[] = {
@@ -3462,10 +3830,6 @@ int cmd_sched(int argc, const char **argv)
 		.switch_event	    = replay_switch_event,
 		.fork_event	    = replay_fork_event,
 	};
-	unsigned int i;
-
-	for (i = 0; i < ARRAY_SIZE(sched.curr_pid); i++)
-		sched.curr_pid[i] = -1;
 
 	argc = parse_options_subcommand(argc, argv, sched_options, sched_subcommands,
 					sched_usage, PARSE_OPT_STOP_AT_NON_OPTION);
@@ -28,6 +28,7 @@
 #include "util/thread-stack.h"
 #include "util/time-utils.h"
 #include "util/path.h"
+#include "util/strlist.h"
 #include "print_binary.h"
 #include "archinsn.h"
 #include <linux/bitmap.h>
@@ -38,13 +39,17 @@
 #include "asm/bug.h"
 #include "util/mem-events.h"
 #include "util/dump-insn.h"
+#include "util/mem-stats.h"
+#include "util/script-binary.h"
 #include <dirent.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <stdio_ext.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <subcmd/pager.h>
@@ -66,6 +71,7 @@ static const char		*cpu_list;
 static DECLARE_BITMAP(cpu_bitmap, MAX_NR_CPUS);
 static struct perf_stat_config	stat_config;
 static int			max_blocks;
+static unsigned int		nr_unwind_threads;
 static bool			native_arch;
 
 unsigned int scripting_max_stack = PERF_MAX_STACK_DEPTH;
@@ -254,6 +260,21 @@ static inline struct perf_evsel_script *evsel_script(struct perf_evsel *evsel)
 	return (struct perf_evsel_script *)evsel->priv;
 }
 
+/*
+ * The samples are printed a few bytes at a time, by a single thread, see
+ * perf_set_singlethreaded(): with a big buffer and no locking around each
+ * of those writes most of the stdio overhead goes away.
+ */
+#define SCRIPT_OUTPUT_BUF_SIZE	(1 << 20)
+
+static void perf_script__setup_output(FILE *fp)
+{
+	/* a terminal still wants a line at a time */
+	if (!isatty(fileno(fp)))
+		setvbuf(fp, NULL, _IOFBF, SCRIPT_OUTPUT_BUF_SIZE);
+	__fsetlocking(fp, FSETLOCKING_BYCALLER);
+}
+
 static struct perf_evsel_script *perf_evsel_script__new(struct perf_evsel *evsel,
 							struct perf_data *data)
 {
@@ -265,6 +286,7 @@ static struct perf_evsel_script *perf_evsel_script__new(struct perf_evsel *evsel
 		es->fp = fopen(es->filename, "w");
 		if (es->fp == NULL)
 			goto out_free_filename;
+		perf_script__setup_output(es->fp);
 	}
 
 	return es;
@@ -287,6 +309,7 @@ static int perf_evsel_script__fprintf(struct perf_evsel_script *es, FILE *fp)
 {
 	struct stat st;
 
+	fflush(es->fp);
 	fstat(fileno(es->fp), &st);
 	return fprintf(fp, "[ perf script: Wrote %.3f MB %s (%" PRIu64 " samples) ]\n",
 		       st.st_size / 1024.0 / 1024.0, es->filename, es->samples);
@@ -1608,6 +1631,12 @@ struct perf_script {
 	bool			show_round_events;
 	bool			allocated;
 	bool			per_event_dump;
+	bool			binary;
+	/* the samples in the format of util/script-binary.h */
+	struct script_binary	*sb;
+	unsigned int		nr_jobs;
+	/* set in the processes of --jobs */
+	struct script_job	*job;
 	struct cpu_map		*cpus;
 	struct thread_map	*threads;
 	int			name_width;
@@ -1615,6 +1644,9 @@ struct perf_script {
 	struct perf_time_interval *ptime_range;
 	int			range_size;
 	int			range_num;
+	/* of the tracepoints, see perf_script__filtered() */
+	struct strlist		*filter_strs;
+	struct tep_event_filter	*filter;
 };
 
 static int perf_evlist__max_name_len(struct perf_evlist *evlist)
@@ -1873,6 +1905,27 @@ static void process_event(struct perf_script *script,
 		fflush(fp);
 }
 
+static int process_event_binary(struct perf_script *script,
+				struct perf_sample *sample, struct perf_evsel *evsel,
+				struct addr_location *al)
+{
+	struct callchain_cursor *cursor = NULL;
+	int err;
+
+	if (!show_event(sample, evsel, al->thread, al))
+		return 0;
+
+	if (symbol_conf.use_callchain && sample->callchain &&
+	    thread__resolve_callchain(al->thread, &callchain_cursor, evsel,
+				      sample, NULL, NULL, scripting_max_stack) == 0)
+		cursor = &callchain_cursor;
+
+	err = script_binary__write_sample(script->sb, evsel, sample, al, cursor);
+	if (err)
+		pr_err("Failed to write the sample: %s\n", strerror(-err));
+	return err;
+}
+
 static struct scripting_ops	*scripting_ops;
 
 static void __process_stat(struct perf_evsel *counter, u64 tstamp)
@@ -1948,6 +2001,143 @@ static bool filter_cpu(struct perf_sample *sample)
 	return false;
 }
 
+/*
+ * --jobs: each job is a process going through all the events, so that its
+ * threads and maps are the same as everywhere else, but that only
+ * resolves and prints the samples of its blocks, the blocks of
+ * SCRIPT_JOB_BLOCK samples going round robin to the jobs. What the other
+ * events print goes with the block of the sample before them.
+ *
+ * A job prints to a file of its own and, at the end of each of its blocks,
+ * sends that text to the parent as a u64 size and the bytes, the parent
+ * printing them in the order of the blocks.
+ */
+#define SCRIPT_JOB_BLOCK	4096
+
+struct script_job {
+	unsigned int	idx;
+	unsigned int	nr;
+	int		fd;		/* to the parent */
+	u64		nr_samples;
+	u64		block;		/* of what is being printed */
+};
+
+static int script_job__end_block(struct script_job *job)
+{
+	char buf[64 * 1024];
+	off_t off, len;
+	u64 size;
+
+	if (fflush(stdout))
+		return -errno;
+
+	len = ftello(stdout);
+	if (len < 0)
+		return -errno;
+
+	if (job->block % job->nr == job->idx) {
+		size = len;
+		if (writen(job->fd, &size, sizeof(size)) < 0)
+			return -errno;
+
+		for (off = 0; off < len; ) {
+			ssize_t n = pread(STDOUT_FILENO, buf,
+					  min_t(off_t, len - off, sizeof(buf)), off);
+
+			if (n <= 0)
+				return n ? -errno : -EIO;
+			if (writen(job->fd, buf, n) < 0)
+				return -errno;
+			off += n;
+		}
+	}
+
+	/* the next block overwrites this one, len is all that counts */
+	if (fseeko(stdout, 0, SEEK_SET))
+		return -errno;
+	return 0;
+}
+
+/* Whether this job prints the sample */
+static bool script_job__sample(struct script_job *job)
+{
+	u64 block = job->nr_samples++ / SCRIPT_JOB_BLOCK;
+
+	if (block != job->block) {
+		/* the parent is gone */
+		if (script_job__end_block(job))
+			session_done = 1;
+		job->block = block;
+	}
+
+	return block % job->nr == job->idx;
+}
+
+/* The --filter and perf_script_filter strings */
+static int perf_script__add_filter(struct perf_script *scr, const char *str)
+{
+	int err;
+
+	if (scr->filter_strs == NULL) {
+		scr->filter_strs = strlist__new(NULL, NULL);
+		if (scr->filter_strs == NULL)
+			return -ENOMEM;
+	}
+
+	err = strlist__add(scr->filter_strs, str);
+	return err == -EEXIST ? 0 : err;
+}
+
+static int perf_script__compile_filter(struct perf_script *scr,
+				       struct tep_handle *pevent)
+{
+	struct str_node *pos;
+
+	scr->filter = tep_filter_alloc(pevent);
+	if (scr->filter == NULL)
+		return -ENOMEM;
+
+	strlist__for_each_entry(pos, scr->filter_strs) {
+		enum tep_errno err = tep_filter_add_filter_str(scr->filter, pos->s);
+
+		if (err < 0) {
+			char buf[BUFSIZ];
+
+			tep_filter_strerror(scr->filter, err, buf, sizeof(buf));
+			pr_err("Invalid filter '%s': %s\n", pos->s, buf);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The tracepoint samples the filter rejects are dropped before they are
+ * resolved or their fields get to a script.  It is compiled for the first
+ * one, when the formats are known in pipe mode too.
+ */
+static int perf_script__filtered(struct perf_script *scr,
+				 struct perf_evsel *evsel,
+				 struct perf_sample *sample)
+{
+	struct tep_record record = {
+		.ts   = sample->time,
+		.cpu  = sample->cpu,
+		.data = sample->raw_data,
+		.size = sample->raw_size,
+	};
+
+	if (scr->filter_strs == NULL || evsel->tp_format == NULL)
+		return 0;
+
+	if (scr->filter == NULL &&
+	    perf_script__compile_filter(scr, evsel->tp_format->pevent))
+		return -1;
+
+	return tep_filter_match(scr->filter, &record) == TEP_ERRNO__FILTER_MISS;
+}
+
 static int process_sample_event(struct perf_tool *tool,
 				union perf_event *event,
 				struct perf_sample *sample,
@@ -1956,6 +2146,10 @@ static int process_sample_event(struct perf_tool *tool,
 {
 	struct perf_script *scr = container_of(tool, struct perf_script, tool);
 	struct addr_location al;
+	int ret = 0;
+
+	if (scr->job && !script_job__sample(scr->job))
+		return 0;
 
 	if (perf_time__ranges_skip_sample(scr->ptime_range, scr->range_num,
 					  sample->time)) {
@@ -1973,6 +2167,10 @@ static int process_sample_event(struct perf_tool *tool,
 		return 0;
 	}
 
+	ret = perf_script__filtered(scr, evsel, sample);
+	if (ret)
+		return ret < 0 ? ret : 0;
+
 	if (machine__resolve(machine, &al, sample) < 0) {
 		pr_err("problem processing %d event, skipping it.\n",
 		       event->header.type);
@@ -1987,12 +2185,14 @@ static int process_sample_event(struct perf_tool *tool,
 
 	if (scripting_ops)
 		scripting_ops->process_event(event, sample, evsel, &al);
+	else if (scr->sb)
+		ret = process_event_binary(scr, sample, evsel, &al);
 	else
 		process_event(scr, sample, evsel, &al, machine);
 
 out_put:
 	addr_location__put(&al);
-	return 0;
+	return ret;
 }
 
 static int process_attr(struct perf_tool *tool, union perf_event *event,
@@ -2426,6 +2626,14 @@ static int __cmd_script(struct perf_script *script)
 		return -1;
 	}
 
+	if (symbol_conf.use_callchain) {
+		ret = perf_session__unwind_threads(script->session,
+						   nr_unwind_threads,
+						   scripting_max_stack);
+		if (ret)
+			return ret;
+	}
+
 	ret = perf_session__process_events(script->session);
 
 	if (script->per_event_dump)
@@ -2437,6 +2645,134 @@ static int __cmd_script(struct perf_script *script)
 	return ret;
 }
 
+static int perf_script__run_job(struct perf_script *script, unsigned int idx, int fd)
+{
+	struct script_job job = {
+		.idx = idx,
+		.nr  = script->nr_jobs,
+		.fd  = fd,
+	};
+	FILE *tmp = tmpfile();
+	int err;
+
+	if (tmp == NULL)
+		return -errno;
+
+	err = dup2(fileno(tmp), STDOUT_FILENO) < 0 ? -errno : 0;
+	fclose(tmp);
+	if (err)
+		return err;
+
+	/* the other jobs would only repeat what the first one says */
+	if (idx)
+		verbose = -1;
+
+	script->job = &job;
+	err = __cmd_script(script);
+	if (!err)
+		err = script_job__end_block(&job);
+	return err;
+}
+
+static int perf_script__merge_jobs(int *fds, unsigned int nr)
+{
+	char buf[64 * 1024];
+	u64 block, size;
+
+	for (block = 0; ; block++) {
+		int fd = fds[block % nr];
+		ssize_t n = readn(fd, &size, sizeof(size));
+
+		/* the job with the block after the last one is done */
+		if (n == 0)
+			return 0;
+		if (n < 0)
+			return -errno;
+
+		while (size) {
+			n = readn(fd, buf, min_t(u64, size, sizeof(buf)));
+			if (n <= 0)
+				return n ? -errno : -EIO;
+			if (fwrite(buf, n, 1, stdout) != 1)
+				return -EIO;
+			size -= n;
+		}
+	}
+}
+
+static int perf_script__run_jobs(struct perf_script *script)
+{
+	unsigned int i, nr = script->nr_jobs;
+	pid_t *pids = calloc(nr, sizeof(*pids));
+	int *fds = calloc(nr, sizeof(*fds));
+	int err = 0;
+
+	if (pids == NULL || fds == NULL) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	/* or the jobs would print it again */
+	fflush(stdout);
+
+	for (i = 0; i < nr; i++) {
+		int pipefd[2];
+
+		if (pipe(pipefd)) {
+			err = -errno;
+			break;
+		}
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err = -errno;
+			close(pipefd[0]);
+			close(pipefd[1]);
+			break;
+		}
+
+		if (pids[i] == 0) {
+			unsigned int j;
+
+			close(pipefd[0]);
+			for (j = 0; j < i; j++)
+				close(fds[j]);
+
+			/* no atexit handlers, those are the parent's */
+			_exit(perf_script__run_job(script, i, pipefd[1]) ? 1 : 0);
+		}
+
+		close(pipefd[1]);
+		fds[i] = pipefd[0];
+	}
+
+	/* the jobs stop on ^C, sending what they have */
+	signal(SIGINT, SIG_IGN);
+
+	if (!err)
+		err = perf_script__merge_jobs(fds, nr);
+
+	/* a job still writing gets a SIGPIPE */
+	nr = i;
+	for (i = 0; i < nr; i++)
+		close(fds[i]);
+
+	for (i = 0; i < nr; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			if (!err)
+				err = -1;
+		}
+	}
+
+out_free:
+	free(fds);
+	free(pids);
+	return err;
+}
+
 struct script_spec {
 	struct list_head	node;
 	struct scripting_ops	*ops;
@@ -3282,6 +3618,12 @@ static int parse_insn_trace(const struct option *opt __maybe_unused,
 	return 0;
 }
 
+static int parse_filter(const struct option *opt, const char *str,
+			int unset __maybe_unused)
+{
+	return perf_script__add_filter(opt->value, str);
+}
+
 static int parse_xed(const struct option *opt __maybe_unused,
 		     const char *str __maybe_unused,
 		     int unset __maybe_unused)
@@ -3326,6 +3668,7 @@ int cmd_script(int argc, const char **argv)
 	struct utsname uts;
 	char *script_path = NULL;
 	const char **__argv;
+	const char *filter;
 	int i, j, err = 0;
 	struct perf_script script = {
 		.tool = {
@@ -3421,6 +3764,9 @@ int cmd_script(int argc, const char **argv)
 		     "Set the maximum stack depth when parsing the callchain, "
 		     "anything beyond the specified depth will be ignored. "
 		     "Default: kernel.perf_event_max_stack or " __stringify(PERF_MAX_STACK_DEPTH)),
+	OPT_UINTEGER(0, "unwind-threads", &nr_unwind_threads,
+		     "Number of threads unwinding the user stacks of samples"
+		     " for --call-graph=dwarf"),
 	OPT_BOOLEAN(0, "reltime", &reltime, "Show time stamps relative to start"),
 	OPT_BOOLEAN('I', "show-info", &show_full_info,
 		    "display extended information from perf.data file"),
@@ -3440,6 +3786,10 @@ int cmd_script(int argc, const char **argv)
 		    "Show round events (if recorded)"),
 	OPT_BOOLEAN('\0', "per-event-dump", &script.per_event_dump,
 		    "Dump trace output to files named by the monitored events"),
+	OPT_BOOLEAN(0, "binary", &script.binary,
+		    "Write the samples in a compact binary format instead of text"),
+	OPT_UINTEGER('j', "jobs", &script.nr_jobs,
+		     "Resolve and print the samples in that many processes"),
 	OPT_BOOLEAN('f', "force", &symbol_conf.force, "don't complain, do it"),
 	OPT_INTEGER(0, "max-blocks", &max_blocks,
 		    "Maximum number of code blocks to dump with brstackinsn"),
@@ -3456,8 +3806,16 @@ int cmd_script(int argc, const char **argv)
 			"Enable kernel symbol demangling"),
 	OPT_STRING(0, "time", &script.time_str, "str",
 		   "Time span of interest (start,stop)"),
+	OPT_CALLBACK(0, "filter", &script, "event: condition",
+		     "Only the tracepoint events matching the condition, "
+		     "like 'sched/sched_switch: prev_pid != 0'", parse_filter),
 	OPT_BOOLEAN(0, "inline", &symbol_conf.inline_name,
 		    "Show inline function"),
+	OPT_BOOLEAN(0, "mem-stats", &mem_stats__enabled,
+		    "Show the memory used by threads, maps, symbols, etc on stderr"),
+	OPT_CALLBACK(0, "max-memory", NULL, "size",
+		     "Flush the queued events early to stay under that much"
+		     " memory (B/K/M/G)", mem_stats__parse_max),
 	OPT_END()
 	};
 	const char * const script_subcommands[] = { "record", "report", NULL };
@@ -3501,6 +3859,41 @@ int cmd_script(int argc, const char **argv)
 		return -1;
 	}
 
+	if (script.binary) {
+		if (argc || script_name || generate_script_lang || script.per_event_dump ||
+		    header || header_only || script.show_task_events ||
+		    script.show_mmap_events || script.show_switch_events ||
+		    script.show_namespace_events || script.show_lost_events ||
+		    script.show_round_events) {
+			fprintf(stderr, "--binary only has the samples, it can't be used with scripts,\n"
+					"--per-event-dump, --header or the --show-*-events options\n");
+			return -1;
+		}
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "Not writing --binary to a terminal, redirect it\n");
+			return -1;
+		}
+	}
+
+	if (script.nr_jobs > 1) {
+		int i;
+
+		if (argc || script_name || generate_script_lang || script.binary ||
+		    script.per_event_dump || debug_mode || reltime) {
+			fprintf(stderr, "--jobs is for the text output of a perf.data file, it can't be\n"
+					"used with scripts, --binary, --per-event-dump, -D or --reltime\n");
+			return -1;
+		}
+
+		/* the metrics add up the values of the samples before */
+		for (i = 0; i < OUTPUT_TYPE_MAX; i++) {
+			if (output[i].fields & PERF_OUTPUT_METRIC) {
+				fprintf(stderr, "--jobs can't print -F metric\n");
+				return -1;
+			}
+		}
+	}
+
 	if (itrace_synth_opts.callchain &&
 	    itrace_synth_opts.callchain_sz > scripting_max_stack)
 		scripting_max_stack = itrace_synth_opts.callchain_sz;
@@ -3650,12 +4043,18 @@ int cmd_script(int argc, const char **argv)
 	if (!script_name) {
 		setup_pager();
 		use_browser = 0;
+		perf_script__setup_output(stdout);
 	}
 
 	session = perf_session__new(&data, false, &script.tool);
 	if (session == NULL)
 		return -1;
 
+	if (mem_stats__max_bytes) {
+		ordered_events__set_alloc_size(&session->ordered_events,
+					       mem_stats__max_bytes / 4);
+	}
+
 	if (header || header_only) {
 		script.tool.show_feat_hdr = SHOW_FEAT_HEADER;
 		perf_session__fprintf_info(session, stdout, show_full_info);
@@ -3751,6 +4150,13 @@ int cmd_script(int argc, const char **argv)
 			goto out_delete;
 		pr_debug("perf script started with script %s\n\n", script_name);
 		script_started = true;
+
+		filter = scripting_ops->filter ? scripting_ops->filter() : NULL;
+		if (filter) {
+			err = perf_script__add_filter(&script, filter);
+			if (err)
+				goto out_delete;
+		}
 	}
 
 
@@ -3767,15 +4173,43 @@ int cmd_script(int argc, const char **argv)
 			goto out_delete;
 	}
 
-	err = __cmd_script(&script);
+	if (script.binary) {
+		script.sb = script_binary__new(stdout);
+		if (script.sb == NULL) {
+			err = -ENOMEM;
+			goto out_delete;
+		}
+	}
+
+	if (script.nr_jobs > 1 && perf_data__is_pipe(&data)) {
+		pr_err("--jobs needs to read the events more than once, not from a pipe\n");
+		err = -EINVAL;
+		goto out_delete;
+	}
+
+	if (script.nr_jobs > 1)
+		err = perf_script__run_jobs(&script);
+	else
+		err = __cmd_script(&script);
 
 	flush_scripting();
 
+	if (mem_stats__enabled)
+		mem_stats__fprintf(stderr);
+
 out_delete:
 	if (script.ptime_range)
 		zfree(&script.ptime_range);
 
+	if (script.filter)
+		tep_filter_free(script.filter);
+	strlist__delete(script.filter_strs);
+
+	script_binary__delete(script.sb);
+
 	perf_evlist__free_stats(session->evlist);
+	/* the exit releases the machines much faster */
+	session->skip_teardown = true;
 	perf_session__delete(session);
 
 	if (script_started)
@@ -43,6 +43,7 @@
 
 #include "perf.h"
 #include "builtin.h"
+#include "util/bpf-cgroup.h"
 #include "util/cgroup.h"
 #include "util/util.h"
 #include <subcmd/parse-options.h>
@@ -65,17 +66,22 @@
 #include "util/string2.h"
 #include "util/metricgroup.h"
 #include "util/top.h"
+#include "util/net-output.h"
 #include "asm/bug.h"
 
 #include <linux/time64.h>
 #include <api/fs/fs.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/prctl.h>
 #include <inttypes.h>
 #include <locale.h>
 #include <math.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -157,6 +163,11 @@ static bool			append_file;
 static bool			interval_count;
 static const char		*output_name;
 static int			output_fd;
+/* the BPF program counting the cgroups of -G, see bpf_cgroup__new() */
+static const char		*bpf_counters;
+static struct bpf_cgroup	*bpf_cgroup;
+/* --per-thread-refresh, the threads of -p looked up again every interval */
+static bool			thread_refresh;
 
 struct perf_stat {
 	bool			 record;
@@ -168,6 +179,9 @@ struct perf_stat {
 	struct cpu_map		*cpus;
 	struct thread_map	*threads;
 	enum aggr_mode		 aggr_mode;
+	/* perf stat record -o tcp://host:port or unix:path */
+	const char		*net_addr;
+	struct net_output	*net;
 };
 
 static struct perf_stat		perf_stat;
@@ -213,7 +227,12 @@ static int process_synthesized_event(struct perf_tool *tool __maybe_unused,
 				     struct perf_sample *sample __maybe_unused,
 				     struct machine *machine __maybe_unused)
 {
-	if (perf_data__write(&perf_stat.data, event, event->header.size) < 0) {
+	if (perf_stat.net) {
+		if (net_output__write(perf_stat.net, event, event->header.size) < 0) {
+			pr_err("failed to queue perf data for %s\n", perf_stat.net_addr);
+			return -1;
+		}
+	} else if (perf_data__write(&perf_stat.data, event, event->header.size) < 0) {
 		pr_err("failed to write perf data, error: %m\n");
 		return -1;
 	}
@@ -244,44 +263,82 @@ perf_evsel__write_stat_event(struct perf_evsel *counter, u32 cpu, u32 thread,
 					   process_synthesized_event, NULL);
 }
 
+static bool read_counter__nr(struct perf_evsel *counter, int *ncpus,
+			      int *nthreads)
+{
+	*nthreads = thread_map__nr(evsel_list->threads);
+
+	if (target__has_cpu(&target) && !target__has_per_thread(&target))
+		*ncpus = perf_evsel__nr_cpus(counter);
+	else
+		*ncpus = 1;
+
+	if (counter->system_wide)
+		*nthreads = 1;
+
+	return counter->supported;
+}
+
+/*
+ * Read the counts of a counter on a CPU for a block of the threads, the
+ * group leaders read those of their members too.
+ */
+static int read_counter_cpu(struct perf_evsel *counter, int cpu,
+			    int start, int end)
+{
+	int thread;
+
+	for (thread = start; thread < end; thread++) {
+		struct perf_counts_values *count;
+
+		count = perf_counts(counter->counts, cpu, thread);
+
+		/*
+		 * The leader's group read loads data into its group members
+		 * (via perf_evsel__read_counter) and sets threir count->loaded.
+		 */
+		if (!count->loaded &&
+		    perf_evsel__read_counter(counter, cpu, thread)) {
+			counter->counts->scaled = -1;
+			count->ena = 0;
+			count->run = 0;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Read out the results of a single counter:
  * do not aggregate counts across CPUs in system-wide mode
  */
 static int read_counter(struct perf_evsel *counter)
 {
-	int nthreads = thread_map__nr(evsel_list->threads);
-	int ncpus, cpu, thread;
-
-	if (target__has_cpu(&target) && !target__has_per_thread(&target))
-		ncpus = perf_evsel__nr_cpus(counter);
-	else
-		ncpus = 1;
+	int ncpus, nthreads, cpu;
 
-	if (!counter->supported)
+	if (!read_counter__nr(counter, &ncpus, &nthreads))
 		return -ENOENT;
 
-	if (counter->system_wide)
-		nthreads = 1;
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (read_counter_cpu(counter, cpu, 0, nthreads))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int process_counter_values(struct perf_evsel *counter)
+{
+	int ncpus, nthreads, cpu, thread;
+
+	read_counter__nr(counter, &ncpus, &nthreads);
 
 	for (thread = 0; thread < nthreads; thread++) {
 		for (cpu = 0; cpu < ncpus; cpu++) {
 			struct perf_counts_values *count;
 
 			count = perf_counts(counter->counts, cpu, thread);
-
-			/*
-			 * The leader's group read loads data into its group members
-			 * (via perf_evsel__read_counter) and sets threir count->loaded.
-			 */
-			if (!count->loaded &&
-			    perf_evsel__read_counter(counter, cpu, thread)) {
-				counter->counts->scaled = -1;
-				perf_counts(counter->counts, cpu, thread)->ena = 0;
-				perf_counts(counter->counts, cpu, thread)->run = 0;
-				return -1;
-			}
-
 			count->loaded = false;
 
 			if (STAT_RECORD) {
@@ -304,19 +361,413 @@ static int read_counter(struct perf_evsel *counter)
 	return 0;
 }
 
+struct read_counters_worker {
+	pthread_t	thread;
+	int		*errs;
+	int		start;
+	int		end;
+	bool		pin;
+	/* start and end are threads, read on all CPUs */
+	bool		per_thread;
+};
+
+/*
+ * Read all counters on a block of CPUs, running on them, so that most
+ * reads don't have to interrupt another CPU to get the counts, or on a
+ * block of the threads with --per-thread.
+ */
+static void *read_counters_worker(void *arg)
+{
+	struct read_counters_worker *worker = arg;
+	struct perf_evsel *counter;
+	int cpu;
+
+	if (worker->pin) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		for (cpu = worker->start; cpu < worker->end; cpu++)
+			CPU_SET(evsel_list->cpus->map[cpu], &cpus);
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	}
+
+	evlist__for_each_entry(evsel_list, counter) {
+		int ncpus, nthreads;
+
+		if (!read_counter__nr(counter, &ncpus, &nthreads))
+			continue;
+
+		if (worker->per_thread) {
+			for (cpu = 0; cpu < ncpus; cpu++) {
+				if (worker->errs[counter->idx])
+					break;
+				if (read_counter_cpu(counter, cpu, worker->start,
+						     min(worker->end, nthreads)))
+					worker->errs[counter->idx] = -1;
+			}
+			continue;
+		}
+
+		for (cpu = worker->start; cpu < worker->end && cpu < ncpus; cpu++) {
+			if (worker->errs[counter->idx])
+				break;
+			if (read_counter_cpu(counter, cpu, 0, nthreads))
+				worker->errs[counter->idx] = -1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Spread the reads of all counters over --read-threads threads, each
+ * reading the counts on a block of the CPUs, or of the threads counted
+ * with --per-thread, returns -1 if they are to be read one counter after
+ * the other.
+ */
+static int read_counters_threaded(int *errs)
+{
+	int nr = cpu_map__nr(evsel_list->cpus);
+	struct read_counters_worker *workers;
+	unsigned int i, nr_threads, started = 0;
+	bool per_thread = false;
+
+	if (stat_config.aggr_mode == AGGR_THREAD) {
+		nr = thread_map__nr(evsel_list->threads);
+		per_thread = true;
+	} else if (!target__has_cpu(&target) || target__has_per_thread(&target)) {
+		return -1;
+	}
+
+	nr_threads = stat_config.nr_read_threads;
+	if (nr_threads == UINT_MAX)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > (unsigned int)nr)
+		nr_threads = nr;
+	if (nr_threads < 2)
+		return -1;
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (workers == NULL)
+		return -1;
+
+	perf_set_multithreaded();
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].errs       = errs;
+		workers[i].start      = nr * i / nr_threads;
+		workers[i].end        = nr * (i + 1) / nr_threads;
+		workers[i].per_thread = per_thread;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		workers[i].pin = !per_thread;
+		if (pthread_create(&workers[i].thread, NULL,
+				   read_counters_worker, &workers[i])) {
+			workers[i].pin = false;
+			break;
+		}
+		started = i;
+	}
+
+	/* this thread reads the first block and the ones without a thread */
+	read_counters_worker(&workers[0]);
+	for (i = started + 1; i < nr_threads; i++)
+		read_counters_worker(&workers[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	perf_set_singlethreaded();
+	free(workers);
+	return 0;
+}
+
 static void read_counters(void)
 {
 	struct perf_evsel *counter;
-	int ret;
+	int *errs = NULL;
+	int ret, bpf_ret = 0;
+
+	if (bpf_cgroup)
+		bpf_ret = bpf_cgroup__read(bpf_cgroup, evsel_list);
+	else if (stat_config.nr_read_threads > 1)
+		errs = calloc(evsel_list->nr_entries, sizeof(*errs));
+	if (errs && read_counters_threaded(errs))
+		zfree(&errs);
 
 	evlist__for_each_entry(evsel_list, counter) {
-		ret = read_counter(counter);
+		if (bpf_cgroup)
+			ret = bpf_ret;
+		else if (errs)
+			ret = counter->supported ? errs[counter->idx] : -ENOENT;
+		else
+			ret = read_counter(counter);
+
+		if (ret == 0)
+			ret = process_counter_values(counter);
 		if (ret)
 			pr_debug("failed to read counter %s\n", counter->name);
 
+		/* nothing gets printed, the counts are for the other end */
+		if (STAT_RECORD && perf_stat.data.is_pipe)
+			continue;
+
 		if (ret == 0 && perf_stat_process_counter(&stat_config, counter))
 			pr_warning("failed to process counter %s\n", counter->name);
 	}
+
+	free(errs);
+}
+
+struct thread_refresh_tid {
+	pid_t	pid;
+	int	idx;
+};
+
+static int thread_refresh_tid__cmp(const void *a, const void *b)
+{
+	const struct thread_refresh_tid *ta = a, *tb = b;
+
+	return ta->pid < tb->pid ? -1 : ta->pid > tb->pid;
+}
+
+/*
+ * Open and enable the counters of a thread started since the last
+ * interval, at index thread of the fds, all of them or none.
+ */
+static int thread_refresh__open(struct xyarray **fds, pid_t pid, int thread)
+{
+	struct xyarray **saved = calloc(evsel_list->nr_entries, sizeof(*saved));
+	struct thread_map *threads = thread_map__new_by_tid(pid);
+	struct perf_evsel *counter;
+	int cpu, err = -ENOMEM;
+
+	if (saved == NULL || threads == NULL)
+		goto out;
+
+	/* the group leaders' fds are the ones of this thread while opening */
+	evlist__for_each_entry(evsel_list, counter) {
+		saved[counter->idx] = counter->fd;
+		counter->fd = NULL;
+	}
+
+	err = 0;
+	evlist__for_each_entry(evsel_list, counter) {
+		if (!counter->supported || saved[counter->idx] == NULL)
+			continue;
+		err = perf_evsel__open_per_thread(counter, threads);
+		if (err)
+			break;
+	}
+
+	evlist__for_each_entry(evsel_list, counter) {
+		if (counter->fd) {
+			if (!err && perf_evsel__is_group_leader(counter))
+				err = perf_evsel__enable(counter);
+
+			for (cpu = 0; cpu < xyarray__max_x(counter->fd); cpu++) {
+				*(int *)xyarray__entry(fds[counter->idx], cpu, thread) =
+					*(int *)xyarray__entry(counter->fd, cpu, 0);
+			}
+			xyarray__delete(counter->fd);
+		}
+		counter->fd = saved[counter->idx];
+	}
+
+	if (err) {
+		/* it exited already */
+		pr_debug("Not counting thread %d: %d\n", pid, err);
+		evlist__for_each_entry(evsel_list, counter) {
+			if (fds[counter->idx] == NULL)
+				continue;
+
+			for (cpu = 0; cpu < xyarray__max_x(fds[counter->idx]); cpu++) {
+				int *fd = xyarray__entry(fds[counter->idx], cpu, thread);
+
+				if (*fd >= 0)
+					close(*fd);
+				*fd = -1;
+			}
+		}
+	}
+out:
+	thread_map__put(threads);
+	free(saved);
+	return err;
+}
+
+/*
+ * Move the fds and counts of a thread still there to its index in the
+ * new map, the fds left in the old arrays are of the threads that exited.
+ */
+static void thread_refresh__move(struct perf_evsel *counter, struct xyarray *fds,
+				 struct perf_counts *counts,
+				 struct perf_counts *prev_raw_counts,
+				 int from, int to)
+{
+	int cpu;
+
+	for (cpu = 0; fds && cpu < xyarray__max_x(fds); cpu++) {
+		int *fd = xyarray__entry(counter->fd, cpu, from);
+
+		*(int *)xyarray__entry(fds, cpu, to) = *fd;
+		*fd = -1;
+	}
+
+	for (cpu = 0; cpu < xyarray__max_x(counts->values); cpu++) {
+		*perf_counts(counts, cpu, to) = *perf_counts(counter->counts, cpu, from);
+		if (prev_raw_counts) {
+			*perf_counts(prev_raw_counts, cpu, to) =
+				*perf_counts(counter->prev_raw_counts, cpu, from);
+		}
+	}
+}
+
+static void thread_refresh__replace(struct perf_evsel *counter, struct xyarray *fds,
+				    struct perf_counts *counts,
+				    struct perf_counts *prev_raw_counts)
+{
+	if (fds) {
+		perf_evsel__close_fd(counter);
+		xyarray__delete(counter->fd);
+		counter->fd = fds;
+	}
+
+	counts->scaled = counter->counts->scaled;
+	perf_counts__delete(counter->counts);
+	counter->counts = counts;
+
+	if (prev_raw_counts) {
+		perf_counts__delete(counter->prev_raw_counts);
+		counter->prev_raw_counts = prev_raw_counts;
+	}
+}
+
+/*
+ * --per-thread-refresh: the threads of the -p processes started since the
+ * last interval get their counters, the ones that exited lose theirs,
+ * after their last counts were shown. The counters aren't inherited then,
+ * the counts of a new thread would be in the thread that started it too.
+ */
+static void refresh_threads(void)
+{
+	struct thread_map *old = evsel_list->threads, *threads;
+	struct thread_refresh_tid *tids = NULL;
+	struct xyarray **fds = NULL;
+	struct perf_counts **counts = NULL, **prev_raw_counts = NULL;
+	struct perf_evsel *counter;
+	int *idx = NULL, i, nr, nr_kept = 0;
+
+	/* their one fd counts all the threads */
+	evlist__for_each_entry(evsel_list, counter) {
+		if (counter->system_wide)
+			return;
+	}
+
+	threads = thread_map__new_str(target.pid, target.tid, target.uid, false);
+	if (threads == NULL)
+		return;
+
+	tids = calloc(old->nr, sizeof(*tids));
+	idx = calloc(threads->nr, sizeof(*idx));
+	if (tids == NULL || idx == NULL)
+		goto out;
+
+	for (i = 0; i < old->nr; i++) {
+		tids[i].pid = thread_map__pid(old, i);
+		tids[i].idx = i;
+	}
+	qsort(tids, old->nr, sizeof(*tids), thread_refresh_tid__cmp);
+
+	for (i = 0; i < threads->nr; i++) {
+		struct thread_refresh_tid key = { .pid = thread_map__pid(threads, i), }, *tid;
+
+		tid = bsearch(&key, tids, old->nr, sizeof(*tids), thread_refresh_tid__cmp);
+		idx[i] = tid ? tid->idx : -1;
+		if (tid)
+			nr_kept++;
+	}
+
+	if (nr_kept == old->nr && nr_kept == threads->nr)
+		goto out;
+
+	fds = calloc(evsel_list->nr_entries, sizeof(*fds));
+	counts = calloc(evsel_list->nr_entries, sizeof(*counts));
+	prev_raw_counts = calloc(evsel_list->nr_entries, sizeof(*prev_raw_counts));
+	if (fds == NULL || counts == NULL || prev_raw_counts == NULL)
+		goto out_free;
+
+	evlist__for_each_entry(evsel_list, counter) {
+		int ncpus = xyarray__max_x(counter->counts->values), cpu, thread;
+
+		counts[counter->idx] = perf_counts__new(ncpus, threads->nr);
+		if (counts[counter->idx] == NULL)
+			goto out_free;
+
+		if (counter->prev_raw_counts) {
+			prev_raw_counts[counter->idx] = perf_counts__new(ncpus, threads->nr);
+			if (prev_raw_counts[counter->idx] == NULL)
+				goto out_free;
+		}
+
+		/* the ones that failed to open have none */
+		if (counter->fd == NULL)
+			continue;
+
+		ncpus = xyarray__max_x(counter->fd);
+		fds[counter->idx] = xyarray__new(ncpus, threads->nr, sizeof(int));
+		if (fds[counter->idx] == NULL)
+			goto out_free;
+
+		for (cpu = 0; cpu < ncpus; cpu++) {
+			for (thread = 0; thread < threads->nr; thread++)
+				*(int *)xyarray__entry(fds[counter->idx], cpu, thread) = -1;
+		}
+	}
+
+	/* the threads that exited before being opened are left out */
+	for (i = 0, nr = 0; i < threads->nr; i++) {
+		if (idx[i] >= 0) {
+			evlist__for_each_entry(evsel_list, counter) {
+				thread_refresh__move(counter, fds[counter->idx],
+						     counts[counter->idx],
+						     prev_raw_counts[counter->idx],
+						     idx[i], nr);
+			}
+		} else if (thread_refresh__open(fds, thread_map__pid(threads, i), nr)) {
+			continue;
+		}
+		threads->map[nr++] = threads->map[i];
+	}
+
+	/* all gone, the old ones are still read until the end */
+	if (nr == 0)
+		goto out_free;
+	threads->nr = nr;
+
+	evlist__for_each_entry(evsel_list, counter) {
+		thread_refresh__replace(counter, fds[counter->idx], counts[counter->idx],
+					prev_raw_counts[counter->idx]);
+	}
+
+	thread_map__read_comms(threads);
+	perf_evlist__set_maps(evsel_list, evsel_list->cpus, threads);
+	goto out;
+
+out_free:
+	evlist__for_each_entry(evsel_list, counter) {
+		xyarray__delete(fds ? fds[counter->idx] : NULL);
+		perf_counts__delete(counts ? counts[counter->idx] : NULL);
+		perf_counts__delete(prev_raw_counts ? prev_raw_counts[counter->idx] : NULL);
+	}
+out:
+	thread_map__put(threads);
+	free(prev_raw_counts);
+	free(counts);
+	free(fds);
+	free(idx);
+	free(tids);
 }
 
 static void process_interval(void)
@@ -331,11 +782,17 @@ static void process_interval(void)
 	if (STAT_RECORD) {
 		if (WRITE_STAT_ROUND_EVENT(rs.tv_sec * NSEC_PER_SEC + rs.tv_nsec, INTERVAL))
 			pr_err("failed to write stat round event\n");
+		/* a round at a time to the collector */
+		if (perf_stat.net)
+			net_output__flush(perf_stat.net);
 	}
 
 	init_stats(&walltime_nsecs_stats);
 	update_stats(&walltime_nsecs_stats, stat_config.interval * 1000000);
 	print_counters(&rs, 0, NULL);
+
+	if (thread_refresh)
+		refresh_threads();
 }
 
 static void enable_counters(void)
@@ -348,7 +805,9 @@ static void enable_counters(void)
 	 * - we don't have tracee (attaching to task or cpu)
 	 * - we have initial delay configured
 	 */
-	if (!target__none(&target) || stat_config.initial_delay)
+	if (bpf_cgroup)
+		bpf_cgroup__enable(bpf_cgroup);
+	else if (!target__none(&target) || stat_config.initial_delay)
 		perf_evlist__enable(evsel_list);
 }
 
@@ -359,7 +818,9 @@ static void disable_counters(void)
 	 * still be running. To get accurate group ratios, we must stop groups
 	 * from counting before reading their constituent counters.
 	 */
-	if (!target__none(&target))
+	if (bpf_cgroup)
+		bpf_cgroup__disable(bpf_cgroup);
+	else if (!target__none(&target))
 		perf_evlist__disable(evsel_list);
 }
 
@@ -403,6 +864,44 @@ static bool is_target_alive(struct target *_target,
 	return false;
 }
 
+/*
+ * Like 'perf record -o tcp://host:port': pipe mode, with what is written
+ * before the counters start, the header, attributes and maps, going to an
+ * unlinked file to be sent again at the start of every connection.
+ */
+static int stat_record__net_open(struct perf_data *data)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/perf-net-XXXXXX", getenv("TMPDIR") ?: "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		pr_err("Failed to create %s: %m\n", path);
+		return -errno;
+	}
+	unlink(path);
+
+	data->file.fd = fd;
+	return 0;
+}
+
+static int stat_record__net_start(void)
+{
+	int err;
+
+	/* the rounds are small, dropping the oldest ones past a few seconds of them */
+	perf_stat.net = net_output__new(perf_stat.net_addr, 16 << 20, false,
+					perf_evlist__id_hdr_size(evsel_list));
+	if (perf_stat.net == NULL)
+		return -ENOMEM;
+
+	err = net_output__start(perf_stat.net, perf_data__fd(&perf_stat.data));
+	if (err)
+		pr_err("Failed to start sending to %s: %s\n", perf_stat.net_addr, strerror(-err));
+	return err;
+}
+
 static int __run_perf_stat(int argc, const char **argv, int run_idx)
 {
 	int interval = stat_config.interval;
@@ -440,9 +939,17 @@ static int __run_perf_stat(int argc, const char **argv, int run_idx)
 	if (group)
 		perf_evlist__set_leader(evsel_list);
 
+	/* the events are counted by the counters it opens */
+	if (bpf_cgroup && bpf_cgroup__open(bpf_cgroup) < 0) {
+		if (child_pid != -1)
+			kill(child_pid, SIGTERM);
+		return -1;
+	}
+
 	evlist__for_each_entry(evsel_list, counter) {
 try_again:
-		if (create_perf_stat_counter(counter, &stat_config, &target) < 0) {
+		if (bpf_cgroup == NULL &&
+		    create_perf_stat_counter(counter, &stat_config, &target) < 0) {
 
 			/* Weak group failed. Reset the group. */
 			if ((errno == EINVAL || errno == EBADF) &&
@@ -529,6 +1036,12 @@ try_again:
 						  process_synthesized_event, is_pipe);
 		if (err < 0)
 			return err;
+
+		if (perf_stat.net_addr) {
+			err = stat_record__net_start();
+			if (err < 0)
+				return err;
+		}
 	}
 
 	/*
@@ -595,6 +1108,8 @@ try_again:
 	 */
 	read_counters();
 	perf_evlist__close(evsel_list);
+	if (bpf_cgroup)
+		bpf_cgroup__close(bpf_cgroup);
 
 	return WEXITSTATUS(status);
 }
@@ -744,6 +1259,9 @@ static struct option stat_options[] = {
 		   "print counts with custom separator"),
 	OPT_CALLBACK('G', "cgroup", &evsel_list, "name",
 		     "monitor event in cgroup name only", parse_cgroups),
+	OPT_STRING_OPTARG(0, "bpf-counters", &bpf_counters, "file",
+			  "count the events of the -G cgroups with BPF, on one counter per event and CPU",
+			  ""),
 	OPT_STRING('o', "output", &output_name, "file", "output file name"),
 	OPT_BOOLEAN(0, "append", &append_file, "append to the output file"),
 	OPT_INTEGER(0, "log-fd", &output_fd,
@@ -759,6 +1277,8 @@ static struct option stat_options[] = {
 		    "print counts for fixed number of times"),
 	OPT_BOOLEAN(0, "interval-clear", &stat_config.interval_clear,
 		    "clear screen in between new interval"),
+	OPT_UINTEGER(0, "read-threads", &stat_config.nr_read_threads,
+		     "number of threads reading the counters on their CPUs"),
 	OPT_UINTEGER(0, "timeout", &stat_config.timeout,
 		    "stop workload and print counts after a timeout period in ms (>= 10ms)"),
 	OPT_SET_UINT(0, "per-socket", &stat_config.aggr_mode,
@@ -767,6 +1287,10 @@ static struct option stat_options[] = {
 		     "aggregate counts per physical processor core", AGGR_CORE),
 	OPT_SET_UINT(0, "per-thread", &stat_config.aggr_mode,
 		     "aggregate counts per thread", AGGR_THREAD),
+	OPT_UINTEGER(0, "per-thread-top", &stat_config.thread_top,
+		     "show the n threads with the highest counts of each event"),
+	OPT_BOOLEAN(0, "per-thread-refresh", &thread_refresh,
+		    "count the threads of -p started while counting, each interval"),
 	OPT_UINTEGER('D', "delay", &stat_config.initial_delay,
 		     "ms to wait before starting measurement after program start"),
 	OPT_CALLBACK_NOOPT(0, "metric-only", &stat_config.metric_only, NULL,
@@ -781,16 +1305,29 @@ static struct option stat_options[] = {
 	OPT_END()
 };
 
+static int perf_env__build_socket_map(struct perf_env *env, struct cpu_map *cpus,
+				      struct cpu_map **sockp)
+{
+	return cpu_map__build_map(cpus, sockp, perf_env__get_socket, env);
+}
+
+static int perf_env__build_core_map(struct perf_env *env, struct cpu_map *cpus,
+				    struct cpu_map **corep)
+{
+	return cpu_map__build_map(cpus, corep, perf_env__get_core, env);
+}
+
+/* The topology is read from sysfs once, to perf_env, not per cpu and evsel */
 static int perf_stat__get_socket(struct perf_stat_config *config __maybe_unused,
 				 struct cpu_map *map, int cpu)
 {
-	return cpu_map__get_socket(map, cpu, NULL);
+	return perf_env__get_socket(map, cpu, &perf_env);
 }
 
 static int perf_stat__get_core(struct perf_stat_config *config __maybe_unused,
 			       struct cpu_map *map, int cpu)
 {
-	return cpu_map__get_core(map, cpu, NULL);
+	return perf_env__get_core(map, cpu, &perf_env);
 }
 
 static int cpu_map__get_max(struct cpu_map *map)
@@ -837,16 +1374,23 @@ static int perf_stat_init_aggr_mode(void)
 {
 	int nr;
 
+	if ((stat_config.aggr_mode == AGGR_SOCKET ||
+	     stat_config.aggr_mode == AGGR_CORE) &&
+	    perf_env__read_cpu_topology_map(&perf_env)) {
+		pr_err("cannot read the cpu topology\n");
+		return -1;
+	}
+
 	switch (stat_config.aggr_mode) {
 	case AGGR_SOCKET:
-		if (cpu_map__build_socket_map(evsel_list->cpus, &stat_config.aggr_map)) {
+		if (perf_env__build_socket_map(&perf_env, evsel_list->cpus, &stat_config.aggr_map)) {
 			perror("cannot build socket map");
 			return -1;
 		}
 		stat_config.aggr_get_id = perf_stat__get_socket_cached;
 		break;
 	case AGGR_CORE:
-		if (cpu_map__build_core_map(evsel_list->cpus, &stat_config.aggr_map)) {
+		if (perf_env__build_core_map(&perf_env, evsel_list->cpus, &stat_config.aggr_map)) {
 			perror("cannot build core map");
 			return -1;
 		}
@@ -867,7 +1411,10 @@ static int perf_stat_init_aggr_mode(void)
 	 */
 	nr = cpu_map__get_max(evsel_list->cpus);
 	stat_config.cpus_aggr_map = cpu_map__empty_new(nr + 1);
-	return stat_config.cpus_aggr_map ? 0 : -ENOMEM;
+	if (!stat_config.cpus_aggr_map)
+		return -ENOMEM;
+
+	return perf_stat__build_aggr_idx(&stat_config, evsel_list->cpus);
 }
 
 static void perf_stat__exit_aggr_mode(void)
@@ -876,61 +1423,7 @@ static void perf_stat__exit_aggr_mode(void)
 	cpu_map__put(stat_config.cpus_aggr_map);
 	stat_config.aggr_map = NULL;
 	stat_config.cpus_aggr_map = NULL;
-}
-
-static inline int perf_env__get_cpu(struct perf_env *env, struct cpu_map *map, int idx)
-{
-	int cpu;
-
-	if (idx > map->nr)
-		return -1;
-
-	cpu = map->map[idx];
-
-	if (cpu >= env->nr_cpus_avail)
-		return -1;
-
-	return cpu;
-}
-
-static int perf_env__get_socket(struct cpu_map *map, int idx, void *data)
-{
-	struct perf_env *env = data;
-	int cpu = perf_env__get_cpu(env, map, idx);
-
-	return cpu == -1 ? -1 : env->cpu[cpu].socket_id;
-}
-
-static int perf_env__get_core(struct cpu_map *map, int idx, void *data)
-{
-	struct perf_env *env = data;
-	int core = -1, cpu = perf_env__get_cpu(env, map, idx);
-
-	if (cpu != -1) {
-		int socket_id = env->cpu[cpu].socket_id;
-
-		/*
-		 * Encode socket in upper 16 bits
-		 * core_id is relative to socket, and
-		 * we need a global id. So we combine
-		 * socket + core id.
-		 */
-		core = (socket_id << 16) | (env->cpu[cpu].core_id & 0xffff);
-	}
-
-	return core;
-}
-
-static int perf_env__build_socket_map(struct perf_env *env, struct cpu_map *cpus,
-				      struct cpu_map **sockp)
-{
-	return cpu_map__build_map(cpus, sockp, perf_env__get_socket, env);
-}
-
-static int perf_env__build_core_map(struct perf_env *env, struct cpu_map *cpus,
-				    struct cpu_map **corep)
-{
-	return cpu_map__build_map(cpus, corep, perf_env__get_core, env);
+	zfree(&stat_config.aggr_idx);
 }
 
 static int perf_stat__get_socket_file(struct perf_stat_config *config __maybe_unused,
@@ -972,7 +1465,7 @@ static int perf_stat_init_aggr_mode_file(struct perf_stat *st)
 		break;
 	}
 
-	return 0;
+	return perf_stat__build_aggr_idx(&stat_config, evsel_list->cpus);
 }
 
 static int topdown_filter_events(const char **attr, char **str, bool use_group)
@@ -1313,6 +1806,8 @@ static void init_features(struct perf_session *session)
 	perf_header__clear_feat(&session->header, HEADER_TRACING_DATA);
 	perf_header__clear_feat(&session->header, HEADER_BRANCH_STACK);
 	perf_header__clear_feat(&session->header, HEADER_AUXTRACE);
+	perf_header__clear_feat(&session->header, HEADER_SORTED);
+	perf_header__clear_feat(&session->header, HEADER_RECORD_STATS);
 }
 
 static int __cmd_record(int argc, const char **argv)
@@ -1326,6 +1821,11 @@ static int __cmd_record(int argc, const char **argv)
 	if (output_name)
 		data->path = output_name;
 
+	if (net_output__is_addr(output_name)) {
+		perf_stat.net_addr = output_name;
+		data->path = "-";
+	}
+
 	if (stat_config.run_count != 1 || forever) {
 		pr_err("Cannot use -r option with perf stat record.\n");
 		return -1;
@@ -1337,6 +1837,11 @@ static int __cmd_record(int argc, const char **argv)
 		return -1;
 	}
 
+	if (perf_stat.net_addr && stat_record__net_open(data)) {
+		perf_session__delete(session);
+		return -1;
+	}
+
 	init_features(session);
 
 	session->evlist   = evsel_list;
@@ -1351,8 +1856,12 @@ static int process_stat_round_event(struct perf_session *session,
 	struct stat_round_event *stat_round = &event->stat_round;
 	struct perf_evsel *counter;
 	struct timespec tsh, *ts = NULL;
-	const char **argv = session->header.env.cmdline_argv;
-	int argc = session->header.env.nr_cmdline;
+	const char **argv;
+	int argc;
+
+	perf_env__read_feat(&session->header.env, HEADER_CMDLINE);
+	argv = session->header.env.cmdline_argv;
+	argc = session->header.env.nr_cmdline;
 
 	evlist__for_each_entry(evsel_list, counter)
 		perf_stat_process_counter(&stat_config, counter);
@@ -1367,6 +1876,10 @@ static int process_stat_round_event(struct perf_session *session,
 	}
 
 	print_counters(ts, argc, argv);
+
+	/* a round at a time, not mixed with those of the other hosts */
+	if (stat_config.host)
+		fflush(stat_config.output);
 	return 0;
 }
 
@@ -1500,9 +2013,98 @@ static struct perf_stat perf_stat = {
 	.aggr_mode = AGGR_UNSET,
 };
 
-static int __cmd_report(int argc, const char **argv)
+static int stat_report__session(void)
 {
 	struct perf_session *session;
+	int ret;
+
+	perf_stat.data.path = input_name;
+	perf_stat.data.mode = PERF_DATA_MODE_READ;
+
+	session = perf_session__new(&perf_stat.data, false, &perf_stat.tool);
+	if (session == NULL)
+		return -1;
+
+	perf_stat.session  = session;
+	evsel_list         = session->evlist;
+
+	ret = perf_session__process_events(session);
+	if (ret)
+		return ret;
+
+	perf_session__delete(session);
+	return 0;
+}
+
+/* The stream of a host, in a process of its own */
+static int stat_report__connection(int sock, struct sockaddr *addr, socklen_t len)
+{
+	char host[NI_MAXHOST] = "local";
+	int ret;
+
+	if (addr->sa_family != AF_UNIX)
+		getnameinfo(addr, len, host, sizeof(host), NULL, 0, 0);
+
+	if (dup2(sock, STDIN_FILENO) < 0)
+		return -errno;
+	close(sock);
+
+	input_name	   = "-";
+	stat_config.host   = host;
+	stat_config.output = stdout;
+	setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+
+	ret = stat_report__session();
+	fflush(stdout);
+	return ret;
+}
+
+/*
+ * The collector of 'perf stat record -I <ms> -o tcp://host:port', the
+ * rounds of all the hosts in one output, processed as they come.
+ */
+static int stat_report__listen(const char *addr)
+{
+	int fd = net_output__listen(addr);
+
+	if (fd < 0) {
+		pr_err("Failed to listen on %s: %s\n", addr, strerror(-fd));
+		return fd;
+	}
+
+	/* no zombies from the hosts that went away */
+	signal(SIGCHLD, SIG_IGN);
+
+	while (true) {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		int sock = accept(fd, (struct sockaddr *)&ss, &len);
+		pid_t pid;
+
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			pr_err("Failed to accept on %s: %m\n", addr);
+			break;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			close(fd);
+			_exit(stat_report__connection(sock, (struct sockaddr *)&ss, len) ? 1 : 0);
+		}
+		if (pid < 0)
+			pr_err("Failed to fork for a connection: %m\n");
+		close(sock);
+	}
+
+	close(fd);
+	return -1;
+}
+
+static int __cmd_report(int argc, const char **argv)
+{
+	const char *listen_addr = NULL;
 	const struct option options[] = {
 	OPT_STRING('i', "input", &input_name, "file", "input file name"),
 	OPT_SET_UINT(0, "per-socket", &perf_stat.aggr_mode,
@@ -1511,13 +2113,22 @@ static int __cmd_report(int argc, const char **argv)
 		     "aggregate counts per physical processor core", AGGR_CORE),
 	OPT_SET_UINT('A', "no-aggr", &perf_stat.aggr_mode,
 		     "disable CPU count aggregation", AGGR_NONE),
+	OPT_STRING(0, "listen", &listen_addr, "addr",
+		   "Report the streams of perf stat record -o tcp://host:port or unix:path"),
 	OPT_END()
 	};
 	struct stat st;
-	int ret;
 
 	argc = parse_options(argc, argv, options, stat_report_usage, 0);
 
+	if (listen_addr) {
+		if (!net_output__is_addr(listen_addr)) {
+			pr_err("--listen takes tcp://[host]:port or unix:path\n");
+			return -1;
+		}
+		return stat_report__listen(listen_addr);
+	}
+
 	if (!input_name || !strlen(input_name)) {
 		if (!fstat(STDIN_FILENO, &st) && S_ISFIFO(st.st_mode))
 			input_name = "-";
@@ -1525,23 +2136,8 @@ static int __cmd_report(int argc, const char **argv)
 			input_name = "perf.data";
 	}
 
-	perf_stat.data.path = input_name;
-	perf_stat.data.mode = PERF_DATA_MODE_READ;
-
-	session = perf_session__new(&perf_stat.data, false, &perf_stat.tool);
-	if (session == NULL)
-		return -1;
-
-	perf_stat.session  = session;
 	stat_config.output = stderr;
-	evsel_list         = session->evlist;
-
-	ret = perf_session__process_events(session);
-	if (ret)
-		return ret;
-
-	perf_session__delete(session);
-	return 0;
+	return stat_report__session();
 }
 
 static void setup_system_wide(int forks)
@@ -1748,6 +2344,28 @@ int cmd_stat(int argc, const char **argv)
 		goto out;
 	}
 
+	if (thread_refresh && (stat_config.aggr_mode != AGGR_THREAD ||
+			       !target.pid || !stat_config.interval || STAT_RECORD)) {
+		fprintf(stderr, "--per-thread-refresh is only for --per-thread -p "
+			"with -I, without 'perf stat record'\n");
+		parse_options_usage(stat_usage, stat_options, "per-thread-refresh", 0);
+		parse_options_usage(NULL, stat_options, "I", 1);
+		goto out;
+	}
+
+	/* the new threads would also count in the ones starting them */
+	if (thread_refresh)
+		stat_config.no_inherit = true;
+
+	if (bpf_counters && (!nr_cgroups || STAT_RECORD ||
+			     stat_config.aggr_mode == AGGR_THREAD)) {
+		fprintf(stderr, "--bpf-counters is only for -G, "
+			"without 'perf stat record' or --per-thread\n");
+		parse_options_usage(stat_usage, stat_options, "bpf-counters", 0);
+		parse_options_usage(NULL, stat_options, "G", 1);
+		goto out;
+	}
+
 	if (add_default_attributes())
 		goto out;
 
@@ -1816,6 +2434,14 @@ int cmd_stat(int argc, const char **argv)
 	if (perf_stat_init_aggr_mode())
 		goto out;
 
+	if (bpf_counters) {
+		bpf_cgroup = bpf_cgroup__new(evsel_list, bpf_counters);
+		if (IS_ERR(bpf_cgroup)) {
+			bpf_cgroup = NULL;
+			goto out;
+		}
+	}
+
 	/*
 	 * Set sample_type to PERF_SAMPLE_IDENTIFIER, which should be harmless
 	 * while avoiding that older tools show confusing messages.
@@ -1888,9 +2514,13 @@ int cmd_stat(int argc, const char **argv)
 			perf_session__write_header(perf_stat.session, evsel_list, fd, true);
 		}
 
+		net_output__delete(perf_stat.net);
+		perf_stat.net = NULL;
+
 		perf_session__delete(perf_stat.session);
 	}
 
+	bpf_cgroup__delete(bpf_cgroup);
 	perf_stat__exit_aggr_mode();
 	perf_evlist__free_stats(evsel_list);
 out:
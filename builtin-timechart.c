@@ -70,6 +70,8 @@ struct timechart {
 				with_backtrace,
 				topology;
 	bool			force;
+	/* merge the intervals narrower than a pixel */
+	bool			lod;
 	/* IO related settings */
 	bool			io_only,
 				skip_eagain;
@@ -1013,29 +1015,128 @@ static void sort_pids(struct timechart *tchart)
 }
 
 
+/*
+ * The intervals of a row, merged while they fit in a pixel column or are
+ * less than a pixel apart, so that each column is drawn once.
+ */
+struct lod_box {
+	u64		start;
+	u64		end;
+	/* how long the interval drawn for the merged ones lasts */
+	u64		longest;
+	int		type;
+	int		cpu;
+	u64		state;
+	const char	*backtrace;
+	bool		used;
+};
+
+struct lod_row {
+	int		Y;
+	int		pid;
+	const char	*comm;
+};
+
+typedef void (*lod_draw_t)(struct lod_box *box, struct lod_row *row);
+
+static void lod_box__flush(struct lod_box *box, lod_draw_t draw,
+			   struct lod_row *row)
+{
+	if (box->used)
+		draw(box, row);
+	box->used = false;
+}
+
+static void lod_box__add(struct timechart *tchart, struct lod_box *box,
+			 int type, int cpu, u64 state, u64 start, u64 end,
+			 const char *backtrace, lod_draw_t draw,
+			 struct lod_row *row)
+{
+	if (box->used && tchart->lod) {
+		u64 s = min(box->start, start), e = max(box->end, end);
+		bool same = box->type == type && box->cpu == cpu &&
+			    box->state == state;
+		double gap = svg_pixels(s, e) - svg_pixels(box->start, box->end) -
+			     svg_pixels(start, end);
+
+		if (svg_pixels(s, e) < 1.0 || (same && gap < 1.0)) {
+			/* the longest interval tells what the column shows */
+			if (!same && end - start > box->longest) {
+				box->type      = type;
+				box->cpu       = cpu;
+				box->state     = state;
+				box->backtrace = backtrace;
+			}
+			box->longest = max(box->longest, end - start);
+			box->start = s;
+			box->end   = e;
+			return;
+		}
+	}
+
+	lod_box__flush(box, draw, row);
+
+	box->start     = start;
+	box->end       = end;
+	box->longest   = end - start;
+	box->type      = type;
+	box->cpu       = cpu;
+	box->state     = state;
+	box->backtrace = backtrace;
+	box->used      = true;
+}
+
+static void lod_draw_cstate(struct lod_box *box, struct lod_row *row __maybe_unused)
+{
+	svg_cstate(box->cpu, box->start, box->end, box->state);
+}
+
+static void lod_draw_pstate(struct lod_box *box, struct lod_row *row __maybe_unused)
+{
+	svg_pstate(box->cpu, box->start, box->end, box->state);
+}
+
 static void draw_c_p_states(struct timechart *tchart)
 {
 	struct power_event *pwr;
-	pwr = tchart->power_events;
+	struct lod_box *boxes;
+	unsigned int cpu;
+
+	boxes = calloc(tchart->numcpus, sizeof(*boxes));
+	if (boxes == NULL)
+		return;
 
 	/*
 	 * two pass drawing so that the P state bars are on top of the C state blocks
 	 */
+	pwr = tchart->power_events;
 	while (pwr) {
-		if (pwr->type == CSTATE)
-			svg_cstate(pwr->cpu, pwr->start_time, pwr->end_time, pwr->state);
+		if (pwr->type == CSTATE && (unsigned int)pwr->cpu < tchart->numcpus)
+			lod_box__add(tchart, &boxes[pwr->cpu], CSTATE, pwr->cpu,
+				     pwr->state, pwr->start_time, pwr->end_time,
+				     NULL, lod_draw_cstate, NULL);
 		pwr = pwr->next;
 	}
 
+	for (cpu = 0; cpu < tchart->numcpus; cpu++)
+		lod_box__flush(&boxes[cpu], lod_draw_cstate, NULL);
+
 	pwr = tchart->power_events;
 	while (pwr) {
-		if (pwr->type == PSTATE) {
+		if (pwr->type == PSTATE && (unsigned int)pwr->cpu < tchart->numcpus) {
 			if (!pwr->state)
 				pwr->state = tchart->min_freq;
-			svg_pstate(pwr->cpu, pwr->start_time, pwr->end_time, pwr->state);
+			lod_box__add(tchart, &boxes[pwr->cpu], PSTATE, pwr->cpu,
+				     pwr->state, pwr->start_time, pwr->end_time,
+				     NULL, lod_draw_pstate, NULL);
 		}
 		pwr = pwr->next;
 	}
+
+	for (cpu = 0; cpu < tchart->numcpus; cpu++)
+		lod_box__flush(&boxes[cpu], lod_draw_pstate, NULL);
+
+	free(boxes);
 }
 
 static void draw_wakeups(struct timechart *tchart)
@@ -1106,32 +1207,57 @@ static void draw_wakeups(struct timechart *tchart)
 	}
 }
 
+static void lod_draw_process(struct lod_box *box, struct lod_row *row)
+{
+	svg_process(box->cpu, box->start, box->end, row->pid, row->comm,
+		    box->backtrace);
+}
+
 static void draw_cpu_usage(struct timechart *tchart)
 {
 	struct per_pid *p;
 	struct per_pidcomm *c;
 	struct cpu_sample *sample;
+	struct lod_box *boxes;
+	unsigned int cpu;
+
+	boxes = calloc(tchart->numcpus, sizeof(*boxes));
+	if (boxes == NULL)
+		return;
+
 	p = tchart->all_data;
 	while (p) {
 		c = p->all;
 		while (c) {
+			struct lod_row row = {
+				.pid  = p->pid,
+				.comm = c->comm,
+			};
+
 			sample = c->samples;
 			while (sample) {
-				if (sample->type == TYPE_RUNNING) {
-					svg_process(sample->cpu,
-						    sample->start_time,
-						    sample->end_time,
-						    p->pid,
-						    c->comm,
-						    sample->backtrace);
+				if (sample->type == TYPE_RUNNING &&
+				    (unsigned int)sample->cpu < tchart->numcpus) {
+					lod_box__add(tchart, &boxes[sample->cpu],
+						     TYPE_RUNNING, sample->cpu, 0,
+						     sample->start_time,
+						     sample->end_time,
+						     sample->backtrace,
+						     lod_draw_process, &row);
 				}
 
 				sample = sample->next;
 			}
+
+			/* the cpu rows are shared by all the tasks */
+			for (cpu = 0; cpu < tchart->numcpus; cpu++)
+				lod_box__flush(&boxes[cpu], lod_draw_process, &row);
 			c = c->next;
 		}
 		p = p->next;
 	}
+
+	free(boxes);
 }
 
 static void draw_io_bars(struct timechart *tchart)
@@ -1249,11 +1375,26 @@ static void draw_io_bars(struct timechart *tchart)
 	}
 }
 
+static void lod_draw_sample(struct lod_box *box, struct lod_row *row)
+{
+	if (box->type == TYPE_RUNNING)
+		svg_running(row->Y, box->cpu, box->start, box->end,
+			    box->backtrace);
+	if (box->type == TYPE_BLOCKED)
+		svg_blocked(row->Y, box->cpu, box->start, box->end,
+			    box->backtrace);
+	if (box->type == TYPE_WAITING)
+		svg_waiting(row->Y, box->cpu, box->start, box->end,
+			    box->backtrace);
+}
+
 static void draw_process_bars(struct timechart *tchart)
 {
 	struct per_pid *p;
 	struct per_pidcomm *c;
 	struct cpu_sample *sample;
+	struct lod_box box = { .used = false, };
+	struct lod_row row = { .Y = 0, };
 	int Y = 0;
 
 	Y = 2 * tchart->numcpus + 2;
@@ -1269,25 +1410,21 @@ static void draw_process_bars(struct timechart *tchart)
 			}
 
 			svg_box(Y, c->start_time, c->end_time, "process");
+			row.Y = Y;
 			sample = c->samples;
 			while (sample) {
-				if (sample->type == TYPE_RUNNING)
-					svg_running(Y, sample->cpu,
-						    sample->start_time,
-						    sample->end_time,
-						    sample->backtrace);
-				if (sample->type == TYPE_BLOCKED)
-					svg_blocked(Y, sample->cpu,
-						    sample->start_time,
-						    sample->end_time,
-						    sample->backtrace);
-				if (sample->type == TYPE_WAITING)
-					svg_waiting(Y, sample->cpu,
-						    sample->start_time,
-						    sample->end_time,
-						    sample->backtrace);
+				if (sample->type == TYPE_RUNNING ||
+				    sample->type == TYPE_BLOCKED ||
+				    sample->type == TYPE_WAITING)
+					lod_box__add(tchart, &box, sample->type,
+						     sample->cpu, 0,
+						     sample->start_time,
+						     sample->end_time,
+						     sample->backtrace,
+						     lod_draw_sample, &row);
 				sample = sample->next;
 			}
+			lod_box__flush(&box, lod_draw_sample, &row);
 
 			if (c->comm) {
 				char comm[256];
@@ -1935,6 +2072,7 @@ int cmd_timechart(int argc, const char **argv)
 		.proc_num = 15,
 		.min_time = NSEC_PER_MSEC,
 		.merge_dist = 1000,
+		.lod = true,
 	};
 	const char *output_name = "output.svg";
 	const struct option timechart_common_options[] = {
@@ -1968,6 +2106,8 @@ int cmd_timechart(int argc, const char **argv)
 		     "merge events that are merge-dist us apart",
 		     parse_time),
 	OPT_BOOLEAN('f', "force", &tchart.force, "don't complain, do it"),
+	OPT_BOOLEAN(0, "lod", &tchart.lod,
+		    "merge the intervals narrower than a pixel (default)"),
 	OPT_PARENT(timechart_common_options),
 	};
 	const char * const timechart_subcommands[] = { "record", NULL };
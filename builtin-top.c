@@ -72,6 +72,7 @@
 #include <sys/utsname.h>
 #include <sys/mman.h>
 
+#include <linux/string.h>
 #include <linux/stringify.h>
 #include <linux/time64.h>
 #include <linux/types.h>
@@ -729,8 +730,9 @@ static void perf_event__process_sample(struct perf_tool *tool,
 		return;
 	}
 
+	/* samples can be resolved on several threads */
 	if (event->header.misc & PERF_RECORD_MISC_EXACT_IP)
-		top->exact_samples++;
+		__sync_fetch_and_add(&top->exact_samples, 1);
 
 	if (machine__resolve(machine, &al, sample) < 0)
 		return;
@@ -788,6 +790,8 @@ static void perf_event__process_sample(struct perf_tool *tool,
 			.evsel		= evsel,
 			.sample 	= sample,
 			.add_entry_cb 	= hist_iter__top_callback,
+			/* the callchain gets resolved without it */
+			.lock		= &hists->lock,
 		};
 
 		if (symbol_conf.cumulate_callchain)
@@ -795,13 +799,9 @@ static void perf_event__process_sample(struct perf_tool *tool,
 		else
 			iter.ops = &hist_iter_normal;
 
-		pthread_mutex_lock(&hists->lock);
-
 		err = hist_entry_iter__add(&iter, &al, top->max_stack, top);
 		if (err < 0)
 			pr_err("Problem incrementing symbol period, skipping event\n");
-
-		pthread_mutex_unlock(&hists->lock);
 	}
 
 	addr_location__put(&al);
@@ -832,33 +832,112 @@ perf_top__process_lost_samples(struct perf_top *top,
 
 static u64 last_timestamp;
 
+#define TOP_HOLDBACK_MAX	4096
+
+static int top_sample_queue__add(struct top_sample_queue *q, union perf_event *event,
+				 u64 timestamp)
+{
+	struct top_queued_sample *qs;
+
+	if (q->nr == q->size) {
+		unsigned int size = q->size ? q->size * 2 : 1024;
+
+		qs = realloc(q->entries, size * sizeof(*qs));
+		if (qs == NULL)
+			return -ENOMEM;
+		q->entries = qs;
+		q->size = size;
+	}
+
+	qs = &q->entries[q->nr];
+	qs->event = memdup(event, event->header.size);
+	if (qs->event == NULL)
+		return -ENOMEM;
+
+	qs->timestamp = timestamp;
+	q->nr++;
+	return 0;
+}
+
+static void top_sample_queue__exit(struct top_sample_queue *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->nr; i++)
+		free(q->entries[i].event);
+	zfree(&q->entries);
+	q->nr = q->size = 0;
+}
+
+/*
+ * Once the queues were rotated, the watermark is the oldest of the last
+ * events read from each mmap before, all were queued to be processed.
+ */
+static void perf_top__rotated(struct perf_top *top)
+{
+	static struct ordered_events *last_in;
+	u64 watermark = ULLONG_MAX;
+	int i;
+
+	if (top->qe.mmap_last == NULL || top->qe.in == last_in)
+		return;
+
+	for (i = 0; i < top->evlist->nr_mmaps; i++)
+		watermark = min(watermark, top->qe.mmap_last[i]);
+
+	top->qe.watermark = watermark;
+	last_in = top->qe.in;
+}
+
 static void perf_top__mmap_read_idx(struct perf_top *top, int idx)
 {
 	struct record_opts *opts = &top->record_opts;
 	struct perf_evlist *evlist = top->evlist;
+	u64 *mmap_last = top->qe.mmap_last;
+	struct perf_mmap_batch batch;
 	struct perf_mmap *md;
 	union perf_event *event;
+	int ret = 0;
 
 	md = opts->overwrite ? &evlist->overwrite_mmap[idx] : &evlist->mmap[idx];
-	if (perf_mmap__read_init(md) < 0)
+	if (perf_mmap__read_init(md) < 0) {
+		/* nothing more in it up to now */
+		if (mmap_last)
+			mmap_last[idx] = last_timestamp;
 		return;
+	}
 
-	while ((event = perf_mmap__read_event(md)) != NULL) {
-		int ret;
+	/* the events are copied when queued, hand them back a batch at a time */
+	while (!ret && perf_mmap__read_batch(md, &batch, md->mask + 1) > 0) {
+		while ((event = perf_mmap_batch__next(&batch)) != NULL) {
+			ret = perf_evlist__parse_sample_timestamp(evlist, event, &last_timestamp);
+			if (ret && ret != -1)
+				break;
 
-		ret = perf_evlist__parse_sample_timestamp(evlist, event, &last_timestamp);
-		if (ret && ret != -1)
-			break;
+			perf_top__rotated(top);
 
-		ret = ordered_events__queue(top->qe.in, event, last_timestamp, 0);
-		if (ret)
-			break;
+			if (mmap_last && event->header.type == PERF_RECORD_SAMPLE) {
+				struct ordered_events *in = top->qe.in;
 
-		perf_mmap__consume(md);
+				ret = top_sample_queue__add(&top->qe.samples[in - top->qe.data],
+							    event, last_timestamp);
+			} else {
+				ret = ordered_events__queue_src(top->qe.in, event,
+								last_timestamp, 0, idx);
+			}
+			if (ret)
+				break;
+
+			if (mmap_last)
+				mmap_last[idx] = last_timestamp;
+		}
+
+		perf_mmap__consume_batch(md, &batch);
 
 		if (top->qe.rotate) {
 			pthread_mutex_lock(&top->qe.mutex);
 			top->qe.rotate = false;
+			perf_top__rotated(top);
 			pthread_cond_signal(&top->qe.cond);
 			pthread_mutex_unlock(&top->qe.mutex);
 		}
@@ -1051,14 +1130,166 @@ static struct ordered_events *rotate_queues(struct perf_top *top)
 	return in;
 }
 
+#define TOP_RESOLVE_BATCH	1024
+#define TOP_RESOLVE_MIN		64
+#define TOP_UNWIND_QUEUE	8192
+
+struct top_sample {
+	union perf_event	*event;
+	struct perf_evsel	*evsel;
+	struct machine		*machine;
+	struct perf_sample	sample;
+};
+
+static int perf_top__init_resolve(struct perf_top *top)
+{
+	if (top->nr_threads_resolve == UINT_MAX)
+		top->nr_threads_resolve = sysconf(_SC_NPROCESSORS_ONLN);
+	if (top->nr_threads_resolve < 2)
+		return 0;
+
+	top->resolve.samples = calloc(TOP_RESOLVE_BATCH,
+				      sizeof(*top->resolve.samples));
+	top->resolve.threads = calloc(top->nr_threads_resolve - 1,
+				      sizeof(*top->resolve.threads));
+	if (top->resolve.samples == NULL || top->resolve.threads == NULL) {
+		zfree(&top->resolve.samples);
+		zfree(&top->resolve.threads);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue a host sample to be resolved and added to the hists with the
+ * others in the batch, the event goes away once it is delivered.
+ */
+static int perf_top__queue_sample(struct perf_top *top,
+				  union perf_event *event,
+				  struct perf_evsel *evsel,
+				  struct machine *machine,
+				  bool self_only)
+{
+	struct top_sample *ts = &top->resolve.samples[top->resolve.nr];
+
+	ts->event = memdup(event, event->header.size);
+	if (ts->event == NULL)
+		return -ENOMEM;
+
+	if (perf_evlist__parse_sample(top->evlist, ts->event, &ts->sample)) {
+		zfree(&ts->event);
+		return -EINVAL;
+	}
+
+	if (self_only)
+		ts->sample.user_stack.size = 0;
+
+	ts->evsel   = evsel;
+	ts->machine = machine;
+	top->resolve.nr++;
+	return 0;
+}
+
+static void *resolve_worker(void *arg)
+{
+	struct perf_top *top = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&top->resolve.next, 1)) < top->resolve.nr) {
+		struct top_sample *ts = &top->resolve.samples[i];
+
+		perf_event__process_sample(&top->tool, ts->event, ts->evsel,
+					   &ts->sample, ts->machine);
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolve the queued samples on top->nr_threads_resolve threads, they
+ * only take hists->lock to add their entries.  Done before any other
+ * event is processed, so they all see the maps as they were when they
+ * were taken.
+ */
+static void perf_top__resolve_samples(struct perf_top *top)
+{
+	unsigned int i, started = 0, nr_threads = top->nr_threads_resolve;
+	pthread_t *threads = top->resolve.threads;
+
+	if (top->resolve.nr == 0)
+		return;
+
+	if (top->resolve.nr < TOP_RESOLVE_MIN)
+		nr_threads = 1;
+
+	for (; started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, resolve_worker, top))
+			break;
+	}
+
+	resolve_worker(top);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < top->resolve.nr; i++)
+		zfree(&top->resolve.samples[i].event);
+
+	top->resolve.nr = top->resolve.next = 0;
+}
+
+static int __deliver_event(struct perf_top *top, union perf_event *event,
+			   u64 timestamp, u64 backlog);
+
+/*
+ * Deliver the samples queued without ordering, after the sideband events
+ * read with them were.  Those taken after the watermark may belong to an
+ * mmap not read yet from another mmap, they wait for the next rotation,
+ * in a queue bounded to TOP_HOLDBACK_MAX samples.
+ */
+static void perf_top__deliver_relaxed(struct perf_top *top, struct top_sample_queue *q)
+{
+	struct top_sample_queue *holdback = &top->qe.holdback;
+	u64 watermark = top->qe.watermark;
+	unsigned int i, nr = 0, nr_held = holdback->nr;
+
+	for (i = 0; i < nr_held; i++) {
+		struct top_queued_sample *qs = &holdback->entries[i];
+
+		if (qs->timestamp > watermark) {
+			holdback->entries[nr++] = *qs;
+			continue;
+		}
+
+		__deliver_event(top, qs->event, qs->timestamp, q->nr);
+		free(qs->event);
+	}
+	holdback->nr = nr;
+
+	for (i = 0; i < q->nr; i++) {
+		struct top_queued_sample *qs = &q->entries[i];
+
+		if (qs->timestamp > watermark && holdback->nr < holdback->size) {
+			holdback->entries[holdback->nr++] = *qs;
+			continue;
+		}
+
+		__deliver_event(top, qs->event, qs->timestamp, q->nr - i);
+		free(qs->event);
+	}
+	q->nr = 0;
+}
+
 static void *process_thread(void *arg)
 {
 	struct perf_top *top = arg;
 
 	while (!done) {
 		struct ordered_events *out, *in = top->qe.in;
+		struct top_sample_queue *samples = &top->qe.samples[in - top->qe.data];
 
-		if (!in->nr_events) {
+		if (!in->nr_events && !samples->nr) {
 			usleep(100);
 			continue;
 		}
@@ -1072,6 +1303,11 @@ static void *process_thread(void *arg)
 
 		if (ordered_events__flush(out, OE_FLUSH__TOP))
 			pr_err("failed to process events\n");
+
+		if (top->relaxed_ordering)
+			perf_top__deliver_relaxed(top, samples);
+
+		perf_top__resolve_samples(top);
 	}
 
 	return NULL;
@@ -1080,31 +1316,48 @@ static void *process_thread(void *arg)
 /*
  * Allow only 'top->delay_secs' seconds behind samples.
  */
-static int should_drop(struct ordered_event *qevent, struct perf_top *top)
+static int should_drop(union perf_event *event, u64 timestamp, struct perf_top *top)
 {
-	union perf_event *event = qevent->event;
 	u64 delay_timestamp;
 
 	if (event->header.type != PERF_RECORD_SAMPLE)
 		return false;
 
-	delay_timestamp = qevent->timestamp + top->delay_secs * NSEC_PER_SEC;
+	delay_timestamp = timestamp + top->delay_secs * NSEC_PER_SEC;
 	return delay_timestamp < last_timestamp;
 }
 
-static int deliver_event(struct ordered_events *qe,
-			 struct ordered_event *qevent)
+/*
+ * Unwinding the user stacks of --call-graph dwarf is what makes the samples
+ * fall behind, until they get dropped.  With more than top->unwind_queue
+ * events still waiting to be delivered, leave them with their own address
+ * and their kernel callchain instead, counted in the status line.
+ */
+static bool perf_top__skip_unwind(struct perf_top *top, u64 backlog,
+				  struct perf_sample *sample)
+{
+	if (!sample->user_stack.size || !top->unwind_queue ||
+	    backlog <= top->unwind_queue)
+		return false;
+
+	sample->user_stack.size = 0;
+	top->self_only++;
+	top->self_only_total++;
+	return true;
+}
+
+/* backlog: the events still waiting to be delivered after this one */
+static int __deliver_event(struct perf_top *top, union perf_event *event,
+			   u64 timestamp, u64 backlog)
 {
-	struct perf_top *top = qe->data;
 	struct perf_evlist *evlist = top->evlist;
 	struct perf_session *session = top->session;
-	union perf_event *event = qevent->event;
 	struct perf_sample sample;
 	struct perf_evsel *evsel;
 	struct machine *machine;
 	int ret = -1;
 
-	if (should_drop(qevent, top)) {
+	if (should_drop(event, timestamp, top)) {
 		top->drop++;
 		top->drop_total++;
 		return 0;
@@ -1155,6 +1408,14 @@ static int deliver_event(struct ordered_events *qe,
 	}
 
 	if (event->header.type == PERF_RECORD_SAMPLE) {
+		bool self_only = perf_top__skip_unwind(top, backlog, &sample);
+
+		if (top->resolve.samples && machine == &session->machines.host) {
+			if (top->resolve.nr == TOP_RESOLVE_BATCH)
+				perf_top__resolve_samples(top);
+			if (!perf_top__queue_sample(top, event, evsel, machine, self_only))
+				goto out;
+		}
 		perf_event__process_sample(&top->tool, event, evsel,
 					   &sample, machine);
 	} else if (event->header.type == PERF_RECORD_LOST) {
@@ -1162,16 +1423,31 @@ static int deliver_event(struct ordered_events *qe,
 	} else if (event->header.type == PERF_RECORD_LOST_SAMPLES) {
 		perf_top__process_lost_samples(top, event, evsel);
 	} else if (event->header.type < PERF_RECORD_MAX) {
+		perf_top__resolve_samples(top);
 		hists__inc_nr_events(evsel__hists(evsel), event->header.type);
 		machine__process_event(machine, event, &sample);
 	} else
 		++session->evlist->stats.nr_unknown_events;
 
+out:
 	ret = 0;
 next_event:
 	return ret;
 }
 
+static int deliver_event(struct ordered_events *qe,
+			 struct ordered_event *qevent)
+{
+	struct perf_top *top = qe->data;
+	u64 backlog = qe->nr_events;
+
+	/* the queued samples wait too */
+	if (top->relaxed_ordering)
+		backlog += top->qe.samples[0].nr + top->qe.samples[1].nr;
+
+	return __deliver_event(top, qevent->event, qevent->timestamp, backlog);
+}
+
 static void init_process_thread(struct perf_top *top)
 {
 	ordered_events__init(&top->qe.data[0], deliver_event, top);
@@ -1214,6 +1490,13 @@ static int __cmd_top(struct perf_top *top)
 	if (ret < 0)
 		pr_warning("Couldn't synthesize bpf events.\n");
 
+	if (top->record_opts.record_cgroup) {
+		ret = perf_event__synthesize_cgroups(&top->tool, perf_event__process,
+						     &top->session->machines.host);
+		if (ret < 0)
+			pr_warning("Couldn't synthesize cgroup events.\n");
+	}
+
 	machine__synthesize_threads(&top->session->machines.host, &opts->target,
 				    top->evlist->threads, false,
 				    top->nr_threads_synthesize);
@@ -1221,6 +1504,14 @@ static int __cmd_top(struct perf_top *top)
 	if (top->nr_threads_synthesize > 1)
 		perf_set_singlethreaded();
 
+	ret = perf_top__init_resolve(top);
+	if (ret)
+		return ret;
+
+	/* the threads, maps and dsos get looked up by all of them */
+	if (top->resolve.samples)
+		perf_set_multithreaded();
+
 	if (perf_hpp_list.socket) {
 		ret = perf_env__read_cpu_topology_map(&perf_env);
 		if (ret < 0) {
@@ -1236,6 +1527,27 @@ static int __cmd_top(struct perf_top *top)
 	if (ret)
 		return ret;
 
+	/*
+	 * Queue the events per mmap, they come time ordered from each
+	 * of them, so we just merge the queues at flush time.
+	 */
+	if (ordered_events__set_sources(&top->qe.data[0], top->evlist->nr_mmaps) ||
+	    ordered_events__set_sources(&top->qe.data[1], top->evlist->nr_mmaps))
+		pr_debug("Couldn't allocate per mmap event queues.\n");
+
+	/* only the sideband events get ordered, the samples are counted as read */
+	if (top->relaxed_ordering) {
+		top->qe.mmap_last = calloc(top->evlist->nr_mmaps, sizeof(u64));
+		top->qe.holdback.entries = calloc(TOP_HOLDBACK_MAX,
+						  sizeof(*top->qe.holdback.entries));
+		if (top->qe.mmap_last == NULL || top->qe.holdback.entries == NULL) {
+			zfree(&top->qe.mmap_last);
+			zfree(&top->qe.holdback.entries);
+			return -ENOMEM;
+		}
+		top->qe.holdback.size = TOP_HOLDBACK_MAX;
+	}
+
 	top->session->evlist = top->evlist;
 	perf_session__set_id_hdr_size(top->session);
 
@@ -1297,6 +1609,10 @@ out_join:
 out_join_thread:
 	pthread_cond_signal(&top->qe.cond);
 	pthread_join(thread_process, NULL);
+	top_sample_queue__exit(&top->qe.samples[0]);
+	top_sample_queue__exit(&top->qe.samples[1]);
+	top_sample_queue__exit(&top->qe.holdback);
+	zfree(&top->qe.mmap_last);
 	return ret;
 }
 
@@ -1382,6 +1698,8 @@ int cmd_top(int argc, const char **argv)
 		.max_stack	     = sysctl__max_stack(),
 		.annotation_opts     = annotation__default_options,
 		.nr_threads_synthesize = UINT_MAX,
+		.nr_threads_resolve = UINT_MAX,
+		.unwind_queue	= TOP_UNWIND_QUEUE,
 	};
 	struct record_opts *opts = &top.record_opts;
 	struct target *target = &opts->target;
@@ -1485,6 +1803,9 @@ int cmd_top(int argc, const char **argv)
 		   "don't try to adjust column width, use these fixed values"),
 	OPT_UINTEGER(0, "proc-map-timeout", &proc_map_timeout,
 			"per thread proc mmap processing timeout in ms"),
+	OPT_CALLBACK(0, "synth-skip-mmaps", NULL, "comm[,comm...]",
+		     "don't synthesize the maps of existing tasks with these comms",
+		     perf_event__parse_skip_mmaps),
 	OPT_CALLBACK_NOOPT('b', "branch-any", &opts->branch_stack,
 		     "branch any", "sample any taken branches",
 		     parse_branch_stack),
@@ -1495,11 +1816,19 @@ int cmd_top(int argc, const char **argv)
 		    "Show raw trace event output (do not use print fmt or plugins)"),
 	OPT_BOOLEAN(0, "hierarchy", &symbol_conf.report_hierarchy,
 		    "Show entries in a hierarchy"),
+	OPT_BOOLEAN(0, "all-cgroups", &top.record_opts.record_cgroup,
+		    "Sample the cgroup of the tasks, for --sort cgroup"),
 	OPT_BOOLEAN(0, "overwrite", &top.record_opts.overwrite,
 		    "Use a backward ring buffer, default: no"),
 	OPT_BOOLEAN(0, "force", &symbol_conf.force, "don't complain, do it"),
 	OPT_UINTEGER(0, "num-thread-synthesize", &top.nr_threads_synthesize,
 			"number of thread to run event synthesize"),
+	OPT_UINTEGER(0, "num-thread-resolve", &top.nr_threads_resolve,
+			"number of threads resolving samples, 0 to resolve them as they come"),
+	OPT_UINTEGER(0, "unwind-queue", &top.unwind_queue,
+			"events waiting past which user stacks aren't unwound, 0 for no limit"),
+	OPT_BOOLEAN(0, "relaxed-ordering", &top.relaxed_ordering,
+		    "Only order the sideband events, the samples are added as they are read"),
 	OPT_END()
 	};
 	struct perf_evlist *sb_evlist = NULL;
@@ -40,6 +40,7 @@
 #include "util/intlist.h"
 #include "util/thread_map.h"
 #include "util/stat.h"
+#include "util/latency-hist.h"
 #include "trace/beauty/beauty.h"
 #include "trace-event.h"
 #include "util/parse-events.h"
@@ -54,14 +55,17 @@
 #include <inttypes.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
 #include <linux/err.h>
 #include <linux/filter.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <linux/random.h>
 #include <linux/stringify.h>
 #include <linux/time64.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <sys/sysmacros.h>
 
@@ -82,6 +86,7 @@ struct trace {
 		int		max;
 		struct syscall  *table;
 		struct bpf_map  *map;
+		struct bpf_map  *stats_map;
 		struct {
 			struct perf_evsel *sys_enter,
 					  *sys_exit,
@@ -95,9 +100,12 @@ struct trace {
 	struct perf_evlist	*evlist;
 	struct machine		*host;
 	struct thread		*current;
+	/* struct fd_table of each process, by pid */
+	struct intlist		*fd_tables;
 	struct cgroup		*cgroup;
 	u64			base_time;
 	FILE			*output;
+	FILE			*hist_output;
 	unsigned long		nr_events;
 	unsigned long		nr_events_printed;
 	unsigned long		max_events;
@@ -923,6 +931,7 @@ static struct syscall_fmt *syscall_fmt__find_by_alias(const char *alias)
 /*
  * is_exit: is this "exit" or "exit_group"?
  * is_open: is this "open" or "openat"? To associate the fd returned in sys_exit with the pathname in sys_enter.
+ * fd_op: what else it does to the fd table of the process, see thread_trace__track_fd().
  * args_size: sum of the sizes of the syscall arguments, anything after that is augmented stuff: pathname for openat, etc.
  */
 struct syscall {
@@ -931,16 +940,43 @@ struct syscall {
 	int		    args_size;
 	bool		    is_exit;
 	bool		    is_open;
+	u8		    fd_op;
 	struct tep_format_field *args;
 	const char	    *name;
 	struct syscall_fmt  *fmt;
 	struct syscall_arg_fmt *arg_fmt;
 };
 
+enum syscall_fd_op {
+	SYSCALL_FD_NONE,
+	SYSCALL_FD_CLOSE,	/* close(fd) */
+	SYSCALL_FD_DUP,		/* dup*(fd, ...) returns a copy of fd */
+	SYSCALL_FD_FCNTL,	/* so does fcntl(fd, F_DUPFD*, ...) */
+	SYSCALL_FD_NEW,		/* returns an fd that has no pathname */
+};
+
 struct bpf_map_syscall_entry {
 	bool	enabled;
 };
 
+/*
+ * What examples/bpf/syscall_summary.c accrues in its syscalls_stats map
+ * for each thread and syscall.
+ */
+struct bpf_map_syscall_stats_key {
+	pid_t	tid;
+	int	syscall;
+};
+
+struct bpf_map_syscall_stats {
+	u64	count;
+	u64	total;
+	u64	min;
+	u64	max;
+	u64	squares;
+	u64	hist[32];
+};
+
 /*
  * We need to have this 'calculated' boolean because in some cases we really
  * don't know what is the duration of a syscall, for instance, when we start
@@ -948,20 +984,20 @@ struct bpf_map_syscall_entry {
  * in which case all we can do is to print "( ? ) for duration and for the
  * start timestamp.
  */
-static size_t fprintf_duration(unsigned long t, bool calculated, FILE *fp)
+static size_t scnprintf_duration(unsigned long t, bool calculated, char *bf, size_t size)
 {
 	double duration = (double)t / NSEC_PER_MSEC;
-	size_t printed = fprintf(fp, "(");
+	size_t printed = scnprintf(bf, size, "(");
 
 	if (!calculated)
-		printed += fprintf(fp, "         ");
+		printed += scnprintf(bf + printed, size - printed, "         ");
 	else if (duration >= 1.0)
-		printed += color_fprintf(fp, PERF_COLOR_RED, "%6.3f ms", duration);
+		printed += color_snprintf(bf + printed, size - printed, PERF_COLOR_RED, "%6.3f ms", duration);
 	else if (duration >= 0.01)
-		printed += color_fprintf(fp, PERF_COLOR_YELLOW, "%6.3f ms", duration);
+		printed += color_snprintf(bf + printed, size - printed, PERF_COLOR_YELLOW, "%6.3f ms", duration);
 	else
-		printed += color_fprintf(fp, PERF_COLOR_NORMAL, "%6.3f ms", duration);
-	return printed + fprintf(fp, "): ");
+		printed += color_snprintf(bf + printed, size - printed, PERF_COLOR_NORMAL, "%6.3f ms", duration);
+	return printed + scnprintf(bf + printed, size - printed, "): ");
 }
 
 /**
@@ -986,27 +1022,298 @@ struct thread_trace {
 		unsigned int  namelen;
 		char	      *name;
 	} filename;
-	struct {
-		int	      max;
-		struct file   *table;
-	} files;
+	/* shared with the other threads of the process */
+	struct fd_table *files;
+	/* the fd and fcntl cmd args of a syscall changing the fd table */
+	struct syscall	*fd_sc;
+	unsigned long	fd_args[2];
 
 	struct intlist *syscall_stats;
 };
 
+/* What is accrued for each syscall of a thread, the priv of syscall_stats */
+struct syscall_stats {
+	struct stats		stats;
+	struct latency_hist	latency;
+};
+
+static struct syscall_stats *thread_trace__syscall_stats(struct thread_trace *ttrace,
+							 int id)
+{
+	struct int_node *inode = intlist__findnew(ttrace->syscall_stats, id);
+	struct syscall_stats *ss;
+
+	if (inode == NULL)
+		return NULL;
+
+	ss = inode->priv;
+	if (ss == NULL) {
+		ss = malloc(sizeof(*ss));
+		if (ss == NULL)
+			return NULL;
+		init_stats(&ss->stats);
+		latency_hist__init(&ss->latency);
+		inode->priv = ss;
+	}
+
+	return ss;
+}
+
 static struct thread_trace *thread_trace__new(void)
 {
 	struct thread_trace *ttrace =  zalloc(sizeof(struct thread_trace));
 
 	if (ttrace)
-		ttrace->files.max = -1;
-
-	ttrace->syscall_stats = intlist__new(NULL);
+		ttrace->syscall_stats = intlist__new(NULL);
 
 	return ttrace;
 }
 
-static struct thread_trace *thread__trace(struct thread *thread, FILE *fp)
+/*
+ * The fds of a process, shared by its threads, with what they were opened
+ * as: tracked from the returns of the syscalls opening, duplicating and
+ * closing them, the ones opened before perf trace attached read from
+ * /proc/PID/fd all at once, the first time one is looked for.
+ *
+ * Open addressing, as the fds of a process can go in the 100k.
+ */
+struct fd_entry {
+	int		fd;
+	struct file	file;
+};
+
+#define FD_ENTRY__EMPTY		-1
+#define FD_ENTRY__REMOVED	-2
+
+struct fd_table {
+	pid_t		pid;
+	bool		seeded;
+	unsigned int	bits;
+	/* the entries in use, and those removed */
+	unsigned int	nr;
+	unsigned int	nr_removed;
+	struct fd_entry	*entries;
+};
+
+static struct fd_table *fd_table__new(pid_t pid)
+{
+	struct fd_table *files = zalloc(sizeof(*files));
+
+	if (files)
+		files->pid = pid;
+
+	return files;
+}
+
+static void fd_table__delete(struct fd_table *files)
+{
+	unsigned int i;
+
+	if (files == NULL)
+		return;
+
+	for (i = 0; files->entries && i < (1U << files->bits); i++) {
+		if (files->entries[i].fd >= 0)
+			free(files->entries[i].file.pathname);
+	}
+
+	free(files->entries);
+	free(files);
+}
+
+static struct fd_entry *fd_table__slot(struct fd_table *files, int fd, bool add)
+{
+	unsigned int mask = (1U << files->bits) - 1;
+	unsigned int i = hash_32(fd, files->bits);
+	struct fd_entry *removed = NULL;
+
+	for (;; i = (i + 1) & mask) {
+		struct fd_entry *entry = &files->entries[i];
+
+		if (entry->fd == fd)
+			return entry;
+		if (entry->fd == FD_ENTRY__EMPTY) {
+			if (!add)
+				return NULL;
+			return removed ?: entry;
+		}
+		if (entry->fd == FD_ENTRY__REMOVED && removed == NULL)
+			removed = entry;
+	}
+}
+
+static int fd_table__grow(struct fd_table *files)
+{
+	struct fd_entry *old = files->entries;
+	unsigned int i, old_size = old ? 1U << files->bits : 0;
+	unsigned int bits = files->bits;
+
+	/* only grow when not just full of removed entries */
+	if (old == NULL)
+		bits = 6;
+	else if (files->nr * 2 >= old_size)
+		bits++;
+
+	files->entries = malloc(sizeof(*old) << bits);
+	if (files->entries == NULL) {
+		files->entries = old;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (1U << bits); i++)
+		files->entries[i].fd = FD_ENTRY__EMPTY;
+
+	files->bits	  = bits;
+	files->nr_removed = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].fd >= 0)
+			*fd_table__slot(files, old[i].fd, true) = old[i];
+	}
+
+	free(old);
+	return 0;
+}
+
+static struct file *fd_table__find(struct fd_table *files, int fd)
+{
+	struct fd_entry *entry;
+
+	if (files == NULL || files->entries == NULL || fd < 0)
+		return NULL;
+
+	entry = fd_table__slot(files, fd, false);
+	return entry ? &entry->file : NULL;
+}
+
+static void fd_table__remove(struct fd_table *files, int fd)
+{
+	struct fd_entry *entry;
+
+	if (files == NULL || files->entries == NULL || fd < 0)
+		return;
+
+	entry = fd_table__slot(files, fd, false);
+	if (entry == NULL)
+		return;
+
+	zfree(&entry->file.pathname);
+	entry->fd = FD_ENTRY__REMOVED;
+	files->nr--;
+	files->nr_removed++;
+}
+
+/* Set the pathname of fd, replacing what it was before */
+static struct file *fd_table__set(struct fd_table *files, int fd, const char *pathname)
+{
+	struct fd_entry *entry;
+	char *name;
+
+	if (files == NULL || fd < 0)
+		return NULL;
+
+	name = strdup(pathname);
+	if (name == NULL)
+		return NULL;
+
+	/* at most 3/4 full, counting the removed */
+	if (files->entries == NULL ||
+	    (files->nr + files->nr_removed + 1) * 4 > (3U << files->bits)) {
+		if (fd_table__grow(files)) {
+			free(name);
+			return NULL;
+		}
+	}
+
+	entry = fd_table__slot(files, fd, true);
+	if (entry->fd == fd) {
+		free(entry->file.pathname);
+	} else {
+		if (entry->fd == FD_ENTRY__REMOVED)
+			files->nr_removed--;
+		entry->fd = fd;
+		files->nr++;
+	}
+
+	entry->file.pathname = name;
+	entry->file.dev_maj  = 0;
+	return &entry->file;
+}
+
+/* Read the fds of the process that are not known yet */
+static void fd_table__seed(struct fd_table *files, struct trace *trace)
+{
+	char dirname[PATH_MAX], pathname[PATH_MAX];
+	struct dirent *dent;
+	DIR *dir;
+
+	files->seeded = true;
+
+	scnprintf(dirname, sizeof(dirname), "/proc/%d/fd", files->pid);
+	dir = opendir(dirname);
+	if (dir == NULL)
+		return;
+
+	while ((dent = readdir(dir)) != NULL) {
+		struct file *file;
+		struct stat st;
+		char *end;
+		ssize_t len;
+		int fd;
+
+		fd = strtol(dent->d_name, &end, 10);
+		if (*end || end == dent->d_name || fd_table__find(files, fd))
+			continue;
+
+		len = readlinkat(dirfd(dir), dent->d_name, pathname, sizeof(pathname) - 1);
+		if (len < 0)
+			continue;
+		pathname[len] = '\0';
+		++trace->stats.proc_getname;
+
+		file = fd_table__set(files, fd, pathname);
+		if (file && fstatat(dirfd(dir), dent->d_name, &st, 0) == 0)
+			file->dev_maj = major(st.st_rdev);
+	}
+
+	closedir(dir);
+}
+
+static struct fd_table *trace__fd_table(struct trace *trace, pid_t pid)
+{
+	struct int_node *node;
+
+	if (trace->fd_tables == NULL) {
+		trace->fd_tables = intlist__new(NULL);
+		if (trace->fd_tables == NULL)
+			return NULL;
+	}
+
+	node = intlist__findnew(trace->fd_tables, pid);
+	if (node == NULL)
+		return NULL;
+
+	if (node->priv == NULL)
+		node->priv = fd_table__new(pid);
+
+	return node->priv;
+}
+
+static void trace__delete_fd_tables(struct trace *trace)
+{
+	struct int_node *node;
+
+	if (trace->fd_tables == NULL)
+		return;
+
+	intlist__for_each_entry(node, trace->fd_tables)
+		fd_table__delete(node->priv);
+
+	intlist__delete(trace->fd_tables);
+	trace->fd_tables = NULL;
+}
+
+static struct thread_trace *thread__trace(struct thread *thread, struct trace *trace)
 {
 	struct thread_trace *ttrace;
 
@@ -1022,9 +1329,12 @@ static struct thread_trace *thread__trace(struct thread *thread, FILE *fp)
 	ttrace = thread__priv(thread);
 	++ttrace->nr_events;
 
+	if (ttrace->files == NULL)
+		ttrace->files = trace__fd_table(trace, thread->pid_ != -1 ? thread->pid_ : thread->tid);
+
 	return ttrace;
 fail:
-	color_fprintf(fp, PERF_COLOR_RED,
+	color_fprintf(trace->output, PERF_COLOR_RED,
 		      "WARNING: not enough memory, dropping samples!\n");
 	return NULL;
 }
@@ -1043,51 +1353,25 @@ void syscall_arg__set_ret_scnprintf(struct syscall_arg *arg,
 
 static const size_t trace__entry_str_size = 2048;
 
-static struct file *thread_trace__files_entry(struct thread_trace *ttrace, int fd)
-{
-	if (fd < 0)
-		return NULL;
-
-	if (fd > ttrace->files.max) {
-		struct file *nfiles = realloc(ttrace->files.table, (fd + 1) * sizeof(struct file));
-
-		if (nfiles == NULL)
-			return NULL;
-
-		if (ttrace->files.max != -1) {
-			memset(nfiles + ttrace->files.max + 1, 0,
-			       (fd - ttrace->files.max) * sizeof(struct file));
-		} else {
-			memset(nfiles, 0, (fd + 1) * sizeof(struct file));
-		}
-
-		ttrace->files.table = nfiles;
-		ttrace->files.max   = fd;
-	}
-
-	return ttrace->files.table + fd;
-}
-
 struct file *thread__files_entry(struct thread *thread, int fd)
 {
-	return thread_trace__files_entry(thread__priv(thread), fd);
+	struct thread_trace *ttrace = thread__priv(thread);
+
+	return ttrace ? fd_table__find(ttrace->files, fd) : NULL;
 }
 
 static int trace__set_fd_pathname(struct thread *thread, int fd, const char *pathname)
 {
 	struct thread_trace *ttrace = thread__priv(thread);
-	struct file *file = thread_trace__files_entry(ttrace, fd);
+	struct file *file = fd_table__set(ttrace->files, fd, pathname);
+	struct stat st;
 
-	if (file != NULL) {
-		struct stat st;
-		if (stat(pathname, &st) == 0)
-			file->dev_maj = major(st.st_rdev);
-		file->pathname = strdup(pathname);
-		if (file->pathname)
-			return 0;
-	}
+	if (file == NULL)
+		return -1;
 
-	return -1;
+	if (stat(pathname, &st) == 0)
+		file->dev_maj = major(st.st_rdev);
+	return 0;
 }
 
 static int thread__read_fd_path(struct thread *thread, int fd)
@@ -1120,22 +1404,83 @@ static const char *thread__fd_path(struct thread *thread, int fd,
 				   struct trace *trace)
 {
 	struct thread_trace *ttrace = thread__priv(thread);
+	struct file *file;
 
-	if (ttrace == NULL)
+	if (ttrace == NULL || ttrace->files == NULL)
 		return NULL;
 
 	if (fd < 0)
 		return NULL;
 
-	if ((fd > ttrace->files.max || ttrace->files.table[fd].pathname == NULL)) {
+	file = fd_table__find(ttrace->files, fd);
+	if (file == NULL) {
 		if (!trace->live)
 			return NULL;
-		++trace->stats.proc_getname;
-		if (thread__read_fd_path(thread, fd))
-			return NULL;
+
+		if (!ttrace->files->seeded) {
+			fd_table__seed(ttrace->files, trace);
+			file = fd_table__find(ttrace->files, fd);
+		}
+
+		/* say a pipe, not opened by pathname */
+		if (file == NULL) {
+			++trace->stats.proc_getname;
+			if (thread__read_fd_path(thread, fd))
+				return NULL;
+			file = fd_table__find(ttrace->files, fd);
+		}
 	}
 
-	return ttrace->files.table[fd].pathname;
+	return file ? file->pathname : NULL;
+}
+
+/*
+ * Keep the fd table of the process in sync with what a syscall that
+ * succeeded, returning @ret, did to it.
+ */
+static void thread_trace__track_fd(struct thread_trace *ttrace, struct syscall *sc, long ret)
+{
+	struct fd_table *files = ttrace->files;
+	int fd = ttrace->fd_args[0];
+	struct file *file;
+	char *pathname;
+
+	if (ttrace->fd_sc != sc)
+		return;
+	ttrace->fd_sc = NULL;
+
+	switch (sc->fd_op) {
+	case SYSCALL_FD_CLOSE:
+		fd_table__remove(files, fd);
+		break;
+	case SYSCALL_FD_FCNTL:
+		if (ttrace->fd_args[1] != F_DUPFD && ttrace->fd_args[1] != F_DUPFD_CLOEXEC)
+			break;
+		/* fall through */
+	case SYSCALL_FD_DUP:
+		if (ret == fd)
+			break;
+		file = fd_table__find(files, fd);
+		pathname = file ? strdup(file->pathname) : NULL;
+		fd_table__remove(files, ret);
+		if (pathname) {
+			int dev_maj = file->dev_maj;
+
+			/* this may move the entries, file with them */
+			file = fd_table__set(files, ret, pathname);
+			if (file)
+				file->dev_maj = dev_maj;
+			free(pathname);
+		}
+		break;
+	case SYSCALL_FD_NEW:
+		/* read from /proc when asked */
+		fd_table__remove(files, ret);
+		break;
+	case SYSCALL_FD_NONE:
+	default:
+		break;
+	}
 }
 
 size_t syscall_arg__scnprintf_fd(char *bf, size_t size, struct syscall_arg *arg)
@@ -1174,8 +1519,8 @@ static size_t syscall_arg__scnprintf_close_fd(char *bf, size_t size,
 	size_t printed = syscall_arg__scnprintf_fd(bf, size, arg);
 	struct thread_trace *ttrace = thread__priv(arg->thread);
 
-	if (ttrace && fd >= 0 && fd <= ttrace->files.max)
-		zfree(&ttrace->files.table[fd].pathname);
+	if (ttrace)
+		fd_table__remove(ttrace->files, fd);
 
 	return printed;
 }
@@ -1216,11 +1561,11 @@ static bool trace__filter_duration(struct trace *trace, double t)
 	return t < (trace->duration_filter * NSEC_PER_MSEC);
 }
 
-static size_t __trace__fprintf_tstamp(struct trace *trace, u64 tstamp, FILE *fp)
+static size_t __trace__scnprintf_tstamp(struct trace *trace, u64 tstamp, char *bf, size_t size)
 {
 	double ts = (double)(tstamp - trace->base_time) / NSEC_PER_MSEC;
 
-	return fprintf(fp, "%10.3f ", ts);
+	return scnprintf(bf, size, "%10.3f ", ts);
 }
 
 /*
@@ -1229,12 +1574,20 @@ static size_t __trace__fprintf_tstamp(struct trace *trace, u64 tstamp, FILE *fp)
  * first having received a sys_enter ("poll" issued before tracing session
  * starts, lost sys_enter exit due to ring buffer overflow).
  */
-static size_t trace__fprintf_tstamp(struct trace *trace, u64 tstamp, FILE *fp)
+static size_t trace__scnprintf_tstamp(struct trace *trace, u64 tstamp, char *bf, size_t size)
 {
 	if (tstamp > 0)
-		return __trace__fprintf_tstamp(trace, tstamp, fp);
+		return __trace__scnprintf_tstamp(trace, tstamp, bf, size);
+
+	return scnprintf(bf, size, "         ? ");
+}
+
+static size_t trace__fprintf_tstamp(struct trace *trace, u64 tstamp, FILE *fp)
+{
+	char bf[64];
+	size_t printed = trace__scnprintf_tstamp(trace, tstamp, bf, sizeof(bf));
 
-	return fprintf(fp, "         ? ");
+	return fwrite(bf, 1, printed, fp);
 }
 
 static bool done = false;
@@ -1246,29 +1599,54 @@ static void sig_handler(int sig)
 	interrupted = sig == SIGINT;
 }
 
-static size_t trace__fprintf_comm_tid(struct trace *trace, struct thread *thread, FILE *fp)
+static size_t trace__scnprintf_comm_tid(struct trace *trace, struct thread *thread,
+					char *bf, size_t size)
 {
 	size_t printed = 0;
 
 	if (trace->multiple_threads) {
 		if (trace->show_comm)
-			printed += fprintf(fp, "%.14s/", thread__comm_str(thread));
-		printed += fprintf(fp, "%d ", thread->tid);
+			printed += scnprintf(bf, size, "%.14s/", thread__comm_str(thread));
+		printed += scnprintf(bf + printed, size - printed, "%d ", thread->tid);
 	}
 
 	return printed;
 }
 
-static size_t trace__fprintf_entry_head(struct trace *trace, struct thread *thread,
-					u64 duration, bool duration_calculated, u64 tstamp, FILE *fp)
+static size_t trace__fprintf_comm_tid(struct trace *trace, struct thread *thread, FILE *fp)
+{
+	char bf[64];
+	size_t printed = trace__scnprintf_comm_tid(trace, thread, bf, sizeof(bf));
+
+	return fwrite(bf, 1, printed, fp);
+}
+
+/* Large enough for the timestamp, duration, comm and tid */
+#define TRACE_ENTRY_HEAD_SIZE	128
+/* That, the args, up to trace__entry_str_size, and the return */
+#define TRACE_LINE_SIZE		4096
+
+static size_t trace__scnprintf_entry_head(struct trace *trace, struct thread *thread,
+					  u64 duration, bool duration_calculated, u64 tstamp,
+					  char *bf, size_t size)
 {
 	size_t printed = 0;
 
 	if (trace->show_tstamp)
-		printed = trace__fprintf_tstamp(trace, tstamp, fp);
+		printed = trace__scnprintf_tstamp(trace, tstamp, bf, size);
 	if (trace->show_duration)
-		printed += fprintf_duration(duration, duration_calculated, fp);
-	return printed + trace__fprintf_comm_tid(trace, thread, fp);
+		printed += scnprintf_duration(duration, duration_calculated, bf + printed, size - printed);
+	return printed + trace__scnprintf_comm_tid(trace, thread, bf + printed, size - printed);
+}
+
+static size_t trace__fprintf_entry_head(struct trace *trace, struct thread *thread,
+					u64 duration, bool duration_calculated, u64 tstamp, FILE *fp)
+{
+	char bf[TRACE_ENTRY_HEAD_SIZE];
+	size_t printed = trace__scnprintf_entry_head(trace, thread, duration, duration_calculated,
+						     tstamp, bf, sizeof(bf));
+
+	return fwrite(bf, 1, printed, fp);
 }
 
 static int trace__process_event(struct trace *trace, struct machine *machine,
@@ -1346,6 +1724,7 @@ static void trace__symbols__exit(struct trace *trace)
 {
 	machine__exit(trace->host);
 	trace->host = NULL;
+	trace__delete_fd_tables(trace);
 
 	symbol__exit();
 }
@@ -1472,10 +1851,36 @@ static int trace__read_syscall_info(struct trace *trace, int id)
 
 	sc->is_exit = !strcmp(name, "exit_group") || !strcmp(name, "exit");
 	sc->is_open = !strcmp(name, "open") || !strcmp(name, "openat");
+	sc->fd_op   = syscall__fd_op(name);
 
 	return syscall__set_arg_fmts(sc);
 }
 
+static u8 syscall__fd_op(const char *name)
+{
+	static const char * const new_fds[] = {
+		"socket", "accept", "accept4", "epoll_create", "epoll_create1",
+		"eventfd", "eventfd2", "signalfd", "signalfd4", "timerfd_create",
+		"inotify_init", "inotify_init1", "fanotify_init", "memfd_create",
+		"perf_event_open", "userfaultfd", "pidfd_open", "open_by_handle_at",
+	};
+	size_t i;
+
+	if (!strcmp(name, "close"))
+		return SYSCALL_FD_CLOSE;
+	if (!strcmp(name, "dup") || !strcmp(name, "dup2") || !strcmp(name, "dup3"))
+		return SYSCALL_FD_DUP;
+	if (!strcmp(name, "fcntl"))
+		return SYSCALL_FD_FCNTL;
+
+	for (i = 0; i < ARRAY_SIZE(new_fds); i++) {
+		if (!strcmp(name, new_fds[i]))
+			return SYSCALL_FD_NEW;
+	}
+
+	return SYSCALL_FD_NONE;
+}
+
 static int trace__validate_ev_qualifier(struct trace *trace)
 {
 	int err = 0, i;
@@ -1740,27 +2145,17 @@ out_cant_read:
 static void thread__update_stats(struct thread_trace *ttrace,
 				 int id, struct perf_sample *sample)
 {
-	struct int_node *inode;
-	struct stats *stats;
+	struct syscall_stats *ss = thread_trace__syscall_stats(ttrace, id);
 	u64 duration = 0;
 
-	inode = intlist__findnew(ttrace->syscall_stats, id);
-	if (inode == NULL)
+	if (ss == NULL)
 		return;
 
-	stats = inode->priv;
-	if (stats == NULL) {
-		stats = malloc(sizeof(struct stats));
-		if (stats == NULL)
-			return;
-		init_stats(stats);
-		inode->priv = stats;
-	}
-
 	if (ttrace->entry_time && sample->time > ttrace->entry_time)
 		duration = sample->time - ttrace->entry_time;
 
-	update_stats(stats, duration);
+	update_stats(&ss->stats, duration);
+	latency_hist__add(&ss->latency, duration);
 }
 
 static int trace__printf_interrupted_entry(struct trace *trace)
@@ -1852,7 +2247,7 @@ static int trace__sys_enter(struct trace *trace, struct perf_evsel *evsel,
 		return -1;
 
 	thread = machine__findnew_thread(trace->host, sample->pid, sample->tid);
-	ttrace = thread__trace(thread, trace->output);
+	ttrace = thread__trace(thread, trace);
 	if (ttrace == NULL)
 		goto out_put;
 
@@ -1901,6 +2296,15 @@ static int trace__sys_enter(struct trace *trace, struct perf_evsel *evsel,
 		ttrace->entry_pending = true;
 		/* See trace__vfs_getname & trace__sys_exit */
 		ttrace->filename.pending_open = false;
+		/* See thread_trace__track_fd */
+		ttrace->fd_sc = NULL;
+		if (sc->fd_op != SYSCALL_FD_NONE && args) {
+			struct syscall_arg arg = { .args = args, };
+
+			ttrace->fd_sc	   = sc;
+			ttrace->fd_args[0] = syscall_arg__val(&arg, 0);
+			ttrace->fd_args[1] = sc->fd_op == SYSCALL_FD_FCNTL ? syscall_arg__val(&arg, 1) : 0;
+		}
 	}
 
 	if (trace->current != thread) {
@@ -1928,7 +2332,7 @@ static int trace__fprintf_sys_enter(struct trace *trace, struct perf_evsel *evse
 		return -1;
 
 	thread = machine__findnew_thread(trace->host, sample->pid, sample->tid);
-	ttrace = thread__trace(thread, trace->output);
+	ttrace = thread__trace(thread, trace);
 	/*
 	 * We need to get ttrace just to make sure it is there when syscall__scnprintf_args()
 	 * and the rest of the beautifiers accessing it via struct syscall_arg touches it.
@@ -1994,12 +2398,14 @@ static int trace__sys_exit(struct trace *trace, struct perf_evsel *evsel,
 	int alignment = trace->args_alignment;
 	struct syscall *sc = trace__syscall_info(trace, evsel, id);
 	struct thread_trace *ttrace;
+	char line[TRACE_LINE_SIZE];
+	size_t len;
 
 	if (sc == NULL)
 		return -1;
 
 	thread = machine__findnew_thread(trace->host, sample->pid, sample->tid);
-	ttrace = thread__trace(thread, trace->output);
+	ttrace = thread__trace(thread, trace);
 	if (ttrace == NULL)
 		goto out_put;
 
@@ -2016,6 +2422,9 @@ static int trace__sys_exit(struct trace *trace, struct perf_evsel *evsel,
 		++trace->stats.vfs_getname;
 	}
 
+	if (ret >= 0)
+		thread_trace__track_fd(ttrace, sc, ret);
+
 	if (ttrace->entry_time) {
 		duration = sample->time - ttrace->entry_time;
 		if (trace__filter_duration(trace, duration))
@@ -2036,15 +2445,18 @@ static int trace__sys_exit(struct trace *trace, struct perf_evsel *evsel,
 	if (trace->summary_only || (ret >= 0 && trace->failure_only))
 		goto out;
 
-	trace__fprintf_entry_head(trace, thread, duration, duration_calculated, ttrace->entry_time, trace->output);
+	/* the whole line is formatted here and written at once */
+	len = trace__scnprintf_entry_head(trace, thread, duration, duration_calculated,
+					  ttrace->entry_time, line, sizeof(line));
 
 	if (ttrace->entry_pending) {
-		printed = fprintf(trace->output, "%s", ttrace->entry_str);
+		printed = scnprintf(line + len, sizeof(line) - len, "%s", ttrace->entry_str);
+		len += printed;
 	} else {
-		printed += fprintf(trace->output, " ... [");
-		color_fprintf(trace->output, PERF_COLOR_YELLOW, "continued");
-		printed += 9;
-		printed += fprintf(trace->output, "]: %s()", sc->name);
+		len += scnprintf(line + len, sizeof(line) - len, " ... [");
+		len += color_snprintf(line + len, sizeof(line) - len, PERF_COLOR_YELLOW, "continued");
+		len += scnprintf(line + len, sizeof(line) - len, "]: %s()", sc->name);
+		printed += 5 + 9 + 3 + strlen(sc->name) + 2;
 	}
 
 	printed++; /* the closing ')' */
@@ -2054,48 +2466,47 @@ static int trace__sys_exit(struct trace *trace, struct perf_evsel *evsel,
 	else
 		alignment = 0;
 
-	fprintf(trace->output, ")%*s= ", alignment, " ");
+	len += scnprintf(line + len, sizeof(line) - len, ")%*s= ", alignment, " ");
 
 	if (sc->fmt == NULL) {
 		if (ret < 0)
 			goto errno_print;
 signed_print:
-		fprintf(trace->output, "%ld", ret);
+		len += scnprintf(line + len, sizeof(line) - len, "%ld", ret);
 	} else if (ret < 0) {
 errno_print: {
 		char bf[STRERR_BUFSIZE];
 		const char *emsg = str_error_r(-ret, bf, sizeof(bf)),
 			   *e = errno_to_name(evsel, -ret);
 
-		fprintf(trace->output, "-1 %s (%s)", e, emsg);
+		len += scnprintf(line + len, sizeof(line) - len, "-1 %s (%s)", e, emsg);
 	}
 	} else if (ret == 0 && sc->fmt->timeout)
-		fprintf(trace->output, "0 (Timeout)");
+		len += scnprintf(line + len, sizeof(line) - len, "0 (Timeout)");
 	else if (ttrace->ret_scnprintf) {
-		char bf[1024];
 		struct syscall_arg arg = {
 			.val	= ret,
 			.thread	= thread,
 			.trace	= trace,
 		};
-		ttrace->ret_scnprintf(bf, sizeof(bf), &arg);
+		len += ttrace->ret_scnprintf(line + len, sizeof(line) - len, &arg);
 		ttrace->ret_scnprintf = NULL;
-		fprintf(trace->output, "%s", bf);
 	} else if (sc->fmt->hexret)
-		fprintf(trace->output, "%#lx", ret);
+		len += scnprintf(line + len, sizeof(line) - len, "%#lx", ret);
 	else if (sc->fmt->errpid) {
 		struct thread *child = machine__find_thread(trace->host, ret, ret);
 
 		if (child != NULL) {
-			fprintf(trace->output, "%ld", ret);
+			len += scnprintf(line + len, sizeof(line) - len, "%ld", ret);
 			if (child->comm_set)
-				fprintf(trace->output, " (%s)", thread__comm_str(child));
+				len += scnprintf(line + len, sizeof(line) - len, " (%s)", thread__comm_str(child));
 			thread__put(child);
 		}
 	} else
 		goto signed_print;
 
-	fputc('\n', trace->output);
+	len += scnprintf(line + len, sizeof(line) - len, "\n");
+	fwrite(line, 1, len, trace->output);
 
 	/*
 	 * We only consider an 'event' for the sake of --max-events a non-filtered
@@ -2186,7 +2597,7 @@ static int trace__sched_stat_runtime(struct trace *trace, struct perf_evsel *evs
 	struct thread *thread = machine__findnew_thread(trace->host,
 							sample->pid,
 							sample->tid);
-	struct thread_trace *ttrace = thread__trace(thread, trace->output);
+	struct thread_trace *ttrace = thread__trace(thread, trace);
 
 	if (ttrace == NULL)
 		goto out_dump;
@@ -2363,7 +2774,7 @@ static int trace__pgfault(struct trace *trace,
 		}
 	}
 
-	ttrace = thread__trace(thread, trace->output);
+	ttrace = thread__trace(thread, trace);
 	if (ttrace == NULL)
 		goto out_put;
 
@@ -2722,6 +3133,74 @@ static int trace__init_syscalls_bpf_map(struct trace *trace)
 
 	return __trace__init_syscalls_bpf_map(trace, enabled);
 }
+
+static void thread_trace__add_bpf_stats(struct thread_trace *ttrace, int id,
+					struct bpf_map_syscall_stats *value)
+{
+	struct syscall_stats *ss = thread_trace__syscall_stats(ttrace, id);
+	struct stats *stats;
+	unsigned int i;
+	double m2;
+
+	if (ss == NULL)
+		return;
+
+	/* The squares are of usecs, the M2 of update_stats() of nsecs */
+	stats	    = &ss->stats;
+	stats->n    = value->count;
+	stats->mean = (double)value->total / value->count;
+	m2 = (double)value->squares * NSEC_PER_USEC * NSEC_PER_USEC -
+	     stats->n * stats->mean * stats->mean;
+	stats->M2   = m2 > 0 ? m2 : 0;
+	stats->min  = value->min;
+	stats->max  = value->max;
+
+	/* Only the power of two is known, count them at its middle */
+	for (i = 0; i < ARRAY_SIZE(value->hist); i++) {
+		if (value->hist[i])
+			latency_hist__add_n(&ss->latency, (1ULL << i) + (1ULL << i) / 2,
+					    value->hist[i]);
+	}
+}
+
+/*
+ * Turn what was accrued in the syscalls_stats map into the per thread
+ * stats thread__update_stats() would have accrued from the events.
+ */
+static int trace__read_syscalls_bpf_stats(struct trace *trace)
+{
+	int fd = bpf_map__fd(trace->syscalls.stats_map);
+	struct bpf_map_syscall_stats_key key, *prev = NULL;
+	struct bpf_map_syscall_stats value;
+
+	while (bpf_map_get_next_key(fd, prev, &key) == 0) {
+		struct thread_trace *ttrace;
+		struct thread *thread;
+
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, &value) || value.count == 0 ||
+		    key.syscall < 0 ||
+		    trace__syscall_info(trace, NULL, key.syscall) == NULL)
+			continue;
+
+		thread = machine__findnew_thread(trace->host, -1, key.tid);
+		if (thread == NULL)
+			return -ENOMEM;
+
+		if (thread__priv(thread) == NULL)
+			thread__set_priv(thread, thread_trace__new());
+
+		ttrace = thread__priv(thread);
+		if (ttrace) {
+			ttrace->nr_events += value.count;
+			trace->nr_events  += value.count;
+			thread_trace__add_bpf_stats(ttrace, key.syscall, &value);
+		}
+		thread__put(thread);
+	}
+
+	return 0;
+}
 #else
 static int trace__set_ev_qualifier_bpf_filter(struct trace *trace __maybe_unused)
 {
@@ -2732,6 +3211,11 @@ static int trace__init_syscalls_bpf_map(struct trace *trace __maybe_unused)
 {
 	return 0;
 }
+
+static int trace__read_syscalls_bpf_stats(struct trace *trace __maybe_unused)
+{
+	return 0;
+}
 #endif // HAVE_LIBBPF_SUPPORT
 
 static int trace__set_ev_qualifier_filter(struct trace *trace)
@@ -2845,7 +3329,8 @@ static int trace__flush_events(struct trace *trace)
 	return !trace->sort_events ? 0 : __trace__flush_events(trace);
 }
 
-static int trace__deliver_event(struct trace *trace, union perf_event *event)
+static int trace__deliver_event(struct trace *trace, union perf_event *event,
+				unsigned int idx)
 {
 	int err;
 
@@ -2856,7 +3341,7 @@ static int trace__deliver_event(struct trace *trace, union perf_event *event)
 	if (err && err != -1)
 		return err;
 
-	err = ordered_events__queue(&trace->oe.data, event, trace->oe.last, 0);
+	err = ordered_events__queue_src(&trace->oe.data, event, trace->oe.last, 0, idx);
 	if (err)
 		return err;
 
@@ -3008,6 +3493,10 @@ static int trace__run(struct trace *trace, int argc, const char **argv)
 	if (err < 0)
 		goto out_error_mmap;
 
+	if (trace->sort_events &&
+	    ordered_events__set_sources(&trace->oe.data, evlist->nr_mmaps))
+		pr_debug("Couldn't allocate per mmap event queues.\n");
+
 	if (!target__none(&trace->opts.target) && !trace->opts.initial_delay)
 		perf_evlist__enable(evlist);
 
@@ -3048,7 +3537,7 @@ again:
 		while ((event = perf_mmap__read_event(md)) != NULL) {
 			++trace->nr_events;
 
-			err = trace__deliver_event(trace, event);
+			err = trace__deliver_event(trace, event, i);
 			if (err)
 				goto out_disable;
 
@@ -3090,6 +3579,9 @@ out_disable:
 		ordered_events__flush(&trace->oe.data, OE_FLUSH__FINAL);
 
 	if (!err) {
+		if (trace->syscalls.stats_map)
+			err = trace__read_syscalls_bpf_stats(trace);
+
 		if (trace->summary)
 			trace__fprintf_thread_summary(trace, trace->output);
 
@@ -3257,20 +3749,20 @@ static size_t trace__fprintf_threads_header(FILE *fp)
 }
 
 DEFINE_RESORT_RB(syscall_stats, a->msecs > b->msecs,
-	struct stats 	*stats;
+	struct syscall_stats *ss;
 	double		msecs;
 	int		syscall;
 )
 {
 	struct int_node *source = rb_entry(nd, struct int_node, rb_node);
-	struct stats *stats = source->priv;
+	struct syscall_stats *ss = source->priv;
 
 	entry->syscall = source->i;
-	entry->stats   = stats;
-	entry->msecs   = stats ? (u64)stats->n * (avg_stats(stats) / NSEC_PER_MSEC) : 0;
+	entry->ss      = ss;
+	entry->msecs   = ss ? (u64)ss->stats.n * (avg_stats(&ss->stats) / NSEC_PER_MSEC) : 0;
 }
 
-static size_t thread__dump_stats(struct thread_trace *ttrace,
+static size_t thread__dump_stats(struct thread *thread, struct thread_trace *ttrace,
 				 struct trace *trace, FILE *fp)
 {
 	size_t printed = 0;
@@ -3283,13 +3775,15 @@ static size_t thread__dump_stats(struct thread_trace *ttrace,
 
 	printed += fprintf(fp, "\n");
 
-	printed += fprintf(fp, "   syscall            calls    total       min       avg       max      stddev\n");
-	printed += fprintf(fp, "                               (msec)    (msec)    (msec)    (msec)        (%%)\n");
-	printed += fprintf(fp, "   --------------- -------- --------- --------- --------- ---------     ------\n");
+	printed += fprintf(fp, "   syscall            calls    total       min       avg       max      stddev       p50       p99      p999\n");
+	printed += fprintf(fp, "                               (msec)    (msec)    (msec)    (msec)        (%%)    (msec)    (msec)    (msec)\n");
+	printed += fprintf(fp, "   --------------- -------- --------- --------- --------- ---------     ------ --------- --------- ---------\n");
 
 	resort_rb__for_each_entry(nd, syscall_stats) {
-		struct stats *stats = syscall_stats_entry->stats;
-		if (stats) {
+		struct syscall_stats *ss = syscall_stats_entry->ss;
+		if (ss) {
+			struct stats *stats = &ss->stats;
+			struct latency_hist *latency = &ss->latency;
 			double min = (double)(stats->min) / NSEC_PER_MSEC;
 			double max = (double)(stats->max) / NSEC_PER_MSEC;
 			double avg = avg_stats(stats);
@@ -3303,7 +3797,19 @@ static size_t thread__dump_stats(struct thread_trace *ttrace,
 			printed += fprintf(fp, "   %-15s", sc->name);
 			printed += fprintf(fp, " %8" PRIu64 " %9.3f %9.3f %9.3f",
 					   n, syscall_stats_entry->msecs, min, avg);
-			printed += fprintf(fp, " %9.3f %9.2f%%\n", max, pct);
+			printed += fprintf(fp, " %9.3f %9.2f%%", max, pct);
+			printed += fprintf(fp, " %9.3f %9.3f %9.3f\n",
+					   (double)latency_hist__percentile(latency, 50) / NSEC_PER_MSEC,
+					   (double)latency_hist__percentile(latency, 99) / NSEC_PER_MSEC,
+					   (double)latency_hist__percentile(latency, 99.9) / NSEC_PER_MSEC);
+
+			if (trace->hist_output) {
+				char prefix[64];
+
+				scnprintf(prefix, sizeof(prefix), "%s,%d,%s,",
+					  thread__comm_str(thread), thread->tid, sc->name);
+				latency_hist__fprintf_csv(latency, prefix, trace->hist_output);
+			}
 		}
 	}
 
@@ -3336,7 +3842,7 @@ static size_t trace__fprintf_thread(FILE *fp, struct thread *thread, struct trac
 	else if (fputc('\n', fp) != EOF)
 		++printed;
 
-	printed += thread__dump_stats(ttrace, trace, fp);
+	printed += thread__dump_stats(thread, ttrace, trace, fp);
 
 	return printed;
 }
@@ -3433,6 +3939,20 @@ static int trace__open_output(struct trace *trace, const char *filename)
 	return trace->output == NULL ? -errno : 0;
 }
 
+/*
+ * The events are all written from the main thread: no stdio locking and,
+ * when not on a terminal, a buffer taking many lines per write.
+ */
+#define TRACE_OUTPUT_BUFSIZE	(1 << 20)
+
+static void trace__setup_output(struct trace *trace)
+{
+	__fsetlocking(trace->output, FSETLOCKING_BYCALLER);
+
+	if (!isatty(fileno(trace->output)))
+		setvbuf(trace->output, NULL, _IOFBF, TRACE_OUTPUT_BUFSIZE);
+}
+
 static int parse_pagefaults(const struct option *opt, const char *str,
 			    int unset __maybe_unused)
 {
@@ -3617,6 +4137,7 @@ static void trace__set_bpf_map_filtered_pids(struct trace *trace)
 static void trace__set_bpf_map_syscalls(struct trace *trace)
 {
 	trace->syscalls.map = bpf__find_map_by_name("syscalls");
+	trace->syscalls.stats_map = bpf__find_map_by_name("syscalls_stats");
 }
 
 static int trace__config(const char *var, const char *value, void *arg)
@@ -3693,6 +4214,7 @@ int cmd_trace(int argc, const char **argv)
 	};
 	const char *map_dump_str = NULL;
 	const char *output_name = NULL;
+	const char *hist_output_name = NULL;
 	const struct option trace_options[] = {
 	OPT_CALLBACK('e', "event", &trace, "event",
 		     "event/syscall selector. use 'perf list' to list available events",
@@ -3737,6 +4259,8 @@ int cmd_trace(int argc, const char **argv)
 		    "Show only syscall summary with statistics"),
 	OPT_BOOLEAN('S', "with-summary", &trace.summary,
 		    "Show all syscalls and summary with statistics"),
+	OPT_STRING(0, "summary-hist", &hist_output_name, "file",
+		   "Write the latency histograms of the summary to file, as CSV"),
 	OPT_CALLBACK_DEFAULT('F', "pf", &trace.trace_pgfaults, "all|maj|min",
 		     "Trace pagefaults", parse_pagefaults, "maj"),
 	OPT_BOOLEAN(0, "syscalls", &trace.trace_syscalls, "Trace syscalls"),
@@ -3937,6 +4461,10 @@ init_augmented_syscall_tp:
 	if (trace.summary_only)
 		trace.summary = trace.summary_only;
 
+	/* the histograms are written with the summary */
+	if (hist_output_name)
+		trace.summary = true;
+
 	if (!trace.trace_syscalls && !trace.trace_pgfaults &&
 	    trace.evlist->nr_entries == 0 /* Was --events used? */) {
 		trace.trace_syscalls = true;
@@ -3950,6 +4478,16 @@ init_augmented_syscall_tp:
 		}
 	}
 
+	if (hist_output_name != NULL) {
+		trace.hist_output = fopen(hist_output_name, "w");
+		if (trace.hist_output == NULL) {
+			perror("failed to create histogram output file");
+			err = -errno;
+			goto out_close;
+		}
+		fprintf(trace.hist_output, "comm,tid,syscall,lower_ns,upper_ns,count\n");
+	}
+
 	err = target__validate(&trace.opts.target);
 	if (err) {
 		target__strerror(&trace.opts.target, err, bf, sizeof(bf));
@@ -3967,12 +4505,16 @@ init_augmented_syscall_tp:
 	if (!argc && target__none(&trace.opts.target))
 		trace.opts.target.system_wide = true;
 
+	trace__setup_output(&trace);
+
 	if (input_name)
 		err = trace__replay(&trace);
 	else
 		err = trace__run(&trace, argc, argv);
 
 out_close:
+	if (trace.hist_output != NULL)
+		fclose(trace.hist_output);
 	if (output_name != NULL)
 		fclose(trace.output);
 out:
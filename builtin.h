@@ -11,6 +11,7 @@ void list_common_cmds_help(void);
 const char *help_unknown_cmd(const char *cmd);
 
 int cmd_annotate(int argc, const char **argv);
+int cmd_archive(int argc, const char **argv);
 int cmd_bench(int argc, const char **argv);
 int cmd_buildid_cache(int argc, const char **argv);
 int cmd_buildid_list(int argc, const char **argv);
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Count events per cgroup with a single set of per-CPU counters.
+ *
+ * Used by 'perf stat --bpf-counters', that sets up the maps below:
+ *
+ * perf stat -a --bpf-counters -e cycles,instructions -G A,B sleep 1
+ *
+ * At each context switch the counters of the CPU are read and what they
+ * counted since the previous switch is added to the cgroup the task going
+ * out was in and to its ancestors, those perf stat asked for.  It needs
+ * cgroup v2, the helpers only know of the ids of that hierarchy.
+ */
+
+#include <bpf.h>
+
+/* Must match BPF_CGROUP_MAX_EVENTS and BPF_CGROUP_MAX_LEVELS in util/bpf-cgroup.h */
+#define MAX_EVENTS	16
+#define MAX_LEVELS	8
+#define MAX_CGROUPS	512
+
+/* The counter fds, at cpu * MAX_EVENTS + event */
+bpf_map(events, PERF_EVENT_ARRAY, int, u32, __NR_CPUS__ * MAX_EVENTS);
+
+/* The index perf stat gave to the cgroups it wants, by their id */
+bpf_map(cgroup_idx, HASH, u64, u32, MAX_CGROUPS);
+
+/* The counts at the previous switch on this CPU */
+bpf_map(prev_readings, PERCPU_ARRAY, u32, struct bpf_perf_event_value, MAX_EVENTS);
+
+/* What was counted for each cgroup, at cgroup * MAX_EVENTS + event */
+bpf_map(cgroup_readings, PERCPU_ARRAY, u32, struct bpf_perf_event_value, MAX_CGROUPS * MAX_EVENTS);
+
+SEC("sched:sched_switch")
+int on_switch(void *args)
+{
+	u32 cgrps[MAX_LEVELS], nr_cgrps = 0;
+	u32 cpu = get_smp_processor_id();
+	int level, ev, i;
+
+	/* the task going out is still current */
+#pragma clang loop unroll(full)
+	for (level = 0; level < MAX_LEVELS; level++) {
+		u64 id = get_current_ancestor_cgroup_id(level);
+		u32 *idx;
+
+		if (id == 0)
+			break;
+
+		idx = bpf_map_lookup_elem(&cgroup_idx, &id);
+		if (idx)
+			cgrps[nr_cgrps++] = *idx;
+	}
+
+#pragma clang loop unroll(full)
+	for (ev = 0; ev < MAX_EVENTS; ev++) {
+		struct bpf_perf_event_value val, *prev;
+		u32 key = ev;
+
+		/* the events are set from the first */
+		if (perf_event_read_value(&events, cpu * MAX_EVENTS + ev, &val, sizeof(val)))
+			break;
+
+		prev = bpf_map_lookup_elem(&prev_readings, &key);
+		if (prev == NULL)
+			break;
+
+#pragma clang loop unroll(full)
+		for (i = 0; i < MAX_LEVELS; i++) {
+			struct bpf_perf_event_value *count;
+
+			if (i == nr_cgrps)
+				break;
+
+			key = cgrps[i] * MAX_EVENTS + ev;
+			count = bpf_map_lookup_elem(&cgroup_readings, &key);
+			if (count == NULL)
+				continue;
+
+			count->counter += val.counter - prev->counter;
+			count->enabled += val.enabled - prev->enabled;
+			count->running += val.running - prev->running;
+		}
+
+		*prev = val;
+	}
+
+	return 0;
+}
+
+license(GPL);
@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Aggregate the lock contentions in the kernel, by lock and callchain.
+ *
+ * Used by 'perf lock contention --bpf', that reads and empties the
+ * lock_stats map at each interval:
+ *
+ * perf lock contention -a --bpf -I 1000
+ *
+ * The start of the wait of each thread is kept at contention_begin, at
+ * contention_end the wait is accrued in lock_stats, keyed by the lock and
+ * the callchain of the begin, and nothing is written to the ring buffer.
+ * The tracepoints don't need lockdep nor lock_stat.
+ */
+
+#include <bpf.h>
+
+/* Must match BPF_LOCK_MAX_STACK in util/bpf-lock.h */
+#define MAX_STACK	16
+
+typedef u64 lock_stack_t[MAX_STACK];
+
+struct tstamp {
+	u64		time;
+	u64		lock;
+	int		stack_id;
+};
+
+bpf_map(tstamp, HASH, u32, struct tstamp, 16384);
+
+bpf_map(stacks, STACK_TRACE, u32, lock_stack_t, 16384);
+
+/* Must match struct bpf_lock_key and bpf_lock_stat in util/bpf-lock.h */
+struct contention_key {
+	u64		lock;
+	int		stack_id;
+	u32		pad;
+};
+
+struct contention_stat {
+	u64		count;
+	u64		total;
+	u64		max;
+	/* log2 histogram of the waits in nsecs, the last has the longer ones */
+	u64		hist[32];
+};
+
+bpf_map(lock_stats, HASH, struct contention_key, struct contention_stat, 16384);
+
+struct contention_begin_args {
+	unsigned long long common_tp_fields;
+	void		   *lock_addr;
+	unsigned int	   flags;
+};
+
+struct contention_end_args {
+	unsigned long long common_tp_fields;
+	void		   *lock_addr;
+	int		   ret;
+};
+
+static int (*bpf_get_current_pid_tgid)(void) = (void *)BPF_FUNC_get_current_pid_tgid;
+
+static unsigned int log2_u64(u64 v)
+{
+	unsigned int r = 0;
+
+	if (v >> 32) { v >>= 32; r += 32; }
+	if (v >> 16) { v >>= 16; r += 16; }
+	if (v >> 8)  { v >>= 8;  r += 8;  }
+	if (v >> 4)  { v >>= 4;  r += 4;  }
+	if (v >> 2)  { v >>= 2;  r += 2;  }
+	if (v >> 1)  r += 1;
+
+	return r < 31 ? r : 31;
+}
+
+SEC("lock:contention_begin")
+int contention_begin(struct contention_begin_args *args)
+{
+	u32 tid = bpf_get_current_pid_tgid();
+	struct tstamp *ts, new;
+
+	/* a mutex spinning then sleeping begins twice, keep the first */
+	ts = bpf_map_lookup_elem(&tstamp, &tid);
+	if (ts && ts->lock == (u64)(long)args->lock_addr)
+		return 0;
+
+	new.time     = ktime_get_ns();
+	new.lock     = (u64)(long)args->lock_addr;
+	new.stack_id = get_stackid(args, &stacks, 0);
+	bpf_map_update_elem(&tstamp, &tid, &new, BPF_ANY);
+	return 0;
+}
+
+SEC("lock:contention_end")
+int contention_end(struct contention_end_args *args)
+{
+	u32 tid = bpf_get_current_pid_tgid();
+	struct contention_key key = { .pad = 0, };
+	struct contention_stat *stat;
+	struct tstamp *ts;
+	u64 duration;
+
+	ts = bpf_map_lookup_elem(&tstamp, &tid);
+	if (ts == NULL)
+		return 0;
+
+	duration     = ktime_get_ns() - ts->time;
+	key.lock     = ts->lock;
+	key.stack_id = ts->stack_id;
+	bpf_map_delete_elem(&tstamp, &tid);
+
+	stat = bpf_map_lookup_elem(&lock_stats, &key);
+	if (stat == NULL) {
+		struct contention_stat zero = { .count = 0, };
+
+		bpf_map_update_elem(&lock_stats, &key, &zero, BPF_NOEXIST);
+		stat = bpf_map_lookup_elem(&lock_stats, &key);
+		if (stat == NULL)
+			return 0;
+	}
+
+	__sync_fetch_and_add(&stat->count, 1);
+	__sync_fetch_and_add(&stat->total, duration);
+	__sync_fetch_and_add(&stat->hist[log2_u64(duration) & 31], 1);
+	/* racy, a max a bit off is fine */
+	if (duration > stat->max)
+		stat->max = duration;
+
+	return 0;
+}
+
+license(GPL);
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Aggregate the 'perf trace --summary' syscall statistics in the kernel.
+ *
+ * Test it with:
+ *
+ * perf trace -s -e tools/perf/examples/bpf/syscall_summary.c find /usr > /dev/null
+ *
+ * The entry time of each thread is kept at sys_enter, at sys_exit the
+ * duration is accrued in the syscalls_stats map, keyed by thread and
+ * syscall, and nothing is written to the ring buffer, 'perf trace' reads
+ * the map when the session ends to print the summary.
+ */
+
+#include <unistd.h>
+#include <pid_filter.h>
+
+/* bpf-output associated map, so that 'perf trace' sets up the maps below */
+bpf_map(__augmented_syscalls__, PERF_EVENT_ARRAY, int, u32, __NR_CPUS__);
+
+struct syscall {
+	bool	enabled;
+};
+
+bpf_map(syscalls, ARRAY, int, struct syscall, 512);
+
+struct syscall_stats_key {
+	pid_t		tid;
+	int		syscall;
+};
+
+/* Must match struct bpf_map_syscall_stats in builtin-trace.c */
+struct syscall_stats {
+	u64		count;
+	u64		total;
+	u64		min;
+	u64		max;
+	/* of the durations in usecs, for the stddev */
+	u64		squares;
+	/* log2 histogram of the durations in nsecs, the last has the longer ones */
+	u64		hist[32];
+};
+
+bpf_map(syscalls_stats, HASH, struct syscall_stats_key, struct syscall_stats, 16384);
+
+struct syscall_entry {
+	u64		time;
+	long		syscall_nr;
+};
+
+bpf_map(syscalls_entry, HASH, pid_t, struct syscall_entry, 16384);
+
+struct syscall_enter_args {
+	unsigned long long common_tp_fields;
+	long		   syscall_nr;
+	unsigned long	   args[6];
+};
+
+struct syscall_exit_args {
+	unsigned long long common_tp_fields;
+	long		   syscall_nr;
+	long		   ret;
+};
+
+pid_filter(pids_filtered);
+
+static unsigned int log2_u64(u64 v)
+{
+	unsigned int r = 0;
+
+	if (v >> 32) { v >>= 32; r += 32; }
+	if (v >> 16) { v >>= 16; r += 16; }
+	if (v >> 8)  { v >>= 8;  r += 8;  }
+	if (v >> 4)  { v >>= 4;  r += 4;  }
+	if (v >> 2)  { v >>= 2;  r += 2;  }
+	if (v >> 1)  r += 1;
+
+	return r < 31 ? r : 31;
+}
+
+SEC("raw_syscalls:sys_enter")
+int sys_enter(struct syscall_enter_args *args)
+{
+	struct syscall_entry entry;
+	struct syscall *syscall;
+	pid_t tid = getpid();
+
+	if (pid_filter__has(&pids_filtered, tid))
+		return 0;
+
+	probe_read(&entry.syscall_nr, sizeof(entry.syscall_nr), &args->syscall_nr);
+
+	syscall = bpf_map_lookup_elem(&syscalls, &entry.syscall_nr);
+	if (syscall == NULL || !syscall->enabled)
+		return 0;
+
+	entry.time = ktime_get_ns();
+	bpf_map_update_elem(&syscalls_entry, &tid, &entry, BPF_ANY);
+	return 0;
+}
+
+SEC("raw_syscalls:sys_exit")
+int sys_exit(struct syscall_exit_args *args)
+{
+	struct syscall_stats_key key;
+	struct syscall_stats *stats;
+	struct syscall_entry *entry;
+	u64 duration, usecs;
+	pid_t tid = getpid();
+
+	entry = bpf_map_lookup_elem(&syscalls_entry, &tid);
+	if (entry == NULL)
+		return 0;
+
+	duration = ktime_get_ns() - entry->time;
+	key.tid	    = tid;
+	key.syscall = entry->syscall_nr;
+	bpf_map_delete_elem(&syscalls_entry, &tid);
+
+	stats = bpf_map_lookup_elem(&syscalls_stats, &key);
+	if (stats == NULL) {
+		struct syscall_stats zero = { .min = (u64)-1, };
+
+		bpf_map_update_elem(&syscalls_stats, &key, &zero, BPF_NOEXIST);
+		stats = bpf_map_lookup_elem(&syscalls_stats, &key);
+		if (stats == NULL)
+			return 0;
+	}
+
+	usecs = duration / 1000;
+	__sync_fetch_and_add(&stats->count, 1);
+	__sync_fetch_and_add(&stats->total, duration);
+	__sync_fetch_and_add(&stats->squares, usecs * usecs);
+	__sync_fetch_and_add(&stats->hist[log2_u64(duration) & 31], 1);
+	/* racy only between threads with the same tid, i.e. none */
+	if (duration < stats->min)
+		stats->min = duration;
+	if (duration > stats->max)
+		stats->max = duration;
+
+	return 0;
+}
+
+license(GPL);
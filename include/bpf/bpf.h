@@ -44,6 +44,7 @@ struct ____btf_map_##name __attribute__((section(".maps." #name), used)) \
 
 static int (*bpf_map_update_elem)(struct bpf_map *map, void *key, void *value, u64 flags) = (void *)BPF_FUNC_map_update_elem;
 static void *(*bpf_map_lookup_elem)(struct bpf_map *map, void *key) = (void *)BPF_FUNC_map_lookup_elem;
+static int (*bpf_map_delete_elem)(struct bpf_map *map, void *key) = (void *)BPF_FUNC_map_delete_elem;
 
 #define SEC(NAME) __attribute__((section(NAME),  used))
 
@@ -63,6 +64,13 @@ int _version SEC("version") = LINUX_VERSION_CODE;
 static int (*probe_read)(void *dst, int size, const void *unsafe_addr) = (void *)BPF_FUNC_probe_read;
 static int (*probe_read_str)(void *dst, int size, const void *unsafe_addr) = (void *)BPF_FUNC_probe_read_str;
 
+static u64 (*ktime_get_ns)(void) = (void *)BPF_FUNC_ktime_get_ns;
+
 static int (*perf_event_output)(void *, struct bpf_map *, int, void *, unsigned long) = (void *)BPF_FUNC_perf_event_output;
+static int (*perf_event_read_value)(struct bpf_map *map, u64 flags, struct bpf_perf_event_value *buf, u32 size) = (void *)BPF_FUNC_perf_event_read_value;
+
+static u32 (*get_smp_processor_id)(void) = (void *)BPF_FUNC_get_smp_processor_id;
+static int (*get_stackid)(void *ctx, struct bpf_map *map, u64 flags) = (void *)BPF_FUNC_get_stackid;
+static u64 (*get_current_ancestor_cgroup_id)(int level) = (void *)BPF_FUNC_get_current_ancestor_cgroup_id;
 
 #endif /* _PERF_BPF_H */
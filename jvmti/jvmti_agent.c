@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <syscall.h> /* for gettid() */
 #include <err.h>
@@ -42,6 +43,50 @@
 
 #define JIT_LANG "java"
 
+/* The writer drains the rings at least this often */
+#define JR_WRITER_PERIOD_NS	10000000
+
+/*
+ * The threads compiling the methods write their records to rings of their
+ * own, drained to the jitdump file by a writer thread, so the JVM startup
+ * doesn't wait for tens of thousands of writes. A record is built in the
+ * scratch buffer of the thread first, then copied to its ring.
+ *
+ * perf attaches a debug info record to the code load that follows it in
+ * the file, so the debug info of a method is only committed, and drained,
+ * with its code load.
+ */
+struct jr_thread {
+	struct jr_thread	*next;
+	char			*ring;		/* NULL to write synchronously */
+	uint64_t		size;		/* a power of 2 */
+	/* committed by the thread, drained by the writer */
+	volatile uint64_t	head;
+	volatile uint64_t	tail;
+	/* written by the thread */
+	uint64_t		pos;
+	char			*scratch;
+	size_t			scratch_size;
+};
+
+struct jvmti_agent {
+	FILE			*fp;
+	/* the threads list, tail and the rings of the threads */
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	pthread_cond_t		drained;
+	pthread_t		writer;
+	int			has_writer;
+	int			stop;
+	struct jr_thread	*threads;
+	size_t			ring_size;
+	int			drop_debug;
+	unsigned long		nr_dropped;
+	int			code_generation;
+};
+
+static __thread struct jr_thread *jr_self;
+
 static char jit_path[PATH_MAX];
 static void *marker_addr;
 
@@ -241,8 +286,218 @@ init_arch_timestamp(void)
 	use_arch_timestamp = 1;
 }
 
-void *jvmti_open(void)
+/*
+ * Write what the thread committed, with agent->lock held. The FILE lock
+ * keeps the records of the synchronous writes whole.
+ */
+static int jr_thread__drain(struct jvmti_agent *agent, struct jr_thread *t)
+{
+	uint64_t head = t->head, tail = t->tail, size = t->size;
+	char *ring = t->ring;
+	int ret = 0;
+
+	if (head == tail)
+		return 0;
+
+	pthread_mutex_unlock(&agent->lock);
+	/* read the records after head */
+	__sync_synchronize();
+
+	flockfile(agent->fp);
+	while (tail != head) {
+		uint64_t off = tail & (size - 1);
+		uint64_t len = head - tail;
+
+		if (len > size - off)
+			len = size - off;
+		if (fwrite_unlocked(ring + off, len, 1, agent->fp) != 1)
+			ret = -1;
+		tail += len;
+	}
+	funlockfile(agent->fp);
+
+	pthread_mutex_lock(&agent->lock);
+	t->tail = head;
+	if (ret)
+		warnx("jvmti: cannot write to jitdump file");
+	return 1;
+}
+
+static void *jr_writer(void *arg)
+{
+	struct jvmti_agent *agent = arg;
+	struct jr_thread *t;
+	struct timespec ts;
+	int stop, wrote;
+
+	pthread_mutex_lock(&agent->lock);
+	do {
+		stop = agent->stop;
+
+		wrote = 0;
+		for (t = agent->threads; t; t = t->next)
+			wrote |= jr_thread__drain(agent, t);
+		if (wrote)
+			fflush(agent->fp);
+		pthread_cond_broadcast(&agent->drained);
+
+		if (!stop) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += JR_WRITER_PERIOD_NS;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&agent->wake, &agent->lock, &ts);
+		}
+	} while (!stop);
+	pthread_mutex_unlock(&agent->lock);
+
+	return NULL;
+}
+
+/* Wait for the writer to drain what t committed, with agent->lock held */
+static void jr_thread__wait(struct jvmti_agent *agent, struct jr_thread *t,
+			    uint64_t len)
+{
+	while (t->pos + len - t->tail > t->size) {
+		pthread_cond_signal(&agent->wake);
+		pthread_cond_wait(&agent->drained, &agent->lock);
+	}
+}
+
+static struct jr_thread *jr_thread__get(struct jvmti_agent *agent)
+{
+	struct jr_thread *t = jr_self;
+
+	if (t)
+		return t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	if (agent->ring_size) {
+		t->ring = malloc(agent->ring_size);
+		if (!t->ring) {
+			free(t);
+			return NULL;
+		}
+		t->size = agent->ring_size;
+	}
+
+	pthread_mutex_lock(&agent->lock);
+	t->next = agent->threads;
+	agent->threads = t;
+	pthread_mutex_unlock(&agent->lock);
+
+	jr_self = t;
+	return t;
+}
+
+static void *jr_thread__scratch(struct jr_thread *t, size_t len)
+{
+	if (len > t->scratch_size) {
+		char *scratch = realloc(t->scratch, len);
+
+		if (!scratch)
+			return NULL;
+		t->scratch = scratch;
+		t->scratch_size = len;
+	}
+	return t->scratch;
+}
+
+/*
+ * Make room for a record bigger than the ring, moving what's not committed
+ * yet to a bigger one once the writer drained the rest.
+ */
+static int jr_thread__grow(struct jvmti_agent *agent, struct jr_thread *t,
+			   uint64_t len)
+{
+	uint64_t size = t->size, used, off;
+	char *ring;
+
+	used = t->pos - t->head;
+	while (size < used + len)
+		size *= 2;
+
+	ring = malloc(size);
+	if (!ring)
+		return -1;
+
+	pthread_mutex_lock(&agent->lock);
+	while (t->tail != t->head) {
+		pthread_cond_signal(&agent->wake);
+		pthread_cond_wait(&agent->drained, &agent->lock);
+	}
+
+	for (off = 0; off < used; off++)
+		ring[off] = t->ring[(t->head + off) & (t->size - 1)];
+
+	free(t->ring);
+	t->ring = ring;
+	t->size = size;
+	t->pos  = used;
+	t->head = t->tail = 0;
+	pthread_mutex_unlock(&agent->lock);
+	return 0;
+}
+
+/*
+ * Queue the record in the scratch buffer of t, committing it and what was
+ * queued before it, or drop it if that can be done rather than waiting.
+ */
+static int jr_emit(struct jvmti_agent *agent, struct jr_thread *t,
+		   uint64_t len, int commit, int can_drop)
 {
+	uint64_t off, part;
+	int ret = 0;
+
+	if (!t->ring) {
+		flockfile(agent->fp);
+		if (fwrite_unlocked(t->scratch, len, 1, agent->fp) != 1)
+			ret = -1;
+		funlockfile(agent->fp);
+		return ret;
+	}
+
+	if (t->pos + len - t->tail > t->size) {
+		if (can_drop) {
+			__sync_fetch_and_add(&agent->nr_dropped, 1);
+			return 0;
+		}
+		if (t->pos - t->head + len > t->size) {
+			if (jr_thread__grow(agent, t, len))
+				return -1;
+		} else {
+			pthread_mutex_lock(&agent->lock);
+			jr_thread__wait(agent, t, len);
+			pthread_mutex_unlock(&agent->lock);
+		}
+	}
+
+	off = t->pos & (t->size - 1);
+	part = t->size - off;
+	if (part > len)
+		part = len;
+	memcpy(t->ring + off, t->scratch, part);
+	memcpy(t->ring, t->scratch + part, len - part);
+	t->pos += len;
+
+	if (commit) {
+		/* the records before head */
+		__sync_synchronize();
+		t->head = t->pos;
+		if (t->head - t->tail > t->size / 2)
+			pthread_cond_signal(&agent->wake);
+	}
+	return 0;
+}
+
+void *jvmti_open(const struct jvmti_agent_opts *opts)
+{
+	struct jvmti_agent *agent;
 	char dump_path[PATH_MAX];
 	struct jitheader header;
 	int fd, ret;
@@ -295,7 +550,7 @@ void *jvmti_open(void)
 	if (!fp) {
 		warn("jvmti: cannot create %s", dump_path);
 		close(fd);
-		goto error;
+		return NULL;
 	}
 
 	warnx("jvmti: jitdump in %s", dump_path);
@@ -319,59 +574,112 @@ void *jvmti_open(void)
 		warn("jvmti: cannot write dumpfile header");
 		goto error;
 	}
-	return fp;
+
+	agent = calloc(1, sizeof(*agent));
+	if (!agent)
+		goto error;
+
+	agent->fp = fp;
+	agent->drop_debug = opts->drop_debug;
+	agent->code_generation = 1;
+	pthread_mutex_init(&agent->lock, NULL);
+	pthread_cond_init(&agent->wake, NULL);
+	pthread_cond_init(&agent->drained, NULL);
+
+	if (opts->ring_size) {
+		agent->ring_size = 4096;
+		while (agent->ring_size < opts->ring_size)
+			agent->ring_size *= 2;
+
+		if (pthread_create(&agent->writer, NULL, jr_writer, agent)) {
+			warnx("jvmti: cannot start the writer thread, writing synchronously");
+			agent->ring_size = 0;
+		} else {
+			agent->has_writer = 1;
+		}
+	}
+
+	return agent;
 error:
 	fclose(fp);
 	return NULL;
 }
 
 int
-jvmti_close(void *agent)
+jvmti_close(void *arg)
 {
+	struct jvmti_agent *agent = arg;
 	struct jr_code_close rec;
-	FILE *fp = agent;
+	struct jr_thread *t;
+	int ret = 0;
 
-	if (!fp) {
+	if (!agent) {
 		warnx("jvmti: invalid fd in close_agent");
 		return -1;
 	}
 
+	/* the writer drains the rings before it stops */
+	if (agent->has_writer) {
+		pthread_mutex_lock(&agent->lock);
+		agent->stop = 1;
+		pthread_cond_signal(&agent->wake);
+		pthread_mutex_unlock(&agent->lock);
+		pthread_join(agent->writer, NULL);
+	}
+
+	if (agent->nr_dropped)
+		warnx("jvmti: dropped the debug info of %lu methods", agent->nr_dropped);
+
 	rec.p.id = JIT_CODE_CLOSE;
 	rec.p.total_size = sizeof(rec);
 
 	rec.p.timestamp = perf_get_timestamp();
 
-	if (!fwrite(&rec, sizeof(rec), 1, fp))
-		return -1;
-
-	fclose(fp);
+	if (!fwrite(&rec, sizeof(rec), 1, agent->fp))
+		ret = -1;
 
-	fp = NULL;
+	fclose(agent->fp);
 
 	perf_close_marker_file();
 
-	return 0;
+	while ((t = agent->threads)) {
+		agent->threads = t->next;
+		free(t->ring);
+		free(t->scratch);
+		free(t);
+	}
+	jr_self = NULL;
+	pthread_cond_destroy(&agent->drained);
+	pthread_cond_destroy(&agent->wake);
+	pthread_mutex_destroy(&agent->lock);
+	free(agent);
+
+	return ret;
 }
 
 int
-jvmti_write_code(void *agent, char const *sym,
+jvmti_write_code(void *arg, char const *sym,
 	uint64_t vma, void const *code, unsigned int const size)
 {
-	static int code_generation = 1;
+	struct jvmti_agent *agent = arg;
 	struct jr_code_load rec;
+	struct jr_thread *t;
 	size_t sym_len;
-	FILE *fp = agent;
-	int ret = -1;
+	char *buf;
 
 	/* don't care about 0 length function, no samples */
 	if (size == 0)
 		return 0;
 
-	if (!fp) {
+	if (!agent) {
 		warnx("jvmti: invalid fd in write_native_code");
 		return -1;
 	}
 
+	t = jr_thread__get(agent);
+	if (!t)
+		return -1;
+
 	sym_len = strlen(sym) + 1;
 
 	rec.p.id           = JIT_CODE_LOAD;
@@ -387,39 +695,35 @@ jvmti_write_code(void *agent, char const *sym,
 	if (code)
 		rec.p.total_size += size;
 
-	/*
-	 * If JVM is multi-threaded, nultiple concurrent calls to agent
-	 * may be possible, so protect file writes
-	 */
-	flockfile(fp);
+	buf = jr_thread__scratch(t, rec.p.total_size);
+	if (!buf)
+		return -1;
 
 	/*
-	 * get code index inside lock to avoid race condition
+	 * If JVM is multi-threaded, nultiple concurrent calls to agent
+	 * may be possible, so the code index is taken atomically
 	 */
-	rec.code_index = code_generation++;
-
-	ret = fwrite_unlocked(&rec, sizeof(rec), 1, fp);
-	fwrite_unlocked(sym, sym_len, 1, fp);
+	rec.code_index = __sync_fetch_and_add(&agent->code_generation, 1);
 
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), sym, sym_len);
 	if (code)
-		fwrite_unlocked(code, size, 1, fp);
-
-	funlockfile(fp);
+		memcpy(buf + sizeof(rec) + sym_len, code, size);
 
-	ret = 0;
-
-	return ret;
+	return jr_emit(agent, t, rec.p.total_size, 1, 0);
 }
 
 int
-jvmti_write_debug_info(void *agent, uint64_t code,
+jvmti_write_debug_info(void *arg, uint64_t code,
     int nr_lines, jvmti_line_info_t *li,
     const char * const * file_names)
 {
+	struct jvmti_agent *agent = arg;
 	struct jr_code_debug_info rec;
-	size_t sret, len, size, flen = 0;
+	size_t len, size, flen = 0;
+	struct jr_thread *t;
 	uint64_t addr;
-	FILE *fp = agent;
+	char *buf, *p;
 	int i;
 
 	/*
@@ -428,11 +732,15 @@ jvmti_write_debug_info(void *agent, uint64_t code,
 	if (!nr_lines)
 		return 0;
 
-	if (!fp) {
+	if (!agent) {
 		warnx("jvmti: invalid fd in write_debug_info");
 		return -1;
 	}
 
+	t = jr_thread__get(agent);
+	if (!t)
+		return -1;
+
 	for (i = 0; i < nr_lines; ++i) {
 	    flen += strlen(file_names[i]) + 1;
 	}
@@ -454,41 +762,33 @@ jvmti_write_debug_info(void *agent, uint64_t code,
 	size += flen;
 	rec.p.total_size = size;
 
-	/*
-	 * If JVM is multi-threaded, nultiple concurrent calls to agent
-	 * may be possible, so protect file writes
-	 */
-	flockfile(fp);
+	buf = jr_thread__scratch(t, size);
+	if (!buf)
+		return -1;
 
-	sret = fwrite_unlocked(&rec, sizeof(rec), 1, fp);
-	if (sret != 1)
-		goto error;
+	memcpy(buf, &rec, sizeof(rec));
+	p = buf + sizeof(rec);
 
 	for (i = 0; i < nr_lines; i++) {
 
 		addr = (uint64_t)li[i].pc;
 		len  = sizeof(addr);
-		sret = fwrite_unlocked(&addr, len, 1, fp);
-		if (sret != 1)
-			goto error;
+		memcpy(p, &addr, len);
+		p += len;
 
 		len  = sizeof(li[0].line_number);
-		sret = fwrite_unlocked(&li[i].line_number, len, 1, fp);
-		if (sret != 1)
-			goto error;
+		memcpy(p, &li[i].line_number, len);
+		p += len;
 
 		len  = sizeof(li[0].discrim);
-		sret = fwrite_unlocked(&li[i].discrim, len, 1, fp);
-		if (sret != 1)
-			goto error;
+		memcpy(p, &li[i].discrim, len);
+		p += len;
 
-		sret = fwrite_unlocked(file_names[i], strlen(file_names[i]) + 1, 1, fp);
-		if (sret != 1)
-			goto error;
+		len  = strlen(file_names[i]) + 1;
+		memcpy(p, file_names[i], len);
+		p += len;
 	}
-	funlockfile(fp);
-	return 0;
-error:
-	funlockfile(fp);
-	return -1;
+
+	/* committed with the code load that follows */
+	return jr_emit(agent, t, size, 0, agent->drop_debug);
 }
@@ -17,7 +17,17 @@ typedef struct {
 	jmethodID	methodID;
 } jvmti_line_info_t;
 
-void *jvmti_open(void);
+/*
+ * The agent options, as in -agentpath:libperf-jvmti.so=ring=1M,drop-debug
+ */
+struct jvmti_agent_opts {
+	/* of the ring of each thread, 0 to write the records synchronously */
+	size_t	ring_size;
+	/* drop the debug info of a method rather than wait for the writer */
+	int	drop_debug;
+};
+
+void *jvmti_open(const struct jvmti_agent_opts *opts);
 int   jvmti_close(void *agent);
 int   jvmti_write_code(void *agent, char const *symbol_name,
 		       uint64_t vma, void const *code,
@@ -13,6 +13,9 @@
 
 #include "jvmti_agent.h"
 
+/* The default ring of the records of each thread */
+#define JVMTI_RING_SIZE	(256 * 1024)
+
 static int has_line_numbers;
 void *jvmti_agent;
 
@@ -348,16 +351,70 @@ code_generated_cb(jvmtiEnv *jvmti,
 		warnx("jvmti: write_code() failed for code_generated");
 }
 
+/* ring=<size>[KMG] per thread, 0 to write synchronously, and drop-debug */
+static int parse_options(const char *options, struct jvmti_agent_opts *opts)
+{
+	char *str, *tok, *saveptr = NULL, *end;
+	int ret = 0;
+
+	opts->ring_size = JVMTI_RING_SIZE;
+	opts->drop_debug = 0;
+
+	if (!options)
+		return 0;
+
+	str = strdup(options);
+	if (!str)
+		return -1;
+
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (!strncmp(tok, "ring=", 5)) {
+			opts->ring_size = strtoul(tok + 5, &end, 0);
+			switch (*end) {
+			case 'G': case 'g':
+				opts->ring_size <<= 10;
+				/* fall through */
+			case 'M': case 'm':
+				opts->ring_size <<= 10;
+				/* fall through */
+			case 'K': case 'k':
+				opts->ring_size <<= 10;
+				end++;
+				/* fall through */
+			default:
+				break;
+			}
+			if (*end || end == tok + 5) {
+				warnx("jvmti: invalid ring size %s", tok + 5);
+				ret = -1;
+			}
+		} else if (!strcmp(tok, "drop-debug")) {
+			opts->drop_debug = 1;
+		} else {
+			warnx("jvmti: unknown option %s", tok);
+			ret = -1;
+		}
+	}
+
+	free(str);
+	return ret;
+}
+
 JNIEXPORT jint JNICALL
 Agent_OnLoad(JavaVM *jvm, char *options, void *reserved __maybe_unused)
 {
+	struct jvmti_agent_opts opts;
 	jvmtiEventCallbacks cb;
 	jvmtiCapabilities caps1;
 	jvmtiJlocationFormat format;
 	jvmtiEnv *jvmti = NULL;
 	jint ret;
 
-	jvmti_agent = jvmti_open();
+	if (parse_options(options, &opts))
+		return -1;
+
+	jvmti_agent = jvmti_open(&opts);
 	if (!jvmti_agent) {
 		warnx("jvmti: open_agent failed");
 		return -1;
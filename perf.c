@@ -46,6 +46,9 @@ struct cmd_struct {
 };
 
 static struct cmd_struct commands[] = {
+#ifdef HAVE_ZSTD_SUPPORT
+	{ "archive",	cmd_archive,	0 },
+#endif
 	{ "buildid-cache", cmd_buildid_cache, 0 },
 	{ "buildid-list", cmd_buildid_list, 0 },
 	{ "config",	cmd_config,	0 },
@@ -58,6 +58,7 @@ struct record_opts {
 	bool	     full_auxtrace;
 	bool	     auxtrace_snapshot_mode;
 	bool	     record_namespaces;
+	bool	     record_cgroup;
 	bool	     record_switch_events;
 	bool	     all_kernel;
 	bool	     all_user;
@@ -85,6 +86,13 @@ struct record_opts {
 	u64          clockid_res_ns;
 	int	     nr_cblocks;
 	int	     affinity;
+	int	     threads_spec;
+	int	     comp_level;
+	int	     mmap_flush;
+	int	     mmap_huge;
+	bool	     io_uring;
+	unsigned int nr_threads_synthesize;
+	bool	     lazy_mmaps;
 };
 
 enum perf_affinity {
@@ -94,6 +102,15 @@ enum perf_affinity {
 	PERF_AFFINITY_MAX
 };
 
+enum perf_thread_spec {
+	THREAD_SPEC__UNDEFINED = 0,
+	THREAD_SPEC__CPU,
+	THREAD_SPEC__CORE,
+	THREAD_SPEC__SOCKET,
+	THREAD_SPEC__NUMA,
+	THREAD_SPEC__MAX
+};
+
 struct option;
 extern const char * const *record_usage;
 extern struct option *record_options;
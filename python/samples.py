@@ -0,0 +1,27 @@
+#! /usr/bin/python
+# SPDX-License-Identifier: GPL-2.0
+# -*- python -*-
+# -*- coding: utf-8 -*-
+#   samples - the samples of a perf.data file, by batches of columns
+
+import sys
+import perf
+
+def main(path = "perf.data"):
+	session = perf.session(path)
+	names = session.event_names()
+	nr = [0] * len(names)
+	periods = [0] * len(names)
+
+	for batch in session.samples(fields = ["evsel", "period"]):
+		# memoryview(), or numpy.frombuffer(), of the columns
+		evsels = memoryview(batch["evsel"])
+		for i, period in enumerate(memoryview(batch["period"])):
+			nr[evsels[i]] += 1
+			periods[evsels[i]] += period
+
+	for i, name in enumerate(names):
+		print("%-32s %12d samples %16d period" % (name, nr[i], periods[i]))
+
+if __name__ == '__main__':
+	main(*sys.argv[1:])
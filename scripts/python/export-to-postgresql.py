@@ -763,3 +763,17 @@ def call_return_table(cr_id, thread_id, comm_id, call_path_id, call_time, return
 	fmt = "!hiqiqiqiqiqiqiqiqiqiqiiiq"
 	value = struct.pack(fmt, 12, 8, cr_id, 8, thread_id, 8, comm_id, 8, call_path_id, 8, call_time, 8, return_time, 8, branch_count, 8, call_id, 8, return_id, 8, parent_call_path_id, 4, flags, 8, parent_id)
 	call_file.write(value)
+
+def table_batch(fmt, rows, fn):
+	s = struct.Struct(fmt)
+	for offset in range(0, len(rows), s.size):
+		fn(*s.unpack_from(rows, offset))
+
+def sample_table_batch(fmt, rows):
+	table_batch(fmt, rows, sample_table)
+
+def call_path_table_batch(fmt, rows):
+	table_batch(fmt, rows, call_path_table)
+
+def call_return_table_batch(fmt, rows):
+	table_batch(fmt, rows, call_return_table)
@@ -465,3 +465,27 @@ def call_path_table(*x):
 
 def call_return_table(*x):
 	bind_exec(call_query, 12, x)
+
+# Rows exported in batches are inserted a few hundred at a time
+def insert_rows(table, fmt, rows, columns=None):
+	s = struct.Struct(fmt)
+	values = []
+	for offset in range(0, len(rows), s.size):
+		x = s.unpack_from(rows, offset)
+		if columns:
+			x = [x[i] for i in columns]
+		values.append("(" + ",".join([str(xx) for xx in x]) + ")")
+	for i in range(0, len(values), 500):
+		do_query(query, "INSERT INTO " + table + " VALUES " + ",".join(values[i:i + 500]))
+
+def sample_table_batch(fmt, rows):
+	if branches:
+		insert_rows("samples", fmt, rows, list(range(0, 15)) + list(range(19, 22)))
+	else:
+		insert_rows("samples", fmt, rows)
+
+def call_path_table_batch(fmt, rows):
+	insert_rows("call_paths", fmt, rows)
+
+def call_return_table_batch(fmt, rows):
+	insert_rows("calls", fmt, rows)
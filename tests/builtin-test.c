@@ -25,6 +25,8 @@
 #include <subcmd/exec-cmd.h>
 
 static bool dont_fork;
+/* run the timed workloads of tests/shell/regression instead */
+static bool regression;
 
 struct test __weak arch_tests[] = {
 	{
@@ -289,6 +291,10 @@ static struct test generic_tests[] = {
 		.desc = "mem2node",
 		.func = test__mem2node,
 	},
+	{
+		.desc = "Ordered events per source queues",
+		.func = test__ordered_events,
+	},
 	{
 		.func = NULL,
 	},
@@ -446,7 +452,8 @@ static const char *shell_tests__dir(char *path, size_t size)
 	for (i = 0; i < ARRAY_SIZE(devel_dirs); ++i) {
 		struct stat st;
 		if (!lstat(devel_dirs[i], &st)) {
-			scnprintf(path, size, "%s/shell", devel_dirs[i]);
+			scnprintf(path, size, "%s/shell%s", devel_dirs[i],
+				  regression ? "/regression" : "");
 			if (!lstat(devel_dirs[i], &st))
 				return path;
 		}
@@ -454,7 +461,8 @@ static const char *shell_tests__dir(char *path, size_t size)
 
         /* Then installed path. */
         exec_path = get_argv_exec_path();
-        scnprintf(path, size, "%s/tests/shell", exec_path);
+        scnprintf(path, size, "%s/tests/shell%s", exec_path,
+		  regression ? "/regression" : "");
 	free(exec_path);
 	return path;
 }
@@ -554,6 +562,9 @@ static int __cmd_test(int argc, const char *argv[], struct intlist *skiplist)
 	int i = 0;
 	int width = shell_tests__max_desc_width();
 
+	if (regression)
+		return run_shell_tests(argc, argv, 0, width);
+
 	for_each_test(j, t) {
 		int len = strlen(t->desc);
 
@@ -659,6 +670,9 @@ static int perf_test__list(int argc, const char **argv)
 	struct test *t;
 	int i = 0;
 
+	if (regression)
+		return perf_test__list_shell(argc, argv, 0);
+
 	for_each_test(j, t) {
 		int curr = i++;
 
@@ -690,12 +704,23 @@ int cmd_test(int argc, const char **argv)
 	NULL,
 	};
 	const char *skip = NULL;
+	const char *baseline = NULL, *results = NULL;
+	unsigned int tolerance = 10;
+	char tolerance_str[16];
 	const struct option test_options[] = {
 	OPT_STRING('s', "skip", &skip, "tests", "tests to skip"),
 	OPT_INCR('v', "verbose", &verbose,
 		    "be more verbose (show symbol address, etc)"),
 	OPT_BOOLEAN('F', "dont-fork", &dont_fork,
 		    "Do not fork for testcase"),
+	OPT_BOOLEAN('R', "regression", &regression,
+		    "Run the performance regression tests instead"),
+	OPT_STRING(0, "baseline", &baseline, "file",
+		   "Timings to compare the regression tests with, from --results"),
+	OPT_STRING(0, "results", &results, "file",
+		   "Add the timings of the regression tests to file, as CSV"),
+	OPT_UINTEGER(0, "tolerance", &tolerance,
+		     "Percent slower than the baseline a regression test still passes, default 10"),
 	OPT_END()
 	};
 	const char * const test_subcommands[] = { "list", NULL };
@@ -709,6 +734,14 @@ int cmd_test(int argc, const char **argv)
 	if (argc >= 1 && !strcmp(argv[0], "list"))
 		return perf_test__list(argc - 1, argv + 1);
 
+	/* for tests/shell/lib/regression.sh */
+	if (baseline)
+		setenv("PERF_TEST_BASELINE", baseline, 1);
+	if (results)
+		setenv("PERF_TEST_RESULTS", results, 1);
+	scnprintf(tolerance_str, sizeof(tolerance_str), "%u", tolerance);
+	setenv("PERF_TEST_TOLERANCE", tolerance_str, 1);
+
 	symbol_conf.priv_size = sizeof(int);
 	symbol_conf.sort_by_name = true;
 	symbol_conf.try_vmlinux_path = true;
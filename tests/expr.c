@@ -18,6 +18,8 @@ int test__expr(struct test *t __maybe_unused, int subtest __maybe_unused)
 {
 	const char *p;
 	const char **other;
+	struct expr_prog *prog;
+	double vals[2];
 	double val;
 	int i, ret;
 	struct parse_ctx ctx;
@@ -49,6 +51,22 @@ int test__expr(struct test *t __maybe_unused, int subtest __maybe_unused)
 	ret = expr__parse(&val, &ctx, &p);
 	TEST_ASSERT_VAL("missing operand", ret == 1);
 
+	p = "FOO * 2 + BAR if BAR else FOO";
+	prog = expr__compile(&ctx, &p);
+	TEST_ASSERT_VAL("compile", prog != NULL);
+	vals[0] = 3;
+	vals[1] = 4;
+	TEST_ASSERT_VAL("eval", expr__eval(prog, vals, &val) == 0 && val == 10);
+	vals[1] = 0;
+	TEST_ASSERT_VAL("eval", expr__eval(prog, vals, &val) == 0 && val == 3);
+	free(prog);
+
+	p = "FOO / BAR";
+	prog = expr__compile(&ctx, &p);
+	TEST_ASSERT_VAL("compile", prog != NULL);
+	TEST_ASSERT_VAL("eval division by zero", expr__eval(prog, vals, &val) == -1);
+	free(prog);
+
 	TEST_ASSERT_VAL("find other",
 			expr__find_other("FOO + BAR + BAZ + BOZO", "FOO", &other, &num_other) == 0);
 	TEST_ASSERT_VAL("find other", num_other == 3);
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <linux/compiler.h>
+#include <linux/kernel.h>
+#include "event.h"
+#include "ordered-events.h"
+#include "tests.h"
+#include "debug.h"
+
+/* timestamps, queued per source in the order below */
+static u64 test_times[][4] = {
+	{  10,  40,  38,  90 },	/* 38 goes back in time */
+	{   5,  50,  60,  70 },
+	{  30,  35,  80, 100 },
+};
+
+struct test_oe {
+	struct ordered_events	oe;
+	u64			last;
+	int			nr;
+	bool			ordered;
+};
+
+static int test_oe__deliver(struct ordered_events *oe,
+			    struct ordered_event *event)
+{
+	struct test_oe *t = container_of(oe, struct test_oe, oe);
+
+	if (event->timestamp < t->last)
+		t->ordered = false;
+
+	t->last = event->timestamp;
+	t->nr++;
+	return 0;
+}
+
+static int test_oe__queue(struct test_oe *t, union perf_event *event, int col)
+{
+	unsigned int src;
+
+	for (src = 0; src < ARRAY_SIZE(test_times); src++) {
+		if (ordered_events__queue_src(&t->oe, event, test_times[src][col], 0, src))
+			return -1;
+	}
+
+	return 0;
+}
+
+int test__ordered_events(struct test *test __maybe_unused, int subtest __maybe_unused)
+{
+	union perf_event event = {
+		.header = {
+			.type = PERF_RECORD_SAMPLE,
+			.size = sizeof(struct perf_event_header),
+		},
+	};
+	struct test_oe t = {
+		.ordered = true,
+	};
+	int i;
+
+	ordered_events__init(&t.oe, test_oe__deliver, NULL);
+
+	TEST_ASSERT_VAL("failed to set sources",
+			!ordered_events__set_sources(&t.oe, ARRAY_SIZE(test_times)));
+
+	for (i = 0; i < 2; i++)
+		TEST_ASSERT_VAL("failed to queue", !test_oe__queue(&t, &event, i));
+
+	TEST_ASSERT_VAL("wrong first time", ordered_events__first_time(&t.oe) == 5);
+
+	TEST_ASSERT_VAL("failed to flush", !ordered_events__flush_time(&t.oe, 35));
+	TEST_ASSERT_VAL("wrong flushed count", t.nr == 4);
+	TEST_ASSERT_VAL("wrong last flushed", t.last == 35);
+
+	for (i = 2; i < 4; i++)
+		TEST_ASSERT_VAL("failed to queue", !test_oe__queue(&t, &event, i));
+
+	TEST_ASSERT_VAL("failed to flush", !ordered_events__flush(&t.oe, OE_FLUSH__FINAL));
+	TEST_ASSERT_VAL("wrong flushed count", t.nr == 12);
+	TEST_ASSERT_VAL("events not ordered", t.ordered);
+	TEST_ASSERT_VAL("wrong last flushed", t.last == 100);
+
+	TEST_ASSERT_VAL("wrong unordered count", t.oe.nr_unordered_events == 0);
+
+	ordered_events__free(&t.oe);
+	return 0;
+}
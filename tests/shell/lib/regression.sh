@@ -0,0 +1,44 @@
+# Helpers of the performance regression tests, run by 'perf test --regression'.
+# They time workloads, add the timings to $PERF_TEST_RESULTS and fail when
+# one is more than $PERF_TEST_TOLERANCE percent slower than in
+# $PERF_TEST_BASELINE, a file of results from a previous run.
+
+# Print the best wall clock time of the command over 3 runs, in usecs
+regression_time() {
+	best=
+	for i in 1 2 3 ; do
+		start=$(date +%s%N)
+		"$@" > /dev/null 2>&1 || return 1
+		end=$(date +%s%N)
+		elapsed=$(( (end - start) / 1000 ))
+		if [ -z "$best" ] || [ $elapsed -lt $best ] ; then
+			best=$elapsed
+		fi
+	done
+	echo $best
+}
+
+# regression_check <metric> <unit> <value>, for times, where lower is better
+regression_check() {
+	metric=$1
+	unit=$2
+	value=$3
+
+	baseline=
+	if [ -n "$PERF_TEST_BASELINE" ] ; then
+		baseline=$(grep "^$metric,$unit," "$PERF_TEST_BASELINE" | tail -1 | cut -d, -f3)
+	fi
+
+	if [ -n "$PERF_TEST_RESULTS" ] ; then
+		echo "$metric,$unit,$value" >> "$PERF_TEST_RESULTS"
+	fi
+
+	[ -n "$baseline" ] || return 0
+
+	tolerance=${PERF_TEST_TOLERANCE:-10}
+	if awk -v v=$value -v b=$baseline -v t=$tolerance 'BEGIN { exit !(v > b * (1 + t / 100)) }' ; then
+		echo "$metric: $value $unit, over the baseline $baseline $unit + $tolerance%"
+		return 1
+	fi
+	return 0
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Time the hists, callchain and ordered events benchmarks
+
+# Runs the 'perf bench internals' benchmarks of the event processing hot
+# paths and checks the time of each operation.
+
+. $(dirname $0)/../lib/regression.sh
+
+err=0
+for bench in hists-add callchain-append ordered-events parse-sample findnew-thread find-symbol ; do
+	results=$(perf bench --format=csv --repeat=5 internals $bench 2>/dev/null) || exit 2
+	# collection,benchmark,metric,unit,repeat,value,stddev for each run and for "all"
+	op_time=$(echo "$results" | awk -F, '$3 == "op_time" && $5 == "all" { print $6; exit }')
+	[ -n "$op_time" ] || exit 2
+	regression_check internals.$bench.op_time usec $op_time || err=1
+done
+
+exit $err
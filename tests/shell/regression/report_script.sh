@@ -0,0 +1,32 @@
+#!/bin/sh
+# Time perf report and perf script on a recorded perf.data
+
+# Records the callchains of 'perf bench sched messaging', then times
+# processing it with 'perf report --stdio', with and without --children,
+# and 'perf script', per sample.
+
+. $(dirname $0)/../lib/regression.sh
+
+perfdata=$(mktemp /tmp/__perf_test.perf.data.XXXXX)
+
+cleanup() {
+	rm -f ${perfdata} ${perfdata}.old
+}
+trap cleanup EXIT
+
+perf record -q -o ${perfdata} -F 4000 -g -- perf bench sched messaging -l 100 > /dev/null 2>&1 || exit 2
+
+samples=$(perf report -i ${perfdata} --stats 2>/dev/null | awk '/ SAMPLE events:/ { print $3; exit }')
+[ -n "$samples" ] && [ "$samples" -gt 0 ] || exit 2
+
+err=0
+for workload in "report.stdio:perf report -i ${perfdata} --stdio --no-children" \
+		"report.children:perf report -i ${perfdata} --stdio --children" \
+		"script:perf script -i ${perfdata}" ; do
+	metric=${workload%%:*}
+	usecs=$(regression_time ${workload#*:}) || exit 1
+	per_sample=$(awk -v t=$usecs -v n=$samples 'BEGIN { printf "%.3f", t / n }')
+	regression_check $metric usec/sample $per_sample || err=1
+done
+
+exit $err
@@ -42,6 +42,8 @@ static void hist_browser__update_nr_entries(struct hist_browser *hb);
 
 static struct rb_node *hists__filter_entries(struct rb_node *nd,
 					     float min_pcnt);
+static struct rb_node *hists__filter_prev_entries(struct rb_node *nd,
+						  float min_pcnt);
 
 static bool hist_browser__has_filter(struct hist_browser *hb)
 {
@@ -86,7 +88,9 @@ static u32 hist_browser__nr_entries(struct hist_browser *hb)
 	else
 		nr_entries = hb->hists->nr_entries;
 
-	hb->nr_callchain_rows = hist_browser__get_folding(hb);
+	/* kept up to date on folding otherwise */
+	if (symbol_conf.report_hierarchy)
+		hb->nr_callchain_rows = hist_browser__get_folding(hb);
 	return nr_entries + hb->nr_callchain_rows;
 }
 
@@ -266,8 +270,10 @@ static int hierarchy_count_rows(struct hist_browser *hb, struct hist_entry *he,
 	struct rb_node *node;
 	struct hist_entry *child;
 
-	if (he->leaf)
+	if (he->leaf) {
+		hist_entry__sort_callchain(he);
 		return callchain__count_rows(&he->sorted_chain);
+	}
 
 	if (he->has_no_entry)
 		return 1;
@@ -374,6 +380,11 @@ static void hist_entry__init_have_children(struct hist_entry *he)
 		return;
 
 	if (he->leaf) {
+		/* don't sort the callchain until it gets unfolded */
+		if (he->sorted_chain_stale) {
+			he->has_children = !RB_EMPTY_ROOT(&he->callchain->node.rb_root_in);
+			return;
+		}
 		he->has_children = !RB_EMPTY_ROOT(&he->sorted_chain);
 		callchain__init_have_children(&he->sorted_chain);
 	} else {
@@ -393,6 +404,11 @@ static bool hist_browser__toggle_fold(struct hist_browser *browser)
 	if (!he || !ms)
 		return false;
 
+	if (he->leaf && he->sorted_chain_stale) {
+		hist_entry__sort_callchain(he);
+		hist_entry__init_have_children(he);
+	}
+
 	if (ms == &he->ms)
 		has_children = hist_entry__toggle_fold(he);
 	else
@@ -526,6 +542,9 @@ static int hierarchy_set_folding(struct hist_browser *hb, struct hist_entry *he,
 static void __hist_entry__set_folding(struct hist_entry *he,
 				      struct hist_browser *hb, bool unfold)
 {
+	if (unfold && he->leaf)
+		hist_entry__sort_callchain(he);
+
 	hist_entry__init_have_children(he);
 	he->unfolded = unfold ? he->has_children : false;
 
@@ -598,6 +617,8 @@ static void hist_browser__set_folding_selected(struct hist_browser *browser, boo
 	if (!browser->he_selection)
 		return;
 
+	if (browser->he_selection->leaf)
+		browser->nr_callchain_rows -= browser->he_selection->nr_rows;
 	hist_entry__set_folding(browser->he_selection, browser, unfold);
 	browser->b.nr_entries = hist_browser__nr_entries(browser);
 }
@@ -625,6 +646,7 @@ int hist_browser__run(struct hist_browser *browser, const char *help,
 	int delay_secs = hbt ? hbt->refresh : 0;
 
 	browser->b.entries = &browser->hists->entries;
+	hist_browser__update_nr_entries(browser);
 	browser->b.nr_entries = hist_browser__nr_entries(browser);
 
 	hist_browser__title(browser, title, sizeof(title));
@@ -640,9 +662,8 @@ int hist_browser__run(struct hist_browser *browser, const char *help,
 			u64 nr_entries;
 			hbt->timer(hbt->arg);
 
-			if (hist_browser__has_filter(browser) ||
-			    symbol_conf.report_hierarchy)
-				hist_browser__update_nr_entries(browser);
+			/* the entries were resorted, index them again */
+			hist_browser__update_nr_entries(browser);
 
 			nr_entries = hist_browser__nr_entries(browser);
 			ui_browser__update_nr_entries(&browser->b, nr_entries);
@@ -1114,6 +1135,9 @@ static int hist_browser__show_callchain(struct hist_browser *browser,
 	else
 		parent_total = entry->stat.period;
 
+	/* resorted since it was unfolded, e.g. by perf top */
+	hist_entry__sort_callchain(entry);
+
 	if (callchain_param.mode == CHAIN_FLAT) {
 		printed = hist_browser__show_callchain_flat(browser,
 						&entry->sorted_chain, row,
@@ -1739,6 +1763,58 @@ static void hist_browser__show_headers(struct hist_browser *browser)
 		hists_browser__headers(browser);
 }
 
+static bool hist_browser__indexed(struct hist_browser *hb, struct rb_node *nd)
+{
+	struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node);
+
+	return hb->visible && he->browser_idx < hb->nr_visible &&
+	       hb->visible[he->browser_idx] == nd;
+}
+
+static struct rb_node *hist_browser__first_entry(struct hist_browser *hb)
+{
+	if (hb->visible)
+		return hb->nr_visible ? hb->visible[0] : NULL;
+
+	return hists__filter_entries(rb_first(hb->b.entries), hb->min_pcnt);
+}
+
+static struct rb_node *hist_browser__last_entry(struct hist_browser *hb)
+{
+	struct rb_node *nd;
+
+	if (hb->visible)
+		return hb->nr_visible ? hb->visible[hb->nr_visible - 1] : NULL;
+
+	nd = rb_hierarchy_last(rb_last(hb->b.entries));
+	return hists__filter_prev_entries(nd, hb->min_pcnt);
+}
+
+/* The entry shown after nd, nd has to be shown too */
+static struct rb_node *hist_browser__next_entry(struct hist_browser *hb,
+						struct rb_node *nd)
+{
+	if (hist_browser__indexed(hb, nd)) {
+		u32 idx = rb_entry(nd, struct hist_entry, rb_node)->browser_idx;
+
+		return idx + 1 < hb->nr_visible ? hb->visible[idx + 1] : NULL;
+	}
+
+	return hists__filter_entries(rb_hierarchy_next(nd), hb->min_pcnt);
+}
+
+static struct rb_node *hist_browser__prev_entry(struct hist_browser *hb,
+						struct rb_node *nd)
+{
+	if (hist_browser__indexed(hb, nd)) {
+		u32 idx = rb_entry(nd, struct hist_entry, rb_node)->browser_idx;
+
+		return idx ? hb->visible[idx - 1] : NULL;
+	}
+
+	return hists__filter_prev_entries(rb_hierarchy_prev(nd), hb->min_pcnt);
+}
+
 static void ui_browser__hists_init_top(struct ui_browser *browser)
 {
 	if (browser->top == NULL) {
@@ -1762,7 +1838,9 @@ static unsigned int hist_browser__refresh(struct ui_browser *browser)
 	hb->he_selection = NULL;
 	hb->selection = NULL;
 
-	for (nd = browser->top; nd; nd = rb_hierarchy_next(nd)) {
+	for (nd = browser->top; nd;
+	     nd = hist_browser__indexed(hb, nd) ?
+		  hist_browser__next_entry(hb, nd) : rb_hierarchy_next(nd)) {
 		struct hist_entry *h = rb_entry(nd, struct hist_entry, rb_node);
 		float percent;
 
@@ -1853,15 +1931,13 @@ static void ui_browser__hists_seek(struct ui_browser *browser,
 
 	switch (whence) {
 	case SEEK_SET:
-		nd = hists__filter_entries(rb_first(browser->entries),
-					   hb->min_pcnt);
+		nd = hist_browser__first_entry(hb);
 		break;
 	case SEEK_CUR:
 		nd = browser->top;
 		goto do_offset;
 	case SEEK_END:
-		nd = rb_hierarchy_last(rb_last(browser->entries));
-		nd = hists__filter_prev_entries(nd, hb->min_pcnt);
+		nd = hist_browser__last_entry(hb);
 		first = false;
 		break;
 	default:
@@ -1907,8 +1983,7 @@ do_offset:
 					break;
 				}
 			}
-			nd = hists__filter_entries(rb_hierarchy_next(nd),
-						   hb->min_pcnt);
+			nd = hist_browser__next_entry(hb, nd);
 			if (nd == NULL)
 				break;
 			--offset;
@@ -1941,8 +2016,7 @@ do_offset:
 				}
 			}
 
-			nd = hists__filter_prev_entries(rb_hierarchy_prev(nd),
-							hb->min_pcnt);
+			nd = hist_browser__prev_entry(hb, nd);
 			if (nd == NULL)
 				break;
 			++offset;
@@ -2082,8 +2156,7 @@ static int hist_browser__fprintf_hierarchy_entry(struct hist_browser *browser,
 
 static int hist_browser__fprintf(struct hist_browser *browser, FILE *fp)
 {
-	struct rb_node *nd = hists__filter_entries(rb_first(browser->b.entries),
-						   browser->min_pcnt);
+	struct rb_node *nd = hist_browser__first_entry(browser);
 	int printed = 0;
 
 	while (nd) {
@@ -2097,8 +2170,7 @@ static int hist_browser__fprintf(struct hist_browser *browser, FILE *fp)
 			printed += hist_browser__fprintf_entry(browser, h, fp);
 		}
 
-		nd = hists__filter_entries(rb_hierarchy_next(nd),
-					   browser->min_pcnt);
+		nd = hist_browser__next_entry(browser, nd);
 	}
 
 	return printed;
@@ -2197,8 +2269,15 @@ perf_evsel_browser__new(struct perf_evsel *evsel,
 	return browser;
 }
 
+void hist_browser__exit(struct hist_browser *browser)
+{
+	zfree(&browser->visible);
+	browser->nr_visible = browser->alloc_visible = 0;
+}
+
 void hist_browser__delete(struct hist_browser *browser)
 {
+	hist_browser__exit(browser);
 	free(browser);
 }
 
@@ -2234,6 +2313,11 @@ static int hists_browser__scnprintf_title(struct hist_browser *browser, char *bf
 				     " drop: %" PRIu64 "/%" PRIu64,
 				     top->drop, top->drop_total);
 
+		if (top->self_only_total)
+			printed += scnprintf(bf + printed, size - printed,
+					     " self-only: %" PRIu64 "/%" PRIu64,
+					     top->self_only, top->self_only_total);
+
 		if (top->zero)
 			printed += scnprintf(bf + printed, size - printed, " [z]");
 
@@ -2747,23 +2831,60 @@ add_socket_opt(struct hist_browser *browser, struct popup_action *act,
 	return 1;
 }
 
+static int hist_browser__add_visible(struct hist_browser *hb,
+				     struct rb_node *nd)
+{
+	struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node);
+
+	if (hb->nr_visible == hb->alloc_visible) {
+		u32 alloc = hb->alloc_visible ? hb->alloc_visible * 2 : 1024;
+		struct rb_node **visible;
+
+		visible = realloc(hb->visible, alloc * sizeof(*visible));
+		if (visible == NULL)
+			return -ENOMEM;
+		hb->visible = visible;
+		hb->alloc_visible = alloc;
+	}
+
+	he->browser_idx = hb->nr_visible;
+	hb->visible[hb->nr_visible++] = nd;
+	return 0;
+}
+
+/*
+ * Count the entries shown and their unfolded callchain rows, indexing
+ * them when they are not in a hierarchy, so that moving around doesn't
+ * walk over the entries filtered out.
+ */
 static void hist_browser__update_nr_entries(struct hist_browser *hb)
 {
-	u64 nr_entries = 0;
+	u64 nr_entries = 0, nr_rows = 0;
 	struct rb_node *nd = rb_first_cached(&hb->hists->entries);
+	bool index = !symbol_conf.report_hierarchy;
 
-	if (hb->min_pcnt == 0 && !symbol_conf.report_hierarchy) {
-		hb->nr_non_filtered_entries = hb->hists->nr_non_filtered_entries;
-		return;
-	}
+	hb->nr_visible = 0;
+	if (!index)
+		hist_browser__exit(hb);
 
 	while ((nd = hists__filter_entries(nd, hb->min_pcnt)) != NULL) {
+		struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node);
+
+		if (index && hist_browser__add_visible(hb, nd)) {
+			/* walk the entries then */
+			hist_browser__exit(hb);
+			index = false;
+		}
+		if (he->leaf && he->unfolded)
+			nr_rows += he->nr_rows;
 		nr_entries++;
 		nd = rb_hierarchy_next(nd);
 	}
 
 	hb->nr_non_filtered_entries = nr_entries;
 	hb->nr_hierarchy_entries = nr_entries;
+	if (!symbol_conf.report_hierarchy)
+		hb->nr_callchain_rows = nr_rows;
 }
 
 static void hist_browser__update_percent_limit(struct hist_browser *hb,
@@ -2772,9 +2893,9 @@ static void hist_browser__update_percent_limit(struct hist_browser *hb,
 	struct hist_entry *he;
 	struct rb_node *nd = rb_first_cached(&hb->hists->entries);
 	u64 total = hists__total_period(hb->hists);
-	u64 min_callchain_hits = total * (percent / 100);
 
 	hb->min_pcnt = callchain_param.min_percent = percent;
+	hb->hists->min_callchain_hits = total * (percent / 100);
 
 	while ((nd = hists__filter_entries(nd, hb->min_pcnt)) != NULL) {
 		he = rb_entry(nd, struct hist_entry, rb_node);
@@ -2787,17 +2908,8 @@ static void hist_browser__update_percent_limit(struct hist_browser *hb,
 		if (!he->leaf || !hist_entry__has_callchains(he) || !symbol_conf.use_callchain)
 			goto next;
 
-		if (callchain_param.mode == CHAIN_GRAPH_REL) {
-			total = he->stat.period;
-
-			if (symbol_conf.cumulate_callchain)
-				total = he->stat_acc->period;
-
-			min_callchain_hits = total * (percent / 100);
-		}
-
-		callchain_param.sort(&he->sorted_chain, he->callchain,
-				     min_callchain_hits, &callchain_param);
+		/* sorted again with the new limit when unfolded */
+		he->sorted_chain_stale = true;
 
 next:
 		nd = __rb_hierarchy_next(nd, HMD_FORCE_CHILD);
@@ -22,6 +22,13 @@ struct hist_browser {
 	u64		     nr_non_filtered_entries;
 	u64		     nr_hierarchy_entries;
 	u64		     nr_callchain_rows;
+	/*
+	 * The entries shown, in order, not to walk over the filtered ones
+	 * when moving around, not used with --hierarchy.
+	 */
+	struct rb_node	    **visible;
+	u32		     nr_visible;
+	u32		     alloc_visible;
 	bool		     c2c_filter;
 
 	/* Get title string. */
@@ -31,6 +38,7 @@ struct hist_browser {
 
 struct hist_browser *hist_browser__new(struct hists *hists);
 void hist_browser__delete(struct hist_browser *browser);
+void hist_browser__exit(struct hist_browser *browser);
 int hist_browser__run(struct hist_browser *browser, const char *help,
 		      bool warn_lost_event);
 void hist_browser__init(struct hist_browser *browser,
@@ -389,6 +389,7 @@ static void perf_gtk__show_hists(GtkWidget *window, struct hists *hists,
 				total = symbol_conf.cumulate_callchain ?
 					h->stat_acc->period : h->stat.period;
 
+			hist_entry__sort_callchain(h);
 			perf_gtk__add_callchain(&h->sorted_chain, store, &iter,
 						sym_col, total);
 		}
@@ -486,6 +487,7 @@ static void perf_gtk__add_hierarchy_entries(struct hists *hists,
 				total = symbol_conf.cumulate_callchain ?
 					he->stat_acc->period : he->stat.period;
 
+			hist_entry__sort_callchain(he);
 			perf_gtk__add_callchain(&he->sorted_chain, store, &iter,
 						col_idx, total);
 		}
@@ -258,11 +258,86 @@ int hpp_color_scnprintf(struct perf_hpp *hpp, const char *fmt, ...)
 	return (ret >= ssize) ? (ssize - 1) : ret;
 }
 
-static int hpp_entry_scnprintf(struct perf_hpp *hpp, const char *fmt, ...)
+/*
+ * The percents and counts of the columns without vsnprintf(), those are most
+ * of what gets formatted for the rows of a report: " " and val right aligned
+ * to len, with 'decimals' of its digits after the point.  Returns -1 when it
+ * doesn't fit in hpp.
+ */
+static int hpp__scnprintf_fixed(struct perf_hpp *hpp, int len, u64 val,
+				int decimals, bool percent)
+{
+	int min_digits = decimals ? decimals + 2 : 1;
+	char digits[32], *buf = hpp->buf;
+	int nr = 0, pad, ret;
+
+	do {
+		digits[nr++] = '0' + val % 10;
+		val /= 10;
+		if (decimals && nr == decimals)
+			digits[nr++] = '.';
+	} while (val || nr < min_digits);
+
+	pad = len > nr ? len - nr : 0;
+	ret = 1 + pad + nr + percent;
+	if ((size_t)ret >= hpp->size)
+		return -1;
+
+	*buf++ = ' ';
+	memset(buf, ' ', pad);
+	buf += pad;
+	while (nr)
+		*buf++ = digits[--nr];
+	if (percent)
+		*buf++ = '%';
+	*buf = '\0';
+
+	return ret;
+}
+
+/* The print_fn of the " %*.2f%%" percent columns */
+static int hpp_entry_percent_scnprintf(struct perf_hpp *hpp, const char *fmt, ...)
 {
+	ssize_t ssize = hpp->size;
+	double percent, scaled;
 	va_list args;
+	int len, ret = -1;
+
+	va_start(args, fmt);
+	len = va_arg(args, int);
+	percent = va_arg(args, double);
+	va_end(args);
+
+	/* the ties and what doesn't fit are left to the rounding of printf */
+	scaled = percent * 100;
+	if (scaled >= 0 && scaled < 1e15 && fabs(scaled - floor(scaled) - 0.5) > 1e-6)
+		ret = hpp__scnprintf_fixed(hpp, len, scaled + 0.5, 2, true);
+	if (ret >= 0)
+		return ret;
+
+	va_start(args, fmt);
+	ret = vsnprintf(hpp->buf, hpp->size, fmt, args);
+	va_end(args);
+
+	return (ret >= ssize) ? (ssize - 1) : ret;
+}
+
+/* The print_fn of the " %*"PRIu64 count columns */
+static int hpp_entry_u64_scnprintf(struct perf_hpp *hpp, const char *fmt, ...)
+{
 	ssize_t ssize = hpp->size;
-	int ret;
+	va_list args;
+	int len, ret;
+	u64 val;
+
+	va_start(args, fmt);
+	len = va_arg(args, int);
+	val = va_arg(args, u64);
+	va_end(args);
+
+	ret = hpp__scnprintf_fixed(hpp, len, val, 0, false);
+	if (ret >= 0)
+		return ret;
 
 	va_start(args, fmt);
 	ret = vsnprintf(hpp->buf, hpp->size, fmt, args);
@@ -289,7 +364,7 @@ static int hpp__entry_##_type(struct perf_hpp_fmt *fmt,				\
 			      struct perf_hpp *hpp, struct hist_entry *he) 	\
 {										\
 	return hpp__fmt(fmt, hpp, he, he_get_##_field, " %*.2f%%",		\
-			hpp_entry_scnprintf, true);				\
+			hpp_entry_percent_scnprintf, true);			\
 }
 
 #define __HPP_SORT_FN(_type, _field)						\
@@ -317,7 +392,7 @@ static int hpp__entry_##_type(struct perf_hpp_fmt *fmt,				\
 			      struct perf_hpp *hpp, struct hist_entry *he) 	\
 {										\
 	return hpp__fmt_acc(fmt, hpp, he, he_get_acc_##_field, " %*.2f%%",	\
-			    hpp_entry_scnprintf, true);				\
+			    hpp_entry_percent_scnprintf, true);			\
 }
 
 #define __HPP_SORT_ACC_FN(_type, _field)					\
@@ -337,7 +412,7 @@ static int hpp__entry_##_type(struct perf_hpp_fmt *fmt,				\
 			      struct perf_hpp *hpp, struct hist_entry *he) 	\
 {										\
 	return hpp__fmt(fmt, hpp, he, he_get_raw_##_field, " %*"PRIu64, 	\
-			hpp_entry_scnprintf, false);				\
+			hpp_entry_u64_scnprintf, false);			\
 }
 
 #define __HPP_SORT_RAW_FN(_type, _field)					\
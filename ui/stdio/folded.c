@@ -0,0 +1,332 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * The callchains of the hists as flame graph input, straight from the
+ * callchain trees instead of formatting every sample with 'perf script'
+ * to collapse them again:
+ *
+ *  - folded: a line per stack, caller first and ';' separated, with the
+ *    period of the samples that ended there, what flamegraph.pl reads.
+ *
+ *  - json: the stacks merged by name into a tree, each node with the
+ *    period of its subtree, what d3-flame-graph reads.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/rbtree.h>
+
+#include "../../util/callchain.h"
+#include "../../util/util.h"
+#include "../../util/hist.h"
+#include "../../util/map.h"
+#include "../../util/symbol.h"
+#include "../../util/sort.h"
+#include "../../util/thread.h"
+
+struct folded_stack {
+	struct hist_entry	*he;
+	/* a frame for the event and the comm, if any, before the callchain */
+	const char		*prefix[2];
+	int			nr_prefix;
+	/* in the order of the callchain tree, from its root */
+	struct callchain_list	**path;
+	unsigned int		nr;
+	unsigned int		alloc;
+};
+
+typedef int (*folded_cb_t)(struct folded_stack *fs, u64 value, void *arg);
+
+static int folded_stack__push(struct folded_stack *fs, struct callchain_node *node)
+{
+	struct callchain_list *chain;
+
+	list_for_each_entry(chain, &node->val, list) {
+		if (chain->ip >= PERF_CONTEXT_MAX)
+			continue;
+
+		if (fs->nr == fs->alloc) {
+			unsigned int alloc = fs->alloc ? fs->alloc * 2 : 64;
+			struct callchain_list **path;
+
+			path = realloc(fs->path, alloc * sizeof(*path));
+			if (path == NULL)
+				return -ENOMEM;
+
+			fs->path  = path;
+			fs->alloc = alloc;
+		}
+		fs->path[fs->nr++] = chain;
+	}
+
+	return 0;
+}
+
+/* The name of the i-th frame, caller first, the prefix frames included */
+static const char *folded_stack__frame(struct folded_stack *fs, unsigned int i,
+				       char *bf, size_t size)
+{
+	struct callchain_list *chain;
+	struct symbol *sym;
+
+	if (i < (unsigned int)fs->nr_prefix)
+		return fs->prefix[i];
+	i -= fs->nr_prefix;
+
+	/* no callchain, just where the samples were */
+	if (fs->nr == 0) {
+		sym = fs->he->ms.sym;
+		if (sym)
+			return sym->name;
+		scnprintf(bf, size, "%#" PRIx64, fs->he->ip);
+		return bf;
+	}
+
+	if (callchain_param.order == ORDER_CALLEE)
+		i = fs->nr - 1 - i;
+
+	chain = fs->path[i];
+	return callchain_list__sym_name(chain, bf, size, false);
+}
+
+static unsigned int folded_stack__nr_frames(struct folded_stack *fs)
+{
+	return fs->nr_prefix + (fs->nr ?: 1);
+}
+
+static u64 callchain_node__folded_value(struct callchain_node *node)
+{
+	if (callchain_param.value == CCVAL_COUNT)
+		return node->count;
+	return node->hit;
+}
+
+static int callchain_node__walk_folded(struct callchain_node *node,
+				       struct folded_stack *fs,
+				       folded_cb_t cb, void *arg)
+{
+	unsigned int nr = fs->nr;
+	u64 value = callchain_node__folded_value(node);
+	struct rb_node *rb;
+	int ret;
+
+	ret = folded_stack__push(fs, node);
+
+	/* the root of the tree has no frames, those samples had no callchain */
+	if (!ret && value)
+		ret = cb(fs, value, arg);
+
+	/* the input tree, the sorted one leaves out what is under --percent-limit */
+	for (rb = rb_first(&node->rb_root_in); rb && !ret; rb = rb_next(rb)) {
+		struct callchain_node *child;
+
+		child = rb_entry(rb, struct callchain_node, rb_node_in);
+		ret = callchain_node__walk_folded(child, fs, cb, arg);
+	}
+
+	fs->nr = nr;
+	return ret;
+}
+
+static int hists__walk_folded(struct hists *hists, const char *event,
+			      folded_cb_t cb, void *arg)
+{
+	struct folded_stack fs = { .nr_prefix = 0, };
+	bool comm = hists__has(hists, comm) || hists__has(hists, thread);
+	struct rb_node *nd;
+	int ret = 0;
+
+	if (event)
+		fs.prefix[fs.nr_prefix++] = event;
+
+	for (nd = rb_first_cached(&hists->entries); nd && !ret;
+	     nd = __rb_hierarchy_next(nd, HMD_FORCE_CHILD)) {
+		struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node);
+
+		/* with --hierarchy the callchains are in the leaves */
+		if (he->filtered || !he->leaf)
+			continue;
+
+		fs.he = he;
+		fs.nr = 0;
+		fs.nr_prefix = event ? 1 : 0;
+		if (comm)
+			fs.prefix[fs.nr_prefix++] = thread__comm_str(he->thread);
+
+		if (symbol_conf.use_callchain && hist_entry__has_callchains(he)) {
+			ret = callchain_node__walk_folded(&he->callchain->node,
+							  &fs, cb, arg);
+		} else {
+			u64 value = callchain_param.value == CCVAL_COUNT ?
+				    he->stat.nr_events : he->stat.period;
+
+			if (value)
+				ret = cb(&fs, value, arg);
+		}
+	}
+
+	free(fs.path);
+	return ret;
+}
+
+static int folded__fprintf_cb(struct folded_stack *fs, u64 value, void *arg)
+{
+	unsigned int i, nr = folded_stack__nr_frames(fs);
+	FILE *fp = arg;
+	char bf[1024];
+
+	for (i = 0; i < nr; i++) {
+		fprintf(fp, "%s%s", i ? ";" : "",
+			folded_stack__frame(fs, i, bf, sizeof(bf)));
+	}
+	fprintf(fp, " %" PRIu64 "\n", value);
+	return 0;
+}
+
+/*
+ * With event set, the event is the outermost frame, for more than one
+ * event in the same output.
+ */
+int hists__fprintf_folded(struct hists *hists, const char *event, FILE *fp)
+{
+	return hists__walk_folded(hists, event, folded__fprintf_cb, fp);
+}
+
+struct flame_node {
+	struct rb_node		rb_node;
+	struct rb_root		children;
+	char			*name;
+	u64			value;
+};
+
+static struct flame_node *flame_node__new(const char *name)
+{
+	struct flame_node *node = zalloc(sizeof(*node));
+
+	if (node == NULL)
+		return NULL;
+
+	node->name = strdup(name);
+	if (node->name == NULL) {
+		free(node);
+		return NULL;
+	}
+	node->children = RB_ROOT;
+	return node;
+}
+
+static void flame_node__delete(struct flame_node *node)
+{
+	struct rb_node *rb = rb_first(&node->children);
+
+	while (rb) {
+		struct flame_node *child = rb_entry(rb, struct flame_node, rb_node);
+
+		rb = rb_next(rb);
+		flame_node__delete(child);
+	}
+
+	free(node->name);
+	free(node);
+}
+
+static struct flame_node *flame_node__findnew(struct flame_node *parent,
+					      const char *name)
+{
+	struct rb_node **p = &parent->children.rb_node;
+	struct rb_node *rb = NULL;
+	struct flame_node *node;
+
+	while (*p != NULL) {
+		int cmp;
+
+		rb = *p;
+		node = rb_entry(rb, struct flame_node, rb_node);
+
+		cmp = strcmp(name, node->name);
+		if (!cmp)
+			return node;
+
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	node = flame_node__new(name);
+	if (node == NULL)
+		return NULL;
+
+	rb_link_node(&node->rb_node, rb, p);
+	rb_insert_color(&node->rb_node, &parent->children);
+	return node;
+}
+
+static int flame__add_cb(struct folded_stack *fs, u64 value, void *arg)
+{
+	unsigned int i, nr = folded_stack__nr_frames(fs);
+	struct flame_node *node = arg;
+	char bf[1024];
+
+	node->value += value;
+
+	for (i = 0; i < nr; i++) {
+		node = flame_node__findnew(node, folded_stack__frame(fs, i, bf, sizeof(bf)));
+		if (node == NULL)
+			return -ENOMEM;
+		node->value += value;
+	}
+
+	return 0;
+}
+
+static void json__fprintf_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void flame_node__fprintf_json(struct flame_node *node, FILE *fp)
+{
+	struct rb_node *rb;
+
+	fprintf(fp, "{\"name\": ");
+	json__fprintf_string(fp, node->name);
+	fprintf(fp, ", \"value\": %" PRIu64 ", \"children\": [", node->value);
+
+	for (rb = rb_first(&node->children); rb; rb = rb_next(rb)) {
+		flame_node__fprintf_json(rb_entry(rb, struct flame_node, rb_node), fp);
+		if (rb_next(rb))
+			fprintf(fp, ", ");
+	}
+
+	fprintf(fp, "]}");
+}
+
+/* A line with the tree of the stacks of the hists, rooted at 'name' */
+int hists__fprintf_flame_json(struct hists *hists, const char *name, FILE *fp)
+{
+	struct flame_node *root = flame_node__new(name);
+	int ret;
+
+	if (root == NULL)
+		return -ENOMEM;
+
+	ret = hists__walk_folded(hists, NULL, flame__add_cb, root);
+	if (!ret) {
+		flame_node__fprintf_json(root, fp);
+		fprintf(fp, "\n");
+	}
+
+	flame_node__delete(root);
+	return ret;
+}
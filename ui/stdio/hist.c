@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <linux/string.h>
 
 #include "../../util/callchain.h"
@@ -383,6 +386,8 @@ static size_t hist_entry_callchain__fprintf(struct hist_entry *he,
 	if (symbol_conf.cumulate_callchain)
 		parent_samples = he->stat_acc->period;
 
+	hist_entry__sort_callchain(he);
+
 	switch (callchain_param.mode) {
 	case CHAIN_GRAPH_REL:
 		return callchain__fprintf_graph(fp, &he->sorted_chain, total_samples,
@@ -531,6 +536,184 @@ out:
 	return printed;
 }
 
+/*
+ * The rows of a report of many entries without callchains are formatted
+ * on as many threads as there are CPUs, HISTS_FPRINTF_CHUNK rows at a time
+ * into buffers that are then written in order.
+ */
+#define HISTS_FPRINTF_PARALLEL_MIN	(16 * 1024)
+#define HISTS_FPRINTF_CHUNK		1024
+
+struct hists_fprintf_chunk {
+	char	*buf;
+	size_t	len;
+	size_t	alloc;
+};
+
+struct hists_fprintf_arg {
+	struct hist_entry		**entries;
+	unsigned int			nr;
+	struct hists_fprintf_chunk	*chunks;
+	unsigned int			nr_chunks;
+	unsigned int			next;
+	size_t				size;
+	size_t				linesz;
+	int				err;
+};
+
+static int hists_fprintf_chunk__add(struct hists_fprintf_chunk *chunk,
+				    const char *line, size_t len)
+{
+	if (chunk->len + len + 1 > chunk->alloc) {
+		size_t alloc = max(chunk->alloc * 2, chunk->len + len + 1);
+		char *buf = realloc(chunk->buf, alloc);
+
+		if (buf == NULL)
+			return -ENOMEM;
+		chunk->buf = buf;
+		chunk->alloc = alloc;
+	}
+
+	memcpy(chunk->buf + chunk->len, line, len);
+	chunk->len += len;
+	chunk->buf[chunk->len++] = '\n';
+	return 0;
+}
+
+static void *hists__fprintf_worker(void *arg)
+{
+	struct hists_fprintf_arg *args = arg;
+	char *line = malloc(args->linesz);
+	unsigned int i, j;
+
+	if (line == NULL) {
+		args->err = -ENOMEM;
+		return NULL;
+	}
+
+	while ((i = __sync_fetch_and_add(&args->next, 1)) < args->nr_chunks) {
+		unsigned int end = min((i + 1) * HISTS_FPRINTF_CHUNK, args->nr);
+
+		for (j = i * HISTS_FPRINTF_CHUNK; j < end; j++) {
+			struct perf_hpp hpp = {
+				.buf	= line,
+				.size	= args->size,
+			};
+			int len = hist_entry__snprintf(args->entries[j], &hpp);
+
+			if (hists_fprintf_chunk__add(&args->chunks[i], line, len))
+				args->err = -ENOMEM;
+		}
+	}
+
+	free(line);
+	return NULL;
+}
+
+/*
+ * The columns that look up srclines or format trace output as they print
+ * them can't be formatted on several threads, nor the callchains and
+ * hierarchies, printed straight to fp.
+ */
+static bool hists__fprintf_can_parallel(struct hists *hists,
+					bool ignore_callchains)
+{
+	struct perf_hpp_fmt *fmt;
+
+	if (symbol_conf.report_hierarchy || symbol_conf.exclude_other ||
+	    verbose > 1)
+		return false;
+
+	if (!ignore_callchains && symbol_conf.use_callchain)
+		return false;
+
+	if (hists->nr_non_filtered_entries < HISTS_FPRINTF_PARALLEL_MIN)
+		return false;
+
+	hists__for_each_format(hists, fmt) {
+		if (perf_hpp__is_srcline_entry(fmt) ||
+		    perf_hpp__is_srcfile_entry(fmt) ||
+		    perf_hpp__is_trace_entry(fmt) ||
+		    perf_hpp__is_dynamic_entry(fmt))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns what it printed for the entries of hists, up to max_rows of them,
+ * or -1 when they have to be printed one by one instead.
+ */
+static ssize_t hists__fprintf_parallel(struct hists *hists, int max_rows,
+				       int max_cols, float min_pcnt,
+				       size_t linesz, FILE *fp)
+{
+	struct hists_fprintf_arg args = { .linesz = linesz, };
+	unsigned int i, started = 0, nr_threads;
+	pthread_t *threads = NULL;
+	ssize_t printed = -1;
+	struct rb_node *nd;
+
+	args.entries = malloc(hists->nr_non_filtered_entries * sizeof(*args.entries));
+	if (args.entries == NULL)
+		return -1;
+
+	for (nd = rb_first_cached(&hists->entries); nd; nd = rb_next(nd)) {
+		struct hist_entry *h = rb_entry(nd, struct hist_entry, rb_node);
+
+		if (h->filtered || hist_entry__get_percent_limit(h) < min_pcnt)
+			continue;
+		if (args.nr == hists->nr_non_filtered_entries)
+			break;
+
+		args.entries[args.nr++] = h;
+		if (max_rows && args.nr >= (unsigned int)max_rows)
+			break;
+	}
+
+	args.size = max_cols;
+	if (args.size == 0 || args.size > linesz)
+		args.size = linesz;
+
+	args.nr_chunks = DIV_ROUND_UP(args.nr, HISTS_FPRINTF_CHUNK);
+	args.chunks = calloc(args.nr_chunks, sizeof(*args.chunks));
+	if (args.chunks == NULL)
+		goto out_free;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > args.nr_chunks)
+		nr_threads = args.nr_chunks;
+
+	if (nr_threads > 1)
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+
+	for (; threads && started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL,
+				   hists__fprintf_worker, &args))
+			break;
+	}
+
+	hists__fprintf_worker(&args);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (args.err == 0) {
+		printed = 0;
+		for (i = 0; i < args.nr_chunks; i++)
+			printed += fwrite(args.chunks[i].buf, 1, args.chunks[i].len, fp);
+	}
+
+	for (i = 0; i < args.nr_chunks; i++)
+		free(args.chunks[i].buf);
+	free(args.chunks);
+	free(threads);
+out_free:
+	free(args.entries);
+	return printed;
+}
+
 static int hist_entry__fprintf(struct hist_entry *he, size_t size,
 			       char *bf, size_t bfsz, FILE *fp,
 			       bool ignore_callchains)
@@ -792,6 +975,17 @@ size_t hists__fprintf(struct hists *hists, bool show_header, int max_rows,
 
 	indent = hists__overhead_width(hists) + 4;
 
+	if (hists__fprintf_can_parallel(hists, ignore_callchains)) {
+		ssize_t printed = hists__fprintf_parallel(hists,
+							  max_rows ? max_rows - nr_rows : 0,
+							  max_cols, min_pcnt,
+							  linesz, fp);
+		if (printed >= 0) {
+			ret += printed;
+			goto out_free;
+		}
+	}
+
 	for (nd = rb_first_cached(&hists->entries); nd;
 	     nd = __rb_hierarchy_next(nd, HMD_FORCE_CHILD)) {
 		struct hist_entry *h = rb_entry(nd, struct hist_entry, rb_node);
@@ -829,6 +1023,7 @@ size_t hists__fprintf(struct hists *hists, bool show_header, int max_rows,
 		}
 	}
 
+out_free:
 	free(line);
 out:
 	zfree(&rem_sq_bracket);
@@ -30,11 +30,16 @@
 #include "evlist.h"
 #include "bpf-event.h"
 #include "block-range.h"
+#include "disasm-cache.h"
+#include "srccode.h"
+#include "srcline.h"
 #include "string2.h"
 #include "arch/common.h"
 #include <regex.h>
 #include <pthread.h>
+#include <sys/wait.h>
 #include <linux/bitops.h>
+#include <linux/hash.h>
 #include <linux/kernel.h>
 #include <bpf/libbpf.h>
 
@@ -62,6 +67,14 @@ struct annotation_options annotation__default_options = {
 
 static regex_t	 file_lineno;
 
+/*
+ * Symbols can be annotated on several threads, see perf annotate --hottest,
+ * the instruction tables of an arch get sorted and grown on first use.
+ */
+static pthread_mutex_t arch__lock = PTHREAD_MUTEX_INITIALIZER;
+/* libbfd, the addr2line pipes and the source code cache aren't either */
+static pthread_mutex_t disasm_bfd__lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct ins_ops *ins__find(struct arch *arch, const char *name);
 static void ins__sort(struct arch *arch);
 static int disasm_line__parse(char *line, const char **namep, char **rawp);
@@ -683,10 +696,13 @@ static struct ins_ops *__ins__find(struct arch *arch, const char *name)
 
 static struct ins_ops *ins__find(struct arch *arch, const char *name)
 {
-	struct ins_ops *ops = __ins__find(arch, name);
+	struct ins_ops *ops;
 
+	pthread_mutex_lock(&arch__lock);
+	ops = __ins__find(arch, name);
 	if (!ops && arch->associate_instruction_ops)
 		ops = arch->associate_instruction_ops(arch, name);
+	pthread_mutex_unlock(&arch__lock);
 
 	return ops;
 }
@@ -726,6 +742,166 @@ static struct arch *arch__find(const char *name)
 	return bsearch(name, architectures, nmemb, sizeof(struct arch), arch__key_cmp);
 }
 
+/*
+ * Open addressing, the slots are the offset + 1, 0 when free, followed by
+ * a value_size value.
+ */
+struct sparse_hist {
+	size_t	nr;
+	int	bits;
+	size_t	value_size;
+	void	*slots;
+};
+
+#define SPARSE_HIST__MIN_BITS	6
+
+#define sparse_hist__nr_slots(sh)	(1UL << (sh)->bits)
+
+static size_t sparse_hist__slot_size(struct sparse_hist *sh)
+{
+	return sizeof(u64) + sh->value_size;
+}
+
+static u64 *sparse_hist__slot(struct sparse_hist *sh, size_t i)
+{
+	return sh->slots + i * sparse_hist__slot_size(sh);
+}
+
+/* Go over the values with an offset, in no particular order */
+#define sparse_hist__for_each(sh, i, slot)				\
+	for (i = 0; i < sparse_hist__nr_slots(sh); i++)			\
+		if (*(slot = sparse_hist__slot(sh, i)) != 0)
+
+static struct sparse_hist *sparse_hist__new(size_t value_size)
+{
+	struct sparse_hist *sh = zalloc(sizeof(*sh));
+
+	if (sh == NULL)
+		return NULL;
+
+	sh->bits       = SPARSE_HIST__MIN_BITS;
+	sh->value_size = value_size;
+	sh->slots      = calloc(sparse_hist__nr_slots(sh), sparse_hist__slot_size(sh));
+	if (sh->slots == NULL)
+		zfree(&sh);
+
+	return sh;
+}
+
+static void sparse_hist__delete(struct sparse_hist *sh)
+{
+	if (sh == NULL)
+		return;
+
+	free(sh->slots);
+	free(sh);
+}
+
+static u64 *sparse_hist__probe(struct sparse_hist *sh, u64 offset)
+{
+	size_t mask = sparse_hist__nr_slots(sh) - 1;
+	size_t i = hash_64(offset, sh->bits);
+	u64 *slot;
+
+	while (*(slot = sparse_hist__slot(sh, i)) != 0 && *slot != offset + 1)
+		i = (i + 1) & mask;
+
+	return slot;
+}
+
+/* The value at offset, NULL if it hasn't one */
+static void *sparse_hist__find(struct sparse_hist *sh, u64 offset)
+{
+	u64 *slot = sparse_hist__probe(sh, offset);
+
+	return *slot ? slot + 1 : NULL;
+}
+
+static int sparse_hist__grow(struct sparse_hist *sh)
+{
+	struct sparse_hist old = *sh;
+	size_t i;
+	u64 *slot;
+
+	sh->bits++;
+	sh->slots = calloc(sparse_hist__nr_slots(sh), sparse_hist__slot_size(sh));
+	if (sh->slots == NULL) {
+		*sh = old;
+		return -ENOMEM;
+	}
+
+	sparse_hist__for_each(&old, i, slot)
+		memcpy(sparse_hist__probe(sh, *slot - 1), slot, sparse_hist__slot_size(sh));
+
+	free(old.slots);
+	return 0;
+}
+
+/* The value at offset, zeroed when new */
+static void *sparse_hist__findnew(struct sparse_hist *sh, u64 offset)
+{
+	u64 *slot = sparse_hist__probe(sh, offset);
+
+	if (*slot)
+		return slot + 1;
+
+	/* no more than 3/4 full */
+	if ((sh->nr + 1) * 4 > sparse_hist__nr_slots(sh) * 3) {
+		if (sparse_hist__grow(sh))
+			return NULL;
+		slot = sparse_hist__probe(sh, offset);
+	}
+
+	*slot = offset + 1;
+	sh->nr++;
+	return slot + 1;
+}
+
+static void sparse_hist__zero(struct sparse_hist *sh)
+{
+	memset(sh->slots, 0, sparse_hist__nr_slots(sh) * sparse_hist__slot_size(sh));
+	sh->nr = 0;
+}
+
+static int sparse_hist__cmp_desc(const void *a, const void *b)
+{
+	u64 oa = *(const u64 *)a, ob = *(const u64 *)b;
+
+	return oa < ob ? 1 : oa > ob ? -1 : 0;
+}
+
+/* The offsets with a value, from the last */
+static u64 *sparse_hist__offsets(struct sparse_hist *sh, size_t *nr)
+{
+	u64 *offsets = malloc(sh->nr * sizeof(u64) ?: 1), *slot;
+	size_t i;
+
+	*nr = 0;
+	if (offsets == NULL)
+		return NULL;
+
+	sparse_hist__for_each(sh, i, slot)
+		offsets[(*nr)++] = *slot - 1;
+
+	qsort(offsets, *nr, sizeof(u64), sparse_hist__cmp_desc);
+	return offsets;
+}
+
+const struct sym_hist_entry *sym_hist__sparse_entry(struct sym_hist *h, u64 offset)
+{
+	static const struct sym_hist_entry zero;
+	const struct sym_hist_entry *entry = sparse_hist__find(h->sparse, offset);
+
+	return entry ?: &zero;
+}
+
+static struct sym_hist_entry *sym_hist__findnew_entry(struct sym_hist *h, u64 offset)
+{
+	if (h->sparse == NULL)
+		return &h->addr[offset];
+	return sparse_hist__findnew(h->sparse, offset);
+}
+
 static struct annotated_source *annotated_source__new(void)
 {
 	struct annotated_source *src = zalloc(sizeof(*src));
@@ -736,12 +912,25 @@ static struct annotated_source *annotated_source__new(void)
 	return src;
 }
 
-static __maybe_unused void annotated_source__delete(struct annotated_source *src)
+static void annotated_source__delete_histograms(struct annotated_source *src)
 {
-	if (src == NULL)
+	int i;
+
+	if (src->histograms == NULL)
 		return;
+
+	for (i = 0; i < src->nr_histograms; i++)
+		sparse_hist__delete(annotated_source__histogram(src, i)->sparse);
 	zfree(&src->histograms);
+}
+
+void annotated_source__delete(struct annotated_source *src)
+{
+	if (src == NULL)
+		return;
+	annotated_source__delete_histograms(src);
 	zfree(&src->cycles_hist);
+	sparse_hist__delete(src->cycles_sparse);
 	free(src);
 }
 
@@ -749,6 +938,7 @@ static int annotated_source__alloc_histograms(struct annotated_source *src,
 					      size_t size, int nr_hists)
 {
 	size_t sizeof_sym_hist;
+	int i;
 
 	/*
 	 * Add buffer of one element for zero length symbol.
@@ -760,6 +950,9 @@ static int annotated_source__alloc_histograms(struct annotated_source *src,
 	if (size == 0)
 		size = 1;
 
+	if (size > ANNOTATION__SPARSE_SIZE)
+		size = 0;
+
 	/* Check for overflow when calculating sizeof_sym_hist */
 	if (size > (SIZE_MAX - sizeof(struct sym_hist)) / sizeof(struct sym_hist_entry))
 		return -1;
@@ -773,7 +966,22 @@ static int annotated_source__alloc_histograms(struct annotated_source *src,
 	src->sizeof_sym_hist = sizeof_sym_hist;
 	src->nr_histograms   = nr_hists;
 	src->histograms	     = calloc(nr_hists, sizeof_sym_hist) ;
-	return src->histograms ? 0 : -1;
+	if (src->histograms == NULL)
+		return -1;
+
+	if (size == 0) {
+		for (i = 0; i < nr_hists; i++) {
+			struct sym_hist *h = annotated_source__histogram(src, i);
+
+			h->sparse = sparse_hist__new(sizeof(struct sym_hist_entry));
+			if (h->sparse == NULL) {
+				annotated_source__delete_histograms(src);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
 }
 
 /* The cycles histogram is lazily allocated. */
@@ -782,6 +990,11 @@ static int symbol__alloc_hist_cycles(struct symbol *sym)
 	struct annotation *notes = symbol__annotation(sym);
 	const size_t size = symbol__size(sym);
 
+	if (size > ANNOTATION__SPARSE_SIZE) {
+		notes->src->cycles_sparse = sparse_hist__new(sizeof(struct cyc_hist));
+		return notes->src->cycles_sparse ? 0 : -1;
+	}
+
 	notes->src->cycles_hist = calloc(size, sizeof(struct cyc_hist));
 	if (notes->src->cycles_hist == NULL)
 		return -1;
@@ -794,18 +1007,21 @@ void symbol__annotate_zero_histograms(struct symbol *sym)
 
 	pthread_mutex_lock(&notes->lock);
 	if (notes->src != NULL) {
-		memset(notes->src->histograms, 0,
-		       notes->src->nr_histograms * notes->src->sizeof_sym_hist);
+		int i;
+
+		for (i = 0; i < notes->src->nr_histograms; i++)
+			symbol__annotate_zero_histogram(sym, i);
 		if (notes->src->cycles_hist)
 			memset(notes->src->cycles_hist, 0,
 				symbol__size(sym) * sizeof(struct cyc_hist));
+		if (notes->src->cycles_sparse)
+			sparse_hist__zero(notes->src->cycles_sparse);
 	}
 	pthread_mutex_unlock(&notes->lock);
 }
 
 static int __symbol__account_cycles(struct cyc_hist *ch,
-				    u64 start,
-				    unsigned offset, unsigned cycles,
+				    u64 start, unsigned cycles,
 				    unsigned have_start)
 {
 	/*
@@ -816,36 +1032,36 @@ static int __symbol__account_cycles(struct cyc_hist *ch,
 	 *
 	 * We separately always account the full cycles.
 	 */
-	ch[offset].num_aggr++;
-	ch[offset].cycles_aggr += cycles;
+	ch->num_aggr++;
+	ch->cycles_aggr += cycles;
 
-	if (cycles > ch[offset].cycles_max)
-		ch[offset].cycles_max = cycles;
+	if (cycles > ch->cycles_max)
+		ch->cycles_max = cycles;
 
-	if (ch[offset].cycles_min) {
-		if (cycles && cycles < ch[offset].cycles_min)
-			ch[offset].cycles_min = cycles;
+	if (ch->cycles_min) {
+		if (cycles && cycles < ch->cycles_min)
+			ch->cycles_min = cycles;
 	} else
-		ch[offset].cycles_min = cycles;
+		ch->cycles_min = cycles;
 
-	if (!have_start && ch[offset].have_start)
+	if (!have_start && ch->have_start)
 		return 0;
-	if (ch[offset].num) {
-		if (have_start && (!ch[offset].have_start ||
-				   ch[offset].start > start)) {
-			ch[offset].have_start = 0;
-			ch[offset].cycles = 0;
-			ch[offset].num = 0;
-			if (ch[offset].reset < 0xffff)
-				ch[offset].reset++;
+	if (ch->num) {
+		if (have_start && (!ch->have_start ||
+				   ch->start > start)) {
+			ch->have_start = 0;
+			ch->cycles = 0;
+			ch->num = 0;
+			if (ch->reset < 0xffff)
+				ch->reset++;
 		} else if (have_start &&
-			   ch[offset].start < start)
+			   ch->start < start)
 			return 0;
 	}
-	ch[offset].have_start = have_start;
-	ch[offset].start = start;
-	ch[offset].cycles += cycles;
-	ch[offset].num++;
+	ch->have_start = have_start;
+	ch->start = start;
+	ch->cycles += cycles;
+	ch->num++;
 	return 0;
 }
 
@@ -853,6 +1069,7 @@ static int __symbol__inc_addr_samples(struct symbol *sym, struct map *map,
 				      struct annotated_source *src, int evidx, u64 addr,
 				      struct perf_sample *sample)
 {
+	struct sym_hist_entry *entry;
 	unsigned offset;
 	struct sym_hist *h;
 
@@ -872,19 +1089,22 @@ static int __symbol__inc_addr_samples(struct symbol *sym, struct map *map,
 			 __func__, __LINE__, sym->name, sym->start, addr, sym->end, sym->type == STT_FUNC);
 		return -ENOMEM;
 	}
+	entry = sym_hist__findnew_entry(h, offset);
+	if (entry == NULL)
+		return -ENOMEM;
 	h->nr_samples++;
-	h->addr[offset].nr_samples++;
+	entry->nr_samples++;
 	h->period += sample->period;
-	h->addr[offset].period += sample->period;
+	entry->period += sample->period;
 
 	pr_debug3("%#" PRIx64 " %s: period++ [addr: %#" PRIx64 ", %#" PRIx64
 		  ", evidx=%d] => nr_samples: %" PRIu64 ", period: %" PRIu64 "\n",
 		  sym->start, sym->name, addr, addr - sym->start, evidx,
-		  h->addr[offset].nr_samples, h->addr[offset].period);
+		  entry->nr_samples, entry->period);
 	return 0;
 }
 
-static struct cyc_hist *symbol__cycles_hist(struct symbol *sym)
+static struct annotated_source *symbol__cycles_hist(struct symbol *sym)
 {
 	struct annotation *notes = symbol__annotation(sym);
 
@@ -895,12 +1115,13 @@ static struct cyc_hist *symbol__cycles_hist(struct symbol *sym)
 		goto alloc_cycles_hist;
 	}
 
-	if (!notes->src->cycles_hist) {
+	if (!notes->src->cycles_hist && !notes->src->cycles_sparse) {
 alloc_cycles_hist:
-		symbol__alloc_hist_cycles(sym);
+		if (symbol__alloc_hist_cycles(sym))
+			return NULL;
 	}
 
-	return notes->src->cycles_hist;
+	return notes->src;
 }
 
 struct annotated_source *symbol__hists(struct symbol *sym, int nr_hists)
@@ -940,13 +1161,15 @@ static int symbol__inc_addr_samples(struct symbol *sym, struct map *map,
 static int symbol__account_cycles(u64 addr, u64 start,
 				  struct symbol *sym, unsigned cycles)
 {
-	struct cyc_hist *cycles_hist;
+	struct annotated_source *src;
+	struct cyc_hist *ch;
 	unsigned offset;
+	int err;
 
 	if (sym == NULL)
 		return 0;
-	cycles_hist = symbol__cycles_hist(sym);
-	if (cycles_hist == NULL)
+	src = symbol__cycles_hist(sym);
+	if (src == NULL)
 		return -ENOMEM;
 	if (addr < sym->start || addr >= sym->end)
 		return -ERANGE;
@@ -958,10 +1181,20 @@ static int symbol__account_cycles(u64 addr, u64 start,
 			start = 0;
 	}
 	offset = addr - sym->start;
-	return __symbol__account_cycles(cycles_hist,
-					start ? start - sym->start : 0,
-					offset, cycles,
-					!!start);
+
+	if (src->cycles_hist) {
+		return __symbol__account_cycles(&src->cycles_hist[offset],
+						start ? start - sym->start : 0,
+						cycles, !!start);
+	}
+
+	/* a table that grows, unlike the array, keep it from the readers */
+	pthread_mutex_lock(&symbol__annotation(sym)->lock);
+	ch = sparse_hist__findnew(src->cycles_sparse, offset);
+	err = ch ? __symbol__account_cycles(ch, start ? start - sym->start : 0,
+					    cycles, !!start) : -ENOMEM;
+	pthread_mutex_unlock(&symbol__annotation(sym)->lock);
+	return err;
 }
 
 int addr_map_symbol__account_cycles(struct addr_map_symbol *ams,
@@ -1041,11 +1274,45 @@ static void annotation__count_and_fill(struct annotation *notes, u64 start, u64
 	}
 }
 
+static void annotation__compute_ipc_offset(struct annotation *notes,
+					   struct cyc_hist *ch, s64 offset)
+{
+	if (ch && ch->cycles) {
+		struct annotation_line *al;
+
+		if (ch->have_start)
+			annotation__count_and_fill(notes, ch->start, offset, ch);
+		al = notes->offsets[offset];
+		if (al && ch->num_aggr) {
+			al->cycles = ch->cycles_aggr / ch->num_aggr;
+			al->cycles_max = ch->cycles_max;
+			al->cycles_min = ch->cycles_min;
+		}
+		notes->have_cycles = true;
+	}
+}
+
+/* Only the offsets that have cycles, from the last as for the array */
+static void annotation__compute_ipc_sparse(struct annotation *notes)
+{
+	struct sparse_hist *sh = notes->src->cycles_sparse;
+	size_t i, nr;
+	u64 *offsets = sparse_hist__offsets(sh, &nr);
+
+	if (offsets == NULL)
+		return;
+
+	for (i = 0; i < nr; i++)
+		annotation__compute_ipc_offset(notes, sparse_hist__find(sh, offsets[i]), offsets[i]);
+
+	free(offsets);
+}
+
 void annotation__compute_ipc(struct annotation *notes, size_t size)
 {
 	s64 offset;
 
-	if (!notes->src || !notes->src->cycles_hist)
+	if (!notes->src || (!notes->src->cycles_hist && !notes->src->cycles_sparse))
 		return;
 
 	notes->total_insn = annotation__count_insn(notes, 0, size - 1);
@@ -1054,23 +1321,11 @@ void annotation__compute_ipc(struct annotation *notes, size_t size)
 	notes->cover_insn = 0;
 
 	pthread_mutex_lock(&notes->lock);
-	for (offset = size - 1; offset >= 0; --offset) {
-		struct cyc_hist *ch;
-
-		ch = &notes->src->cycles_hist[offset];
-		if (ch && ch->cycles) {
-			struct annotation_line *al;
-
-			if (ch->have_start)
-				annotation__count_and_fill(notes, ch->start, offset, ch);
-			al = notes->offsets[offset];
-			if (al && ch->num_aggr) {
-				al->cycles = ch->cycles_aggr / ch->num_aggr;
-				al->cycles_max = ch->cycles_max;
-				al->cycles_min = ch->cycles_min;
-			}
-			notes->have_cycles = true;
-		}
+	if (notes->src->cycles_sparse) {
+		annotation__compute_ipc_sparse(notes);
+	} else {
+		for (offset = size - 1; offset >= 0; --offset)
+			annotation__compute_ipc_offset(notes, &notes->src->cycles_hist[offset], offset);
 	}
 	pthread_mutex_unlock(&notes->lock);
 }
@@ -1683,11 +1938,13 @@ fallback:
 	return 0;
 }
 
-#if defined(HAVE_LIBBFD_SUPPORT) && defined(HAVE_LIBBPF_SUPPORT)
+#ifdef HAVE_LIBBFD_SUPPORT
 #define PACKAGE "perf"
 #include <bfd.h>
 #include <dis-asm.h>
+#endif
 
+#if defined(HAVE_LIBBFD_SUPPORT) && defined(HAVE_LIBBPF_SUPPORT)
 static int symbol__disassemble_bpf(struct symbol *sym,
 				   struct annotate_args *args)
 {
@@ -1833,56 +2090,203 @@ static int symbol__disassemble_bpf(struct symbol *sym __maybe_unused,
 }
 #endif // defined(HAVE_LIBBFD_SUPPORT) && defined(HAVE_LIBBPF_SUPPORT)
 
-static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
+#ifdef HAVE_LIBBFD_SUPPORT
+struct disasm_bfd {
+	struct annotate_args	*args;
+	FILE			*insn;
+	unsigned int		srcline_nr;
+	char			*srcfile;
+};
+
+/* Print addresses the way objdump does, "<addr> <sym+off>" */
+static void disasm_bfd__print_address(bfd_vma addr, struct disassemble_info *info)
+{
+	struct disasm_bfd *db = info->application_data;
+	struct map *map = db->args->ms.map;
+	struct symbol *sym;
+
+	info->fprintf_func(info->stream, "%" PRIx64, (u64)addr);
+
+	sym = map__find_symbol(map, map->map_ip(map, map__objdump_2mem(map, addr)));
+	if (sym == NULL)
+		return;
+
+	addr -= map__rip_2objdump(map, sym->start);
+	if (addr)
+		info->fprintf_func(info->stream, " <%s+0x%" PRIx64 ">",
+				   sym->name, (u64)addr);
+	else
+		info->fprintf_func(info->stream, " <%s>", sym->name);
+}
+
+/* Emit the "/file:line" and source lines of objdump -l -S when they change */
+static void disasm_bfd__srcline(struct disasm_bfd *db, FILE *out, u64 addr)
+{
+	struct annotation_options *opts = db->args->options;
+	struct dso *dso = db->args->ms.map->dso;
+	unsigned int line;
+	char *file, *src;
+	int len;
+
+	file = get_srcline_split(dso, addr, &line);
+	if (file == NULL)
+		return;
+
+	if (line == db->srcline_nr && db->srcfile && !strcmp(file, db->srcfile)) {
+		free(file);
+		return;
+	}
+
+	fprintf(out, "%s:%u\n", file, line);
+	if (opts->annotate_src) {
+		src = find_sourceline(file, line, &len);
+		if (src)
+			fprintf(out, "%.*s\n", len, src);
+	}
+
+	free(db->srcfile);
+	db->srcfile = file;
+	db->srcline_nr = line;
+}
+
+/*
+ * Disassemble a symbol in process with libopcodes, writing the same text
+ * objdump would, for x86 and arm64.  Returns -1 for anything else so it
+ * gets disassembled by objdump.
+ */
+static int symbol__disassemble_bfd(const char *filename, u64 start, u64 end,
+				   struct annotate_args *args,
+				   char **bufp, size_t *sizep)
 {
 	struct annotation_options *opts = args->options;
-	struct map *map = args->ms.map;
-	struct dso *dso = map->dso;
-	char *command;
-	FILE *file;
-	char symfs_filename[PATH_MAX];
-	struct kcore_extract kce;
-	bool delete_extract = false;
-	bool decomp = false;
-	int stdout_fd[2];
-	int lineno = 0;
-	int nline;
-	pid_t pid;
-	int err = dso__disassemble_filename(dso, symfs_filename, sizeof(symfs_filename));
+	struct disasm_bfd db = { .args = args, };
+	disassembler_ftype disassemble;
+	struct disassemble_info info;
+	bfd_byte *data = NULL;
+	char *insn = NULL;
+	size_t insn_size;
+	asection *sec;
+	FILE *out;
+	bfd *abfd;
+	u64 pc;
+	int ret = -1;
 
-	if (err)
-		return err;
+	/* Only objdump knows about a user provided objdump */
+	if (opts->objdump_path)
+		return -1;
 
-	pr_debug("%s: filename=%s, sym=%s, start=%#" PRIx64 ", end=%#" PRIx64 "\n", __func__,
-		 symfs_filename, sym->name, map->unmap_ip(map, sym->start),
-		 map->unmap_ip(map, sym->end));
+	abfd = bfd_openr(filename, NULL);
+	if (abfd == NULL)
+		return -1;
 
-	pr_debug("annotating [%p] %30s : [%p] %30s\n",
-		 dso, dso->long_name, sym, sym->name);
+	if (!bfd_check_format(abfd, bfd_object) ||
+	    (bfd_get_arch(abfd) != bfd_arch_i386 &&
+	     bfd_get_arch(abfd) != bfd_arch_aarch64))
+		goto out_close;
 
-	if (dso->binary_type == DSO_BINARY_TYPE__BPF_PROG_INFO) {
-		return symbol__disassemble_bpf(sym, args);
-	} else if (dso__is_kcore(dso)) {
-		kce.kcore_filename = symfs_filename;
-		kce.addr = map__rip_2objdump(map, sym->start);
-		kce.offs = sym->start;
-		kce.len = sym->end - sym->start;
-		if (!kcore_extract__create(&kce)) {
-			delete_extract = true;
-			strlcpy(symfs_filename, kce.extract_filename,
-				sizeof(symfs_filename));
-		}
-	} else if (dso__needs_decompress(dso)) {
-		char tmp[KMOD_DECOMP_LEN];
+	for (sec = abfd->sections; sec; sec = sec->next) {
+		if ((bfd_get_section_flags(abfd, sec) & SEC_CODE) &&
+		    start >= bfd_get_section_vma(abfd, sec) &&
+		    end <= bfd_get_section_vma(abfd, sec) +
+			   bfd_get_section_size(sec))
+			break;
+	}
 
-		if (dso__decompress_kmodule_path(dso, symfs_filename,
-						 tmp, sizeof(tmp)) < 0)
-			goto out;
+	if (sec == NULL || !bfd_malloc_and_get_section(abfd, sec, &data))
+		goto out_close;
 
-		decomp = true;
-		strcpy(symfs_filename, tmp);
+	out = open_memstream(bufp, sizep);
+	if (out == NULL)
+		goto out_free;
+
+	db.insn = open_memstream(&insn, &insn_size);
+	if (db.insn == NULL)
+		goto out_fclose;
+
+	init_disassemble_info(&info, db.insn, (fprintf_ftype)fprintf);
+	info.arch	       = bfd_get_arch(abfd);
+	info.mach	       = bfd_get_mach(abfd);
+	info.buffer	       = data;
+	info.buffer_vma	       = bfd_get_section_vma(abfd, sec);
+	info.buffer_length     = bfd_get_section_size(sec);
+	info.section	       = sec;
+	info.application_data  = &db;
+	info.print_address_func = disasm_bfd__print_address;
+	info.disassembler_options = opts->disassembler_style;
+	disassemble_init_for_target(&info);
+
+#ifdef DISASM_FOUR_ARGS_SIGNATURE
+	disassemble = disassembler(info.arch, bfd_big_endian(abfd), info.mach,
+				   abfd);
+#else
+	disassemble = disassembler(abfd);
+#endif
+	if (disassemble == NULL)
+		goto out_fclose_insn;
+
+	for (pc = start; pc < end; ) {
+		int i, count;
+
+		disasm_bfd__srcline(&db, out, pc);
+
+		rewind(db.insn);
+		count = disassemble(pc, &info);
+		fputc('\0', db.insn);
+		fflush(db.insn);
+		if (count <= 0)
+			break;
+
+		fprintf(out, "%8" PRIx64 ":\t", pc);
+		if (opts->show_asm_raw) {
+			for (i = 0; i < count; i++)
+				fprintf(out, "%02x ", data[pc - info.buffer_vma + i]);
+			fputc('\t', out);
+		}
+		fprintf(out, "%s\n", insn);
+		pc += count;
 	}
 
+	ret = 0;
+out_fclose_insn:
+	fclose(db.insn);
+	free(insn);
+	free(db.srcfile);
+out_fclose:
+	fclose(out);
+	if (ret) {
+		zfree(bufp);
+		*sizep = 0;
+	}
+out_free:
+	free(data);
+out_close:
+	bfd_close(abfd);
+	return ret;
+}
+#else
+static int symbol__disassemble_bfd(const char *filename __maybe_unused,
+				   u64 start __maybe_unused,
+				   u64 end __maybe_unused,
+				   struct annotate_args *args __maybe_unused,
+				   char **bufp __maybe_unused,
+				   size_t *sizep __maybe_unused)
+{
+	return -1;
+}
+#endif /* HAVE_LIBBFD_SUPPORT */
+
+/* Run objdump on the symbol and save all its output in *bufp */
+static int symbol__disassemble_objdump(const char *filename, u64 start, u64 end,
+				       struct annotation_options *opts,
+				       char **bufp, size_t *sizep)
+{
+	char *command, *buf = NULL;
+	size_t size = 0, alloc = 0;
+	int stdout_fd[2];
+	int status, err;
+	ssize_t n;
+	pid_t pid;
+
 	err = asprintf(&command,
 		 "%s %s%s --start-address=0x%016" PRIx64
 		 " --stop-address=0x%016" PRIx64
@@ -1890,14 +2294,13 @@ static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
 		 opts->objdump_path ?: "objdump",
 		 opts->disassembler_style ? "-M " : "",
 		 opts->disassembler_style ?: "",
-		 map__rip_2objdump(map, sym->start),
-		 map__rip_2objdump(map, sym->end),
+		 start, end,
 		 opts->show_asm_raw ? "" : "--no-show-raw",
 		 opts->annotate_src ? "-S" : "");
 
 	if (err < 0) {
 		pr_err("Failure allocating memory for the command to run\n");
-		goto out_remove_tmp;
+		return -1;
 	}
 
 	pr_debug("Executing: %s\n", command);
@@ -1911,14 +2314,15 @@ static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
 	pid = fork();
 	if (pid < 0) {
 		pr_err("Failure forking to run %s\n", command);
-		goto out_close_stdout;
+		close(stdout_fd[1]);
+		goto out_close;
 	}
 
 	if (pid == 0) {
 		close(stdout_fd[0]);
 		dup2(stdout_fd[1], 1);
 		close(stdout_fd[1]);
-		execl("/bin/sh", "sh", "-c", command, "--", symfs_filename,
+		execl("/bin/sh", "sh", "-c", command, "--", filename,
 		      NULL);
 		perror(command);
 		exit(-1);
@@ -1926,17 +2330,129 @@ static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
 
 	close(stdout_fd[1]);
 
-	file = fdopen(stdout_fd[0], "r");
+	do {
+		if (alloc - size < BUFSIZ) {
+			char *new = realloc(buf, alloc + 16 * BUFSIZ);
+
+			if (new == NULL) {
+				pr_err("Failure allocating memory for the output of %s\n",
+				       command);
+				zfree(&buf);
+				break;
+			}
+			buf = new;
+			alloc += 16 * BUFSIZ;
+		}
+
+		n = read(stdout_fd[0], buf + size, alloc - size);
+		if (n > 0)
+			size += n;
+	} while (n > 0 || (n < 0 && errno == EINTR));
+
+	waitpid(pid, &status, 0);
+
+	if (buf) {
+		if (size == 0)
+			pr_err("No output from %s\n", command);
+		*bufp  = buf;
+		*sizep = size;
+		err = 0;
+	}
+out_close:
+	close(stdout_fd[0]);
+out_free_command:
+	free(command);
+	return err;
+}
+
+static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
+{
+	struct annotation_options *opts = args->options;
+	struct map *map = args->ms.map;
+	struct dso *dso = map->dso;
+	u64 start = map__rip_2objdump(map, sym->start);
+	u64 end = map__rip_2objdump(map, sym->end);
+	char symfs_filename[PATH_MAX];
+	struct kcore_extract kce;
+	bool delete_extract = false;
+	bool decomp = false;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *file;
+	int lineno = 0;
+	int err = dso__disassemble_filename(dso, symfs_filename, sizeof(symfs_filename));
+
+	if (err)
+		return err;
+
+	pr_debug("%s: filename=%s, sym=%s, start=%#" PRIx64 ", end=%#" PRIx64 "\n", __func__,
+		 symfs_filename, sym->name, map->unmap_ip(map, sym->start),
+		 map->unmap_ip(map, sym->end));
+
+	pr_debug("annotating [%p] %30s : [%p] %30s\n",
+		 dso, dso->long_name, sym, sym->name);
+
+	if (dso->binary_type == DSO_BINARY_TYPE__BPF_PROG_INFO) {
+		pthread_mutex_lock(&disasm_bfd__lock);
+		err = symbol__disassemble_bpf(sym, args);
+		pthread_mutex_unlock(&disasm_bfd__lock);
+		return err;
+	}
+
+	/* kcore changes under us, everything else has a build-id */
+	if (!dso__is_kcore(dso) &&
+	    !disasm_cache__find(dso, start, end, opts, &buf, &size))
+		goto parse;
+
+	if (dso__is_kcore(dso)) {
+		kce.kcore_filename = symfs_filename;
+		kce.addr = start;
+		kce.offs = sym->start;
+		kce.len = sym->end - sym->start;
+		if (!kcore_extract__create(&kce)) {
+			delete_extract = true;
+			strlcpy(symfs_filename, kce.extract_filename,
+				sizeof(symfs_filename));
+		}
+	} else if (dso__needs_decompress(dso)) {
+		char tmp[KMOD_DECOMP_LEN];
+
+		if (dso__decompress_kmodule_path(dso, symfs_filename,
+						 tmp, sizeof(tmp)) < 0)
+			goto out;
+
+		decomp = true;
+		strcpy(symfs_filename, tmp);
+	}
+
+	pthread_mutex_lock(&disasm_bfd__lock);
+	err = symbol__disassemble_bfd(symfs_filename, start, end, args,
+				      &buf, &size);
+	pthread_mutex_unlock(&disasm_bfd__lock);
+
+	if (err && symbol__disassemble_objdump(symfs_filename, start, end, opts,
+					       &buf, &size)) {
+		err = -1;
+		goto out_remove_tmp;
+	}
+	err = 0;
+
+	if (!dso__is_kcore(dso))
+		disasm_cache__add(dso, start, end, opts, buf, size);
+
+parse:
+	/* fmemopen() doesn't take empty buffers */
+	if (size == 0)
+		goto out_remove_tmp;
+
+	file = fmemopen(buf, size, "r");
 	if (!file) {
-		pr_err("Failure creating FILE stream for %s\n", command);
-		/*
-		 * If we were using debug info should retry with
-		 * original binary.
-		 */
-		goto out_free_command;
+		pr_err("Failure creating FILE stream for the disassembly of %s\n",
+		       sym->name);
+		err = -1;
+		goto out_remove_tmp;
 	}
 
-	nline = 0;
 	while (!feof(file)) {
 		/*
 		 * The source code line number (lineno) needs to be kept in
@@ -1946,12 +2462,8 @@ static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
 		 */
 		if (symbol__parse_objdump_line(sym, file, args, &lineno) < 0)
 			break;
-		nline++;
 	}
 
-	if (nline == 0)
-		pr_err("No output from %s\n", command);
-
 	/*
 	 * kallsyms does not have symbol sizes so there may a nop at the end.
 	 * Remove it.
@@ -1960,11 +2472,8 @@ static int symbol__disassemble(struct symbol *sym, struct annotate_args *args)
 		delete_last_nop(sym);
 
 	fclose(file);
-	err = 0;
-out_free_command:
-	free(command);
 out_remove_tmp:
-	close(stdout_fd[0]);
+	free(buf);
 
 	if (decomp)
 		unlink(symfs_filename);
@@ -1973,10 +2482,27 @@ out_remove_tmp:
 		kcore_extract__delete(&kce);
 out:
 	return err;
+}
 
-out_close_stdout:
-	close(stdout_fd[1]);
-	goto out_free_command;
+static void annotation_data__set_percent(struct annotation_data *data,
+					 struct sym_hist *sym_hist,
+					 struct hists *hists,
+					 u64 hits, u64 period)
+{
+	if (sym_hist->nr_samples) {
+		data->he.period     = period;
+		data->he.nr_samples = hits;
+		data->percent[PERCENT_HITS_LOCAL] = 100.0 * hits / sym_hist->nr_samples;
+	}
+
+	if (hists->stats.nr_non_filtered_samples)
+		data->percent[PERCENT_HITS_GLOBAL] = 100.0 * hits / hists->stats.nr_non_filtered_samples;
+
+	if (sym_hist->period)
+		data->percent[PERCENT_PERIOD_LOCAL] = 100.0 * period / sym_hist->period;
+
+	if (hists->stats.total_period)
+		data->percent[PERCENT_PERIOD_GLOBAL] = 100.0 * period / hists->stats.total_period;
 }
 
 static void calc_percent(struct sym_hist *sym_hist,
@@ -1988,36 +2514,168 @@ static void calc_percent(struct sym_hist *sym_hist,
 	u64 period = 0;
 
 	while (offset < end) {
-		hits   += sym_hist->addr[offset].nr_samples;
-		period += sym_hist->addr[offset].period;
+		const struct sym_hist_entry *entry = sym_hist__entry(sym_hist, offset);
+
+		hits   += entry->nr_samples;
+		period += entry->period;
 		++offset;
 	}
 
-	if (sym_hist->nr_samples) {
-		data->he.period     = period;
-		data->he.nr_samples = hits;
-		data->percent[PERCENT_HITS_LOCAL] = 100.0 * hits / sym_hist->nr_samples;
+	annotation_data__set_percent(data, sym_hist, hists, hits, period);
+}
+
+/*
+ * The lines with instructions, in offset order, each up to the start of the
+ * next one, the last up to len.
+ */
+struct annotation_ranges {
+	int			 nr;
+	struct annotation_line	**lines;
+	/* nr + 1 starts, the last is len */
+	s64			*start;
+	struct sym_hist_entry	*sums;
+};
+
+static void annotation_ranges__exit(struct annotation_ranges *r)
+{
+	zfree(&r->lines);
+	zfree(&r->start);
+	zfree(&r->sums);
+}
+
+/* -1 when the lines with instructions aren't in offset order */
+static int annotation_ranges__init(struct annotation_ranges *r,
+				   struct annotation *notes, s64 len)
+{
+	struct annotation_line *al;
+	int nr = 0;
+
+	memset(r, 0, sizeof(*r));
+
+	list_for_each_entry(al, &notes->src->source, node) {
+		if (al->offset != -1)
+			nr++;
 	}
 
-	if (hists->stats.nr_non_filtered_samples)
-		data->percent[PERCENT_HITS_GLOBAL] = 100.0 * hits / hists->stats.nr_non_filtered_samples;
+	r->lines = calloc(nr ?: 1, sizeof(*r->lines));
+	r->start = calloc(nr + 1, sizeof(*r->start));
+	r->sums  = calloc(nr ?: 1, sizeof(*r->sums));
+	if (r->lines == NULL || r->start == NULL || r->sums == NULL)
+		goto out_err;
 
-	if (sym_hist->period)
-		data->percent[PERCENT_PERIOD_LOCAL] = 100.0 * period / sym_hist->period;
+	list_for_each_entry(al, &notes->src->source, node) {
+		if (al->offset == -1)
+			continue;
 
-	if (hists->stats.total_period)
-		data->percent[PERCENT_PERIOD_GLOBAL] = 100.0 * period / hists->stats.total_period;
+		if (r->nr && al->offset < r->start[r->nr - 1])
+			goto out_err;
+
+		r->lines[r->nr]   = al;
+		r->start[r->nr++] = al->offset;
+	}
+	r->start[r->nr] = len;
+	return 0;
+
+out_err:
+	annotation_ranges__exit(r);
+	return -1;
+}
+
+/* The line of offset, the last one starting at or before it */
+static int annotation_ranges__find(struct annotation_ranges *r, s64 offset)
+{
+	int lo = 0, hi = r->nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (r->start[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/*
+ * Sum the samples of each line in one pass over the histogram: in order for
+ * the dense ones, over just the offsets with samples for the sparse ones.
+ */
+static void annotation_ranges__sum(struct annotation_ranges *r, struct sym_hist *h)
+{
+	struct sym_hist_entry *sums = r->sums;
+	int i;
+
+	memset(sums, 0, r->nr * sizeof(*sums));
+
+	if (h->sparse == NULL) {
+		for (i = 0; i < r->nr; i++) {
+			u64 hits = 0, period = 0;
+			s64 offset;
+
+			for (offset = r->start[i]; offset < r->start[i + 1]; offset++) {
+				hits   += h->addr[offset].nr_samples;
+				period += h->addr[offset].period;
+			}
+			sums[i].nr_samples = hits;
+			sums[i].period	   = period;
+		}
+	} else {
+		u64 *slot;
+		size_t s;
+
+		sparse_hist__for_each(h->sparse, s, slot) {
+			const struct sym_hist_entry *entry = (void *)(slot + 1);
+			s64 offset = *slot - 1;
+
+			if (!r->nr || offset < r->start[0] || offset >= r->start[r->nr])
+				continue;
+
+			i = annotation_ranges__find(r, offset);
+			sums[i].nr_samples += entry->nr_samples;
+			sums[i].period	   += entry->period;
+		}
+	}
 }
 
+/*
+ * Each line for each event looked up the samples of each of its offsets,
+ * one hash lookup per byte of a large symbol, so sum all the lines of an
+ * event at once, then make them percents.
+ */
 static void annotation__calc_percent(struct annotation *notes,
 				     struct perf_evsel *leader, s64 len)
 {
+	struct annotation_ranges r;
 	struct annotation_line *al, *next;
 	struct perf_evsel *evsel;
+	int i = 0, j;
+
+	if (annotation_ranges__init(&r, notes, len))
+		goto slow;
+
+	for_each_group_evsel(evsel, leader) {
+		struct hists *hists = evsel__hists(evsel);
+		struct sym_hist *sym_hist = annotation__histogram(notes, evsel->idx);
+
+		annotation_ranges__sum(&r, sym_hist);
 
+		for (j = 0; j < r.nr; j++) {
+			al = r.lines[j];
+			BUG_ON(i >= al->data_nr);
+			annotation_data__set_percent(&al->data[i], sym_hist, hists,
+						     r.sums[j].nr_samples, r.sums[j].period);
+		}
+		i++;
+	}
+
+	annotation_ranges__exit(&r);
+	return;
+
+slow:
 	list_for_each_entry(al, &notes->src->source, node) {
 		s64 end;
-		int i = 0;
 
 		if (al->offset == -1)
 			continue;
@@ -2025,6 +2683,7 @@ static void annotation__calc_percent(struct annotation *notes,
 		next = annotation_line__next(al, &notes->src->source);
 		end  = next ? next->offset : len;
 
+		i = 0;
 		for_each_group_evsel(evsel, leader) {
 			struct hists *hists = evsel__hists(evsel);
 			struct annotation_data *data;
@@ -2066,9 +2725,12 @@ int symbol__annotate(struct symbol *sym, struct map *map,
 	if (!arch_name)
 		return -1;
 
+	pthread_mutex_lock(&arch__lock);
 	args.arch = arch = arch__find(arch_name);
-	if (arch == NULL)
+	if (arch == NULL) {
+		pthread_mutex_unlock(&arch__lock);
 		return -ENOTSUP;
+	}
 
 	if (parch)
 		*parch = arch;
@@ -2076,10 +2738,16 @@ int symbol__annotate(struct symbol *sym, struct map *map,
 	if (arch->init) {
 		err = arch->init(arch, env ? env->cpuid : NULL);
 		if (err) {
+			pthread_mutex_unlock(&arch__lock);
 			pr_err("%s: failed to initialize %s arch priv area\n", __func__, arch->name);
 			return err;
 		}
 	}
+	pthread_mutex_unlock(&arch__lock);
+
+	/* Already annotated ahead of time, see perf annotate --hottest */
+	if (!list_empty(&notes->src->source))
+		return 0;
 
 	args.ms.map = map;
 	args.ms.sym = sym;
@@ -2219,10 +2887,13 @@ static void symbol__annotate_hits(struct symbol *sym, struct perf_evsel *evsel)
 	struct sym_hist *h = annotation__histogram(notes, evsel->idx);
 	u64 len = symbol__size(sym), offset;
 
-	for (offset = 0; offset < len; ++offset)
-		if (h->addr[offset].nr_samples != 0)
+	for (offset = 0; offset < len; ++offset) {
+		const struct sym_hist_entry *entry = sym_hist__entry(h, offset);
+
+		if (entry->nr_samples != 0)
 			printf("%*" PRIx64 ": %" PRIu64 "\n", BITS_PER_LONG / 2,
-			       sym->start + offset, h->addr[offset].nr_samples);
+			       sym->start + offset, entry->nr_samples);
+	}
 	printf("%*s: %" PRIu64 "\n", BITS_PER_LONG / 2, "h->nr_samples", h->nr_samples);
 }
 
@@ -2441,6 +3112,12 @@ void symbol__annotate_zero_histogram(struct symbol *sym, int evidx)
 	struct annotation *notes = symbol__annotation(sym);
 	struct sym_hist *h = annotation__histogram(notes, evidx);
 
+	if (h->sparse) {
+		h->nr_samples = h->period = 0;
+		sparse_hist__zero(h->sparse);
+		return;
+	}
+
 	memset(h, 0, notes->src->sizeof_sym_hist);
 }
 
@@ -2451,6 +3128,19 @@ void symbol__annotate_decay_histogram(struct symbol *sym, int evidx)
 	int len = symbol__size(sym), offset;
 
 	h->nr_samples = 0;
+	if (h->sparse) {
+		struct sym_hist_entry *entry;
+		size_t i;
+		u64 *slot;
+
+		sparse_hist__for_each(h->sparse, i, slot) {
+			entry = (struct sym_hist_entry *)(slot + 1);
+			entry->nr_samples = entry->nr_samples * 7 / 8;
+			h->nr_samples += entry->nr_samples;
+		}
+		return;
+	}
+
 	for (offset = 0; offset < len; ++offset) {
 		h->addr[offset].nr_samples = h->addr[offset].nr_samples * 7 / 8;
 		h->nr_samples += h->addr[offset].nr_samples;
@@ -223,12 +223,33 @@ int disasm_line__scnprintf(struct disasm_line *dl, char *bf, size_t size, bool r
 size_t disasm__fprintf(struct list_head *head, FILE *fp);
 void symbol__calc_percent(struct symbol *sym, struct perf_evsel *evsel);
 
+/*
+ * The histograms of the symbols larger than this only have the offsets
+ * with samples, in a sparse_hist, most of those of a large symbol, say a
+ * JITted blob or a kernel text symbol, get none.
+ */
+#define ANNOTATION__SPARSE_SIZE	(64 * 1024)
+
+struct sparse_hist;
+
 struct sym_hist {
 	u64		      nr_samples;
 	u64		      period;
+	/* the entries, instead of addr, for the large symbols */
+	struct sparse_hist   *sparse;
 	struct sym_hist_entry addr[0];
 };
 
+const struct sym_hist_entry *sym_hist__sparse_entry(struct sym_hist *h, u64 offset);
+
+/* The samples at offset, zero if none */
+static inline const struct sym_hist_entry *sym_hist__entry(struct sym_hist *h, u64 offset)
+{
+	if (h->sparse == NULL)
+		return &h->addr[offset];
+	return sym_hist__sparse_entry(h, offset);
+}
+
 struct cyc_hist {
 	u64	start;
 	u64	cycles;
@@ -252,6 +273,7 @@ struct cyc_hist {
  * @lines: If 'print_lines' is specified, per source code line percentages
  * @source: source parsed from a disassembler like objdump -dS
  * @cyc_hist: Average cycles per basic block
+ * @cycles_sparse: Instead of cycles_hist for the large symbols
  *
  * lines is allocated, percentages calculated and all sorted by percentage
  * when the annotation is about to be presented, so the percentages are for
@@ -264,9 +286,12 @@ struct annotated_source {
 	int    		   nr_histograms;
 	size_t		   sizeof_sym_hist;
 	struct cyc_hist	   *cycles_hist;
+	struct sparse_hist *cycles_sparse;
 	struct sym_hist	   *histograms;
 };
 
+void annotated_source__delete(struct annotated_source *src);
+
 struct annotation {
 	pthread_mutex_t		lock;
 	u64			max_coverage;
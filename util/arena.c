@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+
+struct arena_chunk {
+	struct list_head	list;
+	char			data[] __attribute__((aligned(sizeof(u64))));
+};
+
+void arena__init(struct arena *arena, enum mem_stat_id mem_stat)
+{
+	pthread_mutex_init(&arena->lock, NULL);
+	INIT_LIST_HEAD(&arena->chunks);
+	arena->cur = NULL;
+	arena->avail = 0;
+	arena->mem_stat = mem_stat;
+	arena->bytes = 0;
+	arena->nr_objs = 0;
+}
+
+void arena__exit(struct arena *arena)
+{
+	struct arena_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, &arena->chunks, list) {
+		list_del(&chunk->list);
+		free(chunk);
+	}
+
+	mem_stats__sub(arena->mem_stat, arena->bytes, arena->nr_objs);
+	pthread_mutex_destroy(&arena->lock);
+	arena->cur = NULL;
+	arena->avail = 0;
+	arena->bytes = 0;
+	arena->nr_objs = 0;
+}
+
+void *arena__zalloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *obj = NULL;
+
+	size = roundup(size, sizeof(u64));
+
+	pthread_mutex_lock(&arena->lock);
+
+	if (size > arena->avail) {
+		size_t chunk_size = max(size, (size_t)ARENA_CHUNK_SIZE);
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			goto out_unlock;
+
+		list_add(&chunk->list, &arena->chunks);
+		arena->bytes += sizeof(*chunk) + chunk_size;
+		mem_stats__add(arena->mem_stat, sizeof(*chunk) + chunk_size, 0);
+		/* a big object gets a chunk of its own, keep the current one */
+		if (size > ARENA_CHUNK_SIZE / 2 && arena->cur) {
+			obj = chunk->data;
+			goto out_zero;
+		}
+
+		arena->cur = chunk->data;
+		arena->avail = chunk_size;
+	}
+
+	obj = arena->cur;
+	arena->cur += size;
+	arena->avail -= size;
+out_zero:
+	memset(obj, 0, size);
+	arena->nr_objs++;
+	mem_stats__add(arena->mem_stat, 0, 1);
+out_unlock:
+	pthread_mutex_unlock(&arena->lock);
+	return obj;
+}
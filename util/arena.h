@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_ARENA_H
+#define __PERF_ARENA_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+#include <pthread.h>
+#include "mem-stats.h"
+
+/*
+ * Objects of any size carved out of 64K chunks, for what lives as long as
+ * its owner: nothing is freed on its own, the chunks are all released in
+ * arena__exit().
+ */
+struct arena {
+	pthread_mutex_t		 lock;
+	struct list_head	 chunks;
+	char			*cur;
+	size_t			 avail;
+	/* accounted chunk bytes and objects */
+	enum mem_stat_id	 mem_stat;
+	size_t			 bytes;
+	size_t			 nr_objs;
+};
+
+void  arena__init(struct arena *arena, enum mem_stat_id mem_stat);
+void  arena__exit(struct arena *arena);
+void *arena__zalloc(struct arena *arena, size_t size);
+
+#endif /* __PERF_ARENA_H */
@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Arm Statistical Profiling Extensions (SPE) support
+ * Copyright (c) 2017-2018, Arm Ltd.
+ */
+
+#include <string.h>
+
+#include "arm-spe-pkt-decoder.h"
+#include "arm-spe-decoder.h"
+
+#define ARM_SPE_ADDR_PC		0
+#define ARM_SPE_ADDR_TGT	1
+#define ARM_SPE_ADDR_VA		2
+#define ARM_SPE_ADDR_PA		3
+
+#define ARM_SPE_CNT_TOTAL	0
+#define ARM_SPE_CNT_ISSUE	1
+#define ARM_SPE_CNT_XLAT	2
+
+#define ARM_SPE_OP_CLASS_OTHER	0
+#define ARM_SPE_OP_CLASS_LDST	1
+#define ARM_SPE_OP_CLASS_BRANCH	2
+
+#define ADDR_BYTES_0_6(payload)	((payload) & ~(0xffULL << 56))
+#define ADDR_EL(payload)	(((payload) >> 61) & 0x3)
+
+/* The instruction addresses have 56 bits, sign extended */
+static u64 arm_spe_insn_addr(u64 payload)
+{
+	u64 addr = ADDR_BYTES_0_6(payload);
+
+	if (addr & (1ULL << 55))
+		addr |= 0xffULL << 56;
+	return addr;
+}
+
+/* The top byte of a data address is a tag, unless it's a kernel address */
+static u64 arm_spe_data_addr(u64 payload)
+{
+	u64 addr = ADDR_BYTES_0_6(payload);
+
+	if (((payload >> 48) & 0xff) == 0xff)
+		addr |= 0xffULL << 56;
+	return addr;
+}
+
+void arm_spe_decoder__init(struct arm_spe_decoder *decoder,
+			   const unsigned char *buf, size_t len)
+{
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->buf = buf;
+	decoder->len = len;
+}
+
+static void arm_spe_record__add(struct arm_spe_record *record,
+				const struct arm_spe_pkt *packet)
+{
+	u64 payload = packet->payload;
+
+	switch (packet->type) {
+	case ARM_SPE_ADDRESS:
+		switch (packet->index) {
+		case ARM_SPE_ADDR_PC:
+			record->from_ip = arm_spe_insn_addr(payload);
+			record->el = ADDR_EL(payload);
+			break;
+		case ARM_SPE_ADDR_TGT:
+			record->to_ip = arm_spe_insn_addr(payload);
+			break;
+		case ARM_SPE_ADDR_VA:
+			record->virt_addr = arm_spe_data_addr(payload);
+			break;
+		case ARM_SPE_ADDR_PA:
+			record->phys_addr = ADDR_BYTES_0_6(payload);
+			record->has_phys_addr = true;
+			break;
+		default:
+			break;
+		}
+		break;
+	case ARM_SPE_COUNTER:
+		switch (packet->index) {
+		case ARM_SPE_CNT_TOTAL:
+			record->latency = payload;
+			break;
+		case ARM_SPE_CNT_ISSUE:
+			record->issue_latency = payload;
+			break;
+		case ARM_SPE_CNT_XLAT:
+			record->xlat_latency = payload;
+			break;
+		default:
+			break;
+		}
+		break;
+	case ARM_SPE_CONTEXT:
+		record->context_id = payload;
+		record->has_context = true;
+		break;
+	case ARM_SPE_OP_TYPE:
+		if (packet->index == ARM_SPE_OP_CLASS_LDST)
+			record->op = payload & 0x1 ? ARM_SPE_OP_STORE : ARM_SPE_OP_LOAD;
+		else if (packet->index == ARM_SPE_OP_CLASS_BRANCH)
+			record->op = ARM_SPE_OP_BRANCH;
+		break;
+	case ARM_SPE_EVENTS:
+		record->events = payload;
+		break;
+	case ARM_SPE_DATA_SOURCE:
+		record->source = payload;
+		record->has_source = true;
+		break;
+	case ARM_SPE_BAD:
+	case ARM_SPE_PAD:
+	case ARM_SPE_END:
+	case ARM_SPE_TIMESTAMP:
+	default:
+		break;
+	}
+}
+
+/*
+ * A record ends with its timestamp, or with an END packet when the
+ * timestamps are off. A bad packet skips a byte, as in the dump.
+ */
+int arm_spe_decode(struct arm_spe_decoder *decoder, struct arm_spe_record *record)
+{
+	struct arm_spe_pkt packet;
+	bool empty = true;
+	int ret;
+
+	memset(record, 0, sizeof(*record));
+
+	while (decoder->len) {
+		ret = arm_spe_get_packet(decoder->buf, decoder->len, &packet);
+		if (ret <= 0) {
+			/* a record cut at the end of the buffer is dropped */
+			if (ret == ARM_SPE_NEED_MORE_BYTES)
+				break;
+			decoder->nr_bad++;
+			ret = 1;
+			packet.type = ARM_SPE_BAD;
+		}
+
+		decoder->buf += ret;
+		decoder->len -= ret;
+
+		if (packet.type == ARM_SPE_PAD || packet.type == ARM_SPE_BAD)
+			continue;
+
+		if (packet.type == ARM_SPE_TIMESTAMP) {
+			record->timestamp = packet.payload;
+			return 1;
+		}
+
+		if (packet.type == ARM_SPE_END) {
+			if (empty)
+				continue;
+			return 1;
+		}
+
+		arm_spe_record__add(record, &packet);
+		empty = false;
+	}
+
+	decoder->len = 0;
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Arm Statistical Profiling Extensions (SPE) support
+ * Copyright (c) 2017-2018, Arm Ltd.
+ */
+
+#ifndef INCLUDE__ARM_SPE_DECODER_H__
+#define INCLUDE__ARM_SPE_DECODER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+/* The bits of the EVENTS packet */
+#define ARM_SPE_EV_EXCEPTION_GEN	(1 << 0)
+#define ARM_SPE_EV_RETIRED		(1 << 1)
+#define ARM_SPE_EV_L1D_ACCESS		(1 << 2)
+#define ARM_SPE_EV_L1D_REFILL		(1 << 3)
+#define ARM_SPE_EV_TLB_ACCESS		(1 << 4)
+#define ARM_SPE_EV_TLB_REFILL		(1 << 5)
+#define ARM_SPE_EV_NOT_TAKEN		(1 << 6)
+#define ARM_SPE_EV_MISPRED		(1 << 7)
+#define ARM_SPE_EV_LLC_ACCESS		(1 << 8)
+#define ARM_SPE_EV_LLC_REFILL		(1 << 9)
+#define ARM_SPE_EV_REMOTE_ACCESS	(1 << 10)
+
+enum arm_spe_op {
+	ARM_SPE_OP_OTHER,
+	ARM_SPE_OP_LOAD,
+	ARM_SPE_OP_STORE,
+	ARM_SPE_OP_BRANCH,
+};
+
+/* The data sources of the Neoverse cores, the encoding is implementation defined */
+enum arm_spe_neoverse_source {
+	ARM_SPE_NV_L1D		= 0x0,
+	ARM_SPE_NV_L2		= 0x8,
+	ARM_SPE_NV_PEER_CORE	= 0x9,
+	ARM_SPE_NV_LOCAL_CLUSTER = 0xa,
+	ARM_SPE_NV_SYS_CACHE	= 0xb,
+	ARM_SPE_NV_PEER_CLUSTER	= 0xc,
+	ARM_SPE_NV_REMOTE	= 0xd,
+	ARM_SPE_NV_DRAM		= 0xe,
+};
+
+/* A sampled operation, the packets from one record of the trace */
+struct arm_spe_record {
+	u64		timestamp;
+	u64		from_ip;
+	u64		to_ip;		/* of a branch */
+	u64		virt_addr;
+	u64		phys_addr;
+	u64		context_id;	/* the pid, with PID_IN_CONTEXTIDR */
+	u32		events;
+	u16		latency;	/* total, in cycles */
+	u16		issue_latency;
+	u16		xlat_latency;
+	u16		source;
+	u8		op;
+	u8		el;		/* exception level of from_ip */
+	bool		has_context;
+	bool		has_source;
+	bool		has_phys_addr;
+};
+
+/*
+ * Decodes records out of a buffer of SPE trace. It only touches the buffer
+ * and the record, so the buffers of different queues can be decoded on
+ * different threads.
+ */
+struct arm_spe_decoder {
+	const unsigned char	*buf;
+	size_t			len;
+	/* bad packets skipped */
+	unsigned long		nr_bad;
+};
+
+void arm_spe_decoder__init(struct arm_spe_decoder *decoder,
+			   const unsigned char *buf, size_t len);
+/* 1 with the next record decoded, 0 at the end of the buffer */
+int arm_spe_decode(struct arm_spe_decoder *decoder, struct arm_spe_record *record);
+
+#endif
@@ -12,6 +12,8 @@
 #include <linux/types.h>
 #include <linux/bitops.h>
 #include <linux/log2.h>
+#include <pthread.h>
+#include <stdlib.h>
 
 #include "cpumap.h"
 #include "color.h"
@@ -22,9 +24,52 @@
 #include "util.h"
 #include "thread.h"
 #include "debug.h"
+#include "config.h"
 #include "auxtrace.h"
 #include "arm-spe.h"
 #include "arm-spe-pkt-decoder.h"
+#include "arm-spe-decoder.h"
+
+#define ARM_SPE_CHUNK_RECORDS	4096
+#define ARM_SPE_MAX_CHUNKS	16
+
+/* The samples synthesized from the records, with the itrace option of each */
+enum arm_spe_sample_kind {
+	ARM_SPE_L1D_MISS,
+	ARM_SPE_L1D_ACCESS,
+	ARM_SPE_LLC_MISS,
+	ARM_SPE_LLC_ACCESS,
+	ARM_SPE_TLB_MISS,
+	ARM_SPE_TLB_ACCESS,
+	ARM_SPE_BRANCH_MISS,
+	ARM_SPE_REMOTE_ACCESS,
+	ARM_SPE_MEMORY,
+	ARM_SPE_SAMPLE_MAX,
+};
+
+static const struct {
+	const char	*name;
+	u64		config;
+	u32		events;		/* any of, 0 for the loads and stores */
+} arm_spe_samples[ARM_SPE_SAMPLE_MAX] = {
+	[ARM_SPE_L1D_MISS]	= { "l1d-miss", PERF_COUNT_HW_CACHE_MISSES,
+				    ARM_SPE_EV_L1D_REFILL, },
+	[ARM_SPE_L1D_ACCESS]	= { "l1d-access", PERF_COUNT_HW_CACHE_REFERENCES,
+				    ARM_SPE_EV_L1D_ACCESS, },
+	[ARM_SPE_LLC_MISS]	= { "llc-miss", PERF_COUNT_HW_CACHE_MISSES,
+				    ARM_SPE_EV_LLC_REFILL, },
+	[ARM_SPE_LLC_ACCESS]	= { "llc-access", PERF_COUNT_HW_CACHE_REFERENCES,
+				    ARM_SPE_EV_LLC_ACCESS, },
+	[ARM_SPE_TLB_MISS]	= { "tlb-miss", PERF_COUNT_HW_CACHE_MISSES,
+				    ARM_SPE_EV_TLB_REFILL, },
+	[ARM_SPE_TLB_ACCESS]	= { "tlb-access", PERF_COUNT_HW_CACHE_REFERENCES,
+				    ARM_SPE_EV_TLB_ACCESS, },
+	[ARM_SPE_BRANCH_MISS]	= { "branch-miss", PERF_COUNT_HW_BRANCH_MISSES,
+				    ARM_SPE_EV_MISPRED, },
+	[ARM_SPE_REMOTE_ACCESS]	= { "remote-access", PERF_COUNT_HW_CACHE_MISSES,
+				    ARM_SPE_EV_REMOTE_ACCESS, },
+	[ARM_SPE_MEMORY]	= { "memory", PERF_COUNT_HW_CACHE_REFERENCES, 0, },
+};
 
 struct arm_spe {
 	struct auxtrace			auxtrace;
@@ -34,6 +79,24 @@ struct arm_spe {
 	struct perf_session		*session;
 	struct machine			*machine;
 	u32				pmu_type;
+	bool				data_queued;
+	struct itrace_synth_opts	synth_opts;
+	bool				sample[ARM_SPE_SAMPLE_MAX];
+	u64				sample_id[ARM_SPE_SAMPLE_MAX];
+	u64				sample_type;
+	size_t				event_size;
+	unsigned long			num_events;
+	unsigned int			nr_decode_threads;
+	/* the records decoded on the workers, see arm_spe_decode_queues() */
+	pthread_mutex_t			lock;
+	pthread_cond_t			produced;
+	pthread_cond_t			consumed;
+};
+
+struct arm_spe_chunk {
+	struct list_head	node;
+	unsigned int		nr;
+	struct arm_spe_record	records[ARM_SPE_CHUNK_RECORDS];
 };
 
 struct arm_spe_queue {
@@ -45,6 +108,21 @@ struct arm_spe_queue {
 	pid_t			pid;
 	pid_t			tid;
 	int			cpu;
+	/* the pid of context_tid, from the CONTEXT packets */
+	pid_t			context_pid;
+	pid_t			context_tid;
+	/* filled on a worker, delivered by the main thread */
+	struct list_head	chunks;
+	struct arm_spe_chunk	*chunk;
+	unsigned int		nr_chunks;
+	bool			decoded;
+};
+
+/* The queues decoded together, the workers take them in turn */
+struct arm_spe_decode {
+	struct arm_spe_queue	**queues;
+	unsigned int		nr_queues;
+	unsigned int		next;
 };
 
 static void arm_spe_dump(struct arm_spe *spe __maybe_unused,
@@ -93,11 +171,488 @@ static void arm_spe_dump_event(struct arm_spe *spe, unsigned char *buf,
 	arm_spe_dump(spe, buf, len);
 }
 
-static int arm_spe_process_event(struct perf_session *session __maybe_unused,
-				 union perf_event *event __maybe_unused,
+static struct arm_spe_queue *arm_spe_alloc_queue(struct arm_spe *spe,
+						 unsigned int queue_nr)
+{
+	struct arm_spe_queue *speq = zalloc(sizeof(*speq));
+
+	if (!speq)
+		return NULL;
+
+	speq->spe = spe;
+	speq->queue_nr = queue_nr;
+	speq->pid = -1;
+	speq->tid = -1;
+	speq->cpu = -1;
+	speq->context_tid = -1;
+	INIT_LIST_HEAD(&speq->chunks);
+
+	return speq;
+}
+
+static int arm_spe_setup_queues(struct arm_spe *spe)
+{
+	unsigned int i;
+
+	for (i = 0; i < spe->queues.nr_queues; i++) {
+		struct auxtrace_queue *queue = &spe->queues.queue_array[i];
+		struct arm_spe_queue *speq = queue->priv;
+
+		if (list_empty(&queue->head) || speq)
+			continue;
+
+		speq = arm_spe_alloc_queue(spe, i);
+		if (!speq)
+			return -ENOMEM;
+		queue->priv = speq;
+
+		if (queue->cpu != -1)
+			speq->cpu = queue->cpu;
+		speq->tid = queue->tid;
+	}
+	return 0;
+}
+
+static inline int arm_spe_update_queues(struct arm_spe *spe)
+{
+	if (spe->queues.new_data) {
+		spe->queues.new_data = false;
+		return arm_spe_setup_queues(spe);
+	}
+	return 0;
+}
+
+static u64 arm_spe_data_src(const struct arm_spe_record *record)
+{
+	union perf_mem_data_src data_src = { .val = 0, };
+
+	if (record->op == ARM_SPE_OP_LOAD)
+		data_src.mem_op = PERF_MEM_OP_LOAD;
+	else if (record->op == ARM_SPE_OP_STORE)
+		data_src.mem_op = PERF_MEM_OP_STORE;
+	else
+		data_src.mem_op = PERF_MEM_OP_NA;
+
+	data_src.mem_snoop = PERF_MEM_SNOOP_NA;
+	data_src.mem_lvl_num = PERF_MEM_LVLNUM_NA;
+
+	if (record->has_source && record->op == ARM_SPE_OP_LOAD) {
+		switch (record->source) {
+		case ARM_SPE_NV_L1D:
+			data_src.mem_lvl = PERF_MEM_LVL_L1 | PERF_MEM_LVL_HIT;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_L1;
+			data_src.mem_snoop = PERF_MEM_SNOOP_NONE;
+			break;
+		case ARM_SPE_NV_L2:
+			data_src.mem_lvl = PERF_MEM_LVL_L2 | PERF_MEM_LVL_HIT;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_L2;
+			data_src.mem_snoop = PERF_MEM_SNOOP_NONE;
+			break;
+		case ARM_SPE_NV_PEER_CORE:
+			data_src.mem_lvl = PERF_MEM_LVL_L2 | PERF_MEM_LVL_HIT;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_L2;
+			data_src.mem_snoop = PERF_MEM_SNOOP_HITM;
+			break;
+		case ARM_SPE_NV_LOCAL_CLUSTER:
+		case ARM_SPE_NV_PEER_CLUSTER:
+			data_src.mem_lvl = PERF_MEM_LVL_L3 | PERF_MEM_LVL_HIT;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_L3;
+			data_src.mem_snoop = PERF_MEM_SNOOP_HITM;
+			break;
+		case ARM_SPE_NV_SYS_CACHE:
+			data_src.mem_lvl = PERF_MEM_LVL_L3 | PERF_MEM_LVL_HIT;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_L3;
+			data_src.mem_snoop = PERF_MEM_SNOOP_NONE;
+			break;
+		case ARM_SPE_NV_REMOTE:
+			data_src.mem_lvl = PERF_MEM_LVL_REM_CCE1;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_ANY_CACHE;
+			data_src.mem_remote = PERF_MEM_REMOTE_REMOTE;
+			data_src.mem_snoop = PERF_MEM_SNOOP_HITM;
+			break;
+		case ARM_SPE_NV_DRAM:
+			data_src.mem_lvl = PERF_MEM_LVL_LOC_RAM | PERF_MEM_LVL_HIT;
+			data_src.mem_lvl_num = PERF_MEM_LVLNUM_RAM;
+			data_src.mem_snoop = PERF_MEM_SNOOP_NONE;
+			break;
+		default:
+			break;
+		}
+	} else if (record->op == ARM_SPE_OP_LOAD || record->op == ARM_SPE_OP_STORE) {
+		/* no data source, as much as the events tell */
+		if (record->events & ARM_SPE_EV_LLC_REFILL) {
+			data_src.mem_lvl = PERF_MEM_LVL_L3 | PERF_MEM_LVL_MISS;
+		} else if (record->events & ARM_SPE_EV_LLC_ACCESS) {
+			data_src.mem_lvl = PERF_MEM_LVL_L3 | PERF_MEM_LVL_HIT;
+		} else if (record->events & ARM_SPE_EV_L1D_REFILL) {
+			data_src.mem_lvl = PERF_MEM_LVL_L1 | PERF_MEM_LVL_MISS;
+		} else if (record->events & ARM_SPE_EV_L1D_ACCESS) {
+			data_src.mem_lvl = PERF_MEM_LVL_L1 | PERF_MEM_LVL_HIT;
+		}
+		if (record->events & ARM_SPE_EV_REMOTE_ACCESS)
+			data_src.mem_lvl |= PERF_MEM_LVL_REM_CCE1;
+	}
+
+	if (record->events & ARM_SPE_EV_TLB_REFILL)
+		data_src.mem_dtlb = PERF_MEM_TLB_WK | PERF_MEM_TLB_MISS;
+	else if (record->events & ARM_SPE_EV_TLB_ACCESS)
+		data_src.mem_dtlb = PERF_MEM_TLB_L1 | PERF_MEM_TLB_HIT;
+
+	return data_src.val;
+}
+
+/* With PID_IN_CONTEXTIDR the CONTEXT packets have the tid that ran */
+static void arm_spe_set_tid(struct arm_spe_queue *speq,
+			    const struct arm_spe_record *record,
+			    struct perf_sample *sample)
+{
+	struct thread *thread;
+
+	sample->pid = speq->pid;
+	sample->tid = speq->tid;
+
+	if (!record->has_context)
+		return;
+
+	if ((pid_t)record->context_id != speq->context_tid) {
+		speq->context_tid = record->context_id;
+		speq->context_pid = -1;
+
+		thread = machine__find_thread(speq->spe->machine, -1,
+					      speq->context_tid);
+		if (thread) {
+			speq->context_pid = thread->pid_;
+			thread__put(thread);
+		}
+	}
+
+	sample->pid = speq->context_pid;
+	sample->tid = speq->context_tid;
+}
+
+static int arm_spe_synth_sample(struct arm_spe_queue *speq,
+				const struct arm_spe_record *record,
+				enum arm_spe_sample_kind kind)
+{
+	struct arm_spe *spe = speq->spe;
+	union perf_event event;
+	struct perf_sample sample = { .ip = 0, };
+	int ret;
+
+	if (spe->synth_opts.initial_skip &&
+	    spe->num_events++ <= spe->synth_opts.initial_skip)
+		return 0;
+
+	sample.ip = record->from_ip;
+	sample.cpumode = record->el ? PERF_RECORD_MISC_KERNEL :
+				      PERF_RECORD_MISC_USER;
+	arm_spe_set_tid(speq, record, &sample);
+	sample.time = record->timestamp;
+	sample.id = spe->sample_id[kind];
+	sample.stream_id = spe->sample_id[kind];
+	sample.period = 1;
+	sample.cpu = speq->cpu;
+	sample.weight = record->latency;
+
+	if (record->op == ARM_SPE_OP_BRANCH) {
+		sample.addr = record->to_ip;
+		sample.flags = PERF_IP_FLAG_BRANCH;
+	} else {
+		sample.addr = record->virt_addr;
+		sample.phys_addr = record->phys_addr;
+		sample.data_src = arm_spe_data_src(record);
+	}
+
+	event.sample.header.type = PERF_RECORD_SAMPLE;
+	event.sample.header.misc = sample.cpumode;
+	event.sample.header.size = sizeof(struct perf_event_header);
+
+	if (spe->synth_opts.inject) {
+		event.sample.header.size = spe->event_size;
+		ret = perf_event__synthesize_sample(&event, spe->sample_type,
+						    0, &sample);
+		if (ret)
+			return ret;
+	}
+
+	ret = perf_session__deliver_synth_event(spe->session, &event, &sample);
+	if (ret)
+		pr_err("ARM SPE: failed to deliver %s event, error %d\n",
+		       arm_spe_samples[kind].name, ret);
+
+	return ret;
+}
+
+static int arm_spe_sample(struct arm_spe_queue *speq,
+			  const struct arm_spe_record *record)
+{
+	struct arm_spe *spe = speq->spe;
+	bool memory = record->op == ARM_SPE_OP_LOAD ||
+		      record->op == ARM_SPE_OP_STORE;
+	int kind, err;
+
+	for (kind = 0; kind < ARM_SPE_SAMPLE_MAX; kind++) {
+		if (!spe->sample[kind])
+			continue;
+
+		if (arm_spe_samples[kind].events) {
+			if (!(record->events & arm_spe_samples[kind].events))
+				continue;
+		} else if (!memory) {
+			continue;
+		}
+
+		err = arm_spe_synth_sample(speq, record, kind);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode the buffers of speq, handing each record to cb. The decoding
+ * itself only touches the buffers of speq, it's what the workers run.
+ */
+static int arm_spe_run_decoder(struct arm_spe_queue *speq,
+			       int (*cb)(struct arm_spe_queue *speq,
+					 const struct arm_spe_record *record))
+{
+	struct auxtrace_queue *queue;
+	struct auxtrace_buffer *buffer = NULL;
+	struct arm_spe_decoder decoder;
+	struct arm_spe_record record;
+	int fd = perf_data__fd(speq->spe->session->data);
+	int err = 0;
+
+	queue = &speq->spe->queues.queue_array[speq->queue_nr];
+
+	while (!err && (buffer = auxtrace_buffer__next(queue, buffer))) {
+		if (!auxtrace_buffer__get_data(buffer, fd)) {
+			err = -ENOMEM;
+			break;
+		}
+
+		arm_spe_decoder__init(&decoder, buffer->data, buffer->size);
+		while (!err && arm_spe_decode(&decoder, &record))
+			err = cb(speq, &record);
+
+		if (decoder.nr_bad)
+			pr_debug("ARM SPE: %lu bad packets in buffer %" PRIu64 " of queue %u\n",
+				 decoder.nr_bad, buffer->buffer_nr, speq->queue_nr);
+
+		auxtrace_buffer__drop_data(buffer);
+	}
+
+	speq->decoded = true;
+	return err;
+}
+
+/*
+ * Hand the chunk being filled to the main thread, waiting for it to deliver
+ * some if too many are pending.
+ */
+static void arm_spe_publish(struct arm_spe_queue *speq, bool done)
+{
+	struct arm_spe *spe = speq->spe;
+
+	pthread_mutex_lock(&spe->lock);
+
+	if (speq->chunk) {
+		list_add_tail(&speq->chunk->node, &speq->chunks);
+		speq->nr_chunks++;
+		speq->chunk = NULL;
+	}
+	if (done)
+		speq->done = true;
+	pthread_cond_broadcast(&spe->produced);
+
+	while (!done && speq->nr_chunks >= ARM_SPE_MAX_CHUNKS)
+		pthread_cond_wait(&spe->consumed, &spe->lock);
+
+	pthread_mutex_unlock(&spe->lock);
+}
+
+static int arm_spe_queue_record(struct arm_spe_queue *speq,
+				const struct arm_spe_record *record)
+{
+	if (!speq->chunk) {
+		speq->chunk = malloc(sizeof(*speq->chunk));
+		if (!speq->chunk)
+			return -ENOMEM;
+		speq->chunk->nr = 0;
+	}
+
+	speq->chunk->records[speq->chunk->nr++] = *record;
+
+	if (speq->chunk->nr == ARM_SPE_CHUNK_RECORDS)
+		arm_spe_publish(speq, false);
+
+	return 0;
+}
+
+static void *arm_spe_decode_worker(void *arg)
+{
+	struct arm_spe_decode *d = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&d->next, 1)) < d->nr_queues) {
+		struct arm_spe_queue *speq = d->queues[i];
+
+		if (arm_spe_run_decoder(speq, arm_spe_queue_record))
+			pr_err("ARM SPE: failed to decode queue %u\n", speq->queue_nr);
+		arm_spe_publish(speq, true);
+	}
+
+	return NULL;
+}
+
+/* Synthesize the samples of what a worker decoded for speq, as it comes */
+static int arm_spe_deliver_queue(struct arm_spe_queue *speq)
+{
+	struct arm_spe *spe = speq->spe;
+	struct arm_spe_chunk *chunk;
+	unsigned int i;
+	int err = 0;
+
+	while (1) {
+		pthread_mutex_lock(&spe->lock);
+		while (list_empty(&speq->chunks) && !speq->done)
+			pthread_cond_wait(&spe->produced, &spe->lock);
+		chunk = list_first_entry_or_null(&speq->chunks,
+						 struct arm_spe_chunk, node);
+		if (chunk) {
+			list_del(&chunk->node);
+			speq->nr_chunks--;
+			pthread_cond_broadcast(&spe->consumed);
+		}
+		pthread_mutex_unlock(&spe->lock);
+
+		if (!chunk)
+			return err;
+
+		for (i = 0; i < chunk->nr && !err; i++)
+			err = arm_spe_sample(speq, &chunk->records[i]);
+		free(chunk);
+	}
+}
+
+/*
+ * Decode the queues on nr_decode_threads workers while this thread
+ * synthesizes the samples queue after queue, as decoding them one after
+ * the other would. The SPE records are self contained, a worker needs
+ * nothing from the session.
+ */
+static int arm_spe_decode_queues(struct arm_spe *spe,
+				 struct arm_spe_queue **queues,
+				 unsigned int nr_queues)
+{
+	struct arm_spe_decode d = {
+		.queues = queues,
+		.nr_queues = nr_queues,
+	};
+	unsigned int i, started = 0;
+	unsigned int nr_threads = min(spe->nr_decode_threads, nr_queues);
+	pthread_t *threads;
+	int err = 0, ret;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (threads) {
+		for (i = 0; i < nr_threads; i++) {
+			if (pthread_create(&threads[i], NULL,
+					   arm_spe_decode_worker, &d))
+				break;
+			started++;
+		}
+	}
+
+	if (!started) {
+		pr_debug("ARM SPE: no decoding threads, decoding serially\n");
+		for (i = 0; i < nr_queues && !err; i++)
+			err = arm_spe_run_decoder(queues[i], arm_spe_sample);
+		goto out_free;
+	}
+
+	/* keep delivering on error, the workers may be waiting on a queue */
+	for (i = 0; i < nr_queues; i++) {
+		ret = arm_spe_deliver_queue(queues[i]);
+		if (!err)
+			err = ret;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+out_free:
+	free(threads);
+	return err;
+}
+
+/* The queues of tid, all with -1, not decoded yet */
+static int arm_spe_process_timeless_queues(struct arm_spe *spe, pid_t tid)
+{
+	struct auxtrace_queues *queues = &spe->queues;
+	struct arm_spe_queue **decode;
+	unsigned int i, nr = 0;
+	int err = 0;
+
+	decode = calloc(queues->nr_queues, sizeof(*decode));
+	if (!decode)
+		return -ENOMEM;
+
+	for (i = 0; i < queues->nr_queues; i++) {
+		struct arm_spe_queue *speq = queues->queue_array[i].priv;
+
+		if (!speq || speq->decoded)
+			continue;
+		if (tid != -1 && speq->tid != tid)
+			continue;
+
+		if (speq->tid != -1 && speq->pid == -1) {
+			struct thread *thread;
+
+			thread = machine__find_thread(spe->machine, -1, speq->tid);
+			if (thread) {
+				speq->pid = thread->pid_;
+				thread__put(thread);
+			}
+		}
+
+		if (spe->nr_decode_threads > 1)
+			decode[nr++] = speq;
+		else
+			err = arm_spe_run_decoder(speq, arm_spe_sample);
+		if (err)
+			break;
+	}
+
+	if (!err && nr)
+		err = arm_spe_decode_queues(spe, decode, nr);
+
+	free(decode);
+	return err;
+}
+
+static int arm_spe_process_event(struct perf_session *session,
+				 union perf_event *event,
 				 struct perf_sample *sample __maybe_unused,
 				 struct perf_tool *tool __maybe_unused)
 {
+	struct arm_spe *spe = container_of(session->auxtrace, struct arm_spe,
+					     auxtrace);
+	int err;
+
+	if (dump_trace)
+		return 0;
+
+	err = arm_spe_update_queues(spe);
+	if (err)
+		return err;
+
+	/* the per-thread queues end with their thread */
+	if (event->header.type == PERF_RECORD_EXIT)
+		return arm_spe_process_timeless_queues(spe, event->fork.tid);
+
 	return 0;
 }
 
@@ -112,6 +667,9 @@ static int arm_spe_process_auxtrace_event(struct perf_session *session,
 	int fd = perf_data__fd(session->data);
 	int err;
 
+	if (spe->data_queued)
+		return 0;
+
 	if (perf_data__is_pipe(session->data)) {
 		data_offset = 0;
 	} else {
@@ -137,18 +695,36 @@ static int arm_spe_process_auxtrace_event(struct perf_session *session,
 	return 0;
 }
 
-static int arm_spe_flush(struct perf_session *session __maybe_unused,
+static int arm_spe_flush(struct perf_session *session,
 			 struct perf_tool *tool __maybe_unused)
 {
-	return 0;
+	struct arm_spe *spe = container_of(session->auxtrace, struct arm_spe,
+					     auxtrace);
+	int err;
+
+	if (dump_trace)
+		return 0;
+
+	err = arm_spe_update_queues(spe);
+	if (err)
+		return err;
+
+	return arm_spe_process_timeless_queues(spe, -1);
 }
 
 static void arm_spe_free_queue(void *priv)
 {
 	struct arm_spe_queue *speq = priv;
+	struct arm_spe_chunk *chunk, *tmp;
 
 	if (!speq)
 		return;
+
+	list_for_each_entry_safe(chunk, tmp, &speq->chunks, node) {
+		list_del(&chunk->node);
+		free(chunk);
+	}
+	free(speq->chunk);
 	free(speq);
 }
 
@@ -174,9 +750,171 @@ static void arm_spe_free(struct perf_session *session)
 	auxtrace_heap__free(&spe->heap);
 	arm_spe_free_events(session);
 	session->auxtrace = NULL;
+	pthread_cond_destroy(&spe->consumed);
+	pthread_cond_destroy(&spe->produced);
+	pthread_mutex_destroy(&spe->lock);
 	free(spe);
 }
 
+struct arm_spe_synth {
+	struct perf_tool dummy_tool;
+	struct perf_session *session;
+};
+
+static int arm_spe_event_synth(struct perf_tool *tool,
+			       union perf_event *event,
+			       struct perf_sample *sample __maybe_unused,
+			       struct machine *machine __maybe_unused)
+{
+	struct arm_spe_synth *arm_spe_synth =
+			container_of(tool, struct arm_spe_synth, dummy_tool);
+
+	return perf_session__deliver_synth_event(arm_spe_synth->session,
+						 event, NULL);
+}
+
+static int arm_spe_synth_event(struct perf_session *session,
+			       struct perf_event_attr *attr, u64 id)
+{
+	struct arm_spe_synth arm_spe_synth;
+
+	memset(&arm_spe_synth, 0, sizeof(struct arm_spe_synth));
+	arm_spe_synth.session = session;
+
+	return perf_event__synthesize_attr(&arm_spe_synth.dummy_tool, attr, 1,
+					   &id, arm_spe_event_synth);
+}
+
+static void arm_spe_set_event_name(struct perf_evlist *evlist, u64 id,
+				   const char *name)
+{
+	struct perf_evsel *evsel;
+
+	evlist__for_each_entry(evlist, evsel) {
+		if (evsel->id && evsel->id[0] == id) {
+			if (evsel->name)
+				zfree(&evsel->name);
+			evsel->name = strdup(name);
+			break;
+		}
+	}
+}
+
+static bool arm_spe_sample_wanted(struct arm_spe *spe,
+				  enum arm_spe_sample_kind kind)
+{
+	struct itrace_synth_opts *opts = &spe->synth_opts;
+
+	switch (kind) {
+	case ARM_SPE_L1D_MISS:
+	case ARM_SPE_L1D_ACCESS:
+		return opts->flc;
+	case ARM_SPE_LLC_MISS:
+	case ARM_SPE_LLC_ACCESS:
+		return opts->llc;
+	case ARM_SPE_TLB_MISS:
+	case ARM_SPE_TLB_ACCESS:
+		return opts->tlb;
+	case ARM_SPE_BRANCH_MISS:
+		return opts->branches;
+	case ARM_SPE_REMOTE_ACCESS:
+		return opts->remote_access;
+	case ARM_SPE_MEMORY:
+		return opts->mem;
+	case ARM_SPE_SAMPLE_MAX:
+	default:
+		return false;
+	}
+}
+
+static int arm_spe_synth_events(struct arm_spe *spe,
+				struct perf_session *session)
+{
+	struct perf_evlist *evlist = session->evlist;
+	struct perf_evsel *evsel;
+	struct perf_event_attr attr;
+	bool found = false;
+	int kind, err;
+	u64 id;
+
+	evlist__for_each_entry(evlist, evsel) {
+		if (evsel->attr.type == spe->pmu_type && evsel->ids) {
+			found = true;
+			break;
+		}
+	}
+
+	if (!found) {
+		pr_debug("There are no selected events with ARM SPE data\n");
+		return 0;
+	}
+
+	memset(&attr, 0, sizeof(struct perf_event_attr));
+	attr.size = sizeof(struct perf_event_attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.sample_type = evsel->attr.sample_type & PERF_SAMPLE_MASK;
+	attr.sample_type |= PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+			    PERF_SAMPLE_PERIOD | PERF_SAMPLE_ADDR |
+			    PERF_SAMPLE_PHYS_ADDR | PERF_SAMPLE_WEIGHT |
+			    PERF_SAMPLE_DATA_SRC;
+	attr.exclude_user = evsel->attr.exclude_user;
+	attr.exclude_kernel = evsel->attr.exclude_kernel;
+	attr.exclude_hv = evsel->attr.exclude_hv;
+	attr.exclude_host = evsel->attr.exclude_host;
+	attr.exclude_guest = evsel->attr.exclude_guest;
+	attr.sample_id_all = evsel->attr.sample_id_all;
+	attr.read_format = evsel->attr.read_format;
+	attr.sample_period = 1;
+
+	id = evsel->id[0] + 1000000000;
+	if (!id)
+		id = 1;
+
+	for (kind = 0; kind < ARM_SPE_SAMPLE_MAX; kind++) {
+		const char *name = arm_spe_samples[kind].name;
+
+		if (!arm_spe_sample_wanted(spe, kind))
+			continue;
+
+		attr.config = arm_spe_samples[kind].config;
+		pr_debug("Synthesizing '%s' event with id %" PRIu64 " sample type %#" PRIx64 "\n",
+			 name, id, (u64)attr.sample_type);
+		err = arm_spe_synth_event(session, &attr, id);
+		if (err) {
+			pr_err("%s: failed to synthesize '%s' event type\n",
+			       __func__, name);
+			return err;
+		}
+		arm_spe_set_event_name(evlist, id, name);
+		spe->sample[kind] = true;
+		spe->sample_id[kind] = id;
+		id += 1;
+	}
+
+	spe->sample_type = attr.sample_type;
+	/*
+	 * We only use sample types from PERF_SAMPLE_MASK so we can use
+	 * __perf_evsel__sample_size() here.
+	 */
+	spe->event_size = sizeof(struct sample_event) +
+			  __perf_evsel__sample_size(attr.sample_type);
+	return 0;
+}
+
+static int arm_spe_perf_config(const char *var, const char *value, void *data)
+{
+	struct arm_spe *spe = data;
+
+	if (!strcmp(var, "arm-spe.decode-threads")) {
+		long val = strtol(value, NULL, 0);
+
+		if (val > 0 && val <= INT_MAX)
+			spe->nr_decode_threads = val;
+	}
+
+	return 0;
+}
+
 static const char * const arm_spe_info_fmts[] = {
 	[ARM_SPE_PMU_TYPE]		= "  PMU Type           %"PRId64"\n",
 };
@@ -205,6 +943,10 @@ int arm_spe_process_auxtrace_info(union perf_event *event,
 	if (!spe)
 		return -ENOMEM;
 
+	pthread_mutex_init(&spe->lock, NULL);
+	pthread_cond_init(&spe->produced, NULL);
+	pthread_cond_init(&spe->consumed, NULL);
+
 	err = auxtrace_queues__init(&spe->queues);
 	if (err)
 		goto err_free;
@@ -213,6 +955,7 @@ int arm_spe_process_auxtrace_info(union perf_event *event,
 	spe->machine = &session->machines.host; /* No kvm support */
 	spe->auxtrace_type = auxtrace_info->type;
 	spe->pmu_type = auxtrace_info->priv[ARM_SPE_PMU_TYPE];
+	spe->nr_decode_threads = 1;
 
 	spe->auxtrace.process_event = arm_spe_process_event;
 	spe->auxtrace.process_auxtrace_event = arm_spe_process_auxtrace_event;
@@ -223,9 +966,38 @@ int arm_spe_process_auxtrace_info(union perf_event *event,
 
 	arm_spe_print_info(&auxtrace_info->priv[0]);
 
+	if (dump_trace)
+		return 0;
+
+	perf_config(arm_spe_perf_config, spe);
+
+	if (session->itrace_synth_opts && session->itrace_synth_opts->set) {
+		spe->synth_opts = *session->itrace_synth_opts;
+	} else {
+		itrace_synth_opts__set_default(&spe->synth_opts,
+				session->itrace_synth_opts->default_no_sample);
+	}
+
+	err = arm_spe_synth_events(spe, session);
+	if (err)
+		goto err_free_queues;
+
+	err = auxtrace_queues__process_index(&spe->queues, session);
+	if (err)
+		goto err_free_queues;
+
+	if (spe->queues.populated)
+		spe->data_queued = true;
+
 	return 0;
 
+err_free_queues:
+	auxtrace_queues__free(&spe->queues);
+	session->auxtrace = NULL;
 err_free:
+	pthread_cond_destroy(&spe->consumed);
+	pthread_cond_destroy(&spe->produced);
+	pthread_mutex_destroy(&spe->lock);
 	free(spe);
 	return err;
 }
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <linux/kernel.h>
 #include <linux/perf_event.h>
@@ -209,6 +210,7 @@ static int auxtrace_queues__grow(struct auxtrace_queues *queues,
 		queue_array[i].cpu = queues->queue_array[i].cpu;
 		queue_array[i].set = queues->queue_array[i].set;
 		queue_array[i].priv = queues->queue_array[i].priv;
+		queue_array[i].synth_buf = queues->queue_array[i].synth_buf;
 	}
 
 	queues->nr_queues = nr_queues;
@@ -315,6 +317,28 @@ static bool filter_cpu(struct perf_session *session, int cpu)
 	return cpu_bitmap && cpu != -1 && !test_bit(cpu, cpu_bitmap);
 }
 
+/*
+ * The data of a buffer is not later than the time index entries past it,
+ * and later than those before the one preceding it, as for the samples, so
+ * the buffers out of the part of the file the time index gives for the
+ * --time range have no data in it. The entries are at round boundaries,
+ * a buffer is on one side.
+ */
+static bool filter_offset(struct auxtrace_queues *queues,
+			  struct perf_session *session, u64 offset)
+{
+	u64 from, to;
+
+	if (perf_data__is_pipe(session->data))
+		return false;
+
+	perf_session__time_index_range(session, &from, &to);
+	if (queues->snapshot_mode)
+		to = 0;
+
+	return (from && offset < from) || (to && offset >= to);
+}
+
 static int auxtrace_queues__add_buffer(struct auxtrace_queues *queues,
 				       struct perf_session *session,
 				       unsigned int idx,
@@ -323,7 +347,8 @@ static int auxtrace_queues__add_buffer(struct auxtrace_queues *queues,
 {
 	int err = -ENOMEM;
 
-	if (filter_cpu(session, buffer->cpu))
+	if (filter_cpu(session, buffer->cpu) ||
+	    filter_offset(queues, session, buffer->data_offset))
 		return 0;
 
 	buffer = memdup(buffer, sizeof(*buffer));
@@ -338,11 +363,14 @@ static int auxtrace_queues__add_buffer(struct auxtrace_queues *queues,
 		if (!buffer->data)
 			goto out_free;
 		buffer->data_needs_freeing = true;
-	} else if (BITS_PER_LONG == 32 &&
-		   buffer->size > BUFFER_LIMIT_FOR_32_BIT) {
-		err = auxtrace_queues__split_buffer(queues, idx, buffer);
-		if (err)
-			goto out_free;
+	} else {
+		buffer->session = session;
+		if (BITS_PER_LONG == 32 &&
+		    buffer->size > BUFFER_LIMIT_FOR_32_BIT) {
+			err = auxtrace_queues__split_buffer(queues, idx, buffer);
+			if (err)
+				goto out_free;
+		}
 	}
 
 	err = auxtrace_queues__queue_buffer(queues, idx, buffer);
@@ -420,6 +448,7 @@ void auxtrace_queues__free(struct auxtrace_queues *queues)
 			list_del(&buffer->list);
 			auxtrace_buffer__free(buffer);
 		}
+		zfree(&queues->queue_array[i].synth_buf.buf);
 	}
 
 	zfree(&queues->queue_array);
@@ -511,6 +540,421 @@ void auxtrace_heap__pop(struct auxtrace_heap *heap)
 			 heap_array[last].ordinal);
 }
 
+/*
+ * The events synthesized while decoding a queue on a worker thread are
+ * buffered, each copied with what its sample points to into memory that
+ * is reused, for the main thread to deliver them afterwards, merged in
+ * timestamp order with those of the other queues.
+ */
+struct auxtrace_synth_item {
+	u32			size;
+	bool			has_sample;
+	u64			time;
+	struct perf_sample	sample;
+	u64			data[];
+};
+
+/* The buffer of the queue being decoded on this thread, if any */
+static __thread struct auxtrace_synth_buf *auxtrace_synth_current;
+
+static int auxtrace_synth_buf__add(struct auxtrace_synth_buf *sb,
+				   union perf_event *event,
+				   struct perf_sample *sample, u64 time)
+{
+	size_t event_sz = PERF_ALIGN(event->header.size, sizeof(u64));
+	size_t chain_sz = 0, bs_sz = 0, raw_sz = 0, size;
+	struct auxtrace_synth_item *item;
+	void *p;
+
+	if (sample) {
+		if (sample->callchain)
+			chain_sz = (sample->callchain->nr + 1) * sizeof(u64);
+		if (sample->branch_stack)
+			bs_sz = sizeof(u64) + sample->branch_stack->nr *
+					      sizeof(struct branch_entry);
+		raw_sz = PERF_ALIGN(sample->raw_size, sizeof(u64));
+	}
+
+	size = sizeof(*item) + event_sz + chain_sz + bs_sz + raw_sz;
+
+	if (sb->size + size > sb->alloc) {
+		size_t alloc = max(sb->alloc * 2, sb->size + size);
+		void *buf = realloc(sb->buf, alloc);
+
+		if (!buf)
+			return -ENOMEM;
+		sb->buf = buf;
+		sb->alloc = alloc;
+	}
+
+	item = sb->buf + sb->size;
+	item->size = size;
+	item->has_sample = sample != NULL;
+	item->time = time;
+
+	p = item->data;
+	memcpy(p, event, event->header.size);
+	p += event_sz;
+
+	if (sample) {
+		item->sample = *sample;
+		if (chain_sz)
+			memcpy(p, sample->callchain, chain_sz);
+		p += chain_sz;
+		if (bs_sz)
+			memcpy(p, sample->branch_stack, bs_sz);
+		p += bs_sz;
+		if (sample->raw_size)
+			memcpy(p, sample->raw_data, sample->raw_size);
+	}
+
+	sb->size += size;
+
+	return 0;
+}
+
+/* Point the sample of item at its copies and deliver it */
+static int auxtrace_synth_item__deliver(struct perf_session *session,
+					struct auxtrace_synth_item *item)
+{
+	union perf_event *event = (union perf_event *)item->data;
+	struct perf_sample *sample = NULL;
+	void *p = item->data;
+
+	p += PERF_ALIGN(event->header.size, sizeof(u64));
+
+	if (item->has_sample) {
+		sample = &item->sample;
+		if (sample->callchain) {
+			sample->callchain = p;
+			p += (sample->callchain->nr + 1) * sizeof(u64);
+		}
+		if (sample->branch_stack) {
+			sample->branch_stack = p;
+			p += sizeof(u64) + sample->branch_stack->nr *
+					   sizeof(struct branch_entry);
+		}
+		if (sample->raw_data)
+			sample->raw_data = p;
+	}
+
+	return perf_session__deliver_synth_event(session, event, sample);
+}
+
+/*
+ * Deliver the event a decoder synthesized, or buffer it if its queue is
+ * being decoded on a worker thread, for the main thread to deliver it at
+ * time, once all the queues decoded together are done.
+ */
+int auxtrace__deliver_synth_event(struct perf_session *session,
+				  union perf_event *event,
+				  struct perf_sample *sample, u64 time)
+{
+	if (auxtrace_synth_current)
+		return auxtrace_synth_buf__add(auxtrace_synth_current, event,
+					       sample, time);
+
+	return perf_session__deliver_synth_event(session, event, sample);
+}
+
+struct auxtrace_worker_job {
+	struct auxtrace_queue	*queue;
+	unsigned int		queue_nr;
+	u64			timestamp;
+	int			ret;
+};
+
+/*
+ * Worker threads decoding the queues that are due on the heap of a decoder
+ * together, each up to the same timestamp, see auxtrace_workers__process().
+ */
+struct auxtrace_workers {
+	pthread_t			*threads;
+	unsigned int			nr_threads;
+	auxtrace_decode_t		decode;
+	const char			*name;
+	pthread_mutex_t			lock;
+	pthread_cond_t			work_cond;
+	pthread_cond_t			done_cond;
+	unsigned int			round;
+	unsigned int			nr_busy;
+	bool				exit;
+	struct auxtrace_worker_job	*jobs;
+	unsigned int			nr_jobs;
+	unsigned int			jobs_sz;
+	unsigned int			next;
+	struct auxtrace_heap		heap;
+};
+
+static void auxtrace_workers__decode(struct auxtrace_workers *w)
+{
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&w->next, 1)) < w->nr_jobs) {
+		struct auxtrace_worker_job *job = &w->jobs[i];
+
+		auxtrace_synth_current = &job->queue->synth_buf;
+		job->ret = w->decode(job->queue, &job->timestamp);
+		auxtrace_synth_current = NULL;
+	}
+}
+
+static void *auxtrace_worker__run(void *arg)
+{
+	struct auxtrace_workers *w = arg;
+	unsigned int round = 0;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		while (!w->exit && w->round == round)
+			pthread_cond_wait(&w->work_cond, &w->lock);
+		if (w->exit)
+			break;
+		round = w->round;
+		pthread_mutex_unlock(&w->lock);
+
+		auxtrace_workers__decode(w);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->nr_busy == 0)
+			pthread_cond_signal(&w->done_cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+void auxtrace_workers__delete(struct auxtrace_workers *w)
+{
+	unsigned int i;
+
+	if (!w)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->exit = true;
+	pthread_cond_broadcast(&w->work_cond);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < w->nr_threads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	pthread_cond_destroy(&w->done_cond);
+	pthread_cond_destroy(&w->work_cond);
+	pthread_mutex_destroy(&w->lock);
+	auxtrace_heap__free(&w->heap);
+	free(w->jobs);
+	free(w->threads);
+	free(w);
+}
+
+/*
+ * nr_threads - 1 workers calling decode, the main thread decodes too, or
+ * NULL if none can be started, then the decoder is to decode the queues one
+ * after the other.  Everything decode synthesizes has to be delivered with
+ * auxtrace__deliver_synth_event(), and anything else it writes to has to be
+ * its queue's, per cpu, or locked.
+ */
+struct auxtrace_workers *auxtrace_workers__new(unsigned int nr_threads,
+					       auxtrace_decode_t decode,
+					       const char *name)
+{
+	struct auxtrace_workers *w;
+	unsigned int i;
+
+	if (nr_threads < 2)
+		return NULL;
+
+	w = zalloc(sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->threads = calloc(nr_threads - 1, sizeof(*w->threads));
+	if (!w->threads) {
+		free(w);
+		return NULL;
+	}
+
+	w->decode = decode;
+	w->name = name;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work_cond, NULL);
+	pthread_cond_init(&w->done_cond, NULL);
+
+	for (i = 0; i < nr_threads - 1; i++) {
+		if (pthread_create(&w->threads[i], NULL, auxtrace_worker__run, w))
+			break;
+		w->nr_threads++;
+	}
+
+	if (!w->nr_threads) {
+		auxtrace_workers__delete(w);
+		return NULL;
+	}
+
+	pr_debug("%s: decoding on %u threads\n", name, w->nr_threads + 1);
+
+	return w;
+}
+
+/* More than one queue is due, so decoding them together is worth it */
+bool auxtrace_workers__due(struct auxtrace_workers *w,
+			   struct auxtrace_heap *heap, u64 timestamp)
+{
+	unsigned int i, nr = 0;
+
+	if (!w)
+		return false;
+
+	for (i = 0; i < heap->heap_cnt; i++) {
+		if (heap->heap_array[i].ordinal < timestamp && ++nr > 1)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Have the queue, popped off the heap of the decoder, decoded up to
+ * timestamp by the next auxtrace_workers__process().
+ */
+int auxtrace_workers__add(struct auxtrace_workers *w, unsigned int queue_nr,
+			  u64 timestamp)
+{
+	struct auxtrace_worker_job *job;
+
+	if (w->nr_jobs == w->jobs_sz) {
+		unsigned int jobs_sz = w->jobs_sz ? w->jobs_sz * 2 : 16;
+
+		job = realloc(w->jobs, jobs_sz * sizeof(*job));
+		if (!job)
+			return -ENOMEM;
+		w->jobs = job;
+		w->jobs_sz = jobs_sz;
+	}
+
+	job = &w->jobs[w->nr_jobs++];
+	job->queue_nr = queue_nr;
+	job->timestamp = timestamp;
+	job->ret = 0;
+
+	return 0;
+}
+
+/* Decode the queues added on the workers and this thread */
+static void auxtrace_workers__run(struct auxtrace_workers *w)
+{
+	bool singlethreaded = perf_singlethreaded;
+
+	perf_set_multithreaded();
+
+	pthread_mutex_lock(&w->lock);
+	w->next = 0;
+	w->nr_busy = w->nr_threads;
+	w->round++;
+	pthread_cond_broadcast(&w->work_cond);
+	pthread_mutex_unlock(&w->lock);
+
+	auxtrace_workers__decode(w);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->nr_busy)
+		pthread_cond_wait(&w->done_cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	if (singlethreaded)
+		perf_set_singlethreaded();
+}
+
+/*
+ * Deliver the events the queues decoded together synthesized, in timestamp
+ * order, as they would have been had the queues been decoded in turn.
+ */
+static int auxtrace_workers__deliver(struct auxtrace_workers *w,
+				     struct perf_session *session)
+{
+	struct auxtrace_synth_item *item;
+	struct auxtrace_synth_buf *sb;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < w->nr_jobs && !err; i++) {
+		sb = &w->jobs[i].queue->synth_buf;
+		if (sb->size) {
+			item = sb->buf;
+			err = auxtrace_heap__add(&w->heap, i, item->time);
+		}
+	}
+
+	while (w->heap.heap_cnt && !err) {
+		i = w->heap.heap_array[0].queue_nr;
+		auxtrace_heap__pop(&w->heap);
+
+		sb = &w->jobs[i].queue->synth_buf;
+		item = sb->buf + sb->pos;
+		sb->pos += item->size;
+
+		err = auxtrace_synth_item__deliver(session, item);
+		if (err) {
+			pr_err("%s: failed to deliver event, error %d\n",
+			       w->name, err);
+			break;
+		}
+
+		if (sb->pos < sb->size) {
+			item = sb->buf + sb->pos;
+			err = auxtrace_heap__add(&w->heap, i, item->time);
+		}
+	}
+
+	while (w->heap.heap_cnt)
+		auxtrace_heap__pop(&w->heap);
+
+	for (i = 0; i < w->nr_jobs; i++) {
+		sb = &w->jobs[i].queue->synth_buf;
+		sb->size = 0;
+		sb->pos = 0;
+	}
+
+	return err;
+}
+
+/*
+ * Decode the queues added, all up to their timestamp at the same time,
+ * put those with more data back on heap, at the timestamp they are next
+ * due at, then deliver what they synthesized, in timestamp order.
+ */
+int auxtrace_workers__process(struct auxtrace_workers *w,
+			      struct perf_session *session,
+			      struct auxtrace_queues *queues,
+			      struct auxtrace_heap *heap)
+{
+	struct auxtrace_worker_job *job;
+	unsigned int i;
+	int ret, err = 0;
+
+	for (i = 0; i < w->nr_jobs; i++)
+		w->jobs[i].queue = &queues->queue_array[w->jobs[i].queue_nr];
+
+	auxtrace_workers__run(w);
+
+	for (i = 0; i < w->nr_jobs; i++) {
+		job = &w->jobs[i];
+
+		if (job->ret > 0)
+			continue;
+
+		ret = auxtrace_heap__add(heap, job->queue_nr, job->timestamp);
+		if (!err)
+			err = job->ret ?: ret;
+	}
+
+	ret = auxtrace_workers__deliver(w, session);
+	w->nr_jobs = 0;
+
+	return err ?: ret;
+}
+
 size_t auxtrace_record__info_priv_size(struct auxtrace_record *itr,
 				       struct perf_evlist *evlist)
 {
@@ -772,7 +1216,7 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 {
 	struct auxtrace_index *auxtrace_index;
 	struct auxtrace_index_entry *ent;
-	size_t i;
+	size_t i, skipped = 0;
 	int err;
 
 	if (auxtrace__dont_decode(session))
@@ -781,6 +1225,11 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 	list_for_each_entry(auxtrace_index, &session->auxtrace_index, list) {
 		for (i = 0; i < auxtrace_index->nr; i++) {
 			ent = &auxtrace_index->entries[i];
+			/* out of the --time range, don't even read the event */
+			if (filter_offset(queues, session, ent->file_offset)) {
+				skipped++;
+				continue;
+			}
 			err = auxtrace_queues__process_index_entry(queues,
 								   session,
 								   ent);
@@ -788,6 +1237,9 @@ int auxtrace_queues__process_index(struct auxtrace_queues *queues,
 				return err;
 		}
 	}
+
+	if (skipped)
+		pr_debug("auxtrace index: %zu buffers out of the time range\n", skipped);
 	return 0;
 }
 
@@ -807,6 +1259,11 @@ struct auxtrace_buffer *auxtrace_buffer__next(struct auxtrace_queue *queue,
 	}
 }
 
+/*
+ * The data is decoded in place, from the data file mapped by the reader or
+ * from a window mapped for it and the buffers that follow, shared by all
+ * the buffers in it until the last one puts its data.
+ */
 void *auxtrace_buffer__get_data(struct auxtrace_buffer *buffer, int fd)
 {
 	size_t adj = buffer->data_offset & (page_size - 1);
@@ -817,6 +1274,14 @@ void *auxtrace_buffer__get_data(struct auxtrace_buffer *buffer, int fd)
 	if (buffer->data)
 		return buffer->data;
 
+	if (buffer->session) {
+		buffer->data = perf_session__pin_data(buffer->session, fd,
+						      buffer->data_offset,
+						      buffer->size, &buffer->win);
+		if (buffer->data)
+			return buffer->data;
+	}
+
 	addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, file_offset);
 	if (addr == MAP_FAILED)
 		return NULL;
@@ -831,6 +1296,14 @@ void *auxtrace_buffer__get_data(struct auxtrace_buffer *buffer, int fd)
 
 void auxtrace_buffer__put_data(struct auxtrace_buffer *buffer)
 {
+	if (buffer->win) {
+		perf_session__unpin_data(buffer->session, buffer->win);
+		buffer->win = NULL;
+		buffer->data = NULL;
+		buffer->use_data = NULL;
+		return;
+	}
+
 	if (!buffer->data || !buffer->mmap_addr)
 		return;
 	munmap(buffer->mmap_addr, buffer->mmap_size);
@@ -974,6 +1447,11 @@ void itrace_synth_opts__set_default(struct itrace_synth_opts *synth_opts,
 	synth_opts->ptwrites = true;
 	synth_opts->pwr_events = true;
 	synth_opts->errors = true;
+	synth_opts->flc = true;
+	synth_opts->llc = true;
+	synth_opts->tlb = true;
+	synth_opts->remote_access = true;
+	synth_opts->mem = true;
 	if (no_sample) {
 		synth_opts->period_type = PERF_ITRACE_PERIOD_INSTRUCTIONS;
 		synth_opts->period = 1;
@@ -1066,6 +1544,21 @@ int itrace_parse_synth_opts(const struct option *opt, const char *str,
 		case 'w':
 			synth_opts->ptwrites = true;
 			break;
+		case 'f':
+			synth_opts->flc = true;
+			break;
+		case 'm':
+			synth_opts->llc = true;
+			break;
+		case 't':
+			synth_opts->tlb = true;
+			break;
+		case 'a':
+			synth_opts->remote_access = true;
+			break;
+		case 'M':
+			synth_opts->mem = true;
+			break;
 		case 'p':
 			synth_opts->pwr_events = true;
 			break;
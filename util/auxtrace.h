@@ -39,6 +39,8 @@ struct option;
 struct record_opts;
 struct auxtrace_info_event;
 struct events_stats;
+struct mmap_window;
+struct auxtrace_workers;
 
 /* Auxtrace records must have the same alignment as perf event records */
 #define PERF_AUXTRACE_RECORD_ALIGNMENT 8
@@ -70,6 +72,11 @@ enum itrace_period_type {
  * @ptwrites: whether to synthesize events for ptwrites
  * @pwr_events: whether to synthesize power events
  * @errors: whether to synthesize decoder error events
+ * @flc: whether to synthesize first level cache events
+ * @llc: whether to synthesize last level cache events
+ * @tlb: whether to synthesize TLB events
+ * @remote_access: whether to synthesize remote access events
+ * @mem: whether to synthesize memory operation events
  * @dont_decode: whether to skip decoding entirely
  * @log: write a decoding log
  * @calls: limit branch samples to calls (can be combined with @returns)
@@ -94,6 +101,11 @@ struct itrace_synth_opts {
 	bool			ptwrites;
 	bool			pwr_events;
 	bool			errors;
+	bool			flc;
+	bool			llc;
+	bool			tlb;
+	bool			remote_access;
+	bool			mem;
 	bool			dont_decode;
 	bool			log;
 	bool			calls;
@@ -179,6 +191,8 @@ struct auxtrace {
  * @buffer_nr: used to number each buffer
  * @use_size: implementation actually only uses this number of bytes
  * @use_data: implementation actually only uses data starting at this address
+ * @session: the session whose data file windows can hold @data
+ * @win: the window of @session @data is pinned in
  */
 struct auxtrace_buffer {
 	struct list_head	list;
@@ -197,6 +211,23 @@ struct auxtrace_buffer {
 	u64			buffer_nr;
 	size_t			use_size;
 	void			*use_data;
+	struct perf_session	*session;
+	struct mmap_window	*win;
+};
+
+/**
+ * struct auxtrace_synth_buf - events synthesized decoding a queue on a worker.
+ * @buf: the events, each followed by the callchain, branch stack and raw data
+ *       of its sample
+ * @size: bytes used in @buf
+ * @alloc: bytes allocated for @buf
+ * @pos: where the next event to deliver is
+ */
+struct auxtrace_synth_buf {
+	void			*buf;
+	size_t			size;
+	size_t			alloc;
+	size_t			pos;
 };
 
 /**
@@ -206,6 +237,8 @@ struct auxtrace_buffer {
  * @cpu: in per-cpu mode, the cpu this queue is associated with
  * @set: %true once this queue has been dedicated to a specific thread or cpu
  * @priv: implementation-specific data
+ * @synth_buf: what was synthesized decoding the queue on a worker, see
+ *             struct auxtrace_workers
  */
 struct auxtrace_queue {
 	struct list_head	head;
@@ -213,6 +246,7 @@ struct auxtrace_queue {
 	int			cpu;
 	bool			set;
 	void			*priv;
+	struct auxtrace_synth_buf synth_buf;
 };
 
 /**
@@ -221,6 +255,8 @@ struct auxtrace_queue {
  * @nr_queues: number of queues
  * @new_data: set whenever new data is queued
  * @populated: queues have been fully populated using the auxtrace_index
+ * @snapshot_mode: the buffers are snapshots, which can have data from before
+ *                 the previous round, only the start of --time filters them
  * @next_buffer_nr: used to number each buffer
  */
 struct auxtrace_queues {
@@ -228,6 +264,7 @@ struct auxtrace_queues {
 	unsigned int		nr_queues;
 	bool			new_data;
 	bool			populated;
+	bool			snapshot_mode;
 	u64			next_buffer_nr;
 };
 
@@ -473,6 +510,28 @@ int auxtrace_heap__add(struct auxtrace_heap *heap, unsigned int queue_nr,
 void auxtrace_heap__pop(struct auxtrace_heap *heap);
 void auxtrace_heap__free(struct auxtrace_heap *heap);
 
+/*
+ * Decode queue up to *timestamp, updating it to the timestamp the queue is
+ * next due at.  Returns > 0 once the queue has no more data, < 0 on error.
+ */
+typedef int (*auxtrace_decode_t)(struct auxtrace_queue *queue, u64 *timestamp);
+
+struct auxtrace_workers *auxtrace_workers__new(unsigned int nr_threads,
+					       auxtrace_decode_t decode,
+					       const char *name);
+void auxtrace_workers__delete(struct auxtrace_workers *w);
+bool auxtrace_workers__due(struct auxtrace_workers *w,
+			   struct auxtrace_heap *heap, u64 timestamp);
+int auxtrace_workers__add(struct auxtrace_workers *w, unsigned int queue_nr,
+			  u64 timestamp);
+int auxtrace_workers__process(struct auxtrace_workers *w,
+			      struct perf_session *session,
+			      struct auxtrace_queues *queues,
+			      struct auxtrace_heap *heap);
+int auxtrace__deliver_synth_event(struct perf_session *session,
+				  union perf_event *event,
+				  struct perf_sample *sample, u64 time);
+
 struct auxtrace_cache_entry {
 	struct hlist_node hash;
 	u32 key;
@@ -592,12 +651,17 @@ static inline void auxtrace__free(struct perf_session *session)
 "				w:	    		synthesize ptwrite events\n"		\
 "				p:	    		synthesize power events\n"			\
 "				e:	    		synthesize error events\n"			\
+"				f:	    		synthesize first level cache events\n"	\
+"				m:	    		synthesize last level cache events\n"	\
+"				t:	    		synthesize TLB events\n"			\
+"				a:	    		synthesize remote access events\n"		\
+"				M:	    		synthesize memory events\n"			\
 "				d:	    		create a debug log\n"			\
 "				g[len]:     		synthesize a call chain (use with i or x)\n" \
 "				l[len]:     		synthesize last branch entries (use with i or x)\n" \
 "				sNUMBER:    		skip initial number of events\n"		\
 "				PERIOD[ns|us|ms|i|t]:   specify period to sample stream\n" \
-"				concatenate multiple options. Default is ibxwpe or cewp\n"
+"				concatenate multiple options. Default is ibxwpefmtaM or cewpfmtaM\n"
 
 
 #else
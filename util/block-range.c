@@ -1,12 +1,39 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "block-range.h"
 #include "annotate.h"
+#include "util.h"
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <linux/kernel.h>
+
+/*
+ * The blocks are gathered as they come and the ranges are built from all
+ * of them at once, when first looked up: each block split the ranges it
+ * overlapped, several tree operations per branch record, while the same
+ * few blocks of the hot loops come over and over in the branch stacks.
+ */
+struct block_edge {
+	u64 start;
+	u64 end;
+	struct symbol *sym;
+	u64 count;
+	u64 pred;
+};
+
+/* Sort and merge the pending blocks when there are this many */
+#define BLOCK_EDGES_BATCH	(1 << 20)
 
 struct {
 	struct rb_root root;
 	u64 blocks;
+
+	struct block_edge *edges;
+	size_t nr_edges;
+	/* the first nr_sorted are sorted and unique */
+	size_t nr_sorted;
+	size_t alloc_edges;
+	bool dirty;
 } block_ranges;
 
 static void block_range__debug(void)
@@ -30,276 +57,242 @@ static void block_range__debug(void)
 #endif
 }
 
-struct block_range *block_range__find(u64 addr)
+static int block_edge__cmp(const void *a, const void *b)
 {
-	struct rb_node **p = &block_ranges.root.rb_node;
-	struct rb_node *parent = NULL;
-	struct block_range *entry;
-
-	while (*p != NULL) {
-		parent = *p;
-		entry = rb_entry(parent, struct block_range, node);
-
-		if (addr < entry->start)
-			p = &parent->rb_left;
-		else if (addr > entry->end)
-			p = &parent->rb_right;
-		else
-			return entry;
-	}
+	const struct block_edge *ea = a, *eb = b;
 
-	return NULL;
+	if (ea->start != eb->start)
+		return ea->start < eb->start ? -1 : 1;
+	if (ea->end != eb->end)
+		return ea->end < eb->end ? -1 : 1;
+	return 0;
 }
 
-static inline void rb_link_left_of_node(struct rb_node *left, struct rb_node *node)
+static int block_edge__cmp_end(const void *a, const void *b)
 {
-	struct rb_node **p = &node->rb_left;
-	while (*p) {
-		node = *p;
-		p = &node->rb_right;
-	}
-	rb_link_node(left, node, p);
+	const struct block_edge *ea = *(const struct block_edge **)a;
+	const struct block_edge *eb = *(const struct block_edge **)b;
+
+	if (ea->end != eb->end)
+		return ea->end < eb->end ? -1 : 1;
+	return 0;
 }
 
-static inline void rb_link_right_of_node(struct rb_node *right, struct rb_node *node)
+/* Sort the edges and fold the same blocks together */
+static void block_edges__compact(void)
 {
-	struct rb_node **p = &node->rb_right;
-	while (*p) {
-		node = *p;
-		p = &node->rb_left;
+	struct block_edge *edges = block_ranges.edges;
+	size_t i, nr = 0;
+
+	if (block_ranges.nr_sorted == block_ranges.nr_edges)
+		return;
+
+	qsort(edges, block_ranges.nr_edges, sizeof(*edges), block_edge__cmp);
+
+	for (i = 0; i < block_ranges.nr_edges; i++) {
+		if (nr && !block_edge__cmp(&edges[nr - 1], &edges[i])) {
+			edges[nr - 1].count += edges[i].count;
+			edges[nr - 1].pred  += edges[i].pred;
+			edges[nr - 1].sym    = edges[i].sym;
+			continue;
+		}
+		edges[nr++] = edges[i];
 	}
-	rb_link_node(right, node, p);
+
+	block_ranges.nr_edges  = nr;
+	block_ranges.nr_sorted = nr;
 }
 
 /**
- * block_range__create
+ * block_range__add
  * @start: branch target starting this basic block
  * @end:   branch ending this basic block
+ * @sym:   the symbol of @start
+ * @predicted: the branch at @end was predicted
  *
- * Create all the required block ranges to precisely span the given range.
+ * Account a run of the basic block, the ranges are built when looked up.
  */
-struct block_range_iter block_range__create(u64 start, u64 end)
+int block_range__add(u64 start, u64 end, struct symbol *sym, bool predicted)
 {
-	struct rb_node **p = &block_ranges.root.rb_node;
-	struct rb_node *n, *parent = NULL;
-	struct block_range *next, *entry = NULL;
-	struct block_range_iter iter = { NULL, NULL };
+	struct block_edge *edge;
 
-	while (*p != NULL) {
-		parent = *p;
-		entry = rb_entry(parent, struct block_range, node);
+	if (block_ranges.nr_edges == block_ranges.alloc_edges) {
+		size_t alloc;
 
-		if (start < entry->start)
-			p = &parent->rb_left;
-		else if (start > entry->end)
-			p = &parent->rb_right;
-		else
-			break;
-	}
+		block_edges__compact();
 
-	/*
-	 * Didn't find anything.. there's a hole at @start, however @end might
-	 * be inside/behind the next range.
-	 */
-	if (!*p) {
-		if (!entry) /* tree empty */
-			goto do_whole;
-
-		/*
-		 * If the last node is before, advance one to find the next.
-		 */
-		n = parent;
-		if (entry->end < start) {
-			n = rb_next(n);
-			if (!n)
-				goto do_whole;
-		}
-		next = rb_entry(n, struct block_range, node);
-
-		if (next->start <= end) { /* add head: [start...][n->start...] */
-			struct block_range *head = malloc(sizeof(struct block_range));
-			if (!head)
-				return iter;
-
-			*head = (struct block_range){
-				.start		= start,
-				.end		= next->start - 1,
-				.is_target	= 1,
-				.is_branch	= 0,
-			};
-
-			rb_link_left_of_node(&head->node, &next->node);
-			rb_insert_color(&head->node, &block_ranges.root);
-			block_range__debug();
-
-			iter.start = head;
-			goto do_tail;
-		}
+		alloc = block_ranges.alloc_edges;
+		if (block_ranges.nr_edges >= alloc / 2)
+			alloc = alloc ? alloc * 2 : BLOCK_EDGES_BATCH;
 
-do_whole:
-		/*
-		 * The whole [start..end] range is non-overlapping.
-		 */
-		entry = malloc(sizeof(struct block_range));
-		if (!entry)
-			return iter;
-
-		*entry = (struct block_range){
-			.start		= start,
-			.end		= end,
-			.is_target	= 1,
-			.is_branch	= 1,
-		};
-
-		rb_link_node(&entry->node, parent, p);
-		rb_insert_color(&entry->node, &block_ranges.root);
-		block_range__debug();
-
-		iter.start = entry;
-		iter.end   = entry;
-		goto done;
+		if (alloc != block_ranges.alloc_edges) {
+			edge = realloc(block_ranges.edges, alloc * sizeof(*edge));
+			if (!edge)
+				return -ENOMEM;
+			block_ranges.edges = edge;
+			block_ranges.alloc_edges = alloc;
+		}
 	}
 
-	/*
-	 * We found a range that overlapped with ours, split if needed.
-	 */
-	if (entry->start < start) { /* split: [e->start...][start...] */
-		struct block_range *head = malloc(sizeof(struct block_range));
-		if (!head)
-			return iter;
+	edge = &block_ranges.edges[block_ranges.nr_edges++];
+	edge->start = start;
+	edge->end   = end;
+	edge->sym   = sym;
+	edge->count = 1;
+	edge->pred  = predicted;
 
-		*head = (struct block_range){
-			.start		= entry->start,
-			.end		= start - 1,
-			.is_target	= entry->is_target,
-			.is_branch	= 0,
+	block_ranges.blocks++;
+	block_ranges.dirty = true;
+	return 0;
+}
 
-			.coverage	= entry->coverage,
-			.entry		= entry->entry,
-		};
+static void block_ranges__delete(void)
+{
+	struct rb_node *rb = rb_first(&block_ranges.root);
 
-		entry->start		= start;
-		entry->is_target	= 1;
-		entry->entry		= 0;
+	while (rb) {
+		struct block_range *br = rb_entry(rb, struct block_range, node);
 
-		rb_link_left_of_node(&head->node, &entry->node);
-		rb_insert_color(&head->node, &block_ranges.root);
-		block_range__debug();
+		rb = rb_next(rb);
+		rb_erase(&br->node, &block_ranges.root);
+		free(br);
+	}
+}
 
-	} else if (entry->start == start)
-		entry->is_target = 1;
+/* The ranges come in address order, each goes right of the previous one */
+static struct block_range *block_ranges__append(struct block_range *last,
+						u64 start, u64 end)
+{
+	struct block_range *br = zalloc(sizeof(*br));
 
-	iter.start = entry;
+	if (!br)
+		return NULL;
 
-do_tail:
-	/*
-	 * At this point we've got: @iter.start = [@start...] but @end can still be
-	 * inside or beyond it.
-	 */
-	entry = iter.start;
-	for (;;) {
-		/*
-		 * If @end is inside @entry, split.
-		 */
-		if (end < entry->end) { /* split: [...end][...e->end] */
-			struct block_range *tail = malloc(sizeof(struct block_range));
-			if (!tail)
-				return iter;
-
-			*tail = (struct block_range){
-				.start		= end + 1,
-				.end		= entry->end,
-				.is_target	= 0,
-				.is_branch	= entry->is_branch,
-
-				.coverage	= entry->coverage,
-				.taken		= entry->taken,
-				.pred		= entry->pred,
-			};
-
-			entry->end		= end;
-			entry->is_branch	= 1;
-			entry->taken		= 0;
-			entry->pred		= 0;
-
-			rb_link_right_of_node(&tail->node, &entry->node);
-			rb_insert_color(&tail->node, &block_ranges.root);
-			block_range__debug();
-
-			iter.end = entry;
-			goto done;
-		}
+	br->start = start;
+	br->end   = end;
+
+	if (last)
+		rb_link_node(&br->node, &last->node, &last->node.rb_right);
+	else
+		rb_link_node(&br->node, NULL, &block_ranges.root.rb_node);
+	rb_insert_color(&br->node, &block_ranges.root);
 
-		/*
-		 * If @end matches @entry, done
-		 */
-		if (end == entry->end) {
-			entry->is_branch = 1;
-			iter.end = entry;
-			goto done;
+	return br;
+}
+
+/*
+ * Split the address space at every block start and after every block end
+ * and sweep it in order: the ranges covered by some block get the number
+ * of blocks covering them, the runs entering at their start and the
+ * branches taken at their end.
+ */
+static int block_ranges__build(void)
+{
+	struct block_edge *edges, **ends;
+	struct block_range *last = NULL;
+	struct symbol *sym = NULL;
+	size_t i = 0, j = 0, nr;
+	u64 coverage = 0, entry = 0, pos = 0;
+	int err = 0;
+
+	block_edges__compact();
+	block_ranges__delete();
+
+	edges = block_ranges.edges;
+	nr = block_ranges.nr_edges;
+
+	ends = malloc(nr * sizeof(*ends));
+	if (nr && !ends)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++)
+		ends[i] = &edges[i];
+	qsort(ends, nr, sizeof(*ends), block_edge__cmp_end);
+
+	i = 0;
+	while (i < nr || j < nr) {
+		u64 point, taken = 0, pred = 0;
+		bool is_branch = false;
+
+		if (j == nr || (i < nr && edges[i].start <= ends[j]->end))
+			point = edges[i].start;
+		else
+			point = ends[j]->end + 1;
+
+		/* the branches ending the range before point */
+		while (j < nr && ends[j]->end + 1 == point) {
+			is_branch = true;
+			taken    += ends[j]->count;
+			pred     += ends[j]->pred;
+			coverage -= ends[j]->count;
+			j++;
 		}
 
-		next = block_range__next(entry);
-		if (!next)
-			goto add_tail;
-
-		/*
-		 * If @end is in beyond @entry but not inside @next, add tail.
-		 */
-		if (end < next->start) { /* add tail: [...e->end][...end] */
-			struct block_range *tail;
-add_tail:
-			tail = malloc(sizeof(struct block_range));
-			if (!tail)
-				return iter;
-
-			*tail = (struct block_range){
-				.start		= entry->end + 1,
-				.end		= end,
-				.is_target	= 0,
-				.is_branch	= 1,
-			};
-
-			rb_link_right_of_node(&tail->node, &entry->node);
-			rb_insert_color(&tail->node, &block_ranges.root);
-			block_range__debug();
-
-			iter.end = tail;
-			goto done;
+		if (pos < point && (coverage || taken)) {
+			struct block_range *br;
+
+			br = block_ranges__append(last, pos, point - 1);
+			if (!br) {
+				err = -ENOMEM;
+				break;
+			}
+
+			br->sym       = sym;
+			br->is_target = entry != 0;
+			br->entry     = entry;
+			br->coverage  = coverage + taken;
+			br->is_branch = is_branch;
+			br->taken     = taken;
+			br->pred      = pred;
+
+			if (sym) {
+				struct annotation *notes = symbol__annotation(sym);
+
+				notes->max_coverage = max(notes->max_coverage, br->coverage);
+			}
+			last = br;
 		}
 
-		/*
-		 * If there is a hole between @entry and @next, fill it.
-		 */
-		if (entry->end + 1 != next->start) {
-			struct block_range *hole = malloc(sizeof(struct block_range));
-			if (!hole)
-				return iter;
-
-			*hole = (struct block_range){
-				.start		= entry->end + 1,
-				.end		= next->start - 1,
-				.is_target	= 0,
-				.is_branch	= 0,
-			};
-
-			rb_link_left_of_node(&hole->node, &next->node);
-			rb_insert_color(&hole->node, &block_ranges.root);
-			block_range__debug();
+		entry = 0;
+		while (i < nr && edges[i].start == point) {
+			entry    += edges[i].count;
+			coverage += edges[i].count;
+			sym       = edges[i].sym;
+			i++;
 		}
 
-		entry = next;
+		pos = point;
 	}
 
-done:
-	assert(iter.start->start == start && iter.start->is_target);
-	assert(iter.end->end == end && iter.end->is_branch);
+	free(ends);
+	block_range__debug();
+	block_ranges.dirty = false;
+	return err;
+}
 
-	block_ranges.blocks++;
+struct block_range *block_range__find(u64 addr)
+{
+	struct rb_node **p = &block_ranges.root.rb_node;
+	struct rb_node *parent = NULL;
+	struct block_range *entry;
 
-	return iter;
-}
+	if (block_ranges.dirty && block_ranges__build())
+		return NULL;
+
+	while (*p != NULL) {
+		parent = *p;
+		entry = rb_entry(parent, struct block_range, node);
 
+		if (addr < entry->start)
+			p = &parent->rb_left;
+		else if (addr > entry->end)
+			p = &parent->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
 
 /*
  * Compute coverage as:
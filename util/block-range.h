@@ -16,6 +16,7 @@ struct symbol;
  * @is_target:	@start is a jump target
  * @is_branch:	@end is a branch instruction
  * @coverage:	number of blocks that cover this range
+ * @entry:	number of blocks starting at @start
  * @taken:	number of times the branch is taken (requires @is_branch)
  * @pred:	number of times the taken branch was predicted
  */
@@ -43,34 +44,8 @@ static inline struct block_range *block_range__next(struct block_range *br)
 	return rb_entry(n, struct block_range, node);
 }
 
-struct block_range_iter {
-	struct block_range *start;
-	struct block_range *end;
-};
-
-static inline struct block_range *block_range_iter(struct block_range_iter *iter)
-{
-	return iter->start;
-}
-
-static inline bool block_range_iter__next(struct block_range_iter *iter)
-{
-	if (iter->start == iter->end)
-		return false;
-
-	iter->start = block_range__next(iter->start);
-	return true;
-}
-
-static inline bool block_range_iter__valid(struct block_range_iter *iter)
-{
-	if (!iter->start || !iter->end)
-		return false;
-	return true;
-}
-
+extern int block_range__add(u64 start, u64 end, struct symbol *sym, bool predicted);
 extern struct block_range *block_range__find(u64 addr);
-extern struct block_range_iter block_range__create(u64 start, u64 end);
 extern double block_range__coverage(struct block_range *br);
 
 #endif /* __PERF_BLOCK_RANGE_H */
@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/err.h>
+#include <subcmd/exec-cmd.h>
+#include "bpf-cgroup.h"
+#include "bpf-loader.h"
+#include "cgroup.h"
+#include "counts.h"
+#include "cpumap.h"
+#include "debug.h"
+#include "evlist.h"
+#include "evsel.h"
+#include "thread_map.h"
+#include "util.h"
+#include "xyarray.h"
+
+/*
+ * The evsels of evlist with the same attr count the same event, in their
+ * cgroups: they share a counter.  The evsels without a cgroup count in the
+ * root one, that all the tasks are in.
+ */
+struct bpf_cgroup {
+	struct bpf_object	*obj;
+	int			events_fd;
+	int			cgroup_idx_fd;
+	int			prev_readings_fd;
+	int			readings_fd;
+	/* the CPUs the events map has room for */
+	int			max_cpus;
+	int			max_cgroups;
+	struct cpu_map		*cpus;
+	struct thread_map	*threads;
+	struct perf_evsel	*counters[BPF_CGROUP_MAX_EVENTS];
+	struct perf_event_attr	attrs[BPF_CGROUP_MAX_EVENTS];
+	int			nr_counters;
+	struct perf_evsel	*switch_evsel;
+	int			nr_cgroups;
+	bool			enabled;
+	/* by evsel->idx */
+	int			*counter_of;
+	int			*cgroup_of;
+	/* a value per possible CPU, as the per-cpu maps have them */
+	struct bpf_perf_event_value *values;
+	int			nr_possible;
+};
+
+static int bpf_cgroup__map_fd(struct bpf_cgroup *bc, const char *name, int *max_entries)
+{
+	struct bpf_map *map = bpf_object__find_map_by_name(bc->obj, name);
+	const struct bpf_map_def *def;
+
+	if (map == NULL) {
+		pr_err("No '%s' map in the BPF object\n", name);
+		return -ENOENT;
+	}
+
+	def = bpf_map__def(map);
+	if (IS_ERR(def))
+		return PTR_ERR(def);
+
+	if (max_entries)
+		*max_entries = def->max_entries;
+
+	return bpf_map__fd(map);
+}
+
+static int bpf_cgroup__set_switch(const char *group, const char *event,
+				  int fd, void *arg)
+{
+	struct bpf_cgroup *bc = arg;
+
+	if (bc->switch_evsel) {
+		pr_err("Only one BPF program is expected, at the context switches\n");
+		return -EINVAL;
+	}
+
+	bc->switch_evsel = perf_evsel__newtp(group, event);
+	if (IS_ERR(bc->switch_evsel)) {
+		int err = PTR_ERR(bc->switch_evsel);
+
+		bc->switch_evsel = NULL;
+		return err;
+	}
+
+	bc->switch_evsel->bpf_fd = fd;
+	return 0;
+}
+
+static int bpf_cgroup__load(struct bpf_cgroup *bc, const char *path)
+{
+	char *obj_path = NULL;
+	int err;
+
+	if (!*path) {
+		obj_path = system_path(PERF_EXAMPLES_DIR "/" BPF_CGROUP_OBJ);
+		if (obj_path == NULL)
+			return -ENOMEM;
+		path = obj_path;
+	}
+
+	bc->obj = bpf__prepare_load(path, true);
+	if (IS_ERR(bc->obj)) {
+		char errbuf[BUFSIZ];
+
+		err = PTR_ERR(bc->obj);
+		bc->obj = NULL;
+		bpf__strerror_prepare_load(path, true, -err, errbuf, sizeof(errbuf));
+		pr_err("%s: %s\n", path, errbuf);
+		goto out;
+	}
+
+	atexit(bpf__clear);
+
+	err = bpf__probe(bc->obj);
+	if (!err)
+		err = bpf__load(bc->obj);
+	if (err) {
+		char errbuf[BUFSIZ];
+
+		bpf__strerror_load(bc->obj, err, errbuf, sizeof(errbuf));
+		pr_err("%s: %s\n", path, errbuf);
+		goto out;
+	}
+
+	err = bpf__foreach_event(bc->obj, bpf_cgroup__set_switch, bc);
+	if (!err && bc->switch_evsel == NULL)
+		err = -ENOENT;
+	if (err) {
+		pr_err("%s: no program at the context switches\n", path);
+		goto out;
+	}
+
+	bc->events_fd	     = bpf_cgroup__map_fd(bc, "events", &bc->max_cpus);
+	bc->cgroup_idx_fd    = bpf_cgroup__map_fd(bc, "cgroup_idx", NULL);
+	bc->prev_readings_fd = bpf_cgroup__map_fd(bc, "prev_readings", NULL);
+	bc->readings_fd	     = bpf_cgroup__map_fd(bc, "cgroup_readings", &bc->max_cgroups);
+
+	if (bc->events_fd < 0 || bc->cgroup_idx_fd < 0 ||
+	    bc->prev_readings_fd < 0 || bc->readings_fd < 0)
+		err = -ENOENT;
+
+	bc->max_cpus	/= BPF_CGROUP_MAX_EVENTS;
+	bc->max_cgroups /= BPF_CGROUP_MAX_EVENTS;
+out:
+	free(obj_path);
+	return err;
+}
+
+/* The id of the cgroup v2 directory, that bpf_get_current_cgroup_id() has */
+static int cgroup__id(int dirfd, const char *path, u64 *id)
+{
+	struct {
+		struct file_handle fh;
+		u64 id;
+	} handle;
+	int mount_id;
+
+	handle.fh.handle_bytes = sizeof(handle.id);
+	if (name_to_handle_at(dirfd, path, &handle.fh, &mount_id,
+			      dirfd >= 0 ? AT_EMPTY_PATH : 0) < 0)
+		return -errno;
+
+	memcpy(id, handle.fh.f_handle, sizeof(*id));
+	return 0;
+}
+
+static int bpf_cgroup__add_cgroup(struct bpf_cgroup *bc, struct cgroup *cgrp,
+				  struct cgroup **cgrps)
+{
+	char mnt[PATH_MAX + 1];
+	u32 idx;
+	u64 id;
+	int i, err;
+
+	for (i = 0; i < bc->nr_cgroups; i++) {
+		if (cgrps[i] == cgrp)
+			return i;
+	}
+
+	if (bc->nr_cgroups == bc->max_cgroups) {
+		pr_err("Only %d cgroups can be counted with BPF\n", bc->max_cgroups);
+		return -E2BIG;
+	}
+
+	if (cgrp)
+		err = cgroup__id(cgrp->fd, "", &id);
+	else if (cgroupfs_find_mountpoint(mnt, sizeof(mnt)))
+		err = -ENOENT;
+	else
+		err = cgroup__id(AT_FDCWD, mnt, &id);
+
+	if (err) {
+		pr_err("Can't get the id of cgroup %s\n", cgrp ? cgrp->name : "/");
+		return err;
+	}
+
+	idx = bc->nr_cgroups;
+	if (bpf_map_update_elem(bc->cgroup_idx_fd, &id, &idx, BPF_ANY))
+		return -errno;
+
+	cgrps[bc->nr_cgroups] = cgrp;
+	return bc->nr_cgroups++;
+}
+
+static int bpf_cgroup__add_counter(struct bpf_cgroup *bc, struct perf_evsel *evsel)
+{
+	int i;
+
+	for (i = 0; i < bc->nr_counters; i++) {
+		if (!memcmp(&bc->attrs[i], &evsel->attr, sizeof(evsel->attr)))
+			return i;
+	}
+
+	if (bc->nr_counters == BPF_CGROUP_MAX_EVENTS) {
+		pr_err("Only %d events can be counted with BPF\n", BPF_CGROUP_MAX_EVENTS);
+		return -E2BIG;
+	}
+
+	bc->counters[i] = perf_evsel__new(&evsel->attr);
+	if (bc->counters[i] == NULL)
+		return -ENOMEM;
+
+	/* as given, to be found again */
+	bc->attrs[i] = evsel->attr;
+	bc->counters[i]->attr.disabled	  = 1;
+	bc->counters[i]->attr.inherit	  = 0;
+	bc->counters[i]->attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+					    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return bc->nr_counters++;
+}
+
+static int bpf_cgroup__setup(struct bpf_cgroup *bc, struct perf_evlist *evlist)
+{
+	struct cgroup **cgrps = calloc(bc->max_cgroups, sizeof(*cgrps));
+	struct perf_evsel *evsel;
+	int err = 0;
+
+	bc->counter_of = calloc(evlist->nr_entries, sizeof(int));
+	bc->cgroup_of  = calloc(evlist->nr_entries, sizeof(int));
+	if (!cgrps || !bc->counter_of || !bc->cgroup_of) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	evlist__for_each_entry(evlist, evsel) {
+		err = bpf_cgroup__add_counter(bc, evsel);
+		if (err < 0)
+			goto out;
+		bc->counter_of[evsel->idx] = err;
+
+		err = bpf_cgroup__add_cgroup(bc, evsel->cgrp, cgrps);
+		if (err < 0)
+			goto out;
+		bc->cgroup_of[evsel->idx] = err;
+		err = 0;
+	}
+out:
+	free(cgrps);
+	return err;
+}
+
+struct bpf_cgroup *bpf_cgroup__new(struct perf_evlist *evlist, const char *path)
+{
+	struct bpf_cgroup *bc = zalloc(sizeof(*bc));
+	int i, err = -ENOMEM;
+
+	if (bc == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	bc->cpus	= cpu_map__get(evlist->cpus);
+	bc->threads	= thread_map__new_dummy();
+	bc->nr_possible = cpu__max_cpu();
+	bc->values	= calloc(bc->nr_possible, sizeof(*bc->values));
+	if (bc->threads == NULL || bc->values == NULL)
+		goto out_delete;
+
+	err = bpf_cgroup__load(bc, path);
+	if (err)
+		goto out_delete;
+
+	for (i = 0; i < bc->cpus->nr; i++) {
+		if (bc->cpus->map[i] >= bc->max_cpus) {
+			pr_err("CPU %d is past the %d the BPF program has room for\n",
+			       bc->cpus->map[i], bc->max_cpus);
+			err = -E2BIG;
+			goto out_delete;
+		}
+	}
+
+	err = bpf_cgroup__setup(bc, evlist);
+	if (err)
+		goto out_delete;
+
+	pr_debug("bpf cgroup: %d counters for %d events in %d cgroups\n",
+		 bc->nr_counters, evlist->nr_entries, bc->nr_cgroups);
+	return bc;
+
+out_delete:
+	bpf_cgroup__delete(bc);
+	return ERR_PTR(err);
+}
+
+void bpf_cgroup__delete(struct bpf_cgroup *bc)
+{
+	int i;
+
+	if (bc == NULL)
+		return;
+
+	bpf_cgroup__close(bc);
+
+	for (i = 0; i < bc->nr_counters; i++)
+		perf_evsel__delete(bc->counters[i]);
+	if (bc->switch_evsel)
+		perf_evsel__delete(bc->switch_evsel);
+
+	cpu_map__put(bc->cpus);
+	thread_map__put(bc->threads);
+	free(bc->counter_of);
+	free(bc->cgroup_of);
+	free(bc->values);
+	free(bc);
+}
+
+static int bpf_cgroup__clear(int map_fd, u32 key, struct bpf_cgroup *bc)
+{
+	memset(bc->values, 0, bc->nr_possible * sizeof(*bc->values));
+
+	return bpf_map_update_elem(map_fd, &key, bc->values, BPF_ANY) ? -errno : 0;
+}
+
+int bpf_cgroup__open(struct bpf_cgroup *bc)
+{
+	int i, cpu, err;
+
+	for (i = 0; i < bc->nr_counters; i++) {
+		struct perf_evsel *counter = bc->counters[i];
+
+		err = perf_evsel__open(counter, bc->cpus, bc->threads);
+		if (err) {
+			pr_err("Can't open %s: %s\n", perf_evsel__name(counter),
+			       strerror(-err));
+			goto out_close;
+		}
+
+		/* the counts at the previous switch are of the previous run */
+		err = bpf_cgroup__clear(bc->prev_readings_fd, i, bc);
+		if (err)
+			goto out_close;
+
+		for (cpu = 0; cpu < bc->cpus->nr; cpu++) {
+			u32 key = bc->cpus->map[cpu] * BPF_CGROUP_MAX_EVENTS + i;
+			int *fd = xyarray__entry(counter->fd, cpu, 0);
+
+			if (bpf_map_update_elem(bc->events_fd, &key, fd, BPF_ANY)) {
+				err = -errno;
+				goto out_close;
+			}
+		}
+	}
+
+	/* now that it has the counters to read */
+	err = perf_evsel__open(bc->switch_evsel, bc->cpus, bc->threads);
+	if (err) {
+		pr_err("Can't attach the BPF program to %s: %s\n",
+		       perf_evsel__name(bc->switch_evsel), strerror(-err));
+		goto out_close;
+	}
+
+	return 0;
+
+out_close:
+	bpf_cgroup__close(bc);
+	return err;
+}
+
+void bpf_cgroup__close(struct bpf_cgroup *bc)
+{
+	int i, cpu;
+
+	if (bc->switch_evsel)
+		perf_evsel__close(bc->switch_evsel);
+
+	for (i = 0; i < bc->nr_counters; i++) {
+		/* the map keeps the events alive otherwise */
+		for (cpu = 0; cpu < bc->cpus->nr; cpu++) {
+			u32 key = bc->cpus->map[cpu] * BPF_CGROUP_MAX_EVENTS + i;
+
+			bpf_map_delete_elem(bc->events_fd, &key);
+		}
+		perf_evsel__close(bc->counters[i]);
+	}
+}
+
+/*
+ * What was counted since the last context switch of a CPU is added at the
+ * next one: have one on all the CPUs by running on each of them.
+ */
+static void bpf_cgroup__sync(struct bpf_cgroup *bc)
+{
+	cpu_set_t orig, cpus;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(orig), &orig))
+		return;
+
+	for (cpu = 0; cpu < bc->cpus->nr; cpu++) {
+		CPU_ZERO(&cpus);
+		CPU_SET(bc->cpus->map[cpu], &cpus);
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	}
+
+	sched_setaffinity(0, sizeof(orig), &orig);
+}
+
+int bpf_cgroup__enable(struct bpf_cgroup *bc)
+{
+	int i, cgrp, err;
+
+	for (i = 0; i < bc->nr_counters; i++) {
+		err = perf_evsel__enable(bc->counters[i]);
+		if (err)
+			return err;
+	}
+
+	/* start from here, not from the last switch before the enabling */
+	bpf_cgroup__sync(bc);
+	bc->enabled = true;
+
+	for (cgrp = 0; cgrp < bc->nr_cgroups; cgrp++) {
+		for (i = 0; i < bc->nr_counters; i++) {
+			err = bpf_cgroup__clear(bc->readings_fd,
+						cgrp * BPF_CGROUP_MAX_EVENTS + i, bc);
+			if (err)
+				return err;
+		}
+	}
+
+	return 0;
+}
+
+int bpf_cgroup__disable(struct bpf_cgroup *bc)
+{
+	int i, err;
+
+	/* what was counted up to here */
+	bpf_cgroup__sync(bc);
+	bc->enabled = false;
+
+	for (i = 0; i < bc->nr_counters; i++) {
+		err = perf_evsel__disable(bc->counters[i]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+int bpf_cgroup__read(struct bpf_cgroup *bc, struct perf_evlist *evlist)
+{
+	struct perf_evsel *evsel;
+
+	if (bc->enabled)
+		bpf_cgroup__sync(bc);
+
+	evlist__for_each_entry(evlist, evsel) {
+		struct cpu_map *cpus = perf_evsel__cpus(evsel);
+		u32 key = bc->cgroup_of[evsel->idx] * BPF_CGROUP_MAX_EVENTS +
+			  bc->counter_of[evsel->idx];
+		int cpu;
+
+		if (bpf_map_lookup_elem(bc->readings_fd, &key, bc->values))
+			return -errno;
+
+		for (cpu = 0; cpu < cpus->nr; cpu++) {
+			struct perf_counts_values *count = perf_counts(evsel->counts, cpu, 0);
+			struct bpf_perf_event_value *value = &bc->values[cpus->map[cpu]];
+
+			count->val = value->counter;
+			count->ena = value->enabled;
+			count->run = value->running;
+		}
+	}
+
+	return 0;
+}
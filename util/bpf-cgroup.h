@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_BPF_CGROUP_H
+#define __PERF_BPF_CGROUP_H
+
+#include <linux/compiler.h>
+#include <linux/err.h>
+
+struct bpf_cgroup;
+struct perf_evlist;
+
+/* Must match MAX_EVENTS and MAX_LEVELS in examples/bpf/cgroup_counters.c */
+#define BPF_CGROUP_MAX_EVENTS	16
+#define BPF_CGROUP_MAX_LEVELS	8
+
+#define BPF_CGROUP_OBJ		"bpf/cgroup_counters.c"
+
+/*
+ * Counts the events of 'perf stat -G' with one counter per event and CPU
+ * instead of one per event, cgroup and CPU: the BPF program in path, or
+ * examples/bpf/cgroup_counters.c when empty, adds what they counted to
+ * the cgroup of the task going out, at each context switch, in a map.
+ *
+ * The counts are read from that map into those of the events of evlist,
+ * that aren't opened.
+ */
+#ifdef HAVE_LIBBPF_SUPPORT
+struct bpf_cgroup *bpf_cgroup__new(struct perf_evlist *evlist, const char *path);
+void bpf_cgroup__delete(struct bpf_cgroup *bc);
+
+int bpf_cgroup__open(struct bpf_cgroup *bc);
+void bpf_cgroup__close(struct bpf_cgroup *bc);
+int bpf_cgroup__enable(struct bpf_cgroup *bc);
+int bpf_cgroup__disable(struct bpf_cgroup *bc);
+
+/* Set the counts of the events of evlist to what was counted so far */
+int bpf_cgroup__read(struct bpf_cgroup *bc, struct perf_evlist *evlist);
+#else
+#include <errno.h>
+#include "debug.h"
+
+static inline struct bpf_cgroup *
+bpf_cgroup__new(struct perf_evlist *evlist __maybe_unused,
+		const char *path __maybe_unused)
+{
+	pr_err("BPF support is not compiled\n");
+	return ERR_PTR(-ENOTSUP);
+}
+
+static inline void bpf_cgroup__delete(struct bpf_cgroup *bc __maybe_unused) { }
+
+static inline int bpf_cgroup__open(struct bpf_cgroup *bc __maybe_unused) { return -ENOTSUP; }
+static inline void bpf_cgroup__close(struct bpf_cgroup *bc __maybe_unused) { }
+static inline int bpf_cgroup__enable(struct bpf_cgroup *bc __maybe_unused) { return -ENOTSUP; }
+static inline int bpf_cgroup__disable(struct bpf_cgroup *bc __maybe_unused) { return -ENOTSUP; }
+
+static inline int
+bpf_cgroup__read(struct bpf_cgroup *bc __maybe_unused,
+		 struct perf_evlist *evlist __maybe_unused)
+{
+	return -ENOTSUP;
+}
+#endif // HAVE_LIBBPF_SUPPORT
+#endif /* __PERF_BPF_CGROUP_H */
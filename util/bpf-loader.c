@@ -73,22 +73,29 @@ struct bpf_object *bpf__prepare_load(const char *filename, bool source)
 	}
 
 	if (source) {
+		bool cached = true;
 		int err;
 		void *obj_buf;
 		size_t obj_buf_sz;
 
-		perf_clang__init();
-		err = perf_clang__compile_bpf(filename, &obj_buf, &obj_buf_sz);
-		perf_clang__cleanup();
-		if (err) {
-			pr_debug("bpf: builtin compilation failed: %d, try external compiler\n", err);
-			err = llvm__compile_bpf(filename, &obj_buf, &obj_buf_sz);
-			if (err)
-				return ERR_PTR(-BPF_LOADER_ERRNO__COMPILE);
-		} else
-			pr_debug("bpf: successful builtin compilation\n");
+		if (llvm__cache_lookup(filename, &obj_buf, &obj_buf_sz)) {
+			cached = false;
+			perf_clang__init();
+			err = perf_clang__compile_bpf(filename, &obj_buf, &obj_buf_sz);
+			perf_clang__cleanup();
+			if (err) {
+				pr_debug("bpf: builtin compilation failed: %d, try external compiler\n", err);
+				err = llvm__compile_bpf(filename, &obj_buf, &obj_buf_sz);
+				if (err)
+					return ERR_PTR(-BPF_LOADER_ERRNO__COMPILE);
+			} else
+				pr_debug("bpf: successful builtin compilation\n");
+		}
 		obj = bpf_object__open_buffer(obj_buf, obj_buf_sz, filename);
 
+		if (!IS_ERR_OR_NULL(obj) && !cached)
+			llvm__cache_store(filename, obj_buf, obj_buf_sz);
+
 		if (!IS_ERR_OR_NULL(obj) && llvm_param.dump_obj)
 			llvm__dump_obj(filename, obj_buf, obj_buf_sz);
 
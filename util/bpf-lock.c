@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/err.h>
+#include <subcmd/exec-cmd.h>
+#include "bpf-lock.h"
+#include "bpf-loader.h"
+#include "cpumap.h"
+#include "debug.h"
+#include "evsel.h"
+#include "thread_map.h"
+#include "util.h"
+
+#define BPF_LOCK_MAX_EVSELS	2
+
+struct bpf_lock {
+	struct bpf_object	*obj;
+	int			stats_fd;
+	int			stacks_fd;
+	int			max_stats;
+	/* at lock:contention_begin and lock:contention_end */
+	struct perf_evsel	*evsels[BPF_LOCK_MAX_EVSELS];
+	int			nr_evsels;
+	/* the keys read, deleted after the walk */
+	struct bpf_lock_key	*keys;
+};
+
+static int bpf_lock__map_fd(struct bpf_lock *bl, const char *name, int *max_entries)
+{
+	struct bpf_map *map = bpf_object__find_map_by_name(bl->obj, name);
+	const struct bpf_map_def *def;
+
+	if (map == NULL) {
+		pr_err("No '%s' map in the BPF object\n", name);
+		return -ENOENT;
+	}
+
+	def = bpf_map__def(map);
+	if (IS_ERR(def))
+		return PTR_ERR(def);
+
+	if (max_entries)
+		*max_entries = def->max_entries;
+
+	return bpf_map__fd(map);
+}
+
+static int bpf_lock__add_evsel(const char *group, const char *event,
+			       int fd, void *arg)
+{
+	struct bpf_lock *bl = arg;
+	struct perf_evsel *evsel;
+
+	if (strcmp(group, "lock") || bl->nr_evsels == BPF_LOCK_MAX_EVSELS) {
+		pr_err("Only programs at lock:contention_begin and lock:contention_end are expected\n");
+		return -EINVAL;
+	}
+
+	evsel = perf_evsel__newtp(group, event);
+	if (IS_ERR(evsel))
+		return PTR_ERR(evsel);
+
+	evsel->bpf_fd = fd;
+	bl->evsels[bl->nr_evsels++] = evsel;
+	return 0;
+}
+
+struct bpf_lock *bpf_lock__new(const char *path)
+{
+	struct bpf_lock *bl = zalloc(sizeof(*bl));
+	char *obj_path = NULL;
+	char errbuf[BUFSIZ];
+	int err = -ENOMEM;
+
+	if (bl == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	if (!*path) {
+		obj_path = system_path(PERF_EXAMPLES_DIR "/" BPF_LOCK_OBJ);
+		if (obj_path == NULL)
+			goto out_delete;
+		path = obj_path;
+	}
+
+	bl->obj = bpf__prepare_load(path, true);
+	if (IS_ERR(bl->obj)) {
+		err = PTR_ERR(bl->obj);
+		bl->obj = NULL;
+		bpf__strerror_prepare_load(path, true, -err, errbuf, sizeof(errbuf));
+		pr_err("%s: %s\n", path, errbuf);
+		goto out_delete;
+	}
+
+	atexit(bpf__clear);
+
+	err = bpf__probe(bl->obj);
+	if (!err)
+		err = bpf__load(bl->obj);
+	if (err) {
+		bpf__strerror_load(bl->obj, err, errbuf, sizeof(errbuf));
+		pr_err("%s: %s\n", path, errbuf);
+		goto out_delete;
+	}
+
+	err = bpf__foreach_event(bl->obj, bpf_lock__add_evsel, bl);
+	if (!err && bl->nr_evsels != BPF_LOCK_MAX_EVSELS)
+		err = -ENOENT;
+	if (err) {
+		pr_err("%s: no programs at the lock contention tracepoints\n", path);
+		goto out_delete;
+	}
+
+	bl->stats_fd  = bpf_lock__map_fd(bl, "lock_stats", &bl->max_stats);
+	bl->stacks_fd = bpf_lock__map_fd(bl, "stacks", NULL);
+	if (bl->stats_fd < 0 || bl->stacks_fd < 0) {
+		err = -ENOENT;
+		goto out_delete;
+	}
+
+	err = -ENOMEM;
+	bl->keys = calloc(bl->max_stats, sizeof(*bl->keys));
+	if (bl->keys == NULL)
+		goto out_delete;
+
+	free(obj_path);
+	return bl;
+
+out_delete:
+	free(obj_path);
+	bpf_lock__delete(bl);
+	return ERR_PTR(err);
+}
+
+void bpf_lock__delete(struct bpf_lock *bl)
+{
+	int i;
+
+	if (bl == NULL)
+		return;
+
+	bpf_lock__close(bl);
+
+	for (i = 0; i < bl->nr_evsels; i++)
+		perf_evsel__delete(bl->evsels[i]);
+
+	free(bl->keys);
+	free(bl);
+}
+
+int bpf_lock__open(struct bpf_lock *bl, struct cpu_map *cpus,
+		   struct thread_map *threads)
+{
+	int i, err;
+
+	for (i = 0; i < bl->nr_evsels; i++) {
+		err = perf_evsel__open(bl->evsels[i], cpus, threads);
+		if (err) {
+			pr_err("Can't attach the BPF program to %s: %s\n",
+			       perf_evsel__name(bl->evsels[i]), strerror(-err));
+			bpf_lock__close(bl);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void bpf_lock__close(struct bpf_lock *bl)
+{
+	int i;
+
+	for (i = 0; i < bl->nr_evsels; i++)
+		perf_evsel__close(bl->evsels[i]);
+}
+
+int bpf_lock__read(struct bpf_lock *bl, bpf_lock_cb_t cb, void *arg)
+{
+	struct bpf_lock_key key, *prev = NULL;
+	struct bpf_lock_stat stat;
+	int i, nr = 0, err = 0;
+
+	while (nr < bl->max_stats &&
+	       bpf_map_get_next_key(bl->stats_fd, prev, &key) == 0) {
+		bl->keys[nr] = key;
+		prev = &bl->keys[nr++];
+	}
+
+	for (i = 0; i < nr; i++) {
+		u64 ips[BPF_LOCK_MAX_STACK];
+		int nr_ips = 0;
+
+		/* a wait ending after the lookup counts in the next read */
+		if (bpf_map_lookup_elem(bl->stats_fd, &bl->keys[i], &stat))
+			continue;
+		bpf_map_delete_elem(bl->stats_fd, &bl->keys[i]);
+
+		if (bl->keys[i].stack_id >= 0 &&
+		    !bpf_map_lookup_elem(bl->stacks_fd, &bl->keys[i].stack_id, ips)) {
+			while (nr_ips < BPF_LOCK_MAX_STACK && ips[nr_ips])
+				nr_ips++;
+		}
+
+		if (!err)
+			err = cb(arg, bl->keys[i].lock, ips, nr_ips, &stat);
+	}
+
+	/* the same stacks get the same ids, keep them for the next waits */
+	return err;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_BPF_LOCK_H
+#define __PERF_BPF_LOCK_H
+
+#include <linux/compiler.h>
+#include <linux/err.h>
+#include <linux/types.h>
+
+struct bpf_lock;
+struct cpu_map;
+struct thread_map;
+
+/* Must match MAX_STACK in examples/bpf/lock_contention.c */
+#define BPF_LOCK_MAX_STACK	16
+
+#define BPF_LOCK_OBJ		"bpf/lock_contention.c"
+
+/* Must match struct contention_key and contention_stat in the BPF program */
+struct bpf_lock_key {
+	u64	lock;
+	s32	stack_id;
+	u32	pad;
+};
+
+struct bpf_lock_stat {
+	u64	count;
+	u64	total;
+	u64	max;
+	/* log2 histogram of the waits in nsecs */
+	u64	hist[32];
+};
+
+typedef int (*bpf_lock_cb_t)(void *arg, u64 lock, u64 *ips, int nr_ips,
+			     struct bpf_lock_stat *stat);
+
+/*
+ * Aggregates the lock contentions of 'perf lock contention --bpf' in the
+ * kernel: the BPF program in path, or examples/bpf/lock_contention.c when
+ * empty, runs at the lock:contention_begin and lock:contention_end
+ * tracepoints, opened on cpus and threads, and accrues the waits by lock
+ * and callchain in a map.
+ */
+#ifdef HAVE_LIBBPF_SUPPORT
+struct bpf_lock *bpf_lock__new(const char *path);
+void bpf_lock__delete(struct bpf_lock *bl);
+
+int bpf_lock__open(struct bpf_lock *bl, struct cpu_map *cpus,
+		   struct thread_map *threads);
+void bpf_lock__close(struct bpf_lock *bl);
+
+/* Pass what was accrued since the last read to cb, emptying the map */
+int bpf_lock__read(struct bpf_lock *bl, bpf_lock_cb_t cb, void *arg);
+#else
+#include <errno.h>
+#include "debug.h"
+
+static inline struct bpf_lock *bpf_lock__new(const char *path __maybe_unused)
+{
+	pr_err("BPF support is not compiled\n");
+	return ERR_PTR(-ENOTSUP);
+}
+
+static inline void bpf_lock__delete(struct bpf_lock *bl __maybe_unused) { }
+
+static inline int
+bpf_lock__open(struct bpf_lock *bl __maybe_unused,
+	       struct cpu_map *cpus __maybe_unused,
+	       struct thread_map *threads __maybe_unused)
+{
+	return -ENOTSUP;
+}
+
+static inline void bpf_lock__close(struct bpf_lock *bl __maybe_unused) { }
+
+static inline int
+bpf_lock__read(struct bpf_lock *bl __maybe_unused, bpf_lock_cb_t cb __maybe_unused,
+	       void *arg __maybe_unused)
+{
+	return -ENOTSUP;
+}
+#endif // HAVE_LIBBPF_SUPPORT
+#endif /* __PERF_BPF_LOCK_H */
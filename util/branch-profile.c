@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include "branch.h"
+#include "branch-profile.h"
+#include "debug.h"
+#include "dso.h"
+#include "event.h"
+#include "map.h"
+#include "symbol.h"
+#include "thread.h"
+#include "util.h"
+
+#define BRANCH_PROFILE_BITS	16
+
+/* In the order of the sections of the profile */
+enum branch_profile_kind {
+	BP_RANGE,
+	BP_ADDR,
+	BP_BRANCH,
+	BP_NR_KINDS,
+};
+
+/* A range, from-to, an address, from, or a branch, from->to, of a dso */
+struct bp_entry {
+	u64		from;
+	u64		to;
+	u64		count;		/* 0 for a free slot */
+	u64		mispred;
+	u32		dso;
+	u32		kind;
+};
+
+struct bp_dso {
+	struct dso	*dso;
+	/* a map of the dso, for its objdump addresses */
+	struct map	*map;
+	u64		nr[BP_NR_KINDS];
+};
+
+struct bp_block {
+	u64		start;
+	u64		end;
+	u64		count;
+};
+
+/*
+ * The counts are in a table with open addressing, one slot per distinct
+ * range, address or branch, so the 32 entries of a LBR stack are mostly
+ * increments of slots already there.
+ */
+struct branch_profile {
+	struct bp_entry		*table;
+	unsigned int		bits;
+	size_t			nr;
+	struct bp_dso		*dsos;
+	u32			nr_dsos;
+	/* the map of the last address resolved, most are in the same one */
+	struct map		*last_map;
+	struct map_groups	*last_mg;
+	u32			last_dso;
+};
+
+struct branch_profile *branch_profile__new(void)
+{
+	struct branch_profile *bp = zalloc(sizeof(*bp));
+
+	if (!bp)
+		return NULL;
+
+	bp->table = calloc(1 << BRANCH_PROFILE_BITS, sizeof(*bp->table));
+	if (!bp->table) {
+		free(bp);
+		return NULL;
+	}
+	bp->bits = BRANCH_PROFILE_BITS;
+	return bp;
+}
+
+void branch_profile__delete(struct branch_profile *bp)
+{
+	u32 i;
+
+	if (!bp)
+		return;
+
+	for (i = 0; i < bp->nr_dsos; i++)
+		map__put(bp->dsos[i].map);
+	map__put(bp->last_map);
+	free(bp->dsos);
+	free(bp->table);
+	free(bp);
+}
+
+static unsigned int bp_entry__hash(u32 dso, u32 kind, u64 from, u64 to,
+				   unsigned int bits)
+{
+	return hash_64(from ^ hash_64(to ^ ((u64)dso << 2 | kind), 64), bits);
+}
+
+/* Double the slots once half of them are in use */
+static int branch_profile__rehash(struct branch_profile *bp)
+{
+	unsigned int bits = bp->bits + 1;
+	size_t i, mask = (1UL << bits) - 1;
+	struct bp_entry *table;
+
+	table = calloc(1UL << bits, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < (1UL << bp->bits); i++) {
+		struct bp_entry *e = &bp->table[i];
+		size_t h;
+
+		if (!e->count)
+			continue;
+
+		h = bp_entry__hash(e->dso, e->kind, e->from, e->to, bits);
+		while (table[h].count)
+			h = (h + 1) & mask;
+		table[h] = *e;
+	}
+
+	free(bp->table);
+	bp->table = table;
+	bp->bits = bits;
+	return 0;
+}
+
+static int branch_profile__inc(struct branch_profile *bp, u32 dso, u32 kind,
+			       u64 from, u64 to, bool mispred)
+{
+	struct bp_entry *e;
+	size_t h, mask;
+
+	if (bp->nr >= (1UL << bp->bits) / 2 && branch_profile__rehash(bp))
+		return -ENOMEM;
+
+	mask = (1UL << bp->bits) - 1;
+	h = bp_entry__hash(dso, kind, from, to, bp->bits);
+	for (;; h = (h + 1) & mask) {
+		e = &bp->table[h];
+		if (!e->count) {
+			e->from = from;
+			e->to   = to;
+			e->dso  = dso;
+			e->kind = kind;
+			bp->dsos[dso].nr[kind]++;
+			bp->nr++;
+			break;
+		}
+		if (e->from == from && e->to == to &&
+		    e->dso == dso && e->kind == kind)
+			break;
+	}
+
+	e->count++;
+	e->mispred += mispred;
+	return 0;
+}
+
+static int branch_profile__findnew_dso(struct branch_profile *bp, struct map *map)
+{
+	struct bp_dso *dsos;
+	u32 i;
+
+	for (i = 0; i < bp->nr_dsos; i++) {
+		if (bp->dsos[i].dso == map->dso)
+			return i;
+	}
+
+	dsos = realloc(bp->dsos, (bp->nr_dsos + 1) * sizeof(*dsos));
+	if (!dsos)
+		return -ENOMEM;
+	bp->dsos = dsos;
+
+	memset(&dsos[i], 0, sizeof(dsos[i]));
+	dsos[i].dso = map->dso;
+	dsos[i].map = map__get(map);
+	return bp->nr_dsos++;
+}
+
+/* The dso of addr and its address in it, false if it isn't in any */
+static bool branch_profile__resolve(struct branch_profile *bp,
+				    struct thread *thread, u8 cpumode,
+				    u64 addr, u32 *dso, u64 *rip)
+{
+	struct map *map = bp->last_map;
+
+	if (!map || bp->last_mg != thread->mg ||
+	    addr < map->start || addr >= map->end) {
+		struct addr_location al;
+		int idx;
+
+		map = thread__find_map_fb(thread, cpumode, addr, &al);
+		if (!map || !map->dso)
+			return false;
+
+		idx = branch_profile__findnew_dso(bp, map);
+		if (idx < 0)
+			return false;
+
+		map__put(bp->last_map);
+		bp->last_map = map__get(map);
+		bp->last_mg  = thread->mg;
+		bp->last_dso = idx;
+	}
+
+	*dso = bp->last_dso;
+	*rip = map->map_ip(map, addr);
+	return true;
+}
+
+int branch_profile__add_sample(struct branch_profile *bp,
+			       struct perf_sample *sample,
+			       struct addr_location *al)
+{
+	struct branch_stack *bs = sample->branch_stack;
+	struct thread *thread = al->thread;
+	bool newer_from_ok = false;
+	u32 dso = 0, to_dso = 0, newer_dso = 0;
+	u64 i, from, to, newer_from = 0;
+	int err = 0;
+
+	if (!thread)
+		return 0;
+
+	if (branch_profile__resolve(bp, thread, sample->cpumode, sample->ip,
+				    &dso, &from))
+		err = branch_profile__inc(bp, dso, BP_ADDR, from, 0, false);
+
+	if (!bs)
+		return err;
+
+	/* The newest branch comes first, the code between two ran in between */
+	for (i = 0; i < bs->nr && !err; i++) {
+		struct branch_entry *be = &bs->entries[i];
+		bool from_ok, to_ok;
+
+		from_ok = branch_profile__resolve(bp, thread, sample->cpumode,
+						  be->from, &dso, &from);
+		to_ok = branch_profile__resolve(bp, thread, sample->cpumode,
+						be->to, &to_dso, &to);
+
+		/* the profiles are per dso, calls into others are left out */
+		if (from_ok && to_ok && dso == to_dso)
+			err = branch_profile__inc(bp, dso, BP_BRANCH, from, to,
+						  be->flags.mispred);
+
+		if (!err && to_ok && newer_from_ok && to_dso == newer_dso &&
+		    to <= newer_from)
+			err = branch_profile__inc(bp, to_dso, BP_RANGE, to,
+						  newer_from, false);
+
+		newer_from_ok = from_ok;
+		newer_dso = dso;
+		newer_from = from;
+	}
+
+	return err;
+}
+
+static int bp_entry__cmp(const void *a, const void *b)
+{
+	const struct bp_entry *ea = *(const struct bp_entry **)a;
+	const struct bp_entry *eb = *(const struct bp_entry **)b;
+
+	if (ea->dso != eb->dso)
+		return ea->dso < eb->dso ? -1 : 1;
+	if (ea->kind != eb->kind)
+		return ea->kind < eb->kind ? -1 : 1;
+	if (ea->from != eb->from)
+		return ea->from < eb->from ? -1 : 1;
+	if (ea->to != eb->to)
+		return ea->to < eb->to ? -1 : 1;
+	return 0;
+}
+
+static int bp_entry__cmp_to(const void *a, const void *b)
+{
+	const struct bp_entry *ea = *(const struct bp_entry **)a;
+	const struct bp_entry *eb = *(const struct bp_entry **)b;
+
+	if (ea->to != eb->to)
+		return ea->to < eb->to ? -1 : 1;
+	return 0;
+}
+
+static int bp_entry__cmp_count(const void *a, const void *b)
+{
+	const struct bp_entry *ea = *(const struct bp_entry **)a;
+	const struct bp_entry *eb = *(const struct bp_entry **)b;
+
+	if (ea->count != eb->count)
+		return ea->count > eb->count ? -1 : 1;
+	return 0;
+}
+
+static int bp_block__cmp_count(const void *a, const void *b)
+{
+	const struct bp_block *ba = a, *bb = b;
+
+	if (ba->count != bb->count)
+		return ba->count > bb->count ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Split the ranges, sorted by start, at each other's starts and ends: a
+ * block is then run as many times as the ranges covering it.
+ */
+static struct bp_block *bp_blocks__new(struct bp_entry **ranges, size_t nr,
+				       size_t *nr_blocks)
+{
+	struct bp_entry **ends = malloc(nr * sizeof(*ends) + 1);
+	struct bp_block *blocks = malloc(2 * nr * sizeof(*blocks) + 1);
+	size_t i = 0, j = 0, n = 0;
+	u64 count = 0, pos = 0;
+
+	if (!ends || !blocks) {
+		free(ends);
+		free(blocks);
+		return NULL;
+	}
+
+	memcpy(ends, ranges, nr * sizeof(*ends));
+	qsort(ends, nr, sizeof(*ends), bp_entry__cmp_to);
+
+	while (i < nr || j < nr) {
+		u64 point;
+
+		if (j == nr || (i < nr && ranges[i]->from <= ends[j]->to))
+			point = ranges[i]->from;
+		else
+			point = ends[j]->to + 1;
+
+		if (count && pos < point) {
+			blocks[n].start = pos;
+			blocks[n].end   = point - 1;
+			blocks[n].count = count;
+			n++;
+		}
+
+		while (j < nr && ends[j]->to + 1 == point)
+			count -= ends[j++]->count;
+		while (i < nr && ranges[i]->from == point)
+			count += ranges[i++]->count;
+
+		pos = point;
+	}
+
+	free(ends);
+	*nr_blocks = n;
+	return blocks;
+}
+
+static void bp_dso__fprintf_addr(struct bp_dso *d, u64 rip, FILE *fp)
+{
+	struct symbol *sym = dso__find_symbol(d->dso, rip);
+
+	fprintf(fp, "%#" PRIx64, map__rip_2objdump(d->map, rip));
+	if (sym)
+		fprintf(fp, " %s+%#" PRIx64, sym->name, rip - sym->start);
+}
+
+static void bp_dso__fprintf_top(struct bp_dso *d, struct bp_entry **ents,
+				int nr_top, FILE *fp)
+{
+	struct bp_entry **ranges = ents, **branches;
+	size_t nr_ranges = d->nr[BP_RANGE], nr_branches = d->nr[BP_BRANCH];
+	struct bp_block *blocks;
+	size_t i, nr_blocks;
+
+	blocks = bp_blocks__new(ranges, nr_ranges, &nr_blocks);
+	if (blocks) {
+		qsort(blocks, nr_blocks, sizeof(*blocks), bp_block__cmp_count);
+
+		fprintf(fp, "#\n# %12s  %s\n", "count", "block");
+		for (i = 0; i < nr_blocks && i < (size_t)nr_top; i++) {
+			fprintf(fp, "  %12" PRIu64 "  ", blocks[i].count);
+			bp_dso__fprintf_addr(d, blocks[i].start, fp);
+			fprintf(fp, " - %#" PRIx64 "\n",
+				map__rip_2objdump(d->map, blocks[i].end));
+		}
+		free(blocks);
+	}
+
+	branches = ents + nr_ranges + d->nr[BP_ADDR];
+	qsort(branches, nr_branches, sizeof(*branches), bp_entry__cmp_count);
+
+	fprintf(fp, "#\n# %12s  %7s  %s\n", "count", "mispred", "branch");
+	for (i = 0; i < nr_branches && i < (size_t)nr_top; i++) {
+		struct bp_entry *e = branches[i];
+
+		fprintf(fp, "  %12" PRIu64 "  %6.2f%%  ", e->count,
+			100.0 * e->mispred / e->count);
+		bp_dso__fprintf_addr(d, e->from, fp);
+		fprintf(fp, " -> ");
+		bp_dso__fprintf_addr(d, e->to, fp);
+		fputc('\n', fp);
+	}
+}
+
+static int bp_dso__write(struct branch_profile *bp, u32 idx,
+			 struct bp_entry **ents, const char *dir,
+			 FILE *fp, int nr_top)
+{
+	struct bp_dso *d = &bp->dsos[idx];
+	const char *name = d->dso->short_name;
+	char path[PATH_MAX];
+	struct bp_entry **e = ents;
+	bool dup = false;
+	FILE *out;
+	u32 i;
+	int k;
+
+	for (i = 0; i < idx; i++)
+		dup |= !strcmp(bp->dsos[i].dso->short_name, name);
+
+	if (dup)
+		scnprintf(path, sizeof(path), "%s/%s-%u.afdo", dir, name, idx);
+	else
+		scnprintf(path, sizeof(path), "%s/%s.afdo", dir, name);
+
+	out = fopen(path, "w");
+	if (!out) {
+		pr_err("Failed to create %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	for (k = 0; k < BP_NR_KINDS; k++) {
+		u64 n;
+
+		fprintf(out, "%" PRIu64 "\n", d->nr[k]);
+		for (n = 0; n < d->nr[k]; n++, e++) {
+			u64 from = map__rip_2objdump(d->map, (*e)->from);
+			u64 to = map__rip_2objdump(d->map, (*e)->to);
+
+			if (k == BP_RANGE)
+				fprintf(out, "%" PRIx64 "-%" PRIx64 ":%" PRIu64 "\n",
+					from, to, (*e)->count);
+			else if (k == BP_ADDR)
+				fprintf(out, "%" PRIx64 ":%" PRIu64 "\n",
+					from, (*e)->count);
+			else
+				fprintf(out, "%" PRIx64 "->%" PRIx64 ":%" PRIu64 "\n",
+					from, to, (*e)->count);
+		}
+	}
+
+	if (fclose(out)) {
+		pr_err("Failed to write %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	fprintf(fp, "# %s: %" PRIu64 " ranges, %" PRIu64 " addresses, %" PRIu64
+		" branches in %s\n", d->dso->long_name, d->nr[BP_RANGE],
+		d->nr[BP_ADDR], d->nr[BP_BRANCH], path);
+
+	if (nr_top > 0)
+		bp_dso__fprintf_top(d, ents, nr_top, fp);
+	fputc('\n', fp);
+	return 0;
+}
+
+int branch_profile__write(struct branch_profile *bp, const char *dir,
+			  FILE *fp, int nr_top)
+{
+	struct bp_entry **ents;
+	char path[PATH_MAX];
+	size_t i, n = 0;
+	int err = 0;
+	u32 d;
+
+	strlcpy(path, dir, sizeof(path));
+	if (mkdir_p(path, 0755)) {
+		pr_err("Failed to create %s: %s\n", dir, strerror(errno));
+		return -errno;
+	}
+
+	ents = malloc(bp->nr * sizeof(*ents) + 1);
+	if (!ents)
+		return -ENOMEM;
+
+	for (i = 0; i < (1UL << bp->bits); i++) {
+		if (bp->table[i].count)
+			ents[n++] = &bp->table[i];
+	}
+	qsort(ents, n, sizeof(*ents), bp_entry__cmp);
+
+	for (d = 0, i = 0; d < bp->nr_dsos && !err; d++) {
+		struct bp_dso *dso = &bp->dsos[d];
+
+		if (dso->nr[BP_RANGE] || dso->nr[BP_BRANCH])
+			err = bp_dso__write(bp, d, ents + i, dir, fp, nr_top);
+		i += dso->nr[BP_RANGE] + dso->nr[BP_ADDR] + dso->nr[BP_BRANCH];
+	}
+
+	free(ents);
+	return err;
+}
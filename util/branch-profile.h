@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_BRANCH_PROFILE_H
+#define __PERF_BRANCH_PROFILE_H
+
+#include <stdio.h>
+
+struct addr_location;
+struct branch_profile;
+struct perf_sample;
+
+/*
+ * Aggregates the branch stacks of the samples into the counts a PGO
+ * toolchain wants, per dso: the taken branches, from -> to, the ranges
+ * run between two branches of a stack, from the target of one to the
+ * source of the next, and the sampled addresses.
+ *
+ * They are written one file per dso in the AutoFDO text format, with
+ * the objdump addresses of the dso:
+ *
+ *   <number of ranges>
+ *   start-end:count
+ *   <number of addresses>
+ *   addr:count
+ *   <number of branches>
+ *   from->to:count
+ */
+struct branch_profile *branch_profile__new(void);
+void branch_profile__delete(struct branch_profile *bp);
+
+int branch_profile__add_sample(struct branch_profile *bp,
+			       struct perf_sample *sample,
+			       struct addr_location *al);
+
+/*
+ * Write the profiles in dir and a summary to fp: for each dso the basic
+ * blocks and the branches run the most, the blocks split out of the
+ * ranges so that each has a single count.
+ */
+int branch_profile__write(struct branch_profile *bp, const char *dir,
+			  FILE *fp, int nr_top);
+
+#endif /* __PERF_BRANCH_PROFILE_H */
@@ -10,6 +10,7 @@
 #include "util.h"
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -284,6 +285,38 @@ char *dso__build_id_filename(const struct dso *dso, char *bf, size_t size,
 	return bf;
 }
 
+/*
+ * Path of an additional file, like the symbol or srcline caches, in the
+ * build-id cache directory of dso.
+ */
+char *dso__build_id_cache_file(const struct dso *dso, const char *file,
+			       char *bf, size_t size)
+{
+	char sbuild_id[SBUILD_ID_SIZE];
+	char *linkname;
+	bool alloc = (bf == NULL);
+	int ret;
+
+	if (!dso->has_build_id)
+		return NULL;
+
+	build_id__sprintf(dso->build_id, sizeof(dso->build_id), sbuild_id);
+	linkname = build_id_cache__linkname(sbuild_id, NULL, 0);
+	if (!linkname)
+		return NULL;
+
+	/* The old style build-id cache has no directory to put it in */
+	if (is_regular_file(linkname))
+		ret = -1;
+	else
+		ret = asnprintf(&bf, size, "%s/%s", linkname, file);
+	if (ret < 0 || (!alloc && size < (unsigned int)ret))
+		bf = NULL;
+	free(linkname);
+
+	return bf;
+}
+
 #define dsos__for_each_with_build_id(pos, head)	\
 	list_for_each_entry(pos, head, node)	\
 		if (!pos->has_build_id)		\
@@ -638,6 +671,36 @@ out:
 	return realname;
 }
 
+/*
+ * Already cached from the same file: the link is there and the copy is
+ * the file itself, hardlinked, or is as big and at least as recent, so
+ * there is no need to look at the binary again.
+ */
+static bool build_id_cache__uptodate(const char *sbuild_id,
+				     const char *realname,
+				     const char *filename, struct nsinfo *nsi)
+{
+	struct stat st, cst;
+	struct nscookie nsc;
+	int err;
+
+	if (stat(filename, &cst) || !build_id_cache__cached(sbuild_id))
+		return false;
+
+	/* kallsyms, the copy goes with the kernel build-id */
+	if (realname == NULL)
+		return true;
+
+	nsinfo__mountns_enter(nsi, &nsc);
+	err = stat(realname, &st);
+	nsinfo__mountns_exit(&nsc);
+	if (err)
+		return false;
+
+	return (st.st_dev == cst.st_dev && st.st_ino == cst.st_ino) ||
+	       (st.st_size == cst.st_size && st.st_mtime <= cst.st_mtime);
+}
+
 int build_id_cache__add_s(const char *sbuild_id, const char *name,
 			  struct nsinfo *nsi, bool is_kallsyms, bool is_vdso)
 {
@@ -677,6 +740,13 @@ int build_id_cache__add_s(const char *sbuild_id, const char *name,
 		goto out_free;
 	}
 
+	if (build_id_cache__uptodate(sbuild_id, realname, filename,
+				     is_vdso ? NULL : nsi)) {
+		pr_debug4("%s is already cached for %s\n", sbuild_id, name);
+		err = 0;
+		goto out_free;
+	}
+
 	if (access(filename, F_OK)) {
 		if (is_kallsyms) {
 			if (copyfile("/proc/kallsyms", filename))
@@ -747,18 +817,6 @@ out_free:
 	return err;
 }
 
-static int build_id_cache__add_b(const u8 *build_id, size_t build_id_size,
-				 const char *name, struct nsinfo *nsi,
-				 bool is_kallsyms, bool is_vdso)
-{
-	char sbuild_id[SBUILD_ID_SIZE];
-
-	build_id__sprintf(build_id, build_id_size, sbuild_id);
-
-	return build_id_cache__add_s(sbuild_id, name, nsi, is_kallsyms,
-				     is_vdso);
-}
-
 bool build_id_cache__cached(const char *sbuild_id)
 {
 	bool ret = false;
@@ -809,41 +867,190 @@ out_free:
 	return err;
 }
 
-static int dso__cache_build_id(struct dso *dso, struct machine *machine)
+/* Workers populating the build-id cache, at most */
+#define BUILD_ID_CACHE_THREADS	8
+
+struct build_id_cache_job {
+	char		sbuild_id[SBUILD_ID_SIZE];
+	const char	*name;
+	struct nsinfo	*nsi;
+	bool		is_kallsyms;
+	bool		is_vdso;
+	int		err;
+};
+
+struct build_id_cache_jobs {
+	struct build_id_cache_job	*jobs;
+	unsigned int			nr;
+	unsigned int			alloc;
+};
+
+struct build_id_cache_worker {
+	struct build_id_cache_jobs	*jobs;
+	unsigned int			shard;
+	unsigned int			nr_shards;
+};
+
+static int build_id_cache_jobs__add(struct build_id_cache_jobs *jobs,
+				    struct dso *dso, struct machine *machine)
 {
-	bool is_kallsyms = dso__is_kallsyms(dso);
-	bool is_vdso = dso__is_vdso(dso);
-	const char *name = dso->long_name;
+	struct build_id_cache_job *job;
+
+	if (jobs->nr == jobs->alloc) {
+		unsigned int alloc = jobs->alloc ? jobs->alloc * 2 : 64;
+
+		job = realloc(jobs->jobs, alloc * sizeof(*job));
+		if (job == NULL)
+			return -ENOMEM;
+		jobs->jobs = job;
+		jobs->alloc = alloc;
+	}
+
+	job = &jobs->jobs[jobs->nr++];
+	build_id__sprintf(dso->build_id, sizeof(dso->build_id), job->sbuild_id);
+	job->name	 = dso->long_name;
+	job->nsi	 = dso->nsinfo;
+	job->is_kallsyms = dso__is_kallsyms(dso);
+	job->is_vdso	 = dso__is_vdso(dso);
+	job->err	 = 0;
 
 	if (dso__is_kcore(dso)) {
-		is_kallsyms = true;
-		name = machine->mmap_name;
+		job->is_kallsyms = true;
+		job->name = machine->mmap_name;
 	}
-	return build_id_cache__add_b(dso->build_id, sizeof(dso->build_id), name,
-				     dso->nsinfo, is_kallsyms, is_vdso);
+	return 0;
 }
 
-static int __dsos__cache_build_ids(struct list_head *head,
-				   struct machine *machine)
+static int machine__add_build_id_cache_jobs(struct machine *machine,
+					    struct build_id_cache_jobs *jobs)
 {
 	struct dso *pos;
-	int err = 0;
 
-	dsos__for_each_with_build_id(pos, head)
-		if (dso__cache_build_id(pos, machine))
-			err = -1;
+	dsos__for_each_with_build_id(pos, &machine->dsos.head) {
+		if (build_id_cache_jobs__add(jobs, pos, machine))
+			return -ENOMEM;
+	}
+	return 0;
+}
 
-	return err;
+static int build_id_cache_job__cmp(const void *a, const void *b)
+{
+	const struct build_id_cache_job *ja = a, *jb = b;
+
+	return strcmp(ja->sbuild_id, jb->sbuild_id);
+}
+
+/* The same binary is often mapped by several machines or under several names */
+static void build_id_cache_jobs__dedup(struct build_id_cache_jobs *jobs)
+{
+	unsigned int i, nr = 0;
+
+	qsort(jobs->jobs, jobs->nr, sizeof(*jobs->jobs), build_id_cache_job__cmp);
+
+	for (i = 0; i < jobs->nr; i++) {
+		if (nr && !strcmp(jobs->jobs[nr - 1].sbuild_id,
+				  jobs->jobs[i].sbuild_id))
+			continue;
+		jobs->jobs[nr++] = jobs->jobs[i];
+	}
+	jobs->nr = nr;
+}
+
+static void build_id_cache_job__run(struct build_id_cache_job *job)
+{
+	job->err = build_id_cache__add_s(job->sbuild_id, job->name, job->nsi,
+					 job->is_kallsyms, job->is_vdso);
+}
+
+/* setns() can't switch the mount namespace of a multithreaded process */
+static bool build_id_cache_job__serial(struct build_id_cache_job *job)
+{
+	return job->nsi && job->nsi->need_setns;
+}
+
+static void *build_id_cache_worker__run(void *arg)
+{
+	struct build_id_cache_worker *worker = arg;
+	struct build_id_cache_jobs *jobs = worker->jobs;
+	unsigned int i;
+
+	for (i = worker->shard; i < jobs->nr; i += worker->nr_shards) {
+		if (!build_id_cache_job__serial(&jobs->jobs[i]))
+			build_id_cache_job__run(&jobs->jobs[i]);
+	}
+
+	return NULL;
 }
 
-static int machine__cache_build_ids(struct machine *machine)
+static void build_id_cache_jobs__run(struct build_id_cache_jobs *jobs)
 {
-	return __dsos__cache_build_ids(&machine->dsos.head, machine);
+	struct build_id_cache_worker *workers;
+	pthread_t *threads;
+	unsigned int i, nr_threads, started = 0;
+	bool singlethreaded = perf_singlethreaded;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (i = 0; i < jobs->nr; i++) {
+		if (build_id_cache_job__serial(&jobs->jobs[i]))
+			build_id_cache_job__run(&jobs->jobs[i]);
+	}
+
+	nr_threads = min_t(unsigned int, nr_cpus > 0 ? nr_cpus : 1,
+			   BUILD_ID_CACHE_THREADS);
+	nr_threads = min(nr_threads, jobs->nr);
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (nr_threads < 2 || workers == NULL || threads == NULL) {
+		struct build_id_cache_worker worker = {
+			.jobs	   = jobs,
+			.nr_shards = 1,
+		};
+
+		build_id_cache_worker__run(&worker);
+		goto out_free;
+	}
+
+	perf_set_multithreaded();
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].jobs = jobs;
+		workers[i].shard = i;
+		workers[i].nr_shards = nr_threads;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, build_id_cache_worker__run,
+				   &workers[i])) {
+			/* the shards without a thread are done below */
+			break;
+		}
+		started = i;
+	}
+
+	build_id_cache_worker__run(&workers[0]);
+	for (i = started + 1; i < nr_threads; i++)
+		build_id_cache_worker__run(&workers[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (singlethreaded)
+		perf_set_singlethreaded();
+out_free:
+	free(workers);
+	free(threads);
 }
 
+/*
+ * The binaries are copied on a pool of threads, once per build-id, the
+ * ones already cached from the same file are only stat'ed.
+ */
 int perf_session__cache_build_ids(struct perf_session *session)
 {
+	struct build_id_cache_jobs jobs = { .jobs = NULL, };
 	struct rb_node *nd;
+	unsigned int i;
 	int ret;
 
 	if (no_buildid_cache)
@@ -852,13 +1059,25 @@ int perf_session__cache_build_ids(struct perf_session *session)
 	if (mkdir(buildid_dir, 0755) != 0 && errno != EEXIST)
 		return -1;
 
-	ret = machine__cache_build_ids(&session->machines.host);
+	ret = machine__add_build_id_cache_jobs(&session->machines.host, &jobs);
 
-	for (nd = rb_first_cached(&session->machines.guests); nd;
+	for (nd = rb_first_cached(&session->machines.guests); nd && !ret;
 	     nd = rb_next(nd)) {
 		struct machine *pos = rb_entry(nd, struct machine, rb_node);
-		ret |= machine__cache_build_ids(pos);
+		ret = machine__add_build_id_cache_jobs(pos, &jobs);
+	}
+
+	if (!ret) {
+		build_id_cache_jobs__dedup(&jobs);
+		build_id_cache_jobs__run(&jobs);
 	}
+
+	for (i = 0; i < jobs.nr; i++) {
+		if (jobs.jobs[i].err)
+			ret = -1;
+	}
+
+	free(jobs.jobs);
 	return ret ? -1 : 0;
 }
 
@@ -13,12 +13,14 @@
  *
  */
 
-#include <linux/rbtree.h>
+#include <linux/hash.h>
 #include <linux/list.h>
 
 #include "util.h"
 #include "call-path.h"
 
+#define CALL_PATH_HASH_BITS 10
+
 static void call_path__init(struct call_path *cp, struct call_path *parent,
 			    struct symbol *sym, u64 ip, bool in_kernel)
 {
@@ -26,9 +28,8 @@ static void call_path__init(struct call_path *cp, struct call_path *parent,
 	cp->sym = sym;
 	cp->ip = sym ? 0 : ip;
 	cp->db_id = 0;
+	cp->next = NULL;
 	cp->in_kernel = in_kernel;
-	RB_CLEAR_NODE(&cp->rb_node);
-	cp->children = RB_ROOT;
 }
 
 struct call_path_root *call_path_root__new(void)
@@ -38,6 +39,12 @@ struct call_path_root *call_path_root__new(void)
 	cpr = zalloc(sizeof(struct call_path_root));
 	if (!cpr)
 		return NULL;
+	cpr->hash = calloc(1 << CALL_PATH_HASH_BITS, sizeof(*cpr->hash));
+	if (!cpr->hash) {
+		free(cpr);
+		return NULL;
+	}
+	cpr->hash_bits = CALL_PATH_HASH_BITS;
 	call_path__init(&cpr->call_path, NULL, NULL, 0, false);
 	INIT_LIST_HEAD(&cpr->blocks);
 	return cpr;
@@ -51,6 +58,7 @@ void call_path_root__free(struct call_path_root *cpr)
 		list_del(&pos->node);
 		free(pos);
 	}
+	free(cpr->hash);
 	free(cpr);
 }
 
@@ -82,14 +90,47 @@ static struct call_path *call_path__new(struct call_path_root *cpr,
 	return cp;
 }
 
+static unsigned int call_path__hash(struct call_path *parent,
+				    struct symbol *sym, u64 ip,
+				    unsigned int bits)
+{
+	return hash_64((u64)(unsigned long)parent ^
+		       hash_64((u64)(unsigned long)sym ^ ip, 64), bits);
+}
+
+/* Double the buckets once there are more call paths than buckets */
+static void call_path_root__rehash(struct call_path_root *cpr)
+{
+	unsigned int bits = cpr->hash_bits + 1, i;
+	struct call_path **hash, *cp, *next;
+
+	hash = calloc(1 << bits, sizeof(*hash));
+	if (!hash)
+		return;
+
+	for (i = 0; i < (1U << cpr->hash_bits); i++) {
+		for (cp = cpr->hash[i]; cp; cp = next) {
+			unsigned int h = call_path__hash(cp->parent, cp->sym,
+							 cp->ip, bits);
+
+			next = cp->next;
+			cp->next = hash[h];
+			hash[h] = cp;
+		}
+	}
+
+	free(cpr->hash);
+	cpr->hash = hash;
+	cpr->hash_bits = bits;
+}
+
 struct call_path *call_path__findnew(struct call_path_root *cpr,
 				     struct call_path *parent,
 				     struct symbol *sym, u64 ip, u64 ks)
 {
-	struct rb_node **p;
-	struct rb_node *node_parent = NULL;
 	struct call_path *cp;
 	bool in_kernel = ip >= ks;
+	unsigned int h;
 
 	if (sym)
 		ip = 0;
@@ -97,26 +138,21 @@ struct call_path *call_path__findnew(struct call_path_root *cpr,
 	if (!parent)
 		return call_path__new(cpr, parent, sym, ip, in_kernel);
 
-	p = &parent->children.rb_node;
-	while (*p != NULL) {
-		node_parent = *p;
-		cp = rb_entry(node_parent, struct call_path, rb_node);
-
-		if (cp->sym == sym && cp->ip == ip)
+	h = call_path__hash(parent, sym, ip, cpr->hash_bits);
+	for (cp = cpr->hash[h]; cp; cp = cp->next) {
+		if (cp->parent == parent && cp->sym == sym && cp->ip == ip)
 			return cp;
-
-		if (sym < cp->sym || (sym == cp->sym && ip < cp->ip))
-			p = &(*p)->rb_left;
-		else
-			p = &(*p)->rb_right;
 	}
 
 	cp = call_path__new(cpr, parent, sym, ip, in_kernel);
 	if (!cp)
 		return NULL;
 
-	rb_link_node(&cp->rb_node, node_parent, p);
-	rb_insert_color(&cp->rb_node, &parent->children);
+	cp->next = cpr->hash[h];
+	cpr->hash[h] = cp;
+
+	if (cpr->next > (1U << cpr->hash_bits))
+		call_path_root__rehash(cpr);
 
 	return cp;
 }
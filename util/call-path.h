@@ -19,7 +19,7 @@
 #include <sys/types.h>
 
 #include <linux/types.h>
-#include <linux/rbtree.h>
+#include <linux/list.h>
 
 /**
  * struct call_path - node in list of calls leading to a function call.
@@ -27,9 +27,8 @@
  * @sym: symbol of function called
  * @ip: only if sym is null, the ip of the function
  * @db_id: id used for db-export
+ * @next: next call path in the same call_path_root hash bucket
  * @in_kernel: whether function is a in the kernel
- * @rb_node: node in parent's tree of called functions
- * @children: tree of call paths of functions called
  *
  * In combination with the call_return structure, the call_path structure
  * defines a context-sensitve call-graph.
@@ -39,9 +38,8 @@ struct call_path {
 	struct symbol *sym;
 	u64 ip;
 	u64 db_id;
+	struct call_path *next;
 	bool in_kernel;
-	struct rb_node rb_node;
-	struct rb_root children;
 };
 
 #define CALL_PATH_BLOCK_SHIFT 8
@@ -59,12 +57,16 @@ struct call_path_block {
  * @blocks: list of blocks to store call paths
  * @next: next free space
  * @sz: number of spaces
+ * @hash: call paths by parent, symbol and ip, so each is only stored once
+ * @hash_bits: log2 of the number of hash buckets
  */
 struct call_path_root {
 	struct call_path call_path;
 	struct list_head blocks;
 	size_t next;
 	size_t sz;
+	struct call_path **hash;
+	unsigned int hash_bits;
 };
 
 struct call_path_root *call_path_root__new(void);
@@ -27,6 +27,7 @@
 #include "callchain.h"
 #include "branch.h"
 #include "symbol.h"
+#include "stage-time.h"
 
 #define CALLCHAIN_PARAM_DEFAULT			\
 	.mode		= CHAIN_GRAPH_ABS,	\
@@ -513,6 +514,53 @@ int callchain_register_param(struct callchain_param *param)
 	return 0;
 }
 
+static struct callchain_node *callchain_node__zalloc(struct callchain_alloc *alloc)
+{
+	struct callchain_node *node;
+
+	node = alloc ? slab__zalloc(&alloc->nodes) : zalloc(sizeof(*node));
+	if (node)
+		node->alloc = alloc;
+	return node;
+}
+
+static void callchain_node__free(struct callchain_node *node)
+{
+	if (node->alloc)
+		slab__free(&node->alloc->nodes, node);
+	else
+		free(node);
+}
+
+static struct callchain_list *callchain_list__zalloc(struct callchain_node *node)
+{
+	if (node->alloc)
+		return slab__zalloc(&node->alloc->lists);
+	return zalloc(sizeof(struct callchain_list));
+}
+
+static void callchain_list__free(struct callchain_node *node,
+				 struct callchain_list *list)
+{
+	free(list->branch);
+	if (node->alloc)
+		slab__free(&node->alloc->lists, list);
+	else
+		free(list);
+}
+
+void callchain_alloc__init(struct callchain_alloc *alloc)
+{
+	slab__init(&alloc->nodes, sizeof(struct callchain_node), MEM_STAT__CALLCHAINS);
+	slab__init(&alloc->lists, sizeof(struct callchain_list), MEM_STAT__CALLCHAINS);
+}
+
+void callchain_alloc__exit(struct callchain_alloc *alloc)
+{
+	slab__exit(&alloc->nodes);
+	slab__exit(&alloc->lists);
+}
+
 /*
  * Create a child for a parent. If inherit_children, then the new child
  * will become the new parent of it's parent children
@@ -522,7 +570,7 @@ create_child(struct callchain_node *parent, bool inherit_children)
 {
 	struct callchain_node *new;
 
-	new = zalloc(sizeof(*new));
+	new = callchain_node__zalloc(parent->alloc);
 	if (!new) {
 		perror("not enough memory to create child for code path tree");
 		return NULL;
@@ -554,6 +602,52 @@ create_child(struct callchain_node *parent, bool inherit_children)
 }
 
 
+/*
+ * Account a branch of the cursor node to the callchain entry it matched,
+ * without memory for the counts the entry just doesn't get them.
+ */
+static void callchain_list__add_branch(struct callchain_list *call,
+				      struct callchain_cursor_node *node)
+{
+	struct callchain_branch *branch = call->branch;
+
+	if (branch == NULL) {
+		branch = call->branch = zalloc(sizeof(*branch));
+		if (branch == NULL)
+			return;
+	}
+
+	branch->branch_count++;
+
+	if (node->branch_from) {
+		/*
+		 * branch_from is set with value somewhere else
+		 * to imply it's "to" of a branch.
+		 */
+		branch->brtype_stat.branch_to = true;
+
+		if (node->branch_flags.predicted)
+			branch->predicted_count++;
+
+		if (node->branch_flags.abort)
+			branch->abort_count++;
+
+		branch_type_count(&branch->brtype_stat,
+				  &node->branch_flags,
+				  node->branch_from,
+				  node->ip);
+	} else {
+		/*
+		 * It's "from" of a branch
+		 */
+		branch->brtype_stat.branch_to = false;
+		branch->cycles_count += node->branch_flags.cycles;
+		branch->iter_count += node->nr_loop_iter;
+		branch->iter_cycles += node->iter_cycles;
+		branch->from_count++;
+	}
+}
+
 /*
  * Fill the node with callchain values
  */
@@ -571,7 +665,7 @@ fill_node(struct callchain_node *node, struct callchain_cursor *cursor)
 	while (cursor_node) {
 		struct callchain_list *call;
 
-		call = zalloc(sizeof(*call));
+		call = callchain_list__zalloc(node);
 		if (!call) {
 			perror("not enough memory for the code path tree");
 			return -1;
@@ -581,37 +675,8 @@ fill_node(struct callchain_node *node, struct callchain_cursor *cursor)
 		call->ms.map = map__get(cursor_node->map);
 		call->srcline = cursor_node->srcline;
 
-		if (cursor_node->branch) {
-			call->branch_count = 1;
-
-			if (cursor_node->branch_from) {
-				/*
-				 * branch_from is set with value somewhere else
-				 * to imply it's "to" of a branch.
-				 */
-				call->brtype_stat.branch_to = true;
-
-				if (cursor_node->branch_flags.predicted)
-					call->predicted_count = 1;
-
-				if (cursor_node->branch_flags.abort)
-					call->abort_count = 1;
-
-				branch_type_count(&call->brtype_stat,
-						  &cursor_node->branch_flags,
-						  cursor_node->branch_from,
-						  cursor_node->ip);
-			} else {
-				/*
-				 * It's "from" of a branch
-				 */
-				call->brtype_stat.branch_to = false;
-				call->cycles_count =
-					cursor_node->branch_flags.cycles;
-				call->iter_count = cursor_node->nr_loop_iter;
-				call->iter_cycles = cursor_node->iter_cycles;
-			}
-		}
+		if (cursor_node->branch)
+			callchain_list__add_branch(call, cursor_node);
 
 		list_add_tail(&call->list, &node->val);
 
@@ -638,9 +703,9 @@ add_child(struct callchain_node *parent,
 		list_for_each_entry_safe(call, tmp, &new->val, list) {
 			list_del(&call->list);
 			map__zput(call->ms.map);
-			free(call);
+			callchain_list__free(new, call);
 		}
-		free(new);
+		callchain_node__free(new);
 		return NULL;
 	}
 
@@ -693,8 +758,17 @@ static enum match_result match_chain_dso_addresses(struct map *left_map, u64 lef
 	struct dso *left_dso = left_map ? left_map->dso : NULL;
 	struct dso *right_dso = right_map ? right_map->dso : NULL;
 
-	if (left_dso != right_dso)
-		return left_dso < right_dso ? MATCH_LT : MATCH_GT;
+	if (left_dso != right_dso) {
+		if (symbol_conf.dso_by_build_id && left_dso && right_dso &&
+		    (left_dso->has_build_id || right_dso->has_build_id)) {
+			int cmp = dso__cmp_build_id(left_dso, right_dso);
+
+			if (cmp)
+				return cmp < 0 ? MATCH_LT : MATCH_GT;
+		} else {
+			return left_dso < right_dso ? MATCH_LT : MATCH_GT;
+		}
+	}
 
 	if (left_ip != right_ip)
  		return left_ip < right_ip ? MATCH_LT : MATCH_GT;
@@ -741,36 +815,8 @@ static enum match_result match_chain(struct callchain_cursor_node *node,
 		break;
 	}
 
-	if (match == MATCH_EQ && node->branch) {
-		cnode->branch_count++;
-
-		if (node->branch_from) {
-			/*
-			 * It's "to" of a branch
-			 */
-			cnode->brtype_stat.branch_to = true;
-
-			if (node->branch_flags.predicted)
-				cnode->predicted_count++;
-
-			if (node->branch_flags.abort)
-				cnode->abort_count++;
-
-			branch_type_count(&cnode->brtype_stat,
-					  &node->branch_flags,
-					  node->branch_from,
-					  node->ip);
-		} else {
-			/*
-			 * It's "from" of a branch
-			 */
-			cnode->brtype_stat.branch_to = false;
-			cnode->cycles_count += node->branch_flags.cycles;
-			cnode->iter_count += node->nr_loop_iter;
-			cnode->iter_cycles += node->iter_cycles;
-			cnode->from_count++;
-		}
-	}
+	if (match == MATCH_EQ && node->branch)
+		callchain_list__add_branch(cnode, node);
 
 	return match;
 }
@@ -1004,7 +1050,7 @@ merge_chain_branch(struct callchain_cursor *cursor,
 					false, NULL, 0, 0, 0, list->srcline);
 		list_del(&list->list);
 		map__zput(list->ms.map);
-		free(list);
+		callchain_list__free(src, list);
 	}
 
 	if (src->hit) {
@@ -1023,7 +1069,7 @@ merge_chain_branch(struct callchain_cursor *cursor,
 		if (err)
 			break;
 
-		free(child);
+		callchain_node__free(child);
 	}
 
 	cursor->nr = old_pos;
@@ -1038,6 +1084,71 @@ int callchain_merge(struct callchain_cursor *cursor,
 	return merge_chain_branch(cursor, &dst->node, &src->node);
 }
 
+/*
+ * Append to root the paths of the samples thru node and below it, after
+ * the frames already in cursor, leaving node as it is.
+ */
+int callchain_append_subtree(struct callchain_root *root,
+			     struct callchain_cursor *cursor,
+			     struct callchain_node *node)
+{
+	struct callchain_cursor_node **old_last = cursor->last;
+	struct callchain_node *child;
+	struct callchain_list *list;
+	struct rb_node *n;
+	u64 old_pos = cursor->nr;
+	int err = 0;
+
+	if (node->hit && callchain_append(root, cursor, node->hit) < 0)
+		return -1;
+
+	for (n = rb_first(&node->rb_root_in); n && !err; n = rb_next(n)) {
+		child = rb_entry(n, struct callchain_node, rb_node_in);
+
+		list_for_each_entry(list, &child->val, list) {
+			err = callchain_cursor_append(cursor, list->ip,
+						      list->ms.map, list->ms.sym,
+						      false, NULL, 0, 0, 0,
+						      list->srcline);
+			if (err)
+				break;
+		}
+
+		if (!err)
+			err = callchain_append_subtree(root, cursor, child);
+
+		cursor->nr = old_pos;
+		cursor->last = old_last;
+	}
+
+	return err;
+}
+
+/*
+ * Move the nodes of src to dst and leave src empty, the nodes stay where
+ * they were allocated.
+ */
+void callchain_move(struct callchain_root *dst, struct callchain_root *src)
+{
+	struct rb_node *n;
+
+	*dst = *src;
+	INIT_LIST_HEAD(&dst->node.val);
+	INIT_LIST_HEAD(&dst->node.parent_val);
+	list_splice_init(&src->node.val, &dst->node.val);
+	list_splice_init(&src->node.parent_val, &dst->node.parent_val);
+
+	for (n = rb_first(&dst->node.rb_root_in); n; n = rb_next(n))
+		rb_entry(n, struct callchain_node, rb_node_in)->parent = &dst->node;
+
+	callchain_init(src);
+	src->node.alloc = dst->node.alloc;
+	src->node.rb_root = RB_ROOT;
+	src->node.val_nr = 0;
+	src->node.count = 0;
+	src->node.children_count = 0;
+}
+
 int callchain_cursor_append(struct callchain_cursor *cursor,
 			    u64 ip, struct map *map, struct symbol *sym,
 			    bool branch, struct branch_flags *flags,
@@ -1075,10 +1186,11 @@ int callchain_cursor_append(struct callchain_cursor *cursor,
 	return 0;
 }
 
-int sample__resolve_callchain(struct perf_sample *sample,
-			      struct callchain_cursor *cursor, struct symbol **parent,
-			      struct perf_evsel *evsel, struct addr_location *al,
-			      int max_stack)
+static int __sample__resolve_callchain(struct perf_sample *sample,
+				       struct callchain_cursor *cursor,
+				       struct symbol **parent,
+				       struct perf_evsel *evsel,
+				       struct addr_location *al, int max_stack)
 {
 	if (sample->callchain == NULL && !symbol_conf.show_branchflag_count)
 		return 0;
@@ -1091,6 +1203,19 @@ int sample__resolve_callchain(struct perf_sample *sample,
 	return 0;
 }
 
+int sample__resolve_callchain(struct perf_sample *sample,
+			      struct callchain_cursor *cursor, struct symbol **parent,
+			      struct perf_evsel *evsel, struct addr_location *al,
+			      int max_stack)
+{
+	u64 start = stage_time__start();
+	int err = __sample__resolve_callchain(sample, cursor, parent, evsel,
+					      al, max_stack);
+
+	stage_time__end(STAGE_TIME__CALLCHAIN, start);
+	return err;
+}
+
 int hist_entry__append_callchain(struct hist_entry *he, struct perf_sample *sample)
 {
 	if ((!symbol_conf.use_callchain || sample->callchain == NULL) &&
@@ -1230,17 +1355,22 @@ static void callchain_counts_value(struct callchain_node *node,
 	struct callchain_list *clist;
 
 	list_for_each_entry(clist, &node->val, list) {
+		struct callchain_branch *branch = clist->branch;
+
+		if (branch == NULL)
+			continue;
+
 		if (branch_count)
-			*branch_count += clist->branch_count;
+			*branch_count += branch->branch_count;
 
 		if (predicted_count)
-			*predicted_count += clist->predicted_count;
+			*predicted_count += branch->predicted_count;
 
 		if (abort_count)
-			*abort_count += clist->abort_count;
+			*abort_count += branch->abort_count;
 
 		if (cycles_count)
-			*cycles_count += clist->cycles_count;
+			*cycles_count += branch->cycles_count;
 	}
 }
 
@@ -1427,23 +1557,17 @@ static int callchain_counts_printf(FILE *fp, char *bf, int bfsize,
 int callchain_list_counts__printf_value(struct callchain_list *clist,
 					FILE *fp, char *bf, int bfsize)
 {
-	u64 branch_count, predicted_count;
-	u64 abort_count, cycles_count;
-	u64 iter_count, iter_cycles;
-	u64 from_count;
-
-	branch_count = clist->branch_count;
-	predicted_count = clist->predicted_count;
-	abort_count = clist->abort_count;
-	cycles_count = clist->cycles_count;
-	iter_count = clist->iter_count;
-	iter_cycles = clist->iter_cycles;
-	from_count = clist->from_count;
-
-	return callchain_counts_printf(fp, bf, bfsize, branch_count,
-				       predicted_count, abort_count,
-				       cycles_count, iter_count, iter_cycles,
-				       from_count, &clist->brtype_stat);
+	struct callchain_branch none = { .branch_count = 0, };
+	struct callchain_branch *branch = clist->branch ?: &none;
+
+	return callchain_counts_printf(fp, bf, bfsize, branch->branch_count,
+				       branch->predicted_count,
+				       branch->abort_count,
+				       branch->cycles_count,
+				       branch->iter_count,
+				       branch->iter_cycles,
+				       branch->from_count,
+				       &branch->brtype_stat);
 }
 
 static void free_callchain_node(struct callchain_node *node)
@@ -1455,13 +1579,13 @@ static void free_callchain_node(struct callchain_node *node)
 	list_for_each_entry_safe(list, tmp, &node->parent_val, list) {
 		list_del(&list->list);
 		map__zput(list->ms.map);
-		free(list);
+		callchain_list__free(node, list);
 	}
 
 	list_for_each_entry_safe(list, tmp, &node->val, list) {
 		list_del(&list->list);
 		map__zput(list->ms.map);
-		free(list);
+		callchain_list__free(node, list);
 	}
 
 	n = rb_first(&node->rb_root_in);
@@ -1471,7 +1595,7 @@ static void free_callchain_node(struct callchain_node *node)
 		rb_erase(&child->rb_node_in, &node->rb_root_in);
 
 		free_callchain_node(child);
-		free(child);
+		callchain_node__free(child);
 	}
 }
 
@@ -1483,32 +1607,35 @@ void free_callchain(struct callchain_root *root)
 	free_callchain_node(&root->node);
 }
 
-static u64 decay_callchain_node(struct callchain_node *node)
+static u64 decay_callchain_node(struct callchain_node *node, unsigned int nr)
 {
 	struct callchain_node *child;
 	struct rb_node *n;
 	u64 child_hits = 0;
+	unsigned int i;
 
 	n = rb_first(&node->rb_root_in);
 	while (n) {
 		child = container_of(n, struct callchain_node, rb_node_in);
 
-		child_hits += decay_callchain_node(child);
+		child_hits += decay_callchain_node(child, nr);
 		n = rb_next(n);
 	}
 
-	node->hit = (node->hit * 7) / 8;
+	for (i = 0; i < nr && node->hit; i++)
+		node->hit = (node->hit * 7) / 8;
 	node->children_hit = child_hits;
 
 	return node->hit;
 }
 
-void decay_callchain(struct callchain_root *root)
+/* Decay the hits of all nodes nr times, in one walk of the tree */
+void decay_callchain(struct callchain_root *root, unsigned int nr)
 {
-	if (!symbol_conf.use_callchain)
+	if (!symbol_conf.use_callchain || nr == 0)
 		return;
 
-	decay_callchain_node(&root->node);
+	decay_callchain_node(&root->node, nr);
 }
 
 int callchain_node__make_parent_list(struct callchain_node *node)
@@ -1519,11 +1646,13 @@ int callchain_node__make_parent_list(struct callchain_node *node)
 
 	while (parent) {
 		list_for_each_entry_reverse(chain, &parent->val, list) {
-			new = malloc(sizeof(*new));
+			new = callchain_list__zalloc(node);
 			if (new == NULL)
 				goto out;
 			*new = *chain;
 			new->has_children = false;
+			/* the parent keeps the branch counts */
+			new->branch = NULL;
 			map__get(new->ms.map);
 			list_add_tail(&new->list, &head);
 		}
@@ -1546,7 +1675,7 @@ out:
 	list_for_each_entry_safe(chain, new, &head, list) {
 		list_del(&chain->list);
 		map__zput(chain->ms.map);
-		free(chain);
+		callchain_list__free(node, chain);
 	}
 	return -ENOMEM;
 }
@@ -7,6 +7,7 @@
 #include "event.h"
 #include "map_symbol.h"
 #include "branch.h"
+#include "slab.h"
 
 struct map;
 
@@ -52,8 +53,18 @@ enum chain_order {
 	ORDER_CALLEE
 };
 
+/*
+ * Where the nodes and the callchain lists of a callchain tree come
+ * from, all the nodes of a tree share it, NULL means malloc.
+ */
+struct callchain_alloc {
+	struct slab		nodes;
+	struct slab		lists;
+};
+
 struct callchain_node {
 	struct callchain_node	*parent;
+	struct callchain_alloc	*alloc;
 	struct list_head	val;
 	struct list_head	parent_val;
 	struct rb_node		rb_node_in; /* to insert nodes in an rbtree */
@@ -110,13 +121,11 @@ struct callchain_param {
 extern struct callchain_param callchain_param;
 extern struct callchain_param callchain_param_default;
 
-struct callchain_list {
-	u64			ip;
-	struct map_symbol	ms;
-	struct /* for TUI */ {
-		bool		unfolded;
-		bool		has_children;
-	};
+/*
+ * The branch counts of a callchain entry, only the callchains built from
+ * branch stacks have them, so they're kept out of the list entries.
+ */
+struct callchain_branch {
 	u64			branch_count;
 	u64			from_count;
 	u64			predicted_count;
@@ -125,6 +134,17 @@ struct callchain_list {
 	u64			iter_count;
 	u64			iter_cycles;
 	struct branch_type_stat brtype_stat;
+};
+
+struct callchain_list {
+	u64			ip;
+	struct map_symbol	ms;
+	struct /* for TUI */ {
+		bool		unfolded;
+		bool		has_children;
+	};
+	/* NULL until a branch hits this entry */
+	struct callchain_branch	*branch;
 	const char		*srcline;
 	struct list_head	list;
 };
@@ -164,6 +184,7 @@ static inline void callchain_init(struct callchain_root *root)
 	INIT_LIST_HEAD(&root->node.parent_val);
 
 	root->node.parent = NULL;
+	root->node.alloc = NULL;
 	root->node.hit = 0;
 	root->node.children_hit = 0;
 	root->node.rb_root_in = RB_ROOT;
@@ -187,6 +208,10 @@ int callchain_append(struct callchain_root *root,
 
 int callchain_merge(struct callchain_cursor *cursor,
 		    struct callchain_root *dst, struct callchain_root *src);
+int callchain_append_subtree(struct callchain_root *root,
+			     struct callchain_cursor *cursor,
+			     struct callchain_node *node);
+void callchain_move(struct callchain_root *dst, struct callchain_root *src);
 
 void callchain_cursor_reset(struct callchain_cursor *cursor);
 
@@ -279,7 +304,9 @@ int callchain_list_counts__printf_value(struct callchain_list *clist,
 					FILE *fp, char *bf, int bfsize);
 
 void free_callchain(struct callchain_root *root);
-void decay_callchain(struct callchain_root *root);
+void callchain_alloc__init(struct callchain_alloc *alloc);
+void callchain_alloc__exit(struct callchain_alloc *alloc);
+void decay_callchain(struct callchain_root *root, unsigned int nr);
 int callchain_node__make_parent_list(struct callchain_node *node);
 
 int callchain_branch_counts(struct callchain_root *root,
@@ -5,15 +5,18 @@
 #include "evsel.h"
 #include "cgroup.h"
 #include "evlist.h"
+#include "env.h"
+#include "strbuf.h"
+#include "thread_map.h"
 #include <linux/stringify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 
 int nr_cgroups;
 
-static int
-cgroupfs_find_mountpoint(char *buf, size_t maxlen)
+int cgroupfs_find_mountpoint(char *buf, size_t maxlen)
 {
 	FILE *fp;
 	char mountpoint[PATH_MAX + 1], tokens[PATH_MAX + 1], type[PATH_MAX + 1];
@@ -90,6 +93,87 @@ static int open_cgroup(const char *name)
 	return fd;
 }
 
+/*
+ * The name of the cgroup of pid in the hierarchy cgroupfs_find_mountpoint()
+ * picks: the cgroup v1 one with the perf_event controller, else the v2 one.
+ */
+int cgroup__pid_name(pid_t pid, char *buf, size_t maxlen)
+{
+	char path[PATH_MAX], *line = NULL, *ctrl, *name, *token, *saved_ptr;
+	char name_v1[PATH_MAX] = "", name_v2[PATH_MAX] = "";
+	size_t len = 0;
+	FILE *fp;
+
+	scnprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	/* the lines are hierarchy-id:controllers:name */
+	while (getline(&line, &len, fp) > 0) {
+		ctrl = strchr(line, ':');
+		name = ctrl ? strchr(ctrl + 1, ':') : NULL;
+		if (!name)
+			continue;
+		*ctrl++ = '\0';
+		*name++ = '\0';
+		name[strcspn(name, "\n")] = '\0';
+
+		if (!strcmp(line, "0") && !*ctrl) {
+			strlcpy(name_v2, name, sizeof(name_v2));
+			continue;
+		}
+
+		for (token = strtok_r(ctrl, ",", &saved_ptr); token;
+		     token = strtok_r(NULL, ",", &saved_ptr)) {
+			if (!strcmp(token, "perf_event"))
+				strlcpy(name_v1, name, sizeof(name_v1));
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	name = name_v1[0] ? name_v1 : name_v2;
+	if (!name[0] || strlen(name) >= maxlen)
+		return -1;
+
+	strcpy(buf, name);
+	return 0;
+}
+
+/* The threads of the processes in a cgroup, e.g. to synthesize them */
+struct thread_map *cgroup__thread_map(const char *name)
+{
+	char path[PATH_MAX + 1], mnt[PATH_MAX + 1];
+	struct thread_map *threads = NULL;
+	struct strbuf pids = STRBUF_INIT;
+	char *line = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if (cgroupfs_find_mountpoint(mnt, PATH_MAX + 1))
+		return NULL;
+
+	scnprintf(path, PATH_MAX, "%s/%s/cgroup.procs", mnt, name);
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	while (getline(&line, &len, fp) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strbuf_addf(&pids, "%s%s", pids.len ? "," : "", line) < 0)
+			goto out;
+	}
+
+	if (pids.len)
+		threads = thread_map__new_str(pids.buf, NULL, UINT_MAX, true);
+out:
+	strbuf_release(&pids);
+	free(line);
+	fclose(fp);
+	return threads;
+}
+
 static struct cgroup *evlist__find_cgroup(struct perf_evlist *evlist, const char *str)
 {
 	struct perf_evsel *counter;
@@ -165,7 +249,8 @@ found:
 
 static void cgroup__delete(struct cgroup *cgroup)
 {
-	close(cgroup->fd);
+	if (cgroup->fd >= 0)
+		close(cgroup->fd);
 	zfree(&cgroup->name);
 	free(cgroup);
 }
@@ -249,3 +334,90 @@ int parse_cgroups(const struct option *opt, const char *str,
 	}
 	return 0;
 }
+
+/*
+ * The cgroups in the PERF_RECORD_CGROUP events, by the id the samples
+ * have, only for their names.
+ */
+struct cgroup *cgroup__findnew(struct perf_env *env, u64 id, const char *path)
+{
+	struct rb_node **p, *parent = NULL;
+	struct cgroup *cgrp;
+
+	down_write(&env->cgroups.lock);
+	p = &env->cgroups.tree.rb_node;
+	while (*p != NULL) {
+		parent = *p;
+		cgrp = rb_entry(parent, struct cgroup, node);
+
+		if (cgrp->id == id)
+			goto out;
+
+		if (cgrp->id < id)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	cgrp = zalloc(sizeof(*cgrp));
+	if (cgrp == NULL)
+		goto out;
+
+	cgrp->name = strdup(path);
+	if (cgrp->name == NULL) {
+		zfree(&cgrp);
+		goto out;
+	}
+
+	cgrp->fd = -1;
+	cgrp->id = id;
+	refcount_set(&cgrp->refcnt, 1);
+
+	rb_link_node(&cgrp->node, parent, p);
+	rb_insert_color(&cgrp->node, &env->cgroups.tree);
+out:
+	up_write(&env->cgroups.lock);
+	return cgrp;
+}
+
+struct cgroup *cgroup__find(struct perf_env *env, u64 id)
+{
+	struct rb_node *n;
+	struct cgroup *cgrp = NULL;
+
+	down_read(&env->cgroups.lock);
+	n = env->cgroups.tree.rb_node;
+	while (n != NULL) {
+		struct cgroup *pos = rb_entry(n, struct cgroup, node);
+
+		if (pos->id == id) {
+			cgrp = pos;
+			break;
+		}
+
+		if (pos->id < id)
+			n = n->rb_left;
+		else
+			n = n->rb_right;
+	}
+	up_read(&env->cgroups.lock);
+
+	return cgrp;
+}
+
+void perf_env__purge_cgroups(struct perf_env *env)
+{
+	struct rb_node *node;
+
+	down_write(&env->cgroups.lock);
+	while (!RB_EMPTY_ROOT(&env->cgroups.tree)) {
+		struct cgroup *cgrp;
+
+		node = rb_first(&env->cgroups.tree);
+		cgrp = rb_entry(node, struct cgroup, node);
+
+		rb_erase(node, &env->cgroups.tree);
+		cgroup__put(cgrp);
+	}
+	up_write(&env->cgroups.lock);
+}
@@ -3,10 +3,15 @@
 #define __CGROUP_H__
 
 #include <linux/refcount.h>
+#include <linux/rbtree.h>
+#include <linux/types.h>
+#include <sys/types.h>
 
 struct option;
 
 struct cgroup {
+	struct rb_node node;
+	u64 id;
 	char *name;
 	int fd;
 	refcount_t refcnt;
@@ -26,4 +31,18 @@ void evlist__set_default_cgroup(struct perf_evlist *evlist, struct cgroup *cgrou
 
 int parse_cgroups(const struct option *opt, const char *str, int unset);
 
+int cgroupfs_find_mountpoint(char *buf, size_t maxlen);
+int cgroup__pid_name(pid_t pid, char *buf, size_t maxlen);
+
+struct thread_map;
+
+struct thread_map *cgroup__thread_map(const char *name);
+
+struct perf_env;
+
+struct cgroup *cgroup__findnew(struct perf_env *env, u64 id, const char *path);
+struct cgroup *cgroup__find(struct perf_env *env, u64 id);
+
+void perf_env__purge_cgroups(struct perf_env *env);
+
 #endif /* __CGROUP_H__ */
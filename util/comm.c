@@ -5,104 +5,84 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <linux/refcount.h>
-#include <linux/rbtree.h>
-#include "rwsem.h"
-
+#include <linux/compiler.h>
+#include <linux/hash.h>
+
+/*
+ * The comm strings are interned in a hash that is never shrunk: an
+ * interned string lives, and keeps its id, until the tool exits. That way
+ * nothing is refcounted and the lookups don't take any lock, new strings
+ * are pushed on the head of their bucket with a compare and swap.
+ */
 struct comm_str {
-	char *str;
-	struct rb_node rb_node;
-	refcount_t refcnt;
+	struct comm_str *next;
+	u32 id;
+	char str[];
 };
 
-/* Should perhaps be moved to struct machine */
-static struct rb_root comm_str_root;
-static struct rw_semaphore comm_str_lock = {.lock = PTHREAD_RWLOCK_INITIALIZER,};
+#define COMM_STR_HASH_BITS	12
 
-static struct comm_str *comm_str__get(struct comm_str *cs)
-{
-	if (cs && refcount_inc_not_zero(&cs->refcnt))
-		return cs;
+static struct comm_str *comm_str_hash[1 << COMM_STR_HASH_BITS];
+static u32 comm_str__nr;
 
-	return NULL;
-}
-
-static void comm_str__put(struct comm_str *cs)
+static struct comm_str **comm_str__head(const char *str)
 {
-	if (cs && refcount_dec_and_test(&cs->refcnt)) {
-		down_write(&comm_str_lock);
-		rb_erase(&cs->rb_node, &comm_str_root);
-		up_write(&comm_str_lock);
-		zfree(&cs->str);
-		free(cs);
-	}
-}
+	u32 hash = 2166136261U;
+	const char *s;
 
-static struct comm_str *comm_str__alloc(const char *str)
-{
-	struct comm_str *cs;
+	/* FNV-1a */
+	for (s = str; *s; s++)
+		hash = (hash ^ (u8)*s) * 16777619;
 
-	cs = zalloc(sizeof(*cs));
-	if (!cs)
-		return NULL;
-
-	cs->str = strdup(str);
-	if (!cs->str) {
-		free(cs);
-		return NULL;
-	}
-
-	refcount_set(&cs->refcnt, 1);
-
-	return cs;
+	return &comm_str_hash[hash_32(hash, COMM_STR_HASH_BITS)];
 }
 
-static
-struct comm_str *__comm_str__findnew(const char *str, struct rb_root *root)
+static struct comm_str *comm_str__find(struct comm_str *cs, const char *str)
 {
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
-	struct comm_str *iter, *new;
-	int cmp;
-
-	while (*p != NULL) {
-		parent = *p;
-		iter = rb_entry(parent, struct comm_str, rb_node);
-
-		/*
-		 * If we race with comm_str__put, iter->refcnt is 0
-		 * and it will be removed within comm_str__put call
-		 * shortly, ignore it in this search.
-		 */
-		cmp = strcmp(str, iter->str);
-		if (!cmp && comm_str__get(iter))
-			return iter;
-
-		if (cmp < 0)
-			p = &(*p)->rb_left;
-		else
-			p = &(*p)->rb_right;
+	for (; cs != NULL; cs = cs->next) {
+		if (!strcmp(cs->str, str))
+			return cs;
 	}
 
-	new = comm_str__alloc(str);
-	if (!new)
-		return NULL;
-
-	rb_link_node(&new->rb_node, parent, p);
-	rb_insert_color(&new->rb_node, root);
-
-	return new;
+	return NULL;
 }
 
-static struct comm_str *comm_str__findnew(const char *str, struct rb_root *root)
+static struct comm_str *comm_str__findnew(const char *str)
 {
-	struct comm_str *cs;
+	struct comm_str **head = comm_str__head(str);
+	struct comm_str *first = READ_ONCE(*head), *cs;
+	size_t len;
 
-	down_write(&comm_str_lock);
-	cs = __comm_str__findnew(str, root);
-	up_write(&comm_str_lock);
+	cs = comm_str__find(first, str);
+	if (cs)
+		return cs;
+
+	len = strlen(str) + 1;
+	cs = malloc(sizeof(*cs) + len);
+	if (!cs)
+		return NULL;
 
-	return cs;
+	memcpy(cs->str, str, len);
+	cs->id = __sync_add_and_fetch(&comm_str__nr, 1);
+
+	for (;;) {
+		struct comm_str *found, *iter;
+
+		cs->next = first;
+		/* the full barrier publishes the string along with the entry */
+		found = __sync_val_compare_and_swap(head, first, cs);
+		if (found == first)
+			return cs;
+
+		/* raced with another insertion, look at what is new in the bucket */
+		for (iter = found; iter != first; iter = iter->next) {
+			if (!strcmp(iter->str, str)) {
+				free(cs);
+				return iter;
+			}
+		}
+		first = found;
+	}
 }
 
 struct comm *comm__new(const char *str, u64 timestamp, bool exec)
@@ -115,7 +95,7 @@ struct comm *comm__new(const char *str, u64 timestamp, bool exec)
 	comm->start = timestamp;
 	comm->exec = exec;
 
-	comm->comm_str = comm_str__findnew(str, &comm_str_root);
+	comm->comm_str = comm_str__findnew(str);
 	if (!comm->comm_str) {
 		free(comm);
 		return NULL;
@@ -126,13 +106,11 @@ struct comm *comm__new(const char *str, u64 timestamp, bool exec)
 
 int comm__override(struct comm *comm, const char *str, u64 timestamp, bool exec)
 {
-	struct comm_str *new, *old = comm->comm_str;
+	struct comm_str *new = comm_str__findnew(str);
 
-	new = comm_str__findnew(str, &comm_str_root);
 	if (!new)
 		return -ENOMEM;
 
-	comm_str__put(old);
 	comm->comm_str = new;
 	comm->start = timestamp;
 	if (exec)
@@ -143,7 +121,6 @@ int comm__override(struct comm *comm, const char *str, u64 timestamp, bool exec)
 
 void comm__free(struct comm *comm)
 {
-	comm_str__put(comm->comm_str);
 	free(comm);
 }
 
@@ -151,3 +128,20 @@ const char *comm__str(const struct comm *comm)
 {
 	return comm->comm_str->str;
 }
+
+/*
+ * Two comms have the same id if and only if they have the same string, ids
+ * are handed out in the order the strings are first seen, from 1.
+ */
+u32 comm__id(const struct comm *comm)
+{
+	return comm->comm_str->id;
+}
+
+/* The id the comms of str have, interning it, 0 if it can't be */
+u32 comm__str_id(const char *str)
+{
+	struct comm_str *cs = comm_str__findnew(str);
+
+	return cs ? cs->id : 0;
+}
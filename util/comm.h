@@ -22,6 +22,8 @@ struct comm {
 void comm__free(struct comm *comm);
 struct comm *comm__new(const char *str, u64 timestamp, bool exec);
 const char *comm__str(const struct comm *comm);
+u32 comm__id(const struct comm *comm);
+u32 comm__str_id(const char *str);
 int comm__override(struct comm *comm, const char *str, u64 timestamp,
 		   bool exec);
 
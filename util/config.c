@@ -18,6 +18,9 @@
 #include "util/event.h"  /* proc_map_timeout */
 #include "util/hist.h"  /* perf_hist_config */
 #include "util/llvm-utils.h"   /* perf_llvm_config */
+#include "util/dso.h"  /* dso__data_cache_budget */
+#include "util/kallsyms-cache.h"  /* kallsyms_cache__enabled */
+#include "util/tp-format-cache.h" /* tp_format_cache__enabled */
 #include "config.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -423,6 +426,14 @@ static int perf_default_core_config(const char *var __maybe_unused,
 {
 	if (!strcmp(var, "core.proc-map-timeout"))
 		proc_map_timeout = strtoul(value, NULL, 10);
+	else if (!strcmp(var, "core.dso-cache-size"))
+		return perf_config_u64(&dso__data_cache_budget, var, value);
+	else if (!strcmp(var, "core.kallsyms-cache"))
+		kallsyms_cache__enabled = perf_config_bool(var, value);
+	else if (!strcmp(var, "core.tracefs-format-cache"))
+		tp_format_cache__enabled = perf_config_bool(var, value);
+	else if (!strcmp(var, "core.share-dsos"))
+		symbol_conf.share_dsos = perf_config_bool(var, value);
 
 	/* Add other config variables here. */
 	return 0;
@@ -5,9 +5,13 @@
 #include "cpumap.h"
 #include <assert.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <linux/bitmap.h>
+#include <linux/kernel.h>
 #include "asm/bug.h"
 
 #include "sane_ctype.h"
@@ -740,3 +744,103 @@ const struct cpu_map *cpu_map__online(void) /* thread unsafe */
 
 	return online;
 }
+
+/* Below this many cpus the threads cost more than they save */
+#define CPU_MAP_PARALLEL_MIN	32
+#define CPU_MAP_PARALLEL_SHARE	8
+
+struct cpu_map_parallel {
+	struct cpu_map	*cpus;
+	int		(*fn)(int idx, void *arg);
+	void		*arg;
+	int		start;
+	int		end;
+	/* lowest index failed, or INT_MAX */
+	int		*failed;
+	pthread_t	thread;
+};
+
+/* Keep the lowest index failed, for the error to be the same every time */
+static void cpu_map_parallel__fail(int *failed, int idx)
+{
+	int old = *failed;
+
+	while (idx < old && !__sync_bool_compare_and_swap(failed, old, idx))
+		old = *failed;
+}
+
+static void *cpu_map__parallel_worker(void *arg)
+{
+	struct cpu_map_parallel *w = arg;
+	cpu_set_t mask;
+	bool pin = false;
+	int idx;
+
+	CPU_ZERO(&mask);
+	for (idx = w->start; idx < w->end; idx++) {
+		int cpu = w->cpus->map[idx];
+
+		if (cpu >= 0 && cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &mask);
+			pin = true;
+		}
+	}
+	if (pin)
+		sched_setaffinity(0, sizeof(mask), &mask);
+
+	for (idx = w->start; idx < w->end; idx++) {
+		if (w->fn(idx, w->arg)) {
+			cpu_map_parallel__fail(w->failed, idx);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+int cpu_map__parallel(struct cpu_map *cpus, int start,
+		      int (*fn)(int idx, void *arg), void *arg)
+{
+	struct cpu_map_parallel *workers = NULL;
+	int nr = cpus->nr - start, nr_workers = 0, started = 0;
+	int failed = INT_MAX, idx, i;
+
+	if (cpus->nr >= CPU_MAP_PARALLEL_MIN) {
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_workers > DIV_ROUND_UP(nr, CPU_MAP_PARALLEL_SHARE))
+			nr_workers = DIV_ROUND_UP(nr, CPU_MAP_PARALLEL_SHARE);
+	}
+
+	if (nr_workers > 1)
+		workers = calloc(nr_workers, sizeof(*workers));
+
+	for (i = 0; workers && i < nr_workers; i++) {
+		struct cpu_map_parallel *w = &workers[started];
+
+		w->cpus   = cpus;
+		w->fn     = fn;
+		w->arg    = arg;
+		w->start  = start + (long)nr * i / nr_workers;
+		w->end    = start + (long)nr * (i + 1) / nr_workers;
+		w->failed = &failed;
+
+		if (pthread_create(&w->thread, NULL, cpu_map__parallel_worker, w))
+			break;
+		started++;
+	}
+
+	/* the cpus the threads didn't get are done here */
+	idx = started ? workers[started - 1].end : start;
+	for (; idx < cpus->nr; idx++) {
+		if (fn(idx, arg)) {
+			cpu_map_parallel__fail(&failed, idx);
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+
+	return failed == INT_MAX ? -1 : failed;
+}
@@ -75,4 +75,15 @@ int cpu_map__build_map(struct cpu_map *cpus, struct cpu_map **res,
 int cpu_map__cpu(struct cpu_map *cpus, int idx);
 bool cpu_map__has(struct cpu_map *cpus, int cpu);
 int cpu_map__idx(struct cpu_map *cpus, int cpu);
+
+/*
+ * Call fn for each cpu index from start on. With enough cpus they are
+ * shared out to worker threads, each bound to the cpus of its share so that
+ * what fn has the kernel allocate is local to them.
+ *
+ * Returns -1, or the lowest index fn failed on: fn may have been called for
+ * any other index too.
+ */
+int cpu_map__parallel(struct cpu_map *cpus, int start,
+		      int (*fn)(int idx, void *arg), void *arg);
 #endif /* __PERF_CPUMAP_H */
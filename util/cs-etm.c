@@ -13,10 +13,12 @@
 #include <linux/types.h>
 
 #include <opencsd/ocsd_if_types.h>
+#include <pthread.h>
 #include <stdlib.h>
 
 #include "auxtrace.h"
 #include "color.h"
+#include "config.h"
 #include "cs-etm.h"
 #include "cs-etm-decoder/cs-etm-decoder.h"
 #include "debug.h"
@@ -33,6 +35,10 @@
 
 #define MAX_TIMESTAMP (~0ULL)
 
+/* Samples a worker buffers per queue before waiting for them to be delivered */
+#define CS_ETM_SYNTH_CHUNK_SZ	(1 << 20)
+#define CS_ETM_SYNTH_MAX_CHUNKS	16
+
 struct cs_etm_auxtrace {
 	struct auxtrace auxtrace;
 	struct auxtrace_queues queues;
@@ -58,6 +64,20 @@ struct cs_etm_auxtrace {
 	u64 **metadata;
 	u64 kernel_start;
 	unsigned int pmu_type;
+	unsigned int nr_decode_threads;
+};
+
+struct cs_etm_synth_chunk {
+	struct list_head node;
+	size_t size;
+	char data[CS_ETM_SYNTH_CHUNK_SZ];
+};
+
+/* A synthesized event followed by the branch stack of its sample */
+struct cs_etm_synth_item {
+	u32 size;
+	struct perf_sample sample;
+	u64 data[];
 };
 
 struct cs_etm_queue {
@@ -78,8 +98,27 @@ struct cs_etm_queue {
 	struct cs_etm_packet *packet;
 	const unsigned char *buf;
 	size_t buf_len, buf_used;
+	/* What was synthesized on a worker, see cs_etm__decode_queues() */
+	struct list_head synth_chunks;
+	struct cs_etm_synth_chunk *synth_chunk;
+	unsigned int nr_synth_chunks;
+	bool synth_done;
 };
 
+/* The queues decoded together, the workers take them in turn */
+struct cs_etm_decode {
+	struct cs_etm_queue **queues;
+	unsigned int nr_queues;
+	unsigned int next;
+};
+
+static pthread_mutex_t cs_etm_synth_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cs_etm_synth_produced = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cs_etm_synth_consumed = PTHREAD_COND_INITIALIZER;
+
+/* The queue being decoded on this worker thread, if any */
+static __thread struct cs_etm_queue *cs_etm_synth_current;
+
 static int cs_etm__update_queues(struct cs_etm_auxtrace *etm);
 static int cs_etm__process_timeless_queues(struct cs_etm_auxtrace *etm,
 					   pid_t tid);
@@ -418,6 +457,8 @@ static struct cs_etm_queue *cs_etm__alloc_queue(struct cs_etm_auxtrace *etm)
 	if (!etmq)
 		return NULL;
 
+	INIT_LIST_HEAD(&etmq->synth_chunks);
+
 	etmq->packet = zalloc(szp);
 	if (!etmq->packet)
 		goto out_free;
@@ -726,6 +767,86 @@ cs_etm__get_trace(struct cs_etm_queue *etmq)
 	return etmq->buf_len;
 }
 
+/*
+ * Hand the chunk being filled to the main thread, waiting for it to deliver
+ * some if too many are pending.
+ */
+static void cs_etm__synth_publish(struct cs_etm_queue *etmq, bool done)
+{
+	pthread_mutex_lock(&cs_etm_synth_lock);
+
+	if (etmq->synth_chunk) {
+		list_add_tail(&etmq->synth_chunk->node, &etmq->synth_chunks);
+		etmq->nr_synth_chunks++;
+		etmq->synth_chunk = NULL;
+	}
+	if (done)
+		etmq->synth_done = true;
+	pthread_cond_broadcast(&cs_etm_synth_produced);
+
+	while (!done && etmq->nr_synth_chunks >= CS_ETM_SYNTH_MAX_CHUNKS)
+		pthread_cond_wait(&cs_etm_synth_consumed, &cs_etm_synth_lock);
+
+	pthread_mutex_unlock(&cs_etm_synth_lock);
+}
+
+static int cs_etm__synth_buffer(struct cs_etm_queue *etmq,
+				union perf_event *event,
+				struct perf_sample *sample)
+{
+	size_t event_sz = PERF_ALIGN(event->header.size, sizeof(u64));
+	struct cs_etm_synth_chunk *chunk = etmq->synth_chunk;
+	struct cs_etm_synth_item *item;
+	size_t bs_sz = 0, size;
+
+	if (sample->branch_stack)
+		bs_sz = sizeof(u64) + sample->branch_stack->nr *
+				      sizeof(struct branch_entry);
+
+	size = sizeof(*item) + event_sz + bs_sz;
+	if (size > CS_ETM_SYNTH_CHUNK_SZ)
+		return -E2BIG;
+
+	if (chunk && chunk->size + size > CS_ETM_SYNTH_CHUNK_SZ) {
+		cs_etm__synth_publish(etmq, false);
+		chunk = NULL;
+	}
+
+	if (!chunk) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			return -ENOMEM;
+		chunk->size = 0;
+		etmq->synth_chunk = chunk;
+	}
+
+	item = (void *)chunk->data + chunk->size;
+	item->size = size;
+	item->sample = *sample;
+	memcpy(item->data, event, event->header.size);
+	if (bs_sz)
+		memcpy((void *)item->data + event_sz, sample->branch_stack,
+		       bs_sz);
+	chunk->size += size;
+
+	return 0;
+}
+
+/*
+ * Deliver the event, or buffer it if its queue is decoded on a worker, for
+ * the main thread to deliver it in order.
+ */
+static int cs_etm__deliver_synth_event(struct cs_etm_auxtrace *etm,
+				       union perf_event *event,
+				       struct perf_sample *sample)
+{
+	if (cs_etm_synth_current)
+		return cs_etm__synth_buffer(cs_etm_synth_current, event,
+					    sample);
+
+	return perf_session__deliver_synth_event(etm->session, event, sample);
+}
+
 static void cs_etm__set_pid_tid_cpu(struct cs_etm_auxtrace *etm,
 				    struct auxtrace_queue *queue)
 {
@@ -781,7 +902,7 @@ static int cs_etm__synth_instruction_sample(struct cs_etm_queue *etmq,
 			return ret;
 	}
 
-	ret = perf_session__deliver_synth_event(etm->session, event, &sample);
+	ret = cs_etm__deliver_synth_event(etm, event, &sample);
 
 	if (ret)
 		pr_err(
@@ -848,7 +969,7 @@ static int cs_etm__synth_branch_sample(struct cs_etm_queue *etmq)
 			return ret;
 	}
 
-	ret = perf_session__deliver_synth_event(etm->session, event, &sample);
+	ret = cs_etm__deliver_synth_event(etm, event, &sample);
 
 	if (ret)
 		pr_err(
@@ -1644,11 +1765,130 @@ static int cs_etm__run_decoder(struct cs_etm_queue *etmq)
 	return err;
 }
 
+static void *cs_etm__decode_worker(void *arg)
+{
+	struct cs_etm_decode *d = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&d->next, 1)) < d->nr_queues) {
+		struct cs_etm_queue *etmq = d->queues[i];
+
+		cs_etm_synth_current = etmq;
+		cs_etm__run_decoder(etmq);
+		cs_etm_synth_current = NULL;
+		cs_etm__synth_publish(etmq, true);
+	}
+
+	return NULL;
+}
+
+/* Deliver what a worker synthesized for etmq, as it comes */
+static void cs_etm__deliver_queue(struct cs_etm_auxtrace *etm,
+				  struct cs_etm_queue *etmq)
+{
+	struct cs_etm_synth_chunk *chunk;
+	struct cs_etm_synth_item *item;
+	size_t pos;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&cs_etm_synth_lock);
+		while (list_empty(&etmq->synth_chunks) && !etmq->synth_done)
+			pthread_cond_wait(&cs_etm_synth_produced,
+					  &cs_etm_synth_lock);
+		chunk = list_first_entry_or_null(&etmq->synth_chunks,
+						 struct cs_etm_synth_chunk,
+						 node);
+		if (chunk) {
+			list_del(&chunk->node);
+			etmq->nr_synth_chunks--;
+			pthread_cond_broadcast(&cs_etm_synth_consumed);
+		} else {
+			etmq->synth_done = false;
+		}
+		pthread_mutex_unlock(&cs_etm_synth_lock);
+
+		if (!chunk)
+			return;
+
+		for (pos = 0; pos < chunk->size; pos += item->size) {
+			union perf_event *event;
+
+			item = (void *)chunk->data + pos;
+			event = (union perf_event *)item->data;
+			if (item->sample.branch_stack)
+				item->sample.branch_stack = (void *)item->data +
+					PERF_ALIGN(event->header.size,
+						   sizeof(u64));
+
+			ret = perf_session__deliver_synth_event(etm->session,
+								event,
+								&item->sample);
+			if (ret)
+				pr_err("CS ETM Trace: failed to deliver instruction event, error %d\n",
+				       ret);
+		}
+		free(chunk);
+	}
+}
+
+/*
+ * Decode the queues on nr_decode_threads workers, which buffer what they
+ * synthesize, while this thread delivers it queue after queue, as decoding
+ * them one after the other would.
+ */
+static void cs_etm__decode_queues(struct cs_etm_auxtrace *etm,
+				  struct cs_etm_queue **queues,
+				  unsigned int nr_queues)
+{
+	struct cs_etm_decode d = {
+		.queues = queues,
+		.nr_queues = nr_queues,
+	};
+	unsigned int i, started = 0;
+	unsigned int nr_threads = min(etm->nr_decode_threads, nr_queues);
+	bool singlethreaded = perf_singlethreaded;
+	pthread_t *threads;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (threads) {
+		perf_set_multithreaded();
+		for (i = 0; i < nr_threads; i++) {
+			if (pthread_create(&threads[i], NULL,
+					   cs_etm__decode_worker, &d))
+				break;
+			started++;
+		}
+	}
+
+	if (!started) {
+		pr_debug("CS ETM Trace: no decoding threads, decoding serially\n");
+		for (i = 0; i < nr_queues; i++)
+			cs_etm__run_decoder(queues[i]);
+		goto out_free;
+	}
+
+	for (i = 0; i < nr_queues; i++)
+		cs_etm__deliver_queue(etm, queues[i]);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+out_free:
+	if (threads && singlethreaded)
+		perf_set_singlethreaded();
+	free(threads);
+}
+
 static int cs_etm__process_timeless_queues(struct cs_etm_auxtrace *etm,
 					   pid_t tid)
 {
-	unsigned int i;
+	unsigned int i, nr = 0;
 	struct auxtrace_queues *queues = &etm->queues;
+	struct cs_etm_queue **decode = NULL;
+
+	if (etm->nr_decode_threads > 1)
+		decode = calloc(queues->nr_queues, sizeof(*decode));
 
 	for (i = 0; i < queues->nr_queues; i++) {
 		struct auxtrace_queue *queue = &etm->queues.queue_array[i];
@@ -1656,10 +1896,17 @@ static int cs_etm__process_timeless_queues(struct cs_etm_auxtrace *etm,
 
 		if (etmq && ((tid == -1) || (etmq->tid == tid))) {
 			cs_etm__set_pid_tid_cpu(etm, queue);
-			cs_etm__run_decoder(etmq);
+			if (decode)
+				decode[nr++] = etmq;
+			else
+				cs_etm__run_decoder(etmq);
 		}
 	}
 
+	if (nr)
+		cs_etm__decode_queues(etm, decode, nr);
+	free(decode);
+
 	return 0;
 }
 
@@ -1805,6 +2052,20 @@ static void cs_etm__print_auxtrace_info(u64 *val, int num)
 	}
 }
 
+static int cs_etm__perf_config(const char *var, const char *value, void *data)
+{
+	struct cs_etm_auxtrace *etm = data;
+
+	if (!strcmp(var, "cs-etm.decode-threads")) {
+		long val = strtol(value, NULL, 0);
+
+		if (val > 0 && val <= INT_MAX)
+			etm->nr_decode_threads = val;
+	}
+
+	return 0;
+}
+
 int cs_etm__process_auxtrace_info(union perf_event *event,
 				  struct perf_session *session)
 {
@@ -1953,6 +2214,7 @@ int cs_etm__process_auxtrace_info(union perf_event *event,
 	etm->num_cpu = num_cpu;
 	etm->pmu_type = pmu_type;
 	etm->snapshot_mode = (hdr[CS_ETM_SNAPSHOT] != 0);
+	etm->queues.snapshot_mode = etm->snapshot_mode;
 	etm->metadata = metadata;
 	etm->auxtrace_type = auxtrace_info->type;
 	etm->timeless_decoding = cs_etm__is_timeless_decoding(etm);
@@ -2004,6 +2266,8 @@ int cs_etm__process_auxtrace_info(union perf_event *event,
 
 	etm->data_queued = etm->queues.populated;
 
+	perf_config(cs_etm__perf_config, etm);
+
 	return 0;
 
 err_delete_thread:
@@ -9,8 +9,10 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <linux/compiler.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
 #include <babeltrace/ctf-writer/writer.h>
 #include <babeltrace/ctf-writer/clock.h>
 #include <babeltrace/ctf-writer/stream.h>
@@ -80,9 +82,45 @@ struct ctf_writer {
 	struct bt_ctf_event_class	*mmap2_class;
 };
 
+struct convert;
+struct ctf_item;
+
+typedef int (*ctf_encode_t)(struct convert *c, struct ctf_item *item);
+
+/* An event copied for the encoder thread */
+struct ctf_item {
+	union perf_event	*event;
+	/* of a sample, NULL otherwise */
+	struct perf_evsel	*evsel;
+	u64			 time;
+	ctf_encode_t		 encode;
+};
+
+#define CTF_QUEUE_EVENTS	(64 * 1024)
+
+/*
+ * The events are encoded and the streams flushed on a thread of its own,
+ * while the session thread goes on reading and ordering the next ones.
+ * There is only one as the CTF writer objects, e.g. the event classes
+ * and field types all streams share, are not thread safe.
+ */
+struct ctf_encoder {
+	pthread_t		 thread;
+	pthread_mutex_t		 lock;
+	/* signalled when an event was queued or taken off the queue */
+	pthread_cond_t		 cond;
+	struct ctf_item		*items;
+	unsigned int		 head;
+	unsigned int		 nr;
+	bool			 running;
+	bool			 done;
+	int			 err;
+};
+
 struct convert {
 	struct perf_tool	tool;
 	struct ctf_writer	writer;
+	struct ctf_encoder	encoder;
 
 	u64			events_size;
 	u64			events_count;
@@ -783,31 +821,148 @@ static bool is_flush_needed(struct ctf_stream *cs)
 	return cs->count >= STREAM_FLUSH_COUNT;
 }
 
-static int process_sample_event(struct perf_tool *tool,
-				union perf_event *_event,
-				struct perf_sample *sample,
-				struct perf_evsel *evsel,
-				struct machine *machine __maybe_unused)
+static void *ctf_encoder__run(void *arg)
 {
-	struct convert *c = container_of(tool, struct convert, tool);
+	struct convert *c = arg;
+	struct ctf_encoder *enc = &c->encoder;
+	struct ctf_item item;
+	int err = 0;
+
+	pthread_mutex_lock(&enc->lock);
+	while (!err) {
+		while (!enc->nr && !enc->done)
+			pthread_cond_wait(&enc->cond, &enc->lock);
+		if (!enc->nr)
+			break;
+
+		item = enc->items[enc->head];
+		enc->head = (enc->head + 1) % CTF_QUEUE_EVENTS;
+		enc->nr--;
+		pthread_cond_signal(&enc->cond);
+		pthread_mutex_unlock(&enc->lock);
+
+		err = item.encode(c, &item);
+		free(item.event);
+
+		pthread_mutex_lock(&enc->lock);
+	}
+
+	if (err) {
+		/* fail the events queued after it */
+		enc->err = err;
+		while (enc->nr) {
+			free(enc->items[enc->head].event);
+			enc->head = (enc->head + 1) % CTF_QUEUE_EVENTS;
+			enc->nr--;
+		}
+		pthread_cond_signal(&enc->cond);
+	}
+	pthread_mutex_unlock(&enc->lock);
+
+	return NULL;
+}
+
+static void ctf_encoder__start(struct convert *c)
+{
+	struct ctf_encoder *enc = &c->encoder;
+
+	enc->items = calloc(CTF_QUEUE_EVENTS, sizeof(*enc->items));
+	if (enc->items == NULL)
+		goto out_serial;
+
+	pthread_mutex_init(&enc->lock, NULL);
+	pthread_cond_init(&enc->cond, NULL);
+
+	if (pthread_create(&enc->thread, NULL, ctf_encoder__run, c)) {
+		pthread_cond_destroy(&enc->cond);
+		pthread_mutex_destroy(&enc->lock);
+		zfree(&enc->items);
+		goto out_serial;
+	}
+
+	enc->running = true;
+	return;
+
+out_serial:
+	pr("Encoding the CTF events on the session thread\n");
+}
+
+/* Wait for the queued events to be encoded */
+static int ctf_encoder__stop(struct convert *c)
+{
+	struct ctf_encoder *enc = &c->encoder;
+
+	if (!enc->running)
+		return enc->err;
+
+	pthread_mutex_lock(&enc->lock);
+	enc->done = true;
+	pthread_cond_signal(&enc->cond);
+	pthread_mutex_unlock(&enc->lock);
+
+	pthread_join(enc->thread, NULL);
+	pthread_cond_destroy(&enc->cond);
+	pthread_mutex_destroy(&enc->lock);
+	zfree(&enc->items);
+	enc->running = false;
+
+	return enc->err;
+}
+
+static int ctf_encoder__queue(struct convert *c, union perf_event *event,
+			      struct perf_evsel *evsel, u64 time,
+			      ctf_encode_t encode)
+{
+	struct ctf_encoder *enc = &c->encoder;
+	struct ctf_item item = {
+		.event	= event,
+		.evsel	= evsel,
+		.time	= time,
+		.encode	= encode,
+	};
+	int err;
+
+	if (!enc->running)
+		return encode(c, &item);
+
+	/* the session is done with it once this returns */
+	item.event = memdup(event, event->header.size);
+	if (item.event == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&enc->lock);
+	while (enc->nr == CTF_QUEUE_EVENTS && !enc->err)
+		pthread_cond_wait(&enc->cond, &enc->lock);
+
+	err = enc->err;
+	if (!err) {
+		enc->items[(enc->head + enc->nr) % CTF_QUEUE_EVENTS] = item;
+		enc->nr++;
+		pthread_cond_signal(&enc->cond);
+	}
+	pthread_mutex_unlock(&enc->lock);
+
+	if (err)
+		free(item.event);
+	return err;
+}
+
+static int encode_sample_event(struct convert *c, struct ctf_item *item)
+{
+	struct perf_evsel *evsel = item->evsel;
 	struct evsel_priv *priv = evsel->priv;
 	struct ctf_writer *cw = &c->writer;
+	struct bt_ctf_event_class *event_class = priv->event_class;
+	struct perf_sample sample_data, *sample = &sample_data;
 	struct ctf_stream *cs;
-	struct bt_ctf_event_class *event_class;
 	struct bt_ctf_event *event;
 	int ret;
 	unsigned long type = evsel->attr.sample_type;
 
-	if (WARN_ONCE(!priv, "Failed to setup all events.\n"))
-		return 0;
-
-	event_class = priv->event_class;
-
-	/* update stats */
-	c->events_count++;
-	c->events_size += _event->header.size;
-
-	pr_time2(sample->time, "sample %" PRIu64 "\n", c->events_count);
+	/* the sample the session parsed points into its copy of the event */
+	ret = perf_evsel__parse_sample(evsel, item->event, sample);
+	if (ret)
+		return ret;
 
 	event = bt_ctf_event_create(event_class);
 	if (!event) {
@@ -815,7 +970,7 @@ static int process_sample_event(struct perf_tool *tool,
 		return -1;
 	}
 
-	bt_ctf_clock_set_time(cw->clock, sample->time);
+	bt_ctf_clock_set_time(cw->clock, item->time);
 
 	ret = add_generic_values(cw, event, evsel, sample);
 	if (ret)
@@ -854,6 +1009,27 @@ static int process_sample_event(struct perf_tool *tool,
 	return cs ? 0 : -1;
 }
 
+static int process_sample_event(struct perf_tool *tool,
+				union perf_event *_event,
+				struct perf_sample *sample,
+				struct perf_evsel *evsel,
+				struct machine *machine __maybe_unused)
+{
+	struct convert *c = container_of(tool, struct convert, tool);
+
+	if (WARN_ONCE(!evsel->priv, "Failed to setup all events.\n"))
+		return 0;
+
+	/* update stats */
+	c->events_count++;
+	c->events_size += _event->header.size;
+
+	pr_time2(sample->time, "sample %" PRIu64 "\n", c->events_count);
+
+	return ctf_encoder__queue(c, _event, evsel, sample->time,
+				  encode_sample_event);
+}
+
 #define __NON_SAMPLE_SET_FIELD(_name, _type, _field) 	\
 do {							\
 	ret = value_set_##_type(cw, event, #_field, _event->_name._field);\
@@ -862,27 +1038,23 @@ do {							\
 } while(0)
 
 #define __FUNC_PROCESS_NON_SAMPLE(_name, body) 	\
-static int process_##_name##_event(struct perf_tool *tool,	\
-				   union perf_event *_event,	\
-				   struct perf_sample *sample,	\
-				   struct machine *machine)	\
+static int encode_##_name##_event(struct convert *c,		\
+				  struct ctf_item *item)	\
 {								\
-	struct convert *c = container_of(tool, struct convert, tool);\
+	union perf_event *_event = item->event;			\
 	struct ctf_writer *cw = &c->writer;			\
 	struct bt_ctf_event_class *event_class = cw->_name##_class;\
 	struct bt_ctf_event *event;				\
 	struct ctf_stream *cs;					\
 	int ret;						\
 								\
-	c->non_sample_count++;					\
-	c->events_size += _event->header.size;			\
 	event = bt_ctf_event_create(event_class);		\
 	if (!event) {						\
 		pr_err("Failed to create an CTF event\n");	\
 		return -1;					\
 	}							\
 								\
-	bt_ctf_clock_set_time(cw->clock, sample->time);		\
+	bt_ctf_clock_set_time(cw->clock, item->time);		\
 	body							\
 	cs = ctf_stream(cw, 0);					\
 	if (cs) {						\
@@ -894,6 +1066,24 @@ static int process_##_name##_event(struct perf_tool *tool,	\
 	}							\
 	bt_ctf_event_put(event);				\
 								\
+	return 0;						\
+}								\
+								\
+static int process_##_name##_event(struct perf_tool *tool,	\
+				   union perf_event *_event,	\
+				   struct perf_sample *sample,	\
+				   struct machine *machine)	\
+{								\
+	struct convert *c = container_of(tool, struct convert, tool);\
+	int ret;						\
+								\
+	c->non_sample_count++;					\
+	c->events_size += _event->header.size;			\
+	ret = ctf_encoder__queue(c, _event, NULL, sample->time,	\
+				 encode_##_name##_event);	\
+	if (ret)						\
+		return ret;					\
+								\
 	return perf_event__process_##_name(tool, _event, sample, machine);\
 }
 
@@ -1642,7 +1832,11 @@ int bt_convert__perf2ctf(const char *input, const char *path,
 	if (setup_streams(cw, session))
 		goto free_session;
 
+	ctf_encoder__start(&c);
+
 	err = perf_session__process_events(session);
+	if (ctf_encoder__stop(&c) && !err)
+		err = -1;
 	if (!err)
 		err = ctf_writer__flush_streams(cw);
 	else
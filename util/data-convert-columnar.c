@@ -0,0 +1,611 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Columnar output of perf data convert, see data-convert-columnar.h.
+ *
+ * The data.<n> files of a directory are converted each on a thread of its
+ * own, into a file of the same name in the output directory.  Every thread
+ * has a session reading the whole directory, so the samples it gets, only
+ * those of its file, are resolved against the side band events of all of
+ * them.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/kernel.h>
+#include "data-convert-columnar.h"
+#include "debug.h"
+#include "evlist.h"
+#include "evsel.h"
+#include "machine.h"
+#include "map.h"
+#include "session.h"
+#include "symbol.h"
+#include "thread.h"
+#include "tool.h"
+#include "util.h"
+
+enum {
+	COL_TIME,
+	COL_CPU,
+	COL_PID,
+	COL_TID,
+	COL_IP,
+	COL_ADDR,
+	COL_PERIOD,
+	COL_EVENT,
+	COL_COMM,
+	COL_DSO,
+	COL_SYM,
+	COL_MAX,
+};
+
+static const struct {
+	const char	*name;
+	u32		type;
+} columnar__columns[COL_MAX] = {
+	[COL_TIME]	= { "time",	COLUMNAR_U64, },
+	[COL_CPU]	= { "cpu",	COLUMNAR_U32, },
+	[COL_PID]	= { "pid",	COLUMNAR_S32, },
+	[COL_TID]	= { "tid",	COLUMNAR_S32, },
+	[COL_IP]	= { "ip",	COLUMNAR_U64, },
+	[COL_ADDR]	= { "addr",	COLUMNAR_U64, },
+	[COL_PERIOD]	= { "period",	COLUMNAR_U64, },
+	[COL_EVENT]	= { "event",	COLUMNAR_DICT, },
+	[COL_COMM]	= { "comm",	COLUMNAR_DICT, },
+	[COL_DSO]	= { "dso",	COLUMNAR_DICT, },
+	[COL_SYM]	= { "sym",	COLUMNAR_DICT, },
+};
+
+static u32 columnar__width(int col)
+{
+	return columnar__columns[col].type == COLUMNAR_U64 ? sizeof(u64) :
+							     sizeof(u32);
+}
+
+struct columnar_strings {
+	char		**strs;
+	u32		nr;
+	u32		alloc;
+	/* open addressing, the index of the string + 1, 0 for a free slot */
+	u32		*slots;
+	u32		mask;
+	u64		size;
+};
+
+struct columnar_writer {
+	FILE			*fp;
+	u64			pos;
+	int			err;
+	void			*columns[COL_MAX];
+	u32			nr_rows;
+	u64			total_rows;
+	struct columnar_strings	strings[COL_MAX];
+	u64			*row_groups;
+	u32			nr_row_groups;
+	u32			alloc_row_groups;
+};
+
+struct columnar_convert {
+	struct perf_tool	tool;
+	struct perf_data	data;
+	struct perf_session	*session;
+	struct columnar_writer	writer;
+	char			*path;
+	u64			samples;
+	int			err;
+};
+
+static u32 columnar_strings__hash(const char *s)
+{
+	u32 hash = 2166136261U;
+
+	/* FNV-1a */
+	for (; *s; s++)
+		hash = (hash ^ (u8)*s) * 16777619;
+	return hash;
+}
+
+static int columnar_strings__init(struct columnar_strings *cs)
+{
+	cs->alloc = 64;
+	cs->strs = calloc(cs->alloc, sizeof(*cs->strs));
+	if (cs->strs == NULL)
+		return -ENOMEM;
+
+	/* what couldn't be resolved */
+	cs->strs[0] = strdup("");
+	if (cs->strs[0] == NULL)
+		return -ENOMEM;
+
+	cs->nr = 1;
+	cs->size = 1;
+	return 0;
+}
+
+static void columnar_strings__exit(struct columnar_strings *cs)
+{
+	u32 i;
+
+	for (i = 0; i < cs->nr; i++)
+		free(cs->strs[i]);
+	zfree(&cs->strs);
+	zfree(&cs->slots);
+}
+
+static int columnar_strings__grow(struct columnar_strings *cs)
+{
+	u32 nr_slots = cs->slots ? (cs->mask + 1) * 2 : 1024, i;
+	u32 *slots = calloc(nr_slots, sizeof(*slots));
+
+	if (slots == NULL)
+		return -ENOMEM;
+
+	for (i = 1; i < cs->nr; i++) {
+		u32 h = columnar_strings__hash(cs->strs[i]) & (nr_slots - 1);
+
+		while (slots[h])
+			h = (h + 1) & (nr_slots - 1);
+		slots[h] = i + 1;
+	}
+
+	free(cs->slots);
+	cs->slots = slots;
+	cs->mask  = nr_slots - 1;
+	return 0;
+}
+
+static int columnar_strings__id(struct columnar_strings *cs, const char *s,
+				u32 *id)
+{
+	u32 h;
+
+	*id = 0;
+	if (s == NULL || *s == '\0')
+		return 0;
+
+	/* keep the table at most half full */
+	if ((cs->slots == NULL || cs->nr * 2 > cs->mask) &&
+	    columnar_strings__grow(cs))
+		return -ENOMEM;
+
+	for (h = columnar_strings__hash(s) & cs->mask; cs->slots[h];
+	     h = (h + 1) & cs->mask) {
+		if (!strcmp(cs->strs[cs->slots[h] - 1], s)) {
+			*id = cs->slots[h] - 1;
+			return 0;
+		}
+	}
+
+	if (cs->nr == cs->alloc) {
+		char **strs = realloc(cs->strs, cs->alloc * 2 * sizeof(*strs));
+
+		if (strs == NULL)
+			return -ENOMEM;
+		cs->strs   = strs;
+		cs->alloc *= 2;
+	}
+
+	cs->strs[cs->nr] = strdup(s);
+	if (cs->strs[cs->nr] == NULL)
+		return -ENOMEM;
+
+	cs->size += strlen(s) + 1;
+	cs->slots[h] = cs->nr + 1;
+	*id = cs->nr++;
+	return 0;
+}
+
+static void columnar_writer__write(struct columnar_writer *w,
+				   const void *buf, size_t size)
+{
+	if (w->err || size == 0)
+		return;
+
+	if (fwrite(buf, size, 1, w->fp) != 1)
+		w->err = -errno ?: -EIO;
+	else
+		w->pos += size;
+}
+
+static void columnar_writer__pad(struct columnar_writer *w)
+{
+	static const u8 zeroes[8];
+
+	columnar_writer__write(w, zeroes, PERF_ALIGN(w->pos, 8) - w->pos);
+}
+
+static int columnar_writer__init(struct columnar_writer *w, const char *path)
+{
+	struct columnar_header hdr = {
+		.magic	    = COLUMNAR_MAGIC,
+		.version    = COLUMNAR_VERSION,
+		.nr_columns = COL_MAX,
+	};
+	int col;
+
+	for (col = 0; col < COL_MAX; col++) {
+		w->columns[col] = calloc(COLUMNAR_ROW_GROUP_ROWS,
+					 columnar__width(col));
+		if (w->columns[col] == NULL)
+			return -ENOMEM;
+
+		if (columnar__columns[col].type == COLUMNAR_DICT &&
+		    columnar_strings__init(&w->strings[col]))
+			return -ENOMEM;
+	}
+
+	w->fp = fopen(path, "w");
+	if (w->fp == NULL) {
+		pr_err("Failed to create %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	columnar_writer__write(w, &hdr, sizeof(hdr));
+
+	for (col = 0; col < COL_MAX; col++) {
+		struct columnar_column desc = {
+			.type  = columnar__columns[col].type,
+			.width = columnar__width(col),
+		};
+
+		strncpy(desc.name, columnar__columns[col].name,
+			sizeof(desc.name) - 1);
+		columnar_writer__write(w, &desc, sizeof(desc));
+	}
+
+	return w->err;
+}
+
+static void columnar_writer__exit(struct columnar_writer *w)
+{
+	int col;
+
+	for (col = 0; col < COL_MAX; col++) {
+		zfree(&w->columns[col]);
+		if (columnar__columns[col].type == COLUMNAR_DICT)
+			columnar_strings__exit(&w->strings[col]);
+	}
+
+	zfree(&w->row_groups);
+	if (w->fp) {
+		fclose(w->fp);
+		w->fp = NULL;
+	}
+}
+
+static int columnar_writer__flush(struct columnar_writer *w)
+{
+	u64 nr_rows = w->nr_rows;
+	int col;
+
+	if (nr_rows == 0)
+		return w->err;
+
+	if (w->nr_row_groups == w->alloc_row_groups) {
+		u32 alloc = w->alloc_row_groups ? w->alloc_row_groups * 2 : 64;
+		u64 *row_groups = realloc(w->row_groups,
+					  alloc * sizeof(*row_groups));
+
+		if (row_groups == NULL)
+			return -ENOMEM;
+		w->row_groups	    = row_groups;
+		w->alloc_row_groups = alloc;
+	}
+
+	w->row_groups[w->nr_row_groups++] = w->pos;
+	columnar_writer__write(w, &nr_rows, sizeof(nr_rows));
+
+	for (col = 0; col < COL_MAX; col++) {
+		columnar_writer__write(w, w->columns[col],
+				       nr_rows * columnar__width(col));
+		columnar_writer__pad(w);
+	}
+
+	w->total_rows += nr_rows;
+	w->nr_rows = 0;
+	return w->err;
+}
+
+static int columnar_writer__add(struct columnar_writer *w, u64 *row)
+{
+	int col;
+
+	for (col = 0; col < COL_MAX; col++) {
+		if (columnar__width(col) == sizeof(u64))
+			((u64 *)w->columns[col])[w->nr_rows] = row[col];
+		else
+			((u32 *)w->columns[col])[w->nr_rows] = row[col];
+	}
+
+	if (++w->nr_rows == COLUMNAR_ROW_GROUP_ROWS)
+		return columnar_writer__flush(w);
+	return 0;
+}
+
+static void columnar_writer__write_strings(struct columnar_writer *w, int col)
+{
+	struct columnar_strings *cs = &w->strings[col];
+	struct columnar_dict dict = {
+		.column	    = col,
+		.nr_strings = cs->nr,
+		.size	    = cs->size,
+	};
+	u32 i, offset = 0;
+
+	columnar_writer__write(w, &dict, sizeof(dict));
+
+	for (i = 0; i < cs->nr; i++) {
+		columnar_writer__write(w, &offset, sizeof(offset));
+		offset += strlen(cs->strs[i]) + 1;
+	}
+	columnar_writer__pad(w);
+
+	for (i = 0; i < cs->nr; i++)
+		columnar_writer__write(w, cs->strs[i], strlen(cs->strs[i]) + 1);
+	columnar_writer__pad(w);
+}
+
+static int columnar_writer__finish(struct columnar_writer *w)
+{
+	struct columnar_footer footer;
+	struct columnar_trailer trailer = {
+		.magic = COLUMNAR_MAGIC,
+	};
+	int col, err;
+
+	err = columnar_writer__flush(w);
+	if (err)
+		return err;
+
+	footer.dicts_offset = w->pos;
+	for (col = 0; col < COL_MAX; col++) {
+		if (columnar__columns[col].type == COLUMNAR_DICT)
+			columnar_writer__write_strings(w, col);
+	}
+
+	footer.nr_rows	     = w->total_rows;
+	footer.nr_row_groups = w->nr_row_groups;
+	trailer.footer_offset = w->pos;
+
+	columnar_writer__write(w, &footer, sizeof(footer));
+	columnar_writer__write(w, w->row_groups,
+			       w->nr_row_groups * sizeof(*w->row_groups));
+	columnar_writer__write(w, &trailer, sizeof(trailer));
+
+	if (fclose(w->fp) && !w->err)
+		w->err = -errno;
+	w->fp = NULL;
+	return w->err;
+}
+
+static int process_sample_event(struct perf_tool *tool,
+				union perf_event *event __maybe_unused,
+				struct perf_sample *sample,
+				struct perf_evsel *evsel,
+				struct machine *machine)
+{
+	struct columnar_convert *c = container_of(tool, struct columnar_convert, tool);
+	struct columnar_writer *w = &c->writer;
+	const char *strs[COL_MAX] = { NULL, };
+	struct addr_location al;
+	u64 row[COL_MAX];
+	int col, err = 0;
+
+	if (machine__resolve(machine, &al, sample) < 0) {
+		pr_debug("problem processing sample at %" PRIu64 ", skipping it.\n",
+			 sample->time);
+		return 0;
+	}
+
+	strs[COL_EVENT] = perf_evsel__name(evsel);
+	strs[COL_COMM]	= thread__comm_str(al.thread);
+	if (al.map)
+		strs[COL_DSO] = al.map->dso->long_name;
+	if (al.sym)
+		strs[COL_SYM] = al.sym->name;
+
+	row[COL_TIME]	= sample->time;
+	row[COL_CPU]	= sample->cpu;
+	row[COL_PID]	= sample->pid;
+	row[COL_TID]	= sample->tid;
+	row[COL_IP]	= sample->ip;
+	row[COL_ADDR]	= sample->addr;
+	row[COL_PERIOD] = sample->period;
+
+	for (col = 0; col < COL_MAX && !err; col++) {
+		u32 id;
+
+		if (columnar__columns[col].type != COLUMNAR_DICT)
+			continue;
+
+		err = columnar_strings__id(&w->strings[col], strs[col], &id);
+		row[col] = id;
+	}
+
+	addr_location__put(&al);
+
+	if (err)
+		return err;
+
+	c->samples++;
+	return columnar_writer__add(w, row);
+}
+
+static struct columnar_convert *columnar_convert__new(const char *input,
+						      bool force)
+{
+	struct columnar_convert *c = zalloc(sizeof(*c));
+
+	if (c == NULL)
+		return NULL;
+
+	c->tool.sample		 = process_sample_event;
+	c->tool.mmap		 = perf_event__process_mmap;
+	c->tool.mmap2		 = perf_event__process_mmap2;
+	c->tool.comm		 = perf_event__process_comm;
+	c->tool.exit		 = perf_event__process_exit;
+	c->tool.fork		 = perf_event__process_fork;
+	c->tool.lost		 = perf_event__process_lost;
+	c->tool.tracing_data	 = perf_event__process_tracing_data;
+	c->tool.build_id	 = perf_event__process_build_id;
+	c->tool.namespaces	 = perf_event__process_namespaces;
+	c->tool.ordered_events	 = true;
+	c->tool.ordering_requires_timestamps = true;
+
+	c->data.path  = input;
+	c->data.mode  = PERF_DATA_MODE_READ;
+	c->data.force = force;
+
+	c->session = perf_session__new(&c->data, false, &c->tool);
+	if (c->session == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+static void columnar_convert__delete(struct columnar_convert *c)
+{
+	if (c == NULL)
+		return;
+
+	columnar_writer__exit(&c->writer);
+	perf_session__delete(c->session);
+	free(c->path);
+	free(c);
+}
+
+static void *columnar_convert__run(void *arg)
+{
+	struct columnar_convert *c = arg;
+
+	c->err = perf_session__process_events(c->session);
+	if (!c->err)
+		c->err = columnar_writer__finish(&c->writer);
+	return NULL;
+}
+
+static void columnar_convert__run_all(struct columnar_convert **convs, int nr)
+{
+	bool singlethreaded = perf_singlethreaded;
+	int i, started = 0;
+	pthread_t *threads;
+
+	threads = nr > 1 ? calloc(nr, sizeof(*threads)) : NULL;
+	if (threads == NULL) {
+		for (i = 0; i < nr; i++)
+			columnar_convert__run(convs[i]);
+		return;
+	}
+
+	perf_set_multithreaded();
+
+	for (i = 1; i < nr; i++) {
+		if (pthread_create(&threads[i], NULL, columnar_convert__run,
+				   convs[i])) {
+			/* the files without a thread are converted below */
+			break;
+		}
+		started = i;
+	}
+
+	columnar_convert__run(convs[0]);
+	for (i = started + 1; i < nr; i++)
+		columnar_convert__run(convs[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (singlethreaded)
+		perf_set_singlethreaded();
+	free(threads);
+}
+
+int columnar_convert__perf2columnar(const char *input, const char *path,
+				    struct perf_data_convert_opts *opts)
+{
+	struct columnar_convert **convs, *c;
+	bool is_dir;
+	u64 samples = 0;
+	int i, nr = 1, err = -1;
+
+	c = columnar_convert__new(input, opts->force);
+	if (c == NULL)
+		return -1;
+
+	is_dir = perf_data__is_dir(&c->data);
+	if (is_dir)
+		nr = c->data.dir.nr;
+
+	convs = calloc(nr, sizeof(*convs));
+	if (convs == NULL) {
+		columnar_convert__delete(c);
+		return -1;
+	}
+	convs[0] = c;
+
+	if (symbol__init(&c->session->header.env) < 0)
+		goto out_delete;
+
+	if (is_dir && mkdir(path, 0755) && errno != EEXIST) {
+		pr_err("Failed to create %s: %s\n", path, strerror(errno));
+		goto out_delete;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (i) {
+			convs[i] = columnar_convert__new(input, opts->force);
+			if (convs[i] == NULL)
+				goto out_delete;
+		}
+		c = convs[i];
+
+		if (is_dir) {
+			const char *name = strrchr(c->data.dir.files[i].path, '/');
+
+			/* the header file samples go with the first file */
+			c->session->dir_samples = i + 1;
+			if (asprintf(&c->path, "%s/%s", path, name + 1) < 0)
+				c->path = NULL;
+		} else {
+			c->path = strdup(path);
+		}
+
+		if (c->path == NULL ||
+		    columnar_writer__init(&c->writer, c->path))
+			goto out_delete;
+	}
+
+	columnar_convert__run_all(convs, nr);
+
+	err = 0;
+	for (i = 0; i < nr; i++) {
+		if (convs[i]->err) {
+			pr_err("Error during conversion of %s.\n", convs[i]->path);
+			err = convs[i]->err;
+		}
+		samples += convs[i]->samples;
+	}
+
+	fprintf(stderr,
+		"[ perf data convert: Converted '%s' into columnar data '%s' ]\n",
+		convs[0]->data.path, path);
+	fprintf(stderr,
+		"[ perf data convert: Converted and wrote %" PRIu64 " samples in %d file%s ]\n",
+		samples, nr, nr > 1 ? "s" : "");
+	goto out_free;
+
+out_delete:
+	pr_err("Error during conversion setup.\n");
+out_free:
+	for (i = 0; i < nr; i++)
+		columnar_convert__delete(convs[i]);
+	free(convs);
+	return err;
+}
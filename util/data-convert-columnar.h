@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __DATA_CONVERT_COLUMNAR_H
+#define __DATA_CONVERT_COLUMNAR_H
+#include <linux/types.h>
+#include "data-convert.h"
+
+/*
+ * The samples of a perf.data file, one column per sample field, in row
+ * groups of up to COLUMNAR_ROW_GROUP_ROWS rows.  Everything is little
+ * endian and 8 byte aligned:
+ *
+ *   struct columnar_header
+ *   struct columnar_column		[nr_columns]
+ *   row groups, each:
+ *     u64 nr_rows
+ *     every column in order, nr_rows values, padded to 8 bytes
+ *   dictionaries, for each COLUMNAR_DICT column in order:
+ *     struct columnar_dict
+ *     u32 offsets[nr_strings]		into the strings, padded to 8 bytes
+ *     the NUL terminated strings,	padded to 8 bytes
+ *   struct columnar_footer
+ *   u64 row_group_offsets[nr_row_groups]
+ *   struct columnar_trailer
+ *
+ * Readers start at the trailer at the end of the file.  A dictionary
+ * encoded value is the index of its string, 0 being the empty string
+ * for what couldn't be resolved.
+ */
+#define COLUMNAR_MAGIC		0x4c4f435f46524550ULL	/* "PERF_COL" */
+#define COLUMNAR_VERSION	1
+#define COLUMNAR_ROW_GROUP_ROWS	(64 * 1024)
+
+enum columnar_type {
+	COLUMNAR_U64,
+	COLUMNAR_U32,
+	COLUMNAR_S32,
+	COLUMNAR_DICT,		/* u32 indexes into the column dictionary */
+};
+
+struct columnar_header {
+	u64	magic;
+	u32	version;
+	u32	nr_columns;
+};
+
+struct columnar_column {
+	char	name[24];
+	u32	type;
+	u32	width;
+};
+
+struct columnar_dict {
+	u32	column;
+	u32	nr_strings;
+	u64	size;
+};
+
+struct columnar_footer {
+	u64	nr_rows;
+	u64	nr_row_groups;
+	u64	dicts_offset;
+};
+
+struct columnar_trailer {
+	u64	footer_offset;
+	u64	magic;
+};
+
+int columnar_convert__perf2columnar(const char *input_name, const char *path,
+				    struct perf_data_convert_opts *opts);
+
+#endif /* __DATA_CONVERT_COLUMNAR_H */
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * perf data sort, see data-sort.h.
+ *
+ * The input is read as perf report reads it, the ordered events merging
+ * each round with what was held back from the previous one, and what they
+ * deliver is written out as is.  A round is ended in the output where one
+ * was in the input, for the readers that don't know about HEADER_SORTED.
+ * Only the events of about a round are held, in the mapped input.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/kernel.h>
+#include "build-id.h"
+#include "data.h"
+#include "data-sort.h"
+#include "debug.h"
+#include "evlist.h"
+#include "evsel.h"
+#include "header.h"
+#include "ordered-events.h"
+#include "session.h"
+#include "tool.h"
+
+/* The events are written in chunks of up to that much */
+#define DATA_SORT_BUF_SIZE	(256 << 10)
+
+struct data_sort {
+	struct perf_tool	  tool;
+	struct perf_session	 *session;
+	struct perf_data	  output;
+	/* the session's, that still gets the events */
+	ordered_events__deliver_t deliver;
+	void			 *buf;
+	size_t			  len;
+	u64			  bytes_written;
+	/* bytes_written at the last round written */
+	u64			  round_bytes;
+	u64			  last_time;
+	u64			  nr_events;
+	u64			  nr_unordered;
+};
+
+static int data_sort__flush(struct data_sort *s)
+{
+	ssize_t ret = 0;
+
+	if (s->len)
+		ret = perf_data__write(&s->output, s->buf, s->len);
+	s->len = 0;
+
+	if (ret < 0) {
+		pr_err("failed to write perf data to %s, error: %m\n", s->output.path);
+		return -errno;
+	}
+	return 0;
+}
+
+static int data_sort__write(struct data_sort *s, union perf_event *event)
+{
+	size_t size = event->header.size;
+	int err;
+
+	/* an event is at most 64k, it always fits in an empty buffer */
+	if (s->len + size > DATA_SORT_BUF_SIZE) {
+		err = data_sort__flush(s);
+		if (err)
+			return err;
+	}
+
+	memcpy(s->buf + s->len, event, size);
+	s->len += size;
+	s->bytes_written += size;
+	return 0;
+}
+
+static int data_sort__deliver(struct ordered_events *oe,
+			      struct ordered_event *oevent)
+{
+	struct data_sort *s = oe->data;
+	int err, ret;
+
+	/* queued after a later one was flushed, see ordered_events__queue() */
+	if (oevent->timestamp < s->last_time)
+		s->nr_unordered++;
+	s->last_time = oevent->timestamp;
+	s->nr_events++;
+
+	err = data_sort__write(s, oevent->event);
+	/* processed as usual, the event unpinned */
+	ret = s->deliver(oe, oevent);
+	return err ?: ret;
+}
+
+static int data_sort__finished_round(struct perf_tool *tool,
+				     union perf_event *event,
+				     struct ordered_events *oe)
+{
+	struct data_sort *s = container_of(tool, struct data_sort, tool);
+	int err = ordered_events__flush(oe, OE_FLUSH__ROUND);
+
+	/* what is still queued and what comes next is after what was written */
+	if (err || s->bytes_written == s->round_bytes)
+		return err;
+
+	err = data_sort__write(s, event);
+	s->round_bytes = s->bytes_written;
+	return err;
+}
+
+/* The events without a time are written where they are in the input */
+static int data_sort__repipe(struct perf_session *session,
+			     union perf_event *event)
+{
+	struct data_sort *s = container_of(session->tool, struct data_sort, tool);
+
+	return data_sort__write(s, event);
+}
+
+static bool data_sort__has_time(struct perf_session *session)
+{
+	struct perf_evsel *evsel;
+
+	if (!perf_evlist__sample_id_all(session->evlist))
+		return false;
+
+	evlist__for_each_entry(session->evlist, evsel) {
+		if (!(evsel->attr.sample_type & PERF_SAMPLE_TIME))
+			return false;
+	}
+
+	return true;
+}
+
+static int data_sort__check(struct data_sort *s, const char *input)
+{
+	struct perf_session *session = s->session;
+
+	if (perf_data__is_pipe(session->data) || perf_data__is_dir(session->data)) {
+		pr_err("%s: only perf.data files can be sorted\n", input);
+		return -1;
+	}
+
+	if (perf_header__has_feat(&session->header, HEADER_SORTED)) {
+		pr_err("%s is already sorted\n", input);
+		return -1;
+	}
+
+	/* the AUX area data follows its events, unparsed */
+	if (perf_header__has_feat(&session->header, HEADER_AUXTRACE)) {
+		pr_err("%s: AUX area tracing data can't be sorted\n", input);
+		return -1;
+	}
+
+	if (!data_sort__has_time(session)) {
+		pr_err("%s: the events have no time to be sorted by, record with -T\n",
+		       input);
+		return -1;
+	}
+
+	return 0;
+}
+
+int data_sort__sort(const char *input, const char *output, bool force)
+{
+	struct data_sort s = {
+		.tool = {
+			.finished_round	= data_sort__finished_round,
+			.build_id	= data_sort__repipe,
+			.id_index	= data_sort__repipe,
+			.auxtrace_error	= data_sort__repipe,
+			.time_conv	= data_sort__repipe,
+			.thread_map	= data_sort__repipe,
+			.cpu_map	= data_sort__repipe,
+			.stat_config	= data_sort__repipe,
+			.stat		= data_sort__repipe,
+			.stat_round	= data_sort__repipe,
+			.ordered_events	= true,
+			.ordering_requires_timestamps = true,
+		},
+		.output = {
+			.path = output,
+			.mode = PERF_DATA_MODE_WRITE,
+		},
+	};
+	struct perf_data data = {
+		.path  = input,
+		.mode  = PERF_DATA_MODE_READ,
+		.force = force,
+	};
+	struct perf_session *session;
+	struct perf_header *header;
+	int fd, err = -1;
+
+	session = perf_session__new(&data, false, &s.tool);
+	if (session == NULL)
+		return -1;
+
+	s.session = session;
+	header = &session->header;
+
+	if (data_sort__check(&s, input))
+		goto out_delete;
+
+	s.buf = malloc(DATA_SORT_BUF_SIZE);
+	if (s.buf == NULL)
+		goto out_delete;
+
+	if (perf_data__open(&s.output)) {
+		pr_err("failed to create %s\n", output);
+		goto out_free;
+	}
+
+	if (perf_data__is_pipe(&s.output)) {
+		pr_err("perf data sort can't write to a pipe\n");
+		goto out_close;
+	}
+
+	s.deliver = session->ordered_events.deliver;
+	session->ordered_events.deliver = data_sort__deliver;
+	session->ordered_events.data = &s;
+
+	fd = perf_data__fd(&s.output);
+	lseek(fd, header->data_offset, SEEK_SET);
+
+	err = perf_session__process_events(session);
+	if (!err)
+		err = data_sort__flush(&s);
+	if (err)
+		goto out_close;
+
+	/* the events are written as they were decompressed, elsewhere */
+	perf_header__clear_feat(header, HEADER_COMPRESSED);
+	perf_header__clear_feat(header, HEADER_TIME_INDEX);
+
+	if (!s.nr_unordered) {
+		perf_header__set_feat(header, HEADER_SORTED);
+		header->env.nr_sorted_events = s.nr_events;
+	} else {
+		pr_warning("%" PRIu64 " events were out of order, %s is not marked sorted\n",
+			   s.nr_unordered, output);
+	}
+
+	/* the build-ids are kept whatever the samples hit */
+	if (perf_header__has_feat(header, HEADER_BUILD_ID))
+		dsos__hit_all(session);
+
+	header->data_size = s.bytes_written;
+	err = perf_session__write_header(session, session->evlist, fd, true);
+	if (err)
+		goto out_close;
+
+	fprintf(stderr, "[ perf data sort: Wrote %" PRIu64 " events of '%s' in time order to '%s' ]\n",
+		s.nr_events, input, output);
+
+out_close:
+	perf_data__close(&s.output);
+out_free:
+	free(s.buf);
+out_delete:
+	perf_session__delete(session);
+	return err;
+}
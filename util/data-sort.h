@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_DATA_SORT_H
+#define __PERF_DATA_SORT_H
+
+#include <stdbool.h>
+
+/*
+ * Write the events of input to output in the order the ordered events
+ * deliver them in, and set HEADER_SORTED in output for the readers to
+ * deliver them as they come, see perf_session__process_events().
+ */
+int data_sort__sort(const char *input, const char *output, bool force);
+
+#endif /* __PERF_DATA_SORT_H */
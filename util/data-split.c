@@ -0,0 +1,627 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * perf data split and merge, see data-split.h.
+ *
+ * The data section of the inputs is read in big chunks and the events
+ * are copied from there to the output as they are, nothing is processed:
+ * a sample is only looked at up to its cpu, to be picked out, and the
+ * other events up to their time.  Both are about as fast as the disk.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/bitmap.h>
+#include <linux/kernel.h>
+#include "../perf.h"
+#include "build-id.h"
+#include "data.h"
+#include "data-split.h"
+#include "debug.h"
+#include "dso.h"
+#include "evlist.h"
+#include "evsel.h"
+#include "header.h"
+#include "intlist.h"
+#include "machine.h"
+#include "session.h"
+#include "time-utils.h"
+#include "util.h"
+
+/* The input is read and the output written in chunks of up to that much */
+#define DATA_SPLIT_IN_SIZE	(4 << 20)
+#define DATA_SPLIT_OUT_SIZE	(256 << 10)
+
+struct data_split {
+	struct perf_data	 output;
+	void			*in;
+	void			*out;
+	size_t			 len;
+	u64			 bytes_written;
+	/* bytes_written at the last round written */
+	u64			 round_bytes;
+	u64			 nr_samples;
+	u64			 nr_written;
+	u64			 nr_dropped;
+	u64			 first_time;
+	u64			 last_time;
+	/* split */
+	struct perf_time_interval ptime;
+	const char		*cpu_list;
+	DECLARE_BITMAP(cpu_bitmap, MAX_NR_CPUS);
+	struct intlist		*pids;
+	/* merge, the input's rounds still end rounds in the output */
+	bool			 keep_rounds;
+};
+
+typedef int (*data_split__event_t)(struct data_split *s,
+				   struct perf_session *session,
+				   union perf_event *event);
+
+static int data_split__flush(struct data_split *s)
+{
+	ssize_t ret = 0;
+
+	if (s->len)
+		ret = perf_data__write(&s->output, s->out, s->len);
+	s->len = 0;
+
+	if (ret < 0) {
+		pr_err("failed to write perf data to %s, error: %m\n", s->output.path);
+		return -errno;
+	}
+	return 0;
+}
+
+static int data_split__write(struct data_split *s, union perf_event *event)
+{
+	size_t size = event->header.size;
+	int err;
+
+	/* an event is at most 64k, it always fits in an empty buffer */
+	if (s->len + size > DATA_SPLIT_OUT_SIZE) {
+		err = data_split__flush(s);
+		if (err)
+			return err;
+	}
+
+	memcpy(s->out + s->len, event, size);
+	s->len += size;
+	s->bytes_written += size;
+	return 0;
+}
+
+static int data_split__round(struct data_split *s, union perf_event *event)
+{
+	int err;
+
+	/* empty rounds only cost the readers a flush */
+	if (s->bytes_written == s->round_bytes)
+		return 0;
+
+	err = data_split__write(s, event);
+	s->round_bytes = s->bytes_written;
+	return err;
+}
+
+/*
+ * Hands fn the events of the data section of session, in the order they
+ * are in the file, from the chunk of it read in s->in.
+ */
+static int data_split__read(struct data_split *s, struct perf_session *session,
+			    data_split__event_t fn)
+{
+	struct perf_header *header = &session->header;
+	int fd = perf_data__fd(session->data);
+	u64 left = header->data_size;
+	size_t len = 0;
+	int err;
+
+	if (lseek(fd, header->data_offset, SEEK_SET) == (off_t)-1) {
+		pr_err("failed to seek to the data of %s: %m\n", session->data->path);
+		return -errno;
+	}
+
+	while (left) {
+		size_t n = min(left, (u64)DATA_SPLIT_IN_SIZE - len), pos = 0;
+
+		if (readn(fd, s->in + len, n) != (ssize_t)n) {
+			pr_err("failed to read the data of %s\n", session->data->path);
+			return -EIO;
+		}
+		len  += n;
+		left -= n;
+
+		while (len - pos >= sizeof(struct perf_event_header)) {
+			union perf_event *event = s->in + pos;
+			u16 size = event->header.size;
+
+			if (size < sizeof(struct perf_event_header)) {
+				pr_err("%s: bad event header at offset %#" PRIx64 "\n",
+				       session->data->path,
+				       header->data_offset + header->data_size -
+				       left - len + pos);
+				return -EINVAL;
+			}
+
+			if (len - pos < size)
+				break;
+
+			err = fn(s, session, event);
+			if (err)
+				return err;
+
+			pos += size;
+		}
+
+		/* the sizes keep the events 8 byte aligned */
+		memmove(s->in, s->in + pos, len - pos);
+		len -= pos;
+	}
+
+	if (len)
+		pr_warning("%s: the last %zu bytes, of a truncated event, are ignored\n",
+			   session->data->path, len);
+	return 0;
+}
+
+/* Only what is read as is can be copied as is */
+static int data_split__check(struct perf_session *session, const char *input)
+{
+	struct perf_header *header = &session->header;
+
+	if (perf_data__is_pipe(session->data) || perf_data__is_dir(session->data)) {
+		pr_err("%s: only perf.data files can be split or merged\n", input);
+		return -1;
+	}
+
+	if (header->needs_swap) {
+		pr_err("%s: was recorded with the other endianness\n", input);
+		return -1;
+	}
+
+	/* the AUX area data follows its events, unparsed */
+	if (perf_header__has_feat(header, HEADER_AUXTRACE)) {
+		pr_err("%s: AUX area tracing data can't be split or merged\n", input);
+		return -1;
+	}
+
+	if (perf_header__has_feat(header, HEADER_COMPRESSED)) {
+		pr_err("%s: is compressed, perf data sort writes it uncompressed\n", input);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int data_split__write_header(struct data_split *s,
+				    struct perf_session *session)
+{
+	struct perf_header *header = &session->header;
+	int err = data_split__flush(s);
+
+	if (err)
+		return err;
+
+	/* the index and the count are of the input's events */
+	perf_header__clear_feat(header, HEADER_TIME_INDEX);
+	perf_header__clear_feat(header, HEADER_SORTED);
+
+	session->evlist->first_sample_time = s->first_time;
+	session->evlist->last_sample_time  = s->last_time;
+
+	/* the build-ids are kept whatever the samples hit */
+	if (perf_header__has_feat(header, HEADER_BUILD_ID))
+		dsos__hit_all(session);
+
+	header->data_size = s->bytes_written;
+	return perf_session__write_header(session, session->evlist,
+					  perf_data__fd(&s->output), true);
+}
+
+static int data_split__open_output(struct data_split *s,
+				   struct perf_session *session)
+{
+	s->in  = malloc(DATA_SPLIT_IN_SIZE);
+	s->out = malloc(DATA_SPLIT_OUT_SIZE);
+	if (s->in == NULL || s->out == NULL)
+		return -ENOMEM;
+
+	if (perf_data__open(&s->output)) {
+		pr_err("failed to create %s\n", s->output.path);
+		return -1;
+	}
+
+	if (perf_data__is_pipe(&s->output)) {
+		pr_err("perf data can't split or merge to a pipe\n");
+		perf_data__close(&s->output);
+		return -1;
+	}
+
+	lseek(perf_data__fd(&s->output), session->header.data_offset, SEEK_SET);
+	return 0;
+}
+
+static void data_split__exit(struct data_split *s)
+{
+	zfree(&s->in);
+	zfree(&s->out);
+	intlist__delete(s->pids);
+}
+
+static int data_split__split_event(struct data_split *s,
+				   struct perf_session *session,
+				   union perf_event *event)
+{
+	struct perf_evsel *evsel;
+	struct perf_sample sample;
+	u64 timestamp;
+
+	if (event->header.type == PERF_RECORD_FINISHED_ROUND)
+		return data_split__round(s, event);
+
+	if (event->header.type >= PERF_RECORD_USER_TYPE_START)
+		return data_split__write(s, event);
+
+	/*
+	 * The side band before the end is kept for the threads and maps the
+	 * samples are in, whenever they were set up, what is after is of no
+	 * use to them.
+	 */
+	if (event->header.type != PERF_RECORD_SAMPLE) {
+		if (s->ptime.end &&
+		    !perf_evlist__parse_sample_timestamp(session->evlist, event, &timestamp) &&
+		    timestamp > s->ptime.end)
+			return 0;
+		return data_split__write(s, event);
+	}
+
+	s->nr_samples++;
+
+	evsel = perf_evlist__event2evsel(session->evlist, event);
+	if (evsel == NULL || perf_evsel__parse_sample_head(evsel, event, &sample)) {
+		s->nr_dropped++;
+		return 0;
+	}
+
+	if (perf_time__skip_sample(&s->ptime, sample.time))
+		return 0;
+
+	if (s->cpu_list &&
+	    (sample.cpu >= MAX_NR_CPUS || !test_bit(sample.cpu, s->cpu_bitmap)))
+		return 0;
+
+	if (s->pids && !intlist__has_entry(s->pids, sample.pid))
+		return 0;
+
+	if (sample.time != -1ULL) {
+		if (!s->first_time)
+			s->first_time = sample.time;
+		s->last_time = sample.time;
+	}
+
+	s->nr_written++;
+	return data_split__write(s, event);
+}
+
+static int data_split__split_opts(struct data_split *s,
+				  struct perf_session *session,
+				  struct data_split_opts *opts)
+{
+	struct perf_evsel *evsel;
+
+	if (opts->time_str) {
+		evlist__for_each_entry(session->evlist, evsel) {
+			if (!(evsel->attr.sample_type & PERF_SAMPLE_TIME)) {
+				pr_err("%s has no sample time, record with -T\n",
+				       perf_evsel__name(evsel));
+				return -1;
+			}
+		}
+
+		if (perf_time__parse_str(&s->ptime, opts->time_str)) {
+			pr_err("Invalid time string: %s\n", opts->time_str);
+			return -1;
+		}
+	}
+
+	if (opts->cpu_list) {
+		if (perf_session__cpu_bitmap(session, opts->cpu_list, s->cpu_bitmap))
+			return -1;
+		s->cpu_list = opts->cpu_list;
+	}
+
+	if (opts->pid_list) {
+		evlist__for_each_entry(session->evlist, evsel) {
+			if (!(evsel->attr.sample_type & PERF_SAMPLE_TID)) {
+				pr_err("%s has no sample pid\n", perf_evsel__name(evsel));
+				return -1;
+			}
+		}
+
+		s->pids = intlist__new(opts->pid_list);
+		if (s->pids == NULL) {
+			pr_err("Invalid pid list: %s\n", opts->pid_list);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int data_split__split(const char *input, const char *output,
+		      struct data_split_opts *opts)
+{
+	struct data_split s = {
+		.output = {
+			.path = output,
+			.mode = PERF_DATA_MODE_WRITE,
+		},
+	};
+	struct perf_data data = {
+		.path  = input,
+		.mode  = PERF_DATA_MODE_READ,
+		.force = opts->force,
+	};
+	struct perf_session *session;
+	int err = -1;
+
+	session = perf_session__new(&data, false, NULL);
+	if (session == NULL)
+		return -1;
+
+	if (data_split__check(session, input) ||
+	    data_split__split_opts(&s, session, opts))
+		goto out_delete;
+
+	err = data_split__open_output(&s, session);
+	if (err)
+		goto out_delete;
+
+	err = data_split__read(&s, session, data_split__split_event);
+	if (!err)
+		err = data_split__write_header(&s, session);
+	if (err)
+		goto out_close;
+
+	if (s.nr_dropped)
+		pr_warning("%" PRIu64 " samples of unknown events were dropped\n",
+			   s.nr_dropped);
+
+	fprintf(stderr, "[ perf data split: Wrote %" PRIu64 " of the %" PRIu64 " samples of '%s' to '%s' ]\n",
+		s.nr_written, s.nr_samples, input, output);
+
+out_close:
+	perf_data__close(&s.output);
+out_delete:
+	data_split__exit(&s);
+	perf_session__delete(session);
+	return err;
+}
+
+static int data_split__merge_event(struct data_split *s,
+				   struct perf_session *session __maybe_unused,
+				   union perf_event *event)
+{
+	if (event->header.type == PERF_RECORD_FINISHED_ROUND)
+		return s->keep_rounds ? data_split__round(s, event) : 0;
+
+	if (event->header.type == PERF_RECORD_SAMPLE)
+		s->nr_samples++;
+
+	return data_split__write(s, event);
+}
+
+/* The samples of all are written with the attrs and ids of the first */
+static int data_split__same_events(struct perf_session *session,
+				   struct perf_session *other)
+{
+	struct perf_evsel *pos, *evsel;
+
+	if (session->evlist->nr_entries != other->evlist->nr_entries)
+		return -1;
+
+	evsel = perf_evlist__first(other->evlist);
+	evlist__for_each_entry(session->evlist, pos) {
+		if (memcmp(&pos->attr, &evsel->attr, sizeof(pos->attr)) ||
+		    pos->ids != evsel->ids ||
+		    memcmp(pos->id, evsel->id, pos->ids * sizeof(u64)))
+			return -1;
+		evsel = perf_evsel__next(evsel);
+	}
+
+	return 0;
+}
+
+static int machine__merge_build_ids(struct machine *machine,
+				    struct machines *machines)
+{
+	struct machine *to = machines__findnew(machines, machine->pid);
+	struct dso *pos;
+
+	if (to == NULL)
+		return -ENOMEM;
+
+	list_for_each_entry(pos, &machine->dsos.head, node) {
+		struct dso *dso;
+
+		if (!pos->has_build_id)
+			continue;
+
+		dso = machine__findnew_dso(to, pos->long_name);
+		if (dso == NULL)
+			return -ENOMEM;
+
+		if (!dso->has_build_id) {
+			dso__set_build_id(dso, pos->build_id);
+			dso->kernel = pos->kernel;
+		}
+		dso__put(dso);
+	}
+
+	return 0;
+}
+
+/* The header written is the first's, with the build-ids of all */
+static int session__merge_build_ids(struct perf_session *session,
+				    struct perf_session *other)
+{
+	struct rb_node *nd;
+	int err;
+
+	if (!perf_header__has_feat(&other->header, HEADER_BUILD_ID))
+		return 0;
+
+	perf_header__set_feat(&session->header, HEADER_BUILD_ID);
+
+	err = machine__merge_build_ids(&other->machines.host, &session->machines);
+	if (err)
+		return err;
+
+	for (nd = rb_first_cached(&other->machines.guests); nd; nd = rb_next(nd)) {
+		struct machine *pos = rb_entry(nd, struct machine, rb_node);
+
+		err = machine__merge_build_ids(pos, &session->machines);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int session__cmp_first_sample(const void *a, const void *b)
+{
+	const struct perf_session *sa = *(struct perf_session * const *)a;
+	const struct perf_session *sb = *(struct perf_session * const *)b;
+	u64 ta = sa->evlist->first_sample_time;
+	u64 tb = sb->evlist->first_sample_time;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/*
+ * The inputs are written one after the other.  The rounds of one that
+ * overlaps no other in time still hold, as does one ending each set of
+ * overlapping inputs.  Within a set the readers have to order it all.
+ */
+static int data_split__merge_sessions(struct data_split *s,
+				      struct perf_session **sessions, int nr,
+				      bool timed)
+{
+	struct perf_event_header round = {
+		.type = PERF_RECORD_FINISHED_ROUND,
+		.size = sizeof(round),
+	};
+	u64 end = 0;
+	int i, err;
+
+	for (i = 0; i < nr; i++) {
+		struct perf_evlist *evlist = sessions[i]->evlist;
+		bool after = timed && (!i || evlist->first_sample_time > end);
+
+		if (i && after) {
+			err = data_split__round(s, (union perf_event *)&round);
+			if (err)
+				return err;
+		}
+
+		s->keep_rounds = after &&
+				 (i == nr - 1 ||
+				  sessions[i + 1]->evlist->first_sample_time > evlist->last_sample_time);
+
+		err = data_split__read(s, sessions[i], data_split__merge_event);
+		if (err)
+			return err;
+
+		if (!s->first_time)
+			s->first_time = evlist->first_sample_time;
+		end = max(end, evlist->last_sample_time);
+	}
+
+	s->last_time = end;
+	return 0;
+}
+
+int data_split__merge(const char **inputs, int nr, const char *output,
+		      bool force)
+{
+	struct data_split s = {
+		.output = {
+			.path = output,
+			.mode = PERF_DATA_MODE_WRITE,
+		},
+	};
+	struct perf_session **sessions;
+	struct perf_data *data;
+	bool timed = true;
+	int i, err = -1;
+
+	sessions = calloc(nr, sizeof(*sessions));
+	data = calloc(nr, sizeof(*data));
+	if (sessions == NULL || data == NULL)
+		goto out_free;
+
+	for (i = 0; i < nr; i++) {
+		data[i].path  = inputs[i];
+		data[i].mode  = PERF_DATA_MODE_READ;
+		data[i].force = force;
+
+		sessions[i] = perf_session__new(&data[i], false, NULL);
+		if (sessions[i] == NULL)
+			goto out_delete;
+
+		if (data_split__check(sessions[i], inputs[i]))
+			goto out_delete;
+
+		if (i && data_split__same_events(sessions[0], sessions[i])) {
+			pr_err("%s was not recorded with the same events as %s\n",
+			       inputs[i], inputs[0]);
+			goto out_delete;
+		}
+
+		if (!perf_header__has_feat(&sessions[i]->header, HEADER_SAMPLE_TIME))
+			timed = false;
+	}
+
+	/* the order of the files is then about the order of their events */
+	if (timed)
+		qsort(sessions, nr, sizeof(*sessions), session__cmp_first_sample);
+
+	for (i = 1; i < nr; i++) {
+		if (session__merge_build_ids(sessions[0], sessions[i]))
+			goto out_delete;
+	}
+
+	err = data_split__open_output(&s, sessions[0]);
+	if (err)
+		goto out_delete;
+
+	err = data_split__merge_sessions(&s, sessions, nr, timed);
+	if (err)
+		goto out_close;
+
+	if (!timed)
+		perf_header__clear_feat(&sessions[0]->header, HEADER_SAMPLE_TIME);
+
+	err = data_split__write_header(&s, sessions[0]);
+	if (err)
+		goto out_close;
+
+	fprintf(stderr, "[ perf data merge: Wrote %" PRIu64 " samples of %d files to '%s' ]\n",
+		s.nr_samples, nr, output);
+
+out_close:
+	perf_data__close(&s.output);
+out_delete:
+	for (i = 0; i < nr; i++) {
+		if (sessions[i])
+			perf_session__delete(sessions[i]);
+	}
+out_free:
+	data_split__exit(&s);
+	free(sessions);
+	free(data);
+	return err;
+}
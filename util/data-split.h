@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_DATA_SPLIT_H
+#define __PERF_DATA_SPLIT_H
+
+#include <stdbool.h>
+
+struct data_split_opts {
+	/* start,end of the samples kept, see perf_time__parse_str() */
+	const char	*time_str;
+	const char	*cpu_list;
+	const char	*pid_list;
+	bool		 force;
+};
+
+/*
+ * Copy to output the samples of input in the time, cpus and pids of
+ * opts, with the side band events up to the end of that time, for the
+ * threads and maps at its start.  The events are copied as they are,
+ * only the start of the samples is parsed.
+ */
+int data_split__split(const char *input, const char *output,
+		      struct data_split_opts *opts);
+
+/*
+ * Copy the events of the inputs, recorded with the same events, e.g. the
+ * files of perf record --switch-output or of perf data split, to output,
+ * in the order of their first samples.
+ */
+int data_split__merge(const char **inputs, int nr, const char *output,
+		      bool force);
+
+#endif /* __PERF_DATA_SPLIT_H */
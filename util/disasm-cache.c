@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include "annotate.h"
+#include "build-id.h"
+#include "debug.h"
+#include "disasm-cache.h"
+#include "dso.h"
+#include "util.h"
+
+#define DISASM_CACHE_BITS	8
+#define DISASM_CACHE_MAX	(64 << 20)
+
+struct disasm_entry {
+	struct hlist_node	node;
+	u8			build_id[BUILD_ID_SIZE];
+	u64			start;
+	u64			end;
+	u32			key;
+	size_t			size;
+	char			buf[];
+};
+
+static struct hlist_head disasm_cache[1 << DISASM_CACHE_BITS];
+static size_t disasm_cache__size;
+static pthread_mutex_t disasm_cache__lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u32 disasm_cache__hash_str(u32 hash, const char *s)
+{
+	/* FNV-1a */
+	for (; s && *s; s++)
+		hash = (hash ^ (u8)*s) * 16777619;
+	return hash;
+}
+
+/* A hash of the options the disassembler output depends on */
+static u32 disasm_cache__key(struct annotation_options *opts)
+{
+	u32 key = 2166136261U;
+
+	key = disasm_cache__hash_str(key, opts->objdump_path);
+	key = disasm_cache__hash_str(key, "\n");
+	key = disasm_cache__hash_str(key, opts->disassembler_style);
+	key = disasm_cache__hash_str(key, opts->show_asm_raw ? "r" : "-");
+	key = disasm_cache__hash_str(key, opts->annotate_src ? "s" : "-");
+
+	return key;
+}
+
+static struct hlist_head *disasm_cache__head(struct dso *dso, u64 start)
+{
+	return &disasm_cache[hash_64(start ^ dso->build_id[0],
+				     DISASM_CACHE_BITS)];
+}
+
+static char *disasm_cache__filename(struct dso *dso, u64 start, u64 end,
+				    u32 key, char *bf, size_t size)
+{
+	char name[64];
+
+	scnprintf(name, sizeof(name), "disasm-%" PRIx64 "-%" PRIx64 "-%08x",
+		  start, end, key);
+	return dso__build_id_cache_file(dso, name, bf, size);
+}
+
+static int disasm_cache__read(const char *filename, char **bufp,
+			      size_t *sizep)
+{
+	struct stat st;
+	char *buf;
+	int fd, err = -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		goto out_close;
+
+	buf = malloc(st.st_size);
+	if (buf == NULL)
+		goto out_close;
+
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		goto out_close;
+	}
+
+	*bufp  = buf;
+	*sizep = st.st_size;
+	err = 0;
+out_close:
+	close(fd);
+	return err;
+}
+
+static void disasm_cache__write(const char *filename, const char *buf,
+				size_t size)
+{
+	char tmpname[PATH_MAX];
+	int fd;
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return;
+
+	if (write(fd, buf, size) != (ssize_t)size || close(fd) ||
+	    rename(tmpname, filename))
+		unlink(tmpname);
+}
+
+static void disasm_cache__insert(struct dso *dso, u64 start, u64 end,
+				 u32 key, const char *buf, size_t size)
+{
+	struct disasm_entry *entry;
+
+	if (disasm_cache__size + size > DISASM_CACHE_MAX)
+		return;
+
+	entry = malloc(sizeof(*entry) + size);
+	if (entry == NULL)
+		return;
+
+	memcpy(entry->build_id, dso->build_id, sizeof(entry->build_id));
+	entry->start = start;
+	entry->end   = end;
+	entry->key   = key;
+	entry->size  = size;
+	memcpy(entry->buf, buf, size);
+
+	hlist_add_head(&entry->node, disasm_cache__head(dso, start));
+	disasm_cache__size += size;
+}
+
+/*
+ * Returns 0 and a copy of the cached output in *bufp, for the caller to
+ * free, or -1 if it has to be disassembled.
+ */
+int disasm_cache__find(struct dso *dso, u64 start, u64 end,
+		       struct annotation_options *opts,
+		       char **bufp, size_t *sizep)
+{
+	char filename[PATH_MAX];
+	struct disasm_entry *entry;
+	u32 key = disasm_cache__key(opts);
+	int err = -1;
+
+	if (!dso->has_build_id)
+		return -1;
+
+	pthread_mutex_lock(&disasm_cache__lock);
+	hlist_for_each_entry(entry, disasm_cache__head(dso, start), node) {
+		if (entry->start != start || entry->end != end ||
+		    entry->key != key ||
+		    memcmp(entry->build_id, dso->build_id, sizeof(entry->build_id)))
+			continue;
+
+		*bufp = memdup(entry->buf, entry->size);
+		if (*bufp) {
+			*sizep = entry->size;
+			err = 0;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&disasm_cache__lock);
+
+	if (err && disasm_cache__filename(dso, start, end, key, filename,
+					  sizeof(filename)) &&
+	    !disasm_cache__read(filename, bufp, sizep)) {
+		pr_debug("Using the cached disassembly in %s\n", filename);
+		pthread_mutex_lock(&disasm_cache__lock);
+		disasm_cache__insert(dso, start, end, key, *bufp, *sizep);
+		pthread_mutex_unlock(&disasm_cache__lock);
+		err = 0;
+	}
+
+	return err;
+}
+
+void disasm_cache__add(struct dso *dso, u64 start, u64 end,
+		       struct annotation_options *opts,
+		       const char *buf, size_t size)
+{
+	char filename[PATH_MAX];
+	u32 key = disasm_cache__key(opts);
+
+	if (!dso->has_build_id || size == 0)
+		return;
+
+	pthread_mutex_lock(&disasm_cache__lock);
+	disasm_cache__insert(dso, start, end, key, buf, size);
+	pthread_mutex_unlock(&disasm_cache__lock);
+
+	if (disasm_cache__filename(dso, start, end, key, filename,
+				   sizeof(filename)))
+		disasm_cache__write(filename, buf, size);
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_DISASM_CACHE_H
+#define __PERF_DISASM_CACHE_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+struct annotation_options;
+struct dso;
+
+/*
+ * The disassembler output for a symbol of a dso with a build-id, kept in
+ * memory and in the build-id cache directory of the dso, so annotating
+ * the same symbol again doesn't disassemble it again.  Entries are keyed
+ * by build-id, objdump address range and the options changing the output.
+ */
+int disasm_cache__find(struct dso *dso, u64 start, u64 end,
+		       struct annotation_options *opts,
+		       char **bufp, size_t *sizep);
+void disasm_cache__add(struct dso *dso, u64 start, u64 end,
+		       struct annotation_options *opts,
+		       const char *buf, size_t size);
+
+#endif /* __PERF_DISASM_CACHE_H */
@@ -1,10 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <asm/bug.h>
 #include <linux/kernel.h>
+#include <linux/hash.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -22,6 +24,7 @@
 #include "debug.h"
 #include "string2.h"
 #include "vdso.h"
+#include "unwind-cfi.h"
 
 static const char * const debuglink_paths[] = {
 	"%.0s%s",
@@ -438,7 +441,7 @@ static void dso__list_del(struct dso *dso)
 
 static void close_first_dso(void);
 
-static int do_open(char *name)
+static int do_open(const char *name)
 {
 	int fd;
 	char sbuf[STRERR_BUFSIZE];
@@ -459,11 +462,15 @@ static int do_open(char *name)
 	return -1;
 }
 
-static int __open_dso(struct dso *dso, struct machine *machine)
+/* nsi is set to get to the file through the root of its namespace */
+static int __open_dso(struct dso *dso, struct machine *machine,
+		      struct nsinfo *nsi)
 {
 	int fd = -EINVAL;
 	char *root_dir = (char *)"";
 	char *name = malloc(PATH_MAX);
+	char nspath[PATH_MAX];
+	const char *path;
 	bool decomp = false;
 
 	if (!name)
@@ -476,23 +483,25 @@ static int __open_dso(struct dso *dso, struct machine *machine)
 					    root_dir, name, PATH_MAX))
 		goto out;
 
-	if (!is_regular_file(name))
+	path = nsinfo__root_path(nsi, name, nspath, sizeof(nspath));
+	if (!is_regular_file(path))
 		goto out;
 
 	if (dso__needs_decompress(dso)) {
 		char newpath[KMOD_DECOMP_LEN];
 		size_t len = sizeof(newpath);
 
-		if (dso__decompress_kmodule_path(dso, name, newpath, len) < 0) {
+		if (dso__decompress_kmodule_path(dso, path, newpath, len) < 0) {
 			fd = -dso->load_errno;
 			goto out;
 		}
 
 		decomp = true;
 		strcpy(name, newpath);
+		path = name;
 	}
 
-	fd = do_open(name);
+	fd = do_open(path);
 
 	if (decomp)
 		unlink(name);
@@ -515,12 +524,22 @@ static int open_dso(struct dso *dso, struct machine *machine)
 {
 	int fd;
 	struct nscookie nsc;
+	struct nsinfo *nsi = NULL;
 
 	if (dso->binary_type != DSO_BINARY_TYPE__BUILD_ID_CACHE)
-		nsinfo__mountns_enter(dso->nsinfo, &nsc);
-	fd = __open_dso(dso, machine);
-	if (dso->binary_type != DSO_BINARY_TYPE__BUILD_ID_CACHE)
-		nsinfo__mountns_exit(&nsc);
+		nsi = dso->nsinfo;
+
+	/* the debuglink is read from the dso, in its namespace */
+	if (!nsinfo__has_root(nsi) ||
+	    dso->binary_type == DSO_BINARY_TYPE__DEBUGLINK) {
+		nsinfo__mountns_enter(nsi, &nsc);
+		nsi = NULL;
+	} else {
+		nsc.oldns = nsc.newns = -1;
+	}
+
+	fd = __open_dso(dso, machine, nsi);
+	nsinfo__mountns_exit(&nsc);
 
 	if (fd >= 0) {
 		dso__list_add(dso);
@@ -706,22 +725,65 @@ bool dso__data_status_seen(struct dso *dso, enum dso_data_status_seen by)
 	return false;
 }
 
+/*
+ * The chunks of all the dsos are on a global LRU list, the least recently
+ * read first, and are dropped from its head when they take more than
+ * dso__data_cache_budget. They are mapped from the file, read with pread()
+ * only when it can't be mapped.
+ *
+ * A chunk may be dropped while another thread reads some other dso, so
+ * the trees, the list and the reads from the chunks are all under
+ * dso__data_cache_lock.
+ */
+static LIST_HEAD(dso__data_cache_lru);
+static u64 dso__data_cache_total;
+static pthread_mutex_t dso__data_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+u64 dso__data_cache_budget = DSO__DATA_CACHE_BUDGET;
+
+static void dso_cache__delete(struct dso_cache *cache)
+{
+	if (cache->mapped)
+		munmap(cache->data, cache->size);
+	free(cache);
+}
+
+static void __dso_cache__remove(struct dso_cache *cache)
+{
+	rb_erase(&cache->rb_node, &cache->dso->data.cache);
+	list_del(&cache->lru);
+	dso__data_cache_total -= cache->size;
+	dso_cache__delete(cache);
+}
+
 static void
 dso_cache__free(struct dso *dso)
 {
 	struct rb_root *root = &dso->data.cache;
 	struct rb_node *next = rb_first(root);
 
-	pthread_mutex_lock(&dso->lock);
+	pthread_mutex_lock(&dso__data_cache_lock);
 	while (next) {
 		struct dso_cache *cache;
 
 		cache = rb_entry(next, struct dso_cache, rb_node);
 		next = rb_next(&cache->rb_node);
-		rb_erase(&cache->rb_node, root);
-		free(cache);
+		__dso_cache__remove(cache);
+	}
+	pthread_mutex_unlock(&dso__data_cache_lock);
+}
+
+/* Drop the least recently read chunks over the budget, but the one in use */
+static void dso_cache__shrink(struct dso_cache *keep)
+{
+	while (dso__data_cache_total > dso__data_cache_budget) {
+		struct dso_cache *cache;
+
+		cache = list_first_entry(&dso__data_cache_lru, struct dso_cache, lru);
+		if (cache == keep)
+			break;
+		__dso_cache__remove(cache);
 	}
-	pthread_mutex_unlock(&dso->lock);
 }
 
 static struct dso_cache *dso_cache__find(struct dso *dso, u64 offset)
@@ -758,7 +820,6 @@ dso_cache__insert(struct dso *dso, struct dso_cache *new)
 	struct dso_cache *cache;
 	u64 offset = new->offset;
 
-	pthread_mutex_lock(&dso->lock);
 	while (*p != NULL) {
 		u64 end;
 
@@ -771,16 +832,16 @@ dso_cache__insert(struct dso *dso, struct dso_cache *new)
 		else if (offset >= end)
 			p = &(*p)->rb_right;
 		else
-			goto out;
+			return cache;
 	}
 
 	rb_link_node(&new->rb_node, parent, p);
 	rb_insert_color(&new->rb_node, root);
 
-	cache = NULL;
-out:
-	pthread_mutex_unlock(&dso->lock);
-	return cache;
+	new->dso = dso;
+	list_add_tail(&new->lru, &dso__data_cache_lru);
+	dso__data_cache_total += new->size;
+	return NULL;
 }
 
 static ssize_t
@@ -794,60 +855,92 @@ dso_cache__memcpy(struct dso_cache *cache, u64 offset,
 	return cache_size;
 }
 
-static ssize_t
-dso_cache__read(struct dso *dso, struct machine *machine,
-		u64 offset, u8 *data, ssize_t size)
+/* Map the chunk at cache_offset, or read it when it can't be mapped */
+static struct dso_cache *dso_cache__load(struct dso *dso, u64 cache_offset,
+					 ssize_t *ret)
 {
 	struct dso_cache *cache;
-	struct dso_cache *old;
-	ssize_t ret;
-
-	do {
-		u64 cache_offset;
+	size_t len = 0;
+	void *data;
+
+	if (cache_offset < dso->data.file_size)
+		len = min((u64)DSO__DATA_CACHE_SIZE, dso->data.file_size - cache_offset);
+
+	if (len) {
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, dso->data.fd, cache_offset);
+		if (data != MAP_FAILED) {
+			cache = zalloc(sizeof(*cache));
+			if (!cache) {
+				munmap(data, len);
+				*ret = -ENOMEM;
+				return NULL;
+			}
+			cache->data   = data;
+			cache->mapped = true;
+			cache->offset = cache_offset;
+			cache->size   = len;
+			*ret = len;
+			return cache;
+		}
+	}
 
-		cache = zalloc(sizeof(*cache) + DSO__DATA_CACHE_SIZE);
-		if (!cache)
-			return -ENOMEM;
+	cache = zalloc(sizeof(*cache) + DSO__DATA_CACHE_SIZE);
+	if (!cache) {
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	cache->data = (char *)(cache + 1);
 
-		pthread_mutex_lock(&dso__data_open_lock);
+	*ret = pread(dso->data.fd, cache->data, DSO__DATA_CACHE_SIZE, cache_offset);
+	if (*ret <= 0) {
+		free(cache);
+		return NULL;
+	}
 
-		/*
-		 * dso->data.fd might be closed if other thread opened another
-		 * file (dso) due to open file limit (RLIMIT_NOFILE).
-		 */
-		try_to_open_dso(dso, machine);
+	cache->offset = cache_offset;
+	cache->size   = *ret;
+	return cache;
+}
 
-		if (dso->data.fd < 0) {
-			ret = -errno;
-			dso->data.status = DSO_DATA_STATUS_ERROR;
-			break;
-		}
+static ssize_t
+dso_cache__read(struct dso *dso, struct machine *machine,
+		u64 offset, u8 *data, ssize_t size)
+{
+	struct dso_cache *cache = NULL;
+	struct dso_cache *old;
+	ssize_t ret;
 
-		cache_offset = offset & DSO__DATA_CACHE_MASK;
+	pthread_mutex_lock(&dso__data_open_lock);
 
-		ret = pread(dso->data.fd, cache->data, DSO__DATA_CACHE_SIZE, cache_offset);
-		if (ret <= 0)
-			break;
+	/*
+	 * dso->data.fd might be closed if other thread opened another
+	 * file (dso) due to open file limit (RLIMIT_NOFILE).
+	 */
+	try_to_open_dso(dso, machine);
 
-		cache->offset = cache_offset;
-		cache->size   = ret;
-	} while (0);
+	if (dso->data.fd < 0) {
+		ret = -errno;
+		dso->data.status = DSO_DATA_STATUS_ERROR;
+	} else {
+		cache = dso_cache__load(dso, offset & DSO__DATA_CACHE_MASK, &ret);
+	}
 
 	pthread_mutex_unlock(&dso__data_open_lock);
 
-	if (ret > 0) {
-		old = dso_cache__insert(dso, cache);
-		if (old) {
-			/* we lose the race */
-			free(cache);
-			cache = old;
-		}
+	if (!cache)
+		return ret;
 
-		ret = dso_cache__memcpy(cache, offset, data, size);
+	pthread_mutex_lock(&dso__data_cache_lock);
+	old = dso_cache__insert(dso, cache);
+	if (old) {
+		/* we lose the race */
+		dso_cache__delete(cache);
+		cache = old;
 	}
 
-	if (ret <= 0)
-		free(cache);
+	ret = dso_cache__memcpy(cache, offset, data, size);
+	dso_cache__shrink(cache);
+	pthread_mutex_unlock(&dso__data_cache_lock);
 
 	return ret;
 }
@@ -856,12 +949,19 @@ static ssize_t dso_cache_read(struct dso *dso, struct machine *machine,
 			      u64 offset, u8 *data, ssize_t size)
 {
 	struct dso_cache *cache;
+	ssize_t ret;
 
+	pthread_mutex_lock(&dso__data_cache_lock);
 	cache = dso_cache__find(dso, offset);
+	if (cache) {
+		list_move_tail(&cache->lru, &dso__data_cache_lru);
+		ret = dso_cache__memcpy(cache, offset, data, size);
+	}
+	pthread_mutex_unlock(&dso__data_cache_lock);
+
 	if (cache)
-		return dso_cache__memcpy(cache, offset, data, size);
-	else
-		return dso_cache__read(dso, machine, offset, data, size);
+		return ret;
+	return dso_cache__read(dso, machine, offset, data, size);
 }
 
 /*
@@ -1099,9 +1199,27 @@ static inline struct dso *__dso__find_by_longname(struct rb_root *root,
 	return __dso__findlink_by_longname(root, NULL, name);
 }
 
+static u32 dso__name_hash(const char *name)
+{
+	u32 hash = 2166136261U;
+
+	/* FNV-1a */
+	for (; *name; name++)
+		hash = (hash ^ (u8)*name) * 16777619;
+
+	return hash;
+}
+
+static struct hlist_head *dsos__name_head(struct dsos *dsos, u32 hash)
+{
+	return &dsos->name_hash[hash_32(hash, dsos->hash_bits)];
+}
+
 void dso__set_long_name(struct dso *dso, const char *name, bool name_allocated)
 {
 	struct rb_root *root = dso->root;
+	struct dsos *dsos = root ? container_of(root, struct dsos, root) : NULL;
+	bool hashed = !hlist_unhashed(&dso->name_node);
 
 	if (name == NULL)
 		return;
@@ -1119,12 +1237,21 @@ void dso__set_long_name(struct dso *dso, const char *name, bool name_allocated)
 		dso->root = NULL;
 	}
 
+	if (dsos && hashed)
+		hlist_del_init(&dso->name_node);
+
 	dso->long_name		 = name;
 	dso->long_name_len	 = strlen(name);
+	dso->long_name_hash	 = dso__name_hash(name);
 	dso->long_name_allocated = name_allocated;
+	dso->filter		 = SYMBOL_FILTER__UNCHECKED;
 
 	if (root)
 		__dso__findlink_by_longname(root, dso, NULL);
+
+	if (dsos && hashed)
+		hlist_add_head(&dso->name_node,
+			       dsos__name_head(dsos, dso->long_name_hash));
 }
 
 void dso__set_short_name(struct dso *dso, const char *name, bool name_allocated)
@@ -1138,6 +1265,7 @@ void dso__set_short_name(struct dso *dso, const char *name, bool name_allocated)
 	dso->short_name		  = name;
 	dso->short_name_len	  = strlen(name);
 	dso->short_name_allocated = name_allocated;
+	dso->filter		  = SYMBOL_FILTER__UNCHECKED;
 }
 
 static void dso__set_basename(struct dso *dso)
@@ -1209,6 +1337,8 @@ struct dso *dso__new(const char *name)
 		dso->data.cache = RB_ROOT;
 		dso->inlined_nodes = RB_ROOT_CACHED;
 		dso->srclines = RB_ROOT_CACHED;
+		dso->a2l_srclines = RB_ROOT_CACHED;
+		arena__init(&dso->symbols_arena, MEM_STAT__SYMBOLS);
 		dso->data.fd = -1;
 		dso->data.status = DSO_DATA_STATUS_UNKNOWN;
 		dso->symtab_type = DSO_BINARY_TYPE__NOT_FOUND;
@@ -1240,10 +1370,16 @@ void dso__delete(struct dso *dso)
 		pr_err("DSO %s is still in rbtree when being deleted!\n",
 		       dso->long_name);
 
+	/* save what was looked up, before the trees go away */
+	dso__exit_srcline_cache(dso);
+
 	/* free inlines first, as they reference symbols */
 	inlines__tree_delete(&dso->inlined_nodes);
 	srcline__tree_delete(&dso->srclines);
+	srcline__tree_delete(&dso->a2l_srclines);
 	symbols__delete(&dso->symbols);
+	arena__exit(&dso->symbols_arena);
+	zfree(&dso->symbols_array);
 
 	if (dso->short_name_allocated) {
 		zfree((char **)&dso->short_name);
@@ -1256,9 +1392,11 @@ void dso__delete(struct dso *dso)
 	}
 
 	dso__data_close(dso);
+	dso__cfi_free(dso);
 	auxtrace_cache__free(dso->auxtrace_cache);
 	dso_cache__free(dso);
 	dso__free_a2l(dso);
+	dso__put(dso->shared);
 	zfree(&dso->symsrc_filename);
 	nsinfo__zput(dso->nsinfo);
 	pthread_mutex_destroy(&dso->lock);
@@ -1289,6 +1427,21 @@ bool dso__build_id_equal(const struct dso *dso, u8 *build_id)
 	return memcmp(dso->build_id, build_id, sizeof(dso->build_id)) == 0;
 }
 
+/*
+ * Orders the dsos with a build-id before the ones without, and those by
+ * build-id, so that the same binary in different sessions compares equal.
+ */
+int dso__cmp_build_id(const struct dso *a, const struct dso *b)
+{
+	if (a->has_build_id != b->has_build_id)
+		return a->has_build_id ? -1 : 1;
+
+	if (!a->has_build_id)
+		return 0;
+
+	return memcmp(a->build_id, b->build_id, sizeof(a->build_id));
+}
+
 void dso__read_running_kernel_build_id(struct dso *dso, struct machine *machine)
 {
 	char path[PATH_MAX];
@@ -1327,16 +1480,20 @@ bool __dsos__read_build_ids(struct list_head *head, bool with_hits)
 	bool have_build_id = false;
 	struct dso *pos;
 	struct nscookie nsc;
+	char nspath[PATH_MAX];
 
 	list_for_each_entry(pos, head, node) {
+		const char *path;
+
 		if (with_hits && !pos->hit && !dso__is_vdso(pos))
 			continue;
 		if (pos->has_build_id) {
 			have_build_id = true;
 			continue;
 		}
-		nsinfo__mountns_enter(pos->nsinfo, &nsc);
-		if (filename__read_build_id(pos->long_name, pos->build_id,
+		path = nsinfo__mountns_path(pos->nsinfo, pos->long_name,
+					    nspath, sizeof(nspath), &nsc);
+		if (filename__read_build_id(path, pos->build_id,
 					    sizeof(pos->build_id)) > 0) {
 			have_build_id	  = true;
 			pos->has_build_id = true;
@@ -1347,10 +1504,66 @@ bool __dsos__read_build_ids(struct list_head *head, bool with_hits)
 	return have_build_id;
 }
 
+#define DSOS__HASH_MIN_BITS	8
+
+static bool dso_id__equal(const struct dso_id *a, const struct dso_id *b)
+{
+	return a->ino == b->ino && a->ino_generation == b->ino_generation &&
+	       a->maj == b->maj && a->min == b->min;
+}
+
+static struct hlist_head *dsos__id_head(struct dsos *dsos, const struct dso_id *id)
+{
+	u64 hash = hash_64(((u64)id->maj << 32 | id->min) ^
+			   hash_64(id->ino ^ id->ino_generation, 64), 64);
+
+	return &dsos->id_hash[hash_64(hash, dsos->hash_bits)];
+}
+
+/*
+ * Rebuilt from the list, so that the dsos added while a table couldn't be
+ * allocated get hashed too, the lookups use the rbtree until it can be.
+ */
+static void dsos__hash_resize(struct dsos *dsos, unsigned int bits)
+{
+	struct hlist_head *name_hash, *id_hash;
+	struct dso *pos;
+
+	name_hash = calloc(1UL << bits, sizeof(*name_hash));
+	id_hash = calloc(1UL << bits, sizeof(*id_hash));
+	if (!name_hash || !id_hash) {
+		free(name_hash);
+		free(id_hash);
+		return;
+	}
+
+	free(dsos->name_hash);
+	free(dsos->id_hash);
+	dsos->name_hash = name_hash;
+	dsos->id_hash = id_hash;
+	dsos->hash_bits = bits;
+
+	list_for_each_entry(pos, &dsos->head, node) {
+		hlist_add_head(&pos->name_node,
+			       dsos__name_head(dsos, pos->long_name_hash));
+		if (pos->id.ino)
+			hlist_add_head(&pos->id_node, dsos__id_head(dsos, &pos->id));
+	}
+}
+
 void __dsos__add(struct dsos *dsos, struct dso *dso)
 {
+	if (!dsos->name_hash)
+		dsos__hash_resize(dsos, DSOS__HASH_MIN_BITS);
+	else if (dsos->nr >= (2U << dsos->hash_bits))
+		dsos__hash_resize(dsos, dsos->hash_bits + 1);
+
 	list_add_tail(&dso->node, &dsos->head);
 	__dso__findlink_by_longname(&dsos->root, dso, NULL);
+	if (dsos->name_hash)
+		hlist_add_head(&dso->name_node,
+			       dsos__name_head(dsos, dso->long_name_hash));
+	dsos->nr++;
 	/*
 	 * It is now in the linked list, grab a reference, then garbage collect
 	 * this when needing memory, by looking at LRU dso instances in the
@@ -1384,6 +1597,7 @@ void dsos__add(struct dsos *dsos, struct dso *dso)
 struct dso *__dsos__find(struct dsos *dsos, const char *name, bool cmp_short)
 {
 	struct dso *pos;
+	u32 hash;
 
 	if (cmp_short) {
 		list_for_each_entry(pos, &dsos->head, node)
@@ -1391,7 +1605,16 @@ struct dso *__dsos__find(struct dsos *dsos, const char *name, bool cmp_short)
 				return pos;
 		return NULL;
 	}
-	return __dso__find_by_longname(&dsos->root, name);
+
+	if (!dsos->name_hash)
+		return __dso__find_by_longname(&dsos->root, name);
+
+	hash = dso__name_hash(name);
+	hlist_for_each_entry(pos, dsos__name_head(dsos, hash), name_node) {
+		if (pos->long_name_hash == hash && !strcmp(pos->long_name, name))
+			return pos;
+	}
+	return NULL;
 }
 
 struct dso *dsos__find(struct dsos *dsos, const char *name, bool cmp_short)
@@ -1432,6 +1655,97 @@ struct dso *dsos__findnew(struct dsos *dsos, const char *name)
 	return dso;
 }
 
+static struct dso *__dsos__find_id(struct dsos *dsos, const char *name,
+				    struct dso_id *id)
+{
+	struct dso *pos;
+
+	if (!dsos->id_hash)
+		return NULL;
+
+	hlist_for_each_entry(pos, dsos__id_head(dsos, id), id_node) {
+		if (dso_id__equal(&pos->id, id) && !strcmp(pos->long_name, name))
+			return pos;
+	}
+	return NULL;
+}
+
+/*
+ * dsos__findnew() for the file of a mmap: the same files get mmapped over
+ * and over by the processes of a workload, those are found by the device
+ * and inode of the file, under the read lock, the path only compared to
+ * the one of the dso found.  The dsos are still one per path.
+ */
+struct dso *dsos__findnew_id(struct dsos *dsos, const char *name,
+			     struct dso_id *id)
+{
+	struct dso *dso;
+
+	if (!id->ino)
+		return dsos__findnew(dsos, name);
+
+	down_read(&dsos->lock);
+	dso = dso__get(__dsos__find_id(dsos, name, id));
+	up_read(&dsos->lock);
+	if (dso)
+		return dso;
+
+	down_write(&dsos->lock);
+	dso = __dsos__findnew(dsos, name);
+	if (dso && dsos->id_hash) {
+		/* a file replaced by another one of the same path */
+		if (dso->id.ino)
+			hlist_del(&dso->id_node);
+		dso->id = *id;
+		hlist_add_head(&dso->id_node, dsos__id_head(dsos, id));
+	}
+	dso = dso__get(dso);
+	up_write(&dsos->lock);
+
+	return dso;
+}
+
+static bool dso__shareable(struct dso *dso)
+{
+	return dso->has_build_id && dso->kernel == DSO_TYPE_USER &&
+	       !dso__is_vdso(dso);
+}
+
+/*
+ * The same binary mapped from different paths, in different containers
+ * or through bind mounts, gets a dso per path. Their maps all use the
+ * first dso of dsos with the build-id of dso instead, so that the
+ * symbols, srclines and data caches are built once, for it.
+ *
+ * Returns a reference to the dso the maps of dso are to use.
+ */
+struct dso *dsos__shared(struct dsos *dsos, struct dso *dso)
+{
+	struct dso *pos, *shared;
+
+	if (!symbol_conf.share_dsos || !dso__shareable(dso))
+		return dso__get(dso);
+
+	down_write(&dsos->lock);
+	if (!dso->shared_checked) {
+		list_for_each_entry(pos, &dsos->head, node) {
+			/* the first of them, the others use it */
+			if (pos == dso)
+				break;
+			if (dso__shareable(pos) &&
+			    dso__build_id_equal(pos, dso->build_id)) {
+				dso->shared = dso__get(pos);
+				break;
+			}
+		}
+		dso->shared_checked = true;
+	}
+	shared = dso__get(dso->shared ?: dso);
+	up_write(&dsos->lock);
+
+	return shared;
+}
+
 size_t __dsos__fprintf_buildid(struct list_head *head, FILE *fp,
 			       bool (skip)(struct dso *dso, int parm), int parm)
 {
@@ -9,6 +9,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "rwsem.h"
+#include "arena.h"
 #include <linux/bitops.h>
 #include "build-id.h"
 
@@ -116,41 +117,76 @@ enum dso_load_errno {
 	____r;						\
 })
 
-#define DSO__DATA_CACHE_SIZE 4096
-#define DSO__DATA_CACHE_MASK ~(DSO__DATA_CACHE_SIZE - 1)
+#define DSO__DATA_CACHE_SIZE (64 * 1024)
+#define DSO__DATA_CACHE_MASK ~((u64)DSO__DATA_CACHE_SIZE - 1)
+/* The default of the size all the chunks cached may take, core.dso-cache-size */
+#define DSO__DATA_CACHE_BUDGET (256ULL * 1024 * 1024)
+
+extern u64 dso__data_cache_budget;
 
 struct dso_cache {
 	struct rb_node	rb_node;
+	struct list_head lru;
+	struct dso	*dso;
 	u64 offset;
 	u64 size;
-	char data[0];
+	bool mapped;
+	char *data;
+};
+
+/* The file a dso was last mmapped from, see dsos__findnew_id() */
+struct dso_id {
+	u32	maj;
+	u32	min;
+	u64	ino;
+	u64	ino_generation;
 };
 
 /*
- * DSOs are put into both a list for fast iteration and rbtree for fast
- * long name lookup.
+ * DSOs are put into both a list for fast iteration and rbtree for
+ * ordered long name insertion, with the hashes over their long names and
+ * the files they were mmapped from for the lookups.
  */
 struct dsos {
 	struct list_head head;
 	struct rb_root	 root;	/* rbtree root sorted by long name */
+	struct hlist_head *name_hash;
+	struct hlist_head *id_hash;
+	unsigned int	 hash_bits;
+	unsigned int	 nr;
 	struct rw_semaphore lock;
 };
 
 struct auxtrace_cache;
 
+struct symbols_array;
+struct srcline_cache;
+struct dso_cfi;
+
 struct dso {
 	pthread_mutex_t	 lock;
 	struct list_head node;
 	struct rb_node	 rb_node;	/* rbtree node sorted by long name */
 	struct rb_root	 *root;		/* root of rbtree that rb_node is in */
+	struct hlist_node name_node;	/* in dsos->name_hash */
+	struct hlist_node id_node;	/* in dsos->id_hash, when id.ino is set */
+	struct dso_id	 id;
 	struct rb_root_cached symbols;
+	/* the symbols of user dsos, see dso__new_symbol() */
+	struct arena	 symbols_arena;
 	struct rb_root_cached symbol_names;
 	struct rb_root_cached inlined_nodes;
 	struct rb_root_cached srclines;
+	/* file:line of objdump addresses, see dso__resolve_srclines() */
+	struct rb_root_cached a2l_srclines;
+	/* srclines and inlines read back from the build-id cache */
+	struct srcline_cache *srcline_cache;
 	struct {
 		u64		addr;
 		struct symbol	*symbol;
 	} last_find_result;
+	/* frozen copy of symbols for dso__find_symbol(), built once loaded */
+	struct symbols_array *symbols_array;
 	void		 *a2l;
 	char		 *symsrc_filename;
 	unsigned int	 a2l_fails;
@@ -162,19 +198,26 @@ struct dso {
 	u8		 adjust_symbols:1;
 	u8		 has_build_id:1;
 	u8		 has_srcline:1;
+	u8		 srcline_cache_loaded:1;
+	u8		 srcline_cache_dirty:1;
 	u8		 hit:1;
 	u8		 annotate_warned:1;
 	u8		 short_name_allocated:1;
 	u8		 long_name_allocated:1;
 	u8		 is_64_bit:1;
+	u8		 shared_checked:1;
+	u8		 filter;	/* enum symbol_filter, for --dsos */
 	bool		 sorted_by_name;
 	bool		 loaded;
 	u8		 rel;
 	u8		 build_id[BUILD_ID_SIZE];
+	/* the dso of the same build-id the maps of this one use, see dsos__shared() */
+	struct dso	 *shared;
 	u64		 text_offset;
 	const char	 *short_name;
 	const char	 *long_name;
 	u16		 long_name_len;
+	u32		 long_name_hash;
 	u16		 short_name_len;
 	void		*dwfl;			/* DWARF debug info */
 	struct auxtrace_cache *auxtrace_cache;
@@ -190,6 +233,8 @@ struct dso {
 		struct list_head open_entry;
 		u64		 debug_frame_offset;
 		u64		 eh_frame_hdr_offset;
+		struct dso_cfi	 *cfi;
+		bool		 cfi_loaded;
 	} data;
 	/* bpf prog information */
 	struct {
@@ -253,6 +298,7 @@ void dso__sort_by_name(struct dso *dso);
 
 void dso__set_build_id(struct dso *dso, void *build_id);
 bool dso__build_id_equal(const struct dso *dso, u8 *build_id);
+int dso__cmp_build_id(const struct dso *a, const struct dso *b);
 void dso__read_running_kernel_build_id(struct dso *dso,
 				       struct machine *machine);
 int dso__kernel_module_get_build_id(struct dso *dso, const char *root_dir);
@@ -351,6 +397,9 @@ struct dso *__dsos__find(struct dsos *dsos, const char *name, bool cmp_short);
 struct dso *dsos__find(struct dsos *dsos, const char *name, bool cmp_short);
 struct dso *__dsos__findnew(struct dsos *dsos, const char *name);
 struct dso *dsos__findnew(struct dsos *dsos, const char *name);
+struct dso *dsos__findnew_id(struct dsos *dsos, const char *name,
+			     struct dso_id *id);
+struct dso *dsos__shared(struct dsos *dsos, struct dso *dso);
 bool __dsos__read_build_ids(struct list_head *head, bool with_hits);
 
 void dso__reset_find_symbol_cache(struct dso *dso);
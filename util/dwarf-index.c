@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/kernel.h>
+#include <api/fs/fs.h>
+
+#include "build-id.h"
+#include "debug.h"
+#include "dwarf-aux.h"
+#include "string2.h"
+#include "util.h"
+#include "dwarf-index.h"
+
+/*
+ * ~/.debug/<path>/<build-id>/dwarf-index:
+ *
+ *   struct dwarf_index_header
+ *   struct dwarf_index_entry[nr_entries], sorted by name and CU
+ *   the names, NUL terminated
+ *
+ * The build-id is that of the debuginfo, so the index is never stale.
+ */
+#define DWARF_INDEX_FILE	"dwarf-index"
+#define DWARF_INDEX_MAGIC	0x5844494652415744ULL	/* "DWARFIDX" */
+#define DWARF_INDEX_VERSION	1
+
+struct dwarf_index_header {
+	u64	magic;
+	u32	version;
+	u32	nr_entries;
+	u64	names_size;
+};
+
+struct dwarf_index_entry {
+	u64	name;		/* offset in the names */
+	u64	cu;		/* of the CU DIE */
+};
+
+struct dwarf_index {
+	void			 *buf;
+	struct dwarf_index_entry *entries;
+	u32			 nr_entries;
+	const char		 *names;
+	u64			 names_size;
+};
+
+/* While building it, the names point into the DWARF */
+struct dwarf_index_name {
+	const char	*name;
+	Dwarf_Off	cu;
+};
+
+struct dwarf_index_builder {
+	struct dwarf_index_name *entries;
+	size_t		nr;
+	size_t		alloc;
+	Dwarf_Off	cu;
+	int		err;
+};
+
+static char *dwarf_index__filename(Dwfl_Module *mod, const char *path, bool mkdir)
+{
+	char sbuild_id[SBUILD_ID_SIZE], *dir, *filename = NULL;
+	const unsigned char *bits;
+	GElf_Addr vaddr;
+	int len;
+
+	len = dwfl_module_build_id(mod, &bits, &vaddr);
+	if (len <= 0 || len > BUILD_ID_SIZE)
+		return NULL;
+
+	build_id__sprintf(bits, len, sbuild_id);
+
+	dir = build_id_cache__cachedir(sbuild_id, path, NULL, false, false);
+	if (dir == NULL)
+		return NULL;
+
+	if ((!mkdir || !mkdir_p(dir, 0755)) &&
+	    asprintf(&filename, "%s/" DWARF_INDEX_FILE, dir) < 0)
+		filename = NULL;
+
+	free(dir);
+	return filename;
+}
+
+static int dwarf_index__read(struct dwarf_index *idx, const char *filename)
+{
+	struct dwarf_index_header *hdr;
+	size_t size;
+	char *buf;
+
+	if (filename__read_str(filename, &buf, &size))
+		return -ENOENT;
+
+	hdr = (void *)buf;
+	if (size < sizeof(*hdr) || hdr->magic != DWARF_INDEX_MAGIC ||
+	    hdr->version != DWARF_INDEX_VERSION ||
+	    size != sizeof(*hdr) + hdr->nr_entries * sizeof(idx->entries[0]) +
+		    hdr->names_size) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	idx->buf	= buf;
+	idx->entries	= (void *)(hdr + 1);
+	idx->nr_entries	= hdr->nr_entries;
+	idx->names	= (void *)(idx->entries + idx->nr_entries);
+	idx->names_size	= hdr->names_size;
+	return 0;
+}
+
+static void dwarf_index__write(struct dwarf_index *idx, const char *filename)
+{
+	struct dwarf_index_header hdr = {
+		.magic	    = DWARF_INDEX_MAGIC,
+		.version    = DWARF_INDEX_VERSION,
+		.nr_entries = idx->nr_entries,
+		.names_size = idx->names_size,
+	};
+	char tmpname[PATH_MAX];
+	int fd;
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return;
+
+	if (writen(fd, &hdr, sizeof(hdr)) < 0 ||
+	    writen(fd, idx->entries, idx->nr_entries * sizeof(idx->entries[0])) < 0 ||
+	    writen(fd, idx->names, idx->names_size) < 0 ||
+	    close(fd) || rename(tmpname, filename)) {
+		pr_debug("Failed to write the DWARF index %s\n", filename);
+		unlink(tmpname);
+		return;
+	}
+
+	pr_debug("Wrote the DWARF index %s\n", filename);
+}
+
+static void dwarf_index_builder__add(struct dwarf_index_builder *b, const char *name)
+{
+	if (b->nr == b->alloc) {
+		size_t alloc = b->alloc ? b->alloc * 2 : 4096;
+		void *entries = realloc(b->entries, alloc * sizeof(b->entries[0]));
+
+		if (entries == NULL) {
+			b->err = -ENOMEM;
+			return;
+		}
+		b->entries = entries;
+		b->alloc   = alloc;
+	}
+
+	b->entries[b->nr].name = name;
+	b->entries[b->nr].cu   = b->cu;
+	b->nr++;
+}
+
+/* What probe_point_search_cb() and line_range_search_cb() look for */
+static int dwarf_index__func_cb(Dwarf_Die *sp_die, void *data)
+{
+	struct dwarf_index_builder *b = data;
+	const char *name, *linkage;
+
+	if (!die_is_func_def(sp_die))
+		return DWARF_CB_OK;
+
+	name = dwarf_diename(sp_die);
+	if (name)
+		dwarf_index_builder__add(b, name);
+
+	linkage = die_get_linkage_name(sp_die);
+	if (linkage && (!name || strcmp(name, linkage)))
+		dwarf_index_builder__add(b, linkage);
+
+	return b->err ? DWARF_CB_ABORT : DWARF_CB_OK;
+}
+
+static int dwarf_index_name__cmp(const void *a, const void *b)
+{
+	const struct dwarf_index_name *ea = a, *eb = b;
+	int cmp = strcmp(ea->name, eb->name);
+
+	if (cmp)
+		return cmp;
+	return ea->cu < eb->cu ? -1 : ea->cu > eb->cu;
+}
+
+static int dwarf_index__build(struct dwarf_index *idx, Dwarf *dbg)
+{
+	struct dwarf_index_builder b = { .nr = 0, };
+	Dwarf_Off off = 0, noff;
+	size_t cuhl, i, nr = 0;
+	u64 name = 0;
+	Dwarf_Die cu_die;
+	char *names;
+
+	while (!b.err && !dwarf_nextcu(dbg, off, &noff, &cuhl, NULL, NULL, NULL)) {
+		if (dwarf_offdie(dbg, off + cuhl, &cu_die)) {
+			b.cu = off + cuhl;
+			dwarf_getfuncs(&cu_die, dwarf_index__func_cb, &b, 0);
+		}
+		off = noff;
+	}
+
+	if (b.err)
+		goto out_free;
+
+	qsort(b.entries, b.nr, sizeof(b.entries[0]), dwarf_index_name__cmp);
+
+	idx->names_size = 0;
+	for (i = 0; i < b.nr; i++) {
+		if (!i || strcmp(b.entries[i].name, b.entries[i - 1].name))
+			idx->names_size += strlen(b.entries[i].name) + 1;
+	}
+
+	b.err = -ENOMEM;
+	idx->buf = malloc(b.nr * sizeof(idx->entries[0]) + idx->names_size);
+	if (idx->buf == NULL)
+		goto out_free;
+
+	idx->entries = idx->buf;
+	names = (char *)(idx->entries + b.nr);
+	idx->names = names;
+
+	for (i = 0; i < b.nr; i++) {
+		bool same = i && !strcmp(b.entries[i].name, b.entries[i - 1].name);
+
+		/* once per CU */
+		if (same && b.entries[i].cu == b.entries[i - 1].cu)
+			continue;
+
+		if (!same) {
+			name = names - idx->names;
+			names = stpcpy(names, b.entries[i].name) + 1;
+		}
+		idx->entries[nr].name = name;
+		idx->entries[nr].cu   = b.entries[i].cu;
+		nr++;
+	}
+	idx->nr_entries = nr;
+	b.err = 0;
+
+out_free:
+	free(b.entries);
+	return b.err;
+}
+
+struct dwarf_index *dwarf_index__new(Dwarf *dbg, Dwfl_Module *mod, const char *path)
+{
+	struct dwarf_index *idx = zalloc(sizeof(*idx));
+	char *filename;
+
+	if (idx == NULL)
+		return NULL;
+
+	filename = dwarf_index__filename(mod, path, false);
+	if (filename && !dwarf_index__read(idx, filename)) {
+		pr_debug("Read the DWARF index %s\n", filename);
+		free(filename);
+		return idx;
+	}
+	free(filename);
+
+	if (dwarf_index__build(idx, dbg)) {
+		free(idx);
+		return NULL;
+	}
+
+	/* without a build-id it's only for the probes of this run */
+	filename = dwarf_index__filename(mod, path, true);
+	if (filename) {
+		dwarf_index__write(idx, filename);
+		free(filename);
+	}
+
+	return idx;
+}
+
+void dwarf_index__delete(struct dwarf_index *idx)
+{
+	if (idx) {
+		free(idx->buf);
+		free(idx);
+	}
+}
+
+static int dwarf_index__add_cu(Dwarf_Off **cus, int nr, Dwarf_Off cu)
+{
+	Dwarf_Off *n;
+
+	/* grown 64 at a time */
+	if (!(nr & 63)) {
+		n = realloc(*cus, (nr + 64) * sizeof(*n));
+		if (n == NULL)
+			return -ENOMEM;
+		*cus = n;
+	}
+	(*cus)[nr] = cu;
+	return nr + 1;
+}
+
+static int dwarf_off__cmp(const void *a, const void *b)
+{
+	const Dwarf_Off *oa = a, *ob = b;
+
+	return *oa < *ob ? -1 : *oa > *ob;
+}
+
+int dwarf_index__find_cus(struct dwarf_index *idx, const char *glob, Dwarf_Off **cus)
+{
+	u32 i, lo = 0, hi = idx->nr_entries;
+	int nr = 0, j, n;
+
+	*cus = NULL;
+
+	if (strisglob(glob)) {
+		bool match = false;
+
+		/* the entries of a name are together, it is matched once */
+		for (i = 0; i < idx->nr_entries && nr >= 0; i++) {
+			if (!i || idx->entries[i].name != idx->entries[i - 1].name)
+				match = strglobmatch(idx->names + idx->entries[i].name, glob);
+			if (match)
+				nr = dwarf_index__add_cu(cus, nr, idx->entries[i].cu);
+		}
+	} else {
+		/* the first entry with the name */
+		while (lo < hi) {
+			u32 mid = (lo + hi) / 2;
+
+			if (strcmp(idx->names + idx->entries[mid].name, glob) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (i = lo; i < idx->nr_entries && nr >= 0 &&
+			     !strcmp(idx->names + idx->entries[i].name, glob); i++)
+			nr = dwarf_index__add_cu(cus, nr, idx->entries[i].cu);
+	}
+
+	if (nr < 0) {
+		zfree(cus);
+		return nr;
+	}
+
+	/* in the order of the CUs, without the ones found for two names */
+	qsort(*cus, nr, sizeof(**cus), dwarf_off__cmp);
+	for (j = n = 0; j < nr; j++) {
+		if (!n || (*cus)[n - 1] != (*cus)[j])
+			(*cus)[n++] = (*cus)[j];
+	}
+
+	return n;
+}
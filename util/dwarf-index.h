@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_DWARF_INDEX_H
+#define __PERF_DWARF_INDEX_H
+
+#include <elfutils/libdw.h>
+#include <elfutils/libdwfl.h>
+
+/*
+ * The CUs defining each function, for probe-finder not to walk all the
+ * CUs of a big vmlinux for every probe. Built on first use and kept in
+ * the build-id cache directory of the binary, see dwarf-index.c.
+ */
+struct dwarf_index;
+
+struct dwarf_index *dwarf_index__new(Dwarf *dbg, Dwfl_Module *mod, const char *path);
+void dwarf_index__delete(struct dwarf_index *idx);
+
+/*
+ * The DIE offsets of the CUs with a definition of a function whose name
+ * or linkage name matches glob, sorted, in *cus to be freed. Returns how
+ * many or a negative errno.
+ */
+int dwarf_index__find_cus(struct dwarf_index *idx, const char *glob, Dwarf_Off **cus);
+
+#endif /* __PERF_DWARF_INDEX_H */
@@ -1,10 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "cpumap.h"
+#include "cputopo.h"
+#include "cgroup.h"
 #include "env.h"
+#include "header.h"
 #include "sane_ctype.h"
 #include "util.h"
 #include "bpf-event.h"
 #include <errno.h>
+#include <unistd.h>
 #include <sys/utsname.h>
 #include <bpf/libbpf.h>
 
@@ -47,6 +51,8 @@ struct bpf_prog_info_node *perf_env__find_bpf_prog_info(struct perf_env *env,
 	struct bpf_prog_info_node *node = NULL;
 	struct rb_node *n;
 
+	perf_env__read_feat(env, HEADER_BPF_PROG_INFO);
+
 	down_read(&env->bpf_progs.lock);
 	n = env->bpf_progs.infos.rb_node;
 
@@ -101,6 +107,8 @@ struct btf_node *perf_env__find_btf(struct perf_env *env, __u32 btf_id)
 	struct btf_node *node = NULL;
 	struct rb_node *n;
 
+	perf_env__read_feat(env, HEADER_BPF_BTF);
+
 	down_read(&env->bpf_progs.lock);
 	n = env->bpf_progs.btfs.rb_node;
 
@@ -164,6 +172,7 @@ void perf_env__exit(struct perf_env *env)
 	int i;
 
 	perf_env__purge_bpf(env);
+	perf_env__purge_cgroups(env);
 	zfree(&env->hostname);
 	zfree(&env->os_release);
 	zfree(&env->version);
@@ -188,6 +197,14 @@ void perf_env__exit(struct perf_env *env)
 	for (i = 0; i < env->nr_memory_nodes; i++)
 		free(env->memory_nodes[i].set);
 	zfree(&env->memory_nodes);
+	zfree(&env->time_index);
+	zfree(&env->record_stats);
+
+	if (env->lazy) {
+		close(env->lazy->fd);
+		pthread_mutex_destroy(&env->lazy->lock);
+		zfree(&env->lazy);
+	}
 }
 
 void perf_env__init(struct perf_env *env)
@@ -195,6 +212,8 @@ void perf_env__init(struct perf_env *env)
 	env->bpf_progs.infos = RB_ROOT;
 	env->bpf_progs.btfs = RB_ROOT;
 	init_rwsem(&env->bpf_progs.lock);
+	env->cgroups.tree = RB_ROOT;
+	init_rwsem(&env->cgroups.lock);
 }
 
 int perf_env__set_cmdline(struct perf_env *env, int argc, const char *argv[])
@@ -252,6 +271,93 @@ int perf_env__read_cpu_topology_map(struct perf_env *env)
 	return 0;
 }
 
+static int perf_env__get_cpu(struct perf_env *env, struct cpu_map *map, int idx)
+{
+	int cpu;
+
+	if (idx >= map->nr)
+		return -1;
+
+	cpu = map->map[idx];
+
+	if (cpu >= env->nr_cpus_avail)
+		return -1;
+
+	return cpu;
+}
+
+/*
+ * The socket and core of map->map[idx] in the topology of env, read once,
+ * for cpu_map__build_map() and the like, -1 if env doesn't have it.
+ */
+int perf_env__get_socket(struct cpu_map *map, int idx, void *data)
+{
+	struct perf_env *env = data;
+	int cpu = perf_env__get_cpu(env, map, idx);
+
+	return cpu == -1 ? -1 : env->cpu[cpu].socket_id;
+}
+
+int perf_env__get_core(struct cpu_map *map, int idx, void *data)
+{
+	struct perf_env *env = data;
+	int core = -1, cpu = perf_env__get_cpu(env, map, idx);
+
+	if (cpu != -1) {
+		int socket_id = env->cpu[cpu].socket_id;
+
+		/*
+		 * Encode socket in upper 16 bits
+		 * core_id is relative to socket, and
+		 * we need a global id. So we combine
+		 * socket + core id.
+		 */
+		core = (socket_id << 16) | (env->cpu[cpu].core_id & 0xffff);
+	}
+
+	return core;
+}
+
+/* The numa nodes of the running system, as the header feature has them */
+int perf_env__read_numa_topology(struct perf_env *env)
+{
+	struct numa_topology *tp;
+	int err = 0;
+	u32 i;
+
+	if (env->numa_nodes != NULL)
+		return 0;
+
+	tp = numa_topology__new();
+	if (tp == NULL)
+		return -EINVAL;
+
+	env->numa_nodes = calloc(tp->nr, sizeof(env->numa_nodes[0]));
+	if (env->numa_nodes == NULL) {
+		err = -ENOMEM;
+		goto out_delete;
+	}
+
+	for (i = 0; i < tp->nr; i++) {
+		struct numa_node *n = &env->numa_nodes[i];
+
+		n->node      = tp->nodes[i].node;
+		n->mem_total = tp->nodes[i].mem_total;
+		n->mem_free  = tp->nodes[i].mem_free;
+		n->map	     = cpu_map__new(tp->nodes[i].cpus);
+		if (n->map == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+	}
+
+	/* what got read is freed in perf_env__exit() */
+	env->nr_numa_nodes = i;
+out_delete:
+	numa_topology__delete(tp);
+	return err;
+}
+
 static int perf_env__read_arch(struct perf_env *env)
 {
 	struct utsname uts;
@@ -2,6 +2,7 @@
 #ifndef __PERF_ENV_H
 #define __PERF_ENV_H
 
+#include <pthread.h>
 #include <linux/types.h>
 #include <linux/rbtree.h>
 #include "cpumap.h"
@@ -35,6 +36,53 @@ struct memory_node {
 	unsigned long	*set;
 };
 
+/*
+ * Events stored before @offset in the data file are not later than
+ * @time, those stored past the offset of the next entry are later.
+ */
+struct time_index_entry {
+	u64	time;
+	u64	offset;
+};
+
+/* What perf record --stats saw draining one mmap, see HEADER_RECORD_STATS */
+struct record_mmap_stats {
+	u64	cpu;		/* (u64)-1 for the mmaps of a task */
+	u64	size;		/* of the ring buffer */
+	u64	bytes;
+	u64	events;
+	u64	reads;		/* the drains that got data */
+	u64	max_used;	/* the most bytes waiting in the ring at a drain */
+	u64	push_ns;
+	u64	write_ns;
+	u64	compress_ns;
+	u64	lost_records;
+	u64	lost;		/* the samples the kernel dropped */
+	u64	throttle;
+	u64	unthrottle;
+};
+
+/*
+ * The feature sections of a perf.data file left there until first used,
+ * see perf_env__read_feat().
+ */
+struct perf_env_lazy {
+	pthread_mutex_t	lock;
+	int		fd;
+	/* bit HEADER_* set while that section is not read */
+	u64		feats;
+	struct {
+		u64	offset;
+		u64	size;
+	} sec[64];
+};
+
+enum perf_compress_type {
+	PERF_COMP_NONE = 0,
+	PERF_COMP_ZSTD,
+	PERF_COMP_MAX
+};
+
 struct perf_env {
 	char			*hostname;
 	char			*os_release;
@@ -66,6 +114,21 @@ struct perf_env {
 	struct memory_node	*memory_nodes;
 	unsigned long long	 memory_bsize;
 	u64                     clockid_res_ns;
+	u32			comp_type;
+	u32			comp_ver;
+	u32			comp_level;
+	u32			comp_ratio;
+	u32			comp_mmap_len;
+	struct time_index_entry	*time_index;
+	u64			nr_time_index;
+	/* written in time order by perf data sort */
+	u64			nr_sorted_events;
+	struct record_mmap_stats *record_stats;
+	u64			nr_record_stats;
+	u64			record_polls;
+	u64			record_poll_ns;
+	u64			record_poll_max_ns;
+	struct perf_env_lazy	*lazy;
 
 	/*
 	 * bpf_info_lock protects bpf rbtrees. This is needed because the
@@ -78,6 +141,12 @@ struct perf_env {
 		struct rb_root		btfs;
 		u32			btfs_cnt;
 	} bpf_progs;
+
+	/* struct cgroup of the PERF_RECORD_CGROUP events, by id */
+	struct {
+		struct rw_semaphore	lock;
+		struct rb_root		tree;
+	} cgroups;
 };
 
 struct bpf_prog_info_node;
@@ -90,6 +159,9 @@ void perf_env__exit(struct perf_env *env);
 int perf_env__set_cmdline(struct perf_env *env, int argc, const char *argv[]);
 
 int perf_env__read_cpu_topology_map(struct perf_env *env);
+int perf_env__read_numa_topology(struct perf_env *env);
+int perf_env__get_socket(struct cpu_map *map, int idx, void *data);
+int perf_env__get_core(struct cpu_map *map, int idx, void *data);
 
 void cpu_cache_level__free(struct cpu_cache_level *cache);
 
@@ -5,6 +5,7 @@
 #include <inttypes.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -28,6 +29,10 @@
 #include "stat.h"
 #include "session.h"
 #include "bpf-event.h"
+#include "cgroup.h"
+#include "stage-time.h"
+#include "kallsyms-cache.h"
+#include <subcmd/parse-options.h>
 
 #define DEFAULT_PROC_MAP_PARSE_TIMEOUT 500
 
@@ -51,6 +56,7 @@ static const char *perf_event__names[] = {
 	[PERF_RECORD_NAMESPACES]		= "NAMESPACES",
 	[PERF_RECORD_KSYMBOL]			= "KSYMBOL",
 	[PERF_RECORD_BPF_EVENT]			= "BPF_EVENT",
+	[PERF_RECORD_CGROUP]			= "CGROUP",
 	[PERF_RECORD_HEADER_ATTR]		= "ATTR",
 	[PERF_RECORD_HEADER_EVENT_TYPE]		= "EVENT_TYPE",
 	[PERF_RECORD_HEADER_TRACING_DATA]	= "TRACING_DATA",
@@ -68,6 +74,7 @@ static const char *perf_event__names[] = {
 	[PERF_RECORD_EVENT_UPDATE]		= "EVENT_UPDATE",
 	[PERF_RECORD_TIME_CONV]			= "TIME_CONV",
 	[PERF_RECORD_HEADER_FEATURE]		= "FEATURE",
+	[PERF_RECORD_COMPRESSED]		= "COMPRESSED",
 };
 
 static const char *perf_ns__names[] = {
@@ -82,6 +89,39 @@ static const char *perf_ns__names[] = {
 
 unsigned int proc_map_timeout = DEFAULT_PROC_MAP_PARSE_TIMEOUT;
 
+/* the comms of the tasks whose maps are not synthesized, or all of them */
+static struct strlist *skip_mmap_comms;
+static bool skip_all_mmaps;
+
+void perf_event__skip_all_mmaps(bool skip)
+{
+	skip_all_mmaps = skip;
+}
+
+int perf_event__parse_skip_mmaps(const struct option *opt __maybe_unused,
+				 const char *str, int unset)
+{
+	strlist__delete(skip_mmap_comms);
+	skip_mmap_comms = NULL;
+
+	if (unset)
+		return 0;
+
+	skip_mmap_comms = strlist__new(str, NULL);
+	if (skip_mmap_comms == NULL) {
+		pr_err("Not enough memory for the comms to skip the maps of\n");
+		return -1;
+	}
+	return 0;
+}
+
+static bool perf_event__skip_mmaps(union perf_event *comm_event)
+{
+	return skip_all_mmaps ||
+	       (skip_mmap_comms &&
+		strlist__has_entry(skip_mmap_comms, comm_event->comm.comm));
+}
+
 const char *perf_event__name(unsigned int id)
 {
 	if (id >= ARRAY_SIZE(perf_event__names))
@@ -120,7 +160,8 @@ int perf_tool__process_synth_event(struct perf_tool *tool,
  * Assumes that the first 4095 bytes of /proc/pid/stat contains
  * the comm, tgid and ppid.
  */
-static int perf_event__get_comm_ids(pid_t pid, char *comm, size_t len,
+static int perf_event__get_comm_ids(const char *root_dir, pid_t pid,
+				    char *comm, size_t len,
 				    pid_t *tgid, pid_t *ppid)
 {
 	char filename[PATH_MAX];
@@ -133,7 +174,7 @@ static int perf_event__get_comm_ids(pid_t pid, char *comm, size_t len,
 	*tgid = -1;
 	*ppid = -1;
 
-	snprintf(filename, sizeof(filename), "/proc/%d/status", pid);
+	snprintf(filename, sizeof(filename), "%s/proc/%d/status", root_dir, pid);
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
@@ -201,7 +242,7 @@ static int perf_event__prepare_comm(union perf_event *event, pid_t pid,
 	memset(&event->comm, 0, sizeof(event->comm));
 
 	if (machine__is_host(machine)) {
-		if (perf_event__get_comm_ids(pid, event->comm.comm,
+		if (perf_event__get_comm_ids(machine->root_dir, pid, event->comm.comm,
 					     sizeof(event->comm.comm),
 					     tgid, ppid) != 0) {
 			return -1;
@@ -295,6 +336,113 @@ int perf_event__synthesize_namespaces(struct perf_tool *tool,
 	return 0;
 }
 
+/* What the kernel puts in PERF_SAMPLE_CGROUP: the cgroupfs file handle */
+static int perf_event__get_cgroup_id(const char *path, u64 *id)
+{
+	struct {
+		struct file_handle fh;
+		u64 id;
+	} handle;
+	int mount_id;
+
+	handle.fh.handle_bytes = sizeof(handle.id);
+	if (name_to_handle_at(AT_FDCWD, path, &handle.fh, &mount_id, 0) < 0)
+		return -1;
+
+	memcpy(id, handle.fh.f_handle, sizeof(*id));
+	return 0;
+}
+
+static int perf_event__synthesize_cgroup(struct perf_tool *tool,
+					 union perf_event *event,
+					 const char *path, size_t mount_len,
+					 perf_event__handler_t process,
+					 struct machine *machine)
+{
+	size_t event_size = sizeof(event->cgroup) - sizeof(event->cgroup.path);
+	size_t path_len = strlen(path) - mount_len + 1;
+	size_t aligned_len;
+
+	if (perf_event__get_cgroup_id(path, &event->cgroup.id) < 0)
+		return 0;
+
+	/* the path in the cgroupfs, the root being "/" */
+	if (path_len == 1) {
+		strcpy(event->cgroup.path, "/");
+		path_len = 2;
+	} else {
+		memcpy(event->cgroup.path, path + mount_len, path_len);
+	}
+
+	aligned_len = PERF_ALIGN(path_len, sizeof(u64));
+	memset(event->cgroup.path + path_len, 0,
+	       aligned_len - path_len + machine->id_hdr_size);
+
+	event->cgroup.header.type = PERF_RECORD_CGROUP;
+	event->cgroup.header.size = event_size + aligned_len + machine->id_hdr_size;
+
+	return perf_tool__process_synth_event(tool, event, machine, process);
+}
+
+static int perf_event__walk_cgroup_tree(struct perf_tool *tool,
+					union perf_event *event,
+					char *path, size_t mount_len,
+					perf_event__handler_t process,
+					struct machine *machine)
+{
+	size_t pos = strlen(path);
+	struct dirent *dent;
+	DIR *dir;
+	int ret = 0;
+
+	if (perf_event__synthesize_cgroup(tool, event, path, mount_len,
+					  process, machine) < 0)
+		return -1;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+
+	while ((dent = readdir(dir)) != NULL) {
+		if (dent->d_type != DT_DIR || !strcmp(dent->d_name, ".") ||
+		    !strcmp(dent->d_name, ".."))
+			continue;
+
+		if (pos + 1 + strlen(dent->d_name) >= PATH_MAX)
+			continue;
+
+		path[pos] = '/';
+		strcpy(path + pos + 1, dent->d_name);
+
+		ret = perf_event__walk_cgroup_tree(tool, event, path, mount_len,
+						   process, machine);
+		if (ret < 0)
+			break;
+	}
+
+	path[pos] = '\0';
+	closedir(dir);
+	return ret;
+}
+
+int perf_event__synthesize_cgroups(struct perf_tool *tool,
+				   perf_event__handler_t process,
+				   struct machine *machine)
+{
+	union perf_event event;
+	char path[PATH_MAX];
+	size_t mount_len;
+
+	if (cgroupfs_find_mountpoint(path, sizeof(path)) < 0) {
+		pr_debug("Cannot find the cgroup filesystem, no cgroup names\n");
+		return 0;
+	}
+
+	mount_len = strlen(path);
+	return perf_event__walk_cgroup_tree(tool, &event, path, mount_len,
+					    process, machine);
+}
+
 static int perf_event__synthesize_fork(struct perf_tool *tool,
 				       union perf_event *event,
 				       pid_t pid, pid_t tgid, pid_t ppid,
@@ -554,7 +702,7 @@ static int __event__synthesize_thread(union perf_event *comm_event,
 		 * send mmap only for thread group leader
 		 * see thread__init_map_groups
 		 */
-		if (pid == tgid &&
+		if (pid == tgid && !perf_event__skip_mmaps(comm_event) &&
 		    perf_event__synthesize_mmap_events(tool, mmap_event, pid, tgid,
 						       process, machine, mmap_data))
 			return -1;
@@ -602,7 +750,7 @@ static int __event__synthesize_thread(union perf_event *comm_event,
 			break;
 
 		rc = 0;
-		if (_pid == pid) {
+		if (_pid == pid && !perf_event__skip_mmaps(comm_event)) {
 			/* process the parent's maps too */
 			rc = perf_event__synthesize_mmap_events(tool, mmap_event, pid, tgid,
 						process, machine, mmap_data);
@@ -754,41 +902,140 @@ out:
 	return err;
 }
 
+/* The pids a worker synthesizes at a time, in their own buffer */
+#define SYNTHESIZE_CHUNK_PIDS	16
+
+struct synthesize_chunk {
+	void		*buf;
+	size_t		size;
+	size_t		alloc;
+	bool		done;
+};
+
 struct synthesize_threads_arg {
-	struct perf_tool *tool;
-	perf_event__handler_t process;
-	struct machine *machine;
-	bool mmap_data;
-	struct dirent **dirent;
-	int num;
-	int start;
+	struct perf_tool	*tool;
+	struct machine		*machine;
+	bool			mmap_data;
+	struct dirent		**dirent;
+	int			nr_dirent;
+	struct synthesize_chunk	*chunks;
+	unsigned int		nr_chunks;
+	/* the chunks workers may get ahead of the ones processed */
+	unsigned int		window;
+	unsigned int		next;
+	unsigned int		processed;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
 };
 
+static __thread struct synthesize_chunk *synthesize_chunk;
+
+static int synthesize_chunk__add(struct perf_tool *tool __maybe_unused,
+				 union perf_event *event,
+				 struct perf_sample *sample __maybe_unused,
+				 struct machine *machine __maybe_unused)
+{
+	struct synthesize_chunk *chunk = synthesize_chunk;
+	size_t size = event->header.size;
+
+	if (chunk->size + size > chunk->alloc) {
+		size_t alloc = chunk->alloc ?: 64 << 10;
+		void *buf;
+
+		while (alloc < chunk->size + size)
+			alloc *= 2;
+
+		buf = realloc(chunk->buf, alloc);
+		if (buf == NULL)
+			return -ENOMEM;
+
+		chunk->buf   = buf;
+		chunk->alloc = alloc;
+	}
+
+	memcpy(chunk->buf + chunk->size, event, size);
+	chunk->size += size;
+	return 0;
+}
+
 static void *synthesize_threads_worker(void *arg)
 {
 	struct synthesize_threads_arg *args = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&args->next, 1)) < args->nr_chunks) {
+		int start = i * SYNTHESIZE_CHUNK_PIDS;
+
+		/* don't buffer much more than what is being processed */
+		pthread_mutex_lock(&args->lock);
+		while (i >= args->processed + args->window)
+			pthread_cond_wait(&args->cond, &args->lock);
+		pthread_mutex_unlock(&args->lock);
+
+		synthesize_chunk = &args->chunks[i];
+		__perf_event__synthesize_threads(args->tool, synthesize_chunk__add,
+						 args->machine, args->mmap_data,
+						 args->dirent, start,
+						 min(SYNTHESIZE_CHUNK_PIDS,
+						     args->nr_dirent - start));
+
+		pthread_mutex_lock(&args->lock);
+		args->chunks[i].done = true;
+		pthread_cond_broadcast(&args->cond);
+		pthread_mutex_unlock(&args->lock);
+	}
 
-	__perf_event__synthesize_threads(args->tool, args->process,
-					 args->machine, args->mmap_data,
-					 args->dirent,
-					 args->start, args->num);
 	return NULL;
 }
 
+/*
+ * Hand the events of each chunk to process as the workers are done with
+ * it, in the order of the pids, so process is only ever called from this
+ * thread and gets the events as in a serial scan.
+ */
+static void synthesize_threads__process(struct synthesize_threads_arg *args,
+					perf_event__handler_t process)
+{
+	unsigned int i;
+
+	for (i = 0; i < args->nr_chunks; i++) {
+		struct synthesize_chunk *chunk = &args->chunks[i];
+		size_t pos = 0;
+
+		pthread_mutex_lock(&args->lock);
+		while (!chunk->done)
+			pthread_cond_wait(&args->cond, &args->lock);
+		pthread_mutex_unlock(&args->lock);
+
+		while (pos < chunk->size) {
+			union perf_event *event = chunk->buf + pos;
+
+			/* like the serial scan, don't stop for one thread */
+			perf_tool__process_synth_event(args->tool, event,
+						       args->machine, process);
+			pos += event->header.size;
+		}
+		zfree(&chunk->buf);
+
+		pthread_mutex_lock(&args->lock);
+		args->processed++;
+		pthread_cond_broadcast(&args->cond);
+		pthread_mutex_unlock(&args->lock);
+	}
+}
+
 int perf_event__synthesize_threads(struct perf_tool *tool,
 				   perf_event__handler_t process,
 				   struct machine *machine,
 				   bool mmap_data,
 				   unsigned int nr_threads_synthesize)
 {
-	struct synthesize_threads_arg *args = NULL;
+	struct synthesize_threads_arg args = { .nr_chunks = 0, };
 	pthread_t *synthesize_threads = NULL;
 	char proc_path[PATH_MAX];
 	struct dirent **dirent;
-	int num_per_thread;
-	int m, n, i, j;
+	int n, i, started = 0;
 	int thread_nr;
-	int base = 0;
 	int err = -1;
 
 
@@ -805,56 +1052,60 @@ int perf_event__synthesize_threads(struct perf_tool *tool,
 	else
 		thread_nr = nr_threads_synthesize;
 
-	if (thread_nr <= 1) {
+	args.nr_chunks = DIV_ROUND_UP(n, SYNTHESIZE_CHUNK_PIDS);
+	if (thread_nr > (int)args.nr_chunks)
+		thread_nr = args.nr_chunks;
+
+	if (thread_nr > 1) {
+		synthesize_threads = calloc(sizeof(pthread_t), thread_nr);
+		args.chunks = calloc(args.nr_chunks, sizeof(*args.chunks));
+	}
+
+	if (synthesize_threads == NULL || args.chunks == NULL) {
 		err = __perf_event__synthesize_threads(tool, process,
 						       machine, mmap_data,
-						       dirent, base, n);
-		goto free_dirent;
+						       dirent, 0, n);
+		goto free_threads;
 	}
-	if (thread_nr > n)
-		thread_nr = n;
-
-	synthesize_threads = calloc(sizeof(pthread_t), thread_nr);
-	if (synthesize_threads == NULL)
-		goto free_dirent;
 
-	args = calloc(sizeof(*args), thread_nr);
-	if (args == NULL)
-		goto free_threads;
+	/*
+	 * The workers take the next chunk of pids as they are done with the
+	 * previous one, so a few processes with huge maps don't hold up a
+	 * whole share of the pids.
+	 */
+	args.tool      = tool;
+	args.machine   = machine;
+	args.mmap_data = mmap_data;
+	args.dirent    = dirent;
+	args.nr_dirent = n;
+	args.window    = thread_nr * 4;
+	pthread_mutex_init(&args.lock, NULL);
+	pthread_cond_init(&args.cond, NULL);
 
-	num_per_thread = n / thread_nr;
-	m = n % thread_nr;
 	for (i = 0; i < thread_nr; i++) {
-		args[i].tool = tool;
-		args[i].process = process;
-		args[i].machine = machine;
-		args[i].mmap_data = mmap_data;
-		args[i].dirent = dirent;
-	}
-	for (i = 0; i < m; i++) {
-		args[i].num = num_per_thread + 1;
-		args[i].start = i * args[i].num;
-	}
-	if (i != 0)
-		base = args[i-1].start + args[i-1].num;
-	for (j = i; j < thread_nr; j++) {
-		args[j].num = num_per_thread;
-		args[j].start = base + (j - i) * args[i].num;
+		if (pthread_create(&synthesize_threads[i], NULL,
+				   synthesize_threads_worker, &args))
+			break;
+		started++;
 	}
 
-	for (i = 0; i < thread_nr; i++) {
-		if (pthread_create(&synthesize_threads[i], NULL,
-				   synthesize_threads_worker, &args[i]))
-			goto out_join;
+	if (started) {
+		synthesize_threads__process(&args, process);
+		err = 0;
+	} else {
+		err = __perf_event__synthesize_threads(tool, process,
+						       machine, mmap_data,
+						       dirent, 0, n);
 	}
-	err = 0;
-out_join:
-	for (i = 0; i < thread_nr; i++)
+
+	for (i = 0; i < started; i++)
 		pthread_join(synthesize_threads[i], NULL);
-	free(args);
+
+	pthread_cond_destroy(&args.cond);
+	pthread_mutex_destroy(&args.lock);
 free_threads:
+	free(args.chunks);
 	free(synthesize_threads);
-free_dirent:
 	for (i = 0; i < n; i++)
 		free(dirent[i]);
 	free(dirent);
@@ -889,7 +1140,7 @@ int kallsyms__get_function_start(const char *kallsyms_filename,
 {
 	struct process_symbol_args args = { .name = symbol_name, };
 
-	if (kallsyms__parse(kallsyms_filename, &args, find_symbol_cb) <= 0)
+	if (kallsyms_cache__parse(kallsyms_filename, &args, find_symbol_cb) <= 0)
 		return -1;
 
 	*addr = args.start;
@@ -1351,6 +1602,14 @@ int perf_event__process_bpf_event(struct perf_tool *tool __maybe_unused,
 	return machine__process_bpf_event(machine, event, sample);
 }
 
+int perf_event__process_cgroup(struct perf_tool *tool __maybe_unused,
+			       union perf_event *event,
+			       struct perf_sample *sample,
+			       struct machine *machine)
+{
+	return machine__process_cgroup_event(machine, event, sample);
+}
+
 size_t perf_event__fprintf_mmap(union perf_event *event, FILE *fp)
 {
 	return fprintf(fp, " %d/%d: [%#" PRIx64 "(%#" PRIx64 ") @ %#" PRIx64 "]: %c %s\n",
@@ -1498,6 +1757,12 @@ size_t perf_event__fprintf_bpf_event(union perf_event *event, FILE *fp)
 		       event->bpf_event.id);
 }
 
+size_t perf_event__fprintf_cgroup(union perf_event *event, FILE *fp)
+{
+	return fprintf(fp, " cgroup: %" PRIu64 " %s\n",
+		       event->cgroup.id, event->cgroup.path);
+}
+
 size_t perf_event__fprintf(union perf_event *event, FILE *fp)
 {
 	size_t ret = fprintf(fp, "PERF_RECORD_%s",
@@ -1539,6 +1804,9 @@ size_t perf_event__fprintf(union perf_event *event, FILE *fp)
 	case PERF_RECORD_BPF_EVENT:
 		ret += perf_event__fprintf_bpf_event(event, fp);
 		break;
+	case PERF_RECORD_CGROUP:
+		ret += perf_event__fprintf_cgroup(event, fp);
+		break;
 	default:
 		ret += fprintf(fp, "\n");
 	}
@@ -1554,8 +1822,9 @@ int perf_event__process(struct perf_tool *tool __maybe_unused,
 	return machine__process_event(machine, event, sample);
 }
 
-struct map *thread__find_map(struct thread *thread, u8 cpumode, u64 addr,
-			     struct addr_location *al)
+/* With symp, the symbol is looked up too, see map_groups__find_map_symbol() */
+static struct map *__thread__find_map(struct thread *thread, u8 cpumode, u64 addr,
+				      struct addr_location *al, struct symbol **symp)
 {
 	struct map_groups *mg = thread->mg;
 	struct machine *machine = mg->machine;
@@ -1600,6 +1869,13 @@ struct map *thread__find_map(struct thread *thread, u8 cpumode, u64 addr,
 		return NULL;
 	}
 
+	if (symp) {
+		al->map = map_groups__find_map_symbol(mg, al->addr, load_map, symp);
+		if (al->map != NULL)
+			al->addr = al->map->map_ip(al->map, al->addr);
+		return al->map;
+	}
+
 	al->map = map_groups__find(mg, al->addr);
 	if (al->map != NULL) {
 		/*
@@ -1614,6 +1890,12 @@ struct map *thread__find_map(struct thread *thread, u8 cpumode, u64 addr,
 	return al->map;
 }
 
+struct map *thread__find_map(struct thread *thread, u8 cpumode, u64 addr,
+			     struct addr_location *al)
+{
+	return __thread__find_map(thread, cpumode, addr, al, NULL);
+}
+
 /*
  * For branch stacks or branch samples, the sample cpumode might not be correct
  * because it applies only to the sample 'ip' and not necessary to 'addr' or
@@ -1636,8 +1918,7 @@ struct symbol *thread__find_symbol(struct thread *thread, u8 cpumode,
 				   u64 addr, struct addr_location *al)
 {
 	al->sym = NULL;
-	if (thread__find_map(thread, cpumode, addr, al))
-		al->sym = map__find_symbol(al->map, al->addr);
+	__thread__find_map(thread, cpumode, addr, al, &al->sym);
 	return al->sym;
 }
 
@@ -1654,14 +1935,68 @@ struct symbol *thread__find_symbol_fb(struct thread *thread, u8 cpumode,
  * Callers need to drop the reference to al->thread, obtained in
  * machine__findnew_thread()
  */
+static bool dso__is_filtered(struct dso *dso)
+{
+	u8 filter = READ_ONCE(dso->filter);
+
+	if (filter == SYMBOL_FILTER__UNCHECKED) {
+		if (strlist__has_entry(symbol_conf.dso_list, dso->short_name) ||
+		    (dso->short_name != dso->long_name &&
+		     strlist__has_entry(symbol_conf.dso_list, dso->long_name)))
+			filter = SYMBOL_FILTER__KEPT;
+		else
+			filter = SYMBOL_FILTER__FILTERED;
+		WRITE_ONCE(dso->filter, filter);
+	}
+
+	return filter == SYMBOL_FILTER__FILTERED;
+}
+
+static bool symbol__is_filtered(struct symbol *sym)
+{
+	u8 filter = READ_ONCE(sym->filter);
+
+	if (filter == SYMBOL_FILTER__UNCHECKED) {
+		if (strlist__has_entry(symbol_conf.sym_list, sym->name))
+			filter = SYMBOL_FILTER__KEPT;
+		else
+			filter = SYMBOL_FILTER__FILTERED;
+		WRITE_ONCE(sym->filter, filter);
+	}
+
+	return filter == SYMBOL_FILTER__FILTERED;
+}
+
+/*
+ * Set the filtered bits of al for the thread, dso and symbol filters, once
+ * its thread, map and symbol are resolved.  The lists were made bitmaps
+ * by symbol__init() or get looked up once per dso and symbol.
+ */
+void addr_location__filter(struct addr_location *al)
+{
+	struct dso *dso = al->map ? al->map->dso : NULL;
+
+	if (thread__is_filtered(al->thread))
+		al->filtered |= (1 << HIST_FILTER__THREAD);
+
+	if (al->map && symbol_conf.dso_list && (!dso || dso__is_filtered(dso)))
+		al->filtered |= (1 << HIST_FILTER__DSO);
+
+	if (symbol_conf.sym_list && (!al->sym || symbol__is_filtered(al->sym)))
+		al->filtered |= (1 << HIST_FILTER__SYMBOL);
+}
+
 int machine__resolve(struct machine *machine, struct addr_location *al,
 		     struct perf_sample *sample)
 {
+	u64 start = stage_time__start();
 	struct thread *thread = machine__findnew_thread(machine, sample->pid,
 							sample->tid);
 
-	if (thread == NULL)
+	if (thread == NULL) {
+		stage_time__end(STAGE_TIME__RESOLVE, start);
 		return -1;
+	}
 
 	dump_printf(" ... thread: %s:%d\n", thread__comm_str(thread), thread->tid);
 	thread__find_map(thread, sample->cpumode, sample->ip, al);
@@ -1669,9 +2004,6 @@ int machine__resolve(struct machine *machine, struct addr_location *al,
 		    al->map ? al->map->dso->long_name :
 			al->level == 'H' ? "[hypervisor]" : "<not found>");
 
-	if (thread__is_filtered(thread))
-		al->filtered |= (1 << HIST_FILTER__THREAD);
-
 	al->sym = NULL;
 	al->cpu = sample->cpu;
 	al->socket = -1;
@@ -1684,27 +2016,11 @@ int machine__resolve(struct machine *machine, struct addr_location *al,
 			al->socket = env->cpu[al->cpu].socket_id;
 	}
 
-	if (al->map) {
-		struct dso *dso = al->map->dso;
-
-		if (symbol_conf.dso_list &&
-		    (!dso || !(strlist__has_entry(symbol_conf.dso_list,
-						  dso->short_name) ||
-			       (dso->short_name != dso->long_name &&
-				strlist__has_entry(symbol_conf.dso_list,
-						   dso->long_name))))) {
-			al->filtered |= (1 << HIST_FILTER__DSO);
-		}
-
+	if (al->map)
 		al->sym = map__find_symbol(al->map, al->addr);
-	}
-
-	if (symbol_conf.sym_list &&
-		(!al->sym || !strlist__has_entry(symbol_conf.sym_list,
-						al->sym->name))) {
-		al->filtered |= (1 << HIST_FILTER__SYMBOL);
-	}
 
+	addr_location__filter(al);
+	stage_time__end(STAGE_TIME__RESOLVE, start);
 	return 0;
 }
 
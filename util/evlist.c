@@ -48,7 +48,9 @@ void perf_evlist__init(struct perf_evlist *evlist, struct cpu_map *cpus,
 	int i;
 
 	for (i = 0; i < PERF_EVLIST__HLIST_SIZE; ++i)
-		INIT_HLIST_HEAD(&evlist->heads[i]);
+		INIT_HLIST_HEAD(&evlist->__heads[i]);
+	evlist->heads = evlist->__heads;
+	evlist->heads_bits = PERF_EVLIST__HLIST_BITS;
 	INIT_LIST_HEAD(&evlist->entries);
 	perf_evlist__set_maps(evlist, cpus, threads);
 	fdarray__init(&evlist->pollfd, 64);
@@ -132,6 +134,8 @@ void perf_evlist__exit(struct perf_evlist *evlist)
 {
 	zfree(&evlist->mmap);
 	zfree(&evlist->overwrite_mmap);
+	if (evlist->heads != evlist->__heads)
+		zfree(&evlist->heads);
 	fdarray__exit(&evlist->pollfd);
 }
 
@@ -484,17 +488,54 @@ int perf_evlist__poll(struct perf_evlist *evlist, int timeout)
 	return fdarray__poll(&evlist->pollfd, timeout);
 }
 
+static struct hlist_head *perf_evlist__id_head(struct perf_evlist *evlist,
+					       u64 id)
+{
+	return &evlist->heads[hash_64(id, evlist->heads_bits)];
+}
+
+/*
+ * There is an id per event per cpu per thread, keep the chains short by
+ * doubling the buckets as they come, if that fails the chains get longer.
+ */
+static void perf_evlist__id_rehash(struct perf_evlist *evlist)
+{
+	u32 i, nr_heads = 1U << evlist->heads_bits;
+	u32 bits = evlist->heads_bits + 1;
+	struct perf_sample_id *sid;
+	struct hlist_head *heads;
+	struct hlist_node *n;
+
+	heads = calloc(nr_heads * 2, sizeof(*heads));
+	if (heads == NULL)
+		return;
+
+	for (i = 0; i < nr_heads; i++) {
+		hlist_for_each_entry_safe(sid, n, &evlist->heads[i], node) {
+			hlist_del(&sid->node);
+			hlist_add_head(&sid->node, &heads[hash_64(sid->id, bits)]);
+		}
+	}
+
+	if (evlist->heads != evlist->__heads)
+		free(evlist->heads);
+	evlist->heads = heads;
+	evlist->heads_bits = bits;
+}
+
 static void perf_evlist__id_hash(struct perf_evlist *evlist,
 				 struct perf_evsel *evsel,
 				 int cpu, int thread, u64 id)
 {
-	int hash;
 	struct perf_sample_id *sid = SID(evsel, cpu, thread);
 
+	if (++evlist->nr_ids > (1U << evlist->heads_bits) &&
+	    evlist->heads_bits < 24)
+		perf_evlist__id_rehash(evlist);
+
 	sid->id = id;
 	sid->evsel = evsel;
-	hash = hash_64(sid->id, PERF_EVLIST__HLIST_BITS);
-	hlist_add_head(&sid->node, &evlist->heads[hash]);
+	hlist_add_head(&sid->node, perf_evlist__id_head(evlist, id));
 }
 
 void perf_evlist__id_add(struct perf_evlist *evlist, struct perf_evsel *evsel,
@@ -504,18 +545,17 @@ void perf_evlist__id_add(struct perf_evlist *evlist, struct perf_evsel *evsel,
 	evsel->id[evsel->ids++] = id;
 }
 
-int perf_evlist__id_add_fd(struct perf_evlist *evlist,
-			   struct perf_evsel *evsel,
-			   int cpu, int thread, int fd)
+/* The id the kernel gave the event on fd */
+static int perf_evlist__read_id(struct perf_evlist *evlist,
+				struct perf_evsel *evsel, int fd, u64 *id)
 {
 	u64 read_data[4] = { 0, };
 	int id_idx = 1; /* The first entry is the counter value */
-	u64 id;
 	int ret;
 
-	ret = ioctl(fd, PERF_EVENT_IOC_ID, &id);
+	ret = ioctl(fd, PERF_EVENT_IOC_ID, id);
 	if (!ret)
-		goto add;
+		return 0;
 
 	if (errno != ENOTTY)
 		return -1;
@@ -538,9 +578,19 @@ int perf_evlist__id_add_fd(struct perf_evlist *evlist,
 	if (evsel->attr.read_format & PERF_FORMAT_TOTAL_TIME_RUNNING)
 		++id_idx;
 
-	id = read_data[id_idx];
+	*id = read_data[id_idx];
+	return 0;
+}
+
+int perf_evlist__id_add_fd(struct perf_evlist *evlist,
+			   struct perf_evsel *evsel,
+			   int cpu, int thread, int fd)
+{
+	u64 id;
+
+	if (perf_evlist__read_id(evlist, evsel, fd, &id))
+		return -1;
 
- add:
 	perf_evlist__id_add(evlist, evsel, cpu, thread, id);
 	return 0;
 }
@@ -563,12 +613,8 @@ static void perf_evlist__set_sid_idx(struct perf_evlist *evlist,
 
 struct perf_sample_id *perf_evlist__id2sid(struct perf_evlist *evlist, u64 id)
 {
-	struct hlist_head *head;
+	struct hlist_head *head = perf_evlist__id_head(evlist, id);
 	struct perf_sample_id *sid;
-	int hash;
-
-	hash = hash_64(id, PERF_EVLIST__HLIST_BITS);
-	head = &evlist->heads[hash];
 
 	hlist_for_each_entry(sid, head, node)
 		if (sid->id == id)
@@ -634,9 +680,7 @@ struct perf_evsel *perf_evlist__event2evsel(struct perf_evlist *evlist,
 					    union perf_event *event)
 {
 	struct perf_evsel *first = perf_evlist__first(evlist);
-	struct hlist_head *head;
 	struct perf_sample_id *sid;
-	int hash;
 	u64 id;
 
 	if (evlist->nr_entries == 1)
@@ -653,14 +697,8 @@ struct perf_evsel *perf_evlist__event2evsel(struct perf_evlist *evlist,
 	if (!id)
 		return first;
 
-	hash = hash_64(id, PERF_EVLIST__HLIST_BITS);
-	head = &evlist->heads[hash];
-
-	hlist_for_each_entry(sid, head, node) {
-		if (sid->id == id)
-			return sid->evsel;
-	}
-	return NULL;
+	sid = perf_evlist__id2sid(evlist, id);
+	return sid ? sid->evsel : NULL;
 }
 
 static int perf_evlist__set_paused(struct perf_evlist *evlist, bool value)
@@ -752,12 +790,31 @@ perf_evlist__should_poll(struct perf_evlist *evlist __maybe_unused,
 	return true;
 }
 
+static struct perf_mmap *perf_evlist__overwrite_mmap(struct perf_evlist *evlist)
+{
+	struct perf_mmap *maps = evlist->overwrite_mmap;
+
+	if (!maps) {
+		maps = perf_evlist__alloc_mmap(evlist, true);
+		if (!maps)
+			return NULL;
+		evlist->overwrite_mmap = maps;
+		if (evlist->bkw_mmap_state == BKW_MMAP_NOTREADY)
+			perf_evlist__toggle_bkw_mmap(evlist, BKW_MMAP_RUNNING);
+	}
+	return maps;
+}
+
+/*
+ * Map the ring of idx and point the events of cpu_idx and thread to it,
+ * reading their ids. Only the maps of idx and the sample ids of cpu_idx
+ * and thread are touched, for the cpus to be done in parallel.
+ */
 static int perf_evlist__mmap_per_evsel(struct perf_evlist *evlist, int idx,
 				       struct mmap_params *mp, int cpu_idx,
 				       int thread, int *_output, int *_output_overwrite)
 {
 	struct perf_evsel *evsel;
-	int revent;
 	int evlist_cpu = cpu_map__cpu(evlist->cpus, cpu_idx);
 
 	evlist__for_each_entry(evlist, evsel) {
@@ -769,16 +826,9 @@ static int perf_evlist__mmap_per_evsel(struct perf_evlist *evlist, int idx,
 		mp->prot = PROT_READ | PROT_WRITE;
 		if (evsel->attr.write_backward) {
 			output = _output_overwrite;
-			maps = evlist->overwrite_mmap;
-
-			if (!maps) {
-				maps = perf_evlist__alloc_mmap(evlist, true);
-				if (!maps)
-					return -1;
-				evlist->overwrite_mmap = maps;
-				if (evlist->bkw_mmap_state == BKW_MMAP_NOTREADY)
-					perf_evlist__toggle_bkw_mmap(evlist, BKW_MMAP_RUNNING);
-			}
+			maps = perf_evlist__overwrite_mmap(evlist);
+			if (!maps)
+				return -1;
 			mp->prot &= ~PROT_WRITE;
 		}
 
@@ -803,6 +853,40 @@ static int perf_evlist__mmap_per_evsel(struct perf_evlist *evlist, int idx,
 			perf_mmap__get(&maps[idx]);
 		}
 
+		if ((evsel->attr.read_format & PERF_FORMAT_ID) &&
+		    perf_evlist__read_id(evlist, evsel, fd,
+					 &SID(evsel, cpu, thread)->id))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Poll the events mapped to idx and hash their ids, in the order they're in */
+static int perf_evlist__mmap_add_evsel(struct perf_evlist *evlist, int idx,
+				       int cpu_idx, int thread)
+{
+	struct perf_evsel *evsel;
+	int revent;
+	int evlist_cpu = cpu_map__cpu(evlist->cpus, cpu_idx);
+
+	evlist__for_each_entry(evlist, evsel) {
+		struct perf_mmap *maps = evlist->mmap;
+		int fd;
+		int cpu;
+
+		if (evsel->attr.write_backward)
+			maps = evlist->overwrite_mmap;
+
+		if (evsel->system_wide && thread)
+			continue;
+
+		cpu = cpu_map__idx(evsel->cpus, evlist_cpu);
+		if (cpu == -1)
+			continue;
+
+		fd = FD(evsel, cpu, thread);
+
 		revent = perf_evlist__should_poll(evlist, evsel) ? POLLIN : 0;
 
 		/*
@@ -819,9 +903,8 @@ static int perf_evlist__mmap_per_evsel(struct perf_evlist *evlist, int idx,
 		}
 
 		if (evsel->attr.read_format & PERF_FORMAT_ID) {
-			if (perf_evlist__id_add_fd(evlist, evsel, cpu, thread,
-						   fd) < 0)
-				return -1;
+			perf_evlist__id_add(evlist, evsel, cpu, thread,
+					    SID(evsel, cpu, thread)->id);
 			perf_evlist__set_sid_idx(evlist, evsel, idx, cpu,
 						 thread);
 		}
@@ -830,24 +913,66 @@ static int perf_evlist__mmap_per_evsel(struct perf_evlist *evlist, int idx,
 	return 0;
 }
 
+struct perf_evlist_mmap_args {
+	struct perf_evlist	*evlist;
+	struct mmap_params	*mp;
+	int			nr_threads;
+};
+
+static int perf_evlist__mmap_cpu(int cpu, void *arg)
+{
+	struct perf_evlist_mmap_args *args = arg;
+	struct mmap_params mp = *args->mp;
+	int output = -1;
+	int output_overwrite = -1;
+	int thread;
+
+	auxtrace_mmap_params__set_idx(&mp.auxtrace_mp, args->evlist, cpu, true);
+
+	for (thread = 0; thread < args->nr_threads; thread++) {
+		if (perf_evlist__mmap_per_evsel(args->evlist, cpu, &mp, cpu,
+						thread, &output, &output_overwrite))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The rings are mapped, and the events pointed to them, on worker threads
+ * bound to their cpus, then the pollfds and the ids are added here in the
+ * order of the cpus.
+ */
 static int perf_evlist__mmap_per_cpu(struct perf_evlist *evlist,
 				     struct mmap_params *mp)
 {
+	struct perf_evlist_mmap_args args = {
+		.evlist	    = evlist,
+		.mp	    = mp,
+		.nr_threads = thread_map__nr(evlist->threads),
+	};
 	int cpu, thread;
 	int nr_cpus = cpu_map__nr(evlist->cpus);
-	int nr_threads = thread_map__nr(evlist->threads);
+	struct perf_evsel *evsel;
 
 	pr_debug2("perf event ring buffer mmapped per cpu\n");
-	for (cpu = 0; cpu < nr_cpus; cpu++) {
-		int output = -1;
-		int output_overwrite = -1;
 
-		auxtrace_mmap_params__set_idx(&mp->auxtrace_mp, evlist, cpu,
-					      true);
+	/* what the workers would set up lazily */
+	evlist__for_each_entry(evlist, evsel) {
+		if (evsel->attr.write_backward &&
+		    !perf_evlist__overwrite_mmap(evlist))
+			return -1;
+	}
+	if (mp->affinity == PERF_AFFINITY_NODE)
+		cpu_map__online();
+	cpu__max_node();
+
+	if (cpu_map__parallel(evlist->cpus, 0, perf_evlist__mmap_cpu, &args) >= 0)
+		goto out_unmap;
 
-		for (thread = 0; thread < nr_threads; thread++) {
-			if (perf_evlist__mmap_per_evsel(evlist, cpu, mp, cpu,
-							thread, &output, &output_overwrite))
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		for (thread = 0; thread < args.nr_threads; thread++) {
+			if (perf_evlist__mmap_add_evsel(evlist, cpu, cpu, thread))
 				goto out_unmap;
 		}
 	}
@@ -874,7 +999,8 @@ static int perf_evlist__mmap_per_thread(struct perf_evlist *evlist,
 					      false);
 
 		if (perf_evlist__mmap_per_evsel(evlist, thread, mp, 0, thread,
-						&output, &output_overwrite))
+						&output, &output_overwrite) ||
+		    perf_evlist__mmap_add_evsel(evlist, thread, 0, thread))
 			goto out_unmap;
 	}
 
@@ -997,6 +1123,8 @@ int perf_evlist__parse_mmap_pages(const struct option *opt, const char *str,
  * @overwrite: overwrite older events?
  * @auxtrace_pages - auxtrace map length in pages
  * @auxtrace_overwrite - overwrite older auxtrace data?
+ * @flush - bytes to have in a map before it is read, 1 for any
+ * @huge - back the staging buffers with huge pages, see enum perf_mmap_huge
  *
  * If @overwrite is %false the user needs to signal event consumption using
  * perf_mmap__write_tail().  Using perf_evlist__mmap_read() does this
@@ -1009,7 +1137,8 @@ int perf_evlist__parse_mmap_pages(const struct option *opt, const char *str,
  */
 int perf_evlist__mmap_ex(struct perf_evlist *evlist, unsigned int pages,
 			 unsigned int auxtrace_pages,
-			 bool auxtrace_overwrite, int nr_cblocks, int affinity)
+			 bool auxtrace_overwrite, int nr_cblocks, int affinity,
+			 int comp_level, int flush, int huge)
 {
 	struct perf_evsel *evsel;
 	const struct cpu_map *cpus = evlist->cpus;
@@ -1019,7 +1148,9 @@ int perf_evlist__mmap_ex(struct perf_evlist *evlist, unsigned int pages,
 	 * Its value is decided by evsel's write_backward.
 	 * So &mp should not be passed through const pointer.
 	 */
-	struct mmap_params mp = { .nr_cblocks = nr_cblocks, .affinity = affinity };
+	struct mmap_params mp = { .nr_cblocks = nr_cblocks, .affinity = affinity,
+				  .comp_level = comp_level, .flush = flush,
+				  .huge = huge };
 
 	if (!evlist->mmap)
 		evlist->mmap = perf_evlist__alloc_mmap(evlist, false);
@@ -1051,7 +1182,8 @@ int perf_evlist__mmap_ex(struct perf_evlist *evlist, unsigned int pages,
 
 int perf_evlist__mmap(struct perf_evlist *evlist, unsigned int pages)
 {
-	return perf_evlist__mmap_ex(evlist, pages, 0, false, 0, PERF_AFFINITY_SYS);
+	return perf_evlist__mmap_ex(evlist, pages, 0, false, 0, PERF_AFFINITY_SYS, 0, 1,
+				    PERF_MMAP_HUGE_NONE);
 }
 
 int perf_evlist__create_maps(struct perf_evlist *evlist, struct target *target)
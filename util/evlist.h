@@ -26,7 +26,11 @@ struct record_opts;
 
 struct perf_evlist {
 	struct list_head entries;
-	struct hlist_head heads[PERF_EVLIST__HLIST_SIZE];
+	/* of the sample ids, __heads until there are more ids than buckets */
+	struct hlist_head *heads;
+	u32		 heads_bits;
+	u32		 nr_ids;
+	struct hlist_head __heads[PERF_EVLIST__HLIST_SIZE];
 	int		 nr_entries;
 	int		 nr_groups;
 	int		 nr_mmaps;
@@ -177,7 +181,8 @@ unsigned long perf_event_mlock_kb_in_pages(void);
 
 int perf_evlist__mmap_ex(struct perf_evlist *evlist, unsigned int pages,
 			 unsigned int auxtrace_pages,
-			 bool auxtrace_overwrite, int nr_cblocks, int affinity);
+			 bool auxtrace_overwrite, int nr_cblocks, int affinity,
+			 int comp_level, int flush, int huge);
 int perf_evlist__mmap(struct perf_evlist *evlist, unsigned int pages);
 void perf_evlist__munmap(struct perf_evlist *evlist);
 
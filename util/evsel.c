@@ -19,6 +19,7 @@
 #include <linux/compiler.h>
 #include <linux/err.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -1043,6 +1044,11 @@ void perf_evsel__config(struct perf_evsel *evsel, struct record_opts *opts,
 	if (opts->record_namespaces)
 		attr->namespaces  = track;
 
+	if (opts->record_cgroup) {
+		attr->cgroup = track && !perf_missing_features.cgroup;
+		perf_evsel__set_sample_bit(evsel, CGROUP);
+	}
+
 	if (opts->record_switch_events)
 		attr->context_switch = track;
 
@@ -1168,6 +1174,21 @@ int perf_evsel__apply_filter(struct perf_evsel *evsel, const char *filter)
 				     (void *)filter);
 }
 
+/* The sample period, or the sample frequency for events in frequency mode */
+int perf_evsel__set_period(struct perf_evsel *evsel, u64 value)
+{
+	int err = perf_evsel__run_ioctl(evsel, PERF_EVENT_IOC_PERIOD, &value);
+
+	if (!err) {
+		if (evsel->attr.freq)
+			evsel->attr.sample_freq = value;
+		else
+			evsel->attr.sample_period = value;
+	}
+
+	return err;
+}
+
 int perf_evsel__set_filter(struct perf_evsel *evsel, const char *filter)
 {
 	char *new_filter = strdup(filter);
@@ -1293,6 +1314,7 @@ void perf_evsel__exit(struct perf_evsel *evsel)
 {
 	assert(list_empty(&evsel->node));
 	assert(evsel->evlist == NULL);
+	perf_evsel__munmap_self(evsel);
 	perf_evsel__free_counts(evsel);
 	perf_evsel__free_fd(evsel);
 	perf_evsel__free_id(evsel);
@@ -1393,6 +1415,117 @@ int perf_evsel__read(struct perf_evsel *evsel, int cpu, int thread,
 	return 0;
 }
 
+/*
+ * Self monitoring: for an evsel opened for the calling thread only, on any
+ * cpu, map the perf_event_mmap_page of its event so that
+ * perf_evsel__read_self() reads the counter with rdpmc, without a
+ * syscall, when the kernel allows it.
+ */
+int perf_evsel__mmap_self(struct perf_evsel *evsel)
+{
+	void *page;
+
+	if (evsel->self_page)
+		return 0;
+
+	if (evsel->fd == NULL || xyarray__max_x(evsel->fd) != 1 ||
+	    xyarray__max_y(evsel->fd) != 1 || FD(evsel, 0, 0) < 0)
+		return -EINVAL;
+
+	page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, FD(evsel, 0, 0), 0);
+	if (page == MAP_FAILED)
+		return -errno;
+
+	evsel->self_page = page;
+	return 0;
+}
+
+void perf_evsel__munmap_self(struct perf_evsel *evsel)
+{
+	if (evsel->self_page) {
+		munmap(evsel->self_page, page_size);
+		evsel->self_page = NULL;
+	}
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+static u64 read_perf_counter(unsigned int counter)
+{
+	unsigned int low, high;
+
+	asm volatile("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+
+	return low | ((u64)high) << 32;
+}
+
+/*
+ * The count of the event of the page, as in the seqlock loop documented in
+ * include/uapi/linux/perf_event.h, false when it can't be read from
+ * userspace, e.g. when it isn't running on this cpu, or when it was
+ * multiplexed, as the times would have to be extrapolated.
+ */
+static bool perf_event_mmap_page__read(struct perf_event_mmap_page *pc,
+				       struct perf_counts_values *count)
+{
+	u64 val, enabled, running;
+	u32 seq, idx, width;
+	s64 pmc;
+
+	do {
+		seq = READ_ONCE(pc->lock);
+		barrier();
+
+		idx = pc->index;
+		width = pc->pmc_width;
+		if (!pc->cap_user_rdpmc || !idx || !width || width > 64)
+			return false;
+
+		enabled = pc->time_enabled;
+		running = pc->time_running;
+		val = pc->offset;
+
+		pmc = read_perf_counter(idx - 1);
+		pmc <<= 64 - width;
+		pmc >>= 64 - width;
+		val += pmc;
+
+		barrier();
+	} while (READ_ONCE(pc->lock) != seq);
+
+	if (enabled != running)
+		return false;
+
+	count->val = val;
+	count->ena = enabled;
+	count->run = running;
+	return true;
+}
+#else
+static bool perf_event_mmap_page__read(struct perf_event_mmap_page *pc __maybe_unused,
+				       struct perf_counts_values *count __maybe_unused)
+{
+	return false;
+}
+#endif
+
+/*
+ * Read the count of a self monitoring evsel, see perf_evsel__mmap_self(),
+ * with read() when it can't be done from userspace.  The times read from
+ * the page are those of when the event was last scheduled in, the same
+ * as it wasn't multiplexed.
+ */
+int perf_evsel__read_self(struct perf_evsel *evsel,
+			  struct perf_counts_values *count)
+{
+	if (evsel->self_page) {
+		memset(count, 0, sizeof(*count));
+		if (perf_event_mmap_page__read(evsel->self_page, count))
+			return 0;
+	}
+
+	return perf_evsel__read(evsel, 0, 0, count);
+}
+
 static int
 perf_evsel__read_one(struct perf_evsel *evsel, int cpu, int thread)
 {
@@ -1460,6 +1593,7 @@ perf_evsel__read_group(struct perf_evsel *leader, int cpu, int thread)
 	u64 read_format = leader->attr.read_format;
 	int size = perf_evsel__read_size(leader);
 	u64 *data = ps->group_data;
+	int err;
 
 	if (!(read_format & PERF_FORMAT_ID))
 		return -EINVAL;
@@ -1467,21 +1601,30 @@ perf_evsel__read_group(struct perf_evsel *leader, int cpu, int thread)
 	if (!perf_evsel__is_group_leader(leader))
 		return -EINVAL;
 
+	if (FD(leader, cpu, thread) < 0)
+		return -EINVAL;
+
+	/* the group is read on several CPUs at once, see perf stat --read-threads */
+	if (!perf_singlethreaded)
+		data = NULL;
+
 	if (!data) {
 		data = zalloc(size);
 		if (!data)
 			return -ENOMEM;
 
-		ps->group_data = data;
+		if (perf_singlethreaded)
+			ps->group_data = data;
 	}
 
-	if (FD(leader, cpu, thread) < 0)
-		return -EINVAL;
-
 	if (readn(FD(leader, cpu, thread), data, size) <= 0)
-		return -errno;
+		err = -errno;
+	else
+		err = perf_evsel__process_group_data(leader, cpu, thread, data);
 
-	return perf_evsel__process_group_data(leader, cpu, thread, data);
+	if (data != ps->group_data)
+		free(data);
+	return err;
 }
 
 int perf_evsel__read_counter(struct perf_evsel *evsel, int cpu, int thread)
@@ -1658,6 +1801,7 @@ int perf_event_attr__fprintf(FILE *fp, struct perf_event_attr *attr,
 	PRINT_ATTRf(namespaces, p_unsigned);
 	PRINT_ATTRf(ksymbol, p_unsigned);
 	PRINT_ATTRf(bpf_event, p_unsigned);
+	PRINT_ATTRf(cgroup, p_unsigned);
 
 	PRINT_ATTRn("{ wakeup_events, wakeup_watermark }", wakeup_events, p_unsigned);
 	PRINT_ATTRf(bp_type, p_unsigned);
@@ -1803,6 +1947,83 @@ static int perf_event_open(struct perf_evsel *evsel,
 	return fd;
 }
 
+struct perf_evsel_open_args {
+	struct perf_evsel	*evsel;
+	struct cpu_map		*cpus;
+	struct thread_map	*threads;
+	int			nthreads;
+	int			pid;
+	unsigned long		flags;
+};
+
+/* Open the event on one cpu, for all the threads, in a worker */
+static int perf_evsel__open_cpu(int cpu, void *arg)
+{
+	struct perf_evsel_open_args *args = arg;
+	struct perf_evsel *evsel = args->evsel;
+	int thread, pid = args->pid;
+
+	for (thread = 0; thread < args->nthreads; thread++) {
+		int fd;
+
+		if (!evsel->cgrp && !evsel->system_wide)
+			pid = thread_map__pid(args->threads, thread);
+
+		fd = sys_perf_event_open(&evsel->attr, pid, args->cpus->map[cpu],
+					 get_group_fd(evsel, cpu, thread),
+					 args->flags);
+		FD(evsel, cpu, thread) = fd;
+		if (fd < 0)
+			return -1;
+
+		if (evsel->bpf_fd >= 0 &&
+		    ioctl(fd, PERF_EVENT_IOC_SET_BPF, evsel->bpf_fd) &&
+		    errno != EEXIST)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Once the event opened on the first cpu, with whatever fallback it took,
+ * open it on the others in parallel. If that fails anywhere, everything
+ * opened here is closed and left to the serial loop, for the errors to be
+ * handled and reported as always.
+ */
+static int perf_evsel__open_parallel(struct perf_evsel *evsel,
+				     struct cpu_map *cpus,
+				     struct thread_map *threads,
+				     int nthreads, int pid,
+				     unsigned long flags)
+{
+	struct perf_evsel_open_args args = {
+		.evsel	  = evsel,
+		.cpus	  = cpus,
+		.threads  = threads,
+		.nthreads = nthreads,
+		.pid	  = pid,
+		.flags	  = flags,
+	};
+	int cpu, thread;
+
+	/* the threads removed from the map and the debug output are serial */
+	if (evsel->ignore_missing_thread || verbose >= 2 || test_attr__enabled)
+		return -1;
+
+	if (cpu_map__parallel(cpus, 1, perf_evsel__open_cpu, &args) < 0)
+		return 0;
+
+	for (cpu = 1; cpu < cpus->nr; cpu++) {
+		for (thread = 0; thread < nthreads; thread++) {
+			if (FD(evsel, cpu, thread) >= 0)
+				close(FD(evsel, cpu, thread));
+			FD(evsel, cpu, thread) = -1;
+		}
+	}
+	return -1;
+}
+
 int perf_evsel__open(struct perf_evsel *evsel, struct cpu_map *cpus,
 		     struct thread_map *threads)
 {
@@ -1882,6 +2103,11 @@ retry_sample_id:
 
 	for (cpu = 0; cpu < cpus->nr; cpu++) {
 
+		if (cpu == 1 &&
+		    !perf_evsel__open_parallel(evsel, cpus, threads, nthreads,
+					       pid, flags))
+			return 0;
+
 		for (thread = 0; thread < nthreads; thread++) {
 			int fd, group_fd;
 
@@ -1985,7 +2211,11 @@ try_fallback:
 	 * Must probe features in the order they were added to the
 	 * perf_event_attr interface.
 	 */
-	if (!perf_missing_features.bpf_event && evsel->attr.bpf_event) {
+	if (!perf_missing_features.cgroup && evsel->attr.cgroup) {
+		perf_missing_features.cgroup = true;
+		pr_debug2("Kernel has no cgroup sampling support, bailing out\n");
+		goto out_close;
+	} else if (!perf_missing_features.bpf_event && evsel->attr.bpf_event) {
 		perf_missing_features.bpf_event = true;
 		pr_debug2("switching off bpf_event\n");
 		goto fallback_missing_features;
@@ -2056,6 +2286,7 @@ void perf_evsel__close(struct perf_evsel *evsel)
 	if (evsel->fd == NULL)
 		return;
 
+	perf_evsel__munmap_self(evsel);
 	perf_evsel__close_fd(evsel);
 	perf_evsel__free_fd(evsel);
 }
@@ -2092,9 +2323,8 @@ static int perf_evsel__parse_id_sample(const struct perf_evsel *evsel,
 	if (type & PERF_SAMPLE_CPU) {
 		u.val64 = *array;
 		if (swapped) {
-			/* undo swap of u64, then swap on individual u32s */
-			u.val64 = bswap_64(u.val64);
-			u.val32[0] = bswap_32(u.val32[0]);
+			/* put back the u32s the swap of the u64 exchanged */
+			u.val64 = u64_swap__u32s(u.val64);
 		}
 
 		sample->cpu = u.val32[0];
@@ -2119,10 +2349,8 @@ static int perf_evsel__parse_id_sample(const struct perf_evsel *evsel,
 	if (type & PERF_SAMPLE_TID) {
 		u.val64 = *array;
 		if (swapped) {
-			/* undo swap of u64, then swap on individual u32s */
-			u.val64 = bswap_64(u.val64);
-			u.val32[0] = bswap_32(u.val32[0]);
-			u.val32[1] = bswap_32(u.val32[1]);
+			/* put back the u32s the swap of the u64 exchanged */
+			u.val64 = u64_swap__u32s(u.val64);
 		}
 
 		sample->pid = u.val32[0];
@@ -2162,12 +2390,16 @@ perf_event__check_size(union perf_event *event, unsigned int sample_size)
 	return 0;
 }
 
-int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
-			     struct perf_sample *data)
+/*
+ * The part of a PERF_RECORD_SAMPLE after the header, inlined in the parsers
+ * of the common sample types below with a constant type and swapped, so
+ * that they don't test each PERF_SAMPLE_* bit in turn.
+ */
+static __always_inline int
+__perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
+			   struct perf_sample *data, u64 type, bool swapped)
 {
-	u64 type = evsel->attr.sample_type;
-	bool swapped = evsel->needs_swap;
-	const u64 *array;
+	const u64 *array = event->sample.array;
 	u16 max_size = event->header.size;
 	const void *endp = (void *)event + max_size;
 	u64 sz;
@@ -2178,23 +2410,6 @@ int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
 	 */
 	union u64_swap u;
 
-	memset(data, 0, sizeof(*data));
-	data->cpu = data->pid = data->tid = -1;
-	data->stream_id = data->id = data->time = -1ULL;
-	data->period = evsel->attr.sample_period;
-	data->cpumode = event->header.misc & PERF_RECORD_MISC_CPUMODE_MASK;
-	data->misc    = event->header.misc;
-	data->id = -1ULL;
-	data->data_src = PERF_MEM_DATA_SRC_NONE;
-
-	if (event->header.type != PERF_RECORD_SAMPLE) {
-		if (!evsel->attr.sample_id_all)
-			return 0;
-		return perf_evsel__parse_id_sample(evsel, event, data);
-	}
-
-	array = event->sample.array;
-
 	if (perf_event__check_size(event, evsel->sample_size))
 		return -EFAULT;
 
@@ -2211,10 +2426,8 @@ int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
 	if (type & PERF_SAMPLE_TID) {
 		u.val64 = *array;
 		if (swapped) {
-			/* undo swap of u64, then swap on individual u32s */
-			u.val64 = bswap_64(u.val64);
-			u.val32[0] = bswap_32(u.val32[0]);
-			u.val32[1] = bswap_32(u.val32[1]);
+			/* put back the u32s the swap of the u64 exchanged */
+			u.val64 = u64_swap__u32s(u.val64);
 		}
 
 		data->pid = u.val32[0];
@@ -2246,9 +2459,8 @@ int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
 
 		u.val64 = *array;
 		if (swapped) {
-			/* undo swap of u64, then swap on individual u32s */
-			u.val64 = bswap_64(u.val64);
-			u.val32[0] = bswap_32(u.val32[0]);
+			/* put back the u32s the swap of the u64 exchanged */
+			u.val64 = u64_swap__u32s(u.val64);
 		}
 
 		data->cpu = u.val32[0];
@@ -2303,7 +2515,7 @@ int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
 		}
 	}
 
-	if (evsel__has_callchain(evsel)) {
+	if (type & PERF_SAMPLE_CALLCHAIN) {
 		const u64 max_callchain_nr = UINT64_MAX / sizeof(u64);
 
 		OVERFLOW_CHECK_u64(array);
@@ -2320,16 +2532,12 @@ int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
 		u.val64 = *array;
 
 		/*
-		 * Undo swap of u64, then swap on individual u32s,
-		 * get the size of the raw area and undo all of the
-		 * swap. The pevent interface handles endianity by
-		 * itself.
+		 * Put back the u32s the swap of the u64 exchanged, get
+		 * the size of the raw area and undo all of the swap.
+		 * The pevent interface handles endianity by itself.
 		 */
-		if (swapped) {
-			u.val64 = bswap_64(u.val64);
-			u.val32[0] = bswap_32(u.val32[0]);
-			u.val32[1] = bswap_32(u.val32[1]);
-		}
+		if (swapped)
+			u.val64 = u64_swap__u32s(u.val64);
 		data->raw_size = u.val32[0];
 
 		/*
@@ -2438,9 +2646,117 @@ int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
 		array++;
 	}
 
+	data->cgroup = 0;
+	if (type & PERF_SAMPLE_CGROUP) {
+		data->cgroup = *array;
+		array++;
+	}
+
 	return 0;
 }
 
+static int perf_evsel__parse_sample_generic(struct perf_evsel *evsel,
+					    union perf_event *event,
+					    struct perf_sample *data)
+{
+	return __perf_evsel__parse_sample(evsel, event, data,
+					  evsel->attr.sample_type,
+					  evsel->needs_swap);
+}
+
+#define PERF_SAMPLE_PARSER(name, sample_type)				\
+static int perf_evsel__parse_sample_##name(struct perf_evsel *evsel,	\
+					   union perf_event *event,	\
+					   struct perf_sample *data)	\
+{									\
+	return __perf_evsel__parse_sample(evsel, event, data,		\
+					  sample_type, false);		\
+}
+
+/* as set by 'perf record', with -g and with --call-graph=dwarf */
+#define PERF_SAMPLE_PARSERS(name, sample_type)				\
+	PERF_SAMPLE_PARSER(name, sample_type)				\
+	PERF_SAMPLE_PARSER(name##_callchain,				\
+			   (sample_type) | PERF_SAMPLE_CALLCHAIN)	\
+	PERF_SAMPLE_PARSER(name##_dwarf,				\
+			   (sample_type) | PERF_SAMPLE_CALLCHAIN |	\
+			   PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER)
+
+#define PERF_SAMPLE_BASIC	(PERF_SAMPLE_IP | PERF_SAMPLE_TID |	\
+				 PERF_SAMPLE_TIME | PERF_SAMPLE_PERIOD)
+
+PERF_SAMPLE_PARSERS(basic, PERF_SAMPLE_BASIC)
+PERF_SAMPLE_PARSERS(basic_cpu, PERF_SAMPLE_BASIC | PERF_SAMPLE_CPU)
+PERF_SAMPLE_PARSERS(id_basic, PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_BASIC)
+PERF_SAMPLE_PARSERS(id_basic_cpu, PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_BASIC |
+				  PERF_SAMPLE_CPU)
+
+#define PERF_SAMPLE_PARSERS_ENTRY(name, sample_type)			\
+	{ sample_type, perf_evsel__parse_sample_##name, },		\
+	{ (sample_type) | PERF_SAMPLE_CALLCHAIN,			\
+	  perf_evsel__parse_sample_##name##_callchain, },		\
+	{ (sample_type) | PERF_SAMPLE_CALLCHAIN |			\
+	  PERF_SAMPLE_REGS_USER | PERF_SAMPLE_STACK_USER,		\
+	  perf_evsel__parse_sample_##name##_dwarf, }
+
+static const struct {
+	u64			  sample_type;
+	perf_evsel__parse_sample_t parse;
+} perf_sample_parsers[] = {
+	PERF_SAMPLE_PARSERS_ENTRY(basic, PERF_SAMPLE_BASIC),
+	PERF_SAMPLE_PARSERS_ENTRY(basic_cpu, PERF_SAMPLE_BASIC | PERF_SAMPLE_CPU),
+	PERF_SAMPLE_PARSERS_ENTRY(id_basic, PERF_SAMPLE_IDENTIFIER |
+					    PERF_SAMPLE_BASIC),
+	PERF_SAMPLE_PARSERS_ENTRY(id_basic_cpu, PERF_SAMPLE_IDENTIFIER |
+						PERF_SAMPLE_BASIC |
+						PERF_SAMPLE_CPU),
+};
+
+/* Pick the parser of the sample type, once for each sample type set */
+static void perf_evsel__select_parser(struct perf_evsel *evsel)
+{
+	u64 type = evsel->attr.sample_type;
+	unsigned int i;
+
+	evsel->parse_sample = perf_evsel__parse_sample_generic;
+	evsel->parse_sample_type = type;
+
+	if (evsel->needs_swap)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(perf_sample_parsers); i++) {
+		if (perf_sample_parsers[i].sample_type == type) {
+			evsel->parse_sample = perf_sample_parsers[i].parse;
+			break;
+		}
+	}
+}
+
+int perf_evsel__parse_sample(struct perf_evsel *evsel, union perf_event *event,
+			     struct perf_sample *data)
+{
+	memset(data, 0, sizeof(*data));
+	data->cpu = data->pid = data->tid = -1;
+	data->stream_id = data->id = data->time = -1ULL;
+	data->period = evsel->attr.sample_period;
+	data->cpumode = event->header.misc & PERF_RECORD_MISC_CPUMODE_MASK;
+	data->misc    = event->header.misc;
+	data->id = -1ULL;
+	data->data_src = PERF_MEM_DATA_SRC_NONE;
+
+	if (event->header.type != PERF_RECORD_SAMPLE) {
+		if (!evsel->attr.sample_id_all)
+			return 0;
+		return perf_evsel__parse_id_sample(evsel, event, data);
+	}
+
+	if (unlikely(evsel->parse_sample == NULL ||
+		     evsel->parse_sample_type != evsel->attr.sample_type))
+		perf_evsel__select_parser(evsel);
+
+	return evsel->parse_sample(evsel, event, data);
+}
+
 int perf_evsel__parse_sample_timestamp(struct perf_evsel *evsel,
 				       union perf_event *event,
 				       u64 *timestamp)
@@ -2485,6 +2801,61 @@ int perf_evsel__parse_sample_timestamp(struct perf_evsel *evsel,
 	return 0;
 }
 
+/*
+ * Only the fields before the period, at fixed offsets in a sample, for
+ * picking samples out without parsing them, see perf data split.
+ */
+int perf_evsel__parse_sample_head(struct perf_evsel *evsel,
+				  union perf_event *event,
+				  struct perf_sample *data)
+{
+	u64 type = evsel->attr.sample_type;
+	const u64 *array;
+	union u64_swap u;
+
+	data->cpu = data->pid = data->tid = -1;
+	data->stream_id = data->id = data->time = -1ULL;
+
+	if (event->header.type != PERF_RECORD_SAMPLE)
+		return -EINVAL;
+
+	if (perf_event__check_size(event, evsel->sample_size))
+		return -EFAULT;
+
+	array = event->sample.array;
+
+	if (type & PERF_SAMPLE_IDENTIFIER)
+		data->id = *array++;
+
+	if (type & PERF_SAMPLE_IP)
+		data->ip = *array++;
+
+	if (type & PERF_SAMPLE_TID) {
+		u.val64 = *array++;
+		data->pid = u.val32[0];
+		data->tid = u.val32[1];
+	}
+
+	if (type & PERF_SAMPLE_TIME)
+		data->time = *array++;
+
+	if (type & PERF_SAMPLE_ADDR)
+		data->addr = *array++;
+
+	if (type & PERF_SAMPLE_ID)
+		data->id = *array++;
+
+	if (type & PERF_SAMPLE_STREAM_ID)
+		data->stream_id = *array++;
+
+	if (type & PERF_SAMPLE_CPU) {
+		u.val64 = *array;
+		data->cpu = u.val32[0];
+	}
+
+	return 0;
+}
+
 size_t perf_event__sample_event_size(const struct perf_sample *sample, u64 type,
 				     u64 read_format)
 {
@@ -2590,6 +2961,9 @@ size_t perf_event__sample_event_size(const struct perf_sample *sample, u64 type,
 	if (type & PERF_SAMPLE_PHYS_ADDR)
 		result += sizeof(u64);
 
+	if (type & PERF_SAMPLE_CGROUP)
+		result += sizeof(u64);
+
 	return result;
 }
 
@@ -2759,6 +3133,11 @@ int perf_event__synthesize_sample(union perf_event *event, u64 type,
 		array++;
 	}
 
+	if (type & PERF_SAMPLE_CGROUP) {
+		*array = sample->cgroup;
+		array++;
+	}
+
 	return 0;
 }
 
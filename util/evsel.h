@@ -75,6 +75,13 @@ struct perf_stat_evsel;
 
 typedef int (perf_evsel__sb_cb_t)(union perf_event *event, void *data);
 
+struct perf_evsel;
+struct perf_sample;
+
+typedef int (*perf_evsel__parse_sample_t)(struct perf_evsel *evsel,
+					  union perf_event *event,
+					  struct perf_sample *data);
+
 /** struct perf_evsel - event selector
  *
  * @evlist - evlist this evsel is in, if it is in one.
@@ -119,6 +126,9 @@ struct perf_evsel {
 	struct cpu_map		*own_cpus;
 	struct thread_map	*threads;
 	unsigned int		sample_size;
+	/* picked for parse_sample_type by perf_evsel__parse_sample() */
+	perf_evsel__parse_sample_t parse_sample;
+	u64			parse_sample_type;
 	int			id_pos;
 	int			is_pos;
 	bool			uniquified_name;
@@ -150,6 +160,7 @@ struct perf_evsel {
 	const char *		metric_expr;
 	const char *		metric_name;
 	struct perf_evsel	**metric_events;
+	struct expr_prog	*metric_prog;
 	bool			collect_stat;
 	bool			weak_group;
 	const char		*pmu_name;
@@ -157,6 +168,8 @@ struct perf_evsel {
 		perf_evsel__sb_cb_t	*cb;
 		void			*data;
 	} side_band;
+	/* see perf_evsel__mmap_self() */
+	struct perf_event_mmap_page *self_page;
 };
 
 union u64_swap {
@@ -164,6 +177,15 @@ union u64_swap {
 	u32 val32[2];
 };
 
+/*
+ * Two u32s swapped as one u64 are each in the right byte order already,
+ * just in each other's place.
+ */
+static inline u64 u64_swap__u32s(u64 val)
+{
+	return (val >> 32) | (val << 32);
+}
+
 struct perf_missing_features {
 	bool sample_id_all;
 	bool exclude_guest;
@@ -176,6 +198,7 @@ struct perf_missing_features {
 	bool group_read;
 	bool ksymbol;
 	bool bpf_event;
+	bool cgroup;
 };
 
 extern struct perf_missing_features perf_missing_features;
@@ -279,6 +302,7 @@ void __perf_evsel__reset_sample_bit(struct perf_evsel *evsel,
 void perf_evsel__set_sample_id(struct perf_evsel *evsel,
 			       bool use_sample_identifier);
 
+int perf_evsel__set_period(struct perf_evsel *evsel, u64 value);
 int perf_evsel__set_filter(struct perf_evsel *evsel, const char *filter);
 int perf_evsel__append_tp_filter(struct perf_evsel *evsel, const char *filter);
 int perf_evsel__append_addr_filter(struct perf_evsel *evsel,
@@ -337,6 +361,11 @@ int perf_evsel__read(struct perf_evsel *evsel, int cpu, int thread,
 
 int perf_evsel__read_counter(struct perf_evsel *evsel, int cpu, int thread);
 
+int perf_evsel__mmap_self(struct perf_evsel *evsel);
+void perf_evsel__munmap_self(struct perf_evsel *evsel);
+int perf_evsel__read_self(struct perf_evsel *evsel,
+			  struct perf_counts_values *count);
+
 int __perf_evsel__read_on_cpu(struct perf_evsel *evsel,
 			      int cpu, int thread, bool scale);
 
@@ -373,6 +402,10 @@ int perf_evsel__parse_sample_timestamp(struct perf_evsel *evsel,
 				       union perf_event *event,
 				       u64 *timestamp);
 
+int perf_evsel__parse_sample_head(struct perf_evsel *evsel,
+				  union perf_event *event,
+				  struct perf_sample *data);
+
 static inline struct perf_evsel *perf_evsel__next(struct perf_evsel *evsel)
 {
 	return list_entry(evsel->node.next, struct perf_evsel, node);
@@ -15,11 +15,45 @@ struct parse_ctx {
 	struct parse_id ids[MAX_PARSE_ID];
 };
 
+#define EXPR_MAX_INSNS 256
+#define EXPR_MAX_STACK 32
+
+enum expr_op {
+	EXPR_OP_NUM,
+	EXPR_OP_ID,
+	EXPR_OP_OR,
+	EXPR_OP_AND,
+	EXPR_OP_XOR,
+	EXPR_OP_ADD,
+	EXPR_OP_SUB,
+	EXPR_OP_MUL,
+	EXPR_OP_DIV,
+	EXPR_OP_MOD,
+	EXPR_OP_NEG,
+	EXPR_OP_MIN,
+	EXPR_OP_MAX,
+	EXPR_OP_SELECT,
+};
+
+struct expr_insn {
+	enum expr_op op;
+	/* the index of the value of an EXPR_OP_ID */
+	int id;
+	double num;
+};
+
+/* An expression compiled to the ops evaluating it on a stack */
+struct expr_prog {
+	int nr_insns;
+	int depth;
+	struct expr_insn insns[EXPR_MAX_INSNS];
+};
+
 void expr__ctx_init(struct parse_ctx *ctx);
 void expr__add_id(struct parse_ctx *ctx, const char *id, double val);
-#ifndef IN_EXPR_Y
 int expr__parse(double *final_val, struct parse_ctx *ctx, const char **pp);
-#endif
+struct expr_prog *expr__compile(struct parse_ctx *ctx, const char **pp);
+int expr__eval(struct expr_prog *prog, const double *vals, double *final_val);
 int expr__find_other(const char *p, const char *one, const char ***other,
 		int *num_other);
 
@@ -2,7 +2,6 @@
 %{
 #include "util.h"
 #include "util/debug.h"
-#define IN_EXPR_Y 1
 #include "expr.h"
 #include "smt.h"
 #include <string.h>
@@ -11,7 +10,7 @@
 %}
 
 %pure-parser
-%parse-param { double *final_val }
+%parse-param { struct expr_prog *prog }
 %parse-param { struct parse_ctx *ctx }
 %parse-param { const char **pp }
 %lex-param { const char **pp }
@@ -31,62 +30,109 @@
 %left '-' '+'
 %left '*' '/' '%'
 %left NEG NOT
-%type <num> expr if_expr
 
 %{
-static int expr__lex(YYSTYPE *res, const char **pp);
+static int expr_prog__lex(YYSTYPE *res, const char **pp);
 
-static void expr__error(double *final_val __maybe_unused,
-		       struct parse_ctx *ctx __maybe_unused,
-		       const char **pp __maybe_unused,
-		       const char *s)
+static void expr_prog__error(struct expr_prog *prog __maybe_unused,
+			     struct parse_ctx *ctx __maybe_unused,
+			     const char **pp __maybe_unused,
+			     const char *s)
 {
 	pr_debug("%s\n", s);
 }
 
-static int lookup_id(struct parse_ctx *ctx, char *id, double *val)
+static int lookup_id(struct parse_ctx *ctx, char *id)
 {
 	int i;
 
 	for (i = 0; i < ctx->num_ids; i++) {
-		if (!strcasecmp(ctx->ids[i].name, id)) {
-			*val = ctx->ids[i].val;
-			return 0;
-		}
+		if (!strcasecmp(ctx->ids[i].name, id))
+			return i;
 	}
 	return -1;
 }
 
+/* The number of values each op pushes, less the ones it pops */
+static const int expr_op__stack[] = {
+	[EXPR_OP_NUM]	 =  1,
+	[EXPR_OP_ID]	 =  1,
+	[EXPR_OP_OR]	 = -1,
+	[EXPR_OP_AND]	 = -1,
+	[EXPR_OP_XOR]	 = -1,
+	[EXPR_OP_ADD]	 = -1,
+	[EXPR_OP_SUB]	 = -1,
+	[EXPR_OP_MUL]	 = -1,
+	[EXPR_OP_DIV]	 = -1,
+	[EXPR_OP_MOD]	 = -1,
+	[EXPR_OP_NEG]	 =  0,
+	[EXPR_OP_MIN]	 = -1,
+	[EXPR_OP_MAX]	 = -1,
+	[EXPR_OP_SELECT] = -2,
+};
+
+static int expr_prog__emit(struct expr_prog *prog, enum expr_op op,
+			   int id, double num)
+{
+	struct expr_insn *insn;
+
+	if (prog->nr_insns == EXPR_MAX_INSNS) {
+		pr_debug("expression too long\n");
+		return -1;
+	}
+
+	prog->depth += expr_op__stack[op];
+	if (prog->depth > EXPR_MAX_STACK) {
+		pr_debug("expression too deep\n");
+		return -1;
+	}
+
+	insn = &prog->insns[prog->nr_insns++];
+	insn->op  = op;
+	insn->id  = id;
+	insn->num = num;
+	return 0;
+}
+
+#define EMIT(op, id, num)					\
+	do {							\
+		if (expr_prog__emit(prog, op, id, num) < 0)	\
+			YYABORT;				\
+	} while (0)
+
 %}
 %%
 
-all_expr: if_expr			{ *final_val = $1; }
+all_expr: if_expr
 	;
 
 if_expr:
-	expr IF expr ELSE expr { $$ = $3 ? $1 : $5; }
+	expr IF expr ELSE expr	{ EMIT(EXPR_OP_SELECT, 0, 0); }
 	| expr
 	;
 
-expr:	  NUMBER
-	| ID			{ if (lookup_id(ctx, $1, &$$) < 0) {
+expr:	  NUMBER		{ EMIT(EXPR_OP_NUM, 0, $1); }
+	| ID			{ int id = lookup_id(ctx, $1);
+
+				  if (id < 0) {
 					pr_debug("%s not found\n", $1);
 					YYABORT;
 				  }
+				  EMIT(EXPR_OP_ID, id, 0);
 				}
-	| expr '|' expr		{ $$ = (long)$1 | (long)$3; }
-	| expr '&' expr		{ $$ = (long)$1 & (long)$3; }
-	| expr '^' expr		{ $$ = (long)$1 ^ (long)$3; }
-	| expr '+' expr		{ $$ = $1 + $3; }
-	| expr '-' expr		{ $$ = $1 - $3; }
-	| expr '*' expr		{ $$ = $1 * $3; }
-	| expr '/' expr		{ if ($3 == 0) YYABORT; $$ = $1 / $3; }
-	| expr '%' expr		{ if ((long)$3 == 0) YYABORT; $$ = (long)$1 % (long)$3; }
-	| '-' expr %prec NEG	{ $$ = -$2; }
-	| '(' if_expr ')'	{ $$ = $2; }
-	| MIN '(' expr ',' expr ')' { $$ = $3 < $5 ? $3 : $5; }
-	| MAX '(' expr ',' expr ')' { $$ = $3 > $5 ? $3 : $5; }
-	| SMT_ON		 { $$ = smt_on() > 0; }
+	| expr '|' expr		{ EMIT(EXPR_OP_OR, 0, 0); }
+	| expr '&' expr		{ EMIT(EXPR_OP_AND, 0, 0); }
+	| expr '^' expr		{ EMIT(EXPR_OP_XOR, 0, 0); }
+	| expr '+' expr		{ EMIT(EXPR_OP_ADD, 0, 0); }
+	| expr '-' expr		{ EMIT(EXPR_OP_SUB, 0, 0); }
+	| expr '*' expr		{ EMIT(EXPR_OP_MUL, 0, 0); }
+	| expr '/' expr		{ EMIT(EXPR_OP_DIV, 0, 0); }
+	| expr '%' expr		{ EMIT(EXPR_OP_MOD, 0, 0); }
+	| '-' expr %prec NEG	{ EMIT(EXPR_OP_NEG, 0, 0); }
+	| '(' if_expr ')'
+	| MIN '(' expr ',' expr ')' { EMIT(EXPR_OP_MIN, 0, 0); }
+	| MAX '(' expr ',' expr ')' { EMIT(EXPR_OP_MAX, 0, 0); }
+	| SMT_ON		 { EMIT(EXPR_OP_NUM, 0, smt_on() > 0); }
 	;
 
 %%
@@ -140,7 +186,7 @@ static int expr__symbol(YYSTYPE *res, const char *p, const char **pp)
 	return ID;
 }
 
-static int expr__lex(YYSTYPE *res, const char **pp)
+static int expr_prog__lex(YYSTYPE *res, const char **pp)
 {
 	int tok;
 	const char *s;
@@ -166,6 +212,103 @@ static int expr__lex(YYSTYPE *res, const char **pp)
 	return tok;
 }
 
+/*
+ * Compile the expression at *pp, the ids in it become the indexes of their
+ * values in ctx, for expr__eval() to get them from an array of values in
+ * the same order.
+ */
+struct expr_prog *expr__compile(struct parse_ctx *ctx, const char **pp)
+{
+	struct expr_prog *prog = zalloc(sizeof(*prog));
+
+	if (prog && expr_prog__parse(prog, ctx, pp)) {
+		free(prog);
+		prog = NULL;
+	}
+	return prog;
+}
+
+int expr__eval(struct expr_prog *prog, const double *vals, double *final_val)
+{
+	double stack[EXPR_MAX_STACK];
+	int i, sp = 0;
+
+	for (i = 0; i < prog->nr_insns; i++) {
+		struct expr_insn *insn = &prog->insns[i];
+		double a, b;
+
+		switch (insn->op) {
+		case EXPR_OP_NUM:
+			stack[sp++] = insn->num;
+			continue;
+		case EXPR_OP_ID:
+			stack[sp++] = vals[insn->id];
+			continue;
+		case EXPR_OP_NEG:
+			stack[sp - 1] = -stack[sp - 1];
+			continue;
+		case EXPR_OP_SELECT:
+			sp -= 2;
+			stack[sp - 1] = stack[sp] ? stack[sp - 1] : stack[sp + 1];
+			continue;
+		default:
+			break;
+		}
+
+		b = stack[--sp];
+		a = stack[sp - 1];
+
+		switch (insn->op) {
+		case EXPR_OP_OR:  a = (long)a | (long)b; break;
+		case EXPR_OP_AND: a = (long)a & (long)b; break;
+		case EXPR_OP_XOR: a = (long)a ^ (long)b; break;
+		case EXPR_OP_ADD: a = a + b; break;
+		case EXPR_OP_SUB: a = a - b; break;
+		case EXPR_OP_MUL: a = a * b; break;
+		case EXPR_OP_DIV:
+			if (b == 0)
+				return -1;
+			a = a / b;
+			break;
+		case EXPR_OP_MOD:
+			if ((long)b == 0)
+				return -1;
+			a = (long)a % (long)b;
+			break;
+		case EXPR_OP_MIN: a = a < b ? a : b; break;
+		case EXPR_OP_MAX: a = a > b ? a : b; break;
+		default:
+			return -1;
+		}
+
+		stack[sp - 1] = a;
+	}
+
+	*final_val = stack[0];
+	return 0;
+}
+
+/* Compile the expression and evaluate it with the values in ctx, returns 1 on errors */
+int expr__parse(double *final_val, struct parse_ctx *ctx, const char **pp)
+{
+	double vals[MAX_PARSE_ID];
+	struct expr_prog *prog;
+	int i, ret = 1;
+
+	prog = expr__compile(ctx, pp);
+	if (prog == NULL)
+		return 1;
+
+	for (i = 0; i < ctx->num_ids; i++)
+		vals[i] = ctx->ids[i].val;
+
+	if (!expr__eval(prog, vals, final_val))
+		ret = 0;
+
+	free(prog);
+	return ret;
+}
+
 /* Caller must make sure id is allocated */
 void expr__add_id(struct parse_ctx *ctx, const char *name, double val)
 {
@@ -208,7 +351,7 @@ int expr__find_other(const char *p, const char *one, const char ***other,
 	num_other = 0;
 	for (;;) {
 		YYSTYPE val;
-		int tok = expr__lex(&val, &p);
+		int tok = expr_prog__lex(&val, &p);
 		if (tok == 0) {
 			err = 0;
 			break;
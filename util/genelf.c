@@ -77,13 +77,14 @@ static char shd_string_table[] = {
 	'.', 'e', 'h', '_', 'f', 'r', 'a', 'm', 'e', 0, /* 104 */
 };
 
-static struct buildid_note {
+struct buildid_note {
 	Elf_Note desc;		/* descsz: size of build-id, must be multiple of 4 */
 	char	 name[4];	/* GNU\0 */
 	char	 build_id[20];
-} bnote;
+};
 
-static Elf_Sym symtab[]={
+/* copied for each image, the images may be written on several threads */
+static const Elf_Sym jit_symtab[]={
 	/* symbol 0 MUST be the undefined symbol */
 	{ .st_name  = 0, /* index in sym_string table */
 	  .st_info  = ELF_ST_TYPE(STT_NOTYPE),
@@ -254,10 +255,15 @@ jit_write_elf(int fd, uint64_t load_addr, const char *sym,
 	Elf_Ehdr *ehdr;
 	Elf_Shdr *shdr;
 	uint64_t eh_frame_base_offset;
+	struct buildid_note bnote;
+	Elf_Sym symtab[sizeof(jit_symtab) / sizeof(jit_symtab[0])];
 	char *strsym = NULL;
 	int symlen;
 	int retval = -1;
 
+	memset(&bnote, 0, sizeof(bnote));
+	memcpy(symtab, jit_symtab, sizeof(symtab));
+
 	if (elf_version(EV_CURRENT) == EV_NONE) {
 		warnx("ELF initialization failed");
 		return -1;
@@ -878,6 +878,89 @@ static int write_dir_format(struct feat_fd *ff,
 	return do_write(ff, &data->dir.version, sizeof(data->dir.version));
 }
 
+static int write_compressed(struct feat_fd *ff,
+			    struct perf_evlist *evlist __maybe_unused)
+{
+	struct perf_env *env = &ff->ph->env;
+	int ret;
+
+	ret = do_write(ff, &env->comp_ver, sizeof(env->comp_ver));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &env->comp_type, sizeof(env->comp_type));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &env->comp_level, sizeof(env->comp_level));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &env->comp_ratio, sizeof(env->comp_ratio));
+	if (ret)
+		return ret;
+
+	return do_write(ff, &env->comp_mmap_len, sizeof(env->comp_mmap_len));
+}
+
+static int write_time_index(struct feat_fd *ff,
+			    struct perf_evlist *evlist __maybe_unused)
+{
+	struct perf_env *env = &ff->ph->env;
+	int ret;
+
+	ret = do_write(ff, &env->nr_time_index, sizeof(env->nr_time_index));
+	if (ret)
+		return ret;
+
+	return do_write(ff, env->time_index,
+			env->nr_time_index * sizeof(*env->time_index));
+}
+
+static int write_sorted(struct feat_fd *ff,
+			struct perf_evlist *evlist __maybe_unused)
+{
+	return do_write(ff, &ff->ph->env.nr_sorted_events,
+			sizeof(ff->ph->env.nr_sorted_events));
+}
+
+#define RECORD_MMAP_STATS_FIELDS (sizeof(struct record_mmap_stats) / sizeof(u64))
+
+/*
+ * The poll counters, the number of mmaps and of u64 fields each, then the
+ * record_mmap_stats of every mmap. Newer fields are added at the end.
+ */
+static int write_record_stats(struct feat_fd *ff,
+			      struct perf_evlist *evlist __maybe_unused)
+{
+	struct perf_env *env = &ff->ph->env;
+	u64 nr_fields = RECORD_MMAP_STATS_FIELDS;
+	int ret;
+
+	ret = do_write(ff, &env->record_polls, sizeof(env->record_polls));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &env->record_poll_ns, sizeof(env->record_poll_ns));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &env->record_poll_max_ns, sizeof(env->record_poll_max_ns));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &env->nr_record_stats, sizeof(env->nr_record_stats));
+	if (ret)
+		return ret;
+
+	ret = do_write(ff, &nr_fields, sizeof(nr_fields));
+	if (ret)
+		return ret;
+
+	return do_write(ff, env->record_stats,
+			env->nr_record_stats * sizeof(*env->record_stats));
+}
+
 #ifdef HAVE_LIBBPF_SUPPORT
 static int write_bpf_prog_info(struct feat_fd *ff,
 			       struct perf_evlist *evlist __maybe_unused)
@@ -887,6 +970,9 @@ static int write_bpf_prog_info(struct feat_fd *ff,
 	struct rb_node *next;
 	int ret;
 
+	/* perf inject writes what it read */
+	perf_env__read_feat(env, HEADER_BPF_PROG_INFO);
+
 	down_read(&env->bpf_progs.lock);
 
 	ret = do_write(ff, &env->bpf_progs.infos_cnt,
@@ -936,6 +1022,9 @@ static int write_bpf_btf(struct feat_fd *ff,
 	struct rb_node *next;
 	int ret;
 
+	/* perf inject writes what it read */
+	perf_env__read_feat(env, HEADER_BPF_BTF);
+
 	down_read(&env->bpf_progs.lock);
 
 	ret = do_write(ff, &env->bpf_progs.btfs_cnt,
@@ -995,7 +1084,7 @@ static bool cpu_cache_level__cmp(struct cpu_cache_level *a, struct cpu_cache_lev
 	return true;
 }
 
-static int cpu_cache_level__read(struct cpu_cache_level *cache, u32 cpu, u16 level)
+int cpu_cache_level__read(struct cpu_cache_level *cache, u32 cpu, u16 level)
 {
 	char path[PATH_MAX], file[PATH_MAX];
 	struct stat st;
@@ -1452,6 +1541,62 @@ static void print_dir_format(struct feat_fd *ff, FILE *fp)
 	fprintf(fp, "# directory data version : %"PRIu64"\n", data->dir.version);
 }
 
+static void print_compressed(struct feat_fd *ff, FILE *fp)
+{
+	struct perf_env *env = &ff->ph->env;
+
+	fprintf(fp, "# compressed : %s, level = %d, ratio = %d\n",
+		env->comp_type == PERF_COMP_ZSTD ? "Zstd" : "Unknown",
+		env->comp_level, env->comp_ratio);
+}
+
+static void print_time_index(struct feat_fd *ff, FILE *fp)
+{
+	struct perf_env *env = &ff->ph->env;
+	struct time_index_entry *last;
+
+	if (!env->nr_time_index)
+		return;
+
+	last = &env->time_index[env->nr_time_index - 1];
+	fprintf(fp, "# time index : %" PRIu64 " entries, up to time %" PRIu64 " at offset %#" PRIx64 "\n",
+		env->nr_time_index, last->time, last->offset);
+}
+
+static void print_sorted(struct feat_fd *ff, FILE *fp)
+{
+	fprintf(fp, "# sorted : %" PRIu64 " events in time order\n",
+		ff->ph->env.nr_sorted_events);
+}
+
+static void print_record_stats(struct feat_fd *ff, FILE *fp)
+{
+	struct perf_env *env = &ff->ph->env;
+	u64 i;
+
+	fprintf(fp, "# record stats : %" PRIu64 " mmaps, %" PRIu64 " polls, %.3f ms avg, %.3f ms max\n",
+		env->nr_record_stats, env->record_polls,
+		env->record_polls ? env->record_poll_ns / 1e6 / env->record_polls : 0.0,
+		env->record_poll_max_ns / 1e6);
+
+	for (i = 0; i < env->nr_record_stats; i++) {
+		struct record_mmap_stats *st = &env->record_stats[i];
+
+		if ((s64)st->cpu < 0)
+			fprintf(fp, "#   mmap %" PRIu64 ":", i);
+		else
+			fprintf(fp, "#   cpu %" PRIu64 ":", st->cpu);
+
+		fprintf(fp, " %.3f MB, %" PRIu64 " events in %" PRIu64 " reads, %.1f%% max used,"
+			" push %.3f ms (write %.3f ms, compress %.3f ms),"
+			" lost %" PRIu64 " in %" PRIu64 " records, %" PRIu64 " throttle, %" PRIu64 " unthrottle\n",
+			st->bytes / 1024.0 / 1024.0, st->events, st->reads,
+			st->size ? 100.0 * st->max_used / st->size : 0.0,
+			st->push_ns / 1e6, st->write_ns / 1e6, st->compress_ns / 1e6,
+			st->lost, st->lost_records, st->throttle, st->unthrottle);
+	}
+}
+
 static void print_bpf_prog_info(struct feat_fd *ff, FILE *fp)
 {
 	struct perf_env *env = &ff->ph->env;
@@ -2545,6 +2690,105 @@ static int process_dir_format(struct feat_fd *ff,
 	return do_read_u64(ff, &data->dir.version);
 }
 
+static int process_compressed(struct feat_fd *ff,
+			      void *data __maybe_unused)
+{
+	struct perf_env *env = &ff->ph->env;
+
+	if (do_read_u32(ff, &env->comp_ver))
+		return -1;
+
+	if (do_read_u32(ff, &env->comp_type))
+		return -1;
+
+	if (do_read_u32(ff, &env->comp_level))
+		return -1;
+
+	if (do_read_u32(ff, &env->comp_ratio))
+		return -1;
+
+	if (do_read_u32(ff, &env->comp_mmap_len))
+		return -1;
+
+	return 0;
+}
+
+static int process_time_index(struct feat_fd *ff,
+			      void *data __maybe_unused)
+{
+	struct perf_env *env = &ff->ph->env;
+	struct time_index_entry *entries;
+	u64 i, nr;
+
+	if (do_read_u64(ff, &nr))
+		return -1;
+
+	if (nr > ff->size / sizeof(*entries))
+		return -1;
+
+	entries = calloc(nr, sizeof(*entries));
+	if (!entries)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		if (do_read_u64(ff, &entries[i].time) ||
+		    do_read_u64(ff, &entries[i].offset)) {
+			free(entries);
+			return -1;
+		}
+	}
+
+	free(env->time_index);
+	env->time_index = entries;
+	env->nr_time_index = nr;
+	return 0;
+}
+
+static int process_sorted(struct feat_fd *ff,
+			  void *data __maybe_unused)
+{
+	return do_read_u64(ff, &ff->ph->env.nr_sorted_events);
+}
+
+static int process_record_stats(struct feat_fd *ff,
+				void *data __maybe_unused)
+{
+	struct perf_env *env = &ff->ph->env;
+	struct record_mmap_stats *stats;
+	u64 i, j, nr, nr_fields, skip;
+
+	if (do_read_u64(ff, &env->record_polls) ||
+	    do_read_u64(ff, &env->record_poll_ns) ||
+	    do_read_u64(ff, &env->record_poll_max_ns) ||
+	    do_read_u64(ff, &nr) ||
+	    do_read_u64(ff, &nr_fields))
+		return -1;
+
+	if (!nr_fields || nr > ff->size / sizeof(u64) / nr_fields)
+		return -1;
+
+	stats = calloc(nr, sizeof(*stats));
+	if (!stats)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		u64 *fields = (u64 *)&stats[i];
+
+		/* the fields this perf doesn't know about are skipped */
+		for (j = 0; j < nr_fields; j++) {
+			if (do_read_u64(ff, j < RECORD_MMAP_STATS_FIELDS ? &fields[j] : &skip)) {
+				free(stats);
+				return -1;
+			}
+		}
+	}
+
+	free(env->record_stats);
+	env->record_stats = stats;
+	env->nr_record_stats = nr;
+	return 0;
+}
+
 #ifdef HAVE_LIBBPF_SUPPORT
 static int process_bpf_prog_info(struct feat_fd *ff, void *data __maybe_unused)
 {
@@ -2730,6 +2974,10 @@ static const struct feature_ops feat_ops[HEADER_LAST_FEATURE] = {
 	FEAT_OPN(DIR_FORMAT,	dir_format,	false),
 	FEAT_OPR(BPF_PROG_INFO, bpf_prog_info,  false),
 	FEAT_OPR(BPF_BTF,       bpf_btf,        false),
+	FEAT_OPR(COMPRESSED,	compressed,	false),
+	FEAT_OPR(TIME_INDEX,	time_index,	false),
+	FEAT_OPR(SORTED,	sorted,		false),
+	FEAT_OPR(RECORD_STATS,	record_stats,	false),
 };
 
 struct header_print_data {
@@ -2756,6 +3004,8 @@ static int perf_file_section__fprintf_info(struct perf_file_section *section,
 	if (!feat_ops[feat].print)
 		return 0;
 
+	perf_env__read_feat(&ph->env, feat);
+
 	ff = (struct  feat_fd) {
 		.fd = fd,
 		.ph = ph,
@@ -3256,6 +3506,81 @@ static int perf_file_section__process(struct perf_file_section *section,
 	return feat_ops[feat].process(&fdd, data);
 }
 
+/*
+ * What these describe is only looked at by a few commands, some are large:
+ * one BPF program info and BTF per program loaded while recording.
+ */
+static bool perf_header__lazy_feat(int feat)
+{
+	switch (feat) {
+	case HEADER_CMDLINE:
+	case HEADER_NUMA_TOPOLOGY:
+	case HEADER_PMU_MAPPINGS:
+	case HEADER_CACHE:
+	case HEADER_MEM_TOPOLOGY:
+	case HEADER_BPF_PROG_INFO:
+	case HEADER_BPF_BTF:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int perf_file_section__process_lazy(struct perf_file_section *section,
+					   struct perf_header *ph,
+					   int feat, int fd, void *data)
+{
+	struct perf_env_lazy *lazy = ph->env.lazy;
+
+	if (!lazy || !perf_header__lazy_feat(feat))
+		return perf_file_section__process(section, ph, feat, fd, data);
+
+	lazy->sec[feat].offset = section->offset;
+	lazy->sec[feat].size   = section->size;
+	lazy->feats |= 1ULL << feat;
+	return 0;
+}
+
+static struct perf_env_lazy *perf_env_lazy__new(int fd)
+{
+	struct perf_env_lazy *lazy = zalloc(sizeof(*lazy));
+
+	if (lazy == NULL)
+		return NULL;
+
+	/* the sections may be read after the file is closed */
+	lazy->fd = dup(fd);
+	if (lazy->fd < 0) {
+		free(lazy);
+		return NULL;
+	}
+
+	pthread_mutex_init(&lazy->lock, NULL);
+	return lazy;
+}
+
+void perf_env__read_feat(struct perf_env *env, int feat)
+{
+	struct perf_env_lazy *lazy = env->lazy;
+
+	if (lazy == NULL)
+		return;
+
+	pthread_mutex_lock(&lazy->lock);
+	if (lazy->feats & (1ULL << feat)) {
+		struct perf_header *ph = container_of(env, struct perf_header, env);
+		struct perf_file_section section = {
+			.offset	= lazy->sec[feat].offset,
+			.size	= lazy->sec[feat].size,
+		};
+
+		lazy->feats &= ~(1ULL << feat);
+		if (perf_file_section__process(&section, ph, feat, lazy->fd, NULL) < 0)
+			pr_debug("failed to read the %s feature\n", feat_ops[feat].name);
+	}
+	pthread_mutex_unlock(&lazy->lock);
+}
+
 static int perf_file_header__read_pipe(struct perf_pipe_file_header *header,
 				       struct perf_header *ph, int fd,
 				       bool repipe)
@@ -3475,8 +3800,9 @@ int perf_session__read_header(struct perf_session *session)
 		lseek(fd, tmp, SEEK_SET);
 	}
 
+	header->env.lazy = perf_env_lazy__new(fd);
 	perf_header__process_sections(header, fd, &session->tevent,
-				      perf_file_section__process);
+				      perf_file_section__process_lazy);
 
 	if (perf_evlist__prepare_tracepoint_events(session->evlist,
 						   session->tevent.pevent))
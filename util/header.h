@@ -42,6 +42,10 @@ enum {
 	HEADER_DIR_FORMAT,
 	HEADER_BPF_PROG_INFO,
 	HEADER_BPF_BTF,
+	HEADER_COMPRESSED,
+	HEADER_TIME_INDEX,
+	HEADER_SORTED,
+	HEADER_RECORD_STATS,
 	HEADER_LAST_FEATURE,
 	HEADER_FEAT_BITS	= 256,
 };
@@ -114,6 +118,13 @@ int perf_header__process_sections(struct perf_header *header, int fd,
 
 int perf_header__fprintf_info(struct perf_session *s, FILE *fp, bool full);
 
+/*
+ * The cmdline, NUMA, PMU mappings, cache, memory topology and BPF sections
+ * of a perf.data file are only read when first needed, this reads @feat
+ * if it was left for later. Nothing to do for the other envs.
+ */
+void perf_env__read_feat(struct perf_env *env, int feat);
+
 int perf_event__synthesize_features(struct perf_tool *tool,
 				    struct perf_session *session,
 				    struct perf_evlist *evlist,
@@ -175,6 +186,9 @@ int do_write(struct feat_fd *fd, const void *buf, size_t size);
 int write_padded(struct feat_fd *fd, const void *bf,
 		 size_t count, size_t count_aligned);
 
+/* Returns 1 when cpu has no cache index level */
+int cpu_cache_level__read(struct cpu_cache_level *cache, u32 cpu, u16 level);
+
 /*
  * arch specific callback
  */
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0
 #include "callchain.h"
+#include "cgroup.h"
 #include "util.h"
 #include "build-id.h"
 #include "hist.h"
@@ -15,10 +16,14 @@
 #include "symbol.h"
 #include "thread.h"
 #include "ui/progress.h"
+#include "stage-time.h"
 #include <errno.h>
 #include <math.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/param.h>
+#include <linux/hash.h>
 #include <linux/time64.h>
 
 static bool hists__filter_entry_by_dso(struct hists *hists,
@@ -98,6 +103,13 @@ void hists__calc_col_len(struct hists *hists, struct hist_entry *h)
 		hists__new_col_len(hists, HISTC_DSO, len);
 	}
 
+	if (h->cgroup && h->thread) {
+		struct cgroup *cgrp = cgroup__find(h->thread->mg->machine->env, h->cgroup);
+
+		if (cgrp != NULL)
+			hists__new_col_len(hists, HISTC_CGROUP, strlen(cgrp->name));
+	}
+
 	if (h->parent)
 		hists__new_col_len(hists, HISTC_PARENT, h->parent->namelen);
 
@@ -185,6 +197,7 @@ void hists__calc_col_len(struct hists *hists, struct hist_entry *h)
 	}
 
 	hists__new_col_len(hists, HISTC_CGROUP_ID, 20);
+	hists__new_col_len(hists, HISTC_CGROUP, 20);
 	hists__new_col_len(hists, HISTC_CPU, 3);
 	hists__new_col_len(hists, HISTC_SOCKET, 6);
 	hists__new_col_len(hists, HISTC_MEM_LOCKED, 6);
@@ -276,14 +289,96 @@ static void he_stat__add_stat(struct he_stat *dest, struct he_stat *src)
 	dest->weight		+= src->weight;
 }
 
-static void he_stat__decay(struct he_stat *he_stat)
+static void he_stat__decay(struct he_stat *he_stat, unsigned int nr)
 {
-	he_stat->period = (he_stat->period * 7) / 8;
-	he_stat->nr_events = (he_stat->nr_events * 7) / 8;
+	unsigned int i;
+
+	for (i = 0; i < nr && (he_stat->period || he_stat->nr_events); i++) {
+		he_stat->period = (he_stat->period * 7) / 8;
+		he_stat->nr_events = (he_stat->nr_events * 7) / 8;
+	}
 	/* XXX need decay for weight too? */
 }
 
-static void hists__delete_entry(struct hists *hists, struct hist_entry *he);
+#define HISTS_HASH_MIN_BITS	10
+
+static struct hist_entry *hists__hash_find(struct hists *hists,
+					   struct hist_entry *entry, u64 hash)
+{
+	struct hists_hash *hh = hists->entries_hash;
+	struct hlist_head *head;
+	struct hist_entry *he;
+
+	head = &hh->table[hash_64(hash, hh->bits)];
+	hlist_for_each_entry(he, head, hash_node) {
+		if (he->sort_hash == hash && !hist_entry__cmp(he, entry))
+			return he;
+	}
+
+	return NULL;
+}
+
+static void hists_hash__resize(struct hists_hash *hh, unsigned int bits)
+{
+	struct hlist_head *table;
+	struct hlist_node *tmp;
+	struct hist_entry *he;
+	unsigned int i;
+
+	table = calloc(1UL << bits, sizeof(*table));
+	if (!table)
+		return;
+
+	for (i = 0; hh->table && i < (1U << hh->bits); i++) {
+		hlist_for_each_entry_safe(he, tmp, &hh->table[i], hash_node) {
+			hlist_del(&he->hash_node);
+			hlist_add_head(&he->hash_node, &table[hash_64(he->sort_hash, bits)]);
+		}
+	}
+
+	free(hh->table);
+	hh->table = table;
+	hh->bits = bits;
+}
+
+static void hists__hash_add(struct hists *hists, struct hist_entry *he, u64 hash)
+{
+	struct hists_hash *hh = hists->entries_hash;
+
+	if (hh->nr >= (2ULL << hh->bits))
+		hists_hash__resize(hh, hh->bits + 1);
+
+	he->sort_hash = hash;
+	hlist_add_head(&he->hash_node, &hh->table[hash_64(hash, hh->bits)]);
+	hh->nr++;
+}
+
+/* Only the entries of the current entries_in tree are hashed */
+static void hists__hash_del(struct hists *hists, struct hist_entry *he)
+{
+	if (hlist_unhashed(&he->hash_node))
+		return;
+
+	hlist_del_init(&he->hash_node);
+	hists->entries_hash->nr--;
+}
+
+/* The entries_in tree of hh was rotated, its entries are not to be found anymore. */
+static void hists_hash__reset(struct hists_hash *hh)
+{
+	struct hlist_node *tmp;
+	struct hist_entry *he;
+	unsigned int i;
+
+	if (!hh->nr)
+		return;
+
+	for (i = 0; i < (1U << hh->bits); i++) {
+		hlist_for_each_entry_safe(he, tmp, &hh->table[i], hash_node)
+			hlist_del_init(&he->hash_node);
+	}
+	hh->nr = 0;
+}
 
 static bool hists__decay_entry(struct hists *hists, struct hist_entry *he)
 {
@@ -293,10 +388,11 @@ static bool hists__decay_entry(struct hists *hists, struct hist_entry *he)
 	if (prev_period == 0)
 		return true;
 
-	he_stat__decay(&he->stat);
+	he_stat__decay(&he->stat, 1);
 	if (symbol_conf.cumulate_callchain)
-		he_stat__decay(he->stat_acc);
-	decay_callchain(he->callchain);
+		he_stat__decay(he->stat_acc, 1);
+	if (hist_entry__has_callchains(he))
+		decay_callchain(he->callchain, 1);
 
 	diff = prev_period - he->stat.period;
 
@@ -321,7 +417,48 @@ static bool hists__decay_entry(struct hists *hists, struct hist_entry *he)
 	return he->stat.period == 0;
 }
 
-static void hists__delete_entry(struct hists *hists, struct hist_entry *he)
+/*
+ * Without a hierarchy the collapsed entries are decayed by just bumping
+ * hists->decay_epoch, each entry catches up on the decays it missed when
+ * it gets merged into or resorted, its callchain when it gets merged into
+ * or shown, see hist_entry__decay_stat() and hist_entry__decay_callchain().
+ */
+static bool hists__lazy_decay(struct hists *hists)
+{
+	return hists__has(hists, need_collapse) && !symbol_conf.report_hierarchy;
+}
+
+/* Returns true if it decayed to nothing and can go */
+static bool hist_entry__decay_stat(struct hist_entry *he)
+{
+	unsigned int nr = he->hists->decay_epoch - he->decay_epoch;
+
+	if (nr == 0)
+		return false;
+
+	he->decay_epoch = he->hists->decay_epoch;
+	if (he->stat.period == 0)
+		return true;
+
+	he_stat__decay(&he->stat, nr);
+	if (symbol_conf.cumulate_callchain)
+		he_stat__decay(he->stat_acc, nr);
+
+	return he->stat.period == 0;
+}
+
+static void hist_entry__decay_callchain(struct hist_entry *he)
+{
+	unsigned int nr = he->hists->decay_epoch - he->chain_decay_epoch;
+
+	if (nr == 0)
+		return;
+
+	he->chain_decay_epoch = he->hists->decay_epoch;
+	decay_callchain(he->callchain, nr);
+}
+
+void hists__delete_entry(struct hists *hists, struct hist_entry *he)
 {
 	struct rb_root_cached *root_in;
 	struct rb_root_cached *root_out;
@@ -339,6 +476,7 @@ static void hists__delete_entry(struct hists *hists, struct hist_entry *he)
 
 	rb_erase_cached(&he->rb_node_in, root_in);
 	rb_erase_cached(&he->rb_node, root_out);
+	hists__hash_del(hists, he);
 
 	--hists->nr_entries;
 	if (!he->filtered)
@@ -349,15 +487,23 @@ static void hists__delete_entry(struct hists *hists, struct hist_entry *he)
 
 void hists__decay_entries(struct hists *hists, bool zap_user, bool zap_kernel)
 {
-	struct rb_node *next = rb_first_cached(&hists->entries);
+	bool lazy = hists__lazy_decay(hists);
+	struct rb_node *next;
 	struct hist_entry *n;
 
+	if (lazy) {
+		hists->decay_epoch++;
+		if (!zap_user && !zap_kernel)
+			return;
+	}
+
+	next = rb_first_cached(&hists->entries);
 	while (next) {
 		n = rb_entry(next, struct hist_entry, rb_node);
 		next = rb_next(&n->rb_node);
 		if (((zap_user && n->level == '.') ||
 		     (zap_kernel && n->level != '.') ||
-		     hists__decay_entry(hists, n))) {
+		     (!lazy && hists__decay_entry(hists, n)))) {
 			hists__delete_entry(hists, n);
 		}
 	}
@@ -381,11 +527,15 @@ void hists__delete_entries(struct hists *hists)
  */
 
 static int hist_entry__init(struct hist_entry *he,
+			    struct hists *hists,
 			    struct hist_entry *template,
 			    bool sample_self,
-			    size_t callchain_size)
+			    size_t callchain_size,
+			    bool hierarchy)
 {
 	*he = *template;
+	he->hists = hists;
+	INIT_HLIST_NODE(&he->hash_node);
 	he->callchain_size = callchain_size;
 
 	if (symbol_conf.cumulate_callchain) {
@@ -421,8 +571,11 @@ static int hist_entry__init(struct hist_entry *he,
 		map__get(he->mem_info->daddr.map);
 	}
 
-	if (hist_entry__has_callchains(he) && symbol_conf.use_callchain)
+	if (hist_entry__has_callchains(he) && symbol_conf.use_callchain) {
 		callchain_init(he->callchain);
+		if (slab__initialized(&hists->callchain_alloc.nodes))
+			he->callchain->node.alloc = &hists->callchain_alloc;
+	}
 
 	if (he->raw_data) {
 		he->raw_data = memdup(he->raw_data, he->raw_size);
@@ -430,13 +583,14 @@ static int hist_entry__init(struct hist_entry *he,
 			goto err_infos;
 	}
 
-	if (he->srcline) {
+	/* the hierarchy entries take the srcline of the template */
+	if (he->srcline && !hierarchy) {
 		he->srcline = strdup(he->srcline);
 		if (he->srcline == NULL)
 			goto err_rawdata;
 	}
 
-	if (symbol_conf.res_sample) {
+	if (symbol_conf.res_sample && !hierarchy) {
 		he->res_samples = calloc(sizeof(struct res_sample),
 					symbol_conf.res_sample);
 		if (!he->res_samples)
@@ -475,14 +629,23 @@ err:
 	return -ENOMEM;
 }
 
-static void *hist_entry__zalloc(size_t size)
+/*
+ * The entries of a hists all have the same size, the callchain_root is
+ * there or not depending on symbol_conf.use_callchain, so they can come
+ * from a slab that goes away with the hists.
+ */
+static void *hist_entry__zalloc(struct hists *hists, size_t size)
 {
-	return zalloc(size + sizeof(struct hist_entry));
+	if (!slab__initialized(&hists->entry_slab))
+		slab__init(&hists->entry_slab, size + sizeof(struct hist_entry),
+			   MEM_STAT__HIST_ENTRIES);
+
+	return slab__zalloc(&hists->entry_slab);
 }
 
-static void hist_entry__free(void *ptr)
+static void hist_entry__free(struct hists *hists, void *ptr)
 {
-	free(ptr);
+	slab__free(&hists->entry_slab, ptr);
 }
 
 static struct hist_entry_ops default_ops = {
@@ -490,7 +653,8 @@ static struct hist_entry_ops default_ops = {
 	.free	= hist_entry__free,
 };
 
-static struct hist_entry *hist_entry__new(struct hist_entry *template,
+static struct hist_entry *hist_entry__new(struct hists *hists,
+					  struct hist_entry *template,
 					  bool sample_self)
 {
 	struct hist_entry_ops *ops = template->ops;
@@ -504,11 +668,12 @@ static struct hist_entry *hist_entry__new(struct hist_entry *template,
 	if (symbol_conf.use_callchain)
 		callchain_size = sizeof(struct callchain_root);
 
-	he = ops->new(callchain_size);
+	he = ops->new(hists, callchain_size);
 	if (he) {
-		err = hist_entry__init(he, template, sample_self, callchain_size);
+		err = hist_entry__init(he, hists, template, sample_self,
+				       callchain_size, false);
 		if (err) {
-			ops->free(he);
+			ops->free(hists, he);
 			he = NULL;
 		}
 	}
@@ -533,6 +698,25 @@ static void hist_entry__add_callchain_period(struct hist_entry *he, u64 period)
 		he->hists->callchain_non_filtered_period += period;
 }
 
+/*
+ * Look up entries_in on the digest of the sort keys before walking the
+ * rbtree, so that samples hitting an existing entry don't need to go
+ * thru the chain of sort key compares at each level of the tree. The
+ * tree is still used for new entries, every key compares equal with
+ * entries of the same digest, but not the other way around.
+ */
+static bool hists__hash_entry(struct hists *hists, struct hist_entry *entry,
+			      u64 *hash)
+{
+	if (!hist_entry__sort_hash(entry, hash))
+		return false;
+
+	if (!hists->entries_hash->table)
+		hists_hash__resize(hists->entries_hash, HISTS_HASH_MIN_BITS);
+
+	return hists->entries_hash->table != NULL;
+}
+
 static struct hist_entry *hists__findnew_entry(struct hists *hists,
 					       struct hist_entry *entry,
 					       struct addr_location *al,
@@ -545,6 +729,16 @@ static struct hist_entry *hists__findnew_entry(struct hists *hists,
 	u64 period = entry->stat.period;
 	u64 weight = entry->stat.weight;
 	bool leftmost = true;
+	bool hashed;
+	u64 hash;
+
+	hist_entry__init_sort_keys(entry);
+	hashed = hists__hash_entry(hists, entry, &hash);
+	if (hashed) {
+		he = hists__hash_find(hists, entry, hash);
+		if (he)
+			goto found;
+	}
 
 	p = &hists->entries_in->rb_root.rb_node;
 
@@ -560,32 +754,8 @@ static struct hist_entry *hists__findnew_entry(struct hists *hists,
 		 */
 		cmp = hist_entry__cmp(he, entry);
 
-		if (!cmp) {
-			if (sample_self) {
-				he_stat__add_period(&he->stat, period, weight);
-				hist_entry__add_callchain_period(he, period);
-			}
-			if (symbol_conf.cumulate_callchain)
-				he_stat__add_period(he->stat_acc, period, weight);
-
-			/*
-			 * This mem info was allocated from sample__resolve_mem
-			 * and will not be used anymore.
-			 */
-			mem_info__zput(entry->mem_info);
-
-			/* If the map of an existing hist_entry has
-			 * become out-of-date due to an exec() or
-			 * similar, update it.  Otherwise we will
-			 * mis-adjust symbol addresses when computing
-			 * the history counter to increment.
-			 */
-			if (he->ms.map != entry->ms.map) {
-				map__put(he->ms.map);
-				he->ms.map = map__get(entry->ms.map);
-			}
-			goto out;
-		}
+		if (!cmp)
+			goto found;
 
 		if (cmp < 0)
 			p = &(*p)->rb_left;
@@ -595,7 +765,7 @@ static struct hist_entry *hists__findnew_entry(struct hists *hists,
 		}
 	}
 
-	he = hist_entry__new(entry, sample_self);
+	he = hist_entry__new(hists, entry, sample_self);
 	if (!he)
 		return NULL;
 
@@ -605,6 +775,34 @@ static struct hist_entry *hists__findnew_entry(struct hists *hists,
 
 	rb_link_node(&he->rb_node_in, parent, p);
 	rb_insert_color_cached(&he->rb_node_in, hists->entries_in, leftmost);
+	if (hashed)
+		hists__hash_add(hists, he, hash);
+	goto out;
+
+found:
+	if (sample_self) {
+		he_stat__add_period(&he->stat, period, weight);
+		hist_entry__add_callchain_period(he, period);
+	}
+	if (symbol_conf.cumulate_callchain)
+		he_stat__add_period(he->stat_acc, period, weight);
+
+	/*
+	 * This mem info was allocated from sample__resolve_mem
+	 * and will not be used anymore.
+	 */
+	mem_info__zput(entry->mem_info);
+
+	/* If the map of an existing hist_entry has
+	 * become out-of-date due to an exec() or
+	 * similar, update it.  Otherwise we will
+	 * mis-adjust symbol addresses when computing
+	 * the history counter to increment.
+	 */
+	if (he->ms.map != entry->ms.map) {
+		map__put(he->ms.map);
+		he->ms.map = map__get(entry->ms.map);
+	}
 out:
 	if (sample_self)
 		he_stat__add_cpumode_period(&he->stat, al->cpumode, period);
@@ -657,6 +855,7 @@ __hists__add_entry(struct hists *hists,
 			.dev = ns ? ns->link_info[CGROUP_NS_INDEX].dev : 0,
 			.ino = ns ? ns->link_info[CGROUP_NS_INDEX].ino : 0,
 		},
+		.cgroup = sample->cgroup,
 		.ms = {
 			.map	= al->map,
 			.sym	= al->sym,
@@ -888,7 +1087,8 @@ static int
 iter_finish_branch_entry(struct hist_entry_iter *iter,
 			 struct addr_location *al __maybe_unused)
 {
-	zfree(&iter->priv);
+	sample__put_bstack(iter->priv);
+	iter->priv = NULL;
 	iter->he = NULL;
 
 	return iter->curr >= iter->total ? 0 : -1;
@@ -1029,6 +1229,7 @@ iter_add_next_cumulative_entry(struct hist_entry_iter *iter,
 	int i;
 	struct callchain_cursor cursor;
 
+	hist_entry__init_sort_keys(&he_tmp);
 	callchain_cursor_snapshot(&cursor, &callchain_cursor);
 
 	callchain_cursor_advance(&callchain_cursor);
@@ -1100,8 +1301,215 @@ const struct hist_iter_ops hist_iter_cumulative = {
 	.finish_entry 		= iter_finish_cumulative_entry,
 };
 
-int hist_entry_iter__add(struct hist_entry_iter *iter, struct addr_location *al,
-			 int max_stack_depth, void *arg)
+/*
+ * With symbol_conf.defer_children the samples are added with
+ * hist_iter_normal and the entries of the callers for --children come
+ * from the callchains of the self entries afterwards, a callchain node
+ * being added once for all its samples instead of once per sample.
+ */
+struct children_ctx {
+	struct hists		*hists;
+	struct hist_entry	*self;
+	struct machine		*machine;
+	/* the entries of the frames above, not cumulated twice on recursions */
+	struct hist_entry	**stack;
+	int			nr;
+	int			max;
+};
+
+static int children_ctx__add_frame(struct children_ctx *ctx,
+				   struct callchain_node *node,
+				   struct callchain_list *cl, bool *stop)
+{
+	struct hist_entry *self = ctx->self;
+	struct callchain_cursor_node frame = {
+		.ip	 = cl->ip,
+		.map	 = cl->ms.map,
+		.sym	 = cl->ms.sym,
+		.srcline = cl->srcline,
+	};
+	struct addr_location al = {
+		.machine = ctx->machine,
+		.cpumode = self->cpumode,
+		.level	 = self->level,
+	};
+	struct hist_entry entry, *he;
+	struct callchain_list *pos;
+	int i;
+
+	if (!fill_callchain_info(&al, &frame, symbol_conf.hide_unresolved)) {
+		*stop = true;
+		return 0;
+	}
+
+	entry = (struct hist_entry) {
+		.thread	     = self->thread,
+		.comm	     = self->comm,
+		.cgroup_id   = self->cgroup_id,
+		.cgroup	     = self->cgroup,
+		.ms = {
+			.map = al.map,
+			.sym = al.sym,
+		},
+		.srcline     = (char *) al.srcline,
+		.socket	     = self->socket,
+		.cpu	     = self->cpu,
+		.cpumode     = al.cpumode,
+		.ip	     = al.addr,
+		.level	     = al.level,
+		.stat = {
+			.nr_events = 1,
+			.period	   = callchain_cumul_hits(node),
+		},
+		.parent	     = self->parent,
+		.filtered    = self->filtered,
+		.hists	     = ctx->hists,
+		.transaction = self->transaction,
+		.raw_data    = self->raw_data,
+		.raw_size    = self->raw_size,
+		.ops	     = self->ops,
+		.time	     = self->time,
+	};
+
+	hist_entry__init_sort_keys(&entry);
+
+	for (i = 0; i < ctx->nr; i++) {
+		if (hist_entry__cmp(ctx->stack[i], &entry) == 0)
+			return 0;
+	}
+
+	he = hists__findnew_entry(ctx->hists, &entry, &al, false);
+	if (he == NULL)
+		return -ENOMEM;
+
+	/* a sample is one event, whatever the number of entries it goes to */
+	he->stat_acc->nr_events += callchain_cumul_counts(node) - 1;
+
+	if (ctx->nr == ctx->max)
+		return -EINVAL;
+	ctx->stack[ctx->nr++] = he;
+
+	if (!hist_entry__has_callchains(he) || !symbol_conf.use_callchain)
+		return 0;
+
+	callchain_cursor_reset(&callchain_cursor);
+	pos = cl;
+	list_for_each_entry_from(pos, &node->val, list) {
+		if (callchain_cursor_append(&callchain_cursor, pos->ip,
+					    pos->ms.map, pos->ms.sym,
+					    false, NULL, 0, 0, 0, pos->srcline))
+			return -ENOMEM;
+	}
+
+	return callchain_append_subtree(he->callchain, &callchain_cursor, node);
+}
+
+static int children_ctx__add_node(struct children_ctx *ctx,
+				  struct callchain_node *node)
+{
+	struct callchain_node *child;
+	struct callchain_list *cl;
+	struct rb_node *n;
+	int nr = ctx->nr;
+	bool stop = false;
+	int err = 0;
+
+	list_for_each_entry(cl, &node->val, list) {
+		err = children_ctx__add_frame(ctx, node, cl, &stop);
+		if (err || stop)
+			goto out;
+	}
+
+	for (n = rb_first(&node->rb_root_in); n && !err; n = rb_next(n)) {
+		child = rb_entry(n, struct callchain_node, rb_node_in);
+		err = children_ctx__add_node(ctx, child);
+	}
+out:
+	ctx->nr = nr;
+	return err;
+}
+
+/*
+ * Cumulate the periods of the callchains of the self entries into the
+ * entries of their callers, as hist_iter_cumulative does per sample.
+ *
+ * The callchains of the self entries are taken out of them while the
+ * callers' entries are added, as one of those can be a self entry too.
+ */
+int hists__add_children(struct hists *hists)
+{
+	struct children_ctx ctx = { .hists = hists, };
+	struct callchain_root *chains, extra;
+	struct hist_entry **selfs, *he;
+	struct rb_node *next;
+	u64 nr = 0, i;
+	int err = 0;
+
+	if (!symbol_conf.cumulate_callchain || !symbol_conf.use_callchain ||
+	    !hists->nr_entries)
+		return 0;
+
+	selfs = calloc(hists->nr_entries, sizeof(*selfs));
+	chains = calloc(hists->nr_entries, sizeof(*chains));
+	if (selfs == NULL || chains == NULL) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	for (next = rb_first_cached(hists->entries_in); next; next = rb_next(next)) {
+		he = rb_entry(next, struct hist_entry, rb_node_in);
+		if (!hist_entry__has_callchains(he))
+			continue;
+
+		callchain_move(&chains[nr], he->callchain);
+		if (chains[nr].max_depth >= (u64) ctx.max)
+			ctx.max = chains[nr].max_depth + 1;
+		selfs[nr++] = he;
+	}
+
+	ctx.stack = calloc(ctx.max, sizeof(*ctx.stack));
+	if (ctx.stack == NULL && ctx.max) {
+		err = -ENOMEM;
+		goto out_restore;
+	}
+
+	for (i = 0; i < nr && !err; i++) {
+		ctx.self = selfs[i];
+		ctx.machine = selfs[i]->thread->mg->machine;
+		ctx.stack[0] = selfs[i];
+		ctx.nr = 1;
+
+		err = children_ctx__add_node(&ctx, &chains[i].node);
+	}
+
+out_restore:
+	for (i = 0; i < nr; i++) {
+		he = selfs[i];
+
+		if (RB_EMPTY_ROOT(&he->callchain->node.rb_root_in)) {
+			callchain_move(he->callchain, &chains[i]);
+			continue;
+		}
+
+		callchain_move(&extra, he->callchain);
+		callchain_move(he->callchain, &chains[i]);
+		callchain_cursor_reset(&callchain_cursor);
+		if (callchain_merge(&callchain_cursor, he->callchain, &extra) < 0)
+			err = -ENOMEM;
+		if (extra.max_depth > he->callchain->max_depth)
+			he->callchain->max_depth = extra.max_depth;
+	}
+
+	free(ctx.stack);
+out_free:
+	free(chains);
+	free(selfs);
+	return err;
+}
+
+static int __hist_entry_iter__add(struct hist_entry_iter *iter,
+				  struct addr_location *al,
+				  int max_stack_depth, void *arg)
 {
 	int err, err2;
 	struct map *alm = NULL;
@@ -1116,6 +1524,9 @@ int hist_entry_iter__add(struct hist_entry_iter *iter, struct addr_location *al,
 		return err;
 	}
 
+	if (iter->lock)
+		pthread_mutex_lock(iter->lock);
+
 	err = iter->ops->prepare_entry(iter, al);
 	if (err)
 		goto out;
@@ -1147,24 +1558,48 @@ out:
 	if (!err)
 		err = err2;
 
+	if (iter->lock)
+		pthread_mutex_unlock(iter->lock);
+
 	map__put(alm);
 
 	return err;
 }
 
-int64_t
-hist_entry__cmp(struct hist_entry *left, struct hist_entry *right)
+int hist_entry_iter__add(struct hist_entry_iter *iter, struct addr_location *al,
+			 int max_stack_depth, void *arg)
+{
+	u64 start = stage_time__start();
+	int err = __hist_entry_iter__add(iter, al, max_stack_depth, arg);
+
+	stage_time__end(STAGE_TIME__HIST_ADD, start);
+	return err;
+}
+
+static int64_t __hist_entry__cmp(struct hist_entry *left,
+				 struct hist_entry *right, bool collapse)
 {
 	struct hists *hists = left->hists;
 	struct perf_hpp_fmt *fmt;
 	int64_t cmp = 0;
+	int i = 0;
 
 	hists__for_each_sort_list(hists, fmt) {
+		int key = i++;
+
 		if (perf_hpp__is_dynamic_entry(fmt) &&
 		    !perf_hpp__defined_dynamic_entry(fmt, hists))
 			continue;
 
-		cmp = fmt->cmp(fmt, left, right);
+		if (key < HIST_ENTRY_SORT_KEYS && perf_hpp__is_keyed(fmt)) {
+			u64 l = left->sort_keys[key], r = right->sort_keys[key];
+
+			cmp = (l > r) - (l < r);
+		} else if (collapse) {
+			cmp = fmt->collapse(fmt, left, right);
+		} else {
+			cmp = fmt->cmp(fmt, left, right);
+		}
 		if (cmp)
 			break;
 	}
@@ -1173,23 +1608,15 @@ hist_entry__cmp(struct hist_entry *left, struct hist_entry *right)
 }
 
 int64_t
-hist_entry__collapse(struct hist_entry *left, struct hist_entry *right)
+hist_entry__cmp(struct hist_entry *left, struct hist_entry *right)
 {
-	struct hists *hists = left->hists;
-	struct perf_hpp_fmt *fmt;
-	int64_t cmp = 0;
-
-	hists__for_each_sort_list(hists, fmt) {
-		if (perf_hpp__is_dynamic_entry(fmt) &&
-		    !perf_hpp__defined_dynamic_entry(fmt, hists))
-			continue;
-
-		cmp = fmt->collapse(fmt, left, right);
-		if (cmp)
-			break;
-	}
+	return __hist_entry__cmp(left, right, false);
+}
 
-	return cmp;
+int64_t
+hist_entry__collapse(struct hist_entry *left, struct hist_entry *right)
+{
+	return __hist_entry__cmp(left, right, true);
 }
 
 void hist_entry__delete(struct hist_entry *he)
@@ -1218,10 +1645,11 @@ void hist_entry__delete(struct hist_entry *he)
 	free_srcline(he->srcline);
 	if (he->srcfile && he->srcfile[0])
 		free(he->srcfile);
-	free_callchain(he->callchain);
+	if (hist_entry__has_callchains(he))
+		free_callchain(he->callchain);
 	free(he->trace_output);
 	free(he->raw_data);
-	ops->free(he);
+	ops->free(he->hists, he);
 }
 
 /*
@@ -1344,11 +1772,65 @@ static void hist_entry__apply_hierarchy_filters(struct hist_entry *he)
 	hists__apply_filters(he->hists, he);
 }
 
+/*
+ * An entry of the hierarchy only compares and shows the sort keys of its
+ * level, so it doesn't get a copy of the keys of the other levels: its
+ * srcline, trace output and raw data are only taken from 'template' for
+ * the level that sorts on them.  Only the leaves, where the callchains
+ * are merged, get a callchain root, and they take the samples of
+ * 'template' instead of starting with empty ones.
+ */
+static struct hist_entry *hist_entry__new_hierarchy(struct hists *hists,
+						    struct hist_entry *template,
+						    struct perf_hpp_list *hpp_list,
+						    bool leaf)
+{
+	struct hist_entry_ops *ops = template->ops;
+	struct hist_entry level = *template;
+	struct perf_hpp_fmt *fmt;
+	size_t callchain_size = 0;
+	bool trace = false;
+	bool srcline = false;
+	struct hist_entry *he;
+
+	if (!ops)
+		ops = template->ops = &default_ops;
+
+	perf_hpp_list__for_each_sort_list(hpp_list, fmt) {
+		if (perf_hpp__is_trace_entry(fmt) || perf_hpp__is_dynamic_entry(fmt))
+			trace = true;
+		if (perf_hpp__is_srcline_entry(fmt))
+			srcline = true;
+	}
+
+	level.ops = ops;
+	level.res_samples = NULL;
+	level.num_res = 0;
+	if (!trace) {
+		level.raw_data = NULL;
+		level.raw_size = 0;
+	}
+	if (!srcline)
+		level.srcline = NULL;
+
+	if (leaf && symbol_conf.use_callchain)
+		callchain_size = sizeof(struct callchain_root);
+
+	he = ops->new(hists, callchain_size);
+	if (he && hist_entry__init(he, hists, &level, true, callchain_size, true)) {
+		ops->free(hists, he);
+		he = NULL;
+	}
+
+	return he;
+}
+
 static struct hist_entry *hierarchy_insert_entry(struct hists *hists,
 						 struct rb_root_cached *root,
 						 struct hist_entry *he,
 						 struct hist_entry *parent_he,
-						 struct perf_hpp_list *hpp_list)
+						 struct perf_hpp_list *hpp_list,
+						 bool leaf)
 {
 	struct rb_node **p = &root->rb_root.rb_node;
 	struct rb_node *parent = NULL;
@@ -1381,12 +1863,18 @@ static struct hist_entry *hierarchy_insert_entry(struct hists *hists,
 		}
 	}
 
-	new = hist_entry__new(he, true);
+	new = hist_entry__new_hierarchy(hists, he, hpp_list, leaf);
 	if (new == NULL)
 		return NULL;
 
 	hists->nr_entries++;
 
+	if (leaf) {
+		new->res_samples = he->res_samples;
+		new->num_res = he->num_res;
+		he->res_samples = NULL;
+	}
+
 	/* save related format list for output */
 	new->hpp_list = hpp_list;
 	new->parent_he = parent_he;
@@ -1420,19 +1908,25 @@ static int hists__hierarchy_insert_entry(struct hists *hists,
 					 struct rb_root_cached *root,
 					 struct hist_entry *he)
 {
-	struct perf_hpp_list_node *node;
+	struct perf_hpp_list_node *node, *last = NULL;
 	struct hist_entry *new_he = NULL;
 	struct hist_entry *parent = NULL;
 	int depth = 0;
 	int ret = 0;
 
+	list_for_each_entry(node, &hists->hpp_formats, list) {
+		if (node->level && !node->skip)
+			last = node;
+	}
+
 	list_for_each_entry(node, &hists->hpp_formats, list) {
 		/* skip period (overhead) and elided columns */
 		if (node->level == 0 || node->skip)
 			continue;
 
-		/* insert copy of 'he' for each fmt into the hierarchy */
-		new_he = hierarchy_insert_entry(hists, root, he, parent, &node->hpp);
+		/* insert 'he' for each fmt into the hierarchy */
+		new_he = hierarchy_insert_entry(hists, root, he, parent,
+						&node->hpp, node == last);
 		if (new_he == NULL) {
 			ret = -1;
 			break;
@@ -1463,9 +1957,48 @@ static int hists__hierarchy_insert_entry(struct hists *hists,
 	return ret;
 }
 
+/*
+ * The callchains of the entries collapsed into the same entry, to merge
+ * them all on several threads once everything is collapsed.
+ */
+struct collapse_merge {
+	struct hist_entry	*dst;
+	struct hist_entry	*src;
+	unsigned int		idx;
+};
+
+struct collapse_merges {
+	struct collapse_merge	*merges;
+	unsigned int		nr;
+	unsigned int		alloc;
+};
+
+static int collapse_merges__add(struct collapse_merges *cm,
+				struct hist_entry *dst, struct hist_entry *src)
+{
+	if (cm->nr == cm->alloc) {
+		unsigned int alloc = cm->alloc ? cm->alloc * 2 : 1024;
+		struct collapse_merge *merges;
+
+		merges = realloc(cm->merges, alloc * sizeof(*merges));
+		if (merges == NULL)
+			return -ENOMEM;
+
+		cm->merges = merges;
+		cm->alloc  = alloc;
+	}
+
+	cm->merges[cm->nr].dst = dst;
+	cm->merges[cm->nr].src = src;
+	cm->merges[cm->nr].idx = cm->nr;
+	cm->nr++;
+	return 0;
+}
+
 static int hists__collapse_insert_entry(struct hists *hists,
 					struct rb_root_cached *root,
-					struct hist_entry *he)
+					struct hist_entry *he,
+					struct collapse_merges *cm)
 {
 	struct rb_node **p = &root->rb_root.rb_node;
 	struct rb_node *parent = NULL;
@@ -1485,11 +2018,18 @@ static int hists__collapse_insert_entry(struct hists *hists,
 		if (!cmp) {
 			int ret = 0;
 
+			/* the decays it missed don't apply to the new samples */
+			hist_entry__decay_stat(iter);
 			he_stat__add_stat(&iter->stat, &he->stat);
 			if (symbol_conf.cumulate_callchain)
 				he_stat__add_stat(iter->stat_acc, he->stat_acc);
 
 			if (hist_entry__has_callchains(he) && symbol_conf.use_callchain) {
+				/* merge it later, with the others */
+				if (cm && !collapse_merges__add(cm, iter, he))
+					return 0;
+
+				hist_entry__decay_callchain(iter);
 				callchain_cursor_reset(&callchain_cursor);
 				if (callchain_merge(&callchain_cursor,
 						    iter->callchain,
@@ -1508,24 +2048,37 @@ static int hists__collapse_insert_entry(struct hists *hists,
 		}
 	}
 	hists->nr_entries++;
+	he->decay_epoch = he->chain_decay_epoch = hists->decay_epoch;
 
 	rb_link_node(&he->rb_node_in, parent, p);
 	rb_insert_color_cached(&he->rb_node_in, root, leftmost);
 	return 1;
 }
 
+/*
+ * Switch the samples being added to the other entries_in tree and return
+ * the one they were going to.  Each tree has its own hash, so switching
+ * them is all that happens with the lock held, samples coming in don't
+ * wait for the old hash to be emptied.
+ */
 struct rb_root_cached *hists__get_rotate_entries_in(struct hists *hists)
 {
 	struct rb_root_cached *root;
+	struct hists_hash *hh;
 
 	pthread_mutex_lock(&hists->lock);
 
 	root = hists->entries_in;
+	hh = hists->entries_hash;
 	if (++hists->entries_in > &hists->entries_in_array[1])
 		hists->entries_in = &hists->entries_in_array[0];
+	if (++hists->entries_hash > &hists->entries_hash_array[1])
+		hists->entries_hash = &hists->entries_hash_array[0];
 
 	pthread_mutex_unlock(&hists->lock);
 
+	hists_hash__reset(hh);
+
 	return root;
 }
 
@@ -1537,19 +2090,176 @@ static void hists__apply_filters(struct hists *hists, struct hist_entry *he)
 	hists__filter_entry_by_socket(hists, he);
 }
 
-int hists__collapse_resort(struct hists *hists, struct ui_progress *prog)
+/*
+ * Collapsing --sort srcline entries needs the srcline of every entry, look
+ * them up all at once instead of one by one from the comparisons.
+ */
+static void hists__resolve_srclines(struct hists *hists,
+				    struct rb_root_cached *root)
 {
-	struct rb_root_cached *root;
-	struct rb_node *next;
-	struct hist_entry *n;
-	int ret;
+	struct perf_hpp_fmt *fmt;
+	struct srcline_req *reqs;
+	struct hist_entry *he;
+	struct rb_node *nd;
+	bool has_srcline = false;
+	size_t nr = 0;
 
-	if (!hists__has(hists, need_collapse))
+	hists__for_each_sort_list(hists, fmt) {
+		if (perf_hpp__is_srcline_entry(fmt))
+			has_srcline = true;
+	}
+
+	if (!has_srcline)
+		return;
+
+	for (nd = rb_first_cached(root); nd; nd = rb_next(nd))
+		nr++;
+
+	reqs = malloc(nr * sizeof(*reqs));
+	if (reqs == NULL)
+		return;
+
+	nr = 0;
+	for (nd = rb_first_cached(root); nd; nd = rb_next(nd)) {
+		he = rb_entry(nd, struct hist_entry, rb_node_in);
+		if (he->srcline || !he->ms.map)
+			continue;
+
+		reqs[nr].dso  = he->ms.map->dso;
+		reqs[nr].addr = map__rip_2objdump(he->ms.map, he->ip);
+		nr++;
+	}
+
+	srclines__resolve(reqs, nr);
+	free(reqs);
+}
+
+static int collapse_merge__cmp_dst(const void *a, const void *b)
+{
+	const struct collapse_merge *ma = a, *mb = b;
+
+	if (ma->dst != mb->dst)
+		return ma->dst < mb->dst ? -1 : 1;
+
+	return ma->idx < mb->idx ? -1 : ma->idx > mb->idx;
+}
+
+/* A run of merges into the same entry */
+struct collapse_group {
+	struct collapse_merge	*merges;
+	unsigned int		nr;
+};
+
+static int collapse_group__cmp_nr(const void *a, const void *b)
+{
+	const struct collapse_group *ga = a, *gb = b;
+
+	return ga->nr > gb->nr ? -1 : ga->nr < gb->nr;
+}
+
+struct collapse_merge_arg {
+	struct collapse_group	*groups;
+	unsigned int		nr;
+	unsigned int		next;
+	int			err;
+};
+
+static void *collapse_merge_worker(void *arg)
+{
+	struct collapse_merge_arg *args = arg;
+	unsigned int i, j;
+
+	while ((i = __sync_fetch_and_add(&args->next, 1)) < args->nr) {
+		struct collapse_group *group = &args->groups[i];
+
+		hist_entry__decay_callchain(group->merges[0].dst);
+		for (j = 0; j < group->nr; j++) {
+			struct collapse_merge *m = &group->merges[j];
+
+			callchain_cursor_reset(&callchain_cursor);
+			if (callchain_merge(&callchain_cursor, m->dst->callchain,
+					    m->src->callchain) < 0)
+				args->err = -1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Merge the callchains of the collapsed entries, the merges into different
+ * entries are independent and done on as many threads as there are CPUs,
+ * the biggest first, the ones into the same entry still one after the
+ * other and in the order they were collapsed.
+ */
+static int collapse_merges__run(struct collapse_merges *cm)
+{
+	struct collapse_merge_arg args = { .nr = 0, };
+	unsigned int i, started = 0, nr_threads;
+	pthread_t *threads = NULL;
+
+	if (cm->nr == 0)
 		return 0;
 
-	hists->nr_entries = 0;
+	qsort(cm->merges, cm->nr, sizeof(*cm->merges), collapse_merge__cmp_dst);
+
+	args.groups = calloc(cm->nr, sizeof(*args.groups));
+	if (args.groups == NULL) {
+		args.err = -1;
+		goto out_delete;
+	}
+
+	for (i = 0; i < cm->nr; i++) {
+		if (!i || cm->merges[i].dst != cm->merges[i - 1].dst)
+			args.groups[args.nr++].merges = &cm->merges[i];
+		args.groups[args.nr - 1].nr++;
+	}
+
+	qsort(args.groups, args.nr, sizeof(*args.groups), collapse_group__cmp_nr);
 
-	root = hists__get_rotate_entries_in(hists);
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > args.nr)
+		nr_threads = args.nr;
+
+	if (nr_threads > 1)
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+
+	for (; threads && started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL,
+				   collapse_merge_worker, &args))
+			break;
+	}
+
+	collapse_merge_worker(&args);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pr_debug2("Merged the callchains of %u entries into %u with %u threads\n",
+		  cm->nr, args.nr, started + 1);
+
+	free(threads);
+	free(args.groups);
+out_delete:
+	/* 'src' is no longer used */
+	for (i = 0; i < cm->nr; i++)
+		hist_entry__delete(cm->merges[i].src);
+	zfree(&cm->merges);
+	cm->nr = cm->alloc = 0;
+
+	return args.err;
+}
+
+/* Collapse the entries of 'root' into the collapsed ones of 'hists' */
+static int hists__collapse_entries(struct hists *hists, struct rb_root_cached *root,
+				   struct ui_progress *prog)
+{
+	struct collapse_merges cm = { .nr = 0, };
+	struct rb_node *next;
+	struct hist_entry *n;
+	int ret;
+
+	hists__resolve_srclines(hists, root);
 
 	next = rb_first_cached(root);
 
@@ -1560,9 +2270,12 @@ int hists__collapse_resort(struct hists *hists, struct ui_progress *prog)
 		next = rb_next(&n->rb_node_in);
 
 		rb_erase_cached(&n->rb_node_in, root);
-		ret = hists__collapse_insert_entry(hists, &hists->entries_collapsed, n);
-		if (ret < 0)
+		ret = hists__collapse_insert_entry(hists, &hists->entries_collapsed,
+						   n, &cm);
+		if (ret < 0) {
+			collapse_merges__run(&cm);
 			return -1;
+		}
 
 		if (ret) {
 			/*
@@ -1575,7 +2288,83 @@ int hists__collapse_resort(struct hists *hists, struct ui_progress *prog)
 		if (prog)
 			ui_progress__update(prog, 1);
 	}
-	return 0;
+
+	return collapse_merges__run(&cm);
+}
+
+static int __hists__collapse_resort(struct hists *hists, struct ui_progress *prog)
+{
+	if (!hists__has(hists, need_collapse))
+		return 0;
+
+	hists->nr_entries = 0;
+
+	return hists__collapse_entries(hists, hists__get_rotate_entries_in(hists), prog);
+}
+
+int hists__collapse_resort(struct hists *hists, struct ui_progress *prog)
+{
+	u64 start = stage_time__start();
+	int ret = __hists__collapse_resort(hists, prog);
+
+	stage_time__end(STAGE_TIME__COLLAPSE, start);
+	return ret;
+}
+
+static void events_stats__add(struct events_stats *stats, struct events_stats *other)
+{
+	int i;
+
+	stats->total_lost	    += other->total_lost;
+	stats->total_lost_samples   += other->total_lost_samples;
+	stats->total_aux_lost	    += other->total_aux_lost;
+	stats->total_aux_partial    += other->total_aux_partial;
+	stats->total_invalid_chains += other->total_invalid_chains;
+
+	for (i = 0; i < PERF_RECORD_HEADER_MAX; i++)
+		stats->nr_events[i] += other->nr_events[i];
+
+	stats->nr_non_filtered_samples	+= other->nr_non_filtered_samples;
+	stats->nr_unknown_events	+= other->nr_unknown_events;
+	stats->nr_invalid_chains	+= other->nr_invalid_chains;
+	stats->nr_unknown_id		+= other->nr_unknown_id;
+	stats->nr_unprocessable_samples	+= other->nr_unprocessable_samples;
+	stats->nr_proc_map_timeout	+= other->nr_proc_map_timeout;
+
+	for (i = 0; i < PERF_AUXTRACE_ERROR_MAX; i++)
+		stats->nr_auxtrace_errors[i] += other->nr_auxtrace_errors[i];
+}
+
+/*
+ * Sum the entries of 'other', the hists of the same event in another
+ * session, into the collapsed entries of 'hists'.  The entries are moved,
+ * they keep pointing at the threads and maps of their own session, which
+ * has to stay around for as long as 'hists' does.
+ */
+int hists__collapse_merge(struct hists *hists, struct hists *other,
+			  struct ui_progress *prog)
+{
+	struct rb_root_cached *root;
+	struct rb_node *nd;
+	u64 start;
+	int ret;
+
+	if (!hists__has(hists, need_collapse))
+		return -EINVAL;
+
+	start = stage_time__start();
+
+	root = hists__get_rotate_entries_in(other);
+	for (nd = rb_first_cached(root); nd; nd = rb_next(nd))
+		rb_entry(nd, struct hist_entry, rb_node_in)->hists = hists;
+	other->nr_entries = 0;
+
+	events_stats__add(&hists->stats, &other->stats);
+
+	ret = hists__collapse_entries(hists, root, prog);
+
+	stage_time__end(STAGE_TIME__COLLAPSE, start);
+	return ret;
 }
 
 static int hist_entry__sort(struct hist_entry *a, struct hist_entry *b)
@@ -1685,7 +2474,6 @@ static void hists__hierarchy_output_resort(struct hists *hists,
 					   struct ui_progress *prog,
 					   struct rb_root_cached *root_in,
 					   struct rb_root_cached *root_out,
-					   u64 min_callchain_hits,
 					   bool use_callchain)
 {
 	struct rb_node *node;
@@ -1713,7 +2501,6 @@ static void hists__hierarchy_output_resort(struct hists *hists,
 			hists__hierarchy_output_resort(hists, prog,
 						       &he->hroot_in,
 						       &he->hroot_out,
-						       min_callchain_hits,
 						       use_callchain);
 			continue;
 		}
@@ -1721,23 +2508,12 @@ static void hists__hierarchy_output_resort(struct hists *hists,
 		if (!use_callchain)
 			continue;
 
-		if (callchain_param.mode == CHAIN_GRAPH_REL) {
-			u64 total = he->stat.period;
-
-			if (symbol_conf.cumulate_callchain)
-				total = he->stat_acc->period;
-
-			min_callchain_hits = total * (callchain_param.min_percent / 100);
-		}
-
-		callchain_param.sort(&he->sorted_chain, he->callchain,
-				     min_callchain_hits, &callchain_param);
+		he->sorted_chain_stale = true;
 	}
 }
 
 static void __hists__insert_output_entry(struct rb_root_cached *entries,
 					 struct hist_entry *he,
-					 u64 min_callchain_hits,
 					 bool use_callchain)
 {
 	struct rb_node **p = &entries->rb_root.rb_node;
@@ -1746,18 +2522,8 @@ static void __hists__insert_output_entry(struct rb_root_cached *entries,
 	struct perf_hpp_fmt *fmt;
 	bool leftmost = true;
 
-	if (use_callchain) {
-		if (callchain_param.mode == CHAIN_GRAPH_REL) {
-			u64 total = he->stat.period;
-
-			if (symbol_conf.cumulate_callchain)
-				total = he->stat_acc->period;
-
-			min_callchain_hits = total * (callchain_param.min_percent / 100);
-		}
-		callchain_param.sort(&he->sorted_chain, he->callchain,
-				      min_callchain_hits, &callchain_param);
-	}
+	/* Most entries are never shown, sort their callchains on demand */
+	he->sorted_chain_stale = use_callchain;
 
 	while (*p != NULL) {
 		parent = *p;
@@ -1781,21 +2547,47 @@ static void __hists__insert_output_entry(struct rb_root_cached *entries,
 	}
 }
 
-static void output_resort(struct hists *hists, struct ui_progress *prog,
-			  bool use_callchain, hists__resort_cb_t cb,
-			  void *cb_arg)
+/*
+ * Sort the callchain of an entry for output, if it wasn't since the last
+ * output resort, only what is shown needs it.
+ */
+void hist_entry__sort_callchain(struct hist_entry *he)
+{
+	u64 min_callchain_hits = he->hists->min_callchain_hits;
+
+	if (!he->sorted_chain_stale)
+		return;
+
+	hist_entry__decay_callchain(he);
+
+	if (callchain_param.mode == CHAIN_GRAPH_REL) {
+		u64 total = he->stat.period;
+
+		if (symbol_conf.cumulate_callchain)
+			total = he->stat_acc->period;
+
+		min_callchain_hits = total * (callchain_param.min_percent / 100);
+	}
+
+	callchain_param.sort(&he->sorted_chain, he->callchain,
+			     min_callchain_hits, &callchain_param);
+	he->sorted_chain_stale = false;
+}
+
+static void __output_resort(struct hists *hists, struct ui_progress *prog,
+			    bool use_callchain, hists__resort_cb_t cb,
+			    void *cb_arg)
 {
 	struct rb_root_cached *root;
 	struct rb_node *next;
 	struct hist_entry *n;
 	u64 callchain_total;
-	u64 min_callchain_hits;
 
 	callchain_total = hists->callchain_period;
 	if (symbol_conf.filter_relative)
 		callchain_total = hists->callchain_non_filtered_period;
 
-	min_callchain_hits = callchain_total * (callchain_param.min_percent / 100);
+	hists->min_callchain_hits = callchain_total * (callchain_param.min_percent / 100);
 
 	hists__reset_stats(hists);
 	hists__reset_col_len(hists);
@@ -1804,7 +2596,6 @@ static void output_resort(struct hists *hists, struct ui_progress *prog,
 		hists__hierarchy_output_resort(hists, prog,
 					       &hists->entries_collapsed,
 					       &hists->entries,
-					       min_callchain_hits,
 					       use_callchain);
 		hierarchy_recalc_total_periods(hists);
 		return;
@@ -1822,10 +2613,18 @@ static void output_resort(struct hists *hists, struct ui_progress *prog,
 		n = rb_entry(next, struct hist_entry, rb_node_in);
 		next = rb_next(&n->rb_node_in);
 
+		if (hist_entry__decay_stat(n)) {
+			/* decayed to nothing, nobody else looks at it */
+			rb_erase_cached(&n->rb_node_in, root);
+			hists__hash_del(hists, n);
+			hist_entry__delete(n);
+			continue;
+		}
+
 		if (cb && cb(n, cb_arg))
 			continue;
 
-		__hists__insert_output_entry(&hists->entries, n, min_callchain_hits, use_callchain);
+		__hists__insert_output_entry(&hists->entries, n, use_callchain);
 		hists__inc_stats(hists, n);
 
 		if (!n->filtered)
@@ -1836,6 +2635,16 @@ static void output_resort(struct hists *hists, struct ui_progress *prog,
 	}
 }
 
+static void output_resort(struct hists *hists, struct ui_progress *prog,
+			  bool use_callchain, hists__resort_cb_t cb,
+			  void *cb_arg)
+{
+	u64 start = stage_time__start();
+
+	__output_resort(hists, prog, use_callchain, cb, cb_arg);
+	stage_time__end(STAGE_TIME__RESORT, start);
+}
+
 void perf_evsel__output_resort_cb(struct perf_evsel *evsel, struct ui_progress *prog,
 				  hists__resort_cb_t cb, void *cb_arg)
 {
@@ -2260,7 +3069,7 @@ static struct hist_entry *hists__add_dummy_entry(struct hists *hists,
 		}
 	}
 
-	he = hist_entry__new(pair, true);
+	he = hist_entry__new(hists, pair, true);
 	if (he) {
 		memset(&he->stat, 0, sizeof(he->stat));
 		he->hists = hists;
@@ -2308,7 +3117,7 @@ static struct hist_entry *add_dummy_hierarchy_entry(struct hists *hists,
 		}
 	}
 
-	he = hist_entry__new(pair, true);
+	he = hist_entry__new(hists, pair, true);
 	if (he) {
 		rb_link_node(&he->rb_node_in, parent, p);
 		rb_insert_color_cached(&he->rb_node_in, root, leftmost);
@@ -2395,11 +3204,86 @@ static void hists__match_hierarchy(struct rb_root_cached *leader_root,
 /*
  * Look for pairs to link to the leader buckets (hist_entries):
  */
+struct hists_join_slot {
+	u64			hash;
+	struct hist_entry	*he;
+};
+
+struct hists_join {
+	struct hists_join_slot	*slots;
+	size_t			mask;
+};
+
+/*
+ * Open addressing table of the collapsed entries of other, to pair the
+ * entries of the leader without walking the tree of other for each one.
+ */
+static int hists_join__init(struct hists_join *hj, struct hists *other)
+{
+	struct rb_root_cached *root;
+	struct rb_node *nd;
+	size_t nr = 0, size = 16;
+	u64 hash;
+
+	if (hists__has(other, need_collapse))
+		root = &other->entries_collapsed;
+	else
+		root = other->entries_in;
+
+	for (nd = rb_first_cached(root); nd; nd = rb_next(nd))
+		nr++;
+
+	while (size < 2 * nr)
+		size <<= 1;
+
+	hj->slots = calloc(size, sizeof(*hj->slots));
+	if (hj->slots == NULL)
+		return -ENOMEM;
+	hj->mask = size - 1;
+
+	for (nd = rb_first_cached(root); nd; nd = rb_next(nd)) {
+		struct hist_entry *he = rb_entry(nd, struct hist_entry, rb_node_in);
+		size_t i;
+
+		if (!hist_entry__collapse_hash(he, &hash)) {
+			zfree(&hj->slots);
+			return -EINVAL;
+		}
+
+		for (i = hash & hj->mask; hj->slots[i].he; i = (i + 1) & hj->mask)
+			;
+		hj->slots[i].hash = hash;
+		hj->slots[i].he   = he;
+	}
+
+	return 0;
+}
+
+static struct hist_entry *hists_join__find(struct hists_join *hj,
+					   struct hist_entry *he)
+{
+	struct hists_join_slot *slot;
+	size_t i;
+	u64 hash;
+
+	hist_entry__collapse_hash(he, &hash);
+
+	for (i = hash & hj->mask; hj->slots[i].he; i = (i + 1) & hj->mask) {
+		slot = &hj->slots[i];
+		if (slot->hash == hash && !hist_entry__collapse(slot->he, he))
+			return slot->he;
+	}
+
+	return NULL;
+}
+
 void hists__match(struct hists *leader, struct hists *other)
 {
 	struct rb_root_cached *root;
 	struct rb_node *nd;
 	struct hist_entry *pos, *pair;
+	struct hists_join hj;
+	bool join;
 
 	if (symbol_conf.report_hierarchy) {
 		/* hierarchy report always collapses entries */
@@ -2412,13 +3296,22 @@ void hists__match(struct hists *leader, struct hists *other)
 	else
 		root = leader->entries_in;
 
+	/* both hists have the same sort keys, fall back to the tree if unhashable */
+	join = !hists_join__init(&hj, other);
+
 	for (nd = rb_first_cached(root); nd; nd = rb_next(nd)) {
 		pos  = rb_entry(nd, struct hist_entry, rb_node_in);
-		pair = hists__find_entry(other, pos);
+		if (join)
+			pair = hists_join__find(&hj, pos);
+		else
+			pair = hists__find_entry(other, pos);
 
 		if (pair)
 			hist_entry__add_pair(pair, pos);
 	}
+
+	if (join)
+		free(hj.slots);
 }
 
 static int hists__link_hierarchy(struct hists *leader_hists,
@@ -2531,7 +3424,7 @@ void hist__account_cycles(struct branch_stack *bs, struct addr_location *al,
 					bi[i].flags.cycles);
 				prev = &bi[i].to;
 			}
-			free(bi);
+			sample__put_bstack(bi);
 		}
 	}
 }
@@ -2663,15 +3556,30 @@ int __hists__init(struct hists *hists, struct perf_hpp_list *hpp_list)
 	memset(hists, 0, sizeof(*hists));
 	hists->entries_in_array[0] = hists->entries_in_array[1] = RB_ROOT_CACHED;
 	hists->entries_in = &hists->entries_in_array[0];
+	hists->entries_hash = &hists->entries_hash_array[0];
 	hists->entries_collapsed = RB_ROOT_CACHED;
 	hists->entries = RB_ROOT_CACHED;
 	pthread_mutex_init(&hists->lock, NULL);
 	hists->socket_filter = -1;
 	hists->hpp_list = hpp_list;
 	INIT_LIST_HEAD(&hists->hpp_formats);
+	callchain_alloc__init(&hists->callchain_alloc);
 	return 0;
 }
 
+/*
+ * Releases the memory of the entries in one go, so must be called
+ * once all of them got deleted.
+ */
+void hists__exit_alloc(struct hists *hists)
+{
+	zfree(&hists->entries_hash_array[0].table);
+	zfree(&hists->entries_hash_array[1].table);
+	hists->entries_hash_array[0].nr = hists->entries_hash_array[1].nr = 0;
+	slab__exit(&hists->entry_slab);
+	callchain_alloc__exit(&hists->callchain_alloc);
+}
+
 static void hists__delete_remaining_entries(struct rb_root_cached *root)
 {
 	struct rb_node *node;
@@ -2701,6 +3609,7 @@ static void hists_evsel__exit(struct perf_evsel *evsel)
 	struct perf_hpp_list_node *node, *tmp;
 
 	hists__delete_all_entries(hists);
+	hists__exit_alloc(hists);
 
 	list_for_each_entry_safe(node, tmp, &hists->hpp_formats, list) {
 		perf_hpp_list__for_each_format_safe(&node->hpp, fmt, pos) {
@@ -8,6 +8,8 @@
 #include "evsel.h"
 #include "header.h"
 #include "color.h"
+#include "callchain.h"
+#include "slab.h"
 #include "ui/progress.h"
 
 struct hist_entry;
@@ -36,6 +38,7 @@ enum hist_column {
 	HISTC_THREAD,
 	HISTC_COMM,
 	HISTC_CGROUP_ID,
+	HISTC_CGROUP,
 	HISTC_PARENT,
 	HISTC_CPU,
 	HISTC_SOCKET,
@@ -73,6 +76,13 @@ enum hist_column {
 struct thread;
 struct dso;
 
+/* An index of one of the entries_in trees */
+struct hists_hash {
+	struct hlist_head	*table;
+	unsigned int		bits;
+	u64			nr;
+};
+
 struct hists {
 	struct rb_root_cached	entries_in_array[2];
 	struct rb_root_cached	*entries_in;
@@ -82,6 +92,10 @@ struct hists {
 	u64			nr_non_filtered_entries;
 	u64			callchain_period;
 	u64			callchain_non_filtered_period;
+	/* the callchain hits to be shown, for the output resort */
+	u64			min_callchain_hits;
+	/* bumped by hists__decay_entries(), entries catch up when used */
+	u32			decay_epoch;
 	struct thread		*thread_filter;
 	const struct dso	*dso_filter;
 	const char		*uid_filter_str;
@@ -95,6 +109,12 @@ struct hists {
 	struct perf_hpp_list	*hpp_list;
 	struct list_head	hpp_formats;
 	int			nr_hpp_node;
+	/* indexes of entries_in_array on the sort keys digest, see hists__findnew_entry() */
+	struct hists_hash	entries_hash_array[2];
+	struct hists_hash	*entries_hash;
+	/* memory of the entries added with the default hist_entry_ops */
+	struct slab		entry_slab;
+	struct callchain_alloc	callchain_alloc;
 };
 
 #define hists__has(__h, __f) (__h)->hpp_list->__f
@@ -125,6 +145,8 @@ struct hist_entry_iter {
 	/* user-defined callback function (optional) */
 	int (*add_entry_cb)(struct hist_entry_iter *iter,
 			    struct addr_location *al, bool single, void *arg);
+	/* held while adding the entries, not while resolving the callchain (optional) */
+	pthread_mutex_t *lock;
 };
 
 extern const struct hist_iter_ops hist_iter_normal;
@@ -163,6 +185,7 @@ int hist_entry__sort_snprintf(struct hist_entry *he, char *bf, size_t size,
 int hist_entry__snprintf_alignment(struct hist_entry *he, struct perf_hpp *hpp,
 				   struct perf_hpp_fmt *fmt, int printed);
 void hist_entry__delete(struct hist_entry *he);
+void hist_entry__sort_callchain(struct hist_entry *he);
 
 typedef int (*hists__resort_cb_t)(struct hist_entry *he, void *arg);
 
@@ -172,10 +195,14 @@ void perf_evsel__output_resort(struct perf_evsel *evsel, struct ui_progress *pro
 void hists__output_resort(struct hists *hists, struct ui_progress *prog);
 void hists__output_resort_cb(struct hists *hists, struct ui_progress *prog,
 			     hists__resort_cb_t cb);
+int hists__add_children(struct hists *hists);
 int hists__collapse_resort(struct hists *hists, struct ui_progress *prog);
+int hists__collapse_merge(struct hists *hists, struct hists *other,
+			  struct ui_progress *prog);
 
 void hists__decay_entries(struct hists *hists, bool zap_user, bool zap_kernel);
 void hists__delete_entries(struct hists *hists);
+void hists__delete_entry(struct hists *hists, struct hist_entry *he);
 void hists__output_recalc_col_len(struct hists *hists, int max_rows);
 
 u64 hists__total_period(struct hists *hists);
@@ -189,6 +216,8 @@ size_t events_stats__fprintf(struct events_stats *stats, FILE *fp);
 size_t hists__fprintf(struct hists *hists, bool show_header, int max_rows,
 		      int max_cols, float min_pcnt, FILE *fp,
 		      bool ignore_callchains);
+int hists__fprintf_folded(struct hists *hists, const char *event, FILE *fp);
+int hists__fprintf_flame_json(struct hists *hists, const char *name, FILE *fp);
 size_t perf_evlist__fprintf_nr_events(struct perf_evlist *evlist, FILE *fp);
 
 void hists__filter_by_dso(struct hists *hists);
@@ -235,6 +264,7 @@ static __pure inline bool hists__has_callchains(struct hists *hists)
 
 int hists__init(void);
 int __hists__init(struct hists *hists, struct perf_hpp_list *hpp_list);
+void hists__exit_alloc(struct hists *hists);
 
 struct rb_root_cached *hists__get_rotate_entries_in(struct hists *hists);
 
@@ -363,6 +393,10 @@ int perf_hpp__setup_hists_formats(struct perf_hpp_list *list,
 
 
 bool perf_hpp__is_sort_entry(struct perf_hpp_fmt *format);
+bool perf_hpp__is_keyed(struct perf_hpp_fmt *fmt);
+bool hist_entry__sort_hash(struct hist_entry *he, u64 *hash);
+bool hist_entry__collapse_hash(struct hist_entry *he, u64 *hash);
+void hist_entry__init_sort_keys(struct hist_entry *he);
 bool perf_hpp__is_dynamic_entry(struct perf_hpp_fmt *format);
 bool perf_hpp__defined_dynamic_entry(struct perf_hpp_fmt *fmt, struct hists *hists);
 bool perf_hpp__is_trace_entry(struct perf_hpp_fmt *fmt);
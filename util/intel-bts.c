@@ -884,6 +884,7 @@ int intel_bts_process_auxtrace_info(union perf_event *event,
 	bts->cap_user_time_zero =
 			auxtrace_info->priv[INTEL_BTS_CAP_USER_TIME_ZERO];
 	bts->snapshot_mode = auxtrace_info->priv[INTEL_BTS_SNAPSHOT_MODE];
+	bts->queues.snapshot_mode = bts->snapshot_mode;
 
 	bts->sampling_mode = false;
 
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include "build-id.h"
+#include "debug.h"
+#include "dso.h"
+#include "intel-pt-blocks.h"
+#include "util.h"
+
+#define INTEL_PT_BLOCKS_BITS	6
+/* Blocks walked in a session that are kept for a dso, 56MB of them */
+#define INTEL_PT_BLOCKS_MAX_NEW	(1 << 20)
+
+struct intel_pt_blocks {
+	struct hlist_node	node;
+	u8			build_id[BUILD_ID_SIZE];
+	char			*filename;
+	/* read back from the build-id cache */
+	struct intel_pt_block	*blocks;
+	u32			nr_blocks;
+	/* walked since, to be saved */
+	struct intel_pt_block	*new_blocks;
+	u32			nr_new;
+	u32			alloc_new;
+};
+
+static struct hlist_head intel_pt_blocks__table[1 << INTEL_PT_BLOCKS_BITS];
+static pthread_mutex_t intel_pt_blocks__lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct hlist_head *intel_pt_blocks__head(const u8 *build_id)
+{
+	u64 key;
+
+	memcpy(&key, build_id, sizeof(key));
+	return &intel_pt_blocks__table[hash_64(key, INTEL_PT_BLOCKS_BITS)];
+}
+
+static bool intel_pt_blocks__valid(struct intel_pt_blocks *b,
+				   struct intel_pt_blocks_header *hdr,
+				   size_t size)
+{
+	return size >= sizeof(*hdr) &&
+	       hdr->magic == INTEL_PT_BLOCKS_MAGIC &&
+	       hdr->version == INTEL_PT_BLOCKS_VERSION &&
+	       size == sizeof(*hdr) +
+		       (u64)hdr->nr_blocks * sizeof(struct intel_pt_block) &&
+	       !memcmp(hdr->build_id, b->build_id, sizeof(hdr->build_id));
+}
+
+static void intel_pt_blocks__read(struct intel_pt_blocks *b,
+				  struct dso *dso)
+{
+	struct intel_pt_blocks_header hdr;
+	struct stat st;
+	size_t size;
+	u32 i;
+	int fd;
+
+	fd = open(b->filename, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    !intel_pt_blocks__valid(b, &hdr, st.st_size)) {
+		pr_debug("Ignoring stale Intel PT blocks %s\n", b->filename);
+		goto out_close;
+	}
+
+	size = hdr.nr_blocks * sizeof(*b->blocks);
+	b->blocks = malloc(size);
+	if (b->blocks == NULL)
+		goto out_close;
+
+	if (read(fd, b->blocks, size) != (ssize_t)size)
+		goto out_free;
+
+	/* the lookups are binary searches */
+	for (i = 1; i < hdr.nr_blocks; i++) {
+		if (b->blocks[i - 1].offset >= b->blocks[i].offset)
+			goto out_free;
+	}
+
+	b->nr_blocks = hdr.nr_blocks;
+	pr_debug("Loaded %u Intel PT blocks of %s from %s\n",
+		 b->nr_blocks, dso->long_name, b->filename);
+	close(fd);
+	return;
+
+out_free:
+	zfree(&b->blocks);
+out_close:
+	close(fd);
+}
+
+/* The blocks of dso, read back the first time it is looked up */
+static struct intel_pt_blocks *intel_pt_blocks__get(struct dso *dso)
+{
+	struct hlist_head *head = intel_pt_blocks__head(dso->build_id);
+	struct intel_pt_blocks *b;
+
+	hlist_for_each_entry(b, head, node) {
+		if (!memcmp(b->build_id, dso->build_id, sizeof(b->build_id)))
+			return b;
+	}
+
+	b = zalloc(sizeof(*b));
+	if (b == NULL)
+		return NULL;
+
+	memcpy(b->build_id, dso->build_id, sizeof(b->build_id));
+	b->filename = dso__build_id_cache_file(dso, INTEL_PT_BLOCKS_NAME,
+					       NULL, 0);
+	if (b->filename)
+		intel_pt_blocks__read(b, dso);
+
+	hlist_add_head(&b->node, head);
+	return b;
+}
+
+static bool intel_pt_blocks__usable(struct dso *dso)
+{
+	/* kernel text gets patched, what is decoded is not the binary */
+	return dso->kernel == DSO_TYPE_USER && dso->has_build_id;
+}
+
+static int intel_pt_block__cmp(const void *a, const void *b)
+{
+	const struct intel_pt_block *ba = a, *bb = b;
+
+	if (ba->offset < bb->offset)
+		return -1;
+	return ba->offset > bb->offset;
+}
+
+bool intel_pt_blocks__find(struct dso *dso, u64 offset,
+			   struct intel_pt_block *block)
+{
+	struct intel_pt_block key = { .offset = offset, }, *found = NULL;
+	struct intel_pt_blocks *b;
+
+	if (!intel_pt_blocks__usable(dso))
+		return false;
+
+	pthread_mutex_lock(&intel_pt_blocks__lock);
+	b = intel_pt_blocks__get(dso);
+	if (b && b->nr_blocks)
+		found = bsearch(&key, b->blocks, b->nr_blocks,
+				sizeof(*b->blocks), intel_pt_block__cmp);
+	if (found)
+		*block = *found;
+	pthread_mutex_unlock(&intel_pt_blocks__lock);
+
+	return found != NULL;
+}
+
+void intel_pt_blocks__add(struct dso *dso, const struct intel_pt_block *block)
+{
+	struct intel_pt_blocks *b;
+
+	if (!intel_pt_blocks__usable(dso))
+		return;
+
+	pthread_mutex_lock(&intel_pt_blocks__lock);
+	b = intel_pt_blocks__get(dso);
+	if (b == NULL || b->filename == NULL ||
+	    b->nr_new == INTEL_PT_BLOCKS_MAX_NEW)
+		goto out_unlock;
+
+	if (b->nr_new == b->alloc_new) {
+		u32 alloc = b->alloc_new ? b->alloc_new * 2 : 1024;
+		struct intel_pt_block *new_blocks;
+
+		new_blocks = realloc(b->new_blocks, alloc * sizeof(*new_blocks));
+		if (new_blocks == NULL)
+			goto out_unlock;
+		b->new_blocks = new_blocks;
+		b->alloc_new = alloc;
+	}
+
+	b->new_blocks[b->nr_new++] = *block;
+out_unlock:
+	pthread_mutex_unlock(&intel_pt_blocks__lock);
+}
+
+static int intel_pt_blocks__write(struct intel_pt_blocks *b)
+{
+	struct intel_pt_blocks_header hdr = {
+		.magic	 = INTEL_PT_BLOCKS_MAGIC,
+		.version = INTEL_PT_BLOCKS_VERSION,
+	};
+	struct intel_pt_block *blocks;
+	char tmpname[PATH_MAX];
+	u32 i = 0, j = 0, nr = 0;
+	size_t size;
+	int fd, err = -1;
+
+	qsort(b->new_blocks, b->nr_new, sizeof(*b->new_blocks),
+	      intel_pt_block__cmp);
+
+	blocks = malloc((b->nr_blocks + (size_t)b->nr_new) * sizeof(*blocks));
+	if (blocks == NULL)
+		return -1;
+
+	/* merge the blocks read back with those walked since */
+	while (i < b->nr_blocks || j < b->nr_new) {
+		struct intel_pt_block *block;
+
+		if (j == b->nr_new ||
+		    (i < b->nr_blocks &&
+		     b->blocks[i].offset <= b->new_blocks[j].offset))
+			block = &b->blocks[i++];
+		else
+			block = &b->new_blocks[j++];
+
+		if (nr && blocks[nr - 1].offset == block->offset)
+			continue;
+		blocks[nr++] = *block;
+	}
+
+	hdr.nr_blocks = nr;
+	memcpy(hdr.build_id, b->build_id, sizeof(hdr.build_id));
+	size = nr * sizeof(*blocks);
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", b->filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto out_free;
+
+	if (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	    write(fd, blocks, size) == (ssize_t)size)
+		err = 0;
+	if (close(fd))
+		err = -1;
+	if (!err && rename(tmpname, b->filename))
+		err = -1;
+	if (err)
+		unlink(tmpname);
+	else
+		pr_debug("Saved %u Intel PT blocks to %s\n", nr, b->filename);
+out_free:
+	free(blocks);
+	return err;
+}
+
+void intel_pt_blocks__save(void)
+{
+	struct intel_pt_blocks *b;
+	struct hlist_node *n;
+	unsigned int i;
+
+	pthread_mutex_lock(&intel_pt_blocks__lock);
+	for (i = 0; i < ARRAY_SIZE(intel_pt_blocks__table); i++) {
+		hlist_for_each_entry_safe(b, n, &intel_pt_blocks__table[i], node) {
+			if (b->nr_new)
+				intel_pt_blocks__write(b);
+			hlist_del(&b->node);
+			free(b->new_blocks);
+			free(b->blocks);
+			free(b->filename);
+			free(b);
+		}
+	}
+	pthread_mutex_unlock(&intel_pt_blocks__lock);
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_INTEL_PT_BLOCKS_H
+#define __PERF_INTEL_PT_BLOCKS_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+#include "build-id.h"
+#include "intel-pt-decoder/intel-pt-insn-decoder.h"
+
+struct dso;
+
+#define INTEL_PT_BLOCKS_NAME	"intel-pt-blocks"
+
+/*
+ * The basic blocks the Intel PT decoder walked in user space dsos with a
+ * build-id, kept in the build-id cache directory of each dso so decoding
+ * traces of the same binaries again goes from block to block without
+ * decoding their instructions again:
+ *
+ *   struct intel_pt_blocks_header
+ *   struct intel_pt_block		[nr_blocks], sorted by offset
+ *
+ * A block is walked from the dso offset up to and including the branch
+ * that ends it, which is insn.
+ */
+#define INTEL_PT_BLOCKS_MAGIC	0x4b434f4c42545049ULL	/* "IPTBLOCK" */
+#define INTEL_PT_BLOCKS_VERSION	1
+
+struct intel_pt_blocks_header {
+	u64	magic;
+	u32	version;
+	u32	nr_blocks;
+	u8	build_id[BUILD_ID_SIZE];
+	u8	__reserved[4];
+};
+
+struct intel_pt_block {
+	u64	offset;
+	u64	insn_cnt;
+	u64	byte_cnt;
+	u32	op;
+	u32	branch;
+	s32	length;
+	s32	rel;
+	u8	insn[INTEL_PT_INSN_BUF_SZ];
+};
+
+bool intel_pt_blocks__find(struct dso *dso, u64 offset,
+			   struct intel_pt_block *block);
+void intel_pt_blocks__add(struct dso *dso, const struct intel_pt_block *block);
+/* write the blocks walked since they were read back, and forget them all */
+void intel_pt_blocks__save(void);
+
+#endif /* __PERF_INTEL_PT_BLOCKS_H */
@@ -2209,6 +2209,74 @@ static int intel_pt_sync_ip(struct intel_pt_decoder *decoder)
 	return 0;
 }
 
+/*
+ * A PSB is 8 pairs of 0x02 0x82, so whatever its alignment it covers an 8 byte
+ * aligned word that reads as either psb_w[0] or psb_w[1].  Searches compare
+ * the aligned words of the buffer with those, and only where one matches the
+ * 9 places a PSB covering that word can start.  That is much faster than
+ * searching byte by byte, 0x02 being the first byte of many packets.
+ */
+static bool intel_pt_psb_at(const unsigned char *buf, const unsigned char *end,
+			    const unsigned char *p)
+{
+	return p >= buf && p + INTEL_PT_PSB_LEN <= end &&
+	       !memcmp(p, INTEL_PT_PSB_STR, INTEL_PT_PSB_LEN);
+}
+
+static bool intel_pt_psb_word(const unsigned char *p)
+{
+	uint64_t psb_w[2], w = *(const uint64_t *)p;
+
+	memcpy(&psb_w[0], INTEL_PT_PSB_STR, sizeof(uint64_t));
+	memcpy(&psb_w[1], INTEL_PT_PSB_STR + 1, sizeof(uint64_t));
+
+	return w == psb_w[0] || w == psb_w[1];
+}
+
+#define INTEL_PT_PSB_WORD(p) \
+	((const unsigned char *)((uintptr_t)(p) & ~(uintptr_t)7))
+
+/* Like memmem(buf, len, INTEL_PT_PSB_STR, INTEL_PT_PSB_LEN) */
+static unsigned char *intel_pt_find_psb(const unsigned char *buf, size_t len)
+{
+	const unsigned char *end = buf + len, *p, *s;
+
+	if (len < INTEL_PT_PSB_LEN)
+		return NULL;
+
+	for (p = INTEL_PT_PSB_WORD(buf + 7); p + 8 <= end; p += 8) {
+		if (!intel_pt_psb_word(p))
+			continue;
+		for (s = p - 8; s <= p; s++) {
+			if (intel_pt_psb_at(buf, end, s))
+				return (unsigned char *)s;
+		}
+	}
+
+	return NULL;
+}
+
+/* The last PSB in buf, or NULL */
+static unsigned char *intel_pt_find_last_psb(const unsigned char *buf,
+					     size_t len)
+{
+	const unsigned char *end = buf + len, *p, *s;
+
+	if (len < INTEL_PT_PSB_LEN)
+		return NULL;
+
+	for (p = INTEL_PT_PSB_WORD(end - 8); p >= buf; p -= 8) {
+		if (!intel_pt_psb_word(p))
+			continue;
+		for (s = p; s >= p - 8; s--) {
+			if (intel_pt_psb_at(buf, end, s))
+				return (unsigned char *)s;
+		}
+	}
+
+	return NULL;
+}
+
 static int intel_pt_part_psb(struct intel_pt_decoder *decoder)
 {
 	const unsigned char *end = decoder->buf + decoder->len;
@@ -2274,8 +2342,7 @@ static int intel_pt_scan_for_psb(struct intel_pt_decoder *decoder)
 				return ret;
 		}
 
-		next = memmem(decoder->buf, decoder->len, INTEL_PT_PSB_STR,
-			      INTEL_PT_PSB_LEN);
+		next = intel_pt_find_psb(decoder->buf, decoder->len);
 		if (!next) {
 			int part_psb;
 
@@ -2434,7 +2501,7 @@ static bool intel_pt_next_psb(unsigned char **buf, size_t *len)
 {
 	unsigned char *next;
 
-	next = memmem(*buf, *len, INTEL_PT_PSB_STR, INTEL_PT_PSB_LEN);
+	next = intel_pt_find_psb(*buf, *len);
 	if (next) {
 		*len -= next - *buf;
 		*buf = next;
@@ -2462,7 +2529,7 @@ static bool intel_pt_step_psb(unsigned char **buf, size_t *len)
 	if (!*len)
 		return false;
 
-	next = memmem(*buf + 1, *len - 1, INTEL_PT_PSB_STR, INTEL_PT_PSB_LEN);
+	next = intel_pt_find_psb(*buf + 1, *len - 1);
 	if (next) {
 		*len -= next - *buf;
 		*buf = next;
@@ -2482,24 +2549,7 @@ static bool intel_pt_step_psb(unsigned char **buf, size_t *len)
  */
 static unsigned char *intel_pt_last_psb(unsigned char *buf, size_t len)
 {
-	const char *n = INTEL_PT_PSB_STR;
-	unsigned char *p;
-	size_t k;
-
-	if (len < INTEL_PT_PSB_LEN)
-		return NULL;
-
-	k = len - INTEL_PT_PSB_LEN + 1;
-	while (1) {
-		p = memrchr(buf, n[0], k);
-		if (!p)
-			return NULL;
-		if (!memcmp(p + 1, n + 1, INTEL_PT_PSB_LEN - 1))
-			return p;
-		k = p - buf;
-		if (!k)
-			return NULL;
-	}
+	return intel_pt_find_last_psb(buf, len);
 }
 
 /**
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 
@@ -41,6 +42,7 @@
 #include "auxtrace.h"
 #include "tsc.h"
 #include "intel-pt.h"
+#include "intel-pt-blocks.h"
 #include "config.h"
 
 #include "intel-pt-decoder/intel-pt-log.h"
@@ -69,6 +71,8 @@ struct intel_pt {
 	bool sync_switch;
 	bool mispred_all;
 	int have_sched_switch;
+	unsigned int nr_decode_threads;
+	struct auxtrace_workers *workers;
 	u32 pmu_type;
 	u64 kernel_start;
 	u64 switch_ip;
@@ -160,6 +164,7 @@ struct intel_pt_queue {
 	char insn[INTEL_PT_INSN_BUF_SZ];
 };
 
+
 static void intel_pt_dump(struct intel_pt *pt __maybe_unused,
 			  unsigned char *buf, size_t len)
 {
@@ -357,6 +362,12 @@ static unsigned int intel_pt_cache_size(struct dso *dso,
 	return 32 - __builtin_clz(size);
 }
 
+/*
+ * The caches are shared by the queues decoded on worker threads, and an
+ * add can drop all the entries of a full cache, so lookups copy them out.
+ */
+static pthread_mutex_t intel_pt_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct auxtrace_cache *intel_pt_cache(struct dso *dso,
 					     struct machine *machine)
 {
@@ -376,28 +387,23 @@ static struct auxtrace_cache *intel_pt_cache(struct dso *dso,
 	return c;
 }
 
-static int intel_pt_cache_add(struct dso *dso, struct machine *machine,
-			      u64 offset, u64 insn_cnt, u64 byte_cnt,
-			      struct intel_pt_insn *intel_pt_insn)
+static int __intel_pt_cache_add(struct auxtrace_cache *c, u64 offset,
+				const struct intel_pt_cache_entry *from)
 {
-	struct auxtrace_cache *c = intel_pt_cache(dso, machine);
 	struct intel_pt_cache_entry *e;
 	int err;
 
-	if (!c)
-		return -ENOMEM;
-
 	e = auxtrace_cache__alloc_entry(c);
 	if (!e)
 		return -ENOMEM;
 
-	e->insn_cnt = insn_cnt;
-	e->byte_cnt = byte_cnt;
-	e->op = intel_pt_insn->op;
-	e->branch = intel_pt_insn->branch;
-	e->length = intel_pt_insn->length;
-	e->rel = intel_pt_insn->rel;
-	memcpy(e->insn, intel_pt_insn->buf, INTEL_PT_INSN_BUF_SZ);
+	e->insn_cnt = from->insn_cnt;
+	e->byte_cnt = from->byte_cnt;
+	e->op = from->op;
+	e->branch = from->branch;
+	e->length = from->length;
+	e->rel = from->rel;
+	memcpy(e->insn, from->insn, INTEL_PT_INSN_BUF_SZ);
 
 	err = auxtrace_cache__add(c, offset, &e->entry);
 	if (err)
@@ -406,15 +412,82 @@ static int intel_pt_cache_add(struct dso *dso, struct machine *machine,
 	return err;
 }
 
-static struct intel_pt_cache_entry *
-intel_pt_cache_lookup(struct dso *dso, struct machine *machine, u64 offset)
+static int intel_pt_cache_add(struct dso *dso, struct machine *machine,
+			      u64 offset, u64 insn_cnt, u64 byte_cnt,
+			      struct intel_pt_insn *intel_pt_insn)
 {
-	struct auxtrace_cache *c = intel_pt_cache(dso, machine);
+	struct intel_pt_block block = {
+		.offset = offset,
+		.insn_cnt = insn_cnt,
+		.byte_cnt = byte_cnt,
+		.op = intel_pt_insn->op,
+		.branch = intel_pt_insn->branch,
+		.length = intel_pt_insn->length,
+		.rel = intel_pt_insn->rel,
+	};
+	struct intel_pt_cache_entry e = {
+		.insn_cnt = insn_cnt,
+		.byte_cnt = byte_cnt,
+		.op = intel_pt_insn->op,
+		.branch = intel_pt_insn->branch,
+		.length = intel_pt_insn->length,
+		.rel = intel_pt_insn->rel,
+	};
+	struct auxtrace_cache *c;
+	int err = -ENOMEM;
 
-	if (!c)
-		return NULL;
+	memcpy(block.insn, intel_pt_insn->buf, INTEL_PT_INSN_BUF_SZ);
+	memcpy(e.insn, intel_pt_insn->buf, INTEL_PT_INSN_BUF_SZ);
+
+	/* Kept for the next sessions decoding the same binary */
+	intel_pt_blocks__add(dso, &block);
+
+	pthread_mutex_lock(&intel_pt_cache_lock);
+	c = intel_pt_cache(dso, machine);
+	if (c)
+		err = __intel_pt_cache_add(c, offset, &e);
+	pthread_mutex_unlock(&intel_pt_cache_lock);
+
+	return err;
+}
+
+static bool intel_pt_cache_lookup(struct dso *dso, struct machine *machine,
+				  u64 offset, struct intel_pt_cache_entry *copy)
+{
+	struct intel_pt_block block;
+	struct auxtrace_cache *c;
+	struct intel_pt_cache_entry *e = NULL;
+
+	pthread_mutex_lock(&intel_pt_cache_lock);
+	c = intel_pt_cache(dso, machine);
+	if (c)
+		e = auxtrace_cache__lookup(c, offset);
+	if (e)
+		*copy = *e;
+	pthread_mutex_unlock(&intel_pt_cache_lock);
+
+	if (e)
+		return true;
 
-	return auxtrace_cache__lookup(dso->auxtrace_cache, offset);
+	/* Walked by an earlier session */
+	if (!intel_pt_blocks__find(dso, offset, &block))
+		return false;
+
+	copy->insn_cnt = block.insn_cnt;
+	copy->byte_cnt = block.byte_cnt;
+	copy->op = block.op;
+	copy->branch = block.branch;
+	copy->length = block.length;
+	copy->rel = block.rel;
+	memcpy(copy->insn, block.insn, INTEL_PT_INSN_BUF_SZ);
+
+	pthread_mutex_lock(&intel_pt_cache_lock);
+	c = intel_pt_cache(dso, machine);
+	if (c)
+		__intel_pt_cache_add(c, offset, copy);
+	pthread_mutex_unlock(&intel_pt_cache_lock);
+
+	return true;
 }
 
 static inline u8 intel_pt_cpumode(struct intel_pt *pt, uint64_t ip)
@@ -467,18 +540,18 @@ static int intel_pt_walk_next_insn(struct intel_pt_insn *intel_pt_insn,
 		offset = al.map->map_ip(al.map, *ip);
 
 		if (!to_ip && one_map) {
-			struct intel_pt_cache_entry *e;
-
-			e = intel_pt_cache_lookup(al.map->dso, machine, offset);
-			if (e &&
-			    (!max_insn_cnt || e->insn_cnt <= max_insn_cnt)) {
-				*insn_cnt_ptr = e->insn_cnt;
-				*ip += e->byte_cnt;
-				intel_pt_insn->op = e->op;
-				intel_pt_insn->branch = e->branch;
-				intel_pt_insn->length = e->length;
-				intel_pt_insn->rel = e->rel;
-				memcpy(intel_pt_insn->buf, e->insn,
+			struct intel_pt_cache_entry e;
+
+			if (intel_pt_cache_lookup(al.map->dso, machine, offset,
+						  &e) &&
+			    (!max_insn_cnt || e.insn_cnt <= max_insn_cnt)) {
+				*insn_cnt_ptr = e.insn_cnt;
+				*ip += e.byte_cnt;
+				intel_pt_insn->op = e.op;
+				intel_pt_insn->branch = e.branch;
+				intel_pt_insn->length = e.length;
+				intel_pt_insn->rel = e.rel;
+				memcpy(intel_pt_insn->buf, e.insn,
 				       INTEL_PT_INSN_BUF_SZ);
 				intel_pt_log_insn_no_data(intel_pt_insn, *ip);
 				return 0;
@@ -536,10 +609,10 @@ out:
 	 * entries.
 	 */
 	if (to_ip) {
-		struct intel_pt_cache_entry *e;
+		struct intel_pt_cache_entry e;
 
-		e = intel_pt_cache_lookup(al.map->dso, machine, start_offset);
-		if (e)
+		if (intel_pt_cache_lookup(al.map->dso, machine, start_offset,
+					  &e))
 			return 0;
 	}
 
@@ -1109,6 +1182,12 @@ static inline int intel_pt_opt_inject(struct intel_pt *pt,
 	return intel_pt_inject_event(event, sample, type);
 }
 
+static int intel_pt_deliver(struct intel_pt *pt, union perf_event *event,
+			    struct perf_sample *sample, u64 time)
+{
+	return auxtrace__deliver_synth_event(pt->session, event, sample, time);
+}
+
 static int intel_pt_deliver_synth_b_event(struct intel_pt *pt,
 					  union perf_event *event,
 					  struct perf_sample *sample, u64 type)
@@ -1119,7 +1198,7 @@ static int intel_pt_deliver_synth_b_event(struct intel_pt *pt,
 	if (ret)
 		return ret;
 
-	ret = perf_session__deliver_synth_event(pt->session, event, sample);
+	ret = intel_pt_deliver(pt, event, sample, sample->time);
 	if (ret)
 		pr_err("Intel PT: failed to deliver event, error %d\n", ret);
 
@@ -1422,7 +1501,7 @@ static int intel_pt_synth_error(struct intel_pt *pt, int code, int cpu,
 	auxtrace_synth_error(&event.auxtrace_error, PERF_AUXTRACE_ERROR_ITRACE,
 			     code, cpu, pid, tid, ip, msg, timestamp);
 
-	err = perf_session__deliver_synth_event(pt->session, &event, NULL);
+	err = intel_pt_deliver(pt, &event, NULL, timestamp);
 	if (err)
 		pr_err("Intel Processor Trace: failed to deliver error event, error %d\n",
 		       err);
@@ -1650,26 +1729,32 @@ static void intel_pt_enable_sync_switch(struct intel_pt *pt)
 	}
 }
 
+static void intel_pt_setup_kernel_start(struct intel_pt *pt)
+{
+	if (pt->kernel_start)
+		return;
+
+	pt->kernel_start = machine__kernel_start(pt->machine);
+	if (pt->per_cpu_mmaps &&
+	    (pt->have_sched_switch == 1 || pt->have_sched_switch == 3) &&
+	    !pt->timeless_decoding && intel_pt_tracing_kernel(pt) &&
+	    !pt->sampling_mode) {
+		pt->switch_ip = intel_pt_switch_ip(pt, &pt->ptss_ip);
+		if (pt->switch_ip) {
+			intel_pt_log("switch_ip: %"PRIx64" ptss_ip: %"PRIx64"\n",
+				     pt->switch_ip, pt->ptss_ip);
+			intel_pt_enable_sync_switch(pt);
+		}
+	}
+}
+
 static int intel_pt_run_decoder(struct intel_pt_queue *ptq, u64 *timestamp)
 {
 	const struct intel_pt_state *state = ptq->state;
 	struct intel_pt *pt = ptq->pt;
 	int err;
 
-	if (!pt->kernel_start) {
-		pt->kernel_start = machine__kernel_start(pt->machine);
-		if (pt->per_cpu_mmaps &&
-		    (pt->have_sched_switch == 1 || pt->have_sched_switch == 3) &&
-		    !pt->timeless_decoding && intel_pt_tracing_kernel(pt) &&
-		    !pt->sampling_mode) {
-			pt->switch_ip = intel_pt_switch_ip(pt, &pt->ptss_ip);
-			if (pt->switch_ip) {
-				intel_pt_log("switch_ip: %"PRIx64" ptss_ip: %"PRIx64"\n",
-					     pt->switch_ip, pt->ptss_ip);
-				intel_pt_enable_sync_switch(pt);
-			}
-		}
-	}
+	intel_pt_setup_kernel_start(pt);
 
 	intel_pt_log("queue %u decoding cpu %d pid %d tid %d\n",
 		     ptq->queue_nr, ptq->cpu, ptq->pid, ptq->tid);
@@ -1735,12 +1820,61 @@ static inline int intel_pt_update_queues(struct intel_pt *pt)
 	return 0;
 }
 
+/* Decode a queue on a worker thread, see intel_pt_process_queues_parallel() */
+static int intel_pt_decode_queue(struct auxtrace_queue *queue, u64 *timestamp)
+{
+	struct intel_pt_queue *ptq = queue->priv;
+	int ret;
+
+	ret = intel_pt_run_decoder(ptq, timestamp);
+	if (ret > 0)
+		ptq->on_heap = false;
+
+	return ret;
+}
+
+/*
+ * The queues are independent between two sideband events, so all of those
+ * that are due get decoded up to timestamp at the same time, buffering what
+ * they synthesize.  The Intel PT instruction caches are shared, anything
+ * else a decoder writes to is its queue's or per cpu.
+ */
+static int intel_pt_process_queues_parallel(struct intel_pt *pt, u64 timestamp)
+{
+	int err;
+
+	intel_pt_setup_kernel_start(pt);
+
+	while (pt->heap.heap_cnt &&
+	       pt->heap.heap_array[0].ordinal < timestamp) {
+		unsigned int queue_nr = pt->heap.heap_array[0].queue_nr;
+		struct auxtrace_queue *queue = &pt->queues.queue_array[queue_nr];
+
+		intel_pt_log("queue %u processing 0x%" PRIx64 " to 0x%" PRIx64 "\n",
+			     queue_nr, pt->heap.heap_array[0].ordinal,
+			     timestamp);
+
+		auxtrace_heap__pop(&pt->heap);
+		intel_pt_set_pid_tid_cpu(pt, queue);
+
+		err = auxtrace_workers__add(pt->workers, queue_nr, timestamp);
+		if (err)
+			return err;
+	}
+
+	return auxtrace_workers__process(pt->workers, pt->session,
+					 &pt->queues, &pt->heap);
+}
+
 static int intel_pt_process_queues(struct intel_pt *pt, u64 timestamp)
 {
 	unsigned int queue_nr;
 	u64 ts;
 	int ret;
 
+	if (auxtrace_workers__due(pt->workers, &pt->heap, timestamp))
+		return intel_pt_process_queues_parallel(pt, timestamp);
+
 	while (1) {
 		struct auxtrace_queue *queue;
 		struct intel_pt_queue *ptq;
@@ -2079,6 +2213,8 @@ static void intel_pt_free(struct perf_session *session)
 	struct intel_pt *pt = container_of(session->auxtrace, struct intel_pt,
 					   auxtrace);
 
+	auxtrace_workers__delete(pt->workers);
+	intel_pt_blocks__save();
 	auxtrace_heap__free(&pt->heap);
 	intel_pt_free_events(session);
 	session->auxtrace = NULL;
@@ -2379,6 +2515,13 @@ static int intel_pt_perf_config(const char *var, const char *value, void *data)
 	if (!strcmp(var, "intel-pt.mispred-all"))
 		pt->mispred_all = perf_config_bool(var, value);
 
+	if (!strcmp(var, "intel-pt.decode-threads")) {
+		long val = strtol(value, NULL, 0);
+
+		if (val > 0 && val <= INT_MAX)
+			pt->nr_decode_threads = val;
+	}
+
 	return 0;
 }
 
@@ -2468,6 +2611,7 @@ int intel_pt_process_auxtrace_info(union perf_event *event,
 	pt->noretcomp_bit = auxtrace_info->priv[INTEL_PT_NORETCOMP_BIT];
 	pt->have_sched_switch = auxtrace_info->priv[INTEL_PT_HAVE_SCHED_SWITCH];
 	pt->snapshot_mode = auxtrace_info->priv[INTEL_PT_SNAPSHOT_MODE];
+	pt->queues.snapshot_mode = pt->snapshot_mode;
 	pt->per_cpu_mmaps = auxtrace_info->priv[INTEL_PT_PER_CPU_MMAPS];
 	intel_pt_print_info(&auxtrace_info->priv[0], INTEL_PT_PMU_TYPE,
 			    INTEL_PT_PER_CPU_MMAPS);
@@ -2642,6 +2786,18 @@ int intel_pt_process_auxtrace_info(union perf_event *event,
 	if (pt->timeless_decoding)
 		pr_debug2("Intel PT decoding without timestamps\n");
 
+	/*
+	 * Decoding queues together needs a queue per cpu, ordered by
+	 * timestamps, and thread stacks and skipped events depend on the
+	 * order the queues are decoded in.
+	 */
+	if (pt->per_cpu_mmaps && !pt->timeless_decoding &&
+	    !pt->synth_opts.callchain && !pt->synth_opts.thread_stack &&
+	    !pt->synth_opts.initial_skip)
+		pt->workers = auxtrace_workers__new(pt->nr_decode_threads,
+						    intel_pt_decode_queue,
+						    "Intel PT");
+
 	return 0;
 
 err_delete_thread:
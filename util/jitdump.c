@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,8 @@
 #include <byteswap.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
 #include <linux/stringify.h>
 
 #include "util.h"
@@ -30,6 +33,30 @@
 
 #include "sane_ctype.h"
 
+/* The code loads whose ELF images are written together, at most */
+#define JIT_ELF_BATCH		1024
+#define JIT_ELF_THREADS		8
+
+/* A code load, with the records before it its image needs */
+struct jit_elf_job {
+	union jr_entry	 *jr;
+	union perf_event *event;
+	void		 *debug_data;
+	size_t		 nr_debug_entries;
+	void		 *unwinding_data;
+	uint64_t	 unwinding_size;
+	uint64_t	 unwinding_mapped_size;
+	uint64_t	 eh_frame_hdr_size;
+	int		 ret;
+};
+
+struct jit_elf_worker {
+	struct jit_elf_job	*jobs;
+	unsigned int		nr_jobs;
+	unsigned int		shard;
+	unsigned int		nr_shards;
+};
+
 struct jit_buf_desc {
 	struct perf_data *output;
 	struct perf_session *session;
@@ -49,6 +76,8 @@ struct jit_buf_desc {
 	size_t		 nr_debug_entries;
 	uint32_t         code_load_count;
 	u64		 bytes_written;
+	struct jit_elf_job *jobs;
+	unsigned int	 nr_jobs;
 	struct rb_root   code_root;
 	char		 dir[PATH_MAX];
 };
@@ -383,19 +412,102 @@ static uint64_t convert_timestamp(struct jit_buf_desc *jd, uint64_t timestamp)
 	return tsc_to_perf_time(timestamp, &tc);
 }
 
-static int jit_repipe_code_load(struct jit_buf_desc *jd, union jr_entry *jr)
+static void jit_elf_job__exit(struct jit_elf_job *job)
+{
+	zfree(&job->jr);
+	zfree(&job->event);
+	zfree(&job->debug_data);
+	zfree(&job->unwinding_data);
+}
+
+static void jit_elf_job__emit(struct jit_elf_job *job)
+{
+	union jr_entry *jr = job->jr;
+	const char *sym = (void *)((unsigned long)jr + sizeof(jr->load));
+	uintptr_t code = (unsigned long)jr + jr->load.p.total_size -
+			 jr->load.code_size;
+
+	job->ret = jit_emit_elf(job->event->mmap2.filename, sym,
+				jr->load.code_addr, (const void *)code,
+				jr->load.code_size, job->debug_data,
+				job->nr_debug_entries, job->unwinding_data,
+				job->eh_frame_hdr_size, job->unwinding_size);
+}
+
+static void *jit_elf_worker__run(void *arg)
+{
+	struct jit_elf_worker *worker = arg;
+	unsigned int i;
+
+	for (i = worker->shard; i < worker->nr_jobs; i += worker->nr_shards)
+		jit_elf_job__emit(&worker->jobs[i]);
+
+	return NULL;
+}
+
+/* The images only depend on their own code load, write them in parallel */
+static void jit_emit_elfs(struct jit_buf_desc *jd)
+{
+	struct jit_elf_worker *workers;
+	pthread_t *threads;
+	unsigned int i, nr_threads, started = 0;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nr_threads = min_t(unsigned int, nr_cpus > 0 ? nr_cpus : 1,
+			   JIT_ELF_THREADS);
+	nr_threads = min(nr_threads, jd->nr_jobs);
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (nr_threads < 2 || workers == NULL || threads == NULL) {
+		struct jit_elf_worker worker = {
+			.jobs	   = jd->jobs,
+			.nr_jobs   = jd->nr_jobs,
+			.nr_shards = 1,
+		};
+
+		jit_elf_worker__run(&worker);
+		goto out_free;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].jobs	     = jd->jobs;
+		workers[i].nr_jobs   = jd->nr_jobs;
+		workers[i].shard     = i;
+		workers[i].nr_shards = nr_threads;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, jit_elf_worker__run,
+				   &workers[i])) {
+			/* the shards without a thread are done below */
+			break;
+		}
+		started = i;
+	}
+
+	jit_elf_worker__run(&workers[0]);
+	for (i = started + 1; i < nr_threads; i++)
+		jit_elf_worker__run(&workers[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+out_free:
+	free(workers);
+	free(threads);
+}
+
+static int jit_repipe_elf_job(struct jit_buf_desc *jd, struct jit_elf_job *job)
 {
 	struct perf_sample sample;
-	union perf_event *event;
+	union jr_entry *jr = job->jr;
+	union perf_event *event = job->event;
 	struct perf_tool *tool = jd->session->tool;
-	uint64_t code, addr;
-	uintptr_t uaddr;
-	char *filename;
+	char *filename = event->mmap2.filename;
+	uint64_t addr = jr->load.code_addr;
 	struct stat st;
 	size_t size;
 	u16 idr_size;
-	const char *sym;
-	uint32_t count;
 	int ret, csize, usize;
 	pid_t pid, tid;
 	struct {
@@ -403,51 +515,18 @@ static int jit_repipe_code_load(struct jit_buf_desc *jd, union jr_entry *jr)
 		u64 time;
 	} *id;
 
+	if (job->ret)
+		return -1;
+
 	pid   = jr->load.pid;
 	tid   = jr->load.tid;
 	csize = jr->load.code_size;
-	usize = jd->unwinding_mapped_size;
-	addr  = jr->load.code_addr;
-	sym   = (void *)((unsigned long)jr + sizeof(jr->load));
-	code  = (unsigned long)jr + jr->load.p.total_size - csize;
-	count = jr->load.code_index;
+	usize = job->unwinding_mapped_size;
 	idr_size = jd->machine->id_hdr_size;
 
-	event = calloc(1, sizeof(*event) + idr_size);
-	if (!event)
-		return -1;
-
-	filename = event->mmap2.filename;
-	size = snprintf(filename, PATH_MAX, "%s/jitted-%d-%u.so",
-			jd->dir,
-			pid,
-			count);
-
-	size++; /* for \0 */
-
+	size = strlen(filename) + 1; /* for \0 */
 	size = PERF_ALIGN(size, sizeof(u64));
-	uaddr = (uintptr_t)code;
-	ret = jit_emit_elf(filename, sym, addr, (const void *)uaddr, csize, jd->debug_data, jd->nr_debug_entries,
-			   jd->unwinding_data, jd->eh_frame_hdr_size, jd->unwinding_size);
-
-	if (jd->debug_data && jd->nr_debug_entries) {
-		free(jd->debug_data);
-		jd->debug_data = NULL;
-		jd->nr_debug_entries = 0;
-	}
 
-	if (jd->unwinding_data && jd->eh_frame_hdr_size) {
-		free(jd->unwinding_data);
-		jd->unwinding_data = NULL;
-		jd->eh_frame_hdr_size = 0;
-		jd->unwinding_mapped_size = 0;
-		jd->unwinding_size = 0;
-	}
-
-	if (ret) {
-		free(event);
-		return -1;
-	}
 	if (stat(filename, &st))
 		memset(&st, 0, sizeof(st));
 
@@ -501,6 +580,75 @@ static int jit_repipe_code_load(struct jit_buf_desc *jd, union jr_entry *jr)
 	return ret;
 }
 
+/*
+ * Write the images of the queued code loads and inject their MMAP2
+ * events, in the order of the code loads.
+ */
+static int jit_flush_elfs(struct jit_buf_desc *jd)
+{
+	unsigned int i;
+	int ret = 0, err;
+
+	if (jd->nr_jobs == 0)
+		return 0;
+
+	jit_emit_elfs(jd);
+
+	for (i = 0; i < jd->nr_jobs; i++) {
+		err = jit_repipe_elf_job(jd, &jd->jobs[i]);
+		if (err && !ret)
+			ret = err;
+		jit_elf_job__exit(&jd->jobs[i]);
+	}
+
+	jd->nr_jobs = 0;
+	return ret;
+}
+
+static int jit_repipe_code_load(struct jit_buf_desc *jd, union jr_entry *jr)
+{
+	struct jit_elf_job *job;
+	u16 idr_size = jd->machine->id_hdr_size;
+
+	if (jd->jobs == NULL) {
+		jd->jobs = calloc(JIT_ELF_BATCH, sizeof(*jd->jobs));
+		if (jd->jobs == NULL)
+			return -1;
+	}
+
+	job = &jd->jobs[jd->nr_jobs];
+	/* jr points in the buffer the next record is read in */
+	job->jr = memdup(jr, jr->load.p.total_size);
+	job->event = calloc(1, sizeof(*job->event) + idr_size);
+	if (job->jr == NULL || job->event == NULL) {
+		jit_elf_job__exit(job);
+		return -1;
+	}
+
+	snprintf(job->event->mmap2.filename, PATH_MAX, "%s/jitted-%d-%u.so",
+		 jd->dir, jr->load.pid, jr->load.code_index);
+
+	/* the debug and unwinding info go with the next code load only */
+	job->debug_data	      = jd->debug_data;
+	job->nr_debug_entries = jd->nr_debug_entries;
+	jd->debug_data	      = NULL;
+	jd->nr_debug_entries  = 0;
+
+	job->unwinding_data	   = jd->unwinding_data;
+	job->unwinding_size	   = jd->unwinding_size;
+	job->unwinding_mapped_size = jd->unwinding_mapped_size;
+	job->eh_frame_hdr_size	   = jd->eh_frame_hdr_size;
+	jd->unwinding_data	   = NULL;
+	jd->unwinding_size	   = 0;
+	jd->unwinding_mapped_size  = 0;
+	jd->eh_frame_hdr_size	   = 0;
+
+	if (++jd->nr_jobs == JIT_ELF_BATCH)
+		return jit_flush_elfs(jd);
+
+	return 0;
+}
+
 static int jit_repipe_code_move(struct jit_buf_desc *jd, union jr_entry *jr)
 {
 	struct perf_sample sample;
@@ -518,6 +666,11 @@ static int jit_repipe_code_move(struct jit_buf_desc *jd, union jr_entry *jr)
 		u64 time;
 	} *id;
 
+	/* the image of the code moved may still be queued */
+	ret = jit_flush_elfs(jd);
+	if (ret)
+		return ret;
+
 	pid = jr->move.pid;
 	tid =  jr->move.tid;
 	usize = jd->unwinding_mapped_size;
@@ -666,6 +819,9 @@ jit_process_dump(struct jit_buf_desc *jd)
 			continue;
 		}
 	}
+
+	if (jit_flush_elfs(jd))
+		ret = -1;
 	return ret;
 }
 
@@ -785,6 +941,9 @@ jit_process(struct perf_session *session,
 	*nbytes = 0;
 
 	ret = jit_inject(&jd, filename);
+	free(jd.jobs);
+	free(jd.debug_data);
+	free(jd.unwinding_data);
 	if (!ret) {
 		*nbytes = jd.bytes_written;
 		ret = 1;
@@ -0,0 +1,452 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <api/fs/fs.h>
+#include <symbol/kallsyms.h>
+#include "build-id.h"
+#include "debug.h"
+#include "event.h"
+#include "kallsyms-cache.h"
+#include "string2.h"
+#include "util.h"
+
+/*
+ * Reading /proc/kallsyms has the kernel format its hundreds of thousands
+ * of symbols, for perf to parse them back, a few times per invocation.
+ * What kallsyms__parse() passes on is instead kept in
+ * ~/.cache/perf/kallsyms/<kernel build-id>:
+ *
+ *   struct kallsyms_cache_header
+ *   nr_syms times: u64 start, char type, name with its '\0'
+ *
+ * and mapped. It is only used for the boot it was written in and the
+ * modules that were loaded then. The symbols of the BPF programs, kprobes
+ * and ftrace trampolines come and go without that showing in the modules,
+ * they are left out.
+ *
+ * The kallsyms of the guests, from --guestmount or --guestkallsyms, are
+ * kept too, by the build-id of their kernel, its _text and their modules,
+ * in ~/.cache/perf/kallsyms/guest-<build-id>-<hash of those>. Guests
+ * booted from the same kernel at the same addresses, i.e. without KASLR,
+ * share the one snapshot, parsed once for all of them.
+ */
+#define KALLSYMS_CACHE_DIR	"/.cache/perf/kallsyms"
+#define KALLSYMS_CACHE_MAGIC	0x53594d534c4c414bULL	/* "KALLSYMS" */
+#define KALLSYMS_CACHE_VERSION	2
+#define KALLSYMS_CACHE_REC	(sizeof(u64) + 1)
+
+struct kallsyms_cache_key {
+	u64	magic;
+	u32	version;
+	/* the addresses are hidden to some */
+	u32	euid;
+	u64	modules_hash;
+	char	boot_id[40];
+	char	build_id[48];
+	/* of a guest kernel, zero for the host */
+	u64	text;
+};
+
+struct kallsyms_cache_header {
+	struct kallsyms_cache_key key;
+	u64	nr_syms;
+	u64	size;
+};
+
+struct kallsyms_cache_buf {
+	char	*data;
+	size_t	size;
+	size_t	alloc;
+	u64	nr_syms;
+};
+
+struct kallsyms_cache_guest {
+	struct list_head	  node;
+	struct kallsyms_cache_key key;
+	const char		  *syms;
+	size_t			  size;
+};
+
+bool kallsyms_cache__enabled = true;
+
+static struct {
+	pthread_mutex_t	 lock;
+	bool		 loaded;
+	/* the records, mapped or read */
+	const char	 *syms;
+	size_t		 size;
+	struct list_head guests;
+} kallsyms_cache = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.guests	= LIST_HEAD_INIT(kallsyms_cache.guests),
+};
+
+static u64 kallsyms_cache__hash(u64 hash, const char *s, size_t len)
+{
+	/* FNV-1a */
+	while (len--)
+		hash = (hash ^ (u8)*s++) * 1099511628211ULL;
+	return hash ^ '\n';
+}
+
+static int __kallsyms_cache__modules_hash(const char *filename, u64 *hash)
+{
+	char *buf, *line, *saveptr = NULL;
+	size_t size;
+
+	*hash = 14695981039346656037ULL;
+
+	/* a kernel without modules */
+	if (filename == NULL || access(filename, F_OK))
+		return 0;
+
+	if (filename__read_str(filename, &buf, &size))
+		return -1;
+
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		char *field, *fsave = NULL;
+		int i = 0;
+
+		/* name size refcount deps state address */
+		for (field = strtok_r(line, " ", &fsave); field;
+		     field = strtok_r(NULL, " ", &fsave), i++) {
+			if (i == 0 || i == 1 || i == 5)
+				*hash = kallsyms_cache__hash(*hash, field, strlen(field));
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+/* The names, sizes and addresses of the modules loaded */
+int kallsyms_cache__modules_hash(u64 *hash)
+{
+	return __kallsyms_cache__modules_hash("/proc/modules", hash);
+}
+
+static int kallsyms_cache__key(struct kallsyms_cache_key *key)
+{
+	char *boot_id;
+	size_t len;
+
+	memset(key, 0, sizeof(*key));
+	key->magic   = KALLSYMS_CACHE_MAGIC;
+	key->version = KALLSYMS_CACHE_VERSION;
+	key->euid    = geteuid();
+
+	if (sysfs__sprintf_build_id(NULL, key->build_id) < 0 ||
+	    kallsyms_cache__modules_hash(&key->modules_hash) ||
+	    filename__read_str("/proc/sys/kernel/random/boot_id", &boot_id, &len))
+		return -1;
+
+	scnprintf(key->boot_id, sizeof(key->boot_id), "%.*s", (int)len, boot_id);
+	rtrim(key->boot_id);
+	free(boot_id);
+	return 0;
+}
+
+/* The guest's _text tells apart the boots with KASLR */
+static int kallsyms_cache__guest_key(struct kallsyms_cache_key *key,
+				     const char *filename, const char *modules,
+				     const u8 *build_id)
+{
+	memset(key, 0, sizeof(*key));
+	key->magic   = KALLSYMS_CACHE_MAGIC;
+	key->version = KALLSYMS_CACHE_VERSION;
+	key->euid    = geteuid();
+
+	build_id__sprintf(build_id, BUILD_ID_SIZE, key->build_id);
+
+	if (kallsyms__get_function_start(filename, "_text", &key->text) ||
+	    __kallsyms_cache__modules_hash(modules, &key->modules_hash))
+		return -1;
+	return 0;
+}
+
+static char *kallsyms_cache__filename(const char *name, char *bf, size_t size)
+{
+	const char *home = getenv("HOME");
+
+	if (!home || !*home)
+		return NULL;
+
+	if (name)
+		scnprintf(bf, size, "%s" KALLSYMS_CACHE_DIR "/%s", home, name);
+	else
+		scnprintf(bf, size, "%s" KALLSYMS_CACHE_DIR, home);
+	return bf;
+}
+
+/* The records must all be there, each name ended */
+static bool kallsyms_cache__valid(const char *p, size_t size, u64 nr_syms)
+{
+	const char *end = p + size;
+
+	while (nr_syms--) {
+		const char *name = p + KALLSYMS_CACHE_REC;
+
+		if (name >= end)
+			return false;
+		p = memchr(name, '\0', end - name);
+		if (!p)
+			return false;
+		p++;
+	}
+
+	return p == end;
+}
+
+static int kallsyms_cache__map(const char *filename,
+			       const struct kallsyms_cache_key *key,
+			       const char **syms, size_t *size)
+{
+	const struct kallsyms_cache_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (memcmp(&hdr->key, key, sizeof(*key)) ||
+	    hdr->size != st.st_size - sizeof(*hdr) ||
+	    !kallsyms_cache__valid(map + sizeof(*hdr), hdr->size, hdr->nr_syms)) {
+		pr_debug("Ignoring stale kallsyms cache %s\n", filename);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	*syms = map + sizeof(*hdr);
+	*size = hdr->size;
+	return 0;
+}
+
+static bool kallsyms_cache__ephemeral(const char *name)
+{
+	const char *module = strchr(name, '\t');
+
+	return module && (!strcmp(module + 1, "[bpf]") ||
+			  strstarts(module + 1, "[__builtin__"));
+}
+
+static int kallsyms_cache__add(void *arg, const char *name, char type, u64 start)
+{
+	struct kallsyms_cache_buf *b = arg;
+	size_t len = strlen(name) + 1;
+
+	if (kallsyms_cache__ephemeral(name))
+		return 0;
+
+	if (b->size + KALLSYMS_CACHE_REC + len > b->alloc) {
+		size_t alloc = max(b->alloc * 2, b->size + KALLSYMS_CACHE_REC + len + 4096);
+		char *data = realloc(b->data, alloc);
+
+		if (data == NULL)
+			return -ENOMEM;
+		b->data  = data;
+		b->alloc = alloc;
+	}
+
+	memcpy(b->data + b->size, &start, sizeof(start));
+	b->data[b->size + sizeof(start)] = type;
+	memcpy(b->data + b->size + KALLSYMS_CACHE_REC, name, len);
+	b->size += KALLSYMS_CACHE_REC + len;
+	b->nr_syms++;
+	return 0;
+}
+
+static void kallsyms_cache__write(const char *filename,
+				  const struct kallsyms_cache_key *key,
+				  struct kallsyms_cache_buf *b)
+{
+	struct kallsyms_cache_header hdr;
+	char dir[PATH_MAX], tmpname[PATH_MAX];
+	int fd;
+
+	if (!kallsyms_cache__filename(NULL, dir, sizeof(dir)) ||
+	    mkdir_p(dir, 0755))
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.key     = *key;
+	hdr.nr_syms = b->nr_syms;
+	hdr.size    = b->size;
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, getpid());
+
+	/* the addresses are only for whoever could read them */
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return;
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, b->data, b->size) != (ssize_t)b->size) {
+		close(fd);
+		unlink(tmpname);
+		return;
+	}
+
+	if (close(fd) || rename(tmpname, filename))
+		unlink(tmpname);
+}
+
+/* Map the snapshot, writing it first if there's none for this boot */
+static void kallsyms_cache__load(void)
+{
+	struct kallsyms_cache_buf b = { .data = NULL, };
+	struct kallsyms_cache_key key;
+	char filename[PATH_MAX];
+
+	if (kallsyms_cache__key(&key) ||
+	    !kallsyms_cache__filename(key.build_id, filename, sizeof(filename)))
+		return;
+
+	if (!kallsyms_cache__map(filename, &key, &kallsyms_cache.syms,
+				 &kallsyms_cache.size))
+		return;
+
+	if (kallsyms__parse("/proc/kallsyms", &b, kallsyms_cache__add)) {
+		free(b.data);
+		return;
+	}
+
+	kallsyms_cache__write(filename, &key, &b);
+	/* kept for the life of the process, as the mapping */
+	kallsyms_cache.syms = b.data;
+	kallsyms_cache.size = b.size;
+}
+
+static int kallsyms_cache__process(const char *syms, size_t size, void *arg,
+				   int (*process_symbol)(void *arg, const char *name,
+							 char type, u64 start))
+{
+	const char *p = syms, *end = syms + size;
+
+	while (p < end) {
+		const char *name = p + KALLSYMS_CACHE_REC;
+		u64 start;
+		int err;
+
+		memcpy(&start, p, sizeof(start));
+		err = process_symbol(arg, name, p[sizeof(start)], start);
+		if (err)
+			return err;
+		p = name + strlen(name) + 1;
+	}
+
+	return 0;
+}
+
+int kallsyms_cache__parse(const char *filename, void *arg,
+			  int (*process_symbol)(void *arg, const char *name,
+						char type, u64 start))
+{
+	if (!kallsyms_cache__enabled || strcmp(filename, "/proc/kallsyms"))
+		return kallsyms__parse(filename, arg, process_symbol);
+
+	pthread_mutex_lock(&kallsyms_cache.lock);
+	if (!kallsyms_cache.loaded) {
+		kallsyms_cache__load();
+		kallsyms_cache.loaded = true;
+	}
+	pthread_mutex_unlock(&kallsyms_cache.lock);
+
+	if (!kallsyms_cache.syms)
+		return kallsyms__parse(filename, arg, process_symbol);
+
+	return kallsyms_cache__process(kallsyms_cache.syms, kallsyms_cache.size,
+				       arg, process_symbol);
+}
+
+/*
+ * The snapshot of a guest kernel with that key, the one of a guest seen
+ * before, the one on disk or one parsed and written from filename.
+ */
+static struct kallsyms_cache_guest *
+kallsyms_cache__findnew_guest(const struct kallsyms_cache_key *key,
+			      const char *filename)
+{
+	struct kallsyms_cache_buf b = { .data = NULL, };
+	struct kallsyms_cache_guest *guest;
+	char name[PATH_MAX], cachename[PATH_MAX];
+	u64 hash;
+
+	list_for_each_entry(guest, &kallsyms_cache.guests, node) {
+		if (!memcmp(&guest->key, key, sizeof(*key)))
+			return guest;
+	}
+
+	guest = zalloc(sizeof(*guest));
+	if (guest == NULL)
+		return NULL;
+	guest->key = *key;
+
+	hash = kallsyms_cache__hash(key->modules_hash, (const char *)&key->text,
+				    sizeof(key->text));
+	scnprintf(name, sizeof(name), "guest-%s-%016" PRIx64, key->build_id, hash);
+
+	if (!kallsyms_cache__filename(name, cachename, sizeof(cachename)) ||
+	    kallsyms_cache__map(cachename, key, &guest->syms, &guest->size)) {
+		if (kallsyms__parse(filename, &b, kallsyms_cache__add)) {
+			free(b.data);
+			free(guest);
+			return NULL;
+		}
+
+		if (kallsyms_cache__filename(name, cachename, sizeof(cachename)))
+			kallsyms_cache__write(cachename, key, &b);
+		/* kept for the life of the process, as the mappings */
+		guest->syms = b.data;
+		guest->size = b.size;
+	}
+
+	list_add_tail(&guest->node, &kallsyms_cache.guests);
+	return guest;
+}
+
+int kallsyms_cache__parse_guest(const char *filename, const char *modules,
+				const u8 *build_id, void *arg,
+				int (*process_symbol)(void *arg, const char *name,
+						      char type, u64 start))
+{
+	struct kallsyms_cache_guest *guest;
+	struct kallsyms_cache_key key;
+
+	if (!kallsyms_cache__enabled || build_id == NULL ||
+	    kallsyms_cache__guest_key(&key, filename, modules, build_id))
+		return kallsyms__parse(filename, arg, process_symbol);
+
+	pthread_mutex_lock(&kallsyms_cache.lock);
+	guest = kallsyms_cache__findnew_guest(&key, filename);
+	pthread_mutex_unlock(&kallsyms_cache.lock);
+
+	if (guest == NULL)
+		return kallsyms__parse(filename, arg, process_symbol);
+
+	return kallsyms_cache__process(guest->syms, guest->size, arg,
+				       process_symbol);
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_KALLSYMS_CACHE_H
+#define __PERF_KALLSYMS_CACHE_H
+
+#include <stdbool.h>
+#include <linux/types.h>
+
+extern bool kallsyms_cache__enabled;
+
+/*
+ * Like kallsyms__parse(), but /proc/kallsyms is read from a snapshot
+ * kept for the running kernel, its boot and loaded modules.
+ */
+int kallsyms_cache__parse(const char *filename, void *arg,
+			  int (*process_symbol)(void *arg, const char *name,
+						char type, u64 start));
+
+/*
+ * The same for the kallsyms of a guest, kept by the build-id of its
+ * kernel, its _text and the modules in its /proc/modules, so that the
+ * guests booted alike share it.
+ */
+int kallsyms_cache__parse_guest(const char *filename, const char *modules,
+				const u8 *build_id, void *arg,
+				int (*process_symbol)(void *arg, const char *name,
+						      char type, u64 start));
+
+/* A hash of the modules loaded, telling when they change */
+int kallsyms_cache__modules_hash(u64 *hash);
+
+#endif /* __PERF_KALLSYMS_CACHE_H */
@@ -28,11 +28,11 @@ struct kvm_event {
 
 	struct event_key key;
 
-	struct kvm_event_stats total;
+	/* the slot of the event in the stats of each vcpu */
+	int idx;
 
-	#define DEFAULT_VCPU_NUM 8
-	int max_vcpu;
-	struct kvm_event_stats *vcpu;
+	/* merged from the vcpus reported when displaying */
+	struct kvm_event_stats total;
 };
 
 typedef int (*key_cmp_fun)(struct kvm_event*, struct kvm_event*, int);
@@ -88,6 +88,10 @@ struct perf_kvm_stat {
 	struct kvm_events_ops *events_ops;
 	key_cmp_fun compare;
 	struct list_head kvm_events_cache[EVENTS_CACHE_SIZE];
+	/* indexed by kvm_event->idx */
+	struct kvm_event **events;
+	int nr_events;
+	struct list_head vcpu_records;
 
 	u64 total_time;
 	u64 total_count;
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <inttypes.h>
+#include <string.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include "latency-hist.h"
+
+void latency_hist__init(struct latency_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
+
+static unsigned int latency_hist__index(u64 value)
+{
+	unsigned int shift;
+
+	if (value < LATENCY_HIST_SUB)
+		return value;
+
+	/* the leading one, above the ones picking the sub bucket */
+	shift = fls64(value) - 1 - LATENCY_HIST_SUB_BITS;
+	if (shift >= LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS)
+		return LATENCY_HIST_BUCKETS - 1;
+
+	return (shift + 1) * LATENCY_HIST_SUB +
+	       ((value >> shift) & (LATENCY_HIST_SUB - 1));
+}
+
+/* The lowest value going to bucket idx, the next one starts at its upper */
+static u64 latency_hist__lower(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < LATENCY_HIST_SUB)
+		return idx;
+
+	shift = idx / LATENCY_HIST_SUB - 1;
+	return (u64)(LATENCY_HIST_SUB + idx % LATENCY_HIST_SUB) << shift;
+}
+
+static u64 latency_hist__upper(unsigned int idx)
+{
+	if (idx == LATENCY_HIST_BUCKETS - 1)
+		return ULLONG_MAX;
+	return latency_hist__lower(idx + 1);
+}
+
+void latency_hist__add_n(struct latency_hist *hist, u64 value, u32 n)
+{
+	hist->buckets[latency_hist__index(value)] += n;
+	hist->count += n;
+}
+
+u64 latency_hist__percentile(struct latency_hist *hist, double pct)
+{
+	u64 rank, seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (u64)(hist->count * pct / 100.0 + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+
+	if (i >= LATENCY_HIST_BUCKETS - 1)
+		return latency_hist__lower(LATENCY_HIST_BUCKETS - 1);
+
+	/* the middle of the bucket, the values in it are not known */
+	return (latency_hist__lower(i) + latency_hist__upper(i) - 1) / 2;
+}
+
+size_t latency_hist__fprintf_csv(struct latency_hist *hist, const char *prefix,
+				 FILE *fp)
+{
+	size_t printed = 0;
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		if (hist->buckets[i] == 0)
+			continue;
+		printed += fprintf(fp, "%s%" PRIu64 ",%" PRIu64 ",%u\n", prefix,
+				   latency_hist__lower(i), latency_hist__upper(i),
+				   hist->buckets[i]);
+	}
+
+	return printed;
+}
+
+void latency_hist__log2(struct latency_hist *hist, u64 *log2, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+		u64 lower = latency_hist__lower(i);
+		unsigned int bit = lower ? fls64(lower) - 1 : 0;
+
+		if (hist->buckets[i] == 0)
+			continue;
+		log2[bit < nr ? bit : nr - 1] += hist->buckets[i];
+	}
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_LATENCY_HIST_H
+#define __PERF_LATENCY_HIST_H
+
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * A log-linear histogram of latencies in nsecs, HDR histogram like: the
+ * values below 2^LATENCY_HIST_SUB_BITS have a bucket each, every power of
+ * two above is split in 2^LATENCY_HIST_SUB_BITS buckets, so the error of
+ * the percentiles is at most 1/2^LATENCY_HIST_SUB_BITS of the value, up to
+ * 2^LATENCY_HIST_MAX_BITS nsecs, the longer ones go to the last bucket.
+ *
+ * It is fixed size, adding a value doesn't allocate.
+ */
+#define LATENCY_HIST_SUB_BITS	4
+#define LATENCY_HIST_SUB	(1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_BITS	40	/* ~18 minutes */
+#define LATENCY_HIST_BUCKETS	((LATENCY_HIST_MAX_BITS - LATENCY_HIST_SUB_BITS + 1) * \
+				 LATENCY_HIST_SUB)
+
+struct latency_hist {
+	u64	count;
+	u32	buckets[LATENCY_HIST_BUCKETS];
+};
+
+void latency_hist__init(struct latency_hist *hist);
+void latency_hist__add_n(struct latency_hist *hist, u64 value, u32 n);
+
+static inline void latency_hist__add(struct latency_hist *hist, u64 value)
+{
+	latency_hist__add_n(hist, value, 1);
+}
+
+/* The value at pct percent, 0 <= pct <= 100, of what was added */
+u64 latency_hist__percentile(struct latency_hist *hist, double pct);
+/* A "lower,upper,count" line, in nsecs, for each bucket not empty */
+size_t latency_hist__fprintf_csv(struct latency_hist *hist, const char *prefix,
+				 FILE *fp);
+/*
+ * Add the counts per power of two to log2, at i those in [2^i, 2^(i+1)),
+ * the zeros at 0 too and the longer ones at nr - 1, for a coarser view.
+ */
+void latency_hist__log2(struct latency_hist *hist, u64 *log2, unsigned int nr);
+
+#endif /* __PERF_LATENCY_HIST_H */
@@ -5,10 +5,15 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
 #include <linux/err.h>
+#include <api/fs/fs.h>
 #include "debug.h"
 #include "llvm-utils.h"
 #include "config.h"
@@ -32,6 +37,7 @@ struct llvm_param llvm_param = {
 	.opts = NULL,
 	.kbuild_dir = NULL,
 	.kbuild_opts = NULL,
+	.cache = true,
 	.user_set_param = false,
 };
 
@@ -55,6 +61,8 @@ int perf_llvm_config(const char *var, const char *value)
 		llvm_param.dump_obj = !!perf_config_bool(var, value);
 	else if (!strcmp(var, "opts"))
 		llvm_param.opts = strdup(value);
+	else if (!strcmp(var, "cache"))
+		llvm_param.cache = !!perf_config_bool(var, value);
 	else {
 		pr_debug("Invalid LLVM config option: %s\n", value);
 		return -1;
@@ -575,3 +583,198 @@ int llvm__search_clang(void)
 
 	return search_program(llvm_param.clang_path, "clang", clang_path);
 }
+
+/*
+ * The objects compiled from the BPF scripts are kept in
+ * ~/.cache/perf/bpf/<hash>, so that the same script isn't compiled again
+ * on every run:
+ *
+ *   struct llvm_cache_header
+ *   the key, the source, the object
+ *
+ * The key has what the object depends on besides the source: the kernel,
+ * the clang and llc binaries, the options and the template. The whole key
+ * and source are compared, the hash only names the file. The headers the
+ * source includes are not part of it, see llvm.cache.
+ */
+#define LLVM_CACHE_DIR		"/.cache/perf/bpf"
+#define LLVM_CACHE_MAGIC	0x4548434143465042ULL	/* "BPFCACHE" */
+#define LLVM_CACHE_VERSION	1
+
+struct llvm_cache_header {
+	u64	magic;
+	u32	version;
+	u32	key_len;
+	u64	src_len;
+	u64	obj_len;
+};
+
+struct llvm_cache_key {
+	char	*key;
+	char	*src;
+	size_t	src_len;
+	char	filename[PATH_MAX];
+};
+
+static u64 llvm_cache__hash(u64 hash, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+
+	while (size--)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+	return hash;
+}
+
+/* The path, size and time of a program, what changes when it is upgraded */
+static void llvm_cache__program(FILE *fp, const char *def, const char *name)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (search_program(def, name, path) || stat(path, &st)) {
+		fprintf(fp, "%s=\n", name);
+		return;
+	}
+
+	fprintf(fp, "%s=%s %" PRIu64 " %" PRIu64 ".%09" PRIu64 "\n", name, path,
+		(u64)st.st_size, (u64)st.st_mtim.tv_sec, (u64)st.st_mtim.tv_nsec);
+}
+
+static int llvm_cache__key(const char *path, struct llvm_cache_key *k)
+{
+	const char *home = getenv("HOME");
+	unsigned int kernel_version;
+	struct utsname uts;
+	size_t key_len;
+	FILE *fp;
+	u64 hash;
+
+	if (!llvm_param.cache || path[0] == '-' || !home || !*home ||
+	    uname(&uts) < 0)
+		return -ENOENT;
+
+	if (filename__read_str(path, &k->src, &k->src_len))
+		return -errno;
+
+	if (fetch_kernel_version(&kernel_version, NULL, 0))
+		kernel_version = 0;
+
+	fp = open_memstream(&k->key, &key_len);
+	if (fp == NULL) {
+		zfree(&k->src);
+		return -ENOMEM;
+	}
+
+	fprintf(fp, "release=%s\nversion=%#x\nnr_cpus=%d\n",
+		uts.release, kernel_version, llvm__get_nr_cpus());
+	llvm_cache__program(fp, llvm_param.clang_path, "clang");
+	if (llvm_param.opts)
+		llvm_cache__program(fp, llvm_param.llc_path, "llc");
+	fprintf(fp, "template=%s\nclang-opt=%s\nopts=%s\nkbuild-dir=%s\nkbuild-opts=%s\n",
+		llvm_param.clang_bpf_cmd_template ?: "",
+		llvm_param.clang_opt ?: "", llvm_param.opts ?: "",
+		llvm_param.kbuild_dir ?: "", llvm_param.kbuild_opts ?: "");
+
+	if (fclose(fp)) {
+		zfree(&k->key);
+		zfree(&k->src);
+		return -ENOMEM;
+	}
+
+	hash = llvm_cache__hash(0xcbf29ce484222325ULL, k->key, key_len);
+	hash = llvm_cache__hash(hash, k->src, k->src_len);
+	scnprintf(k->filename, sizeof(k->filename), "%s" LLVM_CACHE_DIR "/%016" PRIx64,
+		  home, hash);
+	return 0;
+}
+
+static void llvm_cache__key_exit(struct llvm_cache_key *k)
+{
+	zfree(&k->key);
+	zfree(&k->src);
+}
+
+int llvm__cache_lookup(const char *path, void **p_obj_buf, size_t *p_obj_buf_sz)
+{
+	struct llvm_cache_key k = { .key = NULL, };
+	struct llvm_cache_header *hdr;
+	size_t size, key_len;
+	char *buf = NULL;
+	void *obj = NULL;
+	int err;
+
+	err = llvm_cache__key(path, &k);
+	if (err)
+		return err;
+
+	err = -ENOENT;
+	if (filename__read_str(k.filename, &buf, &size) || size < sizeof(*hdr))
+		goto out;
+
+	hdr = (void *)buf;
+	key_len = strlen(k.key);
+	if (hdr->magic != LLVM_CACHE_MAGIC || hdr->version != LLVM_CACHE_VERSION ||
+	    hdr->key_len != key_len || hdr->src_len != k.src_len ||
+	    size != sizeof(*hdr) + key_len + k.src_len + hdr->obj_len)
+		goto out;
+
+	if (memcmp(buf + sizeof(*hdr), k.key, key_len) ||
+	    memcmp(buf + sizeof(*hdr) + key_len, k.src, k.src_len))
+		goto out;
+
+	obj = malloc(hdr->obj_len);
+	if (obj == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+	memcpy(obj, buf + size - hdr->obj_len, hdr->obj_len);
+
+	pr_debug("llvm: %s compiled before, in %s\n", path, k.filename);
+	*p_obj_buf    = obj;
+	*p_obj_buf_sz = hdr->obj_len;
+	err = 0;
+out:
+	free(buf);
+	llvm_cache__key_exit(&k);
+	return err;
+}
+
+void llvm__cache_store(const char *path, void *obj_buf, size_t obj_buf_sz)
+{
+	struct llvm_cache_key k = { .key = NULL, };
+	struct llvm_cache_header hdr = {
+		.magic	 = LLVM_CACHE_MAGIC,
+		.version = LLVM_CACHE_VERSION,
+		.obj_len = obj_buf_sz,
+	};
+	char dir[PATH_MAX], tmpname[PATH_MAX];
+	int fd;
+
+	if (llvm_cache__key(path, &k))
+		return;
+
+	hdr.key_len = strlen(k.key);
+	hdr.src_len = k.src_len;
+
+	scnprintf(dir, sizeof(dir), "%s" LLVM_CACHE_DIR, getenv("HOME"));
+	if (mkdir_p(dir, 0755))
+		goto out;
+
+	/* readers see the old one or the whole new one */
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", k.filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto out;
+
+	if (writen(fd, &hdr, sizeof(hdr)) < 0 ||
+	    writen(fd, k.key, hdr.key_len) < 0 ||
+	    writen(fd, k.src, k.src_len) < 0 ||
+	    writen(fd, obj_buf, obj_buf_sz) < 0 ||
+	    close(fd) || rename(tmpname, k.filename)) {
+		pr_debug("llvm: failed to cache the object of %s\n", path);
+		unlink(tmpname);
+	}
+out:
+	llvm_cache__key_exit(&k);
+}
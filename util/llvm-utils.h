@@ -44,6 +44,11 @@ struct llvm_param {
 	 * to object file.
 	 */
 	bool dump_obj;
+	/*
+	 * Default is true. Keep the objects in ~/.cache/perf/bpf, not
+	 * compiling the same source with the same options and kernel again.
+	 */
+	bool cache;
 	/*
 	 * Default is false. If one of the above fields is set by user
 	 * explicitly then user_set_llvm is set to true. This is used
@@ -66,4 +71,7 @@ void llvm__get_kbuild_opts(char **kbuild_dir, char **kbuild_include_opts);
 int llvm__get_nr_cpus(void);
 
 void llvm__dump_obj(const char *path, void *obj_buf, size_t size);
+
+int llvm__cache_lookup(const char *path, void **p_obj_buf, size_t *p_obj_buf_sz);
+void llvm__cache_store(const char *path, void *obj_buf, size_t obj_buf_sz);
 #endif
@@ -14,15 +14,19 @@
 #include "sort.h"
 #include "strlist.h"
 #include "thread.h"
+#include "thread-stack.h"
 #include "vdso.h"
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "unwind.h"
+#include "unwind-pipeline.h"
 #include "linux/hash.h"
 #include "asm/bug.h"
 #include "bpf-event.h"
+#include "stage-time.h"
+#include "cgroup.h"
 
 #include "sane_ctype.h"
 #include <symbol/kallsyms.h>
@@ -34,9 +38,20 @@ static void dsos__init(struct dsos *dsos)
 {
 	INIT_LIST_HEAD(&dsos->head);
 	dsos->root = RB_ROOT;
+	dsos->name_hash = dsos->id_hash = NULL;
+	dsos->hash_bits = 0;
+	dsos->nr = 0;
 	init_rwsem(&dsos->lock);
 }
 
+/* Never reused, so that a last match can't be taken for another table's */
+static unsigned long threads__gen;
+
+static unsigned long threads__new_gen(void)
+{
+	return __sync_add_and_fetch(&threads__gen, 1);
+}
+
 static void machine__threads_init(struct machine *machine)
 {
 	int i;
@@ -47,7 +62,9 @@ static void machine__threads_init(struct machine *machine)
 		init_rwsem(&threads->lock);
 		threads->nr = 0;
 		INIT_LIST_HEAD(&threads->dead);
-		threads->last_match = NULL;
+		threads->hash = NULL;
+		threads->hash_bits = 0;
+		threads->gen = threads__new_gen();
 	}
 }
 
@@ -160,10 +177,18 @@ static void dsos__purge(struct dsos *dsos)
 	list_for_each_entry_safe(pos, n, &dsos->head, node) {
 		RB_CLEAR_NODE(&pos->rb_node);
 		pos->root = NULL;
+		INIT_HLIST_NODE(&pos->name_node);
+		INIT_HLIST_NODE(&pos->id_node);
+		pos->id.ino = 0;
 		list_del_init(&pos->node);
 		dso__put(pos);
 	}
 
+	zfree(&dsos->name_hash);
+	zfree(&dsos->id_hash);
+	dsos->hash_bits = 0;
+	dsos->nr = 0;
+
 	up_write(&dsos->lock);
 }
 
@@ -210,6 +235,7 @@ void machine__exit(struct machine *machine)
 	for (i = 0; i < THREADS__TABLE_SIZE; i++) {
 		struct threads *threads = &machine->threads[i];
 		exit_rwsem(&threads->lock);
+		zfree(&threads->hash);
 	}
 }
 
@@ -366,12 +392,17 @@ void machines__set_id_hdr_size(struct machines *machines, u16 id_hdr_size)
 	return;
 }
 
+static bool thread__needs_pid(struct thread *th, pid_t pid)
+{
+	return pid != th->pid_ && pid != -1 && th->pid_ == -1;
+}
+
 static void machine__update_thread_pid(struct machine *machine,
 				       struct thread *th, pid_t pid)
 {
 	struct thread *leader;
 
-	if (pid == th->pid_ || pid == -1 || th->pid_ != -1)
+	if (!thread__needs_pid(th, pid))
 		return;
 
 	th->pid_ = pid;
@@ -414,52 +445,128 @@ out_err:
 }
 
 /*
- * Front-end cache - TID lookups come in blocks,
- * so most of the time we dont have to look up
- * the full rbtree:
+ * Front-end cache - TID lookups come in blocks, so most of the time we
+ * don't have to look up the table at all.  It is per thread, so that the
+ * threads processing events in parallel don't fight over it, and only
+ * valid while the generation of the table it was taken from is the same,
+ * which is checked with the table lock held.
  */
+static __thread struct {
+	struct threads	*threads;
+	struct thread	*th;
+	unsigned long	gen;
+} last_match;
+
 static struct thread*
-__threads__get_last_match(struct threads *threads, struct machine *machine,
-			  int pid, int tid)
+threads__get_last_match(struct threads *threads, struct machine *machine,
+			int pid, int tid)
+{
+	struct thread *th = last_match.th;
+
+	if (last_match.threads != threads || last_match.gen != threads->gen ||
+	    th == NULL || th->tid != tid)
+		return NULL;
+
+	machine__update_thread_pid(machine, th, pid);
+	return thread__get(th);
+}
+
+static void
+threads__set_last_match(struct threads *threads, struct thread *th)
+{
+	last_match.threads = threads;
+	last_match.th	   = th;
+	last_match.gen	   = threads->gen;
+}
+
+#define THREADS__HASH_MIN_BITS	4
+
+static struct hlist_head *threads__bucket(struct threads *threads, pid_t tid)
+{
+	return &threads->hash[hash_32((u32)tid, threads->hash_bits)];
+}
+
+static struct thread *threads__find(struct threads *threads, pid_t tid)
 {
+	struct rb_node *n = threads->entries.rb_root.rb_node;
 	struct thread *th;
 
-	th = threads->last_match;
-	if (th != NULL) {
-		if (th->tid == tid) {
-			machine__update_thread_pid(machine, th, pid);
-			return thread__get(th);
+	if (threads->hash) {
+		hlist_for_each_entry(th, threads__bucket(threads, tid), hash_node) {
+			if (th->tid == tid)
+				return th;
 		}
+		return NULL;
+	}
+
+	/* the hash couldn't be allocated */
+	while (n) {
+		th = rb_entry(n, struct thread, rb_node);
 
-		threads->last_match = NULL;
+		if (th->tid == tid)
+			return th;
+
+		n = tid < th->tid ? n->rb_left : n->rb_right;
 	}
 
 	return NULL;
 }
 
-static struct thread*
-threads__get_last_match(struct threads *threads, struct machine *machine,
-			int pid, int tid)
+static void threads__hash_resize(struct threads *threads)
 {
-	struct thread *th = NULL;
+	unsigned int bits = threads->hash ? threads->hash_bits + 1 :
+					    THREADS__HASH_MIN_BITS;
+	struct hlist_head *hash = calloc(1UL << bits, sizeof(*hash));
+	struct rb_node *nd;
 
-	if (perf_singlethreaded)
-		th = __threads__get_last_match(threads, machine, pid, tid);
+	if (hash == NULL)
+		return;
 
-	return th;
+	free(threads->hash);
+	threads->hash = hash;
+	threads->hash_bits = bits;
+
+	for (nd = rb_first_cached(&threads->entries); nd; nd = rb_next(nd)) {
+		struct thread *th = rb_entry(nd, struct thread, rb_node);
+
+		hlist_add_head(&th->hash_node, threads__bucket(threads, th->tid));
+	}
 }
 
-static void
-__threads__set_last_match(struct threads *threads, struct thread *th)
+static void threads__insert(struct threads *threads, struct thread *th)
 {
-	threads->last_match = th;
+	struct rb_node **p = &threads->entries.rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true;
+
+	while (*p != NULL) {
+		parent = *p;
+
+		if (th->tid < rb_entry(parent, struct thread, rb_node)->tid)
+			p = &(*p)->rb_left;
+		else {
+			p = &(*p)->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&th->rb_node, parent, p);
+	rb_insert_color_cached(&th->rb_node, &threads->entries, leftmost);
+	++threads->nr;
+
+	/* the resize rehashes th along with everything else */
+	if (threads->hash == NULL || threads->nr > (2U << threads->hash_bits))
+		threads__hash_resize(threads);
+	else
+		hlist_add_head(&th->hash_node, threads__bucket(threads, th->tid));
 }
 
-static void
-threads__set_last_match(struct threads *threads, struct thread *th)
+static void threads__erase(struct threads *threads, struct thread *th)
 {
-	if (perf_singlethreaded)
-		__threads__set_last_match(threads, th);
+	rb_erase_cached(&th->rb_node, &threads->entries);
+	RB_CLEAR_NODE(&th->rb_node);
+	hlist_del_init(&th->hash_node);
+	--threads->nr;
+	threads->gen = threads__new_gen();
 }
 
 /*
@@ -471,31 +578,17 @@ static struct thread *____machine__findnew_thread(struct machine *machine,
 						  pid_t pid, pid_t tid,
 						  bool create)
 {
-	struct rb_node **p = &threads->entries.rb_root.rb_node;
-	struct rb_node *parent = NULL;
 	struct thread *th;
-	bool leftmost = true;
 
 	th = threads__get_last_match(threads, machine, pid, tid);
 	if (th)
 		return th;
 
-	while (*p != NULL) {
-		parent = *p;
-		th = rb_entry(parent, struct thread, rb_node);
-
-		if (th->tid == tid) {
-			threads__set_last_match(threads, th);
-			machine__update_thread_pid(machine, th, pid);
-			return thread__get(th);
-		}
-
-		if (tid < th->tid)
-			p = &(*p)->rb_left;
-		else {
-			p = &(*p)->rb_right;
-			leftmost = false;
-		}
+	th = threads__find(threads, tid);
+	if (th) {
+		threads__set_last_match(threads, th);
+		machine__update_thread_pid(machine, th, pid);
+		return thread__get(th);
 	}
 
 	if (!create)
@@ -503,8 +596,7 @@ static struct thread *____machine__findnew_thread(struct machine *machine,
 
 	th = thread__new(pid, tid);
 	if (th != NULL) {
-		rb_link_node(&th->rb_node, parent, p);
-		rb_insert_color_cached(&th->rb_node, &threads->entries, leftmost);
+		threads__insert(threads, th);
 
 		/*
 		 * We have to initialize map_groups separately
@@ -515,8 +607,7 @@ static struct thread *____machine__findnew_thread(struct machine *machine,
 		 * leader and that would screwed the rb tree.
 		 */
 		if (thread__init_map_groups(th, machine)) {
-			rb_erase_cached(&th->rb_node, &threads->entries);
-			RB_CLEAR_NODE(&th->rb_node);
+			threads__erase(threads, th);
 			thread__put(th);
 			return NULL;
 		}
@@ -525,7 +616,6 @@ static struct thread *____machine__findnew_thread(struct machine *machine,
 		 */
 		thread__get(th);
 		threads__set_last_match(threads, th);
-		++threads->nr;
 	}
 
 	return th;
@@ -542,6 +632,23 @@ struct thread *machine__findnew_thread(struct machine *machine, pid_t pid,
 	struct threads *threads = machine__threads(machine, tid);
 	struct thread *th;
 
+	/* Most lookups find the thread as it is, don't serialize them */
+	down_read(&threads->lock);
+	th = threads__get_last_match(threads, machine, -1, tid);
+	if (th == NULL) {
+		th = threads__find(threads, tid);
+		if (th) {
+			threads__set_last_match(threads, th);
+			thread__get(th);
+		}
+	}
+	if (th && !thread__needs_pid(th, pid)) {
+		up_read(&threads->lock);
+		return th;
+	}
+	up_read(&threads->lock);
+	thread__put(th);
+
 	down_write(&threads->lock);
 	th = __machine__findnew_thread(machine, pid, tid);
 	up_write(&threads->lock);
@@ -595,6 +702,21 @@ int machine__process_comm_event(struct machine *machine, union perf_event *event
 	return err;
 }
 
+int machine__process_cgroup_event(struct machine *machine,
+				  union perf_event *event,
+				  struct perf_sample *sample __maybe_unused)
+{
+	if (dump_trace)
+		perf_event__fprintf_cgroup(event, stdout);
+
+	/* no names to show for the machines without a perf_env */
+	if (machine->env &&
+	    cgroup__findnew(machine->env, event->cgroup.id, event->cgroup.path) == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
 int machine__process_namespaces_event(struct machine *machine __maybe_unused,
 				      union perf_event *event,
 				      struct perf_sample *sample __maybe_unused)
@@ -1745,15 +1867,10 @@ static void __machine__remove_thread(struct machine *machine, struct thread *th,
 {
 	struct threads *threads = machine__threads(machine, th->tid);
 
-	if (threads->last_match == th)
-		threads__set_last_match(threads, NULL);
-
 	BUG_ON(refcount_read(&th->refcnt) == 0);
 	if (lock)
 		down_write(&threads->lock);
-	rb_erase_cached(&th->rb_node, &threads->entries);
-	RB_CLEAR_NODE(&th->rb_node);
-	--threads->nr;
+	threads__erase(threads, th);
 	/*
 	 * Move it first to the dead_threads list, then drop the reference,
 	 * if this is the last reference, then the thread__delete destructor
@@ -1762,6 +1879,7 @@ static void __machine__remove_thread(struct machine *machine, struct thread *th,
 	list_add_tail(&th->node, &threads->dead);
 	if (lock)
 		up_write(&threads->lock);
+	thread__reclaim(th);
 	thread__put(th);
 }
 
@@ -1848,6 +1966,13 @@ int machine__process_exit_event(struct machine *machine, union perf_event *event
 
 	if (thread != NULL) {
 		thread__exited(thread);
+		/*
+		 * Dead threads can be kept around for long by the references
+		 * to them, nothing is going to be pushed on their stacks and
+		 * only kernel samples come after the exit, so the maps of the
+		 * process go when it is its last thread.
+		 */
+		thread__reclaim(thread);
 		thread__put(thread);
 	}
 
@@ -1887,6 +2012,8 @@ int machine__process_event(struct machine *machine, union perf_event *event,
 		ret = machine__process_ksymbol(machine, event, sample); break;
 	case PERF_RECORD_BPF_EVENT:
 		ret = machine__process_bpf_event(machine, event, sample); break;
+	case PERF_RECORD_CGROUP:
+		ret = machine__process_cgroup_event(machine, event, sample); break;
 	default:
 		ret = -1;
 		break;
@@ -2057,12 +2184,70 @@ static int add_callchain_ip(struct thread *thread,
 				       iter_cycles, branch_from, srcline);
 }
 
+/*
+ * The branch_info arrays of sample__resolve_bstack() are only used while
+ * the sample is processed, a few per thread are kept for the next ones.
+ */
+struct branch_info_buf {
+	struct branch_info_buf	*next;
+	unsigned int		nr;
+	struct branch_info	bi[];
+};
+
+#define BRANCH_INFO_BUFS_MAX	4
+#define BRANCH_INFO_BUF_MIN	32
+
+static __thread struct branch_info_buf *branch_info_bufs;
+static __thread unsigned int nr_branch_info_bufs;
+
+static struct branch_info *branch_info__alloc(unsigned int nr)
+{
+	struct branch_info_buf *buf, **p;
+
+	for (p = &branch_info_bufs; *p; p = &(*p)->next) {
+		buf = *p;
+		if (buf->nr < nr)
+			continue;
+
+		*p = buf->next;
+		nr_branch_info_bufs--;
+		memset(buf->bi, 0, nr * sizeof(buf->bi[0]));
+		return buf->bi;
+	}
+
+	nr = max(nr, (unsigned int) BRANCH_INFO_BUF_MIN);
+	buf = zalloc(sizeof(*buf) + nr * sizeof(buf->bi[0]));
+	if (!buf)
+		return NULL;
+
+	buf->nr = nr;
+	return buf->bi;
+}
+
+void sample__put_bstack(struct branch_info *bi)
+{
+	struct branch_info_buf *buf;
+
+	if (!bi)
+		return;
+
+	buf = (void *) bi - offsetof(struct branch_info_buf, bi);
+	if (nr_branch_info_bufs == BRANCH_INFO_BUFS_MAX) {
+		free(buf);
+		return;
+	}
+
+	buf->next = branch_info_bufs;
+	branch_info_bufs = buf;
+	nr_branch_info_bufs++;
+}
+
 struct branch_info *sample__resolve_bstack(struct perf_sample *sample,
 					   struct addr_location *al)
 {
 	unsigned int i;
 	const struct branch_stack *bs = sample->branch_stack;
-	struct branch_info *bi = calloc(bs->nr, sizeof(struct branch_info));
+	struct branch_info *bi = branch_info__alloc(bs->nr);
 
 	if (!bi)
 		return NULL;
@@ -2465,6 +2650,9 @@ static int thread__resolve_callchain_unwind(struct thread *thread,
 					    struct perf_sample *sample,
 					    int max_stack)
 {
+	u64 start;
+	int ret;
+
 	/* Can we do dwarf post unwind? */
 	if (!((evsel->attr.sample_type & PERF_SAMPLE_REGS_USER) &&
 	      (evsel->attr.sample_type & PERF_SAMPLE_STACK_USER)))
@@ -2475,8 +2663,17 @@ static int thread__resolve_callchain_unwind(struct thread *thread,
 	    (!sample->user_stack.size))
 		return 0;
 
-	return unwind__get_entries(unwind_entry, cursor,
-				   thread, sample, max_stack);
+	/* Already unwound by the session unwind pipeline? */
+	ret = unwind_pipeline__get_entries(unwind_entry, cursor, sample,
+					   max_stack);
+	if (ret != -ENOENT)
+		return ret;
+
+	start = stage_time__start();
+	ret = unwind__get_entries(unwind_entry, cursor,
+				  thread, sample, max_stack);
+	stage_time__end(STAGE_TIME__UNWIND, start);
+	return ret;
 }
 
 int thread__resolve_callchain(struct thread *thread,
@@ -2698,6 +2895,12 @@ struct dso *machine__findnew_dso(struct machine *machine, const char *filename)
 	return dsos__findnew(&machine->dsos, filename);
 }
 
+struct dso *machine__findnew_dso_id(struct machine *machine, const char *filename,
+				    struct dso_id *id)
+{
+	return dsos__findnew_id(&machine->dsos, filename, id);
+}
+
 char *machine__resolve_kernel_addr(void *vmachine, unsigned long long *addrp, char **modp)
 {
 	struct machine *machine = vmachine;
@@ -28,12 +28,19 @@ struct vdso_info;
 #define THREADS__TABLE_BITS	8
 #define THREADS__TABLE_SIZE	(1 << THREADS__TABLE_BITS)
 
+/*
+ * The threads are kept in an rbtree for walking them in tid order and in
+ * a tid hash, that grows with nr, for looking them up.  gen changes when
+ * a thread is removed, invalidating the per thread last match caches.
+ */
 struct threads {
 	struct rb_root_cached  entries;
 	struct rw_semaphore    lock;
 	unsigned int	       nr;
 	struct list_head       dead;
-	struct thread	       *last_match;
+	struct hlist_head      *hash;
+	unsigned int	       hash_bits;
+	unsigned long	       gen;
 };
 
 struct machine {
@@ -126,6 +133,9 @@ int machine__process_switch_event(struct machine *machine,
 int machine__process_namespaces_event(struct machine *machine,
 				      union perf_event *event,
 				      struct perf_sample *sample);
+int machine__process_cgroup_event(struct machine *machine,
+				  union perf_event *event,
+				  struct perf_sample *sample);
 int machine__process_mmap_event(struct machine *machine, union perf_event *event,
 				struct perf_sample *sample);
 int machine__process_mmap2_event(struct machine *machine, union perf_event *event,
@@ -168,6 +178,8 @@ void machine__remove_thread(struct machine *machine, struct thread *th);
 
 struct branch_info *sample__resolve_bstack(struct perf_sample *sample,
 					   struct addr_location *al);
+/* Give back the branch_info of sample__resolve_bstack() */
+void sample__put_bstack(struct branch_info *bi);
 struct mem_info *sample__resolve_mem(struct perf_sample *sample,
 				     struct addr_location *al);
 
@@ -202,6 +214,8 @@ struct thread *__machine__findnew_thread(struct machine *machine, pid_t pid, pid
 struct thread *machine__findnew_thread(struct machine *machine, pid_t pid, pid_t tid);
 
 struct dso *machine__findnew_dso(struct machine *machine, const char *filename);
+struct dso *machine__findnew_dso_id(struct machine *machine, const char *filename,
+				  struct dso_id *id);
 
 size_t machine__fprintf(struct machine *machine, FILE *fp);
 
@@ -15,11 +15,15 @@
 #include "util.h"
 #include "debug.h"
 #include "machine.h"
+#include <linux/compiler.h>
+#include <linux/hash.h>
 #include <linux/string.h>
+#include <asm/barrier.h>
 #include "srcline.h"
 #include "namespaces.h"
 #include "unwind.h"
 #include "srccode.h"
+#include "mem-stats.h"
 
 static void __maps__insert(struct maps *maps, struct map *map);
 static void __maps__insert_name(struct maps *maps, struct map *map);
@@ -139,6 +143,7 @@ void map__init(struct map *map, u64 start, u64 end, u64 pgoff, struct dso *dso)
 	map->groups   = NULL;
 	map->erange_warned = false;
 	refcount_set(&map->refcnt, 1);
+	mem_stats__add(MEM_STAT__MAPS, sizeof(*map), 1);
 }
 
 struct map *map__new(struct machine *machine, u64 start, u64 len,
@@ -152,7 +157,7 @@ struct map *map__new(struct machine *machine, u64 start, u64 len,
 
 	if (map != NULL) {
 		char newfilename[PATH_MAX];
-		struct dso *dso;
+		struct dso *dso, *shared;
 		int anon, no_dso, vdso, android;
 
 		android = is_android_lib(filename);
@@ -192,13 +197,23 @@ struct map *map__new(struct machine *machine, u64 start, u64 len,
 			}
 			pgoff = 0;
 			dso = machine__findnew_vdso(machine, thread);
-		} else
-			dso = machine__findnew_dso(machine, filename);
+		} else {
+			struct dso_id id = {
+				.maj		= d_maj,
+				.min		= d_min,
+				.ino		= ino,
+				.ino_generation	= ino_gen,
+			};
+
+			dso = machine__findnew_dso_id(machine, filename, &id);
+		}
 
 		if (dso == NULL)
 			goto out_delete;
 
-		map__init(map, start, start + len, pgoff, dso);
+		shared = dsos__shared(&machine->dsos, dso);
+		map__init(map, start, start + len, pgoff, shared);
+		dso__put(shared);
 
 		if (anon || no_dso) {
 			map->map_ip = map->unmap_ip = identity__map_ip;
@@ -291,6 +306,7 @@ static void map__exit(struct map *map)
 void map__delete(struct map *map)
 {
 	map__exit(map);
+	mem_stats__sub(MEM_STAT__MAPS, sizeof(*map), 1);
 	free(map);
 }
 
@@ -392,6 +408,7 @@ struct map *map__clone(struct map *from)
 		RB_CLEAR_NODE(&map->rb_node);
 		dso__get(map->dso);
 		map->groups = NULL;
+		mem_stats__add(MEM_STAT__MAPS, sizeof(*map), 1);
 	}
 
 	return map;
@@ -564,6 +581,16 @@ static void maps__init(struct maps *maps)
 	maps->entries = RB_ROOT;
 	maps->names = RB_ROOT;
 	init_rwsem(&maps->lock);
+	maps->ranges = NULL;
+	maps->nr_ranges = 0;
+	maps->stale_finds = 0;
+	maps->gen = 1;
+	maps->ranges_gen = 0;
+}
+
+static void __maps__invalidate_ranges(struct maps *maps)
+{
+	maps->gen++;
 }
 
 void map_groups__init(struct map_groups *mg, struct machine *machine)
@@ -571,14 +598,45 @@ void map_groups__init(struct map_groups *mg, struct machine *machine)
 	maps__init(&mg->maps);
 	mg->machine = machine;
 	refcount_set(&mg->refcnt, 1);
+	mg->sym_cache = NULL;
+	mg->cow = NULL;
+	INIT_LIST_HEAD(&mg->cow_children);
+	INIT_LIST_HEAD(&mg->cow_node);
+}
+
+static int map_groups__unshare(struct map_groups *mg);
+
+/*
+ * Before mg changes, the map_groups sharing its maps get a copy, as does
+ * mg if it is sharing the maps of another.
+ */
+static void map_groups__prepare_write(struct map_groups *mg)
+{
+	struct map_groups *child, *n;
+	int err = map_groups__unshare(mg);
+
+	list_for_each_entry_safe(child, n, &mg->cow_children, cow_node) {
+		if (map_groups__unshare(child))
+			err = -ENOMEM;
+	}
+
+	if (err)
+		pr_debug("problem copying the maps of a forked process\n");
 }
 
 void map_groups__insert(struct map_groups *mg, struct map *map)
 {
+	map_groups__prepare_write(mg);
 	maps__insert(&mg->maps, map);
 	map->groups = mg;
 }
 
+void map_groups__remove(struct map_groups *mg, struct map *map)
+{
+	map_groups__prepare_write(mg);
+	maps__remove(&mg->maps, map);
+}
+
 static void __maps__purge(struct maps *maps)
 {
 	struct rb_root *root = &maps->entries;
@@ -591,6 +649,7 @@ static void __maps__purge(struct maps *maps)
 		rb_erase_init(&pos->rb_node, root);
 		map__put(pos);
 	}
+	__maps__invalidate_ranges(maps);
 }
 
 static void __maps__purge_names(struct maps *maps)
@@ -612,17 +671,27 @@ static void maps__exit(struct maps *maps)
 	down_write(&maps->lock);
 	__maps__purge(maps);
 	__maps__purge_names(maps);
+	zfree(&maps->ranges);
+	maps->nr_ranges = 0;
 	up_write(&maps->lock);
 }
 
-void map_groups__exit(struct map_groups *mg)
+/* Drop the maps of mg, that stays usable, e.g. for its machine */
+void map_groups__purge(struct map_groups *mg)
 {
+	map_groups__exec(mg);
 	maps__exit(&mg->maps);
+	zfree(&mg->sym_cache);
+}
+
+void map_groups__exit(struct map_groups *mg)
+{
+	map_groups__purge(mg);
 }
 
 bool map_groups__empty(struct map_groups *mg)
 {
-	return !maps__first(&mg->maps);
+	return !maps__first(&map_groups__owner(mg)->maps);
 }
 
 struct map_groups *map_groups__new(struct machine *machine)
@@ -662,6 +731,124 @@ struct symbol *map_groups__find_symbol(struct map_groups *mg,
 	return NULL;
 }
 
+#define SYM_CACHE_BITS	8
+#define SYM_CACHE_SIZE	(1 << SYM_CACHE_BITS)
+
+/*
+ * The map and symbol of an address, valid while gen is the maps' gen.
+ * The callchains of a process keep hitting the same return addresses.
+ * The callchains of a map_groups can be resolved by several threads: an
+ * entry is read as a seqlock and written by whoever makes its seq odd,
+ * the others leave it be.
+ */
+struct sym_cache_entry {
+	unsigned int	seq;
+	u64		addr;
+	u64		gen;
+	struct map	*map;
+	struct symbol	*sym;
+};
+
+static struct sym_cache_entry *map_groups__sym_cache(struct map_groups *mg,
+						     u64 addr)
+{
+	struct sym_cache_entry *cache = READ_ONCE(mg->sym_cache);
+
+	if (cache == NULL) {
+		cache = calloc(SYM_CACHE_SIZE, sizeof(*cache));
+		if (cache == NULL)
+			return NULL;
+
+		if (!__sync_bool_compare_and_swap(&mg->sym_cache, NULL, cache)) {
+			free(cache);
+			cache = READ_ONCE(mg->sym_cache);
+		}
+	}
+
+	return &cache[hash_64(addr, SYM_CACHE_BITS)];
+}
+
+static bool sym_cache_entry__find(struct sym_cache_entry *e, u64 addr, u64 gen,
+				  struct map **mapp, struct symbol **symp)
+{
+	unsigned int seq = READ_ONCE(e->seq);
+	struct symbol *sym;
+	struct map *map;
+	bool hit;
+
+	if (seq & 1)
+		return false;
+
+	rmb();
+	hit = e->addr == addr && e->gen == gen;
+	map = e->map;
+	sym = e->sym;
+	rmb();
+
+	if (!hit || READ_ONCE(e->seq) != seq)
+		return false;
+
+	/* Maps may be adjusted in place, see __maps__find() */
+	if (addr < map->start || addr >= map->end)
+		return false;
+
+	*mapp = map;
+	*symp = sym;
+	return true;
+}
+
+static void sym_cache_entry__set(struct sym_cache_entry *e, u64 addr, u64 gen,
+				 struct map *map, struct symbol *sym)
+{
+	unsigned int seq = READ_ONCE(e->seq);
+
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&e->seq, seq, seq + 1))
+		return;
+
+	wmb();
+	e->addr = addr;
+	e->gen	= gen;
+	e->map	= map;
+	e->sym	= sym;
+	wmb();
+	WRITE_ONCE(e->seq, seq + 2);
+}
+
+/*
+ * map_groups__find() and map__find_symbol() of the address the map maps
+ * addr to, with the map loaded first if load, looked up in a direct mapped
+ * cache first.  The maps not found aren't cached, as the kernel maps may
+ * yet be adjusted to cover addr.
+ */
+struct map *map_groups__find_map_symbol(struct map_groups *mg, u64 addr,
+					bool load, struct symbol **symp)
+{
+	struct sym_cache_entry *e;
+	struct map *map;
+	u64 gen;
+
+	mg = map_groups__owner(mg);
+	e = map_groups__sym_cache(mg, addr);
+	/* the maps found are of this gen, or later */
+	gen = READ_ONCE(mg->maps.gen);
+
+	if (e && sym_cache_entry__find(e, addr, gen, &map, symp))
+		return map;
+
+	*symp = NULL;
+	map = map_groups__find(mg, addr);
+	if (map == NULL)
+		return NULL;
+
+	if (load)
+		map__load(map);
+	*symp = map__find_symbol(map, map->map_ip(map, addr));
+
+	if (e)
+		sym_cache_entry__set(e, addr, gen, map, *symp);
+	return map;
+}
+
 static bool map__contains_symbol(struct map *map, struct symbol *sym)
 {
 	u64 ip = map->unmap_ip(map, sym->start);
@@ -703,7 +890,7 @@ struct symbol *map_groups__find_symbol_by_name(struct map_groups *mg,
 					       const char *name,
 					       struct map **mapp)
 {
-	return maps__find_symbol_by_name(&mg->maps, name, mapp);
+	return maps__find_symbol_by_name(&map_groups__owner(mg)->maps, name, mapp);
 }
 
 int map_groups__find_ams(struct addr_map_symbol *ams)
@@ -746,7 +933,7 @@ static size_t maps__fprintf(struct maps *maps, FILE *fp)
 
 size_t map_groups__fprintf(struct map_groups *mg, FILE *fp)
 {
-	return maps__fprintf(&mg->maps, fp);
+	return maps__fprintf(&map_groups__owner(mg)->maps, fp);
 }
 
 static void __map_groups__insert(struct map_groups *mg, struct map *map)
@@ -809,6 +996,7 @@ static int maps__fixup_overlappings(struct maps *maps, struct map *map, FILE *fp
 		}
 
 		rb_erase_init(&pos->rb_node, root);
+		__maps__invalidate_ranges(maps);
 		/*
 		 * Now check if we need to create new maps for areas not
 		 * overlapped by the new map:
@@ -858,11 +1046,76 @@ out:
 int map_groups__fixup_overlappings(struct map_groups *mg, struct map *map,
 				   FILE *fp)
 {
+	map_groups__prepare_write(mg);
 	return maps__fixup_overlappings(&mg->maps, map, fp);
 }
 
 /*
- * XXX This should not really _copy_ te maps, but refcount them.
+ * Share the maps of parent with mg, of a forked process, until either
+ * changes them, so that they aren't copied when the process execs or
+ * exits before mapping anything, as most do.  -EBUSY when mg already
+ * has maps, to be cloned into instead.
+ */
+int map_groups__fork(struct map_groups *mg, struct map_groups *parent)
+{
+	if (mg->cow || maps__first(&mg->maps) || mg == map_groups__owner(parent))
+		return -EBUSY;
+
+	/* the owner, so the maps of a map_groups shared are of one level */
+	mg->cow = map_groups__get(map_groups__owner(parent));
+	list_add(&mg->cow_node, &mg->cow->cow_children);
+	return 0;
+}
+
+static void map_groups__stop_sharing(struct map_groups *mg)
+{
+	list_del_init(&mg->cow_node);
+	map_groups__put(mg->cow);
+	mg->cow = NULL;
+}
+
+/* Copy the maps mg is sharing, before it changes */
+static int map_groups__unshare(struct map_groups *mg)
+{
+	struct maps *maps;
+	struct map *map;
+	int err = 0;
+
+	if (!mg->cow)
+		return 0;
+
+	maps = &mg->cow->maps;
+	down_read(&maps->lock);
+
+	for (map = maps__first(maps); map; map = map__next(map)) {
+		struct map *new = map__clone(map);
+
+		if (new == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		maps__insert(&mg->maps, new);
+		new->groups = mg;
+		map__put(new);
+	}
+
+	up_read(&maps->lock);
+
+	map_groups__stop_sharing(mg);
+	return err;
+}
+
+/* After exec the maps shared since fork are gone, there's no need to copy them */
+void map_groups__exec(struct map_groups *mg)
+{
+	if (mg->cow)
+		map_groups__stop_sharing(mg);
+}
+
+/*
+ * Copy the maps of parent into those of the thread, for a forked process
+ * with maps already, see map_groups__fork().
  */
 int map_groups__clone(struct thread *thread, struct map_groups *parent)
 {
@@ -911,6 +1164,7 @@ static void __maps__insert(struct maps *maps, struct map *map)
 	rb_link_node(&map->rb_node, parent, p);
 	rb_insert_color(&map->rb_node, &maps->entries);
 	map__get(map);
+	__maps__invalidate_ranges(maps);
 }
 
 static void __maps__insert_name(struct maps *maps, struct map *map)
@@ -946,6 +1200,7 @@ static void __maps__remove(struct maps *maps, struct map *map)
 {
 	rb_erase_init(&map->rb_node, &maps->entries);
 	map__put(map);
+	__maps__invalidate_ranges(maps);
 
 	rb_erase_init(&map->rb_node_name, &maps->names);
 	map__put(map);
@@ -958,12 +1213,69 @@ void maps__remove(struct maps *maps, struct map *map)
 	up_write(&maps->lock);
 }
 
-struct map *maps__find(struct maps *maps, u64 ip)
+struct map_range {
+	u64		start;
+	u64		end;
+	struct map	*map;
+};
+
+/* Needs the write lock, as maps__find() readers may be using the ranges */
+static void __maps__build_ranges(struct maps *maps)
+{
+	struct map_range *ranges;
+	struct rb_node *nd;
+	unsigned int nr = 0;
+
+	for (nd = rb_first(&maps->entries); nd; nd = rb_next(nd))
+		nr++;
+
+	ranges = realloc(maps->ranges, (nr ?: 1) * sizeof(*ranges));
+	if (ranges == NULL)
+		return;
+
+	maps->ranges = ranges;
+	maps->nr_ranges = 0;
+	for (nd = rb_first(&maps->entries); nd; nd = rb_next(nd)) {
+		struct map *m = rb_entry(nd, struct map, rb_node);
+
+		ranges[maps->nr_ranges].start = m->start;
+		ranges[maps->nr_ranges].end   = m->end;
+		ranges[maps->nr_ranges].map   = m;
+		maps->nr_ranges++;
+	}
+
+	maps->ranges_gen = maps->gen;
+	maps->stale_finds = 0;
+}
+
+static struct map *__maps__find(struct maps *maps, u64 ip)
 {
 	struct rb_node *p;
 	struct map *m;
 
-	down_read(&maps->lock);
+	if (maps->ranges_gen == maps->gen) {
+		struct map_range *r = maps->ranges;
+		unsigned int nr = maps->nr_ranges;
+
+		/* the last range starting at or before ip */
+		while (nr > 1) {
+			unsigned int half = nr / 2;
+
+			r = ip < r[half].start ? r : r + half;
+			nr -= half;
+		}
+
+		/*
+		 * Maps may be adjusted in place, say by kernel map fixups,
+		 * so a hit is checked on the map itself and a miss is not
+		 * trusted.
+		 */
+		if (nr && ip >= r->start && ip < r->end) {
+			m = r->map;
+			if (ip >= m->start && ip < m->end)
+				return m;
+		}
+	}
 
 	p = maps->entries.rb_node;
 	while (p != NULL) {
@@ -973,11 +1285,35 @@ struct map *maps__find(struct maps *maps, u64 ip)
 		else if (ip >= m->end)
 			p = p->rb_right;
 		else
-			goto out;
+			return m;
 	}
 
-	m = NULL;
-out:
+	return NULL;
+}
+
+struct map *maps__find(struct maps *maps, u64 ip)
+{
+	struct map *m;
+
+	down_read(&maps->lock);
+
+	/*
+	 * Rebuild the ranges once there were about as many lookups since
+	 * the last change as there are maps, so that a burst of mmaps isn't
+	 * followed by a rebuild each.
+	 */
+	if (maps->ranges_gen != maps->gen &&
+	    __sync_add_and_fetch(&maps->stale_finds, 1) > maps->nr_ranges) {
+		up_read(&maps->lock);
+		down_write(&maps->lock);
+		if (maps->ranges_gen != maps->gen)
+			__maps__build_ranges(maps);
+		m = __maps__find(maps, ip);
+		up_write(&maps->lock);
+		return m;
+	}
+
+	m = __maps__find(maps, ip);
 	up_read(&maps->lock);
 	return m;
 }
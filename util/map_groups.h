@@ -4,6 +4,7 @@
 
 #include <linux/refcount.h>
 #include <linux/rbtree.h>
+#include <linux/list.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <linux/types.h>
@@ -14,10 +15,22 @@ struct machine;
 struct map;
 struct thread;
 
+struct map_range;
+
+/*
+ * ranges is a sorted copy of the entries for maps__find() to binary
+ * search, valid while ranges_gen matches gen, which changes with every
+ * insertion or removal.
+ */
 struct maps {
 	struct rb_root      entries;
 	struct rb_root	    names;
 	struct rw_semaphore lock;
+	struct map_range    *ranges;
+	unsigned int	    nr_ranges;
+	unsigned int	    stale_finds;
+	u64		    gen;
+	u64		    ranges_gen;
 };
 
 void maps__insert(struct maps *maps, struct map *map);
@@ -27,10 +40,22 @@ struct map *maps__first(struct maps *maps);
 struct map *map__next(struct map *map);
 struct symbol *maps__find_symbol_by_name(struct maps *maps, const char *name, struct map **mapp);
 
+struct sym_cache_entry;
+
+/*
+ * A forked process shares the maps of its parent, cow, until either adds
+ * or removes a map, see map_groups__fork().  The map_groups sharing the
+ * maps of another are in its cow_children and have no maps of their own.
+ */
 struct map_groups {
 	struct maps	 maps;
 	struct machine	 *machine;
 	refcount_t	 refcnt;
+	/* see map_groups__find_map_symbol(), allocated on first use */
+	struct sym_cache_entry *sym_cache;
+	struct map_groups *cow;
+	struct list_head cow_children;
+	struct list_head cow_node;
 };
 
 #define KMAP_NAME_LEN 256
@@ -52,22 +77,28 @@ static inline struct map_groups *map_groups__get(struct map_groups *mg)
 	return mg;
 }
 
+/* The map_groups with the maps mg uses */
+static inline struct map_groups *map_groups__owner(struct map_groups *mg)
+{
+	return mg->cow ?: mg;
+}
+
 void map_groups__put(struct map_groups *mg);
 void map_groups__init(struct map_groups *mg, struct machine *machine);
 void map_groups__exit(struct map_groups *mg);
+void map_groups__purge(struct map_groups *mg);
 int map_groups__clone(struct thread *thread, struct map_groups *parent);
+int map_groups__fork(struct map_groups *mg, struct map_groups *parent);
+void map_groups__exec(struct map_groups *mg);
 size_t map_groups__fprintf(struct map_groups *mg, FILE *fp);
 
 void map_groups__insert(struct map_groups *mg, struct map *map);
 
-static inline void map_groups__remove(struct map_groups *mg, struct map *map)
-{
-	maps__remove(&mg->maps, map);
-}
+void map_groups__remove(struct map_groups *mg, struct map *map);
 
 static inline struct map *map_groups__find(struct map_groups *mg, u64 addr)
 {
-	return maps__find(&mg->maps, addr);
+	return maps__find(&map_groups__owner(mg)->maps, addr);
 }
 
 struct map *map_groups__first(struct map_groups *mg);
@@ -78,6 +109,8 @@ static inline struct map *map_groups__next(struct map *map)
 }
 
 struct symbol *map_groups__find_symbol(struct map_groups *mg, u64 addr, struct map **mapp);
+struct map *map_groups__find_map_symbol(struct map_groups *mg, u64 addr,
+					bool load, struct symbol **symp);
 struct symbol *map_groups__find_symbol_by_name(struct map_groups *mg, const char *name, struct map **mapp);
 
 struct addr_map_symbol;
@@ -420,6 +420,43 @@ do {				\
 	return err;
 }
 
+/*
+ * Age the counts by 1/8, as perf top entries decay, rounding up so
+ * what isn't hit anymore gets to zero.
+ */
+void c2c_decay_stats(struct c2c_stats *stats)
+{
+#define DECAY(__f) stats->__f -= (stats->__f + 7) / 8
+	DECAY(nr_entries);
+
+	DECAY(locks);
+	DECAY(store);
+	DECAY(st_uncache);
+	DECAY(st_noadrs);
+	DECAY(st_l1hit);
+	DECAY(st_l1miss);
+	DECAY(load);
+	DECAY(ld_excl);
+	DECAY(ld_shared);
+	DECAY(ld_uncache);
+	DECAY(ld_io);
+	DECAY(ld_miss);
+	DECAY(ld_noadrs);
+	DECAY(ld_fbhit);
+	DECAY(ld_l1hit);
+	DECAY(ld_l2hit);
+	DECAY(ld_llchit);
+	DECAY(lcl_hitm);
+	DECAY(rmt_hitm);
+	DECAY(tot_hitm);
+	DECAY(rmt_hit);
+	DECAY(lcl_dram);
+	DECAY(rmt_dram);
+	DECAY(nomap);
+	DECAY(noparse);
+#undef DECAY
+}
+
 void c2c_add_stats(struct c2c_stats *stats, struct c2c_stats *add)
 {
 	stats->nr_entries	+= add->nr_entries;
@@ -71,5 +71,6 @@ struct c2c_stats {
 struct hist_entry;
 int c2c_decode_stats(struct c2c_stats *stats, struct mem_info *mi);
 void c2c_add_stats(struct c2c_stats *stats, struct c2c_stats *add);
+void c2c_decay_stats(struct c2c_stats *stats);
 
 #endif /* __PERF_MEM_EVENTS_H */
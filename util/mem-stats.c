@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <inttypes.h>
+#include <linux/compiler.h>
+#include <subcmd/parse-options.h>
+#include "mem-stats.h"
+#include "debug.h"
+#include "units.h"
+
+bool mem_stats__enabled;
+u64 mem_stats__max_bytes;
+
+static struct mem_stat mem_stats[MEM_STAT__MAX];
+static s64 mem_stats__peak;
+
+static const char * const mem_stat_names[MEM_STAT__MAX] = {
+	[MEM_STAT__HIST_ENTRIES]   = "hist entries",
+	[MEM_STAT__CALLCHAINS]	   = "callchain nodes",
+	[MEM_STAT__ORDERED_EVENTS] = "ordered events",
+	[MEM_STAT__THREADS]	   = "threads",
+	[MEM_STAT__MAPS]	   = "maps",
+	[MEM_STAT__SYMBOLS]	   = "symbols",
+	[MEM_STAT__SRCLINES]	   = "srclines",
+	[MEM_STAT__MEM_INFOS]	   = "mem infos",
+};
+
+void __mem_stats__add(enum mem_stat_id id, s64 bytes, s64 nr)
+{
+	struct mem_stat *stat = &mem_stats[id];
+	s64 now = __sync_add_and_fetch(&stat->bytes, bytes);
+
+	__sync_add_and_fetch(&stat->nr, nr);
+
+	/* the peaks are approximate when racing, which is good enough */
+	if (bytes > 0) {
+		s64 total = mem_stats__total();
+
+		if (now > stat->peak_bytes)
+			stat->peak_bytes = now;
+		if (total > mem_stats__peak)
+			mem_stats__peak = total;
+	}
+}
+
+u64 mem_stats__total(void)
+{
+	s64 total = 0;
+	int i;
+
+	for (i = 0; i < MEM_STAT__MAX; i++)
+		total += mem_stats[i].bytes;
+
+	return total > 0 ? total : 0;
+}
+
+bool mem_stats__over_budget(void)
+{
+	return mem_stats__max_bytes && mem_stats__total() > mem_stats__max_bytes;
+}
+
+/* --max-memory, which needs the accounting */
+int mem_stats__parse_max(const struct option *opt __maybe_unused,
+			 const char *str, int unset __maybe_unused)
+{
+	static struct parse_tag tags_size[] = {
+		{ .tag  = 'B', .mult = 1       },
+		{ .tag  = 'K', .mult = 1 << 10 },
+		{ .tag  = 'M', .mult = 1 << 20 },
+		{ .tag  = 'G', .mult = 1 << 30 },
+		{ .tag  = 0 },
+	};
+	unsigned long val = parse_tag_value(str, tags_size);
+
+	if (val == (unsigned long) -1 || !val) {
+		pr_err("Cannot parse max memory `%s'\n", str);
+		return -1;
+	}
+
+	mem_stats__max_bytes = val;
+	mem_stats__enabled = true;
+	return 0;
+}
+
+size_t mem_stats__fprintf(FILE *fp)
+{
+	size_t ret;
+	int i;
+
+	ret = fprintf(fp, "#\n# Memory usage:\n#\n");
+	ret += fprintf(fp, "# %-20s %14s %14s %14s\n",
+		       "", "objects", "bytes", "peak bytes");
+
+	for (i = MEM_STAT__NONE + 1; i < MEM_STAT__MAX; i++) {
+		ret += fprintf(fp, "# %-20s %14" PRId64 " %14" PRId64 " %14" PRId64 "\n",
+			       mem_stat_names[i], mem_stats[i].nr,
+			       mem_stats[i].bytes, mem_stats[i].peak_bytes);
+	}
+
+	ret += fprintf(fp, "# %-20s %14s %14" PRIu64 " %14" PRId64 "\n",
+		       "total", "", mem_stats__total(), mem_stats__peak);
+	if (mem_stats__max_bytes)
+		ret += fprintf(fp, "# %-20s %14s %14" PRIu64 "\n",
+			       "max memory", "", mem_stats__max_bytes);
+
+	return ret;
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_MEM_STATS_H
+#define __PERF_MEM_STATS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * Bytes and objects held by the structures that grow with the size of the
+ * data file, accounted when --mem-stats or --max-memory are asked for.
+ */
+enum mem_stat_id {
+	MEM_STAT__NONE,
+	MEM_STAT__HIST_ENTRIES,
+	MEM_STAT__CALLCHAINS,
+	MEM_STAT__ORDERED_EVENTS,
+	MEM_STAT__THREADS,
+	MEM_STAT__MAPS,
+	MEM_STAT__SYMBOLS,
+	MEM_STAT__SRCLINES,
+	MEM_STAT__MEM_INFOS,
+	MEM_STAT__MAX,
+};
+
+struct mem_stat {
+	s64	bytes;
+	s64	nr;
+	s64	peak_bytes;
+};
+
+extern bool mem_stats__enabled;
+extern u64 mem_stats__max_bytes;
+
+void __mem_stats__add(enum mem_stat_id id, s64 bytes, s64 nr);
+
+static inline void mem_stats__add(enum mem_stat_id id, s64 bytes, s64 nr)
+{
+	if (mem_stats__enabled && id != MEM_STAT__NONE)
+		__mem_stats__add(id, bytes, nr);
+}
+
+static inline void mem_stats__sub(enum mem_stat_id id, s64 bytes, s64 nr)
+{
+	mem_stats__add(id, -bytes, -nr);
+}
+
+u64 mem_stats__total(void);
+bool mem_stats__over_budget(void);
+struct option;
+int mem_stats__parse_max(const struct option *opt, const char *str, int unset);
+size_t mem_stats__fprintf(FILE *fp);
+
+#endif /* __PERF_MEM_STATS_H */
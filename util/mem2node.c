@@ -1,54 +1,43 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/bitmap.h>
+#include "header.h"
 #include "mem2node.h"
 #include "util.h"
 
 struct phys_entry {
-	struct rb_node	rb_node;
 	u64	start;
 	u64	end;
 	u64	node;
 };
 
-static void phys_entry__insert(struct phys_entry *entry, struct rb_root *root)
-{
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
-	struct phys_entry *e;
-
-	while (*p != NULL) {
-		parent = *p;
-		e = rb_entry(parent, struct phys_entry, rb_node);
-
-		if (entry->start < e->start)
-			p = &(*p)->rb_left;
-		else
-			p = &(*p)->rb_right;
-	}
-
-	rb_link_node(&entry->rb_node, parent, p);
-	rb_insert_color(&entry->rb_node, root);
-}
-
 static void
 phys_entry__init(struct phys_entry *entry, u64 start, u64 bsize, u64 node)
 {
 	entry->start = start;
 	entry->end   = start + bsize;
 	entry->node  = node;
-	RB_CLEAR_NODE(&entry->rb_node);
+}
+
+static int phys_entry__cmp(const void *a, const void *b)
+{
+	const struct phys_entry *ea = a, *eb = b;
+
+	return ea->start < eb->start ? -1 : ea->start > eb->start;
 }
 
 int mem2node__init(struct mem2node *map, struct perf_env *env)
 {
-	struct memory_node *n, *nodes = &env->memory_nodes[0];
+	struct memory_node *n, *nodes;
 	struct phys_entry *entries, *tmp_entries;
-	u64 bsize = env->memory_bsize;
+	u64 bsize;
 	int i, j = 0, max = 0;
 
+	perf_env__read_feat(env, HEADER_MEM_TOPOLOGY);
+	nodes = &env->memory_nodes[0];
+	bsize = env->memory_bsize;
+
 	memset(map, 0x0, sizeof(*map));
-	map->root = RB_ROOT;
 
 	for (i = 0; i < env->nr_memory_nodes; i++) {
 		n = &nodes[i];
@@ -73,8 +62,8 @@ int mem2node__init(struct mem2node *map, struct perf_env *env)
 			start = bit * bsize;
 
 			/*
-			 * Merge nearby areas, we walk in order
-			 * through the bitmap, so no need to sort.
+			 * Merge nearby areas, in order within a node, the
+			 * nodes are sorted below.
 			 */
 			if (j > 0) {
 				struct phys_entry *prev = &entries[j - 1];
@@ -95,14 +84,15 @@ int mem2node__init(struct mem2node *map, struct perf_env *env)
 	if (tmp_entries)
 		entries = tmp_entries;
 
+	qsort(entries, j, sizeof(*entries), phys_entry__cmp);
+
 	for (i = 0; i < j; i++) {
 		pr_debug("mem2node %03" PRIu64 " [0x%016" PRIx64 "-0x%016" PRIx64 "]\n",
 			 entries[i].node, entries[i].start, entries[i].end);
-
-		phys_entry__insert(&entries[i], &map->root);
 	}
 
 	map->entries = entries;
+	map->cnt     = j;
 	return 0;
 }
 
@@ -111,24 +101,31 @@ void mem2node__exit(struct mem2node *map)
 	zfree(&map->entries);
 }
 
+/*
+ * The samples of a workload mostly hit the few ranges of its memory, the
+ * last one found is tried before the binary search.
+ */
 int mem2node__node(struct mem2node *map, u64 addr)
 {
-	struct rb_node **p, *parent = NULL;
-	struct phys_entry *entry;
-
-	p = &map->root.rb_node;
-	while (*p != NULL) {
-		parent = *p;
-		entry = rb_entry(parent, struct phys_entry, rb_node);
-		if (addr < entry->start)
-			p = &(*p)->rb_left;
-		else if (addr >= entry->end)
-			p = &(*p)->rb_right;
-		else
-			goto out;
+	struct phys_entry *entry = &map->entries[map->last];
+	int lo = 0, hi = map->cnt;
+
+	if (map->cnt && addr >= entry->start && addr < entry->end)
+		return (int) entry->node;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		entry = &map->entries[mid];
+		if (addr < entry->start) {
+			hi = mid;
+		} else if (addr >= entry->end) {
+			lo = mid + 1;
+		} else {
+			map->last = mid;
+			return (int) entry->node;
+		}
 	}
 
-	entry = NULL;
-out:
-	return entry ? (int) entry->node : -1;
+	return -1;
 }
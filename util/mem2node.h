@@ -1,15 +1,16 @@
 #ifndef __MEM2NODE_H
 #define __MEM2NODE_H
 
-#include <linux/rbtree.h>
 #include "env.h"
 
 struct phys_entry;
 
+/* The physical address ranges of the nodes, sorted */
 struct mem2node {
-	struct rb_root		 root;
 	struct phys_entry	*entries;
 	int			 cnt;
+	/* the entry of the last lookup */
+	int			 last;
 };
 
 int  mem2node__init(struct mem2node *map, struct perf_env *env);
@@ -124,6 +124,34 @@ static struct perf_evsel *find_evsel(struct perf_evlist *perf_evlist,
 	return NULL;
 }
 
+/*
+ * Compile a metric of the event called name using metric_events, for it
+ * not to be parsed each time it is printed.  The ids of the expression are
+ * name and then the names of metric_events, their values are expected in
+ * that order.
+ */
+struct expr_prog *metricgroup__compile(const char *metric_expr,
+				       const char *name,
+				       struct perf_evsel **metric_events)
+{
+	struct parse_ctx pctx;
+	struct expr_prog *prog;
+	int i;
+
+	expr__ctx_init(&pctx);
+	expr__add_id(&pctx, name, 0);
+	for (i = 0; metric_events[i]; i++) {
+		if (pctx.num_ids == MAX_PARSE_ID)
+			return NULL;
+		expr__add_id(&pctx, metric_events[i]->name, 0);
+	}
+
+	prog = expr__compile(&pctx, &metric_expr);
+	if (prog == NULL)
+		pr_debug("Cannot compile %s, parsing it when printed\n", metric_expr);
+	return prog;
+}
+
 static int metricgroup__setup_events(struct list_head *groups,
 				     struct perf_evlist *perf_evlist,
 				     struct rblist *metric_events_list)
@@ -165,6 +193,9 @@ static int metricgroup__setup_events(struct list_head *groups,
 		expr->metric_expr = eg->metric_expr;
 		expr->metric_name = eg->metric_name;
 		expr->metric_events = metric_events;
+		expr->metric_prog = metricgroup__compile(eg->metric_expr,
+							 evsel->name,
+							 metric_events);
 		list_add(&expr->nd, &me->head);
 	}
 	return ret;
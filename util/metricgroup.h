@@ -7,6 +7,8 @@
 #include "evlist.h"
 #include "strbuf.h"
 
+struct expr_prog;
+
 struct metric_event {
 	struct rb_node nd;
 	struct perf_evsel *evsel;
@@ -18,8 +20,13 @@ struct metric_expr {
 	const char *metric_expr;
 	const char *metric_name;
 	struct perf_evsel **metric_events;
+	struct expr_prog *metric_prog;
 };
 
+struct expr_prog *metricgroup__compile(const char *metric_expr,
+				       const char *name,
+				       struct perf_evsel **metric_events);
+
 struct metric_event *metricgroup__lookup(struct rblist *metric_events,
 					 struct perf_evsel *evsel,
 					 bool create);
@@ -9,7 +9,9 @@
 
 #include <sys/mman.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <asm/bug.h>
+#include <api/fs/fs.h>
 #ifdef HAVE_LIBNUMA_SUPPORT
 #include <numaif.h>
 #endif
@@ -23,6 +25,26 @@ size_t perf_mmap__mmap_len(struct perf_mmap *map)
 	return map->mask + 1 + page_size;
 }
 
+/* Copy the event straddling the end of the ring buffer to map->event_copy */
+static union perf_event *perf_mmap__copy_event(struct perf_mmap *map,
+					       u64 start, size_t size)
+{
+	unsigned char *data = map->base + page_size;
+	unsigned int offset = start;
+	unsigned int len = min(sizeof(union perf_event), size), cpy;
+	void *dst = map->event_copy;
+
+	do {
+		cpy = min(map->mask + 1 - (offset & map->mask), len);
+		memcpy(dst, &data[offset & map->mask], cpy);
+		offset += cpy;
+		dst += cpy;
+		len -= cpy;
+	} while (len);
+
+	return (union perf_event *)map->event_copy;
+}
+
 /* When check_messup is true, 'end' must points to a good entry */
 static union perf_event *perf_mmap__read(struct perf_mmap *map,
 					 u64 *startp, u64 end)
@@ -44,21 +66,8 @@ static union perf_event *perf_mmap__read(struct perf_mmap *map,
 		 * Event straddles the mmap boundary -- header should always
 		 * be inside due to u64 alignment of output.
 		 */
-		if ((*startp & map->mask) + size != ((*startp + size) & map->mask)) {
-			unsigned int offset = *startp;
-			unsigned int len = min(sizeof(*event), size), cpy;
-			void *dst = map->event_copy;
-
-			do {
-				cpy = min(map->mask + 1 - (offset & map->mask), len);
-				memcpy(dst, &data[offset & map->mask], cpy);
-				offset += cpy;
-				dst += cpy;
-				len -= cpy;
-			} while (len);
-
-			event = (union perf_event *)map->event_copy;
-		}
+		if ((*startp & map->mask) + size != ((*startp + size) & map->mask))
+			event = perf_mmap__copy_event(map, *startp, size);
 
 		*startp += size;
 	}
@@ -100,6 +109,97 @@ union perf_event *perf_mmap__read_event(struct perf_mmap *map)
 	return event;
 }
 
+/*
+ * Read the whole events in the ring buffer, up to max bytes of them but
+ * at least one, as a batch of at most two spans: the second starts at
+ * the beginning of the ring buffer once it wraps, with the event
+ * straddling the wrap, if any, copied to map->event_copy.  The head is
+ * read once per batch and the tail is only written, once, by
+ * perf_mmap__consume_batch(), so the spans can be handed as they are to
+ * other threads, until consumed.
+ *
+ * Returns the number of events in the batch.
+ *
+ * Usage:
+ * perf_mmap__read_init()
+ * while (perf_mmap__read_batch(map, &batch, max) > 0) {
+ *	while (event = perf_mmap_batch__next(&batch))
+ *		//process the event
+ *	perf_mmap__consume_batch(map, &batch)
+ * }
+ * perf_mmap__read_done()
+ */
+int perf_mmap__read_batch(struct perf_mmap *map, struct perf_mmap_batch *batch,
+			  size_t max)
+{
+	unsigned char *data = map->base + page_size;
+	u64 start = map->start, span_start = start;
+	int span = 0;
+
+	memset(batch, 0, sizeof(*batch));
+
+	/*
+	 * Check if event was unmapped due to a POLLHUP/POLLERR.
+	 */
+	if (!refcount_read(&map->refcnt))
+		return 0;
+
+	/* non-overwrite doesn't pause the ringbuffer */
+	if (!map->overwrite)
+		map->end = perf_mmap__read_head(map);
+
+	batch->span[0].buf = &data[start & map->mask];
+
+	while (map->end - start >= sizeof(struct perf_event_header)) {
+		union perf_event *event = (union perf_event *)&data[start & map->mask];
+		size_t size = event->header.size;
+
+		if (size < sizeof(event->header) || map->end - start < size)
+			break;
+		if (batch->nr && start + size - map->start > max)
+			break;
+
+		/* the header of the next event, and the start of its sample */
+		__builtin_prefetch(&data[(start + size) & map->mask]);
+
+		if ((start & map->mask) + size > (u64)map->mask + 1) {
+			batch->wrapped = perf_mmap__copy_event(map, start, size);
+			batch->span[0].len = start - span_start;
+			start += size;
+			span_start = start;
+			span = 1;
+			batch->span[1].buf = &data[start & map->mask];
+		} else {
+			start += size;
+			if (!span && !(start & map->mask)) {
+				batch->span[0].len = start - span_start;
+				span_start = start;
+				span = 1;
+				batch->span[1].buf = data;
+			}
+		}
+		batch->nr++;
+	}
+
+	batch->span[span].len = start - span_start;
+	batch->end = start;
+	map->start = start;
+
+	return batch->nr;
+}
+
+/*
+ * Hand the events of the batch back to the kernel, with a single write
+ * of the tail, the events and spans of the batch can't be used after it.
+ */
+void perf_mmap__consume_batch(struct perf_mmap *map, struct perf_mmap_batch *batch)
+{
+	if (!map->overwrite)
+		map->prev = batch->end;
+
+	perf_mmap__consume(map);
+}
+
 static bool perf_mmap__empty(struct perf_mmap *map)
 {
 	return perf_mmap__read_head(map) == map->prev && !map->auxtrace_mmap.base;
@@ -156,17 +256,174 @@ void __weak auxtrace_mmap_params__set_idx(struct auxtrace_mmap_params *mp __mayb
 {
 }
 
+static size_t perf_mmap__huge_page_size(void)
+{
+	static unsigned long long size;
+
+	if (!size && sysfs__read_ull("kernel/mm/transparent_hugepage/hpage_pmd_size", &size))
+		size = 2UL << 20;
+
+	return size;
+}
+
+/* Put the huge staging buffers on the node of the CPU of the map */
+static void perf_mmap__bind_buf(struct perf_mmap *map __maybe_unused, void *buf __maybe_unused)
+{
+#ifdef HAVE_LIBNUMA_SUPPORT
+	unsigned long node_mask;
+	int node;
+
+	if (cpu__max_node() <= 1 || map->cpu < 0)
+		return;
+
+	node = cpu__get_node(map->cpu);
+	if (node < 0 || node >= (int)(sizeof(node_mask) * 8))
+		return;
+
+	node_mask = 1UL << node;
+	if (mbind(buf, map->buf_len, MPOL_BIND, &node_mask, cpu__max_node() + 1, 0))
+		pr_debug("Failed to bind [%p-%p] staging buffer to node %d: error %m\n",
+			 buf, buf + map->buf_len, node);
+#endif
+}
+
+/*
+ * A staging buffer of map->buf_len bytes, to copy or compress the ring
+ * buffer to.  With map->huge, backed by hugetlb pages, or THP when none
+ * are reserved, so that copying the ring buffer doesn't miss the TLB
+ * every page.
+ */
+static void *perf_mmap__alloc_buf(struct perf_mmap *map)
+{
+	void *buf;
+
+	if (map->huge == PERF_MMAP_HUGE_HUGETLB) {
+		buf = mmap(NULL, map->buf_len, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (buf != MAP_FAILED)
+			goto out_bind;
+
+		pr_debug("No hugetlb pages for the staging buffers of cpu %d, using THP\n",
+			 map->cpu);
+		map->huge = PERF_MMAP_HUGE_THP;
+	}
+
+	buf = mmap(NULL, map->buf_len, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	if (map->huge == PERF_MMAP_HUGE_NONE)
+		return buf;
+
+	if (madvise(buf, map->buf_len, MADV_HUGEPAGE))
+		pr_debug2("Failed to use THP for the staging buffers of cpu %d: %m\n", map->cpu);
+out_bind:
+	perf_mmap__bind_buf(map, buf);
+	return buf;
+}
+
+static void perf_mmap__free_buf(struct perf_mmap *map, void *buf)
+{
+	munmap(buf, map->buf_len);
+}
+
+struct huge_buf {
+	unsigned long	start;
+	size_t		len;
+};
+
+static int huge_buf__cmp(const void *a, const void *b)
+{
+	const struct huge_buf *ba = a, *bb = b;
+
+	if (ba->start < bb->start)
+		return -1;
+	return ba->start > bb->start;
+}
+
+int perf_mmap__huge_stats(struct perf_mmap *maps, int nr, u64 *total, u64 *huge)
+{
+	struct huge_buf *bufs;
+	unsigned long start = 0, end = 0;
+	int i, j, nr_bufs = 0, max_bufs = 0;
+	char line[BUFSIZ];
+	FILE *fp;
+
+	*total = *huge = 0;
+
+	for (i = 0; i < nr; i++) {
+		max_bufs += 1;
+#ifdef HAVE_AIO_SUPPORT
+		max_bufs += maps[i].aio.nr_cblocks;
+#endif
+	}
+
+	bufs = calloc(max_bufs ?: 1, sizeof(*bufs));
+	if (bufs == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		struct perf_mmap *map = &maps[i];
+
+		if (map->data)
+			bufs[nr_bufs++] = (struct huge_buf){ (unsigned long)map->data, map->buf_len };
+#ifdef HAVE_AIO_SUPPORT
+		for (j = 0; map->aio.data && j < map->aio.nr_cblocks; j++) {
+			if (map->aio.data[j])
+				bufs[nr_bufs++] = (struct huge_buf){
+					(unsigned long)map->aio.data[j], map->buf_len };
+		}
+#endif
+	}
+
+	for (i = 0; i < nr_bufs; i++)
+		*total += bufs[i].len;
+
+	qsort(bufs, nr_bufs, sizeof(*bufs), huge_buf__cmp);
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL) {
+		free(bufs);
+		return -errno;
+	}
+
+	/* the staging buffers next to each other may be in the same mapping */
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned long long kb;
+		u64 in_vma = 0;
+
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			continue;
+
+		if (sscanf(line, "AnonHugePages: %llu kB", &kb) != 1 &&
+		    sscanf(line, "Private_Hugetlb: %llu kB", &kb) != 1)
+			continue;
+
+		if (kb == 0)
+			continue;
+
+		for (j = 0; j < nr_bufs && bufs[j].start < end; j++) {
+			if (bufs[j].start >= start)
+				in_vma += bufs[j].len;
+		}
+
+		*huge += min(in_vma, (u64)kb * 1024);
+	}
+
+	fclose(fp);
+	free(bufs);
+	return 0;
+}
+
 #ifdef HAVE_AIO_SUPPORT
 
 #ifdef HAVE_LIBNUMA_SUPPORT
 static int perf_mmap__aio_alloc(struct perf_mmap *map, int idx)
 {
-	map->aio.data[idx] = mmap(NULL, perf_mmap__mmap_len(map), PROT_READ|PROT_WRITE,
-				  MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-	if (map->aio.data[idx] == MAP_FAILED) {
-		map->aio.data[idx] = NULL;
+	map->aio.data[idx] = perf_mmap__alloc_buf(map);
+	if (map->aio.data[idx] == NULL)
 		return -1;
-	}
 
 	return 0;
 }
@@ -174,7 +431,7 @@ static int perf_mmap__aio_alloc(struct perf_mmap *map, int idx)
 static void perf_mmap__aio_free(struct perf_mmap *map, int idx)
 {
 	if (map->aio.data[idx]) {
-		munmap(map->aio.data[idx], perf_mmap__mmap_len(map));
+		perf_mmap__free_buf(map, map->aio.data[idx]);
 		map->aio.data[idx] = NULL;
 	}
 }
@@ -185,7 +442,8 @@ static int perf_mmap__aio_bind(struct perf_mmap *map, int idx, int cpu, int affi
 	size_t mmap_len;
 	unsigned long node_mask;
 
-	if (affinity != PERF_AFFINITY_SYS && cpu__max_node() > 1) {
+	/* the huge ones are already */
+	if (affinity != PERF_AFFINITY_SYS && !map->huge && cpu__max_node() > 1) {
 		data = map->aio.data[idx];
 		mmap_len = perf_mmap__mmap_len(map);
 		node_mask = 1UL << cpu__get_node(cpu);
@@ -201,7 +459,10 @@ static int perf_mmap__aio_bind(struct perf_mmap *map, int idx, int cpu, int affi
 #else
 static int perf_mmap__aio_alloc(struct perf_mmap *map, int idx)
 {
-	map->aio.data[idx] = malloc(perf_mmap__mmap_len(map));
+	if (map->huge)
+		map->aio.data[idx] = perf_mmap__alloc_buf(map);
+	else
+		map->aio.data[idx] = malloc(perf_mmap__mmap_len(map));
 	if (map->aio.data[idx] == NULL)
 		return -1;
 
@@ -210,6 +471,10 @@ static int perf_mmap__aio_alloc(struct perf_mmap *map, int idx)
 
 static void perf_mmap__aio_free(struct perf_mmap *map, int idx)
 {
+	if (map->huge && map->aio.data[idx]) {
+		perf_mmap__free_buf(map, map->aio.data[idx]);
+		map->aio.data[idx] = NULL;
+	}
 	zfree(&(map->aio.data[idx]));
 }
 
@@ -287,11 +552,15 @@ static void perf_mmap__aio_munmap(struct perf_mmap *map)
 }
 
 int perf_mmap__aio_push(struct perf_mmap *md, void *to, int idx,
-			int push(void *to, struct aiocb *cblock, void *buf, size_t size, off_t off),
+			size_t copy(struct perf_mmap *map, void *to, void *dst, size_t dst_size,
+				    void *src, size_t src_size),
+			int push(struct perf_mmap *map, void *to, struct aiocb *cblock,
+				 void *buf, size_t size, off_t off),
 			off_t *off)
 {
 	u64 head = perf_mmap__read_head(md);
 	unsigned char *data = md->base + page_size;
+	size_t mmap_len = perf_mmap__mmap_len(md);
 	unsigned long size, size0 = 0;
 	void *buf;
 	int rc = 0;
@@ -300,6 +569,34 @@ int perf_mmap__aio_push(struct perf_mmap *md, void *to, int idx,
 	if (rc < 0)
 		return (rc == -EAGAIN) ? 0 : -1;
 
+	size = md->end - md->start;
+
+	/*
+	 * Without copy() the data is written right from the kernel buffer,
+	 * so its space is released only when the write is complete, see
+	 * perf_mmap__aio_consume_inplace(). A chunk that crosses the upper
+	 * bound of the kernel buffer is written till the bound, the
+	 * reminder goes with the next push.
+	 */
+	if (!copy) {
+		buf = &data[md->start & md->mask];
+		if ((md->start & md->mask) + size != (md->end & md->mask))
+			size = md->mask + 1 - (md->start & md->mask);
+
+		perf_mmap__get(md);
+
+		rc = push(md, to, &md->aio.cblocks[idx], buf, size, *off);
+		if (!rc) {
+			*off += size;
+			md->aio.inplace = true;
+			md->aio.inplace_end = md->start + size;
+		} else {
+			perf_mmap__put(md);
+		}
+
+		return rc;
+	}
+
 	/*
 	 * md->base data is copied into md->data[idx] buffer to
 	 * release space in the kernel buffer as fast as possible,
@@ -315,22 +612,22 @@ int perf_mmap__aio_push(struct perf_mmap *md, void *to, int idx,
 	 * till the upper bound and then the reminder from the
 	 * beginning of the kernel buffer till the end of
 	 * the data chunk.
+	 *
+	 * The copy() callback may transform the data on the way,
+	 * e.g. compress it, so it returns the size it has stored.
 	 */
 
-	size = md->end - md->start;
-
 	if ((md->start & md->mask) + size != (md->end & md->mask)) {
 		buf = &data[md->start & md->mask];
 		size = md->mask + 1 - (md->start & md->mask);
 		md->start += size;
-		memcpy(md->aio.data[idx], buf, size);
-		size0 = size;
+		size0 = copy(md, to, md->aio.data[idx], mmap_len, buf, size);
 	}
 
 	buf = &data[md->start & md->mask];
 	size = md->end - md->start;
 	md->start += size;
-	memcpy(md->aio.data[idx] + size0, buf, size);
+	size = copy(md, to, md->aio.data[idx] + size0, mmap_len - size0, buf, size);
 
 	/*
 	 * Increment md->refcount to guard md->data[idx] buffer
@@ -346,7 +643,7 @@ int perf_mmap__aio_push(struct perf_mmap *md, void *to, int idx,
 	md->prev = head;
 	perf_mmap__consume(md);
 
-	rc = push(to, &md->aio.cblocks[idx], md->aio.data[idx], size0 + size, *off);
+	rc = push(md, to, &md->aio.cblocks[idx], md->aio.data[idx], size0 + size, *off);
 	if (!rc) {
 		*off += size0 + size;
 	} else {
@@ -359,6 +656,16 @@ int perf_mmap__aio_push(struct perf_mmap *md, void *to, int idx,
 
 	return rc;
 }
+
+void perf_mmap__aio_consume_inplace(struct perf_mmap *md)
+{
+	if (!md->aio.inplace)
+		return;
+
+	md->aio.inplace = false;
+	md->prev = md->aio.inplace_end;
+	perf_mmap__consume(md);
+}
 #else
 static int perf_mmap__aio_mmap(struct perf_mmap *map __maybe_unused,
 			       struct mmap_params *mp __maybe_unused)
@@ -374,6 +681,10 @@ static void perf_mmap__aio_munmap(struct perf_mmap *map __maybe_unused)
 void perf_mmap__munmap(struct perf_mmap *map)
 {
 	perf_mmap__aio_munmap(map);
+	if (map->data != NULL) {
+		perf_mmap__free_buf(map, map->data);
+		map->data = NULL;
+	}
 	if (map->base != NULL) {
 		munmap(map->base, perf_mmap__mmap_len(map));
 		map->base = NULL;
@@ -437,9 +748,29 @@ int perf_mmap__mmap(struct perf_mmap *map, struct mmap_params *mp, int fd, int c
 	}
 	map->fd = fd;
 	map->cpu = cpu;
+	map->flush = mp->flush;
 
 	perf_mmap__setup_affinity_mask(map, mp);
 
+	map->huge = mp->huge;
+	map->buf_len = perf_mmap__mmap_len(map);
+	if (map->huge)
+		map->buf_len = roundup(map->buf_len, perf_mmap__huge_page_size());
+
+	/*
+	 * Compressed records are staged in a private buffer as big
+	 * as the ring buffer before they are written out.
+	 */
+	map->comp_level = mp->comp_level;
+	if (map->comp_level && !mp->nr_cblocks) {
+		map->data = perf_mmap__alloc_buf(map);
+		if (map->data == NULL) {
+			pr_debug2("failed to mmap data buffer, error %d\n",
+				  errno);
+			return -1;
+		}
+	}
+
 	if (auxtrace_mmap__mmap(&map->auxtrace_mmap,
 				&mp->auxtrace_mp, map->base, fd))
 		return -1;
@@ -496,6 +827,10 @@ static int __perf_mmap__read_init(struct perf_mmap *md)
 		return -EAGAIN;
 
 	size = md->end - md->start;
+	/* leave it for a bigger write */
+	if (!md->overwrite && size < (unsigned long)md->flush)
+		return -EAGAIN;
+
 	if (size > (unsigned long)(md->mask) + 1) {
 		if (!md->overwrite) {
 			WARN_ONCE(1, "failed to keep up with mmap data. (warn only once)\n");
@@ -36,9 +36,18 @@ struct perf_mmap {
 		struct aiocb	 *cblocks;
 		struct aiocb	 **aiocb;
 		int		 nr_cblocks;
+		bool		 inplace;
+		u64		 inplace_end;
 	} aio;
 #endif
 	cpu_set_t	affinity_mask;
+	void		*data;
+	int		comp_level;
+	/* how the staging buffers, data and aio.data, are backed and their size */
+	int		huge;
+	size_t		buf_len;
+	/* bytes to let accumulate before reading, see perf_mmap__read_init() */
+	int		flush;
 };
 
 /*
@@ -69,14 +78,26 @@ enum bkw_mmap_state {
 	BKW_MMAP_EMPTY,
 };
 
+enum perf_mmap_huge {
+	PERF_MMAP_HUGE_NONE = 0,
+	PERF_MMAP_HUGE_THP,
+	PERF_MMAP_HUGE_HUGETLB,
+};
+
 struct mmap_params {
-	int			    prot, mask, nr_cblocks, affinity;
+	int			    prot, mask, nr_cblocks, affinity, comp_level, flush, huge;
 	struct auxtrace_mmap_params auxtrace_mp;
 };
 
 int perf_mmap__mmap(struct perf_mmap *map, struct mmap_params *mp, int fd, int cpu);
 void perf_mmap__munmap(struct perf_mmap *map);
 
+/*
+ * The bytes of the staging buffers of the nr maps, the ones backed by huge
+ * pages in huge, as found in /proc/self/smaps.
+ */
+int perf_mmap__huge_stats(struct perf_mmap *maps, int nr, u64 *total, u64 *huge);
+
 void perf_mmap__get(struct perf_mmap *map);
 void perf_mmap__put(struct perf_mmap *map);
 
@@ -96,19 +117,74 @@ union perf_event *perf_mmap__read_forward(struct perf_mmap *map);
 
 union perf_event *perf_mmap__read_event(struct perf_mmap *map);
 
+/**
+ * struct perf_mmap_batch - whole events read at once from a ring buffer
+ *
+ * @span - the events in place, the second after the ring buffer wraps
+ * @wrapped - the event straddling the wrap, in between, in map->event_copy
+ * @end - where the tail goes when the batch is consumed
+ * @nr - the number of events
+ * @idx, @pos - where perf_mmap_batch__next() is
+ */
+struct perf_mmap_batch {
+	struct {
+		void	 *buf;
+		size_t	 len;
+	} span[2];
+	union perf_event *wrapped;
+	u64		 end;
+	unsigned int	 nr;
+	int		 idx;
+	size_t		 pos;
+};
+
+int perf_mmap__read_batch(struct perf_mmap *map, struct perf_mmap_batch *batch,
+			  size_t max);
+void perf_mmap__consume_batch(struct perf_mmap *map, struct perf_mmap_batch *batch);
+
+/* The events of the batch in order, NULL after the last one */
+static inline union perf_event *perf_mmap_batch__next(struct perf_mmap_batch *batch)
+{
+	union perf_event *event;
+
+	while (batch->pos >= batch->span[batch->idx].len) {
+		if (batch->idx)
+			return NULL;
+		batch->idx = 1;
+		batch->pos = 0;
+		if (batch->wrapped)
+			return batch->wrapped;
+	}
+
+	event = batch->span[batch->idx].buf + batch->pos;
+	batch->pos += event->header.size;
+	return event;
+}
+
 int perf_mmap__push(struct perf_mmap *md, void *to,
 		    int push(struct perf_mmap *map, void *to, void *buf, size_t size));
 #ifdef HAVE_AIO_SUPPORT
 int perf_mmap__aio_push(struct perf_mmap *md, void *to, int idx,
-			int push(void *to, struct aiocb *cblock, void *buf, size_t size, off_t off),
+			size_t copy(struct perf_mmap *map, void *to, void *dst, size_t dst_size,
+				    void *src, size_t src_size),
+			int push(struct perf_mmap *map, void *to, struct aiocb *cblock,
+				 void *buf, size_t size, off_t off),
 			off_t *off);
+void perf_mmap__aio_consume_inplace(struct perf_mmap *md);
 #else
 static inline int perf_mmap__aio_push(struct perf_mmap *md __maybe_unused, void *to __maybe_unused, int idx __maybe_unused,
-	int push(void *to, struct aiocb *cblock, void *buf, size_t size, off_t off) __maybe_unused,
+	size_t copy(struct perf_mmap *map, void *to, void *dst, size_t dst_size,
+		    void *src, size_t src_size) __maybe_unused,
+	int push(struct perf_mmap *map, void *to, struct aiocb *cblock,
+		 void *buf, size_t size, off_t off) __maybe_unused,
 	off_t *off __maybe_unused)
 {
 	return 0;
 }
+
+static inline void perf_mmap__aio_consume_inplace(struct perf_mmap *md __maybe_unused)
+{
+}
 #endif
 
 size_t perf_mmap__mmap_len(struct perf_mmap *map);
@@ -13,12 +13,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <asm/bug.h>
+#include <linux/list.h>
 
 struct namespaces *namespaces__new(struct namespaces_event *event)
 {
@@ -43,6 +45,95 @@ void namespaces__free(struct namespaces *namespaces)
 	free(namespaces);
 }
 
+/*
+ * The processes of a container share its mount namespace and root. The
+ * root is opened once for all of them and their files are reached through
+ * it, as /proc/self/fd/<fd>/<path>, instead of entering the namespace for
+ * each file. It also stays usable once the processes are gone.
+ */
+struct nsroot {
+	struct list_head	node;
+	dev_t			mntns_dev;
+	ino_t			mntns_ino;
+	dev_t			dev;
+	ino_t			ino;
+	int			fd;
+	refcount_t		refcnt;
+	char			path[32];
+};
+
+static LIST_HEAD(nsroots);
+static pthread_mutex_t nsroots__lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct nsroot *nsroot__findnew(pid_t pid, struct stat *mntns)
+{
+	struct nsroot *root;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/root", pid);
+	fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&nsroots__lock);
+	list_for_each_entry(root, &nsroots, node) {
+		if (root->mntns_dev == mntns->st_dev &&
+		    root->mntns_ino == mntns->st_ino &&
+		    root->dev == st.st_dev && root->ino == st.st_ino) {
+			refcount_inc(&root->refcnt);
+			close(fd);
+			goto out;
+		}
+	}
+
+	root = zalloc(sizeof(*root));
+	if (root == NULL) {
+		close(fd);
+		goto out;
+	}
+
+	root->mntns_dev = mntns->st_dev;
+	root->mntns_ino = mntns->st_ino;
+	root->dev	= st.st_dev;
+	root->ino	= st.st_ino;
+	root->fd	= fd;
+	snprintf(root->path, sizeof(root->path), "/proc/self/fd/%d", fd);
+	refcount_set(&root->refcnt, 1);
+	list_add(&root->node, &nsroots);
+out:
+	pthread_mutex_unlock(&nsroots__lock);
+	return root;
+}
+
+static struct nsroot *nsroot__get(struct nsroot *root)
+{
+	if (root)
+		refcount_inc(&root->refcnt);
+	return root;
+}
+
+static void nsroot__put(struct nsroot *root)
+{
+	if (root == NULL)
+		return;
+
+	/* under the lock, not to be found while going away */
+	pthread_mutex_lock(&nsroots__lock);
+	if (refcount_dec_and_test(&root->refcnt)) {
+		list_del(&root->node);
+		close(root->fd);
+		free(root);
+	}
+	pthread_mutex_unlock(&nsroots__lock);
+}
+
 int nsinfo__init(struct nsinfo *nsi)
 {
 	char oldns[PATH_MAX];
@@ -74,6 +165,7 @@ int nsinfo__init(struct nsinfo *nsi)
 		nsi->need_setns = true;
 		nsi->mntns_path = newns;
 		newns = NULL;
+		nsi->root = nsroot__findnew(nsi->pid, &new_stat);
 	}
 
 	/* If we're dealing with a process that is in a different PID namespace,
@@ -156,6 +248,7 @@ struct nsinfo *nsinfo__copy(struct nsinfo *nsi)
 				return NULL;
 			}
 		}
+		nnsi->root = nsroot__get(nsi->root);
 		refcount_set(&nnsi->refcnt, 1);
 	}
 
@@ -165,6 +258,7 @@ struct nsinfo *nsinfo__copy(struct nsinfo *nsi)
 void nsinfo__delete(struct nsinfo *nsi)
 {
 	zfree(&nsi->mntns_path);
+	nsroot__put(nsi->root);
 	free(nsi);
 }
 
@@ -263,3 +357,42 @@ char *nsinfo__realpath(const char *path, struct nsinfo *nsi)
 
 	return rpath;
 }
+
+/*
+ * The path of a file of the mount namespace of nsi, through its root,
+ * that can be opened from ours: path itself if nsi is in ours.
+ */
+const char *nsinfo__root_path(struct nsinfo *nsi, const char *path,
+			      char *buf, size_t size)
+{
+	if (!nsinfo__has_root(nsi) || path[0] != '/')
+		return path;
+
+	if ((size_t)snprintf(buf, size, "%s%s", nsi->root->path, path) >= size)
+		return path;
+
+	return buf;
+}
+
+/*
+ * Like nsinfo__root_path(), entering the namespace when the root of nsi
+ * couldn't be opened: nsinfo__mountns_exit(nc) is to be called once done
+ * with the path returned.
+ */
+const char *nsinfo__mountns_path(struct nsinfo *nsi, const char *path,
+				 char *buf, size_t size, struct nscookie *nc)
+{
+	nc->oldns = -1;
+	nc->newns = -1;
+	nc->oldcwd = NULL;
+
+	if (nsinfo__has_root(nsi)) {
+		const char *root_path = nsinfo__root_path(nsi, path, buf, size);
+
+		if (root_path != path)
+			return root_path;
+	}
+
+	nsinfo__mountns_enter(nsi, nc);
+	return path;
+}
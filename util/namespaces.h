@@ -26,12 +26,16 @@ struct namespaces {
 struct namespaces *namespaces__new(struct namespaces_event *event);
 void namespaces__free(struct namespaces *namespaces);
 
+struct nsroot;
+
 struct nsinfo {
 	pid_t			pid;
 	pid_t			tgid;
 	pid_t			nstgid;
 	bool			need_setns;
 	char			*mntns_path;
+	/* the root of the process, to get to its files without setns() */
+	struct nsroot		*root;
 	refcount_t		refcnt;
 };
 
@@ -52,6 +56,17 @@ void nsinfo__put(struct nsinfo *nsi);
 void nsinfo__mountns_enter(struct nsinfo *nsi, struct nscookie *nc);
 void nsinfo__mountns_exit(struct nscookie *nc);
 
+/* A root was opened to get to the files of nsi without setns() */
+static inline bool nsinfo__has_root(struct nsinfo *nsi)
+{
+	return nsi && nsi->need_setns && nsi->root;
+}
+
+const char *nsinfo__root_path(struct nsinfo *nsi, const char *path,
+			      char *buf, size_t size);
+const char *nsinfo__mountns_path(struct nsinfo *nsi, const char *path,
+				 char *buf, size_t size, struct nscookie *nc);
+
 char *nsinfo__realpath(const char *path, struct nsinfo *nsi);
 
 static inline void __nsinfo__zput(struct nsinfo **nsip)
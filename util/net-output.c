@@ -0,0 +1,521 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/time64.h>
+
+#include "event.h"
+#include "debug.h"
+#include "util.h"
+#include "net-output.h"
+
+#define NET_OUTPUT_TCP		"tcp://"
+#define NET_OUTPUT_UNIX		"unix:"
+
+/* Between reconnection attempts, doubling */
+#define NET_BACKOFF_MIN_MS	100
+#define NET_BACKOFF_MAX_MS	5000
+
+struct net_block {
+	struct list_head list;
+	char		*data;
+	size_t		 size;
+	u64		 nr_events;
+};
+
+struct net_output {
+	char		*addr;
+	u16		 id_hdr_size;
+	bool		 block;
+	int		 sock;
+	pthread_t	 tid;
+	bool		 running;
+
+	/* the block being filled by the writer, only it touches it */
+	char		*cur;
+	size_t		 cur_len;
+	size_t		 cur_size;
+
+	void		*preamble;
+	size_t		 preamble_len;
+
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 more;
+	pthread_cond_t	 room;
+	struct list_head queue;
+	size_t		 queued;
+	size_t		 max_queued;
+	bool		 stop;
+	/* dropped since the last PERF_RECORD_LOST was sent */
+	u64		 lost;
+	u64		 total_lost;
+	u64		 sent;
+};
+
+bool net_output__is_addr(const char *path)
+{
+	return path && (!strncmp(path, NET_OUTPUT_TCP, strlen(NET_OUTPUT_TCP)) ||
+			!strncmp(path, NET_OUTPUT_UNIX, strlen(NET_OUTPUT_UNIX)));
+}
+
+static int net_output__connect_unix(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, };
+	int sock;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(sun.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun))) {
+		int err = -errno;
+
+		close(sock);
+		return err;
+	}
+	return sock;
+}
+
+/* Splits "host:port", the host being empty for any address when listening */
+static int net_output__split(const char *hostport, char **host, char **port)
+{
+	*host = strdup(hostport);
+	if (*host == NULL)
+		return -ENOMEM;
+
+	*port = strrchr(*host, ':');
+	if (*port == NULL) {
+		zfree(host);
+		return -EINVAL;
+	}
+	*(*port)++ = '\0';
+	return 0;
+}
+
+static int net_output__connect_tcp(const char *hostport)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM, }, *res, *ai;
+	char *host, *port;
+	int sock = net_output__split(hostport, &host, &port);
+
+	if (sock)
+		return sock;
+	sock = -ECONNREFUSED;
+
+	if (getaddrinfo(host, port, &hints, &res)) {
+		free(host);
+		return -EHOSTUNREACH;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (sock < 0) {
+			sock = -errno;
+			continue;
+		}
+		if (!connect(sock, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(sock);
+		sock = -errno;
+	}
+
+	freeaddrinfo(res);
+	free(host);
+	return sock;
+}
+
+static int net_output__connect(struct net_output *net)
+{
+	if (!strncmp(net->addr, NET_OUTPUT_UNIX, strlen(NET_OUTPUT_UNIX)))
+		return net_output__connect_unix(net->addr + strlen(NET_OUTPUT_UNIX));
+
+	return net_output__connect_tcp(net->addr + strlen(NET_OUTPUT_TCP));
+}
+
+static int net_output__listen_unix(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, };
+	int sock;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(sun.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    listen(sock, SOMAXCONN)) {
+		int err = -errno;
+
+		close(sock);
+		return err;
+	}
+	return sock;
+}
+
+static int net_output__listen_tcp(const char *hostport)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags    = AI_PASSIVE,
+	}, *res, *ai;
+	char *host, *port;
+	int sock = net_output__split(hostport, &host, &port);
+
+	if (sock)
+		return sock;
+	sock = -EADDRNOTAVAIL;
+
+	if (getaddrinfo(*host ? host : NULL, port, &hints, &res)) {
+		free(host);
+		return -EADDRNOTAVAIL;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		int one = 1;
+
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (sock < 0) {
+			sock = -errno;
+			continue;
+		}
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(sock, ai->ai_addr, ai->ai_addrlen) &&
+		    !listen(sock, SOMAXCONN))
+			break;
+		close(sock);
+		sock = -errno;
+	}
+
+	freeaddrinfo(res);
+	free(host);
+	return sock;
+}
+
+int net_output__listen(const char *addr)
+{
+	if (!strncmp(addr, NET_OUTPUT_UNIX, strlen(NET_OUTPUT_UNIX)))
+		return net_output__listen_unix(addr + strlen(NET_OUTPUT_UNIX));
+
+	if (!strncmp(addr, NET_OUTPUT_TCP, strlen(NET_OUTPUT_TCP)))
+		return net_output__listen_tcp(addr + strlen(NET_OUTPUT_TCP));
+
+	return -EINVAL;
+}
+
+static int net_output__send(struct net_output *net, const void *buf, size_t size)
+{
+	while (size) {
+		ssize_t n = send(net->sock, buf, size, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		size -= n;
+		net->sent += n;
+	}
+	return 0;
+}
+
+static int net_output__send_lost(struct net_output *net, u64 lost)
+{
+	size_t size = sizeof(struct lost_event) + net->id_hdr_size;
+	struct lost_event *event = zalloc(size);
+	int err;
+
+	if (event == NULL)
+		return -ENOMEM;
+
+	/* id 0, like the LOST records of the kernel for no event in particular */
+	event->header.type = PERF_RECORD_LOST;
+	event->header.size = size;
+	event->lost = lost;
+
+	err = net_output__send(net, event, size);
+	free(event);
+	return err;
+}
+
+static void net_block__delete(struct net_block *b)
+{
+	free(b->data);
+	free(b);
+}
+
+/* Called with the lock held */
+static void net_output__requeue(struct net_output *net, struct net_block *b, u64 lost)
+{
+	list_add(&b->list, &net->queue);
+	net->queued += b->size;
+	net->lost += lost;
+}
+
+/* Waits for ms or until stopped, called with the lock held */
+static void net_output__backoff(struct net_output *net, unsigned int ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += ms / MSEC_PER_SEC;
+	ts.tv_nsec += (ms % MSEC_PER_SEC) * NSEC_PER_MSEC;
+	if (ts.tv_nsec >= (long)NSEC_PER_SEC) {
+		ts.tv_nsec -= NSEC_PER_SEC;
+		ts.tv_sec++;
+	}
+
+	if (!net->stop)
+		pthread_cond_timedwait(&net->more, &net->lock, &ts);
+}
+
+static void *net_output__thread(void *arg)
+{
+	struct net_output *net = arg;
+	unsigned int backoff = NET_BACKOFF_MIN_MS;
+
+	pthread_mutex_lock(&net->lock);
+
+	while (true) {
+		struct net_block *b;
+		u64 lost;
+		int err;
+
+		while (list_empty(&net->queue) && !net->stop)
+			pthread_cond_wait(&net->more, &net->lock);
+		if (list_empty(&net->queue))
+			break;
+
+		b = list_first_entry(&net->queue, struct net_block, list);
+		list_del(&b->list);
+		net->queued -= b->size;
+		lost = net->lost;
+		net->lost = 0;
+		pthread_cond_signal(&net->room);
+		pthread_mutex_unlock(&net->lock);
+
+		err = 0;
+		if (net->sock < 0) {
+			net->sock = net_output__connect(net);
+			if (net->sock >= 0) {
+				pr_debug("net output: connected to %s\n", net->addr);
+				err = net_output__send(net, net->preamble, net->preamble_len);
+			} else {
+				err = net->sock;
+			}
+		}
+
+		if (!err && lost)
+			err = net_output__send_lost(net, lost);
+		if (!err)
+			err = net_output__send(net, b->data, b->size);
+
+		pthread_mutex_lock(&net->lock);
+
+		if (!err) {
+			net_block__delete(b);
+			backoff = NET_BACKOFF_MIN_MS;
+			continue;
+		}
+
+		pr_debug("net output: %s: %s\n", net->addr, strerror(-err));
+		if (net->sock >= 0) {
+			close(net->sock);
+			net->sock = -1;
+		}
+
+		/* when stopping there's one more try, not a wait */
+		if (net->stop && backoff > NET_BACKOFF_MIN_MS) {
+			net->total_lost += b->nr_events;
+			net_block__delete(b);
+			continue;
+		}
+
+		net_output__requeue(net, b, lost);
+		net_output__backoff(net, backoff);
+		backoff = min_t(unsigned int, backoff * 2, NET_BACKOFF_MAX_MS);
+	}
+
+	pthread_mutex_unlock(&net->lock);
+	return NULL;
+}
+
+struct net_output *net_output__new(const char *addr, size_t max_queued,
+				   bool block, u16 id_hdr_size)
+{
+	struct net_output *net = zalloc(sizeof(*net));
+
+	if (net == NULL)
+		return NULL;
+
+	net->addr = strdup(addr);
+	if (net->addr == NULL) {
+		free(net);
+		return NULL;
+	}
+
+	net->max_queued	 = max_queued;
+	net->block	 = block;
+	net->id_hdr_size = id_hdr_size;
+	net->sock	 = -1;
+	INIT_LIST_HEAD(&net->queue);
+	pthread_mutex_init(&net->lock, NULL);
+	pthread_cond_init(&net->more, NULL);
+	pthread_cond_init(&net->room, NULL);
+	return net;
+}
+
+int net_output__start(struct net_output *net, int preamble_fd)
+{
+	off_t size = lseek(preamble_fd, 0, SEEK_END);
+	int err;
+
+	if (size < 0)
+		return -errno;
+
+	net->preamble = malloc(size);
+	if (net->preamble == NULL)
+		return -ENOMEM;
+
+	if (pread(preamble_fd, net->preamble, size, 0) != size)
+		return -EIO;
+	net->preamble_len = size;
+
+	err = pthread_create(&net->tid, NULL, net_output__thread, net);
+	if (err)
+		return -err;
+
+	net->running = true;
+	return 0;
+}
+
+int net_output__write(struct net_output *net, const void *buf, size_t size)
+{
+	if (net->cur_len + size > net->cur_size) {
+		size_t new_size = max(net->cur_size * 2, net->cur_len + size);
+		char *cur = realloc(net->cur, new_size);
+
+		if (cur == NULL)
+			return -ENOMEM;
+		net->cur = cur;
+		net->cur_size = new_size;
+	}
+
+	memcpy(net->cur + net->cur_len, buf, size);
+	net->cur_len += size;
+	return 0;
+}
+
+static u64 net_block__nr_events(struct net_block *b)
+{
+	size_t off = 0;
+	u64 nr = 0;
+
+	while (off + sizeof(struct perf_event_header) <= b->size) {
+		struct perf_event_header *hdr = (void *)b->data + off;
+
+		if (hdr->size < sizeof(*hdr))
+			break;
+		off += hdr->size;
+		nr++;
+	}
+	return nr;
+}
+
+void net_output__flush(struct net_output *net)
+{
+	struct net_block *b;
+
+	if (!net->cur_len)
+		return;
+
+	b = zalloc(sizeof(*b));
+	if (b == NULL)
+		return;
+
+	/* the writer starts a new one, the sender frees this one */
+	b->data = net->cur;
+	b->size = net->cur_len;
+	b->nr_events = net_block__nr_events(b);
+	net->cur = NULL;
+	net->cur_len = net->cur_size = 0;
+
+	pthread_mutex_lock(&net->lock);
+
+	while (net->queued + b->size > net->max_queued && !list_empty(&net->queue)) {
+		struct net_block *oldest;
+
+		if (net->block && !net->stop) {
+			pthread_cond_wait(&net->room, &net->lock);
+			continue;
+		}
+
+		oldest = list_first_entry(&net->queue, struct net_block, list);
+		list_del(&oldest->list);
+		net->queued -= oldest->size;
+		net->lost += oldest->nr_events;
+		net->total_lost += oldest->nr_events;
+		net_block__delete(oldest);
+	}
+
+	list_add_tail(&b->list, &net->queue);
+	net->queued += b->size;
+	pthread_cond_signal(&net->more);
+	pthread_mutex_unlock(&net->lock);
+}
+
+void net_output__delete(struct net_output *net)
+{
+	struct net_block *b, *tmp;
+
+	if (net == NULL)
+		return;
+
+	net_output__flush(net);
+
+	if (net->running) {
+		pthread_mutex_lock(&net->lock);
+		net->stop = true;
+		pthread_cond_broadcast(&net->more);
+		pthread_mutex_unlock(&net->lock);
+		pthread_join(net->tid, NULL);
+	}
+
+	list_for_each_entry_safe(b, tmp, &net->queue, list) {
+		net->total_lost += b->nr_events;
+		list_del(&b->list);
+		net_block__delete(b);
+	}
+
+	if (net->total_lost)
+		pr_warning("net output: %" PRIu64 " events couldn't be sent to %s\n",
+			   net->total_lost, net->addr);
+	pr_debug("net output: %" PRIu64 " bytes sent to %s\n", net->sent, net->addr);
+
+	if (net->sock >= 0)
+		close(net->sock);
+	pthread_cond_destroy(&net->room);
+	pthread_cond_destroy(&net->more);
+	pthread_mutex_destroy(&net->lock);
+	free(net->preamble);
+	free(net->cur);
+	free(net->addr);
+	free(net);
+}
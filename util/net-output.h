@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_NET_OUTPUT_H
+#define __PERF_NET_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/types.h>
+
+/*
+ * Streams pipe mode perf data to a collector, "tcp://host:port" or
+ * "unix:path", from a sender thread of its own.
+ *
+ * The writes are gathered in a block that net_output__flush() queues at
+ * an event boundary. When the queue is full the oldest block is dropped
+ * (or, with block set, the writer waits), the collector gets a
+ * PERF_RECORD_LOST with the number of events dropped in its place.
+ *
+ * Everything written to preamble_fd before net_output__start(), the pipe
+ * header, attributes and the synthesized tasks, is sent again after every
+ * reconnection, so each connection is a stream of its own.
+ */
+struct net_output;
+
+bool net_output__is_addr(const char *path);
+
+struct net_output *net_output__new(const char *addr, size_t max_queued,
+				   bool block, u16 id_hdr_size);
+int net_output__start(struct net_output *net, int preamble_fd);
+int net_output__write(struct net_output *net, const void *buf, size_t size);
+void net_output__flush(struct net_output *net);
+/* Sends what's queued, if it can, and stops the sender thread */
+void net_output__delete(struct net_output *net);
+
+/* The collector end: a socket listening on addr, or a negative errno */
+int net_output__listen(const char *addr);
+
+#endif /* __PERF_NET_OUTPUT_H */
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Off-cpu profiles: the callchains of the sched:sched_switch samples, where
+ * the threads block, weighted by the time until they run again, taken from
+ * the next switch in of the thread, a PERF_RECORD_SWITCH event or the
+ * next_pid of another sched_switch sample. Only the last switch out of each
+ * thread is kept, so the memory used depends on the number of threads, not
+ * on the number of switches.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+
+#include "event.h"
+#include "evsel.h"
+#include "intlist.h"
+#include "off-cpu.h"
+#include "util.h"
+
+struct off_cpu {
+	/* struct off_cpu_sample of the threads, by tid */
+	struct intlist		*threads;
+};
+
+struct off_cpu_sample {
+	struct perf_evsel	*evsel;
+	struct perf_sample	sample;
+	bool			pending;
+	/* the copies of sample.callchain and sample.raw_data */
+	struct ip_callchain	*callchain;
+	size_t			callchain_size;
+	void			*raw_data;
+	size_t			raw_size;
+};
+
+struct off_cpu *off_cpu__new(void)
+{
+	struct off_cpu *oc = zalloc(sizeof(*oc));
+
+	if (oc == NULL)
+		return NULL;
+
+	oc->threads = intlist__new(NULL);
+	if (oc->threads == NULL) {
+		free(oc);
+		return NULL;
+	}
+
+	return oc;
+}
+
+void off_cpu__delete(struct off_cpu *oc)
+{
+	struct int_node *node;
+
+	if (oc == NULL)
+		return;
+
+	intlist__for_each_entry(node, oc->threads) {
+		struct off_cpu_sample *ocs = node->priv;
+
+		if (ocs) {
+			free(ocs->callchain);
+			free(ocs->raw_data);
+			free(ocs);
+		}
+	}
+	intlist__delete(oc->threads);
+	free(oc);
+}
+
+bool off_cpu__is_switch(struct perf_evsel *evsel)
+{
+	return evsel->attr.type == PERF_TYPE_TRACEPOINT &&
+	       !strcmp(perf_evsel__name(evsel), "sched:sched_switch");
+}
+
+static int off_cpu__copy(void **dst, size_t *dst_size, const void *src, size_t size)
+{
+	if (size > *dst_size) {
+		void *buf = realloc(*dst, size);
+
+		if (buf == NULL)
+			return -ENOMEM;
+		*dst = buf;
+		*dst_size = size;
+	}
+
+	memcpy(*dst, src, size);
+	return 0;
+}
+
+int off_cpu__switch_out(struct off_cpu *oc, struct perf_evsel *evsel,
+			struct perf_sample *sample)
+{
+	struct int_node *node = intlist__findnew(oc->threads, sample->tid);
+	struct off_cpu_sample *ocs;
+
+	if (node == NULL)
+		return -ENOMEM;
+
+	ocs = node->priv;
+	if (ocs == NULL) {
+		ocs = zalloc(sizeof(*ocs));
+		if (ocs == NULL)
+			return -ENOMEM;
+		node->priv = ocs;
+	}
+
+	ocs->evsel  = evsel;
+	ocs->sample = *sample;
+	ocs->pending = true;
+
+	if (sample->callchain) {
+		size_t size = (sample->callchain->nr + 1) * sizeof(u64);
+
+		if (off_cpu__copy((void **)&ocs->callchain, &ocs->callchain_size,
+				  sample->callchain, size))
+			goto out_drop;
+		ocs->sample.callchain = ocs->callchain;
+	}
+
+	if (sample->raw_data) {
+		if (off_cpu__copy(&ocs->raw_data, &ocs->raw_size,
+				  sample->raw_data, sample->raw_size))
+			goto out_drop;
+		ocs->sample.raw_data = ocs->raw_data;
+	}
+
+	/* what isn't copied is gone with the event */
+	ocs->sample.branch_stack = NULL;
+	ocs->sample.user_regs.abi = 0;
+	ocs->sample.user_stack.size = 0;
+	return 0;
+
+out_drop:
+	ocs->pending = false;
+	return -ENOMEM;
+}
+
+int off_cpu__switch_in(struct off_cpu *oc, int tid, u64 time,
+		       struct machine *machine, off_cpu__add_t add, void *arg)
+{
+	struct int_node *node = intlist__find(oc->threads, tid);
+	struct off_cpu_sample *ocs;
+
+	if (node == NULL || node->priv == NULL)
+		return 0;
+
+	ocs = node->priv;
+	if (!ocs->pending || time < ocs->sample.time)
+		return 0;
+
+	ocs->pending = false;
+	ocs->sample.period = time - ocs->sample.time;
+	if (!ocs->sample.period)
+		return 0;
+
+	return add(arg, ocs->evsel, &ocs->sample, machine);
+}
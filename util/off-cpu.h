@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_OFF_CPU_H
+#define __PERF_OFF_CPU_H
+
+#include <linux/types.h>
+#include <stdbool.h>
+
+struct machine;
+struct perf_evsel;
+struct perf_sample;
+struct off_cpu;
+
+typedef int (*off_cpu__add_t)(void *arg, struct perf_evsel *evsel,
+			      struct perf_sample *sample,
+			      struct machine *machine);
+
+struct off_cpu *off_cpu__new(void);
+void off_cpu__delete(struct off_cpu *oc);
+
+/* The sched:sched_switch samples, where the threads leave the cpu */
+bool off_cpu__is_switch(struct perf_evsel *evsel);
+
+/* Keep the sample of the thread switched out until it is switched in */
+int off_cpu__switch_out(struct off_cpu *oc, struct perf_evsel *evsel,
+			struct perf_sample *sample);
+
+/*
+ * The thread tid is back on a cpu at time: call add with the sample of
+ * its switch out, its period the nanoseconds it was off cpu.
+ */
+int off_cpu__switch_in(struct off_cpu *oc, int tid, u64 time,
+		       struct machine *machine, off_cpu__add_t add, void *arg);
+
+#endif /* __PERF_OFF_CPU_H */
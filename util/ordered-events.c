@@ -1,6 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/compiler.h>
 #include <linux/string.h>
@@ -8,12 +14,35 @@
 #include "session.h"
 #include "asm/bug.h"
 #include "debug.h"
+#include "util.h"
+#include "mem-stats.h"
+#include "stage-time.h"
 
 #define pr_N(n, fmt, ...) \
 	eprintf(n, debug_ordered_events, fmt, ##__VA_ARGS__)
 
 #define pr(fmt, ...) pr_N(1, pr_fmt(fmt), ##__VA_ARGS__)
 
+/*
+ * The events queued when max_alloc_size is reached, in time order, in an
+ * unlinked file of spill_dir, see ordered_events__spill().  The first one
+ * not delivered yet is read in head.
+ */
+struct ordered_events_run {
+	FILE			*file;
+	struct ordered_event	 head;
+	union perf_event	*buf;
+};
+
+struct ordered_events_run_rec {
+	u64			 timestamp;
+	u64			 file_offset;
+	/* followed by the event */
+};
+
+/* The biggest event, header.size is a u16 */
+#define RUN_BUF_SIZE		(64 * 1024)
+
 static void queue_event(struct ordered_events *oe, struct ordered_event *new)
 {
 	struct ordered_event *last = oe->last;
@@ -60,6 +89,34 @@ static void queue_event(struct ordered_events *oe, struct ordered_event *new)
 	}
 }
 
+static void queue_event_src(struct ordered_events *oe, struct ordered_event *new,
+			    unsigned int src)
+{
+	struct list_head *head = &oe->queues[src % oe->nr_queues].events;
+	u64 timestamp = new->timestamp;
+	struct ordered_event *iter;
+
+	++oe->nr_events;
+
+	pr_oe_time2(timestamp, "queue_event src %u nr_events %u\n", src, oe->nr_events);
+
+	if (timestamp > oe->max_timestamp)
+		oe->max_timestamp = timestamp;
+
+	/*
+	 * Single source events are mostly in time order, so the tail
+	 * is where the new event normally goes.
+	 */
+	list_for_each_entry_reverse(iter, head, list) {
+		if (iter->timestamp <= timestamp) {
+			list_add(&new->list, &iter->list);
+			return;
+		}
+	}
+
+	list_add(&new->list, head);
+}
+
 static union perf_event *__dup_event(struct ordered_events *oe,
 				     union perf_event *event)
 {
@@ -67,8 +124,10 @@ static union perf_event *__dup_event(struct ordered_events *oe,
 
 	if (oe->cur_alloc_size < oe->max_alloc_size) {
 		new_event = memdup(event, event->header.size);
-		if (new_event)
+		if (new_event) {
 			oe->cur_alloc_size += event->header.size;
+			mem_stats__add(MEM_STAT__ORDERED_EVENTS, event->header.size, 1);
+		}
 	}
 
 	return new_event;
@@ -84,6 +143,7 @@ static void __free_dup_event(struct ordered_events *oe, union perf_event *event)
 {
 	if (event) {
 		oe->cur_alloc_size -= event->header.size;
+		mem_stats__sub(MEM_STAT__ORDERED_EVENTS, event->header.size, 1);
 		free(event);
 	}
 }
@@ -154,12 +214,14 @@ static struct ordered_event *alloc_event(struct ordered_events *oe,
 		   oe->cur_alloc_size, size, oe->max_alloc_size);
 
 		oe->cur_alloc_size += size;
+		mem_stats__add(MEM_STAT__ORDERED_EVENTS, size, 0);
 		list_add(&oe->buffer->list, &oe->to_free);
 
 		oe->buffer_idx = 1;
 		new = &oe->buffer->event[0];
 	} else {
 		pr("allocation limit reached %" PRIu64 "B\n", oe->max_alloc_size);
+		free_dup_event(oe, new_event);
 		return NULL;
 	}
 
@@ -169,14 +231,17 @@ static struct ordered_event *alloc_event(struct ordered_events *oe,
 
 static struct ordered_event *
 ordered_events__new_event(struct ordered_events *oe, u64 timestamp,
-		    union perf_event *event)
+		    union perf_event *event, unsigned int src)
 {
 	struct ordered_event *new;
 
 	new = alloc_event(oe, event);
 	if (new) {
 		new->timestamp = timestamp;
-		queue_event(oe, new);
+		if (oe->nr_queues)
+			queue_event_src(oe, new, src);
+		else
+			queue_event(oe, new);
 	}
 
 	return new;
@@ -190,8 +255,10 @@ void ordered_events__delete(struct ordered_events *oe, struct ordered_event *eve
 	event->event = NULL;
 }
 
-int ordered_events__queue(struct ordered_events *oe, union perf_event *event,
-			  u64 timestamp, u64 file_offset)
+static int ordered_events__spill(struct ordered_events *oe);
+
+int ordered_events__queue_src(struct ordered_events *oe, union perf_event *event,
+			      u64 timestamp, u64 file_offset, unsigned int src)
 {
 	struct ordered_event *oevent;
 
@@ -206,10 +273,17 @@ int ordered_events__queue(struct ordered_events *oe, union perf_event *event,
 		oe->nr_unordered_events++;
 	}
 
-	oevent = ordered_events__new_event(oe, timestamp, event);
+	oevent = ordered_events__new_event(oe, timestamp, event, src);
 	if (!oevent) {
-		ordered_events__flush(oe, OE_FLUSH__HALF);
-		oevent = ordered_events__new_event(oe, timestamp, event);
+		if (oe->spill_dir) {
+			int err = ordered_events__spill(oe);
+
+			if (err)
+				return err;
+		} else {
+			ordered_events__flush(oe, OE_FLUSH__HALF);
+		}
+		oevent = ordered_events__new_event(oe, timestamp, event, src);
 	}
 
 	if (!oevent)
@@ -219,6 +293,99 @@ int ordered_events__queue(struct ordered_events *oe, union perf_event *event,
 	return 0;
 }
 
+int ordered_events__queue(struct ordered_events *oe, union perf_event *event,
+			  u64 timestamp, u64 file_offset)
+{
+	return ordered_events__queue_src(oe, event, timestamp, file_offset, 0);
+}
+
+static u64 queue__first_time(struct ordered_events *oe, unsigned int idx)
+{
+	struct ordered_event *event;
+
+	event = list_first_entry(&oe->queues[idx].events, struct ordered_event, list);
+	return event->timestamp;
+}
+
+static void heap__sift_down(struct ordered_events *oe, unsigned int nr,
+			    unsigned int pos)
+{
+	unsigned int *heap = oe->heap;
+
+	while (true) {
+		unsigned int min = pos;
+		unsigned int l = 2 * pos + 1;
+		unsigned int r = l + 1;
+
+		if (l < nr && queue__first_time(oe, heap[l]) < queue__first_time(oe, heap[min]))
+			min = l;
+		if (r < nr && queue__first_time(oe, heap[r]) < queue__first_time(oe, heap[min]))
+			min = r;
+		if (min == pos)
+			break;
+
+		swap(heap[pos], heap[min]);
+		pos = min;
+	}
+}
+
+/*
+ * K-way merge of the per source queues, the heap holds the queues
+ * that still have events up to the flush limit, keyed by the
+ * timestamp of their first event.
+ */
+static int do_flush_queues(struct ordered_events *oe, bool show_progress)
+{
+	unsigned int *heap = oe->heap;
+	u64 limit = oe->next_flush;
+	struct ui_progress prog;
+	unsigned int i, nr = 0;
+	int ret;
+
+	if (!limit)
+		return 0;
+
+	for (i = 0; i < oe->nr_queues; i++) {
+		if (!list_empty(&oe->queues[i].events) &&
+		    queue__first_time(oe, i) <= limit)
+			heap[nr++] = i;
+	}
+
+	for (i = nr / 2; i-- > 0; )
+		heap__sift_down(oe, nr, i);
+
+	if (show_progress)
+		ui_progress__init(&prog, oe->nr_events, "Processing time ordered events...");
+
+	while (nr) {
+		struct list_head *head = &oe->queues[heap[0]].events;
+		struct ordered_event *iter;
+
+		if (session_done())
+			return 0;
+
+		iter = list_first_entry(head, struct ordered_event, list);
+		ret = oe->deliver(oe, iter);
+		if (ret)
+			return ret;
+
+		ordered_events__delete(oe, iter);
+		oe->last_flush = iter->timestamp;
+
+		if (list_empty(head) || queue__first_time(oe, heap[0]) > limit)
+			heap[0] = heap[--nr];
+		heap__sift_down(oe, nr, 0);
+
+		if (show_progress)
+			ui_progress__update(&prog, 1);
+	}
+
+	if (show_progress)
+		ui_progress__finish();
+
+	return 0;
+}
+
 static int do_flush(struct ordered_events *oe, bool show_progress)
 {
 	struct list_head *head = &oe->events;
@@ -228,6 +395,9 @@ static int do_flush(struct ordered_events *oe, bool show_progress)
 	struct ui_progress prog;
 	int ret;
 
+	if (oe->nr_queues)
+		return do_flush_queues(oe, show_progress);
+
 	if (!limit)
 		return 0;
 
@@ -262,6 +432,212 @@ static int do_flush(struct ordered_events *oe, bool show_progress)
 	return 0;
 }
 
+static void ordered_events_run__delete(struct ordered_events *oe, unsigned int idx)
+{
+	struct ordered_events_run *run = &oe->runs[idx];
+
+	if (run->file)
+		fclose(run->file);
+	free(run->buf);
+	*run = oe->runs[--oe->nr_runs];
+}
+
+/* Read the next event of run in its head: 1 if there's one, 0 at the end */
+static int ordered_events_run__next(struct ordered_events_run *run)
+{
+	struct ordered_events_run_rec rec;
+	size_t size;
+
+	if (fread(&rec, sizeof(rec), 1, run->file) != 1)
+		return ferror(run->file) ? -EIO : 0;
+
+	if (fread(run->buf, sizeof(run->buf->header), 1, run->file) != 1)
+		return -EIO;
+
+	size = run->buf->header.size;
+	if (size < sizeof(run->buf->header) ||
+	    fread((void *)run->buf + sizeof(run->buf->header),
+		  size - sizeof(run->buf->header), 1, run->file) != 1)
+		return -EIO;
+
+	run->head.timestamp   = rec.timestamp;
+	run->head.file_offset = rec.file_offset;
+	run->head.event	      = run->buf;
+	return 1;
+}
+
+/* Write the events to the last run, see ordered_events__spill() */
+static int ordered_events_run__write(struct ordered_events *oe,
+				     struct ordered_event *event)
+{
+	struct ordered_events_run *run = &oe->runs[oe->nr_runs - 1];
+	struct ordered_events_run_rec rec = {
+		.timestamp   = event->timestamp,
+		.file_offset = event->file_offset,
+	};
+
+	if (fwrite(&rec, sizeof(rec), 1, run->file) != 1 ||
+	    fwrite(event->event, event->event->header.size, 1, run->file) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Out of memory for the events: write them all, in time order, in a new
+ * run to be merged with the others and the queue when they get flushed.
+ * The events are copies, see ordered_events__set_spill(), they are freed.
+ */
+static int ordered_events__spill(struct ordered_events *oe)
+{
+	ordered_events__deliver_t deliver = oe->deliver;
+	u64 last_flush = oe->last_flush, next_flush = oe->next_flush;
+	unsigned int nr_events = oe->nr_events;
+	struct ordered_events_run *runs, *run;
+	char path[PATH_MAX];
+	int fd, err;
+
+	if (!nr_events)
+		return -ENOMEM;
+
+	runs = realloc(oe->runs, (oe->nr_runs + 1) * sizeof(*runs));
+	if (!runs)
+		return -ENOMEM;
+	oe->runs = runs;
+
+	run = &runs[oe->nr_runs++];
+	memset(run, 0, sizeof(*run));
+
+	scnprintf(path, sizeof(path), "%s/perf-ordered-events-XXXXXX", oe->spill_dir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		err = -errno;
+		pr_err("failed to create %s to spill the queued events: %m\n", path);
+		ordered_events_run__delete(oe, oe->nr_runs - 1);
+		return err;
+	}
+	/* gone with the last reference, however perf ends */
+	unlink(path);
+
+	run->file = fdopen(fd, "w+");
+	run->buf  = malloc(RUN_BUF_SIZE);
+	if (!run->file || !run->buf) {
+		if (!run->file)
+			close(fd);
+		ordered_events_run__delete(oe, oe->nr_runs - 1);
+		return -ENOMEM;
+	}
+
+	oe->deliver    = ordered_events_run__write;
+	oe->next_flush = ULLONG_MAX;
+	err = do_flush(oe, false);
+	oe->deliver    = deliver;
+	oe->next_flush = next_flush;
+	/* nothing was delivered */
+	oe->last_flush = last_flush;
+
+	if (!err && (fflush(run->file) || fseek(run->file, 0, SEEK_SET)))
+		err = -errno;
+	if (!err)
+		err = ordered_events_run__next(run);
+
+	if (err <= 0) {
+		ordered_events_run__delete(oe, oe->nr_runs - 1);
+		return err ?: -ENOMEM;
+	}
+
+	pr("spilled %u events to run %u\n", nr_events - oe->nr_events, oe->nr_runs);
+	return 0;
+}
+
+/* The first event still queued in memory, 0 if none */
+static u64 queue__first_event_time(struct ordered_events *oe)
+{
+	struct ordered_event *event;
+
+	if (oe->nr_queues) {
+		u64 first = 0;
+		unsigned int i;
+
+		for (i = 0; i < oe->nr_queues; i++) {
+			u64 time;
+
+			if (list_empty(&oe->queues[i].events))
+				continue;
+
+			time = queue__first_time(oe, i);
+			if (!first || time < first)
+				first = time;
+		}
+
+		return first;
+	}
+
+	if (list_empty(&oe->events))
+		return 0;
+
+	event = list_first_entry(&oe->events, struct ordered_event, list);
+	return event->timestamp;
+}
+
+/*
+ * Deliver the events up to next_flush of the runs and of the queue in
+ * time order: the queued events up to the first of the runs, then the
+ * events of that run up to the first of the others and of the queue,
+ * and again.
+ */
+static int do_flush_runs(struct ordered_events *oe, bool show_progress)
+{
+	u64 limit = oe->next_flush;
+	int ret;
+
+	while (true) {
+		struct ordered_events_run *run = NULL;
+		unsigned int i, idx = 0;
+		u64 bound = limit, first;
+
+		for (i = 0; i < oe->nr_runs; i++) {
+			if (!run || oe->runs[i].head.timestamp < run->head.timestamp) {
+				run = &oe->runs[i];
+				idx = i;
+			}
+		}
+
+		oe->next_flush = run ? min(limit, run->head.timestamp) : limit;
+		ret = do_flush(oe, show_progress && !run);
+		oe->next_flush = limit;
+		if (ret || !run || run->head.timestamp > limit)
+			return ret;
+
+		for (i = 0; i < oe->nr_runs; i++) {
+			if (i != idx)
+				bound = min(bound, oe->runs[i].head.timestamp);
+		}
+
+		first = queue__first_event_time(oe);
+		if (first)
+			bound = min(bound, first);
+
+		while (run->head.timestamp <= bound) {
+			if (session_done())
+				return 0;
+
+			ret = oe->deliver(oe, &run->head);
+			if (ret)
+				return ret;
+			oe->last_flush = run->head.timestamp;
+
+			ret = ordered_events_run__next(run);
+			if (ret < 0)
+				return ret;
+			if (ret == 0) {
+				ordered_events_run__delete(oe, idx);
+				break;
+			}
+		}
+	}
+}
+
 static int __ordered_events__flush(struct ordered_events *oe, enum oe_flush how,
 				   u64 timestamp)
 {
@@ -273,10 +649,11 @@ static int __ordered_events__flush(struct ordered_events *oe, enum oe_flush how,
 		"TOP  ",
 		"TIME ",
 	};
-	int err;
 	bool show_progress = false;
+	u64 start;
+	int err;
 
-	if (oe->nr_events == 0)
+	if (oe->nr_events == 0 && oe->nr_runs == 0)
 		return 0;
 
 	switch (how) {
@@ -292,6 +669,14 @@ static int __ordered_events__flush(struct ordered_events *oe, enum oe_flush how,
 		struct ordered_event *first, *last;
 		struct list_head *head = &oe->events;
 
+		if (oe->nr_queues) {
+			u64 first_time = ordered_events__first_time(oe);
+
+			oe->next_flush  = first_time;
+			oe->next_flush += (oe->max_timestamp - first_time) / 2;
+			break;
+		}
+
 		first = list_entry(head->next, struct ordered_event, list);
 		last = oe->last;
 
@@ -319,7 +704,12 @@ static int __ordered_events__flush(struct ordered_events *oe, enum oe_flush how,
 		   str[how], oe->nr_events);
 	pr_oe_time(oe->max_timestamp, "max_timestamp\n");
 
-	err = do_flush(oe, show_progress);
+	start = stage_time__start();
+	if (oe->nr_runs)
+		err = do_flush_runs(oe, show_progress);
+	else
+		err = do_flush(oe, show_progress);
+	stage_time__end(STAGE_TIME__FLUSH, start);
 
 	if (!err) {
 		if (how == OE_FLUSH__ROUND)
@@ -347,13 +737,75 @@ int ordered_events__flush_time(struct ordered_events *oe, u64 timestamp)
 
 u64 ordered_events__first_time(struct ordered_events *oe)
 {
-	struct ordered_event *event;
+	u64 first = queue__first_event_time(oe);
+	unsigned int i;
 
-	if (list_empty(&oe->events))
-		return 0;
+	for (i = 0; i < oe->nr_runs; i++) {
+		if (!first || oe->runs[i].head.timestamp < first)
+			first = oe->runs[i].head.timestamp;
+	}
 
-	event = list_first_entry(&oe->events, struct ordered_event, list);
-	return event->timestamp;
+	return first;
+}
+
+/*
+ * Switch to one queue per event source (e.g. mmap index), must be
+ * called before any event is queued. Passing nr <= 1 goes back to
+ * the single time ordered list.
+ */
+int ordered_events__set_sources(struct ordered_events *oe, unsigned int nr)
+{
+	struct ordered_events_queue *queues = NULL;
+	unsigned int *heap = NULL;
+	unsigned int i;
+
+	if (oe->nr_events)
+		return -EBUSY;
+
+	if (nr > 1) {
+		queues = calloc(nr, sizeof(*queues));
+		heap = calloc(nr, sizeof(*heap));
+		if (!queues || !heap) {
+			free(queues);
+			free(heap);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < nr; i++)
+			INIT_LIST_HEAD(&queues[i].events);
+	}
+
+	free(oe->queues);
+	free(oe->heap);
+	oe->queues    = queues;
+	oe->heap      = heap;
+	oe->nr_queues = queues ? nr : 0;
+	oe->last      = NULL;
+	return 0;
+}
+
+/*
+ * Past max_alloc_size, write the queued events to a file in dir, in time
+ * order, and merge them back in when flushing instead of flushing half of
+ * them early, out of order with what comes next.  The events are then
+ * copied when queued, not pinned where they were read.  NULL goes back to
+ * flushing early.
+ */
+int ordered_events__set_spill(struct ordered_events *oe, const char *dir)
+{
+	char *spill_dir = NULL;
+
+	if (dir) {
+		spill_dir = strdup(dir);
+		if (!spill_dir)
+			return -ENOMEM;
+	}
+
+	free(oe->spill_dir);
+	oe->spill_dir = spill_dir;
+	if (spill_dir)
+		oe->copy_on_queue = true;
+	return 0;
 }
 
 void ordered_events__init(struct ordered_events *oe, ordered_events__deliver_t deliver,
@@ -379,6 +831,8 @@ ordered_events_buffer__free(struct ordered_events_buffer *buffer,
 			__free_dup_event(oe, buffer->event[i].event);
 	}
 
+	mem_stats__sub(MEM_STAT__ORDERED_EVENTS, sizeof(*buffer) +
+		       MAX_SAMPLE_BUFFER * sizeof(struct ordered_event), 0);
 	free(buffer);
 }
 
@@ -386,6 +840,15 @@ void ordered_events__free(struct ordered_events *oe)
 {
 	struct ordered_events_buffer *buffer, *tmp;
 
+	zfree(&oe->queues);
+	zfree(&oe->heap);
+	oe->nr_queues = 0;
+
+	while (oe->nr_runs)
+		ordered_events_run__delete(oe, 0);
+	zfree(&oe->runs);
+	zfree(&oe->spill_dir);
+
 	if (list_empty(&oe->to_free))
 		return;
 
@@ -408,8 +871,18 @@ void ordered_events__free(struct ordered_events *oe)
 void ordered_events__reinit(struct ordered_events *oe)
 {
 	ordered_events__deliver_t old_deliver = oe->deliver;
+	unsigned int nr_queues = oe->nr_queues;
+	char *spill_dir = oe->spill_dir;
 
+	oe->spill_dir = NULL;
 	ordered_events__free(oe);
 	memset(oe, '\0', sizeof(*oe));
 	ordered_events__init(oe, old_deliver, oe->data);
+
+	if (nr_queues)
+		ordered_events__set_sources(oe, nr_queues);
+	if (spill_dir) {
+		oe->spill_dir = spill_dir;
+		oe->copy_on_queue = true;
+	}
 }
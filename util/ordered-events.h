@@ -32,6 +32,17 @@ struct ordered_events_buffer {
 	struct ordered_event	event[0];
 };
 
+/*
+ * Per source (mmap or cpu) FIFO, events from a single source come
+ * (almost) in time order so they are just appended and merged with
+ * the other sources at flush time.
+ */
+struct ordered_events_queue {
+	struct list_head	events;
+};
+
+struct ordered_events_run;
+
 struct ordered_events {
 	u64				 last_flush;
 	u64				 next_flush;
@@ -43,6 +54,9 @@ struct ordered_events {
 	struct list_head		 to_free;
 	struct ordered_events_buffer	*buffer;
 	struct ordered_event		*last;
+	struct ordered_events_queue	*queues;
+	unsigned int			*heap;
+	unsigned int			 nr_queues;
 	ordered_events__deliver_t	 deliver;
 	int				 buffer_idx;
 	unsigned int			 nr_events;
@@ -50,10 +64,17 @@ struct ordered_events {
 	u32				 nr_unordered_events;
 	bool				 copy_on_queue;
 	void				*data;
+	/* where the events go past max_alloc_size, see ordered_events__set_spill() */
+	char				*spill_dir;
+	struct ordered_events_run	*runs;
+	unsigned int			 nr_runs;
 };
 
 int ordered_events__queue(struct ordered_events *oe, union perf_event *event,
 			  u64 timestamp, u64 file_offset);
+int ordered_events__queue_src(struct ordered_events *oe, union perf_event *event,
+			      u64 timestamp, u64 file_offset, unsigned int src);
+int ordered_events__set_sources(struct ordered_events *oe, unsigned int nr);
 void ordered_events__delete(struct ordered_events *oe, struct ordered_event *event);
 int ordered_events__flush(struct ordered_events *oe, enum oe_flush how);
 int ordered_events__flush_time(struct ordered_events *oe, u64 timestamp);
@@ -62,6 +83,7 @@ void ordered_events__init(struct ordered_events *oe, ordered_events__deliver_t d
 void ordered_events__free(struct ordered_events *oe);
 void ordered_events__reinit(struct ordered_events *oe);
 u64 ordered_events__first_time(struct ordered_events *oe);
+int ordered_events__set_spill(struct ordered_events *oe, const char *dir);
 
 static inline
 void ordered_events__set_alloc_size(struct ordered_events *oe, u64 size)
@@ -1,15 +1,18 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <linux/list.h>
 #include <linux/compiler.h>
+#include <linux/hash.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <dirent.h>
+#include <ctype.h>
 #include <api/fs/fs.h>
 #include <locale.h>
 #include <regex.h>
@@ -282,25 +285,98 @@ static void perf_pmu_free_alias(struct perf_pmu_alias *newalias)
 	free(newalias);
 }
 
+#define PERF_PMU_ALIAS_HASH_BITS	6
+
+static struct hlist_head *perf_pmu__alias_head(struct perf_pmu *pmu,
+					       const char *name)
+{
+	u32 hash = 2166136261U;
+
+	/* FNV-1a, the names are case insensitive */
+	for (; *name; name++)
+		hash = (hash ^ (u8)tolower(*name)) * 16777619;
+
+	return &pmu->alias_hash[hash_32(hash, pmu->alias_hash_bits)];
+}
+
+/*
+ * The core PMUs of recent CPUs have thousands of aliases, double the
+ * buckets as they come. If that fails the hash is kept as it is, or the
+ * list is walked while there is none.
+ */
+static int perf_pmu__rehash_aliases(struct perf_pmu *pmu)
+{
+	u32 bits = pmu->alias_hash ? pmu->alias_hash_bits + 1 :
+				     PERF_PMU_ALIAS_HASH_BITS;
+	struct perf_pmu_alias *alias;
+	struct hlist_head *heads;
+
+	heads = calloc(1U << bits, sizeof(*heads));
+	if (heads == NULL)
+		return -ENOMEM;
+
+	free(pmu->alias_hash);
+	pmu->alias_hash = heads;
+	pmu->alias_hash_bits = bits;
+
+	list_for_each_entry(alias, &pmu->aliases, list)
+		hlist_add_head(&alias->hash, perf_pmu__alias_head(pmu, alias->name));
+
+	return 0;
+}
+
+static void perf_pmu__add_alias(struct perf_pmu *pmu,
+				struct perf_pmu_alias *alias)
+{
+	u32 nr_heads = pmu->alias_hash ? 1U << pmu->alias_hash_bits : 0;
+
+	list_add_tail(&alias->list, &pmu->aliases);
+
+	/* the rehash puts in all of the list */
+	if (++pmu->nr_aliases > nr_heads && !perf_pmu__rehash_aliases(pmu))
+		return;
+
+	if (pmu->alias_hash)
+		hlist_add_head(&alias->hash, perf_pmu__alias_head(pmu, alias->name));
+}
+
+static struct perf_pmu_alias *perf_pmu__find_alias(struct perf_pmu *pmu,
+						   const char *name)
+{
+	struct perf_pmu_alias *alias;
+
+	if (!pmu->alias_hash) {
+		list_for_each_entry(alias, &pmu->aliases, list) {
+			if (!strcasecmp(alias->name, name))
+				return alias;
+		}
+		return NULL;
+	}
+
+	hlist_for_each_entry(alias, perf_pmu__alias_head(pmu, name), hash) {
+		if (!strcasecmp(alias->name, name))
+			return alias;
+	}
+	return NULL;
+}
+
 /* Merge an alias, search in alias list. If this name is already
  * present merge both of them to combine all information.
  */
 static bool perf_pmu_merge_alias(struct perf_pmu_alias *newalias,
-				 struct list_head *alist)
+				 struct perf_pmu *pmu)
 {
-	struct perf_pmu_alias *a;
+	struct perf_pmu_alias *a = perf_pmu__find_alias(pmu, newalias->name);
 
-	list_for_each_entry(a, alist, list) {
-		if (!strcasecmp(newalias->name, a->name)) {
-			perf_pmu_update_alias(a, newalias);
-			perf_pmu_free_alias(newalias);
-			return true;
-		}
+	if (a) {
+		perf_pmu_update_alias(a, newalias);
+		perf_pmu_free_alias(newalias);
+		return true;
 	}
 	return false;
 }
 
-static int __perf_pmu__new_alias(struct list_head *list, char *dir, char *name,
+static int __perf_pmu__new_alias(struct perf_pmu *pmu, char *dir, char *name,
 				 char *desc, char *val,
 				 char *long_desc, char *topic,
 				 char *unit, char *perpkg,
@@ -376,13 +452,13 @@ static int __perf_pmu__new_alias(struct list_head *list, char *dir, char *name,
 	alias->per_pkg = perpkg && sscanf(perpkg, "%d", &num) == 1 && num == 1;
 	alias->str = strdup(newval);
 
-	if (!perf_pmu_merge_alias(alias, list))
-		list_add_tail(&alias->list, list);
+	if (!perf_pmu_merge_alias(alias, pmu))
+		perf_pmu__add_alias(pmu, alias);
 
 	return 0;
 }
 
-static int perf_pmu__new_alias(struct list_head *list, char *dir, char *name, FILE *file)
+static int perf_pmu__new_alias(struct perf_pmu *pmu, char *dir, char *name, FILE *file)
 {
 	char buf[256];
 	int ret;
@@ -396,7 +472,7 @@ static int perf_pmu__new_alias(struct list_head *list, char *dir, char *name, FI
 	/* Remove trailing newline from sysfs file */
 	rtrim(buf);
 
-	return __perf_pmu__new_alias(list, dir, name, NULL, buf, NULL, NULL, NULL,
+	return __perf_pmu__new_alias(pmu, dir, name, NULL, buf, NULL, NULL, NULL,
 				     NULL, NULL, NULL);
 }
 
@@ -421,7 +497,7 @@ static inline bool pmu_alias_info_file(char *name)
  * Process all the sysfs attributes located under the directory
  * specified in 'dir' parameter.
  */
-static int pmu_aliases_parse(char *dir, struct list_head *head)
+static int pmu_aliases_parse(char *dir, struct perf_pmu *pmu)
 {
 	struct dirent *evt_ent;
 	DIR *event_dir;
@@ -452,7 +528,7 @@ static int pmu_aliases_parse(char *dir, struct list_head *head)
 			continue;
 		}
 
-		if (perf_pmu__new_alias(head, dir, name, file) < 0)
+		if (perf_pmu__new_alias(pmu, dir, name, file) < 0)
 			pr_debug("Cannot set up %s\n", name);
 		fclose(file);
 	}
@@ -465,7 +541,7 @@ static int pmu_aliases_parse(char *dir, struct list_head *head)
  * Reading the pmu event aliases definition, which should be located at:
  * /sys/bus/event_source/devices/<dev>/events as sysfs group attributes.
  */
-static int pmu_aliases(const char *name, struct list_head *head)
+static int pmu_aliases(const char *name, struct perf_pmu *pmu)
 {
 	struct stat st;
 	char path[PATH_MAX];
@@ -480,7 +556,7 @@ static int pmu_aliases(const char *name, struct list_head *head)
 	if (stat(path, &st) < 0)
 		return 0;	 /* no error if 'events' does not exist */
 
-	if (pmu_aliases_parse(path, head))
+	if (pmu_aliases_parse(path, pmu))
 		return -1;
 
 	return 0;
@@ -705,7 +781,7 @@ struct pmu_events_map *perf_pmu__find_map(struct perf_pmu *pmu)
  * to the current running CPU. Then, add all PMU events from that table
  * as aliases.
  */
-static void pmu_add_cpu_aliases(struct list_head *head, struct perf_pmu *pmu)
+static void pmu_add_cpu_aliases(struct perf_pmu *pmu)
 {
 	int i;
 	struct pmu_events_map *map;
@@ -747,7 +823,7 @@ static void pmu_add_cpu_aliases(struct list_head *head, struct perf_pmu *pmu)
 
 new_alias:
 		/* need type casts to override 'const' */
-		__perf_pmu__new_alias(head, NULL, (char *)pe->name,
+		__perf_pmu__new_alias(pmu, NULL, (char *)pe->name,
 				(char *)pe->desc, (char *)pe->event,
 				(char *)pe->long_desc, (char *)pe->topic,
 				(char *)pe->unit, (char *)pe->perpkg,
@@ -775,50 +851,492 @@ static int pmu_max_precise(const char *name)
 	return max_precise;
 }
 
-static struct perf_pmu *pmu_lookup(const char *name)
+/* Free what was read of pmu, to read it again */
+static void perf_pmu__purge(struct perf_pmu *pmu)
 {
-	struct perf_pmu *pmu;
-	LIST_HEAD(format);
-	LIST_HEAD(aliases);
-	__u32 type;
+	struct perf_pmu_format *format, *f;
+	struct perf_pmu_alias *alias, *a;
 
-	/*
-	 * The pmu data we store & need consists of the pmu
-	 * type value and format definitions. Load both right
-	 * now.
-	 */
-	if (pmu_format(name, &format))
-		return NULL;
+	list_for_each_entry_safe(format, f, &pmu->format, list) {
+		list_del(&format->list);
+		zfree(&format->name);
+		free(format);
+	}
 
-	/*
-	 * Check the type first to avoid unnecessary work.
-	 */
-	if (pmu_type(name, &type))
-		return NULL;
+	list_for_each_entry_safe(alias, a, &pmu->aliases, list) {
+		list_del(&alias->list);
+		perf_pmu_free_alias(alias);
+	}
 
-	if (pmu_aliases(name, &aliases))
+	zfree(&pmu->alias_hash);
+	pmu->alias_hash_bits = 0;
+	pmu->nr_aliases = 0;
+	cpu_map__put(pmu->cpus);
+	pmu->cpus = NULL;
+}
+
+/*
+ * What pmu_lookup() reads from sysfs, less the aliases of the JSON
+ * tables, is kept in ~/.cache/perf/pmu/<name> so that the many short
+ * lived perf invocations of monitoring agents don't read and parse the
+ * hundreds of PMU format and event files again:
+ *
+ *   struct pmu_cache_header
+ *   u32 type, s32 max_precise, u8 is_uncore, str cpus
+ *   u32 nr_formats, then name, value and bits of each
+ *   u32 nr_aliases, then each alias with its terms
+ *
+ * A str is a u32 length, PMU_CACHE_NULL for NULL, and its bytes. The
+ * cache is only used for the kernel and boot it was written in, when the
+ * sysfs directory of the PMU is as old as it was.
+ */
+#define PMU_CACHE_DIR		"/.cache/perf/pmu"
+#define PMU_CACHE_MAGIC		0x4548434143554d50ULL	/* "PMUCACHE" */
+#define PMU_CACHE_VERSION	1
+#define PMU_CACHE_NULL		((u32)~0U)
+
+struct pmu_cache_header {
+	u64	magic;
+	u32	version;
+	u32	__reserved;
+	u64	mtime_sec;
+	u64	mtime_nsec;
+	char	boot_id[40];
+	char	release[72];
+};
+
+struct pmu_cache_buf {
+	char	*data;
+	size_t	size;
+	size_t	alloc;
+	bool	err;
+};
+
+struct pmu_cache_cursor {
+	const char *p;
+	const char *end;
+};
+
+static bool pmu_cache__disabled;
+
+/* The header of the caches of this kernel and boot, false if none can be used */
+static bool pmu_cache__key(const char *name, struct pmu_cache_header *hdr)
+{
+	static struct pmu_cache_header key;
+	static bool key_read;
+	const char *sysfs = sysfs__mountpoint();
+	char path[PATH_MAX];
+	struct utsname uts;
+	struct stat st;
+	char *boot_id;
+	size_t len;
+
+	if (pmu_cache__disabled || !sysfs || !*name || *name == '.' ||
+	    strchr(name, '/'))
+		return false;
+
+	if (!key_read) {
+		key_read = true;
+		key.magic   = PMU_CACHE_MAGIC;
+		key.version = PMU_CACHE_VERSION;
+		if (uname(&uts) < 0 ||
+		    filename__read_str("/proc/sys/kernel/random/boot_id",
+				       &boot_id, &len)) {
+			pmu_cache__disabled = true;
+			return false;
+		}
+		scnprintf(key.boot_id, sizeof(key.boot_id), "%.*s",
+			  (int)len, boot_id);
+		rtrim(key.boot_id);
+		free(boot_id);
+		scnprintf(key.release, sizeof(key.release), "%s", uts.release);
+	}
+
+	snprintf(path, PATH_MAX, "%s" EVENT_SOURCE_DEVICE_PATH "%s", sysfs, name);
+	if (stat(path, &st) < 0)
+		return false;
+
+	*hdr = key;
+	hdr->mtime_sec  = st.st_mtim.tv_sec;
+	hdr->mtime_nsec = st.st_mtim.tv_nsec;
+	return true;
+}
+
+static char *pmu_cache__filename(const char *name, char *bf, size_t size)
+{
+	const char *home = getenv("HOME");
+
+	if (!home || !*home)
 		return NULL;
 
+	if (name)
+		scnprintf(bf, size, "%s" PMU_CACHE_DIR "/%s", home, name);
+	else
+		scnprintf(bf, size, "%s" PMU_CACHE_DIR, home);
+	return bf;
+}
+
+static void pmu_cache__put(struct pmu_cache_buf *b, const void *p, size_t size)
+{
+	if (b->err)
+		return;
+
+	if (b->size + size > b->alloc) {
+		size_t alloc = max(b->alloc * 2, b->size + size + 4096);
+		char *data = realloc(b->data, alloc);
+
+		if (data == NULL) {
+			b->err = true;
+			return;
+		}
+		b->data  = data;
+		b->alloc = alloc;
+	}
+
+	memcpy(b->data + b->size, p, size);
+	b->size += size;
+}
+
+static void pmu_cache__put_u32(struct pmu_cache_buf *b, u32 val)
+{
+	pmu_cache__put(b, &val, sizeof(val));
+}
+
+static void pmu_cache__put_str(struct pmu_cache_buf *b, const char *s)
+{
+	u32 len = s ? strlen(s) : PMU_CACHE_NULL;
+
+	pmu_cache__put_u32(b, len);
+	if (s)
+		pmu_cache__put(b, s, len);
+}
+
+static int pmu_cache__get(struct pmu_cache_cursor *c, void *p, size_t size)
+{
+	if ((size_t)(c->end - c->p) < size)
+		return -1;
+
+	memcpy(p, c->p, size);
+	c->p += size;
+	return 0;
+}
+
+static int pmu_cache__get_u32(struct pmu_cache_cursor *c, u32 *val)
+{
+	return pmu_cache__get(c, val, sizeof(*val));
+}
+
+static int pmu_cache__get_str(struct pmu_cache_cursor *c, char **s)
+{
+	u32 len;
+
+	*s = NULL;
+	if (pmu_cache__get_u32(c, &len))
+		return -1;
+	if (len == PMU_CACHE_NULL)
+		return 0;
+	if ((size_t)(c->end - c->p) < len)
+		return -1;
+
+	*s = strndup(c->p, len);
+	if (*s == NULL)
+		return -1;
+	c->p += len;
+	return 0;
+}
+
+static void pmu_cache__put_alias(struct pmu_cache_buf *b,
+				 struct perf_pmu_alias *alias)
+{
+	struct parse_events_term *term;
+	u32 nr_terms = 0;
+	u8 flags[2] = { alias->per_pkg, alias->snapshot, };
+
+	pmu_cache__put_str(b, alias->name);
+	pmu_cache__put_str(b, alias->desc);
+	pmu_cache__put_str(b, alias->long_desc);
+	pmu_cache__put_str(b, alias->topic);
+	pmu_cache__put_str(b, alias->str);
+	pmu_cache__put_str(b, alias->metric_expr);
+	pmu_cache__put_str(b, alias->metric_name);
+	pmu_cache__put(b, alias->unit, sizeof(alias->unit));
+	pmu_cache__put(b, &alias->scale, sizeof(alias->scale));
+	pmu_cache__put(b, flags, sizeof(flags));
+
+	list_for_each_entry(term, &alias->terms, list)
+		nr_terms++;
+	pmu_cache__put_u32(b, nr_terms);
+
+	list_for_each_entry(term, &alias->terms, list) {
+		u8 no_value = term->no_value;
+
+		/* only the sysfs terms are cached, none has an array */
+		if (term->array.nr_ranges)
+			b->err = true;
+
+		pmu_cache__put_str(b, term->config);
+		pmu_cache__put_u32(b, term->type_term);
+		pmu_cache__put_u32(b, term->type_val);
+		pmu_cache__put(b, &no_value, sizeof(no_value));
+		if (term->type_val == PARSE_EVENTS__TERM_TYPE_STR)
+			pmu_cache__put_str(b, term->val.str);
+		else
+			pmu_cache__put(b, &term->val.num, sizeof(term->val.num));
+	}
+}
+
+static int pmu_cache__get_alias(struct pmu_cache_cursor *c,
+				struct perf_pmu *pmu)
+{
+	struct perf_pmu_alias *alias;
+	u32 i, nr_terms;
+	u8 flags[2];
+
+	alias = zalloc(sizeof(*alias));
+	if (!alias)
+		return -1;
+
+	INIT_LIST_HEAD(&alias->terms);
+	if (pmu_cache__get_str(c, &alias->name) || alias->name == NULL ||
+	    pmu_cache__get_str(c, &alias->desc) ||
+	    pmu_cache__get_str(c, &alias->long_desc) ||
+	    pmu_cache__get_str(c, &alias->topic) ||
+	    pmu_cache__get_str(c, &alias->str) ||
+	    pmu_cache__get_str(c, &alias->metric_expr) ||
+	    pmu_cache__get_str(c, &alias->metric_name) ||
+	    pmu_cache__get(c, alias->unit, sizeof(alias->unit)) ||
+	    pmu_cache__get(c, &alias->scale, sizeof(alias->scale)) ||
+	    pmu_cache__get(c, flags, sizeof(flags)) ||
+	    pmu_cache__get_u32(c, &nr_terms))
+		goto out_free;
+
+	alias->unit[sizeof(alias->unit) - 1] = '\0';
+	alias->per_pkg  = flags[0];
+	alias->snapshot = flags[1];
+
+	for (i = 0; i < nr_terms; i++) {
+		struct parse_events_term *term;
+		u32 type_term, type_val;
+		char *config, *str = NULL;
+		u8 no_value;
+		u64 num = 0;
+		int ret;
+
+		if (pmu_cache__get_str(c, &config) ||
+		    pmu_cache__get_u32(c, &type_term) ||
+		    pmu_cache__get_u32(c, &type_val) ||
+		    pmu_cache__get(c, &no_value, sizeof(no_value)))
+			goto out_free;
+
+		if (type_val == PARSE_EVENTS__TERM_TYPE_STR) {
+			if (pmu_cache__get_str(c, &str) || str == NULL)
+				goto out_free;
+			ret = parse_events_term__str(&term, type_term, config,
+						     str, NULL, NULL);
+		} else {
+			if (pmu_cache__get(c, &num, sizeof(num)))
+				goto out_free;
+			ret = parse_events_term__num(&term, type_term, config,
+						     num, no_value, NULL, NULL);
+		}
+		if (ret)
+			goto out_free;
+		list_add_tail(&term->list, &alias->terms);
+	}
+
+	perf_pmu__add_alias(pmu, alias);
+	return 0;
+
+out_free:
+	perf_pmu_free_alias(alias);
+	return -1;
+}
+
+/* Returns 0 if pmu was read back from its cache */
+static int pmu_cache__read(struct perf_pmu *pmu)
+{
+	struct pmu_cache_header key, *hdr;
+	struct pmu_cache_cursor c;
+	char filename[PATH_MAX];
+	u32 i, nr_formats, nr_aliases;
+	char *buf = NULL, *cpus;
+	size_t size;
+	u8 is_uncore;
+
+	if (!pmu_cache__key(pmu->name, &key) ||
+	    !pmu_cache__filename(pmu->name, filename, sizeof(filename)) ||
+	    filename__read_str(filename, &buf, &size))
+		return -1;
+
+	hdr = (struct pmu_cache_header *)buf;
+	if (size < sizeof(*hdr) || memcmp(hdr, &key, sizeof(key)))
+		goto out_stale;
+
+	c.p   = buf + sizeof(*hdr);
+	c.end = buf + size;
+
+	if (pmu_cache__get_u32(&c, &pmu->type) ||
+	    pmu_cache__get(&c, &pmu->max_precise, sizeof(pmu->max_precise)) ||
+	    pmu_cache__get(&c, &is_uncore, sizeof(is_uncore)) ||
+	    pmu_cache__get_str(&c, &cpus))
+		goto out_stale;
+
+	pmu->is_uncore = is_uncore;
+	if (cpus) {
+		pmu->cpus = cpu_map__new(cpus);
+		free(cpus);
+		if (pmu->cpus == NULL)
+			goto out_stale;
+	}
+
+	if (pmu_cache__get_u32(&c, &nr_formats))
+		goto out_stale;
+
+	for (i = 0; i < nr_formats; i++) {
+		DECLARE_BITMAP(bits, PERF_PMU_FORMAT_BITS);
+		char *name;
+		u32 value;
+		int err;
+
+		if (pmu_cache__get_str(&c, &name) || name == NULL)
+			goto out_stale;
+		err = pmu_cache__get_u32(&c, &value) ||
+		      pmu_cache__get(&c, bits, sizeof(bits)) ||
+		      perf_pmu__new_format(&pmu->format, name, value, bits);
+		free(name);
+		if (err)
+			goto out_stale;
+	}
+
+	if (pmu_cache__get_u32(&c, &nr_aliases))
+		goto out_stale;
+
+	for (i = 0; i < nr_aliases; i++) {
+		if (pmu_cache__get_alias(&c, pmu))
+			goto out_stale;
+	}
+
+	if (c.p != c.end)
+		goto out_stale;
+
+	free(buf);
+	return 0;
+
+out_stale:
+	pr_debug("Ignoring stale PMU cache %s\n", filename);
+	perf_pmu__purge(pmu);
+	free(buf);
+	return -1;
+}
+
+static void pmu_cache__write(struct perf_pmu *pmu)
+{
+	struct pmu_cache_buf b = { .err = false, };
+	struct pmu_cache_header hdr;
+	struct perf_pmu_format *format;
+	struct perf_pmu_alias *alias;
+	char filename[PATH_MAX], tmpname[PATH_MAX];
+	char cpus[4096] = "";
+	u8 is_uncore = pmu->is_uncore;
+	u32 nr = 0;
+	int fd;
+
+	if (!pmu_cache__key(pmu->name, &hdr) ||
+	    !pmu_cache__filename(NULL, filename, sizeof(filename)) ||
+	    mkdir_p(filename, 0755) ||
+	    !pmu_cache__filename(pmu->name, filename, sizeof(filename)))
+		return;
+
+	if (pmu->cpus &&
+	    cpu_map__snprint(pmu->cpus, cpus, sizeof(cpus)) >= sizeof(cpus) - 1)
+		return;
+
+	pmu_cache__put(&b, &hdr, sizeof(hdr));
+	pmu_cache__put_u32(&b, pmu->type);
+	pmu_cache__put(&b, &pmu->max_precise, sizeof(pmu->max_precise));
+	pmu_cache__put(&b, &is_uncore, sizeof(is_uncore));
+	pmu_cache__put_str(&b, pmu->cpus ? cpus : NULL);
+
+	list_for_each_entry(format, &pmu->format, list)
+		nr++;
+	pmu_cache__put_u32(&b, nr);
+	list_for_each_entry(format, &pmu->format, list) {
+		pmu_cache__put_str(&b, format->name);
+		pmu_cache__put_u32(&b, format->value);
+		pmu_cache__put(&b, format->bits, sizeof(format->bits));
+	}
+
+	pmu_cache__put_u32(&b, pmu->nr_aliases);
+	list_for_each_entry(alias, &pmu->aliases, list)
+		pmu_cache__put_alias(&b, alias);
+
+	if (b.err)
+		goto out_free;
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto out_free;
+
+	if (write(fd, b.data, b.size) != (ssize_t)b.size || close(fd) ||
+	    rename(tmpname, filename))
+		unlink(tmpname);
+out_free:
+	free(b.data);
+}
+
+static struct perf_pmu *pmu_lookup(const char *name)
+{
+	struct perf_pmu *pmu;
+
 	pmu = zalloc(sizeof(*pmu));
 	if (!pmu)
 		return NULL;
 
-	pmu->cpus = pmu_cpumask(name);
-	pmu->name = strdup(name);
-	pmu->type = type;
-	pmu->is_uncore = pmu_is_uncore(name);
-	pmu->max_precise = pmu_max_precise(name);
-	pmu_add_cpu_aliases(&aliases, pmu);
-
 	INIT_LIST_HEAD(&pmu->format);
 	INIT_LIST_HEAD(&pmu->aliases);
-	list_splice(&format, &pmu->format);
-	list_splice(&aliases, &pmu->aliases);
+	pmu->name = strdup(name);
+	if (!pmu->name)
+		goto out_free;
+
+	if (pmu_cache__read(pmu)) {
+		/*
+		 * The pmu data we store & need consists of the pmu
+		 * type value and format definitions. Load both right
+		 * now.
+		 */
+		if (pmu_format(name, &pmu->format))
+			goto out_purge;
+
+		/*
+		 * Check the type first to avoid unnecessary work.
+		 */
+		if (pmu_type(name, &pmu->type))
+			goto out_purge;
+
+		if (pmu_aliases(name, pmu))
+			goto out_purge;
+
+		pmu->cpus = pmu_cpumask(name);
+		pmu->is_uncore = pmu_is_uncore(name);
+		pmu->max_precise = pmu_max_precise(name);
+		pmu_cache__write(pmu);
+	}
+
+	pmu_add_cpu_aliases(pmu);
 	list_add_tail(&pmu->list, &pmus);
 
 	pmu->default_config = perf_pmu__get_default_config(pmu);
 
 	return pmu;
+
+out_purge:
+	perf_pmu__purge(pmu);
+out_free:
+	free(pmu->name);
+	free(pmu);
+	return NULL;
 }
 
 static struct perf_pmu *pmu_find(const char *name)
@@ -1119,7 +1637,6 @@ int perf_pmu__config(struct perf_pmu *pmu, struct perf_event_attr *attr,
 static struct perf_pmu_alias *pmu_find_alias(struct perf_pmu *pmu,
 					     struct parse_events_term *term)
 {
-	struct perf_pmu_alias *alias;
 	char *name;
 
 	if (parse_events__is_hardcoded_term(term))
@@ -1139,11 +1656,7 @@ static struct perf_pmu_alias *pmu_find_alias(struct perf_pmu *pmu,
 		return NULL;
 	}
 
-	list_for_each_entry(alias, &pmu->aliases, list) {
-		if (!strcasecmp(alias->name, name))
-			return alias;
-	}
-	return NULL;
+	return perf_pmu__find_alias(pmu, name);
 }
 
 
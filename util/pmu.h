@@ -31,6 +31,10 @@ struct perf_pmu {
 	struct cpu_map *cpus;
 	struct list_head format;  /* HEAD struct perf_pmu_format -> list */
 	struct list_head aliases; /* HEAD struct perf_pmu_alias -> list */
+	/* of the aliases by case insensitive name, NULL until allocated */
+	struct hlist_head *alias_hash;
+	u32 alias_hash_bits;
+	u32 nr_aliases;
 	struct list_head list;    /* ELEM */
 };
 
@@ -53,6 +57,7 @@ struct perf_pmu_alias {
 	char *str;
 	struct list_head terms; /* HEAD struct parse_events_term -> list */
 	struct list_head list;  /* ELEM */
+	struct hlist_node hash;	/* in perf_pmu->alias_hash */
 	char unit[UNIT_MAX_LEN+1];
 	double scale;
 	bool per_pkg;
@@ -498,11 +498,17 @@ static struct debuginfo *open_debuginfo(const char *module, struct nsinfo *nsi,
 	return ret;
 }
 
-/* For caching the last debuginfo */
+/*
+ * For caching the last debuginfo: the probes of a batch are mostly in the
+ * same binary, reusing its libdw handle reuses the CUs and line tables it
+ * has already read.
+ */
 static struct debuginfo *debuginfo_cache;
 static char *debuginfo_cache_path;
+static struct nsinfo *debuginfo_cache_nsi;
 
-static struct debuginfo *debuginfo_cache__open(const char *module, bool silent)
+static struct debuginfo *debuginfo_cache__open(const char *module,
+					       struct nsinfo *nsi, bool silent)
 {
 	const char *path = module;
 
@@ -510,21 +516,24 @@ static struct debuginfo *debuginfo_cache__open(const char *module, bool silent)
 	if (!module)
 		path = "kernel";
 
-	if (debuginfo_cache_path && !strcmp(debuginfo_cache_path, path))
+	if (debuginfo_cache_path && !strcmp(debuginfo_cache_path, path) &&
+	    debuginfo_cache_nsi == nsi)
 		goto out;
 
 	/* Copy module path */
+	debuginfo__delete(debuginfo_cache);
+	debuginfo_cache = NULL;
+	nsinfo__zput(debuginfo_cache_nsi);
 	free(debuginfo_cache_path);
 	debuginfo_cache_path = strdup(path);
-	if (!debuginfo_cache_path) {
-		debuginfo__delete(debuginfo_cache);
-		debuginfo_cache = NULL;
+	if (!debuginfo_cache_path)
 		goto out;
-	}
 
-	debuginfo_cache = open_debuginfo(module, NULL, silent);
+	debuginfo_cache = open_debuginfo(module, nsi, silent);
 	if (!debuginfo_cache)
 		zfree(&debuginfo_cache_path);
+	else
+		debuginfo_cache_nsi = nsinfo__get(nsi);
 out:
 	return debuginfo_cache;
 }
@@ -533,6 +542,7 @@ static void debuginfo_cache__exit(void)
 {
 	debuginfo__delete(debuginfo_cache);
 	debuginfo_cache = NULL;
+	nsinfo__zput(debuginfo_cache_nsi);
 	zfree(&debuginfo_cache_path);
 }
 
@@ -608,7 +618,7 @@ static int find_perf_probe_point_from_dwarf(struct probe_trace_point *tp,
 	pr_debug("try to find information at %" PRIx64 " in %s\n", addr,
 		 tp->module ? : "kernel");
 
-	dinfo = debuginfo_cache__open(tp->module, verbose <= 0);
+	dinfo = debuginfo_cache__open(tp->module, NULL, verbose <= 0);
 	if (dinfo)
 		ret = debuginfo__find_probe_point(dinfo,
 						 (unsigned long)addr, pp);
@@ -837,7 +847,7 @@ static int try_to_find_probe_trace_events(struct perf_probe_event *pev,
 	struct debuginfo *dinfo;
 	int ntevs, ret = 0;
 
-	dinfo = open_debuginfo(pev->target, pev->nsi, !need_dwarf);
+	dinfo = debuginfo_cache__open(pev->target, pev->nsi, !need_dwarf);
 	if (!dinfo) {
 		if (need_dwarf)
 			return -ENOENT;
@@ -874,8 +884,6 @@ static int try_to_find_probe_trace_events(struct perf_probe_event *pev,
 		}
 	}
 
-	debuginfo__delete(dinfo);
-
 	if (ntevs == 0)	{	/* No error but failed to find probe point. */
 		pr_warning("Probe point '%s' not found.\n",
 			   synthesize_perf_probe_point(&pev->point));
@@ -2756,44 +2764,209 @@ static int __open_probe_file_and_namelist(bool uprobe,
 	return fd;
 }
 
-static int __add_probe_trace_events(struct perf_probe_event *pev,
-				     struct probe_trace_event *tevs,
-				     int ntevs, bool allow_suffix)
+/*
+ * The events of a batch are written to the kprobe/uprobe_events with a
+ * write per PROBE_ADDER_BUFSIZE bytes of commands instead of one per
+ * event, and are added to the probe cache of their target in one
+ * transaction instead of one per perf_probe_event.
+ */
+#define PROBE_ADDER_BUFSIZE	(64 * 1024)
+
+struct probe_adder {
+	int			fd[2];
+	struct strlist		*namelist[2];
+	struct strbuf		buf[2];
+	/* the mount namespace the pending commands are written in */
+	struct nsinfo		*nsi;
+	/* the last uprobe event queued, to warn about old kernels */
+	struct probe_trace_event *last_uprobe;
+	struct probe_cache	*cache;
+	char			*cache_target;
+	struct nsinfo		*cache_nsi;
+};
+
+static void probe_adder__init(struct probe_adder *adder)
+{
+	int up;
+
+	memset(adder, 0, sizeof(*adder));
+	for (up = 0; up < 2; up++) {
+		adder->fd[up] = -1;
+		strbuf_init(&adder->buf[up], 0);
+	}
+}
+
+static int probe_adder__flush(struct probe_adder *adder)
 {
-	int i, fd[2] = {-1, -1}, up, ret;
-	struct probe_trace_event *tev = NULL;
-	struct probe_cache *cache = NULL;
-	struct strlist *namelist[2] = {NULL, NULL};
 	struct nscookie nsc;
+	int up, ret = 0;
 
-	up = pev->uprobes ? 1 : 0;
-	fd[up] = __open_probe_file_and_namelist(up, &namelist[up]);
-	if (fd[up] < 0)
-		return fd[up];
+	nsinfo__mountns_enter(adder->nsi, &nsc);
+	for (up = 0; up < 2; up++) {
+		if (!adder->buf[up].len)
+			continue;
+		if (!ret)
+			ret = probe_file__add_events(adder->fd[up],
+						     adder->buf[up].buf,
+						     adder->buf[up].len);
+		if (ret == -EINVAL && up)
+			warn_uprobe_event_compat(adder->last_uprobe);
+		strbuf_setlen(&adder->buf[up], 0);
+	}
+	nsinfo__mountns_exit(&nsc);
+
+	return ret;
+}
+
+static int probe_adder__queue(struct probe_adder *adder,
+			      struct perf_probe_event *pev,
+			      struct probe_trace_event *tev)
+{
+	int ret, up = tev->uprobes ? 1 : 0;
+	char *cmd;
+
+	if (adder->nsi != pev->nsi) {
+		ret = probe_adder__flush(adder);
+		if (ret < 0)
+			return ret;
+		nsinfo__zput(adder->nsi);
+		adder->nsi = nsinfo__get(pev->nsi);
+	}
+
+	cmd = synthesize_probe_trace_command(tev);
+	if (!cmd) {
+		pr_debug("Failed to synthesize probe trace event.\n");
+		return -EINVAL;
+	}
+
+	pr_debug("Writing event: %s\n", cmd);
+	ret = strbuf_addf(&adder->buf[up], "%s\n", cmd);
+	free(cmd);
+	if (ret < 0)
+		return ret;
+
+	if (up)
+		adder->last_uprobe = tev;
+
+	if (adder->buf[up].len >= PROBE_ADDER_BUFSIZE)
+		return probe_adder__flush(adder);
+	return 0;
+}
+
+/* Commit the cache entries of the events written so far */
+static int probe_adder__commit(struct probe_adder *adder)
+{
+	int ret = 0;
+
+	if (!adder->cache)
+		return 0;
+
+	ret = probe_cache__commit(adder->cache);
+	if (ret < 0)
+		pr_warning("Failed to add event to probe cache\n");
+	probe_cache__delete(adder->cache);
+	adder->cache = NULL;
+	zfree(&adder->cache_target);
+	nsinfo__zput(adder->cache_nsi);
+	return ret;
+}
+
+static int probe_adder__add_cache(struct probe_adder *adder,
+				  struct perf_probe_event *pev,
+				  struct probe_trace_event *tevs, int ntevs)
+{
+	const char *target = pev->target ?: "";
+	int ret;
+
+	if (adder->cache && (adder->cache_nsi != pev->nsi ||
+			     strcmp(adder->cache_target, target))) {
+		/* The events of the last target must be written first */
+		ret = probe_adder__flush(adder);
+		if (ret < 0)
+			return ret;
+		probe_adder__commit(adder);
+	}
+
+	if (!adder->cache) {
+		adder->cache = probe_cache__new(pev->target, pev->nsi);
+		if (!adder->cache)
+			goto error;
+		adder->cache_target = strdup(target);
+		adder->cache_nsi = nsinfo__get(pev->nsi);
+	}
+
+	if (probe_cache__add_entry(adder->cache, pev, tevs, ntevs) < 0)
+		goto error;
+	return 0;
+
+error:
+	/* Like a failed commit, this doesn't fail the adding of the events */
+	pr_warning("Failed to add event to probe cache\n");
+	return 0;
+}
+
+/* Write the pending events, then commit their cache entries if it worked */
+static int probe_adder__exit(struct probe_adder *adder, int ret)
+{
+	int up;
+
+	if (ret == 0)
+		ret = probe_adder__flush(adder);
+	if (ret == 0)
+		probe_adder__commit(adder);
+
+	probe_cache__delete(adder->cache);
+	free(adder->cache_target);
+	nsinfo__zput(adder->cache_nsi);
+	nsinfo__zput(adder->nsi);
+	for (up = 0; up < 2; up++) {
+		strbuf_release(&adder->buf[up]);
+		strlist__delete(adder->namelist[up]);
+		if (adder->fd[up] >= 0)
+			close(adder->fd[up]);
+	}
+	return ret;
+}
+
+/* Open the kprobe/uprobe_events if not yet */
+static int probe_adder__open(struct probe_adder *adder, int up)
+{
+	if (adder->fd[up] == -1)
+		adder->fd[up] = __open_probe_file_and_namelist(up,
+							&adder->namelist[up]);
+	return adder->fd[up] < 0 ? adder->fd[up] : 0;
+}
+
+static int __add_probe_trace_events(struct probe_adder *adder,
+				    struct perf_probe_event *pev,
+				    struct probe_trace_event *tevs,
+				    int ntevs, bool allow_suffix)
+{
+	struct probe_trace_event *tev;
+	int i, up, ret;
+
+	ret = probe_adder__open(adder, pev->uprobes ? 1 : 0);
+	if (ret < 0)
+		return ret;
 
-	ret = 0;
 	for (i = 0; i < ntevs; i++) {
 		tev = &tevs[i];
 		up = tev->uprobes ? 1 : 0;
-		if (fd[up] == -1) {	/* Open the kprobe/uprobe_events */
-			fd[up] = __open_probe_file_and_namelist(up,
-								&namelist[up]);
-			if (fd[up] < 0)
-				goto close_out;
-		}
+		ret = probe_adder__open(adder, up);
+		if (ret < 0)
+			break;
+
 		/* Skip if the symbol is out of .text or blacklisted */
 		if (!tev->point.symbol && !pev->uprobes)
 			continue;
 
 		/* Set new name for tev (and update namelist) */
-		ret = probe_trace_event__set_name(tev, pev, namelist[up],
+		ret = probe_trace_event__set_name(tev, pev, adder->namelist[up],
 						  allow_suffix);
 		if (ret < 0)
 			break;
 
-		nsinfo__mountns_enter(pev->nsi, &nsc);
-		ret = probe_file__add_event(fd[up], tev);
-		nsinfo__mountns_exit(&nsc);
+		ret = probe_adder__queue(adder, pev, tev);
 		if (ret < 0)
 			break;
 
@@ -2805,23 +2978,9 @@ static int __add_probe_trace_events(struct perf_probe_event *pev,
 		 */
 		allow_suffix = true;
 	}
-	if (ret == -EINVAL && pev->uprobes)
-		warn_uprobe_event_compat(tev);
-	if (ret == 0 && probe_conf.cache) {
-		cache = probe_cache__new(pev->target, pev->nsi);
-		if (!cache ||
-		    probe_cache__add_entry(cache, pev, tevs, ntevs) < 0 ||
-		    probe_cache__commit(cache) < 0)
-			pr_warning("Failed to add event to probe cache\n");
-		probe_cache__delete(cache);
-	}
+	if (ret == 0 && probe_conf.cache)
+		ret = probe_adder__add_cache(adder, pev, tevs, ntevs);
 
-close_out:
-	for (up = 0; up < 2; up++) {
-		strlist__delete(namelist[up]);
-		if (fd[up] >= 0)
-			close(fd[up]);
-	}
 	return ret;
 }
 
@@ -3360,13 +3519,17 @@ int convert_perf_probe_events(struct perf_probe_event *pevs, int npevs)
 		/* Convert with or without debuginfo */
 		ret  = convert_to_probe_trace_events(&pevs[i], &pevs[i].tevs);
 		if (ret < 0)
-			return ret;
+			goto out;
 		pevs[i].ntevs = ret;
 	}
+	ret = 0;
+out:
 	/* This just release blacklist only if allocated */
 	kprobe_blacklist__release();
+	/* The debuginfo was kept open for the events after the first one */
+	debuginfo_cache__exit();
 
-	return 0;
+	return ret;
 }
 
 static int show_probe_trace_event(struct probe_trace_event *tev)
@@ -3417,17 +3580,20 @@ int show_probe_trace_events(struct perf_probe_event *pevs, int npevs)
 
 int apply_perf_probe_events(struct perf_probe_event *pevs, int npevs)
 {
+	struct probe_adder adder;
 	int i, ret = 0;
 
+	probe_adder__init(&adder);
+
 	/* Loop 2: add all events */
 	for (i = 0; i < npevs; i++) {
-		ret = __add_probe_trace_events(&pevs[i], pevs[i].tevs,
+		ret = __add_probe_trace_events(&adder, &pevs[i], pevs[i].tevs,
 					       pevs[i].ntevs,
 					       probe_conf.force_add);
 		if (ret < 0)
 			break;
 	}
-	return ret;
+	return probe_adder__exit(&adder, ret);
 }
 
 void cleanup_perf_probe_events(struct perf_probe_event *pevs, int npevs)
@@ -257,6 +257,28 @@ int probe_file__add_event(int fd, struct probe_trace_event *tev)
 	return ret;
 }
 
+/*
+ * Write the probe trace commands in buf, one per line, with one write: the
+ * kernel parses each line of it, applying the ones before a bad one.
+ */
+int probe_file__add_events(int fd, const char *buf, size_t len)
+{
+	char sbuf[STRERR_BUFSIZE];
+	ssize_t ret;
+
+	if (probe_event_dry_run || !len)
+		return 0;
+
+	ret = write(fd, buf, len);
+	if (ret < (ssize_t)len) {
+		ret = ret < 0 ? -errno : -EIO;
+		pr_warning("Failed to write events: %s\n",
+			   str_error_r(-ret, sbuf, sizeof(sbuf)));
+		return ret;
+	}
+	return 0;
+}
+
 static int __del_trace_probe_event(int fd, struct str_node *ent)
 {
 	char *p;
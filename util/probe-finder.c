@@ -43,6 +43,7 @@
 #include "probe-finder.h"
 #include "probe-file.h"
 #include "string2.h"
+#include "dwarf-index.h"
 
 /* Kprobe tracer basic type is up to u64 */
 #define MAX_BASIC_TYPE_BITS	64
@@ -104,8 +105,14 @@ static struct debuginfo *__debuginfo__new(const char *path)
 
 	if (debuginfo__init_offline_dwarf(dbg, path) < 0)
 		zfree(&dbg);
-	if (dbg)
+	if (dbg) {
 		pr_debug("Open Debuginfo file: %s\n", path);
+		dbg->path = strdup(path);
+		if (!dbg->path) {
+			debuginfo__delete(dbg);
+			return NULL;
+		}
+	}
 	return dbg;
 }
 
@@ -147,8 +154,10 @@ out:
 void debuginfo__delete(struct debuginfo *dbg)
 {
 	if (dbg) {
+		dwarf_index__delete(dbg->index);
 		if (dbg->dwfl)
 			dwfl_end(dbg->dwfl);
+		free(dbg->path);
 		free(dbg);
 	}
 }
@@ -1075,6 +1084,44 @@ static int pubname_search_cb(Dwarf *dbg, Dwarf_Global *gl, void *data)
 	return DWARF_CB_OK;
 }
 
+/*
+ * The CUs with a definition of func, from the index of the debuginfo, or
+ * -ENOENT to look in all the CUs.
+ */
+static int debuginfo__func_cus(struct debuginfo *dbg, const char *func,
+			       Dwarf_Off **cus)
+{
+	if (!dbg->index)
+		dbg->index = dwarf_index__new(dbg->dbg, dbg->mod, dbg->path);
+	if (!dbg->index)
+		return -ENOENT;
+
+	return dwarf_index__find_cus(dbg->index, func, cus);
+}
+
+/* Find the probe point in the CU of pf->cu_die */
+static int probe_finder__search_cu(struct probe_finder *pf)
+{
+	struct perf_probe_point *pp = &pf->pev->point;
+
+	/* Check if target file is included. */
+	if (pp->file)
+		pf->fname = cu_find_realpath(&pf->cu_die, pp->file);
+	else
+		pf->fname = NULL;
+
+	if (pp->file && !pf->fname)
+		return 0;
+
+	if (pp->function)
+		return find_probe_point_by_func(pf);
+	if (pp->lazy_line)
+		return find_probe_point_lazy(&pf->cu_die, pf);
+
+	pf->lno = pp->line;
+	return find_probe_point_by_line(pf);
+}
+
 static int debuginfo__find_probe_location(struct debuginfo *dbg,
 				  struct probe_finder *pf)
 {
@@ -1111,6 +1158,21 @@ static int debuginfo__find_probe_location(struct debuginfo *dbg,
 		}
 	}
 
+	/* Only the CUs defining the function */
+	if (pp->function) {
+		Dwarf_Off *cus;
+		int i, nr = debuginfo__func_cus(dbg, pp->function, &cus);
+
+		if (nr >= 0) {
+			for (i = 0; i < nr && ret >= 0; i++) {
+				if (dwarf_offdie(dbg->dbg, cus[i], &pf->cu_die))
+					ret = probe_finder__search_cu(pf);
+			}
+			free(cus);
+			goto found;
+		}
+	}
+
 	/* Loop on CUs (Compilation Unit) */
 	while (!dwarf_nextcu(dbg->dbg, off, &noff, &cuhl, NULL, NULL, NULL)) {
 		/* Get the DIE(Debugging Information Entry) of this CU */
@@ -1118,24 +1180,9 @@ static int debuginfo__find_probe_location(struct debuginfo *dbg,
 		if (!diep)
 			continue;
 
-		/* Check if target file is included. */
-		if (pp->file)
-			pf->fname = cu_find_realpath(&pf->cu_die, pp->file);
-		else
-			pf->fname = NULL;
-
-		if (!pp->file || pf->fname) {
-			if (pp->function)
-				ret = find_probe_point_by_func(pf);
-			else if (pp->lazy_line)
-				ret = find_probe_point_lazy(&pf->cu_die, pf);
-			else {
-				pf->lno = pp->line;
-				ret = find_probe_point_by_line(pf);
-			}
-			if (ret < 0)
-				break;
-		}
+		ret = probe_finder__search_cu(pf);
+		if (ret < 0)
+			break;
 		off = noff;
 	}
 
@@ -1751,6 +1798,28 @@ static int find_line_range_by_func(struct line_finder *lf)
 	return param.retval;
 }
 
+/* Find the line range in the CU of lf->cu_die */
+static int line_finder__search_cu(struct line_finder *lf)
+{
+	struct line_range *lr = lf->lr;
+
+	/* Check if target file is included. */
+	if (lr->file)
+		lf->fname = cu_find_realpath(&lf->cu_die, lr->file);
+	else
+		lf->fname = 0;
+
+	if (lr->file && !lf->fname)
+		return 0;
+
+	if (lr->function)
+		return find_line_range_by_func(lf);
+
+	lf->lno_s = lr->start;
+	lf->lno_e = lr->end;
+	return find_line_range_by_line(NULL, lf);
+}
+
 int debuginfo__find_line_range(struct debuginfo *dbg, struct line_range *lr)
 {
 	struct line_finder lf = {.lr = lr, .found = 0};
@@ -1777,6 +1846,21 @@ int debuginfo__find_line_range(struct debuginfo *dbg, struct line_range *lr)
 		}
 	}
 
+	/* Only the CUs defining the function */
+	if (lr->function) {
+		Dwarf_Off *cus;
+		int i, nr = debuginfo__func_cus(dbg, lr->function, &cus);
+
+		if (nr >= 0) {
+			for (i = 0; i < nr && !lf.found && ret >= 0; i++) {
+				if (dwarf_offdie(dbg->dbg, cus[i], &lf.cu_die))
+					ret = line_finder__search_cu(&lf);
+			}
+			free(cus);
+			goto found;
+		}
+	}
+
 	/* Loop on CUs (Compilation Unit) */
 	while (!lf.found && ret >= 0) {
 		if (dwarf_nextcu(dbg->dbg, off, &noff, &cuhl,
@@ -1788,21 +1872,7 @@ int debuginfo__find_line_range(struct debuginfo *dbg, struct line_range *lr)
 		if (!diep)
 			continue;
 
-		/* Check if target file is included. */
-		if (lr->file)
-			lf.fname = cu_find_realpath(&lf.cu_die, lr->file);
-		else
-			lf.fname = 0;
-
-		if (!lr->file || lf.fname) {
-			if (lr->function)
-				ret = find_line_range_by_func(&lf);
-			else {
-				lf.lno_s = lr->start;
-				lf.lno_e = lr->end;
-				ret = find_line_range_by_line(NULL, &lf);
-			}
-		}
+		ret = line_finder__search_cu(&lf);
 		off = noff;
 	}
 
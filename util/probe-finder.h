@@ -26,12 +26,17 @@ static inline int is_c_varname(const char *name)
 
 /* TODO: export debuginfo data structure even if no dwarf support */
 
+struct dwarf_index;
+
 /* debug information structure */
 struct debuginfo {
 	Dwarf		*dbg;
 	Dwfl_Module	*mod;
 	Dwfl		*dwfl;
 	Dwarf_Addr	bias;
+	char		*path;
+	/* the CUs of the functions, built on first use */
+	struct dwarf_index *index;
 };
 
 /* This also tries to open distro debuginfo */
@@ -3,11 +3,17 @@
 #include <structmember.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include "evlist.h"
 #include "callchain.h"
 #include "evsel.h"
 #include "event.h"
+#include "header.h"
 #include "cpumap.h"
 #include "print_binary.h"
 #include "thread_map.h"
@@ -49,6 +55,21 @@ int parse_callchain_record(const char *arg __maybe_unused,
 	return 0;
 }
 
+/*
+ * And these so that tp-format-cache.c doesn't drag build-id.c and
+ * kallsyms-cache.c in, the formats are then only kept for the process.
+ */
+int sysfs__sprintf_build_id(const char *root_dir __maybe_unused,
+			    char *sbuild_id __maybe_unused)
+{
+	return -1;
+}
+
+int kallsyms_cache__modules_hash(u64 *hash __maybe_unused)
+{
+	return -1;
+}
+
 /*
  * Support debug printing even though util/debug.c is not linked.  That means
  * implementing 'verbose' and 'eprintf'.
@@ -518,6 +539,7 @@ static PyObject *pyrf_event__new(union perf_event *event)
 {
 	struct pyrf_event *pevent;
 	PyTypeObject *ptype;
+	size_t size;
 
 	if ((event->header.type < PERF_RECORD_MMAP ||
 	     event->header.type > PERF_RECORD_SAMPLE) &&
@@ -526,9 +548,14 @@ static PyObject *pyrf_event__new(union perf_event *event)
 		return NULL;
 
 	ptype = pyrf_event__type[event->header.type];
-	pevent = PyObject_New(struct pyrf_event, ptype);
-	if (pevent != NULL)
-		memcpy(&pevent->event, event, event->header.size);
+	/* samples with stacks or long callchains don't fit in the union */
+	size = max(sizeof(*pevent), offsetof(struct pyrf_event, event) + event->header.size);
+	pevent = PyObject_Malloc(size);
+	if (pevent == NULL)
+		return PyErr_NoMemory();
+
+	PyObject_Init((PyObject *)pevent, ptype);
+	memcpy(&pevent->event, event, event->header.size);
 	return (PyObject *)pevent;
 }
 
@@ -825,6 +852,40 @@ static PyObject *pyrf_evsel__open(struct pyrf_evsel *pevsel,
 	return Py_None;
 }
 
+static PyObject *pyrf_evsel__mmap_self(struct pyrf_evsel *pevsel,
+				       PyObject *args __maybe_unused,
+				       PyObject *kwargs __maybe_unused)
+{
+	int err = perf_evsel__mmap_self(&pevsel->evsel);
+
+	if (err < 0) {
+		errno = -err;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *pyrf_evsel__read_self(struct pyrf_evsel *pevsel,
+				       PyObject *args __maybe_unused,
+				       PyObject *kwargs __maybe_unused)
+{
+	struct perf_counts_values count;
+	int err = perf_evsel__read_self(&pevsel->evsel, &count);
+
+	if (err < 0) {
+		errno = -err;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+
+	return Py_BuildValue("(KKK)", (unsigned long long)count.val,
+			     (unsigned long long)count.ena,
+			     (unsigned long long)count.run);
+}
+
 static PyMethodDef pyrf_evsel__methods[] = {
 	{
 		.ml_name  = "open",
@@ -832,6 +893,18 @@ static PyMethodDef pyrf_evsel__methods[] = {
 		.ml_flags = METH_VARARGS | METH_KEYWORDS,
 		.ml_doc	  = PyDoc_STR("open the event selector file descriptor table.")
 	},
+	{
+		.ml_name  = "mmap_self",
+		.ml_meth  = (PyCFunction)pyrf_evsel__mmap_self,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("map the page of an event opened for the calling thread, to read it with read_self() from userspace.")
+	},
+	{
+		.ml_name  = "read_self",
+		.ml_meth  = (PyCFunction)pyrf_evsel__read_self,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("read the (value, enabled, running) counts of an event opened for the calling thread.")
+	},
 	{ .ml_name = NULL, }
 };
 
@@ -1045,6 +1118,267 @@ end:
 	return Py_None;
 }
 
+/*
+ * The events read_batch() read from one mmap, left in the ring buffer
+ * until the batch is consumed, those straddling its end are copied.
+ */
+struct pyrf_batch_event {
+	union perf_event	*event;
+	bool			copied;
+};
+
+struct pyrf_event_batch {
+	PyObject_HEAD
+
+	struct pyrf_evlist	*pevlist;
+	struct perf_mmap	*md;
+	/* where the ring buffer is handed back to when consumed */
+	u64			end;
+	bool			consumed;
+	unsigned int		nr;
+	struct pyrf_batch_event	*events;
+};
+
+static void pyrf_event_batch__consume_md(struct pyrf_event_batch *batch)
+{
+	struct perf_mmap *md = batch->md;
+	u64 prev = md->prev;
+
+	if (batch->consumed)
+		return;
+
+	/* Leave what batches read after this one have in the ring buffer. */
+	md->prev = batch->end;
+	perf_mmap__consume(md);
+	md->prev = prev;
+	batch->consumed = true;
+}
+
+static void pyrf_event_batch__delete(struct pyrf_event_batch *batch)
+{
+	unsigned int i;
+
+	pyrf_event_batch__consume_md(batch);
+
+	for (i = 0; i < batch->nr; i++) {
+		if (batch->events[i].copied)
+			free(batch->events[i].event);
+	}
+	free(batch->events);
+	Py_XDECREF(batch->pevlist);
+	Py_TYPE(batch)->tp_free((PyObject*)batch);
+}
+
+static union perf_event *pyrf_event_batch__event(struct pyrf_event_batch *batch,
+						 Py_ssize_t i)
+{
+	if (i < 0 || i >= batch->nr) {
+		PyErr_SetString(PyExc_IndexError, "event index out of range");
+		return NULL;
+	}
+
+	if (batch->consumed) {
+		PyErr_SetString(PyExc_ValueError, "perf: batch already consumed");
+		return NULL;
+	}
+
+	return batch->events[i].event;
+}
+
+static Py_ssize_t pyrf_event_batch__length(PyObject *obj)
+{
+	struct pyrf_event_batch *batch = (void *)obj;
+
+	return batch->nr;
+}
+
+/* The event objects, and so their samples, are only made when asked for. */
+static PyObject *pyrf_event_batch__item(PyObject *obj, Py_ssize_t i)
+{
+	struct pyrf_event_batch *batch = (void *)obj;
+	struct perf_evlist *evlist = &batch->pevlist->evlist;
+	union perf_event *event = pyrf_event_batch__event(batch, i);
+	struct pyrf_event *pevent;
+	struct perf_evsel *evsel;
+	PyObject *pyevent;
+	int err;
+
+	if (event == NULL)
+		return NULL;
+
+	pyevent = pyrf_event__new(event);
+	if (pyevent == NULL) {
+		if (PyErr_Occurred())
+			return NULL;
+		/* not a type the module has an object for */
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	pevent = (struct pyrf_event *)pyevent;
+	evsel = perf_evlist__event2evsel(evlist, &pevent->event);
+	if (!evsel) {
+		Py_DECREF(pyevent);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	pevent->evsel = evsel;
+
+	err = perf_evsel__parse_sample(evsel, &pevent->event, &pevent->sample);
+	if (err) {
+		Py_DECREF(pyevent);
+		return PyErr_Format(PyExc_OSError,
+				    "perf: can't parse sample, err=%d", err);
+	}
+
+	return pyevent;
+}
+
+static PyObject *pyrf_event_batch__raw(struct pyrf_event_batch *batch,
+				       PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = { "index", NULL };
+	union perf_event *event;
+	Py_buffer view;
+	Py_ssize_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n", kwlist, &i))
+		return NULL;
+
+	event = pyrf_event_batch__event(batch, i);
+	if (event == NULL)
+		return NULL;
+
+	/* the view keeps a reference on the batch, and so on the mmap */
+	if (PyBuffer_FillInfo(&view, (PyObject *)batch, event,
+			      event->header.size, 1, PyBUF_FULL_RO) < 0)
+		return NULL;
+
+	return PyMemoryView_FromBuffer(&view);
+}
+
+static PyObject *pyrf_event_batch__consume(struct pyrf_event_batch *batch,
+					   PyObject *args __maybe_unused,
+					   PyObject *kwargs __maybe_unused)
+{
+	pyrf_event_batch__consume_md(batch);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyMethodDef pyrf_event_batch__methods[] = {
+	{
+		.ml_name  = "raw",
+		.ml_meth  = (PyCFunction)pyrf_event_batch__raw,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("a read only memoryview of an event in the ring buffer, valid until the batch is consumed.")
+	},
+	{
+		.ml_name  = "consume",
+		.ml_meth  = (PyCFunction)pyrf_event_batch__consume,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("hands the events back to the ring buffer, done when the batch is freed otherwise.")
+	},
+	{ .ml_name = NULL, }
+};
+
+static PySequenceMethods pyrf_event_batch__sequence_methods = {
+	.sq_length = pyrf_event_batch__length,
+	.sq_item   = pyrf_event_batch__item,
+};
+
+static char pyrf_event_batch__doc[] = PyDoc_STR("perf events read from a ring buffer.");
+
+static PyTypeObject pyrf_event_batch__type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "perf.event_batch",
+	.tp_basicsize	= sizeof(struct pyrf_event_batch),
+	.tp_dealloc	= (destructor)pyrf_event_batch__delete,
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= pyrf_event_batch__doc,
+	.tp_as_sequence	= &pyrf_event_batch__sequence_methods,
+	.tp_methods	= pyrf_event_batch__methods,
+};
+
+static int pyrf_event_batch__setup_types(void)
+{
+	return PyType_Ready(&pyrf_event_batch__type);
+}
+
+static PyObject *pyrf_evlist__read_batch(struct pyrf_evlist *pevlist,
+					 PyObject *args, PyObject *kwargs)
+{
+	struct perf_evlist *evlist = &pevlist->evlist;
+	static char *kwlist[] = { "cpu", "max_events", NULL };
+	struct pyrf_event_batch *batch;
+	int max_events = 1024, cpu;
+	union perf_event *event;
+	struct perf_mmap *md;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|i", kwlist,
+					 &cpu, &max_events))
+		return NULL;
+
+	md = get_md(evlist, cpu);
+	if (!md)
+		return NULL;
+
+	if (max_events <= 0 || perf_mmap__read_init(md) < 0)
+		goto end;
+
+	batch = PyObject_New(struct pyrf_event_batch, &pyrf_event_batch__type);
+	if (batch == NULL)
+		return NULL;
+
+	Py_INCREF(pevlist);
+	batch->pevlist	= pevlist;
+	batch->md	= md;
+	batch->nr	= 0;
+	batch->consumed	= false;
+	batch->events	= calloc(max_events, sizeof(*batch->events));
+	if (batch->events == NULL) {
+		/* nothing read, nothing to consume */
+		batch->consumed = true;
+		Py_DECREF(batch);
+		return PyErr_NoMemory();
+	}
+
+	while (batch->nr < (unsigned int)max_events &&
+	       (event = perf_mmap__read_event(md)) != NULL) {
+		struct pyrf_batch_event *bevent = &batch->events[batch->nr];
+
+		/* md->event_copy is reused by the next event straddling the end */
+		if (event == (union perf_event *)md->event_copy) {
+			union perf_event *copy = malloc(event->header.size);
+
+			if (copy == NULL)
+				break;
+			memcpy(copy, event, event->header.size);
+			event = copy;
+			bevent->copied = true;
+		}
+
+		bevent->event = event;
+		batch->nr++;
+	}
+
+	batch->end = md->prev;
+
+	if (batch->nr == 0) {
+		Py_DECREF(batch);
+		if (PyErr_Occurred())
+			return NULL;
+		goto end;
+	}
+
+	return (PyObject *)batch;
+end:
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
 static PyObject *pyrf_evlist__open(struct pyrf_evlist *pevlist,
 				   PyObject *args, PyObject *kwargs)
 {
@@ -1104,6 +1438,12 @@ static PyMethodDef pyrf_evlist__methods[] = {
 		.ml_flags = METH_VARARGS | METH_KEYWORDS,
 		.ml_doc	  = PyDoc_STR("reads an event.")
 	},
+	{
+		.ml_name  = "read_batch",
+		.ml_meth  = (PyCFunction)pyrf_evlist__read_batch,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("reads up to max_events events, left in the ring buffer until the batch is consumed.")
+	},
 	{ .ml_name = NULL, }
 };
 
@@ -1155,6 +1495,685 @@ static int pyrf_evlist__setup_types(void)
 	return PyType_Ready(&pyrf_evlist__type);
 }
 
+/*
+ * perf.session: the events of a perf.data file, read from a mmap of it
+ * with the header parsed here, as session.c and header.c would drag most
+ * of perf into the module.  Like ordered_events, the events of a round,
+ * up to a PERF_RECORD_FINISHED_ROUND, are queued and handed out in time
+ * order up to the last time of the round before.  Neither symbols nor
+ * threads are resolved, the samples have their ips.
+ */
+struct pyrf_session_event {
+	union perf_event	*event;
+	u64			time;
+	u64			seq;
+};
+
+struct pyrf_session {
+	PyObject_HEAD
+
+	struct perf_evlist	*evlist;
+	void			*base;
+	size_t			size;
+	/* the offsets of the data section not read yet */
+	u64			head;
+	u64			end;
+	bool			ordered;
+	u64			seq;
+	u64			last_time;
+	/* the last time queued, and the one at the last round */
+	u64			round_time;
+	u64			flush_time;
+	/* the events queued, in time order from next to ready */
+	struct pyrf_session_event *queue;
+	unsigned int		next;
+	unsigned int		ready;
+	unsigned int		nr;
+	unsigned int		alloc;
+};
+
+static int pyrf_session__read_header(struct pyrf_session *psession)
+{
+	struct perf_file_header *header = psession->base;
+	u64 i, nr_attrs;
+
+	if (psession->size < sizeof(u64) * 2 ||
+	    memcmp(&header->magic, "PERFILE2", 8)) {
+		PyErr_SetString(PyExc_ValueError,
+				"perf: not a perf.data file of this endianness");
+		return -1;
+	}
+
+	if (header->size != sizeof(*header) ||
+	    psession->size < sizeof(*header) ||
+	    header->attr_size < sizeof(struct perf_file_section) + PERF_ATTR_SIZE_VER0 ||
+	    header->attrs.offset + header->attrs.size > psession->size ||
+	    header->data.offset > psession->size) {
+		PyErr_SetString(PyExc_ValueError,
+				"perf: pipe mode or bad perf.data header");
+		return -1;
+	}
+
+	psession->head = header->data.offset;
+	psession->end  = header->data.offset + header->data.size;
+	/* the size is left 0 when perf record didn't end properly */
+	if (!header->data.size || psession->end > psession->size)
+		psession->end = psession->size;
+
+	psession->ordered = true;
+	nr_attrs = header->attrs.size / header->attr_size;
+
+	for (i = 0; i < nr_attrs; i++) {
+		void *entry = psession->base + header->attrs.offset + i * header->attr_size;
+		struct perf_file_section *ids = entry + header->attr_size - sizeof(*ids);
+		struct perf_event_attr attr;
+		struct perf_evsel *evsel;
+		size_t sz = ((struct perf_event_attr *)entry)->size ?: PERF_ATTR_SIZE_VER0;
+		u64 j, nr_ids, *id;
+
+		if (sz > header->attr_size - sizeof(*ids) ||
+		    ids->offset + ids->size > psession->size) {
+			PyErr_SetString(PyExc_ValueError, "perf: bad perf.data attr");
+			return -1;
+		}
+
+		memset(&attr, 0, sizeof(attr));
+		memcpy(&attr, entry, min(sz, sizeof(attr)));
+
+		evsel = perf_evsel__new(&attr);
+		if (evsel == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		perf_evlist__add(psession->evlist, evsel);
+
+		if (!(attr.sample_type & PERF_SAMPLE_TIME))
+			psession->ordered = false;
+
+		nr_ids = ids->size / sizeof(u64);
+		if (perf_evsel__alloc_id(evsel, 1, nr_ids)) {
+			PyErr_NoMemory();
+			return -1;
+		}
+
+		id = psession->base + ids->offset;
+		for (j = 0; j < nr_ids; j++)
+			perf_evlist__id_add(psession->evlist, evsel, 0, j, id[j]);
+	}
+
+	if (!psession->evlist->nr_entries) {
+		PyErr_SetString(PyExc_ValueError, "perf: no events in the perf.data file");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int pyrf_session__init(struct pyrf_session *psession,
+			      PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = { "path", NULL };
+	char *path = "perf.data";
+	struct stat st;
+	int fd;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|s", kwlist, &path))
+		return -1;
+
+	psession->evlist = perf_evlist__new();
+	if (psession->evlist == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+		if (S_ISDIR(st.st_mode))
+			errno = EISDIR;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		close(fd);
+		return -1;
+	}
+
+	psession->size = st.st_size;
+	psession->base = mmap(NULL, psession->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (psession->base == MAP_FAILED) {
+		psession->base = NULL;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+		return -1;
+	}
+
+	return pyrf_session__read_header(psession);
+}
+
+static void pyrf_session__delete(struct pyrf_session *psession)
+{
+	if (psession->base)
+		munmap(psession->base, psession->size);
+	if (psession->evlist)
+		perf_evlist__delete(psession->evlist);
+	free(psession->queue);
+	Py_TYPE(psession)->tp_free((PyObject*)psession);
+}
+
+static int pyrf_session_event__cmp(const void *a, const void *b)
+{
+	const struct pyrf_session_event *ea = a, *eb = b;
+
+	if (ea->time != eb->time)
+		return ea->time < eb->time ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : 1;
+}
+
+/* Sort what is queued and make the events up to limit ready */
+static void pyrf_session__flush(struct pyrf_session *psession, u64 limit)
+{
+	struct pyrf_session_event *queue = psession->queue;
+	unsigned int nr = psession->nr - psession->next;
+
+	memmove(queue, queue + psession->next, nr * sizeof(*queue));
+	psession->next = 0;
+	psession->nr = nr;
+
+	qsort(queue, nr, sizeof(*queue), pyrf_session_event__cmp);
+	for (psession->ready = 0; psession->ready < nr; psession->ready++) {
+		if (queue[psession->ready].time > limit)
+			break;
+	}
+}
+
+static int pyrf_session__queue(struct pyrf_session *psession,
+			       union perf_event *event)
+{
+	struct pyrf_session_event *sevent;
+	struct perf_sample sample;
+	struct perf_evsel *evsel;
+
+	if (psession->nr == psession->alloc) {
+		unsigned int alloc = psession->alloc ? psession->alloc * 2 : 4096;
+
+		sevent = realloc(psession->queue, alloc * sizeof(*sevent));
+		if (sevent == NULL) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		psession->queue = sevent;
+		psession->alloc = alloc;
+	}
+
+	/* the events without a time stay after the one before them */
+	evsel = perf_evlist__event2evsel(psession->evlist, event);
+	if (psession->ordered && evsel &&
+	    !perf_evsel__parse_sample_timestamp(evsel, event, &sample.time) &&
+	    sample.time != -1ULL)
+		psession->last_time = sample.time;
+
+	sevent = &psession->queue[psession->nr++];
+	sevent->event = event;
+	sevent->time  = psession->last_time;
+	sevent->seq   = psession->seq++;
+
+	if (psession->last_time > psession->round_time)
+		psession->round_time = psession->last_time;
+	if (!psession->ordered)
+		psession->ready = psession->nr;
+	return 0;
+}
+
+/* The next event of the file, in time order, NULL at the end or on errors */
+static union perf_event *pyrf_session__next_event(struct pyrf_session *psession)
+{
+	union perf_event *event;
+
+	while (psession->next == psession->ready) {
+		if (psession->head + sizeof(struct perf_event_header) > psession->end) {
+			if (psession->next == psession->nr)
+				return NULL;
+			pyrf_session__flush(psession, ULLONG_MAX);
+			continue;
+		}
+
+		event = psession->base + psession->head;
+		if (event->header.size < sizeof(struct perf_event_header) ||
+		    psession->head + event->header.size > psession->end) {
+			/* a truncated file, deliver what was read */
+			psession->head = psession->end;
+			continue;
+		}
+		psession->head += event->header.size;
+
+		switch (event->header.type) {
+		case PERF_RECORD_FINISHED_ROUND:
+			if (psession->ordered) {
+				pyrf_session__flush(psession, psession->flush_time);
+				psession->flush_time = psession->round_time;
+			}
+			break;
+		case PERF_RECORD_AUXTRACE:
+			/* the trace follows the event */
+			psession->head += event->auxtrace.size;
+			break;
+		default:
+			if (event->header.type >= PERF_RECORD_USER_TYPE_START)
+				break;
+			if (pyrf_session__queue(psession, event))
+				return NULL;
+			break;
+		}
+	}
+
+	return psession->queue[psession->next++].event;
+}
+
+/* The next event the module has an object for, with its sample parsed */
+static PyObject *pyrf_session__iternext(struct pyrf_session *psession)
+{
+	union perf_event *event;
+	struct pyrf_event *pevent;
+	struct perf_evsel *evsel;
+	PyObject *pyevent;
+	int err;
+
+	while ((event = pyrf_session__next_event(psession)) != NULL) {
+		evsel = perf_evlist__event2evsel(psession->evlist, event);
+		if (!evsel)
+			continue;
+
+		pyevent = pyrf_event__new(event);
+		if (pyevent == NULL) {
+			if (PyErr_Occurred())
+				return NULL;
+			continue;
+		}
+
+		pevent = (struct pyrf_event *)pyevent;
+		pevent->evsel = evsel;
+
+		err = perf_evsel__parse_sample(evsel, &pevent->event, &pevent->sample);
+		if (err) {
+			Py_DECREF(pyevent);
+			return PyErr_Format(PyExc_OSError,
+					    "perf: can't parse sample, err=%d", err);
+		}
+		return pyevent;
+	}
+
+	return NULL;
+}
+
+/*
+ * perf.column: the values of a sample field for a batch of samples, an
+ * array exported with the buffer protocol, e.g. for numpy.frombuffer().
+ */
+struct pyrf_column {
+	PyObject_HEAD
+
+	void		*data;
+	Py_ssize_t	nr;
+	Py_ssize_t	itemsize;
+	const char	*format;
+};
+
+static void pyrf_column__delete(struct pyrf_column *pcolumn)
+{
+	free(pcolumn->data);
+	Py_TYPE(pcolumn)->tp_free((PyObject*)pcolumn);
+}
+
+static Py_ssize_t pyrf_column__length(PyObject *obj)
+{
+	struct pyrf_column *pcolumn = (void *)obj;
+
+	return pcolumn->nr;
+}
+
+static PyObject *pyrf_column__item(PyObject *obj, Py_ssize_t i)
+{
+	struct pyrf_column *pcolumn = (void *)obj;
+	void *value = pcolumn->data + i * pcolumn->itemsize;
+
+	if (i < 0 || i >= pcolumn->nr) {
+		PyErr_SetString(PyExc_IndexError, "column index out of range");
+		return NULL;
+	}
+
+	if (pcolumn->itemsize == sizeof(u64))
+		return PyLong_FromUnsignedLongLong(*(u64 *)value);
+	if (*pcolumn->format == 'i')
+		return PyLong_FromLong(*(s32 *)value);
+	return PyLong_FromUnsignedLong(*(u32 *)value);
+}
+
+static int pyrf_column__getbuffer(PyObject *obj, Py_buffer *view, int flags)
+{
+	struct pyrf_column *pcolumn = (void *)obj;
+
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "perf: columns are read only");
+		return -1;
+	}
+
+	view->obj	 = obj;
+	view->buf	 = pcolumn->data;
+	view->len	 = pcolumn->nr * pcolumn->itemsize;
+	view->readonly	 = 1;
+	view->itemsize	 = pcolumn->itemsize;
+	view->format	 = (flags & PyBUF_FORMAT) ? (char *)pcolumn->format : NULL;
+	view->ndim	 = 1;
+	view->shape	 = (flags & PyBUF_ND) ? &pcolumn->nr : NULL;
+	view->strides	 = (flags & PyBUF_STRIDES) ? &pcolumn->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal	 = NULL;
+	Py_INCREF(obj);
+	return 0;
+}
+
+static PySequenceMethods pyrf_column__sequence_methods = {
+	.sq_length = pyrf_column__length,
+	.sq_item   = pyrf_column__item,
+};
+
+static PyBufferProcs pyrf_column__buffer_procs = {
+	.bf_getbuffer = pyrf_column__getbuffer,
+};
+
+static char pyrf_column__doc[] = PyDoc_STR("the values of a sample field, with the buffer protocol.");
+
+static PyTypeObject pyrf_column__type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "perf.column",
+	.tp_basicsize	= sizeof(struct pyrf_column),
+	.tp_dealloc	= (destructor)pyrf_column__delete,
+#if PY_MAJOR_VERSION < 3
+	.tp_flags	= Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_NEWBUFFER,
+#else
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+#endif
+	.tp_doc		= pyrf_column__doc,
+	.tp_as_sequence	= &pyrf_column__sequence_methods,
+	.tp_as_buffer	= &pyrf_column__buffer_procs,
+};
+
+#define sample_field(name, member, format) \
+	{ #name, format, sizeof(((struct perf_sample *)0)->member), \
+	  offsetof(struct perf_sample, member) }
+
+static const struct pyrf_sample_field {
+	const char	*name;
+	const char	*format;
+	int		size;
+	/* in struct perf_sample, -1 for the index of the evsel */
+	int		offset;
+} pyrf_sample_fields[] = {
+	sample_field(ip, ip, "Q"),
+	sample_field(pid, pid, "I"),
+	sample_field(tid, tid, "I"),
+	sample_field(time, time, "Q"),
+	sample_field(addr, addr, "Q"),
+	sample_field(id, id, "Q"),
+	sample_field(stream_id, stream_id, "Q"),
+	sample_field(period, period, "Q"),
+	sample_field(weight, weight, "Q"),
+	sample_field(transaction, transaction, "Q"),
+	sample_field(cpu, cpu, "I"),
+	sample_field(data_src, data_src, "Q"),
+	sample_field(phys_addr, phys_addr, "Q"),
+	sample_field(cgroup, cgroup, "Q"),
+	{ "evsel", "i", sizeof(s32), -1 },
+};
+
+#define NR_SAMPLE_FIELDS ARRAY_SIZE(pyrf_sample_fields)
+
+/* perf.sample_batches: the iterator of session.samples() */
+struct pyrf_sample_batches {
+	PyObject_HEAD
+
+	struct pyrf_session	*psession;
+	unsigned int		batch;
+	unsigned int		nr_fields;
+	const struct pyrf_sample_field *fields[NR_SAMPLE_FIELDS];
+};
+
+static void pyrf_sample_batches__delete(struct pyrf_sample_batches *pbatches)
+{
+	Py_XDECREF(pbatches->psession);
+	Py_TYPE(pbatches)->tp_free((PyObject*)pbatches);
+}
+
+/* A dict of the columns of the next batch of samples */
+static PyObject *pyrf_sample_batches__iternext(struct pyrf_sample_batches *pbatches)
+{
+	struct pyrf_session *psession = pbatches->psession;
+	struct pyrf_column *columns[NR_SAMPLE_FIELDS];
+	PyObject *dict = NULL;
+	union perf_event *event;
+	struct perf_sample sample;
+	struct perf_evsel *evsel;
+	unsigned int i, nr = 0;
+
+	memset(columns, 0, sizeof(columns));
+	for (i = 0; i < pbatches->nr_fields; i++) {
+		columns[i] = PyObject_New(struct pyrf_column, &pyrf_column__type);
+		if (columns[i] == NULL)
+			goto out;
+		columns[i]->nr	     = 0;
+		columns[i]->itemsize = pbatches->fields[i]->size;
+		columns[i]->format   = pbatches->fields[i]->format;
+		columns[i]->data     = malloc((size_t)pbatches->batch * columns[i]->itemsize);
+		if (columns[i]->data == NULL) {
+			PyErr_NoMemory();
+			goto out;
+		}
+	}
+
+	while (nr < pbatches->batch &&
+	       (event = pyrf_session__next_event(psession)) != NULL) {
+		if (event->header.type != PERF_RECORD_SAMPLE)
+			continue;
+
+		evsel = perf_evlist__event2evsel(psession->evlist, event);
+		if (!evsel || perf_evsel__parse_sample(evsel, event, &sample))
+			continue;
+
+		for (i = 0; i < pbatches->nr_fields; i++) {
+			const struct pyrf_sample_field *field = pbatches->fields[i];
+			void *value = columns[i]->data + nr * field->size;
+
+			if (field->offset < 0)
+				*(s32 *)value = evsel->idx;
+			else
+				memcpy(value, (void *)&sample + field->offset, field->size);
+		}
+		nr++;
+	}
+
+	if (nr == 0 || PyErr_Occurred())
+		goto out;
+
+	dict = PyDict_New();
+	if (dict == NULL)
+		goto out;
+
+	for (i = 0; i < pbatches->nr_fields; i++) {
+		columns[i]->nr = nr;
+		if (PyDict_SetItemString(dict, pbatches->fields[i]->name,
+					 (PyObject *)columns[i]) < 0) {
+			Py_CLEAR(dict);
+			goto out;
+		}
+	}
+out:
+	for (i = 0; i < pbatches->nr_fields; i++)
+		Py_XDECREF(columns[i]);
+	return dict;
+}
+
+static char pyrf_sample_batches__doc[] = PyDoc_STR("the samples of a perf.session, by batches of columns.");
+
+static PyTypeObject pyrf_sample_batches__type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "perf.sample_batches",
+	.tp_basicsize	= sizeof(struct pyrf_sample_batches),
+	.tp_dealloc	= (destructor)pyrf_sample_batches__delete,
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= pyrf_sample_batches__doc,
+	.tp_iter	= PyObject_SelfIter,
+	.tp_iternext	= (iternextfunc)pyrf_sample_batches__iternext,
+};
+
+static const struct pyrf_sample_field *pyrf_sample_field__find(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NR_SAMPLE_FIELDS; i++) {
+		if (!strcmp(pyrf_sample_fields[i].name, name))
+			return &pyrf_sample_fields[i];
+	}
+	return NULL;
+}
+
+static PyObject *pyrf_session__samples(struct pyrf_session *psession,
+				       PyObject *args, PyObject *kwargs)
+{
+	static char *kwlist[] = { "fields", "batch", NULL };
+	struct pyrf_sample_batches *pbatches;
+	PyObject *fields = NULL, *seq;
+	int batch = 65536;
+	Py_ssize_t i, nr;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Oi", kwlist,
+					 &fields, &batch))
+		return NULL;
+
+	if (batch <= 0) {
+		PyErr_SetString(PyExc_ValueError, "perf: batch must be positive");
+		return NULL;
+	}
+
+	pbatches = PyObject_New(struct pyrf_sample_batches, &pyrf_sample_batches__type);
+	if (pbatches == NULL)
+		return NULL;
+
+	Py_INCREF(psession);
+	pbatches->psession  = psession;
+	pbatches->batch	    = batch;
+	pbatches->nr_fields = 0;
+
+	if (fields == NULL || fields == Py_None) {
+		for (i = 0; i < (Py_ssize_t)NR_SAMPLE_FIELDS; i++)
+			pbatches->fields[pbatches->nr_fields++] = &pyrf_sample_fields[i];
+		return (PyObject *)pbatches;
+	}
+
+	seq = PySequence_Fast(fields, "perf: fields must be a sequence of names");
+	if (seq == NULL)
+		goto out_err;
+
+	nr = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < nr; i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		const struct pyrf_sample_field *field = NULL;
+		const char *name = _PyUnicode_AsString(item);
+
+		if (name)
+			field = pyrf_sample_field__find(name);
+		if (field == NULL) {
+			if (!PyErr_Occurred())
+				PyErr_Format(PyExc_ValueError, "perf: unknown sample field %s", name);
+			Py_DECREF(seq);
+			goto out_err;
+		}
+		if (pbatches->nr_fields == NR_SAMPLE_FIELDS) {
+			PyErr_SetString(PyExc_ValueError, "perf: too many fields");
+			Py_DECREF(seq);
+			goto out_err;
+		}
+		pbatches->fields[pbatches->nr_fields++] = field;
+	}
+	Py_DECREF(seq);
+
+	return (PyObject *)pbatches;
+
+out_err:
+	Py_DECREF(pbatches);
+	return NULL;
+}
+
+static PyObject *pyrf_session__event_names(struct pyrf_session *psession,
+					   PyObject *args __maybe_unused,
+					   PyObject *kwargs __maybe_unused)
+{
+	struct perf_evsel *evsel;
+	PyObject *list = PyList_New(0);
+
+	if (list == NULL)
+		return NULL;
+
+	evlist__for_each_entry(psession->evlist, evsel) {
+		PyObject *name = _PyUnicode_FromString(perf_evsel__name(evsel));
+
+		if (name == NULL || PyList_Append(list, name) < 0) {
+			Py_XDECREF(name);
+			Py_DECREF(list);
+			return NULL;
+		}
+		Py_DECREF(name);
+	}
+
+	return list;
+}
+
+static PyMethodDef pyrf_session__methods[] = {
+	{
+		.ml_name  = "samples",
+		.ml_meth  = (PyCFunction)pyrf_session__samples,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("iterates over the samples by batches, dicts of a column per field.")
+	},
+	{
+		.ml_name  = "event_names",
+		.ml_meth  = (PyCFunction)pyrf_session__event_names,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc	  = PyDoc_STR("the names of the events, by the evsel index of the samples.")
+	},
+	{ .ml_name = NULL, }
+};
+
+static char pyrf_session__doc[] = PyDoc_STR("the events of a perf.data file, in time order.");
+
+static PyTypeObject pyrf_session__type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "perf.session",
+	.tp_basicsize	= sizeof(struct pyrf_session),
+	.tp_dealloc	= (destructor)pyrf_session__delete,
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= pyrf_session__doc,
+	.tp_methods	= pyrf_session__methods,
+	.tp_init	= (initproc)pyrf_session__init,
+	.tp_iter	= PyObject_SelfIter,
+	.tp_iternext	= (iternextfunc)pyrf_session__iternext,
+};
+
+static int pyrf_session__setup_types(void)
+{
+	int err;
+
+	pyrf_session__type.tp_new = PyType_GenericNew;
+	err = PyType_Ready(&pyrf_session__type);
+	if (err < 0)
+		return err;
+	err = PyType_Ready(&pyrf_sample_batches__type);
+	if (err < 0)
+		return err;
+	return PyType_Ready(&pyrf_column__type);
+}
+
 #define PERF_CONST(name) { #name, PERF_##name }
 
 static struct {
@@ -1296,6 +2315,8 @@ PyMODINIT_FUNC PyInit_perf(void)
 	if (module == NULL ||
 	    pyrf_event__setup_types() < 0 ||
 	    pyrf_evlist__setup_types() < 0 ||
+	    pyrf_event_batch__setup_types() < 0 ||
+	    pyrf_session__setup_types() < 0 ||
 	    pyrf_evsel__setup_types() < 0 ||
 	    pyrf_thread_map__setup_types() < 0 ||
 	    pyrf_cpu_map__setup_types() < 0)
@@ -1311,6 +2332,15 @@ PyMODINIT_FUNC PyInit_perf(void)
 	Py_INCREF(&pyrf_evlist__type);
 	PyModule_AddObject(module, "evlist", (PyObject*)&pyrf_evlist__type);
 
+	Py_INCREF(&pyrf_event_batch__type);
+	PyModule_AddObject(module, "event_batch", (PyObject*)&pyrf_event_batch__type);
+
+	Py_INCREF(&pyrf_session__type);
+	PyModule_AddObject(module, "session", (PyObject*)&pyrf_session__type);
+
+	Py_INCREF(&pyrf_column__type);
+	PyModule_AddObject(module, "column", (PyObject*)&pyrf_column__type);
+
 	Py_INCREF(&pyrf_evsel__type);
 	PyModule_AddObject(module, "evsel", (PyObject*)&pyrf_evsel__type);
 
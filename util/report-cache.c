@@ -0,0 +1,921 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include "debug.h"
+#include "dso.h"
+#include "event.h"
+#include "evlist.h"
+#include "evsel.h"
+#include "machine.h"
+#include "map.h"
+#include "report-cache.h"
+#include "session.h"
+#include "symbol.h"
+#include "thread.h"
+#include "util.h"
+#include "../perf.h"
+
+#define REPORT_CACHE_INDEX_MIN_BITS	10
+
+/* The index of the objects already kept, by address */
+struct report_cache_index {
+	const void	**keys;
+	u32		*vals;
+	unsigned int	bits;
+	size_t		nr;
+};
+
+/* The strings already kept, by content, as names may be freed meanwhile */
+struct report_cache_strtab {
+	u64		*hashes;
+	u32		*offs;
+	unsigned int	bits;
+	size_t		nr;
+};
+
+struct report_cache {
+	struct perf_session		*session;
+	char				*filename;
+	bool				broken;
+	struct report_cache_index	dsos_idx;
+	struct report_cache_index	maps_idx;
+	struct report_cache_index	syms_idx;
+	struct report_cache_index	threads_idx;
+	struct report_cache_strtab	strtab;
+	char				*strings;
+	size_t				strings_size, strings_alloc;
+	struct report_cache_dso		*dsos;
+	size_t				nr_dsos, alloc_dsos;
+	struct report_cache_map		*maps;
+	/* held, so that their addresses are not reused */
+	struct map			**map_refs;
+	size_t				nr_maps, alloc_maps, alloc_map_refs;
+	struct report_cache_sym		*syms;
+	size_t				nr_syms, alloc_syms;
+	struct report_cache_thread	*threads;
+	struct thread			**thread_refs;
+	size_t				nr_threads, alloc_threads, alloc_thread_refs;
+	struct report_cache_row		*rows;
+	size_t				nr_rows, alloc_rows;
+};
+
+static u64 report_cache__hash_str(u64 hash, const char *s)
+{
+	/* FNV-1a */
+	for (; s && *s; s++)
+		hash = (hash ^ (u8)*s) * 1099511628211ULL;
+	return hash ^ '\n';
+}
+
+/* A hash of the options the resolved samples depend on */
+static u64 report_cache__key(void)
+{
+	u64 key = 14695981039346656037ULL;
+
+	key = report_cache__hash_str(key, perf_version_string);
+	key = report_cache__hash_str(key, symbol_conf.symfs);
+	key = report_cache__hash_str(key, symbol_conf.vmlinux_name);
+	key = report_cache__hash_str(key, symbol_conf.kallsyms_name);
+	key = report_cache__hash_str(key, symbol_conf.demangle ? "d" : "-");
+	key = report_cache__hash_str(key, symbol_conf.demangle_kernel ? "k" : "-");
+
+	return key;
+}
+
+static int report_cache__data_stat(struct perf_session *session,
+				   u64 *size, u64 *mtime)
+{
+	struct stat st;
+
+	if (stat(session->data->path, &st) < 0)
+		return -errno;
+
+	*size  = st.st_size;
+	*mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+	return 0;
+}
+
+static char *report_cache__filename(struct perf_session *session)
+{
+	char *filename;
+
+	if (asprintf(&filename, "%s" REPORT_CACHE_SUFFIX,
+		     session->data->path) < 0)
+		return NULL;
+	return filename;
+}
+
+static int report_cache__reserve(void **array, size_t *alloc, size_t nr,
+				 size_t size)
+{
+	size_t new_alloc;
+	void *new_array;
+
+	if (nr < *alloc)
+		return 0;
+
+	new_alloc = *alloc ? *alloc * 2 : 1024;
+	new_array = realloc(*array, new_alloc * size);
+	if (new_array == NULL)
+		return -ENOMEM;
+
+	*array = new_array;
+	*alloc = new_alloc;
+	return 0;
+}
+
+#define report_cache__reserve_one(rc, name)				\
+	report_cache__reserve((void **)&(rc)->name, &(rc)->alloc_ ## name,	\
+			      (rc)->nr_ ## name, sizeof(*(rc)->name))
+
+static size_t report_cache_index__slot(struct report_cache_index *idx,
+				       const void *key)
+{
+	size_t mask = (1UL << idx->bits) - 1;
+	size_t i = hash_64((unsigned long)key, idx->bits);
+
+	while (idx->keys[i] && idx->keys[i] != key)
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+static int report_cache_index__grow(struct report_cache_index *idx)
+{
+	const void **keys = idx->keys;
+	u32 *vals = idx->vals;
+	size_t i, size = keys ? 1UL << idx->bits : 0;
+	unsigned int bits = keys ? idx->bits + 1 : REPORT_CACHE_INDEX_MIN_BITS;
+
+	idx->keys = calloc(1UL << bits, sizeof(*idx->keys));
+	idx->vals = calloc(1UL << bits, sizeof(*idx->vals));
+	if (idx->keys == NULL || idx->vals == NULL) {
+		free(idx->keys);
+		free(idx->vals);
+		idx->keys = keys;
+		idx->vals = vals;
+		return -ENOMEM;
+	}
+
+	idx->bits = bits;
+	for (i = 0; i < size; i++) {
+		size_t slot;
+
+		if (keys[i] == NULL)
+			continue;
+
+		slot = report_cache_index__slot(idx, keys[i]);
+		idx->keys[slot] = keys[i];
+		idx->vals[slot] = vals[i];
+	}
+
+	free(keys);
+	free(vals);
+	return 0;
+}
+
+/*
+ * The index key was kept at, or REPORT_CACHE_NONE after adding it with
+ * val, if it wasn't.
+ */
+static int report_cache_index__find(struct report_cache_index *idx,
+				    const void *key, u32 val, u32 *found)
+{
+	size_t slot;
+
+	if ((idx->keys == NULL || idx->nr >= (1UL << idx->bits) / 2) &&
+	    report_cache_index__grow(idx))
+		return -ENOMEM;
+
+	slot = report_cache_index__slot(idx, key);
+	if (idx->keys[slot]) {
+		*found = idx->vals[slot];
+		return 0;
+	}
+
+	idx->keys[slot] = key;
+	idx->vals[slot] = val;
+	idx->nr++;
+	*found = REPORT_CACHE_NONE;
+	return 0;
+}
+
+static void report_cache_index__exit(struct report_cache_index *idx)
+{
+	zfree(&idx->keys);
+	zfree(&idx->vals);
+}
+
+struct report_cache *report_cache__new(struct perf_session *session)
+{
+	struct report_cache *rc = zalloc(sizeof(*rc));
+
+	if (rc == NULL)
+		return NULL;
+
+	rc->session  = session;
+	rc->filename = report_cache__filename(session);
+	if (rc->filename == NULL) {
+		free(rc);
+		return NULL;
+	}
+
+	return rc;
+}
+
+void report_cache__delete(struct report_cache *rc)
+{
+	size_t i;
+
+	if (rc == NULL)
+		return;
+
+	for (i = 0; i < rc->nr_maps; i++)
+		map__put(rc->map_refs[i]);
+	for (i = 0; i < rc->nr_threads; i++)
+		thread__put(rc->thread_refs[i]);
+
+	report_cache_index__exit(&rc->dsos_idx);
+	report_cache_index__exit(&rc->maps_idx);
+	report_cache_index__exit(&rc->syms_idx);
+	report_cache_index__exit(&rc->threads_idx);
+	free(rc->strtab.hashes);
+	free(rc->strtab.offs);
+	free(rc->strings);
+	free(rc->dsos);
+	free(rc->maps);
+	free(rc->map_refs);
+	free(rc->syms);
+	free(rc->threads);
+	free(rc->thread_refs);
+	free(rc->rows);
+	free(rc->filename);
+	free(rc);
+}
+
+static size_t report_cache__strtab_slot(struct report_cache *rc, u64 hash,
+					const char *s)
+{
+	struct report_cache_strtab *st = &rc->strtab;
+	size_t mask = (1UL << st->bits) - 1;
+	size_t i = hash & mask;
+
+	/* hashes are never 0, s is NULL to find a free slot */
+	while (st->hashes[i] && (!s || st->hashes[i] != hash ||
+				 strcmp(rc->strings + st->offs[i], s)))
+		i = (i + 1) & mask;
+
+	return i;
+}
+
+static int report_cache__strtab_grow(struct report_cache *rc)
+{
+	struct report_cache_strtab *st = &rc->strtab, old = rc->strtab;
+	size_t i, size = old.hashes ? 1UL << old.bits : 0;
+
+	st->bits = old.hashes ? old.bits + 1 : REPORT_CACHE_INDEX_MIN_BITS;
+	st->hashes = calloc(1UL << st->bits, sizeof(*st->hashes));
+	st->offs = calloc(1UL << st->bits, sizeof(*st->offs));
+	if (st->hashes == NULL || st->offs == NULL) {
+		free(st->hashes);
+		free(st->offs);
+		*st = old;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < size; i++) {
+		size_t slot;
+
+		if (old.hashes[i] == 0)
+			continue;
+
+		slot = report_cache__strtab_slot(rc, old.hashes[i], NULL);
+		st->hashes[slot] = old.hashes[i];
+		st->offs[slot] = old.offs[i];
+	}
+
+	free(old.hashes);
+	free(old.offs);
+	return 0;
+}
+
+static int report_cache__string(struct report_cache *rc, const char *s,
+				u32 *off)
+{
+	struct report_cache_strtab *st = &rc->strtab;
+	size_t len = strlen(s) + 1, slot;
+	u64 hash = report_cache__hash_str(14695981039346656037ULL, s) | 1;
+
+	if ((st->hashes == NULL || st->nr >= (1UL << st->bits) / 2) &&
+	    report_cache__strtab_grow(rc))
+		return -ENOMEM;
+
+	slot = report_cache__strtab_slot(rc, hash, s);
+	if (st->hashes[slot]) {
+		*off = st->offs[slot];
+		return 0;
+	}
+
+	if (rc->strings_size + len > UINT_MAX)
+		return -E2BIG;
+
+	while (rc->strings_size + len > rc->strings_alloc) {
+		size_t alloc = rc->strings_alloc ? rc->strings_alloc * 2 : 65536;
+		char *strings = realloc(rc->strings, alloc);
+
+		if (strings == NULL)
+			return -ENOMEM;
+		rc->strings = strings;
+		rc->strings_alloc = alloc;
+	}
+
+	memcpy(rc->strings + rc->strings_size, s, len);
+	st->hashes[slot] = hash;
+	st->offs[slot] = *off = rc->strings_size;
+	st->nr++;
+	rc->strings_size += len;
+	return 0;
+}
+
+static int report_cache__dso(struct report_cache *rc, struct dso *dso, u32 *idx)
+{
+	struct report_cache_dso *d;
+	int err;
+
+	err = report_cache_index__find(&rc->dsos_idx, dso, rc->nr_dsos, idx);
+	if (err || *idx != REPORT_CACHE_NONE)
+		return err;
+
+	err = report_cache__reserve_one(rc, dsos);
+	if (err)
+		return err;
+
+	d = &rc->dsos[rc->nr_dsos];
+	memset(d, 0, sizeof(*d));
+	err = report_cache__string(rc, dso->long_name, &d->long_name) ?:
+	      report_cache__string(rc, dso->short_name, &d->short_name);
+	if (err)
+		return err;
+
+	memcpy(d->build_id, dso->build_id, sizeof(d->build_id));
+	d->has_build_id = dso->has_build_id;
+	d->kernel = dso->kernel;
+
+	*idx = rc->nr_dsos++;
+	return 0;
+}
+
+static int report_cache__map(struct report_cache *rc, struct map *map, u32 *idx)
+{
+	struct report_cache_map *m;
+	u32 dso;
+	int err;
+
+	err = report_cache_index__find(&rc->maps_idx, map, rc->nr_maps, idx);
+	if (err || *idx != REPORT_CACHE_NONE)
+		return err;
+
+	err = report_cache__reserve_one(rc, maps) ?:
+	      report_cache__reserve((void **)&rc->map_refs, &rc->alloc_map_refs,
+				    rc->nr_maps, sizeof(*rc->map_refs)) ?:
+	      report_cache__dso(rc, map->dso, &dso);
+	if (err)
+		return err;
+
+	m = &rc->maps[rc->nr_maps];
+	m->start    = map->start;
+	m->end      = map->end;
+	m->pgoff    = map->pgoff;
+	m->reloc    = map->reloc;
+	m->dso      = dso;
+	m->identity = map->map_ip == identity__map_ip;
+
+	rc->map_refs[rc->nr_maps] = map__get(map);
+	*idx = rc->nr_maps++;
+	return 0;
+}
+
+static int report_cache__sym(struct report_cache *rc, struct map *map,
+			     struct symbol *sym, u32 *idx)
+{
+	struct report_cache_sym *s;
+	u32 dso;
+	int err;
+
+	err = report_cache_index__find(&rc->syms_idx, sym, rc->nr_syms, idx);
+	if (err || *idx != REPORT_CACHE_NONE)
+		return err;
+
+	err = report_cache__reserve_one(rc, syms) ?:
+	      report_cache__dso(rc, map->dso, &dso);
+	if (err)
+		return err;
+
+	s = &rc->syms[rc->nr_syms];
+	memset(s, 0, sizeof(*s));
+	err = report_cache__string(rc, sym->name, &s->name);
+	if (err)
+		return err;
+
+	s->start   = sym->start;
+	s->end     = sym->end;
+	s->dso     = dso;
+	s->binding = sym->binding;
+	s->type    = sym->type;
+
+	*idx = rc->nr_syms++;
+	return 0;
+}
+
+static int report_cache__thread(struct report_cache *rc, struct thread *thread,
+				u32 *idx)
+{
+	int err;
+
+	err = report_cache_index__find(&rc->threads_idx, thread, rc->nr_threads,
+				       idx);
+	if (err || *idx != REPORT_CACHE_NONE)
+		return err;
+
+	err = report_cache__reserve_one(rc, threads) ?:
+	      report_cache__reserve((void **)&rc->thread_refs,
+				    &rc->alloc_thread_refs, rc->nr_threads,
+				    sizeof(*rc->thread_refs));
+	if (err)
+		return err;
+
+	rc->threads[rc->nr_threads].pid = thread->pid_;
+	rc->threads[rc->nr_threads].tid = thread->tid;
+	rc->thread_refs[rc->nr_threads] = thread__get(thread);
+	*idx = rc->nr_threads++;
+	return 0;
+}
+
+void report_cache__add(struct report_cache *rc, struct perf_evsel *evsel,
+		       struct perf_sample *sample, struct addr_location *al)
+{
+	struct report_cache_row *row;
+	int err;
+
+	if (rc == NULL || rc->broken)
+		return;
+
+	/* guests have their own machine, the cache only knows the host */
+	if (al->machine != &rc->session->machines.host) {
+		rc->broken = true;
+		return;
+	}
+
+	err = report_cache__reserve_one(rc, rows);
+	if (err)
+		goto out_broken;
+
+	row = &rc->rows[rc->nr_rows];
+	memset(row, 0, sizeof(*row));
+	row->ip		 = sample->ip;
+	row->addr	 = al->addr;
+	row->time	 = sample->time;
+	row->period	 = sample->period;
+	row->weight	 = sample->weight;
+	row->transaction = sample->transaction;
+	row->cpu	 = sample->cpu;
+	row->evsel	 = evsel->idx;
+	row->cpumode	 = al->cpumode;
+	row->level	 = al->level;
+	row->map	 = REPORT_CACHE_NONE;
+	row->sym	 = REPORT_CACHE_NONE;
+
+	err = report_cache__thread(rc, al->thread, &row->thread) ?:
+	      report_cache__string(rc, thread__comm_str(al->thread), &row->comm);
+	if (!err && al->map)
+		err = report_cache__map(rc, al->map, &row->map);
+	if (!err && al->map && al->sym)
+		err = report_cache__sym(rc, al->map, al->sym, &row->sym);
+	if (err)
+		goto out_broken;
+
+	rc->nr_rows++;
+	return;
+
+out_broken:
+	pr_debug("report cache: can't keep the samples, %s\n", strerror(-err));
+	rc->broken = true;
+}
+
+int report_cache__write(struct report_cache *rc)
+{
+	struct perf_evlist *evlist = rc->session->evlist;
+	struct report_cache_header hdr = {
+		.magic	      = REPORT_CACHE_MAGIC,
+		.version      = REPORT_CACHE_VERSION,
+		.stats_size   = sizeof(evlist->stats),
+		.key	      = report_cache__key(),
+		.strings_size = rc->strings_size,
+		.nr_dsos      = rc->nr_dsos,
+		.nr_maps      = rc->nr_maps,
+		.nr_syms      = rc->nr_syms,
+		.nr_threads   = rc->nr_threads,
+		.nr_rows      = rc->nr_rows,
+	};
+	char tmpname[PATH_MAX];
+	int fd, err;
+
+	if (rc->broken || rc->nr_rows == 0)
+		return 0;
+
+	err = report_cache__data_stat(rc->session, &hdr.data_size,
+				      &hdr.data_mtime);
+	if (err)
+		return err;
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", rc->filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return -errno;
+
+	err = -EIO;
+	if (writen(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	    writen(fd, &evlist->stats, sizeof(evlist->stats)) == sizeof(evlist->stats) &&
+	    writen(fd, rc->strings, rc->strings_size) == (ssize_t)rc->strings_size &&
+	    writen(fd, rc->dsos, rc->nr_dsos * sizeof(*rc->dsos)) ==
+		(ssize_t)(rc->nr_dsos * sizeof(*rc->dsos)) &&
+	    writen(fd, rc->maps, rc->nr_maps * sizeof(*rc->maps)) ==
+		(ssize_t)(rc->nr_maps * sizeof(*rc->maps)) &&
+	    writen(fd, rc->syms, rc->nr_syms * sizeof(*rc->syms)) ==
+		(ssize_t)(rc->nr_syms * sizeof(*rc->syms)) &&
+	    writen(fd, rc->threads, rc->nr_threads * sizeof(*rc->threads)) ==
+		(ssize_t)(rc->nr_threads * sizeof(*rc->threads)) &&
+	    writen(fd, rc->rows, rc->nr_rows * sizeof(*rc->rows)) ==
+		(ssize_t)(rc->nr_rows * sizeof(*rc->rows)))
+		err = 0;
+	if (close(fd))
+		err = -EIO;
+	if (!err && rename(tmpname, rc->filename))
+		err = -errno;
+	if (err)
+		unlink(tmpname);
+	else
+		pr_debug("Saved %zu resolved samples to %s\n", rc->nr_rows,
+			 rc->filename);
+	return err;
+}
+
+/* The sections of a cache file read back, the counts are checked */
+struct report_cache_file {
+	struct report_cache_header	*hdr;
+	void				*stats;
+	const char			*strings;
+	struct report_cache_dso		*dsos;
+	struct report_cache_map		*maps;
+	struct report_cache_sym		*syms;
+	struct report_cache_thread	*threads;
+	struct report_cache_row		*rows;
+};
+
+static int report_cache__read(struct perf_session *session, const char *filename,
+			      char **bufp, struct report_cache_file *f)
+{
+	struct report_cache_header *hdr;
+	u64 data_size, data_mtime, size;
+	struct stat st;
+	char *buf = NULL;
+	int fd;
+
+	if (report_cache__data_stat(session, &data_size, &data_mtime))
+		return -ENOENT;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -ENOENT;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr))
+		goto out_stale;
+
+	buf = malloc(st.st_size);
+	if (buf == NULL || readn(fd, buf, st.st_size) != st.st_size)
+		goto out_stale;
+
+	hdr = (struct report_cache_header *)buf;
+	if (hdr->magic != REPORT_CACHE_MAGIC ||
+	    hdr->version != REPORT_CACHE_VERSION ||
+	    hdr->stats_size != sizeof(session->evlist->stats) ||
+	    hdr->data_size != data_size || hdr->data_mtime != data_mtime ||
+	    hdr->key != report_cache__key())
+		goto out_stale;
+
+	size = sizeof(*hdr) + hdr->stats_size + hdr->strings_size +
+	       (u64)hdr->nr_dsos * sizeof(*f->dsos) +
+	       (u64)hdr->nr_maps * sizeof(*f->maps) +
+	       (u64)hdr->nr_syms * sizeof(*f->syms) +
+	       (u64)hdr->nr_threads * sizeof(*f->threads) +
+	       hdr->nr_rows * sizeof(*f->rows);
+	if (size != (u64)st.st_size || hdr->strings_size == 0)
+		goto out_stale;
+
+	f->hdr	   = hdr;
+	f->stats   = hdr + 1;
+	f->strings = f->stats + hdr->stats_size;
+	f->dsos	   = (void *)(f->strings + hdr->strings_size);
+	f->maps	   = (void *)(f->dsos + hdr->nr_dsos);
+	f->syms	   = (void *)(f->maps + hdr->nr_maps);
+	f->threads = (void *)(f->syms + hdr->nr_syms);
+	f->rows	   = (void *)(f->threads + hdr->nr_threads);
+
+	if (f->strings[hdr->strings_size - 1] != '\0')
+		goto out_stale;
+
+	close(fd);
+	*bufp = buf;
+	return 0;
+
+out_stale:
+	pr_debug("Ignoring the stale report cache %s\n", filename);
+	free(buf);
+	close(fd);
+	return -ENOENT;
+}
+
+static bool report_cache__valid_string(struct report_cache_file *f, u32 off)
+{
+	return off < f->hdr->strings_size;
+}
+
+/* Back from the cache, the objects the rows refer to */
+struct report_cache_objs {
+	struct dso	**dsos;
+	struct map	**maps;
+	struct symbol	**syms;
+	struct thread	**threads;
+};
+
+static void report_cache_objs__exit(struct report_cache_objs *o,
+				    struct report_cache_file *f)
+{
+	u32 i;
+
+	for (i = 0; o->dsos && i < f->hdr->nr_dsos; i++)
+		dso__put(o->dsos[i]);
+	for (i = 0; o->maps && i < f->hdr->nr_maps; i++)
+		map__put(o->maps[i]);
+	for (i = 0; o->threads && i < f->hdr->nr_threads; i++)
+		thread__put(o->threads[i]);
+
+	zfree(&o->dsos);
+	zfree(&o->maps);
+	zfree(&o->syms);
+	zfree(&o->threads);
+}
+
+static struct dso *report_cache__findnew_dso(struct machine *machine,
+					     struct report_cache_file *f,
+					     struct report_cache_dso *d)
+{
+	const char *short_name = f->strings + d->short_name;
+	struct dso *dso;
+
+	dso = machine__findnew_dso(machine, f->strings + d->long_name);
+	if (dso == NULL)
+		return NULL;
+
+	if (strcmp(dso->short_name, short_name)) {
+		char *name = strdup(short_name);
+
+		if (name)
+			dso__set_short_name(dso, name, true);
+	}
+
+	dso->kernel = d->kernel;
+	if (d->has_build_id && !dso->has_build_id)
+		dso__set_build_id(dso, d->build_id);
+
+	return dso;
+}
+
+static int report_cache_objs__init(struct report_cache_objs *o,
+				   struct machine *machine,
+				   struct report_cache_file *f)
+{
+	struct report_cache_header *hdr = f->hdr;
+	u32 i;
+
+	o->dsos	   = calloc(hdr->nr_dsos, sizeof(*o->dsos));
+	o->maps	   = calloc(hdr->nr_maps, sizeof(*o->maps));
+	o->syms	   = calloc(hdr->nr_syms, sizeof(*o->syms));
+	o->threads = calloc(hdr->nr_threads, sizeof(*o->threads));
+	if ((hdr->nr_dsos && o->dsos == NULL) ||
+	    (hdr->nr_maps && o->maps == NULL) ||
+	    (hdr->nr_syms && o->syms == NULL) ||
+	    (hdr->nr_threads && o->threads == NULL))
+		return -ENOMEM;
+
+	for (i = 0; i < hdr->nr_dsos; i++) {
+		struct report_cache_dso *d = &f->dsos[i];
+
+		if (!report_cache__valid_string(f, d->long_name) ||
+		    !report_cache__valid_string(f, d->short_name))
+			return -EINVAL;
+
+		o->dsos[i] = report_cache__findnew_dso(machine, f, d);
+		if (o->dsos[i] == NULL)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < hdr->nr_syms; i++) {
+		struct report_cache_sym *s = &f->syms[i];
+		struct symbol *sym;
+		struct dso *dso;
+
+		if (s->dso >= hdr->nr_dsos || s->end < s->start ||
+		    !report_cache__valid_string(f, s->name))
+			return -EINVAL;
+
+		dso = o->dsos[s->dso];
+		/* symbols of dsos already loaded are just looked up */
+		sym = dso__loaded(dso) ? dso__find_symbol(dso, s->start) : NULL;
+		if (sym == NULL || sym->start != s->start ||
+		    strcmp(sym->name, f->strings + s->name)) {
+			sym = dso__new_symbol(dso, s->start, s->end - s->start,
+					      s->binding, s->type,
+					      f->strings + s->name);
+			if (sym == NULL)
+				return -ENOMEM;
+			dso__insert_symbol(dso, sym);
+		}
+		o->syms[i] = sym;
+	}
+
+	/* the symbols that weren't hit are not needed */
+	for (i = 0; i < hdr->nr_dsos; i++)
+		dso__set_loaded(o->dsos[i]);
+
+	for (i = 0; i < hdr->nr_maps; i++) {
+		struct report_cache_map *m = &f->maps[i];
+		struct map *map;
+
+		if (m->dso >= hdr->nr_dsos)
+			return -EINVAL;
+
+		map = map__new2(m->start, o->dsos[m->dso]);
+		if (map == NULL)
+			return -ENOMEM;
+
+		map->end   = m->end;
+		map->pgoff = m->pgoff;
+		map->reloc = m->reloc;
+		if (m->identity)
+			map->map_ip = map->unmap_ip = identity__map_ip;
+		/* they are not in any map_groups, but kernel maps need one */
+		if (map->dso->kernel)
+			map->groups = &machine->kmaps;
+		o->maps[i] = map;
+	}
+
+	for (i = 0; i < hdr->nr_threads; i++) {
+		struct report_cache_thread *t = &f->threads[i];
+
+		o->threads[i] = machine__findnew_thread(machine, t->pid, t->tid);
+		if (o->threads[i] == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static struct perf_evsel *report_cache__evsel(struct perf_evlist *evlist,
+					      u32 idx)
+{
+	struct perf_evsel *evsel;
+
+	evlist__for_each_entry(evlist, evsel) {
+		if ((u32)evsel->idx == idx)
+			return evsel;
+	}
+
+	return NULL;
+}
+
+static bool report_cache__valid_row(struct perf_evlist *evlist,
+				    struct report_cache_file *f,
+				    struct report_cache_row *row)
+{
+	struct report_cache_header *hdr = f->hdr;
+
+	return report_cache__evsel(evlist, row->evsel) &&
+	       row->thread < hdr->nr_threads &&
+	       report_cache__valid_string(f, row->comm) &&
+	       (row->map == REPORT_CACHE_NONE || row->map < hdr->nr_maps) &&
+	       (row->sym == REPORT_CACHE_NONE ||
+		(row->sym < hdr->nr_syms && row->map != REPORT_CACHE_NONE));
+}
+
+static int report_cache__replay_row(struct machine *machine,
+				    struct perf_evlist *evlist,
+				    struct report_cache_file *f,
+				    struct report_cache_objs *o,
+				    struct report_cache_row *row,
+				    report_cache_cb_t cb, void *arg)
+{
+	struct perf_evsel *evsel = report_cache__evsel(evlist, row->evsel);
+	struct perf_sample sample;
+	struct addr_location al;
+	struct thread *thread;
+	const char *comm;
+
+	thread = o->threads[row->thread];
+	comm = f->strings + row->comm;
+	if (strcmp(thread__comm_str(thread), comm) &&
+	    thread__set_comm(thread, comm, row->time))
+		return -ENOMEM;
+
+	memset(&sample, 0, sizeof(sample));
+	sample.ip	   = row->ip;
+	sample.pid	   = thread->pid_;
+	sample.tid	   = thread->tid;
+	sample.time	   = row->time;
+	sample.cpu	   = row->cpu;
+	sample.period	   = row->period;
+	sample.weight	   = row->weight;
+	sample.transaction = row->transaction;
+	sample.cpumode	   = row->cpumode;
+
+	memset(&al, 0, sizeof(al));
+	al.machine = machine;
+	al.thread  = thread;
+	al.map	   = row->map != REPORT_CACHE_NONE ? o->maps[row->map] : NULL;
+	al.sym	   = row->sym != REPORT_CACHE_NONE ? o->syms[row->sym] : NULL;
+	al.addr	   = row->addr;
+	al.level   = row->level;
+	al.cpumode = row->cpumode;
+	al.cpu	   = row->cpu;
+	al.socket  = -1;
+
+	if (al.cpu >= 0 && machine->env && machine->env->cpu)
+		al.socket = machine->env->cpu[al.cpu].socket_id;
+
+	addr_location__filter(&al);
+
+	return cb(arg, evsel, &sample, &al);
+}
+
+/*
+ * Hand the samples kept in the cache of the session data file to cb, in
+ * the order they were delivered, instead of processing its events.
+ */
+int report_cache__replay(struct perf_session *session,
+			 report_cache_cb_t cb, void *arg)
+{
+	struct machine *machine = &session->machines.host;
+	struct report_cache_objs objs = { .dsos = NULL, };
+	struct report_cache_file f;
+	char *filename, *buf = NULL;
+	u64 i;
+	int err;
+
+	filename = report_cache__filename(session);
+	if (filename == NULL)
+		return -ENOMEM;
+
+	err = report_cache__read(session, filename, &buf, &f);
+	if (err)
+		goto out_free;
+
+	for (i = 0; i < f.hdr->nr_rows; i++) {
+		if (!report_cache__valid_row(session->evlist, &f, &f.rows[i])) {
+			pr_debug("Bad report cache %s\n", filename);
+			err = -ENOENT;
+			goto out_free;
+		}
+	}
+
+	err = report_cache_objs__init(&objs, machine, &f);
+	if (err) {
+		pr_debug("Bad report cache %s\n", filename);
+		goto out_exit;
+	}
+
+	memcpy(&session->evlist->stats, f.stats, f.hdr->stats_size);
+
+	for (i = 0; i < f.hdr->nr_rows && !err && !session_done(); i++)
+		err = report_cache__replay_row(machine, session->evlist, &f,
+					       &objs, &f.rows[i], cb, arg);
+
+	if (!err)
+		pr_debug("Read %" PRIu64 " resolved samples from %s\n",
+			 f.hdr->nr_rows, filename);
+out_exit:
+	report_cache_objs__exit(&objs, &f);
+out_free:
+	free(buf);
+	free(filename);
+	return err;
+}
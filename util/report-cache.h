@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_REPORT_CACHE_H
+#define __PERF_REPORT_CACHE_H
+
+#include <linux/types.h>
+#include "build-id.h"
+
+struct addr_location;
+struct perf_evsel;
+struct perf_sample;
+struct perf_session;
+struct report_cache;
+
+/*
+ * The samples of a perf.data file as 'perf report' resolved them, kept
+ * next to it in <perf.data>.report-cache, so reports with other sort keys
+ * or filters rebuild their hists from it without processing the events
+ * and resolving the samples again:
+ *
+ *   struct report_cache_header
+ *   struct events_stats	stats, of stats_size
+ *   char			strings[strings_size]
+ *   struct report_cache_dso	[nr_dsos]
+ *   struct report_cache_map	[nr_maps]
+ *   struct report_cache_sym	[nr_syms]
+ *   struct report_cache_thread	[nr_threads]
+ *   struct report_cache_row	[nr_rows]
+ *
+ * Only the samples of the host machine are kept, without their callchains,
+ * in the order they were delivered.
+ */
+#define REPORT_CACHE_SUFFIX	".report-cache"
+#define REPORT_CACHE_MAGIC	0x4548434143545052ULL	/* "RPTCACHE" */
+#define REPORT_CACHE_VERSION	1
+#define REPORT_CACHE_NONE	((u32)~0U)
+
+struct report_cache_header {
+	u64	magic;
+	u32	version;
+	u32	stats_size;
+	/* of the perf.data file the rows were resolved from */
+	u64	data_size;
+	u64	data_mtime;
+	/* of the options changing how the samples are resolved */
+	u64	key;
+	u64	strings_size;
+	u32	nr_dsos;
+	u32	nr_maps;
+	u32	nr_syms;
+	u32	nr_threads;
+	u64	nr_rows;
+};
+
+/* names are offsets in the strings */
+struct report_cache_dso {
+	u32	long_name;
+	u32	short_name;
+	u8	build_id[BUILD_ID_SIZE];
+	u8	has_build_id;
+	u8	kernel;
+	u8	__reserved[2];
+};
+
+struct report_cache_map {
+	u64	start;
+	u64	end;
+	u64	pgoff;
+	u64	reloc;
+	u32	dso;
+	u32	identity;
+};
+
+struct report_cache_sym {
+	u64	start;
+	u64	end;
+	u32	dso;
+	u32	name;
+	u8	binding;
+	u8	type;
+	u8	__reserved[6];
+};
+
+struct report_cache_thread {
+	s32	pid;
+	s32	tid;
+};
+
+/* map and sym are REPORT_CACHE_NONE when unresolved */
+struct report_cache_row {
+	u64	ip;
+	u64	addr;
+	u64	time;
+	u64	period;
+	u64	weight;
+	u64	transaction;
+	s32	cpu;
+	u32	evsel;
+	u32	thread;
+	u32	comm;
+	u32	map;
+	u32	sym;
+	u8	cpumode;
+	s8	level;
+	u8	__reserved[6];
+};
+
+typedef int (*report_cache_cb_t)(void *arg, struct perf_evsel *evsel,
+				 struct perf_sample *sample,
+				 struct addr_location *al);
+
+struct report_cache *report_cache__new(struct perf_session *session);
+void report_cache__delete(struct report_cache *rc);
+/* keep sample, resolved to al, some of them can't be and spoil the cache */
+void report_cache__add(struct report_cache *rc, struct perf_evsel *evsel,
+		       struct perf_sample *sample, struct addr_location *al);
+int report_cache__write(struct report_cache *rc);
+/* returns -ENOENT if there is no cache that is up to date */
+int report_cache__replay(struct perf_session *session,
+			 report_cache_cb_t cb, void *arg);
+
+#endif /* __PERF_REPORT_CACHE_H */
@@ -0,0 +1,252 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+
+#include "callchain.h"
+#include "evsel.h"
+#include "event.h"
+#include "map.h"
+#include "symbol.h"
+#include "thread.h"
+#include "util.h"
+#include "script-binary.h"
+
+struct script_binary_str {
+	char	*s;
+	u32	hash;
+	u32	id;
+};
+
+struct script_binary {
+	FILE			 *fp;
+	/* open addressing, a power of two, at most half full */
+	struct script_binary_str *strs;
+	u32			 nr_strs;
+	u32			 alloc_strs;
+	/* the sample being written */
+	struct script_binary_sample *sample;
+	u32			 max_frames;
+};
+
+static u32 str_hash(const char *s)
+{
+	u32 hash = 2166136261u;
+
+	while (*s)
+		hash = (hash ^ (unsigned char)*s++) * 16777619u;
+	return hash;
+}
+
+static int script_binary__write(struct script_binary *sb, const void *buf, size_t size)
+{
+	if (fwrite(buf, size, 1, sb->fp) != 1)
+		return -errno;
+	return 0;
+}
+
+static int script_binary__grow_strs(struct script_binary *sb)
+{
+	u32 i, alloc = sb->alloc_strs ? sb->alloc_strs * 2 : 4096;
+	struct script_binary_str *strs = calloc(alloc, sizeof(*strs));
+
+	if (strs == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < sb->alloc_strs; i++) {
+		struct script_binary_str *str = &sb->strs[i];
+		u32 pos = str->hash & (alloc - 1);
+
+		if (str->s == NULL)
+			continue;
+
+		while (strs[pos].s)
+			pos = (pos + 1) & (alloc - 1);
+		strs[pos] = *str;
+	}
+
+	free(sb->strs);
+	sb->strs = strs;
+	sb->alloc_strs = alloc;
+	return 0;
+}
+
+static int script_binary__write_string(struct script_binary *sb, u32 id, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	size_t size = PERF_ALIGN(sizeof(struct script_binary_string) + len, sizeof(u64));
+	struct script_binary_string *rec = zalloc(size);
+	int err;
+
+	if (rec == NULL)
+		return -ENOMEM;
+
+	rec->rec.size = size;
+	rec->rec.type = SCRIPT_BINARY_STRING;
+	rec->id	      = id;
+	memcpy(rec->str, s, len);
+
+	err = script_binary__write(sb, rec, size);
+	free(rec);
+	return err;
+}
+
+/* The id of s, writing it the first time it's seen, 0 for no string */
+static int script_binary__intern(struct script_binary *sb, const char *s, u32 *id)
+{
+	struct script_binary_str *str;
+	u32 hash, pos;
+	int err;
+
+	*id = 0;
+	if (s == NULL)
+		return 0;
+
+	if (sb->nr_strs * 2 >= sb->alloc_strs) {
+		err = script_binary__grow_strs(sb);
+		if (err)
+			return err;
+	}
+
+	hash = str_hash(s);
+	pos = hash & (sb->alloc_strs - 1);
+
+	for (str = &sb->strs[pos]; str->s; str = &sb->strs[pos]) {
+		if (str->hash == hash && !strcmp(str->s, s)) {
+			*id = str->id;
+			return 0;
+		}
+		pos = (pos + 1) & (sb->alloc_strs - 1);
+	}
+
+	str->s = strdup(s);
+	if (str->s == NULL)
+		return -ENOMEM;
+	str->hash = hash;
+	str->id	  = ++sb->nr_strs;
+
+	*id = str->id;
+	return script_binary__write_string(sb, str->id, s);
+}
+
+static int script_binary__frame(struct script_binary *sb,
+				struct script_binary_frame *frame,
+				u64 ip, struct map *map, struct symbol *sym)
+{
+	int err;
+
+	frame->ip      = ip;
+	frame->sym_off = 0;
+
+	if (sym && map)
+		frame->sym_off = map->map_ip(map, ip) - sym->start;
+
+	err = script_binary__intern(sb, sym ? sym->name : NULL, &frame->sym);
+	if (!err)
+		err = script_binary__intern(sb, map ? map->dso->long_name : NULL,
+					    &frame->dso);
+	return err;
+}
+
+int script_binary__write_sample(struct script_binary *sb, struct perf_evsel *evsel,
+				struct perf_sample *sample, struct addr_location *al,
+				struct callchain_cursor *cursor)
+{
+	struct script_binary_sample *rec;
+	u32 nr_frames = 1;
+	size_t size;
+	int err;
+
+	if (cursor && cursor->nr)
+		nr_frames = cursor->nr;
+	else
+		cursor = NULL;
+
+	if (nr_frames > sb->max_frames) {
+		rec = realloc(sb->sample, sizeof(*rec) + nr_frames * sizeof(rec->frames[0]));
+		if (rec == NULL)
+			return -ENOMEM;
+		sb->sample = rec;
+		sb->max_frames = nr_frames;
+	}
+	rec = sb->sample;
+
+	rec->time   = sample->time;
+	rec->period = sample->period;
+	rec->addr   = sample->addr;
+	rec->pid    = sample->pid;
+	rec->tid    = sample->tid;
+	rec->cpu    = sample->cpu;
+
+	err = script_binary__intern(sb, perf_evsel__name(evsel), &rec->event);
+	if (!err)
+		err = script_binary__intern(sb, thread__comm_str(al->thread), &rec->comm);
+
+	rec->nr_frames = 0;
+
+	if (cursor) {
+		callchain_cursor_commit(cursor);
+
+		while (!err && rec->nr_frames < nr_frames) {
+			struct callchain_cursor_node *node = callchain_cursor_current(cursor);
+
+			if (node == NULL)
+				break;
+
+			err = script_binary__frame(sb, &rec->frames[rec->nr_frames++],
+						   node->ip, node->map, node->sym);
+			callchain_cursor_advance(cursor);
+		}
+	} else if (!err) {
+		err = script_binary__frame(sb, &rec->frames[rec->nr_frames++],
+					   sample->ip, al->map, al->sym);
+	}
+
+	if (err)
+		return err;
+
+	size = sizeof(*rec) + rec->nr_frames * sizeof(rec->frames[0]);
+	rec->rec.size = size;
+	rec->rec.type = SCRIPT_BINARY_SAMPLE;
+
+	return script_binary__write(sb, rec, size);
+}
+
+struct script_binary *script_binary__new(FILE *fp)
+{
+	struct script_binary_header header = {
+		.magic	    = SCRIPT_BINARY_MAGIC,
+		.version    = SCRIPT_BINARY_VERSION,
+		.byte_order = SCRIPT_BINARY_ORDER,
+	};
+	struct script_binary *sb = zalloc(sizeof(*sb));
+
+	if (sb == NULL)
+		return NULL;
+
+	sb->fp = fp;
+
+	if (script_binary__write(sb, &header, sizeof(header))) {
+		free(sb);
+		return NULL;
+	}
+
+	return sb;
+}
+
+void script_binary__delete(struct script_binary *sb)
+{
+	u32 i;
+
+	if (sb == NULL)
+		return;
+
+	fflush(sb->fp);
+
+	for (i = 0; i < sb->alloc_strs; i++)
+		free(sb->strs[i].s);
+	free(sb->strs);
+	free(sb->sample);
+	free(sb);
+}
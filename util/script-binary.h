@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_SCRIPT_BINARY_H
+#define __PERF_SCRIPT_BINARY_H
+
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * The samples of 'perf script --binary', for tools that would otherwise
+ * parse the text of 'perf script'.
+ *
+ * A script_binary_header, then records starting with a script_binary_record
+ * that has the size of the whole record, padding included, so that the
+ * unknown types can be skipped. Everything is in the byte order of the
+ * host, see byte_order, and 8 byte aligned.
+ *
+ * The comms, events, symbols and dsos are strings interned in STRING
+ * records, each before the first record using its id; id 0 is unknown.
+ */
+#define SCRIPT_BINARY_MAGIC	"PERFSCRB"
+#define SCRIPT_BINARY_VERSION	1
+#define SCRIPT_BINARY_ORDER	0x01020304
+
+struct script_binary_header {
+	char	magic[8];
+	u32	version;
+	u32	byte_order;
+};
+
+enum script_binary_type {
+	SCRIPT_BINARY_STRING	= 1,
+	SCRIPT_BINARY_SAMPLE	= 2,
+};
+
+struct script_binary_record {
+	u32	size;
+	u32	type;
+};
+
+struct script_binary_string {
+	struct script_binary_record rec;
+	u32	id;
+	char	str[];		/* NUL terminated */
+};
+
+struct script_binary_frame {
+	u64	ip;
+	u64	sym_off;	/* of ip in the symbol */
+	u32	sym;
+	u32	dso;
+};
+
+/* The frames start with the sample ip, then its callers, if any */
+struct script_binary_sample {
+	struct script_binary_record rec;
+	u64	time;
+	u64	period;
+	u64	addr;
+	u32	pid, tid;
+	u32	cpu;
+	u32	event;
+	u32	comm;
+	u32	nr_frames;
+	struct script_binary_frame frames[];
+};
+
+struct script_binary;
+struct perf_evsel;
+struct perf_sample;
+struct addr_location;
+struct callchain_cursor;
+
+struct script_binary *script_binary__new(FILE *fp);
+void script_binary__delete(struct script_binary *sb);
+int script_binary__write_sample(struct script_binary *sb, struct perf_evsel *evsel,
+				struct perf_sample *sample, struct addr_location *al,
+				struct callchain_cursor *cursor);
+
+#endif /* __PERF_SCRIPT_BINARY_H */
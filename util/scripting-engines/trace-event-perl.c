@@ -515,6 +515,16 @@ error:
 	return err;
 }
 
+static const char *perl_filter(void)
+{
+	SV *filter = get_sv("main::perf_script_filter", 0);
+
+	if (!filter || !SvOK(filter))
+		return NULL;
+
+	return SvPV_nolen(filter);
+}
+
 static int perl_flush_script(void)
 {
 	return 0;
@@ -751,4 +761,5 @@ struct scripting_ops perl_scripting_ops = {
 	.stop_script = perl_stop_script,
 	.process_event = perl_process_event,
 	.generate_script = perl_generate_script,
+	.filter = perl_filter,
 };
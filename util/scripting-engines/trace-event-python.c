@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <linux/bitmap.h>
 #include <linux/compiler.h>
+#include <linux/hash.h>
 #include <linux/time64.h>
 
 #include "../../perf.h"
@@ -63,6 +64,8 @@
   PyInt_FromLong(arg)
 #define _PyLong_AsLong(arg) \
   PyInt_AsLong(arg)
+#define _PyUnicode_AsString(arg) \
+  PyString_AsString(arg)
 #define _PyCapsule_New(arg1, arg2, arg3) \
   PyCObject_FromVoidPtr((arg1), (arg2))
 
@@ -78,6 +81,8 @@ PyMODINIT_FUNC initperf_trace_context(void);
   PyLong_FromLong(arg)
 #define _PyLong_AsLong(arg) \
   PyLong_AsLong(arg)
+#define _PyUnicode_AsString(arg) \
+  PyUnicode_AsUTF8(arg)
 #define _PyCapsule_New(arg1, arg2, arg3) \
   PyCapsule_New((arg1), (arg2), (arg3))
 
@@ -99,6 +104,23 @@ static int zero_flag_atom;
 
 static PyObject *main_module, *main_dict;
 
+#define TABLE_BATCH_ROWS	16384
+
+/*
+ * The rows of a table exported to <table>_batch(format, rows) instead of a
+ * call per row, rows being a bytes object of the rows packed as described
+ * by the struct module format.
+ */
+struct table_batch {
+	PyObject		*handler;
+	const char		*handler_name;
+	const char		*format;
+	unsigned int		row_size;
+	unsigned int		nr;
+	char			*buf;
+	char			*pos;
+};
+
 struct tables {
 	struct db_export	dbe;
 	PyObject		*evsel_handler;
@@ -112,11 +134,72 @@ struct tables {
 	PyObject		*sample_handler;
 	PyObject		*call_path_handler;
 	PyObject		*call_return_handler;
+	struct table_batch	sample_rows;
+	struct table_batch	call_path_rows;
+	struct table_batch	call_return_rows;
 	bool			db_export_mode;
 };
 
 static struct tables tables_global;
 
+#define SAMPLE_BATCH_DEFAULT	4096
+
+/*
+ * The samples handed to process_event_batch(), one array per field.  The
+ * strings are in one list passed to every batch, the arrays have indexes
+ * into it, so each name becomes a Python string once.
+ */
+struct sample_batch {
+	PyObject		*handler;
+	PyObject		*strings;
+	unsigned int		nr;
+	unsigned int		size;
+	u64			*time;
+	u64			*ip;
+	u64			*addr;
+	u64			*period;
+	s32			*pid;
+	s32			*tid;
+	s32			*cpu;
+	u32			*ev;
+	u32			*comm;
+	u32			*dso;
+	u32			*sym;
+	/* index in strings of each string, by address */
+	const void		**str_keys;
+	u32			*str_ids;
+	unsigned int		str_size;
+	unsigned int		str_nr;
+};
+
+static struct sample_batch sample_batch;
+
+/*
+ * What python_process_tracepoint() needs of an event, looked up once, on
+ * its first sample: the handler, how many arguments it takes and the
+ * fields, with their names made Python strings for the dict keys.
+ */
+struct tp_field {
+	struct tep_format_field	*field;
+	PyObject		*name;
+};
+
+struct tp_event {
+	PyObject		*handler;
+	char			*name;
+	PyObject		*handler_name;
+	/* trace_unhandled, getting the fields in a dict */
+	bool			unhandled;
+	int			argc;
+	struct tep_format_field	*common_pid;
+	unsigned int		nr_fields;
+	struct tp_field		fields[];
+};
+
+/* by event id */
+static struct tp_event **tp_events;
+static unsigned int tp_events_size;
+
 static void handler_call_die(const char *handler_name) __noreturn;
 static void handler_call_die(const char *handler_name)
 {
@@ -138,6 +221,12 @@ static void pydict_set_item_string_decref(PyObject *dict, const char *key, PyObj
 	Py_DECREF(val);
 }
 
+static void pydict_set_item_decref(PyObject *dict, PyObject *key, PyObject *val)
+{
+	PyDict_SetItem(dict, key, val);
+	Py_DECREF(val);
+}
+
 static PyObject *get_handler(const char *handler_name)
 {
 	PyObject *handler;
@@ -787,23 +876,120 @@ static PyObject *get_perf_sample_dict(struct perf_sample *sample,
 	return dict;
 }
 
+static struct tp_event *tp_event__new(struct tep_event *event)
+{
+	const char *default_handler_name = "trace_unhandled";
+	struct tep_format_field *field;
+	char handler_name[256];
+	struct tp_event *tp;
+	unsigned int n = 0;
+
+	for (field = event->format.fields; field; field = field->next)
+		n++;
+
+	tp = zalloc(sizeof(*tp) + n * sizeof(tp->fields[0]));
+	if (!tp)
+		Py_FatalError("couldn't allocate the event accessors");
+
+	snprintf(handler_name, sizeof(handler_name), "%s__%s",
+		 event->system, event->name);
+
+	if (!test_and_set_bit(event->id, events_defined))
+		define_event_symbols(event, handler_name, event->print_fmt.args);
+
+	tp->handler = get_handler(handler_name);
+	if (!tp->handler) {
+		tp->handler = get_handler(default_handler_name);
+		tp->unhandled = true;
+	}
+
+	tp->name = strdup(handler_name);
+	tp->handler_name = _PyUnicode_FromString(handler_name);
+	if (!tp->name || !tp->handler_name)
+		Py_FatalError("couldn't create Python string");
+
+	if (tp->handler) {
+		Py_INCREF(tp->handler);
+		tp->argc = get_argument_count(tp->handler);
+	}
+
+	tp->common_pid = tep_find_common_field(event, "common_pid");
+
+	for (field = event->format.fields; field; field = field->next) {
+		struct tp_field *f = &tp->fields[tp->nr_fields++];
+
+		f->field = field;
+		f->name  = _PyUnicode_FromString(field->name);
+		if (!f->name)
+			Py_FatalError("couldn't create Python string");
+	}
+
+	return tp;
+}
+
+static struct tp_event *tp_event__find(struct tep_event *event)
+{
+	unsigned int id = event->id;
+
+	if (id >= tp_events_size) {
+		unsigned int size = max(id + 1, tp_events_size * 2);
+		struct tp_event **events;
+
+		events = realloc(tp_events, size * sizeof(*events));
+		if (!events)
+			Py_FatalError("couldn't allocate the event accessors");
+
+		memset(events + tp_events_size, 0,
+		       (size - tp_events_size) * sizeof(*events));
+		tp_events = events;
+		tp_events_size = size;
+	}
+
+	if (!tp_events[id])
+		tp_events[id] = tp_event__new(event);
+
+	return tp_events[id];
+}
+
+static void tp_events__exit(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < tp_events_size; i++) {
+		struct tp_event *tp = tp_events[i];
+
+		if (!tp)
+			continue;
+
+		Py_XDECREF(tp->handler);
+		Py_DECREF(tp->handler_name);
+		free(tp->name);
+		for (j = 0; j < tp->nr_fields; j++)
+			Py_DECREF(tp->fields[j].name);
+		free(tp);
+	}
+
+	zfree(&tp_events);
+	tp_events_size = 0;
+}
+
 static void python_process_tracepoint(struct perf_sample *sample,
 				      struct perf_evsel *evsel,
 				      struct addr_location *al)
 {
 	struct tep_event *event = evsel->tp_format;
-	PyObject *handler, *context, *t, *obj = NULL, *callchain;
+	PyObject *context, *t, *obj = NULL, *callchain;
 	PyObject *dict = NULL, *all_entries_dict = NULL;
 	static char handler_name[256];
-	struct tep_format_field *field;
+	struct tp_event *tp;
 	unsigned long s, ns;
-	unsigned n = 0;
-	int pid;
+	unsigned int i, n = 0, size;
+	int pid = 0;
 	int cpu = sample->cpu;
 	void *data = sample->raw_data;
 	unsigned long long nsecs = sample->time;
 	const char *comm = thread__comm_str(al->thread);
-	const char *default_handler_name = "trace_unhandled";
+	bool all_entries;
 
 	if (!event) {
 		snprintf(handler_name, sizeof(handler_name),
@@ -811,24 +997,30 @@ static void python_process_tracepoint(struct perf_sample *sample,
 		Py_FatalError(handler_name);
 	}
 
-	pid = raw_field_value(event, "common_pid", data);
-
-	sprintf(handler_name, "%s__%s", event->system, event->name);
+	tp = tp_event__find(event);
+	if (!tp->handler)
+		return;
 
-	if (!test_and_set_bit(event->id, events_defined))
-		define_event_symbols(event, handler_name, event->print_fmt.args);
+	if (tp->common_pid)
+		pid = tep_read_number(event->pevent, data + tp->common_pid->offset,
+				      tp->common_pid->size);
 
-	handler = get_handler(handler_name);
-	if (!handler) {
-		handler = get_handler(default_handler_name);
-		if (!handler)
-			return;
+	if (tp->unhandled) {
 		dict = PyDict_New();
 		if (!dict)
 			Py_FatalError("couldn't create Python dict");
+		/* handler name, context, dict */
+		size = 3;
+	} else {
+		/* handler name, context, the 6 common ones and the fields */
+		size = 8 + tp->nr_fields;
 	}
 
-	t = PyTuple_New(MAX_FIELDS);
+	all_entries = tp->argc == (int)size + 1;
+	if (all_entries)
+		size++;
+
+	t = PyTuple_New(size);
 	if (!t)
 		Py_FatalError("couldn't create Python tuple");
 
@@ -841,7 +1033,8 @@ static void python_process_tracepoint(struct perf_sample *sample,
 
 	context = _PyCapsule_New(scripting_context, NULL, NULL);
 
-	PyTuple_SetItem(t, n++, _PyUnicode_FromString(handler_name));
+	Py_INCREF(tp->handler_name);
+	PyTuple_SetItem(t, n++, tp->handler_name);
 	PyTuple_SetItem(t, n++, context);
 
 	/* ip unwinding */
@@ -864,7 +1057,8 @@ static void python_process_tracepoint(struct perf_sample *sample,
 		pydict_set_item_string_decref(dict, "common_comm", _PyUnicode_FromString(comm));
 		pydict_set_item_string_decref(dict, "common_callchain", callchain);
 	}
-	for (field = event->format.fields; field; field = field->next) {
+	for (i = 0; i < tp->nr_fields; i++) {
+		struct tep_format_field *field = tp->fields[i].field;
 		unsigned int offset, len;
 		unsigned long long val;
 
@@ -891,14 +1085,14 @@ static void python_process_tracepoint(struct perf_sample *sample,
 		if (!dict)
 			PyTuple_SetItem(t, n++, obj);
 		else
-			pydict_set_item_string_decref(dict, field->name, obj);
+			pydict_set_item_decref(dict, tp->fields[i].name, obj);
 
 	}
 
 	if (dict)
 		PyTuple_SetItem(t, n++, dict);
 
-	if (get_argument_count(handler) == (int) n + 1) {
+	if (all_entries) {
 		all_entries_dict = get_perf_sample_dict(sample, evsel, al,
 			callchain);
 		PyTuple_SetItem(t, n++,	all_entries_dict);
@@ -906,13 +1100,10 @@ static void python_process_tracepoint(struct perf_sample *sample,
 		Py_DECREF(callchain);
 	}
 
-	if (_PyTuple_Resize(&t, n) == -1)
-		Py_FatalError("error resizing Python tuple");
-
-	if (!dict)
-		call_object(handler, t, handler_name);
+	if (!tp->unhandled)
+		call_object(tp->handler, t, tp->name);
 	else
-		call_object(handler, t, default_handler_name);
+		call_object(tp->handler, t, "trace_unhandled");
 
 	Py_DECREF(t);
 }
@@ -947,6 +1138,98 @@ static int tuple_set_string(PyObject *t, unsigned int pos, const char *s)
 	return PyTuple_SetItem(t, pos, _PyUnicode_FromString(s));
 }
 
+/* The size of the rows of a "=<n>q<n>i..." format */
+static unsigned int table_batch__row_size(const char *format)
+{
+	unsigned int size = 0;
+	char *end;
+
+	for (format++; *format; format = end + 1) {
+		unsigned long n = strtoul(format, &end, 10);
+
+		if (end == format)
+			n = 1;
+		size += n * (*end == 'q' ? sizeof(u64) : sizeof(s32));
+	}
+
+	return size;
+}
+
+static bool table_batch__init(struct table_batch *b, const char *handler_name,
+			      const char *format)
+{
+	b->handler = get_handler(handler_name);
+	if (!b->handler)
+		return false;
+
+	b->handler_name = handler_name;
+	b->format	= format;
+	b->row_size	= table_batch__row_size(format);
+	b->buf		= malloc(TABLE_BATCH_ROWS * b->row_size);
+	if (!b->buf)
+		Py_FatalError("couldn't allocate the table batch");
+	b->pos		= b->buf;
+	return true;
+}
+
+static void table_batch__exit(struct table_batch *b)
+{
+	zfree(&b->buf);
+	b->handler = NULL;
+}
+
+static void table_batch__flush(struct table_batch *b)
+{
+	PyObject *t;
+
+	if (!b->nr)
+		return;
+
+	t = tuple_new(2);
+	tuple_set_string(t, 0, b->format);
+	PyTuple_SetItem(t, 1, _PyBytes_FromStringAndSize(b->buf,
+							 b->pos - b->buf));
+
+	call_object(b->handler, t, b->handler_name);
+
+	Py_DECREF(t);
+
+	b->nr  = 0;
+	b->pos = b->buf;
+}
+
+static void table_batch__end_row(struct table_batch *b)
+{
+	if (++b->nr == TABLE_BATCH_ROWS)
+		table_batch__flush(b);
+}
+
+static void row_set_u64(struct table_batch *b, u64 val)
+{
+	memcpy(b->pos, &val, sizeof(val));
+	b->pos += sizeof(val);
+}
+
+static void row_set_s32(struct table_batch *b, s32 val)
+{
+	memcpy(b->pos, &val, sizeof(val));
+	b->pos += sizeof(val);
+}
+
+static void tables__flush_batches(struct tables *tables)
+{
+	table_batch__flush(&tables->sample_rows);
+	table_batch__flush(&tables->call_path_rows);
+	table_batch__flush(&tables->call_return_rows);
+}
+
+static void tables__exit_batches(struct tables *tables)
+{
+	table_batch__exit(&tables->sample_rows);
+	table_batch__exit(&tables->call_path_rows);
+	table_batch__exit(&tables->call_return_rows);
+}
+
 static int python_export_evsel(struct db_export *dbe, struct perf_evsel *evsel)
 {
 	struct tables *tables = container_of(dbe, struct tables, dbe);
@@ -1109,8 +1392,36 @@ static int python_export_sample(struct db_export *dbe,
 				struct export_sample *es)
 {
 	struct tables *tables = container_of(dbe, struct tables, dbe);
+	struct table_batch *b = &tables->sample_rows;
 	PyObject *t;
 
+	if (b->handler) {
+		row_set_u64(b, es->db_id);
+		row_set_u64(b, es->evsel->db_id);
+		row_set_u64(b, es->al->machine->db_id);
+		row_set_u64(b, es->al->thread->db_id);
+		row_set_u64(b, es->comm_db_id);
+		row_set_u64(b, es->dso_db_id);
+		row_set_u64(b, es->sym_db_id);
+		row_set_u64(b, es->offset);
+		row_set_u64(b, es->sample->ip);
+		row_set_u64(b, es->sample->time);
+		row_set_s32(b, es->sample->cpu);
+		row_set_u64(b, es->addr_dso_db_id);
+		row_set_u64(b, es->addr_sym_db_id);
+		row_set_u64(b, es->addr_offset);
+		row_set_u64(b, es->sample->addr);
+		row_set_u64(b, es->sample->period);
+		row_set_u64(b, es->sample->weight);
+		row_set_u64(b, es->sample->transaction);
+		row_set_u64(b, es->sample->data_src);
+		row_set_s32(b, es->sample->flags & PERF_BRANCH_MASK);
+		row_set_s32(b, !!(es->sample->flags & PERF_IP_FLAG_IN_TX));
+		row_set_u64(b, es->call_path_id);
+		table_batch__end_row(b);
+		return 0;
+	}
+
 	t = tuple_new(22);
 
 	tuple_set_u64(t, 0, es->db_id);
@@ -1146,12 +1457,22 @@ static int python_export_sample(struct db_export *dbe,
 static int python_export_call_path(struct db_export *dbe, struct call_path *cp)
 {
 	struct tables *tables = container_of(dbe, struct tables, dbe);
+	struct table_batch *b = &tables->call_path_rows;
 	PyObject *t;
 	u64 parent_db_id, sym_db_id;
 
 	parent_db_id = cp->parent ? cp->parent->db_id : 0;
 	sym_db_id = cp->sym ? *(u64 *)symbol__priv(cp->sym) : 0;
 
+	if (b->handler) {
+		row_set_u64(b, cp->db_id);
+		row_set_u64(b, parent_db_id);
+		row_set_u64(b, sym_db_id);
+		row_set_u64(b, cp->ip);
+		table_batch__end_row(b);
+		return 0;
+	}
+
 	t = tuple_new(4);
 
 	tuple_set_u64(t, 0, cp->db_id);
@@ -1171,8 +1492,26 @@ static int python_export_call_return(struct db_export *dbe,
 {
 	struct tables *tables = container_of(dbe, struct tables, dbe);
 	u64 comm_db_id = cr->comm ? cr->comm->db_id : 0;
+	struct table_batch *b = &tables->call_return_rows;
 	PyObject *t;
 
+	if (b->handler) {
+		row_set_u64(b, cr->db_id);
+		row_set_u64(b, cr->thread->db_id);
+		row_set_u64(b, comm_db_id);
+		row_set_u64(b, cr->cp->db_id);
+		row_set_u64(b, cr->call_time);
+		row_set_u64(b, cr->return_time);
+		row_set_u64(b, cr->branch_count);
+		row_set_u64(b, cr->call_ref);
+		row_set_u64(b, cr->return_ref);
+		row_set_u64(b, cr->cp->parent->db_id);
+		row_set_s32(b, cr->flags);
+		row_set_u64(b, cr->parent_db_id);
+		table_batch__end_row(b);
+		return 0;
+	}
+
 	t = tuple_new(12);
 
 	tuple_set_u64(t, 0, cr->db_id);
@@ -1238,6 +1577,220 @@ static void python_process_general_event(struct perf_sample *sample,
 	Py_DECREF(t);
 }
 
+static void sample_batch__grow_strings(struct sample_batch *b)
+{
+	unsigned int i, size = b->str_size ? b->str_size * 2 : 1024;
+	const void **keys = calloc(size, sizeof(*keys));
+	u32 *ids = calloc(size, sizeof(*ids));
+
+	if (!keys || !ids)
+		Py_FatalError("couldn't allocate the batch strings");
+
+	for (i = 0; i < b->str_size; i++) {
+		unsigned int h;
+
+		if (!b->str_keys[i])
+			continue;
+		h = hash_ptr(b->str_keys[i], 32) & (size - 1);
+		while (keys[h])
+			h = (h + 1) & (size - 1);
+		keys[h] = b->str_keys[i];
+		ids[h] = b->str_ids[i];
+	}
+
+	free(b->str_keys);
+	free(b->str_ids);
+	b->str_keys = keys;
+	b->str_ids = ids;
+	b->str_size = size;
+}
+
+/*
+ * The index in the strings list of str, which is a name perf keeps for
+ * as long as the session, so it is looked up by address.  Index 0 is None.
+ */
+static u32 sample_batch__string(struct sample_batch *b, const char *str)
+{
+	unsigned int h;
+	PyObject *obj;
+
+	if (!str)
+		return 0;
+
+	if (2 * (b->str_nr + 1) > b->str_size)
+		sample_batch__grow_strings(b);
+
+	h = hash_ptr(str, 32) & (b->str_size - 1);
+	while (b->str_keys[h]) {
+		if (b->str_keys[h] == str)
+			return b->str_ids[h];
+		h = (h + 1) & (b->str_size - 1);
+	}
+
+	obj = _PyUnicode_FromString(str);
+	if (!obj || PyList_Append(b->strings, obj))
+		Py_FatalError("couldn't add to the batch strings");
+	Py_DECREF(obj);
+
+	b->str_keys[h] = str;
+	b->str_ids[h] = PyList_GET_SIZE(b->strings) - 1;
+	b->str_nr++;
+
+	return b->str_ids[h];
+}
+
+static void set_batch_column(PyObject *dict, const char *key, void *array,
+			     unsigned int nr, Py_ssize_t itemsize,
+			     const char *format)
+{
+	Py_ssize_t shape = nr;
+	Py_buffer view = {
+		.buf	  = array,
+		.len	  = nr * itemsize,
+		.readonly = 1,
+		.itemsize = itemsize,
+		.format	  = (char *)format,
+		.ndim	  = 1,
+		.shape	  = &shape,
+		.strides  = &view.itemsize,
+	};
+	PyObject *mv = PyMemoryView_FromBuffer(&view);
+
+	if (!mv)
+		Py_FatalError("couldn't create Python memoryview");
+	pydict_set_item_string_decref(dict, key, mv);
+}
+
+/*
+ * Hand the batched samples to the script.  The columns are views of the
+ * arrays, without copies, so they are only valid during the call.
+ */
+static void sample_batch__flush(struct sample_batch *b)
+{
+	const char *handler_name = "process_event_batch";
+	PyObject *t, *dict;
+	unsigned int nr = b->nr;
+
+	if (!b->handler || !nr)
+		return;
+
+	dict = PyDict_New();
+	if (!dict)
+		Py_FatalError("couldn't create Python dictionary");
+
+	pydict_set_item_string_decref(dict, "nr", _PyLong_FromLong(nr));
+	set_batch_column(dict, "time", b->time, nr, sizeof(u64), "Q");
+	set_batch_column(dict, "ip", b->ip, nr, sizeof(u64), "Q");
+	set_batch_column(dict, "addr", b->addr, nr, sizeof(u64), "Q");
+	set_batch_column(dict, "period", b->period, nr, sizeof(u64), "Q");
+	set_batch_column(dict, "pid", b->pid, nr, sizeof(s32), "i");
+	set_batch_column(dict, "tid", b->tid, nr, sizeof(s32), "i");
+	set_batch_column(dict, "cpu", b->cpu, nr, sizeof(s32), "i");
+	set_batch_column(dict, "ev_name", b->ev, nr, sizeof(u32), "I");
+	set_batch_column(dict, "comm", b->comm, nr, sizeof(u32), "I");
+	set_batch_column(dict, "dso", b->dso, nr, sizeof(u32), "I");
+	set_batch_column(dict, "symbol", b->sym, nr, sizeof(u32), "I");
+	Py_INCREF(b->strings);
+	pydict_set_item_string_decref(dict, "strings", b->strings);
+
+	t = PyTuple_New(1);
+	if (!t)
+		Py_FatalError("couldn't create Python tuple");
+	PyTuple_SetItem(t, 0, dict);
+
+	call_object(b->handler, t, handler_name);
+
+	Py_DECREF(t);
+	b->nr = 0;
+}
+
+static void sample_batch__add(struct sample_batch *b,
+			      struct perf_sample *sample,
+			      struct perf_evsel *evsel,
+			      struct addr_location *al)
+{
+	unsigned int i = b->nr++;
+
+	b->time[i]   = sample->time;
+	b->ip[i]     = sample->ip;
+	b->addr[i]   = sample->addr;
+	b->period[i] = sample->period;
+	b->pid[i]    = sample->pid;
+	b->tid[i]    = sample->tid;
+	b->cpu[i]    = sample->cpu;
+	b->ev[i]     = sample_batch__string(b, perf_evsel__name(evsel));
+	b->comm[i]   = sample_batch__string(b, thread__comm_str(al->thread));
+	b->dso[i]    = sample_batch__string(b, al->map ? al->map->dso->name : NULL);
+	b->sym[i]    = sample_batch__string(b, al->sym ? al->sym->name : NULL);
+
+	if (b->nr == b->size)
+		sample_batch__flush(b);
+}
+
+/*
+ * Scripts defining process_event_batch() get the samples that are not
+ * tracepoints that way, perf_batch_size at a time, instead of one
+ * process_event() call with a dict per sample.
+ */
+static void set_batch_handler(struct sample_batch *b)
+{
+	const char *perf_batch_size = "perf_batch_size";
+	PyObject *size_obj;
+	long size = SAMPLE_BATCH_DEFAULT;
+
+	memset(b, 0, sizeof(*b));
+
+	b->handler = get_handler("process_event_batch");
+	if (!b->handler)
+		return;
+
+	size_obj = PyDict_GetItemString(main_dict, perf_batch_size);
+	if (size_obj) {
+		size = _PyLong_AsLong(size_obj);
+		if (size <= 0 || size > INT_MAX)
+			handler_call_die(perf_batch_size);
+	}
+
+	b->size	  = size;
+	b->time	  = calloc(size, sizeof(*b->time));
+	b->ip	  = calloc(size, sizeof(*b->ip));
+	b->addr	  = calloc(size, sizeof(*b->addr));
+	b->period = calloc(size, sizeof(*b->period));
+	b->pid	  = calloc(size, sizeof(*b->pid));
+	b->tid	  = calloc(size, sizeof(*b->tid));
+	b->cpu	  = calloc(size, sizeof(*b->cpu));
+	b->ev	  = calloc(size, sizeof(*b->ev));
+	b->comm	  = calloc(size, sizeof(*b->comm));
+	b->dso	  = calloc(size, sizeof(*b->dso));
+	b->sym	  = calloc(size, sizeof(*b->sym));
+	if (!b->time || !b->ip || !b->addr || !b->period || !b->pid ||
+	    !b->tid || !b->cpu || !b->ev || !b->comm || !b->dso || !b->sym)
+		Py_FatalError("couldn't allocate the sample batch");
+
+	b->strings = PyList_New(0);
+	if (!b->strings || PyList_Append(b->strings, Py_None))
+		Py_FatalError("couldn't create Python list");
+}
+
+static void sample_batch__exit(struct sample_batch *b)
+{
+	Py_XDECREF(b->strings);
+	free(b->time);
+	free(b->ip);
+	free(b->addr);
+	free(b->period);
+	free(b->pid);
+	free(b->tid);
+	free(b->cpu);
+	free(b->ev);
+	free(b->comm);
+	free(b->dso);
+	free(b->sym);
+	free(b->str_keys);
+	free(b->str_ids);
+	memset(b, 0, sizeof(*b));
+}
+
 static void python_process_event(union perf_event *event,
 				 struct perf_sample *sample,
 				 struct perf_evsel *evsel,
@@ -1253,6 +1806,8 @@ static void python_process_event(union perf_event *event,
 	default:
 		if (tables->db_export_mode)
 			db_export__sample(&tables->dbe, event, sample, evsel, al);
+		else if (sample_batch.handler)
+			sample_batch__add(&sample_batch, sample, evsel, al);
 		else
 			python_process_general_event(sample, evsel, al);
 	}
@@ -1387,6 +1942,12 @@ error:
 #define SET_TABLE_HANDLER(name) \
 	SET_TABLE_HANDLER_(name, name ## _handler, name ## _table)
 
+#define SET_TABLE_BATCH_HANDLER(name, format) do {			\
+	if (table_batch__init(&tables->name ## _rows,			\
+			      #name "_table_batch", format))		\
+		tables->dbe.export_ ## name = python_export_ ## name;	\
+} while (0)
+
 static void set_table_handlers(struct tables *tables)
 {
 	const char *perf_db_export_mode = "perf_db_export_mode";
@@ -1473,6 +2034,11 @@ static void set_table_handlers(struct tables *tables)
 	SET_TABLE_HANDLER(sample);
 	SET_TABLE_HANDLER(call_path);
 	SET_TABLE_HANDLER(call_return);
+
+	/* the tables with a row per sample or call can be exported in batches */
+	SET_TABLE_BATCH_HANDLER(sample, "=10qi8q2iq");
+	SET_TABLE_BATCH_HANDLER(call_path, "=4q");
+	SET_TABLE_BATCH_HANDLER(call_return, "=10qiq");
 }
 
 #if PY_MAJOR_VERSION < 3
@@ -1555,6 +2121,7 @@ static int python_start_script(const char *script, int argc, const char **argv)
 	}
 
 	set_table_handlers(tables);
+	set_batch_handler(&sample_batch);
 
 	if (tables->db_export_mode) {
 		err = db_export__branch_types(&tables->dbe);
@@ -1576,7 +2143,13 @@ static int python_flush_script(void)
 {
 	struct tables *tables = &tables_global;
 
-	return db_export__flush(&tables->dbe);
+	int err;
+
+	sample_batch__flush(&sample_batch);
+
+	err = db_export__flush(&tables->dbe);
+	tables__flush_batches(tables);
+	return err;
 }
 
 /*
@@ -1586,10 +2159,16 @@ static int python_stop_script(void)
 {
 	struct tables *tables = &tables_global;
 
+	sample_batch__flush(&sample_batch);
+	tables__flush_batches(tables);
 	try_call_object("trace_end", NULL);
+	sample_batch__exit(&sample_batch);
+	tables__exit_batches(tables);
 
 	db_export__exit(&tables->dbe);
 
+	tp_events__exit();
+
 	Py_XDECREF(main_dict);
 	Py_XDECREF(main_module);
 	Py_Finalize();
@@ -1597,6 +2176,23 @@ static int python_stop_script(void)
 	return 0;
 }
 
+static const char *python_filter(void)
+{
+	const char *perf_script_filter = "perf_script_filter";
+	PyObject *filter_obj;
+	const char *filter;
+
+	filter_obj = PyDict_GetItemString(main_dict, perf_script_filter);
+	if (!filter_obj || filter_obj == Py_None)
+		return NULL;
+
+	filter = _PyUnicode_AsString(filter_obj);
+	if (!filter)
+		handler_call_die(perf_script_filter);
+
+	return filter;
+}
+
 static int python_generate_script(struct tep_handle *pevent, const char *outfile)
 {
 	struct tep_event *event = NULL;
@@ -1788,4 +2384,5 @@ struct scripting_ops python_scripting_ops = {
 	.process_stat		= python_process_stat,
 	.process_stat_interval	= python_process_stat_interval,
 	.generate_script	= python_generate_script,
+	.filter			= python_filter,
 };
@@ -6,9 +6,11 @@
 #include <api/fs/fs.h>
 
 #include <byteswap.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "evlist.h"
 #include "evsel.h"
@@ -27,8 +29,287 @@
 #include "thread-stack.h"
 #include "sample-raw.h"
 #include "stat.h"
+#include "vdso.h"
+#include "namespaces.h"
+#include "unwind-pipeline.h"
+#include "stage-time.h"
 #include "arch/common.h"
 
+static struct mmap_window *
+perf_session__add_window(struct perf_session *session, void *base, size_t size,
+			 int fd, u64 file_offset)
+{
+	struct mmap_window *win = zalloc(sizeof(*win));
+
+	if (win) {
+		win->base = base;
+		win->size = size;
+		win->fd = fd;
+		win->file_offset = file_offset;
+		pthread_mutex_lock(&session->windows_lock);
+		list_add(&win->list, &session->windows);
+		pthread_mutex_unlock(&session->windows_lock);
+	}
+
+	return win;
+}
+
+/* With the windows_lock held, but at teardown */
+static void mmap_window__delete(struct mmap_window *win)
+{
+	list_del(&win->list);
+	munmap(win->base, win->size);
+	free(win);
+}
+
+static void perf_session__retire_window(struct perf_session *session,
+					struct mmap_window *win)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	if (win->pinned)
+		win->retired = true;
+	else
+		mmap_window__delete(win);
+	pthread_mutex_unlock(&session->windows_lock);
+}
+
+static struct mmap_window *
+perf_session__find_window(struct perf_session *session, void *ptr)
+{
+	struct mmap_window *win;
+
+	/* The latest windows are the first ones, most events are there. */
+	list_for_each_entry(win, &session->windows, list) {
+		if (ptr >= win->base && ptr < win->base + win->size)
+			return win;
+	}
+
+	return NULL;
+}
+
+/*
+ * Queued events are not copied unless copy_on_queue is set, keep the
+ * window they are in mapped until they get delivered.
+ */
+static void perf_session__pin_event(struct perf_session *session,
+				    union perf_event *event)
+{
+	struct mmap_window *win;
+
+	if (session->ordered_events.copy_on_queue)
+		return;
+
+	pthread_mutex_lock(&session->windows_lock);
+	win = perf_session__find_window(session, event);
+	if (win)
+		win->pinned++;
+	pthread_mutex_unlock(&session->windows_lock);
+}
+
+static void mmap_window__unpin(struct mmap_window *win)
+{
+	if (win && win->pinned && !--win->pinned && win->retired)
+		mmap_window__delete(win);
+}
+
+static void perf_session__unpin_event(struct perf_session *session,
+				      union perf_event *event)
+{
+	if (session->ordered_events.copy_on_queue)
+		return;
+
+	pthread_mutex_lock(&session->windows_lock);
+	mmap_window__unpin(perf_session__find_window(session, event));
+	pthread_mutex_unlock(&session->windows_lock);
+}
+
+/* The data windows are what's mapped from the data files */
+static struct mmap_window *
+perf_session__find_data_window(struct perf_session *session, int fd,
+			       u64 offset, size_t size)
+{
+	struct mmap_window *win;
+
+	list_for_each_entry(win, &session->windows, list) {
+		if (win->fd == fd && offset >= win->file_offset &&
+		    offset + size <= win->file_offset + win->size)
+			return win;
+	}
+
+	return NULL;
+}
+
+#define DATA_WINDOW_SIZE	(32 * 1024 * 1024ULL)
+
+/*
+ * size bytes at offset of the data file fd, from a window already mapping
+ * them, the reader's or one mapped for an earlier call, or from a new one
+ * mapping what follows too. The window stays mapped until the pin is
+ * dropped with perf_session__unpin_data().
+ */
+void *perf_session__pin_data(struct perf_session *session, int fd, u64 offset,
+			     size_t size, struct mmap_window **winp)
+{
+	struct mmap_window *win;
+	u64 file_offset, len;
+	struct stat st;
+	void *base;
+
+	pthread_mutex_lock(&session->windows_lock);
+	win = perf_session__find_data_window(session, fd, offset, size);
+	if (win)
+		win->pinned++;
+	pthread_mutex_unlock(&session->windows_lock);
+
+	if (win)
+		goto out;
+
+	if (fstat(fd, &st) < 0 || offset + size > (u64)st.st_size)
+		return NULL;
+
+	file_offset = offset & ~((u64)page_size - 1);
+	len = max(offset + size - file_offset, DATA_WINDOW_SIZE);
+	len = min(len, (u64)st.st_size - file_offset);
+
+	base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, file_offset);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	win = perf_session__add_window(session, base, len, fd, file_offset);
+	if (!win) {
+		munmap(base, len);
+		return NULL;
+	}
+
+	/* No reader owns it, it goes with the last pin */
+	pthread_mutex_lock(&session->windows_lock);
+	win->pinned++;
+	win->retired = true;
+	pthread_mutex_unlock(&session->windows_lock);
+out:
+	*winp = win;
+	return win->base + (offset - win->file_offset);
+}
+
+void perf_session__unpin_data(struct perf_session *session,
+			      struct mmap_window *win)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	mmap_window__unpin(win);
+	pthread_mutex_unlock(&session->windows_lock);
+}
+
+static void perf_session__delete_windows(struct perf_session *session)
+{
+	struct mmap_window *win, *tmp;
+
+	list_for_each_entry_safe(win, tmp, &session->windows, list)
+		mmap_window__delete(win);
+}
+
+static void perf_session__release_decomp_events(struct perf_session *session)
+{
+	struct decomp *next, *decomp;
+
+	next = session->decomp;
+	session->decomp = NULL;
+	session->decomp_last = NULL;
+
+	while (next) {
+		decomp = next;
+		next = decomp->next;
+		perf_session__retire_window(session, decomp->win);
+	}
+}
+
+#ifdef HAVE_ZSTD_SUPPORT
+static int perf_session__process_compressed_event(struct perf_session *session,
+						  union perf_event *event, u64 file_offset)
+{
+	void *src;
+	size_t decomp_size, src_size;
+	u64 decomp_last_rem = 0;
+	size_t mmap_len, decomp_len = session->header.env.comp_mmap_len;
+	struct decomp *decomp, *decomp_last = session->decomp_last;
+
+	if (!decomp_len) {
+		pr_err("Missing compression details in the data header\n");
+		return -1;
+	}
+
+	if (decomp_last) {
+		decomp_last_rem = decomp_last->size - decomp_last->head;
+		decomp_len += decomp_last_rem;
+	}
+
+	mmap_len = sizeof(struct decomp) + decomp_len;
+	decomp = mmap(NULL, mmap_len, PROT_READ|PROT_WRITE,
+		      MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+	if (decomp == MAP_FAILED) {
+		pr_err("Couldn't allocate memory for decompression\n");
+		return -1;
+	}
+
+	decomp->win = perf_session__add_window(session, decomp, mmap_len, -1, 0);
+	if (!decomp->win) {
+		munmap(decomp, mmap_len);
+		pr_err("Couldn't allocate memory for decompression\n");
+		return -1;
+	}
+
+	decomp->next = NULL;
+	decomp->file_pos = file_offset;
+	decomp->mmap_len = mmap_len;
+	decomp->head = 0;
+	decomp->size = 0;
+
+	/* Carry over the tail of a record split between compressed chunks. */
+	if (decomp_last_rem) {
+		memcpy(decomp->data, &(decomp_last->data[decomp_last->head]), decomp_last_rem);
+		decomp->size = decomp_last_rem;
+	}
+
+	src = (void *)event + sizeof(struct compressed_event);
+	src_size = event->pack.header.size - sizeof(struct compressed_event);
+
+	decomp_size = zstd_decompress_stream(&(session->zstd_data), src, src_size,
+				&(decomp->data[decomp_last_rem]), decomp_len - decomp_last_rem);
+	if (!decomp_size) {
+		perf_session__retire_window(session, decomp->win);
+		pr_err("Couldn't decompress data\n");
+		return -1;
+	}
+
+	decomp->size += decomp_size;
+
+	/*
+	 * The already processed chunks stay mapped only while queued
+	 * events point into them, see perf_session__pin_event().
+	 */
+	perf_session__release_decomp_events(session);
+
+	if (session->decomp == NULL) {
+		session->decomp = decomp;
+		session->decomp_last = decomp;
+	} else {
+		session->decomp_last->next = decomp;
+		session->decomp_last = decomp;
+	}
+
+	pr_debug("decomp (B): %zd to %zd\n", src_size, decomp_size);
+
+	return 0;
+}
+#else /* !HAVE_ZSTD_SUPPORT */
+static int perf_session__process_compressed_event(struct perf_session *session __maybe_unused,
+						  union perf_event *event __maybe_unused,
+						  u64 file_offset __maybe_unused)
+{
+	pr_err("Compressed data is not supported, rebuild perf with libzstd\n");
+	return -1;
+}
+#endif
+
 static int perf_session__deliver_event(struct perf_session *session,
 				       union perf_event *event,
 				       struct perf_tool *tool,
@@ -83,6 +364,135 @@ int perf_session__create_kernel_maps(struct perf_session *session)
 	return ret;
 }
 
+struct load_dsos_arg {
+	struct dso	**dsos;
+	unsigned int	nr;
+	unsigned int	next;
+};
+
+static void *load_dsos_worker(void *arg)
+{
+	struct load_dsos_arg *args = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&args->next, 1)) < args->nr) {
+		struct dso *dso = args->dsos[i];
+		struct map *map = map__new2(0, dso);
+
+		/* takes dso->lock, so a racing map__load() just waits for it */
+		if (map) {
+			dso__load(dso, map);
+			map__put(map);
+		}
+	}
+
+	return NULL;
+}
+
+static bool dso__can_preload(struct dso *dso)
+{
+	/*
+	 * Kernel, module and vdso symbols depend on the map they're in and
+	 * a threaded process can't change mount namespaces.
+	 */
+	return dso->has_build_id && dso->kernel == DSO_TYPE_USER &&
+	       !dso__is_vdso(dso) && dso->long_name[0] == '/' &&
+	       !(dso->nsinfo && dso->nsinfo->need_setns) &&
+	       !dso__loaded(dso);
+}
+
+/*
+ * Load the symbols of the user space dsos of the build-id table with
+ * nr_threads threads, so that they don't have to be loaded one by one
+ * when samples first hit them.
+ */
+int perf_session__load_dsos(struct perf_session *session,
+			    unsigned int nr_threads)
+{
+	struct dsos *dsos = &session->machines.host.dsos;
+	struct load_dsos_arg args = { .nr = 0, };
+	pthread_t *threads = NULL;
+	unsigned int i, started = 0;
+	struct dso *dso;
+
+	if (nr_threads == UINT_MAX)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads == 0)
+		return 0;
+
+	down_read(&dsos->lock);
+	list_for_each_entry(dso, &dsos->head, node) {
+		if (dso__can_preload(dso))
+			args.nr++;
+	}
+
+	args.dsos = calloc(args.nr, sizeof(*args.dsos));
+	if (args.dsos == NULL) {
+		up_read(&dsos->lock);
+		return -ENOMEM;
+	}
+
+	args.nr = 0;
+	list_for_each_entry(dso, &dsos->head, node) {
+		if (dso__can_preload(dso))
+			args.dsos[args.nr++] = dso__get(dso);
+	}
+	up_read(&dsos->lock);
+
+	if (nr_threads > args.nr)
+		nr_threads = args.nr;
+
+	if (nr_threads > 1)
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+
+	for (; threads && started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, load_dsos_worker,
+				   &args))
+			break;
+	}
+
+	load_dsos_worker(&args);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pr_debug("Loaded the symbols of %u dsos with %u threads\n",
+		 args.nr, started + 1);
+
+	for (i = 0; i < args.nr; i++)
+		dso__put(args.dsos[i]);
+	free(args.dsos);
+	free(threads);
+	return 0;
+}
+
+/*
+ * Unwind the user stacks of samples on nr_threads threads before they are
+ * delivered, see unwind-pipeline.c.  UINT_MAX stands for the number of
+ * online CPUs, max_stack should be what the tool resolves callchains with.
+ */
+int perf_session__unwind_threads(struct perf_session *session,
+				 unsigned int nr_threads, int max_stack)
+{
+	u64 sample_type = perf_evlist__combined_sample_type(session->evlist);
+
+	if (!(sample_type & PERF_SAMPLE_REGS_USER) ||
+	    !(sample_type & PERF_SAMPLE_STACK_USER))
+		return 0;
+
+	if (nr_threads == UINT_MAX)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads < 2)
+		return 0;
+
+	session->unwind = unwind_pipeline__new(nr_threads, max_stack);
+	if (session->unwind == NULL)
+		return -ENOMEM;
+
+	pr_debug("Unwinding user stacks with %u threads\n", nr_threads);
+	return 0;
+}
+
 static void perf_session__destroy_kernel_maps(struct perf_session *session)
 {
 	machines__destroy_kernel_maps(&session->machines);
@@ -113,8 +523,12 @@ static int ordered_events__deliver_event(struct ordered_events *oe,
 	struct perf_session *session = container_of(oe, struct perf_session,
 						    ordered_events);
 
-	return perf_session__deliver_event(session, event->event,
-					   session->tool, event->file_offset);
+	int ret;
+
+	ret = perf_session__deliver_event(session, event->event,
+					  session->tool, event->file_offset);
+	perf_session__unpin_event(session, event->event);
+	return ret;
 }
 
 struct perf_session *perf_session__new(struct perf_data *data,
@@ -128,6 +542,8 @@ struct perf_session *perf_session__new(struct perf_data *data,
 	session->repipe = repipe;
 	session->tool   = tool;
 	INIT_LIST_HEAD(&session->auxtrace_index);
+	INIT_LIST_HEAD(&session->windows);
+	pthread_mutex_init(&session->windows_lock, NULL);
 	machines__init(&session->machines);
 	ordered_events__init(&session->ordered_events,
 			     ordered_events__deliver_event, NULL);
@@ -143,6 +559,9 @@ struct perf_session *perf_session__new(struct perf_data *data,
 			if (perf_session__open(session) < 0)
 				goto out_delete;
 
+			if (zstd_init(&session->zstd_data, 0) < 0)
+				pr_warning("Decompression initialization failed. Reported data may be incomplete.\n");
+
 			/*
 			 * set session attributes that are present in perf.data
 			 * but not in pipe-mode.
@@ -203,12 +622,21 @@ void perf_session__delete(struct perf_session *session)
 		return;
 	auxtrace__free(session);
 	auxtrace_index__free(&session->auxtrace_index);
-	perf_session__destroy_kernel_maps(session);
-	perf_session__delete_threads(session);
-	perf_env__exit(&session->header.env);
-	machines__exit(&session->machines);
+	if (!session->skip_teardown) {
+		perf_session__destroy_kernel_maps(session);
+		perf_session__delete_threads(session);
+	}
+	perf_session__release_decomp_events(session);
+	unwind_pipeline__delete(session->unwind);
+	perf_session__delete_windows(session);
+	pthread_mutex_destroy(&session->windows_lock);
+	zstd_fini(&session->zstd_data);
 	if (session->data)
 		perf_data__close(session->data);
+	if (session->skip_teardown)
+		return;
+	perf_env__exit(&session->header.env);
+	machines__exit(&session->machines);
 	free(session);
 }
 
@@ -388,6 +816,8 @@ void perf_tool__fill_defaults(struct perf_tool *tool)
 		tool->ksymbol = perf_event__process_ksymbol;
 	if (tool->bpf_event == NULL)
 		tool->bpf_event = perf_event__process_bpf_event;
+	if (tool->cgroup == NULL)
+		tool->cgroup = perf_event__process_cgroup;
 	if (tool->read == NULL)
 		tool->read = process_event_sample_stub;
 	if (tool->throttle == NULL)
@@ -430,6 +860,8 @@ void perf_tool__fill_defaults(struct perf_tool *tool)
 		tool->time_conv = process_event_op2_stub;
 	if (tool->feature == NULL)
 		tool->feature = process_event_op2_stub;
+	if (tool->compressed == NULL)
+		tool->compressed = perf_session__process_compressed_event;
 }
 
 static void swap_sample_id_all(union perf_event *event, void *data)
@@ -555,6 +987,18 @@ static void perf_event__switch_swap(union perf_event *event, bool sample_id_all)
 		swap_sample_id_all(event, &event->context_switch + 1);
 }
 
+static void perf_event__cgroup_swap(union perf_event *event, bool sample_id_all)
+{
+	event->cgroup.id = bswap_64(event->cgroup.id);
+
+	if (sample_id_all) {
+		void *data = &event->cgroup.path;
+
+		data += PERF_ALIGN(strlen(data) + 1, sizeof(u64));
+		swap_sample_id_all(event, data);
+	}
+}
+
 static void perf_event__throttle_swap(union perf_event *event,
 				      bool sample_id_all)
 {
@@ -806,6 +1250,7 @@ static perf_event__swap_op perf_event__swap_ops[] = {
 	[PERF_RECORD_LOST_SAMPLES]	  = perf_event__all64_swap,
 	[PERF_RECORD_SWITCH]		  = perf_event__switch_swap,
 	[PERF_RECORD_SWITCH_CPU_WIDE]	  = perf_event__switch_swap,
+	[PERF_RECORD_CGROUP]		  = perf_event__cgroup_swap,
 	[PERF_RECORD_HEADER_ATTR]	  = perf_event__hdr_attr_swap,
 	[PERF_RECORD_HEADER_EVENT_TYPE]	  = perf_event__event_type_swap,
 	[PERF_RECORD_HEADER_TRACING_DATA] = perf_event__tracing_data_swap,
@@ -875,7 +1320,11 @@ static int process_finished_round(struct perf_tool *tool __maybe_unused,
 int perf_session__queue_event(struct perf_session *s, union perf_event *event,
 			      u64 timestamp, u64 file_offset)
 {
-	return ordered_events__queue(&s->ordered_events, event, timestamp, file_offset);
+	int ret = ordered_events__queue(&s->ordered_events, event, timestamp, file_offset);
+
+	if (!ret)
+		perf_session__pin_event(s, event);
+	return ret;
 }
 
 static void callchain__lbr_callstack_printf(struct perf_sample *sample)
@@ -1128,6 +1577,9 @@ static void dump_sample(struct perf_evsel *evsel, union perf_event *event,
 	if (sample_type & PERF_SAMPLE_PHYS_ADDR)
 		printf(" .. phys_addr: 0x%"PRIx64"\n", sample->phys_addr);
 
+	if (sample_type & PERF_SAMPLE_CGROUP)
+		printf(" .. cgroup: %" PRIu64 "\n", sample->cgroup);
+
 	if (sample_type & PERF_SAMPLE_TRANSACTION)
 		printf("... transaction: %" PRIx64 "\n", sample->transaction);
 
@@ -1333,21 +1785,73 @@ static int machines__deliver_event(struct machines *machines,
 		return tool->ksymbol(tool, event, sample, machine);
 	case PERF_RECORD_BPF_EVENT:
 		return tool->bpf_event(tool, event, sample, machine);
+	case PERF_RECORD_CGROUP:
+		return tool->cgroup(tool, event, sample, machine);
 	default:
 		++evlist->stats.nr_unknown_events;
 		return -1;
 	}
 }
 
+static int perf_session__deliver_unwound(void *arg, union perf_event *event,
+					 struct perf_sample *sample,
+					 u64 file_offset)
+{
+	struct perf_session *session = arg;
+
+	return machines__deliver_event(&session->machines, session->evlist,
+				       event, sample, session->tool,
+				       file_offset);
+}
+
+static int perf_session__flush_unwind(struct perf_session *session)
+{
+	return unwind_pipeline__flush(session->unwind,
+				      perf_session__deliver_unwound, session);
+}
+
+/*
+ * Samples are queued to have their user stacks unwound in parallel, the
+ * thread is looked up now, while it is the one the sample was taken in.
+ */
+static int perf_session__queue_unwind(struct perf_session *session,
+				      union perf_event *event,
+				      struct perf_sample *sample,
+				      u64 file_offset)
+{
+	struct thread *thread = NULL;
+	struct machine *machine;
+	int err;
+
+	if (sample->user_regs.regs && sample->user_stack.size) {
+		machine = machines__find_for_cpumode(&session->machines,
+						     event, sample);
+		if (machine)
+			thread = machine__findnew_thread(machine, sample->pid,
+							 sample->tid);
+	}
+
+	err = unwind_pipeline__queue(session->unwind, session->evlist, event,
+				     thread, file_offset);
+	thread__put(thread);
+	if (err)
+		return err;
+
+	return unwind_pipeline__full(session->unwind) ?
+	       perf_session__flush_unwind(session) : 0;
+}
+
 static int perf_session__deliver_event(struct perf_session *session,
 				       union perf_event *event,
 				       struct perf_tool *tool,
 				       u64 file_offset)
 {
 	struct perf_sample sample;
+	u64 start = stage_time__start();
 	int ret;
 
 	ret = perf_evlist__parse_sample(session->evlist, event, &sample);
+	stage_time__end(STAGE_TIME__PARSE_SAMPLE, start);
 	if (ret) {
 		pr_err("Can't parse sample, err = %d\n", ret);
 		return ret;
@@ -1359,6 +1863,19 @@ static int perf_session__deliver_event(struct perf_session *session,
 	if (ret > 0)
 		return 0;
 
+	if (session->unwind) {
+		/* Anything else may change the maps the samples need */
+		if (event->header.type == PERF_RECORD_SAMPLE &&
+		    tool == session->tool &&
+		    !perf_session__queue_unwind(session, event, &sample,
+						file_offset))
+			return 0;
+
+		ret = perf_session__flush_unwind(session);
+		if (ret)
+			return ret;
+	}
+
 	return machines__deliver_event(&session->machines, session->evlist,
 				       event, &sample, tool, file_offset);
 }
@@ -1426,6 +1943,8 @@ static s64 perf_session__process_user_event(struct perf_session *session,
 		return tool->time_conv(session, event);
 	case PERF_RECORD_HEADER_FEATURE:
 		return tool->feature(session, event);
+	case PERF_RECORD_COMPRESSED:
+		return tool->compressed(session, event, file_offset);
 	default:
 		return -EINVAL;
 	}
@@ -1529,13 +2048,14 @@ static s64 perf_session__process_event(struct perf_session *session,
 		return perf_session__process_user_event(session, event, file_offset);
 
 	if (tool->ordered_events) {
-		u64 timestamp = -1ULL;
+		u64 timestamp = -1ULL, start = stage_time__start();
 
 		ret = perf_evlist__parse_sample_timestamp(evlist, event, &timestamp);
 		if (ret && ret != -1)
 			return ret;
 
 		ret = perf_session__queue_event(session, event, timestamp, file_offset);
+		stage_time__end(STAGE_TIME__QUEUE, start);
 		if (ret != -ETIME)
 			return ret;
 	}
@@ -1708,77 +2228,289 @@ static int perf_session__flush_thread_stacks(struct perf_session *session)
 
 volatile int session_done;
 
-static int __perf_session__process_pipe_events(struct perf_session *session)
+static union perf_event *
+fetch_mmaped_event(struct perf_session *session,
+		   u64 head, size_t mmap_size, char *buf)
 {
-	struct ordered_events *oe = &session->ordered_events;
-	struct perf_tool *tool = session->tool;
-	int fd = perf_data__fd(session->data);
 	union perf_event *event;
-	uint32_t size, cur_size = 0;
-	void *buf = NULL;
-	s64 skip = 0;
-	u64 head;
-	ssize_t err;
-	void *p;
-
-	perf_tool__fill_defaults(tool);
 
-	head = 0;
-	cur_size = sizeof(union perf_event);
-
-	buf = malloc(cur_size);
-	if (!buf)
-		return -errno;
-	ordered_events__set_copy_on_queue(oe, true);
-more:
-	event = buf;
-	err = readn(fd, event, sizeof(struct perf_event_header));
-	if (err <= 0) {
-		if (err == 0)
-			goto done;
+	/*
+	 * Ensure we have enough space remaining to read
+	 * the size of the event in the headers.
+	 */
+	if (head + sizeof(event->header) > mmap_size)
+		return NULL;
 
-		pr_err("failed to read event header\n");
-		goto out_err;
-	}
+	event = (union perf_event *)(buf + head);
 
 	if (session->header.needs_swap)
 		perf_event_header__bswap(&event->header);
 
-	size = event->header.size;
-	if (size < sizeof(struct perf_event_header)) {
-		pr_err("bad event header size\n");
-		goto out_err;
+	if (head + event->header.size > mmap_size) {
+		/* We're not fetching the event so swap back again */
+		if (session->header.needs_swap)
+			perf_event_header__bswap(&event->header);
+		return NULL;
 	}
 
-	if (size > cur_size) {
-		void *new = realloc(buf, size);
-		if (!new) {
-			pr_err("failed to allocate memory to read event\n");
-			goto out_err;
-		}
-		buf = new;
-		cur_size = size;
-		event = buf;
-	}
-	p = event;
-	p += sizeof(struct perf_event_header);
+	return event;
+}
 
-	if (size - sizeof(struct perf_event_header)) {
-		err = readn(fd, p, size - sizeof(struct perf_event_header));
-		if (err <= 0) {
-			if (err == 0) {
-				pr_err("unexpected end of event stream\n");
-				goto done;
-			}
+static int perf_session__process_decomp_events(struct perf_session *session)
+{
+	s64 skip;
+	u64 size, file_pos = 0;
+	struct decomp *decomp = session->decomp_last;
 
-			pr_err("failed to read event data\n");
-			goto out_err;
+	if (!decomp)
+		return 0;
+
+	while (decomp->head < decomp->size && !session_done()) {
+		union perf_event *event = fetch_mmaped_event(session, decomp->head, decomp->size, decomp->data);
+
+		if (!event)
+			break;
+
+		size = event->header.size;
+
+		if (size < sizeof(struct perf_event_header) ||
+		    (skip = perf_session__process_event(session, event, file_pos)) < 0) {
+			pr_err("%#" PRIx64 " [%#x]: failed to process type: %d\n",
+				decomp->file_pos + decomp->head, event->header.size, event->header.type);
+			return -EINVAL;
+		}
+
+		if (skip)
+			size += skip;
+
+		decomp->head += size;
+	}
+
+	return 0;
+}
+
+/*
+ * The events of a pipe are read with a read per PIPE_READER_SIZE bytes
+ * instead of two per event, and processed where they are in the buffer,
+ * the ones straddling the end of a read being moved to its start.
+ */
+#define PIPE_READER_SIZE	(2 * 1024 * 1024)
+
+struct pipe_reader {
+	int	 fd;
+	char	*buf;
+	size_t	 size;
+	/* the bytes read but not processed yet */
+	size_t	 pos;
+	size_t	 end;
+};
+
+/*
+ * Have at least need bytes read in the buffer: 1 if so, 0 at the end of
+ * the stream, a negative errno on errors.
+ */
+static int pipe_reader__fill(struct pipe_reader *reader, size_t need)
+{
+	ssize_t ret;
+
+	if (reader->end - reader->pos >= need)
+		return 1;
+
+	/* the events stay 8 byte aligned, as in a perf.data file */
+	if (reader->pos + need > reader->size || (reader->pos & 7)) {
+		memmove(reader->buf, reader->buf + reader->pos,
+			reader->end - reader->pos);
+		reader->end -= reader->pos;
+		reader->pos = 0;
+	}
+
+	if (need > reader->size) {
+		char *buf = realloc(reader->buf, need);
+
+		if (!buf)
+			return -ENOMEM;
+		reader->buf  = buf;
+		reader->size = need;
+	}
+
+	while (reader->end - reader->pos < need) {
+		ret = read(reader->fd, reader->buf + reader->end,
+			   reader->size - reader->end);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return 0;
+		reader->end += ret;
+	}
+
+	return 1;
+}
+
+/*
+ * The tracing data and the AUX area data follow their events in the pipe
+ * and are read from perf_data__fd() by their tools, now that it may be in
+ * the buffer they get them from a temporary file instead, with the event
+ * at the same offset as in the stream, as in a perf.data file, so that
+ * the lseek()s of the tools that read it from files work too.
+ */
+static int pipe_reader__process_payload(struct pipe_reader *reader,
+					struct perf_session *session,
+					union perf_event *event, u64 head,
+					u64 size, s64 *skip)
+{
+	int fd = session->data->file.fd;
+	u64 offset = head + event->header.size;
+	FILE *file = tmpfile();
+	char *chunk = NULL;
+	ssize_t len;
+	int err;
+
+	if (!file) {
+		err = -errno;
+		pr_err("failed to create a file for the event data: %m\n");
+		return err;
+	}
+
+	if (pwrite(fileno(file), event, event->header.size, head) != event->header.size)
+		goto out_err;
+	reader->pos += event->header.size;
+
+	/* what was read with the event, the rest without moving it */
+	len = min((u64)(reader->end - reader->pos), size);
+	if (pwrite(fileno(file), reader->buf + reader->pos, len, offset) != len)
+		goto out_err;
+	reader->pos += len;
+	offset += len;
+	size -= len;
+
+	if (size) {
+		chunk = malloc(PIPE_READER_SIZE);
+		if (!chunk) {
+			err = -ENOMEM;
+			goto out_close;
+		}
+	}
+
+	while (size) {
+		len = readn(reader->fd, chunk, min(size, (u64)PIPE_READER_SIZE));
+		if (len <= 0) {
+			pr_err("unexpected end of event stream\n");
+			err = len ? -errno : -EINVAL;
+			goto out_close;
+		}
+		if (pwrite(fileno(file), chunk, len, offset) != len)
+			goto out_err;
+		offset += len;
+		size -= len;
+	}
+
+	lseek(fileno(file), head, SEEK_SET);
+	session->data->file.fd = fileno(file);
+	*skip = perf_session__process_event(session, event, head);
+	session->data->file.fd = fd;
+	err = 0;
+	goto out_close;
+
+out_err:
+	err = -errno;
+	pr_err("failed to write the event data: %m\n");
+out_close:
+	free(chunk);
+	fclose(file);
+	return err;
+}
+
+static int __perf_session__process_pipe_events(struct perf_session *session)
+{
+	struct ordered_events *oe = &session->ordered_events;
+	struct perf_tool *tool = session->tool;
+	struct pipe_reader reader = {
+		.fd   = perf_data__fd(session->data),
+		.size = PIPE_READER_SIZE,
+	};
+	union perf_event *event;
+	u64 head, payload;
+	uint32_t size;
+	s64 skip = 0;
+	int err;
+
+	perf_tool__fill_defaults(tool);
+
+	head = 0;
+
+	reader.buf = malloc(reader.size);
+	if (!reader.buf)
+		return -errno;
+	ordered_events__set_copy_on_queue(oe, true);
+more:
+	err = pipe_reader__fill(&reader, sizeof(struct perf_event_header));
+	if (err <= 0) {
+		if (err == 0) {
+			if (reader.end != reader.pos)
+				pr_err("unexpected end of event stream\n");
+			goto done;
+		}
+
+		pr_err("failed to read event header\n");
+		goto out_err;
+	}
+
+	event = (union perf_event *)(reader.buf + reader.pos);
+	if (session->header.needs_swap)
+		perf_event_header__bswap(&event->header);
+
+	size = event->header.size;
+	if (size < sizeof(struct perf_event_header)) {
+		pr_err("bad event header size\n");
+		err = -EINVAL;
+		goto out_err;
+	}
+
+	err = pipe_reader__fill(&reader, size);
+	if (err <= 0) {
+		if (err == 0) {
+			pr_err("unexpected end of event stream\n");
+			goto done;
 		}
+
+		pr_err("failed to read event data\n");
+		goto out_err;
 	}
+	/* the fill may have moved it */
+	event = (union perf_event *)(reader.buf + reader.pos);
 
-	if ((skip = perf_session__process_event(session, event, head)) < 0) {
+	payload = 0;
+	if (event->header.type == PERF_RECORD_HEADER_TRACING_DATA &&
+	    size >= sizeof(event->tracing_data)) {
+		payload = event->tracing_data.size;
+		if (session->header.needs_swap)
+			payload = bswap_32(payload);
+	} else if (event->header.type == PERF_RECORD_AUXTRACE &&
+		   size >= sizeof(event->auxtrace)) {
+		payload = event->auxtrace.size;
+		if (session->header.needs_swap)
+			payload = bswap_64(payload);
+	}
+
+	if (payload) {
+		err = pipe_reader__process_payload(&reader, session, event,
+						   head, payload, &skip);
+		if (err)
+			goto out_err;
+		/* all of it was read, whatever the tool did with it */
+		if (skip >= 0)
+			skip = payload;
+	} else {
+		skip = perf_session__process_event(session, event, head);
+		reader.pos += size;
+	}
+
+	if (skip < 0) {
 		pr_err("%#" PRIx64 " [%#x]: failed to process type: %d\n",
-		       head, event->header.size, event->header.type);
+		       head, size, event->header.type);
 		err = -EINVAL;
 		goto out_err;
 	}
@@ -1788,11 +2520,18 @@ more:
 	if (skip > 0)
 		head += skip;
 
+	err = perf_session__process_decomp_events(session);
+	if (err)
+		goto out_err;
+
 	if (!session_done())
 		goto more;
 done:
 	/* do the final flush for ordered samples */
 	err = ordered_events__flush(oe, OE_FLUSH__FINAL);
+	if (err)
+		goto out_err;
+	err = perf_session__flush_unwind(session);
 	if (err)
 		goto out_err;
 	err = auxtrace__flush_events(session, tool);
@@ -1800,7 +2539,7 @@ done:
 		goto out_err;
 	err = perf_session__flush_thread_stacks(session);
 out_err:
-	free(buf);
+	free(reader.buf);
 	if (!tool->no_warn)
 		perf_session__warn_about_errors(session);
 	ordered_events__free(&session->ordered_events);
@@ -1808,34 +2547,6 @@ out_err:
 	return err;
 }
 
-static union perf_event *
-fetch_mmaped_event(struct perf_session *session,
-		   u64 head, size_t mmap_size, char *buf)
-{
-	union perf_event *event;
-
-	/*
-	 * Ensure we have enough space remaining to read
-	 * the size of the event in the headers.
-	 */
-	if (head + sizeof(event->header) > mmap_size)
-		return NULL;
-
-	event = (union perf_event *)(buf + head);
-
-	if (session->header.needs_swap)
-		perf_event_header__bswap(&event->header);
-
-	if (head + event->header.size > mmap_size) {
-		/* We're not fetching the event so swap back again */
-		if (session->header.needs_swap)
-			perf_event_header__bswap(&event->header);
-		return NULL;
-	}
-
-	return event;
-}
-
 /*
  * On 64bit we can mmap the data file in one go. No need for tiny mmap
  * slices. On 32bit we use 32MB.
@@ -1859,35 +2570,56 @@ struct reader {
 	u64		 data_size;
 	u64		 data_offset;
 	reader_cb_t	 process;
+	/* set for the readers of the directory data format */
+	bool		 dir_rounds;
+	/* see perf_session::dir_samples */
+	bool		 skip_samples;
+	struct mmap_window *mmaps[NUM_MMAPS];
+	char		*mmap_cur;
+	size_t		 mmap_size;
+	int		 mmap_idx;
+	u64		 file_offset;
+	u64		 file_pos;
+	u64		 head;
+	u64		 size;
+	union perf_event *round;
+	bool		 done;
+	/* set from the time index, see reader__time_index_range() */
+	u64		 samples_from;
+	u64		 stop_at;
 };
 
-static int
-reader__process_events(struct reader *rd, struct perf_session *session,
-		       struct ui_progress *prog)
-{
-	u64 data_size = rd->data_size;
-	u64 head, page_offset, file_offset, file_pos, size;
-	int err = 0, mmap_prot, mmap_flags, map_idx = 0;
-	size_t	mmap_size;
-	char *buf, *mmaps[NUM_MMAPS];
-	union perf_event *event;
-	s64 skip;
-
-	page_offset = page_size * (rd->data_offset / page_size);
-	file_offset = page_offset;
-	head = rd->data_offset - page_offset;
+enum {
+	READER_OK,
+	READER_NODATA,
+	READER_ROUND,
+};
 
-	ui_progress__init_size(prog, data_size, "Processing events...");
+static void
+reader__init(struct reader *rd, bool *one_mmap)
+{
+	u64 data_size = rd->data_size + rd->data_offset;
 
-	data_size += rd->data_offset;
+	rd->head = rd->data_offset;
+	rd->file_offset = 0;
 
-	mmap_size = MMAP_SIZE;
-	if (mmap_size > data_size) {
-		mmap_size = data_size;
-		session->one_mmap = true;
+	rd->mmap_size = MMAP_SIZE;
+	if (rd->mmap_size > data_size) {
+		rd->mmap_size = data_size;
+		if (one_mmap)
+			*one_mmap = true;
 	}
 
-	memset(mmaps, 0, sizeof(mmaps));
+	memset(rd->mmaps, 0, sizeof(rd->mmaps));
+	rd->mmap_idx = 0;
+}
+
+static int
+reader__mmap(struct reader *rd, struct perf_session *session)
+{
+	int mmap_prot, mmap_flags;
+	u64 page_offset, start;
+	char *buf;
 
 	mmap_prot  = PROT_READ;
 	mmap_flags = MAP_SHARED;
@@ -1896,63 +2628,191 @@ reader__process_events(struct reader *rd, struct perf_session *session,
 		mmap_prot  |= PROT_WRITE;
 		mmap_flags = MAP_PRIVATE;
 	}
-remap:
-	buf = mmap(NULL, mmap_size, mmap_prot, mmap_flags, rd->fd,
-		   file_offset);
+
+	if (rd->mmaps[rd->mmap_idx]) {
+		perf_session__retire_window(session, rd->mmaps[rd->mmap_idx]);
+		rd->mmaps[rd->mmap_idx] = NULL;
+	}
+
+	page_offset = page_size * (rd->head / page_size);
+	rd->file_offset += page_offset;
+	rd->head -= page_offset;
+
+	start = stage_time__start();
+	buf = mmap(NULL, rd->mmap_size, mmap_prot, mmap_flags, rd->fd,
+		   rd->file_offset);
+	stage_time__end(STAGE_TIME__MMAP, start);
 	if (buf == MAP_FAILED) {
 		pr_err("failed to mmap file\n");
-		err = -errno;
-		goto out;
+		return -errno;
+	}
+	rd->mmaps[rd->mmap_idx] = perf_session__add_window(session, buf, rd->mmap_size,
+							   rd->fd, rd->file_offset);
+	if (!rd->mmaps[rd->mmap_idx]) {
+		munmap(buf, rd->mmap_size);
+		return -ENOMEM;
 	}
-	mmaps[map_idx] = buf;
-	map_idx = (map_idx + 1) & (ARRAY_SIZE(mmaps) - 1);
-	file_pos = file_offset + head;
+	rd->mmap_cur = buf;
+	rd->mmap_idx = (rd->mmap_idx + 1) & (ARRAY_SIZE(rd->mmaps) - 1);
+	rd->file_pos = rd->file_offset + rd->head;
 	if (session->one_mmap) {
 		session->one_mmap_addr = buf;
-		session->one_mmap_offset = file_offset;
+		session->one_mmap_offset = rd->file_offset;
 	}
 
-more:
-	event = fetch_mmaped_event(session, head, mmap_size, buf);
-	if (!event) {
-		if (mmaps[map_idx]) {
-			munmap(mmaps[map_idx], mmap_size);
-			mmaps[map_idx] = NULL;
-		}
+	return 0;
+}
 
-		page_offset = page_size * (head / page_size);
-		file_offset += page_offset;
-		head -= page_offset;
-		goto remap;
-	}
+static int
+reader__read_event(struct reader *rd, struct perf_session *session,
+		   struct ui_progress *prog)
+{
+	union perf_event *event;
+	s64 skip = 0;
+	u64 size;
+
+	event = fetch_mmaped_event(session, rd->head, rd->mmap_size, rd->mmap_cur);
+	if (!event)
+		return READER_NODATA;
 
 	size = event->header.size;
 
-	if (size < sizeof(struct perf_event_header) ||
-	    (skip = rd->process(session, event, file_pos)) < 0) {
+	if (size < sizeof(struct perf_event_header)) {
+		skip = -1;
+	} else if (event->header.type == PERF_RECORD_SAMPLE &&
+		   (rd->file_pos < rd->samples_from || rd->skip_samples)) {
+		/*
+		 * Earlier than the wanted time range or not from the wanted
+		 * file, the other events are still needed to have the right
+		 * state for the samples that are.
+		 */
+	} else if (rd->dir_rounds &&
+		   event->header.type == PERF_RECORD_FINISHED_ROUND) {
+		/*
+		 * Every file of the directory has its own rounds, the
+		 * flush is done once all of them got past one, see
+		 * __perf_session__process_dir_events().
+		 */
+		rd->round = event;
+	} else {
+		skip = rd->process(session, event, rd->file_pos);
+	}
+
+	if (skip < 0) {
 		pr_err("%#" PRIx64 " [%#x]: failed to process type: %d\n",
-		       file_offset + head, event->header.size,
+		       rd->file_offset + rd->head, event->header.size,
 		       event->header.type);
-		err = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
 	if (skip)
 		size += skip;
 
-	head += size;
-	file_pos += size;
+	rd->size += size;
+	rd->head += size;
+	rd->file_pos += size;
 
 	ui_progress__update(prog, size);
 
-	if (session_done())
-		goto out;
+	skip = perf_session__process_decomp_events(session);
+	if (skip < 0)
+		return skip;
 
-	if (file_pos < data_size)
-		goto more;
+	return rd->round == event ? READER_ROUND : READER_OK;
+}
 
-out:
-	return err;
+static inline bool
+reader__eof(struct reader *rd)
+{
+	return rd->file_pos >= rd->data_size + rd->data_offset;
+}
+
+static int
+reader__process_events(struct reader *rd, struct perf_session *session,
+		       struct ui_progress *prog)
+{
+	int err;
+
+	reader__init(rd, &session->one_mmap);
+
+	err = reader__mmap(rd, session);
+	if (err)
+		return err;
+
+	while (!reader__eof(rd)) {
+		if (rd->stop_at && rd->file_pos >= rd->stop_at)
+			break;
+
+		err = reader__read_event(rd, session, prog);
+		if (err < 0)
+			return err;
+
+		if (err == READER_NODATA) {
+			err = reader__mmap(rd, session);
+			if (err)
+				return err;
+		}
+
+		if (session_done())
+			break;
+	}
+
+	return 0;
+}
+
+/* First index entry not earlier than @time. */
+static u64 time_index__lower_bound(struct perf_env *env, u64 time)
+{
+	u64 lo = 0, hi = env->nr_time_index;
+
+	while (lo < hi) {
+		u64 mid = lo + (hi - lo) / 2;
+
+		if (env->time_index[mid].time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Find the part of the data file that can hold samples of the session
+ * time range, see struct time_index_entry for what the entries denote.
+ */
+void perf_session__time_index_range(struct perf_session *session,
+				    u64 *from, u64 *to)
+{
+	struct perf_time_interval *range = &session->time_range;
+	struct perf_env *env = &session->header.env;
+	u64 idx;
+
+	*from = *to = 0;
+
+	if (!env->nr_time_index)
+		return;
+
+	if (range->start) {
+		idx = time_index__lower_bound(env, range->start);
+		if (idx)
+			*from = env->time_index[idx - 1].offset;
+	}
+
+	if (range->end) {
+		idx = time_index__lower_bound(env, range->end + 1);
+		if (idx + 1 < env->nr_time_index)
+			*to = env->time_index[idx + 1].offset;
+	}
+}
+
+static void reader__time_index_range(struct reader *rd, struct perf_session *session)
+{
+	perf_session__time_index_range(session, &rd->samples_from, &rd->stop_at);
+
+	if (rd->samples_from || rd->stop_at)
+		pr_debug("time index: samples from %#" PRIx64 ", stop at %#" PRIx64 "\n",
+			 rd->samples_from, rd->stop_at);
 }
 
 static s64 process_simple(struct perf_session *session,
@@ -1982,11 +2842,16 @@ static int __perf_session__process_events(struct perf_session *session)
 
 	ui_progress__init_size(&prog, rd.data_size, "Processing events...");
 
+	reader__time_index_range(&rd, session);
+
 	err = reader__process_events(&rd, session, &prog);
 	if (err)
 		goto out_err;
 	/* do the final flush for ordered samples */
 	err = ordered_events__flush(oe, OE_FLUSH__FINAL);
+	if (err)
+		goto out_err;
+	err = perf_session__flush_unwind(session);
 	if (err)
 		goto out_err;
 	err = auxtrace__flush_events(session, tool);
@@ -2007,15 +2872,176 @@ out_err:
 	return err;
 }
 
+/*
+ * Don't let a single data file of the directory monopolize the
+ * processing, switch to the next one after this much data.
+ */
+#define READER_MAX_SIZE (2 * 1024 * 1024)
+
+static int __perf_session__process_dir_events(struct perf_session *session)
+{
+	struct perf_data *data = session->data;
+	struct ordered_events *oe = &session->ordered_events;
+	struct perf_tool *tool = session->tool;
+	int i, j, err, nr_readers, readers;
+	struct ui_progress prog;
+	struct reader *rd;
+
+	perf_tool__fill_defaults(tool);
+
+	nr_readers = data->dir.nr + 1;
+	rd = zalloc(nr_readers * sizeof(*rd));
+	if (!rd)
+		return -ENOMEM;
+
+	/* The header file carries the synthesized events... */
+	rd[0] = (struct reader) {
+		.fd		= perf_data__fd(data),
+		.data_size	= session->header.data_size,
+		.data_offset	= session->header.data_offset,
+		.process	= process_simple,
+		.dir_rounds	= true,
+		.skip_samples	= session->dir_samples > 1,
+	};
+
+	/* ... and every data.<n> file what one record thread has read. */
+	for (i = 0; i < data->dir.nr; i++) {
+		rd[i + 1] = (struct reader) {
+			.fd		= data->dir.files[i].fd,
+			.data_size	= data->dir.files[i].size,
+			.data_offset	= 0,
+			.process	= process_simple,
+			.dir_rounds	= true,
+			.skip_samples	= session->dir_samples &&
+					  session->dir_samples != i + 1,
+		};
+	}
+
+	ui_progress__init_size(&prog, perf_data__size(data), "Processing events...");
+
+	for (i = 0, readers = 0; i < nr_readers; i++) {
+		if (!rd[i].data_size) {
+			rd[i].done = true;
+			continue;
+		}
+
+		reader__init(&rd[i], NULL);
+		err = reader__mmap(&rd[i], session);
+		if (err)
+			goto out_err;
+		readers++;
+	}
+
+	i = 0;
+	while (readers) {
+		struct reader *r = &rd[i];
+		bool next = false;
+
+		if (session_done())
+			break;
+
+		if (r->done) {
+			i = (i + 1) % nr_readers;
+			continue;
+		}
+
+		if (reader__eof(r)) {
+			r->done = true;
+			readers--;
+			next = true;
+		} else {
+			err = reader__read_event(r, session, &prog);
+			if (err < 0)
+				goto out_err;
+
+			if (err == READER_NODATA) {
+				err = reader__mmap(r, session);
+				if (err)
+					goto out_err;
+			} else if (err == READER_ROUND) {
+				next = true;
+			}
+		}
+
+		/*
+		 * Events of one round are only ordered against the previous
+		 * round of the same file, so flush once every file still
+		 * being read got past a round.
+		 */
+		if (next && r->round) {
+			union perf_event *round = r->round;
+
+			for (j = 0; j < nr_readers; j++) {
+				if (!rd[j].done && !rd[j].round)
+					break;
+			}
+
+			if (j == nr_readers) {
+				err = tool->finished_round(tool, round, oe);
+				if (err)
+					goto out_err;
+				for (j = 0; j < nr_readers; j++)
+					rd[j].round = NULL;
+			}
+		}
+
+		if (next || r->size >= READER_MAX_SIZE) {
+			r->size = 0;
+			i = (i + 1) % nr_readers;
+		}
+	}
+
+	/* do the final flush for ordered samples */
+	err = ordered_events__flush(oe, OE_FLUSH__FINAL);
+	if (err)
+		goto out_err;
+	err = perf_session__flush_unwind(session);
+	if (err)
+		goto out_err;
+	err = auxtrace__flush_events(session, tool);
+	if (err)
+		goto out_err;
+	err = perf_session__flush_thread_stacks(session);
+out_err:
+	ui_progress__finish();
+	if (!tool->no_warn)
+		perf_session__warn_about_errors(session);
+	/*
+	 * We may switching perf.data output, make ordered_events
+	 * reusable.
+	 */
+	ordered_events__reinit(&session->ordered_events);
+	auxtrace__free_events(session);
+	free(rd);
+	return err;
+}
+
 int perf_session__process_events(struct perf_session *session)
 {
+	u64 start;
+	int err;
+
 	if (perf_session__register_idle_thread(session) < 0)
 		return -ENOMEM;
 
+	/* perf data sort wrote the events in the order they'd be delivered in */
+	if (session->tool->ordered_events &&
+	    perf_header__has_feat(&session->header, HEADER_SORTED)) {
+		pr_debug("The events are sorted, not queueing them\n");
+		session->tool->ordered_events = false;
+	}
+
+	start = stage_time__start();
+
 	if (perf_data__is_pipe(session->data))
-		return __perf_session__process_pipe_events(session);
+		err = __perf_session__process_pipe_events(session);
+	else if (perf_data__is_dir(session->data))
+		err = __perf_session__process_dir_events(session);
+	else
+		err = __perf_session__process_events(session);
 
-	return __perf_session__process_events(session);
+	stage_time__end(STAGE_TIME__PROCESS_EVENTS, start);
+	return err;
 }
 
 bool perf_session__has_traces(struct perf_session *session, const char *msg)
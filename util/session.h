@@ -8,9 +8,12 @@
 #include "machine.h"
 #include "data.h"
 #include "ordered-events.h"
+#include "compress.h"
+#include "time-utils.h"
 #include <linux/kernel.h>
 #include <linux/rbtree.h>
 #include <linux/perf_event.h>
+#include <pthread.h>
 
 struct ip_callchain;
 struct symbol;
@@ -18,6 +21,7 @@ struct thread;
 
 struct auxtrace;
 struct itrace_synth_opts;
+struct unwind_pipeline;
 
 struct perf_session {
 	struct perf_header	header;
@@ -35,6 +39,58 @@ struct perf_session {
 	struct ordered_events	ordered_events;
 	struct perf_data	*data;
 	struct perf_tool	*tool;
+	u64			bytes_transferred;
+	u64			bytes_compressed;
+	struct zstd_data	zstd_data;
+	struct list_head	windows;
+	/* the AUX area decoders pin windows from their threads */
+	pthread_mutex_t		windows_lock;
+	struct decomp		*decomp;
+	struct decomp		*decomp_last;
+	struct unwind_pipeline	*unwind;
+	/*
+	 * Samples out of this time range are not wanted by the tool, so the
+	 * reader can use the time index to skip them, 0 stands for no limit.
+	 */
+	struct perf_time_interval time_range;
+	/*
+	 * Only deliver the samples of the data.<n> file that is the
+	 * dir_samples'th of the directory, and of the header file if that is
+	 * the first, the other events of all the files are still processed.
+	 * 0 delivers all the samples.
+	 */
+	int			dir_samples;
+	/*
+	 * One-shot commands exit right after deleting the session, leave
+	 * the threads, maps, dsos and symbols for the exit to release.
+	 */
+	bool			skip_teardown;
+};
+
+/*
+ * Mapped data file window or decompression buffer, queued ordered events
+ * and AUX area buffers point into it, so it is unmapped only once retired
+ * and not pinned by any of them.
+ */
+struct mmap_window {
+	struct list_head list;
+	void *base;
+	size_t size;
+	/* what's mapped of the data file, -1 for decompression buffers */
+	int fd;
+	u64 file_offset;
+	unsigned int pinned;
+	bool retired;
+};
+
+struct decomp {
+	struct decomp *next;
+	struct mmap_window *win;
+	u64 file_pos;
+	size_t mmap_len;
+	u64 head;
+	size_t size;
+	char data[];
 };
 
 struct perf_tool;
@@ -50,6 +106,18 @@ int perf_session__peek_event(struct perf_session *session, off_t file_offset,
 			     union perf_event **event_ptr,
 			     struct perf_sample *sample);
 
+/*
+ * The part of the data file, 0 for no limit, that can have samples in the
+ * --time range according to the time index.
+ */
+void perf_session__time_index_range(struct perf_session *session,
+				    u64 *from, u64 *to);
+
+void *perf_session__pin_data(struct perf_session *session, int fd, u64 offset,
+			     size_t size, struct mmap_window **winp);
+void perf_session__unpin_data(struct perf_session *session,
+			      struct mmap_window *win);
+
 int perf_session__process_events(struct perf_session *session);
 
 int perf_session__queue_event(struct perf_session *s, union perf_event *event,
@@ -68,6 +136,10 @@ bool perf_session__has_traces(struct perf_session *session, const char *msg);
 void perf_event__attr_swap(struct perf_event_attr *attr);
 
 int perf_session__create_kernel_maps(struct perf_session *session);
+int perf_session__load_dsos(struct perf_session *session,
+			    unsigned int nr_threads);
+int perf_session__unwind_threads(struct perf_session *session,
+				 unsigned int nr_threads, int max_stack);
 
 void perf_session__set_id_hdr_size(struct perf_session *session);
 
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdlib.h>
+#include <string.h>
+#include <linux/kernel.h>
+#include "slab.h"
+
+#define SLAB_CHUNK_SIZE	(64 * 1024)
+
+struct slab_chunk {
+	struct list_head	list;
+	char			data[];
+};
+
+static size_t slab__chunk_size(struct slab *slab)
+{
+	return sizeof(struct slab_chunk) + slab->nr_per_chunk * slab->obj_size;
+}
+
+void slab__init(struct slab *slab, size_t obj_size, enum mem_stat_id mem_stat)
+{
+	/* freed objects are linked through their first word */
+	obj_size = roundup(max(obj_size, sizeof(void *)), sizeof(u64));
+
+	pthread_mutex_init(&slab->lock, NULL);
+	INIT_LIST_HEAD(&slab->chunks);
+	slab->free_list = NULL;
+	slab->cur = NULL;
+	slab->cur_idx = 0;
+	slab->obj_size = obj_size;
+	slab->mem_stat = mem_stat;
+	slab->nr_chunks = 0;
+	slab->nr_objs = 0;
+	slab->nr_per_chunk = (SLAB_CHUNK_SIZE - sizeof(struct slab_chunk)) / obj_size;
+	if (!slab->nr_per_chunk)
+		slab->nr_per_chunk = 1;
+}
+
+void slab__exit(struct slab *slab)
+{
+	struct slab_chunk *chunk, *tmp;
+
+	if (!slab__initialized(slab))
+		return;
+
+	list_for_each_entry_safe(chunk, tmp, &slab->chunks, list) {
+		list_del(&chunk->list);
+		free(chunk);
+	}
+
+	mem_stats__sub(slab->mem_stat, slab->nr_chunks * slab__chunk_size(slab),
+		       slab->nr_objs);
+	pthread_mutex_destroy(&slab->lock);
+	memset(slab, 0, sizeof(*slab));
+}
+
+void *slab__zalloc(struct slab *slab)
+{
+	struct slab_chunk *chunk;
+	void *obj = NULL;
+
+	pthread_mutex_lock(&slab->lock);
+
+	if (slab->free_list) {
+		obj = slab->free_list;
+		slab->free_list = *(void **)obj;
+	} else {
+		if (!slab->cur) {
+			chunk = malloc(slab__chunk_size(slab));
+			if (!chunk)
+				goto out_unlock;
+
+			slab->nr_chunks++;
+			mem_stats__add(slab->mem_stat, slab__chunk_size(slab), 0);
+
+			list_add(&chunk->list, &slab->chunks);
+			slab->cur = chunk->data;
+			slab->cur_idx = 0;
+		}
+
+		obj = slab->cur + slab->cur_idx * slab->obj_size;
+		if (++slab->cur_idx == slab->nr_per_chunk)
+			slab->cur = NULL;
+	}
+
+	memset(obj, 0, slab->obj_size);
+	slab->nr_objs++;
+	mem_stats__add(slab->mem_stat, 0, 1);
+out_unlock:
+	pthread_mutex_unlock(&slab->lock);
+	return obj;
+}
+
+void slab__free(struct slab *slab, void *obj)
+{
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&slab->lock);
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+	slab->nr_objs--;
+	mem_stats__sub(slab->mem_stat, 0, 1);
+	pthread_mutex_unlock(&slab->lock);
+}
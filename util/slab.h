@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_SLAB_H
+#define __PERF_SLAB_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+#include <pthread.h>
+#include "mem-stats.h"
+
+/*
+ * Cache of same sized objects carved out of 64K chunks, freed objects
+ * are kept for reuse and the chunks are only released all together in
+ * slab__exit().
+ */
+struct slab {
+	pthread_mutex_t		 lock;
+	struct list_head	 chunks;
+	void			*free_list;
+	char			*cur;
+	unsigned int		 cur_idx;
+	unsigned int		 nr_per_chunk;
+	size_t			 obj_size;
+	/* accounted chunks and objects in use */
+	enum mem_stat_id	 mem_stat;
+	size_t			 nr_chunks;
+	size_t			 nr_objs;
+};
+
+void  slab__init(struct slab *slab, size_t obj_size, enum mem_stat_id mem_stat);
+void  slab__exit(struct slab *slab);
+void *slab__zalloc(struct slab *slab);
+void  slab__free(struct slab *slab, void *obj);
+
+static inline bool slab__initialized(struct slab *slab)
+{
+	return slab->obj_size != 0;
+}
+
+#endif /* __PERF_SLAB_H */
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <regex.h>
 #include <linux/mman.h>
 #include <linux/time64.h>
@@ -17,6 +18,7 @@
 #include <traceevent/event-parse.h>
 #include "mem-events.h"
 #include "annotate.h"
+#include "cgroup.h"
 #include "time-utils.h"
 #include <linux/kernel.h>
 
@@ -68,6 +70,19 @@ static int repsep_snprintf(char *bf, size_t size, const char *fmt, ...)
 	return n;
 }
 
+/* FNV-1a, for the se_hash of the string keys */
+static u64 hash_str(const char *str)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
 static int64_t cmp_null(const void *l, const void *r)
 {
 	if (!l && !r)
@@ -86,6 +101,16 @@ sort__thread_cmp(struct hist_entry *left, struct hist_entry *right)
 	return right->thread->tid - left->thread->tid;
 }
 
+static u64 sort__thread_hash(struct hist_entry *he)
+{
+	return he->thread->tid;
+}
+
+static u64 sort__thread_key(struct hist_entry *he)
+{
+	return he->thread->tid;
+}
+
 static int hist_entry__thread_snprintf(struct hist_entry *he, char *bf,
 				       size_t size, unsigned int width)
 {
@@ -109,6 +134,8 @@ static int hist_entry__thread_filter(struct hist_entry *he, int type, const void
 struct sort_entry sort_thread = {
 	.se_header	= "    Pid:Command",
 	.se_cmp		= sort__thread_cmp,
+	.se_hash	= sort__thread_hash,
+	.se_key		= sort__thread_key,
 	.se_snprintf	= hist_entry__thread_snprintf,
 	.se_filter	= hist_entry__thread_filter,
 	.se_width_idx	= HISTC_THREAD,
@@ -117,20 +144,20 @@ struct sort_entry sort_thread = {
 /* --sort comm */
 
 /*
- * We can't use pointer comparison in functions below,
- * because it gives different results based on pointer
- * values, which could break some sorting assumptions.
+ * The comm strings are interned, so cmp and collapse compare their ids.
+ * Those follow the order the strings were first seen in, the output is
+ * sorted by the strings themselves.
  */
 static int64_t
 sort__comm_cmp(struct hist_entry *left, struct hist_entry *right)
 {
-	return strcmp(comm__str(right->comm), comm__str(left->comm));
+	return (int64_t)comm__id(right->comm) - comm__id(left->comm);
 }
 
 static int64_t
 sort__comm_collapse(struct hist_entry *left, struct hist_entry *right)
 {
-	return strcmp(comm__str(right->comm), comm__str(left->comm));
+	return (int64_t)comm__id(right->comm) - comm__id(left->comm);
 }
 
 static int64_t
@@ -139,6 +166,16 @@ sort__comm_sort(struct hist_entry *left, struct hist_entry *right)
 	return strcmp(comm__str(right->comm), comm__str(left->comm));
 }
 
+static u64 sort__comm_hash(struct hist_entry *he)
+{
+	return comm__id(he->comm);
+}
+
+static u64 sort__comm_key(struct hist_entry *he)
+{
+	return comm__id(he->comm);
+}
+
 static int hist_entry__comm_snprintf(struct hist_entry *he, char *bf,
 				     size_t size, unsigned int width)
 {
@@ -150,6 +187,8 @@ struct sort_entry sort_comm = {
 	.se_cmp		= sort__comm_cmp,
 	.se_collapse	= sort__comm_collapse,
 	.se_sort	= sort__comm_sort,
+	.se_hash	= sort__comm_hash,
+	.se_key		= sort__comm_key,
 	.se_snprintf	= hist_entry__comm_snprintf,
 	.se_filter	= hist_entry__thread_filter,
 	.se_width_idx	= HISTC_COMM,
@@ -166,6 +205,10 @@ static int64_t _sort__dso_cmp(struct map *map_l, struct map *map_r)
 	if (!dso_l || !dso_r)
 		return cmp_null(dso_r, dso_l);
 
+	if (symbol_conf.dso_by_build_id &&
+	    (dso_l->has_build_id || dso_r->has_build_id))
+		return dso__cmp_build_id(dso_l, dso_r);
+
 	if (verbose > 0) {
 		dso_name_l = dso_l->long_name;
 		dso_name_r = dso_r->long_name;
@@ -183,6 +226,99 @@ sort__dso_cmp(struct hist_entry *left, struct hist_entry *right)
 	return _sort__dso_cmp(right->ms.map, left->ms.map);
 }
 
+static u64 _sort__dso_hash(struct map *map)
+{
+	struct dso *dso = map ? map->dso : NULL;
+
+	if (!dso)
+		return 0;
+
+	return hash_str(verbose > 0 ? dso->long_name : dso->short_name);
+}
+
+static u64 sort__dso_hash(struct hist_entry *he)
+{
+	return _sort__dso_hash(he->ms.map);
+}
+
+#define SORT_NAMES_MIN_BITS	8
+
+static pthread_mutex_t sort_names__lock = PTHREAD_MUTEX_INITIALIZER;
+static char **sort_names;
+static unsigned int sort_names__bits;
+static unsigned int sort_names__nr;
+
+static char **sort_names__slot(char **names, unsigned int bits,
+			       const char *name)
+{
+	unsigned int mask = (1U << bits) - 1;
+	unsigned int i = hash_str(name) & mask;
+
+	while (names[i] && strcmp(names[i], name))
+		i = (i + 1) & mask;
+
+	return &names[i];
+}
+
+static int sort_names__grow(void)
+{
+	unsigned int i, bits = sort_names__bits ? sort_names__bits + 1 :
+						  SORT_NAMES_MIN_BITS;
+	char **names = calloc(1UL << bits, sizeof(*names));
+
+	if (names == NULL)
+		return -ENOMEM;
+
+	for (i = 0; sort_names__bits && i < (1U << sort_names__bits); i++) {
+		if (sort_names[i])
+			*sort_names__slot(names, bits, sort_names[i]) = sort_names[i];
+	}
+
+	free(sort_names);
+	sort_names = names;
+	sort_names__bits = bits;
+	return 0;
+}
+
+/*
+ * The interned copy of name, dsos of different machines or sessions with
+ * the same name compare equal. Falls back to name itself, which only
+ * splits entries, if there is no memory for it.
+ */
+static u64 sort__name_key(const char *name)
+{
+	u64 key = (unsigned long)name;
+	char **slot;
+
+	pthread_mutex_lock(&sort_names__lock);
+	/* keep it at most half full, there is always a free slot */
+	if ((!sort_names || sort_names__nr * 2 >= (1U << sort_names__bits)) &&
+	    sort_names__grow() && sort_names__nr + 1 >= (1U << sort_names__bits))
+		goto out_unlock;
+
+	slot = sort_names__slot(sort_names, sort_names__bits, name);
+	if (*slot == NULL) {
+		*slot = strdup(name);
+		if (*slot)
+			sort_names__nr++;
+	}
+	if (*slot)
+		key = (unsigned long)*slot;
+out_unlock:
+	pthread_mutex_unlock(&sort_names__lock);
+	return key;
+}
+
+static u64 sort__dso_key(struct hist_entry *he)
+{
+	struct dso *dso = he->ms.map ? he->ms.map->dso : NULL;
+
+	if (!dso)
+		return 0;
+
+	return sort__name_key(verbose > 0 ? dso->long_name : dso->short_name);
+}
+
 static int _hist_entry__dso_snprintf(struct map *map, char *bf,
 				     size_t size, unsigned int width)
 {
@@ -214,6 +350,8 @@ static int hist_entry__dso_filter(struct hist_entry *he, int type, const void *a
 struct sort_entry sort_dso = {
 	.se_header	= "Shared Object",
 	.se_cmp		= sort__dso_cmp,
+	.se_hash	= sort__dso_hash,
+	.se_key		= sort__dso_key,
 	.se_snprintf	= hist_entry__dso_snprintf,
 	.se_filter	= hist_entry__dso_filter,
 	.se_width_idx	= HISTC_DSO,
@@ -279,6 +417,19 @@ sort__sym_sort(struct hist_entry *left, struct hist_entry *right)
 	return strcmp(right->ms.sym->name, left->ms.sym->name);
 }
 
+/*
+ * Symbols with the same range compare equal whatever their name, but
+ * that is only the case for different dsos with the same name, just
+ * use the name here.
+ */
+static u64 sort__sym_hash(struct hist_entry *he)
+{
+	if (!he->ms.sym)
+		return he->ip;
+
+	return sort__dso_hash(he) ^ hash_str(he->ms.sym->name);
+}
+
 static int _hist_entry__sym_snprintf(struct map *map, struct symbol *sym,
 				     u64 ip, char level, char *bf, size_t size,
 				     unsigned int width)
@@ -335,6 +486,7 @@ struct sort_entry sort_sym = {
 	.se_header	= "Symbol",
 	.se_cmp		= sort__sym_cmp,
 	.se_sort	= sort__sym_sort,
+	.se_hash	= sort__sym_hash,
 	.se_snprintf	= hist_entry__sym_snprintf,
 	.se_filter	= hist_entry__sym_filter,
 	.se_width_idx	= HISTC_SYMBOL,
@@ -347,8 +499,24 @@ char *hist_entry__srcline(struct hist_entry *he)
 	return map__srcline(he->ms.map, he->ip, he->ms.sym);
 }
 
+/*
+ * The same address always has the same srcline, so entries are told apart
+ * by address when they are added and the srclines, that are expensive to
+ * look up, are only needed when collapsing, see hists__resolve_srclines().
+ */
 static int64_t
 sort__srcline_cmp(struct hist_entry *left, struct hist_entry *right)
+{
+	int64_t ret = _sort__dso_cmp(right->ms.map, left->ms.map);
+
+	if (ret)
+		return ret;
+
+	return _sort__addr_cmp(left->ip, right->ip);
+}
+
+static int64_t
+sort__srcline_collapse(struct hist_entry *left, struct hist_entry *right)
 {
 	if (!left->srcline)
 		left->srcline = hist_entry__srcline(left);
@@ -358,6 +526,11 @@ sort__srcline_cmp(struct hist_entry *left, struct hist_entry *right)
 	return strcmp(right->srcline, left->srcline);
 }
 
+static u64 sort__srcline_hash(struct hist_entry *he)
+{
+	return _sort__dso_hash(he->ms.map) ^ he->ip;
+}
+
 static int hist_entry__srcline_snprintf(struct hist_entry *he, char *bf,
 					size_t size, unsigned int width)
 {
@@ -370,6 +543,9 @@ static int hist_entry__srcline_snprintf(struct hist_entry *he, char *bf,
 struct sort_entry sort_srcline = {
 	.se_header	= "Source:Line",
 	.se_cmp		= sort__srcline_cmp,
+	.se_collapse	= sort__srcline_collapse,
+	.se_sort	= sort__srcline_collapse,
+	.se_hash	= sort__srcline_hash,
 	.se_snprintf	= hist_entry__srcline_snprintf,
 	.se_width_idx	= HISTC_SRCLINE,
 };
@@ -572,6 +748,16 @@ sort__cpu_cmp(struct hist_entry *left, struct hist_entry *right)
 	return right->cpu - left->cpu;
 }
 
+static u64 sort__cpu_hash(struct hist_entry *he)
+{
+	return he->cpu;
+}
+
+static u64 sort__cpu_key(struct hist_entry *he)
+{
+	return he->cpu;
+}
+
 static int hist_entry__cpu_snprintf(struct hist_entry *he, char *bf,
 				    size_t size, unsigned int width)
 {
@@ -581,6 +767,8 @@ static int hist_entry__cpu_snprintf(struct hist_entry *he, char *bf,
 struct sort_entry sort_cpu = {
 	.se_header      = "CPU",
 	.se_cmp	        = sort__cpu_cmp,
+	.se_hash	= sort__cpu_hash,
+	.se_key		= sort__cpu_key,
 	.se_snprintf    = hist_entry__cpu_snprintf,
 	.se_width_idx	= HISTC_CPU,
 };
@@ -625,6 +813,40 @@ struct sort_entry sort_cgroup_id = {
 	.se_width_idx	= HISTC_CGROUP_ID,
 };
 
+/* --sort cgroup */
+
+static int64_t
+sort__cgroup_cmp(struct hist_entry *left, struct hist_entry *right)
+{
+	return right->cgroup - left->cgroup;
+}
+
+/* The names are only looked up here, by the id in the samples */
+static int hist_entry__cgroup_snprintf(struct hist_entry *he,
+				       char *bf, size_t size,
+				       unsigned int width __maybe_unused)
+{
+	const char *cgrp_name = "N/A";
+
+	if (he->cgroup) {
+		struct cgroup *cgrp = cgroup__find(he->thread->mg->machine->env,
+						   he->cgroup);
+		if (cgrp != NULL)
+			cgrp_name = cgrp->name;
+		else
+			cgrp_name = "unknown";
+	}
+
+	return repsep_snprintf(bf, size, "%s", cgrp_name);
+}
+
+struct sort_entry sort_cgroup = {
+	.se_header      = "Cgroup",
+	.se_cmp	        = sort__cgroup_cmp,
+	.se_snprintf    = hist_entry__cgroup_snprintf,
+	.se_width_idx	= HISTC_CGROUP,
+};
+
 /* --sort socket */
 
 static int64_t
@@ -633,6 +855,16 @@ sort__socket_cmp(struct hist_entry *left, struct hist_entry *right)
 	return right->socket - left->socket;
 }
 
+static u64 sort__socket_hash(struct hist_entry *he)
+{
+	return he->socket;
+}
+
+static u64 sort__socket_key(struct hist_entry *he)
+{
+	return he->socket;
+}
+
 static int hist_entry__socket_snprintf(struct hist_entry *he, char *bf,
 				    size_t size, unsigned int width)
 {
@@ -652,6 +884,8 @@ static int hist_entry__socket_filter(struct hist_entry *he, int type, const void
 struct sort_entry sort_socket = {
 	.se_header      = "Socket",
 	.se_cmp	        = sort__socket_cmp,
+	.se_hash	= sort__socket_hash,
+	.se_key		= sort__socket_key,
 	.se_snprintf    = hist_entry__socket_snprintf,
 	.se_filter      = hist_entry__socket_filter,
 	.se_width_idx	= HISTC_SOCKET,
@@ -1501,6 +1735,11 @@ sort__transaction_cmp(struct hist_entry *left, struct hist_entry *right)
 	return left->transaction - right->transaction;
 }
 
+static u64 sort__transaction_key(struct hist_entry *he)
+{
+	return he->transaction;
+}
+
 static inline char *add_str(char *p, const char *str)
 {
 	strcpy(p, str);
@@ -1563,6 +1802,7 @@ static int hist_entry__transaction_snprintf(struct hist_entry *he, char *bf,
 struct sort_entry sort_transaction = {
 	.se_header	= "Transaction                ",
 	.se_cmp		= sort__transaction_cmp,
+	.se_key		= sort__transaction_key,
 	.se_snprintf	= hist_entry__transaction_snprintf,
 	.se_width_idx	= HISTC_TRANSACTION,
 };
@@ -1674,6 +1914,7 @@ static struct sort_dimension common_sort_dimensions[] = {
 	DIM(SORT_CGROUP_ID, "cgroup_id", sort_cgroup_id),
 	DIM(SORT_SYM_IPC_NULL, "ipc_null", sort_sym_ipc_null),
 	DIM(SORT_TIME, "time", sort_time),
+	DIM(SORT_CGROUP, "cgroup", sort_cgroup),
 };
 
 #undef DIM
@@ -1829,6 +2070,89 @@ bool perf_hpp__is_sort_entry(struct perf_hpp_fmt *format)
 	return format->header == __sort__hpp_header;
 }
 
+static bool __hist_entry__hash(struct hist_entry *he, u64 *hash,
+			       bool collapse)
+{
+	struct perf_hpp_fmt *fmt;
+	struct hpp_sort_entry *hse;
+	bool hashed = false;
+
+	*hash = 0;
+
+	hists__for_each_sort_list(he->hists, fmt) {
+		if (!perf_hpp__is_sort_entry(fmt))
+			continue;
+
+		hse = container_of(fmt, struct hpp_sort_entry, hpp);
+		if (!hse->se->se_hash)
+			continue;
+
+		/* srclines collapse by name, not by the address hashed */
+		if (collapse && hse->se == &sort_srcline)
+			continue;
+
+		*hash = (*hash * 31) + hse->se->se_hash(he);
+		hashed = true;
+	}
+
+	return hashed;
+}
+
+/*
+ * Digest of the sort keys that have a se_hash, entries comparing equal
+ * with hist_entry__cmp() get the same one. Returns false if none of the
+ * keys can be hashed.
+ */
+bool hist_entry__sort_hash(struct hist_entry *he, u64 *hash)
+{
+	return __hist_entry__hash(he, hash, false);
+}
+
+/*
+ * Same for hist_entry__collapse(), of entries that may be in the hists of
+ * different sessions, the symbols are hashed by name.
+ */
+bool hist_entry__collapse_hash(struct hist_entry *he, u64 *hash)
+{
+	return __hist_entry__hash(he, hash, true);
+}
+
+bool perf_hpp__is_keyed(struct perf_hpp_fmt *fmt)
+{
+	struct hpp_sort_entry *hse;
+
+	if (!perf_hpp__is_sort_entry(fmt))
+		return false;
+
+	hse = container_of(fmt, struct hpp_sort_entry, hpp);
+	return hse->se->se_key != NULL;
+}
+
+/*
+ * The keys of the first HIST_ENTRY_SORT_KEYS sort keys that have a
+ * se_key, hist_entry__cmp() and hist_entry__collapse() compare them
+ * instead of dereferencing the threads, comms and dsos of the entries.
+ * Their order is not that of the sort keys, only the same in all of the
+ * entries compared.
+ */
+void hist_entry__init_sort_keys(struct hist_entry *he)
+{
+	struct perf_hpp_fmt *fmt;
+	struct hpp_sort_entry *hse;
+	int i = 0;
+
+	hists__for_each_sort_list(he->hists, fmt) {
+		if (i == HIST_ENTRY_SORT_KEYS)
+			break;
+
+		if (perf_hpp__is_keyed(fmt)) {
+			hse = container_of(fmt, struct hpp_sort_entry, hpp);
+			he->sort_keys[i] = hse->se->se_key(he);
+		}
+		i++;
+	}
+}
+
 #define MK_SORT_ENTRY_CHK(key)					\
 bool perf_hpp__is_ ## key ## _entry(struct perf_hpp_fmt *fmt)	\
 {								\
@@ -83,8 +83,8 @@ struct hist_entry_diff {
 };
 
 struct hist_entry_ops {
-	void	*(*new)(size_t size);
-	void	(*free)(void *ptr);
+	void	*(*new)(struct hists *hists, size_t size);
+	void	(*free)(struct hists *hists, void *ptr);
 };
 
 /**
@@ -93,9 +93,15 @@ struct hist_entry_ops {
  * @row_offset - offset from the first callchain expanded to appear on screen
  * @nr_rows - rows expanded in callchain, recalculated on folding/unfolding
  */
+/* Of the first sort keys, see hist_entry__init_sort_keys() */
+#define HIST_ENTRY_SORT_KEYS	4
+
 struct hist_entry {
 	struct rb_node		rb_node_in;
 	struct rb_node		rb_node;
+	struct hlist_node	hash_node;
+	u64			sort_hash;
+	u64			sort_keys[HIST_ENTRY_SORT_KEYS];
 	union {
 		struct list_head node;
 		struct list_head head;
@@ -106,6 +112,7 @@ struct hist_entry {
 	struct thread		*thread;
 	struct comm		*comm;
 	struct namespace_id	cgroup_id;
+	u64			cgroup;
 	u64			ip;
 	u64			transaction;
 	s32			socket;
@@ -116,11 +123,16 @@ struct hist_entry {
 	/* We are added by hists__add_dummy_entry. */
 	bool			dummy;
 	bool			leaf;
+	/* sorted_chain is sorted when first used, see hist_entry__sort_callchain() */
+	bool			sorted_chain_stale;
 
 	char			level;
 	u8			filtered;
 
 	u16			callchain_size;
+	/* the hists->decay_epoch stat and callchain were last decayed to */
+	u32			decay_epoch;
+	u32			chain_decay_epoch;
 	union {
 		/*
 		 * Since perf diff only supports the stdio output, TUI
@@ -131,6 +143,8 @@ struct hist_entry {
 		struct /* for TUI */ {
 			u16	row_offset;
 			u16	nr_rows;
+			/* in hist_browser->visible */
+			u32	browser_idx;
 			bool	init_have_children;
 			bool	unfolded;
 			bool	has_children;
@@ -241,6 +255,7 @@ enum sort_type {
 	SORT_CGROUP_ID,
 	SORT_SYM_IPC_NULL,
 	SORT_TIME,
+	SORT_CGROUP,
 
 	/* branch stack specific sort keys */
 	__SORT_BRANCH_STACK,
@@ -279,6 +294,12 @@ struct sort_entry {
 	int64_t (*se_cmp)(struct hist_entry *, struct hist_entry *);
 	int64_t (*se_collapse)(struct hist_entry *, struct hist_entry *);
 	int64_t	(*se_sort)(struct hist_entry *, struct hist_entry *);
+	u64	(*se_hash)(struct hist_entry *);
+	/*
+	 * Same for two entries if and only if se_cmp, and se_collapse when
+	 * there is one, find them equal, set when the entry is added.
+	 */
+	u64	(*se_key)(struct hist_entry *);
 	int	(*se_snprintf)(struct hist_entry *he, char *bf, size_t size,
 			       unsigned int width);
 	int	(*se_filter)(struct hist_entry *he, int type, const void *arg);
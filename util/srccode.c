@@ -19,22 +19,32 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
 #include <string.h>
+#include <linux/types.h>
 #include "srccode.h"
 #include "debug.h"
 #include "util.h"
 
 #define MAXSRCCACHE (32*1024*1024)
-#define MAXSRCFILES     64
-#define SRC_HTAB_SZ	64
+#define MAXSRCFILES     1024
+#define SRC_HTAB_SZ	1024
 
+/*
+ * The lines are indexed as they are looked up, only as far as the last
+ * one asked for, with their offsets in the map: annotate mostly wants a
+ * few lines of each of many files.
+ */
 struct srcfile {
 	struct hlist_node hash_nd;
 	struct list_head nd;
 	char *fn;
-	char **lines;
+	u32 *lines;
 	char *map;
 	unsigned numlines;
+	unsigned alloclines;
+	/* offset of the first line not indexed yet */
+	u32 scanned;
 	size_t maplen;
 };
 
@@ -51,41 +61,31 @@ static unsigned shash(unsigned char *s)
 	return h ^ (h >> 16);
 }
 
-static int countlines(char *map, int maplen)
+/* Index the lines up to line, false if the file is shorter */
+static bool fill_lines(struct srcfile *sf, unsigned line)
 {
-	int numl;
-	char *end = map + maplen;
-	char *p = map;
-
-	if (maplen == 0)
-		return 0;
-	numl = 0;
-	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
-		numl++;
-		p++;
-	}
-	if (p < end)
-		numl++;
-	return numl;
-}
+	while (sf->numlines <= line && sf->scanned < sf->maplen) {
+		char *p;
 
-static void fill_lines(char **lines, int maxline, char *map, int maplen)
-{
-	int l;
-	char *end = map + maplen;
-	char *p = map;
-
-	if (maplen == 0 || maxline == 0)
-		return;
-	l = 0;
-	lines[l++] = map;
-	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
-		if (l >= maxline)
-			return;
-		lines[l++] = ++p;
+		if (sf->numlines == sf->alloclines) {
+			unsigned alloc = sf->alloclines ? sf->alloclines * 2 : 256;
+			u32 *lines = realloc(sf->lines, alloc * sizeof(*lines));
+
+			if (!lines)
+				return false;
+			sf->lines = lines;
+			sf->alloclines = alloc;
+		}
+
+		sf->lines[sf->numlines++] = sf->scanned;
+		p = memchr(sf->map + sf->scanned, '\n', sf->maplen - sf->scanned);
+		if (p)
+			sf->scanned = p + 1 - sf->map;
+		else
+			sf->scanned = sf->maplen;
 	}
-	if (p < end)
-		lines[l] = p;
+
+	return line < sf->numlines;
 }
 
 static void free_srcfile(struct srcfile *sf)
@@ -106,8 +106,16 @@ static struct srcfile *find_srcfile(char *fn)
 	struct srcfile *h;
 	int fd;
 	unsigned long sz;
-	unsigned hval = shash((unsigned char *)fn) % SRC_HTAB_SZ;
+	unsigned hval;
 
+	/* the lines asked for in a row are mostly from the same file */
+	if (!list_empty(&srcfile_list)) {
+		h = list_first_entry(&srcfile_list, struct srcfile, nd);
+		if (!strcmp(fn, h->fn))
+			return h;
+	}
+
+	hval = shash((unsigned char *)fn) % SRC_HTAB_SZ;
 	hlist_for_each_entry (h, &srcfile_htab[hval], hash_nd) {
 		if (!strcmp(fn, h->fn)) {
 			/* Move to front */
@@ -131,9 +139,18 @@ static struct srcfile *find_srcfile(char *fn)
 		return NULL;
 	}
 
-	h = malloc(sizeof(struct srcfile));
-	if (!h)
+	/* the offsets of the lines are 32 bit */
+	if (st.st_size > UINT32_MAX) {
+		pr_debug("source file %s is too big\n", fn);
+		close(fd);
+		return NULL;
+	}
+
+	h = zalloc(sizeof(struct srcfile));
+	if (!h) {
+		close(fd);
 		return NULL;
+	}
 
 	h->fn = strdup(fn);
 	if (!h->fn)
@@ -147,19 +164,12 @@ static struct srcfile *find_srcfile(char *fn)
 		pr_debug("cannot mmap source file %s\n", fn);
 		goto out_fn;
 	}
-	h->numlines = countlines(h->map, h->maplen);
-	h->lines = calloc(h->numlines, sizeof(char *));
-	if (!h->lines)
-		goto out_map;
-	fill_lines(h->lines, h->numlines, h->map, h->maplen);
 	list_add(&h->nd, &srcfile_list);
 	hlist_add_head(&h->hash_nd, &srcfile_htab[hval]);
 	map_total_sz += h->maplen;
 	num_srcfiles++;
 	return h;
 
-out_map:
-	munmap(h->map, sz);
 out_fn:
 	free(h->fn);
 out_h:
@@ -170,17 +180,16 @@ out_h:
 /* Result is not 0 terminated */
 char *find_sourceline(char *fn, unsigned line, int *lenp)
 {
-	char *l, *p;
+	char *l, *p, *end;
 	struct srcfile *sf = find_srcfile(fn);
 	if (!sf)
 		return NULL;
 	line--;
-	if (line >= sf->numlines)
-		return NULL;
-	l = sf->lines[line];
-	if (!l)
+	if (!fill_lines(sf, line))
 		return NULL;
-	p = memchr(l, '\n', sf->map + sf->maplen - l);
-	*lenp = p - l;
+	l = sf->map + sf->lines[line];
+	end = sf->map + sf->maplen;
+	p = memchr(l, '\n', end - l);
+	*lenp = (p ?: end) - l;
 	return l;
 }
@@ -1,11 +1,19 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <linux/kernel.h>
 
+#include "util/build-id.h"
 #include "util/dso.h"
 #include "util/util.h"
 #include "util/debug.h"
@@ -13,9 +21,16 @@
 #include "srcline.h"
 #include "string2.h"
 #include "symbol.h"
+#include "mem-stats.h"
 
 bool srcline_full_filename;
 
+struct srcline_node {
+	u64			addr;
+	char			*srcline;
+	struct rb_node		rb_node;
+};
+
 static const char *dso__name(struct dso *dso)
 {
 	const char *dso_name;
@@ -362,8 +377,72 @@ static struct inline_node *addr2inlines(const char *dso_name, u64 addr,
 	return node;
 }
 
+static int addr2line_resolve(const char *dso_name, struct dso *dso,
+			     u64 *addrs, size_t nr, char **srclines)
+{
+	size_t i;
+
+	for (i = 0; i < nr && dso->has_srcline; i++) {
+		char *file = NULL;
+		unsigned int line = 0;
+
+		if (addr2line(dso_name, addrs[i], &file, &line, dso,
+			      false, NULL, NULL)) {
+			srclines[i] = srcline_from_fileline(file, line);
+			free(file);
+		}
+	}
+
+	return 0;
+}
+
+/* libbfd keeps global state, look up one dso at a time */
+#define A2L_PARALLEL 0
+
 #else /* HAVE_LIBBFD_SUPPORT */
 
+/*
+ * Without libbfd, addr2line(1) is kept running as a coprocess for each dso
+ * that reads the addresses from its stdin, so that looking up many addresses
+ * doesn't fork a process per address.  With -a it echoes every address
+ * before its frames, which is what tells the records apart, a ',' sent at
+ * the end of a batch echoes as 0x0000000000000000 and terminates the last
+ * one.
+ */
+#include <signal.h>
+#include <time.h>
+#include <subcmd/run-command.h>
+
+/* Addresses are small enough to not fill the pipe to addr2line */
+#define A2L_BATCH 512
+
+/* Each dso has its own addr2line, so they can be looked up in parallel */
+#define A2L_PARALLEL 1
+
+struct a2l_subprocess {
+	struct child_process	addr2line;
+	FILE			*to_child;
+	FILE			*from_child;
+	char			*line;
+	size_t			line_sz;
+};
+
+struct a2l_frame {
+	size_t			idx;
+	unsigned int		depth;
+	char			*funcname;
+	char			*filename;
+	unsigned int		line_nr;
+};
+
+typedef int (*a2l_frame_fn)(struct a2l_frame *frame, void *arg);
+
+/*
+ * Other threads must not fork while we hold pipe ends that are not yet
+ * close-on-exec, or their children would keep our addr2line alive.
+ */
+static pthread_mutex_t a2l_start_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int filename_split(char *filename, unsigned int *line_nr)
 {
 	char *sep;
@@ -385,113 +464,795 @@ static int filename_split(char *filename, unsigned int *line_nr)
 	return 0;
 }
 
+static void addr2line_subprocess_cleanup(struct a2l_subprocess *a2l)
+{
+	/* EOF on its stdin makes addr2line exit */
+	if (a2l->to_child)
+		fclose(a2l->to_child);
+	if (a2l->addr2line.pid > 0)
+		finish_command(&a2l->addr2line);
+	if (a2l->from_child)
+		fclose(a2l->from_child);
+	free(a2l->line);
+	free(a2l);
+}
+
+static struct a2l_subprocess *addr2line_subprocess_init(const char *path)
+{
+	const char *argv[] = { "addr2line", "-e", path, "-a", "-i", "-f", NULL };
+	struct a2l_subprocess *a2l = zalloc(sizeof(*a2l));
+	int err;
+
+	if (a2l == NULL)
+		return NULL;
+
+	a2l->addr2line.argv = argv;
+	a2l->addr2line.in = -1;
+	a2l->addr2line.out = -1;
+	a2l->addr2line.no_stderr = 1;
+
+	pthread_mutex_lock(&a2l_start_lock);
+	err = start_command(&a2l->addr2line);
+	if (!err) {
+		fcntl(a2l->addr2line.in, F_SETFD, FD_CLOEXEC);
+		fcntl(a2l->addr2line.out, F_SETFD, FD_CLOEXEC);
+	}
+	pthread_mutex_unlock(&a2l_start_lock);
+	a2l->addr2line.argv = NULL;
+
+	if (err) {
+		free(a2l);
+		return NULL;
+	}
+
+	a2l->to_child = fdopen(a2l->addr2line.in, "w");
+	if (a2l->to_child == NULL)
+		close(a2l->addr2line.in);
+
+	a2l->from_child = fdopen(a2l->addr2line.out, "r");
+	if (a2l->from_child == NULL)
+		close(a2l->addr2line.out);
+
+	if (a2l->to_child == NULL || a2l->from_child == NULL) {
+		addr2line_subprocess_cleanup(a2l);
+		return NULL;
+	}
+
+	return a2l;
+}
+
+static struct a2l_subprocess *dso__a2l(struct dso *dso, const char *dso_name)
+{
+	if (dso->a2l == NULL) {
+		dso->a2l = addr2line_subprocess_init(dso_name);
+		if (dso->a2l == NULL) {
+			pr_warning("Failed to start addr2line for %s\n", dso_name);
+			dso->has_srcline = 0;
+		}
+	}
+
+	return dso->a2l;
+}
+
+/*
+ * Write the addresses with SIGPIPE blocked, to get EPIPE instead of being
+ * killed when addr2line went away, say because it isn't installed.
+ */
+static int addr2line_write(struct a2l_subprocess *a2l, u64 *addrs, size_t nr)
+{
+	sigset_t pipe_set, old_set;
+	int err = 0;
+	size_t i;
+
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	for (i = 0; i < nr && err >= 0; i++)
+		err = fprintf(a2l->to_child, "%016"PRIx64"\n", addrs[i]);
+	if (err >= 0)
+		err = fputs(",\n", a2l->to_child);
+	if (err >= 0)
+		err = fflush(a2l->to_child);
+
+	if (err < 0 && errno == EPIPE && !sigismember(&old_set, SIGPIPE)) {
+		struct timespec ts = { 0, 0 };
+
+		sigtimedwait(&pipe_set, NULL, &ts);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return err < 0 ? -1 : 0;
+}
+
+static int addr2line_getline(struct a2l_subprocess *a2l)
+{
+	if (getline(&a2l->line, &a2l->line_sz, a2l->from_child) < 0)
+		return -1;
+
+	rtrim(a2l->line);
+	return 0;
+}
+
+static bool addr2line_is_addr(struct a2l_subprocess *a2l)
+{
+	return !strncmp(a2l->line, "0x", 2);
+}
+
+/*
+ * Look up nr addresses in one go, calling fn for every frame addr2line
+ * prints, innermost first.  Any error leaves the coprocess out of sync, so
+ * the caller has to drop it.
+ */
+static int addr2line_batch(struct a2l_subprocess *a2l, u64 *addrs, size_t nr,
+			   a2l_frame_fn fn, void *arg)
+{
+	struct a2l_frame frame;
+	char *funcname = NULL;
+	int err = -1;
+
+	if (addr2line_write(a2l, addrs, nr))
+		return -1;
+
+	/* the echo of the first address */
+	if (addr2line_getline(a2l) || !addr2line_is_addr(a2l))
+		return -1;
+
+	for (frame.idx = 0; frame.idx < nr; frame.idx++) {
+		for (frame.depth = 0; ; frame.depth++) {
+			if (addr2line_getline(a2l))
+				goto out;
+			if (addr2line_is_addr(a2l))
+				break;
+
+			funcname = strdup(a2l->line);
+			if (funcname == NULL || addr2line_getline(a2l))
+				goto out;
+
+			frame.funcname = funcname;
+			frame.filename = a2l->line;
+			frame.line_nr  = 0;
+			if (filename_split(a2l->line, &frame.line_nr) != 1)
+				frame.filename = NULL;
+
+			if (fn(&frame, arg))
+				goto out;
+			zfree(&funcname);
+		}
+	}
+
+	/* what the ',' sentinel resolved to: "??" and "??:0" */
+	if (addr2line_getline(a2l) || addr2line_getline(a2l))
+		goto out;
+
+	err = 0;
+out:
+	free(funcname);
+	return err;
+}
+
+static void dso__a2l_failed(struct dso *dso, const char *dso_name)
+{
+	pr_warning("addr2line has no usable output for %s\n", dso_name);
+	dso__free_a2l(dso);
+	dso->has_srcline = 0;
+}
+
+struct a2l_fileline {
+	char		*file;
+	unsigned int	line_nr;
+};
+
+static int a2l_fileline_fn(struct a2l_frame *frame, void *arg)
+{
+	struct a2l_fileline *fl = arg;
+
+	if (frame->depth || frame->filename == NULL)
+		return 0;
+
+	fl->file = strdup(frame->filename);
+	fl->line_nr = frame->line_nr;
+	return fl->file ? 0 : -1;
+}
+
 static int addr2line(const char *dso_name, u64 addr,
 		     char **file, unsigned int *line_nr,
-		     struct dso *dso __maybe_unused,
+		     struct dso *dso,
 		     bool unwind_inlines __maybe_unused,
 		     struct inline_node *node __maybe_unused,
 		     struct symbol *sym __maybe_unused)
 {
-	FILE *fp;
-	char cmd[PATH_MAX];
-	char *filename = NULL;
-	size_t len;
-	int ret = 0;
+	struct a2l_subprocess *a2l = dso__a2l(dso, dso_name);
+	struct a2l_fileline fl = { .file = NULL, };
 
-	scnprintf(cmd, sizeof(cmd), "addr2line -e %s %016"PRIx64,
-		  dso_name, addr);
+	if (a2l == NULL)
+		return 0;
 
-	fp = popen(cmd, "r");
-	if (fp == NULL) {
-		pr_warning("popen failed for %s\n", dso_name);
+	if (addr2line_batch(a2l, &addr, 1, a2l_fileline_fn, &fl)) {
+		dso__a2l_failed(dso, dso_name);
+		free(fl.file);
 		return 0;
 	}
 
-	if (getline(&filename, &len, fp) < 0 || !len) {
-		pr_warning("addr2line has no output for %s\n", dso_name);
-		goto out;
+	if (fl.file == NULL)
+		return 0;
+
+	*file = fl.file;
+	if (line_nr)
+		*line_nr = fl.line_nr;
+
+	return 1;
+}
+
+void dso__free_a2l(struct dso *dso)
+{
+	struct a2l_subprocess *a2l = dso->a2l;
+
+	if (!a2l)
+		return;
+
+	addr2line_subprocess_cleanup(a2l);
+
+	dso->a2l = NULL;
+}
+
+struct a2l_inlines {
+	struct dso		*dso;
+	struct symbol		*sym;
+	struct inline_node	*node;
+	bool			done;
+};
+
+static int a2l_inlines_fn(struct a2l_frame *frame, void *arg)
+{
+	struct a2l_inlines *args = arg;
+	struct symbol *inline_sym;
+	char *srcline;
+
+	/* stop at the first frame addr2line couldn't place */
+	if (args->done || frame->filename == NULL) {
+		args->done = true;
+		return 0;
 	}
 
-	ret = filename_split(filename, line_nr);
-	if (ret != 1) {
-		free(filename);
-		goto out;
+	srcline = srcline_from_fileline(frame->filename, frame->line_nr);
+	inline_sym = new_inline_sym(args->dso, args->sym, frame->funcname);
+
+	if (inline_list__append(inline_sym, srcline, args->node) != 0) {
+		free(srcline);
+		if (inline_sym && inline_sym->inlined)
+			symbol__delete(inline_sym);
+		args->done = true;
 	}
 
-	*file = filename;
+	return 0;
+}
+
+static struct inline_node *addr2inlines(const char *dso_name, u64 addr,
+					struct dso *dso, struct symbol *sym)
+{
+	struct a2l_subprocess *a2l = dso__a2l(dso, dso_name);
+	struct a2l_inlines args = {
+		.dso = dso,
+		.sym = sym,
+	};
 
-out:
-	pclose(fp);
-	return ret;
+	if (a2l == NULL)
+		return NULL;
+
+	args.node = zalloc(sizeof(*args.node));
+	if (args.node == NULL) {
+		perror("not enough memory for the inline node");
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&args.node->val);
+	args.node->addr = addr;
+
+	if (addr2line_batch(a2l, &addr, 1, a2l_inlines_fn, &args))
+		dso__a2l_failed(dso, dso_name);
+
+	return args.node;
 }
 
-void dso__free_a2l(struct dso *dso __maybe_unused)
+static int a2l_srclines_fn(struct a2l_frame *frame, void *arg)
 {
+	char **srclines = arg;
+
+	if (frame->depth || frame->filename == NULL)
+		return 0;
+
+	srclines[frame->idx] = srcline_from_fileline(frame->filename,
+						     frame->line_nr);
+	return 0;
 }
 
-static struct inline_node *addr2inlines(const char *dso_name, u64 addr,
-					struct dso *dso __maybe_unused,
-					struct symbol *sym)
+static int addr2line_resolve(const char *dso_name, struct dso *dso,
+			     u64 *addrs, size_t nr, char **srclines)
 {
-	FILE *fp;
-	char cmd[PATH_MAX];
+	struct a2l_subprocess *a2l = dso__a2l(dso, dso_name);
+	size_t i, n;
+
+	if (a2l == NULL)
+		return -1;
+
+	for (i = 0; i < nr; i += n) {
+		n = min_t(size_t, nr - i, A2L_BATCH);
+
+		if (addr2line_batch(a2l, addrs + i, n, a2l_srclines_fn,
+				    srclines + i)) {
+			dso__a2l_failed(dso, dso_name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+#endif /* HAVE_LIBBFD_SUPPORT */
+
+/*
+ * The srclines and inline frames looked up for a dso are saved in the
+ * build-id cache next to its binary and read back the next time, so that
+ * rerunning a report on the same binaries doesn't go to DWARF again:
+ *
+ *   struct srcline_cache_header
+ *   struct srcline_cache_srcline	[nr_srclines]
+ *   struct srcline_cache_inline	[nr_inlines]
+ *   struct srcline_cache_frame		[nr_frames]
+ *   char				strtab[strtab_size]
+ *
+ * All sorted by objdump address, the frames of an address innermost first.
+ */
+#define SRCLINE_CACHE_NAME	"srclines"
+#define SRCLINE_CACHE_MAGIC	0x4c43525346524550ULL	/* "PERFSRCL" */
+#define SRCLINE_CACHE_VERSION	1
+#define SRCLINE_CACHE_NONE	UINT_MAX
+
+enum {
+	SRCLINE_CACHE_F_FULL_FILENAME	= 1 << 0,
+};
+
+struct srcline_cache_header {
+	u64	magic;
+	u32	version;
+	u32	flags;
+	u32	nr_srclines;
+	u32	nr_inlines;
+	u32	nr_frames;
+	u32	strtab_size;
+	u8	build_id[BUILD_ID_SIZE];
+	u8	__reserved[4];
+};
+
+struct srcline_cache_srcline {
+	u64	addr;
+	u32	srcline;
+	u32	__reserved;
+};
+
+struct srcline_cache_inline {
+	u64	addr;
+	u32	frame;
+	u32	nr_frames;
+};
+
+struct srcline_cache_frame {
+	u32	funcname;
+	u32	srcline;
+};
+
+struct srcline_cache {
+	void				*base;
+	size_t				size;
+	struct srcline_cache_header	*hdr;
+	struct srcline_cache_inline	*inlines;
+	struct srcline_cache_frame	*frames;
+	const char			*strtab;
+};
+
+static u32 srcline_cache__flags(void)
+{
+	return srcline_full_filename ? SRCLINE_CACHE_F_FULL_FILENAME : 0;
+}
+
+static bool srcline_cache__valid_str(struct srcline_cache_header *hdr, u32 off)
+{
+	return off == SRCLINE_CACHE_NONE || off < hdr->strtab_size;
+}
+
+static bool srcline_cache__valid(struct dso *dso, struct srcline_cache *cache)
+{
+	struct srcline_cache_header *hdr = cache->hdr;
+	struct srcline_cache_srcline *srclines = cache->base + sizeof(*hdr);
+	u32 i;
+
+	if (cache->size < sizeof(*hdr) ||
+	    hdr->magic != SRCLINE_CACHE_MAGIC ||
+	    hdr->version != SRCLINE_CACHE_VERSION ||
+	    hdr->flags != srcline_cache__flags() ||
+	    memcmp(hdr->build_id, dso->build_id, sizeof(hdr->build_id)))
+		return false;
+
+	if (cache->size != sizeof(*hdr) +
+	    (u64)hdr->nr_srclines * sizeof(struct srcline_cache_srcline) +
+	    (u64)hdr->nr_inlines * sizeof(struct srcline_cache_inline) +
+	    (u64)hdr->nr_frames * sizeof(struct srcline_cache_frame) +
+	    hdr->strtab_size)
+		return false;
+
+	cache->inlines = (void *)(srclines + hdr->nr_srclines);
+	cache->frames  = (void *)(cache->inlines + hdr->nr_inlines);
+	cache->strtab  = (void *)(cache->frames + hdr->nr_frames);
+
+	if (hdr->strtab_size && cache->strtab[hdr->strtab_size - 1] != '\0')
+		return false;
+
+	for (i = 0; i < hdr->nr_srclines; i++) {
+		if (!srcline_cache__valid_str(hdr, srclines[i].srcline))
+			return false;
+	}
+
+	for (i = 0; i < hdr->nr_inlines; i++) {
+		if (cache->inlines[i].frame > hdr->nr_frames ||
+		    cache->inlines[i].nr_frames >
+		    hdr->nr_frames - cache->inlines[i].frame)
+			return false;
+	}
+
+	for (i = 0; i < hdr->nr_frames; i++) {
+		if (cache->frames[i].funcname == SRCLINE_CACHE_NONE ||
+		    !srcline_cache__valid_str(hdr, cache->frames[i].funcname) ||
+		    !srcline_cache__valid_str(hdr, cache->frames[i].srcline))
+			return false;
+	}
+
+	return true;
+}
+
+static const char *srcline_cache__str(struct srcline_cache *cache, u32 off)
+{
+	return off == SRCLINE_CACHE_NONE ? NULL : cache->strtab + off;
+}
+
+/* Read the cache back the first time anything of dso is looked up */
+static void dso__load_srcline_cache(struct dso *dso)
+{
+	char filename[PATH_MAX];
+	struct srcline_cache *cache;
+	struct srcline_cache_srcline *srclines;
+	struct stat st;
+	u32 i;
+	int fd;
+
+	if (dso->srcline_cache_loaded)
+		return;
+	dso->srcline_cache_loaded = 1;
+
+	if (!dso__build_id_cache_file(dso, SRCLINE_CACHE_NAME, filename,
+				      sizeof(filename)))
+		return;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	cache = zalloc(sizeof(*cache));
+	if (cache == NULL || fstat(fd, &st) < 0 || st.st_size == 0)
+		goto out_free;
+
+	cache->size = st.st_size;
+	cache->base = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cache->base == MAP_FAILED)
+		goto out_free;
+
+	cache->hdr = cache->base;
+	if (!srcline_cache__valid(dso, cache)) {
+		pr_debug("Ignoring stale srcline cache %s\n", filename);
+		goto out_unmap;
+	}
+
+	srclines = cache->base + sizeof(*cache->hdr);
+	for (i = 0; i < cache->hdr->nr_srclines; i++) {
+		const char *srcline = srcline_cache__str(cache,
+							 srclines[i].srcline);
+		char *copy = SRCLINE_UNKNOWN;
+
+		if (srcline) {
+			copy = strdup(srcline);
+			if (copy == NULL)
+				break;
+		}
+		srcline__tree_insert(&dso->a2l_srclines, srclines[i].addr, copy);
+	}
+
+	pr_debug("Loaded %u srclines and %u inlines of %s from %s\n",
+		 cache->hdr->nr_srclines, cache->hdr->nr_inlines,
+		 dso->long_name, filename);
+
+	/* the inline frames are built from the mapping as they are needed */
+	if (cache->hdr->nr_inlines) {
+		dso->srcline_cache = cache;
+		close(fd);
+		return;
+	}
+
+out_unmap:
+	munmap(cache->base, cache->size);
+out_free:
+	free(cache);
+	close(fd);
+}
+
+static int srcline_cache_inline__cmp(const void *key, const void *entry)
+{
+	const u64 *addr = key;
+	const struct srcline_cache_inline *i = entry;
+
+	if (*addr < i->addr)
+		return -1;
+	return *addr > i->addr;
+}
+
+static struct inline_node *dso__find_cached_inlines(struct dso *dso, u64 addr,
+						    struct symbol *sym)
+{
+	struct srcline_cache *cache = dso->srcline_cache;
+	struct srcline_cache_inline *entry;
 	struct inline_node *node;
-	char *filename = NULL;
-	char *funcname = NULL;
-	size_t filelen, funclen;
-	unsigned int line_nr = 0;
+	u32 i;
 
-	scnprintf(cmd, sizeof(cmd), "addr2line -e %s -i -f %016"PRIx64,
-		  dso_name, addr);
+	if (cache == NULL)
+		return NULL;
 
-	fp = popen(cmd, "r");
-	if (fp == NULL) {
-		pr_err("popen failed for %s\n", dso_name);
+	entry = bsearch(&addr, cache->inlines, cache->hdr->nr_inlines,
+			sizeof(*entry), srcline_cache_inline__cmp);
+	if (entry == NULL)
 		return NULL;
-	}
 
 	node = zalloc(sizeof(*node));
-	if (node == NULL) {
-		perror("not enough memory for the inline node");
-		goto out;
-	}
+	if (node == NULL)
+		return NULL;
 
 	INIT_LIST_HEAD(&node->val);
 	node->addr = addr;
 
-	/* addr2line -f generates two lines for each inlined functions */
-	while (getline(&funcname, &funclen, fp) != -1) {
-		char *srcline;
+	for (i = 0; i < entry->nr_frames; i++) {
+		struct srcline_cache_frame *frame = &cache->frames[entry->frame + i];
+		const char *srcline = srcline_cache__str(cache, frame->srcline);
+		char *copy = srcline ? strdup(srcline) : NULL;
 		struct symbol *inline_sym;
 
-		rtrim(funcname);
+		/* the names were demangled before they were saved */
+		inline_sym = new_inline_sym(NULL, sym,
+					    srcline_cache__str(cache, frame->funcname));
 
-		if (getline(&filename, &filelen, fp) == -1)
-			goto out;
+		if (inline_list__append(inline_sym, copy, node) != 0) {
+			free(copy);
+			if (inline_sym && inline_sym->inlined)
+				symbol__delete(inline_sym);
+			break;
+		}
+	}
 
-		if (filename_split(filename, &line_nr) != 1)
-			goto out;
+	return node;
+}
 
-		srcline = srcline_from_fileline(filename, line_nr);
-		inline_sym = new_inline_sym(dso, sym, funcname);
+static void dso__cache_srcline(struct dso *dso, u64 addr, char *srcline)
+{
+	srcline__tree_insert(&dso->a2l_srclines, addr, srcline);
+	dso->srcline_cache_dirty = 1;
+}
 
-		if (inline_list__append(inline_sym, srcline, node) != 0) {
-			free(srcline);
-			if (inline_sym && inline_sym->inlined)
-				symbol__delete(inline_sym);
-			goto out;
+/*
+ * Lays the cache out in buffers when they are set and only sizes it up
+ * when not, so that the same walk does both.
+ */
+struct srcline_cache_writer {
+	struct srcline_cache_srcline	*srclines;
+	struct srcline_cache_inline	*inlines;
+	struct srcline_cache_frame	*frames;
+	char				*strtab;
+	u64				nr_srclines;
+	u64				nr_inlines;
+	u64				nr_frames;
+	u64				strtab_size;
+};
+
+static u32 writer__str(struct srcline_cache_writer *w, const char *str)
+{
+	size_t len;
+	u64 off = w->strtab_size;
+
+	if (str == NULL || str == SRCLINE_UNKNOWN)
+		return SRCLINE_CACHE_NONE;
+
+	len = strlen(str) + 1;
+	if (w->strtab)
+		memcpy(w->strtab + off, str, len);
+	w->strtab_size += len;
+
+	return off;
+}
+
+static void writer__frame(struct srcline_cache_writer *w,
+			  const char *funcname, const char *srcline)
+{
+	u32 name = writer__str(w, funcname);
+	u32 line = writer__str(w, srcline);
+
+	if (w->frames) {
+		w->frames[w->nr_frames].funcname = name;
+		w->frames[w->nr_frames].srcline  = line;
+	}
+	w->nr_frames++;
+}
+
+static void writer__cached_inlines(struct srcline_cache_writer *w,
+				   struct srcline_cache *cache,
+				   struct srcline_cache_inline *entry)
+{
+	u64 first = w->nr_frames;
+	u32 i;
+
+	for (i = 0; i < entry->nr_frames; i++) {
+		struct srcline_cache_frame *frame = &cache->frames[entry->frame + i];
+
+		writer__frame(w, srcline_cache__str(cache, frame->funcname),
+			      srcline_cache__str(cache, frame->srcline));
+	}
+
+	if (w->inlines) {
+		w->inlines[w->nr_inlines].addr	    = entry->addr;
+		w->inlines[w->nr_inlines].frame	    = first;
+		w->inlines[w->nr_inlines].nr_frames = w->nr_frames - first;
+	}
+	w->nr_inlines++;
+}
+
+static void writer__inlines(struct srcline_cache_writer *w,
+			    struct inline_node *node)
+{
+	struct inline_list *ilist;
+	u64 first = w->nr_frames;
+
+	/* saved innermost first, whatever the callchain order is */
+	if (callchain_param.order == ORDER_CALLEE) {
+		list_for_each_entry(ilist, &node->val, list)
+			writer__frame(w, ilist->symbol ? ilist->symbol->name : "??",
+				      ilist->srcline);
+	} else {
+		list_for_each_entry_reverse(ilist, &node->val, list)
+			writer__frame(w, ilist->symbol ? ilist->symbol->name : "??",
+				      ilist->srcline);
+	}
+
+	if (w->inlines) {
+		w->inlines[w->nr_inlines].addr	    = node->addr;
+		w->inlines[w->nr_inlines].frame	    = first;
+		w->inlines[w->nr_inlines].nr_frames = w->nr_frames - first;
+	}
+	w->nr_inlines++;
+}
+
+static void srcline_cache__walk(struct dso *dso, struct srcline_cache_writer *w)
+{
+	struct srcline_cache *cache = dso->srcline_cache;
+	u32 i = 0, nr = cache ? cache->hdr->nr_inlines : 0;
+	struct rb_node *nd;
+
+	for (nd = rb_first_cached(&dso->a2l_srclines); nd; nd = rb_next(nd)) {
+		struct srcline_node *pos = rb_entry(nd, struct srcline_node, rb_node);
+		u32 srcline = writer__str(w, pos->srcline);
+
+		if (w->srclines) {
+			w->srclines[w->nr_srclines].addr    = pos->addr;
+			w->srclines[w->nr_srclines].srcline = srcline;
 		}
+		w->nr_srclines++;
 	}
 
-out:
-	pclose(fp);
-	free(filename);
-	free(funcname);
+	/* merge the inlines read back with those added since */
+	nd = rb_first_cached(&dso->inlined_nodes);
+	while (nd || i < nr) {
+		struct inline_node *node = NULL;
+
+		if (nd)
+			node = rb_entry(nd, struct inline_node, rb_node);
+
+		if (i < nr && (!node || cache->inlines[i].addr <= node->addr)) {
+			if (node && cache->inlines[i].addr == node->addr)
+				nd = rb_next(nd);
+			writer__cached_inlines(w, cache, &cache->inlines[i++]);
+		} else {
+			writer__inlines(w, node);
+			nd = rb_next(nd);
+		}
+	}
+}
 
-	return node;
+static int dso__save_srcline_cache(struct dso *dso)
+{
+	struct srcline_cache_writer w = { .nr_srclines = 0, };
+	struct srcline_cache_header *hdr;
+	char filename[PATH_MAX];
+	char *tmpname;
+	size_t size;
+	void *buf;
+	FILE *fp;
+	int err = -1;
+
+	if (!dso__build_id_cache_file(dso, SRCLINE_CACHE_NAME, filename,
+				      sizeof(filename)))
+		return -1;
+
+	srcline_cache__walk(dso, &w);
+	if (w.nr_srclines > UINT_MAX || w.nr_inlines > UINT_MAX ||
+	    w.nr_frames > UINT_MAX || w.strtab_size >= SRCLINE_CACHE_NONE)
+		return -1;
+
+	size = sizeof(*hdr) + w.nr_srclines * sizeof(*w.srclines) +
+	       w.nr_inlines * sizeof(*w.inlines) +
+	       w.nr_frames * sizeof(*w.frames) + w.strtab_size;
+	buf = zalloc(size);
+	if (buf == NULL)
+		return -1;
+
+	hdr = buf;
+	hdr->magic	 = SRCLINE_CACHE_MAGIC;
+	hdr->version	 = SRCLINE_CACHE_VERSION;
+	hdr->flags	 = srcline_cache__flags();
+	hdr->nr_srclines = w.nr_srclines;
+	hdr->nr_inlines	 = w.nr_inlines;
+	hdr->nr_frames	 = w.nr_frames;
+	hdr->strtab_size = w.strtab_size;
+	memcpy(hdr->build_id, dso->build_id, sizeof(hdr->build_id));
+
+	w.srclines = buf + sizeof(*hdr);
+	w.inlines  = (void *)(w.srclines + w.nr_srclines);
+	w.frames   = (void *)(w.inlines + w.nr_inlines);
+	w.strtab   = (void *)(w.frames + w.nr_frames);
+	w.nr_srclines = w.nr_inlines = w.nr_frames = w.strtab_size = 0;
+	srcline_cache__walk(dso, &w);
+
+	if (asprintf(&tmpname, "%s.tmp", filename) < 0)
+		goto out_free;
+
+	fp = fopen(tmpname, "w");
+	if (fp) {
+		err = fwrite(buf, size, 1, fp) == 1 ? 0 : -1;
+		if (fclose(fp))
+			err = -1;
+		if (!err && rename(tmpname, filename))
+			err = -1;
+		if (err)
+			unlink(tmpname);
+	}
+	free(tmpname);
+out_free:
+	free(buf);
+	return err;
 }
 
-#endif /* HAVE_LIBBFD_SUPPORT */
+/*
+ * Save what was looked up since the cache was read, every tool goes
+ * through here when its dsos go away.
+ */
+void dso__exit_srcline_cache(struct dso *dso)
+{
+	struct srcline_cache *cache = dso->srcline_cache;
+
+	if (dso->srcline_cache_dirty && dso->has_build_id &&
+	    dso__save_srcline_cache(dso))
+		pr_debug("Couldn't save the srcline cache of %s\n",
+			 dso->long_name);
+
+	if (cache) {
+		munmap(cache->base, cache->size);
+		zfree(&dso->srcline_cache);
+	}
+	dso->srcline_cache_dirty = 0;
+}
 
 /*
  * Number of addr2line failures (without success) before disabling it for that
@@ -508,6 +1269,15 @@ char *__get_srcline(struct dso *dso, u64 addr, struct symbol *sym,
 	char *srcline;
 	const char *dso_name;
 
+	if (!unwind_inlines) {
+		dso__load_srcline_cache(dso);
+		srcline = srcline__tree_find(&dso->a2l_srclines, addr);
+		if (srcline && srcline != SRCLINE_UNKNOWN)
+			return strdup(srcline);
+		if (srcline)
+			goto out;
+	}
+
 	if (!dso->has_srcline)
 		goto out;
 
@@ -516,8 +1286,12 @@ char *__get_srcline(struct dso *dso, u64 addr, struct symbol *sym,
 		goto out;
 
 	if (!addr2line(dso_name, addr, &file, &line, dso,
-		       unwind_inlines, NULL, sym))
+		       unwind_inlines, NULL, sym)) {
+		/* don't remember failures of addr2line itself */
+		if (!unwind_inlines && dso->has_srcline)
+			dso__cache_srcline(dso, addr, SRCLINE_UNKNOWN);
 		goto out;
+	}
 
 	srcline = srcline_from_fileline(file, line);
 	free(file);
@@ -525,6 +1299,13 @@ char *__get_srcline(struct dso *dso, u64 addr, struct symbol *sym,
 	if (!srcline)
 		goto out;
 
+	if (!unwind_inlines) {
+		char *copy = strdup(srcline);
+
+		if (copy)
+			dso__cache_srcline(dso, addr, copy);
+	}
+
 	dso->a2l_fails = 0;
 
 	return srcline;
@@ -588,12 +1369,156 @@ char *get_srcline(struct dso *dso, u64 addr, struct symbol *sym,
 	return __get_srcline(dso, addr, sym, show_sym, show_addr, false, ip);
 }
 
-struct srcline_node {
-	u64			addr;
-	char			*srcline;
-	struct rb_node		rb_node;
+/*
+ * Look up the file:line of the sorted, unique addrs at once and keep them
+ * in dso->a2l_srclines, where __get_srcline() finds them.
+ */
+int dso__resolve_srclines(struct dso *dso, u64 *addrs, size_t nr)
+{
+	const char *dso_name;
+	char **srclines;
+	size_t i;
+	int err;
+
+	if (!dso->has_srcline)
+		return 0;
+
+	dso_name = dso__name(dso);
+	if (dso_name == NULL)
+		return 0;
+
+	srclines = calloc(nr, sizeof(*srclines));
+	if (srclines == NULL)
+		return -ENOMEM;
+
+	err = addr2line_resolve(dso_name, dso, addrs, nr, srclines);
+
+	for (i = 0; i < nr; i++) {
+		if (err)
+			free(srclines[i]);
+		else
+			dso__cache_srcline(dso, addrs[i],
+					   srclines[i] ?: SRCLINE_UNKNOWN);
+	}
+
+	free(srclines);
+	return err;
+}
+
+static int srcline_req__cmp(const void *a, const void *b)
+{
+	const struct srcline_req *l = a, *r = b;
+
+	if (l->dso != r->dso)
+		return l->dso < r->dso ? -1 : 1;
+	if (l->addr != r->addr)
+		return l->addr < r->addr ? -1 : 1;
+	return 0;
+}
+
+struct srcline_work {
+	struct srcline_req	*reqs;
+	u64			*addrs;
+	size_t			*groups;
+	size_t			nr_groups;
+	size_t			next;
 };
 
+static void *srcline_worker(void *arg)
+{
+	struct srcline_work *work = arg;
+	size_t g;
+
+	while ((g = __sync_fetch_and_add(&work->next, 1)) < work->nr_groups) {
+		size_t start = work->groups[g], end = work->groups[g + 1];
+
+		dso__resolve_srclines(work->reqs[start].dso, work->addrs + start,
+				      end - start);
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolve the file:line of all the (dso, addr) pairs in reqs, which gets
+ * reordered, the dsos being looked up in parallel when addr2line allows.
+ */
+int srclines__resolve(struct srcline_req *reqs, size_t nr)
+{
+	struct srcline_work work = { .reqs = reqs, };
+	pthread_t *threads = NULL;
+	size_t i, n = 0;
+	long nr_threads = 1, started = 0;
+	int err = -ENOMEM;
+
+	qsort(reqs, nr, sizeof(*reqs), srcline_req__cmp);
+
+	/* drop duplicates and what is already known */
+	for (i = 0; i < nr; i++) {
+		struct dso *dso = reqs[i].dso;
+
+		if (n && reqs[n - 1].dso == dso && reqs[n - 1].addr == reqs[i].addr)
+			continue;
+		dso__load_srcline_cache(dso);
+		if (!dso->has_srcline || dso__name(dso) == NULL ||
+		    srcline__tree_find(&dso->a2l_srclines, reqs[i].addr))
+			continue;
+		reqs[n++] = reqs[i];
+	}
+
+	if (n == 0)
+		return 0;
+
+	work.addrs = malloc(n * sizeof(*work.addrs));
+	work.groups = malloc((n + 1) * sizeof(*work.groups));
+	if (work.addrs == NULL || work.groups == NULL)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		work.addrs[i] = reqs[i].addr;
+		if (i == 0 || reqs[i].dso != reqs[i - 1].dso)
+			work.groups[work.nr_groups++] = i;
+	}
+	work.groups[work.nr_groups] = n;
+
+	if (A2L_PARALLEL)
+		nr_threads = min_t(long, sysconf(_SC_NPROCESSORS_ONLN),
+				   work.nr_groups);
+
+	if (nr_threads > 1)
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+
+	for (; threads && started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL, srcline_worker,
+				   &work))
+			break;
+	}
+
+	/* this thread helps too, and does it all if no thread started */
+	srcline_worker(&work);
+
+	for (i = 0; i < (size_t)started; i++)
+		pthread_join(threads[i], NULL);
+
+	pr_debug("Resolved %zu srclines of %zu dsos with %ld threads\n",
+		 n, work.nr_groups, started + 1);
+	err = 0;
+out:
+	free(threads);
+	free(work.groups);
+	free(work.addrs);
+	return err;
+}
+
+static size_t srcline_node__size(struct srcline_node *node)
+{
+	size_t size = sizeof(*node);
+
+	if (node->srcline && strcmp(node->srcline, SRCLINE_UNKNOWN) != 0)
+		size += strlen(node->srcline) + 1;
+	return size;
+}
+
 void srcline__tree_insert(struct rb_root_cached *tree, u64 addr, char *srcline)
 {
 	struct rb_node **p = &tree->rb_root.rb_node;
@@ -609,6 +1534,7 @@ void srcline__tree_insert(struct rb_root_cached *tree, u64 addr, char *srcline)
 
 	node->addr = addr;
 	node->srcline = srcline;
+	mem_stats__add(MEM_STAT__SRCLINES, srcline_node__size(node), 1);
 
 	while (*p != NULL) {
 		parent = *p;
@@ -652,6 +1578,7 @@ void srcline__tree_delete(struct rb_root_cached *tree)
 		pos = rb_entry(next, struct srcline_node, rb_node);
 		next = rb_next(&pos->rb_node);
 		rb_erase_cached(&pos->rb_node, tree);
+		mem_stats__sub(MEM_STAT__SRCLINES, srcline_node__size(pos), 1);
 		free_srcline(pos->srcline);
 		zfree(&pos);
 	}
@@ -660,13 +1587,23 @@ void srcline__tree_delete(struct rb_root_cached *tree)
 struct inline_node *dso__parse_addr_inlines(struct dso *dso, u64 addr,
 					    struct symbol *sym)
 {
+	struct inline_node *node;
 	const char *dso_name;
 
 	dso_name = dso__name(dso);
 	if (dso_name == NULL)
 		return NULL;
 
-	return addr2inlines(dso_name, addr, dso, sym);
+	dso__load_srcline_cache(dso);
+	node = dso__find_cached_inlines(dso, addr, sym);
+	if (node)
+		return node;
+
+	node = addr2inlines(dso_name, addr, dso, sym);
+	if (node)
+		dso->srcline_cache_dirty = 1;
+
+	return node;
 }
 
 void inline_node__delete(struct inline_node *node)
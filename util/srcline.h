@@ -18,6 +18,17 @@ char *__get_srcline(struct dso *dso, u64 addr, struct symbol *sym,
 void free_srcline(char *srcline);
 char *get_srcline_split(struct dso *dso, u64 addr, unsigned *line);
 
+struct srcline_req {
+	struct dso		*dso;
+	u64			addr;
+};
+
+/* look up the srclines of many addresses ahead of get_srcline() */
+int dso__resolve_srclines(struct dso *dso, u64 *addrs, size_t nr);
+int srclines__resolve(struct srcline_req *reqs, size_t nr);
+/* save the srclines and inlines of dso to the build-id cache */
+void dso__exit_srcline_cache(struct dso *dso);
+
 /* insert the srcline into the DSO, which will take ownership */
 void srcline__tree_insert(struct rb_root_cached *tree, u64 addr, char *srcline);
 /* find previously inserted srcline */
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <inttypes.h>
+#include <time.h>
+#include <linux/time64.h>
+#include "stage-time.h"
+
+bool stage_time__enabled;
+
+static struct {
+	u64	ns;
+	u64	nr;
+} stage_times[STAGE_TIME__MAX];
+
+static const struct {
+	const char	*name;
+	int		depth;
+} stage_time_names[STAGE_TIME__MAX] = {
+	[STAGE_TIME__PROCESS_EVENTS] = { "process events",	0 },
+	[STAGE_TIME__MMAP]	     = { "mmap",		1 },
+	[STAGE_TIME__QUEUE]	     = { "queue",		1 },
+	[STAGE_TIME__FLUSH]	     = { "flush",		1 },
+	[STAGE_TIME__PARSE_SAMPLE]   = { "parse sample",	2 },
+	[STAGE_TIME__RESOLVE]	     = { "resolve",		2 },
+	[STAGE_TIME__SYMBOL_LOAD]    = { "symbol load",		3 },
+	[STAGE_TIME__HIST_ADD]	     = { "hist add",		2 },
+	[STAGE_TIME__CALLCHAIN]	     = { "callchain",		3 },
+	[STAGE_TIME__UNWIND]	     = { "unwind",		4 },
+	[STAGE_TIME__COLLAPSE]	     = { "collapse",		0 },
+	[STAGE_TIME__RESORT]	     = { "resort",		0 },
+	[STAGE_TIME__OUTPUT]	     = { "output",		0 },
+};
+
+u64 __stage_time__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* symbols are loaded and stacks unwound on several threads */
+void __stage_time__end(enum stage_time_id id, u64 start)
+{
+	__sync_add_and_fetch(&stage_times[id].ns, __stage_time__now() - start);
+	__sync_add_and_fetch(&stage_times[id].nr, 1);
+}
+
+size_t stage_time__fprintf(FILE *fp)
+{
+	size_t ret;
+	int i;
+
+	ret = fprintf(fp, "#\n# Processing time, stages include the ones under them:\n#\n");
+	ret += fprintf(fp, "# %-24s %14s %14s\n", "", "calls", "msec");
+
+	for (i = 0; i < STAGE_TIME__MAX; i++) {
+		int depth = stage_time_names[i].depth * 2;
+
+		ret += fprintf(fp, "# %*s%-*s %14" PRIu64 " %14.3f\n",
+			       depth, "", 24 - depth, stage_time_names[i].name,
+			       stage_times[i].nr,
+			       (double)stage_times[i].ns / NSEC_PER_MSEC);
+	}
+
+	return ret;
+}
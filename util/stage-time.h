@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_STAGE_TIME_H
+#define __PERF_STAGE_TIME_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * Time spent in the main stages of processing a data file, a profile of
+ * perf itself, taken when --stage-stats or --stats are asked for. The
+ * stages nest, the time of a stage includes that of the stages under it.
+ */
+enum stage_time_id {
+	STAGE_TIME__PROCESS_EVENTS,
+	STAGE_TIME__MMAP,
+	STAGE_TIME__QUEUE,
+	STAGE_TIME__FLUSH,
+	STAGE_TIME__PARSE_SAMPLE,
+	STAGE_TIME__RESOLVE,
+	STAGE_TIME__SYMBOL_LOAD,
+	STAGE_TIME__HIST_ADD,
+	STAGE_TIME__CALLCHAIN,
+	STAGE_TIME__UNWIND,
+	STAGE_TIME__COLLAPSE,
+	STAGE_TIME__RESORT,
+	STAGE_TIME__OUTPUT,
+	STAGE_TIME__MAX,
+};
+
+extern bool stage_time__enabled;
+
+u64 __stage_time__now(void);
+void __stage_time__end(enum stage_time_id id, u64 start);
+
+static inline u64 stage_time__start(void)
+{
+	return stage_time__enabled ? __stage_time__now() : 0;
+}
+
+static inline void stage_time__end(enum stage_time_id id, u64 start)
+{
+	if (start)
+		__stage_time__end(id, start);
+}
+
+size_t stage_time__fprintf(FILE *fp);
+
+#endif /* __PERF_STAGE_TIME_H */
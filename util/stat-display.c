@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <inttypes.h>
+#include <netdb.h>
 #include <linux/time64.h>
 #include <math.h>
 #include "color.h"
@@ -18,6 +19,9 @@
 #define CNTR_NOT_SUPPORTED	"<not supported>"
 #define CNTR_NOT_COUNTED	"<not counted>"
 
+/* the time of the interval, and the host, if any */
+#define STAT_PREFIX_SIZE	(NI_MAXHOST + 64)
+
 static bool is_duration_time(struct perf_evsel *evsel)
 {
 	return !strcmp(evsel->name, "duration_time");
@@ -312,8 +316,9 @@ static int first_shadow_cpu(struct perf_stat_config *config,
 
 	for (i = 0; i < perf_evsel__nr_cpus(evsel); i++) {
 		int cpu2 = perf_evsel__cpus(evsel)->map[i];
+		int s = perf_stat__aggr_idx(config, evlist->cpus, cpu2);
 
-		if (config->aggr_get_id(config, evlist->cpus, cpu2) == id)
+		if (s >= 0 && config->aggr_map->map[s] == id)
 			return cpu2;
 	}
 	return 0;
@@ -476,25 +481,31 @@ static void printout(struct perf_stat_config *config, int id, int nr,
 static void aggr_update_shadow(struct perf_stat_config *config,
 			       struct perf_evlist *evlist)
 {
-	int cpu, s2, id, s;
-	u64 val;
+	int nr_aggr = config->aggr_map->nr;
 	struct perf_evsel *counter;
+	int cpu, s;
+	u64 *vals;
 
-	for (s = 0; s < config->aggr_map->nr; s++) {
-		id = config->aggr_map->map[s];
-		evlist__for_each_entry(evlist, counter) {
-			val = 0;
-			for (cpu = 0; cpu < perf_evsel__nr_cpus(counter); cpu++) {
-				s2 = config->aggr_get_id(config, evlist->cpus, cpu);
-				if (s2 != id)
-					continue;
-				val += perf_counts(counter->counts, cpu, 0)->val;
-			}
-			perf_stat__update_shadow_stats(counter, val,
-					first_shadow_cpu(config, counter, id),
+	vals = malloc((nr_aggr + 1) * sizeof(*vals));
+	if (!vals)
+		return;
+
+	evlist__for_each_entry(evlist, counter) {
+		memset(vals, 0, nr_aggr * sizeof(*vals));
+		for (cpu = 0; cpu < perf_evsel__nr_cpus(counter); cpu++) {
+			s = perf_stat__aggr_idx(config, evlist->cpus, cpu);
+			if (s >= 0)
+				vals[s] += perf_counts(counter->counts, cpu, 0)->val;
+		}
+		for (s = 0; s < nr_aggr; s++) {
+			perf_stat__update_shadow_stats(counter, vals[s],
+					first_shadow_cpu(config, counter,
+							 config->aggr_map->map[s]),
 					&rt_stat);
 		}
 	}
+
+	free(vals);
 }
 
 static void uniquify_event_name(struct perf_evsel *counter)
@@ -566,22 +577,27 @@ struct aggr_data {
 	int id;
 	int nr;
 	int cpu;
+	bool done;
 };
 
+/* Sum the counts of each cpu of counter into ad[] of its aggregate */
 static void aggr_cb(struct perf_stat_config *config,
 		    struct perf_evsel *counter, void *data, bool first)
 {
 	struct aggr_data *ad = data;
-	int cpu, s2;
+	int cpu, s;
+
+	for (s = 0; s < config->aggr_map->nr; s++)
+		ad[s].done = false;
 
 	for (cpu = 0; cpu < perf_evsel__nr_cpus(counter); cpu++) {
 		struct perf_counts_values *counts;
 
-		s2 = config->aggr_get_id(config, perf_evsel__cpus(counter), cpu);
-		if (s2 != ad->id)
+		s = perf_stat__aggr_idx(config, perf_evsel__cpus(counter), cpu);
+		if (s < 0 || ad[s].done)
 			continue;
 		if (first)
-			ad->nr++;
+			ad[s].nr++;
 		counts = perf_counts(counter->counts, cpu, 0);
 		/*
 		 * When any result is bad, make them all to give
@@ -589,13 +605,14 @@ static void aggr_cb(struct perf_stat_config *config,
 		 */
 		if (counts->ena == 0 || counts->run == 0 ||
 		    counter->counts->scaled == -1) {
-			ad->ena = 0;
-			ad->run = 0;
-			break;
+			ad[s].ena = 0;
+			ad[s].run = 0;
+			ad[s].done = true;
+			continue;
 		}
-		ad->val += counts->val;
-		ad->ena += counts->ena;
-		ad->run += counts->run;
+		ad[s].val += counts->val;
+		ad[s].ena += counts->ena;
+		ad[s].run += counts->run;
 	}
 }
 
@@ -606,7 +623,8 @@ static void print_aggr(struct perf_stat_config *config,
 	bool metric_only = config->metric_only;
 	FILE *output = config->output;
 	struct perf_evsel *counter;
-	int s, id, nr;
+	struct aggr_data *ads;
+	int s, id, nr, nr_aggr;
 	double uval;
 	u64 ena, run, val;
 	bool first;
@@ -616,29 +634,45 @@ static void print_aggr(struct perf_stat_config *config,
 
 	aggr_update_shadow(config, evlist);
 
+	/*
+	 * The counts of all the aggregates of a counter are summed in one
+	 * pass over its cpus, the first of its ads[] has id -1 when it
+	 * doesn't have lines of its own.
+	 */
+	nr_aggr = config->aggr_map->nr;
+	ads = calloc(evlist->nr_entries * nr_aggr + 1, sizeof(*ads));
+	if (!ads)
+		return;
+
+	evlist__for_each_entry(evlist, counter) {
+		struct aggr_data *ad = &ads[counter->idx * nr_aggr];
+
+		if (is_duration_time(counter) ||
+		    !collect_data(config, counter, aggr_cb, ad))
+			ad->id = -1;
+	}
+
 	/*
 	 * With metric_only everything is on a single line.
 	 * Without each counter has its own line.
 	 */
-	for (s = 0; s < config->aggr_map->nr; s++) {
-		struct aggr_data ad;
+	for (s = 0; s < nr_aggr; s++) {
 		if (prefix && metric_only)
 			fprintf(output, "%s", prefix);
 
-		ad.id = id = config->aggr_map->map[s];
+		id = config->aggr_map->map[s];
 		first = true;
 		evlist__for_each_entry(evlist, counter) {
-			if (is_duration_time(counter))
-				continue;
+			struct aggr_data *ad = &ads[counter->idx * nr_aggr];
 
-			ad.val = ad.ena = ad.run = 0;
-			ad.nr = 0;
-			if (!collect_data(config, counter, aggr_cb, &ad))
+			if (ad->id == -1)
 				continue;
-			nr = ad.nr;
-			ena = ad.ena;
-			run = ad.run;
-			val = ad.val;
+
+			ad += s;
+			nr = ad->nr;
+			ena = ad->ena;
+			run = ad->run;
+			val = ad->val;
 			if (first && metric_only) {
 				first = false;
 				aggr_printout(config, counter, id, nr);
@@ -655,15 +689,63 @@ static void print_aggr(struct perf_stat_config *config,
 		if (metric_only)
 			fputc('\n', output);
 	}
+
+	free(ads);
 }
 
 static int cmp_val(const void *a, const void *b)
 {
-	return ((struct perf_aggr_thread_value *)b)->val -
-		((struct perf_aggr_thread_value *)a)->val;
+	u64 va = ((struct perf_aggr_thread_value *)a)->val,
+	    vb = ((struct perf_aggr_thread_value *)b)->val;
+
+	return va < vb ? 1 : va > vb ? -1 : 0;
+}
+
+/* Keep the smallest of the top values at the root of the heap */
+static void top_aggr_thread__sift(struct perf_aggr_thread_value *heap, int nr, int i)
+{
+	while (2 * i + 1 < nr) {
+		struct perf_aggr_thread_value tmp;
+		int min = 2 * i + 1;
+
+		if (min + 1 < nr && heap[min + 1].val < heap[min].val)
+			min++;
+		if (heap[i].val <= heap[min].val)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+/*
+ * Move the top threads with the highest counts to the start of buf, with
+ * a heap of them, not to sort the thousands of threads of a service for
+ * the few shown.
+ */
+static int top_aggr_thread(struct perf_aggr_thread_value *buf, int nr, int top)
+{
+	int i;
+
+	if (!top || nr <= top)
+		return nr;
+
+	for (i = top / 2 - 1; i >= 0; i--)
+		top_aggr_thread__sift(buf, top, i);
+
+	for (i = top; i < nr; i++) {
+		if (buf[i].val <= buf[0].val)
+			continue;
+		buf[0] = buf[i];
+		top_aggr_thread__sift(buf, top, 0);
+	}
+
+	return top;
 }
 
 static struct perf_aggr_thread_value *sort_aggr_thread(
+					struct perf_stat_config *config,
 					struct perf_evsel *counter,
 					int nthreads, int ncpus,
 					int *ret,
@@ -704,6 +786,7 @@ static struct perf_aggr_thread_value *sort_aggr_thread(
 		i++;
 	}
 
+	i = top_aggr_thread(buf, i, config->thread_top);
 	qsort(buf, i, sizeof(struct perf_aggr_thread_value), cmp_val);
 
 	if (ret)
@@ -722,7 +805,7 @@ static void print_aggr_thread(struct perf_stat_config *config,
 	int thread, sorted_threads, id;
 	struct perf_aggr_thread_value *buf;
 
-	buf = sort_aggr_thread(counter, nthreads, ncpus, &sorted_threads, _target);
+	buf = sort_aggr_thread(config, counter, nthreads, ncpus, &sorted_threads, _target);
 	if (!buf) {
 		perror("cannot sort aggr thread");
 		return;
@@ -935,7 +1018,12 @@ static void print_interval(struct perf_stat_config *config,
 	if (config->interval_clear)
 		puts(CONSOLE_CLEAR);
 
-	sprintf(prefix, "%6lu.%09lu%s", ts->tv_sec, ts->tv_nsec, config->csv_sep);
+	if (config->host) {
+		snprintf(prefix, STAT_PREFIX_SIZE, "%s%s%6lu.%09lu%s", config->host,
+			 config->csv_sep, ts->tv_sec, ts->tv_nsec, config->csv_sep);
+	} else {
+		sprintf(prefix, "%6lu.%09lu%s", ts->tv_sec, ts->tv_nsec, config->csv_sep);
+	}
 
 	if ((num_print_interval == 0 && !config->csv_output) || config->interval_clear) {
 		switch (config->aggr_mode) {
@@ -1111,7 +1199,7 @@ perf_evlist__print_counters(struct perf_evlist *evlist,
 	bool metric_only = config->metric_only;
 	int interval = config->interval;
 	struct perf_evsel *counter;
-	char buf[64], *prefix = NULL;
+	char buf[STAT_PREFIX_SIZE], *prefix = NULL;
 
 	if (interval)
 		print_interval(config, evlist, prefix = buf, ts);
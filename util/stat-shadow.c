@@ -382,6 +382,10 @@ void perf_stat__collect_metric_expr(struct perf_evlist *evsel_list)
 			free(metric_events);
 			counter->metric_events = NULL;
 			counter->metric_expr = NULL;
+		} else if (!counter->metric_prog) {
+			counter->metric_prog = metricgroup__compile(counter->metric_expr,
+								    counter->name,
+								    metric_events);
 		}
 	}
 }
@@ -709,6 +713,7 @@ static void print_smi_cost(struct perf_stat_config *config,
 
 static void generic_metric(struct perf_stat_config *config,
 			   const char *metric_expr,
+			   struct expr_prog *metric_prog,
 			   struct perf_evsel **metric_events,
 			   char *name,
 			   const char *metric_name,
@@ -718,13 +723,15 @@ static void generic_metric(struct perf_stat_config *config,
 			   struct runtime_stat *st)
 {
 	print_metric_t print_metric = out->print_metric;
+	double vals[MAX_PARSE_ID];
 	struct parse_ctx pctx;
 	double ratio;
-	int i;
+	int i, err;
 	void *ctxp = out->ctx;
 
 	expr__ctx_init(&pctx);
 	expr__add_id(&pctx, name, avg);
+	vals[0] = avg;
 	for (i = 0; metric_events[i]; i++) {
 		struct saved_value *v;
 		struct stats *stats;
@@ -741,12 +748,19 @@ static void generic_metric(struct perf_stat_config *config,
 			stats = &v->stats;
 			scale = 1.0;
 		}
-		expr__add_id(&pctx, metric_events[i]->name, avg_stats(stats)*scale);
+		vals[i + 1] = avg_stats(stats)*scale;
+		if (!metric_prog)
+			expr__add_id(&pctx, metric_events[i]->name, vals[i + 1]);
 	}
 	if (!metric_events[i]) {
 		const char *p = metric_expr;
 
-		if (expr__parse(&ratio, &pctx, &p) == 0)
+		if (metric_prog)
+			err = expr__eval(metric_prog, vals, &ratio);
+		else
+			err = expr__parse(&ratio, &pctx, &p);
+
+		if (err == 0)
 			print_metric(config, ctxp, NULL, "%8.1f",
 				metric_name ?
 				metric_name :
@@ -971,7 +985,8 @@ void perf_stat__print_shadow_stats(struct perf_stat_config *config,
 		else
 			print_metric(config, ctxp, NULL, NULL, name, 0);
 	} else if (evsel->metric_expr) {
-		generic_metric(config, evsel->metric_expr, evsel->metric_events, evsel->name,
+		generic_metric(config, evsel->metric_expr, evsel->metric_prog,
+				evsel->metric_events, evsel->name,
 				evsel->metric_name, avg, cpu, out, st);
 	} else if (runtime_stat_n(st, STAT_NSECS, 0, cpu) != 0) {
 		char unit = 'M';
@@ -999,7 +1014,8 @@ void perf_stat__print_shadow_stats(struct perf_stat_config *config,
 		list_for_each_entry (mexp, &me->head, nd) {
 			if (num++ > 0)
 				out->new_line(config, ctxp);
-			generic_metric(config, mexp->metric_expr, mexp->metric_events,
+			generic_metric(config, mexp->metric_expr, mexp->metric_prog,
+					mexp->metric_events,
 					evsel->name, mexp->metric_name,
 					avg, cpu, out, st);
 		}
@@ -6,6 +6,7 @@
 #include "evlist.h"
 #include "evsel.h"
 #include "thread_map.h"
+#include "env.h"
 
 void update_stats(struct stats *stats, u64 val)
 {
@@ -23,6 +24,26 @@ void update_stats(struct stats *stats, u64 val)
 		stats->min = val;
 }
 
+/* Account the values accounted in add in stats too */
+void merge_stats(struct stats *stats, struct stats *add)
+{
+	double n = stats->n + add->n;
+	double delta = add->mean - stats->mean;
+
+	if (add->n == 0)
+		return;
+
+	stats->M2 += add->M2 + delta * delta * stats->n * add->n / n;
+	stats->mean += delta * add->n / n;
+	stats->n = n;
+
+	if (add->max > stats->max)
+		stats->max = add->max;
+
+	if (add->min < stats->min)
+		stats->min = add->min;
+}
+
 double avg_stats(struct stats *stats)
 {
 	return stats->mean;
@@ -244,7 +265,11 @@ static int check_per_pkg(struct perf_evsel *counter,
 	if (!(vals->run && vals->ena))
 		return 0;
 
-	s = cpu_map__get_socket(cpus, cpu, NULL);
+	/* not the sysfs files for each cpu and read */
+	if (perf_env__read_cpu_topology_map(&perf_env))
+		return -1;
+
+	s = perf_env__get_socket(cpus, cpu, &perf_env);
 	if (s < 0)
 		return -1;
 
@@ -252,6 +277,53 @@ static int check_per_pkg(struct perf_evsel *counter,
 	return 0;
 }
 
+static int cmp_aggr_id(const void *a, const void *b)
+{
+	return *(int *)a - *(int *)b;
+}
+
+/*
+ * Look up the aggregate of each cpu once, so that the counts of an interval
+ * are summed per aggregate in one pass over the cpus, see print_aggr().
+ */
+int perf_stat__build_aggr_idx(struct perf_stat_config *config, struct cpu_map *cpus)
+{
+	int i, nr = 0;
+
+	if (!config->aggr_map || !config->aggr_get_id)
+		return 0;
+
+	for (i = 0; i < cpus->nr; i++) {
+		if (cpus->map[i] >= nr)
+			nr = cpus->map[i] + 1;
+	}
+
+	free(config->aggr_idx);
+	config->aggr_idx = malloc((nr + 1) * sizeof(int));
+	if (!config->aggr_idx)
+		return -ENOMEM;
+	config->aggr_idx_nr = nr;
+
+	for (i = 0; i < nr; i++)
+		config->aggr_idx[i] = -1;
+
+	for (i = 0; i < cpus->nr; i++) {
+		int id = config->aggr_get_id(config, cpus, i);
+		int *s;
+
+		if (cpus->map[i] < 0)
+			continue;
+
+		/* the aggr_map ids are sorted, see cpu_map__build_map() */
+		s = bsearch(&id, config->aggr_map->map, config->aggr_map->nr,
+			    sizeof(int), cmp_aggr_id);
+		if (s)
+			config->aggr_idx[cpus->map[i]] = s - config->aggr_map->map;
+	}
+
+	return 0;
+}
+
 static int
 process_counter_values(struct perf_stat_config *config, struct perf_evsel *evsel,
 		       int cpu, int thread,
@@ -112,6 +112,9 @@ struct perf_stat_config {
 	unsigned int		 initial_delay;
 	unsigned int		 unit_width;
 	unsigned int		 metric_only_len;
+	unsigned int		 nr_read_threads;
+	/* --per-thread-top, 0 to show all the threads */
+	unsigned int		 thread_top;
 	int			 times;
 	int			 run_count;
 	int			 print_free_counters_hint;
@@ -119,16 +122,40 @@ struct perf_stat_config {
 	struct runtime_stat	*stats;
 	int			 stats_num;
 	const char		*csv_sep;
+	/* the first column of the intervals, for many hosts in one output */
+	const char		*host;
 	struct stats		*walltime_nsecs_stats;
 	struct rusage		 ru_data;
 	struct cpu_map		*aggr_map;
 	aggr_get_id_t		 aggr_get_id;
 	struct cpu_map		*cpus_aggr_map;
+	/* indexed by cpu, the index in aggr_map of its aggregate, or -1 */
+	int			*aggr_idx;
+	int			 aggr_idx_nr;
 	u64			*walltime_run;
 	struct rblist		 metric_events;
 };
 
+int perf_stat__build_aggr_idx(struct perf_stat_config *config, struct cpu_map *cpus);
+
+/* The index in config->aggr_map of the aggregate of cpu idx of map, or -1 */
+static inline int perf_stat__aggr_idx(struct perf_stat_config *config,
+				      struct cpu_map *map, int idx)
+{
+	int cpu;
+
+	if (idx < 0 || idx >= map->nr)
+		return -1;
+
+	cpu = map->map[idx];
+	if (cpu < 0 || cpu >= config->aggr_idx_nr)
+		return -1;
+
+	return config->aggr_idx[cpu];
+}
+
 void update_stats(struct stats *stats, u64 val);
+void merge_stats(struct stats *stats, struct stats *add);
 double avg_stats(struct stats *stats);
 double stddev_stats(struct stats *stats);
 double rel_stddev_stats(double stddev, double avg);
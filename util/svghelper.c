@@ -65,6 +65,12 @@ static double time2pixels(u64 __time)
 	return X;
 }
 
+/* How wide the interval gets drawn, callers merge what is too narrow to see */
+double svg_pixels(u64 start, u64 end)
+{
+	return time2pixels(end) - time2pixels(start);
+}
+
 /*
  * Round text sizes so that the svg viewer only needs a discrete
  * number of renderings of the font
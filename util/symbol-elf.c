@@ -382,7 +382,7 @@ int dso__synthesize_plt_symbols(struct dso *dso, struct symsrc *ss)
 				 "%s@plt", elf_name);
 			free(demangled);
 
-			f = symbol__new(plt_offset, plt_entry_size,
+			f = dso__new_symbol(dso, plt_offset, plt_entry_size,
 					STB_GLOBAL, STT_FUNC, sympltname);
 			if (!f)
 				goto out_elf_end;
@@ -408,7 +408,7 @@ int dso__synthesize_plt_symbols(struct dso *dso, struct symsrc *ss)
 				 "%s@plt", elf_name);
 			free(demangled);
 
-			f = symbol__new(plt_offset, plt_entry_size,
+			f = dso__new_symbol(dso, plt_offset, plt_entry_size,
 					STB_GLOBAL, STT_FUNC, sympltname);
 			if (!f)
 				goto out_elf_end;
@@ -966,8 +966,10 @@ int dso__load_sym(struct dso *dso, struct map *map, struct symsrc *syms_ss,
 	 * Modules may already have symbols from kallsyms, but those symbols
 	 * have the wrong values for the dso maps, so remove them.
 	 */
-	if (kmodule && syms_ss->symtab)
+	if (kmodule && syms_ss->symtab) {
 		symbols__delete(&dso->symbols);
+		dso__reset_find_symbol_cache(dso);
+	}
 
 	if (!syms_ss->symtab) {
 		/*
@@ -1126,9 +1128,9 @@ int dso__load_sym(struct dso *dso, struct map *map, struct symsrc *syms_ss,
 		if (demangled != NULL)
 			elf_name = demangled;
 
-		f = symbol__new(sym.st_value, sym.st_size,
-				GELF_ST_BIND(sym.st_info),
-				GELF_ST_TYPE(sym.st_info), elf_name);
+		f = dso__new_symbol(curr_dso, sym.st_value, sym.st_size,
+				    GELF_ST_BIND(sym.st_info),
+				    GELF_ST_TYPE(sym.st_info), elf_name);
 		free(demangled);
 		if (!f)
 			goto out_elf_end;
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <linux/kernel.h>
+#include <linux/hash.h>
 #include <linux/mman.h>
 #include <linux/time64.h>
 #include <sys/types.h>
@@ -20,12 +21,18 @@
 #include "machine.h"
 #include "map.h"
 #include "symbol.h"
+#include "comm.h"
 #include "strlist.h"
 #include "intlist.h"
 #include "namespaces.h"
 #include "header.h"
 #include "path.h"
 #include "sane_ctype.h"
+#include "symcache.h"
+#include "mem-stats.h"
+#include "stage-time.h"
+#include "kallsyms-cache.h"
+#include "slab.h"
 
 #include <elf.h>
 #include <limits.h>
@@ -51,6 +58,7 @@ struct symbol_conf symbol_conf = {
 	.symfs			= "",
 	.event_group		= true,
 	.inline_name		= true,
+	.share_dsos		= true,
 	.res_sample		= 0,
 };
 
@@ -253,11 +261,12 @@ out_unlock:
 	up_write(&maps->lock);
 }
 
-struct symbol *symbol__new(u64 start, u64 len, u8 binding, u8 type, const char *name)
+static struct symbol *__symbol__new(void *mem, u64 start, u64 len,
+				    u8 binding, u8 type, const char *name,
+				    size_t namelen)
 {
-	size_t namelen = strlen(name) + 1;
-	struct symbol *sym = calloc(1, (symbol_conf.priv_size +
-					sizeof(*sym) + namelen));
+	struct symbol *sym = mem;
+
 	if (sym == NULL)
 		return NULL;
 
@@ -282,8 +291,51 @@ struct symbol *symbol__new(u64 start, u64 len, u8 binding, u8 type, const char *
 	return sym;
 }
 
+static size_t symbol__size(size_t namelen)
+{
+	return symbol_conf.priv_size + sizeof(struct symbol) + namelen;
+}
+
+struct symbol *symbol__new(u64 start, u64 len, u8 binding, u8 type, const char *name)
+{
+	size_t namelen = strlen(name) + 1;
+	struct symbol *sym;
+
+	sym = __symbol__new(calloc(1, symbol__size(namelen)),
+			    start, len, binding, type, name, namelen);
+	if (sym)
+		mem_stats__add(MEM_STAT__SYMBOLS, symbol__size(namelen), 1);
+	return sym;
+}
+
+/*
+ * Symbols of user dsos are allocated in bulk from the dso symbols_arena and
+ * released all together with it. Kernel symbols are not, they get moved to
+ * the dsos of the modules and sections.
+ */
+struct symbol *dso__new_symbol(struct dso *dso, u64 start, u64 len,
+			       u8 binding, u8 type, const char *name)
+{
+	size_t namelen = strlen(name) + 1;
+	struct symbol *sym;
+
+	if (dso->kernel != DSO_TYPE_USER)
+		return symbol__new(start, len, binding, type, name);
+
+	sym = __symbol__new(arena__zalloc(&dso->symbols_arena, symbol__size(namelen)),
+			    start, len, binding, type, name, namelen);
+	if (sym)
+		sym->arena = 1;
+	return sym;
+}
+
 void symbol__delete(struct symbol *sym)
 {
+	/* goes away with the arena */
+	if (sym->arena)
+		return;
+
+	mem_stats__sub(MEM_STAT__SYMBOLS, symbol__size(sym->namelen + 1), 1);
 	free(((void *)sym) - symbol_conf.priv_size);
 }
 
@@ -487,10 +539,130 @@ static struct symbol *symbols__find_by_name(struct rb_root_cached *symbols,
 	return &s->sym;
 }
 
+/*
+ * The symbols of a loaded dso hardly change, so lookups go to a sorted
+ * array of them instead of the rbtree. max_end is the highest end of the
+ * entries up to this one, for overlapping symbols.
+ */
+struct symbols_array {
+	u64			gen;
+	size_t			nr;
+	struct symbols_array_entry {
+		u64		start;
+		u64		end;
+		u64		max_end;
+		struct symbol	*sym;
+	} entries[];
+};
+
+/* Unique id for every array built, so that the lookup cache never gets stale. */
+static u64 symbols_array__gen;
+
+#define SYMBOL_CACHE_BITS	6
+
+static __thread struct symbol_cache_entry {
+	u64		 gen;
+	u64		 addr;
+	struct symbol	*sym;
+} symbol_cache[1 << SYMBOL_CACHE_BITS];
+
+static struct symbols_array *symbols_array__new(struct rb_root_cached *symbols)
+{
+	struct symbols_array *array;
+	struct rb_node *nd;
+	u64 max_end = 0;
+	size_t nr = 0;
+
+	for (nd = rb_first_cached(symbols); nd; nd = rb_next(nd))
+		nr++;
+
+	array = malloc(sizeof(*array) + nr * sizeof(array->entries[0]));
+	if (!array)
+		return NULL;
+
+	array->gen = __sync_add_and_fetch(&symbols_array__gen, 1);
+	array->nr = 0;
+
+	for (nd = rb_first_cached(symbols); nd; nd = rb_next(nd)) {
+		struct symbol *sym = rb_entry(nd, struct symbol, rb_node);
+		struct symbols_array_entry *entry = &array->entries[array->nr++];
+
+		if (sym->end > max_end)
+			max_end = sym->end;
+
+		entry->start   = sym->start;
+		entry->end     = sym->end;
+		entry->max_end = max_end;
+		entry->sym     = sym;
+	}
+
+	return array;
+}
+
+/* Same semantics as symbols__find(), the innermost symbol wins on overlaps. */
+static struct symbol *symbols_array__find(struct symbols_array *array, u64 ip)
+{
+	const struct symbols_array_entry *base = array->entries;
+	size_t n = array->nr, i;
+
+	if (!n || base[0].start > ip)
+		return NULL;
+
+	/* last entry starting at or before ip */
+	while (n > 1) {
+		size_t half = n / 2;
+
+		base = base[half].start <= ip ? base + half : base;
+		n -= half;
+	}
+
+	for (i = base - array->entries + 1; i-- > 0; ) {
+		const struct symbols_array_entry *entry = &array->entries[i];
+
+		if (entry->max_end < ip)
+			break;
+		if (ip < entry->end || (ip == entry->end && ip == entry->start))
+			return entry->sym;
+	}
+
+	return NULL;
+}
+
+static struct symbol *symbols_array__find_cached(struct symbols_array *array, u64 ip)
+{
+	struct symbol_cache_entry *entry;
+
+	entry = &symbol_cache[hash_64(ip ^ array->gen, SYMBOL_CACHE_BITS)];
+	if (entry->gen != array->gen || entry->addr != ip) {
+		entry->gen  = array->gen;
+		entry->addr = ip;
+		entry->sym  = symbols_array__find(array, ip);
+	}
+
+	return entry->sym;
+}
+
+static struct symbols_array *dso__symbols_array(struct dso *dso)
+{
+	struct symbols_array *array = dso->symbols_array;
+
+	if (array || !dso__loaded(dso))
+		return array;
+
+	array = symbols_array__new(&dso->symbols);
+	if (array && !__sync_bool_compare_and_swap(&dso->symbols_array, NULL, array)) {
+		free(array);
+		array = dso->symbols_array;
+	}
+
+	return array;
+}
+
 void dso__reset_find_symbol_cache(struct dso *dso)
 {
 	dso->last_find_result.addr   = 0;
 	dso->last_find_result.symbol = NULL;
+	zfree(&dso->symbols_array);
 }
 
 void dso__insert_symbol(struct dso *dso, struct symbol *sym)
@@ -503,10 +675,17 @@ void dso__insert_symbol(struct dso *dso, struct symbol *sym)
 	    sym->start == sym->end)) {
 		dso->last_find_result.symbol = sym;
 	}
+
+	zfree(&dso->symbols_array);
 }
 
 struct symbol *dso__find_symbol(struct dso *dso, u64 addr)
 {
+	struct symbols_array *array = dso__symbols_array(dso);
+
+	if (array)
+		return symbols_array__find_cached(array, addr);
+
 	if (dso->last_find_result.addr != addr || dso->last_find_result.symbol == NULL) {
 		dso->last_find_result.addr   = addr;
 		dso->last_find_result.symbol = symbols__find(&dso->symbols, addr);
@@ -683,9 +862,25 @@ static int map__process_kallsym_symbol(void *arg, const char *name,
  * so that we can in the next step set the symbol ->end address and then
  * call kernel_maps__split_kallsyms.
  */
-static int dso__load_all_kallsyms(struct dso *dso, const char *filename)
+static int dso__load_all_kallsyms(struct dso *dso, const char *filename,
+				  struct machine *machine)
 {
-	return kallsyms__parse(filename, dso, map__process_kallsym_symbol);
+	char path[PATH_MAX];
+	const char *modules;
+
+	if (dso->kernel != DSO_TYPE_GUEST_KERNEL || !dso->has_build_id)
+		return kallsyms_cache__parse(filename, dso, map__process_kallsym_symbol);
+
+	/* the guests with the same kernel and modules share their symbols */
+	if (machine__is_default_guest(machine)) {
+		modules = symbol_conf.default_guest_modules;
+	} else {
+		scnprintf(path, sizeof(path), "%s/proc/modules", machine->root_dir);
+		modules = path;
+	}
+
+	return kallsyms_cache__parse_guest(filename, modules, dso->build_id, dso,
+					   map__process_kallsym_symbol);
 }
 
 static int map_groups__split_kallsyms_for_kcore(struct map_groups *kmaps, struct dso *dso)
@@ -1041,7 +1236,7 @@ out_delete_from:
 
 struct map *map_groups__first(struct map_groups *mg)
 {
-	return maps__first(&mg->maps);
+	return maps__first(&map_groups__owner(mg)->maps);
 }
 
 static int do_validate_kcore_modules(const char *filename,
@@ -1335,7 +1530,7 @@ int __dso__load_kallsyms(struct dso *dso, const char *filename,
 	if (!kmap || !kmap->kmaps)
 		return -1;
 
-	if (dso__load_all_kallsyms(dso, filename) < 0)
+	if (dso__load_all_kallsyms(dso, filename, kmap->kmaps->machine) < 0)
 		return -1;
 
 	if (kallsyms__delta(kmap, filename, &delta))
@@ -1398,7 +1593,7 @@ static int dso__load_perf_map(const char *map_path, struct dso *dso)
 		if (len + 2 >= line_len)
 			continue;
 
-		sym = symbol__new(start, size, STB_GLOBAL, STT_FUNC, line + len);
+		sym = dso__new_symbol(dso, start, size, STB_GLOBAL, STT_FUNC, line + len);
 
 		if (sym == NULL)
 			goto out_delete_line;
@@ -1479,9 +1674,11 @@ static int dso__find_perf_map(char *filebuf, size_t bufsz,
 	nsi = *nsip;
 
 	if (nsi->need_setns) {
+		char nspath[PATH_MAX];
+
 		snprintf(filebuf, bufsz, "/tmp/perf-%d.map", nsi->nstgid);
-		nsinfo__mountns_enter(nsi, &nsc);
-		rc = access(filebuf, R_OK);
+		rc = access(nsinfo__mountns_path(nsi, filebuf, nspath,
+						 sizeof(nspath), &nsc), R_OK);
 		nsinfo__mountns_exit(&nsc);
 		if (rc == 0)
 			return rc;
@@ -1514,8 +1711,11 @@ int dso__load(struct dso *dso, struct map *map)
 	bool perfmap;
 	unsigned char build_id[BUILD_ID_SIZE];
 	struct nscookie nsc;
+	struct nsinfo *ns_enter;
 	char newmapname[PATH_MAX];
+	char nspath[PATH_MAX];
 	const char *map_path = dso->long_name;
+	u64 start = stage_time__start();
 
 	perfmap = strncmp(dso->name, "/tmp/perf-", 10) == 0;
 	if (perfmap) {
@@ -1525,7 +1725,13 @@ int dso__load(struct dso *dso, struct map *map)
 		}
 	}
 
-	nsinfo__mountns_enter(dso->nsinfo, &nsc);
+	/*
+	 * The files of a process in another mount namespace are reached
+	 * through its root when it could be opened, the namespace is only
+	 * entered otherwise.
+	 */
+	ns_enter = nsinfo__has_root(dso->nsinfo) ? NULL : dso->nsinfo;
+	nsinfo__mountns_enter(ns_enter, &nsc);
 	pthread_mutex_lock(&dso->lock);
 
 	/* check again under the dso->lock */
@@ -1553,7 +1759,9 @@ int dso__load(struct dso *dso, struct map *map)
 	dso->adjust_symbols = 0;
 
 	if (perfmap) {
-		ret = dso__load_perf_map(map_path, dso);
+		ret = dso__load_perf_map(nsinfo__root_path(dso->nsinfo, map_path,
+							   nspath, sizeof(nspath)),
+					 dso);
 		dso->symtab_type = ret > 0 ? DSO_BINARY_TYPE__JAVA_JIT :
 					     DSO_BINARY_TYPE__NOT_FOUND;
 		goto out;
@@ -1577,12 +1785,28 @@ int dso__load(struct dso *dso, struct map *map)
 	 * DSO_BINARY_TYPE__BUILDID_DEBUGINFO to work
 	 */
 	if (!dso->has_build_id &&
-	    is_regular_file(dso->long_name)) {
+	    is_regular_file(nsinfo__root_path(dso->nsinfo, dso->long_name,
+					      nspath, sizeof(nspath)))) {
 	    __symbol__join_symfs(name, PATH_MAX, dso->long_name);
-	    if (filename__read_build_id(name, build_id, BUILD_ID_SIZE) > 0)
+	    if (filename__read_build_id(nsinfo__root_path(dso->nsinfo, name,
+							  nspath, sizeof(nspath)),
+					build_id, BUILD_ID_SIZE) > 0)
 		dso__set_build_id(dso, build_id);
 	}
 
+	/*
+	 * Try the pre-sorted, pre-demangled symbols 'perf buildid-cache'
+	 * stored for this build-id before parsing any ELF file.
+	 */
+	if (!kmod) {
+		nsinfo__mountns_exit(&nsc);
+		ret = dso__load_symcache(dso);
+		nsinfo__mountns_enter(ns_enter, &nsc);
+		if (ret > 0)
+			goto out_free;
+		ret = -1;
+	}
+
 	/*
 	 * Iterate over candidate debug images.
 	 * Keep track of "interesting" ones (those which have a symtab, dynsym,
@@ -1592,7 +1816,8 @@ int dso__load(struct dso *dso, struct map *map)
 		struct symsrc *ss = &ss_[ss_pos];
 		bool next_slot = false;
 		bool is_reg;
-		bool nsexit;
+		bool nsexit, nsdebuglink;
+		const char *path = name;
 		int sirc = -1;
 
 		enum dso_binary_type symtab_type = binary_type_symtab[i];
@@ -1600,22 +1825,37 @@ int dso__load(struct dso *dso, struct map *map)
 		nsexit = (symtab_type == DSO_BINARY_TYPE__BUILD_ID_CACHE ||
 		    symtab_type == DSO_BINARY_TYPE__BUILD_ID_CACHE_DEBUGINFO);
 
+		/* the debuglink is read from the dso, in its namespace */
+		nsdebuglink = nsinfo__has_root(dso->nsinfo) &&
+			      symtab_type == DSO_BINARY_TYPE__DEBUGLINK;
+
 		if (!dso__is_compatible_symtab_type(dso, kmod, symtab_type))
 			continue;
 
+		if (nsdebuglink)
+			nsinfo__mountns_enter(dso->nsinfo, &nsc);
+
 		if (dso__read_binary_type_filename(dso, symtab_type,
-						   root_dir, name, PATH_MAX))
+						   root_dir, name, PATH_MAX)) {
+			if (nsdebuglink)
+				nsinfo__mountns_exit(&nsc);
 			continue;
+		}
 
 		if (nsexit)
 			nsinfo__mountns_exit(&nsc);
+		else if (!nsdebuglink)
+			path = nsinfo__root_path(dso->nsinfo, name,
+						 nspath, sizeof(nspath));
 
-		is_reg = is_regular_file(name);
+		is_reg = is_regular_file(path);
 		if (is_reg)
-			sirc = symsrc__init(ss, dso, name, symtab_type);
+			sirc = symsrc__init(ss, dso, path, symtab_type);
 
 		if (nsexit)
-			nsinfo__mountns_enter(dso->nsinfo, &nsc);
+			nsinfo__mountns_enter(ns_enter, &nsc);
+		if (nsdebuglink)
+			nsinfo__mountns_exit(&nsc);
 
 		if (!is_reg || sirc < 0)
 			continue;
@@ -1677,6 +1917,7 @@ out:
 	dso__set_loaded(dso);
 	pthread_mutex_unlock(&dso->lock);
 	nsinfo__mountns_exit(&nsc);
+	stage_time__end(STAGE_TIME__SYMBOL_LOAD, start);
 
 	return ret;
 }
@@ -2091,6 +2332,99 @@ int setup_intlist(struct intlist **list, const char *list_str,
 	return 0;
 }
 
+/* The pids and tids of the bitmaps, up to the largest pid_max */
+#define FILTER__MAX_ID	(1 << 22)
+
+static unsigned long *filter__new(unsigned int max_id)
+{
+	return calloc(max_id / BITS_PER_LONG + 1, sizeof(unsigned long));
+}
+
+/*
+ * The pids or tids of list as a bitmap, so that thread__is_filtered()
+ * doesn't look up the list for every sample.  It keeps using the list
+ * when the ids don't fit in one.
+ */
+static int setup_id_filter(unsigned long **filter, unsigned int *nr,
+			   struct intlist *list)
+{
+	struct int_node *pos;
+	int max_id = 0;
+
+	if (list == NULL)
+		return 0;
+
+	intlist__for_each_entry(pos, list) {
+		if (pos->i < 0 || pos->i >= FILTER__MAX_ID)
+			return 0;
+		max_id = max(max_id, pos->i);
+	}
+
+	*filter = filter__new(max_id);
+	if (*filter == NULL)
+		return -ENOMEM;
+
+	intlist__for_each_entry(pos, list)
+		set_bit(pos->i, *filter);
+	*nr = max_id + 1;
+	return 0;
+}
+
+/* The comms of list, interned, as a bitmap of their ids, see comm__id() */
+static int setup_comm_filter(unsigned long **filter, unsigned int *nr,
+			     struct strlist *list)
+{
+	struct str_node *pos;
+	u32 id, max_id = 0;
+
+	if (list == NULL)
+		return 0;
+
+	strlist__for_each_entry(pos, list) {
+		id = comm__str_id(pos->s);
+		if (!id)
+			return -ENOMEM;
+		max_id = max(max_id, id);
+	}
+
+	*filter = filter__new(max_id);
+	if (*filter == NULL)
+		return -ENOMEM;
+
+	strlist__for_each_entry(pos, list)
+		set_bit(comm__str_id(pos->s), *filter);
+	*nr = max_id + 1;
+	return 0;
+}
+
+static void symbol__free_filters(void)
+{
+	zfree(&symbol_conf.comm_filter);
+	zfree(&symbol_conf.pid_filter);
+	zfree(&symbol_conf.tid_filter);
+	symbol_conf.comm_filter_nr = 0;
+	symbol_conf.pid_filter_nr = 0;
+	symbol_conf.tid_filter_nr = 0;
+}
+
+static int symbol__setup_filters(void)
+{
+	if (setup_comm_filter(&symbol_conf.comm_filter,
+			      &symbol_conf.comm_filter_nr,
+			      symbol_conf.comm_list) < 0 ||
+	    setup_id_filter(&symbol_conf.pid_filter,
+			    &symbol_conf.pid_filter_nr,
+			    symbol_conf.pid_list) < 0 ||
+	    setup_id_filter(&symbol_conf.tid_filter,
+			    &symbol_conf.tid_filter_nr,
+			    symbol_conf.tid_list) < 0) {
+		pr_err("Not enough memory for the comm, pid and tid filters\n");
+		symbol__free_filters();
+		return -1;
+	}
+	return 0;
+}
+
 static bool symbol__read_kptr_restrict(void)
 {
 	bool value = false;
@@ -2172,6 +2506,9 @@ int symbol__init(struct perf_env *env)
 		       symbol_conf.bt_stop_list_str, "symbol") < 0)
 		goto out_free_sym_list;
 
+	if (symbol__setup_filters() < 0)
+		goto out_free_bt_stop_list;
+
 	/*
 	 * A path to symbols of "/" is identical to ""
 	 * reset here for simplicity.
@@ -2189,6 +2526,8 @@ int symbol__init(struct perf_env *env)
 	symbol_conf.initialized = true;
 	return 0;
 
+out_free_bt_stop_list:
+	strlist__delete(symbol_conf.bt_stop_list);
 out_free_sym_list:
 	strlist__delete(symbol_conf.sym_list);
 out_free_tid_list:
@@ -2212,6 +2551,7 @@ void symbol__exit(void)
 	strlist__delete(symbol_conf.comm_list);
 	intlist__delete(symbol_conf.tid_list);
 	intlist__delete(symbol_conf.pid_list);
+	symbol__free_filters();
 	vmlinux_path__exit();
 	symbol_conf.sym_list = symbol_conf.dso_list = symbol_conf.comm_list = NULL;
 	symbol_conf.bt_stop_list = NULL;
@@ -2248,16 +2588,30 @@ struct mem_info *mem_info__get(struct mem_info *mi)
 	return mi;
 }
 
+/*
+ * A mem_info is resolved for each memory sample and most are put right
+ * away, as their hist entry exists already, so they come from a slab.
+ */
+static struct slab mem_info_slab;
+static pthread_once_t mem_info_slab_once = PTHREAD_ONCE_INIT;
+
+static void mem_info_slab__init(void)
+{
+	slab__init(&mem_info_slab, sizeof(struct mem_info), MEM_STAT__MEM_INFOS);
+}
+
 void mem_info__put(struct mem_info *mi)
 {
 	if (mi && refcount_dec_and_test(&mi->refcnt))
-		free(mi);
+		slab__free(&mem_info_slab, mi);
 }
 
 struct mem_info *mem_info__new(void)
 {
-	struct mem_info *mi = zalloc(sizeof(*mi));
+	struct mem_info *mi;
 
+	pthread_once(&mem_info_slab_once, mem_info_slab__init);
+	mi = slab__zalloc(&mem_info_slab);
 	if (mi)
 		refcount_set(&mi->refcnt, 1);
 	return mi;
@@ -49,6 +49,16 @@ Elf_Scn *elf_section_by_name(Elf *elf, GElf_Ehdr *ep,
 #define DSO__NAME_KALLSYMS	"[kernel.kallsyms]"
 #define DSO__NAME_KCORE		"[kernel.kcore]"
 
+/*
+ * The --dsos or --symbols filter of a dso or symbol, only looked up in
+ * the list the first time, see addr_location__filter().
+ */
+enum symbol_filter {
+	SYMBOL_FILTER__UNCHECKED,
+	SYMBOL_FILTER__KEPT,
+	SYMBOL_FILTER__FILTERED,
+};
+
 /** struct symbol - symtab entry
  *
  * @ignore - resolvable but tools ignore it (e.g. idle routines)
@@ -63,8 +73,10 @@ struct symbol {
 	u8		idle:1;
 	u8		ignore:1;
 	u8		inlined:1;
+	u8		arena:1;
 	u8		arch_sym;
 	bool		annotate2;
+	u8		filter;		/* enum symbol_filter, for --symbols */
 	char		name[0];
 };
 
@@ -213,6 +225,8 @@ void symbol__elf_init(void);
 int symbol__annotation_init(void);
 
 struct symbol *symbol__new(u64 start, u64 len, u8 binding, u8 type, const char *name);
+struct symbol *dso__new_symbol(struct dso *dso, u64 start, u64 len,
+			       u8 binding, u8 type, const char *name);
 size_t __symbol__fprintf_symname_offs(const struct symbol *sym,
 				      const struct addr_location *al,
 				      bool unknown_as_addr,
@@ -23,6 +23,8 @@ struct symbol_conf {
 			show_total_period,
 			use_callchain,
 			cumulate_callchain,
+			defer_children,
+			keep_exited_maps,
 			show_branchflag_count,
 			exclude_other,
 			show_cpu_utilization,
@@ -39,7 +41,9 @@ struct symbol_conf {
 			hide_unresolved,
 			raw_trace,
 			report_hierarchy,
-			inline_name;
+			inline_name,
+			dso_by_build_id,
+			share_dsos;
 	const char	*vmlinux_name,
 			*kallsyms_name,
 			*source_prefix,
@@ -67,6 +71,16 @@ struct symbol_conf {
 			*bt_stop_list;
 	struct intlist	*pid_list,
 			*tid_list;
+	/*
+	 * The comm, pid and tid lists as bitmaps of comm ids, pids and tids,
+	 * see thread__is_filtered(), no pid or tid bitmap when they don't fit
+	 */
+	unsigned long	*comm_filter,
+			*pid_filter,
+			*tid_filter;
+	unsigned int	comm_filter_nr,
+			pid_filter_nr,
+			tid_filter_nr;
 	const char	*symfs;
 	int		res_sample;
 };
@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/kernel.h>
+#include "build-id.h"
+#include "debug.h"
+#include "dso.h"
+#include "map.h"
+#include "namespaces.h"
+#include "symbol.h"
+#include "symcache.h"
+#include "util.h"
+
+static u32 symcache__flags(struct dso *dso)
+{
+	u32 flags = 0;
+
+	if (symbol_conf.demangle)
+		flags |= SYMCACHE_F_DEMANGLE;
+	if (dso->adjust_symbols)
+		flags |= SYMCACHE_F_ADJUST_SYMBOLS;
+
+	return flags;
+}
+
+char *dso__symcache_filename(const struct dso *dso, char *bf, size_t size)
+{
+	return dso__build_id_cache_file(dso, SYMCACHE_NAME, bf, size);
+}
+
+static bool symcache__valid(struct dso *dso, struct symcache_header *hdr,
+			    size_t size)
+{
+	const char *strtab;
+
+	if (size < sizeof(*hdr) ||
+	    hdr->magic != SYMCACHE_MAGIC ||
+	    hdr->version != SYMCACHE_VERSION)
+		return false;
+
+	if (hdr->strtab_size == 0 ||
+	    size != sizeof(*hdr) + hdr->nr_syms * sizeof(struct symcache_entry) +
+		    hdr->strtab_size)
+		return false;
+
+	if (memcmp(hdr->build_id, dso->build_id, sizeof(hdr->build_id)))
+		return false;
+
+	/* Names were demangled, or not, as asked for when it was written */
+	if ((hdr->flags ^ symcache__flags(dso)) & SYMCACHE_F_DEMANGLE)
+		return false;
+
+	strtab = (void *)hdr + size - hdr->strtab_size;
+	return strtab[hdr->strtab_size - 1] == '\0';
+}
+
+/*
+ * Returns the number of symbols loaded from the cache in filename, or -1
+ * when it isn't usable for dso.
+ */
+int dso__load_symcache_file(struct dso *dso, const char *filename)
+{
+	struct symcache_header *hdr;
+	struct symcache_entry *entries;
+	const char *strtab;
+	struct stat st;
+	void *addr;
+	u32 i;
+	int fd, ret = -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr))
+		goto out_close;
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED)
+		goto out_close;
+
+	hdr = addr;
+	if (!symcache__valid(dso, hdr, st.st_size)) {
+		pr_debug("Ignoring stale symbol cache %s\n", filename);
+		goto out_unmap;
+	}
+
+	entries = addr + sizeof(*hdr);
+	strtab  = (const char *)(entries + hdr->nr_syms);
+
+	for (i = 0; i < hdr->nr_syms; i++) {
+		struct symcache_entry *e = &entries[i];
+		struct symbol *sym;
+
+		if (e->name >= hdr->strtab_size || e->end < e->start)
+			goto out_delete;
+
+		sym = dso__new_symbol(dso, e->start, e->end - e->start,
+				      e->binding, e->type, strtab + e->name);
+		if (sym == NULL)
+			goto out_delete;
+
+		sym->arch_sym = e->arch_sym;
+		symbols__insert(&dso->symbols, sym);
+	}
+
+	dso->symtab_type    = hdr->symtab_type;
+	dso->adjust_symbols = !!(hdr->flags & SYMCACHE_F_ADJUST_SYMBOLS);
+	dso->text_offset    = hdr->text_offset;
+	if (!dso->symsrc_filename && strtab[0])
+		dso->symsrc_filename = strdup(strtab);
+
+	pr_debug("Loaded %u symbols of %s from %s\n", hdr->nr_syms,
+		 dso->long_name, filename);
+	ret = hdr->nr_syms;
+	goto out_unmap;
+
+out_delete:
+	pr_debug("Corrupted symbol cache %s\n", filename);
+	symbols__delete(&dso->symbols);
+out_unmap:
+	munmap(addr, st.st_size);
+out_close:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Returns the number of symbols loaded from the cache, or -1 when there
+ * is no usable cache and the symbols have to be read from the binary.
+ */
+int dso__load_symcache(struct dso *dso)
+{
+	char filename[PATH_MAX];
+
+	if (dso->kernel || !dso->has_build_id ||
+	    !dso__symcache_filename(dso, filename, sizeof(filename)))
+		return -1;
+
+	return dso__load_symcache_file(dso, filename);
+}
+
+static int symcache__write_strtab(FILE *fp, struct dso *dso)
+{
+	const char *symsrc = dso->symsrc_filename ?: "";
+	struct rb_node *nd;
+
+	if (fwrite(symsrc, strlen(symsrc) + 1, 1, fp) != 1)
+		return -1;
+
+	for (nd = rb_first_cached(&dso->symbols); nd; nd = rb_next(nd)) {
+		struct symbol *sym = rb_entry(nd, struct symbol, rb_node);
+
+		if (fwrite(sym->name, sym->namelen + 1, 1, fp) != 1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the symbols of a loaded dso to filename, the symbols are walked
+ * in address order so the cache comes out already sorted.
+ */
+int dso__save_symcache(struct dso *dso, const char *filename)
+{
+	struct symcache_header hdr = {
+		.magic	     = SYMCACHE_MAGIC,
+		.version     = SYMCACHE_VERSION,
+		.flags	     = symcache__flags(dso),
+		.symtab_type = dso->symtab_type,
+		.text_offset = dso->text_offset,
+	};
+	const char *symsrc = dso->symsrc_filename ?: "";
+	char *tmpname;
+	struct rb_node *nd;
+	u64 name = strlen(symsrc) + 1;
+	FILE *fp;
+	int err = -1;
+
+	if (!dso->has_build_id)
+		return -1;
+
+	memcpy(hdr.build_id, dso->build_id, sizeof(hdr.build_id));
+
+	for (nd = rb_first_cached(&dso->symbols); nd; nd = rb_next(nd)) {
+		struct symbol *sym = rb_entry(nd, struct symbol, rb_node);
+
+		hdr.nr_syms++;
+		hdr.strtab_size += sym->namelen + 1;
+	}
+	hdr.strtab_size += name;
+
+	if (hdr.strtab_size > UINT_MAX)
+		return -1;
+
+	if (asprintf(&tmpname, "%s.tmp", filename) < 0)
+		return -1;
+
+	fp = fopen(tmpname, "w");
+	if (fp == NULL)
+		goto out_free;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto out_close;
+
+	for (nd = rb_first_cached(&dso->symbols); nd; nd = rb_next(nd)) {
+		struct symbol *sym = rb_entry(nd, struct symbol, rb_node);
+		struct symcache_entry e = {
+			.start	  = sym->start,
+			.end	  = sym->end,
+			.name	  = name,
+			.binding  = sym->binding,
+			.type	  = sym->type,
+			.arch_sym = sym->arch_sym,
+		};
+
+		if (fwrite(&e, sizeof(e), 1, fp) != 1)
+			goto out_close;
+		name += sym->namelen + 1;
+	}
+
+	if (symcache__write_strtab(fp, dso))
+		goto out_close;
+
+	err = 0;
+out_close:
+	if (fclose(fp))
+		err = -1;
+	if (!err && rename(tmpname, filename))
+		err = -1;
+	if (err)
+		unlink(tmpname);
+out_free:
+	free(tmpname);
+	return err;
+}
+
+/*
+ * Load the symbols of name the usual way and store them in the build-id
+ * cache directory it was just added to.
+ */
+int build_id_cache__add_symcache(const u8 *build_id, size_t build_id_size,
+				 const char *name, struct nsinfo *nsi)
+{
+	char filename[PATH_MAX];
+	struct dso *dso;
+	struct map *map;
+	int err = -1;
+
+	if (build_id_size < BUILD_ID_SIZE)
+		return -1;
+
+	dso = dso__new(name);
+	if (dso == NULL)
+		return -1;
+
+	dso->nsinfo = nsinfo__get(nsi);
+	dso__set_build_id(dso, (void *)build_id);
+
+	map = map__new2(0, dso);
+	if (map == NULL)
+		goto out_put;
+
+	if (!dso__symcache_filename(dso, filename, sizeof(filename)))
+		goto out_map;
+
+	/* Don't load back a cache we are asked to refresh */
+	unlink(filename);
+
+	if (dso__load(dso, map) > 0)
+		err = dso__save_symcache(dso, filename);
+
+	pr_debug4("%s symbol cache for %s\n", err ? "Failed to write" : "Wrote",
+		  name);
+out_map:
+	map__put(map);
+out_put:
+	dso__put(dso);
+	return err;
+}
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_SYMCACHE_H
+#define __PERF_SYMCACHE_H
+
+#include <linux/types.h>
+#include "build-id.h"
+
+struct dso;
+struct nsinfo;
+
+#define SYMCACHE_NAME	"symcache"
+
+/*
+ * The symbol cache is a flat file stored in the build-id cache directory
+ * next to the "elf" copy of a binary.  It holds the final, sorted and
+ * already demangled symbol table of the dso so that dso__load() can skip
+ * parsing the ELF symtab:
+ *
+ *   struct symcache_header
+ *   struct symcache_entry	[nr_syms]
+ *   char			strtab[strtab_size]
+ *
+ * Offset 0 of the string table is the symsrc filename the symbols were
+ * read from.
+ */
+#define SYMCACHE_MAGIC		0x434d595346524550ULL	/* "PERFSYMC" */
+#define SYMCACHE_VERSION	1
+
+enum {
+	SYMCACHE_F_DEMANGLE		= 1 << 0,
+	SYMCACHE_F_ADJUST_SYMBOLS	= 1 << 1,
+};
+
+struct symcache_header {
+	u64	magic;
+	u32	version;
+	u32	flags;
+	u32	symtab_type;
+	u32	nr_syms;
+	u64	text_offset;
+	u64	strtab_size;
+	u8	build_id[BUILD_ID_SIZE];
+	u8	__reserved[4];
+};
+
+struct symcache_entry {
+	u64	start;
+	u64	end;
+	u32	name;
+	u8	binding;
+	u8	type;
+	u8	arch_sym;
+	u8	__reserved;
+};
+
+char *dso__symcache_filename(const struct dso *dso, char *bf, size_t size);
+int dso__load_symcache(struct dso *dso);
+int dso__load_symcache_file(struct dso *dso, const char *filename);
+int dso__save_symcache(struct dso *dso, const char *filename);
+int build_id_cache__add_symcache(const u8 *build_id, size_t build_id_size,
+				 const char *name, struct nsinfo *nsi);
+
+#endif /* __PERF_SYMCACHE_H */
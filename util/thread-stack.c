@@ -28,7 +28,8 @@
 #include "call-path.h"
 #include "thread-stack.h"
 
-#define STACK_GROWTH 2048
+/* Most stacks are shallow, deep ones double in size as they grow */
+#define STACK_INIT_SZ 64
 
 /*
  * State of retpoline detection.
@@ -111,7 +112,7 @@ static int thread_stack__grow(struct thread_stack *ts)
 	struct thread_stack_entry *new_stack;
 	size_t sz, new_sz;
 
-	new_sz = ts->sz + STACK_GROWTH;
+	new_sz = ts->sz ? ts->sz * 2 : STACK_INIT_SZ;
 	sz = new_sz * sizeof(struct thread_stack_entry);
 
 	new_stack = realloc(ts->stack, sz);
@@ -15,6 +15,7 @@
 #include "map.h"
 #include "symbol.h"
 #include "unwind.h"
+#include "mem-stats.h"
 
 #include <api/fs/fs.h>
 
@@ -64,9 +65,11 @@ struct thread *thread__new(pid_t pid, pid_t tid)
 		list_add(&comm->list, &thread->comm_list);
 		refcount_set(&thread->refcnt, 1);
 		RB_CLEAR_NODE(&thread->rb_node);
+		INIT_HLIST_NODE(&thread->hash_node);
 		/* Thread holds first ref to nsdata. */
 		thread->nsinfo = nsinfo__new(pid);
 		srccode_state_init(&thread->srccode_state);
+		mem_stats__add(MEM_STAT__THREADS, sizeof(*thread), 1);
 	}
 
 	return thread;
@@ -110,9 +113,29 @@ void thread__delete(struct thread *thread)
 
 	exit_rwsem(&thread->namespaces_lock);
 	exit_rwsem(&thread->comm_lock);
+	mem_stats__sub(MEM_STAT__THREADS, sizeof(*thread), 1);
 	free(thread);
 }
 
+/*
+ * Release what a thread needs only for new samples, once it exited or
+ * can't be found by its tid anymore: the maps of its process, when it is
+ * the last thread of it, and its stack and unwind and source caches.
+ * What the hist entries of its samples use, its comms, namespaces and
+ * the machine of its map_groups, stays, so that the hist entries of
+ * short lived threads cost little more than the thread struct.
+ */
+void thread__reclaim(struct thread *thread)
+{
+	thread_stack__free(thread);
+	unwind__flush_access(thread);
+	srccode_state_free(&thread->srccode_state);
+
+	if (thread->mg && !symbol_conf.keep_exited_maps &&
+	    refcount_read(&thread->mg->refcnt) == 1)
+		map_groups__purge(thread->mg);
+}
+
 struct thread *thread__get(struct thread *thread)
 {
 	if (thread)
@@ -229,6 +252,9 @@ int __thread__set_comm(struct thread *thread, const char *str, u64 timestamp,
 	down_write(&thread->comm_lock);
 	ret = ____thread__set_comm(thread, str, timestamp, exec);
 	up_write(&thread->comm_lock);
+
+	if (exec && thread->mg)
+		map_groups__exec(thread->mg);
 	return ret;
 }
 
@@ -270,6 +296,20 @@ const char *thread__comm_str(const struct thread *thread)
 	return str;
 }
 
+u32 thread__comm_id(const struct thread *thread)
+{
+	const struct comm *comm;
+	u32 id = 0;
+
+	down_read((struct rw_semaphore *)&thread->comm_lock);
+	comm = thread__comm(thread);
+	if (comm)
+		id = comm__id(comm);
+	up_read((struct rw_semaphore *)&thread->comm_lock);
+
+	return id;
+}
+
 /* CHECKME: it should probably better return the max comm len from its comm list */
 int thread__comm_len(struct thread *thread)
 {
@@ -307,7 +347,7 @@ static int __thread__prepare_access(struct thread *thread)
 {
 	bool initialized = false;
 	int err = 0;
-	struct maps *maps = &thread->mg->maps;
+	struct maps *maps = &map_groups__owner(thread->mg)->maps;
 	struct map *map;
 
 	down_read(&maps->lock);
@@ -346,8 +386,14 @@ static int thread__clone_map_groups(struct thread *thread,
 			 thread->pid_, thread->tid, parent->pid_, parent->tid);
 		return 0;
 	}
-	/* But this one is new process, copy maps. */
-	return do_maps_clone ? map_groups__clone(thread, parent->mg) : 0;
+	if (!do_maps_clone)
+		return 0;
+
+	/* But this one is new process, share maps until either changes them. */
+	if (!map_groups__fork(thread->mg, parent->mg))
+		return thread__prepare_access(thread);
+
+	return map_groups__clone(thread, parent->mg);
 }
 
 int thread__fork(struct thread *thread, struct thread *parent, u64 timestamp, bool do_maps_clone)
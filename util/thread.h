@@ -5,6 +5,7 @@
 #include <linux/refcount.h>
 #include <linux/rbtree.h>
 #include <linux/list.h>
+#include <linux/bitops.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -25,6 +26,7 @@ struct thread {
 		struct rb_node	 rb_node;
 		struct list_head node;
 	};
+	struct hlist_node	hash_node;
 	struct map_groups	*mg;
 	pid_t			pid_; /* Not all tools update this */
 	pid_t			tid;
@@ -59,6 +61,7 @@ struct comm;
 struct thread *thread__new(pid_t pid, pid_t tid);
 int thread__init_map_groups(struct thread *thread, struct machine *machine);
 void thread__delete(struct thread *thread);
+void thread__reclaim(struct thread *thread);
 
 struct thread *thread__get(struct thread *thread);
 void thread__put(struct thread *thread);
@@ -94,6 +97,7 @@ int thread__comm_len(struct thread *thread);
 struct comm *thread__comm(const struct thread *thread);
 struct comm *thread__exec_comm(const struct thread *thread);
 const char *thread__comm_str(const struct thread *thread);
+u32 thread__comm_id(const struct thread *thread);
 int thread__insert_map(struct thread *thread, struct map *map);
 int thread__fork(struct thread *thread, struct thread *parent, u64 timestamp, bool do_maps_clone);
 size_t thread__fprintf(struct thread *thread, FILE *fp);
@@ -126,20 +130,35 @@ static inline void thread__set_priv(struct thread *thread, void *p)
 	thread->priv = p;
 }
 
+/* id is in one of the filter bitmaps made by symbol__init() */
+static inline bool thread__filter_has(const unsigned long *filter,
+				      unsigned int nr, int id)
+{
+	return id >= 0 && (unsigned int)id < nr && test_bit(id, filter);
+}
+
 static inline bool thread__is_filtered(struct thread *thread)
 {
 	if (symbol_conf.comm_list &&
-	    !strlist__has_entry(symbol_conf.comm_list, thread__comm_str(thread))) {
+	    !thread__filter_has(symbol_conf.comm_filter,
+				symbol_conf.comm_filter_nr,
+				thread__comm_id(thread))) {
 		return true;
 	}
 
 	if (symbol_conf.pid_list &&
-	    !intlist__has_entry(symbol_conf.pid_list, thread->pid_)) {
+	    !(symbol_conf.pid_filter ?
+	      thread__filter_has(symbol_conf.pid_filter,
+				 symbol_conf.pid_filter_nr, thread->pid_) :
+	      intlist__has_entry(symbol_conf.pid_list, thread->pid_))) {
 		return true;
 	}
 
 	if (symbol_conf.tid_list &&
-	    !intlist__has_entry(symbol_conf.tid_list, thread->tid)) {
+	    !(symbol_conf.tid_filter ?
+	      thread__filter_has(symbol_conf.tid_filter,
+				 symbol_conf.tid_filter_nr, thread->tid) :
+	      intlist__has_entry(symbol_conf.tid_list, thread->tid))) {
 		return true;
 	}
 
@@ -370,11 +370,15 @@ bool perf_time__skip_sample(struct perf_time_interval *ptime, u64 timestamp)
 	return false;
 }
 
+/*
+ * The ranges are sorted and disjoint, see perf_time__ranges_sort(), the
+ * sample is in the last one starting before it, if in any.
+ */
 bool perf_time__ranges_skip_sample(struct perf_time_interval *ptime_buf,
 				   int num, u64 timestamp)
 {
 	struct perf_time_interval *ptime;
-	int i;
+	int lo = 0, hi = num;
 
 	if ((!ptime_buf) || (timestamp == 0) || (num == 0))
 		return false;
@@ -382,20 +386,64 @@ bool perf_time__ranges_skip_sample(struct perf_time_interval *ptime_buf,
 	if (num == 1)
 		return perf_time__skip_sample(&ptime_buf[0], timestamp);
 
+	/* first range starting after timestamp */
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (ptime_buf[mid].start <= timestamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return true;
+
 	/*
-	 * start/end of multiple time ranges must be valid.
+	 * start/end of multiple time ranges must be valid, all but the last
+	 * exclude their end.
 	 */
-	for (i = 0; i < num; i++) {
-		ptime = &ptime_buf[i];
+	ptime = &ptime_buf[lo - 1];
+	if (timestamp < ptime->end || (timestamp == ptime->end && lo == num))
+		return false;
 
-		if (timestamp >= ptime->start &&
-		    ((timestamp < ptime->end && i < num - 1) ||
-		     (timestamp <= ptime->end && i == num - 1))) {
-			break;
+	return true;
+}
+
+static int ptime__cmp_start(const void *a, const void *b)
+{
+	const struct perf_time_interval *pa = a, *pb = b;
+
+	return pa->start < pb->start ? -1 : pa->start > pb->start;
+}
+
+/*
+ * Sort the ranges by start and merge the ones that overlap or touch, for
+ * perf_time__ranges_skip_sample() to binary search them, returns their
+ * new number.
+ */
+int perf_time__ranges_sort(struct perf_time_interval *ptime_buf, int num)
+{
+	int i, n = 0;
+
+	if (num < 2)
+		return num;
+
+	qsort(ptime_buf, num, sizeof(*ptime_buf), ptime__cmp_start);
+
+	for (i = 1; i < num; i++) {
+		struct perf_time_interval *last = &ptime_buf[n];
+
+		if (ptime_buf[i].start <= last->end) {
+			if (ptime_buf[i].end > last->end)
+				last->end = ptime_buf[i].end;
+			continue;
 		}
+
+		ptime_buf[++n] = ptime_buf[i];
 	}
 
-	return (i == num) ? true : false;
+	return n + 1;
 }
 
 int perf_time__parse_for_ranges(const char *time_str,
@@ -431,6 +479,8 @@ int perf_time__parse_for_ranges(const char *time_str,
 			ret = -EINVAL;
 			goto error;
 		}
+
+		num = perf_time__ranges_sort(ptime_range, num);
 	} else {
 		num = 1;
 	}
@@ -438,6 +488,13 @@ int perf_time__parse_for_ranges(const char *time_str,
 	*range_size = size;
 	*range_num = num;
 	*ranges = ptime_range;
+
+	/*
+	 * Samples outside of the ranges get skipped by the callers anyway,
+	 * let the session seek thru their hull.
+	 */
+	session->time_range.start = ptime_range[0].start;
+	session->time_range.end = ptime_range[num - 1].end;
 	return 0;
 
 error:
@@ -23,6 +23,8 @@ bool perf_time__skip_sample(struct perf_time_interval *ptime, u64 timestamp);
 bool perf_time__ranges_skip_sample(struct perf_time_interval *ptime_buf,
 				   int num, u64 timestamp);
 
+int perf_time__ranges_sort(struct perf_time_interval *ptime_buf, int num);
+
 struct perf_session;
 
 int perf_time__parse_for_ranges(const char *str, struct perf_session *session,
@@ -28,6 +28,7 @@ typedef int (*event_attr_op)(struct perf_tool *tool,
 
 typedef int (*event_op2)(struct perf_session *session, union perf_event *event);
 typedef s64 (*event_op3)(struct perf_session *session, union perf_event *event);
+typedef int (*event_op4)(struct perf_session *session, union perf_event *event, u64 data);
 
 typedef int (*event_oe)(struct perf_tool *tool, union perf_event *event,
 			struct ordered_events *oe);
@@ -55,7 +56,8 @@ struct perf_tool {
 			throttle,
 			unthrottle,
 			ksymbol,
-			bpf_event;
+			bpf_event,
+			cgroup;
 
 	event_attr_op	attr;
 	event_attr_op	event_update;
@@ -73,6 +75,7 @@ struct perf_tool {
 			stat_round,
 			feature;
 	event_op3	auxtrace;
+	event_op4	compressed;
 	bool		ordered_events;
 	bool		ordering_requires_timestamps;
 	bool		namespace_events;
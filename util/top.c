@@ -107,6 +107,10 @@ size_t perf_top__header_snprintf(struct perf_top *top, char *bf, size_t size)
 					top->evlist->cpus->nr > 1 ? "s" : "");
 	}
 
+	if (top->self_only_total)
+		ret += SNPRINTF(bf + ret, size - ret, " self-only: %" PRIu64 "/%" PRIu64,
+				top->self_only, top->self_only_total);
+
 	perf_top__reset_sample_counters(top);
 	return ret;
 }
@@ -115,5 +119,6 @@ void perf_top__reset_sample_counters(struct perf_top *top)
 {
 	top->samples = top->us_samples = top->kernel_samples =
 	top->exact_samples = top->guest_kernel_samples =
-	top->guest_us_samples = top->lost = top->drop = 0;
+	top->guest_us_samples = top->lost = top->drop =
+	top->self_only = 0;
 }
@@ -12,6 +12,19 @@
 struct perf_evlist;
 struct perf_evsel;
 struct perf_session;
+struct top_sample;
+
+/* A copy of a sample queued without ordering, see --relaxed-ordering */
+struct top_queued_sample {
+	union perf_event	*event;
+	u64			timestamp;
+};
+
+struct top_sample_queue {
+	struct top_queued_sample	*entries;
+	unsigned int			nr;
+	unsigned int			size;
+};
 
 struct perf_top {
 	struct perf_tool   tool;
@@ -26,11 +39,14 @@ struct perf_top {
 	u64		   kernel_samples, us_samples;
 	u64		   exact_samples;
 	u64		   guest_us_samples, guest_kernel_samples;
+	/* samples whose user stack wasn't unwound, see unwind_queue */
+	u64		   self_only, self_only_total;
 	int		   print_entries, count_filter, delay_secs;
 	int		   max_stack;
 	bool		   hide_kernel_symbols, hide_user_symbols, zero;
 	bool		   use_tui, use_stdio;
 	bool		   vmlinux_warned;
+	bool		   relaxed_ordering;
 	bool		   dump_symtab;
 	struct hist_entry  *sym_filter_entry;
 	struct perf_evsel  *sym_evsel;
@@ -40,6 +56,16 @@ struct perf_top {
 	const char	   *sym_filter;
 	float		   min_percent;
 	unsigned int	   nr_threads_synthesize;
+	unsigned int	   nr_threads_resolve;
+	unsigned int	   unwind_queue;
+
+	/* host samples queued to be resolved on nr_threads_resolve threads */
+	struct {
+		struct top_sample	*samples;
+		pthread_t		*threads;
+		unsigned int		 nr;
+		unsigned int		 next;
+	} resolve;
 
 	struct {
 		struct ordered_events	*in;
@@ -47,6 +73,17 @@ struct perf_top {
 		bool			 rotate;
 		pthread_mutex_t		 mutex;
 		pthread_cond_t		 cond;
+		/*
+		 * With relaxed_ordering the samples go to the queue paired
+		 * with data[], only the other events are ordered.  Every
+		 * event before the watermark was read when rotating, the
+		 * samples after it are held back until their sideband
+		 * events get processed.
+		 */
+		struct top_sample_queue	 samples[2];
+		struct top_sample_queue	 holdback;
+		u64			*mmap_last;
+		u64			 watermark;
 	} qe;
 };
 
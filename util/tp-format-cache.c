@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <api/fs/fs.h>
+#include <api/fs/tracing_path.h>
+#include "build-id.h"
+#include "debug.h"
+#include "kallsyms-cache.h"
+#include "rblist.h"
+#include "string2.h"
+#include "tp-format-cache.h"
+#include "util.h"
+
+/*
+ * Opening hundreds of tracepoints, like syscalls:*, has perf read the
+ * format file of each from tracefs to parse it, then again to put it in
+ * the tracing data of the perf.data header, on every run.  The formats are
+ * instead read once per process and the ones read from tracefs appended
+ * to ~/.cache/perf/tracefs/<kernel build-id>:
+ *
+ *   struct tp_format_cache_key
+ *   per format: sys and name with their '\0', u64 size, the format
+ *
+ * which is read for the boot and loaded modules it was written in, as the
+ * ids of the events in their formats depend on these.  The kprobes,
+ * uprobes and synthetic events come and go without that, they are only
+ * kept for the process.
+ */
+#define TP_FORMAT_CACHE_DIR	"/.cache/perf/tracefs"
+#define TP_FORMAT_CACHE_MAGIC	0x54414d524f465054ULL	/* "TPFORMAT" */
+#define TP_FORMAT_CACHE_VERSION	1
+
+struct tp_format_cache_key {
+	u64	magic;
+	u32	version;
+	u32	reserved;
+	u64	modules_hash;
+	char	boot_id[40];
+	char	build_id[48];
+};
+
+struct tp_format {
+	struct rb_node	rb_node;
+	const char	*sys;
+	const char	*name;
+	char		*data;
+	size_t		size;
+};
+
+bool tp_format_cache__enabled = true;
+
+static struct {
+	pthread_mutex_t	lock;
+	bool		loaded;
+	struct rblist	formats;
+	/* where the formats read from tracefs go, -1 for nowhere */
+	int		fd;
+} tp_format_cache = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.fd	= -1,
+};
+
+static int tp_format__cmp(struct rb_node *rb_node, const void *entry)
+{
+	const struct tp_format *a = container_of(rb_node, struct tp_format, rb_node);
+	const struct tp_format *b = entry;
+
+	return strcmp(a->sys, b->sys) ?: strcmp(a->name, b->name);
+}
+
+static struct rb_node *tp_format__new(struct rblist *rblist __maybe_unused,
+				      const void *entry)
+{
+	const struct tp_format *e = entry;
+	size_t sys_len = strlen(e->sys) + 1, name_len = strlen(e->name) + 1;
+	struct tp_format *fmt;
+	char *p;
+
+	/* the format and the names in one allocation */
+	fmt = malloc(sizeof(*fmt) + e->size + 1 + sys_len + name_len);
+	if (fmt == NULL)
+		return NULL;
+
+	p = (char *)(fmt + 1);
+	fmt->data = p;
+	memcpy(p, e->data, e->size);
+	p[e->size] = '\0';
+	fmt->size = e->size;
+	p += e->size + 1;
+	fmt->sys = memcpy(p, e->sys, sys_len);
+	p += sys_len;
+	fmt->name = memcpy(p, e->name, name_len);
+	return &fmt->rb_node;
+}
+
+static struct tp_format *tp_format_cache__add(const char *sys, const char *name,
+					      char *data, size_t size)
+{
+	struct tp_format entry = {
+		.sys  = sys,
+		.name = name,
+		.data = data,
+		.size = size,
+	};
+	struct rb_node *nd = rblist__findnew(&tp_format_cache.formats, &entry);
+
+	return nd ? container_of(nd, struct tp_format, rb_node) : NULL;
+}
+
+static bool tp_format_cache__dynamic(const char *sys)
+{
+	return strstarts(sys, "probe") || !strcmp(sys, "kprobes") ||
+	       !strcmp(sys, "uprobes") || !strcmp(sys, "synthetic");
+}
+
+static int tp_format_cache__key(struct tp_format_cache_key *key)
+{
+	char *boot_id;
+	size_t len;
+
+	memset(key, 0, sizeof(*key));
+	key->magic   = TP_FORMAT_CACHE_MAGIC;
+	key->version = TP_FORMAT_CACHE_VERSION;
+
+	if (sysfs__sprintf_build_id(NULL, key->build_id) < 0 ||
+	    kallsyms_cache__modules_hash(&key->modules_hash) ||
+	    filename__read_str("/proc/sys/kernel/random/boot_id", &boot_id, &len))
+		return -1;
+
+	scnprintf(key->boot_id, sizeof(key->boot_id), "%.*s", (int)len, boot_id);
+	rtrim(key->boot_id);
+	free(boot_id);
+	return 0;
+}
+
+static char *tp_format_cache__filename(const char *sbuild_id, char *bf, size_t size)
+{
+	const char *home = getenv("HOME");
+
+	if (!home || !*home)
+		return NULL;
+
+	if (sbuild_id)
+		scnprintf(bf, size, "%s" TP_FORMAT_CACHE_DIR "/%s", home, sbuild_id);
+	else
+		scnprintf(bf, size, "%s" TP_FORMAT_CACHE_DIR, home);
+	return bf;
+}
+
+/*
+ * The formats after the key, up to the first that isn't all there, of a
+ * perf that died writing it, cut so that those appended after are read.
+ */
+static void tp_format_cache__parse(int fd, char *buf, size_t size)
+{
+	char *p = buf, *end = buf + size;
+
+	while (p < end) {
+		char *sys = p, *name, *data;
+		u64 len;
+
+		name = memchr(sys, '\0', end - sys);
+		if (!name++ || name >= end)
+			break;
+		data = memchr(name, '\0', end - name);
+		if (!data++ || data + sizeof(len) > end)
+			break;
+		memcpy(&len, data, sizeof(len));
+		data += sizeof(len);
+		if (len > (u64)(end - data))
+			break;
+
+		if (!tp_format_cache__add(sys, name, data, len))
+			return;
+		p = data + len;
+	}
+
+	if (p < end && ftruncate(fd, sizeof(struct tp_format_cache_key) + (p - buf)))
+		pr_debug("Can't cut the tracefs format cache\n");
+}
+
+/* Open the cache to append to, reading the formats in it */
+static int tp_format_cache__open(const char *filename,
+				 const struct tp_format_cache_key *key)
+{
+	struct tp_format_cache_key file_key;
+	struct stat st;
+	char *buf;
+	size_t size;
+	int fd;
+
+	fd = open(filename, O_RDWR | O_APPEND | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(file_key) ||
+	    readn(fd, &file_key, sizeof(file_key)) != sizeof(file_key) ||
+	    memcmp(&file_key, key, sizeof(*key))) {
+		pr_debug("Ignoring stale tracefs format cache %s\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	size = st.st_size - sizeof(file_key);
+	buf = malloc(size);
+	if (buf == NULL || readn(fd, buf, size) != (ssize_t)size) {
+		free(buf);
+		close(fd);
+		return -1;
+	}
+
+	tp_format_cache__parse(fd, buf, size);
+	free(buf);
+	return fd;
+}
+
+/* A new cache, for this boot, with no formats yet */
+static int tp_format_cache__create(const char *filename,
+				   const struct tp_format_cache_key *key)
+{
+	char dir[PATH_MAX], tmpname[PATH_MAX];
+	int fd;
+
+	if (!tp_format_cache__filename(NULL, dir, sizeof(dir)) ||
+	    mkdir_p(dir, 0755))
+		return -1;
+
+	scnprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (write(fd, key, sizeof(*key)) != sizeof(*key) ||
+	    rename(tmpname, filename)) {
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void tp_format_cache__load(void)
+{
+	struct tp_format_cache_key key;
+	char filename[PATH_MAX];
+
+	if (!tp_format_cache__enabled || tp_format_cache__key(&key) ||
+	    !tp_format_cache__filename(key.build_id, filename, sizeof(filename)))
+		return;
+
+	tp_format_cache.fd = tp_format_cache__open(filename, &key);
+	if (tp_format_cache.fd < 0)
+		tp_format_cache.fd = tp_format_cache__create(filename, &key);
+}
+
+/* One write, so that perfs appending at the same time don't interleave */
+static void tp_format_cache__write(struct tp_format *fmt)
+{
+	size_t sys_len = strlen(fmt->sys) + 1, name_len = strlen(fmt->name) + 1;
+	size_t len = sys_len + name_len + sizeof(u64) + fmt->size;
+	u64 size = fmt->size;
+	char *buf, *p;
+
+	p = buf = malloc(len);
+	if (buf == NULL)
+		return;
+
+	memcpy(p, fmt->sys, sys_len);
+	p += sys_len;
+	memcpy(p, fmt->name, name_len);
+	p += name_len;
+	memcpy(p, &size, sizeof(size));
+	p += sizeof(size);
+	memcpy(p, fmt->data, fmt->size);
+
+	if (write(tp_format_cache.fd, buf, len) != (ssize_t)len) {
+		pr_debug("Can't write the tracefs format cache, not using it\n");
+		close(tp_format_cache.fd);
+		tp_format_cache.fd = -1;
+	}
+	free(buf);
+}
+
+static int tp_format_cache__read_tracefs(const char *sys, const char *name,
+					 struct tp_format **fmtp)
+{
+	char *tp_dir = get_events_file(sys);
+	char path[PATH_MAX];
+	char *data;
+	size_t size;
+	int err;
+
+	if (!tp_dir)
+		return -errno;
+
+	scnprintf(path, PATH_MAX, "%s/%s/format", tp_dir, name);
+	put_events_file(tp_dir);
+
+	err = filename__read_str(path, &data, &size);
+	if (err)
+		return err;
+
+	*fmtp = tp_format_cache__add(sys, name, data, size);
+	free(data);
+	if (*fmtp == NULL)
+		return -ENOMEM;
+
+	if (tp_format_cache.fd >= 0 && !tp_format_cache__dynamic(sys))
+		tp_format_cache__write(*fmtp);
+	return 0;
+}
+
+int tp_format_cache__read(const char *sys, const char *name,
+			  const char **data, size_t *size)
+{
+	struct tp_format entry = { .sys = sys, .name = name, };
+	struct tp_format *fmt = NULL;
+	struct rb_node *nd;
+	int err = 0;
+
+	pthread_mutex_lock(&tp_format_cache.lock);
+	if (!tp_format_cache.loaded) {
+		rblist__init(&tp_format_cache.formats);
+		tp_format_cache.formats.node_cmp = tp_format__cmp;
+		tp_format_cache.formats.node_new = tp_format__new;
+		tp_format_cache__load();
+		tp_format_cache.loaded = true;
+	}
+
+	nd = rblist__find(&tp_format_cache.formats, &entry);
+	if (nd)
+		fmt = container_of(nd, struct tp_format, rb_node);
+	else
+		err = tp_format_cache__read_tracefs(sys, name, &fmt);
+	pthread_mutex_unlock(&tp_format_cache.lock);
+
+	if (err)
+		return err;
+
+	*data = fmt->data;
+	*size = fmt->size;
+	return 0;
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_TP_FORMAT_CACHE_H
+#define __PERF_TP_FORMAT_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+extern bool tp_format_cache__enabled;
+
+/*
+ * The format file of the sys:name tracepoint, read once per process and
+ * kept in a cache for the running kernel, its boot and loaded modules.
+ * The format is the cache's, kept for the life of the process.
+ */
+int tp_format_cache__read(const char *sys, const char *name,
+			  const char **data, size_t *size);
+
+#endif /* __PERF_TP_FORMAT_CACHE_H */
@@ -40,6 +40,7 @@
 #include <api/fs/tracing_path.h>
 #include "evsel.h"
 #include "debug.h"
+#include "tp-format-cache.h"
 
 #define VERSION "0.6"
 
@@ -174,8 +175,27 @@ static bool name_in_tp_list(char *sys, struct tracepoint_path *tps)
 		    (strcmp(dent->d_name, ".")) &&		\
 		    (strcmp(dent->d_name, "..")))		\
 
+/* The format read to open the event, see tp_format(), with its size */
+static int record_format(const char *sys, const char *name, const char *file)
+{
+	const char *data;
+	size_t size;
+	u64 size64;
+
+	if (tp_format_cache__read(sys, name, &data, &size))
+		return record_file(file, 8);
+
+	size64 = size;
+	if (write(output_fd, &size64, 8) != 8 ||
+	    write(output_fd, data, size) != (ssize_t)size)
+		return -EIO;
+
+	return 0;
+}
+
 static int copy_event_system(const char *sys, struct tracepoint_path *tps)
 {
+	const char *sys_name = strrchr(sys, '/') ? strrchr(sys, '/') + 1 : sys;
 	struct dirent *dent;
 	struct stat st;
 	char *format;
@@ -223,7 +243,7 @@ static int copy_event_system(const char *sys, struct tracepoint_path *tps)
 		ret = stat(format, &st);
 
 		if (ret >= 0) {
-			err = record_file(format, 8);
+			err = record_format(sys_name, dent->d_name, format);
 			if (err) {
 				free(format);
 				goto out;
@@ -13,6 +13,7 @@
 #include <api/fs/tracing_path.h>
 #include <api/fs/fs.h>
 #include "trace-event.h"
+#include "tp-format-cache.h"
 #include "machine.h"
 #include "util.h"
 
@@ -75,27 +76,17 @@ void trace_event__cleanup(struct trace_event *t)
 static struct tep_event*
 tp_format(const char *sys, const char *name)
 {
-	char *tp_dir = get_events_file(sys);
 	struct tep_handle *pevent = tevent.pevent;
 	struct tep_event *event = NULL;
-	char path[PATH_MAX];
+	const char *data;
 	size_t size;
-	char *data;
 	int err;
 
-	if (!tp_dir)
-		return ERR_PTR(-errno);
-
-	scnprintf(path, PATH_MAX, "%s/%s/format", tp_dir, name);
-	put_events_file(tp_dir);
-
-	err = filename__read_str(path, &data, &size);
+	err = tp_format_cache__read(sys, name, &data, &size);
 	if (err)
 		return ERR_PTR(err);
 
 	tep_parse_format(pevent, &event, data, size, sys);
-
-	free(data);
 	return event;
 }
 
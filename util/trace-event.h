@@ -85,6 +85,8 @@ struct scripting_ops {
 			     struct perf_evsel *evsel, u64 tstamp);
 	void (*process_stat_interval)(u64 tstamp);
 	int (*generate_script) (struct tep_handle *pevent, const char *outfile);
+	/* the perf_script_filter the script sets, see perf script --filter */
+	const char *(*filter) (void);
 };
 
 extern unsigned int scripting_max_stack;
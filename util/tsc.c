@@ -1,4 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <errno.h>
+
 #include <linux/compiler.h>
 #include <linux/types.h>
 
@@ -29,3 +31,9 @@ u64 __weak rdtsc(void)
 {
 	return 0;
 }
+
+int __weak perf_read_tsc_conversion(const struct perf_event_mmap_page *pc __maybe_unused,
+				    struct perf_tsc_conversion *tc __maybe_unused)
+{
+	return -EOPNOTSUPP;
+}
@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <elf.h>
+#include <errno.h>
+#include <gelf.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/hash.h>
+#include "debug.h"
+#include "dso.h"
+#include "symbol.h"
+#include "unwind-cfi.h"
+#include "util.h"
+
+#define DW_EH_PE_omit		0xff
+#define DW_EH_PE_udata4		0x03
+#define DW_EH_PE_udata8		0x04
+#define DW_EH_PE_sdata4		0x0b
+#define DW_EH_PE_sdata8		0x0c
+#define DW_EH_PE_datarel	0x30
+
+static pthread_mutex_t cfi_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int cfi_section__read(struct cfi_section *sec, Elf *elf,
+			     GElf_Ehdr *ehdr, int fd, const char *name)
+{
+	GElf_Shdr shdr;
+
+	if (!elf_section_by_name(elf, ehdr, &shdr, name, NULL) ||
+	    shdr.sh_type == SHT_NOBITS || shdr.sh_size == 0)
+		return 0;
+
+	sec->data = malloc(shdr.sh_size);
+	if (sec->data == NULL)
+		return -ENOMEM;
+
+	if (pread(fd, sec->data, shdr.sh_size, shdr.sh_offset) !=
+	    (ssize_t)shdr.sh_size) {
+		zfree(&sec->data);
+		return -EIO;
+	}
+
+	sec->offset = shdr.sh_offset;
+	sec->size   = shdr.sh_size;
+	return 0;
+}
+
+static int eh_pe_size(u8 enc)
+{
+	switch (enc & 0x0f) {
+	case DW_EH_PE_udata4:
+	case DW_EH_PE_sdata4:
+		return 4;
+	case DW_EH_PE_udata8:
+	case DW_EH_PE_sdata8:
+		return 8;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Point fdes at the binary search table of .eh_frame_hdr, as long as it
+ * uses the encoding everybody emits, the unwinder reads the whole table
+ * otherwise.
+ */
+static void dso_cfi__init_fdes(struct dso_cfi *cfi)
+{
+	struct cfi_section *hdr = &cfi->eh_frame_hdr;
+	u8 ptr_enc, count_enc, table_enc;
+	u64 pos = 4, count = 0;
+	int size;
+
+	if (hdr->size < pos || hdr->data[0] != 1)
+		return;
+
+	ptr_enc   = hdr->data[1];
+	count_enc = hdr->data[2];
+	table_enc = hdr->data[3];
+
+	if (table_enc != (DW_EH_PE_datarel | DW_EH_PE_sdata4) ||
+	    count_enc == DW_EH_PE_omit || (count_enc & 0x70))
+		return;
+
+	if (ptr_enc != DW_EH_PE_omit) {
+		size = eh_pe_size(ptr_enc);
+		if (size < 0)
+			return;
+		pos += size;
+	}
+
+	size = eh_pe_size(count_enc);
+	if (size < 0 || pos + size > hdr->size)
+		return;
+
+	if (size == 4)
+		count = *(u32 *)(hdr->data + pos);
+	else
+		count = *(u64 *)(hdr->data + pos);
+	pos += size;
+
+	if (count > (hdr->size - pos) / sizeof(struct cfi_fde))
+		return;
+
+	cfi->fdes    = (struct cfi_fde *)(hdr->data + pos);
+	cfi->nr_fdes = count;
+}
+
+static struct dso_cfi *dso_cfi__new(struct dso *dso, struct machine *machine)
+{
+	struct dso_cfi *cfi;
+	GElf_Ehdr ehdr;
+	Elf *elf;
+	int fd;
+
+	fd = dso__data_get_fd(dso, machine);
+	if (fd < 0)
+		return NULL;
+
+	cfi = zalloc(sizeof(*cfi));
+	if (cfi == NULL)
+		goto out_put;
+
+	elf = elf_begin(fd, PERF_ELF_C_READ_MMAP, NULL);
+	if (elf == NULL)
+		goto out_free;
+
+	if (gelf_getehdr(elf, &ehdr) == NULL ||
+	    cfi_section__read(&cfi->eh_frame_hdr, elf, &ehdr, fd, ".eh_frame_hdr") ||
+	    cfi_section__read(&cfi->eh_frame, elf, &ehdr, fd, ".eh_frame"))
+		goto out_end;
+
+	cfi->is_exec = ehdr.e_type == ET_EXEC;
+	dso_cfi__init_fdes(cfi);
+
+	pr_debug("unwind: %s: %" PRIu64 " FDEs, %" PRIu64 " bytes of .eh_frame\n",
+		 dso->name, cfi->nr_fdes, cfi->eh_frame.size);
+
+	elf_end(elf);
+	dso__data_put_fd(dso);
+	return cfi;
+
+out_end:
+	elf_end(elf);
+	free(cfi->eh_frame_hdr.data);
+	free(cfi->eh_frame.data);
+out_free:
+	free(cfi);
+out_put:
+	dso__data_put_fd(dso);
+	return NULL;
+}
+
+/*
+ * Returns the unwind tables of dso, loading them on first use, or NULL
+ * if they can't be read, then the unwinder reads straight from the dso.
+ */
+struct dso_cfi *dso__cfi(struct dso *dso, struct machine *machine)
+{
+	if (dso->data.cfi_loaded)
+		return dso->data.cfi;
+
+	pthread_mutex_lock(&cfi_lock);
+	if (!dso->data.cfi_loaded) {
+		dso->data.cfi = dso_cfi__new(dso, machine);
+		/* publish cfi before the flag saying it is there */
+		__sync_synchronize();
+		dso->data.cfi_loaded = true;
+	}
+	pthread_mutex_unlock(&cfi_lock);
+
+	return dso->data.cfi;
+}
+
+void dso__cfi_free(struct dso *dso)
+{
+	struct dso_cfi *cfi = dso->data.cfi;
+
+	if (cfi) {
+		free(cfi->eh_frame_hdr.data);
+		free(cfi->eh_frame.data);
+		zfree(&dso->data.cfi);
+	}
+	dso->data.cfi_loaded = false;
+}
+
+static ssize_t cfi_section__copy(struct cfi_section *sec, u64 offset,
+				 void *buf, size_t size)
+{
+	if (offset < sec->offset || offset - sec->offset > sec->size ||
+	    size > sec->size - (offset - sec->offset))
+		return -1;
+
+	memcpy(buf, sec->data + offset - sec->offset, size);
+	return size;
+}
+
+/*
+ * Read size bytes at file offset from the cached sections, returns -1
+ * when they are not all in one of them.
+ */
+ssize_t dso_cfi__read(struct dso_cfi *cfi, u64 offset, void *buf, size_t size)
+{
+	ssize_t ret = -1;
+
+	if (cfi->eh_frame.data)
+		ret = cfi_section__copy(&cfi->eh_frame, offset, buf, size);
+	if (ret < 0 && cfi->eh_frame_hdr.data)
+		ret = cfi_section__copy(&cfi->eh_frame_hdr, offset, buf, size);
+
+	return ret;
+}
+
+static bool dso_cfi__fde_covers(struct dso_cfi *cfi, u64 idx, s64 pc)
+{
+	return idx < cfi->nr_fdes && cfi->fdes[idx].start_ip <= pc &&
+	       (idx + 1 == cfi->nr_fdes || pc < cfi->fdes[idx + 1].start_ip);
+}
+
+/*
+ * Find the search table entry of the last FDE starting at or before the
+ * file offset, the unwinder still checks that the FDE ends after it.
+ */
+struct cfi_fde *dso_cfi__find_fde(struct dso_cfi *cfi, u64 offset)
+{
+	s64 pc = offset - cfi->eh_frame_hdr.offset;
+	u32 *slot = &cfi->pc_cache[hash_64(offset, CFI_PC_CACHE_BITS)];
+	u64 lo = 0, hi = cfi->nr_fdes;
+	u32 cached = *slot;
+
+	/* Slots are updated racily, so whatever is found gets checked */
+	if (cached && dso_cfi__fde_covers(cfi, cached - 1, pc))
+		return &cfi->fdes[cached - 1];
+
+	if (hi == 0 || pc < cfi->fdes[0].start_ip)
+		return NULL;
+
+	while (hi - lo > 1) {
+		u64 mid = (lo + hi) / 2;
+
+		if (pc < cfi->fdes[mid].start_ip)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	if (lo < UINT_MAX)
+		*slot = lo + 1;
+
+	return &cfi->fdes[lo];
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_UNWIND_CFI_H
+#define __PERF_UNWIND_CFI_H
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct dso;
+struct machine;
+
+/* A section of the dso data file, read in whole */
+struct cfi_section {
+	u64	offset;
+	u64	size;
+	u8	*data;
+};
+
+/* A .eh_frame_hdr search table entry, both relative to .eh_frame_hdr */
+struct cfi_fde {
+	s32	start_ip;
+	s32	fde;
+};
+
+#define CFI_PC_CACHE_BITS	8
+
+/*
+ * The unwind tables of a dso, loaded once instead of going through the
+ * dso data cache for every word the unwinder reads out of them.  fdes
+ * points into eh_frame_hdr and is sorted by start_ip, pc_cache remembers
+ * the last FDE found for a hash of the pc, as index + 1.
+ */
+struct dso_cfi {
+	struct cfi_section	eh_frame_hdr;
+	struct cfi_section	eh_frame;
+	struct cfi_fde		*fdes;
+	u64			nr_fdes;
+	bool			is_exec;
+	u32			pc_cache[1 << CFI_PC_CACHE_BITS];
+};
+
+#ifdef HAVE_DWARF_UNWIND_SUPPORT
+struct dso_cfi *dso__cfi(struct dso *dso, struct machine *machine);
+void dso__cfi_free(struct dso *dso);
+ssize_t dso_cfi__read(struct dso_cfi *cfi, u64 offset, void *buf, size_t size);
+struct cfi_fde *dso_cfi__find_fde(struct dso_cfi *cfi, u64 offset);
+#else
+static inline void dso__cfi_free(struct dso *dso __maybe_unused) {}
+#endif
+
+#endif /* __PERF_UNWIND_CFI_H */
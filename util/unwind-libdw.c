@@ -7,6 +7,7 @@
 #include "debug.h"
 #include "unwind.h"
 #include "unwind-libdw.h"
+#include "unwind-cfi.h"
 #include "machine.h"
 #include "map.h"
 #include "symbol.h"
@@ -104,6 +105,7 @@ static int access_dso_mem(struct unwind_info *ui, Dwarf_Addr addr,
 			  Dwarf_Word *data)
 {
 	struct addr_location al;
+	struct dso_cfi *cfi;
 	ssize_t size;
 
 	if (!thread__find_map(ui->thread, PERF_RECORD_MISC_USER, addr, &al)) {
@@ -114,6 +116,11 @@ static int access_dso_mem(struct unwind_info *ui, Dwarf_Addr addr,
 	if (!al.map->dso)
 		return -1;
 
+	cfi = dso__cfi(al.map->dso, ui->machine);
+	if (cfi && dso_cfi__read(cfi, al.map->map_ip(al.map, addr), data,
+				 sizeof(*data)) == sizeof(*data))
+		return 0;
+
 	size = dso__data_read_addr(al.map->dso, al.map, ui->machine,
 				   addr, (u8 *) data, sizeof(*data));
 
@@ -40,6 +40,7 @@
 #include "debug.h"
 #include "asm/bug.h"
 #include "dso.h"
+#include "unwind-cfi.h"
 
 extern int
 UNW_OBJ(dwarf_search_unwind_table) (unw_addr_space_t as,
@@ -296,8 +297,8 @@ static int read_unwind_spec_eh_frame(struct dso *dso, struct machine *machine,
 }
 
 #ifndef NO_LIBUNWIND_DEBUG_FRAME
-static int read_unwind_spec_debug_frame(struct dso *dso,
-					struct machine *machine, u64 *offset)
+static int __read_unwind_spec_debug_frame(struct dso *dso,
+					  struct machine *machine, u64 *offset)
 {
 	int fd;
 	u64 ofs = dso->data.debug_frame_offset;
@@ -362,6 +363,24 @@ static int read_unwind_spec_debug_frame(struct dso *dso,
 
 	return -EINVAL;
 }
+
+static int read_unwind_spec_debug_frame(struct dso *dso,
+					struct machine *machine, u64 *offset)
+{
+	int ret;
+
+	if (dso->data.debug_frame_offset) {
+		*offset = dso->data.debug_frame_offset;
+		return 0;
+	}
+
+	/* Samples may be unwound in parallel, see unwind-pipeline.c */
+	pthread_mutex_lock(&dso->lock);
+	ret = __read_unwind_spec_debug_frame(dso, machine, offset);
+	pthread_mutex_unlock(&dso->lock);
+
+	return ret;
+}
 #endif
 
 static struct map *find_map(unw_word_t ip, struct unwind_info *ui)
@@ -375,6 +394,7 @@ find_proc_info(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t *pi,
 	       int need_unwind_info, void *arg)
 {
 	struct unwind_info *ui = arg;
+	struct dso_cfi *cfi;
 	struct map *map;
 	unw_dyn_info_t di;
 	u64 table_data, segbase, fde_count;
@@ -386,9 +406,36 @@ find_proc_info(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t *pi,
 
 	pr_debug("unwind: find_proc_info dso %s\n", map->dso->name);
 
-	/* Check the .eh_frame section for unwinding info */
-	if (!read_unwind_spec_eh_frame(map->dso, ui->machine,
-				       &table_data, &segbase, &fde_count)) {
+	cfi = dso__cfi(map->dso, ui->machine);
+
+	/*
+	 * Look up the FDE in the cached search table ourselves and only
+	 * hand that one entry to libunwind, it would otherwise bisect the
+	 * table reading it a word at a time.
+	 */
+	if (cfi && cfi->nr_fdes) {
+		struct cfi_fde *fde;
+
+		fde = dso_cfi__find_fde(cfi, map->map_ip(map, ip));
+		if (fde) {
+			table_data = cfi->eh_frame_hdr.offset +
+				     ((u8 *)fde - cfi->eh_frame_hdr.data);
+
+			memset(&di, 0, sizeof(di));
+			di.format   = UNW_INFO_FORMAT_REMOTE_TABLE;
+			di.start_ip = map->start;
+			di.end_ip   = map->end;
+			di.u.rti.segbase    = map->start + cfi->eh_frame_hdr.offset -
+					      map->pgoff;
+			di.u.rti.table_data = map->start + table_data - map->pgoff;
+			di.u.rti.table_len  = sizeof(*fde) / sizeof(unw_word_t);
+			ret = dwarf_search_unwind_table(as, ip, &di, pi,
+							need_unwind_info, arg);
+		}
+	} else if (!read_unwind_spec_eh_frame(map->dso, ui->machine,
+					      &table_data, &segbase,
+					      &fde_count)) {
+		/* Check the .eh_frame section for unwinding info */
 		memset(&di, 0, sizeof(di));
 		di.format   = UNW_INFO_FORMAT_REMOTE_TABLE;
 		di.start_ip = map->start;
@@ -405,13 +452,20 @@ find_proc_info(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t *pi,
 	/* Check the .debug_frame section for unwinding info */
 	if (ret < 0 &&
 	    !read_unwind_spec_debug_frame(map->dso, ui->machine, &segbase)) {
-		int fd = dso__data_get_fd(map->dso, ui->machine);
-		int is_exec = elf_is_exec(fd, map->dso->name);
-		unw_word_t base = is_exec ? 0 : map->start;
+		unw_word_t base = map->start;
 		const char *symfile;
 
-		if (fd >= 0)
-			dso__data_put_fd(map->dso);
+		if (cfi) {
+			if (cfi->is_exec)
+				base = 0;
+		} else {
+			int fd = dso__data_get_fd(map->dso, ui->machine);
+
+			if (elf_is_exec(fd, map->dso->name))
+				base = 0;
+			if (fd >= 0)
+				dso__data_put_fd(map->dso);
+		}
 
 		symfile = map->dso->symsrc_filename ?: map->dso->name;
 
@@ -464,6 +518,7 @@ get_proc_name(unw_addr_space_t __maybe_unused as,
 static int access_dso_mem(struct unwind_info *ui, unw_word_t addr,
 			  unw_word_t *data)
 {
+	struct dso_cfi *cfi;
 	struct map *map;
 	ssize_t size;
 
@@ -476,6 +531,12 @@ static int access_dso_mem(struct unwind_info *ui, unw_word_t addr,
 	if (!map->dso)
 		return -1;
 
+	/* Almost all of these are reads of the unwind tables */
+	cfi = dso__cfi(map->dso, ui->machine);
+	if (cfi && dso_cfi__read(cfi, map->map_ip(map, addr), data,
+				 sizeof(*data)) == sizeof(*data))
+		return 0;
+
 	size = dso__data_read_addr(map->dso, map, ui->machine,
 				   addr, (u8 *) data, sizeof(*data));
 
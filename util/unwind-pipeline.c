@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Post-processing DWARF unwinding on a pool of threads.
+ *
+ * Samples are queued in the order they are delivered, anything else that
+ * is delivered flushes the queue first, so the maps and threads of all
+ * queued samples stay as they were when each was taken while they are
+ * unwound in parallel.  The samples are then delivered in the order they
+ * were queued, and the callchain resolving code gets the entries that
+ * were unwound for them instead of unwinding again.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include "debug.h"
+#include "event.h"
+#include "evlist.h"
+#include "map.h"
+#include "thread.h"
+#include "unwind.h"
+#include "unwind-pipeline.h"
+#include "stage-time.h"
+#include "util.h"
+
+#define UNWIND_BATCH_EVENTS	4096
+#define UNWIND_BATCH_SIZE	(32 << 20)
+
+struct unwind_item {
+	union perf_event	*event;
+	struct perf_sample	sample;
+	u64			file_offset;
+	/* NULL when the sample has nothing to unwind */
+	struct thread		*thread;
+	unsigned int		shard;
+	int			err;
+	int			max_stack;
+	int			nr_entries;
+	struct unwind_entry	*entries;
+};
+
+struct unwind_pipeline {
+	unsigned int		nr_threads;
+	int			max_stack;
+	unsigned int		nr_items;
+	unsigned int		nr_unwind;
+	size_t			size;
+	struct unwind_item	*items;
+};
+
+struct unwind_worker {
+	struct unwind_pipeline	*up;
+	unsigned int		shard;
+};
+
+/* The item being delivered, for unwind_pipeline__get_entries() */
+static __thread struct unwind_item *unwind_current;
+
+struct unwind_pipeline *unwind_pipeline__new(unsigned int nr_threads,
+					     int max_stack)
+{
+	struct unwind_pipeline *up;
+
+	if (nr_threads < 2 || max_stack <= 0)
+		return NULL;
+
+	up = zalloc(sizeof(*up));
+	if (up == NULL)
+		return NULL;
+
+	up->items = calloc(UNWIND_BATCH_EVENTS, sizeof(*up->items));
+	if (up->items == NULL) {
+		free(up);
+		return NULL;
+	}
+
+	up->nr_threads = nr_threads;
+	up->max_stack  = max_stack;
+	return up;
+}
+
+static void unwind_item__exit(struct unwind_item *item)
+{
+	int i;
+
+	for (i = 0; i < item->nr_entries; i++)
+		map__put(item->entries[i].map);
+	zfree(&item->entries);
+	zfree(&item->event);
+	thread__zput(item->thread);
+	item->nr_entries = 0;
+}
+
+static void unwind_pipeline__reset(struct unwind_pipeline *up)
+{
+	unsigned int i;
+
+	for (i = 0; i < up->nr_items; i++)
+		unwind_item__exit(&up->items[i]);
+
+	up->nr_items  = 0;
+	up->nr_unwind = 0;
+	up->size      = 0;
+}
+
+void unwind_pipeline__delete(struct unwind_pipeline *up)
+{
+	if (up == NULL)
+		return;
+
+	unwind_pipeline__reset(up);
+	free(up->items);
+	free(up);
+}
+
+/*
+ * Queue a copy of a sample event, thread is where its user stack gets
+ * unwound or NULL if it doesn't need to be.
+ */
+int unwind_pipeline__queue(struct unwind_pipeline *up,
+			   struct perf_evlist *evlist,
+			   union perf_event *event, struct thread *thread,
+			   u64 file_offset)
+{
+	struct unwind_item *item = &up->items[up->nr_items];
+	int err;
+
+	if (up->nr_items == UNWIND_BATCH_EVENTS)
+		return -ENOSPC;
+
+	item->event = memdup(event, event->header.size);
+	if (item->event == NULL)
+		return -ENOMEM;
+
+	err = perf_evlist__parse_sample(evlist, item->event, &item->sample);
+	if (err) {
+		zfree(&item->event);
+		return err;
+	}
+
+	item->file_offset = file_offset;
+	item->err = 0;
+	item->max_stack = up->max_stack;
+	item->thread = NULL;
+
+	if (thread && item->sample.user_regs.regs &&
+	    item->sample.user_stack.size) {
+		item->thread = thread__get(thread);
+		/* libunwind address spaces are per thread, keep them apart */
+		item->shard = hash_32(thread->tid, 32) % up->nr_threads;
+		up->nr_unwind++;
+	}
+
+	up->nr_items++;
+	up->size += event->header.size;
+	return 0;
+}
+
+bool unwind_pipeline__full(struct unwind_pipeline *up)
+{
+	return up->nr_items == UNWIND_BATCH_EVENTS ||
+	       up->size >= UNWIND_BATCH_SIZE;
+}
+
+static int unwind_item__add_entry(struct unwind_entry *entry, void *arg)
+{
+	struct unwind_item *item = arg;
+
+	if (item->nr_entries == item->max_stack)
+		return -ENOSPC;
+
+	item->entries[item->nr_entries] = *entry;
+	item->entries[item->nr_entries].map = map__get(entry->map);
+	item->nr_entries++;
+	return 0;
+}
+
+static void unwind_item__unwind(struct unwind_item *item)
+{
+	u64 start;
+
+	item->entries = calloc(item->max_stack, sizeof(*item->entries));
+	if (item->entries == NULL) {
+		/* have it unwound when delivered */
+		item->max_stack = 0;
+		return;
+	}
+
+	start = stage_time__start();
+	item->err = unwind__get_entries(unwind_item__add_entry, item,
+					item->thread, &item->sample,
+					item->max_stack);
+	stage_time__end(STAGE_TIME__UNWIND, start);
+}
+
+static void *unwind_worker__run(void *arg)
+{
+	struct unwind_worker *worker = arg;
+	struct unwind_pipeline *up = worker->up;
+	unsigned int i;
+
+	for (i = 0; i < up->nr_items; i++) {
+		struct unwind_item *item = &up->items[i];
+
+		if (item->thread && item->shard == worker->shard)
+			unwind_item__unwind(item);
+	}
+
+	return NULL;
+}
+
+static void unwind_pipeline__unwind(struct unwind_pipeline *up)
+{
+	struct unwind_worker *workers;
+	pthread_t *threads;
+	unsigned int i, started = 0;
+	bool singlethreaded = perf_singlethreaded;
+
+	workers = calloc(up->nr_threads, sizeof(*workers));
+	threads = calloc(up->nr_threads, sizeof(*threads));
+	if (workers == NULL || threads == NULL) {
+		struct unwind_worker worker = { .up = up, };
+
+		/* one shard after the other, on this thread */
+		pr_debug("unwind: no memory for the workers, unwinding serially\n");
+		for (worker.shard = 0; worker.shard < up->nr_threads; worker.shard++)
+			unwind_worker__run(&worker);
+		goto out_free;
+	}
+
+	perf_set_multithreaded();
+
+	for (i = 0; i < up->nr_threads; i++) {
+		workers[i].up = up;
+		workers[i].shard = i;
+	}
+
+	for (i = 1; i < up->nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, unwind_worker__run,
+				   &workers[i])) {
+			/* the shards without a thread are done below */
+			break;
+		}
+		started = i;
+	}
+
+	unwind_worker__run(&workers[0]);
+	for (i = started + 1; i < up->nr_threads; i++)
+		unwind_worker__run(&workers[i]);
+
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (singlethreaded)
+		perf_set_singlethreaded();
+out_free:
+	free(workers);
+	free(threads);
+}
+
+/*
+ * Unwind the queued samples and hand them all, in the order they were
+ * queued, to deliver.
+ */
+int unwind_pipeline__flush(struct unwind_pipeline *up,
+			   unwind_deliver_cb_t deliver, void *arg)
+{
+	unsigned int i;
+	int err = 0;
+
+	if (up == NULL || up->nr_items == 0)
+		return 0;
+
+	if (up->nr_unwind)
+		unwind_pipeline__unwind(up);
+
+	for (i = 0; i < up->nr_items && !err; i++) {
+		struct unwind_item *item = &up->items[i];
+
+		unwind_current = item;
+		err = deliver(arg, item->event, &item->sample,
+			      item->file_offset);
+		unwind_current = NULL;
+	}
+
+	unwind_pipeline__reset(up);
+	return err;
+}
+
+/*
+ * Feed the entries unwound for sample to cb, as unwind__get_entries()
+ * would have, or return -ENOENT if it wasn't unwound with max_stack.
+ */
+int unwind_pipeline__get_entries(unwind_entry_cb_t cb, void *arg,
+				 struct perf_sample *sample, int max_stack)
+{
+	struct unwind_item *item = unwind_current;
+	int i, ret;
+
+	if (item == NULL || item->entries == NULL ||
+	    item->max_stack != max_stack ||
+	    item->sample.user_stack.data != sample->user_stack.data)
+		return -ENOENT;
+
+	for (i = 0; i < item->nr_entries; i++) {
+		ret = cb(&item->entries[i], arg);
+		if (ret)
+			return ret;
+	}
+
+	return item->err;
+}
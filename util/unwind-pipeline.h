@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __PERF_UNWIND_PIPELINE_H
+#define __PERF_UNWIND_PIPELINE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <linux/compiler.h>
+#include <linux/types.h>
+#include "unwind.h"
+
+struct perf_evlist;
+struct perf_sample;
+struct thread;
+union perf_event;
+
+struct unwind_pipeline;
+
+typedef int (*unwind_deliver_cb_t)(void *arg, union perf_event *event,
+				   struct perf_sample *sample,
+				   u64 file_offset);
+
+#ifdef HAVE_DWARF_UNWIND_SUPPORT
+struct unwind_pipeline *unwind_pipeline__new(unsigned int nr_threads,
+					     int max_stack);
+void unwind_pipeline__delete(struct unwind_pipeline *up);
+int unwind_pipeline__queue(struct unwind_pipeline *up,
+			   struct perf_evlist *evlist,
+			   union perf_event *event, struct thread *thread,
+			   u64 file_offset);
+bool unwind_pipeline__full(struct unwind_pipeline *up);
+int unwind_pipeline__flush(struct unwind_pipeline *up,
+			   unwind_deliver_cb_t deliver, void *arg);
+int unwind_pipeline__get_entries(unwind_entry_cb_t cb, void *arg,
+				 struct perf_sample *sample, int max_stack);
+#else
+static inline struct unwind_pipeline *
+unwind_pipeline__new(unsigned int nr_threads __maybe_unused,
+		     int max_stack __maybe_unused)
+{
+	return NULL;
+}
+
+static inline void
+unwind_pipeline__delete(struct unwind_pipeline *up __maybe_unused) {}
+
+static inline int
+unwind_pipeline__queue(struct unwind_pipeline *up __maybe_unused,
+		       struct perf_evlist *evlist __maybe_unused,
+		       union perf_event *event __maybe_unused,
+		       struct thread *thread __maybe_unused,
+		       u64 file_offset __maybe_unused)
+{
+	return -EINVAL;
+}
+
+static inline bool
+unwind_pipeline__full(struct unwind_pipeline *up __maybe_unused)
+{
+	return false;
+}
+
+static inline int
+unwind_pipeline__flush(struct unwind_pipeline *up __maybe_unused,
+		       unwind_deliver_cb_t deliver __maybe_unused,
+		       void *arg __maybe_unused)
+{
+	return 0;
+}
+
+static inline int
+unwind_pipeline__get_entries(unwind_entry_cb_t cb __maybe_unused,
+			     void *arg __maybe_unused,
+			     struct perf_sample *sample __maybe_unused,
+			     int max_stack __maybe_unused)
+{
+	return -ENOENT;
+}
+#endif /* HAVE_DWARF_UNWIND_SUPPORT */
+
+#endif /* __PERF_UNWIND_PIPELINE_H */
@@ -4,6 +4,7 @@
 #include "debug.h"
 #include "namespaces.h"
 #include <api/fs/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
@@ -23,6 +24,10 @@
 #include "strlist.h"
 #include "string2.h"
 
+#ifndef FICLONE
+#define FICLONE		_IOW(0x94, 9, int)
+#endif
+
 /*
  * XXX We need to find a better place for these things...
  */
@@ -106,16 +111,17 @@ int mkdir_p(char *path, mode_t mode)
 
 	while (*++d == '/');
 
+	/* others may be creating the same directories */
 	while ((d = strchr(d, '/'))) {
 		*d = '\0';
-		err = stat(path, &st) && mkdir(path, mode);
+		err = stat(path, &st) && mkdir(path, mode) && errno != EEXIST;
 		*d++ = '/';
 		if (err)
 			return -1;
 		while (*d == '/')
 			++d;
 	}
-	return (stat(path, &st) && mkdir(path, mode)) ? -1 : 0;
+	return (stat(path, &st) && mkdir(path, mode) && errno != EEXIST) ? -1 : 0;
 }
 
 static bool match_pat(char *file, const char **pat)
@@ -356,7 +362,11 @@ static int copyfile_mode_ns(const char *from, const char *to, mode_t mode,
 	if (fromfd < 0)
 		goto out_close_to;
 
-	err = copyfile_offset(fromfd, 0, tofd, 0, st.st_size);
+	/* share the extents when the filesystem can, e.g. btrfs or xfs */
+	if (ioctl(tofd, FICLONE, fromfd) == 0)
+		err = 0;
+	else
+		err = copyfile_offset(fromfd, 0, tofd, 0, st.st_size);
 
 	close(fromfd);
 out_close_to: